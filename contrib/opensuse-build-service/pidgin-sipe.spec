@@ -479,6 +479,10 @@ rm -rf %{buildroot}
 %{mingw_libdir}/purple-2/libsipe.dll.dbgsym
 %else
 %{_libdir}/purple-2/libsipe.so
+%if 0%{?has_libnice:1} && 0%{?has_gstreamer:1}
+%dir %{_libdir}/pidgin-sipe
+%{_libdir}/pidgin-sipe/libsipe_vv.so
+%endif
 %endif
 
 
@@ -0,0 +1,88 @@
+#!/usr/bin/perl -w
+#
+# Generate the perfect hash slot tables for src/core/sipmsg.c
+#
+#   $ contrib/perfect-hash/sipmsg-tokens.pl
+#
+# Replace the generated block in sipmsg.c with the output. The order of
+# each list must match the corresponding enum in src/core/sipmsg.h.
+#
+use 5.010;
+use strict;
+use warnings;
+use integer;
+
+my %tables = (
+	header => {
+		bits  => 7,
+		names => [qw(
+			Call-ID CSeq Content-Length Content-Type From To
+			Transfer-Encoding
+			Allow Allow-Events Authentication-Info Authorization
+			Connection Contact Date EndPoints Event Expires Location
+			Max-Forwards Message-Id ms-client-diagnostics
+			ms-diagnostics ms-keep-alive ms-piggyback-cseq
+			ms-text-format Ms-Sender P-Asserted-Identity
+			P-Preferred-Identity Proxy-Authenticate
+			Proxy-Authentication-Info Proxy-Authorization
+			Record-Route Refer-To Referred-By Require Roster-Manager
+			Server Session-Expires Set-Cookie Subject
+			Subscription-State Supported TriggeredInvite User-Agent
+			Via Warning WWW-Authenticate
+		)],
+	},
+	method => {
+		bits  => 5,
+		names => [qw(
+			ACK BENOTIFY BYE CANCEL INFO INVITE MESSAGE NOTIFY
+			OPTIONS PRACK PUBLISH REFER REGISTER SERVICE SUBSCRIBE
+		)],
+	},
+	event => {
+		bits  => 5,
+		names => [qw(
+			conference msrtc.wpending presence presence.wpending
+			registration-notify vnd-microsoft-provisioning
+			vnd-microsoft-provisioning-v2 vnd-microsoft-roaming-ACL
+			vnd-microsoft-roaming-contacts vnd-microsoft-roaming-self
+		)],
+	},
+);
+
+# must match sipmsg_token_hash() in sipmsg.c
+sub token_hash($$$) {
+	my($name, $seed, $bits) = @_;
+	my $hash = $seed;
+	foreach my $c (unpack("C*", lc($name))) {
+		$hash = (($hash ^ $c) * 16777619) & 0xFFFFFFFF;
+	}
+	return((($hash >> 16) ^ $hash) & ((1 << $bits) - 1));
+}
+
+foreach my $table (sort keys %tables) {
+	my $bits  = $tables{$table}->{bits};
+	my @names = @{ $tables{$table}->{names} };
+	my($seed, @slots);
+
+ SEED:
+	for ($seed = 1; $seed < 1000000; $seed++) {
+		@slots = (0) x (1 << $bits);
+		for (my $i = 0; $i < @names; $i++) {
+			my $slot = token_hash($names[$i], $seed, $bits);
+			next SEED if $slots[$slot];
+			$slots[$slot] = $i + 1;
+		}
+		last;
+	}
+	die "no seed found for $table table\n" if $seed >= 1000000;
+
+	print "#define SIPMSG_\U$table\E_SEED $seed\n";
+	print "#define SIPMSG_\U$table\E_BITS $bits\n";
+	print "static const guint8 sipmsg_${table}_slots[1 << SIPMSG_\U$table\E_BITS] = {\n";
+	for (my $i = 0; $i < @slots; $i += 16) {
+		my $end = $i + 15 < $#slots ? $i + 15 : $#slots;
+		print "\t", join(", ", map { sprintf("%2d", $_) } @slots[$i..$end]),
+		      ($end < $#slots ? ",\n" : "\n");
+	}
+	print "};\n";
+}
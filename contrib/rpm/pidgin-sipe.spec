@@ -252,6 +252,10 @@ rm -rf %{buildroot}
 %defattr(-,root,root,-)
 %doc AUTHORS ChangeLog COPYING NEWS README TODO
 %{_libdir}/purple-2/libsipe.so
+%if !0%{?_without_vv:1}
+%dir %{_libdir}/pidgin-sipe
+%{_libdir}/pidgin-sipe/libsipe_vv.so
+%endif
 
 
 %if !0%{?_without_telepathy:1}
@@ -90,13 +90,19 @@ void sipe_backend_debug(sipe_debug_level level,
 			const gchar *format,
 			...) G_GNUC_PRINTF(2, 3);
 
-/* Convenience macros */
-#define SIPE_DEBUG_INFO(fmt, ...)        sipe_backend_debug(SIPE_DEBUG_LEVEL_INFO,    fmt, __VA_ARGS__)
-#define SIPE_DEBUG_INFO_NOFORMAT(msg)    sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_INFO,    msg)
-#define SIPE_DEBUG_WARNING(fmt, ...)     sipe_backend_debug(SIPE_DEBUG_LEVEL_WARNING, fmt, __VA_ARGS__)
-#define SIPE_DEBUG_WARNING_NOFORMAT(msg) sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_WARNING, msg)
-#define SIPE_DEBUG_ERROR(fmt, ...)       sipe_backend_debug(SIPE_DEBUG_LEVEL_ERROR,   fmt, __VA_ARGS__)
-#define SIPE_DEBUG_ERROR_NOFORMAT(msg)   sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_ERROR,   msg)
+/*
+ * Convenience macros
+ *
+ * Arguments are only evaluated when debugging is enabled in the backend.
+ */
+#define SIPE_DEBUG_GUARDED(call) \
+	do { if (sipe_backend_debug_enabled()) call; } while (0)
+#define SIPE_DEBUG_INFO(fmt, ...)        SIPE_DEBUG_GUARDED(sipe_backend_debug(SIPE_DEBUG_LEVEL_INFO,    fmt, __VA_ARGS__))
+#define SIPE_DEBUG_INFO_NOFORMAT(msg)    SIPE_DEBUG_GUARDED(sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_INFO,    msg))
+#define SIPE_DEBUG_WARNING(fmt, ...)     SIPE_DEBUG_GUARDED(sipe_backend_debug(SIPE_DEBUG_LEVEL_WARNING, fmt, __VA_ARGS__))
+#define SIPE_DEBUG_WARNING_NOFORMAT(msg) SIPE_DEBUG_GUARDED(sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_WARNING, msg))
+#define SIPE_DEBUG_ERROR(fmt, ...)       SIPE_DEBUG_GUARDED(sipe_backend_debug(SIPE_DEBUG_LEVEL_ERROR,   fmt, __VA_ARGS__))
+#define SIPE_DEBUG_ERROR_NOFORMAT(msg)   SIPE_DEBUG_GUARDED(sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_ERROR,   msg))
 
 /**
  * Check backend debugging status
@@ -111,6 +117,17 @@ void sipe_backend_chat_session_destroy(struct sipe_backend_chat_session *session
 void sipe_backend_chat_add(struct sipe_backend_chat_session *backend_session,
 			   const gchar *uri,
 			   gboolean is_new);
+
+/**
+ * Add several users to a chat at once, e.g. the roster after joining
+ *
+ * @param backend_session backend chat session
+ * @param uris            list of URIs (const gchar *)
+ * @param is_new          @c TRUE if the users have just joined the chat
+ */
+void sipe_backend_chat_add_many(struct sipe_backend_chat_session *backend_session,
+				const GSList *uris,
+				gboolean is_new);
 void sipe_backend_chat_close(struct sipe_backend_chat_session *backend_session);
 
 /**
@@ -239,6 +256,60 @@ gssize sipe_backend_ft_write_file(struct sipe_file_transfer *ft,
 				  const guchar *data,
 				  gsize size);
 
+/**
+ * Open data source for an outgoing file transfer
+ *
+ * Gives the core direct access to the local file, instead of copying
+ * it piecewise with @c sipe_backend_ft_read_file().
+ *
+ * @param sipe_public SIPE core data
+ * @param ft          file transfer data
+ *
+ * @return file source from @c sipe_core_ft_source_open() or @c NULL if
+ *         the data must be read with @c sipe_backend_ft_read_file()
+ */
+struct sipe_ft_source;
+struct sipe_ft_source *sipe_backend_ft_open_source(struct sipe_core_public *sipe_public,
+						   struct sipe_file_transfer *ft);
+
+/**
+ * Account for data sent directly from the file source
+ *
+ * Updates progress and completion like @c sipe_backend_ft_read_file().
+ *
+ * @param ft   file transfer data
+ * @param size number of bytes sent
+ */
+void sipe_backend_ft_source_sent(struct sipe_file_transfer *ft,
+				 gsize size);
+
+/**
+ * Open data sink for an incoming file transfer
+ *
+ * Lets the core write the local file behind, instead of writing it
+ * synchronously with @c sipe_backend_ft_write_file().
+ *
+ * @param sipe_public SIPE core data
+ * @param ft          file transfer data
+ *
+ * @return file sink from @c sipe_core_ft_sink_open() or @c NULL if
+ *         the data must be written with @c sipe_backend_ft_write_file()
+ */
+struct sipe_ft_sink;
+struct sipe_ft_sink *sipe_backend_ft_open_sink(struct sipe_core_public *sipe_public,
+					       struct sipe_file_transfer *ft);
+
+/**
+ * Account for data written by the file sink
+ *
+ * Updates progress and completion like @c sipe_backend_ft_write_file().
+ *
+ * @param ft   file transfer data
+ * @param size number of bytes written
+ */
+void sipe_backend_ft_sink_written(struct sipe_file_transfer *ft,
+				  gsize size);
+
 gboolean sipe_backend_ft_is_completed(struct sipe_file_transfer *ft);
 
 void sipe_backend_ft_cancel_local(struct sipe_file_transfer *ft);
@@ -357,16 +428,23 @@ typedef enum {
 	SIPE_ENCRYPTION_POLICY_OBEY_SERVER
 } SipeEncryptionPolicy;
 
+typedef enum {
+	SIPE_SRTP_AES_CM_128_HMAC_SHA1_80,  /* RFC 4568 */
+	SIPE_SRTP_AEAD_AES_128_GCM          /* RFC 7714 */
+} SipeSrtpSuite;
+
 struct sipe_media_call;
 struct sipe_backend_media;
 struct sipe_backend_codec;
 struct sipe_backend_candidate;
 struct sipe_backend_media_stream;
 struct sipe_backend_media_relays;
+struct sipe_media_stats;
 
 struct sipe_media_stream {
 	struct sipe_backend_media_stream *backend_private;
 
+	struct sipe_media_call *call;
 	gchar *id;
 };
 
@@ -390,15 +468,45 @@ struct sipe_media_call {
 	void (*error_cb)(struct sipe_media_call *, gchar *message);
 
 	void (*read_cb)(struct sipe_media_call *, struct sipe_media_stream *);
+	void (*stats_cb)(struct sipe_media_call *, struct sipe_media_stream *,
+			 struct sipe_media_stats *stats);
 	void (*writable_cb)(struct sipe_media_call *,
 			    struct sipe_media_stream *, gboolean writable);
 };
 
+/**
+ * Quality statistics of a media stream
+ *
+ * RTP counters are only valid when @c have_rtp is @c TRUE, candidate
+ * information only when @c have_candidates is @c TRUE, frame statistics
+ * only when @c have_frames is @c TRUE.
+ */
+struct sipe_media_stats {
+	gboolean have_rtp;
+	guint64 packets_sent;
+	guint64 packets_received;
+	guint64 packets_lost;		/* of the received stream */
+	guint jitter;			/* interarrival jitter in ms */
+	guint rtt;			/* RTCP round trip time in ms, 0 if unknown */
+	guint remote_loss;		/* percent of sent packets lost at the peer */
+
+	gboolean have_candidates;
+	SipeCandidateType local_candidate_type;
+	SipeCandidateType remote_candidate_type;
+	SipeNetworkProtocol protocol;
+
+	gboolean have_frames;		/* desktop sharing presenter */
+	guint frame_rate;		/* current capture frames per second */
+	guint64 frames;			/* capture intervals so far */
+	guint bytes_per_frame;		/* average over the last second */
+};
+
 struct sipe_media_relay {
-	gchar		      *hostname;
+	gchar		      *hostname; /* resolved IP address or NULL */
 	guint		       udp_port;
 	guint		       tcp_port;
 	struct sipe_dns_query *dns_query;
+	gchar		      *name;     /* host name as provided by MRAS */
 };
 
 /* Media handling */
@@ -411,19 +519,40 @@ void sipe_backend_media_free(struct sipe_backend_media *media);
 
 void sipe_backend_media_set_cname(struct sipe_backend_media *media, gchar *cname);
 
+/*
+ * The core keeps the converted relays for consecutive calls and passes the
+ * same object to every stream until the credentials or relays change. The
+ * backend must copy what it needs beyond sipe_backend_media_add_stream(),
+ * but may use the object to keep its relay allocations alive meanwhile.
+ */
 struct sipe_backend_media_relays * sipe_backend_media_relays_convert(GSList *media_relays,
 								     gchar *username,
 								     gchar *password);
 void sipe_backend_media_relays_free(struct sipe_backend_media_relays *media_relays);
 
-struct sipe_backend_media_stream *sipe_backend_media_add_stream(struct sipe_media_call *media,
-							  const gchar *id,
-							  const gchar *participant,
+/**
+ * ICE connectivity check tuning requested by the core
+ */
+struct sipe_media_ice_params {
+	gboolean aggressive_nomination;
+	guint check_interval;		/* pacing Ta in ms, 0: backend default */
+};
+
+/*
+ * The stream pointer is stable for the lifetime of the stream. Backends
+ * should use it as the handle for stream callbacks instead of looking
+ * the stream up by its id.
+ *
+ * @c ice_params is only a hint, backends may ignore what their ICE
+ * implementation doesn't support.
+ */
+struct sipe_backend_media_stream *sipe_backend_media_add_stream(struct sipe_media_stream *stream,
 							  SipeMediaType type,
 							  SipeIceVersion ice_version,
 							  gboolean initiator,
 							  struct sipe_backend_media_relays *media_relays,
-							  guint min_port, guint max_port);
+							  guint min_port, guint max_port,
+							  const struct sipe_media_ice_params *ice_params);
 void sipe_backend_media_add_remote_candidates(struct sipe_media_call *media,
 					      struct sipe_media_stream *stream,
 					      GList *candidates);
@@ -436,8 +565,10 @@ GList *sipe_backend_media_get_active_local_candidates(struct sipe_media_call *me
 						      struct sipe_media_stream *stream);
 GList *sipe_backend_media_get_active_remote_candidates(struct sipe_media_call *media,
 						       struct sipe_media_stream *stream);
+gboolean sipe_backend_media_srtp_suite_supported(SipeSrtpSuite suite);
 void sipe_backend_media_set_encryption_keys(struct sipe_media_call *media,
 					    struct sipe_media_stream *stream,
+					    SipeSrtpSuite suite,
 					    const guchar *encryption_key,
 					    const guchar *decryption_key);
 
@@ -525,6 +656,81 @@ gint sipe_backend_media_write(struct sipe_media_call *call,
 			      guint8 *buffer, guint buffer_len,
 			      gboolean blocking);
 
+/**
+ * Fill RTP statistics of a stream
+ *
+ * Only the RTP fields of @c stats are touched by the backend.
+ *
+ * @param stream media stream
+ * @param stats  statistics to update
+ *
+ * @return @c FALSE if the backend has no RTP statistics for this stream
+ */
+gboolean sipe_backend_media_stream_get_rtp_stats(struct sipe_media_stream *stream,
+						 struct sipe_media_stats *stats);
+
+/**
+ * Video encoder parameters
+ */
+struct sipe_media_video_params {
+	guint width;
+	guint height;
+	guint framerate;		/* frames per second */
+	guint bitrate;			/* kbit/s */
+};
+
+/**
+ * Change encoder parameters of a video stream
+ *
+ * The backend applies what its encoder supports and ignores the rest.
+ *
+ * @param stream video stream
+ * @param params new encoder parameters
+ */
+void sipe_backend_media_set_video_params(struct sipe_media_stream *stream,
+					 const struct sipe_media_video_params *params);
+
+/**
+ * Send RTCP application layer feedback on a stream
+ *
+ * The backend adds the header of a payload-specific feedback message with
+ * FMT 15 (RFC 4585) and sends it with the next RTCP packet.
+ *
+ * @param stream media stream
+ * @param fci    feedback control information
+ * @param length length of @c fci, multiple of 4
+ */
+void sipe_backend_media_send_rtcp_feedback(struct sipe_media_stream *stream,
+					   const guint8 *fci,
+					   gsize length);
+
+/**
+ * Segment of an application data receive buffer
+ */
+struct sipe_media_segment {
+	guint8 *data;
+	guint length;
+};
+
+/**
+ * Read all application data currently queued on a stream
+ *
+ * Never blocks. The backend fills the segments in order and keeps reading
+ * until either all segments are full or no more data is pending, so that
+ * a consumer can process everything that arrived in a single wakeup.
+ *
+ * @param call     media call
+ * @param stream   media stream with application data
+ * @param segments array of receive buffers
+ * @param count    number of entries in @c segments
+ *
+ * @return total number of bytes read, negative on error
+ */
+gint sipe_backend_media_read_iov(struct sipe_media_call *call,
+				 struct sipe_media_stream *stream,
+				 const struct sipe_media_segment *segments,
+				 guint count);
+
 struct sipe_user_ask_ctx *
 sipe_backend_applicationsharing_show_presenter_actions(struct sipe_core_public *sipe_public,
 						       const gchar *message,
@@ -641,6 +847,9 @@ typedef void transport_input_cb(struct sipe_transport_connection *conn);
 typedef void transport_error_cb(struct sipe_transport_connection *conn,
 				const gchar *msg);
 
+/* see sipe_core_tls_session_lookup() */
+struct sipe_tls_session_cache;
+
 typedef struct {
 	guint type;
 	const gchar *server_name;
@@ -649,14 +858,49 @@ typedef struct {
 	transport_connected_cb *connected;
 	transport_input_cb *input;
 	transport_error_cb *error;
+	struct sipe_tls_session_cache *session_cache; /* may be NULL */
 } sipe_connect_setup;
 struct sipe_transport_connection *sipe_backend_transport_connect(struct sipe_core_public *sipe_public,
 								 const sipe_connect_setup *setup);
 void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn);
 void sipe_backend_transport_message(struct sipe_transport_connection *conn,
 				    const gchar *buffer);
+
+/**
+ * Segment of an outgoing message, e.g. header or body
+ */
+struct sipe_transport_segment {
+	const gchar *data;
+	gsize length;
+};
+
+/**
+ * Send a message consisting of one or more segments
+ *
+ * The backend should not flatten the segments into one buffer before
+ * sending. Segment data is only valid for the duration of the call, i.e.
+ * the backend must copy any part it can't send immediately.
+ *
+ * @param conn     transport connection
+ * @param segments array of message segments
+ * @param count    number of entries in @c segments
+ */
+void sipe_backend_transport_message_iov(struct sipe_transport_connection *conn,
+					const struct sipe_transport_segment *segments,
+					guint count);
 void sipe_backend_transport_flush(struct sipe_transport_connection *conn);
 
+/**
+ * Amount of outgoing data that hasn't been written to the network yet
+ *
+ * Used by the core to hold back bulk traffic while the connection is busy.
+ *
+ * @param conn transport connection
+ *
+ * @return number of bytes queued in the backend
+ */
+gsize sipe_backend_transport_pending(struct sipe_transport_connection *conn);
+
 /** USER *********************************************************************/
 
 void sipe_backend_user_feedback_typing(struct sipe_core_public *sipe_public,
@@ -1003,6 +1247,18 @@ const gchar *sipe_backend_buddy_get_photo_hash(struct sipe_core_public *sipe_pub
 gboolean sipe_backend_buddy_group_add(struct sipe_core_public *sipe_public,
 				      const gchar *group_name);
 
+/**
+ * Check whether the buddies of a group are displayed to the user
+ *
+ * Used to decide which buddies need a presence subscription at login.
+ *
+ * @param sipe_public The handle representing the protocol instance making the call
+ * @param group_name  The group to check
+ * @return TRUE if the group is visible, e.g. not collapsed
+ */
+gboolean sipe_backend_buddy_group_visible(struct sipe_core_public *sipe_public,
+					  const gchar *group_name);
+
 /**
  * Called when a new internal group has been renamed
  *
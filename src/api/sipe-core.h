@@ -57,6 +57,9 @@ extern "C" {
  * The processing function in the core can remove content from the buffer.
  * It has to update buffer_used accordingly.
  *
+ * buffer_scanned is private to the core. It records how much of the buffer
+ * has already been searched for the end of a message header, so that the
+ * search can resume there when the backend appends more data.
  */
 struct sipe_transport_connection {
 	gpointer user_data;
@@ -65,8 +68,111 @@ struct sipe_transport_connection {
 	gsize buffer_length;      /* read-only */
 	guint type;               /* read-only */
 	guint client_port;        /* read-only */
+	gsize buffer_scanned;     /* core only, backend must not modify */
 };
 
+/**
+ * Make room in the transport receive buffer
+ *
+ * The backend calls this before each read into buffer + buffer_used.
+ * The buffer grows geometrically. If the core has consumed all data, a
+ * buffer that has grown for a large message is shrunk again.
+ *
+ * The maximum buffer size can be changed at compile time by defining
+ * SIPE_TRANSPORT_BUFFER_MAXIMUM.
+ *
+ * @param conn transport connection
+ *
+ * @return number of bytes that can be read, excluding the string
+ *         terminator. 0 means the buffer has reached its maximum size
+ *         without the core finding a complete message.
+ */
+gsize sipe_core_transport_buffer_reserve(struct sipe_transport_connection *conn);
+
+/**
+ * TLS session cache
+ *
+ * The core passes a session cache in sipe_connect_setup for TLS
+ * connections. A backend that can resume TLS sessions stores the session
+ * state after the handshake and offers it for the next connection to the
+ * same host:port. Entries expire after the server's session timeout.
+ */
+struct sipe_tls_session_cache;
+
+/**
+ * Find the session state of the last connection to host:port
+ *
+ * @param cache TLS session cache (may be @c NULL)
+ * @param host  server name
+ * @param port  server port
+ *
+ * @return session state as stored by the backend or @c NULL
+ */
+gpointer sipe_core_tls_session_lookup(struct sipe_tls_session_cache *cache,
+				      const gchar *host,
+				      guint port);
+
+/**
+ * Store the session state after a successful handshake
+ *
+ * Replaces the previous session state for host:port.
+ *
+ * @param cache   TLS session cache (may be @c NULL)
+ * @param host    server name
+ * @param port    server port
+ * @param data    session state, owned by the cache
+ * @param destroy called when the session state is dropped (may be @c NULL)
+ */
+void sipe_core_tls_session_store(struct sipe_tls_session_cache *cache,
+				 const gchar *host,
+				 guint port,
+				 gpointer data,
+				 GDestroyNotify destroy);
+
+/**
+ * Report that the server accepted the offered session
+ *
+ * Only backends that can tell a resumed handshake from a full one call
+ * this. Used for the "tls.resumption_ratio" metric.
+ *
+ * @param cache TLS session cache (may be @c NULL)
+ */
+void sipe_core_tls_session_resumed(struct sipe_tls_session_cache *cache);
+
+/**
+ * Drop the session state for host:port, e.g. after a handshake failure
+ *
+ * @param cache TLS session cache (may be @c NULL)
+ * @param host  server name
+ * @param port  server port
+ */
+void sipe_core_tls_session_invalidate(struct sipe_tls_session_cache *cache,
+				      const gchar *host,
+				      guint port);
+
+/**
+ * Largest TLS record payload: RFC 5246 6.2.1
+ *
+ * Backends should collect outgoing messages into writes of this size,
+ * i.e. a burst of small SIP messages is encrypted into full records.
+ */
+#define SIPE_TLS_RECORD_LENGTH (16 * 1024)
+
+struct sipe_core_public;
+
+/**
+ * Report a write on a TLS transport
+ *
+ * Used for the "tls.messages" & "tls.records" metrics.
+ *
+ * @param sipe_public The handle representing the protocol instance
+ * @param messages    number of messages included in the write
+ * @param length      number of bytes written
+ */
+void sipe_core_tls_records(struct sipe_core_public *sipe_public,
+			   guint messages,
+			   gsize length);
+
 /**
  * Opaque data type for chat session
  */
@@ -89,6 +195,8 @@ struct sipe_file_transfer {
 	void (* user_rejected)(struct sipe_file_transfer *ft);
 	void (* cancelled)(struct sipe_file_transfer *ft, gboolean local);
 	void (* deallocate)(struct sipe_file_transfer *ft);
+	gboolean (* progress)(struct sipe_file_transfer *ft, guint64 *bytes,
+			      guint64 *bytes_per_second);
 };
 
 /**
@@ -113,6 +221,10 @@ struct sipe_backend_private;
  */
 /* user disabled calendar information publishing */
 #define SIPE_CORE_FLAG_DONT_PUBLISH 0x00000001
+/* keep standby connection to next server for instant failover */
+#define SIPE_CORE_FLAG_STANDBY      0x00000002
+/* negotiate MS-SIPCOMP compression on TLS connections */
+#define SIPE_CORE_FLAG_SIP_COMPRESSION 0x00000004
 
 #define SIPE_CORE_FLAG_IS(flag)    \
 	((sipe_public->flags & SIPE_CORE_FLAG_ ## flag) == SIPE_CORE_FLAG_ ## flag)
@@ -122,9 +234,13 @@ struct sipe_backend_private;
 	(sipe_public->flags &= ~SIPE_CORE_FLAG_ ## flag)
 
 /**
- * Byte length of cryptographic key for call encryption.
+ * Byte length of cryptographic key for call encryption, i.e. master key
+ * and salt of AES_CM_128_HMAC_SHA1_80 and AEAD_AES_128_GCM.
  */
-#define SIPE_SRTP_KEY_LEN 30
+#define SIPE_SRTP_KEY_LEN     30
+#define SIPE_SRTP_GCM_KEY_LEN 28
+#define SIPE_SRTP_SUITE_KEY_LEN(suite) \
+	(((suite) == SIPE_SRTP_AEAD_AES_128_GCM) ? SIPE_SRTP_GCM_KEY_LEN : SIPE_SRTP_KEY_LEN)
 
 /**
  * Public part of the Sipe data structure
@@ -145,6 +261,9 @@ struct sipe_core_public {
 	gchar *sip_name;
 	gchar *sip_domain;
 
+	/* main context for all callbacks of this account, NULL: default */
+	GMainContext *context;
+
 	/* server information */
 	/* currently nothing */
 };
@@ -156,6 +275,139 @@ struct sipe_core_public {
 void sipe_core_init(const char *locale_dir);
 void sipe_core_destroy(void);
 
+/** Debugging ****************************************************************/
+
+/**
+ * Configure per-subsystem debug levels
+ *
+ * The core reads the initial configuration from the environment
+ * variable SIPE_DEBUG in sipe_core_init(). It can be changed at runtime.
+ *
+ * @param spec comma-separated list of "<subsystem>:<level>" entries.
+ *             Subsystem is one of "sip", "http", "schedule" or "all".
+ *             Level is one of "info", "warning", "error" or "none".
+ *
+ * @return @c FALSE if spec contained an invalid entry
+ */
+gboolean sipe_core_debug_configure(const gchar *spec);
+
+/**
+ * Check if the asynchronous debug log file is active
+ *
+ * The core opens the file given by the environment variable
+ * SIPE_DEBUG_LOGFILE in sipe_core_init(). Backends should then consider
+ * debugging enabled and pass their output to sipe_core_debug_log().
+ *
+ * Thread-safe.
+ *
+ * @return @c TRUE if the debug log file is active
+ */
+gboolean sipe_core_debug_log_active(void);
+
+/**
+ * Queue debug message for the debug log file
+ *
+ * Never blocks: the message is written by a separate thread. If too
+ * much output is waiting the message is dropped and counted.
+ *
+ * Thread-safe.
+ *
+ * @param level debug level (sipe_debug_level)
+ * @param msg   debug message without trailing "\n"
+ *
+ * @return @c FALSE if the file isn't active, i.e. the backend has to
+ *         output the message itself
+ */
+gboolean sipe_core_debug_log(guint level, const gchar *msg);
+
+/**
+ * Dump trace of the most recent SIP & HTTP messages
+ *
+ * Doesn't allocate memory, i.e. it can be called from a signal handler.
+ *
+ * @param writer    callback to output one chunk of the dump
+ * @param user_data callback data
+ */
+typedef void (*sipe_core_debug_trace_writer)(const gchar *data,
+					     gsize length,
+					     gpointer user_data);
+void sipe_core_debug_trace_dump(sipe_core_debug_trace_writer writer,
+				gpointer user_data);
+
+/**
+ * Dump the recent protocol events as JSON lines
+ *
+ * One object per line with the members "time" (seconds since the epoch),
+ * "event", "key", "detail", "status", "bytes" and "ms". Events that
+ * belong to the same transaction have the same "key".
+ *
+ * Doesn't allocate memory, i.e. it can be called from a signal handler.
+ *
+ * @param writer    callback to output one chunk of the dump
+ * @param user_data callback data
+ */
+void sipe_core_debug_events_dump(sipe_core_debug_trace_writer writer,
+				 gpointer user_data);
+
+/** Metrics ******************************************************************/
+
+typedef enum {
+	SIPE_CORE_METRIC_COUNTER,
+	SIPE_CORE_METRIC_GAUGE,
+	SIPE_CORE_METRIC_HISTOGRAM
+} sipe_core_metric_type;
+
+struct sipe_core_metric {
+	const gchar *name;          /* static string, e.g. "sip.rtt" */
+	sipe_core_metric_type type;
+	guint64 value;              /* histogram: number of samples */
+
+	/* histogram only: latencies in milliseconds */
+	guint64 sum;
+	guint min;
+	guint max;
+	guint p50;
+	guint p90;
+	guint p99;
+};
+
+/**
+ * Take a snapshot of the runtime metrics of an account
+ *
+ * Counters and histograms are accumulated since login.
+ *
+ * @param sipe_public SIPE core public data
+ *
+ * @return array of struct sipe_core_metric.
+ *         Must be freed with g_array_free(array, TRUE).
+ */
+GArray *sipe_core_metrics_snapshot(struct sipe_core_public *sipe_public);
+
+/** Memory usage *************************************************************/
+
+struct sipe_core_memory {
+	const gchar *name;          /* static string, e.g. "buddies" */
+	guint64 bytes;
+	guint64 objects;
+};
+
+/**
+ * Estimate the memory used by an account, per subsystem
+ *
+ * The data structures are walked when this is called, i.e. there is no
+ * overhead when no report is requested. The numbers don't include the
+ * allocator overhead. "xml" and "uris" are shared by all accounts. The
+ * last entry is the "total" over all subsystems.
+ *
+ * The report is also written to the debug log.
+ *
+ * @param sipe_public SIPE core public data
+ *
+ * @return array of struct sipe_core_memory.
+ *         Must be freed with g_array_free(array, TRUE).
+ */
+GArray *sipe_core_memory_report(struct sipe_core_public *sipe_public);
+
 /** Utility functions exported by the core to backends ***********************/
 gboolean sipe_strequal(const gchar *left, const gchar *right);
 
@@ -230,6 +482,19 @@ void sipe_core_change_access_level_for_domain(struct sipe_core_public *sipe_publ
 const gchar *sipe_core_activity_description(guint type);
 
 /* buddy actions */
+/**
+ * Hint that the presence of a buddy is needed
+ *
+ * Backends should call this when a buddy is displayed, e.g. its group
+ * has been expanded or a tooltip is shown. With large contact lists the
+ * core only subscribes to the presence of buddies in use.
+ *
+ * @param sipe_public Sipe core public data structure.
+ * @param uri         SIP URI of the buddy
+ */
+void sipe_core_buddy_presence_hint(struct sipe_core_public *sipe_public,
+				   const gchar *uri);
+
 /**
  * Get status text for buddy.
  *
@@ -297,6 +562,12 @@ void sipe_core_group_set_alias(struct sipe_core_public *sipe_public,
 
 /**
  * Setup core data
+ *
+ * The core attaches its own timeouts to @c context. The backend must
+ * dispatch all its callbacks for this account, e.g. transport and timer
+ * callbacks, from the same context.
+ *
+ * @param context main context (@c NULL for the default context)
  */
 struct sipe_core_public *sipe_core_allocate(const gchar *signin_name,
 					    gboolean sso,
@@ -304,6 +575,7 @@ struct sipe_core_public *sipe_core_allocate(const gchar *signin_name,
 					    const gchar *password,
 					    const gchar *email,
 					    const gchar *email_url,
+					    GMainContext *context,
 					    const gchar **errmsg);
 void sipe_core_deallocate(struct sipe_core_public *sipe_public);
 
@@ -329,6 +601,18 @@ void sipe_core_transport_sip_connect(struct sipe_core_public *sipe_public,
 				     const gchar *server,
 				     const gchar *port);
 
+/**
+ * Host network configuration has changed
+ *
+ * Triggers an immediate check of the SIP connection. A lost connection
+ * is replaced without going through a full reconnect.
+ *
+ * @param sipe_public Sipe core public data structure
+ * @param available   @c TRUE if the host has network connectivity
+ */
+void sipe_core_transport_sip_network_changed(struct sipe_core_public *sipe_public,
+					     gboolean available);
+
 /**
  * Get SIP server host name
  *
@@ -458,6 +742,18 @@ void sipe_core_media_test_call(struct sipe_core_public *sipe_public);
 void sipe_core_media_candidate_pair_established(struct sipe_media_call *call,
 						struct sipe_media_stream *stream);
 
+/**
+ * Query quality statistics of a media stream
+ *
+ * @param stream (in)  media stream
+ * @param stats  (out) packet loss, jitter, RTT and selected candidate pair
+ *
+ * @return @c FALSE if no statistics are available yet
+ */
+struct sipe_media_stats;
+gboolean sipe_core_media_stream_get_stats(struct sipe_media_stream *stream,
+					  struct sipe_media_stats *stats);
+
 /* file transfer */
 struct sipe_file_transfer *
 sipe_core_ft_create_outgoing(struct sipe_core_public *sipe_public);
@@ -465,6 +761,48 @@ sipe_core_ft_create_outgoing(struct sipe_core_public *sipe_public);
 struct sipe_file_transfer *
 sipe_core_ft_lync_create_outgoing(struct sipe_core_public *sipe_public);
 
+/**
+ * Query file transfer progress
+ *
+ * @param ft               (in)  file transfer
+ * @param bytes            (out) file data transferred so far
+ * @param bytes_per_second (out) average throughput since start
+ *
+ * @return @c FALSE if the transfer hasn't started or doesn't support it
+ */
+gboolean sipe_core_ft_get_progress(struct sipe_file_transfer *ft,
+				   guint64 *bytes,
+				   guint64 *bytes_per_second);
+
+/**
+ * Open local file as data source for an outgoing file transfer
+ *
+ * To be called from @c sipe_backend_ft_open_source(). The file is mapped
+ * into memory or, if that fails, read ahead on a worker thread.
+ *
+ * @param sipe_public (in) SIPE core data
+ * @param filename    (in) local file name (may be @c NULL)
+ *
+ * @return file source or @c NULL if the file can't be opened
+ */
+struct sipe_ft_source;
+struct sipe_ft_source *sipe_core_ft_source_open(struct sipe_core_public *sipe_public,
+						const gchar *filename);
+
+/**
+ * Open file sink for an incoming file transfer
+ *
+ * Received data is written behind on a worker thread.
+ *
+ * @param sipe_public (in) SIPE core data
+ * @param filename    (in) local file name (may be @c NULL)
+ *
+ * @return file sink or @c NULL if the file can't be created
+ */
+struct sipe_ft_sink;
+struct sipe_ft_sink *sipe_core_ft_sink_open(struct sipe_core_public *sipe_public,
+					    const gchar *filename);
+
 /* application sharing */
 
 struct sipe_appshare;
@@ -483,6 +821,57 @@ void sipe_core_groupchat_join(struct sipe_core_public *sipe_public,
 void sipe_core_im_send(struct sipe_core_public *sipe_public,
 		       const gchar *who,
 		       const gchar *what);
+
+/**
+ * Result callback for sipe_core_im_send_many()
+ *
+ * @param sipe_public (in) the handle representing the protocol instance
+ * @param who         (in) destination URI
+ * @param delivered   (in) @c TRUE if the destination accepted the message
+ * @param user_data   (in) callback data
+ */
+typedef void (*sipe_core_im_send_cb)(struct sipe_core_public *sipe_public,
+				     const gchar *who,
+				     gboolean delivered,
+				     gpointer user_data);
+
+/**
+ * Send the same IM to many destinations
+ *
+ * Conversations are set up for a bounded number of destinations at a
+ * time. @c callback is called exactly once for each destination.
+ *
+ * @param sipe_public (in) the handle representing the protocol instance
+ * @param who         (in) list of destination URIs (gchar *)
+ * @param what        (in) message text
+ * @param callback    (in) result callback or NULL
+ * @param user_data   (in) callback data
+ */
+void sipe_core_im_send_many(struct sipe_core_public *sipe_public,
+			    const GSList *who,
+			    const gchar *what,
+			    sipe_core_im_send_cb callback,
+			    gpointer user_data);
+
+/**
+ * Broadcast the same IM to many destinations
+ *
+ * The destinations are invited to an ad-hoc conference and the message is
+ * posted there once. Falls back to sipe_core_im_send_many() for
+ * destinations that don't join and when conferencing is not available.
+ * @c callback is called exactly once for each destination.
+ *
+ * @param sipe_public (in) the handle representing the protocol instance
+ * @param who         (in) list of destination URIs (gchar *)
+ * @param what        (in) message text
+ * @param callback    (in) result callback or NULL
+ * @param user_data   (in) callback data
+ */
+void sipe_core_im_broadcast(struct sipe_core_public *sipe_public,
+			    const GSList *who,
+			    const gchar *what,
+			    sipe_core_im_send_cb callback,
+			    gpointer user_data);
 void sipe_core_im_close(struct sipe_core_public *sipe_public,
 			const gchar *who);
 
@@ -511,6 +900,25 @@ void sipe_core_buddy_group(struct sipe_core_public *sipe_public,
 			   const gchar *old_group_name,
 			   const gchar *new_group_name);
 
+/**
+ * Search local roster
+ *
+ * Uses an index over display name, email address, URI and phone numbers
+ * of all buddies, i.e. it returns immediately and can be called for every
+ * key press before a directory search via sipe_core_buddy_search().
+ *
+ * @param sipe_public Sipe core public data structure
+ * @param query       search string. Every word must be a prefix of a
+ *                    word in one of the buddy properties.
+ * @param max_results maximum number of results, 0 for unlimited
+ *
+ * @return list of buddy URIs (gchar *), best match first. Caller must
+ *         free the list and its contents.
+ */
+GSList *sipe_core_buddy_local_search(struct sipe_core_public *sipe_public,
+				     const gchar *query,
+				     guint max_results);
+
 struct sipe_backend_search_token;
 void sipe_core_buddy_search(struct sipe_core_public *sipe_public,
 			    struct sipe_backend_search_token *token,
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,6 +22,8 @@
 
 /**
  * MIME backend initialization
+ *
+ * Called by core before the first document is passed to the backend.
  */
 void sipe_mime_init(void);
 
@@ -30,6 +32,12 @@ void sipe_mime_init(void);
  */
 void sipe_mime_shutdown(void);
 
+/**
+ * Shut down MIME backend if it has been initialized.
+ * Implemented in core.
+ */
+void sipe_mime_parts_shutdown(void);
+
 /**
  * Callback type for sipe_mime_parts_foreach().
  *
@@ -46,6 +54,10 @@ typedef void (*sipe_mime_parts_cb)(gpointer user_data,
 /**
  * Parse MIME document and call a function for each part.
  *
+ * Implemented in core: the parts are passed to @c callback as views into
+ * @c body, i.e. @c body must stay valid during the call and the part text
+ * is not NUL terminated. Parts without a Content-Type are skipped.
+ *
  * @param type      content type of the MIME document.
  * @param body      body of the MIME document.
  * @param callback  function to call for each MIME part.
@@ -55,3 +67,13 @@ void sipe_mime_parts_foreach(const gchar *type,
 			     const gchar *body,
 			     sipe_mime_parts_cb callback,
 			     gpointer user_data);
+
+/**
+ * MIME backend parser, called by sipe_mime_parts_foreach() for documents
+ * it can't handle itself, e.g. parts which need Content-Transfer-Encoding
+ * decoding. Same parameters as sipe_mime_parts_foreach().
+ */
+void sipe_mime_parts_foreach_fallback(const gchar *type,
+				      const gchar *body,
+				      sipe_mime_parts_cb callback,
+				      gpointer user_data);
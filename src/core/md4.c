@@ -42,7 +42,11 @@
  *
  * Added Coverity warning suppression
  *
- * Copyright (C) 2011-12 SIPE Project <http://sipe.sourceforge.net/>
+ * Added little endian fast path for block word conversion
+ *
+ * Fixed uninitialized length field bytes for 56-63 byte final segments
+ *
+ * Copyright (C) 2011-16 SIPE Project <http://sipe.sourceforge.net/>
  */
 
 /*
@@ -102,6 +106,10 @@ static void w2b(Uint8 *out, const Uint32 *in, Uint32 len)
 /* converts from byte array to word array, len is number of bytes */
 static void b2w(Uint32 *out, const Uint8 *in, Uint32 len)
 {
+#if defined(G_BYTE_ORDER) && (G_BYTE_ORDER == G_LITTLE_ENDIAN)
+  /* byte order already matches: a (possibly unaligned) block copy will do */
+  memcpy(out, in, len);
+#else
   Uint32 *wp; const Uint8 *bp, *bpend;
 
   wp = out;
@@ -115,6 +123,7 @@ static void b2w(Uint32 *out, const Uint8 *in, Uint32 len)
           (Uint32) (bp[2] << 16) |
           (Uint32) (bp[3] << 24);
   }
+#endif
 }
 
 /* update state: data is 64 bytes in length */
@@ -172,7 +181,8 @@ void md4sum(const Uint8 *input, Uint32 inputLen, Uint8 *result)
   n = inputLen % 64;
   memcpy(final, input + (m << 6), n);
   final[n] = 0x80;
-  memset(final + n + 1, 0, 120 - (n + 1));
+  /* clear the upper 32 bits of the 64 bit length field too */
+  memset(final + n + 1, 0, sizeof(final) - (n + 1));
 
   inputLen = inputLen << 3;
   /* This code is correct: w2b() only accesses 4 bytes starting from &inputLen */
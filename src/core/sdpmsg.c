@@ -32,73 +32,138 @@
 #include "sdpmsg.h"
 #include "sipe-utils.h"
 
-static gboolean
-append_attribute(struct sdpmedia *media, gchar *attr)
+/*
+ * SDP parser
+ *
+ * The message is scanned once. Attributes are stored per media and the
+ * ones needed for candidates, codecs and keys are indexed by name at the
+ * same time. Lines are tokenized in place, i.e. only the final objects
+ * are allocated.
+ */
+#define SDP_MAX_TOKENS 12
+
+struct sdp_token {
+	const gchar *s;
+	gsize len;
+};
+
+struct sdp_attribute_index {
+	GPtrArray *candidate;
+	GPtrArray *rtpmap;
+	GPtrArray *fmtp;
+	GPtrArray *crypto;
+	const gchar *ice_ufrag;
+	const gchar *ice_pwd;
+};
+
+/*
+ * Same semantics as g_strsplit_set(): consecutive delimiters create empty
+ * tokens and the last token holds the remainder when "max" is reached.
+ */
+static guint
+sdp_tokenize(const gchar *str, gsize length, const gchar *delimiters,
+	     struct sdp_token *tokens, guint max)
 {
-	gchar **parts = g_strsplit(attr + 2, ":", 2);
+	const gchar *end = str + length;
+	guint count = 0;
 
-	if(!parts[0]) {
-		g_strfreev(parts);
-		return FALSE;
+	if (length == 0)
+		return(0);
+
+	while (count < max - 1) {
+		const gchar *p = str;
+
+		while ((p < end) && !strchr(delimiters, *p))
+			p++;
+		if (p == end)
+			break;
+
+		tokens[count].s   = str;
+		tokens[count].len = p - str;
+		count++;
+		str = p + 1;
 	}
 
-	media->attributes = sipe_utils_nameval_add(media->attributes,
-						   parts[0],
-						   parts[1] ? parts[1] : "");
-	g_strfreev(parts);
-	return TRUE;
+	tokens[count].s   = str;
+	tokens[count].len = end - str;
+	return(count + 1);
 }
 
 static gboolean
-parse_attributes(struct sdpmsg *smsg, gchar *msg) {
-	gchar		**lines = g_strsplit(msg, "\r\n", 0);
-	gchar		**ptr = lines;
-
-	while (*ptr != NULL) {
-		if (g_str_has_prefix(*ptr, "o=")) {
-			gchar **parts = g_strsplit(*ptr + 2, " ", 6);
-			smsg->ip = g_strdup(parts[5]);
-			g_strfreev(parts);
-		} else if (g_str_has_prefix(*ptr, "m=")) {
-			gchar **parts = g_strsplit(*ptr + 2, " ", 3);
-			struct sdpmedia *media = g_new0(struct sdpmedia, 1);
-
-			smsg->media = g_slist_append(smsg->media, media);
-
-			media->name = g_strdup(parts[0]);
-			media->port = atoi(parts[1]);
-			media->encryption_active =
-					g_strstr_len(parts[2], -1, "/SAVP") != NULL;
-
-			g_strfreev(parts);
-
-			while (*(++ptr) && !g_str_has_prefix(*ptr, "m=")) {
-
-				if (g_str_has_prefix(*ptr, "a=")) {
-					if (!append_attribute(media, *ptr)) {
-						g_strfreev(lines);
-						return FALSE;
-					}
-				}
-			}
-			continue;
-		}
+token_equal(const struct sdp_token *token, const gchar *str)
+{
+	return((strlen(str) == token->len) &&
+	       (memcmp(token->s, str, token->len) == 0));
+}
 
-		++ptr;
-	}
+static gchar *
+token_dup(const struct sdp_token *token)
+{
+	return(g_strndup(token->s, token->len));
+}
 
-	g_strfreev(lines);
+static void
+index_attribute(struct sdp_attribute_index *index,
+		const struct sipnameval *attr)
+{
+	const gchar *name = attr->name;
+
+	if (sipe_strequal(name, "candidate"))
+		g_ptr_array_add(index->candidate, attr->value);
+	else if (sipe_strequal(name, "rtpmap"))
+		g_ptr_array_add(index->rtpmap, attr->value);
+	else if (sipe_strequal(name, "fmtp"))
+		g_ptr_array_add(index->fmtp, attr->value);
+	else if (sipe_strequal(name, "crypto"))
+		g_ptr_array_add(index->crypto, attr->value);
+	else if (!index->ice_ufrag && sipe_strequal(name, "ice-ufrag"))
+		index->ice_ufrag = attr->value;
+	else if (!index->ice_pwd && sipe_strequal(name, "ice-pwd"))
+		index->ice_pwd = attr->value;
+}
+
+static void
+index_reset(struct sdp_attribute_index *index)
+{
+	g_ptr_array_set_size(index->candidate, 0);
+	g_ptr_array_set_size(index->rtpmap, 0);
+	g_ptr_array_set_size(index->fmtp, 0);
+	g_ptr_array_set_size(index->crypto, 0);
+	index->ice_ufrag = NULL;
+	index->ice_pwd   = NULL;
+}
+
+/* "line" points after "a=" */
+static gboolean
+append_attribute(struct sdpmedia *media,
+		 struct sdp_attribute_index *index,
+		 const gchar *line, gsize length)
+{
+	const gchar *colon = memchr(line, ':', length);
+	gsize name_length  = colon ? (gsize) (colon - line) : length;
+	struct sipnameval *attr;
+
+	if (length == 0)
+		return FALSE;
+
+	attr = colon ?
+		sipe_utils_nameval_new(line, name_length,
+				       colon + 1, length - name_length - 1) :
+		sipe_utils_nameval_new(line, name_length, "", 0);
+
+	/* reversed when the media is complete */
+	media->attributes = g_slist_prepend(media->attributes, attr);
+	index_attribute(index, attr);
 
 	return TRUE;
 }
 
 static struct sdpcandidate * sdpcandidate_copy(struct sdpcandidate *candidate);
-static void sdpcandidate_free(struct sdpcandidate *candidate);
 
 static SipeComponentType
-parse_component(const gchar *str)
+parse_component(const struct sdp_token *token)
 {
-	switch (atoi(str)) {
+	switch (atoi(token->s)) {
 		case 1: return  SIPE_COMPONENT_RTP;
 		case 2: return  SIPE_COMPONENT_RTCP;
 		default: return SIPE_COMPONENT_NONE;
@@ -106,137 +171,135 @@ parse_component(const gchar *str)
 }
 
 static gchar *
-base64_pad(const gchar* str)
+base64_pad(const struct sdp_token *token)
 {
-	size_t str_len = strlen(str);
+	gsize str_len = token->len;
 	int mod = str_len % 4;
+	int pad = mod > 0 ? 4 - mod : 0;
+	gchar *result = g_malloc(str_len + pad + 1);
 
-	if (mod > 0) {
-		gchar *result = NULL;
-		int pad = 4 - mod;
-		gchar *ptr = result = g_malloc(str_len + pad + 1);
-
-		memcpy(ptr, str, str_len);
-		ptr += str_len;
-		memset(ptr, '=', pad);
-		ptr += pad;
-		*ptr = '\0';
+	memcpy(result, token->s, str_len);
+	memset(result + str_len, '=', pad);
+	result[str_len + pad] = '\0';
 
-		return result;
-	} else
-		return g_strdup(str);
+	return result;
 }
 
 static GSList *
-parse_append_candidate_draft_6(gchar **tokens, GSList *candidates)
+parse_append_candidate_draft_6(const struct sdp_token *tokens, GSList *candidates)
 {
-	struct sdpcandidate *candidate = g_new0(struct sdpcandidate, 1);
+	struct sdpcandidate *candidate = sdpcandidate_new();
 
-	candidate->username = base64_pad(tokens[0]);
-	candidate->component = parse_component(tokens[1]);
-	candidate->password = base64_pad(tokens[2]);
+	candidate->username = base64_pad(tokens + 0);
+	candidate->component = parse_component(tokens + 1);
+	candidate->password = base64_pad(tokens + 2);
 
-	if (sipe_strequal(tokens[3], "UDP"))
+	if (token_equal(tokens + 3, "UDP"))
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_UDP;
-	else if (sipe_strequal(tokens[3], "TCP"))
+	else if (token_equal(tokens + 3, "TCP"))
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_TCP_ACTIVE;
 	else {
 		sdpcandidate_free(candidate);
 		return candidates;
 	}
 
-	candidate->priority = atoi(tokens[4] + 2);
-	candidate->ip = g_strdup(tokens[5]);
-	candidate->port = atoi(tokens[6]);
+	candidate->priority = tokens[4].len > 2 ? atoi(tokens[4].s + 2) : 0;
+	candidate->ip = token_dup(tokens + 5);
+	candidate->port = atoi(tokens[6].s);
 
-	candidates = g_slist_append(candidates, candidate);
+	/* list is reversed by parse_candidates() */
+	candidates = g_slist_prepend(candidates, candidate);
 
 	// draft 6 candidates are both active and passive
 	if (candidate->protocol == SIPE_NETWORK_PROTOCOL_TCP_ACTIVE) {
 		candidate = sdpcandidate_copy(candidate);
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_TCP_PASSIVE;
-		candidates = g_slist_append(candidates, candidate);
+		candidates = g_slist_prepend(candidates, candidate);
 	}
 
 	return candidates;
 }
 
 static GSList *
-parse_append_candidate_rfc_5245(gchar **tokens, GSList *candidates)
+parse_append_candidate_rfc_5245(const struct sdp_token *tokens, GSList *candidates)
 {
-	struct sdpcandidate *candidate = g_new0(struct sdpcandidate, 1);
+	struct sdpcandidate *candidate = sdpcandidate_new();
 
-	candidate->foundation = g_strdup(tokens[0]);
-	candidate->component = parse_component(tokens[1]);
+	candidate->foundation = token_dup(tokens + 0);
+	candidate->component = parse_component(tokens + 1);
 
-	if (sipe_strequal(tokens[2], "UDP"))
+	if (token_equal(tokens + 2, "UDP"))
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_UDP;
-	else if (sipe_strequal(tokens[2], "TCP-ACT"))
+	else if (token_equal(tokens + 2, "TCP-ACT"))
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_TCP_ACTIVE;
-	else if (sipe_strequal(tokens[2], "TCP-PASS"))
+	else if (token_equal(tokens + 2, "TCP-PASS"))
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_TCP_PASSIVE;
 	else {
 		sdpcandidate_free(candidate);
 		return candidates;
 	}
 
-	candidate->priority = atoi(tokens[3]);
-	candidate->ip = g_strdup(tokens[4]);
-	candidate->port = atoi(tokens[5]);
+	candidate->priority = strtoul(tokens[3].s, NULL, 10);
+	candidate->ip = token_dup(tokens + 4);
+	candidate->port = atoi(tokens[5].s);
 
-	if (sipe_strequal(tokens[7], "host"))
+	if (token_equal(tokens + 7, "host"))
 		candidate->type = SIPE_CANDIDATE_TYPE_HOST;
-	else if (sipe_strequal(tokens[7], "relay"))
+	else if (token_equal(tokens + 7, "relay"))
 		candidate->type = SIPE_CANDIDATE_TYPE_RELAY;
-	else if (sipe_strequal(tokens[7], "srflx"))
+	else if (token_equal(tokens + 7, "srflx"))
 		candidate->type = SIPE_CANDIDATE_TYPE_SRFLX;
-	else if (sipe_strequal(tokens[7], "prflx"))
+	else if (token_equal(tokens + 7, "prflx"))
 		candidate->type = SIPE_CANDIDATE_TYPE_PRFLX;
 	else {
 		sdpcandidate_free(candidate);
 		return candidates;
 	}
 
-	candidates = g_slist_append(candidates, candidate);
+	/* list is reversed by parse_candidates() */
+	candidates = g_slist_prepend(candidates, candidate);
 
 	// TCP-ACT candidates are both active and passive
 	if (candidate->protocol == SIPE_NETWORK_PROTOCOL_TCP_ACTIVE) {
 		candidate = sdpcandidate_copy(candidate);
 		candidate->protocol = SIPE_NETWORK_PROTOCOL_TCP_PASSIVE;
-		candidates = g_slist_append(candidates, candidate);
+		candidates = g_slist_prepend(candidates, candidate);
 	}
 	return candidates;
 }
 
 static GSList *
-parse_candidates(GSList *attrs, SipeIceVersion *ice_version)
+parse_candidates(const struct sdp_attribute_index *index,
+		 SipeIceVersion *ice_version)
 {
 	GSList *candidates = NULL;
-	const gchar *attr;
-	int i = 0;
+	guint i;
 
-	while ((attr = sipe_utils_nameval_find_instance(attrs, "candidate", i++))) {
-		gchar **tokens = g_strsplit_set(attr, " ", 0);
+	for (i = 0; i < index->candidate->len; i++) {
+		const gchar *attr = g_ptr_array_index(index->candidate, i);
+		struct sdp_token tokens[SDP_MAX_TOKENS];
+		guint count = sdp_tokenize(attr, strlen(attr), " ",
+					   tokens, SDP_MAX_TOKENS);
 
-		if (sipe_strequal(tokens[6], "typ")) {
+		if ((count > 7) && token_equal(tokens + 6, "typ")) {
 			candidates = parse_append_candidate_rfc_5245(tokens, candidates);
 			if (candidates)
 				*ice_version = SIPE_ICE_RFC_5245;
-		} else {
+		} else if (count >= 7) {
 			candidates = parse_append_candidate_draft_6(tokens, candidates);
 			if (candidates)
 				*ice_version = SIPE_ICE_DRAFT_6;
 		}
-
-		g_strfreev(tokens);
 	}
 
 	if (!candidates)
 		*ice_version = SIPE_ICE_NO_ICE;
 
+	candidates = g_slist_reverse(candidates);
+
 	if (*ice_version == SIPE_ICE_RFC_5245) {
-		const gchar *username = sipe_utils_nameval_find(attrs, "ice-ufrag");
-		const gchar *password = sipe_utils_nameval_find(attrs, "ice-pwd");
+		const gchar *username = index->ice_ufrag;
+		const gchar *password = index->ice_pwd;
 
 		if (username && password) {
 			GSList *i;
@@ -257,7 +320,7 @@ create_legacy_candidates(gchar *ip, guint16 port)
 	struct sdpcandidate *candidate;
 	GSList *candidates = NULL;
 
-	candidate = g_new0(struct sdpcandidate, 1);
+	candidate = sdpcandidate_new();
 	candidate->foundation = g_strdup("1");
 	candidate->component = SIPE_COMPONENT_RTP;
 	candidate->type = SIPE_CANDIDATE_TYPE_HOST;
@@ -267,7 +330,7 @@ create_legacy_candidates(gchar *ip, guint16 port)
 
 	candidates = g_slist_append(candidates, candidate);
 
-	candidate = g_new0(struct sdpcandidate, 1);
+	candidate = sdpcandidate_new();
 	candidate->foundation = g_strdup("1");
 	candidate->component = SIPE_COMPONENT_RTCP;
 	candidate->type = SIPE_CANDIDATE_TYPE_HOST;
@@ -280,147 +343,299 @@ create_legacy_candidates(gchar *ip, guint16 port)
 	return candidates;
 }
 
+static void
+parse_codec_parameters(GSList *codecs, const gchar *attr)
+{
+	const gchar *p = attr;
+	gint id = atoi(attr);
+
+	/* skip payload type */
+	while (*p && (*p != ' '))
+		p++;
+
+	while (*p) {
+		const gchar *name;
+		const gchar *value;
+		gsize name_length;
+		gsize value_length;
+		GSList *i;
+
+		/* skip delimiter */
+		p++;
+
+		/* <alnum>+ "=" <non-space>+ */
+		name = p;
+		while (g_ascii_isalnum(*p))
+			p++;
+		name_length = p - name;
+		if ((name_length == 0) || (*p != '='))
+			goto next;
+		value = ++p;
+		while (*p && !g_ascii_isspace(*p))
+			p++;
+		value_length = p - value;
+		if (value_length == 0)
+			goto next;
+
+		for (i = codecs; i; i = i->next) {
+			struct sdpcodec *codec = i->data;
+			if (codec->id == id)
+				codec->parameters = g_slist_append(codec->parameters,
+								   sipe_utils_nameval_new(name,
+											  name_length,
+											  value,
+											  value_length));
+		}
+
+	next:
+		while (*p && (*p != ' '))
+			p++;
+	}
+}
+
 static GSList *
-parse_codecs(GSList *attrs, SipeMediaType type)
+parse_codecs(const struct sdp_attribute_index *index, SipeMediaType type)
 {
-	int i = 0;
-	const gchar *attr;
 	GSList *codecs = NULL;
+	guint i;
 
-	while ((attr = sipe_utils_nameval_find_instance(attrs, "rtpmap", i++))) {
-		struct sdpcodec *codec = g_new0(struct sdpcodec, 1);
-		gchar **tokens = g_strsplit_set(attr, " /", 3);
+	for (i = 0; i < index->rtpmap->len; i++) {
+		const gchar *attr = g_ptr_array_index(index->rtpmap, i);
+		struct sdp_token tokens[3];
+		struct sdpcodec *codec;
 
-		int j = 0;
-		const gchar* params;
+		if (sdp_tokenize(attr, strlen(attr), " /", tokens, 3) < 3)
+			continue;
 
-		codec->id = atoi(tokens[0]);
-		codec->name = g_strdup(tokens[1]);
-		codec->clock_rate = atoi(tokens[2]);
+		codec = sdpcodec_new();
+		codec->id = atoi(tokens[0].s);
+		codec->name = token_dup(tokens + 1);
+		codec->clock_rate = atoi(tokens[2].s);
 		codec->type = type;
 
-		// TODO: more secure and effective implementation
-		while((params = sipe_utils_nameval_find_instance(attrs, "fmtp", j++))) {
-			gchar **tokens = g_strsplit_set(params, " ", 0);
-			gchar **next = tokens + 1;
+		codecs = g_slist_prepend(codecs, codec);
+	}
+	codecs = g_slist_reverse(codecs);
 
-			if (atoi(tokens[0]) == codec->id) {
-				while (*next) {
-					gchar name[50];
-					gchar value[50];
+	for (i = 0; i < index->fmtp->len; i++)
+		parse_codec_parameters(codecs, g_ptr_array_index(index->fmtp, i));
 
-					if (sscanf(*next, "%[a-zA-Z0-9]=%s", name, value) == 2)
-						codec->parameters = sipe_utils_nameval_add(codec->parameters, name, value);
+	return codecs;
+}
 
-					++next;
-				}
-			}
+static const gchar * const srtp_suite_names[] = {
+	"AES_CM_128_HMAC_SHA1_80", /* SIPE_SRTP_AES_CM_128_HMAC_SHA1_80 */
+	"AEAD_AES_128_GCM",        /* SIPE_SRTP_AEAD_AES_128_GCM */
+};
 
-			g_strfreev(tokens);
-		}
+/* first key of each suite, GCM preferred with AES_CM as fallback */
+static void
+parse_encryption_key(const struct sdp_attribute_index *index,
+		     struct sdpmedia *media)
+{
+	guchar *keys[G_N_ELEMENTS(srtp_suite_names)] = { NULL, NULL };
+	int key_ids[G_N_ELEMENTS(srtp_suite_names)] = { 0, 0 };
+	guint i;
 
-		codecs = g_slist_append(codecs, codec);
-		g_strfreev(tokens);
-	}
+	for (i = 0; i < index->crypto->len; i++) {
+		const gchar *attr = g_ptr_array_index(index->crypto, i);
+		struct sdp_token tokens[6];
+		guint suite;
 
-	return codecs;
-}
+		if ((sdp_tokenize(attr, strlen(attr), " :|", tokens, 6) != 5) ||
+		    !token_equal(tokens + 2, "inline"))
+			continue;
 
-static void
-parse_encryption_key(GSList *attrs, guchar **key, int *key_id)
-{
-	int i = 0;
-	const gchar *attr;
-
-	while ((attr = sipe_utils_nameval_find_instance(attrs, "crypto", i++))) {
-		gchar **tokens = g_strsplit_set(attr, " :|", 6);
-
-		if (tokens[0] && tokens[1] && tokens[2] && tokens[3] && tokens[4] &&
-		    sipe_strcase_equal(tokens[1], "AES_CM_128_HMAC_SHA1_80") &&
-		    sipe_strequal(tokens[2], "inline") &&
-		    !tokens[5]) {
-			gsize key_len;
-			*key = g_base64_decode(tokens[3], &key_len);
-			if (key_len != SIPE_SRTP_KEY_LEN) {
-				g_free(*key);
-				*key = NULL;
+		for (suite = 0; suite < G_N_ELEMENTS(srtp_suite_names); suite++)
+			if ((tokens[1].len == strlen(srtp_suite_names[suite])) &&
+			    (g_ascii_strncasecmp(tokens[1].s,
+						 srtp_suite_names[suite],
+						 tokens[1].len) == 0))
+				break;
+
+		if ((suite < G_N_ELEMENTS(srtp_suite_names)) && !keys[suite]) {
+			gint state = 0;
+			guint save = 0;
+			guchar *key = g_malloc(tokens[3].len * 3 / 4 + 3);
+			gsize key_len = g_base64_decode_step(tokens[3].s,
+							     tokens[3].len,
+							     key, &state, &save);
+
+			if (key_len == SIPE_SRTP_SUITE_KEY_LEN(suite)) {
+				keys[suite]    = key;
+				key_ids[suite] = atoi(tokens[0].s);
+			} else {
+				g_free(key);
 			}
-			*key_id = atoi(tokens[0]);
 		}
+	}
 
-		g_strfreev(tokens);
+	if (keys[SIPE_SRTP_AEAD_AES_128_GCM]) {
+		media->encryption_suite  = SIPE_SRTP_AEAD_AES_128_GCM;
+		media->encryption_key    = keys[SIPE_SRTP_AEAD_AES_128_GCM];
+		media->encryption_key_id = key_ids[SIPE_SRTP_AEAD_AES_128_GCM];
+		media->fallback_key      = keys[SIPE_SRTP_AES_CM_128_HMAC_SHA1_80];
+		media->fallback_key_id   = key_ids[SIPE_SRTP_AES_CM_128_HMAC_SHA1_80];
+	} else {
+		media->encryption_suite  = SIPE_SRTP_AES_CM_128_HMAC_SHA1_80;
+		media->encryption_key    = keys[SIPE_SRTP_AES_CM_128_HMAC_SHA1_80];
+		media->encryption_key_id = key_ids[SIPE_SRTP_AES_CM_128_HMAC_SHA1_80];
+	}
+}
 
-		if (*key) {
-			break;
-		}
+/* called when all lines of a media have been collected */
+static gboolean
+parse_media(struct sdpmsg *smsg,
+	    struct sdpmedia *media,
+	    const struct sdp_attribute_index *index)
+{
+	SipeMediaType type;
+
+	media->attributes = g_slist_reverse(media->attributes);
+
+	media->candidates = parse_candidates(index, &smsg->ice_version);
+
+	if (!media->candidates && media->port != 0) {
+		// No a=candidate in SDP message, this seems to be MSOC 2005
+		media->candidates = create_legacy_candidates(smsg->ip, media->port);
 	}
+
+	if (sipe_strequal(media->name, "audio"))
+		type = SIPE_MEDIA_AUDIO;
+	else if (sipe_strequal(media->name, "video"))
+		type = SIPE_MEDIA_VIDEO;
+	else if (sipe_strequal(media->name, "data"))
+		type = SIPE_MEDIA_APPLICATION;
+	else if (sipe_strequal(media->name, "applicationsharing"))
+		type = SIPE_MEDIA_APPLICATION;
+	else {
+		// Unknown media type
+		return FALSE;
+	}
+
+	media->codecs = parse_codecs(index, type);
+	parse_encryption_key(index, media);
+
+	return TRUE;
 }
 
 struct sdpmsg *
 sdpmsg_parse_msg(gchar *msg)
 {
 	struct sdpmsg *smsg = g_new0(struct sdpmsg, 1);
-	GSList *i;
+	struct sdp_attribute_index index;
+	struct sdpmedia *media = NULL;
+	const gchar *line = msg;
+	gboolean success = TRUE;
+
+	index.candidate = g_ptr_array_new();
+	index.rtpmap    = g_ptr_array_new();
+	index.fmtp      = g_ptr_array_new();
+	index.crypto    = g_ptr_array_new();
+	index.ice_ufrag = NULL;
+	index.ice_pwd   = NULL;
+
+	while (success && line) {
+		const gchar *eol = strstr(line, "\r\n");
+		gsize length = eol ? (gsize) (eol - line) : strlen(line);
+
+		if ((length >= 2) && (line[1] == '=')) {
+			const gchar *value = line + 2;
+			gsize value_length = length - 2;
+
+			switch (line[0]) {
+			case 'o':
+				if (!media && !smsg->ip) {
+					struct sdp_token parts[6];
+					if (sdp_tokenize(value, value_length, " ",
+							 parts, 6) == 6)
+						smsg->ip = token_dup(parts + 5);
+				}
+				break;
 
-	if (!parse_attributes(smsg, msg)) {
-		sdpmsg_free(smsg);
-		return NULL;
-	}
+			case 'm': {
+				struct sdp_token parts[3];
+				guint count = sdp_tokenize(value, value_length,
+							   " ", parts, 3);
 
-	for (i = smsg->media; i; i = i->next) {
-		struct sdpmedia *media = i->data;
-		SipeMediaType type;
+				if (media) {
+					success = parse_media(smsg, media, &index);
+					index_reset(&index);
+				}
 
-		media->candidates = parse_candidates(media->attributes,
-						     &smsg->ice_version);
+				if (count < 2) {
+					success = FALSE;
+					break;
+				}
 
-		if (!media->candidates && media->port != 0) {
-			// No a=candidate in SDP message, this seems to be MSOC 2005
-			media->candidates = create_legacy_candidates(smsg->ip, media->port);
-		}
+				media = g_new0(struct sdpmedia, 1);
+				smsg->media = g_slist_append(smsg->media, media);
+
+				media->name = token_dup(parts + 0);
+				media->port = atoi(parts[1].s);
+				media->encryption_active = (count == 3) &&
+					g_strstr_len(parts[2].s, parts[2].len, "/SAVP");
+				break;
+			}
+
+			case 'a':
+				if (media)
+					success = append_attribute(media, &index,
+								   value,
+								   value_length);
+				break;
 
-		if (sipe_strequal(media->name, "audio"))
-			type = SIPE_MEDIA_AUDIO;
-		else if (sipe_strequal(media->name, "video"))
-			type = SIPE_MEDIA_VIDEO;
-		else if (sipe_strequal(media->name, "data"))
-			type = SIPE_MEDIA_APPLICATION;
-		else if (sipe_strequal(media->name, "applicationsharing"))
-			type = SIPE_MEDIA_APPLICATION;
-		else {
-			// Unknown media type
-			sdpmsg_free(smsg);
-			return NULL;
+			default:
+				break;
+			}
 		}
 
-		media->codecs = parse_codecs(media->attributes, type);
-		parse_encryption_key(media->attributes, &media->encryption_key,
-				&media->encryption_key_id);
+		line = eol ? eol + 2 : NULL;
+	}
+
+	if (success && media)
+		success = parse_media(smsg, media, &index);
+
+	g_ptr_array_free(index.candidate, TRUE);
+	g_ptr_array_free(index.rtpmap, TRUE);
+	g_ptr_array_free(index.fmtp, TRUE);
+	g_ptr_array_free(index.crypto, TRUE);
+
+	if (!success) {
+		sdpmsg_free(smsg);
+		return NULL;
 	}
 
 	return smsg;
 }
 
-static gchar *
-codecs_to_string(GSList *codecs)
-{
-	GString *result = g_string_new(NULL);
+/*
+ * SDP writer
+ *
+ * The whole message is written into one buffer. Every section appends
+ * its lines directly, i.e. there are no temporary strings per media,
+ * candidate or codec.
+ */
+#define SDP_INITIAL_SIZE 1024
 
+static void
+append_codecs(GString *body, GSList *codecs)
+{
 	for (; codecs; codecs = codecs->next) {
 		struct sdpcodec *c = codecs->data;
 		GSList *params = c->parameters;
 
-		g_string_append_printf(result,
+		g_string_append_printf(body,
 				       "a=rtpmap:%d %s/%d\r\n",
 				       c->id,
 				       c->name,
 				       c->clock_rate);
 
 		if (params) {
-			GString *param_str = g_string_new(NULL);
+			gsize start = body->len;
 			int written_params = 0;
 
-			g_string_append_printf(param_str, "a=fmtp:%d", c->id);
+			g_string_append_printf(body, "a=fmtp:%d", c->id);
 
 			for (; params; params = params->next) {
 				struct sipnameval* par = params->data;
@@ -429,130 +644,154 @@ codecs_to_string(GSList *codecs)
 					continue;
 				}
 
-				g_string_append_printf(param_str, " %s=%s",
-						       par->name, par->value);
+				g_string_append_c(body, ' ');
+				g_string_append(body, par->name);
+				g_string_append_c(body, '=');
+				g_string_append(body, par->value);
 				++written_params;
 			}
 
-			g_string_append(param_str, "\r\n");
-
-			if (written_params > 0) {
-				g_string_append(result, param_str->str);
-			}
-
-			g_string_free(param_str, TRUE);
+			if (written_params > 0)
+				g_string_append(body, "\r\n");
+			else
+				g_string_truncate(body, start);
 		}
 	}
-
-	return g_string_free(result, FALSE);
 }
 
-static gchar *
-codec_ids_to_string(GSList *codecs)
+static void
+append_codec_ids(GString *body, GSList *codecs)
 {
-	GString *result = g_string_new(NULL);
-
 	for (; codecs; codecs = codecs->next) {
 		struct sdpcodec *c = codecs->data;
-		g_string_append_printf(result, " %d", c->id);
+		g_string_append_printf(body, " %d", c->id);
 	}
+}
+
+/* length of base64 string without padding */
+static int
+base64_unpadded_length(const gchar *str)
+{
+	gsize length = strlen(str);
+	gsize unpadded = length;
 
-	return g_string_free(result, FALSE);
+	while (unpadded && (str[unpadded - 1] == '='))
+		unpadded--;
+
+	/* a string consisting only of padding is left as is */
+	return(unpadded ? (int) unpadded : (int) length);
 }
 
-static gchar *
-base64_unpad(const gchar *str)
+static const gchar *
+candidate_protocol_rfc_5245(SipeNetworkProtocol protocol)
+{
+	switch (protocol) {
+		case SIPE_NETWORK_PROTOCOL_TCP_ACTIVE:
+			return("TCP-ACT");
+		case SIPE_NETWORK_PROTOCOL_TCP_PASSIVE:
+			return("TCP-PASS");
+		case SIPE_NETWORK_PROTOCOL_UDP:
+			return("UDP");
+		default:
+			/* error unknown/unsupported type */
+			return("UNKNOWN");
+	}
+}
+
+static const gchar *
+candidate_type_rfc_5245(SipeCandidateType type)
 {
-	gchar *result = g_strdup(str);
-	gchar *ptr;
+	switch (type) {
+		case SIPE_CANDIDATE_TYPE_HOST:
+			return("host");
+		case SIPE_CANDIDATE_TYPE_RELAY:
+			return("relay");
+		case SIPE_CANDIDATE_TYPE_SRFLX:
+			return("srflx");
+		case SIPE_CANDIDATE_TYPE_PRFLX:
+			return("prflx");
+		default:
+			/* error unknown/unsupported type */
+			return("unknown");
+	}
+}
 
-	for (ptr = result + strlen(result); ptr != result; --ptr) {
-		if (*(ptr - 1) != '=') {
-			*ptr = '\0';
-			break;
+/*
+ * RFC 5245 4.1.3: a candidate is redundant if another one has the same
+ * transport address and base, but a higher priority. The peer would only
+ * waste connectivity checks on it.
+ */
+static gboolean
+candidate_redundant(const struct sdpcandidate *c, GSList *candidates)
+{
+	gboolean before = TRUE;
+
+	for (; candidates; candidates = candidates->next) {
+		const struct sdpcandidate *c2 = candidates->data;
+
+		if (c2 == c) {
+			before = FALSE;
+			continue;
 		}
+
+		if ((c2->component == c->component) &&
+		    (c2->protocol  == c->protocol) &&
+		    (c2->port      == c->port) &&
+		    (c2->base_port == c->base_port) &&
+		    sipe_strequal(c2->ip, c->ip) &&
+		    sipe_strequal(c2->base_ip, c->base_ip) &&
+		    ((c2->priority > c->priority) ||
+		     ((c2->priority == c->priority) && before)))
+			return TRUE;
 	}
 
-	return result;
+	return FALSE;
 }
 
-static gchar *
-candidates_to_string(GSList *candidates, SipeIceVersion ice_version)
+static void
+append_candidates(GString *body, GSList *candidates, SipeIceVersion ice_version)
 {
-	GString *result = g_string_new("");
 	GSList *i;
 	GSList *processed_tcp_candidates = NULL;
+	guint pruned = 0;
 
 	for (i = candidates; i; i = i->next) {
 		struct sdpcandidate *c = i->data;
 		const gchar *protocol;
-		const gchar *type;
-		gchar *related = NULL;
 
 		if (ice_version == SIPE_ICE_RFC_5245) {
 
-			switch (c->protocol) {
-				case SIPE_NETWORK_PROTOCOL_TCP_ACTIVE:
-					protocol = "TCP-ACT";
-					break;
-				case SIPE_NETWORK_PROTOCOL_TCP_PASSIVE:
-					protocol = "TCP-PASS";
-					break;
-				case SIPE_NETWORK_PROTOCOL_UDP:
-					protocol = "UDP";
-					break;
-				default:
-					/* error unknown/unsupported type */
-					protocol = "UNKNOWN";
-					break;
+			if (candidate_redundant(c, candidates)) {
+				pruned++;
+				continue;
 			}
 
-			switch (c->type) {
-				case SIPE_CANDIDATE_TYPE_HOST:
-					type = "host";
-					break;
-				case SIPE_CANDIDATE_TYPE_RELAY:
-					type = "relay";
-					break;
-				case SIPE_CANDIDATE_TYPE_SRFLX:
-					type = "srflx";
-					break;
-				case SIPE_CANDIDATE_TYPE_PRFLX:
-					type = "prflx";
-					break;
-				default:
-					/* error unknown/unsupported type */
-					type = "unknown";
-					break;
-			}
+			g_string_append_printf(body,
+					       "a=candidate:%s %u %s %u %s %d typ %s ",
+					       c->foundation,
+					       c->component,
+					       candidate_protocol_rfc_5245(c->protocol),
+					       c->priority,
+					       c->ip,
+					       c->port,
+					       candidate_type_rfc_5245(c->type));
 
 			switch (c->type) {
 				case SIPE_CANDIDATE_TYPE_RELAY:
 				case SIPE_CANDIDATE_TYPE_SRFLX:
 				case SIPE_CANDIDATE_TYPE_PRFLX:
-					related = g_strdup_printf("raddr %s rport %d",
-								  c->base_ip,
-								  c->base_port);
+					g_string_append_printf(body,
+							       "raddr %s rport %d",
+							       c->base_ip,
+							       c->base_port);
 					break;
 				default:
 					break;
 			}
 
-			g_string_append_printf(result,
-					       "a=candidate:%s %u %s %u %s %d typ %s %s\r\n",
-					       c->foundation,
-					       c->component,
-					       protocol,
-					       c->priority,
-					       c->ip,
-					       c->port,
-					       type,
-					       related ? related : "");
-			g_free(related);
+			g_string_append(body, "\r\n");
 
 		} else if (ice_version == SIPE_ICE_DRAFT_6) {
-			gchar *username;
-			gchar *password;
 
 			switch (c->protocol) {
 				case SIPE_NETWORK_PROTOCOL_TCP_ACTIVE:
@@ -572,7 +811,7 @@ candidates_to_string(GSList *candidates, SipeIceVersion ice_version)
 					} else {
 						protocol = "TCP";
 						processed_tcp_candidates =
-							g_slist_append(processed_tcp_candidates, c);
+							g_slist_prepend(processed_tcp_candidates, c);
 					}
 					break;
 				}
@@ -589,169 +828,132 @@ candidates_to_string(GSList *candidates, SipeIceVersion ice_version)
 				continue;
 			}
 
-			username = base64_unpad(c->username);
-			password = base64_unpad(c->password);
-
-			g_string_append_printf(result,
-					       "a=candidate:%s %u %s %s 0.%u %s %d\r\n",
-					       username,
+			g_string_append_printf(body,
+					       "a=candidate:%.*s %u %.*s %s 0.%u %s %d\r\n",
+					       base64_unpadded_length(c->username),
+					       c->username,
 					       c->component,
-					       password,
+					       base64_unpadded_length(c->password),
+					       c->password,
 					       protocol,
 					       c->priority,
 					       c->ip,
 					       c->port);
-
-			g_free(username);
-			g_free(password);
 		}
 	}
 
-	g_slist_free(processed_tcp_candidates);
+	if (pruned)
+		SIPE_DEBUG_INFO("append_candidates: pruned %u redundant candidates",
+				pruned);
 
-	return g_string_free(result, FALSE);
+	g_slist_free(processed_tcp_candidates);
 }
 
-static gchar *
-remote_candidates_to_string(GSList *candidates, SipeIceVersion ice_version)
+static void
+append_remote_candidates(GString *body, GSList *candidates, SipeIceVersion ice_version)
 {
-	GString *result = g_string_new("");
-
 	if (candidates) {
 		if (ice_version == SIPE_ICE_RFC_5245) {
 			GSList *i;
-			g_string_append(result, "a=remote-candidates:");
+			g_string_append(body, "a=remote-candidates:");
 
 			for (i = candidates; i; i = i->next) {
 				struct sdpcandidate *c = i->data;
-				g_string_append_printf(result, "%u %s %u ",
+				g_string_append_printf(body, "%u %s %u ",
 						       c->component, c->ip, c->port);
 			}
 
-			g_string_append(result, "\r\n");
+			g_string_append(body, "\r\n");
 		} else if (ice_version == SIPE_ICE_DRAFT_6) {
 			struct sdpcandidate *c = candidates->data;
-			g_string_append_printf(result, "a=remote-candidate:%s\r\n",
+			g_string_append_printf(body, "a=remote-candidate:%s\r\n",
 					       c->username);
 		}
 	}
-
-	return g_string_free(result, FALSE);
 }
 
-static gchar *
-attributes_to_string(GSList *attributes)
+static void
+append_attributes(GString *body, GSList *attributes)
 {
-	GString *result = g_string_new("");
-
 	for (; attributes; attributes = attributes->next) {
 		struct sipnameval *a = attributes->data;
-		g_string_append_printf(result, "a=%s", a->name);
-		if (!sipe_strequal(a->value, ""))
-			g_string_append_printf(result, ":%s", a->value);
-		g_string_append(result, "\r\n");
+		g_string_append(body, "a=");
+		g_string_append(body, a->name);
+		if (!sipe_strequal(a->value, "")) {
+			g_string_append_c(body, ':');
+			g_string_append(body, a->value);
+		}
+		g_string_append(body, "\r\n");
 	}
-
-	return g_string_free(result, FALSE);
 }
 
-static gchar *
-media_to_string(const struct sdpmsg *msg, const struct sdpmedia *media)
+static void
+append_media(GString *body, const struct sdpmsg *msg, const struct sdpmedia *media)
 {
-	gchar *media_str;
-
-	gchar *transport_profile = NULL;
-
-	gchar *media_conninfo = NULL;
-
-	gchar *codecs_str = NULL;
-	gchar *codec_ids_str = codec_ids_to_string(media->codecs);
-
-	gchar *candidates_str = NULL;
-	gchar *remote_candidates_str = NULL;
+	gboolean uses_tcp_transport = FALSE;
 
-	gchar *attributes_str = NULL;
-	gchar *credentials = NULL;
+	if (media->port != 0 && media->remote_candidates) {
+		struct sdpcandidate *c = media->remote_candidates->data;
+		uses_tcp_transport =
+			c->protocol == SIPE_NETWORK_PROTOCOL_TCP_ACTIVE ||
+			c->protocol == SIPE_NETWORK_PROTOCOL_TCP_PASSIVE ||
+			c->protocol == SIPE_NETWORK_PROTOCOL_TCP_SO;
+	}
 
-	gchar *crypto = NULL;
+	g_string_append_printf(body, "m=%s %d %sRTP/%sAVP",
+			       media->name, media->port,
+			       uses_tcp_transport ? "TCP/" : "",
+			       media->encryption_active ? "S" : "");
+	append_codec_ids(body, media->codecs);
+	g_string_append(body, "\r\n");
 
-	gboolean uses_tcp_transport = FALSE;
+	if (media->port == 0)
+		return;
 
-	if (media->port != 0) {
-		if (!sipe_strequal(msg->ip, media->ip)) {
-			media_conninfo = g_strdup_printf("c=IN IP4 %s\r\n", media->ip);
-		}
+	if (!sipe_strequal(msg->ip, media->ip)) {
+		g_string_append_printf(body, "c=IN IP4 %s\r\n", media->ip);
+	}
 
-		codecs_str = codecs_to_string(media->codecs);
-		candidates_str = candidates_to_string(media->candidates, msg->ice_version);
-		remote_candidates_str = remote_candidates_to_string(media->remote_candidates,
-								    msg->ice_version);
-
-		if (media->remote_candidates) {
-			struct sdpcandidate *c = media->remote_candidates->data;
-			uses_tcp_transport =
-				c->protocol == SIPE_NETWORK_PROTOCOL_TCP_ACTIVE ||
-				c->protocol == SIPE_NETWORK_PROTOCOL_TCP_PASSIVE ||
-				c->protocol == SIPE_NETWORK_PROTOCOL_TCP_SO;
-		}
+	append_candidates(body, media->candidates, msg->ice_version);
+
+	if (media->encryption_key) {
+		gchar *key_encoded = g_base64_encode(media->encryption_key,
+						     SIPE_SRTP_SUITE_KEY_LEN(media->encryption_suite));
+		g_string_append_printf(body,
+				       "a=crypto:%d %s inline:%s|2^31\r\n",
+				       media->encryption_key_id,
+				       srtp_suite_names[media->encryption_suite],
+				       key_encoded);
+		g_free(key_encoded);
+	}
 
-		attributes_str = attributes_to_string(media->attributes);
+	if (media->fallback_key) {
+		gchar *key_encoded = g_base64_encode(media->fallback_key, SIPE_SRTP_KEY_LEN);
+		g_string_append_printf(body,
+				       "a=crypto:%d AES_CM_128_HMAC_SHA1_80 inline:%s|2^31\r\n",
+				       media->fallback_key_id, key_encoded);
+		g_free(key_encoded);
+	}
 
-		if (msg->ice_version == SIPE_ICE_RFC_5245 && media->candidates) {
-			struct sdpcandidate *c = media->candidates->data;
+	append_remote_candidates(body, media->remote_candidates, msg->ice_version);
+	append_codecs(body, media->codecs);
+	append_attributes(body, media->attributes);
 
-			credentials = g_strdup_printf("a=ice-ufrag:%s\r\n"
-						      "a=ice-pwd:%s\r\n",
-						      c->username,
-						      c->password);
-		}
+	if (msg->ice_version == SIPE_ICE_RFC_5245 && media->candidates) {
+		struct sdpcandidate *c = media->candidates->data;
 
-		if (media->encryption_key) {
-			gchar *key_encoded = g_base64_encode(media->encryption_key, SIPE_SRTP_KEY_LEN);
-			crypto = g_strdup_printf("a=crypto:%d AES_CM_128_HMAC_SHA1_80 inline:%s|2^31\r\n",
-					media->encryption_key_id, key_encoded);
-			g_free(key_encoded);
-		}
+		g_string_append_printf(body,
+				       "a=ice-ufrag:%s\r\n"
+				       "a=ice-pwd:%s\r\n",
+				       c->username,
+				       c->password);
 	}
-
-	transport_profile = g_strdup_printf("%sRTP/%sAVP",
-					    uses_tcp_transport ? "TCP/" : "",
-					    media->encryption_active ? "S" : "");
-
-	media_str = g_strdup_printf("m=%s %d %s%s\r\n"
-				    "%s"
-				    "%s"
-				    "%s"
-				    "%s"
-				    "%s"
-				    "%s"
-				    "%s",
-				    media->name, media->port, transport_profile, codec_ids_str,
-				    media_conninfo ? media_conninfo : "",
-				    candidates_str ? candidates_str : "",
-				    crypto ? crypto : "",
-				    remote_candidates_str ? remote_candidates_str : "",
-				    codecs_str ? codecs_str : "",
-				    attributes_str ? attributes_str : "",
-				    credentials ? credentials : "");
-
-	g_free(transport_profile);
-	g_free(media_conninfo);
-	g_free(codecs_str);
-	g_free(codec_ids_str);
-	g_free(candidates_str);
-	g_free(remote_candidates_str);
-	g_free(attributes_str);
-	g_free(credentials);
-	g_free(crypto);
-
-	return media_str;
 }
 
 gchar *
 sdpmsg_to_string(const struct sdpmsg *msg)
 {
-	GString *body = g_string_new(NULL);
+	GString *body = g_string_sized_new(SDP_INITIAL_SIZE);
 	GSList *i;
 
 	g_string_append_printf(
@@ -765,20 +967,34 @@ sdpmsg_to_string(const struct sdpmsg *msg)
 		msg->ip, msg->ip);
 
 
-	for (i = msg->media; i; i = i->next) {
-		gchar *media_str = media_to_string(msg, i->data);
-		g_string_append(body, media_str);
-		g_free(media_str);
-	}
+	for (i = msg->media; i; i = i->next)
+		append_media(body, msg, i->data);
 
 	return g_string_free(body, FALSE);
 }
 
+struct sdpcandidate *
+sdpcandidate_new(void)
+{
+	struct sdpcandidate *candidate = g_new0(struct sdpcandidate, 1);
+	candidate->refcount = 1;
+	return(candidate);
+}
+
+struct sdpcandidate *
+sdpcandidate_ref(struct sdpcandidate *candidate)
+{
+	if (candidate)
+		candidate->refcount++;
+	return(candidate);
+}
+
+/* a real copy, e.g. when the copy will be modified */
 static struct sdpcandidate *
 sdpcandidate_copy(struct sdpcandidate *candidate)
 {
 	if (candidate) {
-		struct sdpcandidate *copy = g_new0(struct sdpcandidate, 1);
+		struct sdpcandidate *copy = sdpcandidate_new();
 
 		copy->foundation = g_strdup(candidate->foundation);
 		copy->component  = candidate->component;
@@ -797,10 +1013,10 @@ sdpcandidate_copy(struct sdpcandidate *candidate)
 		return NULL;
 }
 
-static void
+void
 sdpcandidate_free(struct sdpcandidate *candidate)
 {
-	if (candidate) {
+	if (candidate && (--candidate->refcount == 0)) {
 		g_free(candidate->foundation);
 		g_free(candidate->ip);
 		g_free(candidate->base_ip);
@@ -810,10 +1026,26 @@ sdpcandidate_free(struct sdpcandidate *candidate)
 	}
 }
 
+struct sdpcodec *
+sdpcodec_new(void)
+{
+	struct sdpcodec *codec = g_new0(struct sdpcodec, 1);
+	codec->refcount = 1;
+	return(codec);
+}
+
+struct sdpcodec *
+sdpcodec_ref(struct sdpcodec *codec)
+{
+	if (codec)
+		codec->refcount++;
+	return(codec);
+}
+
 void
 sdpcodec_free(struct sdpcodec *codec)
 {
-	if (codec) {
+	if (codec && (--codec->refcount == 0)) {
 		g_free(codec->name);
 		sipe_utils_nameval_free(codec->parameters);
 		g_free(codec);
@@ -837,6 +1069,7 @@ sdpmedia_free(struct sdpmedia *media)
 				  (GDestroyNotify) sdpcandidate_free);
 
 		g_free(media->encryption_key);
+		g_free(media->fallback_key);
 
 		g_free(media);
 	}
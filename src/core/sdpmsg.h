@@ -39,10 +39,19 @@ struct sdpmedia {
 
 	guchar		*encryption_key;
 	int		 encryption_key_id;
+	SipeSrtpSuite	 encryption_suite;
+	/* AES_CM_128_HMAC_SHA1_80 alternative to an AEAD_AES_128_GCM key */
+	guchar		*fallback_key;
+	int		 fallback_key_id;
 	gboolean	 encryption_active;
 };
 
+/*
+ * Candidates and codecs are reference counted, i.e. several media can share
+ * the same object. Use sdpcandidate_new()/sdpcodec_new() to create them.
+ */
 struct sdpcandidate {
+	guint			 refcount;
 	gchar			*foundation;
 	SipeComponentType	 component;
 	SipeCandidateType	 type;
@@ -57,6 +66,7 @@ struct sdpcandidate {
 };
 
 struct sdpcodec {
+	guint		 refcount;
 	gint		 id;
 	gchar		*name;
 	gint		 clock_rate;
@@ -88,7 +98,38 @@ gchar *sdpmsg_to_string(const struct sdpmsg *msg);
 void sdpmsg_free(struct sdpmsg *msg);
 
 /**
- * Deallocates @c sdpcodec.
+ * Allocates a new @c sdpcandidate with one reference.
+ */
+struct sdpcandidate *sdpcandidate_new(void);
+
+/**
+ * Adds a reference to @c sdpcandidate.
+ *
+ * @return @c candidate
+ */
+struct sdpcandidate *sdpcandidate_ref(struct sdpcandidate *candidate);
+
+/**
+ * Releases a reference to @c sdpcandidate. Deallocates it when the last
+ * reference is gone.
+ */
+void sdpcandidate_free(struct sdpcandidate *candidate);
+
+/**
+ * Allocates a new @c sdpcodec with one reference.
+ */
+struct sdpcodec *sdpcodec_new(void);
+
+/**
+ * Adds a reference to @c sdpcodec.
+ *
+ * @return @c codec
+ */
+struct sdpcodec *sdpcodec_ref(struct sdpcodec *codec);
+
+/**
+ * Releases a reference to @c sdpcodec. Deallocates it when the last
+ * reference is gone.
  */
 void sdpcodec_free(struct sdpcodec *codec);
 
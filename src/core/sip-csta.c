@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2009 pier11 <pier11@operamail.com>
  *
  * Implements Remote Call Control (RCC) feature for
@@ -49,6 +49,17 @@
 #define DELIVERED_CSTA_STATUS           "delivered"
 #define ESTABLISHED_CSTA_STATUS         "established"
 
+/**
+ * Call on our line as reported by CSTA events
+ */
+struct sip_csta_call {
+	gchar *call_id;
+	/* our device ID as reported by SIP/CSTA gateway */
+	gchar *device_id;
+	/* one of the *_CSTA_STATUS strings */
+	const gchar *status;
+};
+
 /**
  * Data model for interaction with SIP/CSTA Gateway
  */
@@ -62,12 +73,12 @@ struct sip_csta {
 	gchar *gateway_status;
 	gchar *monitor_cross_ref_id;
 
-	gchar *line_status;
+	/** active calls. key: callID, value: struct sip_csta_call */
+	GHashTable *calls;
 	/** destination tel: URI */
 	gchar *to_tel_uri;
+	/** callID of our call from MakeCall response */
 	gchar *call_id;
-	/* our device ID as reported by SIP/CSTA gateway */
-	gchar *device_id;
 };
 
 /**
@@ -204,6 +215,14 @@ sip_tel_uri_denormalize(const gchar *tel_uri)
 	}
 }
 
+static void
+sip_csta_call_free(struct sip_csta_call *call)
+{
+	g_free(call->call_id);
+	g_free(call->device_id);
+	g_free(call);
+}
+
 static void
 sip_csta_initialize(struct sipe_core_private *sipe_private,
 		    const gchar *line_uri,
@@ -213,6 +232,10 @@ sip_csta_initialize(struct sipe_core_private *sipe_private,
 		sipe_private->csta = g_new0(struct sip_csta, 1);
 		sipe_private->csta->line_uri = g_strdup(line_uri);
 		sipe_private->csta->gateway_uri = g_strdup(server);
+		sipe_private->csta->calls = g_hash_table_new_full(g_str_hash,
+								  g_str_equal,
+								  NULL,
+								  (GDestroyNotify) sip_csta_call_free);
 	} else {
 		SIPE_DEBUG_INFO_NOFORMAT("sip_csta_initialize: sipe_private->csta is already instantiated, exiting.");
 	}
@@ -435,7 +458,7 @@ sipe_invite_csta_gateway(struct sipe_core_private *sipe_private,
 			 SIPE_UNUSED_PARAMETER gpointer unused)
 {
 	gchar *hdr;
-	gchar *contact;
+	const gchar *contact;
 	gchar *body;
 
 	if (!sipe_private->csta) {
@@ -459,7 +482,6 @@ sipe_invite_csta_gateway(struct sipe_core_private *sipe_private,
 		"Content-Disposition: signal;handling=required\r\n"
 		"Content-Type: application/csta+xml\r\n",
 		contact);
-	g_free(contact);
 
 	body = g_strdup_printf(
 		SIP_SEND_CSTA_REQUEST_SYSTEM_STATUS,
@@ -496,10 +518,9 @@ sip_csta_free(struct sip_csta *csta)
 
 	g_free(csta->gateway_status);
 	g_free(csta->monitor_cross_ref_id);
-	g_free(csta->line_status);
+	g_hash_table_destroy(csta->calls);
 	g_free(csta->to_tel_uri);
 	g_free(csta->call_id);
-	g_free(csta->device_id);
 
 	g_free(csta);
 }
@@ -601,99 +622,154 @@ static void sip_csta_make_call(struct sipe_core_private *sipe_private,
 
 static void
 sip_csta_update_id_and_status(struct sip_csta *csta,
-			      const sipe_xml *node,
-			      const char *status)
+			      const gchar *call_id,
+			      const gchar *device_id,
+			      const gchar *status)
 {
-	gchar *call_id = sipe_xml_data(sipe_xml_child(node, "callID"));
-
-	if (!sipe_strequal(call_id, csta->call_id)) {
-		SIPE_DEBUG_INFO("sipe_csta_update_id_and_status: callID (%s) does not match", call_id);
-	}
-	else
-	{
-		/* free old line status */
-		g_free(csta->line_status);
-		csta->line_status = NULL;
-
-		if (status)
-		{
-			/* save deviceID */
-			gchar *device_id = sipe_xml_data(sipe_xml_child(node, "deviceID"));
-			SIPE_DEBUG_INFO("sipe_csta_update_id_and_status: device_id=(%s)", device_id ? device_id : "");
-			if (device_id) {
-				g_free(csta->device_id);
-				csta->device_id = device_id;
-			}
+	if (!call_id) {
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_csta_update_id_and_status: no callID");
+		return;
+	}
+
+	if (status) {
+		struct sip_csta_call *call = g_hash_table_lookup(csta->calls,
+								 call_id);
+
+		if (!call) {
+			call = g_new0(struct sip_csta_call, 1);
+			call->call_id = g_strdup(call_id);
+			g_hash_table_insert(csta->calls, call->call_id, call);
+		}
 
-			/* set new line status */
-			csta->line_status = g_strdup(status);
+		/* save deviceID */
+		SIPE_DEBUG_INFO("sipe_csta_update_id_and_status: call_id=(%s) device_id=(%s) status=%s",
+				call_id, device_id ? device_id : "", status);
+		if (device_id) {
+			g_free(call->device_id);
+			call->device_id = g_strdup(device_id);
 		}
-		else
-		{
-			/* clean up cleared connection */
+
+		/* set new line status */
+		call->status = status;
+	} else {
+		/* clean up cleared connection */
+		g_hash_table_remove(csta->calls, call_id);
+
+		if (sipe_strequal(call_id, csta->call_id)) {
 			g_free(csta->to_tel_uri);
 			csta->to_tel_uri = NULL;
 			g_free(csta->call_id);
 			csta->call_id = NULL;
-			g_free(csta->device_id);
-			csta->device_id = NULL;
 		}
 	}
+}
 
-	g_free(call_id);
+/*
+ * CSTA event decoder
+ *
+ * Events only need a few fields. They are collected with the streaming
+ * parser and applied after the whole event has been parsed.
+ */
+struct csta_event {
+	gchar *monitor_cross_ref_id;
+	gchar *call_id;
+	gchar *device_id;
+	const gchar *status;
+	gboolean has_connection;
+};
+
+static void csta_event_cross_ref_id(const sipe_xml *node,
+				    gpointer user_data)
+{
+	struct csta_event *event = user_data;
+
+	g_free(event->monitor_cross_ref_id);
+	event->monitor_cross_ref_id = sipe_xml_data(node);
 }
 
-void
-process_incoming_info_csta(struct sipe_core_private *sipe_private,
-			   struct sipmsg *msg)
+static void csta_event_connection(const sipe_xml *node,
+				  struct csta_event *event,
+				  const gchar *status)
 {
-	gchar *monitor_cross_ref_id;
-	sipe_xml *xml = sipe_xml_parse(msg->body, msg->bodylen);
+	g_free(event->call_id);
+	g_free(event->device_id);
+	event->call_id        = sipe_xml_data(sipe_xml_child(node, "callID"));
+	event->device_id      = sipe_xml_data(sipe_xml_child(node, "deviceID"));
+	event->status         = status;
+	event->has_connection = TRUE;
+}
 
-	if (!xml) return;
+static void csta_event_originated(const sipe_xml *node,
+				  gpointer user_data)
+{
+	csta_event_connection(node, user_data, ORIGINATED_CSTA_STATUS);
+}
 
-	monitor_cross_ref_id = sipe_xml_data(sipe_xml_child(xml, "monitorCrossRefID"));
+static void csta_event_delivered(const sipe_xml *node,
+				 gpointer user_data)
+{
+	csta_event_connection(node, user_data, DELIVERED_CSTA_STATUS);
+}
+
+static void csta_event_established(const sipe_xml *node,
+				   gpointer user_data)
+{
+	csta_event_connection(node, user_data, ESTABLISHED_CSTA_STATUS);
+}
 
-	if(!sipe_private->csta || !sipe_strequal(monitor_cross_ref_id, sipe_private->csta->monitor_cross_ref_id))
-	{
+static void csta_event_cleared(const sipe_xml *node,
+			       gpointer user_data)
+{
+	csta_event_connection(node, user_data, NULL);
+}
+
+static const struct sipe_xml_stream_handler csta_event_handlers[] = {
+	{ "OriginatedEvent/monitorCrossRefID",        NULL, csta_event_cross_ref_id, NULL },
+	{ "OriginatedEvent/originatedConnection",     NULL, csta_event_originated,   NULL },
+	{ "DeliveredEvent/monitorCrossRefID",         NULL, csta_event_cross_ref_id, NULL },
+	{ "DeliveredEvent/connection",                NULL, csta_event_delivered,    NULL },
+	{ "EstablishedEvent/monitorCrossRefID",       NULL, csta_event_cross_ref_id, NULL },
+	{ "EstablishedEvent/establishedConnection",   NULL, csta_event_established,  NULL },
+	{ "ConnectionClearedEvent/monitorCrossRefID", NULL, csta_event_cross_ref_id, NULL },
+	{ "ConnectionClearedEvent/droppedConnection", NULL, csta_event_cleared,      NULL },
+	{ NULL,                                       NULL, NULL,                    NULL }
+};
+
+void
+process_incoming_info_csta(struct sipe_core_private *sipe_private,
+			   struct sipmsg *msg)
+{
+	struct csta_event event;
+
+	memset(&event, 0, sizeof(event));
+	if (!sipe_xml_stream_parse(msg->body, msg->bodylen,
+				   csta_event_handlers, &event)) {
+		SIPE_DEBUG_INFO_NOFORMAT("process_incoming_info_csta: invalid CSTA event, ignoring");
+	} else if (!sipe_private->csta ||
+		   !sipe_strequal(event.monitor_cross_ref_id,
+				  sipe_private->csta->monitor_cross_ref_id)) {
 		SIPE_DEBUG_INFO("process_incoming_info_csta: monitorCrossRefID (%s) does not match, exiting",
-				monitor_cross_ref_id ? monitor_cross_ref_id : "");
-	}
-	else
-	{
-		if (sipe_strequal(sipe_xml_name(xml), "OriginatedEvent"))
-		{
-			sip_csta_update_id_and_status(sipe_private->csta,
-						      sipe_xml_child(xml, "originatedConnection"),
-						      ORIGINATED_CSTA_STATUS);
-		}
-		else if (sipe_strequal(sipe_xml_name(xml), "DeliveredEvent"))
-		{
-			sip_csta_update_id_and_status(sipe_private->csta,
-						      sipe_xml_child(xml, "connection"),
-						      DELIVERED_CSTA_STATUS);
-		}
-		else if (sipe_strequal(sipe_xml_name(xml), "EstablishedEvent"))
-		{
-			sip_csta_update_id_and_status(sipe_private->csta,
-						      sipe_xml_child(xml, "establishedConnection"),
-						      ESTABLISHED_CSTA_STATUS);
-		}
-		else if (sipe_strequal(sipe_xml_name(xml), "ConnectionClearedEvent"))
-		{
-			sip_csta_update_id_and_status(sipe_private->csta,
-						      sipe_xml_child(xml, "droppedConnection"),
-						      NULL);
-		}
+				event.monitor_cross_ref_id ? event.monitor_cross_ref_id : "");
+	} else if (event.has_connection) {
+		sip_csta_update_id_and_status(sipe_private->csta,
+					      event.call_id,
+					      event.device_id,
+					      event.status);
 	}
 
-	g_free(monitor_cross_ref_id);
-	sipe_xml_free(xml);
+	g_free(event.device_id);
+	g_free(event.call_id);
+	g_free(event.monitor_cross_ref_id);
 }
 
 gboolean sip_csta_is_idle(struct sipe_core_private *sipe_private)
 {
-	return(sipe_private->csta && !sipe_private->csta->line_status);
+	struct sip_csta *csta = sipe_private->csta;
+
+	/* no active call made by us */
+	return(csta &&
+	       !(csta->call_id &&
+		 g_hash_table_lookup(csta->calls, csta->call_id)));
 }
 
 void sipe_core_buddy_make_call(struct sipe_core_public *sipe_public,
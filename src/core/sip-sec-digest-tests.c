@@ -227,6 +227,37 @@ int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char *argv[])
 		"/digest_auth/test.html",
 		"Digest username=\"bob\", realm=\"members only\", qop=\"auth\", algorithm=\"MD5\", uri=\"/digest_auth/test.html\", nonce=\"5UImQA==3d76b2ab859e1770ec60ed285ec68a3e63028461\", nc=00000001, cnonce=\"1672b410efa182c061c2f0a58acaa17d\", response=\"3d9ebe6b9534a7135a3fde59a5a72668\"");
 
+	/*
+	 * Cached challenge: second request uses next nonce count
+	 */
+	{
+		struct sipe_core_private sipe_private;
+		struct sip_sec_digest_state *state;
+		gchar *response;
+
+		printf("\n");
+		sipe_private.authuser = "Mufasa";
+		sipe_private.password = "Circle Of Life";
+		cnonce_fixed          = "0a4f113b";
+		state = sip_sec_digest_state_new(&sipe_private,
+						 "realm=\"testrealm@host.com\", qop=\"auth\", nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\", opaque=\"5ccc069c403ebaf9f0171e9517f40e41\"");
+		response = sip_sec_digest_state_authorization(state, "GET", "/dir/index.html");
+		failed  += expected("Digest username=\"Mufasa\", realm=\"testrealm@host.com\", nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\", uri=\"/dir/index.html\", qop=auth, nc=00000001, cnonce=\"0a4f113b\", response=\"6629fae49393a05397450978507c4ef1\", opaque=\"5ccc069c403ebaf9f0171e9517f40e41\"",
+				    response);
+		g_free(response);
+		response = sip_sec_digest_state_authorization(state, "GET", "/dir/other.html");
+		failed  += expected("Digest username=\"Mufasa\", realm=\"testrealm@host.com\", nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\", uri=\"/dir/other.html\", qop=auth, nc=00000002, cnonce=\"0a4f113b\", response=\"8fd933ee1915789a949cf71f0cee4581\", opaque=\"5ccc069c403ebaf9f0171e9517f40e41\"",
+				    response);
+		g_free(response);
+		sip_sec_digest_state_free(state);
+
+		if (sip_sec_digest_stale("realm=\"testrealm@host.com\", nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\"") ||
+		    !sip_sec_digest_stale("realm=\"testrealm@host.com\", nonce=\"dcd98b7102dd2f0e8b11d0f600bfb0c093\", stale=TRUE")) {
+			SIPE_DEBUG_ERROR_NOFORMAT("FAILED: stale nonce detection");
+			failed++;
+		}
+	}
+
 	return(failed);
 }
 
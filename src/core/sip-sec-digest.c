@@ -31,6 +31,7 @@
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-digest.h"
+#include "sipe-str.h"
 #include "sipe-utils.h"
 
 /*
@@ -48,9 +49,8 @@ static gchar *digest_HA1(const gchar *user,
 	g_free(string);
 
 	/* Result: LOWER(HEXSTRING(H(A1))) */
-	string = buff_to_hex_str(digest, sizeof(digest));
-	HA1 = g_ascii_strdown(string, -1);
-	g_free(string);
+	HA1 = g_malloc(2 * sizeof(digest) + 1);
+	sipe_str_hex_encode(digest, sizeof(digest), HA1, TRUE);
 	return(HA1);
 }
 
@@ -65,9 +65,8 @@ static gchar *digest_HA2(const gchar *method,
 	g_free(string);
 
 	/* Result: LOWER(HEXSTRING(H(A1))) */
-	string = buff_to_hex_str(digest, sizeof(digest));
-	HA2 = g_ascii_strdown(string, -1);
-	g_free(string);
+	HA2 = g_malloc(2 * sizeof(digest) + 1);
+	sipe_str_hex_encode(digest, sizeof(digest), HA2, TRUE);
 	return(HA2);
 }
 
@@ -80,9 +79,18 @@ static gchar *generate_cnonce(void)
 #endif
 }
 
-static gchar *digest_response(const gchar *user,
-			      const gchar *realm,
-			      const gchar *password,
+/* cached challenge, see sip_sec_digest_state_new() */
+struct sip_sec_digest_state {
+	gchar *authuser;
+	gchar *realm;
+	gchar *nonce;
+	gchar *opaque;
+	gchar *cnonce;
+	gchar *HA1;
+	guint32 nc;
+};
+
+static gchar *digest_response(const gchar *HA1,
 			      const gchar *nonce,
 			      const gchar *nc,
 			      const gchar *cnonce,
@@ -90,7 +98,6 @@ static gchar *digest_response(const gchar *user,
 			      const gchar *method,
 			      const gchar *target)
 {
-	gchar *HA1 = digest_HA1(user, realm, password);
 	gchar *HA2 = digest_HA2(method, target);
 	gchar *string, *Digest;
 	guchar digest[SIPE_DIGEST_MD5_LENGTH];
@@ -103,31 +110,28 @@ static gchar *digest_response(const gchar *user,
 	/* Digest: H(H(A1) ":" nonce ":" nc ":" cnonce ":" qop ":" H(A2) */
 	string = g_strdup_printf("%s:%s:%s:%s:%s:%s", HA1, nonce, nc, cnonce, qop, HA2);
 	g_free(HA2);
-	g_free(HA1);
 	sipe_digest_md5((guchar *)string, strlen(string), digest);
 	g_free(string);
 
 	/* Result: LOWER(HEXSTRING(H(A1))) */
-	string = buff_to_hex_str(digest, sizeof(digest));
-	Digest = g_ascii_strdown(string, -1);
-	g_free(string);
+	Digest = g_malloc(2 * sizeof(digest) + 1);
+	sipe_str_hex_encode(digest, sizeof(digest), Digest, TRUE);
 	return(Digest);
 }
 
-gchar *sip_sec_digest_authorization(struct sipe_core_private *sipe_private,
-				    const gchar *header,
-				    const gchar *method,
-				    const gchar *target)
+/*
+ * Calls callback for each parameter in challenge header. Returns FALSE
+ * if the header is corrupted.
+ */
+typedef void digest_parameter_cb(const gchar *name,
+				 const gchar *value,
+				 gsize length,
+				 gpointer data);
+static gboolean digest_parse(const gchar *header,
+			     digest_parameter_cb *callback,
+			     gpointer data)
 {
 	const gchar *param;
-	gchar *nonce  = NULL;
-	gchar *opaque = NULL;
-	gchar *realm  = NULL;
-	gchar *authorization = NULL;
-
-	/* sanity checks */
-	if (!sipe_private->password)
-		return(NULL);
 
 	/* skip white space */
 	while (*header == ' ')
@@ -143,8 +147,8 @@ gchar *sip_sec_digest_authorization(struct sipe_core_private *sipe_private,
 			/* string: xyz="..."(,) */
 			end = strchr(++param, '"');
 			if (!end) {
-				SIPE_DEBUG_ERROR("sip_sec_digest_authorization: corrupted string parameter near '%s'", header);
-				break;
+				SIPE_DEBUG_ERROR("digest_parse: corrupted string parameter near '%s'", header);
+				return(FALSE);
 			}
 		} else {
 			/* number: xyz=12345(,) */
@@ -155,17 +159,7 @@ gchar *sip_sec_digest_authorization(struct sipe_core_private *sipe_private,
 			}
 		}
 
-		/* parameter type */
-		if        (g_str_has_prefix(header, "nonce=\"")) {
-			g_free(nonce);
-			nonce = g_strndup(param, end - param);
-		} else if (g_str_has_prefix(header, "opaque=\"")) {
-			g_free(opaque);
-			opaque = g_strndup(param, end - param);
-		} else if (g_str_has_prefix(header, "realm=\"")) {
-			g_free(realm);
-			realm = g_strndup(param, end - param);
-		}
+		(*callback)(header, param, end - param, data);
 
 		/* skip to next parameter */
 		while ((*end == '"') || (*end == ',') || (*end == ' '))
@@ -173,44 +167,146 @@ gchar *sip_sec_digest_authorization(struct sipe_core_private *sipe_private,
 		header = end;
 	}
 
-	if (nonce && realm) {
+	return(TRUE);
+}
+
+static void digest_state_parameter(const gchar *name,
+				   const gchar *value,
+				   gsize length,
+				   gpointer data)
+{
+	struct sip_sec_digest_state *state = data;
+	gchar **field = NULL;
+
+	/* parameter type */
+	if        (g_str_has_prefix(name, "nonce=\"")) {
+		field = &state->nonce;
+	} else if (g_str_has_prefix(name, "opaque=\"")) {
+		field = &state->opaque;
+	} else if (g_str_has_prefix(name, "realm=\"")) {
+		field = &state->realm;
+	}
+
+	if (field) {
+		g_free(*field);
+		*field = g_strndup(value, length);
+	}
+}
+
+static void digest_stale_parameter(const gchar *name,
+				   const gchar *value,
+				   gsize length,
+				   gpointer data)
+{
+	if (g_str_has_prefix(name, "stale=") &&
+	    (length == 4) &&
+	    !g_ascii_strncasecmp(value, "true", 4))
+		*((gboolean *) data) = TRUE;
+}
+
+struct sip_sec_digest_state *sip_sec_digest_state_new(struct sipe_core_private *sipe_private,
+						      const gchar *header)
+{
+	struct sip_sec_digest_state *state;
+
+	/* sanity checks */
+	if (!sipe_private->password)
+		return(NULL);
+
+	state = g_new0(struct sip_sec_digest_state, 1);
+	if (digest_parse(header, digest_state_parameter, state) &&
+	    state->nonce && state->realm) {
 		const gchar *authuser = sipe_private->authuser ? sipe_private->authuser : sipe_private->username;
-		const gchar *nc       = "00000001";
-		gchar *cnonce         = generate_cnonce();
-		gchar *opt_opaque     = opaque ? g_strdup_printf("opaque=\"%s\", ", opaque) : g_strdup("");
-		gchar *response = digest_response(authuser,
-						  realm,
-						  sipe_private->password,
-						  nonce,
-						  nc,
-						  cnonce,
-						  "auth",
-						  method,
-						  target);
+
+		/* H(A1) and cnonce don't change until the next challenge */
+		state->authuser = g_strdup(authuser);
+		state->cnonce   = generate_cnonce();
+		state->HA1      = digest_HA1(authuser,
+					     state->realm,
+					     sipe_private->password);
+	} else {
+		SIPE_DEBUG_ERROR_NOFORMAT("sip_sec_digest_state_new: no digest parameters found. Giving up.");
+		sip_sec_digest_state_free(state);
+		state = NULL;
+	}
+
+	return(state);
+}
+
+gchar *sip_sec_digest_state_authorization(struct sip_sec_digest_state *state,
+					  const gchar *method,
+					  const gchar *target)
+{
+	gchar nc[8 + 1];
+	gchar *opt_opaque;
+	gchar *response;
+	gchar *authorization;
+
+	/* each request with the same nonce must use a new nonce count */
+	g_snprintf(nc, sizeof(nc), "%08x", ++state->nc);
+	response = digest_response(state->HA1,
+				   state->nonce,
+				   nc,
+				   state->cnonce,
+				   "auth",
+				   method,
+				   target);
 
 #ifdef SIP_SEC_DIGEST_COMPILING_TEST
-		SIPE_DEBUG_INFO("RES %s", response);
+	SIPE_DEBUG_INFO("RES %s", response);
 #endif
 
-		authorization = g_strdup_printf("Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", qop=auth, nc=%s, cnonce=\"%s\", %sresponse=\"%s\"",
-						authuser,
-						realm,
-						nonce,
-						target,
-						nc,
-						cnonce,
-						opt_opaque,
-						response);
-		g_free(response);
-		g_free(opt_opaque);
-		g_free(cnonce);
-
-	} else
-		SIPE_DEBUG_ERROR_NOFORMAT("sip_sec_digest_authorization: no digest parameters found. Giving up.");
-
-	g_free(realm);
-	g_free(opaque);
-	g_free(nonce);
+	opt_opaque    = state->opaque ? g_strdup_printf("opaque=\"%s\", ", state->opaque) : g_strdup("");
+	authorization = g_strdup_printf("Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", qop=auth, nc=%s, cnonce=\"%s\", %sresponse=\"%s\"",
+					state->authuser,
+					state->realm,
+					state->nonce,
+					target,
+					nc,
+					state->cnonce,
+					opt_opaque,
+					response);
+	g_free(response);
+	g_free(opt_opaque);
+
+	return(authorization);
+}
+
+void sip_sec_digest_state_free(struct sip_sec_digest_state *state)
+{
+	if (state) {
+		g_free(state->HA1);
+		g_free(state->cnonce);
+		g_free(state->opaque);
+		g_free(state->nonce);
+		g_free(state->realm);
+		g_free(state->authuser);
+		g_free(state);
+	}
+}
+
+gboolean sip_sec_digest_stale(const gchar *header)
+{
+	gboolean stale = FALSE;
+	digest_parse(header, digest_stale_parameter, &stale);
+	return(stale);
+}
+
+gchar *sip_sec_digest_authorization(struct sipe_core_private *sipe_private,
+				    const gchar *header,
+				    const gchar *method,
+				    const gchar *target)
+{
+	struct sip_sec_digest_state *state = sip_sec_digest_state_new(sipe_private,
+								      header);
+	gchar *authorization = NULL;
+
+	if (state) {
+		authorization = sip_sec_digest_state_authorization(state,
+								   method,
+								   target);
+		sip_sec_digest_state_free(state);
+	}
 
 	return(authorization);
 }
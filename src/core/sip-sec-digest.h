@@ -23,6 +23,7 @@
 
 /* Forward declarations */
 struct sipe_core_private;
+struct sip_sec_digest_state;
 
 /**
  * Generate Digest authorization header
@@ -36,3 +37,48 @@ gchar *sip_sec_digest_authorization(struct sipe_core_private *sipe_private,
 				    const gchar *header,
 				    const gchar *method,
 				    const gchar *target);
+
+/**
+ * Parse Digest challenge and precalculate H(A1) for it
+ *
+ * The state can be used to authorize requests until the server sends a
+ * new challenge, e.g. because the nonce has become stale.
+ *
+ * @param sipe_private SIPE core private data
+ * @param header       Digest authentication header contents
+ *
+ * @return challenge state or @c NULL
+ */
+struct sip_sec_digest_state *sip_sec_digest_state_new(struct sipe_core_private *sipe_private,
+						      const gchar *header);
+
+/**
+ * Generate Digest authorization header from challenge state
+ *
+ * Each call uses the next nonce count.
+ *
+ * @param state  challenge state
+ * @param method request method
+ * @param target request URI
+ *
+ * @return Digest authorization header. Must be @c g_free'd().
+ */
+gchar *sip_sec_digest_state_authorization(struct sip_sec_digest_state *state,
+					  const gchar *method,
+					  const gchar *target);
+
+/**
+ * Free challenge state
+ *
+ * @param state challenge state (may be @c NULL)
+ */
+void sip_sec_digest_state_free(struct sip_sec_digest_state *state);
+
+/**
+ * Check Digest challenge for stale nonce
+ *
+ * @param header Digest authentication header contents
+ *
+ * @return @c TRUE if client credentials were valid but nonce was stale
+ */
+gboolean sip_sec_digest_stale(const gchar *header);
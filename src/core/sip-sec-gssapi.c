@@ -56,10 +56,30 @@
 #include "sipe-core.h"
 #include "sipe-utils.h"
 
+/*
+ * Process-wide credential cache
+ *
+ * Acquiring credentials with password requests a new TGT from the KDC.
+ * All security contexts for the same principal and mechanism share one
+ * credential handle instead. This also shares the service tickets that
+ * GSSAPI stores with the credential, i.e. a new context for an already
+ * visited SPN doesn't need a KDC round trip either.
+ */
+struct gssapi_credential {
+	gss_cred_id_t cred;
+	gchar *password; /* NULL for SSO */
+	guint refs;      /* cache + security contexts */
+};
+static GHashTable *credential_cache = NULL; /* key: "<type> <username>" */
+
+/* don't hand out credentials that would expire during a handshake */
+#define CREDENTIAL_MIN_LIFETIME 60 /* seconds */
+
 /* Security context for Kerberos */
 typedef struct _context_gssapi {
 	struct sip_sec_context common;
 	gss_cred_id_t cred_gssapi;
+	struct gssapi_credential *credential; /* owner of cred_gssapi */
 	gss_ctx_id_t ctx_gssapi;
 	gss_name_t target_name;
 } *context_gssapi;
@@ -271,6 +291,125 @@ static void drop_gssapi_context(SipSecContext context)
 	context->flags &= ~SIP_SEC_FLAG_COMMON_READY;
 }
 
+static void credential_unref(gpointer data)
+{
+	struct gssapi_credential *credential = data;
+
+	if (--credential->refs == 0) {
+		OM_uint32 ret;
+		OM_uint32 minor;
+
+		ret = gss_release_cred(&minor, &(credential->cred));
+		if (GSS_ERROR(ret)) {
+			sip_sec_gssapi_print_gss_error("gss_release_cred", ret, minor);
+			SIPE_DEBUG_ERROR("credential_unref: failed to release credentials (ret=%u)", ret);
+		}
+		g_free(credential->password);
+		g_free(credential);
+	}
+}
+
+static gchar *credential_key(SipSecContext context,
+			     const gchar *username)
+{
+	return(g_strdup_printf("%u %s",
+			       context->type,
+			       ((context->flags & SIP_SEC_FLAG_COMMON_SSO) || !username) ? "" : username));
+}
+
+static gboolean credential_reuse(SipSecContext context,
+				 const gchar *username,
+				 const gchar *password)
+{
+	context_gssapi ctx = (context_gssapi) context;
+	struct gssapi_credential *credential;
+	gchar *key;
+
+	if (!credential_cache)
+		return(FALSE);
+
+	key        = credential_key(context, username);
+	credential = g_hash_table_lookup(credential_cache, key);
+
+	if (credential) {
+		OM_uint32 ret;
+		OM_uint32 minor;
+		OM_uint32 lifetime = 0;
+
+		if (context->flags & SIP_SEC_FLAG_COMMON_SSO)
+			password = NULL;
+
+		ret = gss_inquire_cred(&minor,
+				       credential->cred,
+				       NULL,
+				       &lifetime,
+				       NULL,
+				       NULL);
+		if (!GSS_ERROR(ret) &&
+		    (lifetime > CREDENTIAL_MIN_LIFETIME) &&
+		    sipe_strequal(credential->password, password)) {
+			SIPE_DEBUG_INFO("credential_reuse: '%s' (%u seconds left)",
+					key, lifetime);
+			credential->refs++;
+			ctx->credential  = credential;
+			ctx->cred_gssapi = credential->cred;
+		} else {
+			SIPE_DEBUG_INFO("credential_reuse: dropping '%s'", key);
+			g_hash_table_remove(credential_cache, key);
+			credential = NULL;
+		}
+	}
+	g_free(key);
+
+	return(credential != NULL);
+}
+
+static void credential_store(SipSecContext context,
+			     const gchar *username,
+			     const gchar *password)
+{
+	context_gssapi ctx = (context_gssapi) context;
+	struct gssapi_credential *credential;
+
+	/* Kerberos-only SSO uses the default credentials */
+	if (ctx->cred_gssapi == GSS_C_NO_CREDENTIAL)
+		return;
+
+	if (!credential_cache)
+		credential_cache = g_hash_table_new_full(g_str_hash,
+							 g_str_equal,
+							 g_free,
+							 credential_unref);
+
+	credential           = g_new0(struct gssapi_credential, 1);
+	credential->cred     = ctx->cred_gssapi;
+	credential->refs     = 2;
+	if ((context->flags & SIP_SEC_FLAG_COMMON_SSO) == 0)
+		credential->password = g_strdup(password);
+	ctx->credential      = credential;
+
+	g_hash_table_replace(credential_cache,
+			     credential_key(context, username),
+			     credential);
+}
+
+/* credentials were rejected: next context must acquire new ones */
+static void credential_forget(context_gssapi ctx)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!(credential_cache && ctx->credential))
+		return;
+
+	g_hash_table_iter_init(&iter, credential_cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		if (value == ctx->credential) {
+			g_hash_table_iter_remove(&iter);
+			break;
+		}
+}
+
 /* sip-sec-mech.h API implementation for Kerberos/GSSAPI */
 
 static gboolean
@@ -287,6 +426,9 @@ sip_sec_acquire_cred__gssapi(SipSecContext context,
 	    (context->type == SIPE_AUTHENTICATION_TYPE_NTLM))
 		context->flags |= SIP_SEC_FLAG_GSSAPI_SIP_NTLM;
 
+	if (credential_reuse(context, username, password))
+		return(TRUE);
+
 	/* With SSO we use the default credentials */
 	if ((context->flags & SIP_SEC_FLAG_COMMON_SSO) == 0) {
 #ifdef HAVE_GSSAPI_PASSWORD_SUPPORT
@@ -456,6 +598,8 @@ sip_sec_acquire_cred__gssapi(SipSecContext context,
 	}
 #endif
 
+	credential_store(context, username, password);
+
 	return(TRUE);
 }
 
@@ -589,6 +733,10 @@ sip_sec_init_sec_context__gssapi(SipSecContext context,
 		sip_sec_gssapi_print_gss_error("gss_init_sec_context", ret, minor);
 		SIPE_DEBUG_ERROR("sip_sec_init_sec_context__gssapi: failed to initialize context (ret=%u)", ret);
 
+		if ((GSS_ROUTINE_ERROR(ret) == GSS_S_CREDENTIALS_EXPIRED) ||
+		    (GSS_ROUTINE_ERROR(ret) == GSS_S_NO_CRED))
+			credential_forget(ctx);
+
 #ifdef HAVE_GSSAPI_ONLY
 		/* Enable workaround for SPNEGO (see above) */
 		if (ret == GSS_S_DEFECTIVE_TOKEN) {
@@ -704,7 +852,11 @@ sip_sec_destroy_sec_context__gssapi(SipSecContext context)
 	if (ctx->ctx_gssapi != GSS_C_NO_CONTEXT)
 		drop_gssapi_context(context);
 
-	if (ctx->cred_gssapi != GSS_C_NO_CREDENTIAL) {
+	if (ctx->credential) {
+		credential_unref(ctx->credential);
+		ctx->credential  = NULL;
+		ctx->cred_gssapi = GSS_C_NO_CREDENTIAL;
+	} else if (ctx->cred_gssapi != GSS_C_NO_CREDENTIAL) {
 		ret = gss_release_cred(&minor, &(ctx->cred_gssapi));
 		if (GSS_ERROR(ret)) {
 			sip_sec_gssapi_print_gss_error("gss_release_cred", ret, minor);
@@ -788,6 +940,14 @@ gboolean sip_sec_password__gssapi(void)
 	return(FALSE);
 }
 
+void sip_sec_destroy__gssapi(void)
+{
+	if (credential_cache) {
+		g_hash_table_destroy(credential_cache);
+		credential_cache = NULL;
+	}
+}
+
 /*
   Local Variables:
   mode: c
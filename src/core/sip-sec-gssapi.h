@@ -26,3 +26,5 @@ SipSecContext
 sip_sec_create_context__gssapi(guint type);
 
 gboolean sip_sec_password__gssapi(void);
+
+void sip_sec_destroy__gssapi(void);
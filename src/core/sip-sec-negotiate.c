@@ -46,6 +46,7 @@ typedef struct _context_negotiate {
 } *context_negotiate;
 
 #define SIP_SEC_FLAG_NEGOTIATE_DISABLE_FALLBACK 0x80000000
+#define SIP_SEC_FLAG_NEGOTIATE_STARTED          0x40000000
 
 static void sip_sec_negotiate_drop_krb5(context_negotiate context)
 {
@@ -93,25 +94,43 @@ sip_sec_acquire_cred__negotiate(SipSecContext context,
 				const gchar *password)
 {
 	context_negotiate ctx = (context_negotiate) context;
-	gboolean ret;
 
 	SIPE_DEBUG_INFO_NOFORMAT("sip_sec_acquire_cred__negotiate: entering");
 
+	/*
+	 * The mechanism depends on the target, i.e. credentials are
+	 * acquired in the first sip_sec_init_sec_context__negotiate()
+	 */
 	ctx->username = username;
 	ctx->password = password;
 
-	context = ctx->krb5;
-	sip_sec_negotiate_copy_flags(ctx, context);
-	ret = context->acquire_cred_func(context,
-					 username,
-					 password);
-	if (!ret) {
-		/* Kerberos failed -> fall back to NTLM immediately */
-		SIPE_DEBUG_INFO_NOFORMAT("sip_sec_acquire_cred__negotiate: fallback to NTLM");
-		ret = sip_sec_negotiate_ntlm_fallback(ctx);
+	return(TRUE);
+}
+
+static gboolean sip_sec_negotiate_start(context_negotiate ctx,
+					const gchar *service_name)
+{
+	SipSecContext context = ctx->krb5;
+
+	ctx->common.flags |= SIP_SEC_FLAG_NEGOTIATE_STARTED;
+
+	/* Kerberos failed for this target before -> skip it */
+	if (sip_sec_mechanism_lookup(service_name) == SIPE_AUTHENTICATION_TYPE_NTLM) {
+		SIPE_DEBUG_INFO("sip_sec_negotiate_start: NTLM is known to work for '%s'",
+				service_name);
+		return(sip_sec_negotiate_ntlm_fallback(ctx));
 	}
 
-	return(ret);
+	sip_sec_negotiate_copy_flags(ctx, context);
+	if (context->acquire_cred_func(context,
+				       ctx->username,
+				       ctx->password))
+		return(TRUE);
+
+	/* Kerberos failed -> fall back to NTLM immediately */
+	SIPE_DEBUG_INFO_NOFORMAT("sip_sec_negotiate_start: fallback to NTLM");
+	sip_sec_mechanism_remember(service_name, SIPE_AUTHENTICATION_TYPE_NTLM);
+	return(sip_sec_negotiate_ntlm_fallback(ctx));
 }
 
 static gboolean
@@ -125,6 +144,10 @@ sip_sec_init_sec_context__negotiate(SipSecContext context,
 
 	SIPE_DEBUG_INFO_NOFORMAT("sip_sec_init_sec_context__negotiate: entering");
 
+	if (!(ctx->common.flags & SIP_SEC_FLAG_NEGOTIATE_STARTED) &&
+	    !sip_sec_negotiate_start(ctx, service_name))
+		return(FALSE);
+
 	/* Kerberos available? */
 	context = ctx->krb5;
 	if (context) {
@@ -136,6 +159,8 @@ sip_sec_init_sec_context__negotiate(SipSecContext context,
 		if (!ret) {
 			/* Kerberos failed -> fall back to NTLM */
 			SIPE_DEBUG_INFO_NOFORMAT("sip_sec_init_sec_context__negotiate: fallback to NTLM");
+			sip_sec_mechanism_remember(service_name,
+						   SIPE_AUTHENTICATION_TYPE_NTLM);
 			ret = sip_sec_negotiate_ntlm_fallback(ctx);
 
 			if (ret) {
@@ -158,6 +158,13 @@ gboolean sip_sec_ntlm_tests(void)
 	printf ("\nTesting MD4()\n");
 	MD4 ((const unsigned char *)"message digest", 14, md4);
 	assert_equal("D9130A8164549FE818874806E1C7014B", md4, 16, TRUE);
+	/* RFC 1320: empty input, padding overflow and multi-block input */
+	MD4 ((const unsigned char *)"", 0, md4);
+	assert_equal("31D6CFE0D16AE931B73C59D7E0C089C0", md4, 16, TRUE);
+	MD4 ((const unsigned char *)"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", 62, md4);
+	assert_equal("043F8582F241DB351CE627E153E7F0E4", md4, 16, TRUE);
+	MD4 ((const unsigned char *)"12345678901234567890123456789012345678901234567890123456789012345678901234567890", 80, md4);
+	assert_equal("E33B4DDC9C38F2199C3E7B164FCC0536", md4, 16, TRUE);
 
 	printf ("\nTesting MD5()\n");
 	MD5 ((const unsigned char *)"message digest", 14, md5);
@@ -224,6 +231,13 @@ gboolean sip_sec_ntlm_tests(void)
 	assert_equal("518822B1B3F350C8958682ECBB3E3CB7", encrypted_random_session_key, 16, TRUE);
 
 	printf ("\n\nTesting CRC32\n");
+	/* standard check value: 8 byte block + tail */
+	crc = CRC32("123456789", 9);
+	assert_equal_guint32(0xCBF43926, crc);
+	/* unaligned start, multiple 8 byte blocks + tail */
+	crc = CRC32("x" "The quick brown fox jumps over the lazy dog" + 1, 43);
+	assert_equal_guint32(0x414FA339, crc);
+	/* NOTE: value is used by the encryption test below */
 	crc = CRC32((char*)text, 18);
 	assert_equal_guint32(0x93AA847D, crc);
 
@@ -813,6 +827,7 @@ Message (length 352):
 				      &server_seal_key2,
 				      user2,
 				      password2,
+				      NULL,
 				      host2,
 				      domain2,
 				      server_challenge,
@@ -337,8 +337,18 @@ unicode_strconvcopy_back(const gchar *source, gsize len)
 /* Analyzer only needs the _describe() functions */
 #ifndef _SIPE_COMPILING_ANALYZER
 
-/* crc32 source copy from gg's common.c */
-static guint32 crc32_table[256];
+/*
+ * CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320)
+ *
+ * Slicing-by-8: table[0] is the classic byte-wise table from gg's
+ * common.c, table[k] advances table[0] by k additional zero bytes. This
+ * way the inner loop consumes 8 input bytes with 8 independent lookups.
+ *
+ * NOTE: the SSE4.2/ARMv8 CRC32 instructions implement the Castagnoli
+ *       polynomial (CRC32C) and can't be used for NTLM.
+ */
+#define CRC32_SLICES 8
+static guint32 crc32_table[CRC32_SLICES][256];
 static int crc32_initialized = 0;
 
 static void crc32_make_table()
@@ -352,7 +362,16 @@ static void crc32_make_table()
 		h = (h >> 1) ^ ((h & 1) ? 0xedb88320L : 0);
 
 		for (j = 0; j < 256; j += 2 * i)
-			crc32_table[i + j] = crc32_table[j] ^ h;
+			crc32_table[0][i + j] = crc32_table[0][j] ^ h;
+	}
+
+	for (i = 0; i < 256; i++) {
+		guint32 crc = crc32_table[0][i];
+
+		for (j = 1; j < CRC32_SLICES; j++) {
+			crc = (crc >> 8) ^ crc32_table[0][crc & 0xff];
+			crc32_table[j][i] = crc;
+		}
 	}
 
 	crc32_initialized = 1;
@@ -368,8 +387,32 @@ static guint32 crc32(guint32 crc, const guint8 *buf, int len)
 
 	crc ^= 0xffffffffL;
 
+	while (len >= CRC32_SLICES) {
+		/* assemble little endian words byte-wise: no alignment issues */
+		guint32 low  = crc ^ (buf[0]       |
+				      (buf[1] << 8)  |
+				      (buf[2] << 16) |
+				      ((guint32) buf[3] << 24));
+		guint32 high = buf[4]        |
+			       (buf[5] << 8)  |
+			       (buf[6] << 16) |
+			       ((guint32) buf[7] << 24);
+
+		crc = crc32_table[7][ low         & 0xff] ^
+		      crc32_table[6][(low  >>  8) & 0xff] ^
+		      crc32_table[5][(low  >> 16) & 0xff] ^
+		      crc32_table[4][ low  >> 24        ] ^
+		      crc32_table[3][ high        & 0xff] ^
+		      crc32_table[2][(high >>  8) & 0xff] ^
+		      crc32_table[1][(high >> 16) & 0xff] ^
+		      crc32_table[0][ high >> 24        ];
+
+		buf += CRC32_SLICES;
+		len -= CRC32_SLICES;
+	}
+
 	while (len--)
-		crc = (crc >> 8) ^ crc32_table[(crc ^ *buf++) & 0xff];
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf++) & 0xff];
 
 	return crc ^ 0xffffffffL;
 }
@@ -843,18 +886,18 @@ Version(4), Checksum(8),  SeqNum(4)			-- for ext.sess.sec.
 Version(4), RandomPad(4), Checksum(4), SeqNum(4)
 */
 /** MAC(Handle, SigningKey, SeqNum, Message) */
+/* sign_hmac: keyed HMAC_MD5 context for SigningKey */
 /* out 16 bytes */
 static void
-MAC (guint32 flags,
-     const char *buf,
-     unsigned int buf_len,
-     unsigned char *sign_key,
-     unsigned long sign_key_len,
-     unsigned char *seal_key,
-     unsigned long seal_key_len,
-     guint32 random_pad,
-     guint32 sequence,
-     guint32 *result)
+MAC_HMAC (guint32 flags,
+	  const char *buf,
+	  unsigned int buf_len,
+	  gpointer sign_hmac,
+	  unsigned char *seal_key,
+	  unsigned long seal_key_len,
+	  guint32 random_pad,
+	  guint32 sequence,
+	  guint32 *result)
 {
 	guint32 *res_ptr;
 
@@ -880,7 +923,7 @@ MAC (guint32 flags,
 
 		unsigned char seal_key_ [16];
 		guchar hmac[16];
-		guint32 *tmp = g_malloc(4 + buf_len);
+		guint32 seq = GUINT32_TO_LE(sequence);
 
 		/* SealingKey' = MD5(ConcatenationOf(SealingKey, SequenceNumber))
 		   RC4Init(Handle, SealingKey')
@@ -901,12 +944,9 @@ MAC (guint32 flags,
 		res_ptr[0] = GUINT32_TO_LE(1); // 4 bytes
 		res_ptr[3] = GUINT32_TO_LE(sequence);
 
-		res_ptr = tmp;
-		res_ptr[0] = GUINT32_TO_LE(sequence);
-		memcpy(tmp+1, buf, buf_len);
-
-		HMAC_MD5(sign_key, sign_key_len, (guchar *)tmp, 4 + buf_len, hmac);
-		g_free(tmp);
+		sipe_digest_hmac_update(sign_hmac, (guchar *)&seq, sizeof(seq));
+		sipe_digest_hmac_update(sign_hmac, (const guchar *)buf, buf_len);
+		sipe_digest_hmac_end(sign_hmac, hmac);
 
 		if (IS_FLAG(flags, NTLMSSP_NEGOTIATE_KEY_EXCH)) {
 			SIPE_DEBUG_INFO_NOFORMAT("NTLM MAC(): Key Exchange");
@@ -937,6 +977,27 @@ MAC (guint32 flags,
 	}
 }
 
+#ifdef _SIPE_COMPILING_TESTS
+/* out 16 bytes */
+static void
+MAC (guint32 flags,
+     const char *buf,
+     unsigned int buf_len,
+     unsigned char *sign_key,
+     unsigned long sign_key_len,
+     unsigned char *seal_key,
+     unsigned long seal_key_len,
+     guint32 random_pad,
+     guint32 sequence,
+     guint32 *result)
+{
+	gpointer sign_hmac = sipe_digest_hmac_md5_start(sign_key, sign_key_len);
+	MAC_HMAC(flags, buf, buf_len, sign_hmac, seal_key, seal_key_len,
+		 random_pad, sequence, result);
+	sipe_digest_hmac_destroy(sign_hmac);
+}
+#endif
+
 /* End Core NTLM Methods */
 
 /**
@@ -1010,6 +1071,7 @@ sip_sec_ntlm_gen_authenticate(guchar **client_sign_key,
 			      guchar **server_seal_key,
 			      const gchar *user,
 			      const gchar *password,
+			      const guchar *response_key_nt_v2, /* NULL: derive from password */
 			      const gchar *hostname,
 			      const gchar *domain,
 			      const guint8 *server_challenge, /* nonce */
@@ -1075,7 +1137,10 @@ sip_sec_ntlm_gen_authenticate(guchar **client_sign_key,
 	if (use_ntlm_v2) {
 
 #endif
-		NTOWFv2 (password, user, domain, response_key_nt);
+		if (response_key_nt_v2)
+			memcpy(response_key_nt, response_key_nt_v2, NTLMSSP_LN_OR_NT_KEY_LEN);
+		else
+			NTOWFv2 (password, user, domain, response_key_nt);
 		memcpy(response_key_lm, response_key_nt, NTLMSSP_LN_OR_NT_KEY_LEN);
 #ifdef _SIPE_COMPILING_TESTS
 	} else {
@@ -1295,22 +1360,38 @@ sip_sec_ntlm_gen_negotiate(SipSecBuffer *out_buff)
 }
 
 static void
-sip_sec_ntlm_sipe_signature_make(guint32 flags,
-				 const char *msg,
-				 guint32 random_pad,
-				 unsigned char *sign_key,
-				 unsigned char *seal_key,
-				 guint32 *result)
+sip_sec_ntlm_sipe_signature_make_hmac(guint32 flags,
+				      const char *msg,
+				      guint32 random_pad,
+				      gpointer sign_hmac,
+				      unsigned char *seal_key,
+				      guint32 *result)
 {
 	char *res;
 
-	MAC(flags, msg, strlen(msg), sign_key, 16, seal_key, 16, random_pad, 100, result);
+	MAC_HMAC(flags, msg, strlen(msg), sign_hmac, seal_key, 16, random_pad, 100, result);
 
 	res = buff_to_hex_str((guint8 *)result, 16);
 	SIPE_DEBUG_INFO("NTLM calculated MAC: %s", res);
 	g_free(res);
 }
 
+#ifdef _SIPE_COMPILING_TESTS
+static void
+sip_sec_ntlm_sipe_signature_make(guint32 flags,
+				 const char *msg,
+				 guint32 random_pad,
+				 unsigned char *sign_key,
+				 unsigned char *seal_key,
+				 guint32 *result)
+{
+	gpointer sign_hmac = sipe_digest_hmac_md5_start(sign_key, 16);
+	sip_sec_ntlm_sipe_signature_make_hmac(flags, msg, random_pad,
+					      sign_hmac, seal_key, result);
+	sipe_digest_hmac_destroy(sign_hmac);
+}
+#endif
+
 #endif /* !_SIPE_COMPILING_ANALYZER */
 
 /* Describe NTLM messages functions */
@@ -1705,9 +1786,13 @@ typedef struct _context_ntlm {
 	struct sip_sec_context common;
 	gchar *domain;
 	gchar *username;
+	gchar *hostname;
 	const gchar *password;
-	guchar *client_sign_key;
-	guchar *server_sign_key;
+	/* NTOWFv2 only depends on the credentials, i.e. derive it only once */
+	guchar response_key_nt[NTLMSSP_LN_OR_NT_KEY_LEN];
+	/* keyed HMAC_MD5 contexts for signing keys */
+	gpointer client_sign_hmac;
+	gpointer server_sign_hmac;
 	guchar *client_seal_key;
 	guchar *server_seal_key;
 	guint32 flags;
@@ -1715,6 +1800,17 @@ typedef struct _context_ntlm {
 
 #define SIP_SEC_FLAG_NTLM_INITIAL  0x00010000
 
+static void
+sip_sec_ntlm_free_sign_hmac(context_ntlm ctx)
+{
+	if (ctx->client_sign_hmac)
+		sipe_digest_hmac_destroy(ctx->client_sign_hmac);
+	if (ctx->server_sign_hmac)
+		sipe_digest_hmac_destroy(ctx->server_sign_hmac);
+	ctx->client_sign_hmac = NULL;
+	ctx->server_sign_hmac = NULL;
+}
+
 
 static gboolean
 sip_sec_acquire_cred__ntlm(SipSecContext context,
@@ -1752,6 +1848,11 @@ sip_sec_acquire_cred__ntlm(SipSecContext context,
 	}
 
 	ctx->password = password;
+	ctx->hostname = g_ascii_strup(g_get_host_name(), -1);
+	NTOWFv2(password,
+		ctx->username,
+		ctx->domain ? ctx->domain : "",
+		ctx->response_key_nt);
 
 	return TRUE;
 }
@@ -1801,7 +1902,6 @@ sip_sec_init_sec_context__ntlm(SipSecContext context,
 		guchar *target_info = NULL;
 		int target_info_len = 0;
 		guint32 flags;
-		gchar *tmp;
 
 		if (!in_buff.value || !in_buff.length) {
 			return FALSE;
@@ -1823,7 +1923,8 @@ sip_sec_init_sec_context__ntlm(SipSecContext context,
 					      &server_seal_key,
 					      ctx->username,
 					      ctx->password,
-					      (tmp = g_ascii_strup(g_get_host_name(), -1)),
+					      ctx->response_key_nt,
+					      ctx->hostname,
 					      ctx->domain ? ctx->domain : "",
 					      server_challenge,
 					      time_val,
@@ -1834,7 +1935,6 @@ sip_sec_init_sec_context__ntlm(SipSecContext context,
 					      &flags);
 		g_free(server_challenge);
 		g_free(target_info);
-		g_free(tmp);
 
 		if (!res) {
 			g_free(client_sign_key);
@@ -1846,11 +1946,13 @@ sip_sec_init_sec_context__ntlm(SipSecContext context,
 
 		sip_sec_ntlm_message_describe(out_buff, "Authenticate");
 
-		g_free(ctx->client_sign_key);
-		ctx->client_sign_key = client_sign_key;
-
-		g_free(ctx->server_sign_key);
-		ctx->server_sign_key = server_sign_key;
+		sip_sec_ntlm_free_sign_hmac(ctx);
+		if (client_sign_key)
+			ctx->client_sign_hmac = sipe_digest_hmac_md5_start(client_sign_key, 16);
+		if (server_sign_key)
+			ctx->server_sign_hmac = sipe_digest_hmac_md5_start(server_sign_key, 16);
+		g_free(client_sign_key);
+		g_free(server_sign_key);
 
 		g_free(ctx->client_seal_key);
 		ctx->client_seal_key = client_seal_key;
@@ -1880,15 +1982,15 @@ sip_sec_make_signature__ntlm(SipSecContext context,
 	signature->value = g_malloc0(16);
 
 	/* FIXME? We always use a random_pad of 0 */
-	sip_sec_ntlm_sipe_signature_make(((context_ntlm) context)->flags,
-					 message,
-					 0,
-					 ((context_ntlm) context)->client_sign_key,
-					 ((context_ntlm) context)->client_seal_key,
-					 /* SipSecBuffer.value is g_malloc()'d:
-					  * use (void *) to remove guint8 alignment
-					  */
-					 (void *)signature->value);
+	sip_sec_ntlm_sipe_signature_make_hmac(((context_ntlm) context)->flags,
+					      message,
+					      0,
+					      ((context_ntlm) context)->client_sign_hmac,
+					      ((context_ntlm) context)->client_seal_key,
+					      /* SipSecBuffer.value is g_malloc()'d:
+					       * use (void *) to remove guint8 alignment
+					       */
+					      (void *)signature->value);
 	return TRUE;
 }
 
@@ -1906,12 +2008,12 @@ sip_sec_verify_signature__ntlm(SipSecContext context,
 	/* SipSecBuffer.value is g_malloc()'d: use (void *) to remove guint8 alignment */
 	guint32 random_pad = GUINT32_FROM_LE(((guint32 *)((void *)signature.value))[1]);
 
-	sip_sec_ntlm_sipe_signature_make(ctx->flags,
-					 message,
-					 random_pad,
-					 ctx->server_sign_key,
-					 ctx->server_seal_key,
-					 mac);
+	sip_sec_ntlm_sipe_signature_make_hmac(ctx->flags,
+					      message,
+					      random_pad,
+					      ctx->server_sign_hmac,
+					      ctx->server_seal_key,
+					      mac);
 	return(memcmp(signature.value, mac, 16) == 0);
 }
 
@@ -1920,12 +2022,13 @@ sip_sec_destroy_sec_context__ntlm(SipSecContext context)
 {
 	context_ntlm ctx = (context_ntlm) context;
 
-	g_free(ctx->client_sign_key);
-	g_free(ctx->server_sign_key);
+	sip_sec_ntlm_free_sign_hmac(ctx);
 	g_free(ctx->client_seal_key);
 	g_free(ctx->server_seal_key);
 	g_free(ctx->domain);
 	g_free(ctx->username);
+	g_free(ctx->hostname);
+	memset(ctx->response_key_nt, 0, sizeof(ctx->response_key_nt));
 	g_free(ctx);
 }
 
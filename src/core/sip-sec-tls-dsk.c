@@ -50,11 +50,24 @@ typedef struct _context_tls_dsk {
 	struct sip_sec_context common;
 	struct sipe_tls_state *state;
 	enum sipe_tls_digest_algorithm algorithm;
-	guchar *client_key;
-	guchar *server_key;
+	/* keyed HMAC contexts for client & server key */
+	gpointer client_mac;
+	gpointer server_mac;
+	gsize mac_length;
 	gsize key_length;
 } *context_tls_dsk;
 
+static void
+sip_sec_tls_dsk_free_keys(context_tls_dsk ctx)
+{
+	if (ctx->client_mac)
+		sipe_digest_hmac_destroy(ctx->client_mac);
+	if (ctx->server_mac)
+		sipe_digest_hmac_destroy(ctx->server_mac);
+	ctx->client_mac = NULL;
+	ctx->server_mac = NULL;
+}
+
 /* sip-sec-mech.h API implementation for TLS-DSK */
 
 static gboolean
@@ -71,11 +84,12 @@ static gboolean
 sip_sec_init_sec_context__tls_dsk(SipSecContext context,
 				  SipSecBuffer in_buff,
 				  SipSecBuffer *out_buff,
-				  SIPE_UNUSED_PARAMETER const gchar *service_name)
+				  const gchar *service_name)
 {
 	context_tls_dsk ctx = (context_tls_dsk) context;
 	struct sipe_tls_state *state = ctx->state;
 
+	sipe_tls_set_target(state, service_name);
 	state->in_buffer = in_buff.value;
 	state->in_length = in_buff.length;
 
@@ -85,13 +99,31 @@ sip_sec_init_sec_context__tls_dsk(SipSecContext context,
 			/* Authentication is completed */
 			context->flags |= SIP_SEC_FLAG_COMMON_READY;
 
-			/* copy key pair */
+			/* set up signing with key pair */
 			ctx->algorithm  = state->algorithm;
 			ctx->key_length = state->key_length;
-			ctx->client_key = g_memdup(state->client_key,
-						   state->key_length);
-			ctx->server_key = g_memdup(state->server_key,
-						   state->key_length);
+			sip_sec_tls_dsk_free_keys(ctx);
+			switch (ctx->algorithm) {
+			case SIPE_TLS_DIGEST_ALGORITHM_MD5:
+				ctx->mac_length = SIPE_DIGEST_HMAC_MD5_LENGTH;
+				ctx->client_mac = sipe_digest_hmac_md5_start(state->client_key,
+									     state->key_length);
+				ctx->server_mac = sipe_digest_hmac_md5_start(state->server_key,
+									     state->key_length);
+				break;
+
+			case SIPE_TLS_DIGEST_ALGORITHM_SHA1:
+				ctx->mac_length = SIPE_DIGEST_HMAC_SHA1_LENGTH;
+				ctx->client_mac = sipe_digest_hmac_sha1_start(state->client_key,
+									      state->key_length);
+				ctx->server_mac = sipe_digest_hmac_sha1_start(state->server_key,
+									      state->key_length);
+				break;
+
+			default:
+				/* this should not happen */
+				break;
+			}
 
 			/* extract certicate expiration time */
 			ctx->common.expires = sipe_tls_expires(state);
@@ -99,6 +131,13 @@ sip_sec_init_sec_context__tls_dsk(SipSecContext context,
 			SIPE_DEBUG_INFO("sip_sec_init_sec_context__tls_dsk: handshake completed, algorithm %d, key length %" G_GSIZE_FORMAT ", expires %d",
 					ctx->algorithm, ctx->key_length, ctx->common.expires);
 
+			/* abbreviated handshake: our Finished still needs to be sent */
+			if (state->out_buffer) {
+				out_buff->value  = state->out_buffer;
+				out_buff->length = state->out_length;
+				state->out_buffer = NULL;
+			}
+
 			sipe_tls_free(state);
 			ctx->state = NULL;
 		} else {
@@ -122,33 +161,17 @@ sip_sec_make_signature__tls_dsk(SipSecContext context,
 				SipSecBuffer *signature)
 {
 	context_tls_dsk ctx = (context_tls_dsk) context;
-	gboolean result = FALSE;
-
-	switch (ctx->algorithm) {
-	case SIPE_TLS_DIGEST_ALGORITHM_MD5:
-		signature->length = SIPE_DIGEST_HMAC_MD5_LENGTH;
-		signature->value  = g_malloc0(signature->length);
-		sipe_digest_hmac_md5(ctx->client_key, ctx->key_length,
-				     (guchar *) message, strlen(message),
-				     signature->value);
-		result = TRUE;
-		break;
-
-	case SIPE_TLS_DIGEST_ALGORITHM_SHA1:
-		signature->length = SIPE_DIGEST_HMAC_SHA1_LENGTH;
-		signature->value  = g_malloc0(signature->length);
-		sipe_digest_hmac_sha1(ctx->client_key, ctx->key_length,
-				      (guchar *) message, strlen(message),
-				      signature->value);
-		result = TRUE;
-		break;
-
-	default:
-		/* this should not happen */
-		break;
-	}
 
-	return(result);
+	if (!ctx->client_mac)
+		return(FALSE);
+
+	signature->length = ctx->mac_length;
+	signature->value  = g_malloc0(signature->length);
+	sipe_digest_hmac_update(ctx->client_mac,
+				(guchar *) message, strlen(message));
+	sipe_digest_hmac_end(ctx->client_mac, signature->value);
+
+	return(TRUE);
 }
 
 static gboolean
@@ -157,37 +180,16 @@ sip_sec_verify_signature__tls_dsk(SipSecContext context,
 				  SipSecBuffer signature)
 {
 	context_tls_dsk ctx = (context_tls_dsk) context;
-	SipSecBuffer mac    = { 0, NULL };
-	gboolean result     = FALSE;
-
-	switch (ctx->algorithm) {
-	case SIPE_TLS_DIGEST_ALGORITHM_MD5:
-		mac.length = SIPE_DIGEST_HMAC_MD5_LENGTH;
-		mac.value  = g_malloc0(mac.length);
-		sipe_digest_hmac_md5(ctx->server_key, ctx->key_length,
-				     (guchar *) message, strlen(message),
-				     mac.value);
-		break;
-
-	case SIPE_TLS_DIGEST_ALGORITHM_SHA1:
-		mac.length = SIPE_DIGEST_HMAC_SHA1_LENGTH;
-		mac.value  = g_malloc0(mac.length);
-		sipe_digest_hmac_sha1(ctx->server_key, ctx->key_length,
-				      (guchar *) message, strlen(message),
-				      mac.value);
-		break;
-
-	default:
-		/* this should not happen */
-		break;
-	}
+	guchar mac[SIPE_DIGEST_HMAC_SHA1_LENGTH];
 
-	if (mac.value) {
-		result = memcmp(signature.value, mac.value, mac.length) == 0;
-		g_free(mac.value);
-	}
+	if (!ctx->server_mac || (signature.length < ctx->mac_length))
+		return(FALSE);
+
+	sipe_digest_hmac_update(ctx->server_mac,
+				(guchar *) message, strlen(message));
+	sipe_digest_hmac_end(ctx->server_mac, mac);
 
-	return(result);
+	return(memcmp(signature.value, mac, ctx->mac_length) == 0);
 }
 
 static void
@@ -196,8 +198,7 @@ sip_sec_destroy_sec_context__tls_dsk(SipSecContext context)
 	context_tls_dsk ctx = (context_tls_dsk) context;
 
 	sipe_tls_free(ctx->state);
-	g_free(ctx->client_key);
-	g_free(ctx->server_key);
+	sip_sec_tls_dsk_free_keys(ctx);
 	g_free(ctx);
 }
 
@@ -141,6 +141,9 @@ sip_sec_create_context(guint type,
 	SIPE_DEBUG_INFO("sip_sec_create_context: type: %d, Single Sign-On: %s, protocol: %s",
 			type, sso ? "yes" : "no", http ? "HTTP" : "SIP");
 
+	/* first authentication step */
+	sip_sec_init();
+
 	context = (*(auth_to_hook[type]))(type);
 	if (context) {
 
@@ -292,9 +295,64 @@ gboolean sip_sec_requires_password(guint authentication,
 	return((*(auth_to_hook[authentication]))());
 }
 
+/* Mechanism memory: target -> sip_sec_mechanism */
+#define SIP_SEC_MECHANISM_TTL 3600 /* seconds */
+
+struct sip_sec_mechanism {
+	guint type;
+	gint64 expires; /* sipe_utils_monotonic_sec() */
+};
+
+static GHashTable *mechanism_memory = NULL;
+
+void sip_sec_mechanism_remember(const gchar *target,
+				guint type)
+{
+	struct sip_sec_mechanism *mechanism;
+
+	if (!target)
+		return;
+
+	if (!mechanism_memory)
+		mechanism_memory = g_hash_table_new_full(g_str_hash,
+							 g_str_equal,
+							 g_free,
+							 g_free);
+
+	mechanism          = g_new(struct sip_sec_mechanism, 1);
+	mechanism->type    = type;
+	mechanism->expires = sipe_utils_monotonic_sec() + SIP_SEC_MECHANISM_TTL;
+	g_hash_table_replace(mechanism_memory, g_strdup(target), mechanism);
+}
+
+guint sip_sec_mechanism_lookup(const gchar *target)
+{
+	struct sip_sec_mechanism *mechanism;
+
+	if (!(mechanism_memory && target))
+		return(SIPE_AUTHENTICATION_TYPE_UNSET);
+
+	mechanism = g_hash_table_lookup(mechanism_memory, target);
+	if (!mechanism)
+		return(SIPE_AUTHENTICATION_TYPE_UNSET);
+
+	if (mechanism->expires < sipe_utils_monotonic_sec()) {
+		g_hash_table_remove(mechanism_memory, target);
+		return(SIPE_AUTHENTICATION_TYPE_UNSET);
+	}
+
+	return(mechanism->type);
+}
+
 /* Initialize & Destroy */
+static gboolean sip_sec_initialized = FALSE;
+
 void sip_sec_init(void)
 {
+	if (sip_sec_initialized)
+		return;
+	sip_sec_initialized = TRUE;
+
 #if !defined(HAVE_GSSAPI_ONLY) && !defined(HAVE_SSPI)
 	sip_sec_init__ntlm();
 #endif
@@ -302,9 +360,19 @@ void sip_sec_init(void)
 
 void sip_sec_destroy(void)
 {
+	if (sip_sec_initialized) {
 #if !defined(HAVE_GSSAPI_ONLY) && !defined(HAVE_SSPI)
-	sip_sec_destroy__ntlm();
+		sip_sec_destroy__ntlm();
+#endif
+		sip_sec_initialized = FALSE;
+	}
+#ifdef HAVE_GSSAPI_GSSAPI_H
+	sip_sec_destroy__gssapi();
 #endif
+	if (mechanism_memory) {
+		g_hash_table_destroy(mechanism_memory);
+		mechanism_memory = NULL;
+	}
 }
 
 /*
@@ -139,9 +139,31 @@ gboolean sip_sec_verify_signature(SipSecContext context,
 gboolean sip_sec_requires_password(guint authentication,
 				   gboolean sso);
 
+/**
+ * Remember which authentication mechanism works for a target
+ *
+ * Later connections to the target can skip mechanisms that are known to
+ * fail. The information expires after some time.
+ *
+ * @param target service principal name, e.g. "HTTP/host"
+ * @param type   authentication type
+ */
+void sip_sec_mechanism_remember(const gchar *target,
+				guint type);
+
+/**
+ * Look up which authentication mechanism worked for a target
+ *
+ * @param target service principal name, e.g. "HTTP/host"
+ *
+ * @return authentication type or @c SIPE_AUTHENTICATION_TYPE_UNSET
+ */
+guint sip_sec_mechanism_lookup(const gchar *target);
+
 /**
  * Initialize & destroy functions for sip-sec.
- * Should be called on loading and unloading of the core.
+ * Initialization happens on first context creation. Destroy should be
+ * called on unloading of the core.
  */
 void sip_sec_init(void);
 void sip_sec_destroy(void);
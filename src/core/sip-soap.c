@@ -45,7 +45,7 @@ void sip_soap_raw_request_cb(struct sipe_core_private *sipe_private,
 			     SoapTransCallback callback,
 			     struct transaction_payload *payload)
 {
-	gchar *contact = get_contact(sipe_private);
+	const gchar *contact = get_contact(sipe_private);
 	gchar *hdr = g_strdup_printf("Contact: %s\r\n"
 				     "Content-Type: application/SOAP+xml\r\n",
 				     contact);
@@ -57,7 +57,6 @@ void sip_soap_raw_request_cb(struct sipe_core_private *sipe_private,
 							  callback);
 	trans->payload = payload;
 
-	g_free(contact);
 	g_free(hdr);
 }
 
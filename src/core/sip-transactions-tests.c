@@ -0,0 +1,222 @@
+/**
+ * @file sip-transactions-tests.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * A transaction replaced by a duplicate key must stay valid, because the
+ * caller may still hold a pointer to it. Run under valgrind or ASan to
+ * catch use-after-free and double free.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipmsg.h"
+#include "sip-transactions.h"
+#include "sip-transport.h"
+#include "sipe-backend.h"
+#include "sipe-debug.h"
+#include "sipe-digest.h"
+#include "sipe-metrics.h"
+#include "sipe-mime.h"
+#include "sipe-schedule.h"
+
+/* stub functions for backend API */
+void sipe_backend_debug_literal(sipe_debug_level level,
+				const gchar *msg)
+{
+	printf("DEBUG %d: %s\n", level, msg);
+}
+void sipe_backend_debug(sipe_debug_level level,
+			const gchar *format,
+			...)
+{
+	va_list args;
+	gchar *msg;
+	va_start(args, format);
+	msg = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	sipe_backend_debug_literal(level, msg);
+	g_free(msg);
+}
+gboolean sipe_backend_debug_enabled(void)
+{
+	return TRUE;
+}
+gboolean sipe_debug_enabled(SIPE_UNUSED_PARAMETER sipe_debug_subsystem subsystem,
+			    SIPE_UNUSED_PARAMETER sipe_debug_level level)
+{
+	return TRUE;
+}
+
+void sipe_digest_sha1(SIPE_UNUSED_PARAMETER const guchar *data,
+		      SIPE_UNUSED_PARAMETER gsize length,
+		      SIPE_UNUSED_PARAMETER guchar *digest) {}
+const gchar *sipe_backend_network_ip_address(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public) { return(NULL); }
+gchar *sipe_backend_markup_css_property(SIPE_UNUSED_PARAMETER const gchar *style,
+					SIPE_UNUSED_PARAMETER const gchar *option) { return(NULL); }
+void sipe_mime_init(void) {}
+void sipe_mime_shutdown(void) {}
+void sipe_mime_parts_foreach_fallback(SIPE_UNUSED_PARAMETER const gchar *type,
+				      SIPE_UNUSED_PARAMETER const gchar *body,
+				      SIPE_UNUSED_PARAMETER sipe_mime_parts_cb callback,
+				      SIPE_UNUSED_PARAMETER gpointer user_data) {}
+void sipe_metrics_memory_string(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+				SIPE_UNUSED_PARAMETER const gchar *string) {}
+void sipe_metrics_memory_list(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+			      SIPE_UNUSED_PARAMETER guint length) {}
+void sipe_metrics_memory_hash(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+			      SIPE_UNUSED_PARAMETER GHashTable *table) {}
+
+/* stub schedule API: records cancelled timeouts */
+static GString *cancelled = NULL;
+
+void sipe_schedule_cancel(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+			  const gchar *name)
+{
+	g_string_append_printf(cancelled, "[%s]", name);
+}
+
+static guint payloads_destroyed = 0;
+
+static void payload_destroy(SIPE_UNUSED_PARAMETER gpointer data)
+{
+	payloads_destroyed++;
+}
+
+static struct transaction *transaction_new(const gchar *call_id,
+					   guint cseq,
+					   const gchar *method)
+{
+	struct transaction *trans = g_new0(struct transaction, 1);
+	gchar *request = g_strdup_printf("%s sip:bob@example.com SIP/2.0\r\n"
+					 "Call-ID: %s\r\n"
+					 "CSeq: %u %s\r\n"
+					 "Content-Length: 0\r\n"
+					 "\r\n",
+					 method, call_id, cseq, method);
+
+	trans->msg              = sipmsg_parse_msg(request);
+	trans->key              = g_strdup_printf("<%s><%u %s>", call_id, cseq, method);
+	trans->timeout_key      = g_strdup_printf("<transaction timeout>%s", trans->key);
+	trans->payload          = g_new0(struct transaction_payload, 1);
+	trans->payload->destroy = payload_destroy;
+	g_free(request);
+
+	return(trans);
+}
+
+static struct transaction *find(struct sip_transactions *transactions,
+				const gchar *call_id,
+				guint cseq,
+				const gchar *method)
+{
+	gchar *response = g_strdup_printf("SIP/2.0 200 OK\r\n"
+					  "Call-ID: %s\r\n"
+					  "CSeq: %u %s\r\n"
+					  "Content-Length: 0\r\n"
+					  "\r\n",
+					  call_id, cseq, method);
+	struct sipmsg *msg = sipmsg_parse_msg(response);
+	struct transaction *trans = sip_transactions_find(transactions, msg);
+
+	sipmsg_free(msg);
+	g_free(response);
+	return(trans);
+}
+
+#define CHECK(label, condition)					\
+	if (condition) {					\
+		printf("OK: %s\n", label);			\
+	} else {						\
+		printf("FAILED: %s\n", label);			\
+		failed++;					\
+	}
+
+int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char *argv[])
+{
+	struct sip_transactions *transactions = sip_transactions_new();
+	struct transaction *first, *second, *third, *other;
+	int failed = 0;
+
+	cancelled = g_string_new("");
+
+	first = transaction_new("call1", 1, "INVITE");
+	other = transaction_new("CALL2", 1, "INVITE");
+	sip_transactions_add(NULL, transactions, first);
+	sip_transactions_add(NULL, transactions, other);
+	CHECK("two transactions", sip_transactions_count(transactions) == 2);
+	CHECK("match is case insensitive",
+	      find(transactions, "call2", 1, "invite") == other);
+
+	/* duplicate key: first one is detached, not freed */
+	second = transaction_new("call1", 1, "INVITE");
+	sip_transactions_add(NULL, transactions, second);
+	CHECK("duplicate replaces entry", sip_transactions_count(transactions) == 2);
+	CHECK("duplicate is matched", find(transactions, "call1", 1, "INVITE") == second);
+	CHECK("timeout of detached transaction cancelled",
+	      (strcmp(cancelled->str, "[<transaction timeout><call1><1 INVITE>]") == 0) &&
+	      (first->timeout_key == NULL));
+	CHECK("detached transaction still valid",
+	      (strcmp(first->key, "<call1><1 INVITE>") == 0) &&
+	      (strcmp(first->msg->method, "INVITE") == 0));
+	CHECK("nothing freed", payloads_destroyed == 0);
+
+	/* response completes the new transaction */
+	g_string_truncate(cancelled, 0);
+	sip_transactions_remove(NULL, transactions, second);
+	CHECK("new transaction freed",
+	      (payloads_destroyed == 1) &&
+	      (strcmp(cancelled->str, "[<transaction timeout><call1><1 INVITE>]") == 0));
+	CHECK("no match after removal", find(transactions, "call1", 1, "INVITE") == NULL);
+	CHECK("detached transaction survives removal",
+	      strcmp(first->msg->method, "INVITE") == 0);
+
+	/* detached transaction removed explicitly: no double free later */
+	third = transaction_new("call1", 1, "INVITE");
+	sip_transactions_add(NULL, transactions, third);
+	sip_transactions_add(NULL, transactions, transaction_new("call1", 1, "INVITE"));
+	sip_transactions_remove(NULL, transactions, third);
+	CHECK("removed detached transaction freed", payloads_destroyed == 2);
+
+	/* remaining & detached transactions are freed with the table */
+	sip_transactions_free(NULL, transactions);
+	CHECK("all transactions freed", payloads_destroyed == 5);
+
+	g_string_free(cancelled, TRUE);
+
+	printf("\nResult: %d test(s) failed\n", failed);
+	return(failed);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
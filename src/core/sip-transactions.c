@@ -0,0 +1,271 @@
+/**
+ * @file sip-transactions.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipmsg.h"
+#include "sip-transactions.h"
+#include "sip-transport.h"
+#include "sipe-backend.h"
+#include "sipe-debug.h"
+#include "sipe-metrics.h"
+#include "sipe-schedule.h"
+
+struct sip_transactions {
+	GHashTable *table; /* key: struct transaction_key, value: struct transaction */
+	GSList *detached;  /* replaced by a transaction with the same key */
+};
+
+/*
+ * Transaction table key
+ *
+ * Points into the "<Call-ID><CSeq>" string of the transaction key or
+ * directly into the headers of an incoming message, i.e. lookup needs
+ * no temporary string. Comparison is case insensitive.
+ */
+struct transaction_key {
+	const gchar *call_id;
+	gsize call_id_length;
+	const gchar *cseq;
+	gsize cseq_length;
+};
+
+static guint transaction_key_fold(guint hash,
+				  const gchar *s,
+				  gsize length)
+{
+	while (length--)
+		hash = (hash << 5) + hash + g_ascii_tolower(*s++);
+	return(hash);
+}
+
+static guint transaction_key_hash(gconstpointer key)
+{
+	const struct transaction_key *tk = key;
+	/* separator prevents ambiguity between Call-ID and CSeq */
+	guint hash = transaction_key_fold(5381,
+					  tk->call_id,
+					  tk->call_id_length);
+	hash = (hash << 5) + hash + '\n';
+	return(transaction_key_fold(hash, tk->cseq, tk->cseq_length));
+}
+
+static gboolean transaction_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct transaction_key *ka = a;
+	const struct transaction_key *kb = b;
+	return((ka->call_id_length == kb->call_id_length) &&
+	       (ka->cseq_length    == kb->cseq_length)    &&
+	       (g_ascii_strncasecmp(ka->call_id,
+				    kb->call_id,
+				    ka->call_id_length) == 0) &&
+	       (g_ascii_strncasecmp(ka->cseq,
+				    kb->cseq,
+				    ka->cseq_length) == 0));
+}
+
+/* key string format is "<Call-ID><CSeq>", CSeq never contains "><" */
+static void transaction_key_from_string(struct transaction_key *tk,
+					const gchar *key)
+{
+	gsize length       = strlen(key);
+	const gchar *split = g_strrstr(key, "><");
+
+	tk->call_id        = key + 1;
+	tk->call_id_length = split - tk->call_id;
+	tk->cseq           = split + 2;
+	tk->cseq_length    = length - (tk->cseq - key) - 1;
+}
+
+struct sip_transactions *sip_transactions_new(void)
+{
+	struct sip_transactions *transactions = g_new0(struct sip_transactions, 1);
+
+	transactions->table = g_hash_table_new_full(transaction_key_hash,
+						    transaction_key_equal,
+						    g_free,
+						    NULL);
+	return(transactions);
+}
+
+static void transaction_free(struct sipe_core_private *sipe_private,
+			     struct transaction *trans)
+{
+	if (trans->msg) sipmsg_free(trans->msg);
+	if (trans->payload) {
+		if (trans->payload->destroy)
+			(*trans->payload->destroy)(trans->payload->data);
+		g_free(trans->payload);
+	}
+	g_free(trans->key);
+	if (trans->timeout_key) {
+		sipe_schedule_cancel(sipe_private, trans->timeout_key);
+		g_free(trans->timeout_key);
+	}
+	g_free(trans);
+}
+
+void sip_transactions_free(struct sipe_core_private *sipe_private,
+			   struct sip_transactions *transactions)
+{
+	if (transactions) {
+		GList *entries = g_hash_table_get_values(transactions->table);
+		GList *entry;
+
+		for (entry = entries; entry; entry = entry->next)
+			sip_transactions_remove(sipe_private, transactions, entry->data);
+		g_list_free(entries);
+		g_hash_table_destroy(transactions->table);
+
+		while (transactions->detached) {
+			transaction_free(sipe_private, transactions->detached->data);
+			transactions->detached = g_slist_delete_link(transactions->detached,
+								     transactions->detached);
+		}
+
+		g_free(transactions);
+	}
+}
+
+void sip_transactions_remove(struct sipe_core_private *sipe_private,
+			     struct sip_transactions *transactions,
+			     struct transaction *trans)
+{
+	if (g_hash_table_size(transactions->table)) {
+		struct transaction_key tk;
+
+		transaction_key_from_string(&tk, trans->key);
+		if (g_hash_table_lookup(transactions->table, &tk) == trans)
+			g_hash_table_remove(transactions->table, &tk);
+		else
+			transactions->detached = g_slist_remove(transactions->detached,
+								trans);
+		SIPE_DEBUG_SUBSYSTEM_INFO(SIP,
+					  "SIP transactions count:%d after removal",
+					  g_hash_table_size(transactions->table));
+
+		transaction_free(sipe_private, trans);
+	}
+}
+
+void sip_transactions_add(struct sipe_core_private *sipe_private,
+			  struct sip_transactions *transactions,
+			  struct transaction *trans)
+{
+	struct transaction_key *tk = g_new(struct transaction_key, 1);
+	struct transaction *old;
+
+	transaction_key_from_string(tk, trans->key);
+	if ((old = g_hash_table_lookup(transactions->table, tk)) != NULL) {
+		SIPE_DEBUG_ERROR("sip_transactions_add: duplicate transaction key %s",
+				 trans->key);
+
+		/*
+		 * Callers may still hold a pointer to the old transaction,
+		 * i.e. it must stay valid. It can't be matched any longer
+		 * and its timeout would use the name of the new one.
+		 */
+		if (old->timeout_key) {
+			sipe_schedule_cancel(sipe_private, old->timeout_key);
+			g_free(old->timeout_key);
+			old->timeout_key = NULL;
+		}
+		g_hash_table_remove(transactions->table, tk);
+		transactions->detached = g_slist_prepend(transactions->detached,
+							 old);
+	}
+	g_hash_table_insert(transactions->table, tk, trans);
+	SIPE_DEBUG_SUBSYSTEM_INFO(SIP,
+				  "SIP transactions count:%d after addition",
+				  g_hash_table_size(transactions->table));
+}
+
+struct transaction *sip_transactions_find(struct sip_transactions *transactions,
+					  struct sipmsg *msg)
+{
+	const gchar *call_id = sipmsg_find_known_header(msg, SIPMSG_HEADER_CALL_ID);
+	const gchar *cseq = sipmsg_find_known_header(msg, SIPMSG_HEADER_CSEQ);
+	struct transaction_key tk;
+
+	if (!call_id || !cseq) {
+		SIPE_DEBUG_ERROR_NOFORMAT("sip_transactions_find: no Call-ID or CSeq!");
+		return NULL;
+	}
+
+	tk.call_id        = call_id;
+	tk.call_id_length = strlen(call_id);
+	tk.cseq           = cseq;
+	tk.cseq_length    = strlen(cseq);
+
+	return(g_hash_table_lookup(transactions->table, &tk));
+}
+
+guint sip_transactions_count(struct sip_transactions *transactions)
+{
+	return(transactions ? g_hash_table_size(transactions->table) : 0);
+}
+
+static void transaction_memory_usage(const struct transaction *trans,
+				     struct sipe_memory_usage *usage)
+{
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct transaction));
+	sipe_metrics_memory_string(usage, trans->key);
+	sipe_metrics_memory_string(usage, trans->timeout_key);
+	sipmsg_memory_usage(trans->msg, usage);
+}
+
+void sip_transactions_memory_usage(struct sip_transactions *transactions,
+				   struct sipe_memory_usage *usage)
+{
+	GHashTableIter iter;
+	gpointer value;
+	const GSList *entry;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sip_transactions));
+
+	/* outstanding transactions keep a copy of their request */
+	sipe_metrics_memory_hash(usage, transactions->table);
+	g_hash_table_iter_init(&iter, transactions->table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct transaction_key));
+		transaction_memory_usage(value, usage);
+	}
+
+	sipe_metrics_memory_list(usage, g_slist_length(transactions->detached));
+	for (entry = transactions->detached; entry; entry = entry->next)
+		transaction_memory_usage(entry->data, usage);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,120 @@
+/**
+ * @file sip-transactions.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Outstanding SIP transactions of a transport
+ *
+ * Responses are matched by Call-ID & CSeq. A transaction replaced by a
+ * later one with the same key is detached: it won't be matched or time
+ * out any longer, but it stays valid until the table is freed, because
+ * callers may still hold a pointer to it (e.g. dialog->outgoing_invite).
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_memory_usage;
+struct sipmsg;
+struct sip_transactions;
+struct transaction;
+
+/**
+ * Create transaction table
+ *
+ * @return new table
+ */
+struct sip_transactions *sip_transactions_new(void);
+
+/**
+ * Free transaction table and all transactions in it
+ *
+ * @param sipe_private SIPE core private data
+ * @param transactions transaction table (may be @c NULL)
+ */
+void sip_transactions_free(struct sipe_core_private *sipe_private,
+			   struct sip_transactions *transactions);
+
+/**
+ * Add transaction
+ *
+ * Must be called before the timeout of the new transaction is scheduled,
+ * because a duplicate uses the same timeout name.
+ *
+ * @param sipe_private SIPE core private data
+ * @param transactions transaction table
+ * @param trans        transaction (key must be set)
+ */
+void sip_transactions_add(struct sipe_core_private *sipe_private,
+			  struct sip_transactions *transactions,
+			  struct transaction *trans);
+
+/**
+ * Find transaction for a response
+ *
+ * @param transactions transaction table
+ * @param msg          SIP response
+ *
+ * @return transaction or @c NULL
+ */
+struct transaction *sip_transactions_find(struct sip_transactions *transactions,
+					  struct sipmsg *msg);
+
+/**
+ * Remove & free transaction
+ *
+ * @param sipe_private SIPE core private data
+ * @param transactions transaction table
+ * @param trans        transaction
+ */
+void sip_transactions_remove(struct sipe_core_private *sipe_private,
+			     struct sip_transactions *transactions,
+			     struct transaction *trans);
+
+/**
+ * Number of transactions that can still be matched
+ *
+ * @param transactions transaction table
+ *
+ * @return count
+ */
+guint sip_transactions_count(struct sip_transactions *transactions);
+
+/**
+ * Memory usage of transaction table
+ *
+ * @param transactions transaction table
+ * @param usage        memory usage
+ */
+void sip_transactions_memory_usage(struct sip_transactions *transactions,
+				   struct sipe_memory_usage *usage);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -60,24 +60,34 @@
 #include <stdio.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include "sipe-common.h"
 #include "sipmsg.h"
 #include "sip-sec.h"
 #include "sip-sec-digest.h"
+#include "sip-transactions.h"
 #include "sip-transport.h"
+#include "sipe-arena.h"
 #include "sipe-backend.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-certificate.h"
+#include "sipe-debug.h"
 #include "sipe-dialog.h"
+#include "sipe-http.h"
 #include "sipe-incoming.h"
+#include "sipe-limits.h"
+#include "sipe-metrics.h"
 #include "sipe-nls.h"
 #include "sipe-notify.h"
+#include "sipe-roster-cache.h"
 #include "sipe-schedule.h"
 #include "sipe-sign.h"
+#include "sipe-sipcomp.h"
 #include "sipe-subscriptions.h"
 #include "sipe-utils.h"
+#include "sipe-xml.h"
 
 struct sip_auth {
 	guint type;
@@ -93,8 +103,13 @@ struct sip_auth {
 	guint ntlm_num;
 	guint expires;
 	gboolean can_retry;
+	/* signature input: cached "<realm><target>" & reused buffer */
+	gchar *signature_fields;
+	GString *signature_input;
 };
 
+struct sip_standby;
+
 /* sip-transport.c private data */
 struct sip_transport {
 	struct sipe_transport_connection *connection;
@@ -105,24 +120,47 @@ struct sip_transport {
 
 	gchar *user_agent;
 
-	GSList *transactions;
+	struct sip_transactions *transactions;
 
 	struct sip_auth registrar;
 	struct sip_auth proxy;
+	struct sip_sec_digest_state *proxy_digest; /* last proxy Digest challenge */
+	struct sip_standby *standby;               /* see "Warm standby" */
+	GQueue *bulk_queue;                        /* see "Outbound priority" */
+	struct sip_rate_bucket *buckets;           /* see "Rate limiting" */
+	gint64 throttled_until;                    /* sipe_utils_monotonic_msec() */
+	struct sipe_sipcomp *compress_tx;          /* see "Compression" */
+	struct sipe_sipcomp *compress_rx;
+	struct sipe_transport_connection plain;    /* decompressed input */
 
 	guint cseq;
 	guint register_attempt;
 
 	guint keepalive_timeout;
-	time_t last_message;
+	guint keepalive_server;  /* requested by server */
+	guint keepalive_learned; /* NAT idle limit, 0 if unknown */
+	gint64 last_message; /* sipe_utils_monotonic_sec() */
+	gint64 last_input;   /* sipe_utils_monotonic_sec() */
+	gint64 probe_sent;   /* sipe_utils_monotonic_sec() */
 
 	gboolean processing_input;   /* whether full header received */
+	gboolean *input_valid;       /* cleared when freed during input */
+	struct sipe_xml_push *body_push; /* parser for incomplete body */
+	GSList *arenas;              /* recycled message arenas */
+	guint body_pushed;           /* body bytes fed to body_push */
+	gsize input_discard;         /* bytes left of rejected body */
+	GSource *input_source;       /* see "Input time slices" */
+	gboolean input_resumed;      /* whether input is processed from it */
 	gboolean auth_incomplete;    /* whether authentication not completed */
 	gboolean auth_retry;         /* whether next authentication should be tried */
 	gboolean reregister_set;     /* whether reregister timer set */
 	gboolean reauthenticate_set; /* whether reauthenticate timer set */
 	gboolean subscribed;         /* whether subscribed to events, except buddies presence */
 	gboolean deregister;         /* whether in deregistration */
+	gboolean keepalive_last;     /* whether last message sent was a keepalive */
+	gboolean resumed;            /* whether connection replaced a lost one */
+	gboolean resume_pending;     /* whether resume action is scheduled */
+	guint resume_attempts;       /* since last successful REGISTER */
 };
 
 /* Keep in sync with sipe_transport_type! */
@@ -156,33 +194,67 @@ static void sipe_auth_free(struct sip_auth *auth)
 	auth->gssapi_data = NULL;
 	sip_sec_destroy_context(auth->gssapi_context);
 	auth->gssapi_context = NULL;
+	g_free(auth->signature_fields);
+	auth->signature_fields = NULL;
+	if (auth->signature_input) {
+		g_string_free(auth->signature_input, TRUE);
+		auth->signature_input = NULL;
+	}
+}
+
+/* constant part of the signature input string for this registration */
+static const gchar *auth_signature_fields(struct sip_auth *auth)
+{
+	if (!auth->signature_fields && !is_empty(auth->realm))
+		auth->signature_fields = g_strdup_printf("<%s><%s>",
+							 auth->realm,
+							 auth->target ? auth->target : "");
+	return(auth->signature_fields);
+}
+
+/* returns signature input string or NULL if message can't be signed */
+static const gchar *auth_signature_input(struct sip_auth *auth,
+					 const struct sipmsg *msg,
+					 const gchar *rand,
+					 const gchar *num)
+{
+	if (!auth->signature_input)
+		auth->signature_input = g_string_sized_new(512);
+
+	return(sipmsg_breakdown_build(auth->signature_input,
+				      auth->version,
+				      msg,
+				      auth->protocol,
+				      auth_signature_fields(auth),
+				      rand,
+				      num) ?
+	       auth->signature_input->str : NULL);
 }
 
 static void sipe_make_signature(struct sipe_core_private *sipe_private,
 				struct sipmsg *msg)
 {
 	struct sip_transport *transport = sipe_private->transport;
-	if (sip_sec_context_is_ready(transport->registrar.gssapi_context)) {
-		struct sipmsg_breakdown msgbd;
-		gchar *signature_input_str;
-		msgbd.msg = msg;
-		sipmsg_breakdown_parse(&msgbd, transport->registrar.realm, transport->registrar.target,
-				       transport->registrar.protocol);
-		msgbd.rand = g_strdup_printf("%08x", g_random_int());
-		transport->registrar.ntlm_num++;
-		msgbd.num = g_strdup_printf("%d", transport->registrar.ntlm_num);
-		signature_input_str = sipmsg_breakdown_get_string(transport->registrar.version, &msgbd);
+	struct sip_auth *auth = &transport->registrar;
+	if (sip_sec_context_is_ready(auth->gssapi_context)) {
+		gchar *rand = g_strdup_printf("%08x", g_random_int());
+		gchar *num  = g_strdup_printf("%d", ++auth->ntlm_num);
+		const gchar *signature_input_str = auth_signature_input(auth,
+									msg,
+									rand,
+									num);
 		if (signature_input_str != NULL) {
-			char *signature_hex = sip_sec_make_signature(transport->registrar.gssapi_context, signature_input_str);
+			char *signature_hex = sip_sec_make_signature(auth->gssapi_context, signature_input_str);
 			g_free(msg->signature);
 			msg->signature = signature_hex;
 			g_free(msg->rand);
-			msg->rand = g_strdup(msgbd.rand);
+			msg->rand = rand;
 			g_free(msg->num);
-			msg->num = g_strdup(msgbd.num);
-			g_free(signature_input_str);
+			msg->num = num;
+		} else {
+			g_free(num);
+			g_free(rand);
 		}
-		sipmsg_breakdown_free(&msgbd);
 	}
 }
 
@@ -401,6 +473,10 @@ static void fill_auth(const gchar *hdr, struct sip_auth *auth)
 {
 	const gchar *param;
 
+	/* realm and/or target might change */
+	g_free(auth->signature_fields);
+	auth->signature_fields = NULL;
+
 	/* skip authentication identifier */
 	hdr = strchr(hdr, ' ');
 	if (!hdr) {
@@ -559,25 +635,291 @@ static const gchar *sip_transport_user_agent(struct sipe_core_private *sipe_priv
  * the timestamp for keepalive tracking.
  */
 static void send_sip_message(struct sip_transport *transport,
-			     const gchar *string)
+			     const gchar *header,
+			     const gchar *body,
+			     gsize body_length)
+{
+	struct sipe_transport_segment segments[2];
+
+	sipe_debug_message(SIPE_DEBUG_SUBSYSTEM_SIP, header, body_length ? body : NULL, TRUE);
+	transport->last_message   = sipe_utils_monotonic_sec();
+	transport->keepalive_last = FALSE;
+
+	if (transport->compress_tx) {
+		GByteArray *frames = g_byte_array_new();
+
+		sipe_sipcomp_compress(transport->compress_tx,
+				      (const guchar *) header,
+				      strlen(header),
+				      frames);
+		if (body_length)
+			sipe_sipcomp_compress(transport->compress_tx,
+					      (const guchar *) body,
+					      body_length,
+					      frames);
+		segments[0].data   = (const gchar *) frames->data;
+		segments[0].length = frames->len;
+		sipe_backend_transport_message_iov(transport->connection,
+						   segments,
+						   1);
+		g_byte_array_free(frames, TRUE);
+		return;
+	}
+
+	/* body is sent from where it is, i.e. without copying it */
+	segments[0].data   = header;
+	segments[0].length = strlen(header);
+	segments[1].data   = body;
+	segments[1].length = body_length;
+	sipe_backend_transport_message_iov(transport->connection,
+					   segments,
+					   body_length ? 2 : 1);
+}
+
+/*
+ * Outbound priority
+ *
+ * Bulk requests (SUBSCRIBE, SERVICE, PUBLISH) are only handed to the
+ * backend while its output queue is short. Everything else, e.g. IMs,
+ * ACKs, responses and keepalives, goes out immediately and therefore
+ * waits behind at most SIP_QUEUE_WATERMARK bytes of bulk traffic.
+ *
+ * Messages of the same dialog are never reordered: an interactive message
+ * first pushes out all queued bulk messages with the same Call-ID.
+ */
+#define SIP_QUEUE_WATERMARK 16384 /* bytes */
+#define SIP_QUEUE_POLL         20 /* milliseconds */
+#define SIP_QUEUE_ACTION    "<+send-queue>"
+
+/*
+ * Rate limiting
+ *
+ * Each bulk method has a token bucket. Front Ends reject bursts that are
+ * too large with 503 and Retry-After, or with a throttling reason in
+ * ms-diagnostics. Such a response pauses all bulk traffic for the given
+ * time, halves the rate of the method and puts the request back at the
+ * front of the queue, i.e. the callback never sees the rejection. Every
+ * SIP_RATE_RECOVERY accepted requests raise the rate by one again, up to
+ * the default.
+ *
+ * NOTE: default rates are a guess. Needs more testing!
+ */
+#define SIP_RATE_RECOVERY     20 /* accepted requests */
+#define SIP_THROTTLE_DEFAULT   5 /* seconds, without Retry-After */
+#define SIP_THROTTLE_RETRIES   3
+
+struct sip_rate_bucket {
+	const gchar *method;
+	guint default_rate;  /* requests per second */
+	guint burst;
+	guint rate;
+	guint accepted;      /* since last rate change */
+	gint64 tokens;       /* in 1/1000 requests */
+	gint64 refilled;     /* sipe_utils_monotonic_msec() */
+};
+
+static const struct sip_rate_bucket sip_rate_defaults[] = {
+	{ "SUBSCRIBE", 20, 40, 0, 0, 0, 0 },
+	{ "SERVICE",   10, 20, 0, 0, 0, 0 },
+	{ "PUBLISH",    5, 10, 0, 0, 0, 0 },
+	{ NULL,         0,  0, 0, 0, 0, 0 }
+};
+
+static struct sip_rate_bucket *sip_rate_buckets_new(void)
+{
+	struct sip_rate_bucket *buckets = g_memdup(sip_rate_defaults,
+						   sizeof(sip_rate_defaults));
+	struct sip_rate_bucket *bucket;
+
+	for (bucket = buckets; bucket->method; bucket++) {
+		bucket->rate   = bucket->default_rate;
+		bucket->tokens = bucket->burst * 1000;
+	}
+
+	return(buckets);
+}
+
+/* NULL: method is not rate limited, i.e. not a bulk request */
+static struct sip_rate_bucket *sip_rate_bucket(struct sip_transport *transport,
+					       const struct sipmsg *msg)
+{
+	struct sip_rate_bucket *bucket;
+
+	if (msg->response != 0)
+		return(NULL);
+	for (bucket = transport->buckets; bucket->method; bucket++)
+		if (sipe_strequal(msg->method, bucket->method))
+			return(bucket);
+	return(NULL);
+}
+
+/* returns milliseconds until a request can be sent, 0 for now */
+static guint sip_rate_wait(struct sip_transport *transport,
+			   struct sip_rate_bucket *bucket)
+{
+	gint64 now = sipe_utils_monotonic_msec();
+
+	if (transport->throttled_until > now)
+		return(transport->throttled_until - now);
+
+	bucket->tokens  += (now - bucket->refilled) * bucket->rate;
+	bucket->refilled = now;
+	if (bucket->tokens > bucket->burst * 1000)
+		bucket->tokens = bucket->burst * 1000;
+
+	if (bucket->tokens >= 1000)
+		return(0);
+	return((1000 - bucket->tokens) / bucket->rate + 1);
+}
+
+static void sip_rate_accepted(struct sip_rate_bucket *bucket)
+{
+	if ((bucket->rate < bucket->default_rate) &&
+	    (++bucket->accepted >= SIP_RATE_RECOVERY)) {
+		bucket->rate++;
+		bucket->accepted = 0;
+	}
+}
+
+struct queued_message {
+	struct sip_rate_bucket *bucket;
+	gchar *call_id;
+	gchar *header;
+	gchar *body;
+	gsize body_length;
+};
+
+static void queued_message_send(struct sip_transport *transport,
+				struct queued_message *queued)
+{
+	queued->bucket->tokens -= 1000;
+	send_sip_message(transport,
+			 queued->header,
+			 queued->body,
+			 queued->body_length);
+	g_free(queued->body);
+	g_free(queued->header);
+	g_free(queued->call_id);
+	g_free(queued);
+}
+
+static void send_queue_flush(struct sip_transport *transport,
+			     const gchar *call_id)
+{
+	GList *entry = transport->bulk_queue->head;
+
+	while (entry) {
+		GList *next = entry->next;
+		struct queued_message *queued = entry->data;
+
+		if (!call_id || sipe_strcase_equal(queued->call_id, call_id)) {
+			g_queue_delete_link(transport->bulk_queue, entry);
+			queued_message_send(transport, queued);
+		}
+		entry = next;
+	}
+}
+
+static void send_queue_drain(struct sipe_core_private *sipe_private,
+			     SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	guint wait = SIP_QUEUE_POLL;
+
+	if (!transport)
+		return;
+
+	while (!g_queue_is_empty(transport->bulk_queue)) {
+		struct queued_message *queued = g_queue_peek_head(transport->bulk_queue);
+
+		/* backends have no "drained" notification */
+		if (sipe_backend_transport_pending(transport->connection) >= SIP_QUEUE_WATERMARK)
+			break;
+		if ((wait = sip_rate_wait(transport, queued->bucket)) != 0)
+			break;
+
+		queued_message_send(transport,
+				    g_queue_pop_head(transport->bulk_queue));
+		wait = SIP_QUEUE_POLL;
+	}
+
+	if (!g_queue_is_empty(transport->bulk_queue))
+		sipe_schedule_mseconds(sipe_private,
+				       SIP_QUEUE_ACTION,
+				       NULL,
+				       MAX(wait, SIP_QUEUE_POLL),
+				       send_queue_drain,
+				       NULL);
+}
+
+static void send_queue_add(struct sipe_core_private *sipe_private,
+			   struct sip_rate_bucket *bucket,
+			   const struct sipmsg *msg,
+			   gchar *header,
+			   gboolean front)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	struct queued_message *queued = g_new(struct queued_message, 1);
+
+	queued->bucket      = bucket;
+	queued->call_id     = g_strdup(sipmsg_find_header(msg, "Call-ID"));
+	queued->header      = header;
+	queued->body_length = msg->body ? msg->bodylen : 0;
+	queued->body        = g_memdup(msg->body, queued->body_length);
+	if (front)
+		g_queue_push_head(transport->bulk_queue, queued);
+	else
+		g_queue_push_tail(transport->bulk_queue, queued);
+
+	if (transport->bulk_queue->length == 1)
+		send_queue_drain(sipe_private, NULL);
+}
+
+static void send_sip_msg(struct sipe_core_private *sipe_private,
+			 const struct sipmsg *msg)
 {
-	sipe_utils_message_debug("SIP", string, NULL, TRUE);
-	transport->last_message = time(NULL);
-	sipe_backend_transport_message(transport->connection, string);
+	struct sip_transport *transport = sipe_private->transport;
+	struct sip_rate_bucket *bucket = sip_rate_bucket(transport, msg);
+	const gchar *call_id = sipmsg_find_header(msg, "Call-ID");
+	gchar *header = sipmsg_header_to_string(msg);
+
+	if (bucket) {
+		if (!g_queue_is_empty(transport->bulk_queue) ||
+		    (sipe_backend_transport_pending(transport->connection) >= SIP_QUEUE_WATERMARK) ||
+		    sip_rate_wait(transport, bucket)) {
+			send_queue_add(sipe_private, bucket, msg, header, FALSE);
+			return;
+		}
+		bucket->tokens -= 1000;
+	}
+
+	/* keep order inside the dialog */
+	if (call_id && !g_queue_is_empty(transport->bulk_queue))
+		send_queue_flush(transport, call_id);
+
+	send_sip_message(transport,
+			 header,
+			 msg->body,
+			 msg->body ? msg->bodylen : 0);
+	g_free(header);
 }
 
 static void start_keepalive_timer(struct sipe_core_private *sipe_private,
 				  guint seconds);
+static void sip_standby_keepalive(struct sip_transport *transport);
 static void keepalive_timeout(struct sipe_core_private *sipe_private,
 			      SIPE_UNUSED_PARAMETER gpointer data)
 {
 	struct sip_transport *transport = sipe_private->transport;
 	if (transport) {
-		guint since_last = time(NULL) - transport->last_message;
+		guint since_last = sipe_utils_monotonic_sec() - transport->last_message;
 		guint restart    = transport->keepalive_timeout;
+
+		sip_standby_keepalive(transport);
 		if (since_last >= restart) {
 			SIPE_DEBUG_INFO("keepalive_timeout: expired %d", restart);
-			send_sip_message(transport, "\r\n\r\n");
+			send_sip_message(transport, "\r\n\r\n", NULL, 0);
+			transport->keepalive_last = TRUE;
 		} else {
 			/* timeout not reached since last message -> reschedule */
 			restart -= since_last;
@@ -586,6 +928,54 @@ static void keepalive_timeout(struct sipe_core_private *sipe_private,
 	}
 }
 
+/*
+ * Adaptive keepalive
+ *
+ * The server tells us the maximum keepalive interval. A NAT device or
+ * firewall between us and the server may drop idle connections earlier.
+ * If a connection is lost right after an idle period, i.e. the last
+ * message sent was a keepalive, the interval is halved. Every successful
+ * re-registration lets the interval grow by 25% again, up to the server
+ * maximum. The learned value survives a connection resume.
+ */
+#define SIP_KEEPALIVE_MIN 15 /* seconds */
+
+static void keepalive_update(struct sip_transport *transport)
+{
+	guint timeout = transport->keepalive_server;
+
+	if (transport->keepalive_learned &&
+	    (transport->keepalive_learned < timeout))
+		timeout = transport->keepalive_learned;
+
+	transport->keepalive_timeout = timeout;
+}
+
+static void keepalive_connection_lost(struct sip_transport *transport)
+{
+	if (transport->keepalive_last &&
+	    (transport->last_input < transport->last_message)) {
+		guint learned = MAX(transport->keepalive_timeout / 2,
+				    SIP_KEEPALIVE_MIN);
+
+		if (learned < transport->keepalive_timeout) {
+			SIPE_DEBUG_INFO("keepalive_connection_lost: lost after %u seconds idle, reducing keepalive interval to %u seconds",
+					transport->keepalive_timeout, learned);
+			transport->keepalive_learned = learned;
+		}
+	}
+}
+
+static void keepalive_connection_alive(struct sip_transport *transport)
+{
+	if (transport->keepalive_learned) {
+		transport->keepalive_learned += transport->keepalive_learned / 4;
+		if (transport->keepalive_learned >= transport->keepalive_server)
+			transport->keepalive_learned = 0;
+		keepalive_update(transport);
+	}
+}
+
 static void start_keepalive_timer(struct sipe_core_private *sipe_private,
 				  guint seconds)
 {
@@ -606,7 +996,7 @@ void sip_transport_response(struct sipe_core_private *sipe_private,
 	gchar *name;
 	gchar *value;
 	GString *outstr = g_string_new("");
-	gchar *contact;
+	const gchar *contact;
 	GSList *tmp;
 	static const gchar *keepers[] = { "To", "From", "Call-ID", "CSeq", "Via", "Record-Route", NULL };
 
@@ -614,7 +1004,6 @@ void sip_transport_response(struct sipe_core_private *sipe_private,
 	contact = get_contact(sipe_private);
 	if (contact) {
 		sipmsg_add_header(msg, "Contact", contact);
-		g_free(contact);
 	}
 
 	if (body) {
@@ -642,70 +1031,70 @@ void sip_transport_response(struct sipe_core_private *sipe_private,
 		g_string_append_printf(outstr, "%s: %s\r\n", name, value);
 		tmp = g_slist_next(tmp);
 	}
-	g_string_append_printf(outstr, "\r\n%s", body ? body : "");
-	send_sip_message(sipe_private->transport, outstr->str);
+	g_string_append(outstr, "\r\n");
+	send_sip_message(sipe_private->transport,
+			 outstr->str,
+			 body,
+			 body ? strlen(body) : 0);
 	g_string_free(outstr, TRUE);
 }
 
 static void transactions_remove(struct sipe_core_private *sipe_private,
 				struct transaction *trans)
 {
-	struct sip_transport *transport = sipe_private->transport;
-	if (transport->transactions) {
-		transport->transactions = g_slist_remove(transport->transactions,
-							 trans);
-		SIPE_DEBUG_INFO("SIP transactions count:%d after removal", g_slist_length(transport->transactions));
-
-		if (trans->msg) sipmsg_free(trans->msg);
-		if (trans->payload) {
-			if (trans->payload->destroy)
-				(*trans->payload->destroy)(trans->payload->data);
-			g_free(trans->payload);
-		}
-		g_free(trans->key);
-		if (trans->timeout_key) {
-			sipe_schedule_cancel(sipe_private, trans->timeout_key);
-			g_free(trans->timeout_key);
-		}
-		g_free(trans);
-	}
-}
-
-static struct transaction *transactions_find(struct sip_transport *transport,
-					     struct sipmsg *msg)
-{
-	GSList *transactions = transport->transactions;
-	const gchar *call_id = sipmsg_find_header(msg, "Call-ID");
-	const gchar *cseq = sipmsg_find_header(msg, "CSeq");
-	gchar *key;
-
-	if (!call_id || !cseq) {
-		SIPE_DEBUG_ERROR_NOFORMAT("transaction_find: no Call-ID or CSeq!");
-		return NULL;
-	}
-
-	key = g_strdup_printf("<%s><%s>", call_id, cseq);
-	while (transactions) {
-		struct transaction *trans = transactions->data;
-		if (!g_ascii_strcasecmp(trans->key, key)) {
-			g_free(key);
-			return trans;
-		}
-		transactions = transactions->next;
-	}
-	g_free(key);
-
-	return NULL;
+	sip_transactions_remove(sipe_private,
+				sipe_private->transport->transactions,
+				trans);
 }
 
 static void transaction_timeout_cb(struct sipe_core_private *sipe_private,
 				   gpointer data)
 {
 	struct transaction *trans = data;
+	sipe_metrics_count(sipe_private, SIPE_METRIC_SIP_TIMEOUTS);
+	sipe_debug_event(SIPE_DEBUG_EVENT_SIP_TIMEOUT,
+			 trans->key,
+			 trans->msg->method,
+			 0,
+			 0,
+			 sipe_utils_monotonic_msec() - trans->sent);
 	(trans->timeout_callback)(sipe_private, trans->msg, trans);
 	transactions_remove(sipe_private, trans);
 }
 
+/* dialog part of the request headers */
+static gchar *request_headers(struct sipe_core_private *sipe_private,
+			      const gchar *ourtag,
+			      const gchar *to,
+			      const gchar *theirtag,
+			      const gchar *theirepid,
+			      const gchar *callid,
+			      const GSList *routes)
+{
+	GString *headers = g_string_new(NULL);
+
+	g_string_append_printf(headers,
+			       "From: <sip:%s>%s%s;epid=%s\r\n"
+			       "To: <%s>%s%s%s%s\r\n"
+			       "Call-ID: %s\r\n",
+			       sipe_private->username,
+			       ourtag ? ";tag=" : "",
+			       ourtag ? ourtag : "",
+			       get_epid(sipe_private),
+			       to,
+			       theirtag ? ";tag=" : "",
+			       theirtag ? theirtag : "",
+			       theirepid ? ";epid=" : "",
+			       theirepid ? theirepid : "",
+			       callid);
+	for (; routes; routes = routes->next)
+		g_string_append_printf(headers,
+				       "Route: %s\r\n",
+				       (const gchar *) routes->data);
+
+	return(g_string_free(headers, FALSE));
+}
+
 struct transaction *sip_transport_request_timeout(struct sipe_core_private *sipe_private,
 						  const gchar *method,
 						  const gchar *url,
@@ -721,28 +1110,15 @@ struct transaction *sip_transport_request_timeout(struct sipe_core_private *sipe
 	char *buf;
 	struct sipmsg *msg;
 	gchar *ourtag    = dialog && dialog->ourtag    ? g_strdup(dialog->ourtag)    : NULL;
-	gchar *theirtag  = dialog && dialog->theirtag  ? g_strdup(dialog->theirtag)  : NULL;
-	gchar *theirepid = dialog && dialog->theirepid ? g_strdup(dialog->theirepid) : NULL;
+	const gchar *theirtag  = dialog && dialog->theirtag  ? dialog->theirtag  : NULL;
+	const gchar *theirepid = dialog && dialog->theirepid ? dialog->theirepid : NULL;
 	gchar *callid    = dialog && dialog->callid    ? g_strdup(dialog->callid)    : gencallid();
 	gchar *branch    = dialog && dialog->callid    ? NULL : genbranch();
-	gchar *route     = g_strdup("");
-	gchar *epid      = get_epid(sipe_private);
+	gchar *headers   = NULL;
+	const gchar *dialog_headers;
 	int cseq         = dialog ? ++dialog->cseq : 1 /* as Call-Id is new in this case */;
 	struct transaction *trans = NULL;
 
-	if (dialog && dialog->routes)
-	{
-		GSList *iter = dialog->routes;
-
-		while(iter)
-		{
-			char *tmp = route;
-			route = g_strdup_printf("%sRoute: %s\r\n", route, (char *)iter->data);
-			g_free(tmp);
-			iter = g_slist_next(iter);
-		}
-	}
-
 	if (!ourtag && !dialog) {
 		ourtag = gentag();
 	}
@@ -757,16 +1133,41 @@ struct transaction *sip_transport_request_timeout(struct sipe_core_private *sipe
 		cseq = ++transport->cseq;
 	}
 
+	/*
+	 * Tags, Call-ID and routes of an established dialog only change
+	 * when sipe_dialog_parse() resets the cached headers.
+	 */
+	if (dialog && dialog->is_established && dialog->callid) {
+		if (!dialog->headers || !sipe_strequal(dialog->headers_to, to)) {
+			sipe_dialog_headers_reset(dialog);
+			dialog->headers    = request_headers(sipe_private,
+							     ourtag,
+							     to,
+							     theirtag,
+							     theirepid,
+							     callid,
+							     dialog->routes);
+			dialog->headers_to = g_strdup(to);
+		}
+		dialog_headers = dialog->headers;
+	} else {
+		dialog_headers = headers = request_headers(sipe_private,
+							   ourtag,
+							   to,
+							   theirtag,
+							   theirepid,
+							   callid,
+							   dialog ? dialog->routes : NULL);
+	}
+
 	buf = g_strdup_printf("%s %s SIP/2.0\r\n"
 			"Via: SIP/2.0/%s %s:%d%s%s\r\n"
-			"From: <sip:%s>%s%s;epid=%s\r\n"
-			"To: <%s>%s%s%s%s\r\n"
+			"%s"
 			"Max-Forwards: 70\r\n"
 			"CSeq: %d %s\r\n"
 			"User-Agent: %s\r\n"
-			"Call-ID: %s\r\n"
-			"%s%s"
-			"Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n%s",
+			"%s"
+			"Content-Length: %" G_GSIZE_FORMAT,
 			method,
 			dialog && dialog->request ? dialog->request : url,
 			TRANSPORT_DESCRIPTOR,
@@ -774,43 +1175,36 @@ struct transaction *sip_transport_request_timeout(struct sipe_core_private *sipe
 			transport->connection->client_port,
 			branch ? ";branch=" : "",
 			branch ? branch : "",
-			sipe_private->username,
-			ourtag ? ";tag=" : "",
-			ourtag ? ourtag : "",
-			epid,
-			to,
-			theirtag ? ";tag=" : "",
-			theirtag ? theirtag : "",
-			theirepid ? ";epid=" : "",
-			theirepid ? theirepid : "",
+			dialog_headers,
 			cseq,
 			method,
 			sip_transport_user_agent(sipe_private),
-			callid,
-			route,
 			addheaders ? addheaders : "",
-			body ? (gsize) strlen(body) : 0,
-			body ? body : "");
-
+			body ? (gsize) strlen(body) : 0);
 
-	//printf ("parsing msg buf:\n%s\n\n", buf);
-	msg = sipmsg_parse_msg(buf);
+	/* body is copied only once: the transaction keeps it for resends */
+	msg = sipmsg_parse_header(buf);
+	msg->body = g_strdup(body ? body : "");
 
 	g_free(buf);
 	g_free(ourtag);
-	g_free(theirtag);
-	g_free(theirepid);
 	g_free(branch);
-	g_free(route);
-	g_free(epid);
+	g_free(headers);
 
 	sign_outgoing_message(sipe_private, msg);
 
+	/* answer last Digest challenge preemptively: saves the 407 round trip */
+	if (transport->proxy_digest) {
+		gchar *auth = sip_sec_digest_state_authorization(transport->proxy_digest,
+								 method,
+								 msg->target);
+		sipmsg_add_header_now(msg, "Proxy-Authorization", auth);
+		g_free(auth);
+	}
+
 	/* The authentication scheme is not ready so we can't send the message.
 	   This should only happen for REGISTER messages. */
 	if (!transport->auth_incomplete) {
-		buf = sipmsg_to_string(msg);
-
 		/* add to ongoing transactions */
 		/* ACK isn't supposed to be answered ever. So we do not keep transaction for it. */
 		if (!sipe_strequal(method, "ACK")) {
@@ -818,6 +1212,9 @@ struct transaction *sip_transport_request_timeout(struct sipe_core_private *sipe
 			trans->callback = callback;
 			trans->msg = msg;
 			trans->key = g_strdup_printf("<%s><%d %s>", callid, cseq, method);
+			trans->sent = sipe_utils_monotonic_msec();
+			/* a duplicate has the same timeout key */
+			sip_transactions_add(sipe_private, transport->transactions, trans);
 			if (timeout_callback) {
 				trans->timeout_callback = timeout_callback;
 				trans->timeout_key = g_strdup_printf("<transaction timeout>%s", trans->key);
@@ -828,13 +1225,16 @@ struct transaction *sip_transport_request_timeout(struct sipe_core_private *sipe
 						      transaction_timeout_cb,
 						      NULL);
 			}
-			transport->transactions = g_slist_append(transport->transactions,
-								 trans);
-			SIPE_DEBUG_INFO("SIP transactions count:%d after addition", g_slist_length(transport->transactions));
 		}
 
-		send_sip_message(transport, buf);
-		g_free(buf);
+		send_sip_msg(sipe_private, msg);
+		sipe_metrics_count(sipe_private, SIPE_METRIC_SIP_REQUESTS);
+		sipe_debug_event(SIPE_DEBUG_EVENT_SIP_REQUEST,
+				 trans ? trans->key : callid,
+				 method,
+				 0,
+				 msg->bodylen,
+				 0);
 	}
 
 	if (!trans) sipmsg_free(msg);
@@ -937,21 +1337,21 @@ struct transaction *sip_transport_service(struct sipe_core_private *sipe_private
 				     callback);
 }
 
-void sip_transport_subscribe(struct sipe_core_private *sipe_private,
-			     const gchar *uri,
-			     const gchar *addheaders,
-			     const gchar *body,
-			     struct sip_dialog *dialog,
-			     TransCallback callback)
+struct transaction *sip_transport_subscribe(struct sipe_core_private *sipe_private,
+					    const gchar *uri,
+					    const gchar *addheaders,
+					    const gchar *body,
+					    struct sip_dialog *dialog,
+					    TransCallback callback)
 {
-	sip_transport_request(sipe_private,
-			      "SUBSCRIBE",
-			      uri,
-			      uri,
-			      addheaders,
-			      body,
-			      dialog,
-			      callback);
+	return(sip_transport_request(sipe_private,
+				     "SUBSCRIBE",
+				     uri,
+				     uri,
+				     addheaders,
+				     body,
+				     dialog,
+				     callback));
 }
 
 void sip_transport_update(struct sipe_core_private *sipe_private,
@@ -994,6 +1394,8 @@ static void do_reauthenticate_cb(struct sipe_core_private *sipe_private,
 	SIPE_DEBUG_INFO_NOFORMAT("do a full reauthentication");
 	sipe_auth_free(&transport->registrar);
 	sipe_auth_free(&transport->proxy);
+	sip_sec_digest_state_free(transport->proxy_digest);
+	transport->proxy_digest = NULL;
 	sipe_schedule_cancel(sipe_private, "<registration>");
 	transport->auth_retry     = TRUE;
 	transport->reregister_set = FALSE;
@@ -1033,6 +1435,8 @@ static void sipe_server_register(struct sipe_core_private *sipe_private,
 				 guint type,
 				 gchar *server_name,
 				 guint server_port);
+static void sip_standby_start(struct sipe_core_private *sipe_private,
+			      gpointer unused);
 
 static gboolean process_register_response(struct sipe_core_private *sipe_private,
 					  struct sipmsg *msg,
@@ -1054,8 +1458,8 @@ static gboolean process_register_response(struct sipe_core_private *sipe_private
 				const gchar *contact_hdr;
 				const gchar *auth_hdr;
 				gchar *gruu = NULL;
-				gchar *uuid;
-				gchar *timeout;
+				const gchar *uuid;
+				const gchar *timeout;
 				const gchar *server_hdr = sipmsg_find_header(msg, "Server");
 
 				if (!transport->reregister_set) {
@@ -1136,7 +1540,6 @@ static gboolean process_register_response(struct sipe_core_private *sipe_private
 						//SIPE_DEBUG_INFO("process_register_response: ignoring contact hdr b/c not right uuid: %s", contact_hdr);
 					}
 				}
-				g_free(uuid);
 
 				g_free(sipe_private->contact);
 				if(gruu) {
@@ -1150,6 +1553,10 @@ static gboolean process_register_response(struct sipe_core_private *sipe_private
 				SIPE_CORE_PRIVATE_FLAG_UNSET(REMOTE_USER);
 				SIPE_CORE_PRIVATE_FLAG_UNSET(BATCHED_SUPPORT);
 
+				/* every response carries the complete list */
+				sipe_utils_slist_free_full(sipe_private->allowed_events, g_free);
+				sipe_private->allowed_events = NULL;
+
                                 while(hdr)
                                 {
 					elem = hdr->data;
@@ -1191,18 +1598,30 @@ static gboolean process_register_response(struct sipe_core_private *sipe_private
 
 				/* subscriptions, done only once */
 				if (!transport->subscribed) {
+					/* show last known buddy list until the server sends it */
+					sipe_roster_cache_load(sipe_private);
 					sipe_subscription_self_events(sipe_private);
 					transport->subscribed = TRUE;
+
+				/* lost connection was replaced: refresh them */
+				} else if (transport->resumed) {
+					SIPE_DEBUG_INFO_NOFORMAT("process_register_response: connection resumed");
+					sipe_subscriptions_resume(sipe_private);
+					transport->resumed = FALSE;
 				}
+				transport->resume_attempts = 0;
+				sip_standby_start(sipe_private, NULL);
 
-				timeout = sipmsg_find_part_of_header(sipmsg_find_header(msg, "ms-keep-alive"),
-								     "timeout=", ";", NULL);
+				timeout = sipmsg_borrow_part_of_header(msg,
+								       sipmsg_find_header(msg, "ms-keep-alive"),
+								       "timeout=", ";", NULL);
 				if (timeout != NULL) {
-					sscanf(timeout, "%u", &transport->keepalive_timeout);
+					sscanf(timeout, "%u", &transport->keepalive_server);
 					SIPE_DEBUG_INFO("process_register_response: server determined keep alive timeout is %u seconds",
-							transport->keepalive_timeout);
-					g_free(timeout);
+							transport->keepalive_server);
 				}
+				keepalive_connection_alive(transport);
+				keepalive_update(transport);
 
 				SIPE_DEBUG_INFO("process_register_response: got 200, removing CSeq: %d", transport->cseq);
 			}
@@ -1433,7 +1852,7 @@ static void do_register(struct sipe_core_private *sipe_private,
 	char *uri;
 	char *to;
 	char *hdr;
-	char *uuid;
+	const gchar *uuid;
 
 	if (!sipe_private->public.sip_domain) return;
 
@@ -1449,6 +1868,10 @@ static void do_register(struct sipe_core_private *sipe_private,
 	transport->deregister      = deregister;
 	transport->auth_incomplete = FALSE;
 
+	/* nothing must be left behind when the connection goes away */
+	if (deregister)
+		send_queue_flush(transport, NULL);
+
 	uuid = get_uuid(sipe_private);
 	hdr = g_strdup_printf("Contact: <sip:%s:%d;transport=%s;ms-opaque=d3470f2e1d>;methods=\"INVITE, MESSAGE, INFO, SUBSCRIBE, OPTIONS, BYE, CANCEL, NOTIFY, ACK, REFER, BENOTIFY\";proxy=replace;+sip.instance=\"<urn:uuid:%s>\"\r\n"
 				    "Supported: gruu-10, adhoclist, msrtc-event-categories, com.microsoft.msrtc.presence\r\n"
@@ -1461,7 +1884,6 @@ static void do_register(struct sipe_core_private *sipe_private,
 			      TRANSPORT_DESCRIPTOR,
 			      uuid,
 			      deregister ? "Expires: 0\r\n" : "");
-	g_free(uuid);
 
 	uri = sip_uri_from_name(sipe_private->public.sip_domain);
 	to = sip_uri_self(sipe_private);
@@ -1492,36 +1914,63 @@ void sip_transport_deregister(struct sipe_core_private *sipe_private)
 	do_register(sipe_private, TRUE);
 }
 
+static void sip_discovery_free(struct sipe_core_private *sipe_private,
+			       struct sipe_transport_connection *keep);
+static void sip_standby_free(struct sip_standby *standby);
+#define SIP_STANDBY_ACTION "<+standby-connect>"
 void sip_transport_disconnect(struct sipe_core_private *sipe_private)
 {
 	struct sip_transport *transport = sipe_private->transport;
 
 	/* transport can be NULL during connection setup */
 	if (transport) {
+		/* tell sip_transport_input() that transport & conn are gone */
+		if (transport->input_valid)
+			*transport->input_valid = FALSE;
+
 		sipe_backend_transport_disconnect(transport->connection);
 
 		sipe_auth_free(&transport->registrar);
 		sipe_auth_free(&transport->proxy);
-
+		sip_sec_digest_state_free(transport->proxy_digest);
+		sip_standby_free(transport->standby);
+
+		if (transport->bulk_queue) {
+			struct queued_message *queued;
+			while ((queued = g_queue_pop_head(transport->bulk_queue)) != NULL) {
+				g_free(queued->body);
+				g_free(queued->header);
+				g_free(queued->call_id);
+				g_free(queued);
+			}
+			g_queue_free(transport->bulk_queue);
+		}
+		g_free(transport->buckets);
+		sipe_sipcomp_free(transport->compress_tx);
+		sipe_sipcomp_free(transport->compress_rx);
+		g_free(transport->plain.buffer);
+
+		if (transport->input_source)
+			g_source_destroy(transport->input_source);
+		sipe_xml_push_free(transport->body_push);
+		g_slist_free_full(transport->arenas,
+				  (GDestroyNotify) sipe_arena_free);
 		g_free(transport->server_name);
 		g_free(transport->server_version);
 		g_free(transport->user_agent);
 
-		while (transport->transactions)
-			transactions_remove(sipe_private,
-					    transport->transactions->data);
+		sip_transactions_free(sipe_private, transport->transactions);
 
 		g_free(transport);
 	}
 
-	sipe_private->transport    = NULL;
-	sipe_private->service_data = NULL;
-	sipe_private->address_data = NULL;
+	sipe_private->transport = NULL;
 
 	sipe_schedule_cancel(sipe_private, "<+keepalive-timeout>");
+	sipe_schedule_cancel(sipe_private, SIP_STANDBY_ACTION);
+	sipe_schedule_cancel(sipe_private, SIP_QUEUE_ACTION);
 
-	if (sipe_private->dns_query)
-		sipe_backend_dns_query_cancel(sipe_private->dns_query);
+	sip_discovery_free(sipe_private, NULL);
 
 }
 
@@ -1535,6 +1984,121 @@ guint sip_transport_port(struct sipe_core_private *sipe_private)
 	return sipe_private->transport->server_port;
 }
 
+const gchar *sip_transport_server_version(struct sipe_core_private *sipe_private)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	return(transport ? transport->server_version : NULL);
+}
+
+guint sip_transport_pending(struct sipe_core_private *sipe_private)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	return(transport ? sip_transactions_count(transport->transactions) : 0);
+}
+
+void sip_transport_memory_usage(struct sipe_core_private *sipe_private,
+				struct sipe_memory_usage *usage)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	const struct sip_auth *auths[2];
+	const GList *entry;
+	guint i;
+
+	if (!transport)
+		return;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sip_transport));
+	if (transport->connection && transport->connection->buffer)
+		SIPE_MEMORY_OBJECT(usage, transport->connection->buffer_length + 1);
+	if (transport->plain.buffer)
+		SIPE_MEMORY_OBJECT(usage, transport->plain.buffer_length + 1);
+	if (transport->compress_tx)
+		SIPE_MEMORY_OBJECT(usage, sipe_sipcomp_size());
+	if (transport->compress_rx)
+		SIPE_MEMORY_OBJECT(usage, sipe_sipcomp_size());
+
+	auths[0] = &transport->registrar;
+	auths[1] = &transport->proxy;
+	for (i = 0; i < G_N_ELEMENTS(auths); i++) {
+		const struct sip_auth *auth = auths[i];
+
+		sipe_metrics_memory_string(usage, auth->realm);
+		sipe_metrics_memory_string(usage, auth->sts_uri);
+		sipe_metrics_memory_string(usage, auth->target);
+		sipe_metrics_memory_string(usage, auth->signature_fields);
+		if (auth->signature_input)
+			SIPE_MEMORY_OBJECT(usage,
+					   sizeof(GString) +
+					   auth->signature_input->allocated_len);
+	}
+
+	sip_transactions_memory_usage(transport->transactions, usage);
+
+	/* requests held back by "Outbound priority" */
+	sipe_metrics_memory_list(usage, g_queue_get_length(transport->bulk_queue));
+	for (entry = transport->bulk_queue->head; entry; entry = entry->next) {
+		const struct queued_message *queued = entry->data;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct queued_message));
+		sipe_metrics_memory_string(usage, queued->call_id);
+		sipe_metrics_memory_string(usage, queued->header);
+		if (queued->body)
+			SIPE_MEMORY_OBJECT(usage, queued->body_length);
+	}
+}
+
+/* returns TRUE if the request has been queued again */
+static gboolean sip_transport_throttled(struct sipe_core_private *sipe_private,
+					struct sipmsg *msg,
+					struct transaction *trans)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	struct sip_rate_bucket *bucket = sip_rate_bucket(transport, trans->msg);
+	const gchar *retry_after = sipmsg_find_header(msg, "Retry-After");
+	guint seconds = SIP_THROTTLE_DEFAULT;
+	gboolean throttled = FALSE;
+	gint64 until;
+
+	/* only bulk requests are retried */
+	if (!bucket || (msg->response < 400) ||
+	    (trans->throttled >= SIP_THROTTLE_RETRIES))
+		return(FALSE);
+
+	if ((msg->response == 503) && retry_after) {
+		seconds   = CLAMP(atoi(retry_after), 1, 300);
+		throttled = TRUE;
+	} else {
+		gchar *reason = sipmsg_get_ms_diagnostics_reason(msg);
+		if (reason) {
+			gchar *lower = g_ascii_strdown(reason, -1);
+			throttled = strstr(lower, "throttl") || strstr(lower, "too busy");
+			g_free(lower);
+			g_free(reason);
+		}
+	}
+	if (!throttled)
+		return(FALSE);
+
+	/* all bulk traffic pauses */
+	until = sipe_utils_monotonic_msec() + seconds * 1000;
+	if (until > transport->throttled_until)
+		transport->throttled_until = until;
+	bucket->rate     = MAX(bucket->rate / 2, 1);
+	bucket->accepted = 0;
+	trans->throttled++;
+
+	SIPE_DEBUG_INFO("sip_transport_throttled: %s rejected with %d, pausing for %u seconds, new rate %u/s",
+			bucket->method, msg->response, seconds, bucket->rate);
+
+	/* retry before anything else that was queued */
+	send_queue_add(sipe_private,
+		       bucket,
+		       trans->msg,
+		       sipmsg_header_to_string(trans->msg),
+		       TRUE);
+	return(TRUE);
+}
+
 static void process_input_message(struct sipe_core_private *sipe_private,
 				  struct sipmsg *msg)
 {
@@ -1546,41 +2110,62 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 			msg->response, method);
 
 	if (msg->response == 0) { /* request */
-		if (sipe_strequal(method, "MESSAGE")) {
+		sipe_metrics_count(sipe_private, SIPE_METRIC_SIP_INCOMING);
+		sipe_debug_event(SIPE_DEBUG_EVENT_SIP_INCOMING,
+				 sipmsg_find_known_header(msg, SIPMSG_HEADER_CALL_ID),
+				 method,
+				 0,
+				 msg->bodylen,
+				 0);
+		switch (msg->method_id) {
+		case SIPMSG_METHOD_MESSAGE:
 			process_incoming_message(sipe_private, msg);
-		} else if (sipe_strequal(method, "NOTIFY")) {
+			break;
+		case SIPMSG_METHOD_NOTIFY:
 			SIPE_DEBUG_INFO_NOFORMAT("send->process_incoming_notify");
 			process_incoming_notify(sipe_private, msg);
 			sip_transport_response(sipe_private, msg, 200, "OK", NULL);
-		} else if (sipe_strequal(method, "BENOTIFY")) {
+			break;
+		case SIPMSG_METHOD_BENOTIFY:
 			SIPE_DEBUG_INFO_NOFORMAT("send->process_incoming_benotify");
 			process_incoming_notify(sipe_private, msg);
-		} else if (sipe_strequal(method, "INVITE")) {
+			break;
+		case SIPMSG_METHOD_INVITE:
 			process_incoming_invite(sipe_private, msg);
-		} else if (sipe_strequal(method, "REFER")) {
+			break;
+		case SIPMSG_METHOD_REFER:
 			process_incoming_refer(sipe_private, msg);
-		} else if (sipe_strequal(method, "OPTIONS")) {
+			break;
+		case SIPMSG_METHOD_OPTIONS:
 			process_incoming_options(sipe_private, msg);
-		} else if (sipe_strequal(method, "INFO")) {
+			break;
+		case SIPMSG_METHOD_INFO:
 			process_incoming_info(sipe_private, msg);
-		} else if (sipe_strequal(method, "ACK")) {
+			break;
+		case SIPMSG_METHOD_ACK:
 			/* ACK's don't need any response */
-		} else if (sipe_strequal(method, "PRACK")) {
+			break;
+		case SIPMSG_METHOD_PRACK:
 			sip_transport_response(sipe_private, msg, 200, "OK", NULL);
-		} else if (sipe_strequal(method, "SUBSCRIBE")) {
+			break;
+		case SIPMSG_METHOD_SUBSCRIBE:
 			/* LCS 2005 sends us these - just respond 200 OK */
 			sip_transport_response(sipe_private, msg, 200, "OK", NULL);
-		} else if (sipe_strequal(method, "CANCEL")) {
+			break;
+		case SIPMSG_METHOD_CANCEL:
 			process_incoming_cancel(sipe_private, msg);
-		} else if (sipe_strequal(method, "BYE")) {
+			break;
+		case SIPMSG_METHOD_BYE:
 			process_incoming_bye(sipe_private, msg);
-		} else {
+			break;
+		default:
 			sip_transport_response(sipe_private, msg, 501, "Not implemented", NULL);
 			notfound = TRUE;
+			break;
 		}
 
 	} else { /* response */
-		struct transaction *trans = transactions_find(transport, msg);
+		struct transaction *trans = sip_transactions_find(transport->transactions, msg);
 		if (trans) {
 			if (msg->response < 200) {
 				/* ignore provisional response */
@@ -1591,13 +2176,18 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 
 			} else if (msg->response == 401) { /* Unauthorized */
 
+				sipe_debug_event(SIPE_DEBUG_EVENT_SIP_AUTH,
+						 trans->key,
+						 trans->msg->method,
+						 msg->response,
+						 msg->bodylen,
+						 sipe_utils_monotonic_msec() - trans->sent);
+
 				if (sipe_strequal(trans->msg->method, "REGISTER")) {
 					/* Expected response during authentication handshake */
 					transport->registrar.retries++;
 					SIPE_DEBUG_INFO("process_input_message: RE-REGISTER CSeq: %d", transport->cseq);
 				} else {
-					gchar *resend;
-
 					/* Are we registered? */
 					if (transport->reregister_set) {
 						SIPE_DEBUG_INFO_NOFORMAT("process_input_message: 401 response to non-REGISTER message. Retrying with new authentication.");
@@ -1614,9 +2204,7 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 					}
 
 					/* Resend request */
-					resend = sipmsg_to_string(trans->msg);
-					send_sip_message(sipe_private->transport, resend);
-					g_free(resend);
+					send_sip_msg(sipe_private, trans->msg);
 
 					/* Transaction not yet completed */
 					trans = NULL;
@@ -1624,6 +2212,13 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 
 			} else if (msg->response == 407) { /* Proxy Authentication Required */
 
+				sipe_debug_event(SIPE_DEBUG_EVENT_SIP_AUTH,
+						 trans->key,
+						 trans->msg->method,
+						 msg->response,
+						 msg->bodylen,
+						 sipe_utils_monotonic_msec() - trans->sent);
+
 				if (transport->proxy.retries++ <= 30) {
 					const gchar *proxy_hdr = sipmsg_find_header(msg, "Proxy-Authenticate");
 
@@ -1631,10 +2226,16 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 						gchar *auth = NULL;
 
 						if (!g_ascii_strncasecmp(proxy_hdr, "Digest", 6)) {
-							auth = sip_sec_digest_authorization(sipe_private,
-											    proxy_hdr + 7,
-											    msg->method,
-											    msg->target);
+							/* new challenge replaces the cached one */
+							SIPE_DEBUG_INFO("process_input_message: proxy Digest challenge%s",
+									sip_sec_digest_stale(proxy_hdr + 7) ? " (stale nonce)" : "");
+							sip_sec_digest_state_free(transport->proxy_digest);
+							transport->proxy_digest = sip_sec_digest_state_new(sipe_private,
+													   proxy_hdr + 7);
+							if (transport->proxy_digest)
+								auth = sip_sec_digest_state_authorization(transport->proxy_digest,
+													  msg->method,
+													  msg->target);
 						} else {
 							guint i;
 
@@ -1654,17 +2255,13 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 						}
 
 						if (auth) {
-							gchar *resend;
-
 							/* replace old proxy authentication with new one */
 							sipmsg_remove_header_now(trans->msg, "Proxy-Authorization");
 							sipmsg_add_header_now(trans->msg, "Proxy-Authorization", auth);
 							g_free(auth);
 
 							/* resend request with proxy authentication */
-							resend = sipmsg_to_string(trans->msg);
-							send_sip_message(sipe_private->transport, resend);
-							g_free(resend);
+							send_sip_msg(sipe_private, trans->msg);
 
 							/* Transaction not yet completed */
 							trans = NULL;
@@ -1676,13 +2273,33 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 				} else
 					SIPE_DEBUG_ERROR_NOFORMAT("process_input_message: too many proxy authentication retries. Giving up.");
 
+			} else if (sip_transport_throttled(sipe_private, msg, trans)) {
+				/* Transaction not yet completed */
+				trans = NULL;
+
 			} else {
+				struct sip_rate_bucket *bucket = sip_rate_bucket(transport,
+										 trans->msg);
+
 				transport->registrar.retries = 0;
 				transport->proxy.retries = 0;
+				if (bucket && (msg->response < 300))
+					sip_rate_accepted(bucket);
 			}
 
 			/* Is transaction completed? */
 			if (trans) {
+				sipe_metrics_count(sipe_private, SIPE_METRIC_SIP_RESPONSES);
+				sipe_metrics_latency(sipe_private,
+						     SIPE_METRIC_SIP_RTT,
+						     trans->sent);
+				sipe_debug_event(SIPE_DEBUG_EVENT_SIP_RESPONSE,
+						 trans->key,
+						 trans->msg->method,
+						 msg->response,
+						 msg->bodylen,
+						 sipe_utils_monotonic_msec() - trans->sent);
+
 				if (trans->callback) {
 					SIPE_DEBUG_INFO_NOFORMAT("process_input_message: we have a transaction callback");
 					/* call the callback to process response */
@@ -1694,7 +2311,7 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 				 * Redirect case: sipe_private->transport is
 				 * the new transport with empty queue
 				 */
-				if (sipe_private->transport->transactions) {
+				if (sip_transactions_count(sipe_private->transport->transactions)) {
 					SIPE_DEBUG_INFO("process_input_message: removing CSeq %d", transport->cseq);
 					transactions_remove(sipe_private, trans);
 				}
@@ -1710,80 +2327,347 @@ static void process_input_message(struct sipe_core_private *sipe_private,
 	}
 }
 
-static void sip_transport_input(struct sipe_transport_connection *conn)
+/*
+ * Each received message allocates its header from an arena. Arenas are
+ * recycled, i.e. in steady state parsing a message costs no allocations
+ * for start line and header fields.
+ */
+#define ARENA_FREE_LIST_MAX 4
+
+static struct sipe_arena *transport_arena_get(struct sip_transport *transport)
 {
-	struct sipe_core_private *sipe_private = conn->user_data;
-	struct sip_transport *transport = sipe_private->transport;
-	gchar *cur = conn->buffer;
+	GSList *entry = transport->arenas;
 
-	/* according to the RFC remove CRLF at the beginning */
-	while (*cur == '\r' || *cur == '\n') {
-		cur++;
+	if (entry) {
+		struct sipe_arena *arena = entry->data;
+		transport->arenas = g_slist_delete_link(entry, entry);
+		return(arena);
 	}
-	if (cur != conn->buffer)
-		sipe_utils_shrink_buffer(conn, cur);
 
-	/* Received a full Header? */
-	transport->processing_input = TRUE;
-	while (transport->processing_input &&
-	       ((cur = strstr(conn->buffer, "\r\n\r\n")) != NULL)) {
-		struct sipmsg *msg;
-		guint remainder;
+	return(sipe_arena_new());
+}
 
-		cur += 2;
-		cur[0] = '\0';
-		msg = sipmsg_parse_header(conn->buffer);
+static void transport_arena_put(struct sip_transport *transport,
+				struct sipe_arena *arena)
+{
+	if (!arena)
+		return;
 
-		cur += 2;
-		remainder = conn->buffer_used - (cur - conn->buffer);
-		if (msg && remainder >= (guint) msg->bodylen) {
-			char *dummy = g_malloc(msg->bodylen + 1);
-			memcpy(dummy, cur, msg->bodylen);
-			dummy[msg->bodylen] = '\0';
-			msg->body = dummy;
-			cur += msg->bodylen;
-			sipe_utils_message_debug("SIP",
-						 conn->buffer,
-						 msg->body,
-						 FALSE);
-			sipe_utils_shrink_buffer(conn, cur);
-		} else {
-			if (msg) {
-				SIPE_DEBUG_INFO("sipe_transport_input: body too short (%d < %d, strlen %d) - ignoring message", remainder, msg->bodylen, (int)strlen(conn->buffer));
-				sipmsg_free(msg);
-                        }
+	if (g_slist_length(transport->arenas) < ARENA_FREE_LIST_MAX)
+		transport->arenas = g_slist_prepend(transport->arenas, arena);
+	else
+		sipe_arena_free(arena);
+}
 
-			/* restore header for next try */
-			cur[-2] = '\r';
-			return;
-		}
+/*
+ * Large XML bodies, that are always parsed into a document by their
+ * consumer, are parsed while they are still being received.
+ */
+#define BODY_PUSH_MIN 65536
 
-		/* Fatal header parse error? */
-		if (msg->response == SIPMSG_RESPONSE_FATAL_ERROR) {
-			/* can't proceed -> drop connection */
-			sipe_backend_connection_error(SIPE_CORE_PUBLIC,
-						      SIPE_CONNECTION_ERROR_NETWORK,
-						      _("Corrupted message received"));
-			transport->processing_input = FALSE;
+static const gchar *const body_push_types[] = {
+	"application/vnd-microsoft-roaming-self+xml",
+	"application/vnd-microsoft-roaming-acls+xml",
+	"text/xml+msrtc.wpending",
+	NULL
+};
 
-		/* Verify the signature before processing it */
-		} else if (sip_sec_context_is_ready(transport->registrar.gssapi_context)) {
-			struct sipmsg_breakdown msgbd;
-			gchar *signature_input_str;
-			gchar *rspauth;
-			msgbd.msg = msg;
-			sipmsg_breakdown_parse(&msgbd, transport->registrar.realm, transport->registrar.target,
-					       transport->registrar.protocol);
-			signature_input_str = sipmsg_breakdown_get_string(transport->registrar.version, &msgbd);
+static void sip_transport_body_push(struct sip_transport *transport,
+				    const struct sipmsg *msg,
+				    const gchar *body,
+				    guint available)
+{
+	if (!transport->body_push) {
+		const gchar *type = sipmsg_find_header(msg, "Content-Type");
+		const gchar *const *entry;
 
-			rspauth = sipmsg_find_part_of_header(sipmsg_find_header(msg, "Authentication-Info"), "rspauth=\"", "\"", NULL);
+		if (!type || (msg->bodylen < BODY_PUSH_MIN))
+			return;
+		for (entry = body_push_types; *entry; entry++)
+			if (g_str_has_prefix(type, *entry))
+				break;
+		if (!*entry)
+			return;
 
-			if (rspauth != NULL) {
-				if (sip_sec_verify_signature(transport->registrar.gssapi_context, signature_input_str, rspauth)) {
-					SIPE_DEBUG_INFO_NOFORMAT("sip_transport_input: signature of incoming message validated");
-					process_input_message(sipe_private, msg);
-					/* transport is invalid after redirect */
-				} else {
+		transport->body_push   = sipe_xml_push_new();
+		transport->body_pushed = 0;
+		if (!transport->body_push)
+			return;
+	}
+
+	sipe_xml_push_feed(transport->body_push,
+			   body + transport->body_pushed,
+			   available - transport->body_pushed);
+	transport->body_pushed = available;
+}
+
+/*
+ * Compression
+ *
+ * With SIPE_CORE_FLAG_SIP_COMPRESSION a NEGOTIATE request offers MS-SIPCOMP
+ * before the first REGISTER. Only TLS connections are compressed. The
+ * server compresses everything after its 200 response, we compress
+ * everything after we have received it. If the server doesn't answer or
+ * rejects the offer the connection stays uncompressed.
+ *
+ * Received frames are decompressed into transport->plain, i.e. the
+ * message parser doesn't need to know about compression.
+ */
+#define SIP_NEGOTIATE_TIMEOUT 10 /* seconds */
+
+static gboolean sip_transport_decompress(struct sip_transport *transport,
+					 struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_connection *plain = &transport->plain;
+	const guchar *data = (const guchar *) conn->buffer;
+	gsize left = conn->buffer_used;
+	const guchar *decompressed;
+	gsize length;
+	gssize used;
+
+	while ((used = sipe_sipcomp_decompress(transport->compress_rx,
+					       data,
+					       left,
+					       &decompressed,
+					       &length)) > 0) {
+		while (length) {
+			gsize space = sipe_core_transport_buffer_reserve(plain);
+			gsize chunk = MIN(space, length);
+
+			/* maximum buffer size reached */
+			if (chunk == 0)
+				return(FALSE);
+
+			memcpy(plain->buffer + plain->buffer_used,
+			       decompressed,
+			       chunk);
+			plain->buffer_used += chunk;
+			decompressed       += chunk;
+			length             -= chunk;
+		}
+		plain->buffer[plain->buffer_used] = '\0';
+
+		data += used;
+		left -= used;
+	}
+
+	if (used < 0) {
+		SIPE_DEBUG_ERROR_NOFORMAT("sip_transport_decompress: corrupted frame");
+		return(FALSE);
+	}
+
+	sipe_utils_shrink_buffer(conn, (const gchar *) data);
+	return(TRUE);
+}
+
+static gboolean sip_standby_input(struct sipe_core_private *sipe_private,
+				  struct sipe_transport_connection *conn);
+
+/*
+ * Input time slices
+ *
+ * After a reconnect the server can deliver hundreds of NOTIFYs with one
+ * read. Processing stops after SIP_INPUT_SLICE_MESSAGES messages or
+ * SIP_INPUT_SLICE_MSEC milliseconds and continues from an idle source,
+ * i.e. other accounts and the UI get their turn. The messages stay in
+ * the input buffer, so their order is never changed.
+ *
+ * Responses to our own transactions don't wait: when the slice is used
+ * up, processing goes on as long as the next message is a response and
+ * yields before the next request.
+ */
+#define SIP_INPUT_SLICE_MESSAGES 50
+#define SIP_INPUT_SLICE_MSEC     20 /* milliseconds */
+
+static void sip_transport_input(struct sipe_transport_connection *conn);
+
+static gboolean sip_transport_input_resume(gpointer data)
+{
+	struct sipe_core_private *sipe_private = data;
+	struct sip_transport *transport = sipe_private->transport;
+
+	transport->input_source  = NULL;
+	transport->input_resumed = TRUE;
+	sip_transport_input(transport->connection);
+
+	return(FALSE);
+}
+
+static gboolean sip_transport_input_is_response(const gchar *start)
+{
+	while (*start == '\r' || *start == '\n')
+		start++;
+	return(g_str_has_prefix(start, "SIP/2.0 "));
+}
+static void sip_transport_input(struct sipe_transport_connection *conn)
+{
+	struct sipe_core_private *sipe_private = conn->user_data;
+	struct sip_transport *transport = sipe_private->transport;
+	struct sipe_transport_connection *in = conn;
+	gboolean valid = TRUE;
+	gboolean yield = FALSE;
+	guint processed = 0;
+	gint64 slice_start;
+	gchar *start;
+	gchar *cur;
+
+	/* nothing of interest arrives on the standby connection */
+	if (sip_standby_input(sipe_private, conn))
+		return;
+
+	/* continuing a time slice is no sign of life from the server */
+	if (transport->input_resumed)
+		transport->input_resumed = FALSE;
+	else
+		transport->last_input = sipe_utils_monotonic_sec();
+	slice_start = sipe_utils_monotonic_msec();
+
+	if (transport->compress_rx) {
+		if (!sip_transport_decompress(transport, conn)) {
+			sipe_backend_connection_error(SIPE_CORE_PUBLIC,
+						      SIPE_CONNECTION_ERROR_NETWORK,
+						      _("Corrupted message received"));
+			return;
+		}
+		in = &transport->plain;
+	}
+
+	/* read cursor: buffer is compacted once after the loop */
+	start = in->buffer;
+
+	/* Received a full Header? */
+	transport->processing_input = TRUE;
+	transport->input_valid      = &valid;
+	while (transport->processing_input) {
+		struct sipe_arena *arena;
+		struct sipmsg *msg;
+		guint remainder;
+
+		/* skip rest of rejected body without looking at it */
+		if (transport->input_discard) {
+			gsize skip = MIN(transport->input_discard,
+					 (gsize) (in->buffer_used - (start - in->buffer)));
+			start                    += skip;
+			transport->input_discard -= skip;
+			if (transport->input_discard)
+				break;
+		}
+
+		/* according to the RFC remove CRLF at the beginning */
+		while (*start == '\r' || *start == '\n') {
+			start++;
+		}
+
+		/* no need to wait for the end of an oversized header */
+		cur = sipe_utils_find_header_end(in, start);
+		if (sipe_limit_exceeded(SIPE_LIMIT_SIP_HEADER_LENGTH,
+					(cur ? cur : in->buffer + in->buffer_used) - start)) {
+			SIPE_DEBUG_ERROR("sip_transport_input: header longer than %" G_GSIZE_FORMAT " bytes",
+					 sipe_limit_get(SIPE_LIMIT_SIP_HEADER_LENGTH));
+			sipe_backend_connection_error(SIPE_CORE_PUBLIC,
+						      SIPE_CONNECTION_ERROR_NETWORK,
+						      _("Corrupted message received"));
+			transport->processing_input = FALSE;
+			break;
+		}
+		if (!cur)
+			break;
+
+		cur += 2;
+		cur[0] = '\0';
+		arena = transport_arena_get(transport);
+		msg = sipmsg_parse_header_arena(start, cur - start, arena);
+		if (!msg)
+			transport_arena_put(transport, arena);
+
+		/* oversized body: drop message, but keep the connection */
+		if (msg &&
+		    (msg->bodylen > 0) &&
+		    (msg->response != SIPMSG_RESPONSE_FATAL_ERROR) &&
+		    sipe_limit_exceeded(SIPE_LIMIT_SIP_BODY, msg->bodylen)) {
+			SIPE_DEBUG_ERROR("sip_transport_input: dropping %s with %d bytes body",
+					 msg->response ? "response" : msg->method,
+					 msg->bodylen);
+			if (msg->response == 0) {
+				sip_transport_response(sipe_private, msg,
+						       413, "Request Entity Too Large",
+						       NULL);
+			} else if (msg->response >= 200) {
+				/* callback won't be called */
+				struct transaction *trans = sip_transactions_find(transport->transactions, msg);
+				if (trans) transactions_remove(sipe_private, trans);
+			}
+			transport->input_discard = msg->bodylen;
+			transport_arena_put(transport,
+					    sipmsg_free_keep_arena(msg));
+
+			start = cur + 2;
+			continue;
+		}
+
+		cur += 2;
+		remainder = in->buffer_used - (cur - in->buffer);
+		if (msg && remainder >= (guint) msg->bodylen) {
+			char *dummy = g_malloc(msg->bodylen + 1);
+			memcpy(dummy, cur, msg->bodylen);
+			dummy[msg->bodylen] = '\0';
+			msg->body = dummy;
+			if (transport->body_push) {
+				sip_transport_body_push(transport,
+							msg,
+							cur,
+							msg->bodylen);
+				msg->xml = sipe_xml_push_finish(transport->body_push);
+				transport->body_push = NULL;
+			}
+			cur += msg->bodylen;
+			sipe_debug_message(SIPE_DEBUG_SUBSYSTEM_SIP,
+					   start,
+					   msg->body,
+					   FALSE);
+			start = cur;
+		} else {
+			if (msg) {
+				SIPE_DEBUG_INFO("sipe_transport_input: body too short (%d < %d, strlen %d) - ignoring message", remainder, msg->bodylen, (int)strlen(start));
+				sip_transport_body_push(transport,
+							msg,
+							cur,
+							remainder);
+				transport_arena_put(transport,
+						    sipmsg_free_keep_arena(msg));
+                        }
+
+			/* restore header for next try */
+			cur[-2] = '\r';
+			break;
+		}
+
+		/* Fatal header parse error? */
+		if (msg->response == SIPMSG_RESPONSE_FATAL_ERROR) {
+			/* can't proceed -> drop connection */
+			sipe_backend_connection_error(SIPE_CORE_PUBLIC,
+						      SIPE_CONNECTION_ERROR_NETWORK,
+						      _("Corrupted message received"));
+			transport->processing_input = FALSE;
+
+		/* Verify the signature before processing it */
+		} else if (sip_sec_context_is_ready(transport->registrar.gssapi_context)) {
+			const gchar *signature_input_str = auth_signature_input(&transport->registrar,
+										msg,
+										NULL,
+										NULL);
+			const gchar *rspauth;
+
+			rspauth = sipmsg_borrow_part_of_header(msg,
+							       sipmsg_find_header(msg, "Authentication-Info"),
+							       "rspauth=\"", "\"", NULL);
+
+			if (rspauth != NULL) {
+				if (sip_sec_verify_signature(transport->registrar.gssapi_context, signature_input_str, rspauth)) {
+					SIPE_DEBUG_INFO_NOFORMAT("sip_transport_input: signature of incoming message validated");
+					process_input_message(sipe_private, msg);
+					/* transport is invalid after redirect */
+				} else {
 					SIPE_DEBUG_INFO_NOFORMAT("sip_transport_input: signature of incoming message is invalid.");
 					sipe_backend_connection_error(SIPE_CORE_PUBLIC,
 								      SIPE_CONNECTION_ERROR_NETWORK,
@@ -1800,68 +2684,319 @@ static void sip_transport_input(struct sipe_transport_connection *conn)
 				if (msg->response >= 200) {
 					/* We are not calling process_input_message(),
 					   so we need to drop the transaction here. */
-					struct transaction *trans = transactions_find(transport, msg);
+					struct transaction *trans = sip_transactions_find(transport->transactions, msg);
 					if (trans) transactions_remove(sipe_private, trans);
 				}
 				SIPE_DEBUG_INFO_NOFORMAT("sip_transport_input: message without authentication data - ignoring");
 			}
-			g_free(signature_input_str);
-
-			g_free(rspauth);
-			sipmsg_breakdown_free(&msgbd);
 		} else {
 			process_input_message(sipe_private, msg);
 		}
 
-		sipmsg_free(msg);
+		arena = sipmsg_free_keep_arena(msg);
 
 		/* Redirect: old content of "transport" & "conn" is no longer valid */
-		transport = sipe_private->transport;
-		conn      = transport->connection;
+		if (!valid) {
+			sipe_arena_free(arena);
+			return;
+		}
+		transport_arena_put(transport, arena);
+
+		/* NEGOTIATE response: the rest of the input is compressed */
+		if (transport->compress_rx && (in == conn))
+			break;
+
+		/* time slice used up: yield before the next request */
+		if (((++processed >= SIP_INPUT_SLICE_MESSAGES) ||
+		     (sipe_utils_monotonic_msec() - slice_start >= SIP_INPUT_SLICE_MSEC)) &&
+		    (start < in->buffer + in->buffer_used) &&
+		    !sip_transport_input_is_response(start)) {
+			yield = TRUE;
+			break;
+		}
+	}
+
+	transport->input_valid = NULL;
+	if (start != in->buffer)
+		sipe_utils_shrink_buffer(in, start);
+
+	if (yield) {
+		SIPE_DEBUG_INFO("sip_transport_input: yielding after %u messages, %" G_GSIZE_FORMAT " bytes left",
+				processed, in->buffer_used);
+		if (!transport->input_source)
+			transport->input_source = sipe_utils_timeout_add(SIPE_CORE_PUBLIC->context,
+									 0,
+									 sip_transport_input_resume,
+									 sipe_private);
+		return;
 	}
+
+	if (transport->compress_rx && (in == conn) && conn->buffer_used)
+		sip_transport_input(conn);
 }
 
-static void sip_transport_connected(struct sipe_transport_connection *conn)
+static void sip_discovery_won(struct sipe_core_private *sipe_private,
+			      struct sipe_transport_connection *conn);
+static gboolean sip_standby_connected(struct sipe_core_private *sipe_private,
+				      struct sipe_transport_connection *conn);
+
+static gboolean process_negotiate_response(struct sipe_core_private *sipe_private,
+					   struct sipmsg *msg,
+					   SIPE_UNUSED_PARAMETER struct transaction *trans)
 {
-	struct sipe_core_private *sipe_private = conn->user_data;
 	struct sip_transport *transport = sipe_private->transport;
 
-	sipe_private->service_data = NULL;
-	sipe_private->address_data = NULL;
+	if ((msg->response == 200) &&
+	    sipe_strcase_equal(sipmsg_find_header(msg, "Compression"),
+			       SIPE_SIPCOMP_LZ77_8K)) {
+		SIPE_DEBUG_INFO_NOFORMAT("process_negotiate_response: compression enabled");
+		transport->compress_tx = sipe_sipcomp_new();
+		transport->compress_rx = sipe_sipcomp_new();
+		sipe_core_transport_buffer_reserve(&transport->plain);
+		transport->plain.buffer[0] = '\0';
+	} else {
+		SIPE_DEBUG_INFO("process_negotiate_response: compression not accepted (%d)",
+				msg->response);
+	}
+
+	do_register(sipe_private, FALSE);
+	return(TRUE);
+}
+
+static gboolean negotiate_response_timeout(struct sipe_core_private *sipe_private,
+					   SIPE_UNUSED_PARAMETER struct sipmsg *msg,
+					   SIPE_UNUSED_PARAMETER struct transaction *trans)
+{
+	SIPE_DEBUG_INFO_NOFORMAT("negotiate_response_timeout: no answer, continuing without compression");
+	do_register(sipe_private, FALSE);
+	return(TRUE);
+}
+
+static void sip_transport_negotiate(struct sipe_core_private *sipe_private)
+{
+	gchar *uri = sip_uri_from_name(sipe_private->public.sip_domain);
+
+	sip_transport_request_timeout(sipe_private,
+				      "NEGOTIATE",
+				      uri,
+				      uri,
+				      "Compression: " SIPE_SIPCOMP_LZ77_8K "\r\n",
+				      "",
+				      NULL,
+				      process_negotiate_response,
+				      SIP_NEGOTIATE_TIMEOUT,
+				      negotiate_response_timeout);
+	g_free(uri);
+}
+
+static void sip_transport_start(struct sipe_core_private *sipe_private)
+{
+	struct sip_transport *transport = sipe_private->transport;
 
 	/*
 	 * Initial keepalive timeout during REGISTER phase
 	 *
 	 * NOTE: 60 seconds is a guess. Needs more testing!
 	 */
-	transport->keepalive_timeout = 60;
+	transport->keepalive_server  = 60;
+	keepalive_update(transport);
 	start_keepalive_timer(sipe_private, transport->keepalive_timeout);
 
-	do_register(sipe_private, FALSE);
+	/* overlap HTTP connection setup with REGISTER */
+	sipe_http_prewarm(sipe_private);
+
+	if (SIPE_CORE_PUBLIC_FLAG_IS(SIP_COMPRESSION) &&
+	    sipe_private->public.sip_domain &&
+	    (transport->connection->type == SIPE_TRANSPORT_TLS))
+		sip_transport_negotiate(sipe_private);
+	else
+		do_register(sipe_private, FALSE);
 }
 
-static void resolve_next_service(struct sipe_core_private *sipe_private,
-				 const struct sip_service_data *start);
-static void resolve_next_address(struct sipe_core_private *sipe_private,
-				 gboolean initial);
+static void sip_transport_connected(struct sipe_transport_connection *conn)
+{
+	struct sipe_core_private *sipe_private = conn->user_data;
+
+	if (sip_standby_connected(sipe_private, conn))
+		return;
+
+	/* first successful autodiscovery candidate wins */
+	if (sipe_private->discovery) {
+		sip_discovery_won(sipe_private, conn);
+		if (!sipe_private->transport)
+			return;
+	}
+
+	sip_transport_start(sipe_private);
+}
+
+static gboolean sip_discovery_failed(struct sipe_core_private *sipe_private,
+				     struct sipe_transport_connection *conn,
+				     const gchar *msg);
+static gboolean sip_transport_resume(struct sipe_core_private *sipe_private,
+				     struct sipe_transport_connection *conn,
+				     const gchar *msg);
+static gboolean sip_standby_failed(struct sipe_core_private *sipe_private,
+				   struct sipe_transport_connection *conn,
+				   const gchar *msg);
 static void sip_transport_error(struct sipe_transport_connection *conn,
 				const gchar *msg)
 {
 	struct sipe_core_private *sipe_private = conn->user_data;
 
-	/* This failed attempt was based on a DNS SRV record */
-	if (sipe_private->service_data) {
-		resolve_next_service(sipe_private, NULL);
-	/* This failed attempt was based on a DNS A record */
-	} else if (sipe_private->address_data) {
-		resolve_next_address(sipe_private, FALSE);
-	} else {
+	/* Failed attempt was an autodiscovery candidate: try the others */
+	if (!sip_discovery_failed(sipe_private, conn, msg) &&
+	    /* Standby connection failure doesn't affect the account */
+	    !sip_standby_failed(sipe_private, conn, msg) &&
+	    /* Lost connection after login: try to replace it silently */
+	    !sip_transport_resume(sipe_private, conn, msg)) {
 		sipe_backend_connection_error(SIPE_CORE_PUBLIC,
 					      SIPE_CONNECTION_ERROR_NETWORK,
 					      msg);
 	}
 }
 
+/* server_name must be g_alloc()'ed */
+static struct sip_transport *transport_new(gchar *server_name,
+					   guint server_port)
+{
+	struct sip_transport *transport = g_new0(struct sip_transport, 1);
+
+	transport->auth_retry   = TRUE;
+	transport->transactions = sip_transactions_new();
+	transport->bulk_queue   = g_queue_new();
+	transport->buckets      = sip_rate_buckets_new();
+	transport->server_name  = server_name;
+	transport->server_port  = server_port;
+
+	return(transport);
+}
+
+/*
+ * Fast resume
+ *
+ * A network error after a completed login doesn't tear down the account.
+ * A new connection to the same server replaces the lost one and takes
+ * over the state that doesn't depend on the connection: registrar
+ * security context, server information and REGISTER CSeq. Everything
+ * outside the transport, e.g. EPID, REGISTER Call-ID, roster and
+ * subscription dialogs, is kept anyway. If the server no longer accepts
+ * the security context the normal re-authentication takes place.
+ *
+ * Only after repeated failures the error is reported to the backend,
+ * i.e. the user sees a full reconnect.
+ */
+#define SIP_RESUME_ACTION   "<+transport-resume>"
+#define SIP_RESUME_ATTEMPTS 3
+#define SIP_RESUME_DELAY    2 /* seconds, multiplied by attempt number */
+
+static struct sip_transport *sip_standby_failover(struct sip_transport *old);
+static gboolean sip_standby_ready(struct sip_standby *standby);
+
+static void sip_transport_resume_cb(struct sipe_core_private *sipe_private,
+				    SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sip_transport *old = sipe_private->transport;
+	struct sip_transport *transport;
+	sipe_connect_setup setup = {
+		0,
+		NULL,
+		0,
+		sipe_private,
+		sip_transport_connected,
+		sip_transport_input,
+		sip_transport_error,
+		sipe_private->tls_sessions
+	};
+
+	if (!old)
+		return;
+
+	/* standby connection to another server takes over immediately */
+	transport = sip_standby_failover(old);
+	if (!transport) {
+		transport = transport_new(g_strdup(old->server_name),
+					  old->server_port);
+
+		/* same server: security context is still valid */
+		transport->registrar          = old->registrar;
+		memset(&old->registrar, 0, sizeof(old->registrar));
+		transport->proxy_digest       = old->proxy_digest;
+		old->proxy_digest             = NULL;
+		transport->auth_retry         = old->auth_retry;
+		transport->reauthenticate_set = old->reauthenticate_set;
+		setup.type                    = old->connection->type;
+		setup.server_name             = transport->server_name;
+		setup.server_port             = transport->server_port;
+	}
+	SIPE_DEBUG_INFO("sip_transport_resume_cb: attempt %u to %s:%u",
+			old->resume_attempts + 1,
+			transport->server_name,
+			transport->server_port);
+
+	/* take over connection independent state */
+	transport->server_version     = old->server_version;
+	old->server_version           = NULL;
+	transport->user_agent         = old->user_agent;
+	old->user_agent               = NULL;
+	transport->standby            = old->standby;
+	old->standby                  = NULL;
+	transport->cseq               = old->cseq;
+	transport->keepalive_learned  = old->keepalive_learned;
+	transport->subscribed         = TRUE;
+	transport->resumed            = TRUE;
+	transport->resume_attempts    = old->resume_attempts + 1;
+
+	/* drops pending transactions of the lost connection */
+	sip_transport_disconnect(sipe_private);
+	sipe_private->transport = transport;
+
+	if (transport->connection)
+		/* standby connection is already established */
+		sip_transport_start(sipe_private);
+	else
+		transport->connection = sipe_backend_transport_connect(SIPE_CORE_PUBLIC,
+								       &setup);
+}
+
+static gboolean sip_transport_resume(struct sipe_core_private *sipe_private,
+				     struct sipe_transport_connection *conn,
+				     const gchar *msg)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	guint delay;
+
+	/* only after a completed login and only for the active connection */
+	if (!transport                                          ||
+	    (transport->connection != conn)                     ||
+	    !transport->subscribed                              ||
+	    transport->deregister                               ||
+	    (transport->resume_attempts >= SIP_RESUME_ATTEMPTS) ||
+	    sipe_backend_connection_is_disconnecting(SIPE_CORE_PUBLIC))
+		return(FALSE);
+
+	/* backend may report more than one error for the same connection */
+	if (transport->resume_pending)
+		return(TRUE);
+
+	keepalive_connection_lost(transport);
+
+	/* connection must not be replaced from inside a backend callback */
+	delay = sip_standby_ready(transport->standby) ? 0 :
+		SIP_RESUME_DELAY * (transport->resume_attempts + 1);
+	SIPE_DEBUG_INFO("sip_transport_resume: %s - resuming in %u seconds",
+			msg, delay);
+	transport->resume_pending = TRUE;
+	sipe_schedule_seconds(sipe_private,
+			      SIP_RESUME_ACTION,
+			      NULL,
+			      delay,
+			      sip_transport_resume_cb,
+			      NULL);
+
+	return(TRUE);
+}
+
 /* server_name must be g_alloc()'ed */
 static void sipe_server_register(struct sipe_core_private *sipe_private,
 				 guint type,
@@ -1876,13 +3011,12 @@ static void sipe_server_register(struct sipe_core_private *sipe_private,
 		sipe_private,
 		sip_transport_connected,
 		sip_transport_input,
-		sip_transport_error
+		sip_transport_error,
+		sipe_private->tls_sessions
 	};
-	struct sip_transport *transport = g_new0(struct sip_transport, 1);
+	struct sip_transport *transport = transport_new(server_name,
+							setup.server_port);
 
-	transport->auth_retry   = TRUE;
-	transport->server_name  = server_name;
-	transport->server_port  = setup.server_port;
 	transport->connection   = sipe_backend_transport_connect(SIPE_CORE_PUBLIC,
 								 &setup);
 	sipe_private->transport = transport;
@@ -1953,110 +3087,773 @@ static const struct sip_address_data addresses[] = {
 	{ NULL,             0 }
 };
 
-static void sipe_core_dns_resolved(struct sipe_core_public *sipe_public,
-				   const gchar *hostname, guint port)
+/*
+ * Server autodiscovery
+ *
+ * All DNS SRV and A queries are started at once. The resulting candidates
+ * are connected in priority order, but a new attempt is started every
+ * SIP_CONNECT_STAGGER milliseconds while the previous one hasn't
+ * succeeded or failed yet, i.e. a dead candidate no longer delays the
+ * login by a full connect timeout. The first connection wins and all
+ * other attempts are cancelled.
+ *
+ * Resolved candidates are cached on disk. The next login tries them first
+ * and only falls back to DNS when none of them works.
+ */
+#define SIP_CONNECT_STAGGER  250 /* milliseconds */
+#define SIP_CONNECT_RACE       3 /* parallel connection attempts */
+#define SIP_DNS_CACHE_TTL   3600 /* seconds */
+#define SIP_DNS_CACHE_MAGIC "SIPEDNS1\n"
+#define SIP_CONNECT_ACTION  "<+connect-race>"
+
+struct sip_candidate {
+	struct sip_discovery *discovery;
+	struct sipe_dns_query *query;
+	struct sipe_transport_connection *connection;
+	gchar *server_name;
+	guint server_port;
+	guint type;
+	enum {
+		CANDIDATE_RESOLVING = 0,
+		CANDIDATE_RESOLVED,
+		CANDIDATE_CONNECTING,
+		CANDIDATE_FAILED,
+	} state;
+	gboolean srv;
+};
+
+struct sip_discovery {
+	struct sipe_core_private *sipe_private;
+	GPtrArray *candidates;           /* in priority order */
+	struct sip_candidate *starting;  /* inside backend connect call */
+	gchar *error;                    /* last connection error */
+	guint next;                      /* next candidate to connect */
+	guint connecting;
+	gboolean from_cache;
+	gboolean stagger_pending;
+	gboolean advancing;
+};
+
+static void sip_discovery_start(struct sipe_core_private *sipe_private,
+				gboolean use_cache);
+
+static gchar *sip_dns_cache_filename(struct sipe_core_private *sipe_private)
 {
-	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
-	gboolean service = sipe_private->service_data != NULL;
+	gchar *name = g_strdup(sipe_private->username);
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    "dns",
+				    NULL);
+	g_free(name);
+
+	return(filename);
+}
 
-	sipe_private->dns_query = NULL;
+static struct sip_candidate *sip_candidate_add(struct sip_discovery *discovery,
+					       guint type,
+					       gchar *server_name,
+					       guint server_port)
+{
+	struct sip_candidate *candidate = g_new0(struct sip_candidate, 1);
 
-	if (hostname) {
-		gchar *host;
-		guint type;
+	candidate->discovery   = discovery;
+	candidate->type        = type;
+	candidate->server_name = server_name;
+	candidate->server_port = server_port;
+	g_ptr_array_add(discovery->candidates, candidate);
+
+	return(candidate);
+}
+
+/*
+ * Cache file format: magic line, expiration time, SIP domain, transport
+ * type and then one line per candidate: "<type> <port> <host name>"
+ */
+static gboolean sip_dns_cache_load(struct sip_discovery *discovery)
+{
+	struct sipe_core_private *sipe_private = discovery->sipe_private;
+	gchar *filename = sip_dns_cache_filename(sipe_private);
+	gchar *contents;
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		gchar **lines = NULL;
+
+		if (g_str_has_prefix(contents, SIP_DNS_CACHE_MAGIC))
+			lines = g_strsplit(contents + strlen(SIP_DNS_CACHE_MAGIC),
+					   "\n",
+					   0);
+
+		if (lines && (g_strv_length(lines) > 3) &&
+		    (g_ascii_strtoll(lines[0], NULL, 10) > time(NULL)) &&
+		    sipe_strcase_equal(lines[1], sipe_private->public.sip_domain) &&
+		    (g_ascii_strtoull(lines[2], NULL, 10) == sipe_private->transport_type)) {
+			gchar **line;
+
+			for (line = lines + 3; *line; line++) {
+				guint type, port;
+				gchar host[256];
+
+				if (sscanf(*line, "%u %u %255s", &type, &port, host) == 3) {
+					SIPE_DEBUG_INFO("sip_dns_cache_load: candidate %s:%u",
+							host, port);
+					sip_candidate_add(discovery,
+							  type,
+							  g_strdup(host),
+							  port)->state = CANDIDATE_RESOLVED;
+				}
+			}
+		}
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	g_free(filename);
+
+	return(discovery->candidates->len > 0);
+}
+
+static void sip_dns_cache_save(struct sip_discovery *discovery,
+			       const struct sip_candidate *winner)
+{
+	struct sipe_core_private *sipe_private = discovery->sipe_private;
+	GString *buffer = g_string_new(SIP_DNS_CACHE_MAGIC);
+	gchar *filename;
+	gchar *dirname;
+	guint i;
+
+	g_string_append_printf(buffer, "%" G_GINT64_FORMAT "\n%s\n%u\n",
+			       (gint64) time(NULL) + SIP_DNS_CACHE_TTL,
+			       sipe_private->public.sip_domain,
+			       sipe_private->transport_type);
+
+	/* the winner goes first in the next login */
+	g_string_append_printf(buffer, "%u %u %s\n",
+			       winner->type,
+			       winner->server_port,
+			       winner->server_name);
+	for (i = 0; i < discovery->candidates->len; i++) {
+		const struct sip_candidate *candidate = g_ptr_array_index(discovery->candidates, i);
+		if ((candidate != winner) && candidate->server_name)
+			g_string_append_printf(buffer, "%u %u %s\n",
+					       candidate->type,
+					       candidate->server_port,
+					       candidate->server_name);
+	}
+
+	filename = sip_dns_cache_filename(sipe_private);
+	dirname  = g_path_get_dirname(filename);
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(filename, buffer->str, buffer->len, NULL)))
+		SIPE_DEBUG_ERROR("sip_dns_cache_save: can't write '%s'",
+				 filename);
+	g_free(dirname);
+	g_free(filename);
+	g_string_free(buffer, TRUE);
+}
+
+static void sip_dns_cache_remove(struct sipe_core_private *sipe_private)
+{
+	gchar *filename = sip_dns_cache_filename(sipe_private);
+	g_unlink(filename);
+	g_free(filename);
+}
+
+/* disconnect all but "keep" */
+static void sip_discovery_free(struct sipe_core_private *sipe_private,
+			       struct sipe_transport_connection *keep)
+{
+	struct sip_discovery *discovery = sipe_private->discovery;
+	guint i;
+
+	if (!discovery)
+		return;
+	sipe_private->discovery = NULL;
+
+	if (discovery->stagger_pending)
+		sipe_schedule_cancel(sipe_private, SIP_CONNECT_ACTION);
+
+	for (i = 0; i < discovery->candidates->len; i++) {
+		struct sip_candidate *candidate = g_ptr_array_index(discovery->candidates, i);
+
+		if (candidate->query)
+			sipe_backend_dns_query_cancel(candidate->query);
+		if (candidate->connection && (candidate->connection != keep))
+			sipe_backend_transport_disconnect(candidate->connection);
+		g_free(candidate->server_name);
+		g_free(candidate);
+	}
+	g_ptr_array_free(discovery->candidates, TRUE);
+	g_free(discovery->error);
+	g_free(discovery);
+}
+
+static void sip_discovery_next(struct sip_discovery *discovery,
+			       gboolean force);
+
+static void sip_discovery_stagger(struct sipe_core_private *sipe_private,
+				  SIPE_UNUSED_PARAMETER gpointer data)
+{
+	struct sip_discovery *discovery = sipe_private->discovery;
+
+	if (discovery) {
+		discovery->stagger_pending = FALSE;
+		sip_discovery_next(discovery, TRUE);
+	}
+}
+
+static void sip_discovery_connect(struct sip_discovery *discovery,
+				  struct sip_candidate *candidate)
+{
+	struct sipe_core_private *sipe_private = discovery->sipe_private;
+	sipe_connect_setup setup = {
+		candidate->type,
+		candidate->server_name,
+		(candidate->server_port != 0)           ? candidate->server_port :
+		(candidate->type == SIPE_TRANSPORT_TLS) ? 5061 : 5060,
+		sipe_private,
+		sip_transport_connected,
+		sip_transport_input,
+		sip_transport_error,
+		sipe_private->tls_sessions
+	};
+	struct sipe_transport_connection *connection;
+
+	SIPE_DEBUG_INFO("sip_discovery_connect: trying %s:%d",
+			setup.server_name, setup.server_port);
+
+	candidate->server_port = setup.server_port;
+	candidate->state       = CANDIDATE_CONNECTING;
+	discovery->connecting++;
+
+	/* errors can be reported before the connection is returned */
+	discovery->starting = candidate;
+	connection = sipe_backend_transport_connect(SIPE_CORE_PUBLIC, &setup);
+	discovery->starting = NULL;
+	if (candidate->state == CANDIDATE_CONNECTING)
+		candidate->connection = connection;
+}
+
+static void sip_discovery_next(struct sip_discovery *discovery,
+			       gboolean force)
+{
+	struct sipe_core_private *sipe_private = discovery->sipe_private;
+	GPtrArray *candidates = discovery->candidates;
+
+	/* let running attempts proceed undisturbed for a short time */
+	if (discovery->advancing ||
+	    (discovery->stagger_pending && !force))
+		return;
+	if (discovery->stagger_pending) {
+		sipe_schedule_cancel(sipe_private, SIP_CONNECT_ACTION);
+		discovery->stagger_pending = FALSE;
+	}
+
+	discovery->advancing = TRUE;
+	while ((discovery->connecting < SIP_CONNECT_RACE) &&
+	       (discovery->next < candidates->len)) {
+		struct sip_candidate *candidate = g_ptr_array_index(candidates,
+								    discovery->next);
 
-		if (service) {
-			host = g_strdup(hostname);
-			type = sipe_private->service_data->type;
+		/* higher priority candidate is not resolved yet */
+		if (candidate->state == CANDIDATE_RESOLVING)
+			break;
+
+		discovery->next++;
+		if (candidate->state != CANDIDATE_RESOLVED)
+			continue;
+
+		sip_discovery_connect(discovery, candidate);
+
+		/* still connecting: give it a head start */
+		if (candidate->state == CANDIDATE_CONNECTING) {
+			discovery->stagger_pending = TRUE;
+			sipe_schedule_mseconds(sipe_private,
+					       SIP_CONNECT_ACTION,
+					       NULL,
+					       SIP_CONNECT_STAGGER,
+					       sip_discovery_stagger,
+					       NULL);
+			break;
+		}
+	}
+	discovery->advancing = FALSE;
+
+	/* all candidates have failed */
+	if ((discovery->connecting == 0) &&
+	    (discovery->next >= candidates->len)) {
+		gboolean from_cache = discovery->from_cache;
+		gchar *error = g_strdup(discovery->error);
+
+		sip_discovery_free(sipe_private, NULL);
+		if (from_cache) {
+			SIPE_DEBUG_INFO_NOFORMAT("sip_discovery_next: cached servers failed; trying DNS next");
+			sip_dns_cache_remove(sipe_private);
+			sip_discovery_start(sipe_private, FALSE);
 		} else {
-			/* DNS A resolver returns an IP address */
-			host = g_strdup_printf("%s.%s",
-					       sipe_private->address_data->prefix,
-					       sipe_private->public.sip_domain);
-			port = sipe_private->address_data->port;
-			type = sipe_private->transport_type;
-			if (type == SIPE_TRANSPORT_AUTO)
-				type = SIPE_TRANSPORT_TLS;
+			sipe_backend_connection_error(SIPE_CORE_PUBLIC,
+						      SIPE_CONNECTION_ERROR_NETWORK,
+						      error ? error : _("Could not connect"));
 		}
+		g_free(error);
+	}
+}
 
-		SIPE_DEBUG_INFO("sipe_core_dns_resolved - %s hostname: %s port: %d",
-				service ? "SRV" : "A", hostname, port);
-		sipe_server_register(sipe_private, type, host, port);
-	} else {
-		if (service)
-			resolve_next_service(SIPE_CORE_PRIVATE, NULL);
-		else
-			resolve_next_address(SIPE_CORE_PRIVATE, FALSE);
+static struct sip_candidate *sip_discovery_find(struct sip_discovery *discovery,
+						struct sipe_transport_connection *conn)
+{
+	guint i;
+
+	if (discovery->starting)
+		return(discovery->starting);
+
+	for (i = 0; i < discovery->candidates->len; i++) {
+		struct sip_candidate *candidate = g_ptr_array_index(discovery->candidates, i);
+		if (candidate->connection == conn)
+			return(candidate);
 	}
+	return(NULL);
 }
 
-static void resolve_next_service(struct sipe_core_private *sipe_private,
-				 const struct sip_service_data *start)
+/*
+ * Warm standby
+ *
+ * With SIPE_CORE_FLAG_STANDBY the other servers found by autodiscovery
+ * are remembered. After login a connection to the next one is opened,
+ * but nothing apart from keepalives is sent on it. When the active
+ * connection is lost the standby connection takes over immediately, i.e.
+ * failover only needs REGISTER and the subscription refresh. The next
+ * successful REGISTER opens a new standby connection.
+ */
+#define SIP_STANDBY_RETRY 60 /* seconds */
+
+struct sip_alternate {
+	gchar *server_name;
+	guint server_port;
+	guint type;
+};
+
+struct sip_standby {
+	GPtrArray *alternates;         /* in priority order */
+	guint next;                    /* next alternate to connect */
+	struct sip_alternate *target;  /* of current connection */
+	struct sipe_transport_connection *connection;
+	gint64 last_message;           /* sipe_utils_monotonic_sec() */
+	gboolean starting;             /* inside backend connect call */
+	gboolean connected;
+};
+
+static gboolean sip_alternate_match(const struct sip_alternate *alternate,
+				    guint type,
+				    const gchar *server_name,
+				    guint server_port)
 {
-	if (start) {
-		sipe_private->service_data = start;
-	} else {
-		sipe_private->service_data++;
-		if (sipe_private->service_data->protocol == NULL) {
+	return((alternate->type == type)               &&
+	       (alternate->server_port == server_port) &&
+	       sipe_strcase_equal(alternate->server_name, server_name));
+}
 
-			/* We tried all services */
-			sipe_private->service_data = NULL;
+static struct sip_standby *sip_standby_new(struct sip_discovery *discovery,
+					   const struct sip_candidate *winner)
+{
+	struct sip_standby *standby = g_new0(struct sip_standby, 1);
+	guint i;
+
+	standby->alternates = g_ptr_array_new();
+	for (i = 0; i < discovery->candidates->len; i++) {
+		const struct sip_candidate *candidate = g_ptr_array_index(discovery->candidates, i);
+		struct sip_alternate *alternate;
+		guint j;
+
+		/* only servers which are known to resolve */
+		if (!candidate->server_name ||
+		    ((candidate->state != CANDIDATE_RESOLVED) &&
+		     (candidate->state != CANDIDATE_CONNECTING)))
+			continue;
+
+		for (j = 0; j < standby->alternates->len; j++)
+			if (sip_alternate_match(g_ptr_array_index(standby->alternates, j),
+						candidate->type,
+						candidate->server_name,
+						candidate->server_port))
+				break;
+		if (j < standby->alternates->len)
+			continue;
+
+		alternate = g_new0(struct sip_alternate, 1);
+		alternate->server_name = g_strdup(candidate->server_name);
+		alternate->server_port = candidate->server_port;
+		alternate->type        = candidate->type;
+		g_ptr_array_add(standby->alternates, alternate);
+
+		/* start with the server after the winner */
+		if (candidate == winner)
+			standby->next = standby->alternates->len;
+	}
 
-			/* Try A records list next */
-			SIPE_DEBUG_INFO_NOFORMAT("no SRV records found; trying A records next");
-			resolve_next_address(sipe_private, TRUE);
-			return;
+	/* need at least one other server */
+	if (standby->alternates->len < 2) {
+		SIPE_DEBUG_INFO_NOFORMAT("sip_standby_new: no alternative server found");
+		sip_standby_free(standby);
+		return(NULL);
+	}
+
+	SIPE_DEBUG_INFO("sip_standby_new: %u alternative servers",
+			standby->alternates->len - 1);
+	return(standby);
+}
+
+static void sip_standby_free(struct sip_standby *standby)
+{
+	guint i;
+
+	if (!standby)
+		return;
+
+	if (standby->connection)
+		sipe_backend_transport_disconnect(standby->connection);
+	for (i = 0; i < standby->alternates->len; i++) {
+		struct sip_alternate *alternate = g_ptr_array_index(standby->alternates, i);
+		g_free(alternate->server_name);
+		g_free(alternate);
+	}
+	g_ptr_array_free(standby->alternates, TRUE);
+	g_free(standby);
+}
+
+static gboolean sip_standby_ready(struct sip_standby *standby)
+{
+	return(standby && standby->connected);
+}
+
+static gboolean sip_standby_is(struct sip_standby *standby,
+			       struct sipe_transport_connection *conn)
+{
+	return(standby &&
+	       (standby->starting ||
+		(standby->connection && (standby->connection == conn))));
+}
+
+static void sip_standby_start(struct sipe_core_private *sipe_private,
+			      SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	struct sip_standby *standby = transport ? transport->standby : NULL;
+	sipe_connect_setup setup = {
+		0,
+		NULL,
+		0,
+		sipe_private,
+		sip_transport_connected,
+		sip_transport_input,
+		sip_transport_error,
+		sipe_private->tls_sessions
+	};
+	struct sipe_transport_connection *connection;
+	guint i;
+
+	if (!standby || standby->connection || !transport->connection ||
+	    transport->deregister)
+		return;
+
+	/* next server in the list that isn't the active one */
+	for (i = 0; i < standby->alternates->len; i++) {
+		struct sip_alternate *alternate = g_ptr_array_index(standby->alternates,
+								    standby->next++ % standby->alternates->len);
+		if (!sip_alternate_match(alternate,
+					 transport->connection->type,
+					 transport->server_name,
+					 transport->server_port)) {
+			standby->target = alternate;
+			break;
 		}
 	}
+	if (i == standby->alternates->len)
+		return;
+	standby->next %= standby->alternates->len;
+
+	SIPE_DEBUG_INFO("sip_standby_start: connecting to %s:%u",
+			standby->target->server_name,
+			standby->target->server_port);
+
+	setup.type        = standby->target->type;
+	setup.server_name = standby->target->server_name;
+	setup.server_port = standby->target->server_port;
+
+	/* backend may report an error from inside the connect call */
+	standby->starting = TRUE;
+	connection = sipe_backend_transport_connect(SIPE_CORE_PUBLIC, &setup);
+	if (standby->starting) {
+		standby->starting   = FALSE;
+		standby->connection = connection;
+	}
+}
+
+static gboolean sip_standby_connected(struct sipe_core_private *sipe_private,
+				      struct sipe_transport_connection *conn)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	struct sip_standby *standby = transport ? transport->standby : NULL;
 
-	/* Try to resolve next service */
-	sipe_private->dns_query = sipe_backend_dns_query_srv(
-					SIPE_CORE_PUBLIC,
-					sipe_private->service_data->protocol,
-					sipe_private->service_data->transport,
-					sipe_private->public.sip_domain,
-					(sipe_dns_resolved_cb) sipe_core_dns_resolved,
-					SIPE_CORE_PUBLIC);
+	if (!sip_standby_is(standby, conn))
+		return(FALSE);
+
+	SIPE_DEBUG_INFO("sip_standby_connected: %s:%u ready",
+			standby->target->server_name,
+			standby->target->server_port);
+	standby->connected    = TRUE;
+	standby->last_message = sipe_utils_monotonic_sec();
+	return(TRUE);
 }
 
-static void resolve_next_address(struct sipe_core_private *sipe_private,
-				 gboolean initial)
+static gboolean sip_standby_input(struct sipe_core_private *sipe_private,
+				  struct sipe_transport_connection *conn)
 {
-	gchar *hostname;
+	struct sip_transport *transport = sipe_private->transport;
 
-	if (initial) {
-		sipe_private->address_data = addresses;
-	} else {
-		sipe_private->address_data++;
-		if (sipe_private->address_data->prefix == NULL) {
-			guint type = sipe_private->transport_type;
+	if (!transport ||
+	    (transport->connection == conn) ||
+	    !sip_standby_is(transport->standby, conn))
+		return(FALSE);
 
-			/* We tried all addresss */
-			sipe_private->address_data = NULL;
+	/* unregistered: discard keepalive responses */
+	sipe_utils_shrink_buffer(conn, conn->buffer + conn->buffer_used);
+	return(TRUE);
+}
 
-			/* Try connecting to the SIP hostname directly */
-			SIPE_DEBUG_INFO_NOFORMAT("no SRV or A records found; using SIP domain as fallback");
-			if (type == SIPE_TRANSPORT_AUTO)
-				type = SIPE_TRANSPORT_TLS;
+static gboolean sip_standby_failed(struct sipe_core_private *sipe_private,
+				   struct sipe_transport_connection *conn,
+				   const gchar *msg)
+{
+	struct sip_transport *transport = sipe_private->transport;
+	struct sip_standby *standby = transport ? transport->standby : NULL;
 
-			sipe_server_register(sipe_private, type,
-					     g_strdup(sipe_private->public.sip_domain),
-					     0);
-			return;
+	if (!sip_standby_is(standby, conn))
+		return(FALSE);
+
+	SIPE_DEBUG_INFO("sip_standby_failed: %s:%u: %s - retrying in %u seconds",
+			standby->target->server_name,
+			standby->target->server_port,
+			msg,
+			SIP_STANDBY_RETRY);
+
+	/* backend disconnects a failed connection itself */
+	standby->connection = NULL;
+	standby->connected  = FALSE;
+	standby->starting   = FALSE;
+	sipe_schedule_seconds(sipe_private,
+			      SIP_STANDBY_ACTION,
+			      NULL,
+			      SIP_STANDBY_RETRY,
+			      sip_standby_start,
+			      NULL);
+	return(TRUE);
+}
+
+static void sip_standby_keepalive(struct sip_transport *transport)
+{
+	struct sip_standby *standby = transport->standby;
+
+	/* not a SIP message: doesn't go through send_sip_message() */
+	if (sip_standby_ready(standby) &&
+	    (sipe_utils_monotonic_sec() - standby->last_message >= transport->keepalive_timeout)) {
+		sipe_backend_transport_message(standby->connection, "\r\n\r\n");
+		standby->last_message = sipe_utils_monotonic_sec();
+	}
+}
+
+/* returns new transport using the standby connection or NULL */
+static struct sip_transport *sip_standby_failover(struct sip_transport *old)
+{
+	struct sip_standby *standby = old->standby;
+	struct sip_transport *transport;
+
+	if (!sip_standby_ready(standby))
+		return(NULL);
+
+	SIPE_DEBUG_INFO("sip_standby_failover: switching to %s:%u",
+			standby->target->server_name,
+			standby->target->server_port);
+
+	transport = transport_new(g_strdup(standby->target->server_name),
+				  standby->target->server_port);
+	transport->connection = standby->connection;
+	standby->connection   = NULL;
+	standby->connected    = FALSE;
+
+	return(transport);
+}
+
+/* returns TRUE if the connection was part of the race */
+static gboolean sip_discovery_failed(struct sipe_core_private *sipe_private,
+				     struct sipe_transport_connection *conn,
+				     const gchar *msg)
+{
+	struct sip_discovery *discovery = sipe_private->discovery;
+	struct sip_candidate *candidate;
+
+	if (!discovery ||
+	    ((candidate = sip_discovery_find(discovery, conn)) == NULL))
+		return(FALSE);
+
+	SIPE_DEBUG_INFO("sip_discovery_failed: %s:%d: %s",
+			candidate->server_name, candidate->server_port, msg);
+
+	/* backend disconnects a failed connection itself */
+	candidate->connection = NULL;
+	candidate->state      = CANDIDATE_FAILED;
+	discovery->connecting--;
+	g_free(discovery->error);
+	discovery->error = g_strdup(msg);
+
+	sip_discovery_next(discovery, TRUE);
+	return(TRUE);
+}
+
+static void sip_discovery_won(struct sipe_core_private *sipe_private,
+			      struct sipe_transport_connection *conn)
+{
+	struct sip_discovery *discovery = sipe_private->discovery;
+	struct sip_candidate *candidate = sip_discovery_find(discovery, conn);
+	struct sip_transport *transport;
+
+	if (!candidate)
+		return;
+
+	SIPE_DEBUG_INFO("sip_discovery_won: connected to %s:%d",
+			candidate->server_name, candidate->server_port);
+
+	transport = transport_new(candidate->server_name,
+				  candidate->server_port);
+	if (SIPE_CORE_PUBLIC_FLAG_IS(STANDBY))
+		transport->standby = sip_standby_new(discovery, candidate);
+	candidate->server_name = NULL; /* transport takes ownership */
+	transport->connection  = conn;
+	sipe_private->transport = transport;
+
+	sip_dns_cache_save(discovery, candidate);
+	sip_discovery_free(sipe_private, conn);
+}
+
+static void sip_discovery_resolved(struct sip_candidate *candidate,
+				   const gchar *hostname,
+				   guint port)
+{
+	struct sip_discovery *discovery = candidate->discovery;
+
+	candidate->query = NULL;
+
+	if (hostname) {
+		SIPE_DEBUG_INFO("sip_discovery_resolved - %s hostname: %s port: %d",
+				candidate->srv ? "SRV" : "A", hostname, port);
+
+		/* DNS A resolver returns an IP address: keep host name */
+		if (candidate->srv) {
+			candidate->server_name = g_strdup(hostname);
+			candidate->server_port = port;
 		}
+		candidate->state = CANDIDATE_RESOLVED;
+	} else {
+		candidate->state = CANDIDATE_FAILED;
+		g_free(candidate->server_name);
+		candidate->server_name = NULL;
 	}
 
-	/* Try to resolve next address */
-	hostname = g_strdup_printf("%s.%s",
-				   sipe_private->address_data->prefix,
-				   sipe_private->public.sip_domain);
-	sipe_private->dns_query = sipe_backend_dns_query_a(
-					SIPE_CORE_PUBLIC,
-					hostname,
-					sipe_private->address_data->port,
-					(sipe_dns_resolved_cb) sipe_core_dns_resolved,
-					SIPE_CORE_PUBLIC);
-	g_free(hostname);
+	sip_discovery_next(discovery, discovery->connecting == 0);
+}
+
+static void sip_discovery_query(struct sip_discovery *discovery,
+				struct sip_candidate *candidate,
+				const struct sip_service_data *service)
+{
+	struct sipe_core_private *sipe_private = discovery->sipe_private;
+	struct sipe_dns_query *query;
+
+	/* callback can be called before the query is returned */
+	query = service ?
+		sipe_backend_dns_query_srv(SIPE_CORE_PUBLIC,
+					   service->protocol,
+					   service->transport,
+					   sipe_private->public.sip_domain,
+					   (sipe_dns_resolved_cb) sip_discovery_resolved,
+					   candidate) :
+		sipe_backend_dns_query_a(SIPE_CORE_PUBLIC,
+					 candidate->server_name,
+					 candidate->server_port,
+					 (sipe_dns_resolved_cb) sip_discovery_resolved,
+					 candidate);
+	if (candidate->state == CANDIDATE_RESOLVING) {
+		if (query)
+			candidate->query = query;
+		else
+			candidate->state = CANDIDATE_FAILED;
+	}
+}
+
+static void sip_discovery_start(struct sipe_core_private *sipe_private,
+				gboolean use_cache)
+{
+	struct sip_discovery *discovery = g_new0(struct sip_discovery, 1);
+	guint type = sipe_private->transport_type;
+	const struct sip_service_data *service;
+	const struct sip_address_data *address;
+	guint i, count;
+
+	discovery->sipe_private = sipe_private;
+	discovery->candidates   = g_ptr_array_new();
+	sipe_private->discovery = discovery;
+
+	if (use_cache && sip_dns_cache_load(discovery)) {
+		discovery->from_cache = TRUE;
+		sip_discovery_next(discovery, TRUE);
+		return;
+	}
+
+	if (type == SIPE_TRANSPORT_AUTO)
+		type = SIPE_TRANSPORT_TLS;
+
+	/* Autodiscover using DNS SRV records first... */
+	for (service = services[sipe_private->transport_type];
+	     service->protocol;
+	     service++)
+		sip_candidate_add(discovery,
+				  service->type,
+				  NULL,
+				  0)->srv = TRUE;
+
+	/* ... then DNS A records ... */
+	for (address = addresses; address->prefix; address++)
+		sip_candidate_add(discovery,
+				  type,
+				  g_strdup_printf("%s.%s",
+						  address->prefix,
+						  sipe_private->public.sip_domain),
+				  address->port);
+
+	/* ... and finally the SIP domain itself */
+	sip_candidate_add(discovery,
+			  type,
+			  g_strdup(sipe_private->public.sip_domain),
+			  0)->state = CANDIDATE_RESOLVED;
+
+	/* start all DNS queries at once */
+	discovery->advancing = TRUE;
+	count = discovery->candidates->len - 1;
+	for (i = 0, service = services[sipe_private->transport_type];
+	     i < count;
+	     i++) {
+		struct sip_candidate *candidate = g_ptr_array_index(discovery->candidates, i);
+		sip_discovery_query(discovery,
+				    candidate,
+				    candidate->srv ? service++ : NULL);
+	}
+	discovery->advancing = FALSE;
+
+	sip_discovery_next(discovery, TRUE);
 }
 
 /*
@@ -2080,10 +3877,12 @@ void sipe_core_transport_sip_connect(struct sipe_core_public *sipe_public,
 	sipe_core_backend_initialized(sipe_private, authentication);
 
 	/*
-	 * Initializing the certificate sub-system will trigger the generation
-	 * of a cryptographic key pair which takes time. If we do this after we
+	 * Initializing the certificate sub-system will either restore the
+	 * cached key pair & certificates or trigger the generation of a new
+	 * cryptographic key pair which takes time. If we do this after we
 	 * have connected to the server then there is a risk that we run into a
-	 * SIP connection timeout. So let's get this out of the way now...
+	 * SIP connection timeout. So let's get this started now. Generation
+	 * runs in the background when GLib supports it.
 	 *
 	 * This is currently only needed if the user has selected TLS-DSK.
 	 */
@@ -2107,10 +3906,77 @@ void sipe_core_transport_sip_connect(struct sipe_core_public *sipe_public,
 
 		/* Remember user specified transport type */
 		sipe_private->transport_type = transport;
-		resolve_next_service(sipe_private, services[transport]);
+		sip_discovery_start(sipe_private, TRUE);
 	}
 }
 
+/*
+ * Network change
+ *
+ * After the host network configuration changed the SIP connection may be
+ * dead without the OS noticing it for minutes. Probe it immediately with
+ * an early re-registration. If the server doesn't answer in time the
+ * connection is replaced (see fast resume).
+ */
+#define SIP_PROBE_ACTION  "<+liveness-probe>"
+#define SIP_PROBE_TIMEOUT 10 /* seconds */
+
+static void sip_transport_probe_timeout(struct sipe_core_private *sipe_private,
+					SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sip_transport *transport = sipe_private->transport;
+
+	if (transport && (transport->last_input < transport->probe_sent)) {
+		const gchar *msg = _("Connection lost after network change");
+
+		SIPE_DEBUG_INFO_NOFORMAT("sip_transport_probe_timeout: no response from server");
+		if (!sip_transport_resume(sipe_private, transport->connection, msg))
+			sipe_backend_connection_error(SIPE_CORE_PUBLIC,
+						      SIPE_CONNECTION_ERROR_NETWORK,
+						      msg);
+	}
+}
+
+void sipe_core_transport_sip_network_changed(struct sipe_core_public *sipe_public,
+					     gboolean available)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	struct sip_transport *transport = sipe_private->transport;
+
+	SIPE_DEBUG_INFO("sipe_core_transport_sip_network_changed: network %savailable",
+			available ? "" : "not ");
+
+	/* login in progress has its own timeouts */
+	if (!available || !transport || !transport->subscribed ||
+	    transport->deregister)
+		return;
+
+	/* connection is already being replaced: don't wait any longer */
+	if (transport->resume_pending) {
+		sipe_schedule_seconds(sipe_private,
+				      SIP_RESUME_ACTION,
+				      NULL,
+				      1,
+				      sip_transport_resume_cb,
+				      NULL);
+		return;
+	}
+
+	/* monitors tend to report several changes in a row */
+	if (transport->probe_sent &&
+	    (sipe_utils_monotonic_sec() - transport->probe_sent < SIP_PROBE_TIMEOUT))
+		return;
+
+	transport->probe_sent = sipe_utils_monotonic_sec();
+	do_register(sipe_private, FALSE);
+	sipe_schedule_seconds(sipe_private,
+			      SIP_PROBE_ACTION,
+			      NULL,
+			      SIP_PROBE_TIMEOUT,
+			      sip_transport_probe_timeout,
+			      NULL);
+}
+
 const gchar *sipe_core_transport_sip_server_name(struct sipe_core_public *sipe_public)
 {
 	struct sip_transport *transport = SIPE_CORE_PRIVATE->transport;
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -48,6 +48,8 @@ struct transaction {
 	gchar *timeout_key;
         struct sipmsg *msg;
 	struct transaction_payload *payload;
+	gint64 sent; /* sipe_utils_monotonic_msec() */
+	guint throttled; /* number of times rejected by server throttling */
 };
 
 /* Send SIP response */
@@ -99,18 +101,24 @@ struct transaction *sip_transport_service(struct sipe_core_private *sipe_private
 					  const gchar *addheaders,
 					  const gchar *body,
 					  TransCallback callback);
-void sip_transport_subscribe(struct sipe_core_private *sipe_private,
-			     const gchar *uri,
-			     const gchar *addheaders,
-			     const gchar *body,
-			     struct sip_dialog *dialog,
-			     TransCallback callback);
+struct transaction *sip_transport_subscribe(struct sipe_core_private *sipe_private,
+					    const gchar *uri,
+					    const gchar *addheaders,
+					    const gchar *body,
+					    struct sip_dialog *dialog,
+					    TransCallback callback);
 void sip_transport_update(struct sipe_core_private *sipe_private,
 			  struct sip_dialog *dialog,
 			  TransCallback callback);
 
 /* Misc. SIP transport stuff */
 guint sip_transport_port(struct sipe_core_private *sipe_private);
+guint sip_transport_pending(struct sipe_core_private *sipe_private);
+struct sipe_memory_usage;
+void sip_transport_memory_usage(struct sipe_core_private *sipe_private,
+				struct sipe_memory_usage *usage);
+/* "Server" header from REGISTER response, e.g. "RTC/3.5", or NULL */
+const gchar *sip_transport_server_version(struct sipe_core_private *sipe_private);
 void sip_transport_deregister(struct sipe_core_private *sipe_private);
 void sip_transport_disconnect(struct sipe_core_private *sipe_private);
 void sip_transport_authentication_completed(struct sipe_core_private *sipe_private);
@@ -0,0 +1,549 @@
+/**
+ * @file sipe-alloc-tests.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Allocation budgets for hot paths
+ *
+ * Every workload is run once to warm up the caches (parser contexts,
+ * interned strings, compiled paths). Then the GLib allocations of the
+ * following runs are counted at the C library level and compared
+ * against a budget per run.
+ * A new g_strdup() per header or per XML node exceeds the budget.
+ *
+ * The budgets leave headroom above the current numbers. The measured
+ * numbers are always printed, i.e. tighten the budget when a hot path
+ * has become cheaper.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipe-backend.h"
+#include "sipe-digest.h"
+#include "sipe-metrics.h"
+#include "sipe-mime.h"
+#include "sipe-xml.h"
+#include "sipmsg.h"
+
+/* stub functions for backend API */
+void sipe_backend_debug_literal(sipe_debug_level level,
+				const gchar *msg)
+{
+	printf("DEBUG %d: %s", level, msg);
+}
+void sipe_backend_debug(sipe_debug_level level,
+			const gchar *format,
+			...)
+{
+	va_list args;
+	gchar *msg;
+	va_start(args, format);
+	msg = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	sipe_backend_debug_literal(level, msg);
+	g_free(msg);
+}
+/* debug output would be counted too */
+gboolean sipe_backend_debug_enabled(void)
+{
+	return FALSE;
+}
+
+void sipe_digest_sha1(SIPE_UNUSED_PARAMETER const guchar *data,
+		      SIPE_UNUSED_PARAMETER gsize length,
+		      SIPE_UNUSED_PARAMETER guchar *digest) {}
+const gchar *sipe_backend_network_ip_address(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public) { return(NULL); }
+gchar *sipe_backend_markup_css_property(SIPE_UNUSED_PARAMETER const gchar *style,
+					SIPE_UNUSED_PARAMETER const gchar *option) { return(NULL); }
+void sipe_mime_init(void) {}
+void sipe_mime_shutdown(void) {}
+void sipe_mime_parts_foreach_fallback(SIPE_UNUSED_PARAMETER const gchar *type,
+				      SIPE_UNUSED_PARAMETER const gchar *body,
+				      SIPE_UNUSED_PARAMETER sipe_mime_parts_cb callback,
+				      SIPE_UNUSED_PARAMETER gpointer user_data) {}
+void sipe_metrics_memory_string(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+				SIPE_UNUSED_PARAMETER const gchar *string) {}
+void sipe_metrics_memory_list(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+			      SIPE_UNUSED_PARAMETER guint length) {}
+
+/*
+ * Allocation counter
+ *
+ * GLib ignores g_mem_set_vtable() since 2.46. Count at the C library
+ * level instead: on glibc all allocations, including those made by GLib
+ * and libxml2, go through the interposed functions below.
+ */
+static gboolean counting    = FALSE;
+static guint    allocations = 0;
+static gsize    allocated   = 0;
+
+#if defined(__GLIBC__)
+#define TEST_COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	if (counting) {
+		allocations++;
+		allocated += size;
+	}
+	return(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (counting) {
+		allocations++;
+		allocated += nmemb * size;
+	}
+	return(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting) {
+		allocations++;
+		allocated += size;
+	}
+	return(__libc_realloc(ptr, size));
+}
+#else
+#define TEST_COUNT_ALLOCATIONS 0
+#endif
+
+/* workload input */
+#define NOTIFY_PARTS    200
+#define SUBSCRIBE_USERS 200
+#define UCS_PERSONAS    50
+
+static gchar *register_response;
+static gchar *notify;
+static gchar *subscribe;
+static gchar *ucs_response;
+
+static const gchar *notify_type =
+	"multipart/related;type=\"application/rlmi+xml\";start=resourceList;boundary=batch";
+
+static void build_register_response(void)
+{
+	register_response = g_strdup(
+		"SIP/2.0 200 OK\r\n"
+		"ms-keep-alive: UAS; tcp=no; hop-hop=yes; end-end=no; timeout=300\r\n"
+		"Authentication-Info: TLS-DSK qop=\"auth\", opaque=\"6E2D9B8E\", srand=\"A1F0C3B2\", snum=\"2\", rspauth=\"0123456789abcdef0123456789abcdef01234567\", targetname=\"pool01.example.com\", realm=\"SIP Communications Service\", version=4\r\n"
+		"Via: SIP/2.0/TLS 192.168.0.1:49152;branch=z9hG4bK5a3c0e2f;received=10.0.0.1;ms-received-port=49152;ms-received-cid=2A00\r\n"
+		"From: <sip:alice@example.com>;tag=5a3c0e2f7b;epid=01010101\r\n"
+		"To: <sip:alice@example.com>;tag=A1F0C3B2D4E5F6A7B8C9D0E1F2A3B4C5\r\n"
+		"Call-ID: 2a0f5e3b7c1d4e6f8a9b0c1d2e3f4a5b\r\n"
+		"CSeq: 3 REGISTER\r\n"
+		"Contact: <sip:192.168.0.1:49152;transport=tls;ms-opaque=d3470f2e1d>;expires=7200;+sip.instance=\"<urn:uuid:01010101-0101-0101-0101-010101010101>\";gruu=\"sip:alice@example.com;opaque=user:epid:AbCdEfGhIjKlMnOp;gruu\"\r\n"
+		"Expires: 7200\r\n"
+		"presence-state: register-action=\"added\"\r\n"
+		"Allow-Events: vnd-microsoft-provisioning,vnd-microsoft-roaming-contacts,vnd-microsoft-roaming-ACL,presence,presence.wpending,vnd-microsoft-roaming-self,vnd-microsoft-provisioning-v2\r\n"
+		"Supported: adhoclist\r\n"
+		"Supported: msrtc-event-categories\r\n"
+		"Supported: ms-userservices-state-notification\r\n"
+		"Supported: gruu-10\r\n"
+		"Supported: ms-benotify\r\n"
+		"Server: RTC/5.0\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n");
+}
+
+static void build_notify(void)
+{
+	GString *body = g_string_new("");
+	GString *msg;
+	guint i;
+
+	g_string_append(body,
+			"--batch\r\n"
+			"Content-Transfer-Encoding: binary\r\n"
+			"Content-ID: <resourceList>\r\n"
+			"Content-Type: application/rlmi+xml\r\n"
+			"\r\n"
+			"<list xmlns=\"urn:ietf:params:xml:ns:rlmi\" uri=\"sip:alice@example.com\" version=\"1\" fullState=\"true\">");
+	for (i = 0; i < NOTIFY_PARTS; i++)
+		g_string_append_printf(body,
+				       "<resource uri=\"sip:user%03u@example.com\" name=\"\">"
+				       "<instance id=\"%u\" state=\"active\" cid=\"user%03u@example.com\"/>"
+				       "</resource>",
+				       i, i, i);
+	g_string_append(body, "</list>\r\n");
+
+	for (i = 0; i < NOTIFY_PARTS; i++)
+		g_string_append_printf(body,
+				       "--batch\r\n"
+				       "Content-Transfer-Encoding: binary\r\n"
+				       "Content-ID: <user%03u@example.com>\r\n"
+				       "Content-Type: text/xml+msrtc.pidf\r\n"
+				       "\r\n"
+				       "<presentity uri=\"sip:user%03u@example.com\" xmlns=\"http://schemas.microsoft.com/2002/09/sip/presence\">"
+				       "<availability aggregate=\"3500\" description=\"\"/>"
+				       "<activity aggregate=\"400\" note=\"\"/>"
+				       "<displayName displayName=\"User %03u\"/>"
+				       "<email email=\"user%03u@example.com\"/>"
+				       "</presentity>\r\n",
+				       i, i, i, i);
+	g_string_append(body, "--batch--\r\n");
+
+	msg = g_string_new("");
+	g_string_append_printf(msg,
+			       "NOTIFY sip:192.168.0.1:49152;transport=tls;ms-opaque=d3470f2e1d SIP/2.0\r\n"
+			       "Via: SIP/2.0/TLS 10.0.0.2:5061;branch=z9hG4bK8f2a1e0d\r\n"
+			       "From: <sip:alice@example.com>;tag=C1D2E3F4\r\n"
+			       "To: <sip:alice@example.com>;tag=5a3c0e2f7b;epid=01010101\r\n"
+			       "Call-ID: 7e6d5c4b3a291807\r\n"
+			       "CSeq: 1 NOTIFY\r\n"
+			       "Content-Type: %s\r\n"
+			       "Event: presence\r\n"
+			       "subscription-state: active;expires=28800\r\n"
+			       "ms-piggyback-cseq: 1\r\n"
+			       "Supported: ms-benotify, ms-piggyback-first-notify\r\n"
+			       "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+			       "\r\n",
+			       notify_type,
+			       body->len);
+	g_string_append_len(msg, body->str, body->len);
+	g_string_free(body, TRUE);
+	notify = g_string_free(msg, FALSE);
+}
+
+static void build_subscribe(void)
+{
+	GString *body = g_string_new("");
+	GString *msg;
+	guint i;
+
+	g_string_append(body,
+			"<batchSub xmlns=\"http://schemas.microsoft.com/2006/01/sip/batch-subscribe\" uri=\"sip:alice@example.com\" name=\"\">\n"
+			"<action name=\"subscribe\" id=\"63792024\">\n"
+			"<adhocList>\n");
+	for (i = 0; i < SUBSCRIBE_USERS; i++)
+		g_string_append_printf(body,
+				       "<resource uri=\"sip:user%03u@example.com\"/>\n",
+				       i);
+	g_string_append(body,
+			"</adhocList>\n"
+			"<categoryList xmlns=\"http://schemas.microsoft.com/2006/09/sip/categorylist\">\n"
+			"<category name=\"calendarData\"/>\n"
+			"<category name=\"contactCard\"/>\n"
+			"<category name=\"note\"/>\n"
+			"<category name=\"state\"/>\n"
+			"</categoryList>\n"
+			"</action>\n"
+			"</batchSub>");
+
+	msg = g_string_new("");
+	g_string_append_printf(msg,
+			       "SUBSCRIBE sip:alice@example.com SIP/2.0\r\n"
+			       "Via: SIP/2.0/TLS 192.168.0.1:49152\r\n"
+			       "From: <sip:alice@example.com>;tag=5a3c0e2f7b;epid=01010101\r\n"
+			       "To: <sip:alice@example.com>\r\n"
+			       "Max-Forwards: 70\r\n"
+			       "CSeq: 4 SUBSCRIBE\r\n"
+			       "User-Agent: UCCAPI/15.0.4420.1017 OC/15.0.4420.1017 (Microsoft Lync)\r\n"
+			       "Call-ID: 2a0f5e3b7c1d4e6f8a9b0c1d2e3f4a5c\r\n"
+			       "Require: adhoclist, categoryList\r\n"
+			       "Supported: eventlist\r\n"
+			       "Accept:  application/rlmi+xml, multipart/related, text/xml+msrtc.pidf, application/msrtc-event-categories+xml, application/xpidf+xml, application/pidf+xml\r\n"
+			       "Supported: ms-piggyback-first-notify\r\n"
+			       "Supported: ms-benotify\r\n"
+			       "Proxy-Require: ms-benotify\r\n"
+			       "Event: presence\r\n"
+			       "Content-Type: application/msrtc-adrl-categorylist+xml\r\n"
+			       "Contact: <sip:alice@example.com;opaque=user:epid:AbCdEfGh;gruu>\r\n"
+			       "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+			       "\r\n",
+			       body->len);
+	g_string_append_len(msg, body->str, body->len);
+	g_string_free(body, TRUE);
+	subscribe = g_string_free(msg, FALSE);
+}
+
+static void build_ucs_response(void)
+{
+	GString *xml = g_string_new("");
+	guint i;
+
+	g_string_append(xml,
+			"<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+			"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+			"<s:Header><h:ServerVersionInfo MajorVersion=\"15\" MinorVersion=\"0\" MajorBuildNumber=\"1076\" MinorBuildNumber=\"9\" xmlns:h=\"http://schemas.microsoft.com/exchange/services/2006/types\"/></s:Header>"
+			"<s:Body><GetImItemListResponse ResponseClass=\"Success\" xmlns=\"http://schemas.microsoft.com/exchange/services/2006/messages\">"
+			"<ResponseCode>NoError</ResponseCode>"
+			"<ImItemList xmlns:t=\"http://schemas.microsoft.com/exchange/services/2006/types\">"
+			"<t:Groups><t:ImGroup><t:DisplayName>Colleagues</t:DisplayName><t:GroupType>Normal</t:GroupType>"
+			"<t:ExchangeStoreId Id=\"AAMkAGQ=\"/><t:MemberCorrelationKey>");
+	for (i = 0; i < UCS_PERSONAS; i++)
+		g_string_append_printf(xml,
+				       "<t:ItemId Id=\"AAMkAGQ%03u=\" ChangeKey=\"EQAAABYAAAA%03u\"/>",
+				       i, i);
+	g_string_append(xml,
+			"</t:MemberCorrelationKey></t:ImGroup></t:Groups>"
+			"<t:Personas>");
+	for (i = 0; i < UCS_PERSONAS; i++)
+		g_string_append_printf(xml,
+				       "<t:Persona>"
+				       "<t:PersonaId Id=\"AAQkAGQ%03u=\"/>"
+				       "<t:PersonaType>Person</t:PersonaType>"
+				       "<t:CreationTime>2015-03-04T10:00:00Z</t:CreationTime>"
+				       "<t:DisplayName>User %03u</t:DisplayName>"
+				       "<t:DisplayNameFirstLast>User %03u</t:DisplayNameFirstLast>"
+				       "<t:FileAs>%03u, User</t:FileAs>"
+				       "<t:GivenName>User</t:GivenName>"
+				       "<t:Surname>%03u</t:Surname>"
+				       "<t:CompanyName>Example</t:CompanyName>"
+				       "<t:EmailAddress><t:Name>User %03u</t:Name><t:EmailAddress>user%03u@example.com</t:EmailAddress><t:RoutingType>SMTP</t:RoutingType></t:EmailAddress>"
+				       "<t:ImAddress>sip:user%03u@example.com</t:ImAddress>"
+				       "<t:RelevanceScore>2147483647</t:RelevanceScore>"
+				       "</t:Persona>",
+				       i, i, i, i, i, i, i, i);
+	g_string_append(xml,
+			"</t:Personas></ImItemList></GetImItemListResponse></s:Body></s:Envelope>");
+	ucs_response = g_string_free(xml, FALSE);
+}
+
+/* workloads */
+static void run_register_response(void)
+{
+	struct sipmsg *msg = sipmsg_parse_msg(register_response);
+	sipmsg_find_known_header(msg, SIPMSG_HEADER_CSEQ);
+	sipmsg_find_header(msg, "Authentication-Info");
+	sipmsg_free(msg);
+}
+
+/* same lookups as process_incoming_notify_msrtc() */
+static void notify_presentity(const gchar *body, gsize length)
+{
+	sipe_xml *xn_presentity = sipe_xml_parse(body, length);
+	const sipe_xml *node;
+
+	sipe_xml_attribute(xn_presentity, "uri");
+	if ((node = sipe_xml_child(xn_presentity, "availability")) != NULL)
+		sipe_xml_int_attribute(node, "aggregate", 0);
+	if ((node = sipe_xml_child(xn_presentity, "activity")) != NULL)
+		sipe_xml_int_attribute(node, "aggregate", 0);
+	if ((node = sipe_xml_child(xn_presentity, "displayName")) != NULL)
+		sipe_xml_attribute(node, "displayName");
+	if ((node = sipe_xml_child(xn_presentity, "email")) != NULL)
+		sipe_xml_attribute(node, "email");
+	sipe_xml_free(xn_presentity);
+}
+
+/* same walk as process_incoming_notify_rlmi_resub() */
+static void notify_rlmi(const gchar *body, gsize length)
+{
+	sipe_xml *xn_list = sipe_xml_parse(body, length);
+	const sipe_xml *xn_resource;
+
+	for (xn_resource = sipe_xml_child(xn_list, "resource");
+	     xn_resource;
+	     xn_resource = sipe_xml_twin(xn_resource)) {
+		const sipe_xml *xn_instance = sipe_xml_child(xn_resource, "instance");
+		if (!xn_instance)
+			continue;
+		sipe_xml_attribute(xn_resource, "uri");
+		sipe_xml_attribute(xn_instance, "state");
+	}
+	sipe_xml_free(xn_list);
+}
+
+static void notify_part(gpointer user_data,
+			SIPE_UNUSED_PARAMETER const GSList *fields,
+			const gchar *body,
+			gsize length)
+{
+	gboolean *first = user_data;
+
+	if (*first) {
+		*first = FALSE;
+		notify_rlmi(body, length);
+	} else {
+		notify_presentity(body, length);
+	}
+}
+
+static void run_notify(void)
+{
+	struct sipmsg *msg = sipmsg_parse_msg(notify);
+	gboolean first = TRUE;
+	sipe_mime_parts_foreach(sipmsg_find_known_header(msg, SIPMSG_HEADER_CONTENT_TYPE),
+				msg->body,
+				notify_part,
+				&first);
+	sipmsg_free(msg);
+}
+
+static void run_subscribe(void)
+{
+	struct sipmsg *msg = sipmsg_parse_msg(subscribe);
+	gchar *wire = sipmsg_to_string(msg);
+	g_free(wire);
+	sipmsg_free(msg);
+}
+
+static void run_ucs_response(void)
+{
+	sipe_xml *xml = sipe_xml_parse(ucs_response, strlen(ucs_response));
+	const sipe_xml *node;
+
+	for (node = sipe_xml_child(xml, "Body/GetImItemListResponse/ImItemList/Personas/Persona");
+	     node;
+	     node = sipe_xml_twin(node))
+		sipe_xml_child(node, "ImAddress");
+	sipe_xml_free(xml);
+}
+
+static guint count_headers(const gchar *msg)
+{
+	const gchar *end = strstr(msg, "\r\n\r\n");
+	guint count = 0;
+
+	while ((msg = strstr(msg, "\r\n")) != NULL && msg < end) {
+		msg += 2;
+		count++;
+	}
+	return(count);
+}
+
+/* budgets per run */
+struct workload {
+	const gchar *name;
+	void (*run)(void);
+	guint max_allocations;
+	gsize max_bytes;
+};
+
+#define WORKLOAD_LOOPS 10
+
+static guint succeeded = 0;
+static guint failed    = 0;
+
+static void assert_budget(const struct workload *workload)
+{
+	guint loops;
+	guint per_run_allocations;
+	gsize per_run_bytes;
+
+	/* warm up caches */
+	(*workload->run)();
+
+	allocations = 0;
+	allocated   = 0;
+	counting    = TRUE;
+	for (loops = 0; loops < WORKLOAD_LOOPS; loops++)
+		(*workload->run)();
+	counting    = FALSE;
+
+	per_run_allocations = (allocations + WORKLOAD_LOOPS - 1) / WORKLOAD_LOOPS;
+	per_run_bytes       = (allocated + WORKLOAD_LOOPS - 1) / WORKLOAD_LOOPS;
+
+	printf("%s: %u allocations (budget %u), %" G_GSIZE_FORMAT " bytes (budget %" G_GSIZE_FORMAT ")\n",
+	       workload->name,
+	       per_run_allocations, workload->max_allocations,
+	       per_run_bytes, workload->max_bytes);
+
+	if ((per_run_allocations <= workload->max_allocations) &&
+	    (per_run_bytes <= workload->max_bytes)) {
+		succeeded++;
+	} else {
+		printf("FAILED: %s exceeds allocation budget\n", workload->name);
+		failed++;
+	}
+}
+
+int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char **argv)
+{
+#if !TEST_COUNT_ALLOCATIONS
+	/* automake: test skipped */
+	printf("SKIPPED: allocations can't be counted with this C library\n");
+	return(77);
+#endif
+
+	build_register_response();
+	build_notify();
+	build_subscribe();
+	build_ucs_response();
+
+	{
+		/*
+		 * Messages: one list node per header, i.e. no copies of
+		 * header names or values outside the message arena.
+		 * XML: nodes & attributes are allocated in blocks.
+		 */
+		guint register_headers  = count_headers(register_response);
+		guint subscribe_headers = count_headers(subscribe);
+		gsize notify_length     = strlen(notify);
+		gsize subscribe_length  = strlen(subscribe);
+		gsize ucs_length        = strlen(ucs_response);
+		const struct workload workloads[] = {
+			{ "REGISTER response parse",
+			  run_register_response,
+			  register_headers + 10,
+			  4 * strlen(register_response) + 8192 },
+			{ "rlmi NOTIFY with 200 parts",
+			  run_notify,
+			  count_headers(notify) + 48 + 24 * NOTIFY_PARTS,
+			  4 * notify_length + 8192 * NOTIFY_PARTS },
+			{ "batched SUBSCRIBE for 200 users",
+			  run_subscribe,
+			  subscribe_headers + 16,
+			  4 * subscribe_length + 8192 },
+			{ "UCS GetImItemList response",
+			  run_ucs_response,
+			  16 + ucs_length / 1024,
+			  4 * ucs_length + 16384 },
+		};
+		guint i;
+
+		for (i = 0; i < G_N_ELEMENTS(workloads); i++)
+			assert_budget(workloads + i);
+	}
+
+	g_free(ucs_response);
+	g_free(subscribe);
+	g_free(notify);
+	g_free(register_response);
+	sipe_mime_parts_shutdown();
+	sipe_xml_shutdown();
+
+	printf("Result: %d PASSED %d FAILED\n", succeeded, failed);
+	return(failed);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
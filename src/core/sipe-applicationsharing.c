@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2014-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -39,11 +39,41 @@ extern int X11_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS* pEntryPoints);
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-dialog.h"
+#include "sipe-ft-scheduler.h"
 #include "sipe-media.h"
+#include "sipe-metrics.h"
 #include "sipe-nls.h"
 #include "sipe-user.h"
 #include "sipe-utils.h"
 
+/*
+ * Both directions are relayed through one reusable buffer each. Whatever
+ * a non-blocking send didn't accept stays in the buffer and we stop
+ * reading from the source until the sink becomes writable again.
+ */
+#define APPSHARE_BUFFER_SIZE 0x10000
+
+/*
+ * Presenter: the shadow server only encodes the regions that changed
+ * since the last capture, i.e. the capture rate determines how much
+ * data is produced. It follows the congestion of the ICE stream: halved
+ * when the stream was blocked for more than a quarter of the interval,
+ * raised step by step while the stream keeps up.
+ */
+#define APPSHARE_ADAPT_INTERVAL 1000 /* milliseconds */
+#define APPSHARE_FPS_MIN        2
+#define APPSHARE_FPS_MAX        16   /* FreeRDP X11 subsystem default */
+#define APPSHARE_FPS_STEP       2
+#define APPSHARE_CONGESTED      4    /* 1/4 of the interval */
+
+struct appshare_buffer {
+	guint8 *data;
+	gsize offset;
+	gsize length;
+	gint64 stall_start;
+	guint64 total;
+};
+
 struct sipe_appshare {
 	struct sipe_media_call *media;
 	struct sipe_media_stream *stream;
@@ -51,8 +81,26 @@ struct sipe_appshare {
 	GSocket *socket;
 	GIOChannel *channel;
 	guint source_id;
+	guint out_source_id;
 	guint monitor_id;
+	gboolean connected;
+	gboolean stream_blocked;
+	/* RDP socket -> ICE stream is scheduled with file transfers */
+	struct sipe_ft_flow *flow;
+	/* ICE stream -> RDP socket */
+	struct appshare_buffer to_socket;
+	/* RDP socket -> ICE stream */
+	struct appshare_buffer to_stream;
 	struct sipe_user_ask_ctx *ask_ctx;
+
+	/* presenter: capture rate adaptation */
+	guint adapt_source_id;
+	guint frame_rate;
+	gint64 adapt_start;
+	gint64 blocked;             /* milliseconds in current interval */
+	guint64 adapt_total;
+	guint64 frames;
+	guint bytes_per_frame;
 };
 
 static void
@@ -72,17 +120,29 @@ sipe_appshare_free(struct sipe_appshare *appshare)
 {
 	GError *error = NULL;
 
+	SIPE_DEBUG_INFO("sipe_appshare_free: relayed %" G_GUINT64_FORMAT " bytes to socket, %" G_GUINT64_FORMAT " bytes to stream",
+			appshare->to_socket.total, appshare->to_stream.total);
+
 	/* We must close the shadow server socket before stopping the server
 	 * in order to prevent a deadlock. */
 
-	g_source_destroy(g_main_context_find_source_by_id(NULL,
-							  appshare->source_id));
-
-	g_io_channel_shutdown(appshare->channel, TRUE, &error);
-	g_io_channel_unref(appshare->channel);
+	if (appshare->source_id)
+		g_source_remove(appshare->source_id);
+	if (appshare->out_source_id)
+		g_source_remove(appshare->out_source_id);
+	if (appshare->adapt_source_id)
+		g_source_remove(appshare->adapt_source_id);
+	sipe_ft_flow_free(appshare->flow);
+
+	if (appshare->channel) {
+		g_io_channel_shutdown(appshare->channel, TRUE, &error);
+		g_io_channel_unref(appshare->channel);
+	}
 
-	unlink_appshare_socket(appshare->socket);
-	g_object_unref(appshare->socket);
+	if (appshare->socket) {
+		unlink_appshare_socket(appshare->socket);
+		g_object_unref(appshare->socket);
+	}
 
 	if (appshare->server) {
 		shadow_server_stop(appshare->server);
@@ -94,67 +154,268 @@ sipe_appshare_free(struct sipe_appshare *appshare)
 		sipe_user_close_ask(appshare->ask_ctx);
 	}
 
+	g_free(appshare->to_socket.data);
+	g_free(appshare->to_stream.data);
 	g_free(appshare);
 }
 
 static void
-read_cb(struct sipe_media_call *call, struct sipe_media_stream *stream)
+appshare_stall_start(struct sipe_appshare *appshare,
+		     struct appshare_buffer *buffer)
 {
-	struct sipe_appshare *appshare = sipe_media_stream_get_data(stream);
-	guint8 buffer[0x800];
-	gint bytes_read;
-	gsize bytes_written;
-	GError *error = 0;
+	buffer->stall_start = sipe_utils_monotonic_msec();
+	sipe_metrics_count(sipe_media_get_sipe_core_private(appshare->media),
+			   SIPE_METRIC_APPSHARE_STALLS);
+}
+
+static void
+appshare_stall_end(struct sipe_appshare *appshare,
+		   struct appshare_buffer *buffer)
+{
+	sipe_metrics_latency(sipe_media_get_sipe_core_private(appshare->media),
+			     SIPE_METRIC_APPSHARE_STALL,
+			     buffer->stall_start);
+}
 
-	SIPE_DEBUG_INFO_NOFORMAT("INCOMING APPSHARE DATA");
-	bytes_read = sipe_backend_media_read(call, stream, buffer,
-					     sizeof (buffer), FALSE);
+static void relay_stream_to_socket(struct sipe_appshare *appshare);
 
-	if (bytes_read == 0) {
-		return;
+static gboolean
+socket_writable_cb(SIPE_UNUSED_PARAMETER GIOChannel *channel,
+		   SIPE_UNUSED_PARAMETER GIOCondition condition,
+		   gpointer data)
+{
+	struct sipe_appshare *appshare = data;
+
+	appshare->out_source_id = 0;
+	appshare_stall_end(appshare, &appshare->to_socket);
+	relay_stream_to_socket(appshare);
+
+	return FALSE;
+}
+
+/* returns TRUE when the buffer has been written out completely */
+static gboolean
+flush_to_socket(struct sipe_appshare *appshare)
+{
+	struct appshare_buffer *buffer = &appshare->to_socket;
+	gsize start = buffer->offset;
+
+	while (buffer->offset < buffer->length) {
+		GError *error = NULL;
+		gssize sent = g_socket_send(appshare->socket,
+					    (gchar *) buffer->data + buffer->offset,
+					    buffer->length - buffer->offset,
+					    NULL,
+					    &error);
+
+		if (sent < 0) {
+			if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+				/* resume when the RDP client has caught up */
+				appshare->out_source_id = g_io_add_watch(appshare->channel,
+									 G_IO_OUT,
+									 socket_writable_cb,
+									 appshare);
+				appshare_stall_start(appshare, buffer);
+			} else {
+				/* HUP will be handled by data_in_cb() */
+				SIPE_DEBUG_ERROR("flush_to_socket: %s", error->message);
+				buffer->offset = buffer->length = 0;
+			}
+			g_error_free(error);
+			break;
+		}
+
+		buffer->offset += sent;
 	}
 
-	g_io_channel_write_chars(appshare->channel, (gchar *)buffer,
-				 bytes_read, &bytes_written, &error);
-	if (g_io_channel_flush(appshare->channel, &error) == G_IO_STATUS_ERROR &&
-	    g_error_matches(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_PIPE)) {
-		g_error_free(error);
+	if (buffer->offset > start) {
+		buffer->total += buffer->offset - start;
+		sipe_metrics_add(sipe_media_get_sipe_core_private(appshare->media),
+				 SIPE_METRIC_APPSHARE_BYTES_TO_SOCKET,
+				 buffer->offset - start);
+	}
+
+	if (buffer->offset < buffer->length)
+		return(FALSE);
+
+	buffer->offset = buffer->length = 0;
+	return(TRUE);
+}
+
+static void
+relay_stream_to_socket(struct sipe_appshare *appshare)
+{
+	struct appshare_buffer *buffer = &appshare->to_socket;
+
+	/* Data is left in the ICE stream until we can pass it on */
+	if (!appshare->connected || appshare->out_source_id)
 		return;
+
+	while (flush_to_socket(appshare)) {
+		struct sipe_media_segment segment;
+		gint bytes_read;
+
+		/* collect as much queued data as fits into one socket write */
+		segment.data   = buffer->data;
+		segment.length = APPSHARE_BUFFER_SIZE;
+		bytes_read = sipe_backend_media_read_iov(appshare->media,
+							 appshare->stream,
+							 &segment, 1);
+		if (bytes_read <= 0)
+			break;
+
+		buffer->length = bytes_read;
 	}
+}
 
-	g_assert_no_error(error);
-	g_assert(bytes_read == (gint)bytes_written);
+static void
+read_cb(SIPE_UNUSED_PARAMETER struct sipe_media_call *call,
+	struct sipe_media_stream *stream)
+{
+	relay_stream_to_socket(sipe_media_stream_get_data(stream));
+}
+
+static gboolean data_in_cb(GIOChannel *channel,
+			   GIOCondition condition,
+			   gpointer data);
+
+/* sipe_ft_flow_send callback */
+static gsize
+relay_socket_to_stream(gpointer data, gsize budget)
+{
+	struct sipe_appshare *appshare = data;
+	struct appshare_buffer *buffer = &appshare->to_stream;
+	struct sipe_core_private *sipe_private =
+		sipe_media_get_sipe_core_private(appshare->media);
+	gsize sent = 0;
+
+	while (TRUE) {
+		GError *error = NULL;
+		gssize bytes_read;
+
+		while (buffer->offset < buffer->length) {
+			gint written;
+
+			/* fair share used up for this round */
+			if (sent == budget)
+				return(sent);
+
+			written = sipe_backend_media_write(appshare->media,
+							   appshare->stream,
+							   buffer->data + buffer->offset,
+							   MIN(buffer->length - buffer->offset,
+							       budget - sent),
+							   FALSE);
+			if (written <= 0) {
+				/* stream_writable_cb() wakes us */
+				if (!appshare->stream_blocked) {
+					appshare->stream_blocked = TRUE;
+					appshare_stall_start(appshare, buffer);
+				}
+				return(sent);
+			}
+
+			buffer->offset += written;
+			buffer->total  += written;
+			sent           += written;
+			sipe_metrics_add(sipe_private,
+					 SIPE_METRIC_APPSHARE_BYTES_TO_STREAM,
+					 written);
+		}
+		buffer->offset = buffer->length = 0;
+
+		bytes_read = g_socket_receive(appshare->socket,
+					      (gchar *) buffer->data,
+					      APPSHARE_BUFFER_SIZE,
+					      NULL,
+					      &error);
+		if (bytes_read < 0) {
+			if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+				SIPE_DEBUG_ERROR("relay_socket_to_stream: %s",
+						 error->message);
+			g_error_free(error);
+			break;
+		}
+
+		/* EOF: HUP will be handled by data_in_cb() */
+		if (bytes_read == 0)
+			break;
+
+		buffer->length = bytes_read;
+	}
+
+	/* socket drained: data_in_cb() wakes us */
+	if (!appshare->source_id)
+		appshare->source_id = g_io_add_watch(appshare->channel,
+						     G_IO_IN | G_IO_HUP,
+						     data_in_cb,
+						     appshare);
+
+	return(sent);
 }
 
 static gboolean
-data_in_cb (SIPE_UNUSED_PARAMETER GIOChannel *channel,
-	    GIOCondition condition,
-	    gpointer data)
+data_in_cb(SIPE_UNUSED_PARAMETER GIOChannel *channel,
+	   GIOCondition condition,
+	   gpointer data)
 {
 	struct sipe_appshare *appshare = data;
-	GError *error = NULL;
-	gchar buffer[2048];
-	gsize bytes_read;
 
 	if (condition & G_IO_HUP) {
+		appshare->source_id = 0;
 		sipe_backend_media_hangup(appshare->media->backend_private, TRUE);
 		return FALSE;
 	}
 
-	while (1) {
-		g_io_channel_read_chars(channel, buffer, sizeof (buffer), &bytes_read, &error);
-		g_assert_no_error(error);
+	/* the flow reads until the socket is drained */
+	appshare->source_id = 0;
+	sipe_ft_flow_wake(appshare->flow);
 
-		if (bytes_read == 0) {
-			break;
-		}
+	return FALSE;
+}
 
-		sipe_backend_media_write(appshare->media, appshare->stream,
-					 (guint8 *)buffer, bytes_read, TRUE);
-		SIPE_DEBUG_INFO("Written: %" G_GSIZE_FORMAT "\n", bytes_read);
-	}
+static void
+appshare_connected(struct sipe_appshare *appshare)
+{
+	GError *error = NULL;
+
+	g_socket_set_blocking(appshare->socket, FALSE);
+	appshare->channel = g_io_channel_unix_new(g_socket_get_fd(appshare->socket));
+	g_io_channel_set_encoding(appshare->channel, NULL, &error);
+	g_assert_no_error(error);
+	appshare->source_id = g_io_add_watch(appshare->channel,
+					     G_IO_IN | G_IO_HUP, data_in_cb,
+					     appshare);
+
+	appshare->to_socket.data = g_malloc(APPSHARE_BUFFER_SIZE);
+	appshare->to_stream.data = g_malloc(APPSHARE_BUFFER_SIZE);
+	appshare->connected = TRUE;
 
-	return TRUE;
+	/* interactive: always served before bulk file transfers */
+	appshare->flow = sipe_ft_flow_new(sipe_media_get_sipe_core_private(appshare->media),
+					  SIPE_FT_PRIORITY_INTERACTIVE,
+					  relay_socket_to_stream,
+					  appshare);
+
+	/* pick up anything that arrived while we were waiting */
+	relay_stream_to_socket(appshare);
+}
+
+static void
+stream_writable_cb(SIPE_UNUSED_PARAMETER struct sipe_media_call *call,
+		   struct sipe_media_stream *stream,
+		   gboolean writable)
+{
+	struct sipe_appshare *appshare = sipe_media_stream_get_data(stream);
+
+	if (writable && appshare->stream_blocked) {
+		appshare->stream_blocked = FALSE;
+		appshare->blocked += sipe_utils_monotonic_msec() -
+			MAX(appshare->to_stream.stall_start,
+			    appshare->adapt_start);
+		appshare_stall_end(appshare, &appshare->to_stream);
+		sipe_ft_flow_wake(appshare->flow);
+	}
 }
 
 static gboolean
@@ -174,13 +435,10 @@ socket_connect_cb (SIPE_UNUSED_PARAMETER GIOChannel *channel,
 	g_object_unref(appshare->socket);
 
 	appshare->socket = data_socket;
+	/* the listening watch is going away with this callback */
+	appshare->source_id = 0;
 
-	appshare->channel = g_io_channel_unix_new(g_socket_get_fd(appshare->socket));
-	g_io_channel_set_encoding(appshare->channel, NULL, &error);
-	g_assert_no_error(error);
-	appshare->source_id = g_io_add_watch(appshare->channel,
-					     G_IO_IN | G_IO_HUP, data_in_cb,
-					     appshare);
+	appshare_connected(appshare);
 
 	return FALSE;
 }
@@ -250,6 +508,8 @@ writable_cb(struct sipe_media_call *call, struct sipe_media_stream *stream,
 
 		g_free(cmdline);
 		g_free(socket_path);
+	} else {
+		stream_writable_cb(call, stream, writable);
 	}
 }
 
@@ -356,6 +616,64 @@ set_shared_display_area(rdpShadowServer *server, guint monitor_id)
 	}
 }
 
+static gboolean
+adapt_frame_rate_cb(gpointer data)
+{
+	struct sipe_appshare *appshare = data;
+	struct appshare_buffer *buffer = &appshare->to_stream;
+	rdpShadowSubsystem *subsystem = appshare->server->subsystem;
+	gint64 now = sipe_utils_monotonic_msec();
+	gint64 interval = now - appshare->adapt_start;
+	guint frame_rate = appshare->frame_rate;
+	guint64 frames;
+
+	if (interval <= 0)
+		return(TRUE);
+
+	if (appshare->stream_blocked)
+		appshare->blocked += now - MAX(buffer->stall_start,
+					       appshare->adapt_start);
+
+	frames = MAX(frame_rate * interval / 1000, 1);
+	appshare->frames         += frames;
+	appshare->bytes_per_frame = (buffer->total - appshare->adapt_total) / frames;
+
+	if (appshare->blocked * APPSHARE_CONGESTED > interval)
+		frame_rate = MAX(frame_rate / 2, APPSHARE_FPS_MIN);
+	else if ((appshare->blocked == 0) && (buffer->offset == buffer->length))
+		frame_rate = MIN(frame_rate + APPSHARE_FPS_STEP, APPSHARE_FPS_MAX);
+
+	if (frame_rate != appshare->frame_rate) {
+		SIPE_DEBUG_INFO("adapt_frame_rate_cb: %u -> %u fps (stream blocked %" G_GINT64_FORMAT " ms, %u bytes per frame)",
+				appshare->frame_rate, frame_rate,
+				appshare->blocked, appshare->bytes_per_frame);
+		appshare->frame_rate = frame_rate;
+		if (subsystem)
+			subsystem->captureFrameRate = frame_rate;
+	}
+
+	appshare->adapt_start = now;
+	appshare->adapt_total = buffer->total;
+	appshare->blocked     = 0;
+
+	return(TRUE);
+}
+
+static void
+stats_cb(SIPE_UNUSED_PARAMETER struct sipe_media_call *call,
+	 struct sipe_media_stream *stream,
+	 struct sipe_media_stats *stats)
+{
+	struct sipe_appshare *appshare = sipe_media_stream_get_data(stream);
+
+	if (appshare && appshare->adapt_source_id) {
+		stats->have_frames     = TRUE;
+		stats->frame_rate      = appshare->frame_rate;
+		stats->frames          = appshare->frames;
+		stats->bytes_per_frame = appshare->bytes_per_frame;
+	}
+}
+
 static void
 candidate_pair_established_cb(struct sipe_media_call *call,
 			      struct sipe_media_stream *stream)
@@ -417,13 +735,16 @@ candidate_pair_established_cb(struct sipe_media_call *call,
 	sleep(3);
 	g_socket_connect(appshare->socket, address, NULL, &error);
 	g_assert_no_error(error);
+	g_object_unref(address);
 
-	appshare->channel = g_io_channel_unix_new(g_socket_get_fd(appshare->socket));
-	g_io_channel_set_encoding(appshare->channel, NULL, &error);
-	g_assert_no_error(error);
-	appshare->source_id = g_io_add_watch(appshare->channel,
-					     G_IO_IN | G_IO_HUP, data_in_cb,
-					     appshare);
+	appshare_connected(appshare);
+
+	appshare->frame_rate      = APPSHARE_FPS_MAX;
+	appshare->adapt_start     = sipe_utils_monotonic_msec();
+	appshare->blocked         = 0;
+	appshare->adapt_source_id = g_timeout_add(APPSHARE_ADAPT_INTERVAL,
+						  adapt_frame_rate_cb,
+						  appshare);
 
 	g_free(socket_path);
 }
@@ -456,6 +777,8 @@ monitor_selected_cb(struct sipe_core_private *sipe_private, gchar *who,
 
 	call->candidate_pair_established_cb = candidate_pair_established_cb;
 	call->read_cb = read_cb;
+	call->writable_cb = stream_writable_cb;
+	call->stats_cb = stats_cb;
 
 	stream = sipe_media_stream_add(call, "applicationsharing",
 				       SIPE_MEDIA_APPLICATION,
@@ -0,0 +1,140 @@
+/**
+ * @file sipe-arena.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-arena.h"
+
+/* a typical SIP message header fits into the first chunk */
+#define ARENA_FIRST_CHUNK 2048
+#define ARENA_ALIGN       (2 * sizeof(gpointer))
+#define ARENA_ROUND(n)    (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	gsize size; /* usable bytes after header */
+	gsize used;
+};
+
+/* start of usable memory in a chunk */
+#define CHUNK_DATA(c) (((guchar *) (c)) + ARENA_ROUND(sizeof(struct arena_chunk)))
+
+struct sipe_arena {
+	struct arena_chunk *current; /* allocations come from here */
+	struct arena_chunk *first;   /* kept by reset, end of chunk list */
+	gsize total;
+};
+
+static struct arena_chunk *arena_chunk_new(struct sipe_arena *arena,
+					   gsize size)
+{
+	struct arena_chunk *chunk = g_malloc(ARENA_ROUND(sizeof(struct arena_chunk)) +
+					     size);
+	chunk->size   = size;
+	chunk->used   = 0;
+	arena->total += size;
+	return(chunk);
+}
+
+struct sipe_arena *sipe_arena_new(void)
+{
+	struct sipe_arena *arena = g_new0(struct sipe_arena, 1);
+	arena->first = arena->current = arena_chunk_new(arena,
+							ARENA_FIRST_CHUNK);
+	arena->first->next = NULL;
+	return(arena);
+}
+
+gpointer sipe_arena_alloc(struct sipe_arena *arena, gsize size)
+{
+	struct arena_chunk *chunk = arena->current;
+	gpointer p;
+
+	size = ARENA_ROUND(size);
+	if (chunk->size - chunk->used < size) {
+		/* chunks grow with the arena, large blocks get their own */
+		gsize next = MAX(chunk->size * 2, size);
+
+		chunk = arena_chunk_new(arena, next);
+		chunk->next    = arena->current;
+		arena->current = chunk;
+	}
+
+	p = CHUNK_DATA(chunk) + chunk->used;
+	chunk->used += size;
+	return(p);
+}
+
+gchar *sipe_arena_strndup(struct sipe_arena *arena,
+			  const gchar *string,
+			  gsize length)
+{
+	gchar *copy = sipe_arena_alloc(arena, length + 1);
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	return(copy);
+}
+
+gchar *sipe_arena_strdup(struct sipe_arena *arena, const gchar *string)
+{
+	return(string ? sipe_arena_strndup(arena, string, strlen(string)) : NULL);
+}
+
+void sipe_arena_reset(struct sipe_arena *arena)
+{
+	struct arena_chunk *chunk = arena->current;
+
+	while (chunk != arena->first) {
+		struct arena_chunk *next = chunk->next;
+		arena->total -= chunk->size;
+		g_free(chunk);
+		chunk = next;
+	}
+
+	arena->current = arena->first;
+	arena->first->used = 0;
+}
+
+void sipe_arena_free(struct sipe_arena *arena)
+{
+	if (arena) {
+		sipe_arena_reset(arena);
+		g_free(arena->first);
+		g_free(arena);
+	}
+}
+
+gsize sipe_arena_size(const struct sipe_arena *arena)
+{
+	return(arena ? arena->total : 0);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,111 @@
+/**
+ * @file sipe-arena.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Bump allocator
+ *
+ * Memory is handed out sequentially from large chunks and is only
+ * released all at once, i.e. objects with a common lifetime, like
+ * everything derived from one SIP message, need a single free.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+struct sipe_arena;
+
+/**
+ * Create arena
+ *
+ * @return new arena. Must be freed with @c sipe_arena_free()
+ */
+struct sipe_arena *sipe_arena_new(void);
+
+/**
+ * Allocate memory from arena
+ *
+ * The memory block is suitably aligned for any type and not initialized.
+ *
+ * @param arena arena
+ * @param size  number of bytes
+ *
+ * @return memory block, valid until the arena is reset or freed
+ */
+gpointer sipe_arena_alloc(struct sipe_arena *arena, gsize size);
+
+/**
+ * Copy string into arena
+ *
+ * @param arena  arena
+ * @param string string (need not be NUL terminated)
+ * @param length length of @c string
+ *
+ * @return NUL terminated copy, valid until the arena is reset or freed
+ */
+gchar *sipe_arena_strndup(struct sipe_arena *arena,
+			  const gchar *string,
+			  gsize length);
+
+/**
+ * Copy string into arena
+ *
+ * @param arena  arena
+ * @param string NUL terminated string (may be @c NULL)
+ *
+ * @return copy or @c NULL, valid until the arena is reset or freed
+ */
+gchar *sipe_arena_strdup(struct sipe_arena *arena, const gchar *string);
+
+/**
+ * Release all allocations at once
+ *
+ * The first chunk is kept for reuse.
+ *
+ * @param arena arena
+ */
+void sipe_arena_reset(struct sipe_arena *arena);
+
+/**
+ * Free arena and all allocations
+ *
+ * @param arena arena (may be @c NULL)
+ */
+void sipe_arena_free(struct sipe_arena *arena);
+
+/**
+ * Memory held by arena
+ *
+ * @param arena arena (may be @c NULL)
+ *
+ * @return number of bytes allocated from the system
+ */
+gsize sipe_arena_size(const struct sipe_arena *arena);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
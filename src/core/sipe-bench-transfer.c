@@ -0,0 +1,790 @@
+/**
+ * @file sipe-bench-transfer.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * Please use "make bench" to build & run them!
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Data channel throughput benchmark
+ *
+ * A sending and a receiving core instance are connected by an in-process
+ * loopback link. The sender runs a bulk file transfer flow, which reads
+ * from a file source and frames the data into Lync FT chunks, and an
+ * optional interactive flow, which emits application sharing frames at
+ * a fixed rate. Both share the transfer scheduler. The receiver parses
+ * the chunks and writes them to a file sink.
+ *
+ * The link has a limited window, i.e. writes stall like on a congested
+ * socket, a one-way delay and a loss rate. A lost packet delays its
+ * segment, and everything behind it, by the retransmission timeout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sipe-common.h"
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-ft-scheduler.h"
+#include "sipe-ft-sink.h"
+#include "sipe-ft-source.h"
+#include "sipe-job.h"
+#include "sipe-mime.h"
+#include "sipe-utils.h"
+
+/* stub functions for backend API */
+void sipe_backend_debug_literal(SIPE_UNUSED_PARAMETER sipe_debug_level level,
+				SIPE_UNUSED_PARAMETER const gchar *msg) {}
+void sipe_backend_debug(SIPE_UNUSED_PARAMETER sipe_debug_level level,
+			SIPE_UNUSED_PARAMETER const gchar *format,
+			...) {}
+gboolean sipe_backend_debug_enabled(void)
+{
+	return FALSE;
+}
+const gchar *sipe_backend_network_ip_address(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public) { return(NULL); }
+gchar *sipe_backend_markup_css_property(SIPE_UNUSED_PARAMETER const gchar *style,
+					SIPE_UNUSED_PARAMETER const gchar *option) { return(NULL); }
+void sipe_mime_init(void) {}
+void sipe_mime_shutdown(void) {}
+void sipe_mime_parts_foreach_fallback(SIPE_UNUSED_PARAMETER const gchar *type,
+				      SIPE_UNUSED_PARAMETER const gchar *body,
+				      SIPE_UNUSED_PARAMETER sipe_mime_parts_cb callback,
+				      SIPE_UNUSED_PARAMETER gpointer user_data) {}
+
+/* same framing as sipe-ft-lync.c */
+#define BENCH_CHUNK_HEADER_LENGTH 3
+#define BENCH_CHUNK_MAX_LENGTH    G_MAXUINT16
+
+/* loopback link */
+#define BENCH_LINK_MSS            1200  /* bytes per packet, ICE-TCP   */
+#define BENCH_RUN_TIMEOUT         120   /* seconds                     */
+
+enum {
+	BENCH_CHANNEL_FT,
+	BENCH_CHANNEL_APPSHARE,
+};
+
+struct bench_config {
+	guint64 size;           /* bytes                                */
+	guint chunk;            /* FT chunk payload [bytes]             */
+	gdouble loss;           /* packet loss [probability]            */
+	guint delay;            /* one-way delay [ms]                   */
+	guint rto;              /* retransmission timeout [ms]          */
+	gsize window;           /* link window [bytes]                  */
+	guint frame_size;       /* appshare frame [bytes], 0: disabled  */
+	guint frame_interval;   /* appshare frame interval [ms]         */
+};
+
+struct bench_segment {
+	gint64 due;             /* g_get_monotonic_time() */
+	guint channel;
+	gsize length;
+	guchar data[1];         /* allocated with the segment */
+};
+
+struct bench_link {
+	GQueue *segments;       /* in delivery order */
+	gsize in_flight;
+	gsize window;
+	gint64 last_due;
+	GSource *timer;
+	gboolean blocked;       /* write failed, wake writers when drained */
+	gboolean paused;        /* receiver doesn't take more data */
+};
+
+/* latency samples are matched in order, the link never reorders */
+struct bench_latency {
+	GArray *stamps;         /* gint64, sent */
+	guint next;
+	GArray *samples;        /* gint64, microseconds */
+};
+
+struct bench_run {
+	const struct bench_config *config;
+	GMainLoop *loop;
+	gboolean failed;
+	struct bench_link link;
+
+	/* sender */
+	struct sipe_core_private *sender;
+	struct sipe_ft_source *source;
+	struct sipe_ft_flow *ft_flow;
+	guchar header[BENCH_CHUNK_HEADER_LENGTH];
+	const guchar *payload;
+	gsize out_length;       /* header + payload */
+	gsize out_offset;
+	gboolean eof;
+
+	struct sipe_ft_flow *as_flow;
+	GSource *frame_timer;
+	guchar *frame;
+	guint64 as_pending;     /* bytes */
+	guint frame_offset;
+
+	/* receiver */
+	struct sipe_core_private *receiver;
+	struct sipe_ft_sink *sink;
+	guchar in_header[BENCH_CHUNK_HEADER_LENGTH];
+	guint in_header_length;
+	gsize in_expecting;
+	guint64 received;
+	guint64 written;
+	guint64 as_received;
+
+	struct bench_latency chunks;
+	struct bench_latency frames;
+};
+
+static void latency_init(struct bench_latency *latency)
+{
+	latency->stamps  = g_array_new(FALSE, FALSE, sizeof(gint64));
+	latency->next    = 0;
+	latency->samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+}
+
+static void latency_sent(struct bench_latency *latency)
+{
+	gint64 now = g_get_monotonic_time();
+	g_array_append_val(latency->stamps, now);
+}
+
+static void latency_received(struct bench_latency *latency)
+{
+	if (latency->next < latency->stamps->len) {
+		gint64 sample = g_get_monotonic_time() -
+			g_array_index(latency->stamps, gint64, latency->next++);
+		g_array_append_val(latency->samples, sample);
+	}
+}
+
+static gint latency_compare(gconstpointer a, gconstpointer b)
+{
+	gint64 la = *((const gint64 *) a);
+	gint64 lb = *((const gint64 *) b);
+	return((la > lb) - (la < lb));
+}
+
+/* milliseconds */
+static gdouble latency_percentile(struct bench_latency *latency,
+				  guint percent)
+{
+	GArray *samples = latency->samples;
+
+	if (samples->len == 0)
+		return(0.0);
+	return(g_array_index(samples, gint64,
+			     (samples->len - 1) * percent / 100) / 1000.0);
+}
+
+static void latency_free(struct bench_latency *latency)
+{
+	g_array_free(latency->stamps, TRUE);
+	g_array_free(latency->samples, TRUE);
+}
+
+/*
+ * Loopback link
+ */
+static void receiver_input(struct bench_run *run,
+			   guint channel,
+			   const guchar *data,
+			   gsize length);
+
+static gboolean link_deliver(gpointer data);
+
+static void link_schedule(struct bench_run *run)
+{
+	struct bench_link *link = &run->link;
+	struct bench_segment *segment = g_queue_peek_head(link->segments);
+	gint64 wait;
+
+	if (link->timer || link->paused || !segment)
+		return;
+
+	wait = segment->due - g_get_monotonic_time();
+	link->timer = sipe_utils_timeout_add(NULL,
+					     wait > 0 ? (wait + 999) / 1000 : 0,
+					     link_deliver,
+					     run);
+}
+
+static gsize link_write(struct bench_run *run,
+			guint channel,
+			const guchar *data,
+			gsize length)
+{
+	const struct bench_config *config = run->config;
+	struct bench_link *link = &run->link;
+	struct bench_segment *segment;
+	gsize packets;
+	gint64 due;
+
+	if (link->in_flight >= link->window) {
+		link->blocked = TRUE;
+		return(0);
+	}
+	length = MIN(length, link->window - link->in_flight);
+
+	segment = g_malloc(sizeof(struct bench_segment) + length);
+	segment->channel = channel;
+	segment->length  = length;
+	memcpy(segment->data, data, length);
+
+	/* a lost packet is retransmitted, the stream stays in order */
+	due = g_get_monotonic_time() + config->delay * 1000;
+	packets = (length + BENCH_LINK_MSS - 1) / BENCH_LINK_MSS;
+	if ((config->loss > 0.0) &&
+	    (g_random_double() < config->loss * packets))
+		due += config->rto * 1000;
+	segment->due   = MAX(due, link->last_due);
+	link->last_due = segment->due;
+
+	g_queue_push_tail(link->segments, segment);
+	link->in_flight += length;
+	link_schedule(run);
+
+	return(length);
+}
+
+static gboolean link_deliver(gpointer data)
+{
+	struct bench_run *run = data;
+	struct bench_link *link = &run->link;
+	gint64 now = g_get_monotonic_time();
+	struct bench_segment *segment;
+
+	link->timer = NULL;
+
+	while (!link->paused &&
+	       ((segment = g_queue_peek_head(link->segments)) != NULL) &&
+	       (segment->due <= now)) {
+		g_queue_pop_head(link->segments);
+		link->in_flight -= segment->length;
+		receiver_input(run, segment->channel,
+			       segment->data, segment->length);
+		g_free(segment);
+	}
+
+	/* writable again: same hysteresis as a socket send buffer */
+	if (link->blocked && (link->in_flight <= link->window / 2)) {
+		link->blocked = FALSE;
+		sipe_ft_flow_wake(run->ft_flow);
+		sipe_ft_flow_wake(run->as_flow);
+	}
+
+	link_schedule(run);
+	return(FALSE);
+}
+
+/*
+ * Sender
+ */
+
+/* sipe_ft_flow_send callback, see send_file_data() in sipe-ft-lync.c */
+static gsize ft_send(gpointer data, gsize budget)
+{
+	struct bench_run *run = data;
+	gsize left = budget;
+
+	while (left) {
+		gssize bytes_read;
+
+		while (left && (run->out_offset < run->out_length)) {
+			const guchar *p;
+			gsize length;
+			gsize written;
+
+			if (run->out_offset < BENCH_CHUNK_HEADER_LENGTH) {
+				p      = run->header + run->out_offset;
+				length = BENCH_CHUNK_HEADER_LENGTH - run->out_offset;
+			} else {
+				p      = run->payload + run->out_offset - BENCH_CHUNK_HEADER_LENGTH;
+				length = run->out_length - run->out_offset;
+			}
+
+			written = link_write(run, BENCH_CHANNEL_FT, p,
+					     MIN(length, left));
+			if (written == 0)
+				/* congested: link_deliver() wakes us */
+				return(budget - left);
+			run->out_offset += written;
+			left            -= written;
+		}
+
+		/* fair share used up for this round */
+		if (run->out_offset < run->out_length)
+			break;
+
+		if (run->payload) {
+			sipe_ft_source_consume(run->source,
+					       run->out_length - BENCH_CHUNK_HEADER_LENGTH);
+			run->payload = NULL;
+		}
+
+		if (run->eof)
+			break;
+
+		bytes_read = sipe_ft_source_peek(run->source,
+						 &run->payload,
+						 run->config->chunk);
+		if (bytes_read < 0) {
+			run->eof = TRUE;
+			break;
+		}
+		if (bytes_read == 0) {
+			/* read-ahead: source_ready() wakes us */
+			break;
+		}
+
+		run->header[0]  = 0x00;
+		run->header[1]  = bytes_read >> 8;
+		run->header[2]  = bytes_read & 0xFF;
+		run->out_length = BENCH_CHUNK_HEADER_LENGTH + bytes_read;
+		run->out_offset = 0;
+		latency_sent(&run->chunks);
+	}
+
+	return(budget - left);
+}
+
+static void source_ready(gpointer data)
+{
+	struct bench_run *run = data;
+	sipe_ft_flow_wake(run->ft_flow);
+}
+
+/* sipe_ft_flow_send callback */
+static gsize as_send(gpointer data, gsize budget)
+{
+	struct bench_run *run = data;
+	gsize left = budget;
+
+	while (left && run->as_pending) {
+		guint frame_size = run->config->frame_size;
+		gsize length = MIN(frame_size - run->frame_offset, left);
+		gsize written = link_write(run, BENCH_CHANNEL_APPSHARE,
+					   run->frame + run->frame_offset,
+					   length);
+
+		if (written == 0)
+			break;
+		run->frame_offset += written;
+		run->as_pending   -= written;
+		left              -= written;
+		if (run->frame_offset == frame_size)
+			run->frame_offset = 0;
+	}
+
+	return(budget - left);
+}
+
+static gboolean frame_tick(gpointer data)
+{
+	struct bench_run *run = data;
+
+	run->as_pending += run->config->frame_size;
+	latency_sent(&run->frames);
+	sipe_ft_flow_wake(run->as_flow);
+
+	return(TRUE);
+}
+
+/*
+ * Receiver
+ */
+static void receiver_ft(struct bench_run *run,
+			const guchar *data,
+			gsize length)
+{
+	while (length) {
+		gsize copy;
+
+		if (run->in_expecting == 0) {
+			/* chunk header might be split between segments */
+			copy = MIN(length,
+				   BENCH_CHUNK_HEADER_LENGTH - run->in_header_length);
+			memcpy(run->in_header + run->in_header_length, data, copy);
+			run->in_header_length += copy;
+			data                  += copy;
+			length                -= copy;
+
+			if (run->in_header_length < BENCH_CHUNK_HEADER_LENGTH)
+				break;
+			run->in_header_length = 0;
+			run->in_expecting     = (run->in_header[1] << 8) |
+						 run->in_header[2];
+			continue;
+		}
+
+		copy = MIN(length, run->in_expecting);
+		if (!sipe_ft_sink_write(run->sink, data, copy)) {
+			run->failed = TRUE;
+			g_main_loop_quit(run->loop);
+			return;
+		}
+		run->received     += copy;
+		run->in_expecting -= copy;
+		data              += copy;
+		length            -= copy;
+
+		if (run->in_expecting == 0)
+			latency_received(&run->chunks);
+	}
+
+	if (run->received == run->config->size)
+		sipe_ft_sink_flush(run->sink);
+	else if (sipe_ft_sink_full(run->sink))
+		/* stop reading from the link, sink_written() resumes */
+		run->link.paused = TRUE;
+}
+
+static void receiver_input(struct bench_run *run,
+			   guint channel,
+			   const guchar *data,
+			   gsize length)
+{
+	if (channel == BENCH_CHANNEL_FT) {
+		receiver_ft(run, data, length);
+	} else {
+		guint frame_size = run->config->frame_size;
+
+		run->as_received += length;
+		while (run->as_received >= frame_size) {
+			run->as_received -= frame_size;
+			latency_received(&run->frames);
+		}
+	}
+}
+
+static void sink_written(gpointer data, gsize written)
+{
+	struct bench_run *run = data;
+
+	if (written == 0) {
+		run->failed = TRUE;
+		g_main_loop_quit(run->loop);
+		return;
+	}
+
+	run->written += written;
+	if (run->written == run->config->size) {
+		g_main_loop_quit(run->loop);
+		return;
+	}
+
+	/* worker was busy when the last data arrived */
+	if (run->received == run->config->size)
+		sipe_ft_sink_flush(run->sink);
+
+	if (run->link.paused && !sipe_ft_sink_full(run->sink)) {
+		run->link.paused = FALSE;
+		link_schedule(run);
+	}
+}
+
+/*
+ * Runner
+ */
+static gboolean run_timeout(gpointer data)
+{
+	struct bench_run *run = data;
+
+	printf("transfer didn't complete in %d seconds\n", BENCH_RUN_TIMEOUT);
+	run->failed = TRUE;
+	g_main_loop_quit(run->loop);
+
+	return(FALSE);
+}
+
+static gchar *create_file(guint64 size)
+{
+	GError *error = NULL;
+	gchar *filename = NULL;
+	gint fd = g_file_open_tmp("sipe-bench-XXXXXX", &filename, &error);
+	guchar *buffer;
+	guint64 i;
+	gboolean ok;
+
+	if (fd < 0) {
+		printf("can't create temporary file: %s\n",
+		       error ? error->message : "UNKNOWN");
+		if (error)
+			g_error_free(error);
+		return(NULL);
+	}
+	close(fd);
+
+	/* position dependent pattern: misplaced data is detected */
+	buffer = g_malloc(size);
+	for (i = 0; i < size; i++)
+		buffer[i] = (i * 7) ^ (i >> 11);
+	ok = g_file_set_contents(filename, (gchar *) buffer, size, NULL);
+	g_free(buffer);
+
+	if (!ok) {
+		g_unlink(filename);
+		g_free(filename);
+		return(NULL);
+	}
+
+	return(filename);
+}
+
+static gboolean compare_files(const gchar *name1, const gchar *name2)
+{
+	gchar *content1 = NULL;
+	gchar *content2 = NULL;
+	gsize length1 = 0;
+	gsize length2 = 0;
+	gboolean same = g_file_get_contents(name1, &content1, &length1, NULL) &&
+		g_file_get_contents(name2, &content2, &length2, NULL) &&
+		(length1 == length2) &&
+		(memcmp(content1, content2, length1) == 0);
+
+	g_free(content2);
+	g_free(content1);
+	return(same);
+}
+
+static gboolean bench_transfer(const struct bench_config *config)
+{
+	struct bench_run run;
+	gchar *source_name = create_file(config->size);
+	gchar *sink_name;
+	GSource *timeout;
+	gint64 start;
+	gint64 elapsed = 0;
+	clock_t cpu = 0;
+	gdouble megabytes = config->size / (1024.0 * 1024.0);
+	gboolean ok;
+
+	if (!source_name)
+		return(FALSE);
+	sink_name = g_strdup_printf("%s.received", source_name);
+
+	memset(&run, 0, sizeof(run));
+	run.config        = config;
+	run.loop          = g_main_loop_new(NULL, FALSE);
+	run.link.segments = g_queue_new();
+	run.link.window   = config->window;
+	latency_init(&run.chunks);
+	latency_init(&run.frames);
+
+	/* two instances: scheduler and jobs are per instance */
+	run.sender   = g_new0(struct sipe_core_private, 1);
+	run.receiver = g_new0(struct sipe_core_private, 1);
+
+	run.source = sipe_core_ft_source_open((struct sipe_core_public *) run.sender,
+					      source_name);
+	run.sink   = sipe_core_ft_sink_open((struct sipe_core_public *) run.receiver,
+					    sink_name);
+	if (!run.source || !run.sink) {
+		printf("can't open file source or sink\n");
+		run.failed = TRUE;
+	} else {
+		sipe_ft_source_set_ready_cb(run.source, source_ready, &run);
+		sipe_ft_sink_set_written_cb(run.sink, sink_written, &run);
+
+		run.ft_flow = sipe_ft_flow_new(run.sender,
+					       SIPE_FT_PRIORITY_BULK,
+					       ft_send,
+					       &run);
+		if (config->frame_size) {
+			run.frame   = g_malloc0(config->frame_size);
+			run.as_flow = sipe_ft_flow_new(run.sender,
+						       SIPE_FT_PRIORITY_INTERACTIVE,
+						       as_send,
+						       &run);
+			run.frame_timer = sipe_utils_timeout_add(NULL,
+								 config->frame_interval,
+								 frame_tick,
+								 &run);
+		}
+
+		timeout = sipe_utils_timeout_add(NULL,
+						 BENCH_RUN_TIMEOUT * 1000,
+						 run_timeout,
+						 &run);
+		cpu   = clock();
+		start = g_get_monotonic_time();
+		sipe_ft_flow_wake(run.ft_flow);
+		g_main_loop_run(run.loop);
+		elapsed = g_get_monotonic_time() - start;
+		cpu     = clock() - cpu;
+		g_source_destroy(timeout);
+		if (run.frame_timer)
+			g_source_destroy(run.frame_timer);
+	}
+
+	sipe_ft_flow_free(run.as_flow);
+	sipe_ft_flow_free(run.ft_flow);
+	sipe_ft_scheduler_free(run.sender);
+	sipe_ft_source_close(run.source);
+	sipe_ft_sink_close(run.sink);
+	sipe_job_cancel_all(run.sender);
+	sipe_job_cancel_all(run.receiver);
+	if (run.link.timer)
+		g_source_destroy(run.link.timer);
+	while (!g_queue_is_empty(run.link.segments))
+		g_free(g_queue_pop_head(run.link.segments));
+	g_queue_free(run.link.segments);
+
+	ok = !run.failed && compare_files(source_name, sink_name);
+	if (!run.failed && !ok)
+		printf("received file differs from sent file\n");
+
+	if (ok) {
+		g_array_sort(run.chunks.samples, latency_compare);
+		g_array_sort(run.frames.samples, latency_compare);
+
+		printf("size=%-6" G_GUINT64_FORMAT "K chunk=%-5u loss=%.2f%% delay=%-3u",
+		       config->size / 1024,
+		       config->chunk,
+		       config->loss * 100,
+		       config->delay);
+		printf(" %8.1f MB/s %7.2f ms CPU/MB",
+		       megabytes * G_USEC_PER_SEC / MAX(elapsed, 1),
+		       (cpu * 1000.0 / CLOCKS_PER_SEC) / megabytes);
+		printf(" chunk p50 %7.2f p99 %7.2f ms",
+		       latency_percentile(&run.chunks, 50),
+		       latency_percentile(&run.chunks, 99));
+		if (config->frame_size)
+			printf(" frame p50 %7.2f p99 %7.2f ms",
+			       latency_percentile(&run.frames, 50),
+			       latency_percentile(&run.frames, 99));
+		printf("\n");
+	}
+
+	latency_free(&run.frames);
+	latency_free(&run.chunks);
+	g_free(run.frame);
+	g_free(run.receiver);
+	g_free(run.sender);
+	g_main_loop_unref(run.loop);
+	g_unlink(sink_name);
+	g_unlink(source_name);
+	g_free(sink_name);
+	g_free(source_name);
+
+	return(ok);
+}
+
+/* command line: single run, otherwise the default matrix */
+static gint option_size           = 0;
+static gint option_chunk          = BENCH_CHUNK_MAX_LENGTH;
+static gdouble option_loss        = 0.0;
+static gint option_delay          = 0;
+static gint option_rto            = 20;
+static gint option_window         = 256;
+static gint option_frame          = 0;
+static gint option_interval       = 16;
+
+static const GOptionEntry options[] = {
+	{ "size",     's', 0, G_OPTION_ARG_INT,    &option_size,     "Transfer size",                              "KiB"   },
+	{ "chunk",    'c', 0, G_OPTION_ARG_INT,    &option_chunk,    "FT chunk payload size (max. 65535)",         "BYTES" },
+	{ "loss",     'l', 0, G_OPTION_ARG_DOUBLE, &option_loss,     "Packet loss rate",                           "PERCENT" },
+	{ "delay",    'd', 0, G_OPTION_ARG_INT,    &option_delay,    "One-way link delay",                         "MS"    },
+	{ "rto",      'r', 0, G_OPTION_ARG_INT,    &option_rto,      "Retransmission timeout for lost packets",    "MS"    },
+	{ "window",   'w', 0, G_OPTION_ARG_INT,    &option_window,   "Link window",                                "KiB"   },
+	{ "frame",    'f', 0, G_OPTION_ARG_INT,    &option_frame,    "Application sharing frame size (0: none)",   "BYTES" },
+	{ "interval", 'i', 0, G_OPTION_ARG_INT,    &option_interval, "Application sharing frame interval",         "MS"    },
+	{ NULL,       0,   0, 0,                   NULL,             NULL,                                         NULL    }
+};
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context = g_option_context_new(NULL);
+	GError *error           = NULL;
+	struct bench_config config;
+	gboolean ok             = TRUE;
+
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error) ||
+	    (option_size < 0) ||
+	    (option_chunk <= 0) || (option_chunk > BENCH_CHUNK_MAX_LENGTH) ||
+	    (option_loss < 0.0) || (option_loss > 100.0) ||
+	    (option_delay < 0) || (option_rto < 0) ||
+	    (option_window <= 0) ||
+	    (option_frame < 0) || (option_interval <= 0)) {
+		printf("%s\n", error ? error->message : "invalid option value");
+		if (error)
+			g_error_free(error);
+		g_option_context_free(context);
+		return(1);
+	}
+	g_option_context_free(context);
+
+	config.size           = (option_size ? option_size : 16 * 1024) * G_GUINT64_CONSTANT(1024);
+	config.chunk          = option_chunk;
+	config.loss           = option_loss / 100;
+	config.delay          = option_delay;
+	config.rto            = option_rto;
+	config.window         = option_window * 1024;
+	config.frame_size     = option_frame;
+	config.frame_interval = option_interval;
+
+	if (option_size) {
+		ok = bench_transfer(&config);
+	} else {
+		static const guint chunks[] = { 4096, 16384, BENCH_CHUNK_MAX_LENGTH };
+		guint i;
+
+		/* chunk size */
+		for (i = 0; i < G_N_ELEMENTS(chunks); i++) {
+			config.chunk = chunks[i];
+			ok &= bench_transfer(&config);
+		}
+
+		/* lossy link with delay */
+		config.delay = 5;
+		config.loss  = 0.001;
+		ok &= bench_transfer(&config);
+
+		/* application sharing competes with the file transfer */
+		config.delay      = 0;
+		config.loss       = 0.0;
+		config.frame_size = 16 * 1024;
+		ok &= bench_transfer(&config);
+	}
+
+	return(ok ? 0 : 1);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,511 @@
+/**
+ * @file sipe-bench.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * Please use "make bench" to build & run them!
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Micro benchmarks for the core parsers and builders */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipmsg.h"
+#include "sip-sec.h"
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-mime.h"
+#include "sipe-sign.h"
+#include "sipe-str.h"
+#include "sipe-utils.h"
+#include "sipe-xml.h"
+#ifdef HAVE_VV
+#include "sdpmsg.h"
+#endif
+
+/* stub functions for backend API */
+void sipe_backend_debug_literal(SIPE_UNUSED_PARAMETER sipe_debug_level level,
+				SIPE_UNUSED_PARAMETER const gchar *msg) {}
+void sipe_backend_debug(SIPE_UNUSED_PARAMETER sipe_debug_level level,
+			SIPE_UNUSED_PARAMETER const gchar *format,
+			...) {}
+gboolean sipe_backend_debug_enabled(void)
+{
+	return FALSE;
+}
+const gchar *sipe_backend_network_ip_address(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public) { return(NULL); }
+gchar *sipe_backend_markup_css_property(SIPE_UNUSED_PARAMETER const gchar *style,
+					SIPE_UNUSED_PARAMETER const gchar *option) { return(NULL); }
+void sipe_mime_init(void) {}
+void sipe_mime_shutdown(void) {}
+void sipe_mime_parts_foreach_fallback(SIPE_UNUSED_PARAMETER const gchar *type,
+				      SIPE_UNUSED_PARAMETER const gchar *body,
+				      SIPE_UNUSED_PARAMETER sipe_mime_parts_cb callback,
+				      SIPE_UNUSED_PARAMETER gpointer user_data) {}
+
+/*
+ * Allocation counting
+ *
+ * On glibc all allocations, including those made by GLib and libxml2,
+ * go through the interposed functions below. Other C libraries only
+ * report timings.
+ */
+static guint64 allocations = 0;
+
+#if defined(__GLIBC__)
+#define BENCH_COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		allocations++;
+	return(__libc_realloc(ptr, size));
+}
+#else
+#define BENCH_COUNT_ALLOCATIONS 0
+#endif
+
+/* benchmark runner */
+#define BENCH_MIN_TIME 200000 /* microseconds */
+
+typedef void (*bench_function)(gconstpointer data);
+
+static void bench_run(const gchar *name,
+		      bench_function function,
+		      gconstpointer data)
+{
+	guint64 iterations = 1;
+	guint64 allocated;
+	gint64 elapsed;
+
+	/* double the number of iterations until run is long enough */
+	for (;;) {
+		gint64 start;
+		guint64 i;
+
+		allocations = 0;
+		start       = g_get_monotonic_time();
+		for (i = 0; i < iterations; i++)
+			(*function)(data);
+		elapsed     = g_get_monotonic_time() - start;
+		allocated   = allocations;
+
+		if ((elapsed >= BENCH_MIN_TIME) || (iterations >= G_MAXUINT32))
+			break;
+		iterations *= 2;
+	}
+
+	printf("%-32s %10" G_GUINT64_FORMAT " %12.1f ns/op",
+	       name,
+	       iterations,
+	       (elapsed * 1000.0) / iterations);
+	if (BENCH_COUNT_ALLOCATIONS)
+		printf(" %10.1f allocs/op", ((gdouble) allocated) / iterations);
+	printf("\n");
+}
+
+/* test data */
+static const gchar *register_request =
+	"REGISTER sip:cosmo.local SIP/2.0\r\n"
+	"Via: SIP/2.0/TLS 192.168.172.6:12723\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: <sip:user@cosmo.local>;tag=3e49177a52;epid=c8ca638a15\r\n"
+	"To: <sip:user@cosmo.local>\r\n"
+	"Call-ID: 4037df9284354df39065195bd57a4b14\r\n"
+	"CSeq: 3 REGISTER\r\n"
+	"Contact: <sip:192.168.172.6:12723;transport=tls;ms-opaque=fad3dfab32>;methods=\"INVITE, MESSAGE, INFO, OPTIONS, BYE, CANCEL, NOTIFY, ACK, REFER, BENOTIFY\";proxy=replace;+sip.instance=\"<urn:uuid:34D859DB-6585-5F91-A3B4-DE853C15347D>\"\r\n"
+	"User-Agent: UCCAPI/3.5.6907.0 OC/3.5.6907.0 (Microsoft Office Communicator 2007 R2)\r\n"
+	"Supported: gruu-10, adhoclist, msrtc-event-categories\r\n"
+	"Supported: ms-forking\r\n"
+	"ms-keep-alive: UAC;hop-hop=yes\r\n"
+	"Event: registration\r\n"
+	"Proxy-Authorization: NTLM qop=\"auth\", realm=\"SIP Communications Service\", opaque=\"2BDBAC9D\", targetname=\"cosmo-ocs-r2.cosmo.local\", version=4, gssapi-data=\"TlRMTVNTUAADAAAAGAAYAHIAAADGAMYAigAAAAoACgBIAAAACAAIAFIAAAAYABgAWgAAABAAEABQAQAAVYKYYgUCzg4AAAAPQwBPAFMATQBPAFUAcwBlAHIAQwBPAFMATQBPAC0ATwBDAFMALQBSADIAoeku/k4Hi/fFwASazGFmwtauh1yw/apBjcDIAK527KYG0rn769BHMQEBAAAAAAAAWVGaFye5ygHWrodcsP2qQQAAAAACAAoAQwBPAFMATQBPAAEAGABDAE8AUwBNAE8ALQBPAEMAUwAtAFIAMgAEABYAYwBvAHMAbQBvAC4AbABvAGMAYQBsAAMAMABjAG8AcwBtAG8ALQBvAGMAcwAtAHIAMgAuAGMAbwBzAG0AbwAuAGwAbwBjAGEAbAAFABYAYwBvAHMAbQBvAC4AbABvAGMAYQBsAAAAAAAAAAAAMctznhyoCkmFkeiueXEV5A==\", crand=\"13317733\", cnum=\"1\", response=\"0100000029618e9651b65a7764000000\"\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+static const gchar *register_response =
+	"SIP/2.0 200 OK\r\n"
+	"ms-keep-alive: UAS; tcp=no; hop-hop=yes; end-end=no; timeout=300\r\n"
+	"Authentication-Info: NTLM rspauth=\"01000000E615438A917661BE64000000\", srand=\"9616454F\", snum=\"1\", opaque=\"2BDBAC9D\", qop=\"auth\", targetname=\"cosmo-ocs-r2.cosmo.local\", realm=\"SIP Communications Service\"\r\n"
+	"From: \"User\"<sip:user@cosmo.local>;tag=3e49177a52;epid=c8ca638a15\r\n"
+	"To: <sip:user@cosmo.local>;tag=5E61CCD925D17E043D9A74835A88F664\r\n"
+	"Call-ID: 4037df9284354df39065195bd57a4b14\r\n"
+	"CSeq: 3 REGISTER\r\n"
+	"Via: SIP/2.0/TLS 192.168.172.6:12723;ms-received-port=12723;ms-received-cid=2600\r\n"
+	"Contact: <sip:192.168.172.6:12723;transport=tls;ms-opaque=fad3dfab32;ms-received-cid=2600>;expires=7200;+sip.instance=\"<urn:uuid:34d859db-6585-5f91-a3b4-de853c15347d>\";gruu=\"sip:user@cosmo.local;opaque=user:epid:21nYNIVlkV-jtN6FPBU0fQAA;gruu\"\r\n"
+	"Expires: 7200\r\n"
+	"presence-state: register-action=\"added\"\r\n"
+	"Allow-Events: vnd-microsoft-provisioning,vnd-microsoft-roaming-contacts,vnd-microsoft-roaming-ACL,presence,presence.wpending,vnd-microsoft-roaming-self,vnd-microsoft-provisioning-v2\r\n"
+	"Supported: adhoclist\r\n"
+	"Server: RTC/3.5\r\n"
+	"Supported: msrtc-event-categories\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+static const gchar *ntlm_challenge =
+	"TlRMTVNTUAACAAAAAAAAADgAAADzgpji3Ruq9OfiGNEAAAAAAAAAAJYAlgA4AAAABQLODgAAAA8CAAoAQwBPAFMATQBPAAEAGABDAE8AUwBNAE8ALQBPAEMAUwAtAFIAMgAEABYAYwBvAHMAbQBvAC4AbABvAGMAYQBsAAMAMABjAG8AcwBtAG8ALQBvAGMAcwAtAHIAMgAuAGMAbwBzAG0AbwAuAGwAbwBjAGEAbAAFABYAYwBvAHMAbQBvAC4AbABvAGMAYQBsAAAAAAA=";
+
+static const gchar *ntlm_signature_input =
+	"<NTLM><13317733><1><SIP Communications Service><cosmo-ocs-r2.cosmo.local><4037df9284354df39065195bd57a4b14><3><REGISTER><sip:user@cosmo.local><3e49177a52><sip:user@cosmo.local><><><><>";
+
+#ifdef HAVE_VV
+static const gchar *sdp_offer =
+	"v=0\r\n"
+	"o=- 0 0 IN IP4 192.168.172.6\r\n"
+	"s=session\r\n"
+	"c=IN IP4 192.168.172.6\r\n"
+	"b=CT:99980\r\n"
+	"t=0 0\r\n"
+	"m=audio 50040 RTP/AVP 114 111 112 115 116 4 8 0 97 13 118 101\r\n"
+	"a=x-ssrc-range:3254559488-3254559488\r\n"
+	"a=rtcp-fb:* x-message app send:dsh recv:dsh\r\n"
+	"a=rtcp-rsize\r\n"
+	"a=label:main-audio\r\n"
+	"a=x-source:main-audio\r\n"
+	"a=ice-ufrag:Ly0+\r\n"
+	"a=ice-pwd:5hBooDyGXhpbRhRw2W8xJnIU\r\n"
+	"a=candidate:1 1 UDP 2130706431 192.168.172.6 50040 typ host \r\n"
+	"a=candidate:1 2 UDP 2130705918 192.168.172.6 50041 typ host \r\n"
+	"a=candidate:2 1 TCP-PASS 174455807 10.0.0.20 59038 typ relay raddr 192.168.172.6 rport 59038\r\n"
+	"a=candidate:2 2 TCP-PASS 174455294 10.0.0.20 59038 typ relay raddr 192.168.172.6 rport 59038\r\n"
+	"a=candidate:3 1 UDP 184547327 10.0.0.20 51748 typ relay raddr 192.168.172.6 rport 50042\r\n"
+	"a=candidate:3 2 UDP 184546814 10.0.0.20 52108 typ relay raddr 192.168.172.6 rport 50043\r\n"
+	"a=candidate:4 1 UDP 1694234111 80.0.0.1 50042 typ srflx raddr 192.168.172.6 rport 50042\r\n"
+	"a=candidate:4 2 UDP 1694233598 80.0.0.1 50043 typ srflx raddr 192.168.172.6 rport 50043\r\n"
+	"a=cryptoscale:1 client AES_CM_128_HMAC_SHA1_80 inline:nWHBLiDSW6P3QrTfitRBPjgHOhr8/cnhQ4qYsoS6|2^31|1:1\r\n"
+	"a=crypto:2 AES_CM_128_HMAC_SHA1_80 inline:qGIec56NDfjZpHA1/9pUbuMkpxfUWbbzA5VByaWi|2^31|1:1\r\n"
+	"a=crypto:3 AES_CM_128_HMAC_SHA1_80 inline:/pWxUQ4HItSp0DN+QDTlWKyv7gxzM7D1fu+kSUck|2^31\r\n"
+	"a=remote-candidates:1 192.168.172.7 50020 2 192.168.172.7 50021\r\n"
+	"a=maxptime:200\r\n"
+	"a=rtpmap:114 x-msrta/16000\r\n"
+	"a=fmtp:114 bitrate=29000\r\n"
+	"a=rtpmap:111 SIREN/16000\r\n"
+	"a=fmtp:111 bitrate=16000\r\n"
+	"a=rtpmap:112 G7221/16000\r\n"
+	"a=fmtp:112 bitrate=24000\r\n"
+	"a=rtpmap:115 x-msrta/8000\r\n"
+	"a=fmtp:115 bitrate=11800\r\n"
+	"a=rtpmap:116 AAL2-G726-32/8000\r\n"
+	"a=rtpmap:4 G723/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:97 RED/8000\r\n"
+	"a=rtpmap:13 CN/8000\r\n"
+	"a=rtpmap:118 CN/16000\r\n"
+	"a=rtpmap:101 telephone-event/8000\r\n"
+	"a=fmtp:101 0-16\r\n"
+	"a=rtcp:50041\r\n"
+	"a=ptime:20\r\n";
+#endif
+
+/* recorded payload structure, repeated to OCS-sized contact lists */
+#define BENCH_CONTACTS 500
+#define BENCH_GROUPS    20
+
+static gchar *create_roaming_contacts(void)
+{
+	GString *xml = g_string_new("<contactList deltaNum=\"1011\" xmlns=\"http://schemas.microsoft.com/2006/09/sip/contactlist\">\r\n");
+	guint i;
+
+	for (i = 0; i < BENCH_GROUPS; i++)
+		g_string_append_printf(xml,
+				       "<group id=\"%u\" name=\"Group %u\" externalURI=\"\"/>\r\n",
+				       i + 1, i + 1);
+	for (i = 0; i < BENCH_CONTACTS; i++)
+		g_string_append_printf(xml,
+				       "<contact uri=\"sip:user%u@cosmo.local\" name=\"User %u\" groups=\"%u %u\" subscribed=\"true\" externalURI=\"\">"
+				       "<contactSettings contactId=\"%08X-1111-2222-3333-444455556666\"><encryptedContactData/></contactSettings>"
+				       "</contact>\r\n",
+				       i, i,
+				       1 + i % BENCH_GROUPS,
+				       1 + (i + 7) % BENCH_GROUPS,
+				       i);
+	g_string_append(xml, "</contactList>\r\n");
+
+	return(g_string_free(xml, FALSE));
+}
+
+static gchar *create_rlmi_categories(void)
+{
+	GString *xml = g_string_new("<list xmlns=\"urn:ietf:params:xml:ns:rlmi\" uri=\"sip:user@cosmo.local\" version=\"1\" fullState=\"true\">\r\n");
+	guint i;
+
+	for (i = 0; i < BENCH_CONTACTS; i++)
+		g_string_append_printf(xml,
+				       "<resource uri=\"sip:user%u@cosmo.local\" version=\"1\"><instance id=\"%u\" state=\"active\" cid=\"%u@cosmo.local\"/></resource>\r\n",
+				       i, i, i);
+	g_string_append(xml, "</list>\r\n");
+
+	for (i = 0; i < BENCH_CONTACTS; i++)
+		g_string_append_printf(xml,
+				       "<categories xmlns=\"http://schemas.microsoft.com/2006/09/sip/categories\" uri=\"sip:user%u@cosmo.local\">"
+				       "<category name=\"state\" instance=\"1\" publishTime=\"2010-03-01T10:08:08.433\">"
+				       "<state xsi:type=\"aggregateState\" lastActive=\"2010-03-01T10:00:00\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xmlns=\"http://schemas.microsoft.com/2006/09/sip/state\">"
+				       "<availability>3500</availability><endpointLocation></endpointLocation>"
+				       "</state></category>"
+				       "<category name=\"note\" publishTime=\"2010-03-01T10:08:08.433\">"
+				       "<note xmlns=\"http://schemas.microsoft.com/2006/09/sip/note\"><body type=\"personal\" uri=\"\">Out of office %u</body></note>"
+				       "</category>"
+				       "<category name=\"contactCard\" instance=\"0\" publishTime=\"2010-03-01T10:08:08.433\">"
+				       "<contactCard xmlns=\"http://schemas.microsoft.com/2006/09/sip/contactcard\"><identity><name><displayName>User %u</displayName></name></identity><title>Engineer</title></contactCard>"
+				       "</category>"
+				       "</categories>\r\n",
+				       i, i, i);
+
+	return(g_string_free(xml, FALSE));
+}
+
+/* benchmarks */
+static void bench_sipmsg_parse_header(gconstpointer data)
+{
+	sipmsg_free(sipmsg_parse_header(data));
+}
+
+static void bench_sipmsg_parse_msg(gconstpointer data)
+{
+	sipmsg_free(sipmsg_parse_msg(data));
+}
+
+static void bench_sipmsg_to_string(gconstpointer data)
+{
+	g_free(sipmsg_to_string(data));
+}
+
+static void bench_sipe_xml_parse(gconstpointer data)
+{
+	sipe_xml_free(sipe_xml_parse(data, strlen(data)));
+}
+
+static void bench_sipmsg_breakdown(gconstpointer data)
+{
+	struct sipmsg_breakdown msgbd;
+	gchar *realm  = "SIP Communications Service";
+	gchar *target = "cosmo-ocs-r2.cosmo.local";
+
+	memset(&msgbd, 0, sizeof(struct sipmsg_breakdown));
+	msgbd.msg = (struct sipmsg *) data;
+	sipmsg_breakdown_parse(&msgbd, realm, target, NULL);
+	g_free(sipmsg_breakdown_get_string(4, &msgbd));
+	sipmsg_breakdown_free(&msgbd);
+}
+
+static void bench_ntlm_signature(gconstpointer data)
+{
+	g_free(sip_sec_make_signature((SipSecContext) data,
+				      ntlm_signature_input));
+}
+
+static guint8 hex_buffer[256];
+
+static void bench_buff_to_hex_str(gconstpointer data)
+{
+	g_free(buff_to_hex_str(data, sizeof(hex_buffer)));
+}
+
+static void bench_hex_str_to_buff(gconstpointer data)
+{
+	guint8 *buff;
+	hex_str_to_buff(data, &buff);
+	g_free(buff);
+}
+
+static void bench_find_header_end(gconstpointer data)
+{
+	if (!sipe_str_find_header_end(data, strlen(data)))
+		abort();
+}
+
+static void bench_ascii_strdown(gconstpointer data)
+{
+	g_free(sipe_str_ascii_strdown(data));
+}
+
+static void bench_str_replace(gconstpointer data)
+{
+	g_free(sipe_utils_str_replace(data, "\r\n", "\n"));
+}
+
+static void bench_str_to_time(gconstpointer data)
+{
+	if (!sipe_utils_str_to_time(data))
+		abort();
+}
+
+/* reference for bench_str_to_time() */
+static void bench_iso8601_glib(gconstpointer data)
+{
+	GTimeVal tv;
+	if (!g_time_val_from_iso8601(data, &tv))
+		abort();
+}
+
+#ifdef HAVE_VV
+static void bench_sdpmsg_parse_msg(gconstpointer data)
+{
+	gchar *copy = g_strdup(data);
+	sdpmsg_free(sdpmsg_parse_msg(copy));
+	g_free(copy);
+}
+
+static void bench_sdpmsg_to_string(gconstpointer data)
+{
+	g_free(sdpmsg_to_string(data));
+}
+#endif
+
+static SipSecContext create_ntlm_context(void)
+{
+	SipSecContext context = sip_sec_create_context(SIPE_AUTHENTICATION_TYPE_NTLM,
+						       FALSE,
+						       FALSE,
+						       "COSMO\\User",
+						       "Password");
+	gchar *output = NULL;
+	guint expires;
+
+	if (!context)
+		return(NULL);
+
+	/* connection-less NTLM: empty initial message, then challenge */
+	if (sip_sec_init_context_step(context, "cosmo-ocs-r2.cosmo.local",
+				      NULL, &output, &expires)) {
+		g_free(output);
+		output = NULL;
+		if (sip_sec_init_context_step(context, "cosmo-ocs-r2.cosmo.local",
+					      ntlm_challenge, &output, &expires) &&
+		    sip_sec_context_is_ready(context)) {
+			g_free(output);
+			return(context);
+		}
+	}
+
+	g_free(output);
+	sip_sec_destroy_context(context);
+	return(NULL);
+}
+
+int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char *argv[])
+{
+	gchar *header   = g_strndup(register_request,
+				    strstr(register_request, "\r\n\r\n") - register_request);
+	struct sipmsg *request  = sipmsg_parse_msg(register_request);
+	struct sipmsg *response = sipmsg_parse_msg(register_response);
+	gchar *contacts = create_roaming_contacts();
+	gchar *rlmi     = create_rlmi_categories();
+	SipSecContext ntlm;
+	gchar *hex;
+	guint i;
+#ifdef HAVE_VV
+	struct sdpmsg *sdp;
+	gchar *copy;
+#endif
+
+	sip_sec_init();
+
+	printf("%-32s %10s %18s%s\n",
+	       "benchmark", "iterations", "time",
+	       BENCH_COUNT_ALLOCATIONS ? "          allocations" : "");
+
+	bench_run("sipmsg_parse_header",         bench_sipmsg_parse_header, header);
+	bench_run("sipmsg_parse_msg",            bench_sipmsg_parse_msg,    register_response);
+	bench_run("sipmsg_to_string",            bench_sipmsg_to_string,    request);
+	bench_run("sipe_xml_parse/contacts",     bench_sipe_xml_parse,      contacts);
+	bench_run("sipe_xml_parse/rlmi",         bench_sipe_xml_parse,      rlmi);
+	bench_run("sipmsg_breakdown/request",    bench_sipmsg_breakdown,    request);
+	bench_run("sipmsg_breakdown/response",   bench_sipmsg_breakdown,    response);
+
+	for (i = 0; i < sizeof(hex_buffer); i++)
+		hex_buffer[i] = i;
+	hex = buff_to_hex_str(hex_buffer, sizeof(hex_buffer));
+	bench_run("buff_to_hex_str/256",         bench_buff_to_hex_str,     hex_buffer);
+	bench_run("hex_str_to_buff/256",         bench_hex_str_to_buff,     hex);
+	bench_run("sipe_str_find_header_end",    bench_find_header_end,     register_response);
+	bench_run("sipe_str_ascii_strdown",      bench_ascii_strdown,       contacts);
+	bench_run("sipe_utils_str_replace",      bench_str_replace,         register_response);
+	g_free(hex);
+
+	bench_run("sipe_utils_str_to_time",      bench_str_to_time,         "2015-03-04T10:00:00Z");
+	bench_run("sipe_utils_str_to_time/frac", bench_str_to_time,         "2015-03-04T10:00:00.1234567Z");
+	bench_run("sipe_utils_str_to_time/tz",   bench_str_to_time,         "2015-03-04T10:00:00+01:00");
+	bench_run("g_time_val_from_iso8601",     bench_iso8601_glib,        "2015-03-04T10:00:00Z");
+
+	ntlm = create_ntlm_context();
+	if (ntlm) {
+		bench_run("sip_sec_make_signature/ntlm", bench_ntlm_signature, ntlm);
+		sip_sec_destroy_context(ntlm);
+	} else {
+		printf("%-32s skipped\n", "sip_sec_make_signature/ntlm");
+	}
+
+#ifdef HAVE_VV
+	bench_run("sdpmsg_parse_msg",            bench_sdpmsg_parse_msg,    sdp_offer);
+	copy = g_strdup(sdp_offer);
+	sdp  = sdpmsg_parse_msg(copy);
+	g_free(copy);
+	if (sdp) {
+		bench_run("sdpmsg_to_string",    bench_sdpmsg_to_string,    sdp);
+		sdpmsg_free(sdp);
+	}
+#endif
+
+	sip_sec_destroy();
+
+	g_free(rlmi);
+	g_free(contacts);
+	sipmsg_free(response);
+	sipmsg_free(request);
+	g_free(header);
+
+	return(0);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,503 @@
+/**
+ * @file sipe-buddy-index.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Text values are stored case folded. A key is a pointer to the start of
+ * a word inside such a value, i.e. the table is a suffix array restricted
+ * to word boundaries and needs no additional string allocations. Phone
+ * numbers are reduced to their digits and every position is a key, so
+ * that parts of a number without the country or area code also match.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-buddy-index.h"
+#include "sipe-metrics.h"
+#include "sipe-utils.h"
+
+/* indexed properties */
+enum {
+	INDEX_SLOT_URI,
+	INDEX_SLOT_NAME,
+	INDEX_SLOT_EMAIL,
+	INDEX_SLOT_WORK_PHONE,
+	INDEX_SLOT_MOBILE_PHONE,
+	INDEX_SLOT_HOME_PHONE,
+	INDEX_SLOT_OTHER_PHONE,
+	INDEX_SLOT_CUSTOM1_PHONE,
+	INDEX_SLOTS,
+	INDEX_SLOT_NONE = INDEX_SLOTS
+};
+#define INDEX_SLOT_IS_PHONE(slot) ((slot) >= INDEX_SLOT_WORK_PHONE)
+
+/* ranking */
+static const guint slot_weight[INDEX_SLOTS] = {
+	20, /* URI   */
+	40, /* name  */
+	30, /* email */
+	10, 10, 10, 10, 10,
+};
+#define INDEX_SCORE_FIRST_WORD  5
+#define INDEX_SCORE_EXACT_WORD 10
+
+/* shorter tails of phone numbers aren't useful as keys */
+#define INDEX_PHONE_MIN_DIGITS 3
+
+struct index_record {
+	gchar *uri;
+	gchar *values[INDEX_SLOTS]; /* folded, NULL if unknown */
+};
+
+struct index_key {
+	const gchar *text;          /* points into record->values[] */
+	struct index_record *record;
+	guint slot;
+	gboolean first;             /* start of value */
+};
+
+struct sipe_buddy_index {
+	GHashTable *records;        /* key: URI, value: index_record */
+	GArray *keys;               /* index_key, sorted */
+	gboolean stale;             /* keys need to be rebuilt */
+};
+
+struct index_match {
+	const struct index_record *record;
+	guint words;                /* number of query words matched */
+	guint score;
+	guint word_score;           /* best score for the current word */
+};
+
+static guint index_slot(sipe_buddy_info_fields propkey)
+{
+	switch (propkey) {
+	case SIPE_BUDDY_INFO_DISPLAY_NAME:
+		return(INDEX_SLOT_NAME);
+	case SIPE_BUDDY_INFO_EMAIL:
+		return(INDEX_SLOT_EMAIL);
+	case SIPE_BUDDY_INFO_WORK_PHONE:
+	case SIPE_BUDDY_INFO_WORK_PHONE_DISPLAY:
+		return(INDEX_SLOT_WORK_PHONE);
+	case SIPE_BUDDY_INFO_MOBILE_PHONE:
+	case SIPE_BUDDY_INFO_MOBILE_PHONE_DISPLAY:
+		return(INDEX_SLOT_MOBILE_PHONE);
+	case SIPE_BUDDY_INFO_HOME_PHONE:
+	case SIPE_BUDDY_INFO_HOME_PHONE_DISPLAY:
+		return(INDEX_SLOT_HOME_PHONE);
+	case SIPE_BUDDY_INFO_OTHER_PHONE:
+	case SIPE_BUDDY_INFO_OTHER_PHONE_DISPLAY:
+		return(INDEX_SLOT_OTHER_PHONE);
+	case SIPE_BUDDY_INFO_CUSTOM1_PHONE:
+	case SIPE_BUDDY_INFO_CUSTOM1_PHONE_DISPLAY:
+		return(INDEX_SLOT_CUSTOM1_PHONE);
+	default:
+		return(INDEX_SLOT_NONE);
+	}
+}
+
+/* "tel:+1 (425) 555-0100" and "+14255550100" both become "14255550100" */
+static gchar *index_fold_phone(const gchar *value)
+{
+	gchar *digits = g_malloc(strlen(value) + 1);
+	gchar *p = digits;
+
+	for (; *value; value++)
+		if (g_ascii_isdigit(*value))
+			*p++ = *value;
+	*p = '\0';
+
+	return(digits);
+}
+
+static gchar *index_fold(guint slot, const gchar *value)
+{
+	gchar *folded;
+
+	if (is_empty(value))
+		return(NULL);
+
+	if (INDEX_SLOT_IS_PHONE(slot))
+		folded = index_fold_phone(value);
+	else
+		folded = g_utf8_casefold(value, -1);
+
+	if (!*folded) {
+		g_free(folded);
+		return(NULL);
+	}
+
+	return(folded);
+}
+
+/* words start with a letter or digit, anything else is a separator */
+static gboolean index_is_word_char(const gchar *p)
+{
+	return(g_unichar_isalnum(g_utf8_get_char(p)));
+}
+
+static void index_add_key(GArray *keys,
+			  struct index_record *record,
+			  guint slot,
+			  const gchar *text)
+{
+	struct index_key key;
+
+	key.text   = text;
+	key.record = record;
+	key.slot   = slot;
+	key.first  = (text == record->values[slot]);
+	g_array_append_val(keys, key);
+}
+
+static void index_add_keys(GArray *keys,
+			   struct index_record *record,
+			   guint slot)
+{
+	const gchar *value = record->values[slot];
+
+	if (INDEX_SLOT_IS_PHONE(slot)) {
+		/* digits only: every position is a key */
+		gsize length = strlen(value);
+		gsize i;
+
+		index_add_key(keys, record, slot, value);
+		for (i = 1; i + INDEX_PHONE_MIN_DIGITS <= length; i++)
+			index_add_key(keys, record, slot, value + i);
+
+	} else {
+		const gchar *p;
+		gboolean in_word = FALSE;
+
+		for (p = value; *p; p = g_utf8_next_char(p)) {
+			gboolean word_char = index_is_word_char(p);
+
+			if (word_char && !in_word)
+				index_add_key(keys, record, slot, p);
+			in_word = word_char;
+		}
+	}
+}
+
+static gint index_key_compare(gconstpointer a, gconstpointer b)
+{
+	return(strcmp(((const struct index_key *) a)->text,
+		      ((const struct index_key *) b)->text));
+}
+
+static void index_rebuild(struct sipe_buddy_index *index)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_array_set_size(index->keys, 0);
+
+	g_hash_table_iter_init(&iter, index->records);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct index_record *record = value;
+		guint slot;
+
+		for (slot = 0; slot < INDEX_SLOTS; slot++)
+			if (record->values[slot])
+				index_add_keys(index->keys, record, slot);
+	}
+
+	g_array_sort(index->keys, index_key_compare);
+	index->stale = FALSE;
+}
+
+static void index_record_free(gpointer data)
+{
+	struct index_record *record = data;
+	guint slot;
+
+	for (slot = 0; slot < INDEX_SLOTS; slot++)
+		g_free(record->values[slot]);
+	g_free(record->uri);
+	g_free(record);
+}
+
+struct sipe_buddy_index *sipe_buddy_index_new(void)
+{
+	struct sipe_buddy_index *index = g_new0(struct sipe_buddy_index, 1);
+
+	/* URIs are compared case insensitive, like in sipe-buddy.c */
+	index->records = g_hash_table_new_full(sipe_strcase_hash,
+					       (GEqualFunc) sipe_strcase_equal,
+					       NULL,
+					       index_record_free);
+	index->keys    = g_array_new(FALSE, FALSE, sizeof(struct index_key));
+
+	return(index);
+}
+
+void sipe_buddy_index_free(struct sipe_buddy_index *index)
+{
+	if (index) {
+		g_array_free(index->keys, TRUE);
+		g_hash_table_destroy(index->records);
+		g_free(index);
+	}
+}
+
+void sipe_buddy_index_set(struct sipe_buddy_index *index,
+			  const gchar *uri,
+			  sipe_buddy_info_fields propkey,
+			  const gchar *value)
+{
+	struct index_record *record;
+	guint slot = index_slot(propkey);
+	gchar *folded;
+
+	if (!uri)
+		return;
+
+	record = g_hash_table_lookup(index->records, uri);
+	if (!record) {
+		record = g_new0(struct index_record, 1);
+		record->uri = g_strdup(uri);
+		record->values[INDEX_SLOT_URI] =
+			index_fold(INDEX_SLOT_URI, sipe_get_no_sip_uri(uri));
+		g_hash_table_insert(index->records, record->uri, record);
+		index->stale = TRUE;
+	}
+
+	if (slot == INDEX_SLOT_NONE)
+		return;
+
+	folded = index_fold(slot, value);
+	if (!folded || sipe_strequal(folded, record->values[slot])) {
+		g_free(folded);
+		return;
+	}
+
+	g_free(record->values[slot]);
+	record->values[slot] = folded;
+	index->stale = TRUE;
+}
+
+void sipe_buddy_index_remove(struct sipe_buddy_index *index,
+			     const gchar *uri)
+{
+	if (uri && g_hash_table_remove(index->records, uri))
+		index->stale = TRUE;
+}
+
+/* first key that isn't sorted before word */
+static guint index_lower_bound(GArray *keys, const gchar *word)
+{
+	guint low  = 0;
+	guint high = keys->len;
+
+	while (low < high) {
+		guint middle = low + (high - low) / 2;
+
+		if (strcmp(g_array_index(keys, struct index_key, middle).text,
+			   word) < 0)
+			low  = middle + 1;
+		else
+			high = middle;
+	}
+
+	return(low);
+}
+
+static void index_match_word(struct sipe_buddy_index *index,
+			     GHashTable *matches,
+			     const gchar *word,
+			     guint word_index)
+{
+	gsize length = strlen(word);
+	guint i;
+
+	for (i = index_lower_bound(index->keys, word);
+	     i < index->keys->len;
+	     i++) {
+		const struct index_key *key = &g_array_index(index->keys,
+							     struct index_key,
+							     i);
+		struct index_match *match;
+		guint score;
+
+		if (strncmp(key->text, word, length) != 0)
+			break;
+
+		match = g_hash_table_lookup(matches, key->record);
+		if (!match) {
+			/* all query words have to match */
+			if (word_index > 0)
+				continue;
+			match = g_new0(struct index_match, 1);
+			match->record = key->record;
+			g_hash_table_insert(matches, key->record, match);
+		}
+
+		score = slot_weight[key->slot];
+		if (key->first)
+			score += INDEX_SCORE_FIRST_WORD;
+		if (!key->text[length] ||
+		    (!INDEX_SLOT_IS_PHONE(key->slot) &&
+		     !index_is_word_char(key->text + length)))
+			score += INDEX_SCORE_EXACT_WORD;
+
+		/* count each query word once, with its best key */
+		if (match->words == word_index) {
+			match->words++;
+			match->score     += score;
+			match->word_score = score;
+		} else if ((match->words == word_index + 1) &&
+			   (score > match->word_score)) {
+			match->score     += score - match->word_score;
+			match->word_score = score;
+		}
+	}
+}
+
+static gint index_match_compare(gconstpointer a, gconstpointer b)
+{
+	const struct index_record *record_a = ((const struct index_match *) a)->record;
+	const struct index_record *record_b = ((const struct index_match *) b)->record;
+	guint score_a = ((const struct index_match *) a)->score;
+	guint score_b = ((const struct index_match *) b)->score;
+	const gchar *name_a = record_a->values[INDEX_SLOT_NAME];
+	const gchar *name_b = record_b->values[INDEX_SLOT_NAME];
+
+	if (score_a != score_b)
+		return((score_a > score_b) ? -1 : 1);
+
+	/* same score: sort by display name, buddies without one last */
+	if (name_a && name_b) {
+		gint result = strcmp(name_a, name_b);
+		if (result)
+			return(result);
+	} else if (name_a || name_b) {
+		return(name_a ? -1 : 1);
+	}
+
+	return(strcmp(record_a->uri, record_b->uri));
+}
+
+GSList *sipe_buddy_index_search(struct sipe_buddy_index *index,
+				const gchar *query,
+				guint max_results)
+{
+	GHashTable *matches;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *ranked = NULL;
+	GSList *results = NULL;
+	GSList *entry;
+	gchar *folded;
+	gchar *p;
+	guint words = 0;
+	guint count = 0;
+
+	if (is_empty(query))
+		return(NULL);
+
+	if (index->stale)
+		index_rebuild(index);
+
+	matches = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal,
+					NULL,
+					g_free);
+
+	/* split query at separators, like the indexed values */
+	folded = g_utf8_casefold(query, -1);
+	p      = folded;
+	while (*p) {
+		gchar *start;
+
+		while (*p && !index_is_word_char(p))
+			p = g_utf8_next_char(p);
+		if (!*p)
+			break;
+
+		start = p;
+		while (*p && index_is_word_char(p))
+			p = g_utf8_next_char(p);
+		if (*p) {
+			gchar *next = g_utf8_next_char(p);
+			*p = '\0';
+			p  = next;
+		}
+
+		index_match_word(index, matches, start, words++);
+	}
+	g_free(folded);
+
+	g_hash_table_iter_init(&iter, matches);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct index_match *match = value;
+		if (words && (match->words == words))
+			ranked = g_slist_prepend(ranked, match);
+	}
+	ranked = g_slist_sort(ranked, index_match_compare);
+
+	for (entry = ranked;
+	     entry && ((max_results == 0) || (count < max_results));
+	     entry = entry->next, count++) {
+		const struct index_match *match = entry->data;
+		results = g_slist_prepend(results,
+					  g_strdup(match->record->uri));
+	}
+	g_slist_free(ranked);
+	g_hash_table_destroy(matches);
+
+	return(g_slist_reverse(results));
+}
+
+void sipe_buddy_index_memory_usage(const struct sipe_buddy_index *index,
+				   struct sipe_memory_usage *usage)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!index)
+		return;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_buddy_index));
+	SIPE_MEMORY_OBJECT(usage, index->keys->len * sizeof(struct index_key));
+	sipe_metrics_memory_hash(usage, index->records);
+
+	g_hash_table_iter_init(&iter, index->records);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		const struct index_record *record = value;
+		guint slot;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct index_record));
+		sipe_metrics_memory_string(usage, record->uri);
+		for (slot = 0; slot < INDEX_SLOTS; slot++)
+			sipe_metrics_memory_string(usage, record->values[slot]);
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,114 @@
+/**
+ * @file sipe-buddy-index.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Prefix index over the local roster
+ *
+ * Every word of URI, display name, email address and phone numbers is a
+ * key. Keys are kept in a sorted table, i.e. a prefix lookup is a binary
+ * search followed by a linear scan of the matching range. Updates only
+ * mark the table as stale, it is rebuilt by the next search.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ * "sipe-backend.h"
+ */
+
+/* Forward declarations */
+struct sipe_buddy_index;
+struct sipe_memory_usage;
+
+/**
+ * Create empty index
+ *
+ * @return new index. Free with sipe_buddy_index_free().
+ */
+struct sipe_buddy_index *sipe_buddy_index_new(void);
+
+/**
+ * Free index
+ *
+ * @param index buddy index (may be @c NULL)
+ */
+void sipe_buddy_index_free(struct sipe_buddy_index *index);
+
+/**
+ * Add or update indexed buddy property
+ *
+ * Properties other than display name, email address and phone numbers
+ * are ignored. Adding a buddy is done by setting its URI.
+ *
+ * @param index   buddy index
+ * @param uri     buddy URI
+ * @param propkey property
+ * @param value   new value (may be @c NULL)
+ */
+void sipe_buddy_index_set(struct sipe_buddy_index *index,
+			  const gchar *uri,
+			  sipe_buddy_info_fields propkey,
+			  const gchar *value);
+
+/**
+ * Remove buddy from index
+ *
+ * @param index buddy index
+ * @param uri   buddy URI
+ */
+void sipe_buddy_index_remove(struct sipe_buddy_index *index,
+			     const gchar *uri);
+
+/**
+ * Search index
+ *
+ * Every word of the query must be a prefix of a word in one of the
+ * indexed properties. Matches are ranked by property (display name,
+ * email, URI, phone), word position and exact word matches.
+ *
+ * @param index       buddy index
+ * @param query       search string
+ * @param max_results maximum number of results, 0 for unlimited
+ *
+ * @return list of buddy URIs, best match first. Must be freed with
+ *         sipe_utils_slist_free_full(list, g_free).
+ */
+GSList *sipe_buddy_index_search(struct sipe_buddy_index *index,
+				const gchar *query,
+				guint max_results);
+
+/**
+ * Memory usage of index
+ *
+ * @param index buddy index
+ * @param usage memory usage statistics
+ */
+void sipe_buddy_index_memory_usage(const struct sipe_buddy_index *index,
+				   struct sipe_memory_usage *usage);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
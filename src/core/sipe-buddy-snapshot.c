@@ -0,0 +1,162 @@
+/**
+ * @file sipe-buddy-snapshot.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-buddy.h"
+#include "sipe-buddy-snapshot.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+
+struct sipe_buddy_snapshot {
+	gint ref_count;                           /* g_atomic_int_*() */
+	struct sipe_buddy_snapshot_entry *entries; /* sorted by URI */
+	guint count;
+	GStringChunk *strings;
+};
+
+static const gchar *snapshot_string(struct sipe_buddy_snapshot *snapshot,
+				    const gchar *string)
+{
+	return(string ? g_string_chunk_insert(snapshot->strings, string) : NULL);
+}
+
+static void snapshot_add(SIPE_UNUSED_PARAMETER gpointer key,
+			 gpointer value,
+			 gpointer user_data)
+{
+	const struct sipe_buddy *buddy = value;
+	gpointer *data = user_data;
+	struct sipe_core_private *sipe_private = data[0];
+	struct sipe_buddy_snapshot *snapshot = data[1];
+	struct sipe_buddy_snapshot_entry *entry = snapshot->entries + snapshot->count++;
+
+	entry->uri         = snapshot_string(snapshot, buddy->name);
+	entry->activity    = snapshot_string(snapshot, buddy->activity);
+	entry->note        = snapshot_string(snapshot, buddy->note);
+	entry->note_since  = buddy->note_since;
+	entry->status      = sipe_buddy_get_status(sipe_private, buddy->name);
+	entry->is_oof_note = buddy->is_oof_note;
+	entry->is_mobile   = buddy->is_mobile;
+}
+
+static int snapshot_compare(const void *a, const void *b)
+{
+	return(g_ascii_strcasecmp(((const struct sipe_buddy_snapshot_entry *) a)->uri,
+				  ((const struct sipe_buddy_snapshot_entry *) b)->uri));
+}
+
+static struct sipe_buddy_snapshot *snapshot_build(struct sipe_core_private *sipe_private)
+{
+	struct sipe_buddy_snapshot *snapshot = g_new0(struct sipe_buddy_snapshot, 1);
+	guint count = sipe_buddy_count(sipe_private);
+	gpointer data[2];
+
+	snapshot->ref_count = 1;
+	snapshot->entries   = g_new0(struct sipe_buddy_snapshot_entry, MAX(count, 1));
+	snapshot->strings   = g_string_chunk_new(4096);
+
+	data[0] = sipe_private;
+	data[1] = snapshot;
+	sipe_buddy_foreach(sipe_private, snapshot_add, data);
+	qsort(snapshot->entries, snapshot->count,
+	      sizeof(struct sipe_buddy_snapshot_entry),
+	      snapshot_compare);
+
+	SIPE_DEBUG_INFO("snapshot_build: %u buddies", snapshot->count);
+
+	return(snapshot);
+}
+
+struct sipe_buddy_snapshot *sipe_buddy_snapshot_get(struct sipe_core_private *sipe_private)
+{
+	if (!sipe_private->buddy_snapshot)
+		sipe_private->buddy_snapshot = snapshot_build(sipe_private);
+	return(sipe_buddy_snapshot_ref(sipe_private->buddy_snapshot));
+}
+
+void sipe_buddy_snapshot_invalidate(struct sipe_core_private *sipe_private)
+{
+	/* readers keep their reference */
+	sipe_buddy_snapshot_unref(sipe_private->buddy_snapshot);
+	sipe_private->buddy_snapshot = NULL;
+}
+
+struct sipe_buddy_snapshot *sipe_buddy_snapshot_ref(struct sipe_buddy_snapshot *snapshot)
+{
+	g_atomic_int_inc(&snapshot->ref_count);
+	return(snapshot);
+}
+
+void sipe_buddy_snapshot_unref(struct sipe_buddy_snapshot *snapshot)
+{
+	if (snapshot && g_atomic_int_dec_and_test(&snapshot->ref_count)) {
+		g_string_chunk_free(snapshot->strings);
+		g_free(snapshot->entries);
+		g_free(snapshot);
+	}
+}
+
+guint sipe_buddy_snapshot_count(const struct sipe_buddy_snapshot *snapshot)
+{
+	return(snapshot->count);
+}
+
+const struct sipe_buddy_snapshot_entry *sipe_buddy_snapshot_entry(const struct sipe_buddy_snapshot *snapshot,
+								  guint index)
+{
+	return((index < snapshot->count) ? snapshot->entries + index : NULL);
+}
+
+const struct sipe_buddy_snapshot_entry *sipe_buddy_snapshot_find(const struct sipe_buddy_snapshot *snapshot,
+								 const gchar *uri)
+{
+	struct sipe_buddy_snapshot_entry key;
+
+	if (!uri)
+		return(NULL);
+
+	key.uri = uri;
+	return(bsearch(&key, snapshot->entries, snapshot->count,
+		       sizeof(struct sipe_buddy_snapshot_entry),
+		       snapshot_compare));
+}
+
+void sipe_buddy_snapshot_free(struct sipe_core_private *sipe_private)
+{
+	sipe_buddy_snapshot_invalidate(sipe_private);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
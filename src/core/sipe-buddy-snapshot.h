@@ -0,0 +1,143 @@
+/**
+ * @file sipe-buddy-snapshot.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Read-only snapshots of the buddy table
+ *
+ * The buddy table is modified in place on the main thread. Code running
+ * on worker threads (see sipe-job.h) gets a snapshot instead: an
+ * immutable, reference counted copy of the buddy data, ordered by URI.
+ * Readers don't need a lock and may keep the snapshot as long as they
+ * want.
+ *
+ * A snapshot is built on the first request after the buddy table has
+ * changed, i.e. after buddies were added or removed or a batch of
+ * presence updates has been delivered. Until then all requests share
+ * the same snapshot.
+ *
+ * Interface dependencies:
+ *
+ * <time.h>
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_buddy_snapshot;
+
+struct sipe_buddy_snapshot_entry {
+	const gchar *uri;
+	const gchar *activity; /* may be NULL */
+	const gchar *note;     /* HTML, may be NULL */
+	time_t note_since;
+	guint status;          /* SIPE_ACTIVITY_xxx */
+	gboolean is_oof_note;
+	gboolean is_mobile;
+};
+
+/**
+ * Get snapshot of the current buddy table
+ *
+ * Main thread only.
+ *
+ * @param sipe_private SIPE core private data
+ *
+ * @return snapshot. Must be released with @c sipe_buddy_snapshot_unref()
+ */
+struct sipe_buddy_snapshot *sipe_buddy_snapshot_get(struct sipe_core_private *sipe_private);
+
+/**
+ * Buddy table has changed
+ *
+ * Main thread only. Existing snapshots are not affected.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_buddy_snapshot_invalidate(struct sipe_core_private *sipe_private);
+
+/**
+ * Add a reference to a snapshot
+ *
+ * Safe to call from any thread.
+ *
+ * @param snapshot snapshot
+ *
+ * @return @c snapshot
+ */
+struct sipe_buddy_snapshot *sipe_buddy_snapshot_ref(struct sipe_buddy_snapshot *snapshot);
+
+/**
+ * Release a snapshot
+ *
+ * Safe to call from any thread.
+ *
+ * @param snapshot snapshot (may be @c NULL)
+ */
+void sipe_buddy_snapshot_unref(struct sipe_buddy_snapshot *snapshot);
+
+/**
+ * Number of buddies in a snapshot
+ *
+ * @param snapshot snapshot
+ *
+ * @return number of entries
+ */
+guint sipe_buddy_snapshot_count(const struct sipe_buddy_snapshot *snapshot);
+
+/**
+ * Access a snapshot entry
+ *
+ * @param snapshot snapshot
+ * @param index    0 to @c sipe_buddy_snapshot_count() - 1
+ *
+ * @return entry. Valid as long as the snapshot is referenced
+ */
+const struct sipe_buddy_snapshot_entry *sipe_buddy_snapshot_entry(const struct sipe_buddy_snapshot *snapshot,
+								  guint index);
+
+/**
+ * Find a buddy in a snapshot
+ *
+ * @param snapshot snapshot
+ * @param uri      buddy URI (case insensitive)
+ *
+ * @return entry or @c NULL. Valid as long as the snapshot is referenced
+ */
+const struct sipe_buddy_snapshot_entry *sipe_buddy_snapshot_find(const struct sipe_buddy_snapshot *snapshot,
+								 const gchar *uri);
+
+/**
+ * Release the current snapshot of a SIPE instance
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_buddy_snapshot_free(struct sipe_core_private *sipe_private);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -37,17 +37,24 @@
 #include "sip-transport.h"
 #include "sipe-backend.h"
 #include "sipe-buddy.h"
+#include "sipe-buddy-index.h"
+#include "sipe-buddy-snapshot.h"
+#include "sipe-cache.h"
 #include "sipe-cal.h"
 #include "sipe-chat.h"
 #include "sipe-conf.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-directory-cache.h"
 #include "sipe-group.h"
 #include "sipe-http.h"
 #include "sipe-im.h"
+#include "sipe-intern.h"
+#include "sipe-metrics.h"
 #include "sipe-nls.h"
 #include "sipe-ocs2005.h"
 #include "sipe-ocs2007.h"
+#include "sipe-photo-cache.h"
 #include "sipe-schedule.h"
 #include "sipe-session.h"
 #include "sipe-status.h"
@@ -64,22 +71,76 @@ struct sipe_buddies {
 
 	/* Pending photo download HTTP requests */
 	GSList *pending_photo_requests;
+
+	/* Photo fetch manager */
+	GQueue *photo_queue;     /* URIs waiting for a free slot */
+	GHashTable *photo_state; /* key: URI, value: PHOTO_QUEUED/PHOTO_ACTIVE */
+	guint photo_active;
+	gboolean photo_scheduled;
+
+	/* Presence updates waiting to be delivered to the backend */
+	GHashTable *status_pending; /* key: URI, value: activity */
+	gboolean status_scheduled;
+
+	/* Contact searches */
+	GHashTable *searches;  /* key: search ID, value: sipe_buddy_search */
+	guint search_id;
+	GSList *search_cache;  /* sipe_buddy_search, most recent first */
+
+	/* Local roster search */
+	struct sipe_buddy_index *index;
 };
 
-struct buddy_group_data {
-	const struct sipe_group *group;
-	gboolean is_obsolete;
+/* number of concurrent photo lookups/downloads */
+#define BUDDY_PHOTO_WINDOW 4
+/* pause before free slots are filled again, in milliseconds */
+#define BUDDY_PHOTO_DELAY  100
+#define BUDDY_PHOTO_ACTION "<+buddy-photo>"
+
+/* maximum delay before pending presence updates reach the backend */
+#define BUDDY_STATUS_DELAY  250
+#define BUDDY_STATUS_ACTION "<+buddy-status>"
+
+/* lifetime & number of cached contact search results */
+#define BUDDY_SEARCH_CACHE_TTL  60 /* seconds */
+#define BUDDY_SEARCH_CACHE_SIZE 8
+
+#define PHOTO_QUEUED GINT_TO_POINTER(1)
+#define PHOTO_ACTIVE GINT_TO_POINTER(2)
+
+/* group membership bitmaps, see sipe_buddy->groups */
+#define GROUP_WORD(slot) ((slot) / 32)
+#define GROUP_BIT(slot)  (1U << ((slot) % 32))
+
+struct buddy_search_row {
+	gchar *uri;
+	gchar *name;
+	gchar *company;
+	gchar *country;
+	gchar *email;
+};
+
+struct sipe_buddy_search {
+	guint id;
+	struct sipe_backend_search_token *token;
+	gchar *query;   /* cache key */
+	GSList *rows;   /* buddy_search_row */
+	guint count;
+	gboolean more;
+	gint64 expires; /* only for cached results, sipe_utils_monotonic_sec() */
 };
 
 struct photo_response_data {
 	gchar *who;
 	gchar *photo_hash;
 	struct sipe_http_request *request;
+	GByteArray *photo; /* received so far */
 };
 
 static void buddy_fetch_photo(struct sipe_core_private *sipe_private,
 			      const gchar *uri);
 static void photo_response_data_free(struct photo_response_data *data);
+static void buddy_search_free(struct sipe_buddy_search *search);
 
 void sipe_buddy_add_keys(struct sipe_core_private *sipe_private,
 			 struct sipe_buddy *buddy,
@@ -92,8 +153,56 @@ void sipe_buddy_add_keys(struct sipe_core_private *sipe_private,
 				    buddy->exchange_key,
 				    buddy);
 	}
-	if (change_key)
+	if (change_key) {
+		g_free(buddy->change_key);
 		buddy->change_key = g_strdup(change_key);
+	}
+}
+
+void sipe_buddy_set_pool(struct sipe_core_private *sipe_private,
+			 const gchar *uri,
+			 const gchar *pool)
+{
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private, uri);
+
+	if (buddy && !sipe_strequal(buddy->pool, pool)) {
+		SIPE_DEBUG_INFO("sipe_buddy_set_pool: %s on pool %s",
+				uri, pool ? pool : "<unknown>");
+		g_free(buddy->pool);
+		buddy->pool = g_strdup(pool);
+	}
+}
+
+struct sipe_buddy_extended *sipe_buddy_extended(struct sipe_buddy *buddy)
+{
+	if (!buddy->ext)
+		buddy->ext = g_new0(struct sipe_buddy_extended, 1);
+	return(buddy->ext);
+}
+
+/* properties still known by the backend from the last session */
+static void buddy_index_add(struct sipe_core_private *sipe_private,
+			    const gchar *uri)
+{
+	struct sipe_buddy_index *index = sipe_private->buddies->index;
+	sipe_backend_buddy bb = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
+							uri,
+							NULL);
+
+	/* adds URI, even without other properties */
+	sipe_buddy_index_set(index, uri, SIPE_BUDDY_INFO_DISPLAY_NAME, NULL);
+	if (bb) {
+		gchar *value = sipe_backend_buddy_get_server_alias(SIPE_CORE_PUBLIC,
+								   bb);
+		sipe_buddy_index_set(index, uri, SIPE_BUDDY_INFO_DISPLAY_NAME, value);
+		g_free(value);
+
+		value = sipe_backend_buddy_get_string(SIPE_CORE_PUBLIC,
+						      bb,
+						      SIPE_BUDDY_INFO_EMAIL);
+		sipe_buddy_index_set(index, uri, SIPE_BUDDY_INFO_EMAIL, value);
+		g_free(value);
+	}
 }
 
 struct sipe_buddy *sipe_buddy_add(struct sipe_core_private *sipe_private,
@@ -101,16 +210,15 @@ struct sipe_buddy *sipe_buddy_add(struct sipe_core_private *sipe_private,
 				  const gchar *exchange_key,
 				  const gchar *change_key)
 {
-	/* Buddy name must be lower case as we use purple_normalize_nocase() to compare */
-	gchar *normalized_uri = g_ascii_strdown(uri, -1);
-	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
-							  normalized_uri);
+	/* URI table is case insensitive: no need to normalize for lookup */
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private, uri);
 
 	if (!buddy) {
 		buddy = g_new0(struct sipe_buddy, 1);
-		buddy->name = normalized_uri;
+		/* Buddy name must be lower case as we use purple_normalize_nocase() to compare */
+		buddy->name = sipe_intern_uri_lower(uri);
 		g_hash_table_insert(sipe_private->buddies->uri,
-				    buddy->name,
+				    (gpointer) buddy->name,
 				    buddy);
 
 		sipe_buddy_add_keys(sipe_private,
@@ -118,42 +226,105 @@ struct sipe_buddy *sipe_buddy_add(struct sipe_core_private *sipe_private,
 				    exchange_key,
 				    change_key);
 
-		SIPE_DEBUG_INFO("sipe_buddy_add: Added buddy %s", normalized_uri);
+		SIPE_DEBUG_INFO("sipe_buddy_add: Added buddy %s", buddy->name);
+		sipe_buddy_snapshot_invalidate(sipe_private);
+		buddy_index_add(sipe_private, buddy->name);
 
 		if (SIPE_CORE_PRIVATE_FLAG_IS(SUBSCRIBED_BUDDIES)) {
-			buddy->just_added = TRUE;
+			buddy->just_added          = TRUE;
+			buddy->presence_subscribed = TRUE;
+			buddy->presence_used       = sipe_utils_monotonic_sec();
 			sipe_subscribe_presence_single_cb(sipe_private,
-							  buddy->name);
+							  (gpointer) buddy->name);
 		}
 
-		buddy_fetch_photo(sipe_private, normalized_uri);
-
-		normalized_uri = NULL; /* buddy takes ownership */
+		buddy_fetch_photo(sipe_private, buddy->name);
 	} else {
-		SIPE_DEBUG_INFO("sipe_buddy_add: Buddy %s already exists", normalized_uri);
+		SIPE_DEBUG_INFO("sipe_buddy_add: Buddy %s already exists", buddy->name);
 		buddy->is_obsolete = FALSE;
 	}
-	g_free(normalized_uri);
 
 	return(buddy);
 }
 
-static gboolean is_buddy_in_group(struct sipe_buddy *buddy,
-				  const gchar *name)
+static gboolean buddy_group_test(const guint32 *bits,
+				 const struct sipe_buddy *buddy,
+				 const struct sipe_group *group)
 {
-	if (buddy) {
-		GSList *entry = buddy->groups;
+	guint word = GROUP_WORD(group->slot);
 
-		while (entry) {
-			struct buddy_group_data *bgd = entry->data;
-			if (sipe_strequal(bgd->group->name, name)) {
-				bgd->is_obsolete = FALSE;
-				return(TRUE);
-			}
-			entry = entry->next;
+	return((word < buddy->group_words) &&
+	       (bits[word] & GROUP_BIT(group->slot)));
+}
+
+static gboolean buddy_group_clear(struct sipe_buddy *buddy,
+				  const struct sipe_group *group)
+{
+	gboolean member = buddy_group_test(buddy->groups, buddy, group);
+
+	if (member) {
+		guint word = GROUP_WORD(group->slot);
+		buddy->groups[word]          &= ~GROUP_BIT(group->slot);
+		buddy->obsolete_groups[word] &= ~GROUP_BIT(group->slot);
+	}
+
+	return(member);
+}
+
+static gboolean buddy_has_groups(const struct sipe_buddy *buddy)
+{
+	guint word;
+
+	for (word = 0; word < buddy->group_words; word++)
+		if (buddy->groups[word])
+			return(TRUE);
+
+	return(FALSE);
+}
+
+/*
+ * Returns next group in bitmap starting at *slot and advances *slot past it.
+ * The bitmap is re-read on each call, i.e. the caller may clear the bit of
+ * the returned group before asking for the next one.
+ */
+static const struct sipe_group *buddy_group_next(struct sipe_core_private *sipe_private,
+						 const struct sipe_buddy *buddy,
+						 gboolean obsolete,
+						 guint *slot)
+{
+	while (GROUP_WORD(*slot) < buddy->group_words) {
+		guint first = GROUP_WORD(*slot) * 32;
+		const guint32 *bits = obsolete ? buddy->obsolete_groups : buddy->groups;
+		guint32 word = bits[GROUP_WORD(*slot)] & ~(GROUP_BIT(*slot) - 1);
+
+		if (word) {
+			const struct sipe_group *group;
+
+			*slot = first + g_bit_nth_lsf(word, -1);
+			group = sipe_group_find_by_slot(sipe_private, (*slot)++);
+			if (group)
+				return(group);
+		} else {
+			*slot = first + 32;
 		}
 	}
 
+	return(NULL);
+}
+
+static gboolean is_buddy_in_group(struct sipe_core_private *sipe_private,
+				  struct sipe_buddy *buddy,
+				  const gchar *name)
+{
+	const struct sipe_group *group = sipe_group_find_by_name(sipe_private,
+								 name);
+
+	if (buddy && group &&
+	    buddy_group_test(buddy->groups, buddy, group)) {
+		buddy->obsolete_groups[GROUP_WORD(group->slot)] &= ~GROUP_BIT(group->slot);
+		return(TRUE);
+	}
+
 	return(FALSE);
 }
 
@@ -182,6 +353,11 @@ void sipe_buddy_add_to_group(struct sipe_core_private *sipe_private,
 		gchar *old_alias = sipe_backend_buddy_get_alias(SIPE_CORE_PUBLIC,
 								bb);
 
+		sipe_buddy_index_set(sipe_private->buddies->index,
+				     uri,
+				     SIPE_BUDDY_INFO_DISPLAY_NAME,
+				     alias);
+
 		if (sipe_strcase_equal(sipe_get_no_sip_uri(uri),
 				       old_alias)) {
 			sipe_backend_buddy_set_alias(SIPE_CORE_PUBLIC,
@@ -193,58 +369,54 @@ void sipe_buddy_add_to_group(struct sipe_core_private *sipe_private,
 		g_free(old_alias);
 	}
 
-	if (!is_buddy_in_group(buddy, group_name)) {
+	if (!is_buddy_in_group(sipe_private, buddy, group_name)) {
 		sipe_buddy_insert_group(buddy, group);
 		SIPE_DEBUG_INFO("sipe_buddy_add_to_group: added buddy %s to group %s",
 				uri, group_name);
 	}
 }
 
-static gint buddy_group_compare(gconstpointer a, gconstpointer b)
-{
-	return(((const struct buddy_group_data *)a)->group->id -
-	       ((const struct buddy_group_data *)b)->group->id);
-}
-
 void sipe_buddy_insert_group(struct sipe_buddy *buddy,
 			     struct sipe_group *group)
 {
-	struct buddy_group_data *bgd = g_new0(struct buddy_group_data, 1);
+	guint word = GROUP_WORD(group->slot);
 
-	bgd->group = group;
+	if (word >= buddy->group_words) {
+		guint words = word + 1;
 
-	buddy->groups = sipe_utils_slist_insert_unique_sorted(buddy->groups,
-							      bgd,
-							      buddy_group_compare,
-							      NULL);
-}
+		buddy->groups          = g_renew(guint32, buddy->groups, words);
+		buddy->obsolete_groups = g_renew(guint32, buddy->obsolete_groups, words);
+		memset(buddy->groups + buddy->group_words, 0,
+		       (words - buddy->group_words) * sizeof(guint32));
+		memset(buddy->obsolete_groups + buddy->group_words, 0,
+		       (words - buddy->group_words) * sizeof(guint32));
+		buddy->group_words = words;
+	}
 
-static void buddy_group_free(gpointer data)
-{
-	g_free(data);
+	buddy->groups[word] |= GROUP_BIT(group->slot);
+	buddy->roaming_hash = 0;
 }
 
-static void buddy_group_remove(struct sipe_buddy *buddy,
-			       struct buddy_group_data *bgd)
+static void sipe_buddy_remove_group(struct sipe_buddy *buddy,
+				    const struct sipe_group *group)
 {
-	buddy->groups = g_slist_remove(buddy->groups, bgd);
-	buddy_group_free(bgd);
+	if (buddy_group_clear(buddy, group))
+		buddy->roaming_hash = 0;
 }
 
-static void sipe_buddy_remove_group(struct sipe_buddy *buddy,
-				    const struct sipe_group *group)
+void sipe_buddy_group_removed(struct sipe_core_private *sipe_private,
+			      const struct sipe_group *group)
 {
-	GSList *entry = buddy->groups;
-	struct buddy_group_data *bgd = NULL;
+	GHashTableIter iter;
+	gpointer buddy;
 
-	while (entry) {
-		bgd = entry->data;
-		if (bgd->group == group)
-			break;
-		entry = entry->next;
-	}
+	/* buddies are freed first during shutdown */
+	if (!sipe_private->buddies)
+		return;
 
-	buddy_group_remove(buddy, bgd);
+	g_hash_table_iter_init(&iter, sipe_private->buddies->uri);
+	while (g_hash_table_iter_next(&iter, NULL, &buddy))
+		sipe_buddy_remove_group(buddy, group);
 }
 
 void sipe_buddy_update_groups(struct sipe_core_private *sipe_private,
@@ -252,15 +424,10 @@ void sipe_buddy_update_groups(struct sipe_core_private *sipe_private,
 			      GSList *new_groups)
 {
 	const gchar *uri = buddy->name;
-	GSList *entry = buddy->groups;
-
-	while (entry) {
-		struct buddy_group_data *bgd = entry->data;
-		const struct sipe_group *group = bgd->group;
-
-		/* next buddy group */
-		entry = entry->next;
+	const struct sipe_group *group;
+	guint slot = 0;
 
+	while ((group = buddy_group_next(sipe_private, buddy, FALSE, &slot)) != NULL) {
 		/* old group NOT found in new list? */
 		if (g_slist_find(new_groups, group) == NULL) {
 			sipe_backend_buddy oldb = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
@@ -272,48 +439,61 @@ void sipe_buddy_update_groups(struct sipe_core_private *sipe_private,
 			if (oldb)
 				sipe_backend_buddy_remove(SIPE_CORE_PUBLIC,
 							  oldb);
-			buddy_group_remove(buddy, bgd);
+			sipe_buddy_remove_group(buddy, group);
 		}
 	}
 }
 
-gchar *sipe_buddy_groups_string(struct sipe_buddy *buddy)
+gchar *sipe_buddy_groups_string(struct sipe_core_private *sipe_private,
+				struct sipe_buddy *buddy)
 {
-	guint i = 0;
-	gchar *string;
-	/* creating array from GList, converting guint to gchar * */
-	gchar **ids_arr = g_new(gchar *, g_slist_length(buddy->groups) + 1);
-	GSList *entry = buddy->groups;
+	GString *string = g_string_new(NULL);
+	const struct sipe_group *group;
+	guint slot = 0;
 
-	if (!ids_arr)
-		return(NULL);
+	while ((group = buddy_group_next(sipe_private, buddy, FALSE, &slot)) != NULL)
+		g_string_append_printf(string,
+				       string->len ? " %u" : "%u",
+				       group->id);
 
-	while (entry) {
-		const struct sipe_group *group = ((struct buddy_group_data *) entry->data)->group;
-		ids_arr[i] = g_strdup_printf("%u", group->id);
-		entry = entry->next;
-		i++;
-	}
-	ids_arr[i] = NULL;
+	return(g_string_free(string, FALSE));
+}
 
-	string = g_strjoinv(" ", ids_arr);
-	g_strfreev(ids_arr);
+void sipe_buddy_foreach_group(struct sipe_core_private *sipe_private,
+			      struct sipe_buddy *buddy,
+			      GFunc callback,
+			      gpointer callback_data)
+{
+	const struct sipe_group *group;
+	guint slot = 0;
 
-	return(string);
+	while ((group = buddy_group_next(sipe_private, buddy, FALSE, &slot)) != NULL)
+		(*callback)((gpointer) group, callback_data);
 }
 
+/*
+ * Single pass over the backend list joined against the buddy and group hash
+ * tables. Backends list buddies group by group, so the group lookup is only
+ * repeated when the group changes. Removals are collected first and applied
+ * as one batch, i.e. the backend list isn't modified while it is scanned.
+ */
 void sipe_buddy_cleanup_local_list(struct sipe_core_private *sipe_private)
 {
 	GSList *buddies = sipe_backend_buddy_find_all(SIPE_CORE_PUBLIC,
 						      NULL,
 						      NULL);
-	GSList *entry = buddies;
+	GSList *obsolete = NULL;
+	GSList *entry;
+	gchar *last_gname = NULL;
+	const struct sipe_group *group = NULL;
+	guint count = 0;
 
 	SIPE_DEBUG_INFO("sipe_buddy_cleanup_local_list: overall %d backend buddies (including clones)",
 			g_slist_length(buddies));
 	SIPE_DEBUG_INFO("sipe_buddy_cleanup_local_list: %d sipe buddies (unique)",
 			sipe_buddy_count(sipe_private));
-	while (entry) {
+
+	for (entry = buddies; entry; entry = entry->next) {
 		sipe_backend_buddy bb = entry->data;
 		gchar *bname = sipe_backend_buddy_get_name(SIPE_CORE_PUBLIC,
 							   bb);
@@ -322,19 +502,36 @@ void sipe_buddy_cleanup_local_list(struct sipe_core_private *sipe_private)
 		struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
 								  bname);
 
-		if (!is_buddy_in_group(buddy, gname)) {
+		if (!sipe_strequal(gname, last_gname)) {
+			group = sipe_group_find_by_name(sipe_private, gname);
+			g_free(last_gname);
+			last_gname = gname;
+		} else {
+			g_free(gname);
+		}
+
+		if (buddy && group &&
+		    buddy_group_test(buddy->groups, buddy, group)) {
+			buddy->obsolete_groups[GROUP_WORD(group->slot)] &= ~GROUP_BIT(group->slot);
+		} else {
 			SIPE_DEBUG_INFO("sipe_buddy_cleanup_local_list: REMOVING '%s' from local group '%s', as buddy is not in that group on remote contact list",
-					bname, gname);
-			sipe_backend_buddy_remove(SIPE_CORE_PUBLIC, bb);
+					bname, last_gname);
+			obsolete = g_slist_prepend(obsolete, bb);
+			count++;
 		}
 
-		g_free(gname);
 		g_free(bname);
-
-		entry = entry->next;
 	}
-
+	g_free(last_gname);
 	g_slist_free(buddies);
+
+	if (obsolete) {
+		SIPE_DEBUG_INFO("sipe_buddy_cleanup_local_list: removing %d backend buddies",
+				count);
+		for (entry = obsolete; entry; entry = entry->next)
+			sipe_backend_buddy_remove(SIPE_CORE_PUBLIC, entry->data);
+		g_slist_free(obsolete);
+	}
 }
 
 struct sipe_buddy *sipe_buddy_find_by_uri(struct sipe_core_private *sipe_private,
@@ -368,31 +565,38 @@ static void buddy_free(struct sipe_buddy *buddy)
 	  * hash code does not touch the key (buddy->name) or value (buddy)
 	  * of the to-be-deleted hash node at all. It follows that we
 	  *
-	  *   - MUST free the memory for the key ourselves and
+	  *   - MUST release the key ourselves and
 	  *   - ARE allowed to do it in this function
 	  *
 	  * Conclusion: glib must be broken on the Windows platform if sipe
 	  *             crashes with SIGTRAP when closing. You'll have to live
 	  *             with the memory leak until this is fixed.
 	  */
-	g_free(buddy->name);
+	sipe_intern_unref(buddy->name);
 #endif
 	g_free(buddy->exchange_key);
 	g_free(buddy->change_key);
+	g_free(buddy->pool);
 	g_free(buddy->activity);
-	g_free(buddy->meeting_subject);
-	g_free(buddy->meeting_location);
 	g_free(buddy->note);
 
-	g_free(buddy->cal_start_time);
-	g_free(buddy->cal_free_busy_base64);
-	g_free(buddy->cal_free_busy);
-	g_free(buddy->last_non_cal_activity);
+	if (buddy->ext) {
+		struct sipe_buddy_extended *ext = buddy->ext;
 
-	sipe_cal_free_working_hours(buddy->cal_working_hours);
+		g_free(ext->meeting_subject);
+		g_free(ext->meeting_location);
+		g_free(ext->device_name);
+		g_free(ext->cal_free_busy);
+		sipe_cal_free_working_hours(ext->cal_working_hours);
+		g_free(ext->cal_description);
+		g_free(ext->last_non_cal_activity);
+		if (ext->category_hashes)
+			g_hash_table_destroy(ext->category_hashes);
+		g_free(ext);
+	}
 
-	g_free(buddy->device_name);
-	sipe_utils_slist_free_full(buddy->groups, buddy_group_free);
+	g_free(buddy->obsolete_groups);
+	g_free(buddy->groups);
 	g_free(buddy);
 }
 
@@ -421,32 +625,117 @@ void sipe_buddy_free(struct sipe_core_private *sipe_private)
 			g_slist_remove(buddies->pending_photo_requests, data);
 		photo_response_data_free(data);
 	}
+	g_queue_free(buddies->photo_queue);
+	g_hash_table_destroy(buddies->photo_state);
 
+	sipe_schedule_cancel(sipe_private, BUDDY_STATUS_ACTION);
+	g_hash_table_destroy(buddies->status_pending);
+
+	/* outstanding responses will no longer find their search */
+	g_hash_table_destroy(buddies->searches);
+	sipe_utils_slist_free_full(buddies->search_cache,
+				   (GDestroyNotify) buddy_search_free);
+
+	sipe_buddy_index_free(buddies->index);
 	g_hash_table_destroy(buddies->uri);
 	g_hash_table_destroy(buddies->exchange_key);
 	g_free(buddies);
 	sipe_private->buddies = NULL;
 }
 
+void sipe_buddy_memory_usage(struct sipe_core_private *sipe_private,
+			     struct sipe_memory_usage *usage)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!buddies)
+		return;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_buddies));
+	sipe_metrics_memory_hash(usage, buddies->uri);
+	sipe_metrics_memory_hash(usage, buddies->exchange_key);
+	sipe_metrics_memory_hash(usage, buddies->photo_state);
+	sipe_metrics_memory_hash(usage, buddies->status_pending);
+	sipe_metrics_memory_hash(usage, buddies->searches);
+	sipe_metrics_memory_list(usage, g_queue_get_length(buddies->photo_queue));
+	sipe_buddy_index_memory_usage(buddies->index, usage);
+
+	/* buddy names are interned and accounted for by sipe-intern.c */
+	g_hash_table_iter_init(&iter, buddies->uri);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		const struct sipe_buddy *buddy = value;
+		const struct sipe_buddy_extended *ext = buddy->ext;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_buddy));
+		SIPE_MEMORY_OBJECT(usage, buddy->group_words * sizeof(guint32));
+		SIPE_MEMORY_OBJECT(usage, buddy->group_words * sizeof(guint32));
+		sipe_metrics_memory_string(usage, buddy->activity);
+		sipe_metrics_memory_string(usage, buddy->note);
+		sipe_metrics_memory_string(usage, buddy->exchange_key);
+		sipe_metrics_memory_string(usage, buddy->change_key);
+		sipe_metrics_memory_string(usage, buddy->pool);
+
+		if (ext) {
+			SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_buddy_extended));
+			sipe_metrics_memory_string(usage, ext->meeting_subject);
+			sipe_metrics_memory_string(usage, ext->meeting_location);
+			sipe_metrics_memory_string(usage, ext->device_name);
+			sipe_metrics_memory_string(usage, ext->cal_description);
+			sipe_metrics_memory_string(usage, ext->last_non_cal_activity);
+			sipe_metrics_memory_hash(usage, ext->category_hashes);
+			if (ext->cal_free_busy)
+				SIPE_MEMORY_OBJECT(usage, (ext->cal_free_busy_slots + 3) / 4);
+		}
+	}
+}
+
 static void buddy_set_obsolete_flag(SIPE_UNUSED_PARAMETER gpointer key,
 				    gpointer value,
-				    SIPE_UNUSED_PARAMETER gpointer user_data)
+				    gpointer user_data)
 {
 	struct sipe_buddy *buddy = value;
-	GSList *entry = buddy->groups;
+	gboolean obsolete = GPOINTER_TO_INT(user_data);
+	gsize size = buddy->group_words * sizeof(guint32);
 
-	buddy->is_obsolete = TRUE;
-	while (entry) {
-		((struct buddy_group_data *) entry->data)->is_obsolete = TRUE;
-		entry = entry->next;
-	}
+	buddy->is_obsolete = obsolete;
+	if (obsolete)
+		memcpy(buddy->obsolete_groups, buddy->groups, size);
+	else
+		memset(buddy->obsolete_groups, 0, size);
 }
 
 void sipe_buddy_update_start(struct sipe_core_private *sipe_private)
 {
 	g_hash_table_foreach(sipe_private->buddies->uri,
 			     buddy_set_obsolete_flag,
-			     NULL);
+			     GINT_TO_POINTER(TRUE));
+}
+
+gboolean sipe_buddy_update_confirm(struct sipe_core_private *sipe_private,
+				   struct sipe_buddy *buddy)
+{
+	const struct sipe_group *group;
+	gboolean confirmed = TRUE;
+	guint slot = 0;
+
+	buddy->is_obsolete = FALSE;
+	while ((group = buddy_group_next(sipe_private, buddy, FALSE, &slot)) != NULL) {
+		if (group->is_obsolete)
+			confirmed = FALSE;
+		else
+			buddy->obsolete_groups[GROUP_WORD(group->slot)] &= ~GROUP_BIT(group->slot);
+	}
+
+	return(confirmed);
+}
+
+void sipe_buddy_update_cancel(struct sipe_core_private *sipe_private)
+{
+	g_hash_table_foreach(sipe_private->buddies->uri,
+			     buddy_set_obsolete_flag,
+			     GINT_TO_POINTER(FALSE));
 }
 
 static gboolean buddy_check_obsolete_flag(SIPE_UNUSED_PARAMETER gpointer key,
@@ -480,27 +769,20 @@ static gboolean buddy_check_obsolete_flag(SIPE_UNUSED_PARAMETER gpointer key,
 		return(TRUE);
 
 	} else {
-		GSList *entry = buddy->groups;
-
-		while (entry) {
-			struct buddy_group_data *bgd = entry->data;
-
-			/* next buddy group */
-			entry = entry->next;
+		const struct sipe_group *group;
+		guint slot = 0;
 
-			if (bgd->is_obsolete) {
-				const struct sipe_group *group = bgd->group;
-				sipe_backend_buddy oldb = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
-										  uri,
-										  group->name);
-				SIPE_DEBUG_INFO("buddy_check_obsolete_flag: removing buddy '%s' from group '%s'",
-						uri, group->name);
-				/* this should never be NULL */
-				if (oldb)
-					sipe_backend_buddy_remove(SIPE_CORE_PUBLIC,
-								  oldb);
-				buddy_group_remove(buddy, bgd);
-			}
+		while ((group = buddy_group_next(sipe_private, buddy, TRUE, &slot)) != NULL) {
+			sipe_backend_buddy oldb = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
+									  uri,
+									  group->name);
+			SIPE_DEBUG_INFO("buddy_check_obsolete_flag: removing buddy '%s' from group '%s'",
+					uri, group->name);
+			/* this should never be NULL */
+			if (oldb)
+				sipe_backend_buddy_remove(SIPE_CORE_PUBLIC,
+							  oldb);
+			sipe_buddy_remove_group(buddy, group);
 		}
 		return(FALSE);
 	}
@@ -508,9 +790,16 @@ static gboolean buddy_check_obsolete_flag(SIPE_UNUSED_PARAMETER gpointer key,
 
 void sipe_buddy_update_finish(struct sipe_core_private *sipe_private)
 {
-	g_hash_table_foreach_remove(sipe_private->buddies->uri,
-				    buddy_check_obsolete_flag,
-				    sipe_private);
+	if (g_hash_table_foreach_remove(sipe_private->buddies->uri,
+					buddy_check_obsolete_flag,
+					sipe_private))
+		sipe_buddy_snapshot_invalidate(sipe_private);
+}
+
+void sipe_core_buddy_presence_hint(struct sipe_core_public *sipe_public,
+				   const gchar *uri)
+{
+	sipe_subscribe_presence_demand(SIPE_CORE_PRIVATE, uri);
 }
 
 gchar *sipe_core_buddy_status(struct sipe_core_public *sipe_public,
@@ -622,7 +911,7 @@ void sipe_core_buddy_group(struct sipe_core_public *sipe_public,
 						    ucs_trans,
 						    old_group,
 						    buddy);
-			if (g_slist_length(buddy->groups) < 1)
+			if (!buddy_has_groups(buddy))
 				sipe_buddy_remove(sipe_private,
 						  buddy);
 				/* buddy no longer valid */
@@ -666,31 +955,32 @@ void sipe_buddy_remove(struct sipe_core_private *sipe_private,
 {
 	struct sipe_buddies *buddies = sipe_private->buddies;
 	const gchar *uri = buddy->name;
-	GSList *entry = buddy->groups;
+	const struct sipe_group *group;
+	guint slot = 0;
 	gchar *action_name = sipe_utils_presence_key(uri);
 
 	sipe_schedule_cancel(sipe_private, action_name);
 	g_free(action_name);
 
 	/* If the buddy still has groups, we need to delete backend buddies */
-	while (entry) {
-		const struct sipe_group *group = ((struct buddy_group_data *) entry->data)->group;
+	while ((group = buddy_group_next(sipe_private, buddy, FALSE, &slot)) != NULL) {
 		sipe_backend_buddy oldb = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
 								  uri,
 								  group->name);
 		/* this should never be NULL */
 		if (oldb)
 			sipe_backend_buddy_remove(SIPE_CORE_PUBLIC, oldb);
-
-		entry = entry->next;
 	}
 
+	g_hash_table_remove(buddies->status_pending, uri);
+	sipe_buddy_index_remove(buddies->index, uri);
 	g_hash_table_remove(buddies->uri, uri);
 	if (buddy->exchange_key)
 		g_hash_table_remove(buddies->exchange_key,
 				    buddy->exchange_key);
 
 	buddy_free(buddy);
+	sipe_buddy_snapshot_invalidate(sipe_private);
 }
 
 /**
@@ -718,7 +1008,7 @@ void sipe_core_buddy_remove(struct sipe_core_public *sipe_public,
 		}
 	}
 
-	if (g_slist_length(buddy->groups) < 1) {
+	if (!buddy_has_groups(buddy)) {
 
 		if (sipe_ucs_is_migrated(sipe_private)) {
 			sipe_ucs_group_remove_buddy(sipe_private,
@@ -747,11 +1037,118 @@ void sipe_core_buddy_remove(struct sipe_core_public *sipe_public,
 	}
 }
 
-void sipe_core_buddy_got_status(struct sipe_core_public *sipe_public,
-				const gchar *uri,
-				guint activity)
+/* everything that influences the backend presentation of the status */
+static guint buddy_status_hash(const struct sipe_buddy *sbuddy,
+			       guint activity)
+{
+	guint hash = activity;
+
+	hash = hash * 33 + (sbuddy->activity ? g_str_hash(sbuddy->activity) : 0);
+	hash = hash * 33 + (sbuddy->note     ? g_str_hash(sbuddy->note)     : 0);
+	hash = hash * 33 + (sbuddy->is_mobile   ? 2 : 0) +
+			   (sbuddy->is_oof_note ? 1 : 0);
+
+	/* 0 = unknown */
+	return(hash ? hash : 1);
+}
+
+static void buddy_status_flush_cb(struct sipe_core_private *sipe_private,
+				  SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	sipe_private->buddies->status_scheduled = FALSE;
+	sipe_buddy_status_flush(sipe_private);
+}
+
+void sipe_buddy_status_flush(struct sipe_core_private *sipe_private)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	GHashTable *pending = buddies->status_pending;
+	GHashTableIter iter;
+	gpointer uri, activity;
+	guint pushed = 0;
+
+	if (buddies->status_scheduled) {
+		buddies->status_scheduled = FALSE;
+		sipe_schedule_cancel(sipe_private, BUDDY_STATUS_ACTION);
+	}
+
+	if (g_hash_table_size(pending) == 0)
+		return;
+
+	/* backend may cause new updates while we are iterating */
+	buddies->status_pending = g_hash_table_new_full(g_str_hash,
+							g_str_equal,
+							g_free,
+							NULL);
+
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, &uri, &activity)) {
+		struct sipe_buddy *sbuddy = sipe_buddy_find_by_uri(sipe_private,
+								   uri);
+		guint hash;
+
+		/* buddy has been removed in the meantime */
+		if (!sbuddy)
+			continue;
+
+		hash = buddy_status_hash(sbuddy, GPOINTER_TO_UINT(activity));
+		if (hash != sbuddy->status_hash) {
+			sbuddy->status_hash = hash;
+			sipe_backend_buddy_set_status(SIPE_CORE_PUBLIC,
+						      sbuddy->name,
+						      GPOINTER_TO_UINT(activity));
+			pushed++;
+		}
+	}
+
+	SIPE_DEBUG_INFO("sipe_buddy_status_flush: %d of %d updates delivered",
+			pushed, g_hash_table_size(pending));
+	g_hash_table_destroy(pending);
+
+	/* activity and note are updated together with the status */
+	sipe_buddy_snapshot_invalidate(sipe_private);
+}
+
+void sipe_buddy_set_status(struct sipe_core_private *sipe_private,
+			   const gchar *uri,
+			   guint activity)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+
+	/* later updates for the same buddy replace earlier ones */
+	g_hash_table_insert(buddies->status_pending,
+			    g_strdup(uri),
+			    GUINT_TO_POINTER(activity));
+
+	if (!buddies->status_scheduled) {
+		buddies->status_scheduled = TRUE;
+		sipe_schedule_mseconds(sipe_private,
+				       BUDDY_STATUS_ACTION,
+				       NULL,
+				       BUDDY_STATUS_DELAY,
+				       buddy_status_flush_cb,
+				       NULL);
+	}
+}
+
+guint sipe_buddy_get_status(struct sipe_core_private *sipe_private,
+			    const gchar *uri)
+{
+	gpointer activity;
+
+	if (g_hash_table_lookup_extended(sipe_private->buddies->status_pending,
+					 uri,
+					 NULL,
+					 &activity))
+		return(GPOINTER_TO_UINT(activity));
+
+	return(sipe_backend_buddy_get_status(SIPE_CORE_PUBLIC, uri));
+}
+
+void sipe_buddy_got_status(struct sipe_core_private *sipe_private,
+			   const gchar *uri,
+			   guint activity)
 {
-	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
 	struct sipe_buddy *sbuddy = sipe_buddy_find_by_uri(sipe_private,
 							   uri);
 
@@ -761,7 +1158,7 @@ void sipe_core_buddy_got_status(struct sipe_core_public *sipe_public,
 	 * then set/preserve it.
 	 */
 	if (SIPE_CORE_PRIVATE_FLAG_IS(OCS2007)) {
-		sipe_backend_buddy_set_status(sipe_public, uri, activity);
+		sipe_buddy_set_status(sipe_private, uri, activity);
 	} else {
 		sipe_ocs2005_apply_calendar_status(sipe_private,
 						   sbuddy,
@@ -769,6 +1166,22 @@ void sipe_core_buddy_got_status(struct sipe_core_public *sipe_public,
 	}
 }
 
+void sipe_core_buddy_got_status(struct sipe_core_public *sipe_public,
+				const gchar *uri,
+				guint activity)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	struct sipe_buddy *sbuddy = sipe_buddy_find_by_uri(sipe_private,
+							   uri);
+
+	if (!sbuddy) return;
+
+	/* backend requests a refresh: always deliver it immediately */
+	sbuddy->status_hash = 0;
+	sipe_buddy_got_status(sipe_private, uri, activity);
+	sipe_buddy_status_flush(sipe_private);
+}
+
 void sipe_core_buddy_tooltip_info(struct sipe_core_public *sipe_public,
 				  const gchar *uri,
 				  const gchar *status_name,
@@ -801,8 +1214,10 @@ void sipe_core_buddy_tooltip_info(struct sipe_core_public *sipe_public,
 			is_oof_note = sbuddy->is_oof_note;
 			activity = sbuddy->activity;
 			calendar = sipe_cal_get_description(sbuddy);
-			meeting_subject = sbuddy->meeting_subject;
-			meeting_location = sbuddy->meeting_location;
+			if (sbuddy->ext) {
+				meeting_subject = sbuddy->ext->meeting_subject;
+				meeting_location = sbuddy->ext->meeting_location;
+			}
 		}
 		if (SIPE_CORE_PRIVATE_FLAG_IS(OCS2007)) {
 			gboolean is_group_access = FALSE;
@@ -854,10 +1269,19 @@ void sipe_buddy_update_property(struct sipe_core_private *sipe_private,
 				char *property_value)
 {
 	GSList *buddies, *entry;
+	gboolean changed = FALSE;
 
 	if (property_value)
 		property_value = g_strstrip(property_value);
 
+	/* ignores all but the searchable properties */
+	if (!is_empty(property_value) &&
+	    sipe_buddy_find_by_uri(sipe_private, uri))
+		sipe_buddy_index_set(sipe_private->buddies->index,
+				     uri,
+				     propkey,
+				     property_value);
+
 	entry = buddies = sipe_backend_buddy_find_all(SIPE_CORE_PUBLIC, uri, NULL); /* all buddies in different groups */
 	while (entry) {
 		gchar *prop_str;
@@ -870,6 +1294,7 @@ void sipe_buddy_update_property(struct sipe_core_private *sipe_private,
 			if (property_value && sipe_is_bad_alias(uri, alias)) {
 				SIPE_DEBUG_INFO("Replacing alias for %s with %s", uri, property_value);
 				sipe_backend_buddy_set_alias(SIPE_CORE_PUBLIC, p_buddy, property_value);
+				changed = TRUE;
 			}
 			g_free(alias);
 
@@ -879,6 +1304,7 @@ void sipe_buddy_update_property(struct sipe_core_private *sipe_private,
 			{
 				SIPE_DEBUG_INFO("Replacing service alias for %s with %s", uri, property_value);
 				sipe_backend_buddy_set_server_alias(SIPE_CORE_PUBLIC, p_buddy, property_value);
+				changed = TRUE;
 			}
 			g_free(alias);
 		}
@@ -888,6 +1314,7 @@ void sipe_buddy_update_property(struct sipe_core_private *sipe_private,
 				prop_str = sipe_backend_buddy_get_string(SIPE_CORE_PUBLIC, p_buddy, propkey);
 				if (!prop_str || !sipe_strcase_equal(prop_str, property_value)) {
 					sipe_backend_buddy_set_string(SIPE_CORE_PUBLIC, p_buddy, propkey, property_value);
+					changed = TRUE;
 				}
 				g_free(prop_str);
 			}
@@ -896,9 +1323,20 @@ void sipe_buddy_update_property(struct sipe_core_private *sipe_private,
 		entry = entry->next;
 	}
 	g_slist_free(buddies);
+
+	/* cached directory information is stale */
+	if (changed)
+		sipe_directory_cache_invalidate(sipe_private, uri);
 }
 
 
+/* lookups sharing one web ticket request & session */
+struct ms_dlx_batch {
+	GSList *lookups; /* struct ms_dlx_data, same callbacks */
+	struct sipe_svc_session *session;
+	guint pending;   /* lookups not yet freed */
+};
+
 struct ms_dlx_data;
 struct ms_dlx_data {
 	GSList *search_rows;
@@ -906,8 +1344,9 @@ struct ms_dlx_data {
 	guint   max_returns;
 	sipe_svc_callback *callback;
 	struct sipe_svc_session *session;
+	struct ms_dlx_batch *batch; /* NULL for single lookup */
 	gchar *wsse_security;
-	struct sipe_backend_search_token *token;
+	guint search_id;
 	/* must call ms_dlx_free() */
 	void (*failed_callback)(struct sipe_core_private *sipe_private,
 				struct ms_dlx_data *mdd);
@@ -920,8 +1359,17 @@ static void free_search_rows(GSList *search_rows)
 
 static void ms_dlx_free(struct ms_dlx_data *mdd)
 {
+	struct ms_dlx_batch *batch = mdd->batch;
+
 	free_search_rows(mdd->search_rows);
-	sipe_svc_session_close(mdd->session);
+	if (batch) {
+		/* last lookup closes the shared session */
+		if (--batch->pending == 0) {
+			sipe_svc_session_close(batch->session);
+			g_free(batch);
+		}
+	} else
+		sipe_svc_session_close(mdd->session);
 	g_free(mdd->other);
 	g_free(mdd->wsse_security);
 	g_free(mdd);
@@ -981,6 +1429,33 @@ static gchar * prepare_buddy_search_query(GSList *query_rows, gboolean use_dlx)
 	return query;
 }
 
+static gchar *ms_dlx_search(struct ms_dlx_data *mdd)
+{
+	guint length = g_slist_length(mdd->search_rows);
+	gchar *search;
+
+	if (length > 0) {
+		/* complex search */
+		gchar *query = prepare_buddy_search_query(mdd->search_rows, TRUE);
+		search = g_strdup_printf("<ChangeSearch xmlns:q1=\"DistributionListExpander\" soapenc:arrayType=\"q1:AbEntryRequest.ChangeSearchQuery[%d]\">"
+					 " %s"
+					 "</ChangeSearch>",
+					 length / 2,
+					 query);
+		g_free(query);
+	} else {
+		/* simple search */
+		search = g_strdup_printf("<BasicSearch>"
+					 " <SearchList>c,company,displayName,givenName,mail,mailNickname,msRTCSIP-PrimaryUserAddress,sn</SearchList>"
+					 " <Value>%s</Value>"
+					 " <Verb>BeginsWith</Verb>"
+					 "</BasicSearch>",
+					 mdd->other);
+	}
+
+	return(search);
+}
+
 static void ms_dlx_webticket(struct sipe_core_private *sipe_private,
 			     const gchar *base_uri,
 			     const gchar *auth_uri,
@@ -991,31 +1466,11 @@ static void ms_dlx_webticket(struct sipe_core_private *sipe_private,
 	struct ms_dlx_data *mdd = callback_data;
 
 	if (wsse_security) {
-		guint length = g_slist_length(mdd->search_rows);
-		gchar *search;
+		gchar *search = ms_dlx_search(mdd);
 
 		SIPE_DEBUG_INFO("ms_dlx_webticket: got ticket for %s",
 				base_uri);
 
-		if (length > 0) {
-			/* complex search */
-			gchar *query = prepare_buddy_search_query(mdd->search_rows, TRUE);
-			search = g_strdup_printf("<ChangeSearch xmlns:q1=\"DistributionListExpander\" soapenc:arrayType=\"q1:AbEntryRequest.ChangeSearchQuery[%d]\">"
-						 " %s"
-						 "</ChangeSearch>",
-						 length / 2,
-						 query);
-			g_free(query);
-		} else {
-			/* simple search */
-			search = g_strdup_printf("<BasicSearch>"
-						 " <SearchList>c,company,displayName,givenName,mail,mailNickname,msRTCSIP-PrimaryUserAddress,sn</SearchList>"
-						 " <Value>%s</Value>"
-						 " <Verb>BeginsWith</Verb>"
-						 "</BasicSearch>",
-						 mdd->other);
-		}
-
 		if (sipe_svc_ab_entry_request(sipe_private,
 					      mdd->session,
 					      auth_uri,
@@ -1059,10 +1514,100 @@ static void ms_dlx_webticket_request(struct sipe_core_private *sipe_private,
 	}
 }
 
-void sipe_buddy_search_contacts_finalize(struct sipe_core_private *sipe_private,
-					 struct sipe_backend_search_results *results,
-					 guint match_count,
-					 gboolean more)
+static void ms_dlx_batch_webticket(struct sipe_core_private *sipe_private,
+				   const gchar *base_uri,
+				   const gchar *auth_uri,
+				   const gchar *wsse_security,
+				   SIPE_UNUSED_PARAMETER const gchar *failure_msg,
+				   gpointer callback_data)
+{
+	struct ms_dlx_batch *batch = callback_data;
+	GSList *lookups = batch->lookups;
+	guint count = g_slist_length(lookups);
+	GSList *entry;
+
+	/* batch is freed with its last lookup */
+	batch->lookups = NULL;
+
+	if (wsse_security) {
+		struct ms_dlx_data *first = lookups->data;
+		gchar **searches = g_new(gchar *, count + 1);
+		gpointer *mdds = g_new(gpointer, count);
+		guint i = 0;
+
+		SIPE_DEBUG_INFO("ms_dlx_batch_webticket: got ticket for %s (%u lookups)",
+				base_uri, count);
+
+		for (entry = lookups; entry; entry = entry->next, i++) {
+			struct ms_dlx_data *mdd = entry->data;
+
+			/* keep webticket security token for potential further use */
+			mdd->wsse_security = g_strdup(wsse_security);
+			searches[i] = ms_dlx_search(mdd);
+			mdds[i]     = mdd;
+		}
+		searches[i] = NULL;
+
+		/* every lookup gets its callback, even on failure */
+		sipe_svc_ab_entry_request_multi(sipe_private,
+						batch->session,
+						auth_uri,
+						wsse_security,
+						(const gchar * const *) searches,
+						count,
+						first->max_returns,
+						first->callback,
+						mdds);
+		g_free(mdds);
+		g_strfreev(searches);
+
+	} else {
+		/* no ticket: this will show the minmum information */
+		SIPE_DEBUG_ERROR("ms_dlx_batch_webticket: no web ticket for %s",
+				 base_uri);
+
+		for (entry = lookups; entry; entry = entry->next) {
+			struct ms_dlx_data *mdd = entry->data;
+			mdd->failed_callback(sipe_private, mdd);
+		}
+	}
+
+	g_slist_free(lookups);
+}
+
+/* takes ownership of batch */
+static void ms_dlx_batch_request(struct sipe_core_private *sipe_private,
+				 struct ms_dlx_batch *batch)
+{
+	if (!sipe_webticket_request(sipe_private,
+				    batch->session,
+				    sipe_private->dlx_uri,
+				    "AddressBookWebTicketBearer",
+				    ms_dlx_batch_webticket,
+				    batch)) {
+		SIPE_DEBUG_ERROR("ms_dlx_batch_request: couldn't request webticket for %s",
+				 sipe_private->dlx_uri);
+		ms_dlx_batch_webticket(sipe_private,
+				       sipe_private->dlx_uri,
+				       NULL,
+				       NULL,
+				       NULL,
+				       batch);
+	}
+}
+
+static void ms_dlx_batch_add(struct ms_dlx_batch *batch,
+			     struct ms_dlx_data *mdd)
+{
+	mdd->batch     = batch;
+	batch->lookups = g_slist_append(batch->lookups, mdd);
+	batch->pending++;
+}
+
+static void buddy_search_contacts_finalize(struct sipe_core_private *sipe_private,
+					  struct sipe_backend_search_results *results,
+					  guint match_count,
+					  gboolean more)
 {
 	gchar *secondary = g_strdup_printf(
 		dngettext(PACKAGE_NAME,
@@ -1077,6 +1622,293 @@ void sipe_buddy_search_contacts_finalize(struct sipe_core_private *sipe_private,
 	g_free(secondary);
 }
 
+static void buddy_search_row_free(struct buddy_search_row *row)
+{
+	g_free(row->email);
+	g_free(row->country);
+	g_free(row->company);
+	g_free(row->name);
+	g_free(row->uri);
+	g_free(row);
+}
+
+static void buddy_search_free(struct sipe_buddy_search *search)
+{
+	sipe_utils_slist_free_full(search->rows,
+				   (GDestroyNotify) buddy_search_row_free);
+	g_free(search->query);
+	g_free(search);
+}
+
+/* rows are in search result order */
+static void buddy_search_deliver(struct sipe_core_private *sipe_private,
+				 struct sipe_backend_search_token *token,
+				 const struct sipe_buddy_search *search)
+{
+	struct sipe_backend_search_results *results =
+		sipe_backend_search_results_start(SIPE_CORE_PUBLIC, token);
+	const GSList *entry;
+
+	if (!results) {
+		SIPE_DEBUG_ERROR_NOFORMAT("buddy_search_deliver: Unable to display the search results.");
+		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
+					   token,
+					   _("Unable to display the search results"));
+		return;
+	}
+
+	for (entry = search->rows; entry; entry = entry->next) {
+		const struct buddy_search_row *row = entry->data;
+		sipe_backend_search_results_add(SIPE_CORE_PUBLIC,
+						results,
+						row->uri,
+						row->name,
+						row->company,
+						row->country,
+						row->email);
+		/* no-op for contacts that aren't buddies */
+		sipe_subscribe_presence_demand(sipe_private, row->uri);
+	}
+
+	buddy_search_contacts_finalize(sipe_private,
+				       results,
+				       search->count,
+				       search->more);
+}
+
+static void buddy_search_cache_expire(struct sipe_buddies *buddies,
+				      gint64 now)
+{
+	GSList *entry = buddies->search_cache;
+	GSList *prev  = NULL;
+	guint count   = 0;
+
+	while (entry) {
+		struct sipe_buddy_search *cached = entry->data;
+		GSList *next = entry->next;
+
+		if ((cached->expires <= now) ||
+		    (++count > BUDDY_SEARCH_CACHE_SIZE)) {
+			buddy_search_free(cached);
+			if (prev)
+				prev->next = next;
+			else
+				buddies->search_cache = next;
+			g_slist_free_1(entry);
+		} else {
+			prev = entry;
+		}
+		entry = next;
+	}
+}
+
+static void buddy_search_usage(const struct sipe_buddy_search *search,
+			       struct sipe_memory_usage *usage)
+{
+	const GSList *entry;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_buddy_search));
+	sipe_metrics_memory_string(usage, search->query);
+	sipe_metrics_memory_list(usage, search->count);
+	for (entry = search->rows; entry; entry = entry->next) {
+		const struct buddy_search_row *row = entry->data;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct buddy_search_row));
+		sipe_metrics_memory_string(usage, row->uri);
+		sipe_metrics_memory_string(usage, row->name);
+		sipe_metrics_memory_string(usage, row->company);
+		sipe_metrics_memory_string(usage, row->country);
+		sipe_metrics_memory_string(usage, row->email);
+	}
+}
+
+void sipe_buddy_search_cache_memory_usage(struct sipe_core_private *sipe_private,
+					  struct sipe_memory_usage *usage)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	const GSList *entry;
+
+	if (!buddies)
+		return;
+
+	sipe_metrics_memory_list(usage, g_slist_length(buddies->search_cache));
+	for (entry = buddies->search_cache; entry; entry = entry->next)
+		buddy_search_usage(entry->data, usage);
+}
+
+void sipe_buddy_search_cache_shrink(struct sipe_core_private *sipe_private,
+				    gsize target)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	struct sipe_memory_usage usage = { 0, 0 };
+	GSList *entry, *prev = NULL;
+	guint evicted = 0;
+
+	if (!buddies)
+		return;
+
+	/* keep the most recent results that fit into target */
+	for (entry = buddies->search_cache; entry; entry = entry->next) {
+		buddy_search_usage(entry->data, &usage);
+		usage.bytes += sizeof(GSList);
+		if (usage.bytes > target)
+			break;
+		prev = entry;
+	}
+	if (!entry)
+		return;
+
+	if (prev)
+		prev->next = NULL;
+	else
+		buddies->search_cache = NULL;
+	evicted = g_slist_length(entry);
+	sipe_utils_slist_free_full(entry, (GDestroyNotify) buddy_search_free);
+
+	SIPE_DEBUG_INFO("sipe_buddy_search_cache_shrink: evicted %u results",
+			evicted);
+	sipe_cache_evicted(sipe_private, SIPE_CACHE_BUDDY_SEARCH, evicted);
+}
+
+/**
+ * Start a new contact search
+ *
+ * An outstanding search for the same token is superseded, i.e. its
+ * results will no longer be delivered to the backend.
+ *
+ * @return search ID or 0 if the results were taken from the cache
+ */
+static guint buddy_search_start(struct sipe_core_private *sipe_private,
+				struct sipe_backend_search_token *token,
+				const gchar *query)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	struct sipe_buddy_search *search;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *entry;
+
+	g_hash_table_iter_init(&iter, buddies->searches);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		search = value;
+		if (search->token == token) {
+			SIPE_DEBUG_INFO("buddy_search_start: search %d superseded",
+					search->id);
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	buddy_search_cache_expire(buddies, sipe_utils_monotonic_sec());
+	for (entry = buddies->search_cache; entry; entry = entry->next) {
+		search = entry->data;
+		if (sipe_strequal(search->query, query)) {
+			SIPE_DEBUG_INFO_NOFORMAT("buddy_search_start: using cached results");
+			sipe_cache_lookup(sipe_private, SIPE_CACHE_BUDDY_SEARCH, TRUE);
+			buddy_search_deliver(sipe_private, token, search);
+			return(0);
+		}
+	}
+	sipe_cache_lookup(sipe_private, SIPE_CACHE_BUDDY_SEARCH, FALSE);
+
+	/* 0 is reserved for "no search" */
+	if (++buddies->search_id == 0)
+		buddies->search_id++;
+
+	search        = g_new0(struct sipe_buddy_search, 1);
+	search->id    = buddies->search_id;
+	search->token = token;
+	search->query = g_strdup(query);
+	g_hash_table_insert(buddies->searches,
+			    GUINT_TO_POINTER(search->id),
+			    search);
+
+	return(search->id);
+}
+
+gboolean sipe_buddy_search_active(struct sipe_core_private *sipe_private,
+				  guint search_id)
+{
+	return(g_hash_table_lookup(sipe_private->buddies->searches,
+				   GUINT_TO_POINTER(search_id)) != NULL);
+}
+
+void sipe_buddy_search_add(struct sipe_core_private *sipe_private,
+			   guint search_id,
+			   const gchar *uri,
+			   const gchar *name,
+			   const gchar *company,
+			   const gchar *country,
+			   const gchar *email)
+{
+	struct sipe_buddy_search *search = g_hash_table_lookup(sipe_private->buddies->searches,
+								GUINT_TO_POINTER(search_id));
+
+	if (search) {
+		struct buddy_search_row *row = g_new(struct buddy_search_row, 1);
+
+		row->uri     = g_strdup(uri);
+		row->name    = g_strdup(name);
+		row->company = g_strdup(company);
+		row->country = g_strdup(country);
+		row->email   = g_strdup(email);
+
+		search->rows = g_slist_prepend(search->rows, row);
+		search->count++;
+	}
+}
+
+void sipe_buddy_search_finish(struct sipe_core_private *sipe_private,
+			      guint search_id,
+			      gboolean more)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	struct sipe_buddy_search *search = g_hash_table_lookup(buddies->searches,
+								GUINT_TO_POINTER(search_id));
+
+	if (!search) {
+		SIPE_DEBUG_INFO("sipe_buddy_search_finish: dropping results of superseded search %d",
+				search_id);
+		return;
+	}
+	g_hash_table_steal(buddies->searches, GUINT_TO_POINTER(search_id));
+
+	if (search->count == 0) {
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_buddy_search_finish: no matches");
+		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
+					   search->token,
+					   _("No contacts found"));
+		buddy_search_free(search);
+		return;
+	}
+
+	search->rows = g_slist_reverse(search->rows);
+	search->more = more;
+	buddy_search_deliver(sipe_private, search->token, search);
+
+	/* backend token is only valid for this search */
+	search->token   = NULL;
+	search->expires = sipe_utils_monotonic_sec() + BUDDY_SEARCH_CACHE_TTL;
+	buddies->search_cache = g_slist_prepend(buddies->search_cache,
+						search);
+	sipe_cache_stored(sipe_private, SIPE_CACHE_BUDDY_SEARCH);
+}
+
+void sipe_buddy_search_failed(struct sipe_core_private *sipe_private,
+			      guint search_id,
+			      const gchar *msg)
+{
+	struct sipe_buddy_search *search = g_hash_table_lookup(sipe_private->buddies->searches,
+								GUINT_TO_POINTER(search_id));
+
+	if (search) {
+		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
+					   search->token,
+					   msg);
+		g_hash_table_remove(sipe_private->buddies->searches,
+				    GUINT_TO_POINTER(search_id));
+	}
+}
+
 static void search_ab_entry_response(struct sipe_core_private *sipe_private,
 				     const gchar *uri,
 				     SIPE_UNUSED_PARAMETER const gchar *raw,
@@ -1085,9 +1917,14 @@ static void search_ab_entry_response(struct sipe_core_private *sipe_private,
 {
 	struct ms_dlx_data *mdd = callback_data;
 
+	/* search has been superseded */
+	if (!sipe_buddy_search_active(sipe_private, mdd->search_id)) {
+		ms_dlx_free(mdd);
+		return;
+	}
+
 	if (soap_body) {
 		const sipe_xml *node;
-		struct sipe_backend_search_results *results;
 		GHashTable *found;
 
 		SIPE_DEBUG_INFO("search_ab_entry_response: received valid SOAP message from service %s",
@@ -1112,26 +1949,15 @@ static void search_ab_entry_response(struct sipe_core_private *sipe_private,
 			} else {
 				SIPE_DEBUG_ERROR_NOFORMAT("search_ab_entry_response: no matches");
 
-				sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-							   mdd->token,
-							   _("No contacts found"));
+				sipe_buddy_search_failed(sipe_private,
+							 mdd->search_id,
+							 _("No contacts found"));
 				ms_dlx_free(mdd);
 				return;
 			}
 		}
 
-		/* OK, we found something - show the results to the user */
-		results = sipe_backend_search_results_start(SIPE_CORE_PUBLIC,
-							    mdd->token);
-		if (!results) {
-			SIPE_DEBUG_ERROR_NOFORMAT("search_ab_entry_response: Unable to display the search results.");
-			sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-						   mdd->token,
-						   _("Unable to display the search results"));
-			ms_dlx_free(mdd);
-			return;
-		}
-
+		/* OK, we found something - collect the results */
 		/* SearchAbEntryResult can contain duplicates */
 		found = g_hash_table_new_full(g_str_hash, g_str_equal,
 					      g_free, NULL);
@@ -1182,13 +2008,13 @@ static void search_ab_entry_response(struct sipe_core_private *sipe_private,
 
 			if (sip_uri && !g_hash_table_lookup(found, sip_uri)) {
 				gchar **uri_parts = g_strsplit(sip_uri, ":", 2);
-				sipe_backend_search_results_add(SIPE_CORE_PUBLIC,
-								results,
-								uri_parts[1],
-								displayname,
-								company,
-								country,
-								email);
+				sipe_buddy_search_add(sipe_private,
+						      mdd->search_id,
+						      uri_parts[1],
+						      displayname,
+						      company,
+						      country,
+						      email);
 				g_strfreev(uri_parts);
 
 				g_hash_table_insert(found, sip_uri, (gpointer) TRUE);
@@ -1202,9 +2028,7 @@ static void search_ab_entry_response(struct sipe_core_private *sipe_private,
 			g_free(sip_uri);
 		}
 
-		sipe_buddy_search_contacts_finalize(sipe_private, results,
-						    g_hash_table_size(found),
-						    FALSE);
+		sipe_buddy_search_finish(sipe_private, mdd->search_id, FALSE);
 		g_hash_table_destroy(found);
 		ms_dlx_free(mdd);
 
@@ -1217,20 +2041,22 @@ static gboolean process_search_contact_response(struct sipe_core_private *sipe_p
 						struct sipmsg *msg,
 						struct transaction *trans)
 {
-	struct sipe_backend_search_token *token = trans->payload->data;
-	struct sipe_backend_search_results *results;
+	guint search_id = GPOINTER_TO_UINT(trans->payload->data);
 	sipe_xml *searchResults;
 	const sipe_xml *mrow;
-	guint match_count = 0;
 	gboolean more = FALSE;
 
+	/* search has been superseded */
+	if (!sipe_buddy_search_active(sipe_private, search_id))
+		return(FALSE);
+
 	/* valid response? */
 	if (msg->response != 200) {
 		SIPE_DEBUG_ERROR("process_search_contact_response: request failed (%d)",
 				 msg->response);
-		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-					   token,
-					   _("Contact search failed"));
+		sipe_buddy_search_failed(sipe_private,
+					 search_id,
+					 _("Contact search failed"));
 		return(FALSE);
 	}
 
@@ -1240,48 +2066,24 @@ static gboolean process_search_contact_response(struct sipe_core_private *sipe_p
 	searchResults = sipe_xml_parse(msg->body, msg->bodylen);
 	if (!searchResults) {
 		SIPE_DEBUG_INFO_NOFORMAT("process_search_contact_response: no parseable searchResults");
-		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-					   token,
-					   _("Contact search failed"));
+		sipe_buddy_search_failed(sipe_private,
+					 search_id,
+					 _("Contact search failed"));
 		return(FALSE);
 	}
 
-	/* any matches? */
-	mrow = sipe_xml_child(searchResults, "Body/Array/row");
-	if (!mrow) {
-		SIPE_DEBUG_ERROR_NOFORMAT("process_search_contact_response: no matches");
-		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-					   token,
-					   _("No contacts found"));
-
-		sipe_xml_free(searchResults);
-		return(FALSE);
-	}
-
-	/* OK, we found something - show the results to the user */
-	results = sipe_backend_search_results_start(SIPE_CORE_PUBLIC,
-						    trans->payload->data);
-	if (!results) {
-		SIPE_DEBUG_ERROR_NOFORMAT("process_search_contact_response: Unable to display the search results.");
-		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-					   token,
-					   _("Unable to display the search results"));
-
-		sipe_xml_free(searchResults);
-		return FALSE;
-	}
-
-	for (/* initialized above */ ; mrow; mrow = sipe_xml_twin(mrow)) {
+	for (mrow = sipe_xml_child(searchResults, "Body/Array/row");
+	     mrow;
+	     mrow = sipe_xml_twin(mrow)) {
 		gchar **uri_parts = g_strsplit(sipe_xml_attribute(mrow, "uri"), ":", 2);
-		sipe_backend_search_results_add(SIPE_CORE_PUBLIC,
-						results,
-						uri_parts[1],
-						sipe_xml_attribute(mrow, "displayName"),
-						sipe_xml_attribute(mrow, "company"),
-						sipe_xml_attribute(mrow, "country"),
-						sipe_xml_attribute(mrow, "email"));
+		sipe_buddy_search_add(sipe_private,
+				      search_id,
+				      uri_parts[1],
+				      sipe_xml_attribute(mrow, "displayName"),
+				      sipe_xml_attribute(mrow, "company"),
+				      sipe_xml_attribute(mrow, "country"),
+				      sipe_xml_attribute(mrow, "email"));
 		g_strfreev(uri_parts);
-		match_count++;
 	}
 
 	if ((mrow = sipe_xml_child(searchResults, "Body/directorySearch/moreAvailable")) != NULL) {
@@ -1290,7 +2092,7 @@ static gboolean process_search_contact_response(struct sipe_core_private *sipe_p
 		g_free(data);
 	}
 
-	sipe_buddy_search_contacts_finalize(sipe_private, results, match_count, more);
+	sipe_buddy_search_finish(sipe_private, search_id, more);
 	sipe_xml_free(searchResults);
 
 	return(TRUE);
@@ -1324,13 +2126,31 @@ static void search_ab_entry_failed(struct sipe_core_private *sipe_private,
 	if (mdd->search_rows)
 		search_soap_request(sipe_private,
 				    NULL,
-				    mdd->token,
+				    GUINT_TO_POINTER(mdd->search_id),
 				    100,
 				    process_search_contact_response,
 				    mdd->search_rows);
+	else
+		sipe_buddy_search_failed(sipe_private,
+					 mdd->search_id,
+					 _("Contact search failed"));
 	ms_dlx_free(mdd);
 }
 
+GSList *sipe_core_buddy_local_search(struct sipe_core_public *sipe_public,
+				     const gchar *query,
+				     guint max_results)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+
+	if (!sipe_private->buddies)
+		return(NULL);
+
+	return(sipe_buddy_index_search(sipe_private->buddies->index,
+				       query,
+				       max_results));
+}
+
 void sipe_core_buddy_search(struct sipe_core_public *sipe_public,
 			    struct sipe_backend_search_token *token,
 			    const gchar *given_name,
@@ -1341,13 +2161,28 @@ void sipe_core_buddy_search(struct sipe_core_public *sipe_public,
 			    const gchar *country)
 {
 	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	gchar *query = g_strjoin("\n",
+				 given_name ? given_name : "",
+				 surname    ? surname    : "",
+				 email      ? email      : "",
+				 sipid      ? sipid      : "",
+				 company    ? company    : "",
+				 country    ? country    : "",
+				 NULL);
+	guint search_id = buddy_search_start(sipe_private, token, query);
+
+	g_free(query);
+
+	/* results have been taken from cache */
+	if (!search_id)
+		return;
 
 	/* Lync 2013 or newer: use UCS if contacts are migrated */
 	if (SIPE_CORE_PRIVATE_FLAG_IS(LYNC2013) &&
 	    sipe_ucs_is_migrated(sipe_private)) {
 
 		sipe_ucs_search(sipe_private,
-				token,
+				search_id,
 				given_name,
 				surname,
 				email,
@@ -1388,7 +2223,7 @@ void sipe_core_buddy_search(struct sipe_core_public *sipe_public,
 				mdd->callback        = search_ab_entry_response;
 				mdd->failed_callback = search_ab_entry_failed;
 				mdd->session         = sipe_svc_session_start();
-				mdd->token           = token;
+				mdd->search_id       = search_id;
 
 				ms_dlx_webticket_request(sipe_private, mdd);
 
@@ -1396,16 +2231,16 @@ void sipe_core_buddy_search(struct sipe_core_public *sipe_public,
 				/* no [MS-DLX] server, use Active Directory search instead */
 				search_soap_request(sipe_private,
 						    NULL,
-						    token,
+						    GUINT_TO_POINTER(search_id),
 						    100,
 						    process_search_contact_response,
 						    query_rows);
 				free_search_rows(query_rows);
 			}
 		} else
-			sipe_backend_search_failed(sipe_public,
-						   token,
-						   _("Invalid contact search query"));
+			sipe_buddy_search_failed(sipe_private,
+						 search_id,
+						 _("Invalid contact search query"));
 	}
 }
 
@@ -1480,16 +2315,65 @@ static void get_info_finalize(struct sipe_core_private *sipe_private,
 	}
 
 	sbuddy = sipe_buddy_find_by_uri(sipe_private, uri);
-	if (sbuddy && sbuddy->device_name) {
+	if (sbuddy && sbuddy->ext && sbuddy->ext->device_name) {
 		sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
 					    info,
 					    SIPE_BUDDY_INFO_DEVICE,
-					    sbuddy->device_name);
+					    sbuddy->ext->device_name);
 	}
 
 	sipe_backend_buddy_info_finalize(SIPE_CORE_PUBLIC, info, uri);
 }
 
+/* show property and remember it for the directory cache */
+static void get_info_add(struct sipe_core_private *sipe_private,
+			 struct sipe_backend_buddy_info *info,
+			 GSList **properties,
+			 sipe_buddy_info_fields type,
+			 const gchar *value)
+{
+	sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC, info, type, value);
+	*properties = sipe_directory_property_add(*properties, type, value);
+}
+
+static const gchar *get_info_change_key(struct sipe_core_private *sipe_private,
+					const gchar *uri)
+{
+	struct sipe_buddy *sbuddy = sipe_buddy_find_by_uri(sipe_private, uri);
+	return(sbuddy ? sbuddy->change_key : NULL);
+}
+
+/* replay directory information from the cache */
+static void get_info_cached(struct sipe_core_private *sipe_private,
+			    const gchar *uri,
+			    const GSList *properties)
+{
+	struct sipe_backend_buddy_info *info = sipe_backend_buddy_info_start(SIPE_CORE_PUBLIC);
+	const gchar *server_alias = NULL;
+	const gchar *email        = NULL;
+
+	for (; properties; properties = properties->next) {
+		const struct sipe_directory_property *property = properties->data;
+
+		if (!server_alias &&
+		    (property->type == SIPE_BUDDY_INFO_DISPLAY_NAME))
+			server_alias = property->value;
+		else if (!email &&
+			 (property->type == SIPE_BUDDY_INFO_EMAIL))
+			email = property->value;
+
+		sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
+					    info,
+					    property->type,
+					    property->value);
+	}
+
+	get_info_finalize(sipe_private,
+			  info,
+			  uri,
+			  server_alias,
+			  email);
+}
 
 static void get_info_ab_entry_response(struct sipe_core_private *sipe_private,
 				       const gchar *uri,
@@ -1501,6 +2385,7 @@ static void get_info_ab_entry_response(struct sipe_core_private *sipe_private,
 	struct sipe_backend_buddy_info *info = NULL;
 	gchar *server_alias = NULL;
 	gchar *email        = NULL;
+	GSList *properties  = NULL;
 
 	if (soap_body) {
 		const sipe_xml *node;
@@ -1527,33 +2412,38 @@ static void get_info_ab_entry_response(struct sipe_core_private *sipe_private,
 					g_free(server_alias);
 					server_alias = value;
 					value = NULL;
-					sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-								    info,
-								    SIPE_BUDDY_INFO_DISPLAY_NAME,
-								    server_alias);
+					get_info_add(sipe_private,
+						     info,
+						     &properties,
+						     SIPE_BUDDY_INFO_DISPLAY_NAME,
+						     server_alias);
 				} else if (sipe_strcase_equal(name, "mail")) {
 					g_free(email);
 					email = value;
 					value = NULL;
-					sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-								    info,
-								    SIPE_BUDDY_INFO_EMAIL,
-								    email);
+					get_info_add(sipe_private,
+						     info,
+						     &properties,
+						     SIPE_BUDDY_INFO_EMAIL,
+						     email);
 				} else if (sipe_strcase_equal(name, "title")) {
-					sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-								    info,
-								    SIPE_BUDDY_INFO_JOB_TITLE,
-								    value);
+					get_info_add(sipe_private,
+						     info,
+						     &properties,
+						     SIPE_BUDDY_INFO_JOB_TITLE,
+						     value);
 				} else if (sipe_strcase_equal(name, "company")) {
-					sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-								    info,
-								    SIPE_BUDDY_INFO_COMPANY,
-								    value);
+					get_info_add(sipe_private,
+						     info,
+						     &properties,
+						     SIPE_BUDDY_INFO_COMPANY,
+						     value);
 				} else if (sipe_strcase_equal(name, "country")) {
-					sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-								    info,
-								    SIPE_BUDDY_INFO_COUNTRY,
-								    value);
+					get_info_add(sipe_private,
+						     info,
+						     &properties,
+						     SIPE_BUDDY_INFO_COUNTRY,
+						     value);
 				}
 
 			} else if (values) {
@@ -1561,10 +2451,11 @@ static void get_info_ab_entry_response(struct sipe_core_private *sipe_private,
 									    "string"));
 
 				if (sipe_strcase_equal(name, "telephonenumber")) {
-					sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-								    info,
-								    SIPE_BUDDY_INFO_WORK_PHONE,
-								    first);
+					get_info_add(sipe_private,
+						     info,
+						     &properties,
+						     SIPE_BUDDY_INFO_WORK_PHONE,
+						     first);
 				}
 
 				g_free(first);
@@ -1575,6 +2466,11 @@ static void get_info_ab_entry_response(struct sipe_core_private *sipe_private,
 		}
 	}
 
+	sipe_directory_cache_store(sipe_private,
+				   mdd->other,
+				   get_info_change_key(sipe_private, mdd->other),
+				   properties);
+
 	/* this will show the minmum information */
 	get_info_finalize(sipe_private,
 			  info,
@@ -1595,6 +2491,7 @@ static gboolean process_get_info_response(struct sipe_core_private *sipe_private
 	struct sipe_backend_buddy_info *info = NULL;
 	gchar *server_alias = NULL;
 	gchar *email        = NULL;
+	GSList *properties  = NULL;
 
 	SIPE_DEBUG_INFO("Fetching %s's user info for %s",
 			uri, sipe_private->username);
@@ -1641,64 +2538,78 @@ static gboolean process_get_info_response(struct sipe_core_private *sipe_private
 			}
 
 			if (!is_empty(server_alias)) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_DISPLAY_NAME,
-							     server_alias);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_DISPLAY_NAME,
+					     server_alias);
 			}
 			if ((value = sipe_xml_attribute(mrow, "title")) && strlen(value) > 0) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_JOB_TITLE,
-							     value);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_JOB_TITLE,
+					     value);
 			}
 			if ((value = sipe_xml_attribute(mrow, "office")) && strlen(value) > 0) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_OFFICE,
-							     value);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_OFFICE,
+					     value);
 			}
 			if (!is_empty(phone_number)) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_WORK_PHONE,
-							     phone_number);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_WORK_PHONE,
+					     phone_number);
 			}
 			g_free(phone_number);
 			if ((value = sipe_xml_attribute(mrow, "company")) && strlen(value) > 0) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_COMPANY,
-							     value);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_COMPANY,
+					     value);
 			}
 			if ((value = sipe_xml_attribute(mrow, "city")) && strlen(value) > 0) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_CITY,
-							     value);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_CITY,
+					     value);
 			}
 			if ((value = sipe_xml_attribute(mrow, "state")) && strlen(value) > 0) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_STATE,
-							     value);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_STATE,
+					     value);
 			}
 			if ((value = sipe_xml_attribute(mrow, "country")) && strlen(value) > 0) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_COUNTRY,
-							     value);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_COUNTRY,
+					     value);
 			}
 			if (!is_empty(email)) {
-				sipe_backend_buddy_info_add(SIPE_CORE_PUBLIC,
-							     info,
-							     SIPE_BUDDY_INFO_EMAIL,
-							     email);
+				get_info_add(sipe_private,
+					     info,
+					     &properties,
+					     SIPE_BUDDY_INFO_EMAIL,
+					     email);
 			}
 		}
 		sipe_xml_free(searchResults);
 	}
 
+	sipe_directory_cache_store(sipe_private,
+				   uri,
+				   get_info_change_key(sipe_private, uri),
+				   properties);
+
 	/* this will show the minmum information */
 	get_info_finalize(sipe_private,
 			  info,
@@ -1737,8 +2648,18 @@ void sipe_core_buddy_get_info(struct sipe_core_public *sipe_public,
 			      const gchar *who)
 {
 	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
-	GSList *search_rows = search_rows_for_uri(who);
+	const GSList *cached = sipe_directory_cache_lookup(sipe_private,
+							   who,
+							   get_info_change_key(sipe_private,
+									       who));
+	GSList *search_rows;
+
+	if (cached) {
+		get_info_cached(sipe_private, who, cached);
+		return;
+	}
 
+	search_rows = search_rows_for_uri(who);
 	if (sipe_private->dlx_uri) {
 		struct ms_dlx_data *mdd = g_new0(struct ms_dlx_data, 1);
 
@@ -1770,41 +2691,71 @@ static void photo_response_data_free(struct photo_response_data *data)
 	if (data->request) {
 		sipe_http_request_cancel(data->request);
 	}
+	if (data->photo)
+		g_byte_array_free(data->photo, TRUE);
 	g_free(data);
 }
 
+static gsize process_buddy_photo_body(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+				      const gchar *body,
+				      gsize length,
+				      gpointer data)
+{
+	struct photo_response_data *rdata = (struct photo_response_data *) data;
+
+	if (!rdata->photo)
+		rdata->photo = g_byte_array_new();
+	g_byte_array_append(rdata->photo, (const guint8 *) body, length);
+
+	return(length);
+}
+
 static void process_buddy_photo_response(struct sipe_core_private *sipe_private,
 					 guint status,
 					 GSList *headers,
-					 const char *body,
+					 SIPE_UNUSED_PARAMETER const char *body,
 					 gpointer data)
 {
 	struct photo_response_data *rdata = (struct photo_response_data *) data;
 
 	rdata->request = NULL;
 
-	if (status == SIPE_HTTP_STATUS_OK) {
-		const gchar *len_str = sipe_utils_nameval_find(headers,
-							       "Content-Length");
-		if (len_str) {
-			gsize photo_size = atoi(len_str);
-			gpointer photo = g_new(char, photo_size);
-
-			if (photo) {
-				memcpy(photo, body, photo_size);
-
-				sipe_backend_buddy_set_photo(SIPE_CORE_PUBLIC,
-							     rdata->who,
-							     photo,
-							     photo_size,
-							     rdata->photo_hash);
-			}
-		}
+	if ((status == SIPE_HTTP_STATUS_OK) && rdata->photo) {
+		/* body has been collected by process_buddy_photo_body() */
+		gsize photo_size = rdata->photo->len;
+		gpointer photo   = g_byte_array_free(rdata->photo, FALSE);
+
+		rdata->photo = NULL;
+		sipe_photo_cache_store(sipe_private,
+				       rdata->who,
+				       rdata->photo_hash,
+				       sipe_utils_nameval_find(headers,
+							       "ETag"),
+				       photo,
+				       photo_size);
+
+		/* photo may have been set while the request was running */
+		if (sipe_strequal(rdata->photo_hash,
+				  sipe_backend_buddy_get_photo_hash(SIPE_CORE_PUBLIC,
+								    rdata->who)))
+			g_free(photo);
+		else
+			sipe_backend_buddy_set_photo(SIPE_CORE_PUBLIC,
+						     rdata->who,
+						     photo,
+						     photo_size,
+						     rdata->photo_hash);
+	} else if (status == SIPE_HTTP_STATUS_NOT_MODIFIED) {
+		/* conditional request: cached photo is still valid */
+		sipe_photo_cache_revalidate(sipe_private,
+					    rdata->who,
+					    rdata->photo_hash);
 	}
 
 	sipe_private->buddies->pending_photo_requests =
 		g_slist_remove(sipe_private->buddies->pending_photo_requests, rdata);
 
+	sipe_buddy_photo_done(sipe_private, rdata->who);
 	photo_response_data_free(rdata);
 }
 
@@ -1829,38 +2780,57 @@ static gchar *create_x_ms_webticket_header(const gchar *wsse_security)
 	return x_ms_webticket_header;
 }
 
-void sipe_buddy_update_photo(struct sipe_core_private *sipe_private,
-			     const gchar *uri,
-			     const gchar *photo_hash,
-			     const gchar *photo_url,
-			     const gchar *headers)
+gboolean sipe_buddy_update_photo(struct sipe_core_private *sipe_private,
+				 const gchar *uri,
+				 const gchar *photo_hash,
+				 const gchar *photo_url,
+				 const gchar *headers)
 {
 	const gchar *photo_hash_old =
 		sipe_backend_buddy_get_photo_hash(SIPE_CORE_PUBLIC, uri);
+	gboolean started = FALSE;
 
-	if (!sipe_strequal(photo_hash, photo_hash_old)) {
+	if (!sipe_strequal(photo_hash, photo_hash_old) &&
+	    !sipe_photo_cache_load(sipe_private, uri, photo_hash)) {
 		struct photo_response_data *data = g_new(struct photo_response_data, 1);
+		gchar *etag = sipe_photo_cache_etag(sipe_private, uri);
+		gchar *conditional = NULL;
 
-		SIPE_DEBUG_INFO("sipe_buddy_update_photo: who '%s' url '%s' hash '%s'",
-				uri, photo_url, photo_hash);
+		SIPE_DEBUG_INFO("sipe_buddy_update_photo: who '%s' url '%s' hash '%s' etag '%s'",
+				uri, photo_url, photo_hash, etag ? etag : "");
 
 		data->who        = g_strdup(uri);
 		data->photo_hash = g_strdup(photo_hash);
+		data->photo      = NULL;
+
+		/* photo might not have changed although the hash did */
+		if (etag)
+			conditional = g_strdup_printf("%sIf-None-Match: %s\r\n",
+						      headers ? headers : "",
+						      etag);
 
 		data->request = sipe_http_request_get(sipe_private,
 						      photo_url,
-						      headers,
+						      conditional ? conditional : headers,
 						      process_buddy_photo_response,
 						      data);
+		g_free(conditional);
+		g_free(etag);
 
 		if (data->request) {
 			sipe_private->buddies->pending_photo_requests =
 				g_slist_append(sipe_private->buddies->pending_photo_requests, data);
+			sipe_http_request_allow_pipelining(data->request);
+			sipe_http_request_stream(data->request,
+						 process_buddy_photo_body);
 			sipe_http_request_ready(data->request);
+			started = TRUE;
 		} else {
 			photo_response_data_free(data);
 		}
 	}
+
+	return(started);
 }
 
 static void get_photo_ab_entry_response(struct sipe_core_private *sipe_private,
@@ -1907,52 +2877,145 @@ static void get_photo_ab_entry_response(struct sipe_core_private *sipe_private,
 				sipe_private->addressbook_uri, photo_rel_path);
 		gchar *x_ms_webticket_header = create_x_ms_webticket_header(mdd->wsse_security);
 
-		sipe_buddy_update_photo(sipe_private,
-					mdd->other,
-					photo_hash,
-					photo_url,
-					x_ms_webticket_header);
+		/* download completion will release the slot */
+		if (!sipe_buddy_update_photo(sipe_private,
+					     mdd->other,
+					     photo_hash,
+					     photo_url,
+					     x_ms_webticket_header))
+			sipe_buddy_photo_done(sipe_private, mdd->other);
 
 		g_free(x_ms_webticket_header);
 		g_free(photo_url);
-	}
+	} else
+		sipe_buddy_photo_done(sipe_private, mdd->other);
 
 	g_free(photo_rel_path);
 	g_free(photo_hash);
 	ms_dlx_free(mdd);
 }
 
-static void get_photo_ab_entry_failed(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+static void get_photo_ab_entry_failed(struct sipe_core_private *sipe_private,
 				      struct ms_dlx_data *mdd)
 {
+	sipe_buddy_photo_done(sipe_private, mdd->other);
 	ms_dlx_free(mdd);
 }
 
-static void buddy_fetch_photo(struct sipe_core_private *sipe_private,
-			      const gchar *uri)
+/*
+ * [MS-DLX] lookups are added to the batch, which is started by the caller.
+ * Returns FALSE if no lookup could be started.
+ */
+static gboolean buddy_photo_start(struct sipe_core_private *sipe_private,
+				  const gchar *uri,
+				  struct ms_dlx_batch **batch)
 {
-        if (sipe_backend_uses_photo()) {
-
-		/* Lync 2013 or newer: use UCS if contacts are migrated */
-		if (SIPE_CORE_PRIVATE_FLAG_IS(LYNC2013) &&
-		    sipe_ucs_is_migrated(sipe_private)) {
+	/* Lync 2013 or newer: use UCS if contacts are migrated */
+	if (SIPE_CORE_PRIVATE_FLAG_IS(LYNC2013) &&
+	    sipe_ucs_is_migrated(sipe_private)) {
 
-			sipe_ucs_get_photo(sipe_private, uri);
+		sipe_ucs_get_photo(sipe_private, uri);
 
-		/* Lync 2010: use [MS-DLX] */
-		} else if (sipe_private->dlx_uri         &&
-			   sipe_private->addressbook_uri) {
-			struct ms_dlx_data *mdd = g_new0(struct ms_dlx_data, 1);
+	/* Lync 2010: use [MS-DLX] */
+	} else if (sipe_private->dlx_uri         &&
+		   sipe_private->addressbook_uri) {
+		struct ms_dlx_data *mdd = g_new0(struct ms_dlx_data, 1);
 
-			mdd->search_rows     = search_rows_for_uri(uri);
-			mdd->other           = g_strdup(uri);
-			mdd->max_returns     = 1;
-			mdd->callback        = get_photo_ab_entry_response;
-			mdd->failed_callback = get_photo_ab_entry_failed;
-			mdd->session         = sipe_svc_session_start();
+		mdd->search_rows     = search_rows_for_uri(uri);
+		mdd->other           = g_strdup(uri);
+		mdd->max_returns     = 1;
+		mdd->callback        = get_photo_ab_entry_response;
+		mdd->failed_callback = get_photo_ab_entry_failed;
 
-			ms_dlx_webticket_request(sipe_private, mdd);
+		if (!*batch) {
+			*batch = g_new0(struct ms_dlx_batch, 1);
+			(*batch)->session = sipe_svc_session_start();
 		}
+		ms_dlx_batch_add(*batch, mdd);
+
+	} else
+		return(FALSE);
+
+	return(TRUE);
+}
+
+static void buddy_photo_next(struct sipe_core_private *sipe_private,
+			     SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+	struct ms_dlx_batch *batch = NULL;
+
+	buddies->photo_scheduled = FALSE;
+
+	while ((buddies->photo_active < BUDDY_PHOTO_WINDOW) &&
+	       !g_queue_is_empty(buddies->photo_queue)) {
+		gchar *uri = g_queue_pop_head(buddies->photo_queue);
+
+		/* keeps existing key, i.e. uri stays valid */
+		g_hash_table_insert(buddies->photo_state,
+				    g_strdup(uri),
+				    PHOTO_ACTIVE);
+		buddies->photo_active++;
+
+		/* lookups can complete synchronously on failure */
+		if (!buddy_photo_start(sipe_private, uri, &batch))
+			sipe_buddy_photo_done(sipe_private, uri);
+	}
+
+	/* one web ticket request for all [MS-DLX] lookups of this round */
+	if (batch)
+		ms_dlx_batch_request(sipe_private, batch);
+}
+
+/*
+ * Fetching is always deferred. This limits the request rate and avoids
+ * starting new requests from callbacks during shutdown, because pending
+ * actions are cancelled before the core is freed.
+ */
+static void buddy_photo_schedule(struct sipe_core_private *sipe_private)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+
+	if (!buddies->photo_scheduled &&
+	    !g_queue_is_empty(buddies->photo_queue)) {
+		buddies->photo_scheduled = TRUE;
+		sipe_schedule_mseconds(sipe_private,
+				       BUDDY_PHOTO_ACTION,
+				       NULL,
+				       BUDDY_PHOTO_DELAY,
+				       buddy_photo_next,
+				       NULL);
+	}
+}
+
+void sipe_buddy_photo_done(struct sipe_core_private *sipe_private,
+			   const gchar *uri)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+
+	/* ignore downloads that were not started by the fetch manager */
+	if (buddies &&
+	    uri &&
+	    (g_hash_table_lookup(buddies->photo_state, uri) == PHOTO_ACTIVE)) {
+		g_hash_table_remove(buddies->photo_state, uri);
+		buddies->photo_active--;
+		buddy_photo_schedule(sipe_private);
+	}
+}
+
+static void buddy_fetch_photo(struct sipe_core_private *sipe_private,
+			      const gchar *uri)
+{
+	struct sipe_buddies *buddies = sipe_private->buddies;
+
+	/* fetch already queued or in progress? */
+	if (sipe_backend_uses_photo() &&
+	    !g_hash_table_lookup(buddies->photo_state, uri)) {
+		gchar *key = g_strdup(uri);
+
+		g_hash_table_insert(buddies->photo_state, key, PHOTO_QUEUED);
+		g_queue_push_tail(buddies->photo_queue, key);
+		buddy_photo_schedule(sipe_private);
 	}
 }
 
@@ -2220,42 +3283,28 @@ guint sipe_buddy_count(struct sipe_core_private *sipe_private)
 	return(g_hash_table_size(sipe_private->buddies->uri));
 }
 
-static guint sipe_ht_hash_nick(const char *nick)
-{
-	char *lc = g_utf8_strdown(nick, -1);
-	guint bucket = g_str_hash(lc);
-	g_free(lc);
-
-	return bucket;
-}
-
-static gboolean sipe_ht_equals_nick(const char *nick1, const char *nick2)
-{
-	char *nick1_norm = NULL;
-	char *nick2_norm = NULL;
-	gboolean equal;
-
-	if (nick1 == NULL && nick2 == NULL) return TRUE;
-	if (nick1 == NULL || nick2 == NULL    ||
-	    !g_utf8_validate(nick1, -1, NULL) ||
-	    !g_utf8_validate(nick2, -1, NULL)) return FALSE;
-
-	nick1_norm = g_utf8_casefold(nick1, -1);
-	nick2_norm = g_utf8_casefold(nick2, -1);
-	equal = g_utf8_collate(nick1_norm, nick2_norm) == 0;
-	g_free(nick2_norm);
-	g_free(nick1_norm);
-
-	return equal;
-}
-
 void sipe_buddy_init(struct sipe_core_private *sipe_private)
 {
 	struct sipe_buddies *buddies = g_new0(struct sipe_buddies, 1);
-	buddies->uri          = g_hash_table_new((GHashFunc)  sipe_ht_hash_nick,
-						 (GEqualFunc) sipe_ht_equals_nick);
+	/* URIs are compared case insensitive, without allocations */
+	buddies->uri          = g_hash_table_new(sipe_strcase_hash,
+						 (GEqualFunc) sipe_strcase_equal);
 	buddies->exchange_key = g_hash_table_new(g_str_hash,
 						 g_str_equal);
+	buddies->photo_queue  = g_queue_new();
+	buddies->photo_state  = g_hash_table_new_full(g_str_hash,
+						      g_str_equal,
+						      g_free,
+						      NULL);
+	buddies->status_pending = g_hash_table_new_full(g_str_hash,
+							g_str_equal,
+							g_free,
+							NULL);
+	buddies->searches     = g_hash_table_new_full(g_direct_hash,
+						      g_direct_equal,
+						      NULL,
+						      (GDestroyNotify) buddy_search_free);
+	buddies->index        = sipe_buddy_index_new();
 	sipe_private->buddies = buddies;
 }
 
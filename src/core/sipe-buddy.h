@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -25,29 +25,29 @@ struct sipe_backend_search_results;
 struct sipe_cal_working_hours;
 struct sipe_core_private;
 struct sipe_group;
+struct sipe_memory_usage;
 
-struct sipe_buddy {
-	gchar *name;
-	gchar *exchange_key;
-	gchar *change_key;
-	gchar *activity;
+/*
+ * Data that is NULL/0 for most buddies. Allocated on first write by
+ * sipe_buddy_extended(), i.e. readers must check sipe_buddy->ext first.
+ */
+struct sipe_buddy_extended {
 	gchar *meeting_subject;
 	gchar *meeting_location;
-	/* Sipe internal format for Note is HTML.
-	 * All incoming plain text should be html-escaped
-	 * for example by g_markup_escape_text()
-	 */
-	gchar *note;
-	gboolean is_oof_note;
-	gboolean is_mobile;
-	time_t note_since;
+	gchar *device_name;
 
 	/* Calendar related fields */
-	gchar *cal_start_time;
+	time_t cal_start_time;
 	int cal_granularity;
-	gchar *cal_free_busy_base64;
-	gchar *cal_free_busy;
+	/* decoded free/busy: 2 bits per slot, 4 slots per byte, LSB first */
+	guchar *cal_free_busy;
+	guint cal_free_busy_slots;
 	time_t cal_free_busy_published;
+	struct sipe_cal_working_hours *cal_working_hours;
+	/* see sipe_cal_get_description() */
+	gchar *cal_description;
+	time_t cal_description_until;
+
 	/* for 2005 systems */
 	int user_avail;
 	time_t user_avail_since;
@@ -55,22 +55,70 @@ struct sipe_buddy {
 	const char *last_non_cal_status_id;
 	gchar *last_non_cal_activity;
 
-	struct sipe_cal_working_hours *cal_working_hours;
+	/* key: "name/instance/container", value: hash of raw category XML */
+	GHashTable *category_hashes;
+};
 
-	gchar *device_name;
-	GSList *groups;
+struct sipe_buddy {
+	const gchar *name; /* interned, see sipe-intern.h */
+	/* group memberships: bitmaps indexed by sipe_group->slot */
+	guint32 *groups;
+	guint32 *obsolete_groups; /* not yet confirmed by list update */
+	guint group_words;
+	gchar *activity;
+	/* Sipe internal format for Note is HTML.
+	 * All incoming plain text should be html-escaped
+	 * for example by g_markup_escape_text()
+	 */
+	gchar *note;
+	time_t note_since;
+	gboolean is_oof_note;
+	gboolean is_mobile;
 	 /** flag to control sending 'context' element in 2007 subscriptions */
 	gboolean just_added;
 	gboolean is_obsolete;
+	guint roaming_hash; /* last roaming contacts record, 0 = unknown */
+	guint status_hash;  /* last status delivered to backend, 0 = unknown */
+	/* on-demand presence subscription, see sipe-subscriptions.c */
+	gboolean presence_subscribed;
+	gint64 presence_used; /* sipe_utils_monotonic_sec(), 0 = never */
+	gchar *pool; /* home server FQDN from [MS-PRES] redirect, NULL = unknown */
+
+	gchar *exchange_key;
+	gchar *change_key;
+	struct sipe_buddy_extended *ext;
 };
 
+/**
+ * Remember the home server of a buddy
+ *
+ * Batched presence subscriptions for buddies with a known home server
+ * are sent directly to that server. See sipe-subscriptions.c.
+ *
+ * @param sipe_private SIPE core data
+ * @param uri          a SIP URI
+ * @param pool         home server FQDN (may be @c NULL)
+ */
+void sipe_buddy_set_pool(struct sipe_core_private *sipe_private,
+			 const gchar *uri,
+			 const gchar *pool);
+
+/**
+ * Extended buddy data for writing. Allocated if necessary.
+ *
+ * @param buddy sipe_buddy data structure
+ *
+ * @return @c sipe_buddy_extended structure
+ */
+struct sipe_buddy_extended *sipe_buddy_extended(struct sipe_buddy *buddy);
+
 /**
  * Adds UCS Exchange/Change keys to a @c sipe_buddy structure
  *
  * @param sipe_private SIPE core data
  * @param buddy        sipe_buddy data structure
  * @param exchange_key Exchange key (may be @c NULL)
- * @param change_key   Change key (may be @c NULL)
+ * @param change_key   Change key (may be @c NULL, replaces existing key)
  */
 void sipe_buddy_add_keys(struct sipe_core_private *sipe_private,
 			 struct sipe_buddy *buddy,
@@ -130,11 +178,37 @@ void sipe_buddy_update_groups(struct sipe_core_private *sipe_private,
 /**
  * Returns string of group IDs the buddy belongs to, e.g. "2 4 7 8"
  *
- * @param buddy sipe_buddy data structure
+ * @param sipe_private SIPE core data
+ * @param buddy        sipe_buddy data structure
  *
  * @result group string. Must be @c g_free()'d after use.
  */
-gchar *sipe_buddy_groups_string(struct sipe_buddy *buddy);
+gchar *sipe_buddy_groups_string(struct sipe_core_private *sipe_private,
+				struct sipe_buddy *buddy);
+
+/**
+ * Iterate the groups a buddy belongs to
+ *
+ * The callback may remove the buddy from the group it was called for.
+ *
+ * @param sipe_private  SIPE core data
+ * @param buddy         sipe_buddy data structure
+ * @param callback      function to call with each (const) @c sipe_group
+ * @param callback_data user data for the callback
+ */
+void sipe_buddy_foreach_group(struct sipe_core_private *sipe_private,
+			      struct sipe_buddy *buddy,
+			      GFunc callback,
+			      gpointer callback_data);
+
+/**
+ * Drop all memberships for a group that is about to be freed
+ *
+ * @param sipe_private SIPE core data
+ * @param group        sipe_group data structure
+ */
+void sipe_buddy_group_removed(struct sipe_core_private *sipe_private,
+			      const struct sipe_group *group);
 
 /**
  * Remove entries from local buddy list that do not have corresponding entries
@@ -158,6 +232,26 @@ void sipe_buddy_update_start(struct sipe_core_private *sipe_private);
  */
 void sipe_buddy_update_finish(struct sipe_core_private *sipe_private);
 
+/**
+ * Confirm buddy during a buddy list update without changing it.
+ *
+ * Only group memberships for groups that aren't obsolete are confirmed.
+ *
+ * @param sipe_private SIPE core data
+ * @param buddy        sipe_buddy data structure
+ *
+ * @return @c TRUE if all group memberships were confirmed
+ */
+gboolean sipe_buddy_update_confirm(struct sipe_core_private *sipe_private,
+				   struct sipe_buddy *buddy);
+
+/**
+ * Cancel buddy list update. This will keep all buddies.
+ *
+ * @param sipe_private SIPE core data
+ */
+void sipe_buddy_update_cancel(struct sipe_core_private *sipe_private);
+
 /**
  * Find buddy by URI
  *
@@ -229,38 +323,150 @@ void sipe_buddy_update_property(struct sipe_core_private *sipe_private,
 /**
  * Update the buddy photo with given SIP URI. If hash is the same
  * as the cached one then the fetching of the photo is skipped.
+ * Photos found in the on-disk photo cache are not downloaded again.
  *
  * @param sipe_private SIPE core data
  * @param uri          a SIP URI
  * @param photo_hash   hash value for the photo data
  * @param photo_url    HTTP URL where to get the photo data
  * @param headers      additional HTTP headers (may be @c NULL)
+ *
+ * @return @c TRUE if a download was started
+ */
+gboolean sipe_buddy_update_photo(struct sipe_core_private *sipe_private,
+				 const gchar *uri,
+				 const gchar *photo_hash,
+				 const gchar *photo_url,
+				 const gchar *headers);
+
+/**
+ * Queue buddy status update for the backend
+ *
+ * Updates are merged per buddy and delivered after a short delay or
+ * by @c sipe_buddy_status_flush(). Updates that wouldn't change the
+ * status presented by the backend are dropped.
+ *
+ * @param sipe_private SIPE core data
+ * @param uri          a SIP URI
+ * @param activity     a @c sipe_activity value
+ */
+void sipe_buddy_set_status(struct sipe_core_private *sipe_private,
+			   const gchar *uri,
+			   guint activity);
+
+/**
+ * Core version of @c sipe_core_buddy_got_status()
+ *
+ * Applies calendar information on 2005 systems and queues the update.
+ *
+ * @param sipe_private SIPE core data
+ * @param uri          a SIP URI
+ * @param activity     a @c sipe_activity value
+ */
+void sipe_buddy_got_status(struct sipe_core_private *sipe_private,
+			   const gchar *uri,
+			   guint activity);
+
+/**
+ * Get buddy status, including updates not yet delivered to the backend
+ *
+ * @param sipe_private SIPE core data
+ * @param uri          a SIP URI
+ *
+ * @return a @c sipe_activity value
+ */
+guint sipe_buddy_get_status(struct sipe_core_private *sipe_private,
+			    const gchar *uri);
+
+/**
+ * Deliver all queued buddy status updates to the backend
+ *
+ * @param sipe_private SIPE core data
+ */
+void sipe_buddy_status_flush(struct sipe_core_private *sipe_private);
+
+/**
+ * Buddy photo lookup or download has finished
+ *
+ * Releases the slot in the photo fetch manager. Can be called for
+ * URIs unknown to the fetch manager.
+ *
+ * @param sipe_private SIPE core data
+ * @param uri          a SIP URI
  */
-void sipe_buddy_update_photo(struct sipe_core_private *sipe_private,
-			     const gchar *uri,
-			     const gchar *photo_hash,
-			     const gchar *photo_url,
-			     const gchar *headers);
+void sipe_buddy_photo_done(struct sipe_core_private *sipe_private,
+			   const gchar *uri);
 
 /**
  * Triggers a download of all buddy photos that were changed on the server.
  *
+ * Lookups are queued and run with a limited number of concurrent requests.
+ *
  * @param sipe_private SIPE core data
  */
 void sipe_buddy_refresh_photos(struct sipe_core_private *sipe_private);
 
+/**
+ * Contact search still active?
+ *
+ * A search is no longer active after it has finished or has been
+ * superseded by a newer search for the same backend token.
+ *
+ * @param sipe_private SIPE core data
+ * @param search_id    search ID
+ *
+ * @return @c TRUE if results should be collected for this search
+ */
+gboolean sipe_buddy_search_active(struct sipe_core_private *sipe_private,
+				  guint search_id);
+
+/**
+ * Add one match to the results of a contact search
+ *
+ * Ignored if the search is no longer active.
+ *
+ * @param sipe_private SIPE core data
+ * @param search_id    search ID
+ * @param uri          SIP URI without "sip:" prefix
+ * @param name         display name (may be @c NULL)
+ * @param company      company (may be @c NULL)
+ * @param country      country (may be @c NULL)
+ * @param email        email address (may be @c NULL)
+ */
+void sipe_buddy_search_add(struct sipe_core_private *sipe_private,
+			   guint search_id,
+			   const gchar *uri,
+			   const gchar *name,
+			   const gchar *company,
+			   const gchar *country,
+			   const gchar *email);
+
 /**
  * Finalize the search results and display results to user.
  *
+ * Shows an error if no matches were added. The results are cached
+ * for a short time.
+ *
  * @param sipe_private SIPE core data
- * @param results      opaque results handle for backend
- * @param match_count  number of matches found
+ * @param search_id    search ID
  * @param more         @c TRUE if there are more matches available
  */
-void sipe_buddy_search_contacts_finalize(struct sipe_core_private *sipe_private,
-					 struct sipe_backend_search_results *results,
-					 guint match_count,
-					 gboolean more);
+void sipe_buddy_search_finish(struct sipe_core_private *sipe_private,
+			      guint search_id,
+			      gboolean more);
+
+/**
+ * Contact search failed
+ *
+ * Ignored if the search is no longer active.
+ *
+ * @param sipe_private SIPE core data
+ * @param search_id    search ID
+ * @param msg          error message for the user
+ */
+void sipe_buddy_search_failed(struct sipe_core_private *sipe_private,
+			      guint search_id,
+			      const gchar *msg);
 
 /**
  * Number of buddies
@@ -282,3 +488,30 @@ void sipe_buddy_init(struct sipe_core_private *sipe_private);
  * @param sipe_private SIPE core data
  */
 void sipe_buddy_free(struct sipe_core_private *sipe_private);
+
+/**
+ * Estimate memory used by buddy data
+ *
+ * @param sipe_private SIPE core data
+ * @param usage        accumulated memory usage
+ */
+void sipe_buddy_memory_usage(struct sipe_core_private *sipe_private,
+			     struct sipe_memory_usage *usage);
+
+/**
+ * Add memory used by cached contact search results
+ *
+ * @param sipe_private SIPE core data
+ * @param usage        accumulated memory usage
+ */
+void sipe_buddy_search_cache_memory_usage(struct sipe_core_private *sipe_private,
+					  struct sipe_memory_usage *usage);
+
+/**
+ * Drop the oldest cached contact search results
+ *
+ * @param sipe_private SIPE core data
+ * @param target       estimated size in bytes to shrink to
+ */
+void sipe_buddy_search_cache_shrink(struct sipe_core_private *sipe_private,
+				    gsize target);
@@ -0,0 +1,229 @@
+/**
+ * @file sipe-cache.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "sipe-backend.h"
+#include "sipe-buddy.h"
+#include "sipe-cache.h"
+#include "sipe-common.h"
+#include "sipe-conf.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-directory-cache.h"
+#include "sipe-metrics.h"
+#include "sipe-schedule.h"
+
+#define SIPE_CACHE_BUDGET             (4 * 1024 * 1024) /* bytes per account */
+#define SIPE_CACHE_ENVIRONMENT_BUDGET "SIPE_CACHE_BUDGET"
+#define SIPE_CACHE_CHECK_ACTION       "<+cache-budget>"
+#define SIPE_CACHE_CHECK_DELAY        1000 /* milliseconds */
+/* shrink below the budget, so that the next store doesn't trigger again */
+#define SIPE_CACHE_SHRINK_PERCENT     75
+
+struct cache_ops {
+	void (*usage)(struct sipe_core_private *sipe_private,
+		      struct sipe_memory_usage *usage);
+	/* evict least recently used entries until below target bytes */
+	void (*shrink)(struct sipe_core_private *sipe_private,
+		       gsize target);
+};
+
+static const struct cache_ops cache_ops[SIPE_CACHES] = {
+	{ sipe_directory_cache_memory_usage,    sipe_directory_cache_shrink    },
+	{ sipe_conf_focus_cache_memory_usage,   sipe_conf_focus_cache_shrink   },
+	{ sipe_buddy_search_cache_memory_usage, sipe_buddy_search_cache_shrink },
+};
+
+struct sipe_caches {
+	struct sipe_cache_stats stats[SIPE_CACHES];
+	gsize budget;
+#if GLIB_CHECK_VERSION(2,64,0)
+	GMemoryMonitor *monitor;
+	gulong monitor_handler;
+#endif
+};
+
+void sipe_cache_lookup(struct sipe_core_private *sipe_private,
+		       sipe_cache_id cache,
+		       gboolean hit)
+{
+	struct sipe_cache_stats *stats = sipe_private->caches->stats + cache;
+
+	if (hit)
+		stats->hits++;
+	else
+		stats->misses++;
+}
+
+void sipe_cache_evicted(struct sipe_core_private *sipe_private,
+			sipe_cache_id cache,
+			guint entries)
+{
+	sipe_private->caches->stats[cache].evictions += entries;
+}
+
+static guint64 cache_bytes(struct sipe_core_private *sipe_private,
+			   sipe_cache_id cache)
+{
+	struct sipe_memory_usage usage = { 0, 0 };
+
+	(*cache_ops[cache].usage)(sipe_private, &usage);
+	sipe_private->caches->stats[cache].bytes = usage.bytes;
+
+	return(usage.bytes);
+}
+
+/* shrink every cache to percent of its current size */
+static void cache_shrink_all(struct sipe_core_private *sipe_private,
+			     guint64 sizes[SIPE_CACHES],
+			     guint64 percent)
+{
+	guint i;
+
+	for (i = 0; i < SIPE_CACHES; i++)
+		if (sizes[i]) {
+			(*cache_ops[i].shrink)(sipe_private,
+					       sizes[i] * percent / 100);
+			cache_bytes(sipe_private, i);
+		}
+}
+
+static void cache_check(struct sipe_core_private *sipe_private,
+			SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sipe_caches *caches = sipe_private->caches;
+	guint64 sizes[SIPE_CACHES];
+	guint64 total = 0;
+	guint i;
+
+	for (i = 0; i < SIPE_CACHES; i++)
+		total += sizes[i] = cache_bytes(sipe_private, i);
+
+	if (total <= caches->budget)
+		return;
+
+	/* every cache gives up the same fraction of its entries */
+	SIPE_DEBUG_INFO("cache_check: %" G_GUINT64_FORMAT " bytes exceed budget of %" G_GSIZE_FORMAT " bytes",
+			total, caches->budget);
+	cache_shrink_all(sipe_private,
+			 sizes,
+			 (guint64) caches->budget * SIPE_CACHE_SHRINK_PERCENT / total);
+}
+
+void sipe_cache_stored(struct sipe_core_private *sipe_private,
+		       SIPE_UNUSED_PARAMETER sipe_cache_id cache)
+{
+	/* burst of stores, e.g. during login: check once afterwards */
+	sipe_schedule_mseconds(sipe_private,
+			       SIPE_CACHE_CHECK_ACTION,
+			       NULL,
+			       SIPE_CACHE_CHECK_DELAY,
+			       cache_check,
+			       NULL);
+}
+
+void sipe_cache_stats(struct sipe_core_private *sipe_private,
+		      sipe_cache_id cache,
+		      struct sipe_cache_stats *stats)
+{
+	cache_bytes(sipe_private, cache);
+	*stats = sipe_private->caches->stats[cache];
+}
+
+#if GLIB_CHECK_VERSION(2,64,0)
+static void cache_low_memory(SIPE_UNUSED_PARAMETER GMemoryMonitor *monitor,
+			     GMemoryMonitorWarningLevel level,
+			     gpointer data)
+{
+	struct sipe_core_private *sipe_private = data;
+	guint64 sizes[SIPE_CACHES];
+	guint i;
+
+	SIPE_DEBUG_INFO("cache_low_memory: warning level %d", level);
+
+	for (i = 0; i < SIPE_CACHES; i++)
+		sizes[i] = cache_bytes(sipe_private, i);
+
+	/* low: evict the colder half, everything else: drop all */
+	cache_shrink_all(sipe_private,
+			 sizes,
+			 (level < G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM) ? 50 : 0);
+}
+#endif
+
+void sipe_cache_init(struct sipe_core_private *sipe_private)
+{
+	struct sipe_caches *caches = g_new0(struct sipe_caches, 1);
+	const gchar *budget = g_getenv(SIPE_CACHE_ENVIRONMENT_BUDGET);
+
+	caches->budget = SIPE_CACHE_BUDGET;
+	if (budget) {
+		guint64 value = g_ascii_strtoull(budget, NULL, 10);
+		if ((value > 0) && (value <= G_MAXSIZE / 1024))
+			caches->budget = value * 1024;
+	}
+	SIPE_DEBUG_INFO("sipe_cache_init: budget %" G_GSIZE_FORMAT " bytes",
+			caches->budget);
+
+#if GLIB_CHECK_VERSION(2,64,0)
+	caches->monitor = g_memory_monitor_dup_default();
+	if (caches->monitor)
+		caches->monitor_handler = g_signal_connect(caches->monitor,
+							   "low-memory-warning",
+							   G_CALLBACK(cache_low_memory),
+							   sipe_private);
+#endif
+
+	sipe_private->caches = caches;
+}
+
+void sipe_cache_free(struct sipe_core_private *sipe_private)
+{
+	struct sipe_caches *caches = sipe_private->caches;
+
+	if (!caches)
+		return;
+
+	sipe_schedule_cancel(sipe_private, SIPE_CACHE_CHECK_ACTION);
+
+#if GLIB_CHECK_VERSION(2,64,0)
+	if (caches->monitor) {
+		g_signal_handler_disconnect(caches->monitor,
+					    caches->monitor_handler);
+		g_object_unref(caches->monitor);
+	}
+#endif
+
+	g_free(caches);
+	sipe_private->caches = NULL;
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,108 @@
+/**
+ * @file sipe-cache.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * In-memory cache manager
+ *
+ * The in-memory caches of an account share one memory budget. Each cache
+ * keeps its own eviction order and tells the manager when it has grown.
+ * When the sum of all caches exceeds the budget, every cache is asked to
+ * shrink to its share, i.e. cold entries are evicted first. A memory
+ * pressure warning from the system (GLib 2.64 or newer) shrinks the
+ * caches even further.
+ *
+ * The budget can be changed with the environment variable
+ * SIPE_CACHE_BUDGET (in kB).
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+
+typedef enum {
+	SIPE_CACHE_DIRECTORY,     /* sipe-directory-cache.c   */
+	SIPE_CACHE_CONF_FOCUS,    /* sipe-conf.c: meeting URL */
+	SIPE_CACHE_BUDDY_SEARCH,  /* sipe-buddy.c             */
+	SIPE_CACHES
+} sipe_cache_id;
+
+struct sipe_cache_stats {
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions; /* entries evicted by the manager */
+	guint64 bytes;     /* current estimate */
+};
+
+/**
+ * Record the result of a cache lookup
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        cache ID
+ * @param hit          @c TRUE if the entry was found
+ */
+void sipe_cache_lookup(struct sipe_core_private *sipe_private,
+		       sipe_cache_id cache,
+		       gboolean hit);
+
+/**
+ * A cache has grown: check the budget soon
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        cache ID
+ */
+void sipe_cache_stored(struct sipe_core_private *sipe_private,
+		       sipe_cache_id cache);
+
+/**
+ * A cache has evicted entries on behalf of the manager
+ *
+ * Called by the shrink function of the cache.
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        cache ID
+ * @param entries      number of evicted entries
+ */
+void sipe_cache_evicted(struct sipe_core_private *sipe_private,
+			sipe_cache_id cache,
+			guint entries);
+
+/**
+ * Fill in cache statistics
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        cache ID
+ * @param stats        statistics to fill in
+ */
+void sipe_cache_stats(struct sipe_core_private *sipe_private,
+		      sipe_cache_id cache,
+		      struct sipe_cache_stats *stats);
+
+void sipe_cache_init(struct sipe_core_private *sipe_private);
+void sipe_cache_free(struct sipe_core_private *sipe_private);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
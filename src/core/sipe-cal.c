@@ -103,11 +103,21 @@ struct sipe_cal_std_dst {
 	int month;          /* 1..12 */
 	gchar *day_of_week; /* Sunday or Monday or Tuesday or Wednesday or Thursday or Friday or Saturday */
 	gchar *year;        /* YYYY */
-
-	time_t switch_time;
 };
 
+/* number of years, starting with last year, with precomputed switch times */
+#define SIPE_CAL_SWITCH_YEARS 4
+
+/*
+ * Nearly all buddies of an organisation share a few definitions. Each
+ * distinct one is stored once in a pool, shared by all accounts, and is
+ * read-only after it has been added. The pool is freed with the last
+ * reference.
+ */
 struct sipe_cal_working_hours {
+	gchar *key;                   /* canonical form, pool key */
+	guint ref_count;
+
 	int bias;                     /* Ex.: 480 */
 	struct sipe_cal_std_dst std;  /* StandardTime */
 	struct sipe_cal_std_dst dst;  /* DaylightTime */
@@ -115,15 +125,14 @@ struct sipe_cal_working_hours {
 	int start_time;               /* 0...1440 */
 	int end_time;                 /* 0...1440 */
 
-	gchar *tz;                    /* aggregated timezone string as in TZ environment variable.
-	                                 Ex.: TST+8TDT+7,M3.2.0/02:00:00,M11.1.0/02:00:00 */
-	/** separate simple strings for Windows platform as the proper TZ does not work there.
-	 *  anyway, dynamic timezones would't work with just TZ
-	 */
-	gchar *tz_std;                /* Ex.: TST8 */
-	gchar *tz_dst;                /* Ex.: TDT7 */
+	/* std/dst switch times of SIPE_CAL_SWITCH_YEARS years */
+	int switch_first_year;
+	time_t std_switch_times[SIPE_CAL_SWITCH_YEARS];
+	time_t dst_switch_times[SIPE_CAL_SWITCH_YEARS];
 };
 
+static GHashTable *working_hours_pool = NULL;
+
 /* not for translation, a part of XML Schema definitions */
 static const char *wday_names[] = {"Sunday",
 				   "Monday",
@@ -180,9 +189,13 @@ sipe_cal_calendar_free(struct sipe_calendar *cal)
 		g_free(cal->oof_note);
 		g_free(cal->free_busy);
 		g_free(cal->working_hours_xml_str);
+		g_free(cal->fb_hash);
+		g_free(cal->domino_last_modified);
+		g_free(cal->domino_hash);
 
 		sipe_cal_events_free(cal->cal_events);
 
+		sipe_ews_stream_free(cal);
 		if (cal->request)
 			sipe_http_request_cancel(cal->request);
 		sipe_http_session_close(cal->session);
@@ -256,77 +269,100 @@ sipe_cal_event_hash(struct sipe_cal_event* event)
 				event->is_meeting);
 }
 
-#define ENVIRONMENT_TIMEZONE "TZ"
-
-static gchar *
-sipe_switch_tz(const char *tz)
+/* days since 1970-01-01 for a proleptic Gregorian date, month 1..12 */
+static gint64
+sipe_cal_days_from_civil(gint64 year,
+			 int month,
+			 int day)
 {
-	gchar *tz_orig;
-
-	tz_orig = g_strdup(g_getenv(ENVIRONMENT_TIMEZONE));
-	g_setenv(ENVIRONMENT_TIMEZONE, tz, TRUE);
-	tzset();
-	return(tz_orig);
+	gint64 era;
+	int yoe, doy;
+
+	year -= month <= 2;
+	era   = (year >= 0 ? year : year - 399) / 400;
+	yoe   = (int) (year - era * 400);
+	doy   = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
 }
 
+/**
+ * Converts Epoch time to broken-down UTC time.
+ *
+ * Same as gmtime(3) but doesn't use a static buffer.
+ */
 static void
-sipe_reset_tz(gchar *tz_orig)
+sipe_cal_time_to_tm(time_t time,
+		    struct tm *tm)
 {
-	if (tz_orig) {
-		g_setenv(ENVIRONMENT_TIMEZONE, tz_orig, TRUE);
-		g_free(tz_orig);
-	} else {
-		g_unsetenv(ENVIRONMENT_TIMEZONE);
-	}
-	tzset();
+	gint64 t    = time;
+	gint64 days = (t >= 0 ? t : t - 86399) / 86400;
+	int secs    = (int) (t - days * 86400);
+	gint64 z    = days + 719468;
+	gint64 era  = (z >= 0 ? z : z - 146096) / 146097;
+	int doe     = (int) (z - era * 146097);
+	int yoe     = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int doy     = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int mp      = (5 * doy + 2) / 153;
+	int month   = mp + (mp < 10 ? 3 : -9);
+	gint64 year = yoe + era * 400 + (month <= 2);
+
+	tm->tm_sec   = secs % 60;
+	tm->tm_min   = (secs / 60) % 60;
+	tm->tm_hour  = secs / 3600;
+	tm->tm_mday  = doy - (153 * mp + 2) / 5 + 1;
+	tm->tm_mon   = month - 1;
+	tm->tm_year  = (int) (year - 1900);
+	tm->tm_wday  = (int) (((days % 7) + 11) % 7); /* 1970-01-01 was a Thursday */
+	tm->tm_yday  = (int) (days - sipe_cal_days_from_civil(year, 1, 1));
+	tm->tm_isdst = 0;
 }
 
 /**
- * Converts struct tm to Epoch time_t considering timezone.
+ * Converts struct tm in UTC to Epoch time_t.
  *
- * @param tz as defined for TZ environment variable.
- *
- * Reference: see timegm(3) - Linux man page
+ * Same as timegm(3), i.e. out-of-range fields are normalized and
+ * tm_wday/tm_yday are updated. Doesn't touch the TZ environment.
  */
 time_t
-sipe_mktime_tz(struct tm *tm,
-	       const char* tz)
+sipe_mktime_utc(struct tm *tm)
 {
-	time_t ret;
-	gchar *tz_orig;
+	gint64 year = tm->tm_year + 1900;
+	int month   = tm->tm_mon;
+	gint64 t;
+
+	year  += month / 12;
+	month %= 12;
+	if (month < 0) {
+		month += 12;
+		year--;
+	}
 
-	tz_orig = sipe_switch_tz(tz);
-	ret = mktime(tm);
-	sipe_reset_tz(tz_orig);
+	t = (sipe_cal_days_from_civil(year, month + 1, 1) + tm->tm_mday - 1) * 86400 +
+		tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
 
-	return ret;
+	sipe_cal_time_to_tm((time_t) t, tm);
+	return (time_t) t;
 }
 
 /**
- * Converts Epoch time_t to struct tm considering timezone.
+ * Converts Epoch time_t to struct tm in a timezone.
  *
- * @param tz as defined for TZ environment variable.
- *
- * Reference: see timegm(3) - Linux man page
+ * @param offset UTC offset in minutes, positive west of Greenwich
+ *               (i.e. the Exchange "Bias" semantics)
  */
 static struct tm *
-sipe_localtime_tz(const time_t *time,
-		  const char* tz)
+sipe_cal_localtime(time_t time,
+		   int offset,
+		   struct tm *tm)
 {
-	struct tm *ret;
-	gchar *tz_orig;
-
-	tz_orig = sipe_switch_tz(tz);
-	ret = localtime(time);
-	sipe_reset_tz(tz_orig);
-
-	return ret;
+	sipe_cal_time_to_tm(time - offset * 60, tm);
+	return tm;
 }
 
-void
-sipe_cal_free_working_hours(struct sipe_cal_working_hours *wh)
+static void
+sipe_cal_destroy_working_hours(struct sipe_cal_working_hours *wh)
 {
-	if (!wh) return;
+	g_free(wh->key);
 
 	g_free(wh->std.time);
 	g_free(wh->std.day_of_week);
@@ -337,31 +373,39 @@ sipe_cal_free_working_hours(struct sipe_cal_working_hours *wh)
 	g_free(wh->dst.year);
 
 	g_free(wh->days_of_week);
-	g_free(wh->tz);
-	g_free(wh->tz_std);
-	g_free(wh->tz_dst);
 	g_free(wh);
 }
 
+void
+sipe_cal_free_working_hours(struct sipe_cal_working_hours *wh)
+{
+	if (!wh || --wh->ref_count) return;
+
+	g_hash_table_remove(working_hours_pool, wh->key);
+	if (g_hash_table_size(working_hours_pool) == 0) {
+		g_hash_table_destroy(working_hours_pool);
+		working_hours_pool = NULL;
+	}
+	sipe_cal_destroy_working_hours(wh);
+}
+
 /**
  * Returns time_t of daylight savings time start/end
  * in the provided timezone or otherwise
  * (time_t)-1 if no daylight savings time.
  */
 static time_t
-sipe_cal_get_std_dst_time(time_t now,
+sipe_cal_get_std_dst_time(int year,
 			  int bias,
-			  struct sipe_cal_std_dst* std_dst,
-			  struct sipe_cal_std_dst* dst_std)
+			  const struct sipe_cal_std_dst *std_dst,
+			  const struct sipe_cal_std_dst *dst_std)
 {
 	struct tm switch_tm;
 	time_t res = TIME_NULL;
-	struct tm *gm_now_tm;
 	gchar **time_arr;
 
 	if (std_dst->month == 0) return TIME_NULL;
 
-	gm_now_tm = gmtime(&now);
 	time_arr = g_strsplit(std_dst->time, ":", 0);
 
 	switch_tm.tm_sec  = atoi(time_arr[2]);
@@ -370,10 +414,10 @@ sipe_cal_get_std_dst_time(time_t now,
 	g_strfreev(time_arr);
 	switch_tm.tm_mday  = std_dst->year ? std_dst->day_order : 1 /* to adjust later */ ;
 	switch_tm.tm_mon   = std_dst->month - 1;
-	switch_tm.tm_year  = std_dst->year ? atoi(std_dst->year) - 1900 : gm_now_tm->tm_year;
+	switch_tm.tm_year  = std_dst->year ? atoi(std_dst->year) - 1900 : year - 1900;
 	switch_tm.tm_isdst = 0;
 	/* to set tm_wday */
-	res = sipe_mktime_tz(&switch_tm, "UTC");
+	res = sipe_mktime_utc(&switch_tm);
 
 	/* if not dynamic, calculate right tm_mday */
 	if (!std_dst->year) {
@@ -386,18 +430,56 @@ sipe_cal_get_std_dst_time(time_t now,
 		switch_tm.tm_mday += (std_dst->day_order - 1) * 7;
 		needed_month = switch_tm.tm_mon;
 		/* to set settle date if ahead of allowed month dates */
-		res = sipe_mktime_tz(&switch_tm, "UTC");
+		res = sipe_mktime_utc(&switch_tm);
 		if (needed_month != switch_tm.tm_mon) {
 			/* moving 1 week back to stay within required month */
 			switch_tm.tm_mday -= 7;
 			/* to fix date again */
-			res = sipe_mktime_tz(&switch_tm, "UTC");
+			res = sipe_mktime_utc(&switch_tm);
 		}
 	}
 	/* note: bias is taken from "switch to" structure */
 	return res + (bias + dst_std->bias)*60;
 }
 
+/**
+ * Fills std/dst switch times for @c year
+ *
+ * Precomputed for the years around now, calculated for others.
+ */
+static void
+sipe_cal_get_switch_times(const struct sipe_cal_working_hours *wh,
+			  int year,
+			  time_t *std_switch_time,
+			  time_t *dst_switch_time)
+{
+	int i = year - wh->switch_first_year;
+
+	if ((i >= 0) && (i < SIPE_CAL_SWITCH_YEARS)) {
+		*std_switch_time = wh->std_switch_times[i];
+		*dst_switch_time = wh->dst_switch_times[i];
+	} else {
+		*std_switch_time = sipe_cal_get_std_dst_time(year, wh->bias, &(wh->std), &(wh->dst));
+		*dst_switch_time = sipe_cal_get_std_dst_time(year, wh->bias, &(wh->dst), &(wh->std));
+	}
+}
+
+static void
+sipe_cal_precompute_switch_times(struct sipe_cal_working_hours *wh)
+{
+	struct tm now_tm;
+	int i;
+
+	sipe_cal_time_to_tm(time(NULL), &now_tm);
+	wh->switch_first_year = now_tm.tm_year + 1900 - 1;
+
+	for (i = 0; i < SIPE_CAL_SWITCH_YEARS; i++) {
+		int year = wh->switch_first_year + i;
+		wh->std_switch_times[i] = sipe_cal_get_std_dst_time(year, wh->bias, &(wh->std), &(wh->dst));
+		wh->dst_switch_times[i] = sipe_cal_get_std_dst_time(year, wh->bias, &(wh->dst), &(wh->std));
+	}
+}
+
 static void
 sipe_cal_parse_std_dst(const sipe_xml *xn_std_dst_time,
 		       struct sipe_cal_std_dst *std_dst)
@@ -446,6 +528,64 @@ sipe_cal_parse_std_dst(const sipe_xml *xn_std_dst_time,
 	}
 }
 
+static void
+sipe_cal_std_dst_key(GString *key,
+		     const struct sipe_cal_std_dst *std_dst)
+{
+	g_string_append_printf(key, "|%d|%s|%d|%d|%s|%s",
+			       std_dst->bias,
+			       std_dst->time ? std_dst->time : "",
+			       std_dst->day_order,
+			       std_dst->month,
+			       std_dst->day_of_week ? std_dst->day_of_week : "",
+			       std_dst->year ? std_dst->year : "");
+}
+
+/**
+ * Replaces freshly parsed working hours with the pooled copy
+ *
+ * @return working hours from the pool with a new reference
+ */
+static struct sipe_cal_working_hours *
+sipe_cal_intern_working_hours(struct sipe_cal_working_hours *wh)
+{
+	GString *key = g_string_new("");
+	struct sipe_cal_working_hours *pooled;
+
+	g_string_append_printf(key, "%d|%s|%d|%d",
+			       wh->bias,
+			       wh->days_of_week ? wh->days_of_week : "",
+			       wh->start_time,
+			       wh->end_time);
+	sipe_cal_std_dst_key(key, &(wh->std));
+	sipe_cal_std_dst_key(key, &(wh->dst));
+
+	if (!working_hours_pool)
+		working_hours_pool = g_hash_table_new(g_str_hash, g_str_equal);
+
+	pooled = g_hash_table_lookup(working_hours_pool, key->str);
+	if (pooled) {
+		g_string_free(key, TRUE);
+		sipe_cal_destroy_working_hours(wh);
+	} else {
+		pooled      = wh;
+		pooled->key = g_string_free(key, FALSE);
+		sipe_cal_precompute_switch_times(pooled);
+		g_hash_table_insert(working_hours_pool, pooled->key, pooled);
+	}
+
+	pooled->ref_count++;
+	return(pooled);
+}
+
+static void
+sipe_cal_description_invalidate(struct sipe_buddy_extended *ext)
+{
+	g_free(ext->cal_description);
+	ext->cal_description       = NULL;
+	ext->cal_description_until = 0;
+}
+
 void
 sipe_cal_parse_working_hours(const sipe_xml *xn_working_hours,
 			     struct sipe_buddy *buddy)
@@ -456,9 +596,10 @@ sipe_cal_parse_working_hours(const sipe_xml *xn_working_hours,
 	const sipe_xml *xn_standard_time;
 	const sipe_xml *xn_daylight_time;
 	gchar *tmp;
-	time_t now = time(NULL);
 	struct sipe_cal_std_dst* std;
 	struct sipe_cal_std_dst* dst;
+	struct sipe_buddy_extended *ext;
+	struct sipe_cal_working_hours *wh;
 
 	if (!xn_working_hours) return;
 /*
@@ -476,66 +617,49 @@ sipe_cal_parse_working_hours(const sipe_xml *xn_working_hours,
   </WorkingPeriodArray>
 </WorkingHours>
 */
-	sipe_cal_free_working_hours(buddy->cal_working_hours);
-	buddy->cal_working_hours = g_new0(struct sipe_cal_working_hours, 1);
+	wh = g_new0(struct sipe_cal_working_hours, 1);
 
 	xn_timezone = sipe_xml_child(xn_working_hours, "TimeZone");
 	xn_bias = sipe_xml_child(xn_timezone, "Bias");
 	if (xn_bias) {
-		buddy->cal_working_hours->bias = atoi(tmp = sipe_xml_data(xn_bias));
+		wh->bias = atoi(tmp = sipe_xml_data(xn_bias));
 		g_free(tmp);
 	}
 
 	xn_standard_time = sipe_xml_child(xn_timezone, "StandardTime");
 	xn_daylight_time = sipe_xml_child(xn_timezone, "DaylightTime");
 
-	std = &((*buddy->cal_working_hours).std);
-	dst = &((*buddy->cal_working_hours).dst);
+	std = &(wh->std);
+	dst = &(wh->dst);
 	sipe_cal_parse_std_dst(xn_standard_time, std);
 	sipe_cal_parse_std_dst(xn_daylight_time, dst);
 
 	xn_working_period = sipe_xml_child(xn_working_hours, "WorkingPeriodArray/WorkingPeriod");
 	if (xn_working_period) {
 		/* NOTE: this can be NULL! */
-		buddy->cal_working_hours->days_of_week =
+		wh->days_of_week =
 			sipe_xml_data(sipe_xml_child(xn_working_period, "DayOfWeek"));
 
-		buddy->cal_working_hours->start_time =
+		wh->start_time =
 			atoi(tmp = sipe_xml_data(sipe_xml_child(xn_working_period, "StartTimeInMinutes")));
 		g_free(tmp);
 
-		buddy->cal_working_hours->end_time =
+		wh->end_time =
 			atoi(tmp = sipe_xml_data(sipe_xml_child(xn_working_period, "EndTimeInMinutes")));
 		g_free(tmp);
 	}
 
-	std->switch_time = sipe_cal_get_std_dst_time(now, buddy->cal_working_hours->bias, std, dst);
-	dst->switch_time = sipe_cal_get_std_dst_time(now, buddy->cal_working_hours->bias, dst, std);
-
-	/* TST8TDT7,M3.2.0/02:00:00,M11.1.0/02:00:00 */
-	buddy->cal_working_hours->tz =
-		g_strdup_printf("TST%dTDT%d,M%d.%d.%d/%s,M%d.%d.%d/%s",
-				(buddy->cal_working_hours->bias + buddy->cal_working_hours->std.bias) / 60,
-				(buddy->cal_working_hours->bias + buddy->cal_working_hours->dst.bias) / 60,
-
-				buddy->cal_working_hours->dst.month,
-				buddy->cal_working_hours->dst.day_order,
-				sipe_cal_get_wday(buddy->cal_working_hours->dst.day_of_week),
-				buddy->cal_working_hours->dst.time,
-
-				buddy->cal_working_hours->std.month,
-				buddy->cal_working_hours->std.day_order,
-				sipe_cal_get_wday(buddy->cal_working_hours->std.day_of_week),
-				buddy->cal_working_hours->std.time
-				);
-	/* TST8 */
-	buddy->cal_working_hours->tz_std =
-		g_strdup_printf("TST%d",
-				(buddy->cal_working_hours->bias + buddy->cal_working_hours->std.bias) / 60);
-	/* TDT7 */
-	buddy->cal_working_hours->tz_dst =
-		g_strdup_printf("TDT%d",
-				(buddy->cal_working_hours->bias + buddy->cal_working_hours->dst.bias) / 60);
+	wh = sipe_cal_intern_working_hours(wh);
+
+	ext = sipe_buddy_extended(buddy);
+	if (ext->cal_working_hours == wh) {
+		/* unchanged: calendar description is still valid */
+		sipe_cal_free_working_hours(wh);
+		return;
+	}
+	sipe_cal_description_invalidate(ext);
+	sipe_cal_free_working_hours(ext->cal_working_hours);
+	ext->cal_working_hours = wh;
 }
 
 struct sipe_cal_event*
@@ -572,8 +696,95 @@ sipe_cal_get_event(GSList *cal_events,
 	return res;
 }
 
+/* state of a slot in decoded free/busy data, see sipe_cal_set_free_busy() */
+#define FREE_BUSY_SLOT(fb, i) (((fb)[(i) >> 2] >> (((i) & 3) * 2)) & 0x03)
+
+/* byte/word with all slots set to state */
+#define FREE_BUSY_BYTE(state) ((guchar) ((state) * 0x55))
+#define FREE_BUSY_WORD(state) (FREE_BUSY_BYTE(state) * G_GUINT64_CONSTANT(0x0101010101010101))
+
+/**
+ * Returns index of first slot >= @c from which is not in @c state
+ * or @c slots if there is none.
+ *
+ * Runs of unchanged state are skipped 32 slots at a time.
+ */
+static guint
+sipe_cal_next_transition(const guchar *free_busy,
+			 guint slots,
+			 guint from,
+			 int state)
+{
+	guint64 word = FREE_BUSY_WORD(state);
+	guchar byte  = FREE_BUSY_BYTE(state);
+	guint bytes  = slots >> 2;
+	guint i      = from;
+	guint offset;
+
+	/* up to byte boundary */
+	for (; (i < slots) && (i & 3); i++)
+		if (FREE_BUSY_SLOT(free_busy, i) != state)
+			return(i);
+
+	offset = i >> 2;
+	while (offset + sizeof(word) <= bytes) {
+		guint64 tmp;
+		memcpy(&tmp, free_busy + offset, sizeof(tmp));
+		if (tmp != word)
+			break;
+		offset += sizeof(word);
+	}
+	while ((offset < bytes) && (free_busy[offset] == byte))
+		offset++;
+
+	for (i = offset << 2; i < slots; i++)
+		if (FREE_BUSY_SLOT(free_busy, i) != state)
+			return(i);
+
+	return(slots);
+}
+
+/**
+ * Returns index of last slot <= @c from which is not in @c state
+ * or -1 if there is none.
+ */
+static int
+sipe_cal_prev_transition(const guchar *free_busy,
+			 int from,
+			 int state)
+{
+	guint64 word = FREE_BUSY_WORD(state);
+	guchar byte  = FREE_BUSY_BYTE(state);
+	int i        = from;
+	guint offset;
+
+	/* down to byte boundary */
+	for (; (i >= 0) && ((i & 3) != 3); i--)
+		if (FREE_BUSY_SLOT(free_busy, i) != state)
+			return(i);
+
+	/* number of full bytes left */
+	offset = (i + 1) >> 2;
+	while (offset >= sizeof(word)) {
+		guint64 tmp;
+		memcpy(&tmp, free_busy + offset - sizeof(word), sizeof(tmp));
+		if (tmp != word)
+			break;
+		offset -= sizeof(word);
+	}
+	while ((offset > 0) && (free_busy[offset - 1] == byte))
+		offset--;
+
+	for (i = (offset << 2) - 1; i >= 0; i--)
+		if (FREE_BUSY_SLOT(free_busy, i) != state)
+			return(i);
+
+	return(-1);
+}
+
 static int
-sipe_cal_get_status0(const gchar *free_busy,
+sipe_cal_get_status0(const guchar *free_busy,
+		     guint slots,
 		     time_t cal_start,
 		     int granularity,
 		     time_t time_in_question,
@@ -581,7 +792,7 @@ sipe_cal_get_status0(const gchar *free_busy,
 {
 	int res = SIPE_CAL_NO_DATA;
 	int shift;
-	time_t cal_end = cal_start + strlen(free_busy)*granularity*60 - 1;
+	time_t cal_end = cal_start + slots*granularity*60 - 1;
 
 	if (!(time_in_question >= cal_start && time_in_question <= cal_end)) return res;
 
@@ -590,7 +801,7 @@ sipe_cal_get_status0(const gchar *free_busy,
 		*index = shift;
 	}
 
-	res = free_busy[shift] - '0';
+	res = FREE_BUSY_SLOT(free_busy, shift);
 
 	return res;
 }
@@ -599,7 +810,8 @@ sipe_cal_get_status0(const gchar *free_busy,
  * Returns time when current calendar state started
  */
 static time_t
-sipe_cal_get_since_time(const gchar *free_busy,
+sipe_cal_get_since_time(const guchar *free_busy,
+			guint slots,
 			time_t calStart,
 			int granularity,
 			int index,
@@ -607,56 +819,44 @@ sipe_cal_get_since_time(const gchar *free_busy,
 {
 	int i;
 
-	if ((index < 0) || ((size_t)(index + 1) > strlen(free_busy))) return 0;
-
-	for (i = index; i >= 0; i--) {
-		int temp_status = free_busy[i] - '0';
-
-		if (current_state != temp_status) {
-			return calStart + (i + 1)*granularity*60;
-		}
-
-		if (i == 0) return calStart;
-	}
+	if ((index < 0) || ((guint)(index + 1) > slots)) return 0;
 
-	return 0;
+	i = sipe_cal_prev_transition(free_busy, index, current_state);
+	return calStart + (i + 1)*granularity*60;
 }
-static char*
-sipe_cal_get_free_busy(struct sipe_buddy *buddy);
-
 int
 sipe_cal_get_status(struct sipe_buddy *buddy,
 		    time_t time_in_question,
 		    time_t *since)
 {
-	time_t cal_start;
-	const char* free_busy;
+	struct sipe_buddy_extended *ext = buddy ? buddy->ext : NULL;
 	int ret = SIPE_CAL_NO_DATA;
 	time_t state_since;
 	int index = -1;
 
-	if (!buddy || !buddy->cal_start_time || !buddy->cal_granularity) {
+	if (!ext || !ext->cal_start_time || !ext->cal_granularity) {
 		SIPE_DEBUG_INFO("sipe_cal_get_status: no calendar data1 for %s, exiting",
 				  buddy ? (buddy->name ? buddy->name : "") : "");
 		return SIPE_CAL_NO_DATA;
 	}
 
-	if (!(free_busy = sipe_cal_get_free_busy(buddy))) {
+	if (!ext->cal_free_busy) {
 		SIPE_DEBUG_INFO("sipe_cal_get_status: no calendar data2 for %s, exiting", buddy->name);
 		return SIPE_CAL_NO_DATA;
 	}
-	SIPE_DEBUG_INFO("sipe_cal_get_description: buddy->cal_free_busy=\n%s", free_busy);
-
-	cal_start = sipe_utils_str_to_time(buddy->cal_start_time);
+	SIPE_DEBUG_INFO("sipe_cal_get_status: %u free/busy slots for %s",
+			ext->cal_free_busy_slots, buddy->name);
 
-	ret = sipe_cal_get_status0(free_busy,
-				   cal_start,
-				   buddy->cal_granularity,
+	ret = sipe_cal_get_status0(ext->cal_free_busy,
+				   ext->cal_free_busy_slots,
+				   ext->cal_start_time,
+				   ext->cal_granularity,
 				   time_in_question,
 				   &index);
-	state_since = sipe_cal_get_since_time(free_busy,
-					      cal_start,
-					      buddy->cal_granularity,
+	state_since = sipe_cal_get_since_time(ext->cal_free_busy,
+					      ext->cal_free_busy_slots,
+					      ext->cal_start_time,
+					      ext->cal_granularity,
 					      index,
 					      ret);
 
@@ -664,47 +864,84 @@ sipe_cal_get_status(struct sipe_buddy *buddy,
 	return ret;
 }
 
+time_t
+sipe_cal_get_transition(struct sipe_buddy *buddy,
+			time_t time_in_question)
+{
+	struct sipe_buddy_extended *ext = buddy ? buddy->ext : NULL;
+	time_t granularity;
+	time_t cal_end;
+	guint index;
+
+	if (!ext || !ext->cal_start_time || !ext->cal_granularity ||
+	    !ext->cal_free_busy)
+		return 0;
+
+	granularity = ext->cal_granularity * 60;
+	cal_end = ext->cal_start_time + ext->cal_free_busy_slots * granularity;
+
+	if (time_in_question < ext->cal_start_time) return ext->cal_start_time;
+	if (time_in_question >= cal_end) return 0;
+
+	index = (time_in_question - ext->cal_start_time) / granularity;
+	index = sipe_cal_next_transition(ext->cal_free_busy,
+					 ext->cal_free_busy_slots,
+					 index + 1,
+					 FREE_BUSY_SLOT(ext->cal_free_busy, index));
+
+	/* index == slots: end of data */
+	return ext->cal_start_time + index * granularity;
+}
+
 static time_t
-sipe_cal_get_switch_time(const gchar *free_busy,
+sipe_cal_get_switch_time(const guchar *free_busy,
+			 guint slots,
 			 time_t calStart,
 			 int granularity,
 			 int index,
 			 int current_state,
 			 int *to_state)
 {
-	size_t i;
+	guint i;
 	time_t ret = TIME_NULL;
 
-	if ((index < 0) || ((size_t) (index + 1) > strlen(free_busy))) {
+	if ((index < 0) || ((guint) (index + 1) > slots)) {
 		*to_state = SIPE_CAL_NO_DATA;
 		return ret;
 	}
 
-	for (i = index + 1; i < strlen(free_busy); i++) {
-		int temp_status = free_busy[i] - '0';
-
-		if (current_state != temp_status) {
-			*to_state = temp_status;
-			return calStart + i*granularity*60;
-		}
+	i = sipe_cal_next_transition(free_busy, slots, index + 1, current_state);
+	if (i < slots) {
+		*to_state = FREE_BUSY_SLOT(free_busy, i);
+		ret = calStart + i*granularity*60;
 	}
 
 	return ret;
 }
 
-static const char*
-sipe_cal_get_tz(struct sipe_cal_working_hours *wh,
-                time_t time_in_question)
+/**
+ * Returns UTC offset in minutes, positive west of Greenwich,
+ * of the contact's timezone at the given time.
+ */
+static int
+sipe_cal_get_offset(const struct sipe_cal_working_hours *wh,
+		    time_t time_in_question)
 {
-	time_t dst_switch_time = (*wh).dst.switch_time;
-	time_t std_switch_time = (*wh).std.switch_time;
+	time_t dst_switch_time;
+	time_t std_switch_time;
 	gboolean is_dst = FALSE;
+	struct tm tm;
 
 	/* No daylight savings */
-	if (dst_switch_time == TIME_NULL) {
-		return wh->tz_std;
+	if (wh->dst.month == 0) {
+		return wh->bias + wh->std.bias;
 	}
 
+	/* switch times are looked up for the year in question */
+	sipe_cal_time_to_tm(time_in_question, &tm);
+	sipe_cal_get_switch_times(wh, tm.tm_year + 1900,
+				  &std_switch_time, &dst_switch_time);
+
 	if (dst_switch_time < std_switch_time) { /* North hemosphere - Europe, US */
 		if (time_in_question >= dst_switch_time && time_in_question < std_switch_time) {
 			is_dst = TRUE;
@@ -715,23 +952,19 @@ sipe_cal_get_tz(struct sipe_cal_working_hours *wh,
 		}
 	}
 
-	if (is_dst) {
-		return wh->tz_dst;
-	} else {
-		return wh->tz_std;
-	}
+	return wh->bias + (is_dst ? wh->dst.bias : wh->std.bias);
 }
 
 static time_t
 sipe_cal_mktime_of_day(struct tm *sample_today_tm,
 		       const int shift_minutes,
-		       const char *tz)
+		       int offset)
 {
 	sample_today_tm->tm_sec  = 0;
 	sample_today_tm->tm_min  = shift_minutes % 60;
 	sample_today_tm->tm_hour = shift_minutes / 60;
 
-	return sipe_mktime_tz(sample_today_tm, tz);
+	return sipe_mktime_utc(sample_today_tm) + offset * 60;
 }
 
 /**
@@ -740,14 +973,15 @@ sipe_cal_mktime_of_day(struct tm *sample_today_tm,
  * in contact's local time zone.
  */
 static void
-sipe_cal_get_today_work_hours(struct sipe_cal_working_hours *wh,
+sipe_cal_get_today_work_hours(const struct sipe_cal_working_hours *wh,
 			      time_t *start,
 			      time_t *end,
 			      time_t *next_start)
 {
 	time_t now = time(NULL);
-	const char *tz = sipe_cal_get_tz(wh, now);
-	struct tm *remote_now_tm = sipe_localtime_tz(&now, tz);
+	int offset = sipe_cal_get_offset(wh, now);
+	struct tm remote_now;
+	struct tm *remote_now_tm = sipe_cal_localtime(now, offset, &remote_now);
 
 	if (!(wh->days_of_week && strstr(wh->days_of_week, wday_names[remote_now_tm->tm_wday]))) {
 		/* not a work day */
@@ -757,21 +991,23 @@ sipe_cal_get_today_work_hours(struct sipe_cal_working_hours *wh,
 		return;
 	}
 
-	*end = sipe_cal_mktime_of_day(remote_now_tm, wh->end_time, tz);
+	*end = sipe_cal_mktime_of_day(remote_now_tm, wh->end_time, offset);
 
 	if (now < *end) {
-		*start = sipe_cal_mktime_of_day(remote_now_tm, wh->start_time, tz);
+		*start = sipe_cal_mktime_of_day(remote_now_tm, wh->start_time, offset);
 		*next_start = TIME_NULL;
 	} else { /* calculate start of tomorrow's work day if any */
 		time_t tom = now + 24*60*60;
-		struct tm *remote_tom_tm = sipe_localtime_tz(&tom, sipe_cal_get_tz(wh, tom));
+		int tom_offset = sipe_cal_get_offset(wh, tom);
+		struct tm remote_tom;
+		struct tm *remote_tom_tm = sipe_cal_localtime(tom, tom_offset, &remote_tom);
 
 		if (!(wh->days_of_week && strstr(wh->days_of_week, wday_names[remote_tom_tm->tm_wday]))) {
 			/* not a work day */
 			*next_start = TIME_NULL;
 		}
 
-		*next_start = sipe_cal_mktime_of_day(remote_tom_tm, wh->start_time, sipe_cal_get_tz(wh, tom));
+		*next_start = sipe_cal_mktime_of_day(remote_tom_tm, wh->start_time, tom_offset);
 		*start = TIME_NULL;
 	}
 }
@@ -817,20 +1053,30 @@ sipe_cal_get_until(const time_t now,
 	return ret;
 }
 
-static char*
-sipe_cal_get_free_busy(struct sipe_buddy *buddy)
+void
+sipe_cal_set_free_busy(struct sipe_buddy *buddy,
+		       const gchar *start_time,
+		       const gchar *granularity,
+		       const gchar *base64)
 {
-/* do lazy decode if necessary */
-	if (!buddy->cal_free_busy && buddy->cal_free_busy_base64) {
-		gsize cal_dec64_len;
-		guchar *cal_dec64;
-		gsize i;
-		int j = 0;
+	struct sipe_buddy_extended *ext = buddy->ext;
+	gsize length = 0;
 
-		cal_dec64 = g_base64_decode(buddy->cal_free_busy_base64, &cal_dec64_len);
+	/* nothing to clear */
+	if (!ext && !base64)
+		return;
+	ext = sipe_buddy_extended(buddy);
+	sipe_cal_description_invalidate(ext);
+
+	g_free(ext->cal_free_busy);
+	ext->cal_free_busy       = NULL;
+	ext->cal_free_busy_slots = 0;
+	ext->cal_start_time      = start_time ? sipe_utils_str_to_time(start_time) : 0;
+	ext->cal_granularity     = sipe_strcase_equal(granularity, "PT15M") ? 15 : 0;
 
-		buddy->cal_free_busy = g_malloc0(cal_dec64_len * 4 + 1);
 /*
+   The decoded data is kept as is, i.e. 4 slots per byte, LSB first:
+
    http://msdn.microsoft.com/en-us/library/dd941537%28office.13%29.aspx
 		00, Free (Fr)
 		01, Tentative (Te)
@@ -844,57 +1090,68 @@ sipe_cal_get_free_busy(struct sipe_buddy *buddy)
 		3  Out of Office (OOF)
 		4  No data
 */
-		for (i = 0; i < cal_dec64_len; i++) {
-#define TWO_BIT_MASK	0x03
-			char tmp = cal_dec64[i];
-			buddy->cal_free_busy[j++] = (tmp & TWO_BIT_MASK) + '0';
-			buddy->cal_free_busy[j++] = ((tmp >> 2) & TWO_BIT_MASK) + '0';
-			buddy->cal_free_busy[j++] = ((tmp >> 4) & TWO_BIT_MASK) + '0';
-			buddy->cal_free_busy[j++] = ((tmp >> 6) & TWO_BIT_MASK) + '0';
-		}
-		buddy->cal_free_busy[j++] = '\0';
-		g_free(cal_dec64);
+	if (!is_empty(base64))
+		ext->cal_free_busy = g_base64_decode(base64, &length);
+	if (length) {
+		ext->cal_free_busy_slots = length * 4;
+	} else {
+		g_free(ext->cal_free_busy);
+		ext->cal_free_busy = NULL;
 	}
-
-	return buddy->cal_free_busy;
 }
 
 char *
 sipe_cal_get_freebusy_base64(const char* freebusy_hex)
 {
-	guint i = 0;
-	guint j = 0;
-	guint shift_factor = 0;
-	guint len, res_len;
+	const gchar *p;
+	guint len, full, rest, i;
 	guchar *res;
 	gchar *res_base64;
 
 	if (!freebusy_hex) return NULL;
 
-	len = strlen(freebusy_hex);
-	res_len = len / 4 + 1;
-	res = g_malloc0(res_len);
-	while (i < len) {
-		res[j] |= (freebusy_hex[i++] - '0') << shift_factor;
-		shift_factor += 2;
-		if (shift_factor == 8) {
-			shift_factor = 0;
-			j++;
-		}
+	/* 4 states (2 bits each) per byte, first state in lowest bits */
+	len  = strlen(freebusy_hex);
+	full = len / 4;
+	rest = len % 4;
+	res  = g_malloc(full + 1);
+	for (i = 0, p = freebusy_hex; i < full; i++, p += 4)
+		res[i] = ((p[0] - '0')     ) |
+			 ((p[1] - '0') << 2) |
+			 ((p[2] - '0') << 4) |
+			 ((p[3] - '0') << 6);
+	if (rest) {
+		res[full] = 0;
+		for (i = 0; i < rest; i++)
+			res[full] |= (p[i] - '0') << (2 * i);
+		full++;
 	}
 
-	res_base64 = g_base64_encode(res, shift_factor ? res_len : res_len - 1);
+	res_base64 = g_base64_encode(res, full);
 	g_free(res);
 	return res_base64;
 }
 
-char *
-sipe_cal_get_description(struct sipe_buddy *buddy)
+/* earliest of current and candidate, if candidate is in the future */
+static time_t
+sipe_cal_min_future(time_t now,
+		    time_t current,
+		    time_t candidate)
+{
+	if (IS(candidate) && (candidate > now) &&
+	    (!IS(current) || (candidate < current)))
+		return candidate;
+	return current;
+}
+
+static char *
+sipe_cal_get_description0(struct sipe_buddy *buddy,
+			  time_t now,
+			  time_t *valid_until)
 {
 	time_t cal_start;
 	time_t cal_end;
 	int current_cal_state;
-	time_t now = time(NULL);
 	time_t start = TIME_NULL;
 	time_t end = TIME_NULL;
 	time_t next_start = TIME_NULL;
@@ -902,58 +1159,69 @@ sipe_cal_get_description(struct sipe_buddy *buddy)
 	int to_state = SIPE_CAL_NO_DATA;
 	time_t until = TIME_NULL;
 	int index = 0;
-	gboolean has_working_hours = (buddy->cal_working_hours != NULL);
-	const char *free_busy;
+	struct sipe_buddy_extended *ext = buddy->ext;
+	struct sipe_cal_working_hours *wh;
+	gboolean has_working_hours;
 	const char *cal_states[] = {_("Free"),
 				    _("Tentative"),
 				    _("Busy"),
 				    _("Out of office"),
 				    _("No data")};
 
-	if (buddy->cal_granularity != 15) {
-		SIPE_DEBUG_INFO("sipe_cal_get_description: granularity %d is unsupported, exiting.", buddy->cal_granularity);
+	if (!ext || ext->cal_granularity != 15) {
+		SIPE_DEBUG_INFO("sipe_cal_get_description: granularity %d is unsupported, exiting.",
+				ext ? ext->cal_granularity : 0);
 		return NULL;
 	}
 
-	/* to lazy load if needed */
-	free_busy = sipe_cal_get_free_busy(buddy);
-	SIPE_DEBUG_INFO("sipe_cal_get_description: buddy->cal_free_busy=\n%s", free_busy ? free_busy : "");
+	SIPE_DEBUG_INFO("sipe_cal_get_description: %u free/busy slots",
+			ext->cal_free_busy_slots);
 
-	if (!buddy->cal_free_busy || !buddy->cal_granularity || !buddy->cal_start_time) {
+	if (!ext->cal_free_busy || !ext->cal_start_time) {
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_cal_get_description: no calendar data, exiting");
 		return NULL;
 	}
 
-	cal_start = sipe_utils_str_to_time(buddy->cal_start_time);
-	cal_end = cal_start + 60 * (buddy->cal_granularity) * strlen(buddy->cal_free_busy);
+	wh = ext->cal_working_hours;
+	has_working_hours = (wh != NULL);
+	cal_start = ext->cal_start_time;
+	cal_end = cal_start + 60 * (ext->cal_granularity) * ext->cal_free_busy_slots;
 
-	current_cal_state = sipe_cal_get_status0(free_busy, cal_start, buddy->cal_granularity, time(NULL), &index);
+	current_cal_state = sipe_cal_get_status0(ext->cal_free_busy, ext->cal_free_busy_slots, cal_start, ext->cal_granularity, now, &index);
 	if (current_cal_state == SIPE_CAL_NO_DATA) {
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_cal_get_description: calendar is undefined for present moment, exiting.");
 		return NULL;
 	}
 
-	switch_time = sipe_cal_get_switch_time(free_busy, cal_start, buddy->cal_granularity, index, current_cal_state, &to_state);
+	switch_time = sipe_cal_get_switch_time(ext->cal_free_busy, ext->cal_free_busy_slots, cal_start, ext->cal_granularity, index, current_cal_state, &to_state);
 
 	SIPE_DEBUG_INFO_NOFORMAT("\n* Calendar *");
-	if (buddy->cal_working_hours) {
-		sipe_cal_get_today_work_hours(buddy->cal_working_hours, &start, &end, &next_start);
+	if (wh) {
+		struct tm remote_tm;
+		time_t std_switch_time;
+		time_t dst_switch_time;
+
+		sipe_cal_get_today_work_hours(wh, &start, &end, &next_start);
 
-		SIPE_DEBUG_INFO("Remote now timezone : %s", sipe_cal_get_tz(buddy->cal_working_hours, now));
+		sipe_cal_time_to_tm(now, &remote_tm);
+		sipe_cal_get_switch_times(wh, remote_tm.tm_year + 1900,
+					  &std_switch_time, &dst_switch_time);
+
+		SIPE_DEBUG_INFO("Remote now UTC bias : %d min", sipe_cal_get_offset(wh, now));
 		SIPE_DEBUG_INFO("std.switch_time(GMT): %s",
-				IS((*buddy->cal_working_hours).std.switch_time) ? sipe_utils_time_to_debug_str(gmtime(&((*buddy->cal_working_hours).std.switch_time))) : "");
+				IS(std_switch_time) ? sipe_utils_time_to_debug_str(gmtime(&std_switch_time)) : "");
 		SIPE_DEBUG_INFO("dst.switch_time(GMT): %s",
-				IS((*buddy->cal_working_hours).dst.switch_time) ? sipe_utils_time_to_debug_str(gmtime(&((*buddy->cal_working_hours).dst.switch_time))) : "");
+				IS(dst_switch_time) ? sipe_utils_time_to_debug_str(gmtime(&dst_switch_time)) : "");
 		SIPE_DEBUG_INFO("Remote now time     : %s",
-			sipe_utils_time_to_debug_str(sipe_localtime_tz(&now, sipe_cal_get_tz(buddy->cal_working_hours, now))));
+			sipe_utils_time_to_debug_str(sipe_cal_localtime(now, sipe_cal_get_offset(wh, now), &remote_tm)));
 		SIPE_DEBUG_INFO("Remote start time   : %s",
-			IS(start) ? sipe_utils_time_to_debug_str(sipe_localtime_tz(&start, sipe_cal_get_tz(buddy->cal_working_hours, start))) : "");
+			IS(start) ? sipe_utils_time_to_debug_str(sipe_cal_localtime(start, sipe_cal_get_offset(wh, start), &remote_tm)) : "");
 		SIPE_DEBUG_INFO("Remote end time     : %s",
-			IS(end) ? sipe_utils_time_to_debug_str(sipe_localtime_tz(&end, sipe_cal_get_tz(buddy->cal_working_hours, end))) : "");
+			IS(end) ? sipe_utils_time_to_debug_str(sipe_cal_localtime(end, sipe_cal_get_offset(wh, end), &remote_tm)) : "");
 		SIPE_DEBUG_INFO("Rem. next_start time: %s",
-			IS(next_start) ? sipe_utils_time_to_debug_str(sipe_localtime_tz(&next_start, sipe_cal_get_tz(buddy->cal_working_hours, next_start))) : "");
+			IS(next_start) ? sipe_utils_time_to_debug_str(sipe_cal_localtime(next_start, sipe_cal_get_offset(wh, next_start), &remote_tm)) : "");
 		SIPE_DEBUG_INFO("Remote switch time  : %s",
-			IS(switch_time) ? sipe_utils_time_to_debug_str(sipe_localtime_tz(&switch_time, sipe_cal_get_tz(buddy->cal_working_hours, switch_time))) : "");
+			IS(switch_time) ? sipe_utils_time_to_debug_str(sipe_cal_localtime(switch_time, sipe_cal_get_offset(wh, switch_time), &remote_tm)) : "");
 	} else {
 		SIPE_DEBUG_INFO("Local now time      : %s",
 			sipe_utils_time_to_debug_str(localtime(&now)));
@@ -1015,6 +1283,15 @@ sipe_cal_get_description(struct sipe_buddy *buddy)
 	if (!IS(until) && (cal_end - now > 8*60*60))
 		until = cal_end;
 
+	/* text below stays the same until one of these is reached */
+	*valid_until = sipe_cal_min_future(now, TIME_NULL, switch_time);
+	*valid_until = sipe_cal_min_future(now, *valid_until, start);
+	*valid_until = sipe_cal_min_future(now, *valid_until, end);
+	*valid_until = sipe_cal_min_future(now, *valid_until, next_start);
+	*valid_until = sipe_cal_min_future(now, *valid_until, cal_end);
+	if (IS(until))
+		*valid_until = sipe_cal_min_future(now, *valid_until, until - 8*60*60);
+
 	if (!IS(until)) {
 		return g_strdup_printf(_("Currently %s"), cal_states[current_cal_state]);
 	}
@@ -1058,12 +1335,72 @@ sipe_cal_get_description(struct sipe_buddy *buddy)
 	/* End of - Calendar: string calculations */
 }
 
+char *
+sipe_cal_get_description(struct sipe_buddy *buddy)
+{
+	struct sipe_buddy_extended *ext = buddy->ext;
+	time_t now = time(NULL);
+	time_t valid_until = TIME_NULL;
+	char *description;
+
+	/* rendered text is valid until the next calendar transition */
+	if (ext && ext->cal_description &&
+	    (!IS(ext->cal_description_until) ||
+	     (now < ext->cal_description_until)))
+		return g_strdup(ext->cal_description);
+
+	description = sipe_cal_get_description0(buddy, now, &valid_until);
+	if (ext) {
+		g_free(ext->cal_description);
+		ext->cal_description       = g_strdup(description);
+		ext->cal_description_until = valid_until;
+	}
+	return description;
+}
+
+#define CALENDAR_TRANSITION_ACTION "<+cal-transition>"
+
+static void sipe_cal_transition_cb(struct sipe_core_private *sipe_private,
+				   gpointer uri)
+{
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private, uri);
+
+	if (buddy) {
+		SIPE_DEBUG_INFO("sipe_cal_transition_cb: %s", (gchar *) uri);
+		sipe_backend_buddy_refresh_properties(SIPE_CORE_PUBLIC, uri);
+		sipe_cal_schedule_transition(sipe_private, buddy);
+	}
+}
+
+void sipe_cal_schedule_transition(struct sipe_core_private *sipe_private,
+				  struct sipe_buddy *buddy)
+{
+	time_t now = time(NULL);
+	time_t next = sipe_cal_get_transition(buddy, now);
+	gchar *action = g_strdup_printf(CALENDAR_TRANSITION_ACTION "<%s>",
+					buddy->name);
+
+	if (next) {
+		sipe_schedule_seconds(sipe_private,
+				      action,
+				      g_strdup(buddy->name),
+				      next - now,
+				      sipe_cal_transition_cb,
+				      g_free);
+	} else {
+		sipe_schedule_cancel(sipe_private, action);
+	}
+	g_free(action);
+}
+
 #define UPDATE_CALENDAR_INTERVAL (15*60) /* 15 min, default granularity for Exchange */
 #define UPDATE_CALENDAR_OFFSET       30  /* 30 seconds before next interval starts */
+/* changes are pushed: polling only for OOF & free/busy period */
+#define UPDATE_CALENDAR_STREAMING_INTERVAL (4*UPDATE_CALENDAR_INTERVAL)
 
 void sipe_core_update_calendar(struct sipe_core_public *sipe_public)
 {
-	time_t now, offset;
+	time_t now, offset, interval;
 
 	SIPE_DEBUG_INFO_NOFORMAT("sipe_core_update_calendar: started.");
 
@@ -1077,13 +1414,17 @@ void sipe_core_update_calendar(struct sipe_core_public *sipe_public)
 	sipe_domino_update_calendar(SIPE_CORE_PRIVATE);
 #endif
 
+	interval = sipe_ews_streaming(SIPE_CORE_PRIVATE) ?
+		UPDATE_CALENDAR_STREAMING_INTERVAL :
+		UPDATE_CALENDAR_INTERVAL;
+
 	/* how long, in seconds, until the next calendar interval starts? */
 	now    = time(NULL);
-	offset = (now / UPDATE_CALENDAR_INTERVAL + 1) * UPDATE_CALENDAR_INTERVAL - now;
+	offset = (now / interval + 1) * interval - now;
 
 	/* ensure that the update after the initial one is not too soon */
-	if (offset <= (UPDATE_CALENDAR_INTERVAL / 2))
-		offset += UPDATE_CALENDAR_INTERVAL;
+	if (offset <= (interval / 2))
+		offset += interval;
 
 	/* schedule next update before a new calendar interval starts */
 	sipe_schedule_seconds(SIPE_CORE_PRIVATE,
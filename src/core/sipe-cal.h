@@ -24,6 +24,7 @@
 /* Forward declarations */
 struct sipe_buddy;
 struct sipe_core_private;
+struct sipe_ews_notify;
 struct sipe_http_request;
 struct sipe_http_session;
 struct _sipe_xml;
@@ -78,12 +79,18 @@ struct sipe_calendar {
 
 	struct sipe_http_session *session;
 	struct sipe_http_request *request;
+	struct sipe_ews_notify *stream; /* NULL unless EWS notifications are used */
 
 	time_t fb_start;
 	/* hex form */
 	char *free_busy;
 	char *working_hours_xml_str;
 	GSList *cal_events;
+	/* digest of last processed free/busy data */
+	char *fb_hash;
+	/* Lotus Domino: validators of last processed calendar view */
+	char *domino_last_modified;
+	char *domino_hash;
 };
 
 void
@@ -114,15 +121,12 @@ sipe_cal_event_debug(const struct sipe_cal_event *cal_event,
 		     const gchar *label);
 
 /**
- * Converts struct tm to Epoch time_t considering timezone.
+ * Converts struct tm in UTC to Epoch time_t.
  *
- * @param tz as defined for TZ environment variable.
- *
- * Reference: see timegm(3) - Linux man page
+ * Portable replacement for timegm(3). Doesn't touch the TZ environment.
  */
 time_t
-sipe_mktime_tz(struct tm *tm,
-	       const char* tz);
+sipe_mktime_utc(struct tm *tm);
 
 /**
  * Converts hex representation of freebusy string as
@@ -139,14 +143,30 @@ struct sipe_cal_working_hours;
 
 /**
  * Parses Working Hours from passed XML piece
- * and creates/fills struct sipe_cal_working_hours in struct sipe_buddy
+ * and sets shared struct sipe_cal_working_hours in struct sipe_buddy
  */
 void
 sipe_cal_parse_working_hours(const struct _sipe_xml *xn_working_hours,
 			     struct sipe_buddy *buddy);
 
 /**
- * Frees struct sipe_cal_working_hours
+ * Decodes and stores free/busy data for a buddy
+ *
+ * @param buddy       buddy
+ * @param start_time  start time of the data (ISO 8601, may be @c NULL)
+ * @param granularity granularity of the data, e.g. "PT15M" (may be @c NULL)
+ * @param base64      base64 encoded free/busy data (may be @c NULL)
+ *
+ * All parameters @c NULL clears the free/busy data.
+ */
+void
+sipe_cal_set_free_busy(struct sipe_buddy *buddy,
+		       const gchar *start_time,
+		       const gchar *granularity,
+		       const gchar *base64);
+
+/**
+ * Releases reference to shared struct sipe_cal_working_hours
  */
 void
 sipe_cal_free_working_hours(struct sipe_cal_working_hours *wh);
@@ -154,6 +174,8 @@ sipe_cal_free_working_hours(struct sipe_cal_working_hours *wh);
 /**
  * Returns user calendar information in text form.
  * Example: "Currently Busy. Free at 13:00"
+ *
+ * The text is cached per buddy until it changes.
  */
 char *
 sipe_cal_get_description(struct sipe_buddy *buddy);
@@ -169,6 +191,25 @@ sipe_cal_get_status(struct sipe_buddy *buddy,
 		    time_t time_in_question,
 		    time_t *since);
 
+/**
+ * Returns time of the next calendar status change after time specified,
+ * including the start and the end of the calendar data.
+ * Returns 0 if there is no further change.
+ */
+time_t
+sipe_cal_get_transition(struct sipe_buddy *buddy,
+			time_t time_in_question);
+
+/**
+ * Refreshes buddy properties at the next calendar status change.
+ * Each buddy has at most one pending action.
+ *
+ * @param sipe_private SIPE core private data
+ * @param buddy        buddy
+ */
+void sipe_cal_schedule_transition(struct sipe_core_private *sipe_private,
+				  struct sipe_buddy *buddy);
+
 /**
  * Returns calendar event at time in question.
  * If conflict, takes last event in the following
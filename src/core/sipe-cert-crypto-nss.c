@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-2012 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2016 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -28,6 +28,8 @@
 #include "config.h"
 #endif
 
+#include <string.h>
+
 #include <glib.h>
 
 #ifdef HAVE_VALGRIND
@@ -82,7 +84,7 @@ struct certificate_nss {
 	gsize length;
 };
 
-struct sipe_cert_crypto *sipe_cert_crypto_init(void)
+struct sipe_cert_crypto *sipe_cert_crypto_generate(void)
 {
 	PK11SlotInfo *slot = PK11_GetInternalKeySlot();
 
@@ -101,16 +103,13 @@ struct sipe_cert_crypto *sipe_cert_crypto_init(void)
 		 *
 		 * Let's reduce the key size when we detect valgrind.
 		 */
-		if (RUNNING_ON_VALGRIND) {
+		if (RUNNING_ON_VALGRIND)
 			rsaParams.keySizeInBits = 1024;
-			SIPE_DEBUG_INFO("sipe_cert_crypto_init: running on valgrind, reducing RSA key size to %d bits",
-					rsaParams.keySizeInBits);
-		} else
+		else
 #endif
 			rsaParams.keySizeInBits = 2048;
 		rsaParams.pe                    = 65537;
 
-		SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: generate key pair, this might take a while...");
 		scc->private = PK11_GenerateKeyPair(slot,
 						    CKM_RSA_PKCS_KEY_PAIR_GEN,
 						    &rsaParams,
@@ -118,20 +117,36 @@ struct sipe_cert_crypto *sipe_cert_crypto_init(void)
 						    PR_FALSE, /* not permanent */
 						    PR_TRUE,  /* sensitive */
 						    NULL);
-		if (scc->private) {
-			SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: key pair generated");
-			PK11_FreeSlot(slot);
+		PK11_FreeSlot(slot);
+
+		if (scc->private)
 			return(scc);
-		}
 
-		SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_init: key generation failed");
 		g_free(scc);
-		PK11_FreeSlot(slot);
 	}
 
 	return(NULL);
 }
 
+struct sipe_cert_crypto *sipe_cert_crypto_init(void)
+{
+	struct sipe_cert_crypto *scc;
+
+#ifdef HAVE_VALGRIND
+	if (RUNNING_ON_VALGRIND)
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: running on valgrind, reducing RSA key size to 1024 bits");
+#endif
+	SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: generate key pair, this might take a while...");
+	scc = sipe_cert_crypto_generate();
+
+	if (scc)
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: key pair generated");
+	else
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_init: key generation failed");
+
+	return(scc);
+}
+
 void sipe_cert_crypto_free(struct sipe_cert_crypto *scc)
 {
 	if (scc) {
@@ -143,6 +158,162 @@ void sipe_cert_crypto_free(struct sipe_cert_crypto *scc)
 	}
 }
 
+/*
+ * The private key can only be exported in encrypted form. The result is
+ * stored encrypted anyway, so a fixed password is sufficient here.
+ */
+#define SIPE_CERT_CRYPTO_EXPORT_PASSWORD "SIPE TLS-DSK"
+
+static void export_password(SECItem *pwitem)
+{
+	pwitem->type = siBuffer;
+	pwitem->data = (unsigned char *) SIPE_CERT_CRYPTO_EXPORT_PASSWORD;
+	pwitem->len  = sizeof(SIPE_CERT_CRYPTO_EXPORT_PASSWORD) - 1;
+}
+
+/* key pair as "<Base64 SubjectPublicKeyInfo>:<Base64 EncryptedPrivateKeyInfo>" */
+gchar *sipe_cert_crypto_export(struct sipe_cert_crypto *scc)
+{
+	PK11SlotInfo *slot;
+	gchar *result = NULL;
+
+	if (!scc)
+		return(NULL);
+
+	slot = PK11_GetInternalKeySlot();
+	if (slot) {
+		SECItem pwitem;
+		SECKEYEncryptedPrivateKeyInfo *epki;
+
+		export_password(&pwitem);
+		epki = PK11_ExportEncryptedPrivKeyInfo(slot,
+						       SEC_OID_PKCS12_V2_PBE_WITH_SHA1_AND_3KEY_TRIPLE_DES_CBC,
+						       &pwitem,
+						       scc->private,
+						       1,
+						       NULL);
+		if (epki) {
+			SECItem *private = SEC_ASN1EncodeItem(NULL,
+							      NULL,
+							      epki,
+							      SEC_ASN1_GET(SECKEY_EncryptedPrivateKeyInfoTemplate));
+			SECItem *public  = SECKEY_EncodeDERSubjectPublicKeyInfo(scc->public);
+
+			if (private && public) {
+				gchar *b64_private = g_base64_encode(private->data,
+								     private->len);
+				gchar *b64_public  = g_base64_encode(public->data,
+								     public->len);
+				result = g_strdup_printf("%s:%s",
+							 b64_public,
+							 b64_private);
+				g_free(b64_public);
+				g_free(b64_private);
+			} else {
+				SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_export: can't ASN.1 encode key pair");
+			}
+
+			if (public)
+				SECITEM_FreeItem(public, PR_TRUE);
+			if (private)
+				SECITEM_FreeItem(private, PR_TRUE);
+			SECKEY_DestroyEncryptedPrivateKeyInfo(epki, PR_TRUE);
+		} else {
+			SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_export: can't export private key");
+		}
+
+		PK11_FreeSlot(slot);
+	}
+
+	return(result);
+}
+
+struct sipe_cert_crypto *sipe_cert_crypto_import_key(const gchar *base64)
+{
+	struct sipe_cert_crypto *scc = NULL;
+	SECKEYPublicKey *public      = NULL;
+	gchar **parts                = g_strsplit(base64, ":", 2);
+	PRArenaPool *arena;
+
+	if (!parts[0] || !parts[1]) {
+		g_strfreev(parts);
+		return(NULL);
+	}
+
+	/* public key */
+	{
+		SECItem item;
+		gsize length;
+		CERTSubjectPublicKeyInfo *spki;
+
+		item.type = siBuffer;
+		item.data = g_base64_decode(parts[0], &length);
+		item.len  = length;
+		spki = SECKEY_DecodeDERSubjectPublicKeyInfo(&item);
+		if (spki) {
+			public = SECKEY_ExtractPublicKey(spki);
+			SECKEY_DestroySubjectPublicKeyInfo(spki);
+		}
+		g_free(item.data);
+	}
+
+	/* private key */
+	arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+	if (public && arena) {
+		SECItem item;
+		gsize length;
+		SECKEYEncryptedPrivateKeyInfo epki;
+		PK11SlotInfo *slot = PK11_GetInternalKeySlot();
+
+		item.type = siBuffer;
+		item.data = g_base64_decode(parts[1], &length);
+		item.len  = length;
+		memset(&epki, 0, sizeof(epki));
+
+		if (slot &&
+		    (SEC_QuickDERDecodeItem(arena,
+					    &epki,
+					    SEC_ASN1_GET(SECKEY_EncryptedPrivateKeyInfoTemplate),
+					    &item) == SECSuccess)) {
+			SECItem pwitem;
+			SECKEYPrivateKey *private = NULL;
+
+			export_password(&pwitem);
+			if (PK11_ImportEncryptedPrivateKeyInfoAndReturnKey(slot,
+									   &epki,
+									   &pwitem,
+									   NULL,
+									   &public->u.rsa.modulus,
+									   PR_FALSE, /* not permanent */
+									   PR_TRUE,  /* sensitive */
+									   rsaKey,
+									   KU_ALL,
+									   &private,
+									   NULL) == SECSuccess) {
+				scc = g_new0(struct sipe_cert_crypto, 1);
+				scc->private = private;
+				scc->public  = public;
+				public       = NULL;
+			}
+		}
+
+		if (slot)
+			PK11_FreeSlot(slot);
+		g_free(item.data);
+	}
+
+	if (!scc)
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_import_key: can't decode key pair");
+
+	if (arena)
+		PORT_FreeArena(arena, PR_FALSE);
+	if (public)
+		SECKEY_DestroyPublicKey(public);
+	g_strfreev(parts);
+
+	return(scc);
+}
+
 static gchar *sign_cert_or_certreq(CERTCertificate *cert,
 				   CERTCertificateRequest *certreq,
 				   SECKEYPrivateKey *private)
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2013-2016 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -28,6 +28,7 @@
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
 
+#include <string.h>
 #include <time.h>
 
 #include <glib.h>
@@ -64,24 +65,35 @@ struct certificate_openssl {
 	gsize length;
 };
 
-struct sipe_cert_crypto *sipe_cert_crypto_init(void)
+struct sipe_cert_crypto *sipe_cert_crypto_generate(void)
 {
 	struct sipe_cert_crypto *scc = g_new0(struct sipe_cert_crypto, 1);
 
 	/* RSA parameters - should those be configurable? */
-	SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: generate key pair, this might take a while...");
 	scc->key = RSA_generate_key(2048, 65537, NULL, NULL);
 
-	if (scc->key) {
-		SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: key pair generated");
+	if (scc->key)
 		return(scc);
-	}
 
-	SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_init: key generation failed");
 	g_free(scc);
 	return(NULL);
 }
 
+struct sipe_cert_crypto *sipe_cert_crypto_init(void)
+{
+	struct sipe_cert_crypto *scc;
+
+	SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: generate key pair, this might take a while...");
+	scc = sipe_cert_crypto_generate();
+
+	if (scc)
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_cert_crypto_init: key pair generated");
+	else
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_init: key generation failed");
+
+	return(scc);
+}
+
 void sipe_cert_crypto_free(struct sipe_cert_crypto *scc)
 {
 	if (scc) {
@@ -91,6 +103,52 @@ void sipe_cert_crypto_free(struct sipe_cert_crypto *scc)
 	}
 }
 
+/* key pair as Base64 encoded PKCS#1 RSAPrivateKey */
+gchar *sipe_cert_crypto_export(struct sipe_cert_crypto *scc)
+{
+	gchar *base64 = NULL;
+	int length;
+
+	if (!scc)
+		return(NULL);
+
+	length = i2d_RSAPrivateKey(scc->key, NULL);
+	if (length > 0) {
+		guchar *buf = g_malloc(length);
+		/* NOTE: i2d_RSAPrivateKey(a, b) autoincrements b! */
+		guchar *tmp = buf;
+
+		i2d_RSAPrivateKey(scc->key, &tmp);
+		base64 = g_base64_encode(buf, length);
+		memset(buf, 0, length);
+		g_free(buf);
+	}
+
+	return(base64);
+}
+
+struct sipe_cert_crypto *sipe_cert_crypto_import_key(const gchar *base64)
+{
+	struct sipe_cert_crypto *scc = NULL;
+	gsize length;
+	guchar *der = g_base64_decode(base64, &length);
+	/* NOTE: d2i_RSAPrivateKey(NULL, &in, len) autoincrements "in" */
+	const guchar *tmp = der;
+	RSA *key = d2i_RSAPrivateKey(NULL, &tmp, length);
+
+	if (key) {
+		scc = g_new0(struct sipe_cert_crypto, 1);
+		scc->key = key;
+	} else {
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_cert_crypto_import_key: can't decode key pair");
+	}
+
+	memset(der, 0, length);
+	g_free(der);
+
+	return(scc);
+}
+
 
 gchar *sipe_cert_crypto_request(struct sipe_cert_crypto *scc,
 				const gchar *subject)
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-12 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-16 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -36,12 +36,22 @@
 struct sipe_cert_crypto;
 
 /**
- * Free certificate crypto backend data
+ * Create certificate crypto backend data with a new key pair
  *
  * @return opaque pointer to backend private data
  */
 struct sipe_cert_crypto *sipe_cert_crypto_init(void);
 
+/**
+ * Same as @sipe_cert_crypto_init() but without debug output
+ *
+ * Key pair generation takes a long time. This function doesn't call into
+ * the backend, i.e. it can be called from a worker thread.
+ *
+ * @return opaque pointer to backend private data or @c NULL
+ */
+struct sipe_cert_crypto *sipe_cert_crypto_generate(void);
+
 /**
  * Free certificate crypto backend data
  *
@@ -49,6 +59,26 @@ struct sipe_cert_crypto *sipe_cert_crypto_init(void);
  */
 void sipe_cert_crypto_free(struct sipe_cert_crypto *scc);
 
+/**
+ * Export key pair as Base64 encoded string
+ *
+ * The string contains the private key and must be protected accordingly.
+ *
+ * @param scc opaque pointer to backend private data
+ *
+ * @return Base64 encoded string. Must be @g_free'd()
+ */
+gchar *sipe_cert_crypto_export(struct sipe_cert_crypto *scc);
+
+/**
+ * Import key pair from string created by @sipe_cert_crypto_export()
+ *
+ * @param base64 Base64 encoded string
+ *
+ * @return opaque pointer to backend private data. Must be @sipe_cert_crypto_free()'d.
+ */
+struct sipe_cert_crypto *sipe_cert_crypto_import_key(const gchar *base64);
+
 /**
  * Create a certificate request as Base64 encoded string
  *
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-12 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-16 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -44,25 +44,54 @@
 #include "sipe-core-private.h"
 #include "sipe-certificate.h"
 #include "sipe-cert-crypto.h"
+#include "sipe-job.h"
 #include "sipe-nls.h"
 #include "sipe-svc.h"
+#include "sipe-token-store.h"
 #include "sipe-webticket.h"
 #include "sipe-xml.h"
 
+/* certificate must still be valid for another hour */
+#define CERTIFICATE_VALIDITY (60 * 60)
+
+/*
+ * Certificate cache (encrypted by the token store)
+ *
+ *   [key]
+ *   pair=<key pair exported by crypto backend>
+ *
+ *   [certificate <n>]
+ *   target=<target name>
+ *   data=<Base64 DER>
+ */
+#define CERTIFICATE_CACHE_FILE      "certificates"
+#define CERTIFICATE_CACHE_KEY_GROUP "key"
+
 struct sipe_certificate {
 	GHashTable *certificates;
 	struct sipe_cert_crypto *backend;
+	/* key pair generation takes several seconds */
+	struct sipe_job *job;
+	/* certificate requests waiting for the key pair */
+	GSList *pending;
 };
 
 struct certificate_callback_data {
 	gchar *target;
 	struct sipe_svc_session *session;
+	/* Web Ticket for certificate request */
+	gchar *base_uri;
+	gchar *auth_uri;
+	gchar *wsse_security;
 };
 
 static void callback_data_free(struct certificate_callback_data *ccd)
 {
 	if (ccd) {
 		sipe_svc_session_close(ccd->session);
+		g_free(ccd->wsse_security);
+		g_free(ccd->auth_uri);
+		g_free(ccd->base_uri);
 		g_free(ccd->target);
 		g_free(ccd);
 	}
@@ -73,35 +102,213 @@ void sipe_certificate_free(struct sipe_core_private *sipe_private)
 	struct sipe_certificate *sc = sipe_private->certificate;
 
 	if (sc) {
+		/* worker thread result will be discarded */
+		sipe_job_cancel(sc->job);
+		g_slist_free_full(sc->pending,
+				  (GDestroyNotify) callback_data_free);
 		g_hash_table_destroy(sc->certificates);
 		sipe_cert_crypto_free(sc->backend);
 		g_free(sc);
 	}
 }
 
+static void add_certificate(struct sipe_core_private *sipe_private,
+			    const gchar *target,
+			    gpointer certificate)
+{
+	struct sipe_certificate *sc = sipe_private->certificate;
+	g_hash_table_insert(sc->certificates, g_strdup(target), certificate);
+}
+
+static gboolean certificate_cache_load(struct sipe_core_private *sipe_private)
+{
+	struct sipe_certificate *sc = sipe_private->certificate;
+	GKeyFile *cache;
+	gsize length;
+	gchar *data = sipe_token_store_read_secure(sipe_private,
+						   CERTIFICATE_CACHE_FILE,
+						   &length);
+
+	if (!data)
+		return(FALSE);
+
+	cache = g_key_file_new();
+	if (g_key_file_load_from_data(cache, data, length, G_KEY_FILE_NONE, NULL)) {
+		gchar *pair = g_key_file_get_string(cache,
+						    CERTIFICATE_CACHE_KEY_GROUP,
+						    "pair",
+						    NULL);
+
+		if (pair) {
+			sc->backend = sipe_cert_crypto_import_key(pair);
+			memset(pair, 0, strlen(pair));
+			g_free(pair);
+		}
+
+		if (sc->backend) {
+			gchar **groups = g_key_file_get_groups(cache, NULL);
+			gchar **group;
+
+			SIPE_DEBUG_INFO_NOFORMAT("certificate_cache_load: restored key pair");
+
+			for (group = groups; *group; group++) {
+				gchar *target = g_key_file_get_string(cache,
+								      *group,
+								      "target",
+								      NULL);
+				gchar *base64 = g_key_file_get_string(cache,
+								      *group,
+								      "data",
+								      NULL);
+
+				if (target && base64) {
+					gpointer certificate = sipe_cert_crypto_decode(sc->backend,
+										       base64);
+					if (sipe_cert_crypto_valid(certificate,
+								   CERTIFICATE_VALIDITY)) {
+						SIPE_DEBUG_INFO("certificate_cache_load: restored certificate for target '%s'",
+								target);
+						add_certificate(sipe_private,
+								target,
+								certificate);
+					} else {
+						sipe_cert_crypto_destroy(certificate);
+					}
+				}
+
+				g_free(base64);
+				g_free(target);
+			}
+			g_strfreev(groups);
+		}
+	}
+	g_key_file_free(cache);
+
+	memset(data, 0, length);
+	g_free(data);
+
+	return(sc->backend != NULL);
+}
+
+static void certificate_cache_save(struct sipe_core_private *sipe_private)
+{
+	struct sipe_certificate *sc = sipe_private->certificate;
+	gchar *pair = sipe_cert_crypto_export(sc->backend);
+	GKeyFile *cache;
+	GHashTableIter iter;
+	gpointer key, value;
+	guint count = 0;
+	gchar *data;
+	gsize length;
+
+	if (!pair)
+		return;
+
+	cache = g_key_file_new();
+	g_key_file_set_string(cache, CERTIFICATE_CACHE_KEY_GROUP, "pair", pair);
+	memset(pair, 0, strlen(pair));
+	g_free(pair);
+
+	g_hash_table_iter_init(&iter, sc->certificates);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		gchar *group  = g_strdup_printf("certificate %u", count++);
+		gchar *base64 = g_base64_encode(sipe_cert_crypto_raw(value),
+						sipe_cert_crypto_raw_length(value));
+		g_key_file_set_string(cache, group, "target", key);
+		g_key_file_set_string(cache, group, "data",   base64);
+		g_free(base64);
+		g_free(group);
+	}
+
+	data = g_key_file_to_data(cache, &length, NULL);
+	g_key_file_free(cache);
+	if (data) {
+		if (sipe_token_store_write_secure(sipe_private,
+						  CERTIFICATE_CACHE_FILE,
+						  data,
+						  length))
+			SIPE_DEBUG_INFO("certificate_cache_save: saved %u certificate(s)",
+					count);
+		memset(data, 0, length);
+		g_free(data);
+	}
+}
+
+static void certificate_request(struct sipe_core_private *sipe_private,
+				struct certificate_callback_data *ccd);
+
+static void certificate_key_available(struct sipe_core_private *sipe_private,
+				      struct sipe_cert_crypto *backend)
+{
+	struct sipe_certificate *sc = sipe_private->certificate;
+	GSList *pending = sc->pending;
+	GSList *entry;
+
+	if (backend) {
+		SIPE_DEBUG_INFO_NOFORMAT("certificate_key_available: key pair generated");
+		sc->backend = backend;
+	} else {
+		SIPE_DEBUG_ERROR_NOFORMAT("certificate_key_available: key generation failed");
+	}
+
+	/* requests will fail without backend */
+	sc->pending = NULL;
+	for (entry = pending; entry; entry = entry->next)
+		certificate_request(sipe_private, entry->data);
+	g_slist_free(pending);
+}
+
+static void cert_crypto_free(gpointer data)
+{
+	sipe_cert_crypto_free(data);
+}
+
+/* main thread */
+static void certificate_key_ready(struct sipe_core_private *sipe_private,
+				  gpointer result,
+				  SIPE_UNUSED_PARAMETER gpointer data)
+{
+	sipe_private->certificate->job = NULL;
+	certificate_key_available(sipe_private, result);
+}
+
+/* worker thread: must not access SIPE data or call into the backend! */
+static gpointer certificate_key_generate(SIPE_UNUSED_PARAMETER gpointer data)
+{
+	return(sipe_cert_crypto_generate());
+}
+
+static void certificate_key_start(struct sipe_core_private *sipe_private)
+{
+	SIPE_DEBUG_INFO_NOFORMAT("certificate_key_start: generating key pair in background");
+	sipe_private->certificate->job = sipe_job_submit(sipe_private,
+							 certificate_key_generate,
+							 certificate_key_ready,
+							 NULL,
+							 NULL,
+							 cert_crypto_free);
+}
+#define CERTIFICATE_KEY_PENDING(sc) ((sc)->job != NULL)
+
 gboolean sipe_certificate_init(struct sipe_core_private *sipe_private)
 {
 	struct sipe_certificate *sc;
-	struct sipe_cert_crypto *ssc;
 
 	if (sipe_private->certificate)
 		return(TRUE);
 
-	ssc = sipe_cert_crypto_init();
-	if (!ssc) {
-		SIPE_DEBUG_ERROR_NOFORMAT("sipe_certificate_init: crypto backend init FAILED!");
-		return(FALSE);
-	}
-
 	sc = g_new0(struct sipe_certificate, 1);
 	sc->certificates = g_hash_table_new_full(g_str_hash, g_str_equal,
 						 g_free,
 						 sipe_cert_crypto_destroy);
-	sc->backend = ssc;
+	sipe_private->certificate = sc;
+
+	/* key pair and certificates from a previous login? */
+	if (!certificate_cache_load(sipe_private))
+		certificate_key_start(sipe_private);
 
 	SIPE_DEBUG_INFO_NOFORMAT("sipe_certificate_init: DONE");
 
-	sipe_private->certificate = sc;
 	return(TRUE);
 }
 
@@ -110,7 +317,8 @@ static gchar *create_certreq(struct sipe_core_private *sipe_private,
 {
 	gchar *base64;
 
-	if (!sipe_certificate_init(sipe_private))
+	if (!sipe_certificate_init(sipe_private) ||
+	    !sipe_private->certificate->backend)
 		return(NULL);
 
 	SIPE_DEBUG_INFO_NOFORMAT("create_req: generating new certificate request");
@@ -143,27 +351,21 @@ static gchar *create_certreq(struct sipe_core_private *sipe_private,
 	return(base64);
 }
 
-static void add_certificate(struct sipe_core_private *sipe_private,
-			    const gchar *target,
-			    gpointer certificate)
-{
-	struct sipe_certificate *sc = sipe_private->certificate;
-	g_hash_table_insert(sc->certificates, g_strdup(target), certificate);
-}
-
 gpointer sipe_certificate_tls_dsk_find(struct sipe_core_private *sipe_private,
 				       const gchar *target)
 {
-	struct sipe_certificate *sc = sipe_private->certificate;
+	struct sipe_certificate *sc;
 	gpointer certificate;
 
-	if (!target || !sc)
+	/* loads certificate cache */
+	if (!target || !sipe_certificate_init(sipe_private))
 		return(NULL);
+	sc = sipe_private->certificate;
 
 	certificate = g_hash_table_lookup(sc->certificates, target);
 
 	/* Let's make sure the certificate is still valid for another hour */
-	if (!sipe_cert_crypto_valid(certificate, 60 * 60)) {
+	if (!sipe_cert_crypto_valid(certificate, CERTIFICATE_VALIDITY)) {
 		SIPE_DEBUG_ERROR("sipe_certificate_tls_dsk_find: certificate for '%s' is invalid",
 				 target);
 		return(NULL);
@@ -217,6 +419,7 @@ static void get_and_publish_cert(struct sipe_core_private *sipe_private,
 						opaque);
 				SIPE_DEBUG_INFO("get_and_publish_cert: certificate for target '%s' added",
 						ccd->target);
+				certificate_cache_save(sipe_private);
 
 				/* Let's try this again... */
 				sip_transport_authentication_completed(sipe_private);
@@ -238,6 +441,38 @@ static void get_and_publish_cert(struct sipe_core_private *sipe_private,
 	callback_data_free(ccd);
 }
 
+static void certificate_request(struct sipe_core_private *sipe_private,
+				struct certificate_callback_data *ccd)
+{
+	gchar *certreq_base64 = create_certreq(sipe_private,
+					       sipe_private->username);
+
+	if (certreq_base64) {
+
+		SIPE_DEBUG_INFO_NOFORMAT("certificate_request: created certificate request");
+
+		if (sipe_svc_get_and_publish_cert(sipe_private,
+						  ccd->session,
+						  ccd->auth_uri,
+						  ccd->wsse_security,
+						  certreq_base64,
+						  get_and_publish_cert,
+						  ccd))
+			/* callback data passed down the line */
+			ccd = NULL;
+
+		g_free(certreq_base64);
+	}
+
+	if (ccd) {
+		certificate_failure(sipe_private,
+				    _("Certificate request to %s failed"),
+				    ccd->base_uri,
+				    NULL);
+		callback_data_free(ccd);
+	}
+}
+
 static void certprov_webticket(struct sipe_core_private *sipe_private,
 			       const gchar *base_uri,
 			       const gchar *auth_uri,
@@ -249,35 +484,24 @@ static void certprov_webticket(struct sipe_core_private *sipe_private,
 
 	if (wsse_security) {
 		/* Got a Web Ticket for Certificate Provisioning Service */
-		gchar *certreq_base64 = create_certreq(sipe_private,
-						       sipe_private->username);
+		struct sipe_certificate *sc = sipe_private->certificate;
 
 		SIPE_DEBUG_INFO("certprov_webticket: got ticket for %s",
 				base_uri);
 
-		if (certreq_base64) {
-
-			SIPE_DEBUG_INFO_NOFORMAT("certprov_webticket: created certificate request");
+		ccd->base_uri      = g_strdup(base_uri);
+		ccd->auth_uri      = g_strdup(auth_uri);
+		ccd->wsse_security = g_strdup(wsse_security);
 
-			if (sipe_svc_get_and_publish_cert(sipe_private,
-							  ccd->session,
-							  auth_uri,
-							  wsse_security,
-							  certreq_base64,
-							  get_and_publish_cert,
-							  ccd))
-				/* callback data passed down the line */
-				ccd = NULL;
-
-			g_free(certreq_base64);
+		if (sc && CERTIFICATE_KEY_PENDING(sc)) {
+			SIPE_DEBUG_INFO_NOFORMAT("certprov_webticket: waiting for key pair");
+			sc->pending = g_slist_append(sc->pending, ccd);
+		} else {
+			certificate_request(sipe_private, ccd);
 		}
 
-	        if (ccd) {
-			certificate_failure(sipe_private,
-					    _("Certificate request to %s failed"),
-					    base_uri,
-					    NULL);
-		}
+		/* callback data passed down the line */
+		ccd = NULL;
 
 	} else if (auth_uri) {
 		certificate_failure(sipe_private,
@@ -294,9 +518,14 @@ gboolean sipe_certificate_tls_dsk_generate(struct sipe_core_private *sipe_privat
 					   const gchar *target,
 					   const gchar *uri)
 {
-	struct certificate_callback_data *ccd = g_new0(struct certificate_callback_data, 1);
+	struct certificate_callback_data *ccd;
 	gboolean ret;
 
+	/* starts key pair generation in parallel to Web Ticket request */
+	if (!sipe_certificate_init(sipe_private))
+		return(FALSE);
+
+	ccd = g_new0(struct certificate_callback_data, 1);
 	ccd->session = sipe_svc_session_start();
 
 	ret = sipe_webticket_request(sipe_private,
@@ -246,8 +246,8 @@ sipe_refer(struct sipe_core_private *sipe_private,
 	   const gchar *who)
 {
 	gchar *hdr;
-	gchar *contact;
-	gchar *epid = get_epid(sipe_private);
+	const gchar *contact;
+	const gchar *epid = get_epid(sipe_private);
 	struct sip_dialog *dialog = sipe_dialog_find(session,
 						     session->chat_session->id);
 	const char *ourtag = dialog && dialog->ourtag ? dialog->ourtag : NULL;
@@ -264,7 +264,6 @@ sipe_refer(struct sipe_core_private *sipe_private,
 		ourtag ? ";tag=" : "",
 		ourtag ? ourtag : "",
 		epid);
-	g_free(epid);
 
 	sip_transport_request(sipe_private,
 			      "REFER",
@@ -276,7 +275,38 @@ sipe_refer(struct sipe_core_private *sipe_private,
 			      NULL);
 
 	g_free(hdr);
-	g_free(contact);
+}
+
+/*
+ * Roster manager election
+ *
+ * The result is decided as soon as every dialog has answered RequestRM.
+ * Dialogs that don't answer are waited for at most a few round trip times.
+ */
+#define ELECTION_TIMEOUT_MIN 2000  /* milliseconds */
+#define ELECTION_TIMEOUT_MAX 15000 /* milliseconds, also without RTT */
+#define ELECTION_RTT_FACTOR  4
+
+static gchar *
+sipe_election_action(struct sip_session *session)
+{
+	return(g_strdup_printf("<+election-result><%s>", session->callid));
+}
+
+static guint
+sipe_election_timeout(struct sip_session *session)
+{
+	guint timeout = ELECTION_TIMEOUT_MIN;
+
+	SIPE_DIALOG_FOREACH {
+		guint wait = (dialog->rtt &&
+			      (dialog->rtt < ELECTION_TIMEOUT_MAX / ELECTION_RTT_FACTOR)) ?
+			dialog->rtt * ELECTION_RTT_FACTOR : ELECTION_TIMEOUT_MAX;
+		if (wait > timeout)
+			timeout = wait;
+	} SIPE_DIALOG_FOREACH_END;
+
+	return(timeout);
 }
 
 static gboolean
@@ -285,7 +315,7 @@ sipe_is_election_finished(struct sip_session *session)
 	gboolean res = TRUE;
 
 	SIPE_DIALOG_FOREACH {
-		if (dialog->election_vote == 0) {
+		if (dialog->election_sent) {
 			res = FALSE;
 			break;
 		}
@@ -351,11 +381,20 @@ void sipe_chat_set_roster_manager(struct sip_session *session,
 
 static void
 sipe_election_result(struct sipe_core_private *sipe_private,
-		     void *sess)
+		     struct sip_session *session)
 {
-	struct sip_session *session = (struct sip_session *)sess;
+	gchar *action = sipe_election_action(session);
 	const gchar *rival = NULL;
 
+	sipe_schedule_cancel(sipe_private, action);
+	g_free(action);
+
+	/* late votes are ignored */
+	session->is_voting_in_progress = FALSE;
+	SIPE_DIALOG_FOREACH {
+		dialog->election_sent = 0;
+	} SIPE_DIALOG_FOREACH_END;
+
 	if (session->chat_session->id) {
 		SIPE_DEBUG_INFO(
 			"sipe_election_result: RM has already been elected in the meantime. It is %s",
@@ -363,8 +402,6 @@ sipe_election_result(struct sipe_core_private *sipe_private,
 		return;
 	}
 
-	session->is_voting_in_progress = FALSE;
-
 	SIPE_DIALOG_FOREACH {
 		if (dialog->election_vote < 0) {
 			rival = dialog->with;
@@ -392,6 +429,37 @@ sipe_election_result(struct sipe_core_private *sipe_private,
 	sipe_process_pending_invite_queue(sipe_private, session);
 }
 
+static void
+sipe_election_expired(struct sipe_core_private *sipe_private,
+		      gpointer callid)
+{
+	struct sip_session *session = sipe_session_find_chat_by_callid(sipe_private,
+								       callid);
+
+	if (session) {
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_election_expired: not all votes received");
+		sipe_election_result(sipe_private, session);
+	}
+}
+
+static void
+sipe_election_vote(struct sipe_core_private *sipe_private,
+		   struct sip_session *session,
+		   struct sip_dialog *dialog,
+		   int vote)
+{
+	if (dialog->election_sent) {
+		sipe_dialog_rtt_sample(dialog, dialog->election_sent);
+		dialog->election_sent = 0;
+	}
+	if (vote)
+		dialog->election_vote = vote;
+
+	if (session->is_voting_in_progress &&
+	    sipe_is_election_finished(session))
+		sipe_election_result(sipe_private, session);
+}
+
 static gboolean
 process_info_response(struct sipe_core_private *sipe_private,
 		      struct sipmsg *msg,
@@ -426,15 +494,12 @@ process_info_response(struct sipe_core_private *sipe_private,
 
 			if (allow && !g_ascii_strcasecmp(allow, "true")) {
 				SIPE_DEBUG_INFO("process_info_response: %s has voted PRO", with);
-				dialog->election_vote = 1;
+				sipe_election_vote(sipe_private, session, dialog, 1);
 			} else if (allow && !g_ascii_strcasecmp(allow, "false")) {
 				SIPE_DEBUG_INFO("process_info_response: %s has voted CONTRA", with);
-				dialog->election_vote = -1;
-			}
-
-			if (sipe_is_election_finished(session)) {
-				sipe_election_result(sipe_private,
-						     session);
+				sipe_election_vote(sipe_private, session, dialog, -1);
+			} else {
+				sipe_election_vote(sipe_private, session, dialog, 0);
 			}
 
 		} else if (xn_set_rm_response) {
@@ -442,6 +507,17 @@ process_info_response(struct sipe_core_private *sipe_private,
 		}
 		sipe_xml_free(xn_action);
 
+	} else if (msg->response >= 300) {
+		/* failed request doesn't count as vote, but needn't be waited for */
+		gchar *with = parse_from(sipmsg_find_header(msg, "To"));
+
+		dialog = sipe_dialog_find(session, with);
+		if (dialog && dialog->election_sent) {
+			SIPE_DEBUG_INFO("process_info_response: %s didn't vote (%d)",
+					with, msg->response);
+			sipe_election_vote(sipe_private, session, dialog, 0);
+		}
+		g_free(with);
 	}
 
 	return TRUE;
@@ -473,6 +549,10 @@ static void
 sipe_election_start(struct sipe_core_private *sipe_private,
 		    struct sip_session *session)
 {
+	gint64 now;
+	gchar *action;
+	guint timeout;
+
 	if (session->is_voting_in_progress) {
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_election_start: other election is in progress, exiting.");
 		return;
@@ -483,20 +563,34 @@ sipe_election_start(struct sipe_core_private *sipe_private,
 
 	SIPE_DEBUG_INFO("sipe_election_start: RM election has initiated. Our bid=%d", session->bid);
 
+	now = sipe_utils_monotonic_msec();
 	SIPE_DIALOG_FOREACH {
 		/* reset election_vote for each chat participant */
 		dialog->election_vote = 0;
+		dialog->election_sent = now;
 
 		/* send RequestRM to each chat participant*/
 		sipe_send_election_request_rm(sipe_private, dialog, session->bid);
 	} SIPE_DIALOG_FOREACH_END;
 
-	sipe_schedule_seconds(sipe_private,
-			      "<+election-result>",
-			      session,
-			      15,
-			      sipe_election_result,
-			      NULL);
+	/* nobody to ask */
+	if (sipe_is_election_finished(session)) {
+		sipe_election_result(sipe_private, session);
+		return;
+	}
+
+	/* session might go away before the timeout: look it up again */
+	action  = sipe_election_action(session);
+	timeout = sipe_election_timeout(session);
+	SIPE_DEBUG_INFO("sipe_election_start: waiting at most %u ms for votes",
+			timeout);
+	sipe_schedule_mseconds(sipe_private,
+			       action,
+			       g_strdup(session->callid),
+			       timeout,
+			       sipe_election_expired,
+			       g_free);
+	g_free(action);
 }
 
 static void
@@ -46,6 +46,7 @@
 #include "sip-transport.h"
 #include "sipe-backend.h"
 #include "sipe-buddy.h"
+#include "sipe-cache.h"
 #include "sipe-chat.h"
 #include "sipe-conf.h"
 #include "sipe-core.h"
@@ -53,8 +54,12 @@
 #include "sipe-dialog.h"
 #include "sipe-http.h"
 #include "sipe-im.h"
+#include "sipe-metrics.h"
 #include "sipe-nls.h"
+#include "sipe-peer-caps.h"
+#include "sipe-schedule.h"
 #include "sipe-session.h"
+#include "sipe-soap.h"
 #include "sipe-subscriptions.h"
 #include "sipe-user.h"
 #include "sipe-utils.h"
@@ -74,19 +79,20 @@
 	"</im>"\
 "</Conferencing>"
 
+static void conf_broadcast_invite_failed(struct sipe_core_private *sipe_private,
+					 const gchar *who);
+static void conf_broadcast_roster(struct sipe_core_private *sipe_private,
+				  struct sip_session *session);
+
 static struct transaction *
 cccp_request(struct sipe_core_private *sipe_private, const gchar *method,
 	     const gchar *with, struct sip_dialog *dialog,
 	     TransCallback callback, const gchar *body, ...)
 {
 	gchar *headers;
-	gchar *request;
-	gchar *request_body;
-
+	GString *request;
 	gchar *self = sip_uri_self(sipe_private);
-
 	va_list args;
-
 	struct transaction *trans;
 
 	headers = g_strdup_printf(
@@ -96,39 +102,36 @@ cccp_request(struct sipe_core_private *sipe_private, const gchar *method,
 		sipe_private->contact);
 
 	/* TODO: put request_id to queue to further compare with incoming one */
-	request = g_strdup_printf(
+	request = sipe_soap_new(
 		"<?xml version=\"1.0\"?>"
 		"<request xmlns=\"urn:ietf:params:xml:ns:cccp\" "
 		"xmlns:mscp=\"http://schemas.microsoft.com/rtc/2005/08/cccpextensions\" "
 			"C3PVersion=\"1\" "
-			"to=\"%s\" "
-			"from=\"%s\" "
-			"requestId=\"%d\">"
-			"%s"
-		"</request>",
-		with,
-		self,
-		sipe_private->cccp_request_id++,
-		body);
+			"to=\"");
+	sipe_soap_append_escaped(request, with);
+	g_string_append(request, "\" from=\"");
+	sipe_soap_append_escaped(request, self);
+	g_string_append_printf(request, "\" requestId=\"%d\">",
+			       sipe_private->cccp_request_id++);
 	g_free(self);
 
 	va_start(args, body);
-	request_body = g_strdup_vprintf(request, args);
+	g_string_append_vprintf(request, body, args);
 	va_end(args);
 
-	g_free(request);
+	g_string_append(request, "</request>");
 
 	trans = sip_transport_request(sipe_private,
 				      method,
 				      with,
 				      with,
 				      headers,
-				      request_body,
+				      request->str,
 				      dialog,
 				      callback);
 
 	g_free(headers);
-	g_free(request_body);
+	g_string_free(request, TRUE);
 
 	return trans;
 }
@@ -153,6 +156,9 @@ process_conf_get_capabilities(SIPE_UNUSED_PARAMETER struct sipe_core_private *si
 						g_slist_append(sipe_private->conf_mcu_types,
 							       sipe_xml_data(node));
 			}
+			sipe_peer_caps_set_mcu_types(sipe_private,
+						     sipe_private->focus_factory_uri,
+						     sipe_private->conf_mcu_types);
 		}
 
 		sipe_xml_free(xn_response);
@@ -164,6 +170,14 @@ process_conf_get_capabilities(SIPE_UNUSED_PARAMETER struct sipe_core_private *si
 void
 sipe_conf_get_capabilities(struct sipe_core_private *sipe_private)
 {
+	/* server configuration rarely changes: use result of earlier login */
+	sipe_utils_slist_free_full(sipe_private->conf_mcu_types, g_free);
+	sipe_private->conf_mcu_types = NULL;
+	if (sipe_peer_caps_get_mcu_types(sipe_private,
+					 sipe_private->focus_factory_uri,
+					 &sipe_private->conf_mcu_types))
+		return;
+
 	cccp_request(sipe_private, "SERVICE",
 		     sipe_private->focus_factory_uri,
 		     NULL,
@@ -197,6 +211,118 @@ rand_guid()
 			rand() % 0xAAFF + 0x1111);
 }
 
+/*
+ * Lync meeting URL -> focus URI
+ *
+ * Recurring meetings use the same URL. Remembering the focus URI avoids
+ * downloading the meeting page before every join.
+ */
+#define CONF_FOCUS_CACHE_MAX 64
+
+static void conf_focus_cache_add(struct sipe_core_private *sipe_private,
+				 const gchar *url,
+				 const gchar *focus_uri)
+{
+	if (!sipe_private->conf_focus_cache)
+		sipe_private->conf_focus_cache = g_hash_table_new_full(g_str_hash,
+									g_str_equal,
+									g_free,
+									g_free);
+	else if (g_hash_table_size(sipe_private->conf_focus_cache) >= CONF_FOCUS_CACHE_MAX)
+		g_hash_table_remove_all(sipe_private->conf_focus_cache);
+
+	g_hash_table_insert(sipe_private->conf_focus_cache,
+			    g_strdup(url),
+			    g_strdup(focus_uri));
+	sipe_cache_stored(sipe_private, SIPE_CACHE_CONF_FOCUS);
+}
+
+void sipe_conf_focus_cache_memory_usage(struct sipe_core_private *sipe_private,
+					struct sipe_memory_usage *usage)
+{
+	GHashTable *conf_focus_cache = sipe_private->conf_focus_cache;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (!conf_focus_cache)
+		return;
+
+	sipe_metrics_memory_hash(usage, conf_focus_cache);
+	g_hash_table_iter_init(&iter, conf_focus_cache);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		sipe_metrics_memory_string(usage, key);
+		sipe_metrics_memory_string(usage, value);
+	}
+}
+
+/* no usage order is kept for these few entries: drop all of them */
+void sipe_conf_focus_cache_shrink(struct sipe_core_private *sipe_private,
+				  gsize target)
+{
+	GHashTable *conf_focus_cache = sipe_private->conf_focus_cache;
+	struct sipe_memory_usage usage = { 0, 0 };
+	guint entries;
+
+	sipe_conf_focus_cache_memory_usage(sipe_private, &usage);
+	if (usage.bytes <= target)
+		return;
+
+	entries = g_hash_table_size(conf_focus_cache);
+	g_hash_table_remove_all(conf_focus_cache);
+	sipe_cache_evicted(sipe_private, SIPE_CACHE_CONF_FOCUS, entries);
+}
+
+static gboolean conf_focus_cache_match(SIPE_UNUSED_PARAMETER gpointer key,
+				       gpointer value,
+				       gpointer focus_uri)
+{
+	return(sipe_strcase_equal(value, focus_uri));
+}
+
+/* joining failed: URL might point to a different meeting now */
+static void conf_focus_cache_invalidate(struct sipe_core_private *sipe_private,
+					const gchar *focus_uri)
+{
+	if (sipe_private->conf_focus_cache)
+		g_hash_table_foreach_remove(sipe_private->conf_focus_cache,
+					    conf_focus_cache_match,
+					    (gpointer) focus_uri);
+}
+
+static void conf_invite_im_mcu(struct sipe_core_private *sipe_private,
+			       struct sip_session *session)
+{
+	struct sip_dialog *dialog = sipe_dialog_find(session, session->im_mcu_uri);
+
+	if (!dialog) {
+		dialog = sipe_dialog_add(session);
+
+		dialog->callid = g_strdup(session->callid);
+		dialog->with = g_strdup(session->im_mcu_uri);
+
+		/* send INVITE to IM MCU */
+		sipe_im_invite(sipe_private, session, dialog->with, NULL, NULL, NULL, FALSE);
+	}
+}
+
+/*
+ * All MCUs of a conference share the conference ID, e.g.
+ *
+ *   sip:alice@example.com;gruu;opaque=app:conf:focus:id:ABCDEF
+ *   sip:alice@example.com;gruu;opaque=app:conf:chat:id:ABCDEF
+ *
+ * Knowing the IM MCU URI in advance allows us to INVITE it in parallel
+ * to the conference subscription, instead of waiting for the first NOTIFY.
+ */
+static gchar *conf_derive_im_mcu_uri(const gchar *focus_uri)
+{
+	if (focus_uri && strstr(focus_uri, ":conf:focus:"))
+		return(sipe_utils_str_replace(focus_uri,
+					      ":conf:focus:",
+					      ":conf:chat:"));
+	return(NULL);
+}
+
 /** Invite us to the focus callback */
 static gboolean
 process_invite_conf_focus_response(struct sipe_core_private *sipe_private,
@@ -239,6 +365,7 @@ process_invite_conf_focus_response(struct sipe_core_private *sipe_private,
 					  reason ? reason : _("no reason given"));
 		g_free(reason);
 
+		conf_focus_cache_invalidate(sipe_private, focus_uri);
 		sipe_session_remove(sipe_private, session);
 		g_free(focus_uri);
 		return FALSE;
@@ -250,6 +377,12 @@ process_invite_conf_focus_response(struct sipe_core_private *sipe_private,
 			sipe_subscribe_conference(sipe_private,
 						  session->chat_session->id,
 						  FALSE);
+
+			/* NOTIFY corrects the URI if our guess was wrong */
+			if (!session->im_mcu_uri)
+				session->im_mcu_uri = conf_derive_im_mcu_uri(session->chat_session->id);
+			if (session->im_mcu_uri)
+				conf_invite_im_mcu(sipe_private, session);
 #ifdef HAVE_VV
 			if (session->is_call)
 				sipe_core_media_connect_conference(SIPE_CORE_PUBLIC,
@@ -346,13 +479,31 @@ static void sipe_conf_error(struct sipe_core_private *sipe_private,
 	g_free(error);
 }
 
+static void conf_join(struct sipe_core_private *sipe_private,
+		      const gchar *focus_uri,
+		      gint64 start)
+{
+	struct sip_session *session = sipe_conf_create(sipe_private,
+						       NULL,
+						       focus_uri);
+
+	/* include time spent on resolving the meeting URL */
+	session->conf_join_start = start;
+}
+
+struct conf_lync_url_data {
+	gchar *uri;
+	gint64 start;
+};
+
 static void sipe_conf_lync_url_cb(struct sipe_core_private *sipe_private,
 				  guint status,
 				  SIPE_UNUSED_PARAMETER GSList *headers,
 				  const gchar *body,
 				  gpointer callback_data)
 {
-	gchar *uri = callback_data;
+	struct conf_lync_url_data *data = callback_data;
+	gchar *uri = data->uri;
 
 	if (status != (guint) SIPE_HTTP_STATUS_ABORTED) {
 		gchar *focus_uri = NULL;
@@ -400,7 +551,8 @@ static void sipe_conf_lync_url_cb(struct sipe_core_private *sipe_private,
 		}
 
 		if (focus_uri) {
-			sipe_conf_create(sipe_private, NULL, focus_uri);
+			conf_focus_cache_add(sipe_private, uri, focus_uri);
+			conf_join(sipe_private, focus_uri, data->start);
 			g_free(focus_uri);
 		} else {
 			sipe_conf_error(sipe_private, uri);
@@ -408,22 +560,45 @@ static void sipe_conf_lync_url_cb(struct sipe_core_private *sipe_private,
 	}
 
 	g_free(uri);
+	g_free(data);
 }
 
 static gboolean sipe_conf_check_for_lync_url(struct sipe_core_private *sipe_private,
 					     gchar *uri)
 {
+	struct conf_lync_url_data *data;
+	const gchar *focus_uri;
+
 	if (!(g_str_has_prefix(uri, "https://") ||
 	      g_str_has_prefix(uri, "http://")))
 		return(FALSE);
 
+	focus_uri = sipe_private->conf_focus_cache ?
+		g_hash_table_lookup(sipe_private->conf_focus_cache, uri) :
+		NULL;
+	if (focus_uri) {
+		SIPE_DEBUG_INFO("sipe_conf_check_for_lync_url: cached focus URI '%s'",
+				focus_uri);
+		sipe_cache_lookup(sipe_private, SIPE_CACHE_CONF_FOCUS, TRUE);
+		conf_join(sipe_private, focus_uri, sipe_utils_monotonic_msec());
+		g_free(uri);
+		return(TRUE);
+	}
+	sipe_cache_lookup(sipe_private, SIPE_CACHE_CONF_FOCUS, FALSE);
+
 	/* URL points to a HTML page with the conference focus URI */
-	return(sipe_http_request_get(sipe_private,
-				     uri,
-				     NULL,
-				     sipe_conf_lync_url_cb,
-				     uri)
-	       != NULL);
+	data        = g_new0(struct conf_lync_url_data, 1);
+	data->uri   = uri;
+	data->start = sipe_utils_monotonic_msec();
+	if (sipe_http_request_get(sipe_private,
+				  uri,
+				  NULL,
+				  sipe_conf_lync_url_cb,
+				  data))
+		return(TRUE);
+
+	g_free(data);
+	return(FALSE);
 }
 
 void sipe_core_conf_create(struct sipe_core_public *sipe_public,
@@ -479,6 +654,7 @@ sipe_conf_create(struct sipe_core_private *sipe_private,
 							    FALSE,
 							    focus_uri);
 
+	session->conf_join_start = sipe_utils_monotonic_msec();
 	session->focus_dialog = g_new0(struct sip_dialog, 1);
 	session->focus_dialog->callid = gencallid();
 	session->focus_dialog->with = g_strdup(session->chat_session->id);
@@ -659,6 +835,7 @@ process_invite_conf_response(struct sipe_core_private *sipe_private,
 	if (msg->response >= 400) {
 		SIPE_DEBUG_INFO("process_invite_conf_response: INVITE response is not 200. Failed to invite %s.", dialog->with);
 		/* @TODO notify user of failure to invite counterparty */
+		conf_broadcast_invite_failed(sipe_private, dialog->with);
 		sipe_dialog_free(dialog);
 		return FALSE;
 	}
@@ -687,7 +864,7 @@ sipe_invite_conf(struct sipe_core_private *sipe_private,
 		 const gchar* who)
 {
 	gchar *hdr;
-	gchar *contact;
+	const gchar *contact;
 	gchar *body;
 	struct sip_dialog *dialog = NULL;
 
@@ -705,7 +882,6 @@ sipe_invite_conf(struct sipe_core_private *sipe_private,
 		"Contact: %s\r\n"
 		"Content-Type: application/ms-conf-invite+xml\r\n",
 		contact);
-	g_free(contact);
 
 	body = g_strdup_printf(
 		SIPE_SEND_CONF_INVITE,
@@ -760,18 +936,15 @@ process_conf_add_response(struct sipe_core_private *sipe_private,
 	return TRUE;
 }
 
-/**
- * Creates conference.
- */
-void
-sipe_conf_add(struct sipe_core_private *sipe_private,
-	      const gchar* who)
+/** addConference request to the focus factory */
+static struct transaction *
+conf_add(struct sipe_core_private *sipe_private,
+	 TransCallback callback)
 {
 	gchar *conference_id;
 	struct transaction *trans;
 	time_t expiry = time(NULL) + 7*60*60; /* 7 hours */
 	char *expiry_time;
-	struct transaction_payload *payload;
 
 	/* addConference request to the focus factory.
 	 *
@@ -816,17 +989,32 @@ sipe_conf_add(struct sipe_core_private *sipe_private,
 	expiry_time = sipe_utils_time_to_str(expiry);
 	conference_id = genconfid();
 	trans = cccp_request(sipe_private, "SERVICE", sipe_private->focus_factory_uri,
-			     NULL, process_conf_add_response,
+			     NULL, callback,
 			     CCCP_ADD_CONFERENCE,
 			     conference_id, expiry_time, conference_view->str);
 	g_free(conference_id);
 	g_free(expiry_time);
 	g_string_free(conference_view, TRUE);
 
-	payload = g_new0(struct transaction_payload, 1);
-	payload->destroy = g_free;
-	payload->data = g_strdup(who);
-	trans->payload = payload;
+	return(trans);
+}
+
+/**
+ * Creates conference.
+ */
+void
+sipe_conf_add(struct sipe_core_private *sipe_private,
+	      const gchar* who)
+{
+	struct transaction *trans = conf_add(sipe_private,
+					     process_conf_add_response);
+
+	if (trans) {
+		struct transaction_payload *payload = g_new0(struct transaction_payload, 1);
+		payload->destroy = g_free;
+		payload->data = g_strdup(who);
+		trans->payload = payload;
+	}
 }
 
 static void
@@ -1034,6 +1222,585 @@ call_decline_cb(struct sipe_core_private *sipe_private, struct conf_accept_ctx *
 
 #endif // HAVE_VV
 
+/*
+ * Conference roster
+ *
+ * Conference NOTIFYs (RFC 4575) are either full state or partial state
+ * documents. A partial document only contains the users and endpoints
+ * that have changed. We therefore track the connected endpoints of each
+ * user and the roster state already published to the backend, apply the
+ * document as a diff and only issue backend calls for users whose chat
+ * roster state actually changed.
+ */
+struct conf_roster_user {
+	/* endpoint entity -> session type of connected endpoints */
+	GHashTable *endpoints;
+	gboolean is_operator;
+	gboolean seen;
+	/* what the backend roster currently shows */
+	gboolean published;
+	gboolean published_operator;
+};
+
+static void
+conf_roster_user_free(struct conf_roster_user *user)
+{
+	g_hash_table_destroy(user->endpoints);
+	g_free(user);
+}
+
+static gboolean
+conf_roster_is_chat(SIPE_UNUSED_PARAMETER gpointer key, gpointer value,
+		    SIPE_UNUSED_PARAMETER gpointer user_data)
+{
+	return(sipe_strequal(value, "chat"));
+}
+
+static void
+conf_roster_update_endpoints(struct sip_session *session,
+			     struct conf_roster_user *user,
+			     const sipe_xml *xn_user,
+			     gboolean full,
+			     gboolean *audio_was_added)
+{
+	const sipe_xml *endpoint;
+
+	if (full)
+		g_hash_table_remove_all(user->endpoints);
+
+	for (endpoint = sipe_xml_child(xn_user, "endpoint");
+	     endpoint;
+	     endpoint = sipe_xml_twin(endpoint)) {
+		const gchar *session_type = sipe_xml_attribute(endpoint, "session-type");
+		const gchar *key = sipe_xml_attribute(endpoint, "entity");
+		const sipe_xml *xn_status;
+		gchar *status;
+
+		/* endpoints without entity are only distinguished by type */
+		if (!key)
+			key = session_type ? session_type : "";
+
+		if (sipe_strequal("deleted", sipe_xml_attribute(endpoint, "state"))) {
+			g_hash_table_remove(user->endpoints, key);
+			continue;
+		}
+
+		/* partial endpoint update without status: no change */
+		xn_status = sipe_xml_child(endpoint, "status");
+		if (!xn_status)
+			continue;
+
+		status = sipe_xml_data(xn_status);
+		if (sipe_strequal("connected", status)) {
+			/* partial update might omit the session type */
+			if (!session_type)
+				session_type = g_hash_table_lookup(user->endpoints,
+								   key);
+			g_hash_table_insert(user->endpoints,
+					    g_strdup(key),
+					    g_strdup(session_type ? session_type : ""));
+
+			if (sipe_strequal("audio-video", session_type) &&
+			    !session->is_call &&
+			    audio_was_added)
+				*audio_was_added = TRUE;
+		} else {
+			g_hash_table_remove(user->endpoints, key);
+		}
+		g_free(status);
+	}
+}
+
+static void
+conf_roster_publish(struct sipe_core_private *sipe_private,
+		    struct sip_session *session,
+		    gboolean just_joined)
+{
+	struct sipe_backend_chat_session *backend = session->chat_session->backend;
+	gchar *self = sip_uri_self(sipe_private);
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *joined    = NULL; /* users already in the conference */
+	GSList *arrived   = NULL; /* users that have just joined      */
+	GSList *operators = NULL;
+	GSList *entry;
+	guint added = 0;
+	guint removed = 0;
+
+	/*
+	 * Users are handed to the backend in bulk after the roster walk.
+	 * The URIs stay valid: users in the chat have a connected endpoint
+	 * and are therefore not removed from the roster below.
+	 */
+	g_hash_table_iter_init(&iter, session->conf_roster);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const gchar *user_uri = key;
+		struct conf_roster_user *user = value;
+		gboolean in_chat = g_hash_table_find(user->endpoints,
+						     conf_roster_is_chat,
+						     NULL) != NULL;
+
+		if (in_chat && !user->published) {
+			if (!sipe_backend_chat_find(backend, user_uri)) {
+				if (!just_joined && g_ascii_strcasecmp(user_uri, self))
+					arrived = g_slist_prepend(arrived, key);
+				else
+					joined  = g_slist_prepend(joined,  key);
+			}
+			user->published = TRUE;
+			added++;
+		} else if (!in_chat && user->published) {
+			if (sipe_backend_chat_find(backend, user_uri))
+				sipe_backend_chat_remove(backend, user_uri);
+			user->published = FALSE;
+			removed++;
+		}
+
+		if (in_chat && user->is_operator) {
+			if (!user->published_operator)
+				operators = g_slist_prepend(operators, key);
+			user->published_operator = TRUE;
+		} else {
+			user->published_operator = FALSE;
+		}
+
+		/* forget users without any connected endpoint */
+		if (g_hash_table_size(user->endpoints) == 0)
+			g_hash_table_iter_remove(&iter);
+	}
+
+	sipe_backend_chat_add_many(backend, joined,  FALSE);
+	sipe_backend_chat_add_many(backend, arrived, TRUE);
+	for (entry = operators; entry; entry = entry->next)
+		sipe_backend_chat_operator(backend, entry->data);
+	g_slist_free(operators);
+	g_slist_free(arrived);
+	g_slist_free(joined);
+
+	if (added || removed)
+		SIPE_DEBUG_INFO("conf_roster_publish: %u added, %u removed, %u users",
+				added, removed,
+				g_hash_table_size(session->conf_roster));
+
+	g_free(self);
+}
+
+static void
+conf_roster_update(struct sipe_core_private *sipe_private,
+		   struct sip_session *session,
+		   const sipe_xml *xn_conference_info,
+		   gboolean just_joined,
+		   gboolean *audio_was_added)
+{
+	gboolean full_state = !sipe_strequal(sipe_xml_attribute(xn_conference_info,
+								"state"),
+					     "partial");
+	const sipe_xml *node;
+
+	if (!session->conf_roster)
+		session->conf_roster = g_hash_table_new_full(g_str_hash,
+							     g_str_equal,
+							     g_free,
+							     (GDestroyNotify) conf_roster_user_free);
+
+	if (full_state) {
+		GHashTableIter iter;
+		gpointer value;
+
+		g_hash_table_iter_init(&iter, session->conf_roster);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			((struct conf_roster_user *) value)->seen = FALSE;
+	}
+
+	for (node = sipe_xml_child(xn_conference_info, "users/user");
+	     node;
+	     node = sipe_xml_twin(node)) {
+		const gchar *user_uri = sipe_xml_attribute(node, "entity");
+		const gchar *state = sipe_xml_attribute(node, "state");
+		struct conf_roster_user *user;
+		const sipe_xml *xn_role;
+
+		if (!user_uri)
+			continue;
+
+		user = g_hash_table_lookup(session->conf_roster, user_uri);
+		if (sipe_strequal("deleted", state)) {
+			if (user) {
+				g_hash_table_remove_all(user->endpoints);
+				user->seen = TRUE;
+			}
+			continue;
+		}
+
+		if (!user) {
+			user = g_new0(struct conf_roster_user, 1);
+			user->endpoints = g_hash_table_new_full(g_str_hash,
+								g_str_equal,
+								g_free,
+								g_free);
+			g_hash_table_insert(session->conf_roster,
+					    g_strdup(user_uri),
+					    user);
+		}
+		user->seen = TRUE;
+
+		conf_roster_update_endpoints(session, user, node,
+					     full_state ||
+					     !sipe_strequal("partial", state),
+					     audio_was_added);
+
+		xn_role = sipe_xml_child(node, "roles/entry");
+		if (xn_role) {
+			gchar *role = sipe_xml_data(xn_role);
+			user->is_operator = sipe_strequal(role, "presenter");
+			g_free(role);
+		} else if (full_state || !sipe_strequal("partial", state)) {
+			user->is_operator = FALSE;
+		}
+	}
+
+	/* full state: users missing from the document have left */
+	if (full_state) {
+		GHashTableIter iter;
+		gpointer value;
+
+		g_hash_table_iter_init(&iter, session->conf_roster);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct conf_roster_user *user = value;
+			if (!user->seen)
+				g_hash_table_remove_all(user->endpoints);
+		}
+	}
+
+	conf_roster_publish(sipe_private, session, just_joined);
+	conf_broadcast_roster(sipe_private, session);
+}
+
+/*
+ * Broadcast
+ *
+ * Instead of one IM session per recipient an ad-hoc conference is created
+ * and the recipients are invited in batches. When every recipient has
+ * either joined or failed the message is posted once to the conference.
+ * Recipients that decline, fail or don't join in time get the message
+ * through sipe_core_im_send_many() instead.
+ */
+#define CONF_BROADCAST_MINIMUM 3  /* less recipients: separate IMs */
+#define CONF_BROADCAST_BATCH   20 /* outstanding invitations */
+#define CONF_BROADCAST_TIMEOUT 60 /* seconds without progress */
+
+struct conf_broadcast {
+	gchar *action;        /* timeout */
+	gchar *focus_uri;     /* NULL until the conference has been created */
+	gchar *what;
+	GQueue waiting;       /* gchar *: not yet invited */
+	GHashTable *invited;  /* gchar * -> NULL: neither joined nor failed */
+	GSList *joined;       /* gchar * */
+	GSList *failed;       /* gchar * */
+	sipe_core_im_send_cb callback;
+	gpointer user_data;
+};
+
+static void conf_broadcast_report(struct sipe_core_private *sipe_private,
+				  struct conf_broadcast *broadcast,
+				  GSList *who,
+				  gboolean delivered)
+{
+	GSList *entry;
+
+	if (broadcast->callback)
+		for (entry = who; entry; entry = entry->next)
+			(*broadcast->callback)(SIPE_CORE_PUBLIC,
+					       entry->data,
+					       delivered,
+					       broadcast->user_data);
+	sipe_utils_slist_free_full(who, g_free);
+}
+
+static void conf_broadcast_fail_invited(struct conf_broadcast *broadcast)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	g_hash_table_iter_init(&iter, broadcast->invited);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		broadcast->failed = g_slist_prepend(broadcast->failed, key);
+		g_hash_table_iter_steal(&iter);
+	}
+}
+
+static void conf_broadcast_free(struct sipe_core_private *sipe_private,
+				struct conf_broadcast *broadcast)
+{
+	gchar *who;
+
+	sipe_private->conf_broadcasts = g_slist_remove(sipe_private->conf_broadcasts,
+						       broadcast);
+	sipe_schedule_cancel(sipe_private, broadcast->action);
+
+	/* anything left over was not delivered */
+	conf_broadcast_fail_invited(broadcast);
+	while ((who = g_queue_pop_head(&broadcast->waiting)) != NULL)
+		broadcast->failed = g_slist_prepend(broadcast->failed, who);
+	conf_broadcast_report(sipe_private, broadcast, broadcast->joined, FALSE);
+	conf_broadcast_report(sipe_private, broadcast, broadcast->failed, FALSE);
+
+	g_hash_table_destroy(broadcast->invited);
+	g_free(broadcast->what);
+	g_free(broadcast->focus_uri);
+	g_free(broadcast->action);
+	g_free(broadcast);
+}
+
+static void conf_broadcast_finish(struct sipe_core_private *sipe_private,
+				  struct conf_broadcast *broadcast,
+				  struct sip_session *session)
+{
+	SIPE_DEBUG_INFO("conf_broadcast_finish: %u joined, %u fall back to IM",
+			g_slist_length(broadcast->joined),
+			g_slist_length(broadcast->failed));
+
+	if (session && broadcast->joined) {
+		sipe_session_enqueue_message(session, broadcast->what, NULL);
+		sipe_im_process_queue(sipe_private, session);
+		conf_broadcast_report(sipe_private, broadcast,
+				      broadcast->joined, TRUE);
+		broadcast->joined = NULL;
+	} else {
+		/* nobody joined: everybody falls back */
+		broadcast->failed = g_slist_concat(broadcast->failed,
+						   broadcast->joined);
+		broadcast->joined = NULL;
+	}
+
+	if (broadcast->failed) {
+		GSList *failed = g_slist_reverse(broadcast->failed);
+		broadcast->failed = NULL;
+		sipe_core_im_send_many(SIPE_CORE_PUBLIC,
+				       failed,
+				       broadcast->what,
+				       broadcast->callback,
+				       broadcast->user_data);
+		sipe_utils_slist_free_full(failed, g_free);
+	}
+
+	conf_broadcast_free(sipe_private, broadcast);
+}
+
+static void conf_broadcast_timeout(struct sipe_core_private *sipe_private,
+				   gpointer data);
+
+static void conf_broadcast_run(struct sipe_core_private *sipe_private,
+			       struct conf_broadcast *broadcast)
+{
+	struct sip_session *session = sipe_session_find_conference(sipe_private,
+								   broadcast->focus_uri);
+	gchar *who;
+
+	if (!session) {
+		SIPE_DEBUG_INFO_NOFORMAT("conf_broadcast_run: conference is gone");
+		conf_broadcast_fail_invited(broadcast);
+		while ((who = g_queue_pop_head(&broadcast->waiting)) != NULL)
+			broadcast->failed = g_slist_prepend(broadcast->failed,
+							    who);
+	}
+
+	while ((g_hash_table_size(broadcast->invited) < CONF_BROADCAST_BATCH) &&
+	       ((who = g_queue_pop_head(&broadcast->waiting)) != NULL)) {
+		g_hash_table_insert(broadcast->invited, who, NULL);
+		sipe_invite_conf(sipe_private, session, who);
+	}
+
+	if (g_hash_table_size(broadcast->invited) == 0) {
+		conf_broadcast_finish(sipe_private, broadcast, session);
+		return;
+	}
+
+	/* progress restarts the timeout */
+	sipe_schedule_seconds(sipe_private,
+			      broadcast->action,
+			      broadcast,
+			      CONF_BROADCAST_TIMEOUT,
+			      conf_broadcast_timeout,
+			      NULL);
+}
+
+static void conf_broadcast_timeout(struct sipe_core_private *sipe_private,
+				   gpointer data)
+{
+	struct conf_broadcast *broadcast = data;
+
+	SIPE_DEBUG_INFO("conf_broadcast_timeout: %u invitations unanswered",
+			g_hash_table_size(broadcast->invited));
+	conf_broadcast_fail_invited(broadcast);
+	conf_broadcast_run(sipe_private, broadcast);
+}
+
+static struct conf_broadcast *conf_broadcast_find(struct sipe_core_private *sipe_private,
+						  const gchar *focus_uri)
+{
+	GSList *entry;
+
+	for (entry = sipe_private->conf_broadcasts; entry; entry = entry->next) {
+		struct conf_broadcast *broadcast = entry->data;
+		if (sipe_strequal(broadcast->focus_uri, focus_uri))
+			return(broadcast);
+	}
+	return(NULL);
+}
+
+static void conf_broadcast_roster(struct sipe_core_private *sipe_private,
+				  struct sip_session *session)
+{
+	struct conf_broadcast *broadcast = conf_broadcast_find(sipe_private,
+							       session->chat_session->id);
+	GHashTableIter iter;
+	gpointer key;
+	gboolean progress;
+
+	if (!broadcast)
+		return;
+
+	/* first roster update after the conference was joined starts invites */
+	progress = (g_hash_table_size(broadcast->invited) == 0);
+	g_hash_table_iter_init(&iter, broadcast->invited);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		struct conf_roster_user *user = g_hash_table_lookup(session->conf_roster,
+								    key);
+
+		if (user && g_hash_table_find(user->endpoints,
+					      conf_roster_is_chat,
+					      NULL)) {
+			broadcast->joined = g_slist_prepend(broadcast->joined,
+							    key);
+			g_hash_table_iter_steal(&iter);
+			progress = TRUE;
+		}
+	}
+
+	if (progress)
+		conf_broadcast_run(sipe_private, broadcast);
+}
+
+static void conf_broadcast_invite_failed(struct sipe_core_private *sipe_private,
+					 const gchar *who)
+{
+	GSList *entry;
+
+	for (entry = sipe_private->conf_broadcasts; entry; entry = entry->next) {
+		struct conf_broadcast *broadcast = entry->data;
+		gpointer key;
+
+		if (g_hash_table_lookup_extended(broadcast->invited,
+						 who,
+						 &key,
+						 NULL)) {
+			g_hash_table_steal(broadcast->invited, key);
+			broadcast->failed = g_slist_prepend(broadcast->failed,
+							    key);
+			conf_broadcast_run(sipe_private, broadcast);
+			return;
+		}
+	}
+}
+
+static gboolean
+process_conf_broadcast_response(struct sipe_core_private *sipe_private,
+				struct sipmsg *msg,
+				struct transaction *trans)
+{
+	struct conf_broadcast *broadcast = trans->payload->data;
+	sipe_xml *xn_response;
+
+	/* job might have timed out or been cancelled in the meantime */
+	if (!g_slist_find(sipe_private->conf_broadcasts, broadcast))
+		return(TRUE);
+
+	xn_response = (msg->response == 200) ?
+		sipe_xml_parse(msg->body, msg->bodylen) : NULL;
+	if (sipe_strequal("success", sipe_xml_attribute(xn_response, "code"))) {
+		const sipe_xml *xn_conference_info = sipe_xml_child(xn_response,
+								    "addConference/conference-info");
+		struct sip_session *session = sipe_conf_create(sipe_private,
+							       NULL,
+							       sipe_xml_attribute(xn_conference_info,
+										  "entity"));
+
+		SIPE_DEBUG_INFO("process_conf_broadcast_response: conference %s",
+				session->chat_session->id);
+		broadcast->focus_uri = g_strdup(session->chat_session->id);
+	} else {
+		SIPE_DEBUG_INFO("process_conf_broadcast_response: failed to create conference (%d)",
+				msg->response);
+		/* no conference: everybody falls back */
+		conf_broadcast_run(sipe_private, broadcast);
+	}
+	sipe_xml_free(xn_response);
+
+	return(TRUE);
+}
+
+void sipe_core_im_broadcast(struct sipe_core_public *sipe_public,
+			    const GSList *who,
+			    const gchar *what,
+			    sipe_core_im_send_cb callback,
+			    gpointer user_data)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	struct conf_broadcast *broadcast;
+	struct transaction *trans;
+	static guint broadcast_seq = 0;
+
+	if ((g_slist_length((GSList *) who) < CONF_BROADCAST_MINIMUM) ||
+	    !sipe_private->focus_factory_uri ||
+	    !sipe_conf_supports_mcu_type(sipe_private, "chat")) {
+		sipe_core_im_send_many(sipe_public, who, what,
+				       callback, user_data);
+		return;
+	}
+
+	broadcast = g_new0(struct conf_broadcast, 1);
+	broadcast->action    = g_strdup_printf("<+conf-broadcast><%u>",
+					       ++broadcast_seq);
+	broadcast->what      = g_strdup(what);
+	broadcast->invited   = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, NULL);
+	broadcast->callback  = callback;
+	broadcast->user_data = user_data;
+	g_queue_init(&broadcast->waiting);
+	for (; who; who = who->next)
+		g_queue_push_tail(&broadcast->waiting, sip_uri(who->data));
+
+	SIPE_DEBUG_INFO("sipe_core_im_broadcast: %u recipients, '%s'",
+			g_queue_get_length(&broadcast->waiting), what);
+
+	sipe_private->conf_broadcasts = g_slist_prepend(sipe_private->conf_broadcasts,
+							broadcast);
+	/* in case the focus factory doesn't respond */
+	sipe_schedule_seconds(sipe_private,
+			      broadcast->action,
+			      broadcast,
+			      CONF_BROADCAST_TIMEOUT,
+			      conf_broadcast_timeout,
+			      NULL);
+
+	trans = conf_add(sipe_private, process_conf_broadcast_response);
+	if (trans) {
+		struct transaction_payload *payload = g_new0(struct transaction_payload, 1);
+		payload->data  = broadcast;
+		trans->payload = payload;
+	} else {
+		conf_broadcast_run(sipe_private, broadcast);
+	}
+}
+
+void sipe_conf_broadcast_cancel(struct sipe_core_private *sipe_private)
+{
+	while (sipe_private->conf_broadcasts)
+		conf_broadcast_free(sipe_private,
+				    sipe_private->conf_broadcasts->data);
+}
+
 void
 sipe_process_conference(struct sipe_core_private *sipe_private,
 			struct sipmsg *msg)
@@ -1072,6 +1839,15 @@ sipe_process_conference(struct sipe_core_private *sipe_private,
 									  session->chat_session->title,
 									  self);
 		just_joined = TRUE;
+		if (session->conf_join_start) {
+			sipe_metrics_latency(sipe_private,
+					     SIPE_METRIC_CONF_JOIN,
+					     session->conf_join_start);
+			session->conf_join_start = 0;
+		}
+		/* roster of previous backend chat is gone */
+		if (session->conf_roster)
+			g_hash_table_remove_all(session->conf_roster);
 		/* @TODO ask for full state (re-subscribe) if it was a partial one -
 		 * this is to obtain full list of conference participants.
 		 */
@@ -1087,79 +1863,44 @@ sipe_process_conference(struct sipe_core_private *sipe_private,
 	}
 
 	/* IM MCU URI */
-	if (!session->im_mcu_uri) {
-		for (node = sipe_xml_child(xn_conference_info, "conference-description/conf-uris/entry");
-		     node;
-		     node = sipe_xml_twin(node))
-		{
-			gchar *purpose = sipe_xml_data(sipe_xml_child(node, "purpose"));
-
-			if (sipe_strequal("chat", purpose)) {
-				g_free(purpose);
-				session->im_mcu_uri = sipe_xml_data(sipe_xml_child(node, "uri"));
+	for (node = sipe_xml_child(xn_conference_info, "conference-description/conf-uris/entry");
+	     node;
+	     node = sipe_xml_twin(node))
+	{
+		gchar *purpose = sipe_xml_data(sipe_xml_child(node, "purpose"));
+
+		if (sipe_strequal("chat", purpose)) {
+			gchar *im_mcu_uri = sipe_xml_data(sipe_xml_child(node, "uri"));
+
+			if (im_mcu_uri &&
+			    !sipe_strcase_equal(im_mcu_uri, session->im_mcu_uri)) {
+				/* drop dialog for a wrongly derived URI */
+				if (session->im_mcu_uri) {
+					SIPE_DEBUG_INFO("sipe_process_conference: replacing im_mcu_uri=%s",
+							session->im_mcu_uri);
+					sipe_dialog_remove(session, session->im_mcu_uri);
+					g_free(session->im_mcu_uri);
+				}
+				session->im_mcu_uri = im_mcu_uri;
 				SIPE_DEBUG_INFO("sipe_process_conference: im_mcu_uri=%s", session->im_mcu_uri);
-				break;
+			} else {
+				g_free(im_mcu_uri);
 			}
 			g_free(purpose);
+			break;
 		}
+		g_free(purpose);
 	}
 
 	/* users */
-	for (node = sipe_xml_child(xn_conference_info, "users/user"); node; node = sipe_xml_twin(node)) {
-		const gchar *user_uri = sipe_xml_attribute(node, "entity");
-		const gchar *state = sipe_xml_attribute(node, "state");
-		gchar *role = sipe_xml_data(sipe_xml_child(node, "roles/entry"));
-		gboolean is_operator = sipe_strequal(role, "presenter");
-		gboolean is_in_im_mcu = FALSE;
-		gchar *self = sip_uri_self(sipe_private);
-
-		if (sipe_strequal("deleted", state)) {
-			if (sipe_backend_chat_find(session->chat_session->backend, user_uri)) {
-				sipe_backend_chat_remove(session->chat_session->backend,
-							 user_uri);
-			}
-		} else {
-			/* endpoints */
-			const sipe_xml *endpoint;
-			for (endpoint = sipe_xml_child(node, "endpoint"); endpoint; endpoint = sipe_xml_twin(endpoint)) {
-				const gchar *session_type;
-				gchar *status = sipe_xml_data(sipe_xml_child(endpoint, "status"));
-				gboolean connected = sipe_strequal("connected", status);
-				g_free(status);
-
-				if (!connected)
-					continue;
-
-				session_type = sipe_xml_attribute(endpoint, "session-type");
-
-				if (sipe_strequal("chat", session_type)) {
-					is_in_im_mcu = TRUE;
-					if (!sipe_backend_chat_find(session->chat_session->backend, user_uri)) {
-						sipe_backend_chat_add(session->chat_session->backend,
-								      user_uri,
-								      !just_joined && g_ascii_strcasecmp(user_uri, self));
-					}
-					if (is_operator) {
-						sipe_backend_chat_operator(session->chat_session->backend,
-									   user_uri);
-					}
-				} else if (sipe_strequal("audio-video", session_type)) {
+	conf_roster_update(sipe_private, session, xn_conference_info,
+			   just_joined,
 #ifdef HAVE_VV
-					if (!session->is_call)
-						audio_was_added = TRUE;
+			   &audio_was_added
+#else
+			   NULL
 #endif
-				}
-			}
-			if (!is_in_im_mcu) {
-				if (sipe_backend_chat_find(session->chat_session->backend, user_uri)) {
-					sipe_backend_chat_remove(session->chat_session->backend,
-								 user_uri);
-				}
-			}
-		}
-		g_free(role);
-		g_free(self);
-	}
+			   );
 
 #ifdef HAVE_VV
 	if (audio_was_added) {
@@ -1201,18 +1942,8 @@ sipe_process_conference(struct sipe_core_private *sipe_private,
 	}
 	sipe_xml_free(xn_conference_info);
 
-	if (session->im_mcu_uri) {
-		struct sip_dialog *dialog = sipe_dialog_find(session, session->im_mcu_uri);
-		if (!dialog) {
-			dialog = sipe_dialog_add(session);
-
-			dialog->callid = g_strdup(session->callid);
-			dialog->with = g_strdup(session->im_mcu_uri);
-
-			/* send INVITE to IM MCU */
-			sipe_im_invite(sipe_private, session, dialog->with, NULL, NULL, NULL, FALSE);
-		}
-	}
+	if (session->im_mcu_uri)
+		conf_invite_im_mcu(sipe_private, session);
 
 	sipe_process_pending_invite_queue(sipe_private, session);
 }
@@ -1242,56 +1973,187 @@ conf_session_close(struct sipe_core_private *sipe_private,
 	}
 }
 
+/*
+ * Conference IMDN batching
+ *
+ * In large conferences every MCU leg sends its own IMDN for each of our
+ * messages. The IMDNs are collected per message and flushed after
+ * CONF_IMDN_FLUSH milliseconds, i.e. the user gets at most one delivery
+ * failure notice per message listing all failed recipients.
+ */
+#define CONF_IMDN_FLUSH        500 /* milliseconds */
+#define CONF_IMDN_FLUSH_ACTION "<+conf-imdn-flush>"
+
+struct conf_imdn {
+	gchar *message;   /* NULL if not found in conf_unconfirmed_messages */
+	GSList *failed;   /* gchar *, recipient URIs */
+	guint error;      /* of first failed recipient */
+};
+
+static void conf_imdn_free(gpointer data)
+{
+	struct conf_imdn *imdn = data;
+
+	g_free(imdn->message);
+	sipe_utils_slist_free_full(imdn->failed, g_free);
+	g_free(imdn);
+}
+
+static void conf_imdn_flush(struct sipe_core_private *sipe_private,
+			    gpointer data)
+{
+	struct sip_session *session = sipe_session_find_chat_by_callid(sipe_private,
+								       data);
+	GHashTable *pending;
+	GHashTableIter iter;
+	gpointer value;
+	guint failed = 0;
+
+	/* session has been closed in the meantime */
+	if (!session || !session->conf_imdn_pending)
+		return;
+	pending = session->conf_imdn_pending;
+	session->conf_imdn_pending = NULL;
+
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct conf_imdn *imdn = value;
+
+		if (imdn->failed) {
+			GString *who = g_string_new(NULL);
+			GSList *entry;
+
+			/* list is in reverse order of arrival */
+			imdn->failed = g_slist_reverse(imdn->failed);
+			for (entry = imdn->failed; entry; entry = entry->next) {
+				if (who->len)
+					g_string_append(who, ", ");
+				g_string_append(who, entry->data);
+			}
+			sipe_user_present_message_undelivered(sipe_private,
+							      session,
+							      imdn->error,
+							      -1,
+							      who->str,
+							      imdn->message);
+			g_string_free(who, TRUE);
+			failed++;
+		}
+	}
+
+	SIPE_DEBUG_INFO("conf_imdn_flush: %u messages confirmed, %u with failures, %u unconfirmed",
+			g_hash_table_size(pending), failed,
+			g_hash_table_size(session->conf_unconfirmed_messages));
+	g_hash_table_destroy(pending);
+}
+
+static struct conf_imdn *conf_imdn_pending(struct sipe_core_private *sipe_private,
+					   struct sip_session *session,
+					   const gchar *message_id)
+{
+	struct conf_imdn *imdn;
+	gpointer key;
+	gpointer message;
+
+	if (!session->conf_imdn_pending) {
+		gchar *action = g_strdup_printf(CONF_IMDN_FLUSH_ACTION "%s",
+						session->callid);
+
+		session->conf_imdn_pending = g_hash_table_new_full(g_str_hash,
+								   g_str_equal,
+								   g_free,
+								   conf_imdn_free);
+		/* first IMDN of this burst */
+		sipe_schedule_mseconds(sipe_private,
+				       action,
+				       g_strdup(session->callid),
+				       CONF_IMDN_FLUSH,
+				       conf_imdn_flush,
+				       g_free);
+		g_free(action);
+	}
+
+	imdn = g_hash_table_lookup(session->conf_imdn_pending, message_id);
+	if (imdn)
+		return(imdn);
+
+	imdn = g_new0(struct conf_imdn, 1);
+	/* message is confirmed: take it over from the unconfirmed list */
+	if (g_hash_table_lookup_extended(session->conf_unconfirmed_messages,
+					 message_id,
+					 &key,
+					 &message)) {
+		g_hash_table_steal(session->conf_unconfirmed_messages, key);
+		g_free(key);
+		imdn->message = message;
+	}
+	g_hash_table_insert(session->conf_imdn_pending,
+			    g_strdup(message_id),
+			    imdn);
+
+	return(imdn);
+}
+
 void
 sipe_process_imdn(struct sipe_core_private *sipe_private,
 		  struct sipmsg *msg)
 {
 	gchar *with = parse_from(sipmsg_find_header(msg, "From"));
 	const gchar *callid = sipmsg_find_header(msg, "Call-ID");
-	static struct sip_session *session;
+	struct sip_session *session;
 	sipe_xml *xn_imdn;
 	const sipe_xml *node;
-	gchar *message_id;
-	gchar *message;
+	const sipe_xml *id_node;
 
+	/* sessions are indexed by Call-ID */
 	session = sipe_session_find_chat_or_im(sipe_private, callid, with);
+	g_free(with);
 	if (!session) {
 		SIPE_DEBUG_INFO("sipe_process_imdn: unable to find conf session with callid=%s", callid);
-		g_free(with);
 		return;
 	}
 
 	xn_imdn = sipe_xml_parse(msg->body, msg->bodylen);
-	message_id = sipe_xml_data(sipe_xml_child(xn_imdn, "message-id"));
-
-	message = g_hash_table_lookup(session->conf_unconfirmed_messages, message_id);
-
-	/* recipient */
-	for (node = sipe_xml_child(xn_imdn, "recipient"); node; node = sipe_xml_twin(node)) {
-		gchar *tmp = parse_from(sipe_xml_attribute(node, "uri"));
-		gchar *uri = parse_from(tmp);
-		gchar *status = sipe_xml_data(sipe_xml_child(node, "status"));
-		guint error = status ? g_ascii_strtoull(status, NULL, 10) : 0;
-		/* default to error if missing or conversion failed */
-		if ((error == 0) || (error >= 300))
-			sipe_user_present_message_undelivered(sipe_private,
-							      session,
-							      error,
-							      -1,
-							      uri,
-							      message);
-		g_free(status);
-		g_free(tmp);
-		g_free(uri);
+
+	/* one IMDN can confirm several messages */
+	for (id_node = sipe_xml_child(xn_imdn, "message-id");
+	     id_node;
+	     id_node = sipe_xml_twin(id_node)) {
+		gchar *message_id = sipe_xml_data(id_node);
+		struct conf_imdn *imdn;
+
+		if (!message_id)
+			continue;
+		imdn = conf_imdn_pending(sipe_private, session, message_id);
+		g_free(message_id);
+
+		/* recipient */
+		for (node = sipe_xml_child(xn_imdn, "recipient"); node; node = sipe_xml_twin(node)) {
+			gchar *status = sipe_xml_data(sipe_xml_child(node, "status"));
+			guint error = status ? g_ascii_strtoull(status, NULL, 10) : 0;
+
+			/* default to error if missing or conversion failed */
+			if ((error == 0) || (error >= 300)) {
+				gchar *tmp = parse_from(sipe_xml_attribute(node, "uri"));
+				gchar *uri = parse_from(tmp);
+
+				/* every MCU leg may report the same recipient */
+				if (uri && !g_slist_find_custom(imdn->failed,
+								uri,
+								(GCompareFunc) g_ascii_strcasecmp)) {
+					if (!imdn->failed)
+						imdn->error = error;
+					imdn->failed = g_slist_prepend(imdn->failed, uri);
+				} else {
+					g_free(uri);
+				}
+				g_free(tmp);
+			}
+			g_free(status);
+		}
 	}
 
 	sipe_xml_free(xn_imdn);
-
-	g_hash_table_remove(session->conf_unconfirmed_messages, message_id);
-	SIPE_DEBUG_INFO("sipe_process_imdn: removed message %s from conf_unconfirmed_messages(count=%d)",
-			message_id, g_hash_table_size(session->conf_unconfirmed_messages));
-	g_free(message_id);
-	g_free(with);
 }
 
 void sipe_core_conf_make_leader(struct sipe_core_public *sipe_public,
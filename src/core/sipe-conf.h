@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2009-10 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2009-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -24,6 +24,7 @@
 struct sipmsg;
 struct sip_session;
 struct sipe_core_private;
+struct sipe_memory_usage;
 
 /**
  * Obtains conferencing capabilities enabled on the server.
@@ -79,6 +80,15 @@ void
 sipe_process_conference(struct sipe_core_private *sipe_private,
 			struct sipmsg * msg);
 
+/**
+ * Cancel broadcast jobs
+ *
+ * All recipients without a result are reported as undelivered.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_conf_broadcast_cancel(struct sipe_core_private *sipe_private);
+
 /**
  * Invites counterparty to join conference.
  */
@@ -141,3 +151,23 @@ conf_session_close(struct sipe_core_private *sipe_private,
 void
 sipe_process_imdn(struct sipe_core_private *sipe_private,
 		  struct sipmsg *msg);
+
+/**
+ * Add memory used by the meeting URL cache
+ *
+ * @param sipe_private SIPE core data
+ * @param usage        usage to add to
+ */
+void
+sipe_conf_focus_cache_memory_usage(struct sipe_core_private *sipe_private,
+				   struct sipe_memory_usage *usage);
+
+/**
+ * Shrink the meeting URL cache below target bytes
+ *
+ * @param sipe_private SIPE core data
+ * @param target       estimated size in bytes
+ */
+void
+sipe_conf_focus_cache_shrink(struct sipe_core_private *sipe_private,
+			     gsize target);
@@ -21,20 +21,31 @@
  */
 
 /* Forward declarations */
-struct sip_address_data;
 struct sip_csta;
-struct sip_service_data;
+struct sip_discovery;
 struct sip_transport;
+struct sipe_backend_media_relays;
 struct sipe_buddies;
+struct sipe_buddy_snapshot;
+struct sipe_caches;
 struct sipe_calendar;
 struct sipe_certificate;
+struct sipe_containers;
+struct sipe_directory_cache;
 struct sipe_ews_autodiscover;
+struct sipe_ft_scheduler;
 struct sipe_groupchat;
 struct sipe_groups;
 struct sipe_http;
 struct sipe_http_request;
 struct sipe_media_call_private;
+struct sipe_metrics;
+struct sipe_peer_caps;
+struct sipe_resubscriptions;
+struct sipe_schedule_queue;
+struct sipe_session_indexes;
 struct sipe_svc;
+struct sipe_tls_session_cache;
 struct sipe_ucs;
 struct sipe_webticket;
 
@@ -52,8 +63,7 @@ struct sipe_core_private {
 
 	/* sip-transport.c private data */
 	struct sip_transport *transport;
-	const struct sip_service_data *service_data; /* autodiscovery SRV records */
-	const struct sip_address_data *address_data; /* autodiscovery A records */
+	struct sip_discovery *discovery; /* server autodiscovery */
 	guint transport_type;
 	guint authentication_type;
 
@@ -68,9 +78,12 @@ struct sipe_core_private {
 	/* SIPE protocol information */
 	gchar *contact;
 	gchar *register_callid;
-	gchar *epid;
+	gchar *epid;             /* cached, see get_epid() */
+	gchar *uuid;             /* cached, see get_uuid() */
+	gchar *email_epid;       /* cached, see sipe_get_pub_instance() */
 	gchar *focus_factory_uri;
 	GSList *sessions;
+	struct sipe_session_indexes *session_indexes; /* lookup tables for sessions */
 	GSList *sessions_to_accept;
 	/* from REGISTER response: server events
 	 *  we're allowed to subscribe to
@@ -82,20 +95,29 @@ struct sipe_core_private {
 	gchar *note;
 	time_t note_since;
 	gboolean status_set_by_user;
+	/* see sipe_status_publish() */
+	gboolean status_publish_calendar;
+	gint64 status_publish_pending; /* first unpublished change, 0 = none */
+	gint64 status_published;       /* sipe_utils_monotonic_msec(), 0 = never */
 
 	/* [MS-SIP] deltaNum counters */
 	guint deltanum_contacts;
 	guint deltanum_acl;      /* setACE (OCS2005 only) */
+	/* last applied roaming ACL, see sipe_process_roaming_acl() */
+	GHashTable *roaming_acl; /* key: sip: URI, value: blocked */
+	guint roaming_acl_delta;
 
 	/* [MS-PRES] */
-	GSList *containers;
-	GSList *our_publication_keys;
+	struct sipe_containers *containers;
+	/* keys: packed <category><instance><container>, see sipe-ocs2007.c */
+	GHashTable *our_publication_keys;
 	GHashTable *our_publications;
 	GHashTable *user_state_publications;
 
 	/* Buddies */
 	struct sipe_groups *groups;
 	struct sipe_buddies *buddies;
+	struct sipe_directory_cache *directory_cache;
 
 	/* Calendar and related stuff */
 	struct sipe_calendar *calendar;
@@ -115,15 +137,29 @@ struct sipe_core_private {
 	 * - User status
 	 */
 	gchar *ocs2005_user_states;
+	/* calendar flag of pending coalesced publication, see sipe-ocs2005.c */
+	gboolean ocs2005_publish_calendar;
 
 	/* Scheduling system */
-	GSList *timeouts;
+	struct sipe_schedule_queue *timeouts;
 
 	/* Active subscriptions */
 	GHashTable *subscriptions;
+	struct sipe_resubscriptions *resubscriptions;
+
+	/* Runtime metrics */
+	struct sipe_metrics *metrics;
+
+	/* In-memory cache budget */
+	struct sipe_caches *caches;
+
+	/* minimum interval between typing notifications, see sipe-user.c */
+	guint typing_interval; /* milliseconds, 0: not initialized yet */
 
 	/* Voice call */
 	GHashTable *media_calls;
+	/* "<peer> <media>" -> codec the peer preferred last time */
+	GHashTable *media_codec_preferences;
 	gchar *test_call_bot_uri;
 	gchar *uc_line_uri;
 	/**
@@ -134,20 +170,32 @@ struct sipe_core_private {
 	gchar *media_relay_username;
 	gchar *media_relay_password;
 	GSList *media_relays;
+	gint64 media_relay_expires; /* sipe_utils_monotonic_sec() */
+	/* sipe-media.c: relays handed to the backend, kept across calls */
+	struct sipe_backend_media_relays *media_relay_allocation;
+	gchar *media_relay_allocation_key;
+	/* sipe-media.c: port windows per media type */
+	struct sipe_media_ports *media_ports;
 	SipeEncryptionPolicy server_av_encryption_policy;
 
+	/* IM bulk send jobs, see sipe-im.c */
+	GSList *im_bulk_jobs;
+	/* IM broadcast jobs, see sipe-conf.c */
+	GSList *conf_broadcasts;
+	/* cached X-MMS-IM-Format and its "msgr" parameter, see sipe-im.c */
+	gchar *im_format;
+	gchar *im_format_msgr;
+
 	/* Group chat */
 	struct sipe_groupchat *groupchat;
 	gchar *persistentChatPool_uri;
 
-	/* buddy menu memory allocation */
-	GSList *blist_menu_containers;
+	/* buddy menu data, see sipe-ocs2007.c */
+	GHashTable *blist_menu_members;
 
 	/* For RCC - Remote Call Control */
 	struct sip_csta *csta;
 
-	struct sipe_dns_query *dns_query;
-
 	/* HTTP service */
 	struct sipe_http *http;
 
@@ -159,6 +207,21 @@ struct sipe_core_private {
 	/* Unified Contact Store */
 	struct sipe_ucs *ucs;
 
+	/* sipe-job.c: jobs running on worker threads */
+	GSList *jobs;
+
+	/* sipe-notify.c: presence NOTIFYs being parsed, in arrival order */
+	GQueue *presence_batches;
+
+	/* sipe-buddy-snapshot.c: current view, NULL = outdated */
+	struct sipe_buddy_snapshot *buddy_snapshot;
+
+	/* sipe-ft-scheduler.c: outgoing transfer streams */
+	struct sipe_ft_scheduler *ft_scheduler;
+
+	/* sipe-tls-session.c: TLS sessions for resumption */
+	struct sipe_tls_session_cache *tls_sessions;
+
 	/* [MS-DLX] server URI */
 	gchar *dlx_uri;
 
@@ -171,6 +234,12 @@ struct sipe_core_private {
 	guint ms_filetransfer_request_id;
 
 	GSList *conf_mcu_types;
+	/* sipe-notify.c: last applied provisioning v2 document */
+	gchar *provisioning_v2;
+	/* sipe-peer-caps.c: capabilities learned from peers & servers */
+	struct sipe_peer_caps *peer_caps;
+	/* Lync meeting URL -> focus URI, see sipe-conf.c */
+	GHashTable *conf_focus_cache;
 
 	/* Port ranges to use for media connections. Zero means any port. */
 	guint min_media_port;
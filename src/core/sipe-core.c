@@ -75,6 +75,8 @@
 #include "sip-transport.h"
 #include "sipe-backend.h"
 #include "sipe-buddy.h"
+#include "sipe-buddy-snapshot.h"
+#include "sipe-cache.h"
 #include "sipe-cal.h"
 #include "sipe-certificate.h"
 #include "sipe-chat.h"
@@ -82,22 +84,35 @@
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-crypt.h"
+#include "sipe-debug.h"
+#include "sipe-directory-cache.h"
 #include "sipe-ews-autodiscover.h"
+#include "sipe-ft-scheduler.h"
 #include "sipe-group.h"
 #include "sipe-groupchat.h"
 #include "sipe-http.h"
+#include "sipe-im.h"
+#include "sipe-job.h"
+#include "sipe-limits.h"
 #include "sipe-media.h"
+#include "sipe-metrics.h"
 #include "sipe-mime.h"
 #include "sipe-nls.h"
+#include "sipe-notify.h"
 #include "sipe-ocs2007.h"
+#include "sipe-peer-caps.h"
+#include "sipe-presence-batch.h"
+#include "sipe-roster-cache.h"
 #include "sipe-schedule.h"
 #include "sipe-session.h"
 #include "sipe-status.h"
 #include "sipe-subscriptions.h"
 #include "sipe-svc.h"
+#include "sipe-tls-session.h"
 #include "sipe-ucs.h"
 #include "sipe-utils.h"
 #include "sipe-webticket.h"
+#include "sipe-xml.h"
 
 #ifdef PACKAGE_GIT_COMMIT
 #define SIPE_CORE_VERSION PACKAGE_VERSION " (git commit " PACKAGE_GIT_COMMIT ")"
@@ -106,31 +121,71 @@
 #endif
 
 /* locale_dir is unused if ENABLE_NLS is not defined */
+/*
+ * Expensive subsystems are initialized when the first account is
+ * allocated, i.e. a disabled SIPE plugin doesn't pay for them.
+ * Security mechanisms, the MIME backend and the status token table
+ * initialize themselves on first use.
+ */
+static gboolean subsystems_initialized = FALSE;
+
+static void sipe_core_init_subsystems(void)
+{
+	gint64 start;
+	gint64 crypto;
+
+	if (subsystems_initialized)
+		return;
+	subsystems_initialized = TRUE;
+
+	start = g_get_monotonic_time();
+	/* Initialization for crypto backend (production mode) */
+	sipe_crypto_init(TRUE);
+	crypto = g_get_monotonic_time();
+	sipe_xml_init();
+
+	SIPE_DEBUG_INFO("sipe_core_init_subsystems: crypto %" G_GINT64_FORMAT " us, XML %" G_GINT64_FORMAT " us",
+			crypto - start,
+			g_get_monotonic_time() - crypto);
+}
+
 void sipe_core_init(SIPE_UNUSED_PARAMETER const char *locale_dir)
 {
+	gint64 start = g_get_monotonic_time();
+
 	srand(time(NULL));
-	sip_sec_init();
 
 #ifdef ENABLE_NLS
-	SIPE_DEBUG_INFO("bindtextdomain = %s",
-			bindtextdomain(PACKAGE_NAME, locale_dir));
-	SIPE_DEBUG_INFO("bind_textdomain_codeset = %s",
-			bind_textdomain_codeset(PACKAGE_NAME, "UTF-8"));
+	{
+		/* debug macros don't evaluate their arguments when disabled */
+		const gchar *domain  = bindtextdomain(PACKAGE_NAME, locale_dir);
+		const gchar *codeset = bind_textdomain_codeset(PACKAGE_NAME, "UTF-8");
+		SIPE_DEBUG_INFO("bindtextdomain = %s", domain);
+		SIPE_DEBUG_INFO("bind_textdomain_codeset = %s", codeset);
+	}
 	textdomain(PACKAGE_NAME);
 #endif
-	/* Initialization for crypto backend (production mode) */
-	sipe_crypto_init(TRUE);
-	sipe_mime_init();
-	sipe_status_init();
+	sipe_debug_log_init();
+	sipe_core_debug_configure(g_getenv("SIPE_DEBUG"));
+	sipe_limits_init();
+
+	SIPE_DEBUG_INFO("sipe_core_init: %" G_GINT64_FORMAT " us",
+			g_get_monotonic_time() - start);
 }
 
 void sipe_core_destroy(void)
 {
+	sipe_job_shutdown();
 	sipe_chat_destroy();
 	sipe_status_shutdown();
-	sipe_mime_shutdown();
-	sipe_crypto_shutdown();
+	sipe_mime_parts_shutdown();
+	if (subsystems_initialized) {
+		sipe_xml_shutdown();
+		sipe_crypto_shutdown();
+		subsystems_initialized = FALSE;
+	}
 	sip_sec_destroy();
+	sipe_debug_log_shutdown();
 }
 
 gchar *sipe_core_about(void)
@@ -214,6 +269,7 @@ struct sipe_core_public *sipe_core_allocate(const gchar *signin_name,
 					    const gchar *password,
 					    const gchar *email,
 					    const gchar *email_url,
+					    GMainContext *context,
 					    const gchar **errmsg)
 {
 	struct sipe_core_private *sipe_private;
@@ -283,7 +339,12 @@ struct sipe_core_public *sipe_core_allocate(const gchar *signin_name,
 	if (is_empty(login_account))
 		login_account = signin_name;
 
+	sipe_core_init_subsystems();
+
 	sipe_private = g_new0(struct sipe_core_private, 1);
+	sipe_metrics_init(sipe_private);
+	sipe_cache_init(sipe_private);
+	sipe_tls_session_init(sipe_private);
 	SIPE_CORE_PRIVATE_FLAG_UNSET(SUBSCRIBED_BUDDIES);
 	SIPE_CORE_PRIVATE_FLAG_UNSET(INITIAL_PUBLISH);
 	SIPE_CORE_PRIVATE_FLAG_UNSET(SSO);
@@ -295,12 +356,12 @@ struct sipe_core_public *sipe_core_allocate(const gchar *signin_name,
 	sipe_private->password   = sso             ? NULL                  : g_strdup(password);
 	sipe_private->public.sip_name   = g_strdup(user_domain[0]);
 	sipe_private->public.sip_domain = g_strdup(user_domain[1]);
+	sipe_private->public.context    = context ? g_main_context_ref(context) : NULL;
 	g_strfreev(user_domain);
 
 	sipe_group_init(sipe_private);
 	sipe_buddy_init(sipe_private);
-	sipe_private->our_publications = g_hash_table_new_full(g_str_hash, g_str_equal,
-							       g_free, (GDestroyNotify)g_hash_table_destroy);
+	sipe_private->our_publications = sipe_ocs2007_publications_new();
 	sipe_subscriptions_init(sipe_private);
 	sipe_ews_autodiscover_init(sipe_private);
 	sipe_status_set_activity(sipe_private, SIPE_ACTIVITY_UNSET);
@@ -331,6 +392,8 @@ void sipe_core_connection_cleanup(struct sipe_core_private *sipe_private)
 {
 	g_free(sipe_private->epid);
 	sipe_private->epid = NULL;
+	g_free(sipe_private->uuid);
+	sipe_private->uuid = NULL;
 
 	sipe_http_free(sipe_private);
 	sip_transport_disconnect(sipe_private);
@@ -339,6 +402,7 @@ void sipe_core_connection_cleanup(struct sipe_core_private *sipe_private)
 
 	if (sipe_private->allowed_events)
 		sipe_utils_slist_free_full(sipe_private->allowed_events, g_free);
+	sipe_private->allowed_events = NULL;
 
 	sipe_ocs2007_free(sipe_private);
 
@@ -366,6 +430,10 @@ void sipe_core_deallocate(struct sipe_core_public *sipe_public)
 	sipe_media_handle_going_offline(sipe_private);
 #endif
 
+	/* no new conversations for broadcast and bulk send jobs */
+	sipe_conf_broadcast_cancel(sipe_private);
+	sipe_im_bulk_cancel(sipe_private);
+
 	/* leave all conversations */
 	if (sipe_private->sessions) {
 		GSList *entry;
@@ -385,12 +453,18 @@ void sipe_core_deallocate(struct sipe_core_public *sipe_public)
 	sipe_webticket_free(sipe_private);
 	sipe_ucs_free(sipe_private);
 
+	/* results of running jobs will be discarded */
+	sipe_presence_batch_free(sipe_private);
+	sipe_job_cancel_all(sipe_private);
+	sipe_ft_scheduler_free(sipe_private);
+
 	if (sipe_backend_connection_is_valid(SIPE_CORE_PUBLIC)) {
 		sipe_subscriptions_unsubscribe(sipe_private);
 		sip_transport_deregister(sipe_private);
 	}
 
 	sipe_core_connection_cleanup(sipe_private);
+	sipe_roster_cache_save(sipe_private);
 	sipe_ews_autodiscover_free(sipe_private);
 	sipe_cal_calendar_free(sipe_private->calendar);
 	sipe_certificate_free(sipe_private);
@@ -401,21 +475,30 @@ void sipe_core_deallocate(struct sipe_core_public *sipe_public)
 	g_free(sipe_private->email_password);
 	g_free(sipe_private->email_authuser);
 	g_free(sipe_private->email);
+	g_free(sipe_private->email_epid);
 	g_free(sipe_private->password);
 	g_free(sipe_private->authuser);
 	g_free(sipe_private->status);
 	g_free(sipe_private->note);
 	g_free(sipe_private->ocs2005_user_states);
+	g_free(sipe_private->im_format);
+	g_free(sipe_private->im_format_msgr);
 
+	sipe_buddy_snapshot_free(sipe_private);
 	sipe_buddy_free(sipe_private);
+	sipe_directory_cache_free(sipe_private);
 	g_hash_table_destroy(sipe_private->our_publications);
 	g_hash_table_destroy(sipe_private->user_state_publications);
 	g_hash_table_destroy(sipe_private->media_calls);
+	if (sipe_private->media_codec_preferences)
+		g_hash_table_destroy(sipe_private->media_codec_preferences);
 	sipe_subscriptions_destroy(sipe_private);
 	sipe_group_free(sipe_private);
 
 	if (sipe_private->our_publication_keys)
-		sipe_utils_slist_free_full(sipe_private->our_publication_keys, g_free);
+		g_hash_table_destroy(sipe_private->our_publication_keys);
+	if (sipe_private->roaming_acl)
+		g_hash_table_destroy(sipe_private->roaming_acl);
 
 #ifdef HAVE_VV
 	g_free(sipe_private->test_call_bot_uri);
@@ -424,12 +507,23 @@ void sipe_core_deallocate(struct sipe_core_public *sipe_public)
 	g_free(sipe_private->media_relay_username);
 	g_free(sipe_private->media_relay_password);
 	sipe_media_relay_list_free(sipe_private->media_relays);
+	sipe_media_relay_allocation_free(sipe_private);
+	sipe_media_ports_free(sipe_private);
 #endif
 
 	g_free(sipe_private->persistentChatPool_uri);
 	g_free(sipe_private->addressbook_uri);
 	g_free(sipe_private->dlx_uri);
 	sipe_utils_slist_free_full(sipe_private->conf_mcu_types, g_free);
+	g_free(sipe_private->provisioning_v2);
+	sipe_peer_caps_free(sipe_private);
+	if (sipe_private->conf_focus_cache)
+		g_hash_table_destroy(sipe_private->conf_focus_cache);
+	sipe_tls_session_free(sipe_private);
+	sipe_cache_free(sipe_private);
+	sipe_metrics_free(sipe_private);
+	if (sipe_private->public.context)
+		g_main_context_unref(sipe_private->public.context);
 	g_free(sipe_private);
 }
 
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-16 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2010 pier11 <pier11@operamail.com>
  *
  * This program is free software; you can redistribute it and/or modify
@@ -23,7 +23,7 @@
 
 /**
  * Cypher routines implementation based on NSS.
- * Includes: RC4, DES
+ * Includes: RC4, DES, AES-CTR
  */
 
 #include "glib.h"
@@ -38,10 +38,46 @@
 #endif
 #include "pk11pub.h"
 
+#include <string.h>
+
 #include "sipe-common.h"
 #include "sipe-backend.h"
 #include "sipe-crypt.h"
 
+/*
+ * PK11_GetBestSlot() has to search all tokens. Only a handful of
+ * mechanisms are used, so keep a reference to the slot for each of them.
+ */
+#define SIPE_CRYPT_SLOT_CACHE_SIZE 4
+static struct {
+	CK_MECHANISM_TYPE mechanism;
+	PK11SlotInfo *slot;
+} slot_cache[SIPE_CRYPT_SLOT_CACHE_SIZE];
+
+static PK11SlotInfo *
+sipe_crypt_slot(CK_MECHANISM_TYPE cipherMech)
+{
+	guint i;
+
+	for (i = 0; i < SIPE_CRYPT_SLOT_CACHE_SIZE; i++) {
+		if (!slot_cache[i].slot) {
+			PK11SlotInfo *slot = PK11_GetBestSlot(cipherMech, NULL);
+			if (slot) {
+				slot_cache[i].mechanism = cipherMech;
+				slot_cache[i].slot      = slot;
+			}
+			return(slot);
+		}
+		if (slot_cache[i].mechanism == cipherMech)
+			return(slot_cache[i].slot);
+	}
+
+	/* this should not happen */
+	SIPE_DEBUG_ERROR("sipe_crypt_slot: slot cache full, mechanism 0x%lx",
+			 (unsigned long) cipherMech);
+	return(NULL);
+}
+
 /* NSS specific initialization/shutdown */
 void sipe_crypto_init(SIPE_UNUSED_PARAMETER gboolean production_mode)
 {
@@ -66,44 +102,63 @@ void sipe_crypto_init(SIPE_UNUSED_PARAMETER gboolean production_mode)
 
 void sipe_crypto_shutdown(void)
 {
+	guint i;
+
 	/* do nothing for NSS.
 	 * We don't want accedently switch off NSS possibly used by other plugin -
 	 * ssl-nss in Pidgin for example.
+	 *
+	 * Only release our slot references.
 	 */
+	for (i = 0; i < SIPE_CRYPT_SLOT_CACHE_SIZE; i++) {
+		if (slot_cache[i].slot)
+			PK11_FreeSlot(slot_cache[i].slot);
+		slot_cache[i].slot = NULL;
+	}
 }
 
 /* PRIVATE methods */
 
+/* SecParam == NULL: cipher doesn't use an IV */
 static PK11Context*
-sipe_crypt_ctx_create(CK_MECHANISM_TYPE cipherMech, const guchar *key, gsize key_length)
+sipe_crypt_ctx_create(CK_MECHANISM_TYPE cipherMech, const guchar *key, gsize key_length,
+		      SECItem *SecParam)
 {
 	PK11SlotInfo* slot;
 	SECItem keyItem;
 	SECItem ivItem;
 	PK11SymKey* SymKey;
-	SECItem *SecParam;
-	PK11Context* EncContext;
+	PK11Context* EncContext = NULL;
+	gboolean free_param = FALSE;
 
 	/* For key */
-	slot = PK11_GetBestSlot(cipherMech, NULL);
+	slot = sipe_crypt_slot(cipherMech);
+	if (!slot)
+		return(NULL);
 
 	keyItem.type = siBuffer;
 	keyItem.data = (unsigned char *)key;
 	keyItem.len = key_length;
 
 	SymKey = PK11_ImportSymKey(slot, cipherMech, PK11_OriginUnwrap, CKA_ENCRYPT, &keyItem, NULL);
+	if (!SymKey)
+		return(NULL);
 
 	/* Parameter for crypto context */
-	ivItem.type = siBuffer;
-	ivItem.data = NULL;
-	ivItem.len = 0;
-	SecParam = PK11_ParamFromIV(cipherMech, &ivItem);
+	if (!SecParam) {
+		ivItem.type = siBuffer;
+		ivItem.data = NULL;
+		ivItem.len = 0;
+		SecParam = PK11_ParamFromIV(cipherMech, &ivItem);
+		free_param = TRUE;
+	}
 
-	EncContext = PK11_CreateContextBySymKey(cipherMech, CKA_ENCRYPT, SymKey, SecParam);
+	if (SecParam)
+		EncContext = PK11_CreateContextBySymKey(cipherMech, CKA_ENCRYPT, SymKey, SecParam);
 
 	PK11_FreeSymKey(SymKey);
-	SECITEM_FreeItem(SecParam, PR_TRUE);
-	PK11_FreeSlot(slot);
+	if (free_param && SecParam)
+		SECITEM_FreeItem(SecParam, PR_TRUE);
 
 	return EncContext;
 }
@@ -130,7 +185,9 @@ sipe_crypt(CK_MECHANISM_TYPE cipherMech,
 {
 	void *EncContext;
 
-	EncContext = sipe_crypt_ctx_create(cipherMech, key, key_length);
+	EncContext = sipe_crypt_ctx_create(cipherMech, key, key_length, NULL);
+	if (!EncContext)
+		return;
 	sipe_crypt_ctx_encrypt(EncContext, plaintext, plaintext_length, encrypted_text);
 	sipe_crypt_ctx_destroy(EncContext);
 }
@@ -225,47 +282,108 @@ gboolean sipe_crypt_verify_rsa(gpointer public,
 }
 
 
-/* Stream RC4 cipher for file transfer */
-gpointer
-sipe_crypt_ft_start(const guchar *key)
+/*
+ * Symmetric stream cipher contexts
+ *
+ * NSS freebl dispatches to AES-NI/ARMv8 CE implementations at runtime.
+ *
+ * A PK11Context is bound to its key. Re-keying therefore replaces it,
+ * but the wrapper and the cached slot are reused.
+ */
+struct nss_cipher {
+	CK_MECHANISM_TYPE mechanism;
+	PK11Context *context;
+};
+
+static gboolean
+sipe_crypt_cipher_key(struct nss_cipher *cipher,
+		      const guchar *key, gsize key_length,
+		      const guchar *iv)
 {
-	return sipe_crypt_ctx_create(CKM_RC4, key, 16);
-}
+	CK_AES_CTR_PARAMS ctr;
+	SECItem ctrItem;
+	SECItem *SecParam = NULL;
+
+	if (cipher->context)
+		sipe_crypt_ctx_destroy(cipher->context);
+
+	if (cipher->mechanism == CKM_AES_CTR) {
+		if (!iv || (key_length != 16)) {
+			cipher->context = NULL;
+			return(FALSE);
+		}
+
+		/* full 128-bit block is the counter, same as OpenSSL */
+		ctr.ulCounterBits = 128;
+		memcpy(ctr.cb, iv, sizeof(ctr.cb));
+		ctrItem.type = siBuffer;
+		ctrItem.data = (unsigned char *) &ctr;
+		ctrItem.len  = sizeof(ctr);
+		SecParam = &ctrItem;
+	}
 
-void
-sipe_crypt_ft_stream(gpointer context,
-		     const guchar *in, gsize length,
-		     guchar *out)
-{
-	sipe_crypt_ctx_encrypt(context, in, length, out);
+	cipher->context = sipe_crypt_ctx_create(cipher->mechanism,
+						key, key_length,
+						SecParam);
+	return(cipher->context != NULL);
 }
 
-void
-sipe_crypt_ft_destroy(gpointer context)
+gpointer
+sipe_crypt_cipher_start(enum sipe_crypt_cipher type,
+			const guchar *key, gsize key_length,
+			const guchar *iv)
 {
-	sipe_crypt_ctx_destroy(context);
+	struct nss_cipher *cipher = g_new0(struct nss_cipher, 1);
+
+	switch (type) {
+	case SIPE_CRYPT_CIPHER_RC4:
+		cipher->mechanism = CKM_RC4;
+		break;
+	case SIPE_CRYPT_CIPHER_AES_128_CTR:
+		cipher->mechanism = CKM_AES_CTR;
+		break;
+	}
+
+	if (!sipe_crypt_cipher_key(cipher, key, key_length, iv)) {
+		SIPE_DEBUG_ERROR("sipe_crypt_cipher_start: can't initialize cipher %d with key length %" G_GSIZE_FORMAT,
+				 type, key_length);
+		g_free(cipher);
+		return(NULL);
+	}
+
+	return(cipher);
 }
 
-/*
- * Stream RC4 cipher for TLS
- *
- * basically the same as for FT, but with variable key length
- */
-gpointer sipe_crypt_tls_start(const guchar *key, gsize key_length)
+gboolean
+sipe_crypt_cipher_reset(gpointer context,
+			const guchar *key, gsize key_length,
+			const guchar *iv)
 {
-	return sipe_crypt_ctx_create(CKM_RC4, key, key_length);
+	return(sipe_crypt_cipher_key(context, key, key_length, iv));
 }
 
-void sipe_crypt_tls_stream(gpointer context,
-			   const guchar *in, gsize length,
-			   guchar *out)
+void
+sipe_crypt_cipher_stream(gpointer context,
+			 const guchar *in, gsize length,
+			 guchar *out)
 {
-	sipe_crypt_ctx_encrypt(context, in, length, out);
+	struct nss_cipher *cipher = context;
+
+	/* failed reset */
+	if (!cipher->context)
+		return;
+
+	sipe_crypt_ctx_encrypt(cipher->context, in, length, out);
 }
 
-void sipe_crypt_tls_destroy(gpointer context)
+void
+sipe_crypt_cipher_destroy(gpointer context)
 {
-	sipe_crypt_ctx_destroy(context);
+	struct nss_cipher *cipher = context;
+
+	if (cipher->context)
+		sipe_crypt_ctx_destroy(cipher->context);
+	g_free(cipher);
 }
 
 /*
@@ -32,6 +32,9 @@
 #include "sipe-backend.h"
 #include "sipe-crypt.h"
 
+/* one-shot operations reuse the same context */
+static EVP_CIPHER_CTX *oneshot_ctx = NULL;
+
 /* OpenSSL specific initialization/shutdown */
 void sipe_crypto_init(SIPE_UNUSED_PARAMETER gboolean production_mode)
 {
@@ -40,7 +43,9 @@ void sipe_crypto_init(SIPE_UNUSED_PARAMETER gboolean production_mode)
 
 void sipe_crypto_shutdown(void)
 {
-	/* nothing to do here */
+	if (oneshot_ctx)
+		EVP_CIPHER_CTX_free(oneshot_ctx);
+	oneshot_ctx = NULL;
 }
 
 static void openssl_oneshot_crypt(const EVP_CIPHER *type,
@@ -48,27 +53,30 @@ static void openssl_oneshot_crypt(const EVP_CIPHER *type,
 				  const guchar *plaintext, gsize plaintext_length,
 				  guchar *encrypted_text)
 {
-	EVP_CIPHER_CTX ctx;
 	int encrypted_length = 0;
 
 	/* initialize context */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_EncryptInit_ex(&ctx, type, NULL, key, NULL);
+	if (!oneshot_ctx) {
+		oneshot_ctx = EVP_CIPHER_CTX_new();
+		if (!oneshot_ctx)
+			return;
+	}
+	EVP_EncryptInit_ex(oneshot_ctx, type, NULL, key, NULL);
 
 	/* set encryption parameters */
 	if (key_length)
-		EVP_CIPHER_CTX_set_key_length(&ctx, key_length);
-	EVP_EncryptInit_ex(&ctx, NULL, NULL, key, NULL);
+		EVP_CIPHER_CTX_set_key_length(oneshot_ctx, key_length);
+	EVP_EncryptInit_ex(oneshot_ctx, NULL, NULL, key, NULL);
 
 	/* encrypt */
-	EVP_EncryptUpdate(&ctx,
+	EVP_EncryptUpdate(oneshot_ctx,
 			  encrypted_text, &encrypted_length,
 			  plaintext, plaintext_length);
 	encrypted_text += encrypted_length;
-	EVP_EncryptFinal_ex(&ctx, encrypted_text, &encrypted_length);
+	EVP_EncryptFinal_ex(oneshot_ctx, encrypted_text, &encrypted_length);
 
-	/* cleanup */
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	/* reset context, i.e. wipe key material, but keep allocation */
+	EVP_CIPHER_CTX_cleanup(oneshot_ctx);
 }
 
 /* DES CBC with 56-bit key */
@@ -149,59 +157,87 @@ gboolean sipe_crypt_verify_rsa(gpointer public,
 			  public));
 }
 
-static gpointer openssl_rc4_init(const guchar *key, gsize key_length)
-{
-	EVP_CIPHER_CTX *ctx = g_malloc(sizeof(EVP_CIPHER_CTX));
-
-	/* initialize context */
-	EVP_CIPHER_CTX_init(ctx);
-	EVP_EncryptInit_ex(ctx, EVP_rc4(), NULL, key, NULL);
-
-	/* set encryption parameters */
-	EVP_CIPHER_CTX_set_key_length(ctx, key_length);
-	EVP_EncryptInit_ex(ctx, NULL, NULL, key, NULL);
-
-	return(ctx);
+/*
+ * Symmetric stream cipher contexts
+ *
+ * The EVP layer dispatches to AES-NI/ARMv8 CE implementations at runtime.
+ */
+struct openssl_cipher {
+	EVP_CIPHER_CTX *ctx;
+	const EVP_CIPHER *type;
+};
+
+static const EVP_CIPHER *openssl_cipher_type(enum sipe_crypt_cipher cipher)
+{
+	switch (cipher) {
+	case SIPE_CRYPT_CIPHER_RC4:
+		return(EVP_rc4());
+	case SIPE_CRYPT_CIPHER_AES_128_CTR:
+		return(EVP_aes_128_ctr());
+	}
+	return(NULL);
 }
 
-/* Stream RC4 cipher for file transfer with fixed-length 128-bit key */
-gpointer sipe_crypt_ft_start(const guchar *key)
+/* re-keying doesn't require a new context or cipher lookup */
+static gboolean openssl_cipher_key(struct openssl_cipher *cipher,
+				   const guchar *key, gsize key_length,
+				   const guchar *iv)
 {
-	return(openssl_rc4_init(key, 16));
-}
+	/* variable key length ciphers need to be re-initialized first */
+	if (EVP_CIPHER_CTX_key_length(cipher->ctx) != (int) key_length) {
+		if (!EVP_EncryptInit_ex(cipher->ctx, cipher->type, NULL, NULL, NULL) ||
+		    !EVP_CIPHER_CTX_set_key_length(cipher->ctx, key_length))
+			return(FALSE);
+	}
 
-void sipe_crypt_ft_stream(gpointer context,
-			  const guchar *in, gsize length,
-			  guchar *out)
-{
-	int tmp;
-	EVP_EncryptUpdate(context, out, &tmp, in, length);
+	return(EVP_EncryptInit_ex(cipher->ctx, NULL, NULL, key, iv));
 }
 
-void sipe_crypt_ft_destroy(gpointer context)
+gpointer sipe_crypt_cipher_start(enum sipe_crypt_cipher type,
+				 const guchar *key, gsize key_length,
+				 const guchar *iv)
 {
-	EVP_CIPHER_CTX_cleanup(context);
-	g_free(context);
+	struct openssl_cipher *cipher = g_new0(struct openssl_cipher, 1);
+
+	/* initialize context */
+	cipher->ctx  = EVP_CIPHER_CTX_new();
+	cipher->type = openssl_cipher_type(type);
+
+	if (!cipher->ctx  ||
+	    !cipher->type ||
+	    !EVP_EncryptInit_ex(cipher->ctx, cipher->type, NULL, NULL, NULL) ||
+	    !openssl_cipher_key(cipher, key, key_length, iv)) {
+		SIPE_DEBUG_ERROR("sipe_crypt_cipher_start: can't initialize cipher %d with key length %" G_GSIZE_FORMAT,
+				 type, key_length);
+		sipe_crypt_cipher_destroy(cipher);
+		return(NULL);
+	}
+
+	return(cipher);
 }
 
-/* Stream RC4 cipher for TLS with variable key length */
-gpointer sipe_crypt_tls_start(const guchar *key, gsize key_length)
+gboolean sipe_crypt_cipher_reset(gpointer context,
+				 const guchar *key, gsize key_length,
+				 const guchar *iv)
 {
-	return(openssl_rc4_init(key, key_length));
+	return(openssl_cipher_key(context, key, key_length, iv));
 }
 
-void sipe_crypt_tls_stream(gpointer context,
-			   const guchar *in, gsize length,
-			   guchar *out)
+void sipe_crypt_cipher_stream(gpointer context,
+			      const guchar *in, gsize length,
+			      guchar *out)
 {
+	struct openssl_cipher *cipher = context;
 	int tmp;
-	EVP_EncryptUpdate(context, out, &tmp, in, length);
+	EVP_EncryptUpdate(cipher->ctx, out, &tmp, in, length);
 }
 
-void sipe_crypt_tls_destroy(gpointer context)
+void sipe_crypt_cipher_destroy(gpointer context)
 {
-	EVP_CIPHER_CTX_cleanup(context);
-	g_free(context);
+	struct openssl_cipher *cipher = context;
+	if (cipher->ctx)
+		EVP_CIPHER_CTX_free(cipher->ctx);
+	g_free(cipher);
 }
 
 /*
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-16 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -52,16 +52,29 @@ gboolean sipe_crypt_verify_rsa(gpointer public,
 			       const guchar *digest, gsize digest_length,
 			       const guchar *signature, gsize signature_length);
 
-/* Stream RC4 cipher for file transfer */
-gpointer sipe_crypt_ft_start(const guchar *key);
-void sipe_crypt_ft_stream(gpointer context,
-			  const guchar *in, gsize length,
-			  guchar *out);
-void sipe_crypt_ft_destroy(gpointer context);
+/*
+ * Symmetric stream cipher contexts
+ *
+ * The cipher implementation is selected by the crypto library, i.e. the
+ * AES-NI or ARMv8 Crypto Extension code paths are used automatically when
+ * the CPU supports them.
+ *
+ * sipe_crypt_cipher_reset() re-keys an existing context, e.g. for a new
+ * TLS connection state or SRTP session key, without allocating a new one.
+ */
+enum sipe_crypt_cipher {
+	SIPE_CRYPT_CIPHER_RC4,         /* variable key length, no IV       */
+	SIPE_CRYPT_CIPHER_AES_128_CTR, /* 16 byte key, 16 byte counter IV */
+};
 
-/* Stream RC4 cipher for TLS */
-gpointer sipe_crypt_tls_start(const guchar *key, gsize key_length);
-void sipe_crypt_tls_stream(gpointer context,
-			   const guchar *in, gsize length,
-			   guchar *out);
-void sipe_crypt_tls_destroy(gpointer context);
+gpointer sipe_crypt_cipher_start(enum sipe_crypt_cipher cipher,
+				 const guchar *key, gsize key_length,
+				 const guchar *iv);
+gboolean sipe_crypt_cipher_reset(gpointer context,
+				 const guchar *key, gsize key_length,
+				 const guchar *iv);
+/* in & out may be the same buffer */
+void sipe_crypt_cipher_stream(gpointer context,
+			      const guchar *in, gsize length,
+			      guchar *out);
+void sipe_crypt_cipher_destroy(gpointer context);
@@ -0,0 +1,280 @@
+/**
+ * @file sipe-debug-log.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Asynchronous debug log file
+ *
+ * Producers push messages onto a lock-free stack with a compare-and-swap,
+ * i.e. they never wait for a lock or the disk. A writer thread takes the
+ * whole stack at once, restores the original order and writes the batch
+ * with a single fwrite(). When too much output is waiting the message is
+ * dropped and counted instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-debug.h"
+
+#define SIPE_DEBUG_LOG_ENVIRONMENT_FILE "SIPE_DEBUG_LOGFILE"
+#define SIPE_DEBUG_LOG_ENVIRONMENT_SIZE "SIPE_DEBUG_LOGSIZE"
+
+#define SIPE_DEBUG_LOG_SIZE      (10 * 1024 * 1024) /* rotate after [bytes] */
+#define SIPE_DEBUG_LOG_QUEUED    (4 * 1024 * 1024)  /* drop above [bytes]   */
+#define SIPE_DEBUG_LOG_INTERVAL  (100 * 1000)       /* writer poll [us]     */
+
+/* Writer thread requires GLib threads without additional initialization */
+#if GLIB_CHECK_VERSION(2,32,0)
+#define SIPE_DEBUG_LOG_THREAD 1
+#endif
+
+struct log_entry {
+	struct log_entry *next;
+	GTimeVal time;
+	sipe_debug_level level;
+	gsize length;
+	gchar text[1];        /* allocated with the entry */
+};
+
+#ifdef SIPE_DEBUG_LOG_THREAD
+static GThread *log_thread   = NULL;
+static gchar *log_filename   = NULL;
+static gsize log_max_size    = SIPE_DEBUG_LOG_SIZE;
+static FILE *log_fp          = NULL;
+
+/* shared between producers and writer: g_atomic_*() only */
+static gpointer log_head     = NULL;  /* struct log_entry *, newest first */
+static gint log_queued       = 0;     /* bytes */
+static gint log_dropped      = 0;     /* messages */
+static gint log_running      = 0;
+
+static const gchar * const level_tags[] = {
+	"info",
+	"warning",
+	"error",
+};
+
+/* writer thread */
+static void log_rotate(void)
+{
+	gchar *old = g_strdup_printf("%s.1", log_filename);
+
+	fclose(log_fp);
+	g_remove(old);
+	g_rename(log_filename, old);
+	g_free(old);
+
+	log_fp = g_fopen(log_filename, "w");
+}
+
+/* writer thread */
+static gboolean log_write_batch(GString *batch)
+{
+	struct log_entry *entry;
+	struct log_entry *ordered = NULL;
+	gint dropped;
+	gint written = 0;
+
+	/* take all queued entries at once */
+	do {
+		entry = g_atomic_pointer_get(&log_head);
+	} while (entry &&
+		 !g_atomic_pointer_compare_and_exchange(&log_head, entry, NULL));
+
+	/* stack is newest first */
+	while (entry) {
+		struct log_entry *next = entry->next;
+		entry->next = ordered;
+		ordered     = entry;
+		entry       = next;
+	}
+
+	dropped = g_atomic_int_get(&log_dropped);
+	if (dropped) {
+		g_atomic_int_add(&log_dropped, -dropped);
+		g_string_append_printf(batch,
+				       "(warning) sipe_debug_log: %d messages dropped\n",
+				       dropped);
+	}
+
+	while (ordered) {
+		entry   = ordered;
+		ordered = entry->next;
+
+		/* same time stamp format as the message trace */
+		g_string_append_printf(batch, "%ld.%06ld (%s) ",
+				       (long) entry->time.tv_sec,
+				       (long) entry->time.tv_usec,
+				       level_tags[entry->level]);
+		g_string_append_len(batch, entry->text, entry->length);
+		g_string_append_c(batch, '\n');
+
+		written += entry->length;
+		g_free(entry);
+	}
+	if (written)
+		g_atomic_int_add(&log_queued, -written);
+
+	if (batch->len == 0)
+		return(FALSE);
+
+	if (log_fp) {
+		fwrite(batch->str, 1, batch->len, log_fp);
+		fflush(log_fp);
+		if ((gsize) ftell(log_fp) >= log_max_size)
+			log_rotate();
+	}
+	g_string_truncate(batch, 0);
+
+	return(TRUE);
+}
+
+/* writer thread */
+static gpointer log_writer(SIPE_UNUSED_PARAMETER gpointer data)
+{
+	GString *batch = g_string_sized_new(64 * 1024);
+
+	while (g_atomic_int_get(&log_running))
+		/* nothing written: wait for more output */
+		if (!log_write_batch(batch))
+			g_usleep(SIPE_DEBUG_LOG_INTERVAL);
+
+	/* flush remaining output */
+	log_write_batch(batch);
+	g_string_free(batch, TRUE);
+
+	return(NULL);
+}
+#endif
+
+gboolean sipe_core_debug_log_active(void)
+{
+#ifdef SIPE_DEBUG_LOG_THREAD
+	return(g_atomic_int_get(&log_running));
+#else
+	return(FALSE);
+#endif
+}
+
+gboolean sipe_core_debug_log(guint level, const gchar *msg)
+{
+#ifdef SIPE_DEBUG_LOG_THREAD
+	struct log_entry *entry;
+	gsize length;
+
+	if (!g_atomic_int_get(&log_running))
+		return(FALSE);
+
+	length = strlen(msg);
+	if ((gsize) g_atomic_int_get(&log_queued) + length > SIPE_DEBUG_LOG_QUEUED) {
+		g_atomic_int_inc(&log_dropped);
+		return(TRUE);
+	}
+	g_atomic_int_add(&log_queued, length);
+
+	entry = g_malloc(sizeof(struct log_entry) + length);
+	g_get_current_time(&entry->time);
+	entry->level  = (level <= SIPE_DEBUG_LEVEL_ERROR) ? level : SIPE_DEBUG_LEVEL_ERROR;
+	entry->length = length;
+	memcpy(entry->text, msg, length + 1);
+
+	do {
+		entry->next = g_atomic_pointer_get(&log_head);
+	} while (!g_atomic_pointer_compare_and_exchange(&log_head,
+							entry->next,
+							entry));
+
+	return(TRUE);
+#else
+	(void) level;
+	(void) msg;
+	return(FALSE);
+#endif
+}
+
+void sipe_debug_log_init(void)
+{
+#ifdef SIPE_DEBUG_LOG_THREAD
+	const gchar *filename = g_getenv(SIPE_DEBUG_LOG_ENVIRONMENT_FILE);
+	const gchar *size     = g_getenv(SIPE_DEBUG_LOG_ENVIRONMENT_SIZE);
+
+	if (!filename || log_thread)
+		return;
+
+	if (size) {
+		guint64 value = g_ascii_strtoull(size, NULL, 10);
+		if ((value > 0) && (value <= G_MAXSIZE / 1024))
+			log_max_size = value * 1024;
+	}
+
+	log_fp = g_fopen(filename, "a");
+	if (!log_fp) {
+		SIPE_DEBUG_ERROR("sipe_debug_log_init: can't open '%s'",
+				 filename);
+		return;
+	}
+	log_filename = g_strdup(filename);
+
+	g_atomic_int_set(&log_running, 1);
+	log_thread = g_thread_new("sipe-debug-log", log_writer, NULL);
+
+	SIPE_DEBUG_INFO("sipe_debug_log_init: writing to '%s', rotating after %" G_GSIZE_FORMAT " bytes",
+			filename, log_max_size);
+#endif
+}
+
+void sipe_debug_log_shutdown(void)
+{
+#ifdef SIPE_DEBUG_LOG_THREAD
+	if (!log_thread)
+		return;
+
+	/* writer flushes queued output before it exits */
+	g_atomic_int_set(&log_running, 0);
+	g_thread_join(log_thread);
+	log_thread = NULL;
+
+	if (log_fp)
+		fclose(log_fp);
+	log_fp = NULL;
+	g_free(log_filename);
+	log_filename = NULL;
+#endif
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,411 @@
+/**
+ * @file sipe-debug.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-debug.h"
+#include "sipe-utils.h"
+
+/* all debug levels disabled */
+#define SIPE_DEBUG_LEVEL_NONE (SIPE_DEBUG_LEVEL_ERROR + 1)
+
+#define SIPE_DEBUG_TRACE_ENTRIES 32
+#define SIPE_DEBUG_TRACE_BYTES   2048
+
+#define SIPE_DEBUG_EVENT_ENTRIES 512
+#define SIPE_DEBUG_EVENT_KEY     96
+#define SIPE_DEBUG_EVENT_DETAIL  48
+
+static const gchar * const subsystem_names[SIPE_DEBUG_SUBSYSTEM_MAX] = {
+	"SIP",
+	"HTTP",
+	"SCHEDULE",
+};
+
+static const gchar * const level_names[SIPE_DEBUG_LEVEL_NONE + 1] = {
+	"info",
+	"warning",
+	"error",
+	"none",
+};
+
+/* default: everything enabled, i.e. backend setting decides */
+static guint thresholds[SIPE_DEBUG_SUBSYSTEM_MAX];
+
+/*
+ * The trace is a plain ring of fixed-size records: recording a message
+ * is two memcpy()s, no formatting and no memory allocation.
+ */
+struct trace_entry {
+	GTimeVal time;
+	gsize length;          /* original message length */
+	gsize recorded;        /* bytes in data[] */
+	guint subsystem;
+	gboolean sending;
+	gchar data[SIPE_DEBUG_TRACE_BYTES];
+};
+
+static struct trace_entry trace[SIPE_DEBUG_TRACE_ENTRIES];
+static guint trace_next  = 0;
+static guint trace_count = 0;
+
+static const gchar * const event_names[SIPE_DEBUG_EVENT_MAX] = {
+	"sip.request",
+	"sip.response",
+	"sip.auth",
+	"sip.timeout",
+	"sip.incoming",
+	"http.request",
+	"http.response",
+	"http.auth",
+	"webticket",
+};
+
+/* same idea as the message trace: no formatting when recording */
+struct event_entry {
+	GTimeVal time;
+	sipe_debug_event_type type;
+	guint id;              /* numeric key, 0 if key[] is used */
+	guint status;
+	guint duration;
+	gsize bytes;
+	gchar key[SIPE_DEBUG_EVENT_KEY];
+	gchar detail[SIPE_DEBUG_EVENT_DETAIL];
+};
+
+static struct event_entry events[SIPE_DEBUG_EVENT_ENTRIES];
+static guint events_next  = 0;
+static guint events_count = 0;
+
+gboolean sipe_debug_enabled(sipe_debug_subsystem subsystem,
+			    sipe_debug_level level)
+{
+	return((level >= thresholds[subsystem]) &&
+	       sipe_backend_debug_enabled());
+}
+
+gboolean sipe_core_debug_configure(const gchar *spec)
+{
+	gchar **entries;
+	gchar **entry;
+	gboolean valid = TRUE;
+
+	if (!spec)
+		return(TRUE);
+
+	entries = g_strsplit(spec, ",", 0);
+	for (entry = entries; *entry; entry++) {
+		gchar **pair;
+		gboolean applied = FALSE;
+
+		if (is_empty(g_strstrip(*entry)))
+			continue;
+
+		pair = g_strsplit(*entry, ":", 2);
+		if (pair[1]) {
+			gboolean all = sipe_strcase_equal(pair[0], "all");
+			guint level;
+
+			for (level = 0; level <= SIPE_DEBUG_LEVEL_NONE; level++)
+				if (sipe_strcase_equal(pair[1], level_names[level]))
+					break;
+
+			if (level <= SIPE_DEBUG_LEVEL_NONE) {
+				guint i;
+
+				for (i = 0; i < SIPE_DEBUG_SUBSYSTEM_MAX; i++)
+					if (all || sipe_strcase_equal(pair[0],
+								     subsystem_names[i])) {
+						thresholds[i] = level;
+						applied = TRUE;
+					}
+			}
+		}
+		g_strfreev(pair);
+
+		if (!applied) {
+			SIPE_DEBUG_ERROR("sipe_core_debug_configure: invalid entry '%s'",
+					 *entry);
+			valid = FALSE;
+		}
+	}
+	g_strfreev(entries);
+
+	return(valid);
+}
+
+static void trace_record(sipe_debug_subsystem subsystem,
+			 const gchar *header,
+			 const gchar *body,
+			 gboolean sending)
+{
+	struct trace_entry *entry = trace + trace_next;
+	gsize header_length = strlen(header);
+	gsize body_length   = body ? strlen(body) : 0;
+	gsize copy          = MIN(header_length, SIPE_DEBUG_TRACE_BYTES);
+
+	g_get_current_time(&entry->time);
+	entry->length    = header_length + body_length;
+	entry->subsystem = subsystem;
+	entry->sending   = sending;
+	memcpy(entry->data, header, copy);
+	if (body_length && (copy < SIPE_DEBUG_TRACE_BYTES)) {
+		gsize body_copy = MIN(body_length, SIPE_DEBUG_TRACE_BYTES - copy);
+		memcpy(entry->data + copy, body, body_copy);
+		copy += body_copy;
+	}
+	entry->recorded  = copy;
+
+	trace_next = (trace_next + 1) % SIPE_DEBUG_TRACE_ENTRIES;
+	if (trace_count < SIPE_DEBUG_TRACE_ENTRIES)
+		trace_count++;
+}
+
+void sipe_debug_message(sipe_debug_subsystem subsystem,
+			const gchar *header,
+			const gchar *body,
+			gboolean sending)
+{
+	trace_record(subsystem, header, body, sending);
+
+	if (sipe_debug_enabled(subsystem, SIPE_DEBUG_LEVEL_INFO)) {
+		const gchar *type = subsystem_names[subsystem];
+		GString *str      = g_string_new("");
+		GTimeVal currtime;
+		gchar *time_str;
+		const char *marker   = sending ?
+			">>>>>>>>>>" :
+			"<<<<<<<<<<";
+		gchar *tmp;
+
+		g_get_current_time(&currtime);
+		time_str = g_time_val_to_iso8601(&currtime);
+		g_string_append_printf(str, "\nMESSAGE START %s %s - %s\n", marker, type, time_str);
+		g_string_append(str, tmp = sipe_utils_str_replace(header, "\r\n", "\n"));
+		g_free(tmp);
+		g_string_append(str, "\n");
+		if (body) {
+			g_string_append(str, tmp = sipe_utils_str_replace(body, "\r\n", "\n"));
+			g_free(tmp);
+			g_string_append(str, "\n");
+		}
+		g_string_append_printf(str, "MESSAGE END %s %s - %s", marker, type, time_str);
+		g_free(time_str);
+		sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_INFO, str->str);
+		g_string_free(str, TRUE);
+	}
+}
+
+static void event_copy(gchar *dest, const gchar *src, gsize size)
+{
+	gsize length = src ? strlen(src) : 0;
+
+	length = MIN(length, size - 1);
+	memcpy(dest, src, length);
+	dest[length] = '\0';
+}
+
+static struct event_entry *event_record(sipe_debug_event_type type,
+					const gchar *detail,
+					guint status,
+					gsize bytes,
+					guint duration)
+{
+	struct event_entry *entry = events + events_next;
+
+	g_get_current_time(&entry->time);
+	entry->type     = type;
+	entry->status   = status;
+	entry->bytes    = bytes;
+	entry->duration = duration;
+	event_copy(entry->detail, detail, SIPE_DEBUG_EVENT_DETAIL);
+
+	events_next = (events_next + 1) % SIPE_DEBUG_EVENT_ENTRIES;
+	if (events_count < SIPE_DEBUG_EVENT_ENTRIES)
+		events_count++;
+
+	return(entry);
+}
+
+void sipe_debug_event(sipe_debug_event_type type,
+		      const gchar *key,
+		      const gchar *detail,
+		      guint status,
+		      gsize bytes,
+		      guint duration)
+{
+	struct event_entry *entry = event_record(type, detail, status,
+						 bytes, duration);
+	entry->id = 0;
+	event_copy(entry->key, key, SIPE_DEBUG_EVENT_KEY);
+}
+
+void sipe_debug_event_id(sipe_debug_event_type type,
+			 guint id,
+			 const gchar *detail,
+			 guint status,
+			 gsize bytes,
+			 guint duration)
+{
+	struct event_entry *entry = event_record(type, detail, status,
+						 bytes, duration);
+	entry->id     = id;
+	entry->key[0] = '\0';
+}
+
+/* no stdio: must be safe to call from a signal handler */
+static void trace_write_string(sipe_core_debug_trace_writer writer,
+			       gpointer user_data,
+			       const gchar *string)
+{
+	(*writer)(string, strlen(string), user_data);
+}
+
+static void trace_write_number(sipe_core_debug_trace_writer writer,
+			       gpointer user_data,
+			       guint64 value,
+			       guint width)
+{
+	gchar buffer[24];
+	gchar *p = buffer + sizeof(buffer);
+
+	do {
+		*--p = '0' + (value % 10);
+		value /= 10;
+		if (width)
+			width--;
+	} while ((value || width) && (p > buffer));
+
+	(*writer)(p, buffer + sizeof(buffer) - p, user_data);
+}
+
+void sipe_core_debug_trace_dump(sipe_core_debug_trace_writer writer,
+				gpointer user_data)
+{
+	guint first = (trace_next + SIPE_DEBUG_TRACE_ENTRIES - trace_count) %
+		SIPE_DEBUG_TRACE_ENTRIES;
+	guint i;
+
+	trace_write_string(writer, user_data, "\nSIPE TRACE START\n");
+	for (i = 0; i < trace_count; i++) {
+		const struct trace_entry *entry = trace +
+			((first + i) % SIPE_DEBUG_TRACE_ENTRIES);
+
+		trace_write_string(writer, user_data, "\nMESSAGE ");
+		trace_write_string(writer, user_data,
+				   entry->sending ? ">>>>>>>>>> " : "<<<<<<<<<< ");
+		trace_write_string(writer, user_data,
+				   subsystem_names[entry->subsystem]);
+		trace_write_string(writer, user_data, " - ");
+		trace_write_number(writer, user_data,
+				   entry->time.tv_sec, 0);
+		trace_write_string(writer, user_data, ".");
+		trace_write_number(writer, user_data,
+				   entry->time.tv_usec, 6);
+		trace_write_string(writer, user_data, " - ");
+		trace_write_number(writer, user_data, entry->length, 0);
+		trace_write_string(writer, user_data,
+				   (entry->recorded < entry->length) ?
+				   " bytes (truncated)\n" :
+				   " bytes\n");
+		(*writer)(entry->data, entry->recorded, user_data);
+		trace_write_string(writer, user_data, "\n");
+	}
+	trace_write_string(writer, user_data, "\nSIPE TRACE END\n");
+}
+
+/* JSON string: escapes quotes & backslashes, drops control characters */
+static void trace_write_json(sipe_core_debug_trace_writer writer,
+			     gpointer user_data,
+			     const gchar *string)
+{
+	(*writer)("\"", 1, user_data);
+	while (*string) {
+		const gchar *start = string;
+
+		while (*string &&
+		       (*string != '"') &&
+		       (*string != '\\') &&
+		       ((guchar) *string >= 0x20))
+			string++;
+		if (string > start)
+			(*writer)(start, string - start, user_data);
+
+		if (*string) {
+			if ((*string == '"') || (*string == '\\')) {
+				(*writer)("\\", 1, user_data);
+				(*writer)(string, 1, user_data);
+			}
+			string++;
+		}
+	}
+	(*writer)("\"", 1, user_data);
+}
+
+void sipe_core_debug_events_dump(sipe_core_debug_trace_writer writer,
+				 gpointer user_data)
+{
+	guint first = (events_next + SIPE_DEBUG_EVENT_ENTRIES - events_count) %
+		SIPE_DEBUG_EVENT_ENTRIES;
+	guint i;
+
+	for (i = 0; i < events_count; i++) {
+		const struct event_entry *entry = events +
+			((first + i) % SIPE_DEBUG_EVENT_ENTRIES);
+
+		trace_write_string(writer, user_data, "{\"time\":");
+		trace_write_number(writer, user_data,
+				   entry->time.tv_sec, 0);
+		trace_write_string(writer, user_data, ".");
+		trace_write_number(writer, user_data,
+				   entry->time.tv_usec, 6);
+		trace_write_string(writer, user_data, ",\"event\":");
+		trace_write_json(writer, user_data, event_names[entry->type]);
+		trace_write_string(writer, user_data, ",\"key\":");
+		if (entry->id)
+			trace_write_number(writer, user_data, entry->id, 0);
+		else
+			trace_write_json(writer, user_data, entry->key);
+		trace_write_string(writer, user_data, ",\"detail\":");
+		trace_write_json(writer, user_data, entry->detail);
+		trace_write_string(writer, user_data, ",\"status\":");
+		trace_write_number(writer, user_data, entry->status, 0);
+		trace_write_string(writer, user_data, ",\"bytes\":");
+		trace_write_number(writer, user_data, entry->bytes, 0);
+		trace_write_string(writer, user_data, ",\"ms\":");
+		trace_write_number(writer, user_data, entry->duration, 0);
+		trace_write_string(writer, user_data, "}\n");
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
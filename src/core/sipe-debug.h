@@ -0,0 +1,145 @@
+/**
+ * @file sipe-debug.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Per-subsystem debug levels, message trace & event trace
+ *
+ * Requires: sipe-backend.h
+ */
+
+typedef enum {
+	SIPE_DEBUG_SUBSYSTEM_SIP,
+	SIPE_DEBUG_SUBSYSTEM_HTTP,
+	SIPE_DEBUG_SUBSYSTEM_SCHEDULE,
+	SIPE_DEBUG_SUBSYSTEM_MAX
+} sipe_debug_subsystem;
+
+/**
+ * Check if debug output of a subsystem is enabled for a level
+ *
+ * @param subsystem subsystem ID
+ * @param level     debug level
+ *
+ * @return TRUE if backend debugging is enabled and level is at or
+ *         above the threshold configured for the subsystem.
+ */
+gboolean sipe_debug_enabled(sipe_debug_subsystem subsystem,
+			    sipe_debug_level level);
+
+/* Convenience macros: arguments are only evaluated when enabled */
+#define SIPE_DEBUG_SUBSYSTEM(subsystem, level, call) \
+	do { if (sipe_debug_enabled(SIPE_DEBUG_SUBSYSTEM_ ## subsystem, \
+				    SIPE_DEBUG_LEVEL_ ## level)) call; } while (0)
+#define SIPE_DEBUG_SUBSYSTEM_INFO(subsystem, fmt, ...) \
+	SIPE_DEBUG_SUBSYSTEM(subsystem, INFO, sipe_backend_debug(SIPE_DEBUG_LEVEL_INFO, fmt, __VA_ARGS__))
+#define SIPE_DEBUG_SUBSYSTEM_INFO_NOFORMAT(subsystem, msg) \
+	SIPE_DEBUG_SUBSYSTEM(subsystem, INFO, sipe_backend_debug_literal(SIPE_DEBUG_LEVEL_INFO, msg))
+
+/**
+ * Record message in trace buffer and dump it when debugging is enabled
+ *
+ * The last @c SIPE_DEBUG_TRACE_ENTRIES messages are always kept, with
+ * the first @c SIPE_DEBUG_TRACE_BYTES of each, so that they can be
+ * dumped with sipe_core_debug_trace_dump() even when debugging is off.
+ *
+ * @param subsystem subsystem ID (SIP or HTTP)
+ * @param header    message header
+ * @param body      message body (may be @c NULL)
+ * @param sending   @c TRUE for outgoing messages
+ */
+void sipe_debug_message(sipe_debug_subsystem subsystem,
+			const gchar *header,
+			const gchar *body,
+			gboolean sending);
+
+/*
+ * Structured event trace
+ *
+ * Protocol steps are recorded as fixed-size records without any text
+ * formatting, so that they can always be on. The recorded events are
+ * written as JSON lines by sipe_core_debug_events_dump(). Events that
+ * belong together share the same key, e.g. the SIP transaction key
+ * "<Call-ID><CSeq>" or the HTTP request number.
+ */
+typedef enum {
+	SIPE_DEBUG_EVENT_SIP_REQUEST,   /* key: transaction, detail: method  */
+	SIPE_DEBUG_EVENT_SIP_RESPONSE,  /* key: transaction, detail: method  */
+	SIPE_DEBUG_EVENT_SIP_AUTH,      /* 401/407 response, request resent  */
+	SIPE_DEBUG_EVENT_SIP_TIMEOUT,   /* key: transaction, detail: method  */
+	SIPE_DEBUG_EVENT_SIP_INCOMING,  /* key: Call-ID, detail: method      */
+	SIPE_DEBUG_EVENT_HTTP_REQUEST,  /* key: request number, detail: host */
+	SIPE_DEBUG_EVENT_HTTP_RESPONSE, /* key: request number, detail: host */
+	SIPE_DEBUG_EVENT_HTTP_AUTH,     /* detail: authentication scheme     */
+	SIPE_DEBUG_EVENT_WEBTICKET,     /* key: service URI, detail: step    */
+	SIPE_DEBUG_EVENT_MAX
+} sipe_debug_event_type;
+
+/**
+ * Record an event in the event trace
+ *
+ * Strings are copied and truncated to the record size.
+ *
+ * @param type     event type
+ * @param key      correlation key (may be @c NULL)
+ * @param detail   method, host or processing step (may be @c NULL)
+ * @param status   response code, 0 if not applicable
+ * @param bytes    body length, 0 if not applicable
+ * @param duration milliseconds since start of transaction, 0 if not applicable
+ */
+void sipe_debug_event(sipe_debug_event_type type,
+		      const gchar *key,
+		      const gchar *detail,
+		      guint status,
+		      gsize bytes,
+		      guint duration);
+
+/**
+ * Same as sipe_debug_event() with a numeric key
+ */
+void sipe_debug_event_id(sipe_debug_event_type type,
+			 guint id,
+			 const gchar *detail,
+			 guint status,
+			 gsize bytes,
+			 guint duration);
+
+/**
+ * Open debug log file & start its writer thread
+ *
+ * Only if the environment variable SIPE_DEBUG_LOGFILE is set. The file
+ * is rotated to "<name>.1" when it reaches SIPE_DEBUG_LOGSIZE KiB.
+ */
+void sipe_debug_log_init(void);
+
+/**
+ * Flush debug log file & stop its writer thread
+ */
+void sipe_debug_log_shutdown(void);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
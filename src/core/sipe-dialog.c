@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2009-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2009-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -67,10 +67,92 @@ void sipe_dialog_free(struct sip_dialog *dialog)
 	g_free(dialog->theirtag);
 	g_free(dialog->theirepid);
 	g_free(dialog->request);
+	sipe_dialog_headers_reset(dialog);
 
 	g_free(dialog);
 }
 
+void sipe_dialog_headers_reset(struct sip_dialog *dialog)
+{
+	g_free(dialog->headers);
+	dialog->headers = NULL;
+	g_free(dialog->headers_to);
+	dialog->headers_to = NULL;
+}
+
+/*
+ * Dialog lookup caches
+ *
+ * The dialog fields are filled in after sipe_dialog_add() and are changed
+ * in many places. The tables are therefore only caches: a hit is verified
+ * against the current dialog data, a miss or a stale entry falls back to
+ * the list walk. Removing a dialog removes its cache entries.
+ */
+static struct sip_dialog *dialog_cache_lookup(GHashTable *cache,
+					      const gchar *key)
+{
+	return(cache ? g_hash_table_lookup(cache, key) : NULL);
+}
+
+static void dialog_cache_insert(GHashTable **cache,
+				const gchar *key,
+				struct sip_dialog *dialog)
+{
+	if (!*cache)
+		*cache = g_hash_table_new_full(sipe_strcase_hash,
+					       (GEqualFunc) sipe_strcase_equal,
+					       g_free,
+					       NULL);
+	g_hash_table_replace(*cache, g_strdup(key), dialog);
+}
+
+static gboolean dialog_cache_match(SIPE_UNUSED_PARAMETER gpointer key,
+				   gpointer value,
+				   gpointer dialog)
+{
+	return(value == dialog);
+}
+
+static void dialog_cache_forget(struct sip_session *session,
+				struct sip_dialog *dialog)
+{
+	if (session->dialogs_by_with)
+		g_hash_table_foreach_remove(session->dialogs_by_with,
+					    dialog_cache_match,
+					    dialog);
+	if (session->dialogs_by_tag)
+		g_hash_table_foreach_remove(session->dialogs_by_tag,
+					    dialog_cache_match,
+					    dialog);
+}
+
+static void dialog_cache_free(struct sip_session *session)
+{
+	if (session->dialogs_by_with) {
+		g_hash_table_destroy(session->dialogs_by_with);
+		session->dialogs_by_with = NULL;
+	}
+	if (session->dialogs_by_tag) {
+		g_hash_table_destroy(session->dialogs_by_tag);
+		session->dialogs_by_tag = NULL;
+	}
+}
+
+void sipe_dialog_rtt_sample(struct sip_dialog *dialog, gint64 sent)
+{
+	gint64 sample = sipe_utils_monotonic_msec() - sent;
+
+	if (sample < 1)
+		sample = 1;
+	else if (sample > G_MAXINT)
+		sample = G_MAXINT;
+
+	/* same smoothing as TCP (RFC 6298): 7/8 old + 1/8 new */
+	dialog->rtt = dialog->rtt ?
+		(dialog->rtt * 7 + (guint) sample) / 8 :
+		(guint) sample;
+}
+
 struct sip_dialog *sipe_dialog_add(struct sip_session *session)
 {
 	struct sip_dialog *dialog = g_new0(struct sip_dialog, 1);
@@ -78,29 +160,49 @@ struct sip_dialog *sipe_dialog_add(struct sip_session *session)
 	return(dialog);
 }
 
+static gboolean sipe_dialog_match_3(const struct sip_dialog *dialog,
+				    const struct sip_dialog *dialog_in)
+{
+	return(dialog->callid &&
+	       dialog->ourtag &&
+	       dialog->theirtag &&
+
+	       sipe_strcase_equal(dialog_in->callid, dialog->callid) &&
+	       sipe_strcase_equal(dialog_in->ourtag, dialog->ourtag) &&
+	       sipe_strcase_equal(dialog_in->theirtag, dialog->theirtag));
+}
+
 static struct sip_dialog *
 sipe_dialog_find_3(struct sip_session *session,
 		   struct sip_dialog *dialog_in)
 {
-	if (session && dialog_in) {
-		SIPE_DIALOG_FOREACH {
-			if (	dialog_in->callid &&
-				dialog_in->ourtag &&
-				dialog_in->theirtag &&
-
-				dialog->callid &&
-				dialog->ourtag &&
-				dialog->theirtag &&
-
-				sipe_strcase_equal(dialog_in->callid, dialog->callid) &&
-				sipe_strcase_equal(dialog_in->ourtag, dialog->ourtag) &&
-				sipe_strcase_equal(dialog_in->theirtag, dialog->theirtag))
-			{
-				SIPE_DEBUG_INFO("sipe_dialog_find_3 who='%s'",
-						dialog->with ? dialog->with : "");
-				return dialog;
-			}
-		} SIPE_DIALOG_FOREACH_END;
+	if (session && dialog_in &&
+	    dialog_in->callid &&
+	    dialog_in->ourtag &&
+	    dialog_in->theirtag) {
+		struct sip_dialog *found = dialog_cache_lookup(session->dialogs_by_tag,
+							       dialog_in->theirtag);
+
+		if (!(found && sipe_dialog_match_3(found, dialog_in))) {
+			found = NULL;
+			SIPE_DIALOG_FOREACH {
+				if (sipe_dialog_match_3(dialog, dialog_in)) {
+					found = dialog;
+					break;
+				}
+			} SIPE_DIALOG_FOREACH_END;
+
+			if (found)
+				dialog_cache_insert(&session->dialogs_by_tag,
+						    dialog_in->theirtag,
+						    found);
+		}
+
+		if (found) {
+			SIPE_DEBUG_INFO("sipe_dialog_find_3 who='%s'",
+					found->with ? found->with : "");
+			return found;
+		}
 	}
 	return NULL;
 }
@@ -109,12 +211,28 @@ struct sip_dialog *sipe_dialog_find(struct sip_session *session,
 				    const gchar *who)
 {
 	if (session && who) {
-		SIPE_DIALOG_FOREACH {
-			if (dialog->with && sipe_strcase_equal(who, dialog->with)) {
-				SIPE_DEBUG_INFO("sipe_dialog_find who='%s'", who);
-				return dialog;
-			}
-		} SIPE_DIALOG_FOREACH_END;
+		struct sip_dialog *found = dialog_cache_lookup(session->dialogs_by_with,
+							       who);
+
+		if (!(found && sipe_strcase_equal(who, found->with))) {
+			found = NULL;
+			SIPE_DIALOG_FOREACH {
+				if (dialog->with && sipe_strcase_equal(who, dialog->with)) {
+					found = dialog;
+					break;
+				}
+			} SIPE_DIALOG_FOREACH_END;
+
+			if (found)
+				dialog_cache_insert(&session->dialogs_by_with,
+						    who,
+						    found);
+		}
+
+		if (found) {
+			SIPE_DEBUG_INFO("sipe_dialog_find who='%s'", who);
+			return found;
+		}
 	}
 	return NULL;
 }
@@ -124,6 +242,7 @@ void sipe_dialog_remove(struct sip_session *session, const gchar *who)
 	struct sip_dialog *dialog = sipe_dialog_find(session, who);
 	if (dialog) {
 		SIPE_DEBUG_INFO("sipe_dialog_remove who='%s' with='%s'", who, dialog->with ? dialog->with : "");
+		dialog_cache_forget(session, dialog);
 		session->dialogs = g_slist_remove(session->dialogs, dialog);
 		sipe_dialog_free(dialog);
 	}
@@ -137,6 +256,7 @@ sipe_dialog_remove_3(struct sip_session *session,
 	if (dialog) {
 		SIPE_DEBUG_INFO("sipe_dialog_remove_3 with='%s'",
 				dialog->with ? dialog->with : "");
+		dialog_cache_forget(session, dialog);
 		session->dialogs = g_slist_remove(session->dialogs, dialog);
 		sipe_dialog_free(dialog);
 	}
@@ -145,6 +265,8 @@ sipe_dialog_remove_3(struct sip_session *session,
 void sipe_dialog_remove_all(struct sip_session *session)
 {
 	GSList *entry = session->dialogs;
+
+	dialog_cache_free(session);
 	while (entry) {
 		struct sip_dialog *dialog = entry->data;
 		entry = g_slist_remove(entry, dialog);
@@ -248,6 +370,7 @@ void sipe_dialog_parse(struct sip_dialog *dialog,
 
 	g_free(dialog->ourtag);
 	g_free(dialog->theirtag);
+	sipe_dialog_headers_reset(dialog);
 
 	dialog->ourtag = find_tag(sipmsg_find_header(msg, us));
 	dialog->theirtag = find_tag(sipmsg_find_header(msg, them));
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2009-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2009-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -48,6 +48,8 @@ struct sip_dialog {
 	 *   0 - didn't participate
 	 */
 	int election_vote;
+	gint64 election_sent; /* sipe_utils_monotonic_msec() of RequestRM, 0 = no vote outstanding */
+	guint rtt;            /* smoothed INFO round trip time in ms, 0 = unknown */
 	gchar *ourtag;
 	gchar *theirtag;
 	gchar *theirepid;
@@ -62,6 +64,13 @@ struct sip_dialog {
 	gboolean is_established;
 	struct transaction *outgoing_invite;
         struct sipe_delayed_invite *delayed_invite;
+	/* typing notification state, see sipe-user.c */
+	gint64 typing_sent;         /* sipe_utils_monotonic_msec() of last INFO */
+	gboolean typing_active;     /* last INFO sent was "type" */
+	gboolean typing_in_flight;  /* last INFO not responded yet */
+	/* in-dialog request headers, see sip_transport_request_timeout() */
+	gchar *headers;             /* From, To, Call-ID & Route */
+	gchar *headers_to;          /* To URI used for "headers" */
 };
 
 /* Forward declaration */
@@ -74,6 +83,23 @@ struct sip_session;
  */
 void sipe_dialog_free(struct sip_dialog *dialog);
 
+/**
+ * Drop cached in-dialog request headers
+ *
+ * Must be called when tags, Call-ID or routes of the dialog change.
+ *
+ * @param dialog (in) Dialog
+ */
+void sipe_dialog_headers_reset(struct sip_dialog *dialog);
+
+/**
+ * Update round trip time estimate with a new measurement
+ *
+ * @param dialog (in) Dialog
+ * @param sent   (in) sipe_utils_monotonic_msec() when the request was sent
+ */
+void sipe_dialog_rtt_sample(struct sip_dialog *dialog, gint64 sent);
+
 /**
  * Add a new, empty dialog to a session
  *
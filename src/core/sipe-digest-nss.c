@@ -152,6 +152,67 @@ void sipe_digest_hmac_sha1(const guchar *key, gsize key_length,
 	sipe_digest_hmac(CKM_SHA_1_HMAC, key, key_length, data, data_length, digest, SIPE_DIGEST_HMAC_SHA1_LENGTH);
 }
 
+/* Keyed HMAC(MD5/SHA-1) contexts */
+struct sipe_digest_hmac_context {
+	PK11Context *context;
+	gsize length;
+};
+
+static gpointer sipe_digest_hmac_start(CK_MECHANISM_TYPE hmacMech,
+				       const guchar *key, gsize key_length,
+				       gsize digest_length)
+{
+	struct sipe_digest_hmac_context *ctx = g_new0(struct sipe_digest_hmac_context, 1);
+	ctx->context = sipe_digest_hmac_ctx_create(hmacMech, key, key_length);
+	ctx->length  = digest_length;
+	return(ctx);
+}
+
+gpointer sipe_digest_hmac_md5_start(const guchar *key, gsize key_length)
+{
+	return(sipe_digest_hmac_start(CKM_MD5_HMAC, key, key_length, SIPE_DIGEST_HMAC_MD5_LENGTH));
+}
+
+gpointer sipe_digest_hmac_sha1_start(const guchar *key, gsize key_length)
+{
+	return(sipe_digest_hmac_start(CKM_SHA_1_HMAC, key, key_length, SIPE_DIGEST_HMAC_SHA1_LENGTH));
+}
+
+gpointer sipe_digest_hmac_clone(gpointer context)
+{
+	struct sipe_digest_hmac_context *orig = context;
+	struct sipe_digest_hmac_context *ctx  = g_new0(struct sipe_digest_hmac_context, 1);
+	ctx->context = PK11_CloneContext(orig->context);
+	ctx->length  = orig->length;
+	return(ctx);
+}
+
+void sipe_digest_hmac_update(gpointer context, const guchar *data, gsize length)
+{
+	sipe_digest_ctx_append(((struct sipe_digest_hmac_context *) context)->context,
+			       data, length);
+}
+
+void sipe_digest_hmac_end(gpointer context, guchar *digest)
+{
+	struct sipe_digest_hmac_context *ctx = context;
+	sipe_digest_ctx_digest(ctx->context, digest, ctx->length);
+	PK11_DigestBegin(ctx->context);
+}
+
+void sipe_digest_hmac_reset(gpointer context)
+{
+	/* the key stays attached to the context */
+	PK11_DigestBegin(((struct sipe_digest_hmac_context *) context)->context);
+}
+
+void sipe_digest_hmac_destroy(gpointer context)
+{
+	struct sipe_digest_hmac_context *ctx = context;
+	sipe_digest_ctx_destroy(ctx->context);
+	g_free(ctx);
+}
+
 /* Stream HMAC(SHA1) digest for file transfer */
 gpointer sipe_digest_ft_start(const guchar *sha1_digest)
 {
@@ -58,6 +58,57 @@ void sipe_digest_hmac_sha1(const guchar *key, gsize key_length,
 	HMAC(EVP_sha1(), key, key_length, data, data_length, digest, NULL);
 }
 
+/* Keyed HMAC(MD5/SHA-1) contexts */
+static gpointer sipe_digest_hmac_start(const EVP_MD *md,
+				       const guchar *key, gsize key_length)
+{
+	HMAC_CTX *ctx = g_malloc(sizeof(HMAC_CTX));
+	HMAC_CTX_init(ctx);
+	HMAC_Init_ex(ctx, key, key_length, md, NULL);
+	return(ctx);
+}
+
+gpointer sipe_digest_hmac_md5_start(const guchar *key, gsize key_length)
+{
+	return(sipe_digest_hmac_start(EVP_md5(), key, key_length));
+}
+
+gpointer sipe_digest_hmac_sha1_start(const guchar *key, gsize key_length)
+{
+	return(sipe_digest_hmac_start(EVP_sha1(), key, key_length));
+}
+
+gpointer sipe_digest_hmac_clone(gpointer context)
+{
+	HMAC_CTX *ctx = g_malloc(sizeof(HMAC_CTX));
+	HMAC_CTX_init(ctx);
+	HMAC_CTX_copy(ctx, context);
+	return(ctx);
+}
+
+void sipe_digest_hmac_update(gpointer context, const guchar *data, gsize length)
+{
+	HMAC_Update(context, data, length);
+}
+
+void sipe_digest_hmac_end(gpointer context, guchar *digest)
+{
+	HMAC_Final(context, digest, NULL);
+	sipe_digest_hmac_reset(context);
+}
+
+void sipe_digest_hmac_reset(gpointer context)
+{
+	/* NULL key & digest: restart with precomputed pads */
+	HMAC_Init_ex(context, NULL, 0, NULL, NULL);
+}
+
+void sipe_digest_hmac_destroy(gpointer context)
+{
+	HMAC_CTX_cleanup(context);
+	g_free(context);
+}
+
 /* Stream HMAC(SHA1) digest for file transfer */
 gpointer sipe_digest_ft_start(const guchar *sha1_digest)
 {
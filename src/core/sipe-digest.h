@@ -38,6 +38,21 @@ void sipe_digest_hmac_sha1(const guchar *key, gsize key_length,
 			  const guchar *data, gsize data_length,
 			  guchar *digest);
 
+/*
+ * Keyed HMAC(MD5/SHA-1) contexts
+ *
+ * The key setup, i.e. hashing of the inner and outer pads, is only done
+ * once in _start(). _end() returns the digest and resets the context to
+ * the keyed initial state, so it can be used for the next message.
+ */
+gpointer sipe_digest_hmac_md5_start(const guchar *key, gsize key_length);
+gpointer sipe_digest_hmac_sha1_start(const guchar *key, gsize key_length);
+gpointer sipe_digest_hmac_clone(gpointer context);
+void sipe_digest_hmac_update(gpointer context, const guchar *data, gsize length);
+void sipe_digest_hmac_end(gpointer context, guchar *digest);
+void sipe_digest_hmac_reset(gpointer context);
+void sipe_digest_hmac_destroy(gpointer context);
+
 /* Stream HMAC(SHA1) digest for file transfer */
 #define SIPE_DIGEST_FILETRANSFER_LENGTH SIPE_DIGEST_SHA1_LENGTH
 gpointer sipe_digest_ft_start(const guchar *sha1_digest);
@@ -0,0 +1,430 @@
+/**
+ * @file sipe-directory-cache.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * File format:
+ *
+ *   "SIPEDIR1" LF expiration time LF change key LF
+ *   { property type TAB escaped property value LF }
+ *
+ * The file name is the SHA-1 digest of the buddy URI.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sipe-backend.h"
+#include "sipe-cache.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-digest.h"
+#include "sipe-directory-cache.h"
+#include "sipe-metrics.h"
+#include "sipe-utils.h"
+
+#define DIRECTORY_CACHE_MAGIC "SIPEDIR1\n"
+#define DIRECTORY_CACHE_SIZE  256
+#define DIRECTORY_CACHE_TTL   (4 * 60 * 60) /* seconds */
+
+struct directory_cache_entry {
+	gchar *uri;
+	gchar *change_key;
+	time_t expires;
+	GSList *properties;
+	GList *link;         /* in LRU queue */
+};
+
+struct sipe_directory_cache {
+	GHashTable *entries; /* key: URI */
+	GQueue *lru;         /* head: most recently used */
+};
+
+GSList *sipe_directory_property_add(GSList *properties,
+				    sipe_buddy_info_fields type,
+				    const gchar *value)
+{
+	struct sipe_directory_property *property;
+
+	if (is_empty(value))
+		return(properties);
+
+	property = g_new(struct sipe_directory_property, 1);
+	property->type  = type;
+	property->value = g_strdup(value);
+	return(g_slist_append(properties, property));
+}
+
+void sipe_directory_properties_free(GSList *properties)
+{
+	GSList *entry;
+
+	for (entry = properties; entry; entry = entry->next) {
+		struct sipe_directory_property *property = entry->data;
+		g_free(property->value);
+		g_free(property);
+	}
+	g_slist_free(properties);
+}
+
+static void directory_cache_entry_free(gpointer data)
+{
+	struct directory_cache_entry *entry = data;
+
+	sipe_directory_properties_free(entry->properties);
+	g_free(entry->change_key);
+	g_free(entry->uri);
+	g_free(entry);
+}
+
+static struct sipe_directory_cache *directory_cache(struct sipe_core_private *sipe_private)
+{
+	struct sipe_directory_cache *cache = sipe_private->directory_cache;
+
+	if (!cache) {
+		cache = sipe_private->directory_cache = g_new(struct sipe_directory_cache, 1);
+		/* entry owns the key */
+		cache->entries = g_hash_table_new_full(g_str_hash,
+						       g_str_equal,
+						       NULL,
+						       directory_cache_entry_free);
+		cache->lru     = g_queue_new();
+	}
+
+	return(cache);
+}
+
+static void directory_cache_remove(struct sipe_directory_cache *cache,
+				   struct directory_cache_entry *entry)
+{
+	g_queue_delete_link(cache->lru, entry->link);
+	g_hash_table_remove(cache->entries, entry->uri);
+}
+
+static void directory_cache_insert(struct sipe_directory_cache *cache,
+				   struct directory_cache_entry *entry)
+{
+	struct directory_cache_entry *old = g_hash_table_lookup(cache->entries,
+								entry->uri);
+	if (old)
+		directory_cache_remove(cache, old);
+
+	g_queue_push_head(cache->lru, entry);
+	entry->link = cache->lru->head;
+	g_hash_table_insert(cache->entries, entry->uri, entry);
+
+	/* evict least recently used */
+	while (g_queue_get_length(cache->lru) > DIRECTORY_CACHE_SIZE)
+		directory_cache_remove(cache, cache->lru->tail->data);
+}
+
+static gchar *directory_cache_filename(struct sipe_core_private *sipe_private,
+				       const gchar *uri)
+{
+	gchar *name = g_strdup(sipe_private->username);
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+	gchar *digest_string;
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	sipe_digest_sha1((const guchar *) uri, strlen(uri), digest);
+	digest_string = buff_to_hex_str(digest, SIPE_DIGEST_SHA1_LENGTH);
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    "directory",
+				    digest_string,
+				    NULL);
+	g_free(digest_string);
+	g_free(name);
+
+	return(filename);
+}
+
+static struct directory_cache_entry *directory_cache_read(struct sipe_core_private *sipe_private,
+							  const gchar *uri)
+{
+	gchar *filename = directory_cache_filename(sipe_private, uri);
+	struct directory_cache_entry *entry = NULL;
+	gchar *contents;
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		gchar **lines = g_strsplit(contents, "\n", 0);
+
+		if (g_str_has_prefix(contents, DIRECTORY_CACHE_MAGIC) &&
+		    lines[1] && lines[2]) {
+			gchar **line;
+
+			entry = g_new0(struct directory_cache_entry, 1);
+			entry->uri        = g_strdup(uri);
+			entry->expires    = strtoul(lines[1], NULL, 10);
+			entry->change_key = *lines[2] ? g_strdup(lines[2]) : NULL;
+
+			for (line = lines + 3; *line; line++) {
+				gchar *tab = strchr(*line, '\t');
+				if (tab) {
+					gchar *value = g_strcompress(tab + 1);
+					entry->properties = sipe_directory_property_add(entry->properties,
+											strtoul(*line, NULL, 10),
+											value);
+					g_free(value);
+				}
+			}
+		} else {
+			SIPE_DEBUG_INFO("directory_cache_read: ignoring corrupted file '%s'",
+					filename);
+		}
+
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	g_free(filename);
+
+	return(entry);
+}
+
+static void directory_cache_write(struct sipe_core_private *sipe_private,
+				  const struct directory_cache_entry *entry)
+{
+	gchar *filename;
+	gchar *dirname;
+	GString *buffer;
+	GSList *list;
+	GError *error = NULL;
+
+	/* line based header */
+	if (entry->change_key && strpbrk(entry->change_key, "\r\n"))
+		return;
+
+	buffer = g_string_new(DIRECTORY_CACHE_MAGIC);
+	g_string_append_printf(buffer, "%lu\n%s\n",
+			       (gulong) entry->expires,
+			       entry->change_key ? entry->change_key : "");
+	for (list = entry->properties; list; list = list->next) {
+		const struct sipe_directory_property *property = list->data;
+		/* escapes all control characters, i.e. also LF */
+		gchar *value = g_strescape(property->value, NULL);
+		g_string_append_printf(buffer, "%u\t%s\n",
+				       (guint) property->type,
+				       value);
+		g_free(value);
+	}
+
+	filename = directory_cache_filename(sipe_private, entry->uri);
+	dirname  = g_path_get_dirname(filename);
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(filename, buffer->str, buffer->len, &error))) {
+		SIPE_DEBUG_ERROR("directory_cache_write: can't write '%s': %s",
+				 filename,
+				 error ? error->message : "can't create directory");
+		if (error)
+			g_error_free(error);
+	}
+	g_free(dirname);
+	g_free(filename);
+	g_string_free(buffer, TRUE);
+}
+
+static void directory_cache_unlink(struct sipe_core_private *sipe_private,
+				   const gchar *uri)
+{
+	gchar *filename = directory_cache_filename(sipe_private, uri);
+	g_unlink(filename);
+	g_free(filename);
+}
+
+const GSList *sipe_directory_cache_lookup(struct sipe_core_private *sipe_private,
+					  const gchar *uri,
+					  const gchar *change_key)
+{
+	struct sipe_directory_cache *cache;
+	struct directory_cache_entry *entry;
+
+	if (is_empty(uri))
+		return(NULL);
+
+	cache = directory_cache(sipe_private);
+	entry = g_hash_table_lookup(cache->entries, uri);
+	if (entry) {
+		/* move to front */
+		g_queue_unlink(cache->lru, entry->link);
+		g_queue_push_head_link(cache->lru, entry->link);
+	} else {
+		entry = directory_cache_read(sipe_private, uri);
+		if (!entry) {
+			sipe_cache_lookup(sipe_private, SIPE_CACHE_DIRECTORY, FALSE);
+			return(NULL);
+		}
+		directory_cache_insert(cache, entry);
+		sipe_cache_stored(sipe_private, SIPE_CACHE_DIRECTORY);
+	}
+
+	if (entry->expires <= time(NULL)) {
+		SIPE_DEBUG_INFO("sipe_directory_cache_lookup: '%s' expired", uri);
+	} else if (change_key && !sipe_strequal(change_key, entry->change_key)) {
+		SIPE_DEBUG_INFO("sipe_directory_cache_lookup: '%s' change key '%s' -> '%s'",
+				uri,
+				entry->change_key ? entry->change_key : "",
+				change_key);
+	} else {
+		SIPE_DEBUG_INFO("sipe_directory_cache_lookup: '%s' found", uri);
+		sipe_cache_lookup(sipe_private, SIPE_CACHE_DIRECTORY, TRUE);
+		return(entry->properties);
+	}
+
+	sipe_cache_lookup(sipe_private, SIPE_CACHE_DIRECTORY, FALSE);
+
+	directory_cache_remove(cache, entry);
+	directory_cache_unlink(sipe_private, uri);
+	return(NULL);
+}
+
+void sipe_directory_cache_store(struct sipe_core_private *sipe_private,
+				const gchar *uri,
+				const gchar *change_key,
+				GSList *properties)
+{
+	struct directory_cache_entry *entry;
+
+	if (is_empty(uri) || !properties) {
+		sipe_directory_properties_free(properties);
+		return;
+	}
+
+	entry = g_new0(struct directory_cache_entry, 1);
+	entry->uri        = g_strdup(uri);
+	entry->change_key = g_strdup(change_key);
+	entry->expires    = time(NULL) + DIRECTORY_CACHE_TTL;
+	entry->properties = properties;
+
+	directory_cache_write(sipe_private, entry);
+	directory_cache_insert(directory_cache(sipe_private), entry);
+	sipe_cache_stored(sipe_private, SIPE_CACHE_DIRECTORY);
+}
+
+void sipe_directory_cache_invalidate(struct sipe_core_private *sipe_private,
+				     const gchar *uri)
+{
+	struct sipe_directory_cache *cache = sipe_private->directory_cache;
+	struct directory_cache_entry *entry;
+
+	if (is_empty(uri))
+		return;
+
+	if (cache &&
+	    (entry = g_hash_table_lookup(cache->entries, uri)) != NULL)
+		directory_cache_remove(cache, entry);
+	directory_cache_unlink(sipe_private, uri);
+}
+
+void sipe_directory_cache_free(struct sipe_core_private *sipe_private)
+{
+	struct sipe_directory_cache *cache = sipe_private->directory_cache;
+
+	if (!cache)
+		return;
+
+	g_queue_free(cache->lru);
+	g_hash_table_destroy(cache->entries);
+	g_free(cache);
+	sipe_private->directory_cache = NULL;
+}
+
+static void directory_cache_entry_usage(const struct directory_cache_entry *entry,
+					struct sipe_memory_usage *usage)
+{
+	const GSList *property;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct directory_cache_entry));
+	sipe_metrics_memory_string(usage, entry->uri);
+	sipe_metrics_memory_string(usage, entry->change_key);
+	sipe_metrics_memory_list(usage, g_slist_length(entry->properties));
+	for (property = entry->properties; property; property = property->next) {
+		const struct sipe_directory_property *p = property->data;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_directory_property));
+		sipe_metrics_memory_string(usage, p->value);
+	}
+}
+
+void sipe_directory_cache_memory_usage(struct sipe_core_private *sipe_private,
+				       struct sipe_memory_usage *usage)
+{
+	struct sipe_directory_cache *cache = sipe_private->directory_cache;
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!cache)
+		return;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_directory_cache));
+	sipe_metrics_memory_hash(usage, cache->entries);
+	sipe_metrics_memory_list(usage, g_queue_get_length(cache->lru));
+
+	g_hash_table_iter_init(&iter, cache->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		directory_cache_entry_usage(value, usage);
+}
+
+void sipe_directory_cache_shrink(struct sipe_core_private *sipe_private,
+				 gsize target)
+{
+	struct sipe_directory_cache *cache = sipe_private->directory_cache;
+	struct sipe_memory_usage usage = { 0, 0 };
+	guint evicted = 0;
+
+	if (!cache)
+		return;
+
+	/* evicted entries are still on disk */
+	sipe_directory_cache_memory_usage(sipe_private, &usage);
+	while ((usage.bytes > target) && cache->lru->tail) {
+		struct directory_cache_entry *entry = cache->lru->tail->data;
+		struct sipe_memory_usage entry_usage = { 0, 0 };
+
+		directory_cache_entry_usage(entry, &entry_usage);
+		usage.bytes -= MIN(usage.bytes, entry_usage.bytes);
+		directory_cache_remove(cache, entry);
+		evicted++;
+	}
+
+	if (evicted) {
+		SIPE_DEBUG_INFO("sipe_directory_cache_shrink: evicted %u entries",
+				evicted);
+		sipe_cache_evicted(sipe_private, SIPE_CACHE_DIRECTORY, evicted);
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
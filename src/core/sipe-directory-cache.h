@@ -0,0 +1,135 @@
+/**
+ * @file sipe-directory-cache.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Directory (address book) cache for buddy information
+ *
+ * Bounded in-memory LRU backed by one file per buddy URI in the user
+ * cache directory. An entry is used until it expires, or until the
+ * buddy reports a different Exchange change key.
+ *
+ * Needs sipe-backend.h for sipe_buddy_info_fields.
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_memory_usage;
+
+struct sipe_directory_property {
+	sipe_buddy_info_fields type;
+	gchar *value;
+};
+
+/**
+ * Add property to a list of directory properties
+ *
+ * @param properties list of struct sipe_directory_property (may be @c NULL)
+ * @param type       property type
+ * @param value      property value (ignored if empty)
+ *
+ * @return new list head
+ */
+GSList *sipe_directory_property_add(GSList *properties,
+				    sipe_buddy_info_fields type,
+				    const gchar *value);
+
+/**
+ * Free a list of directory properties
+ *
+ * @param properties list of struct sipe_directory_property
+ */
+void sipe_directory_properties_free(GSList *properties);
+
+/**
+ * Look up cached directory information
+ *
+ * Entries not in memory are loaded from disk.
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ * @param change_key   current Exchange change key of the buddy (may be @c NULL)
+ *
+ * @return list of struct sipe_directory_property in insertion order or
+ *         @c NULL. Owned by the cache, only valid until the next call.
+ */
+const GSList *sipe_directory_cache_lookup(struct sipe_core_private *sipe_private,
+					  const gchar *uri,
+					  const gchar *change_key);
+
+/**
+ * Add directory information to cache
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ * @param change_key   Exchange change key of the buddy (may be @c NULL)
+ * @param properties   list of struct sipe_directory_property in insertion
+ *                     order. The cache takes ownership.
+ */
+void sipe_directory_cache_store(struct sipe_core_private *sipe_private,
+				const gchar *uri,
+				const gchar *change_key,
+				GSList *properties);
+
+/**
+ * Drop cached directory information for a buddy
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ */
+void sipe_directory_cache_invalidate(struct sipe_core_private *sipe_private,
+				     const gchar *uri);
+
+/**
+ * Free in-memory directory cache
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_directory_cache_free(struct sipe_core_private *sipe_private);
+
+/**
+ * Estimate memory used by in-memory directory cache
+ *
+ * @param sipe_private SIPE core private data
+ * @param usage        accumulated memory usage
+ */
+void sipe_directory_cache_memory_usage(struct sipe_core_private *sipe_private,
+				       struct sipe_memory_usage *usage);
+
+/**
+ * Evict least recently used entries from memory
+ *
+ * Evicted entries are still available from the cache directory.
+ *
+ * @param sipe_private SIPE core private data
+ * @param target       estimated size in bytes to shrink to
+ */
+void sipe_directory_cache_shrink(struct sipe_core_private *sipe_private,
+				 gsize target);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -75,9 +75,11 @@ Similar functionality for iCalendar/CalDAV/Google would be great to implement to
 #include "sipe-cal.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-digest.h"
 #include "sipe-domino.h"
 #include "sipe-http.h"
 #include "sipe-nls.h"
+#include "sipe-status.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
@@ -146,29 +148,54 @@ static char *
 sipe_domino_get_free_busy(time_t fb_start,
 			  GSList *cal_events)
 {
+	const int slots = SIPE_FREE_BUSY_PERIOD_SEC / SIPE_FREE_BUSY_GRANULARITY_SEC;
 	GSList *entry = cal_events;
 	char *res;
 
 	if (!cal_events) return NULL;
 
-	res = g_strnfill(SIPE_FREE_BUSY_PERIOD_SEC / SIPE_FREE_BUSY_GRANULARITY_SEC,
-			 SIPE_CAL_FREE + '0');
+	res = g_strnfill(slots, SIPE_CAL_FREE + '0');
 
 	while (entry) {
 		struct sipe_cal_event *cal_event = entry->data;
 		int start = sipe_domino_get_slot_no(fb_start, cal_event->start_time);
 		int end = sipe_domino_get_slot_no(fb_start, (cal_event->end_time - 1));
-		int i;
 
-		for (i = start; i <= end; i++) {
-			res[i] = SIPE_CAL_BUSY + '0';
-		}
+		/* view may return events overlapping the period boundaries */
+		if (start < 0) start = 0;
+		if (end >= slots) end = slots - 1;
+
+		/* mark whole slot range at once */
+		if ((cal_event->end_time > fb_start) && (start <= end))
+			memset(res + start, SIPE_CAL_BUSY + '0', end - start + 1);
+
 		entry = entry->next;
 	}
 	SIPE_DEBUG_INFO("sipe_domino_get_free_busy: res=\n%s", res);
 	return res;
 }
 
+/* view content without the volatile "timestamp" attribute of <viewentries> */
+static gchar *
+sipe_domino_view_hash(time_t fb_start,
+		      const gchar *body)
+{
+	const gchar *entries = strstr(body, "<viewentry ");
+	gchar *start_str = sipe_utils_time_to_str(fb_start);
+	gchar *tmp = g_strdup_printf("%s\n%s",
+				     start_str,
+				     entries ? entries : "");
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+	gchar *hash;
+
+	sipe_digest_sha1((guchar *) tmp, strlen(tmp), digest);
+	hash = buff_to_hex_str(digest, sizeof(digest));
+
+	g_free(tmp);
+	g_free(start_str);
+	return(hash);
+}
+
 static void sipe_domino_process_calendar_response(struct sipe_core_private *sipe_private,
 						  guint status,
 						  GSList *headers,
@@ -188,11 +215,32 @@ static void sipe_domino_process_calendar_response(struct sipe_core_private *sipe
 		return;
 	}
 
-	if ((status == SIPE_HTTP_STATUS_OK) && body) {
+	if (status == SIPE_HTTP_STATUS_NOT_MODIFIED) {
+		/* conditional request: parsed view is still valid */
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_domino_process_calendar_response: calendar NOT modified");
+
+	} else if ((status == SIPE_HTTP_STATUS_OK) && body) {
 		const sipe_xml *node, *node2, *node3;
 		sipe_xml *xml;
+		gchar *hash = sipe_domino_view_hash(cal->fb_start, body);
 
 		SIPE_DEBUG_INFO("sipe_domino_process_calendar_response: SUCCESS, ret=%d", status);
+
+		g_free(cal->domino_last_modified);
+		cal->domino_last_modified = g_strdup(sipe_utils_nameval_find(headers,
+									     "Last-Modified"));
+
+		/* server ignored or doesn't support conditional requests */
+		if (sipe_strequal(hash, cal->domino_hash)) {
+			SIPE_DEBUG_INFO_NOFORMAT("sipe_domino_process_calendar_response: calendar view has NOT changed");
+			g_free(hash);
+			sipe_http_session_close(cal->session);
+			cal->session = NULL;
+			return;
+		}
+		g_free(cal->domino_hash);
+		cal->domino_hash = hash;
+
 		xml = sipe_xml_parse(body, strlen(body));
 
 		sipe_cal_events_free(cal->cal_events);
@@ -279,7 +327,7 @@ static void sipe_domino_process_calendar_response(struct sipe_core_private *sipe
 
 		/* update SIP server */
 		cal->is_updated = TRUE;
-		sipe_cal_presence_publish(sipe_private, TRUE);
+		sipe_status_publish(sipe_private, TRUE, FALSE);
 
 	} else if (!headers) {
 		SIPE_DEBUG_INFO("sipe_domino_process_calendar_response: rather FAILURE, ret=%d", status);
@@ -319,6 +367,8 @@ static void sipe_domino_do_calendar_request(struct sipe_calendar *cal)
 	if (cal->domino_url) {
 		char *url_req;
 		char *url;
+		gchar *conditional = NULL;
+		time_t fb_start;
 		time_t end;
 		time_t now = time(NULL);
 		char *start_str;
@@ -332,8 +382,18 @@ static void sipe_domino_do_calendar_request(struct sipe_calendar *cal)
 		now_tm->tm_sec = 0;
 		now_tm->tm_min = 0;
 		now_tm->tm_hour = 0;
-		cal->fb_start = sipe_mktime_tz(now_tm, "UTC");
-		cal->fb_start -= 24*60*60;
+		fb_start = sipe_mktime_utc(now_tm) - 24*60*60;
+
+		/* same period: only fetch the view if it has been modified */
+		if ((fb_start == cal->fb_start) && cal->domino_last_modified) {
+			conditional = g_strdup_printf("If-Modified-Since: %s\r\n",
+						      cal->domino_last_modified);
+		} else {
+			g_free(cal->domino_last_modified);
+			cal->domino_last_modified = NULL;
+		}
+		cal->fb_start = fb_start;
+
 		/* end = start + 4 days - 1 sec */
 		end = cal->fb_start + SIPE_FREE_BUSY_PERIOD_SEC - 1;
 
@@ -348,9 +408,10 @@ static void sipe_domino_do_calendar_request(struct sipe_calendar *cal)
 		g_free(url_req);
 		cal->request = sipe_http_request_get(cal->sipe_private,
 						     url,
-						     NULL,
+						     conditional,
 						     sipe_domino_process_calendar_response,
 						     cal);
+		g_free(conditional);
 		g_free(url);
 
 		sipe_domino_send_http_request(cal);
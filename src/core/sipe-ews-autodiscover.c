@@ -31,6 +31,7 @@
  */
 
 #include <string.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -43,6 +44,10 @@
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
+/* discovered URLs are reused for this many seconds */
+#define AUTODISCOVER_CACHE_TTL   (24 * 60 * 60)
+#define AUTODISCOVER_CACHE_MAGIC "SIPEAUTODISCOVER1\n"
+
 struct sipe_ews_autodiscover_cb {
 	sipe_ews_autodiscover_callback *cb;
 	gpointer cb_data;
@@ -53,22 +58,161 @@ struct autodiscover_method {
 	gboolean redirect;
 };
 
+/* one candidate URL, all candidates are tried in parallel */
+struct autodiscover_probe {
+	struct sipe_ews_autodiscover *sea;
+	struct sipe_http_request *request;
+	const struct autodiscover_method *method;
+	gboolean retried;
+};
+
 struct sipe_ews_autodiscover {
 	struct sipe_ews_autodiscover_data *data;
-	struct sipe_http_request *request;
+	GSList *probes;
 	GSList *callbacks;
 	gchar *email;
-	const struct autodiscover_method *method;
-	gboolean retry;
+	gboolean started;
 	gboolean completed;
 };
 
+static void sipe_ews_autodiscover_data_free(struct sipe_ews_autodiscover_data *ews_data)
+{
+	if (ews_data) {
+		g_free((gchar *)ews_data->as_url);
+		g_free((gchar *)ews_data->ews_url);
+		g_free((gchar *)ews_data->legacy_dn);
+		g_free((gchar *)ews_data->oab_url);
+		g_free((gchar *)ews_data->oof_url);
+		g_free(ews_data);
+	}
+}
+
+static gchar *autodiscover_cache_filename(struct sipe_core_private *sipe_private)
+{
+	gchar *name = g_strdup(sipe_private->username);
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    "autodiscover",
+				    NULL);
+	g_free(name);
+
+	return(filename);
+}
+
+/*
+ * Cache file format: magic line followed by one line for each of
+ *
+ *   expiration time, email address, LegacyDN, AS, EWS, OAB, OOF URL
+ */
+static struct sipe_ews_autodiscover_data *autodiscover_cache_load(struct sipe_core_private *sipe_private)
+{
+	struct sipe_ews_autodiscover_data *ews_data = NULL;
+	gchar *filename = autodiscover_cache_filename(sipe_private);
+	gchar *contents;
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		gchar **lines = NULL;
+
+		if (g_str_has_prefix(contents, AUTODISCOVER_CACHE_MAGIC))
+			lines = g_strsplit(contents + strlen(AUTODISCOVER_CACHE_MAGIC),
+					   "\n",
+					   0);
+
+		if (lines && (g_strv_length(lines) >= 7)) {
+			time_t expires = g_ascii_strtoll(lines[0], NULL, 10);
+
+			if ((expires > time(NULL)) &&
+			    sipe_strcase_equal(lines[1], sipe_private->email)) {
+#define _FIELD(i) (is_empty(lines[i]) ? NULL : g_strdup(lines[i]))
+				ews_data = g_new0(struct sipe_ews_autodiscover_data, 1);
+				ews_data->legacy_dn = _FIELD(2);
+				ews_data->as_url    = _FIELD(3);
+				ews_data->ews_url   = _FIELD(4);
+				ews_data->oab_url   = _FIELD(5);
+				ews_data->oof_url   = _FIELD(6);
+#undef _FIELD
+				SIPE_DEBUG_INFO("autodiscover_cache_load: using cached EWS URL '%s'",
+						ews_data->ews_url ? ews_data->ews_url : "<NOT FOUND>");
+			}
+		}
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	g_free(filename);
+
+	return(ews_data);
+}
+
+static void autodiscover_cache_save(struct sipe_core_private *sipe_private,
+				    const struct sipe_ews_autodiscover_data *ews_data)
+{
+	const gchar *fields[] = {
+		sipe_private->email,
+		ews_data->legacy_dn,
+		ews_data->as_url,
+		ews_data->ews_url,
+		ews_data->oab_url,
+		ews_data->oof_url,
+	};
+	GString *buffer = g_string_new(AUTODISCOVER_CACHE_MAGIC);
+	gchar *filename;
+	gchar *dirname;
+	guint i;
+
+	g_string_append_printf(buffer, "%" G_GINT64_FORMAT "\n",
+			       (gint64) time(NULL) + AUTODISCOVER_CACHE_TTL);
+	for (i = 0; i < G_N_ELEMENTS(fields); i++) {
+		/* line based format */
+		if (fields[i] && strpbrk(fields[i], "\r\n")) {
+			g_string_free(buffer, TRUE);
+			return;
+		}
+		g_string_append_printf(buffer, "%s\n",
+				       fields[i] ? fields[i] : "");
+	}
+
+	filename = autodiscover_cache_filename(sipe_private);
+	dirname  = g_path_get_dirname(filename);
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(filename, buffer->str, buffer->len, NULL)))
+		SIPE_DEBUG_ERROR("autodiscover_cache_save: can't write '%s'",
+				 filename);
+	g_free(dirname);
+	g_free(filename);
+	g_string_free(buffer, TRUE);
+}
+
+static void sipe_ews_autodiscover_probe_free(struct autodiscover_probe *probe)
+{
+	struct sipe_ews_autodiscover *sea = probe->sea;
+
+	if (probe->request)
+		sipe_http_request_cancel(probe->request);
+	sea->probes = g_slist_remove(sea->probes, probe);
+	g_free(probe);
+}
+
+static void sipe_ews_autodiscover_cancel(struct sipe_ews_autodiscover *sea)
+{
+	while (sea->probes)
+		sipe_ews_autodiscover_probe_free(sea->probes->data);
+}
+
 static void sipe_ews_autodiscover_complete(struct sipe_core_private *sipe_private,
 					   struct sipe_ews_autodiscover_data *ews_data)
 {
 	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
 	GSList *entry = sea->callbacks;
 
+	/* first result wins */
+	sipe_ews_autodiscover_cancel(sea);
+
 	while (entry) {
 		struct sipe_ews_autodiscover_cb *sea_cb = entry->data;
 		sea_cb->cb(sipe_private, ews_data, sea_cb->cb_data);
@@ -80,19 +224,35 @@ static void sipe_ews_autodiscover_complete(struct sipe_core_private *sipe_privat
 	sea->completed = TRUE;
 }
 
-static void sipe_ews_autodiscover_request(struct sipe_core_private *sipe_private,
-					  gboolean next_method);
+static void sipe_ews_autodiscover_request(struct sipe_core_private *sipe_private);
+static gboolean sipe_ews_autodiscover_redirect(struct sipe_core_private *sipe_private,
+					       struct autodiscover_probe *probe,
+					       const gchar *url);
 static gboolean sipe_ews_autodiscover_url(struct sipe_core_private *sipe_private,
+					  struct autodiscover_probe *probe,
 					  const gchar *url);
+
+/* candidate has failed: complete when it was the last one */
+static void sipe_ews_autodiscover_failed(struct sipe_core_private *sipe_private,
+					 struct autodiscover_probe *probe)
+{
+	struct sipe_ews_autodiscover *sea = probe->sea;
+
+	sipe_ews_autodiscover_probe_free(probe);
+	if (!sea->probes) {
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_ews_autodiscover_failed: no more methods to try!");
+		sipe_ews_autodiscover_complete(sipe_private, NULL);
+	}
+}
+
 static void sipe_ews_autodiscover_parse(struct sipe_core_private *sipe_private,
+					struct autodiscover_probe *probe,
 					const gchar *body)
 {
 	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
-	struct sipe_ews_autodiscover_data *ews_data = sea->data =
-		g_new0(struct sipe_ews_autodiscover_data, 1);
 	sipe_xml *xml = sipe_xml_parse(body, strlen(body));
 	const sipe_xml *account = sipe_xml_child(xml, "Response/Account");
-	gboolean complete = TRUE;
+	gboolean failed = TRUE;
 
 	/* valid POX autodiscover response? */
 	if (account) {
@@ -100,6 +260,8 @@ static void sipe_ews_autodiscover_parse(struct sipe_core_private *sipe_private,
 
 		/* POX autodiscover settings? */
 		if ((node = sipe_xml_child(account, "Protocol")) != NULL) {
+			struct sipe_ews_autodiscover_data *ews_data = sea->data =
+				g_new0(struct sipe_ews_autodiscover_data, 1);
 
 			/* Autodiscover/Response/User/LegacyDN (requires trimming) */
 			gchar *tmp = sipe_xml_data(sipe_xml_child(xml,
@@ -134,6 +296,11 @@ static void sipe_ews_autodiscover_parse(struct sipe_core_private *sipe_private,
 				g_free(type);
 			}
 
+			sipe_xml_free(xml);
+			autodiscover_cache_save(sipe_private, ews_data);
+			sipe_ews_autodiscover_complete(sipe_private, ews_data);
+			return;
+
 		/* POX autodiscover redirect to new email address? */
 		} else if ((node = sipe_xml_child(account, "RedirectAddr")) != NULL) {
 			gchar *addr = sipe_xml_data(node);
@@ -153,10 +320,10 @@ static void sipe_ews_autodiscover_parse(struct sipe_core_private *sipe_private,
 						sea->email);
 
 				/* restart process with new email address */
-				sea->method = NULL;
-				complete    = FALSE;
-				sipe_ews_autodiscover_request(sipe_private,
-							      TRUE);
+				sipe_xml_free(xml);
+				sipe_ews_autodiscover_cancel(sea);
+				sipe_ews_autodiscover_request(sipe_private);
+				return;
 			}
 			g_free(addr);
 
@@ -167,8 +334,9 @@ static void sipe_ews_autodiscover_parse(struct sipe_core_private *sipe_private,
 			if (!is_empty(url)) {
 				SIPE_DEBUG_INFO("sipe_ews_autodiscover_parse: redirected to URL '%s'",
 						url);
-				complete = !sipe_ews_autodiscover_url(sipe_private,
-								      url);
+				failed = !sipe_ews_autodiscover_url(sipe_private,
+								    probe,
+								    url);
 			}
 			g_free(url);
 
@@ -179,8 +347,8 @@ static void sipe_ews_autodiscover_parse(struct sipe_core_private *sipe_private,
 	}
 	sipe_xml_free(xml);
 
-	if (complete)
-		sipe_ews_autodiscover_complete(sipe_private, ews_data);
+	if (failed)
+		sipe_ews_autodiscover_failed(sipe_private, probe);
 }
 
 static void sipe_ews_autodiscover_response(struct sipe_core_private *sipe_private,
@@ -189,18 +357,19 @@ static void sipe_ews_autodiscover_response(struct sipe_core_private *sipe_privat
 					   const gchar *body,
 					   gpointer data)
 {
-	struct sipe_ews_autodiscover *sea = data;
+	struct autodiscover_probe *probe = data;
 	const gchar *type = sipe_utils_nameval_find(headers, "Content-Type");
+	gboolean failed = TRUE;
 
-	sea->request = NULL;
+	probe->request = NULL;
 
 	switch (status) {
 	case SIPE_HTTP_STATUS_OK:
 		/* only accept XML responses */
-		if (body && g_str_has_prefix(type, "text/xml"))
-			sipe_ews_autodiscover_parse(sipe_private, body);
-		else
-			sipe_ews_autodiscover_request(sipe_private, TRUE);
+		if (body && g_str_has_prefix(type, "text/xml")) {
+			sipe_ews_autodiscover_parse(sipe_private, probe, body);
+			failed = FALSE;
+		}
 		break;
 
 	case SIPE_HTTP_STATUS_CLIENT_FORBIDDEN:
@@ -212,47 +381,59 @@ static void sipe_ews_autodiscover_response(struct sipe_core_private *sipe_privat
 		 *
 		 * Let's try again, but only once...
 		 */
-		sipe_ews_autodiscover_request(sipe_private, !sea->retry);
+		if (!probe->retried) {
+			gchar *url = g_strdup_printf(probe->method->template,
+						     strstr(probe->sea->email, "@") + 1);
+			probe->retried = TRUE;
+			failed = !(probe->method->redirect ?
+				   sipe_ews_autodiscover_redirect(sipe_private, probe, url) :
+				   sipe_ews_autodiscover_url(sipe_private, probe, url));
+			g_free(url);
+		}
 		break;
 
 	case SIPE_HTTP_STATUS_ABORTED:
 		/* we are not allowed to generate new requests */
+		sipe_ews_autodiscover_probe_free(probe);
+		failed = FALSE;
 		break;
 
 	default:
-		sipe_ews_autodiscover_request(sipe_private, TRUE);
 		break;
 	}
+
+	if (failed)
+		sipe_ews_autodiscover_failed(sipe_private, probe);
 }
 
 static gboolean sipe_ews_autodiscover_url(struct sipe_core_private *sipe_private,
+					  struct autodiscover_probe *probe,
 					  const gchar *url)
 {
-	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
 	gchar *body = g_strdup_printf("<Autodiscover xmlns=\"http://schemas.microsoft.com/exchange/autodiscover/outlook/requestschema/2006\">"
 				      " <Request>"
 				      "  <EMailAddress>%s</EMailAddress>"
 				      "  <AcceptableResponseSchema>http://schemas.microsoft.com/exchange/autodiscover/outlook/responseschema/2006a</AcceptableResponseSchema>"
 				      " </Request>"
 				      "</Autodiscover>",
-				      sea->email);
+				      probe->sea->email);
 
 	SIPE_DEBUG_INFO("sipe_ews_autodiscover_url: trying '%s'", url);
 
-	sea->request = sipe_http_request_post(sipe_private,
-					      url,
-					      "Accept: text/xml\r\n",
-					      body,
-					      "text/xml",
-					      sipe_ews_autodiscover_response,
-					      sea);
+	probe->request = sipe_http_request_post(sipe_private,
+						url,
+						"Accept: text/xml\r\n",
+						body,
+						"text/xml",
+						sipe_ews_autodiscover_response,
+						probe);
 	g_free(body);
 
-	if (sea->request) {
+	if (probe->request) {
 		sipe_core_email_authentication(sipe_private,
-					       sea->request);
-		sipe_http_request_allow_redirect(sea->request);
-		sipe_http_request_ready(sea->request);
+					       probe->request);
+		sipe_http_request_allow_redirect(probe->request);
+		sipe_http_request_ready(probe->request);
 		return(TRUE);
 	}
 
@@ -265,10 +446,15 @@ static void sipe_ews_autodiscover_redirect_response(struct sipe_core_private *si
 						    SIPE_UNUSED_PARAMETER const gchar *body,
 						    gpointer data)
 {
-	struct sipe_ews_autodiscover *sea = data;
-	gboolean failed = (status != (guint) SIPE_HTTP_STATUS_ABORTED);
+	struct autodiscover_probe *probe = data;
+	gboolean failed = TRUE;
 
-	sea->request = NULL;
+	probe->request = NULL;
+
+	if (status == (guint) SIPE_HTTP_STATUS_ABORTED) {
+		sipe_ews_autodiscover_probe_free(probe);
+		return;
+	}
 
 	/* Start attempt with URL from redirect (3xx) response */
 	if ((status >= SIPE_HTTP_STATUS_REDIRECTION) &&
@@ -278,36 +464,37 @@ static void sipe_ews_autodiscover_redirect_response(struct sipe_core_private *si
 									 0);
 		if (location)
 			failed = !sipe_ews_autodiscover_url(sipe_private,
+							    probe,
 							    location);
 	}
 
 	if (failed)
-		sipe_ews_autodiscover_request(sipe_private, TRUE);
+		sipe_ews_autodiscover_failed(sipe_private, probe);
 }
 
 static gboolean sipe_ews_autodiscover_redirect(struct sipe_core_private *sipe_private,
+					       struct autodiscover_probe *probe,
 					       const gchar *url)
 {
-	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
-
 	SIPE_DEBUG_INFO("sipe_ews_autodiscover_redirect: trying '%s'", url);
 
-	sea->request = sipe_http_request_get(sipe_private,
-					     url,
-					     NULL,
-					     sipe_ews_autodiscover_redirect_response,
-					     sea);
+	probe->request = sipe_http_request_get(sipe_private,
+					       url,
+					       NULL,
+					       sipe_ews_autodiscover_redirect_response,
+					       probe);
 
-	if (sea->request) {
-		sipe_http_request_ready(sea->request);
+	if (probe->request) {
+		sipe_http_request_allow_pipelining(probe->request);
+		sipe_http_request_ready(probe->request);
 		return(TRUE);
 	}
 
 	return(FALSE);
 }
 
-static void sipe_ews_autodiscover_request(struct sipe_core_private *sipe_private,
-					  gboolean next_method)
+/* start all candidates at once */
+static void sipe_ews_autodiscover_request(struct sipe_core_private *sipe_private)
 {
 	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
 	static const struct autodiscover_method methods[] = {
@@ -317,26 +504,26 @@ static void sipe_ews_autodiscover_request(struct sipe_core_private *sipe_private
 		{ "https://%s/Autodiscover/Autodiscover.xml",              FALSE },
 		{ NULL,                                                    FALSE },
 	};
+	const struct autodiscover_method *method;
 
-	sea->retry = next_method;
-	if (sea->method) {
-		if (next_method)
-			sea->method++;
-	} else
-		sea->method = methods;
-
-	if (sea->method->template) {
-		gchar *url = g_strdup_printf(sea->method->template,
+	for (method = methods; method->template; method++) {
+		struct autodiscover_probe *probe = g_new0(struct autodiscover_probe, 1);
+		gchar *url = g_strdup_printf(method->template,
 					     strstr(sea->email, "@") + 1);
 
-		if (!(sea->method->redirect ?
-		      sipe_ews_autodiscover_redirect(sipe_private, url) :
-		      sipe_ews_autodiscover_url(sipe_private, url)))
-			sipe_ews_autodiscover_request(sipe_private, TRUE);
+		probe->sea    = sea;
+		probe->method = method;
+		sea->probes   = g_slist_append(sea->probes, probe);
+
+		if (!(method->redirect ?
+		      sipe_ews_autodiscover_redirect(sipe_private, probe, url) :
+		      sipe_ews_autodiscover_url(sipe_private, probe, url)))
+			sipe_ews_autodiscover_probe_free(probe);
 
 		g_free(url);
+	}
 
-	} else {
+	if (!sea->probes) {
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_ews_autodiscover_request: no more methods to try!");
 		sipe_ews_autodiscover_complete(sipe_private, NULL);
 	}
@@ -348,6 +535,13 @@ void sipe_ews_autodiscover_start(struct sipe_core_private *sipe_private,
 {
 	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
 
+	/* results from a previous login? */
+	if (!sea->started && !sea->completed) {
+		sea->data = autodiscover_cache_load(sipe_private);
+		if (sea->data)
+			sea->completed = TRUE;
+	}
+
 	if (sea->completed) {
 		(*callback)(sipe_private, sea->data, callback_data);
 	} else {
@@ -356,8 +550,10 @@ void sipe_ews_autodiscover_start(struct sipe_core_private *sipe_private,
 		sea_cb->cb_data = callback_data;
 		sea->callbacks  = g_slist_prepend(sea->callbacks, sea_cb);
 
-		if (!sea->method)
-			sipe_ews_autodiscover_request(sipe_private, TRUE);
+		if (!sea->started) {
+			sea->started = TRUE;
+			sipe_ews_autodiscover_request(sipe_private);
+		}
 	}
 }
 
@@ -373,16 +569,8 @@ void sipe_ews_autodiscover_init(struct sipe_core_private *sipe_private)
 void sipe_ews_autodiscover_free(struct sipe_core_private *sipe_private)
 {
 	struct sipe_ews_autodiscover *sea = sipe_private->ews_autodiscover;
-	struct sipe_ews_autodiscover_data *ews_data = sea->data;
 	sipe_ews_autodiscover_complete(sipe_private, NULL);
-	if (ews_data) {
-		g_free((gchar *)ews_data->as_url);
-		g_free((gchar *)ews_data->ews_url);
-		g_free((gchar *)ews_data->legacy_dn);
-		g_free((gchar *)ews_data->oab_url);
-		g_free((gchar *)ews_data->oof_url);
-		g_free(ews_data);
-	}
+	sipe_ews_autodiscover_data_free(sea->data);
 	g_free(sea->email);
 	g_free(sea);
 }
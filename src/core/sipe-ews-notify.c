@@ -0,0 +1,456 @@
+/**
+ * @file sipe-ews-notify.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Specification references:
+ *
+ *   - Subscribe operation (streaming notifications)
+ *     <http://msdn.microsoft.com/en-us/library/office/ff406186.aspx>
+ *   - GetStreamingEvents operation
+ *     <http://msdn.microsoft.com/en-us/library/office/ff406172.aspx>
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-ews-notify.h"
+#include "sipe-http.h"
+#include "sipe-schedule.h"
+#include "sipe-soap.h"
+#include "sipe-utils.h"
+#include "sipe-xml.h"
+
+#define SIPE_EWS_NOTIFY_ENVELOPE \
+"<?xml version=\"1.0\" encoding=\"utf-8\"?>"\
+"<soap:Envelope xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\""\
+              " xmlns:m=\"http://schemas.microsoft.com/exchange/services/2006/messages\""\
+              " xmlns:t=\"http://schemas.microsoft.com/exchange/services/2006/types\">"\
+  "<soap:Header>"\
+    "<t:RequestServerVersion Version=\""
+/* server version */
+#define SIPE_EWS_NOTIFY_ENVELOPE_BODY \
+                                     "\"/>"\
+  "</soap:Header>"\
+  "<soap:Body>"
+#define SIPE_EWS_NOTIFY_ENVELOPE_END \
+  "</soap:Body>"\
+"</soap:Envelope>"
+
+#define SIPE_EWS_SUBSCRIBE_REQUEST \
+    "<m:Subscribe>"\
+      "<m:StreamingSubscriptionRequest>"\
+        "<t:FolderIds>"
+/* folder IDs */
+#define SIPE_EWS_SUBSCRIBE_REQUEST_END \
+        "</t:FolderIds>"\
+        "<t:EventTypes>"\
+          "<t:EventType>CreatedEvent</t:EventType>"\
+          "<t:EventType>DeletedEvent</t:EventType>"\
+          "<t:EventType>ModifiedEvent</t:EventType>"\
+          "<t:EventType>MovedEvent</t:EventType>"\
+        "</t:EventTypes>"\
+      "</m:StreamingSubscriptionRequest>"\
+    "</m:Subscribe>"
+
+/* server closes the response after this many minutes (maximum: 30) */
+#define SIPE_EWS_NOTIFY_CONNECTION_TIMEOUT 30
+
+#define SIPE_EWS_GET_STREAMING_EVENTS_REQUEST \
+    "<m:GetStreamingEvents>"\
+      "<m:SubscriptionIds>"\
+        "<t:SubscriptionId>"
+/* subscription ID */
+#define SIPE_EWS_GET_STREAMING_EVENTS_REQUEST_END \
+                          "</t:SubscriptionId>"\
+      "</m:SubscriptionIds>"\
+      "<m:ConnectionTimeout>" G_STRINGIFY(SIPE_EWS_NOTIFY_CONNECTION_TIMEOUT) "</m:ConnectionTimeout>"\
+    "</m:GetStreamingEvents>"
+
+#define SIPE_EWS_NOTIFY_RETRY_MINIMUM   30 /* seconds, doubled on each failure */
+#define SIPE_EWS_NOTIFY_RETRY_MAXIMUM (30*60)
+#define SIPE_EWS_NOTIFY_BUFFER_MAXIMUM (1024*1024)
+
+struct sipe_ews_notify {
+	struct sipe_core_private *sipe_private;
+	gchar *name;
+	gchar *retry_action;
+	gchar *url;
+	gchar *version;
+	gchar *folder_ids;
+	sipe_ews_notify_callback *callback;
+	gpointer callback_data;
+	gchar *subscription_id;
+	struct sipe_http_request *request;
+	GString *buffer;      /* incomplete notification message */
+	guint failures;       /* consecutive */
+	gboolean active;      /* server has confirmed the connection */
+	gboolean established; /* current subscription was active once */
+	gboolean resync;      /* an established subscription was lost */
+	gboolean disabled;    /* server doesn't support streaming notifications */
+};
+
+static void sipe_ews_notify_connect(struct sipe_ews_notify *notify);
+
+static void sipe_ews_notify_drop_subscription(struct sipe_ews_notify *notify)
+{
+	g_free(notify->subscription_id);
+	notify->subscription_id = NULL;
+	if (notify->established) {
+		notify->established = FALSE;
+		notify->resync      = TRUE;
+	}
+}
+
+static void sipe_ews_notify_retry_cb(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+				     gpointer data)
+{
+	sipe_ews_notify_connect(data);
+}
+
+static void sipe_ews_notify_failed(struct sipe_ews_notify *notify)
+{
+	guint delay = SIPE_EWS_NOTIFY_RETRY_MINIMUM << MIN(notify->failures, 6);
+
+	if (delay > SIPE_EWS_NOTIFY_RETRY_MAXIMUM)
+		delay = SIPE_EWS_NOTIFY_RETRY_MAXIMUM;
+	notify->failures++;
+
+	SIPE_DEBUG_INFO("sipe_ews_notify_failed(%s): retry in %u seconds",
+			notify->name, delay);
+	sipe_schedule_seconds(notify->sipe_private,
+			      notify->retry_action,
+			      notify,
+			      delay,
+			      sipe_ews_notify_retry_cb,
+			      NULL);
+
+	/* user has to fall back to polling */
+	if (notify->active) {
+		notify->active = FALSE;
+		(*notify->callback)(notify->sipe_private,
+				    SIPE_EWS_NOTIFY_LOST,
+				    NULL,
+				    notify->callback_data);
+	}
+}
+
+static struct sipe_http_request *sipe_ews_notify_request(struct sipe_ews_notify *notify,
+							 const gchar *request,
+							 const gchar *parameter,
+							 gboolean escape,
+							 const gchar *request_end,
+							 sipe_http_response_callback *callback)
+{
+	GString *body = sipe_soap_new(SIPE_EWS_NOTIFY_ENVELOPE);
+	struct sipe_http_request *req;
+
+	g_string_append(body, notify->version);
+	g_string_append(body, SIPE_EWS_NOTIFY_ENVELOPE_BODY);
+	g_string_append(body, request);
+	if (escape)
+		sipe_soap_append_escaped(body, parameter);
+	else
+		g_string_append(body, parameter);
+	g_string_append(body, request_end);
+	g_string_append(body, SIPE_EWS_NOTIFY_ENVELOPE_END);
+
+	req = sipe_http_request_post_buffer(notify->sipe_private,
+					    notify->url,
+					    NULL,
+					    body,
+					    "text/xml; charset=UTF-8",
+					    callback,
+					    notify);
+	if (req) {
+		sipe_core_email_authentication(notify->sipe_private,
+					       req);
+		sipe_http_request_allow_redirect(req);
+	}
+
+	return(req);
+}
+
+static void sipe_ews_notify_process(struct sipe_ews_notify *notify,
+				    const sipe_xml *xml)
+{
+	const sipe_xml *resp = sipe_xml_child(xml,
+					      "Body/GetStreamingEventsResponse/ResponseMessages/GetStreamingEventsResponseMessage");
+	const sipe_xml *notification;
+
+	if (!resp)
+		return;
+
+	if (!sipe_strequal(sipe_xml_attribute(resp, "ResponseClass"), "Success")) {
+		gchar *code = sipe_xml_data(sipe_xml_child(resp, "ResponseCode"));
+
+		SIPE_DEBUG_ERROR("sipe_ews_notify_process(%s): error '%s'",
+				 notify->name, code ? code : "");
+		g_free(code);
+
+		/* subscription is gone: create a new one on next try */
+		sipe_ews_notify_drop_subscription(notify);
+		return;
+	}
+
+	notify->active      = TRUE;
+	notify->established = TRUE;
+	notify->failures    = 0;
+
+	if (notify->resync) {
+		notify->resync = FALSE;
+		SIPE_DEBUG_INFO("sipe_ews_notify_process(%s): subscription restored",
+				notify->name);
+		(*notify->callback)(notify->sipe_private,
+				    SIPE_EWS_NOTIFY_RESYNC,
+				    NULL,
+				    notify->callback_data);
+	}
+
+	for (notification = sipe_xml_child(resp, "Notifications/Notification");
+	     notification;
+	     notification = sipe_xml_twin(notification)) {
+		/* StatusEvent is only a heartbeat */
+		if (sipe_xml_child(notification, "CreatedEvent")  ||
+		    sipe_xml_child(notification, "DeletedEvent")  ||
+		    sipe_xml_child(notification, "ModifiedEvent") ||
+		    sipe_xml_child(notification, "MovedEvent"))
+			(*notify->callback)(notify->sipe_private,
+					    SIPE_EWS_NOTIFY_EVENTS,
+					    notification,
+					    notify->callback_data);
+	}
+}
+
+/* end of one notification message, i.e. "</Envelope>" with any prefix */
+static const gchar *sipe_ews_notify_envelope_end(const gchar *data)
+{
+	const gchar *end;
+
+	while ((end = strstr(data, "Envelope>")) != NULL) {
+		const gchar *tag = end;
+
+		while ((tag > data) && (tag[-1] != '<') && (tag[-1] != '>'))
+			tag--;
+		if ((tag > data) && (tag[-1] == '<') && (tag[0] == '/'))
+			return(end + strlen("Envelope>"));
+		data = end + strlen("Envelope>");
+	}
+
+	return(NULL);
+}
+
+static gsize sipe_ews_notify_body(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+				  const gchar *data,
+				  gsize length,
+				  gpointer callback_data)
+{
+	struct sipe_ews_notify *notify = callback_data;
+	const gchar *end;
+
+	/* the response is a sequence of complete SOAP envelopes */
+	g_string_append_len(notify->buffer, data, length);
+	while ((end = sipe_ews_notify_envelope_end(notify->buffer->str)) != NULL) {
+		gsize used = end - notify->buffer->str;
+		sipe_xml *xml = sipe_xml_parse(notify->buffer->str, used);
+
+		sipe_ews_notify_process(notify, xml);
+		sipe_xml_free(xml);
+		g_string_erase(notify->buffer, 0, used);
+	}
+
+	if (notify->buffer->len > SIPE_EWS_NOTIFY_BUFFER_MAXIMUM) {
+		SIPE_DEBUG_ERROR("sipe_ews_notify_body(%s): message too large - discarding it",
+				 notify->name);
+		g_string_truncate(notify->buffer, 0);
+	}
+
+	return(length);
+}
+
+static void sipe_ews_notify_events_response(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+					    guint status,
+					    SIPE_UNUSED_PARAMETER GSList *headers,
+					    SIPE_UNUSED_PARAMETER const gchar *body,
+					    gpointer data)
+{
+	struct sipe_ews_notify *notify = data;
+
+	SIPE_DEBUG_INFO("sipe_ews_notify_events_response(%s): code %d",
+			notify->name, status);
+	notify->request = NULL;
+	g_string_truncate(notify->buffer, 0);
+
+	if (status == (guint) SIPE_HTTP_STATUS_ABORTED)
+		return;
+
+	if ((status == SIPE_HTTP_STATUS_OK) && notify->active) {
+		/* connection timeout: continue with same subscription */
+		sipe_ews_notify_connect(notify);
+	} else {
+		/* subscription might have expired */
+		sipe_ews_notify_drop_subscription(notify);
+		sipe_ews_notify_failed(notify);
+	}
+}
+
+static void sipe_ews_notify_subscribe_response(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+					       guint status,
+					       SIPE_UNUSED_PARAMETER GSList *headers,
+					       const gchar *body,
+					       gpointer data)
+{
+	struct sipe_ews_notify *notify = data;
+	sipe_xml *xml;
+	const sipe_xml *resp;
+
+	SIPE_DEBUG_INFO("sipe_ews_notify_subscribe_response(%s): code %d",
+			notify->name, status);
+	notify->request = NULL;
+
+	switch (status) {
+	case SIPE_HTTP_STATUS_OK:
+		break;
+	case (guint) SIPE_HTTP_STATUS_ABORTED:
+		return;
+	case SIPE_HTTP_STATUS_SERVER_ERROR:
+		/* SOAP fault, e.g. Exchange 2007 */
+		SIPE_DEBUG_INFO("sipe_ews_notify_subscribe_response(%s): streaming notifications not supported",
+				notify->name);
+		notify->disabled = TRUE;
+		return;
+	default:
+		sipe_ews_notify_failed(notify);
+		return;
+	}
+
+	xml  = sipe_xml_parse(body, body ? strlen(body) : 0);
+	resp = sipe_xml_child(xml,
+			      "Body/SubscribeResponse/ResponseMessages/SubscribeResponseMessage");
+	if (sipe_strequal(sipe_xml_attribute(resp, "ResponseClass"), "Success")) {
+		g_free(notify->subscription_id);
+		notify->subscription_id = sipe_xml_data(sipe_xml_child(resp,
+								       "SubscriptionId"));
+	}
+	sipe_xml_free(xml);
+
+	if (notify->subscription_id) {
+		sipe_ews_notify_connect(notify);
+	} else {
+		SIPE_DEBUG_INFO("sipe_ews_notify_subscribe_response(%s): subscription rejected",
+				notify->name);
+		notify->disabled = TRUE;
+	}
+}
+
+static void sipe_ews_notify_connect(struct sipe_ews_notify *notify)
+{
+	if (notify->disabled || notify->request)
+		return;
+
+	if (notify->subscription_id) {
+		SIPE_DEBUG_INFO("sipe_ews_notify_connect(%s): waiting for events",
+				notify->name);
+		notify->request = sipe_ews_notify_request(notify,
+							  SIPE_EWS_GET_STREAMING_EVENTS_REQUEST,
+							  notify->subscription_id,
+							  TRUE,
+							  SIPE_EWS_GET_STREAMING_EVENTS_REQUEST_END,
+							  sipe_ews_notify_events_response);
+		if (notify->request)
+			sipe_http_request_stream(notify->request,
+						 sipe_ews_notify_body);
+	} else {
+		SIPE_DEBUG_INFO("sipe_ews_notify_connect(%s): subscribing",
+				notify->name);
+		notify->active  = FALSE;
+		notify->request = sipe_ews_notify_request(notify,
+							  SIPE_EWS_SUBSCRIBE_REQUEST,
+							  notify->folder_ids,
+							  FALSE,
+							  SIPE_EWS_SUBSCRIBE_REQUEST_END,
+							  sipe_ews_notify_subscribe_response);
+	}
+
+	if (notify->request)
+		sipe_http_request_ready(notify->request);
+}
+
+struct sipe_ews_notify *sipe_ews_notify_start(struct sipe_core_private *sipe_private,
+					      const gchar *name,
+					      const gchar *url,
+					      const gchar *version,
+					      const gchar *folder_ids,
+					      sipe_ews_notify_callback *callback,
+					      gpointer callback_data)
+{
+	struct sipe_ews_notify *notify = g_new0(struct sipe_ews_notify, 1);
+
+	notify->sipe_private  = sipe_private;
+	notify->name          = g_strdup(name);
+	notify->retry_action  = g_strdup_printf("<+ews-notify-%s>", name);
+	notify->url           = g_strdup(url);
+	notify->version       = g_strdup(version);
+	notify->folder_ids    = g_strdup(folder_ids);
+	notify->callback      = callback;
+	notify->callback_data = callback_data;
+	notify->buffer        = g_string_new("");
+
+	sipe_ews_notify_connect(notify);
+
+	return(notify);
+}
+
+gboolean sipe_ews_notify_active(struct sipe_ews_notify *notify)
+{
+	return(notify && notify->active);
+}
+
+void sipe_ews_notify_free(struct sipe_ews_notify *notify)
+{
+	if (notify) {
+		sipe_schedule_cancel(notify->sipe_private,
+				     notify->retry_action);
+		if (notify->request)
+			sipe_http_request_cancel(notify->request);
+		g_string_free(notify->buffer, TRUE);
+		g_free(notify->subscription_id);
+		g_free(notify->folder_ids);
+		g_free(notify->version);
+		g_free(notify->url);
+		g_free(notify->retry_action);
+		g_free(notify->name);
+		g_free(notify);
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,103 @@
+/**
+ * @file sipe-ews-notify.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * EWS streaming notifications (Exchange 2010 SP1 or newer)
+ *
+ * A streaming subscription on one or more folders is kept open with a
+ * long-running GetStreamingEvents request. Lost connections are retried
+ * with exponential backoff. Servers that don't support streaming
+ * notifications disable the subscription permanently, i.e. the user
+ * has to continue polling.
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_ews_notify;
+struct _sipe_xml;
+
+enum sipe_ews_notify_state {
+	SIPE_EWS_NOTIFY_EVENTS, /* notification contains folder events  */
+	SIPE_EWS_NOTIFY_LOST,   /* connection lost, poll until it's back */
+	SIPE_EWS_NOTIFY_RESYNC, /* new subscription after a lost one:
+				   events might have been missed         */
+};
+
+/**
+ * EWS notification callback
+ *
+ * @param sipe_private  SIPE core private data
+ * @param state         reason for the callback
+ * @param notification  @c Notification node (only for @c SIPE_EWS_NOTIFY_EVENTS)
+ * @param callback_data callback data
+ */
+typedef void (sipe_ews_notify_callback)(struct sipe_core_private *sipe_private,
+					enum sipe_ews_notify_state state,
+					const struct _sipe_xml *notification,
+					gpointer callback_data);
+
+/**
+ * Subscribe to EWS streaming notifications
+ *
+ * @param sipe_private  SIPE core private data
+ * @param name          unique name, used for debugging & scheduling
+ * @param url           EWS URL
+ * @param version       requested server version, e.g. "Exchange2010_SP1"
+ * @param folder_ids    @c t:FolderIds content, e.g. one or more
+ *                      @c t:DistinguishedFolderId elements
+ * @param callback      callback function
+ * @param callback_data callback data
+ *
+ * @return subscription data. Must be freed with @c sipe_ews_notify_free()
+ */
+struct sipe_ews_notify *sipe_ews_notify_start(struct sipe_core_private *sipe_private,
+					      const gchar *name,
+					      const gchar *url,
+					      const gchar *version,
+					      const gchar *folder_ids,
+					      sipe_ews_notify_callback *callback,
+					      gpointer callback_data);
+
+/**
+ * Changes are pushed by the server
+ *
+ * @param notify subscription data (may be @c NULL)
+ *
+ * @return @c TRUE while the server has confirmed the connection
+ */
+gboolean sipe_ews_notify_active(struct sipe_ews_notify *notify);
+
+/**
+ * Stop notifications and free subscription data
+ *
+ * @param notify subscription data (may be @c NULL)
+ */
+void sipe_ews_notify_free(struct sipe_ews_notify *notify);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -54,16 +54,21 @@ be great to implement too.
 #include "sipe-cal.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-digest.h"
 #include "sipe-ews.h"
 #include "sipe-ews-autodiscover.h"
+#include "sipe-ews-notify.h"
 #include "sipe-http.h"
+#include "sipe-schedule.h"
+#include "sipe-soap.h"
+#include "sipe-status.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
 /**
  * GetUserOofSettingsRequest SOAP request to Exchange Web Services
  * to obtain our Out-of-office (OOF) information.
- * @param email (%s) Ex.: alice@cosmo.local
+ * @param email Ex.: alice@cosmo.local
  */
 #define SIPE_EWS_USER_OOF_SETTINGS_REQUEST \
 "<?xml version=\"1.0\" encoding=\"utf-8\"?>"\
@@ -71,7 +76,10 @@ be great to implement too.
   "<soap:Body>"\
     "<GetUserOofSettingsRequest xmlns=\"http://schemas.microsoft.com/exchange/services/2006/messages\">"\
       "<Mailbox xmlns=\"http://schemas.microsoft.com/exchange/services/2006/types\">"\
-        "<Address>%s</Address>"\
+        "<Address>"
+/* email */
+#define SIPE_EWS_USER_OOF_SETTINGS_REQUEST_END \
+                 "</Address>"\
       "</Mailbox>"\
     "</GetUserOofSettingsRequest>"\
   "</soap:Body>"\
@@ -80,9 +88,9 @@ be great to implement too.
 /**
  * GetUserAvailabilityRequest SOAP request to Exchange Web Services
  * to obtain our Availability (FreeBusy, WorkingHours, Meetings) information.
- * @param email      (%s) Ex.: alice@cosmo.local
- * @param start_time (%s) Ex.: 2009-12-06T00:00:00
- * @param end_time   (%s) Ex.: 2009-12-09T23:59:59
+ * @param email      Ex.: alice@cosmo.local
+ * @param start_time Ex.: 2009-12-06T00:00:00
+ * @param end_time   Ex.: 2009-12-09T23:59:59
  */
 #define SIPE_EWS_USER_AVAILABILITY_REQUEST \
 "<?xml version=\"1.0\" encoding=\"utf-8\"?>"\
@@ -113,7 +121,10 @@ be great to implement too.
       "<MailboxDataArray>"\
         "<t:MailboxData>"\
           "<t:Email>"\
-            "<t:Address>%s</t:Address>"\
+            "<t:Address>"
+/* email */
+#define SIPE_EWS_USER_AVAILABILITY_REQUEST_START_TIME \
+                       "</t:Address>"\
           "</t:Email>"\
           "<t:AttendeeType>Required</t:AttendeeType>"\
           "<t:ExcludeConflicts>false</t:ExcludeConflicts>"\
@@ -121,8 +132,14 @@ be great to implement too.
       "</MailboxDataArray>"\
       "<t:FreeBusyViewOptions>"\
         "<t:TimeWindow>"\
-          "<t:StartTime>%s</t:StartTime>"\
-          "<t:EndTime>%s</t:EndTime>"\
+          "<t:StartTime>"
+/* start_time */
+#define SIPE_EWS_USER_AVAILABILITY_REQUEST_END_TIME \
+                        "</t:StartTime>"\
+          "<t:EndTime>"
+/* end_time */
+#define SIPE_EWS_USER_AVAILABILITY_REQUEST_END \
+                      "</t:EndTime>"\
         "</t:TimeWindow>"\
         "<t:MergedFreeBusyIntervalInMinutes>15</t:MergedFreeBusyIntervalInMinutes>"\
         "<t:RequestedView>DetailedMerged</t:RequestedView>"\
@@ -159,6 +176,31 @@ sipe_ews_get_oof_note(struct sipe_calendar *cal)
 static void
 sipe_ews_run_state_machine(struct sipe_calendar *cal);
 
+/**
+ * Returns digest of free/busy view for comparison.
+ *
+ * Must be g_free()'d after use.
+ */
+static gchar *sipe_ews_free_busy_hash(time_t fb_start,
+				      const sipe_xml *view)
+{
+	gchar *start_str = sipe_utils_time_to_str(fb_start);
+	gchar *view_str = sipe_xml_stringify(view);
+	gchar *tmp = g_strdup_printf("%s\n%s",
+				     start_str,
+				     view_str ? view_str : "");
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+	gchar *hash;
+
+	sipe_digest_sha1((guchar *) tmp, strlen(tmp), digest);
+	hash = buff_to_hex_str(digest, sizeof(digest));
+
+	g_free(tmp);
+	g_free(view_str);
+	g_free(start_str);
+	return(hash);
+}
+
 static void sipe_ews_process_avail_response(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
 					    guint status,
 					    SIPE_UNUSED_PARAMETER GSList *headers,
@@ -174,6 +216,7 @@ static void sipe_ews_process_avail_response(SIPE_UNUSED_PARAMETER struct sipe_co
 	if ((status == SIPE_HTTP_STATUS_OK) && body) {
 		const sipe_xml *node;
 		const sipe_xml *resp;
+		gchar *fb_hash;
 		/** ref: [MS-OXWAVLS] */
 		sipe_xml *xml = sipe_xml_parse(body, strlen(body));
 		/*
@@ -188,6 +231,25 @@ Envelope/Body/GetUserAvailabilityResponse/FreeBusyResponseArray/FreeBusyResponse
 			return; /* Error response */
 		}
 
+		/*
+		 * GetUserAvailability has no sync state, i.e. we always
+		 * receive the full view. Skip rebuilding the calendar data
+		 * if nothing has changed since the last update.
+		 */
+		fb_hash = sipe_ews_free_busy_hash(cal->fb_start,
+						  sipe_xml_child(resp, "FreeBusyView"));
+		if (sipe_strequal(fb_hash, cal->fb_hash)) {
+			SIPE_DEBUG_INFO_NOFORMAT("sipe_ews_process_avail_response: free/busy data has NOT changed");
+			g_free(fb_hash);
+			sipe_xml_free(xml);
+
+			cal->state = SIPE_EWS_STATE_AVAILABILITY_SUCCESS;
+			sipe_ews_run_state_machine(cal);
+			return;
+		}
+		g_free(cal->fb_hash);
+		cal->fb_hash = fb_hash;
+
 		/* MergedFreeBusy */
 		g_free(cal->free_busy);
 		cal->free_busy = sipe_xml_data(sipe_xml_child(resp, "FreeBusyView/MergedFreeBusy"));
@@ -363,7 +425,7 @@ static void sipe_ews_send_http_request(struct sipe_calendar *cal)
 static void sipe_ews_do_avail_request(struct sipe_calendar *cal)
 {
 	if (cal->as_url) {
-		char *body;
+		GString *body;
 		time_t end;
 		time_t now = time(NULL);
 		char *start_str;
@@ -377,7 +439,7 @@ static void sipe_ews_do_avail_request(struct sipe_calendar *cal)
 		now_tm->tm_sec = 0;
 		now_tm->tm_min = 0;
 		now_tm->tm_hour = 0;
-		cal->fb_start = sipe_mktime_tz(now_tm, "UTC");
+		cal->fb_start = sipe_mktime_utc(now_tm);
 		cal->fb_start -= 24*60*60;
 		/* end = start + 4 days - 1 sec */
 		end = cal->fb_start + SIPE_FREE_BUSY_PERIOD_SEC - 1;
@@ -385,15 +447,20 @@ static void sipe_ews_do_avail_request(struct sipe_calendar *cal)
 		start_str = sipe_utils_time_to_str(cal->fb_start);
 		end_str = sipe_utils_time_to_str(end);
 
-		body = g_strdup_printf(SIPE_EWS_USER_AVAILABILITY_REQUEST, cal->email, start_str, end_str);
-		cal->request = sipe_http_request_post(cal->sipe_private,
-						      cal->as_url,
-						      NULL,
-						      body,
-						      "text/xml; charset=UTF-8",
-						      sipe_ews_process_avail_response,
-						      cal);
-		g_free(body);
+		body = sipe_soap_new(SIPE_EWS_USER_AVAILABILITY_REQUEST);
+		sipe_soap_append_escaped(body, cal->email);
+		g_string_append(body, SIPE_EWS_USER_AVAILABILITY_REQUEST_START_TIME);
+		g_string_append(body, start_str);
+		g_string_append(body, SIPE_EWS_USER_AVAILABILITY_REQUEST_END_TIME);
+		g_string_append(body, end_str);
+		g_string_append(body, SIPE_EWS_USER_AVAILABILITY_REQUEST_END);
+		cal->request = sipe_http_request_post_buffer(cal->sipe_private,
+							     cal->as_url,
+							     NULL,
+							     body,
+							     "text/xml; charset=UTF-8",
+							     sipe_ews_process_avail_response,
+							     cal);
 		g_free(start_str);
 		g_free(end_str);
 
@@ -404,24 +471,110 @@ static void sipe_ews_do_avail_request(struct sipe_calendar *cal)
 static void sipe_ews_do_oof_request(struct sipe_calendar *cal)
 {
 	if (cal->oof_url) {
-		char *body;
+		GString *body;
 
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_ews_do_oof_request: going OOF req.");
 
-		body = g_strdup_printf(SIPE_EWS_USER_OOF_SETTINGS_REQUEST, cal->email);
-		cal->request = sipe_http_request_post(cal->sipe_private,
-						      cal->as_url,
-						      NULL,
-						      body,
-						      "text/xml; charset=UTF-8",
-						      sipe_ews_process_oof_response,
-						      cal);
-		g_free(body);
+		body = sipe_soap_new(SIPE_EWS_USER_OOF_SETTINGS_REQUEST);
+		sipe_soap_append_escaped(body, cal->email);
+		g_string_append(body, SIPE_EWS_USER_OOF_SETTINGS_REQUEST_END);
+		cal->request = sipe_http_request_post_buffer(cal->sipe_private,
+							     cal->as_url,
+							     NULL,
+							     body,
+							     "text/xml; charset=UTF-8",
+							     sipe_ews_process_oof_response,
+							     cal);
 
 		sipe_ews_send_http_request(cal);
 	}
 }
 
+
+/*
+ * EWS streaming notifications on the calendar folder
+ *
+ * Every change in the folder triggers a calendar update. Polling continues
+ * with a longer interval, because OOF changes aren't reported and the
+ * free/busy period moves.
+ */
+#define SIPE_EWS_CALENDAR_FOLDER_IDS "<t:DistinguishedFolderId Id=\"calendar\"/>"
+#define SIPE_EWS_STREAM_UPDATE_ACTION "<+ews-stream-update>"
+#define SIPE_EWS_STREAM_UPDATE_DELAY     5 /* seconds, collects related changes */
+
+static void sipe_ews_stream_update_cb(struct sipe_core_private *sipe_private,
+				      SIPE_UNUSED_PARAMETER gpointer data)
+{
+	struct sipe_calendar *cal = sipe_private->calendar;
+
+	if (!cal)
+		return;
+
+	/* update in progress: it might have missed the change */
+	if (cal->request) {
+		sipe_schedule_seconds(sipe_private,
+				      SIPE_EWS_STREAM_UPDATE_ACTION,
+				      NULL,
+				      SIPE_EWS_STREAM_UPDATE_DELAY,
+				      sipe_ews_stream_update_cb,
+				      NULL);
+		return;
+	}
+
+	SIPE_DEBUG_INFO_NOFORMAT("sipe_ews_stream_update_cb: calendar changed");
+	sipe_ews_update_calendar(sipe_private);
+}
+
+static void sipe_ews_stream_cb(struct sipe_core_private *sipe_private,
+			       enum sipe_ews_notify_state state,
+			       SIPE_UNUSED_PARAMETER const sipe_xml *notification,
+			       SIPE_UNUSED_PARAMETER gpointer callback_data)
+{
+	switch (state) {
+	case SIPE_EWS_NOTIFY_EVENTS:
+	case SIPE_EWS_NOTIFY_RESYNC:
+		sipe_schedule_seconds(sipe_private,
+				      SIPE_EWS_STREAM_UPDATE_ACTION,
+				      NULL,
+				      SIPE_EWS_STREAM_UPDATE_DELAY,
+				      sipe_ews_stream_update_cb,
+				      NULL);
+		break;
+	case SIPE_EWS_NOTIFY_LOST:
+		/* fall back to normal polling interval */
+		sipe_cal_delayed_calendar_update(sipe_private);
+		break;
+	}
+}
+
+static void sipe_ews_stream_start(struct sipe_calendar *cal)
+{
+	if (cal->as_url && !cal->stream)
+		cal->stream = sipe_ews_notify_start(cal->sipe_private,
+						    "calendar",
+						    cal->as_url,
+						    "Exchange2010_SP1",
+						    SIPE_EWS_CALENDAR_FOLDER_IDS,
+						    sipe_ews_stream_cb,
+						    cal);
+}
+
+gboolean sipe_ews_streaming(struct sipe_core_private *sipe_private)
+{
+	struct sipe_calendar *cal = sipe_private->calendar;
+	return(cal && sipe_ews_notify_active(cal->stream));
+}
+
+void sipe_ews_stream_free(struct sipe_calendar *cal)
+{
+	if (cal->stream) {
+		sipe_schedule_cancel(cal->sipe_private,
+				     SIPE_EWS_STREAM_UPDATE_ACTION);
+		sipe_ews_notify_free(cal->stream);
+		cal->stream = NULL;
+	}
+}
+
 static void
 sipe_ews_run_state_machine(struct sipe_calendar *cal)
 {
@@ -445,7 +598,10 @@ sipe_ews_run_state_machine(struct sipe_calendar *cal)
 
 			cal->state = SIPE_EWS_STATE_IDLE;
 			cal->is_updated = TRUE;
-			sipe_cal_presence_publish(sipe_private, TRUE);
+			sipe_status_publish(sipe_private, TRUE, FALSE);
+
+			/* wait for changes instead of polling */
+			sipe_ews_stream_start(cal);
 		}
 		break;
 	}
@@ -35,6 +35,25 @@ struct sipe_core_private;
 void
 sipe_ews_update_calendar(struct sipe_core_private *sipe_private);
 
+/**
+ * Calendar changes are pushed by the server
+ *
+ * @param sipe_private SIPE core private data
+ *
+ * @return @c TRUE while a streaming notification connection is active,
+ *         i.e. polling is only needed as fallback
+ */
+gboolean
+sipe_ews_streaming(struct sipe_core_private *sipe_private);
+
+/**
+ * Stop streaming notifications and free their data
+ *
+ * @param cal calendar data
+ */
+void
+sipe_ews_stream_free(struct sipe_calendar *cal);
+
 /**
  * Returns OOF note if enabled in the moment
  * otherwise NULL.
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2014-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -34,6 +34,9 @@
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-ft-lync.h"
+#include "sipe-ft-scheduler.h"
+#include "sipe-ft-sink.h"
+#include "sipe-ft-source.h"
 #include "sipe-media.h"
 #include "sipe-mime.h"
 #include "sipe-nls.h"
@@ -42,6 +45,11 @@
 #include "sipe-xml.h"
 #include "sipmsg.h"
 
+/* chunk header: type (1 byte) + big endian length (2 bytes) */
+#define FT_LYNC_CHUNK_HEADER_LENGTH 3
+#define FT_LYNC_CHUNK_MAX_LENGTH    G_MAXUINT16
+#define FT_LYNC_READ_BUFFER_SIZE    0x4000
+
 struct sipe_file_transfer_lync {
 	struct sipe_file_transfer public;
 
@@ -51,7 +59,12 @@ struct sipe_file_transfer_lync {
 	gsize file_size;
 	guint request_id;
 
+	/* incoming chunk: header may arrive split, control payload is collected */
+	guint8 chunk_header[FT_LYNC_CHUNK_HEADER_LENGTH];
+	guint chunk_header_len;
+	guint8 chunk_type;
 	guint expecting_len;
+	GString *control;
 
 	struct sipe_core_private *sipe_private;
 	struct sipe_media_call_private *call_private;
@@ -59,7 +72,24 @@ struct sipe_file_transfer_lync {
 
 	gboolean was_cancelled;
 
-	int write_source_id;
+	struct sipe_ft_flow *flow; /* outgoing: fair share of data streams */
+
+	/* outgoing chunk: header + payload, sent without blocking */
+	guchar *out_buffer;
+	const guchar *out_payload; /* data chunk payload in file source */
+	gsize out_length;
+	gsize out_offset;
+	gboolean end_queued;
+	gboolean end_sent;
+	struct sipe_ft_source *source; /* NULL: read through backend */
+
+	/* incoming data is written behind, reading stops while sink is full */
+	struct sipe_ft_sink *sink;     /* NULL: write through backend */
+	gboolean read_paused;
+
+	/* file data sent or received so far */
+	guint64 bytes_transferred;
+	GTimer *timer;
 
 	void (*call_reject_parent_cb)(struct sipe_media_call *call,
 				      gboolean local);
@@ -77,9 +107,15 @@ sipe_file_transfer_lync_free(struct sipe_file_transfer_lync *ft_private)
 	g_free(ft_private->sdp);
 	g_free(ft_private->id);
 
-	if (ft_private->write_source_id) {
-		g_source_remove(ft_private->write_source_id);
-	}
+	sipe_ft_flow_free(ft_private->flow);
+
+	g_free(ft_private->out_buffer);
+	sipe_ft_source_close(ft_private->source);
+	sipe_ft_sink_close(ft_private->sink);
+	if (ft_private->control)
+		g_string_free(ft_private->control, TRUE);
+	if (ft_private->timer)
+		g_timer_destroy(ft_private->timer);
 
 	g_free(ft_private);
 }
@@ -176,54 +212,161 @@ candidate_pair_established_cb(SIPE_UNUSED_PARAMETER struct sipe_media_call *call
 }
 
 static void
-read_cb(struct sipe_media_call *call, struct sipe_media_stream *stream)
+read_cb(struct sipe_media_call *call, struct sipe_media_stream *stream);
+
+/* sipe_ft_sink_written_cb */
+static void
+sink_written_cb(gpointer data, gsize written)
 {
-	struct sipe_file_transfer_lync *ft_data =
-			sipe_media_stream_get_data(stream);
-	guint8 buffer[0x800];
+	struct sipe_file_transfer_lync *ft_data = data;
 
-	if (ft_data->was_cancelled) {
-		// Just drop the incoming data.
-		sipe_backend_media_read(call, stream, buffer, sizeof (buffer),
-					FALSE);
-		return;
+	if (!ft_data->was_cancelled) {
+		if (written == 0) {
+			sipe_backend_ft_cancel_local(&ft_data->public);
+			return;
+		}
+		sipe_backend_ft_sink_written(&ft_data->public, written);
 	}
 
-	if (ft_data->expecting_len == 0) {
-		guint8 type;
-		guint16 size;
-
-		sipe_backend_media_read(call, stream, &type, sizeof (guint8), TRUE);
-		sipe_backend_media_read(call, stream, (guint8 *)&size, sizeof (guint16), TRUE);
-		size = GUINT16_FROM_BE(size);
-
-		if (type == 0x01) {
-			sipe_backend_media_read(call, stream, buffer, size, TRUE);
-			buffer[size] = 0;
-			SIPE_DEBUG_INFO("Received new stream for requestId : %s", buffer);
-			sipe_backend_ft_start(&ft_data->public, NULL, NULL, 0);
-		} else if (type == 0x02) {
-			sipe_backend_media_read(call, stream, buffer, size, TRUE);
-			buffer[size] = 0;
-
-			SIPE_DEBUG_INFO("Received end of stream for requestId : %s", buffer);
-			// TODO: finish transfer;
-		} else if (type == 0x00) {
-			SIPE_DEBUG_INFO("Received new data chunk of size %d", size);
-			ft_data->expecting_len = size;
+	/* drain what has queued up on the stream in the meantime */
+	if (ft_data->read_paused && !sipe_ft_sink_full(ft_data->sink)) {
+		struct sipe_media_call *call =
+			(struct sipe_media_call *) ft_data->call_private;
+		struct sipe_media_stream *stream =
+			sipe_core_media_get_stream_by_id(call, "data");
+
+		ft_data->read_paused = FALSE;
+		if (stream)
+			read_cb(call, stream);
+	}
+}
+
+static void
+control_chunk_received(struct sipe_file_transfer_lync *ft_data)
+{
+	if (ft_data->chunk_type == 0x01) {
+		SIPE_DEBUG_INFO("Received new stream for requestId : %s",
+				ft_data->control->str);
+		if (!ft_data->timer)
+			ft_data->timer = g_timer_new();
+		sipe_backend_ft_start(&ft_data->public, NULL, NULL, 0);
+
+		if (!ft_data->sink) {
+			ft_data->sink = sipe_backend_ft_open_sink((struct sipe_core_public *) ft_data->sipe_private,
+								  &ft_data->public);
+			if (ft_data->sink)
+				sipe_ft_sink_set_written_cb(ft_data->sink,
+							    sink_written_cb,
+							    ft_data);
+		}
+	} else if (ft_data->chunk_type == 0x02) {
+		SIPE_DEBUG_INFO("Received end of stream for requestId : %s (%" G_GUINT64_FORMAT " bytes)",
+				ft_data->control->str, ft_data->bytes_transferred);
+		if (ft_data->sink)
+			sipe_ft_sink_flush(ft_data->sink);
+		// TODO: finish transfer;
+	}
+}
+
+static void
+process_incoming(struct sipe_file_transfer_lync *ft_data,
+		 const guint8 *data, guint length)
+{
+	while (length > 0) {
+		guint len;
+
+		if (ft_data->expecting_len == 0) {
+			/* chunk header might be split between reads */
+			len = MIN(length,
+				  FT_LYNC_CHUNK_HEADER_LENGTH - ft_data->chunk_header_len);
+			memcpy(ft_data->chunk_header + ft_data->chunk_header_len,
+			       data, len);
+			ft_data->chunk_header_len += len;
+			data   += len;
+			length -= len;
+
+			if (ft_data->chunk_header_len < FT_LYNC_CHUNK_HEADER_LENGTH)
+				break;
+
+			ft_data->chunk_header_len = 0;
+			ft_data->chunk_type       = ft_data->chunk_header[0];
+			ft_data->expecting_len    = (ft_data->chunk_header[1] << 8) |
+						     ft_data->chunk_header[2];
+
+			if (ft_data->chunk_type == 0x00) {
+				SIPE_DEBUG_INFO("Received new data chunk of size %d",
+						ft_data->expecting_len);
+			} else {
+				g_string_truncate(ft_data->control, 0);
+				if (ft_data->expecting_len == 0)
+					control_chunk_received(ft_data);
+			}
+			continue;
+		}
+
+		len = MIN(ft_data->expecting_len, length);
+		if (ft_data->chunk_type == 0x00) {
+			if (ft_data->sink) {
+				/* progress is reported by sink_written_cb() */
+				if (sipe_ft_sink_write(ft_data->sink, data, len))
+					ft_data->bytes_transferred += len;
+			} else if (sipe_backend_ft_write_file(&ft_data->public, data, len) == (gssize) len)
+				ft_data->bytes_transferred += len;
+		} else {
+			g_string_append_len(ft_data->control,
+					    (const gchar *) data, len);
 		}
-		/* Readable will be called again so we can read the rest of
-		 * the buffer or the chunk. */
-	} else {
-		guint len = MIN(ft_data->expecting_len, sizeof (buffer));
-		len = sipe_backend_media_read(call, stream, buffer, len, FALSE);
 		ft_data->expecting_len -= len;
-		SIPE_DEBUG_INFO("Read %d bytes. %d remaining in chunk",
-				len, ft_data->expecting_len);
-		sipe_backend_ft_write_file(&ft_data->public, buffer, len);
+		data   += len;
+		length -= len;
+
+		if ((ft_data->expecting_len == 0) && (ft_data->chunk_type != 0x00))
+			control_chunk_received(ft_data);
 	}
 }
 
+static void
+read_cb(struct sipe_media_call *call, struct sipe_media_stream *stream)
+{
+	struct sipe_file_transfer_lync *ft_data =
+			sipe_media_stream_get_data(stream);
+	guint8 buffer[FT_LYNC_READ_BUFFER_SIZE];
+	struct sipe_media_segment segment;
+	gint len;
+
+	segment.data   = buffer;
+	segment.length = sizeof (buffer);
+
+	/*
+	 * Process everything queued on the stream in this wakeup. A short
+	 * read means the backend has no more data pending.
+	 */
+	do {
+		/*
+		 * Too much data waiting for the disk: leave the rest on the
+		 * stream until sink_written_cb() resumes reading.
+		 */
+		if (ft_data->sink &&
+		    !ft_data->was_cancelled &&
+		    sipe_ft_sink_full(ft_data->sink)) {
+			ft_data->read_paused = TRUE;
+			break;
+		}
+
+		len = sipe_backend_media_read_iov(call, stream, &segment, 1);
+		if (len <= 0)
+			break;
+
+		// Just drop the incoming data when cancelled.
+		if (!ft_data->was_cancelled)
+			process_incoming(ft_data, buffer, len);
+	} while ((guint) len == sizeof (buffer));
+
+	/* start writing partial block if disk is idle */
+	if (ft_data->sink && !ft_data->was_cancelled)
+		sipe_ft_sink_flush(ft_data->sink);
+}
+
 static void
 ft_lync_incoming_init(struct sipe_file_transfer *ft,
 		      SIPE_UNUSED_PARAMETER const gchar *filename,
@@ -277,15 +420,17 @@ ft_lync_incoming_end(struct sipe_file_transfer *ft)
 					"<transferId>%d</transferId>"
 					"<bytesReceived>"
 						"<from>0</from>"
-						"<to>%d</to>"
+						"<to>%" G_GUINT64_FORMAT "</to>"
 					"</bytesReceived>"
 				"</fileTransferProgress>"
 			"</notify>";
 
+	/* report the range we actually received, not the announced size */
 	send_ms_filetransfer_msg(g_strdup_printf(FILETRANSFER_PROGRESS,
 						 rand(),
 						 ft_private->request_id,
-						 ft_private->file_size - 1),
+						 ft_private->bytes_transferred ?
+						 ft_private->bytes_transferred - 1 : 0),
 				 ft_private, NULL);
 
 	/* We still need our filetransfer structure so don't let backend
@@ -363,6 +508,34 @@ ft_lync_incoming_cancelled(struct sipe_file_transfer *ft, gboolean local)
 	}
 }
 
+static gboolean
+ft_lync_progress(struct sipe_file_transfer *ft, guint64 *bytes,
+		 guint64 *bytes_per_second)
+{
+	struct sipe_file_transfer_lync *ft_private =
+			(struct sipe_file_transfer_lync *) ft;
+	gdouble elapsed;
+
+	/* outgoing: throughput as measured by the scheduler */
+	if (ft_private->flow) {
+		guint64 sent;
+		if (!sipe_ft_flow_progress(ft_private->flow, &sent, bytes_per_second))
+			return(FALSE);
+		*bytes = ft_private->bytes_transferred;
+		return(TRUE);
+	}
+
+	if (!ft_private->timer)
+		return(FALSE);
+
+	elapsed = g_timer_elapsed(ft_private->timer, NULL);
+	*bytes = ft_private->bytes_transferred;
+	*bytes_per_second = elapsed > 0 ?
+		(guint64) (ft_private->bytes_transferred / elapsed) : 0;
+
+	return(TRUE);
+}
+
 static void
 ft_lync_deallocate(struct sipe_file_transfer *ft)
 {
@@ -385,6 +558,7 @@ process_incoming_invite_ft_lync(struct sipe_core_private *sipe_private,
 	struct sipe_media_stream *stream;
 
 	ft_private = g_new0(struct sipe_file_transfer_lync, 1);
+	ft_private->control = g_string_new(NULL);
 	sipe_mime_parts_foreach(sipmsg_find_header(msg, "Content-Type"),
 				msg->body, mime_mixed_cb, ft_private);
 
@@ -421,6 +595,7 @@ process_incoming_invite_ft_lync(struct sipe_core_private *sipe_private,
 	ft_private->public.end = ft_lync_incoming_end;
 	ft_private->public.cancelled = ft_lync_incoming_cancelled;
 	ft_private->public.deallocate = ft_lync_deallocate;
+	ft_private->public.progress = ft_lync_progress;
 
 	stream = sipe_core_media_get_stream_by_id(call, "data");
 	sipe_media_stream_set_data(stream, ft_private, NULL);
@@ -455,46 +630,191 @@ process_response(struct sipe_file_transfer_lync *ft_private, sipe_xml *xml)
 }
 
 static void
-write_chunk(struct sipe_media_call *call, struct sipe_media_stream *stream,
-	    guint8 type, guint16 len, const gchar *buffer, gboolean blocking)
+queue_chunk(struct sipe_file_transfer_lync *ft_private, guint8 type,
+	    const gchar *buffer, guint16 len)
 {
-	guint16 len_be = GUINT16_TO_BE(len);
+	guchar *p = ft_private->out_buffer;
+
+	/* header and payload go out in one write */
+	p[0] = type;
+	p[1] = len >> 8;
+	p[2] = len & 0xFF;
+	/* data chunks are read directly behind the header */
+	if (buffer)
+		memcpy(p + FT_LYNC_CHUNK_HEADER_LENGTH, buffer, len);
+
+	ft_private->out_length = FT_LYNC_CHUNK_HEADER_LENGTH + len;
+	ft_private->out_offset = 0;
+}
 
-	sipe_backend_media_write(call, stream, &type, sizeof (guint8), blocking);
-	sipe_backend_media_write(call, stream, (guint8 *)&len_be, sizeof (guint16), blocking);
-	sipe_backend_media_write(call, stream, (guint8 *)buffer, len, blocking);
+/* payload is sent directly from the file source */
+static void
+queue_source_chunk(struct sipe_file_transfer_lync *ft_private,
+		   const guchar *data, guint16 len)
+{
+	queue_chunk(ft_private, 0x00, NULL, len);
+	ft_private->out_payload = data;
 }
 
+/*
+ * writes at most *budget bytes of the queued chunk, returns FALSE if the
+ * stream can't take more data at the moment
+ */
 static gboolean
-send_file_chunk(struct sipe_file_transfer_lync *ft_private)
+flush_chunk(struct sipe_file_transfer_lync *ft_private, gsize *budget)
 {
 	struct sipe_media_call *call =
 			(struct sipe_media_call *)ft_private->call_private;
 	struct sipe_media_stream *stream =
 			sipe_core_media_get_stream_by_id(call, "data");
-	//gchar buffer[G_MAXINT16];
-	gchar buffer[1024];
-	gssize bytes_read;
-
-	bytes_read = sipe_backend_ft_read_file(SIPE_FILE_TRANSFER,
-					       (guchar *)&buffer,
-					       sizeof (buffer));
-	if (bytes_read != 0) {
-		write_chunk(call, stream, 0x00, bytes_read, buffer, TRUE);
+
+	while (stream && *budget &&
+	       (ft_private->out_offset < ft_private->out_length)) {
+		const guchar *data = ft_private->out_buffer + ft_private->out_offset;
+		gsize length = ft_private->out_length - ft_private->out_offset;
+		gint written;
+
+		if (ft_private->out_payload) {
+			if (ft_private->out_offset < FT_LYNC_CHUNK_HEADER_LENGTH) {
+				length = FT_LYNC_CHUNK_HEADER_LENGTH - ft_private->out_offset;
+			} else {
+				data = ft_private->out_payload +
+					ft_private->out_offset - FT_LYNC_CHUNK_HEADER_LENGTH;
+			}
+		}
+
+		written = sipe_backend_media_write(call, stream,
+						   (guint8 *) data,
+						   MIN(length, *budget),
+						   FALSE);
+		if (written <= 0)
+			return FALSE;
+		ft_private->out_offset += written;
+		*budget                -= written;
 	}
 
-	if (sipe_backend_ft_is_completed(SIPE_FILE_TRANSFER)) {
-		/* End of transfer. */
-		gchar *request_id_str =
-				g_strdup_printf("%u", ft_private->request_id);
-		write_chunk(call, stream, 0x02, strlen(request_id_str),
-			    request_id_str, TRUE);
-		g_free(request_id_str);
-		ft_private->write_source_id = 0;
-		return G_SOURCE_REMOVE;
+	return(stream != NULL);
+}
+
+static void
+queue_request_id_chunk(struct sipe_file_transfer_lync *ft_private,
+		       guint8 type)
+{
+	gchar *request_id_str = g_strdup_printf("%u", ft_private->request_id);
+	queue_chunk(ft_private, type, request_id_str, strlen(request_id_str));
+	g_free(request_id_str);
+}
+
+/* sipe_ft_flow_send callback */
+static gsize
+send_file_data(gpointer data, gsize budget)
+{
+	struct sipe_file_transfer_lync *ft_private = data;
+	gsize left = budget;
+
+	while (TRUE) {
+		gssize bytes_read;
+
+		if (!flush_chunk(ft_private, &left)) {
+			/* stream is congested: writable_cb() wakes us */
+			break;
+		}
+
+		/* fair share used up for this round */
+		if (ft_private->out_offset < ft_private->out_length)
+			break;
+
+		if (ft_private->out_payload) {
+			gsize sent = ft_private->out_length - FT_LYNC_CHUNK_HEADER_LENGTH;
+
+			/* payload pages may be released now */
+			ft_private->out_payload = NULL;
+			sipe_ft_source_consume(ft_private->source, sent);
+			sipe_backend_ft_source_sent(SIPE_FILE_TRANSFER, sent);
+		}
+
+		if (ft_private->end_queued) {
+			/* End of transfer. */
+			if (!ft_private->end_sent) {
+				gdouble elapsed = g_timer_elapsed(ft_private->timer, NULL);
+				SIPE_DEBUG_INFO("send_file_data: sent %" G_GUINT64_FORMAT " bytes in %.1f seconds (%.0f bytes/s)",
+						ft_private->bytes_transferred, elapsed,
+						elapsed > 0 ? ft_private->bytes_transferred / elapsed : 0);
+				ft_private->end_sent = TRUE;
+			}
+			break;
+		}
+
+		if (sipe_backend_ft_is_completed(SIPE_FILE_TRANSFER)) {
+			queue_request_id_chunk(ft_private, 0x02);
+			ft_private->end_queued = TRUE;
+			continue;
+		}
+
+		if (ft_private->source) {
+			const guchar *payload;
+
+			bytes_read = sipe_ft_source_peek(ft_private->source,
+							 &payload,
+							 FT_LYNC_CHUNK_MAX_LENGTH);
+			if (bytes_read < 0) {
+				sipe_backend_ft_error(SIPE_FILE_TRANSFER,
+						      _("Error reading file"));
+				break;
+			}
+
+			if (bytes_read == 0) {
+				/* read-ahead: source_ready_cb() wakes us */
+				break;
+			}
+
+			queue_source_chunk(ft_private, payload, bytes_read);
+			ft_private->bytes_transferred += bytes_read;
+			continue;
+		}
+
+		bytes_read = sipe_backend_ft_read_file(SIPE_FILE_TRANSFER,
+						       ft_private->out_buffer + FT_LYNC_CHUNK_HEADER_LENGTH,
+						       FT_LYNC_CHUNK_MAX_LENGTH);
+		if (bytes_read < 0) {
+			/* backend has already raised the error */
+			break;
+		}
+
+		if (bytes_read == 0) {
+			/* try again in the next round */
+			sipe_ft_flow_wake(ft_private->flow);
+			break;
+		}
+
+		queue_chunk(ft_private, 0x00, NULL, bytes_read);
+		ft_private->bytes_transferred += bytes_read;
+	}
+
+	return(budget - left);
+}
+
+static void
+writable_cb(SIPE_UNUSED_PARAMETER struct sipe_media_call *call,
+	    struct sipe_media_stream *stream,
+	    gboolean writable)
+{
+	struct sipe_file_transfer_lync *ft_private =
+			sipe_media_stream_get_data(stream);
+
+	/* resume sending if we were waiting for the stream */
+	if (writable && ft_private && ft_private->out_buffer &&
+	    (!ft_private->end_queued ||
+	     (ft_private->out_offset < ft_private->out_length))) {
+		sipe_ft_flow_wake(ft_private->flow);
 	}
+}
 
-	return G_SOURCE_CONTINUE;
+static void
+source_ready_cb(gpointer data)
+{
+	struct sipe_file_transfer_lync *ft_private = data;
+	sipe_ft_flow_wake(ft_private->flow);
 }
 
 static void
@@ -506,18 +826,28 @@ start_writing(struct sipe_file_transfer_lync *ft_private)
 			sipe_core_media_get_stream_by_id(call, "data");
 
 	if (stream) {
-		gchar *request_id_str =
-				g_strdup_printf("%u", ft_private->request_id);
-
-		write_chunk(call, stream, 0x01, strlen(request_id_str),
-			    request_id_str, TRUE);
-
-		g_free(request_id_str);
+		if (!ft_private->out_buffer)
+			ft_private->out_buffer = g_malloc(FT_LYNC_CHUNK_HEADER_LENGTH +
+							  FT_LYNC_CHUNK_MAX_LENGTH);
+		queue_request_id_chunk(ft_private, 0x01);
+
+		ft_private->source = sipe_backend_ft_open_source((struct sipe_core_public *) ft_private->sipe_private,
+								 SIPE_FILE_TRANSFER);
+		if (ft_private->source)
+			sipe_ft_source_set_ready_cb(ft_private->source,
+						    source_ready_cb,
+						    ft_private);
+
+		ft_private->timer = g_timer_new();
+		call->writable_cb = writable_cb;
+
+		ft_private->flow = sipe_ft_flow_new(ft_private->sipe_private,
+						    SIPE_FT_PRIORITY_BULK,
+						    send_file_data,
+						    ft_private);
 
 		sipe_backend_ft_start(SIPE_FILE_TRANSFER, 0, NULL, 0);
-		ft_private->write_source_id =
-				g_idle_add((GSourceFunc)send_file_chunk,
-					   ft_private);
+		sipe_ft_flow_wake(ft_private->flow);
 	}
 }
 
@@ -686,6 +1016,7 @@ sipe_core_ft_lync_create_outgoing(struct sipe_core_public *sipe_public)
 	ft_private->public.init = ft_lync_outgoing_init;
 	ft_private->public.end = ft_lync_outgoing_end;
 	ft_private->public.deallocate = ft_lync_deallocate;
+	ft_private->public.progress = ft_lync_progress;
 
 	return (struct sipe_file_transfer *)ft_private;
 }
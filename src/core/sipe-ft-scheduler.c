@@ -0,0 +1,341 @@
+/**
+ * @file sipe-ft-scheduler.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-ft-scheduler.h"
+#include "sipe-utils.h"
+
+#define SIPE_FT_PRIORITIES       2
+#define SIPE_FT_QUANTUM          (32 * 1024)          /* bytes per round */
+#define SIPE_FT_DEFICIT_MAX      (4 * SIPE_FT_QUANTUM)
+#define SIPE_FT_RATE_WINDOW      1000                 /* milliseconds */
+#define SIPE_FT_WAIT_MIN         10                   /* milliseconds */
+#define SIPE_FT_ENVIRONMENT_RATE "SIPE_TRANSFER_RATE"
+
+struct sipe_ft_scheduler {
+	GQueue *active[SIPE_FT_PRIORITIES]; /* round-robin order */
+	GSList *flows;
+	struct sipe_ft_flow *running;       /* inside send callback */
+	GMainContext *context;              /* of the SIPE instance */
+	GSource *source;
+
+	/* token bucket, rate 0 means unlimited */
+	guint64 rate;                       /* bytes per second */
+	guint64 tokens;
+	gint64 refilled;                    /* sipe_utils_monotonic_msec() */
+};
+
+struct sipe_ft_flow {
+	struct sipe_ft_scheduler *scheduler; /* NULL: detached */
+	guint priority;
+	sipe_ft_flow_send *send;
+	gpointer data;
+	gsize deficit;
+	gboolean active;
+	gboolean rewake;                     /* woken from send callback */
+	gboolean freed;                      /* freed from send callback */
+
+	/* throughput */
+	guint64 bytes;
+	gint64 started;                      /* sipe_utils_monotonic_msec() */
+	gint64 window_start;
+	guint64 window_bytes;
+	guint64 rate;                        /* bytes per second */
+};
+
+static struct sipe_ft_scheduler *scheduler_new(struct sipe_core_private *sipe_private)
+{
+	struct sipe_ft_scheduler *scheduler = g_new0(struct sipe_ft_scheduler, 1);
+	const gchar *rate = g_getenv(SIPE_FT_ENVIRONMENT_RATE);
+	guint i;
+
+	for (i = 0; i < SIPE_FT_PRIORITIES; i++)
+		scheduler->active[i] = g_queue_new();
+	scheduler->context = SIPE_CORE_PUBLIC->context;
+
+	if (rate)
+		scheduler->rate = g_ascii_strtoull(rate, NULL, 10);
+	if (scheduler->rate) {
+		SIPE_DEBUG_INFO("scheduler_new: transfer rate limited to %" G_GUINT64_FORMAT " bytes/s",
+				scheduler->rate);
+		scheduler->tokens   = scheduler->rate;
+		scheduler->refilled = sipe_utils_monotonic_msec();
+	}
+
+	return(scheduler);
+}
+
+static void scheduler_refill(struct sipe_ft_scheduler *scheduler)
+{
+	gint64 now = sipe_utils_monotonic_msec();
+	gint64 elapsed = now - scheduler->refilled;
+
+	if (elapsed > 0) {
+		/* allow bursts of one second, but at least one quantum */
+		guint64 burst = MAX(scheduler->rate, SIPE_FT_QUANTUM);
+
+		scheduler->tokens += scheduler->rate * elapsed / 1000;
+		if (scheduler->tokens > burst)
+			scheduler->tokens = burst;
+		scheduler->refilled = now;
+	}
+}
+
+static void flow_account(struct sipe_ft_flow *flow, gsize sent)
+{
+	gint64 now = sipe_utils_monotonic_msec();
+
+	if (!flow->started)
+		flow->started = flow->window_start = now;
+
+	flow->bytes        += sent;
+	flow->window_bytes += sent;
+
+	if (now - flow->window_start >= SIPE_FT_RATE_WINDOW) {
+		flow->rate = flow->window_bytes * 1000 / (now - flow->window_start);
+		flow->window_start = now;
+		flow->window_bytes = 0;
+	}
+}
+
+/* one deficit round-robin round over all flows of a priority class */
+static void scheduler_round(struct sipe_ft_scheduler *scheduler,
+			    GQueue *queue,
+			    gsize *budget)
+{
+	guint count = g_queue_get_length(queue);
+
+	while (count-- && *budget) {
+		struct sipe_ft_flow *flow = g_queue_pop_head(queue);
+		gsize allowance;
+		gsize sent;
+
+		flow->deficit = MIN(flow->deficit + SIPE_FT_QUANTUM,
+				    SIPE_FT_DEFICIT_MAX);
+		allowance     = MIN(flow->deficit, *budget);
+		flow->rewake  = FALSE;
+
+		scheduler->running = flow;
+		sent = (*flow->send)(flow->data, allowance);
+		scheduler->running = NULL;
+
+		if (flow->freed) {
+			g_free(flow);
+			continue;
+		}
+
+		sent = MIN(sent, allowance);
+		if (sent) {
+			flow_account(flow, sent);
+			flow->deficit -= sent;
+			*budget       -= sent;
+			if (scheduler->rate)
+				scheduler->tokens -= sent;
+		}
+
+		if (sent || flow->rewake) {
+			g_queue_push_tail(queue, flow);
+		} else {
+			/* idle flows don't keep their deficit */
+			flow->active  = FALSE;
+			flow->deficit = 0;
+		}
+	}
+}
+
+static gboolean scheduler_run(gpointer data);
+
+static void scheduler_kick(struct sipe_ft_scheduler *scheduler)
+{
+	guint i;
+
+	if (scheduler->source)
+		return;
+
+	for (i = 0; i < SIPE_FT_PRIORITIES; i++)
+		if (!g_queue_is_empty(scheduler->active[i]))
+			break;
+	if (i == SIPE_FT_PRIORITIES)
+		return;
+
+	if (scheduler->rate && (scheduler->tokens < SIPE_FT_QUANTUM)) {
+		/* wait until the bucket has been refilled by one quantum */
+		guint64 wait = (SIPE_FT_QUANTUM - scheduler->tokens) * 1000 /
+			scheduler->rate;
+
+		scheduler->source = sipe_utils_timeout_add(scheduler->context,
+							   MAX(wait, SIPE_FT_WAIT_MIN),
+							   scheduler_run,
+							   scheduler);
+	} else {
+		scheduler->source = sipe_utils_timeout_add(scheduler->context,
+							   0,
+							   scheduler_run,
+							   scheduler);
+	}
+}
+
+static gboolean scheduler_run(gpointer data)
+{
+	struct sipe_ft_scheduler *scheduler = data;
+	gsize budget = G_MAXSIZE;
+	guint i;
+
+	scheduler->source = NULL;
+
+	if (scheduler->rate) {
+		scheduler_refill(scheduler);
+		budget = scheduler->tokens;
+	}
+
+	/* strict priority between classes */
+	for (i = 0; i < SIPE_FT_PRIORITIES; i++) {
+		GQueue *queue = scheduler->active[i];
+
+		if (!g_queue_is_empty(queue)) {
+			scheduler_round(scheduler, queue, &budget);
+			break;
+		}
+	}
+
+	scheduler_kick(scheduler);
+	return(FALSE);
+}
+
+struct sipe_ft_flow *sipe_ft_flow_new(struct sipe_core_private *sipe_private,
+				      guint priority,
+				      sipe_ft_flow_send *send,
+				      gpointer data)
+{
+	struct sipe_ft_flow *flow = g_new0(struct sipe_ft_flow, 1);
+
+	if (!sipe_private->ft_scheduler)
+		sipe_private->ft_scheduler = scheduler_new(sipe_private);
+
+	flow->scheduler = sipe_private->ft_scheduler;
+	flow->priority  = MIN(priority, SIPE_FT_PRIORITIES - 1);
+	flow->send      = send;
+	flow->data      = data;
+	flow->scheduler->flows = g_slist_prepend(flow->scheduler->flows, flow);
+
+	return(flow);
+}
+
+void sipe_ft_flow_wake(struct sipe_ft_flow *flow)
+{
+	struct sipe_ft_scheduler *scheduler;
+
+	if (!flow || !flow->scheduler)
+		return;
+	scheduler = flow->scheduler;
+
+	if (scheduler->running == flow) {
+		flow->rewake = TRUE;
+		return;
+	}
+
+	if (!flow->active) {
+		flow->active = TRUE;
+		g_queue_push_tail(scheduler->active[flow->priority], flow);
+	}
+
+	scheduler_kick(scheduler);
+}
+
+gboolean sipe_ft_flow_progress(const struct sipe_ft_flow *flow,
+			       guint64 *bytes,
+			       guint64 *bytes_per_second)
+{
+	if (!flow || !flow->started)
+		return(FALSE);
+
+	*bytes = flow->bytes;
+	if (flow->rate) {
+		*bytes_per_second = flow->rate;
+	} else {
+		/* no complete measurement window yet */
+		gint64 elapsed = sipe_utils_monotonic_msec() - flow->started;
+		*bytes_per_second = flow->bytes * 1000 / MAX(elapsed, 1);
+	}
+
+	return(TRUE);
+}
+
+void sipe_ft_flow_free(struct sipe_ft_flow *flow)
+{
+	struct sipe_ft_scheduler *scheduler;
+
+	if (!flow)
+		return;
+	scheduler = flow->scheduler;
+
+	if (scheduler) {
+		scheduler->flows = g_slist_remove(scheduler->flows, flow);
+		if (scheduler->running == flow) {
+			/* scheduler_round() frees it */
+			flow->freed     = TRUE;
+			flow->scheduler = NULL;
+			return;
+		}
+		if (flow->active)
+			g_queue_remove(scheduler->active[flow->priority], flow);
+	}
+
+	g_free(flow);
+}
+
+void sipe_ft_scheduler_free(struct sipe_core_private *sipe_private)
+{
+	struct sipe_ft_scheduler *scheduler = sipe_private->ft_scheduler;
+	GSList *entry;
+	guint i;
+
+	if (!scheduler)
+		return;
+
+	for (entry = scheduler->flows; entry; entry = entry->next) {
+		struct sipe_ft_flow *flow = entry->data;
+		flow->scheduler = NULL;
+		flow->active    = FALSE;
+	}
+	g_slist_free(scheduler->flows);
+
+	for (i = 0; i < SIPE_FT_PRIORITIES; i++)
+		g_queue_free(scheduler->active[i]);
+	if (scheduler->source)
+		g_source_destroy(scheduler->source);
+	g_free(scheduler);
+	sipe_private->ft_scheduler = NULL;
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
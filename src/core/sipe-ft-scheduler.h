@@ -0,0 +1,125 @@
+/**
+ * @file sipe-ft-scheduler.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Fair-share scheduler for outgoing data streams
+ *
+ * File transfers and application sharing register a flow each. Active
+ * flows are served from one idle source with deficit round-robin, i.e.
+ * every flow may send up to a fixed quantum per round. Interactive flows
+ * are always served before bulk flows. The total rate per account can
+ * be limited with the environment variable SIPE_TRANSFER_RATE (bytes
+ * per second, default 0 = unlimited).
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_ft_flow;
+
+/* Priority classes, lower value is served first */
+#define SIPE_FT_PRIORITY_INTERACTIVE 0
+#define SIPE_FT_PRIORITY_BULK        1
+
+/**
+ * Flow send callback
+ *
+ * Called from the main loop while the flow is active.
+ *
+ * @param data   callback data
+ * @param budget maximum number of bytes to write
+ *
+ * @return number of bytes written. 0 deactivates the flow until the next
+ *         call of @c sipe_ft_flow_wake(), e.g. when the stream is
+ *         congested or there is no data to send.
+ */
+typedef gsize (sipe_ft_flow_send)(gpointer data, gsize budget);
+
+/**
+ * Create flow
+ *
+ * The flow is inactive until @c sipe_ft_flow_wake() is called.
+ *
+ * @param sipe_private SIPE core private data
+ * @param priority     one of @c SIPE_FT_PRIORITY_xxx
+ * @param send         send callback
+ * @param data         callback data
+ *
+ * @return new flow. Must be freed with @c sipe_ft_flow_free()
+ */
+struct sipe_ft_flow *sipe_ft_flow_new(struct sipe_core_private *sipe_private,
+				      guint priority,
+				      sipe_ft_flow_send *send,
+				      gpointer data);
+
+/**
+ * Activate flow
+ *
+ * Safe to call from the send callback, i.e. the flow stays active even
+ * if the callback returns 0.
+ *
+ * @param flow flow (may be @c NULL)
+ */
+void sipe_ft_flow_wake(struct sipe_ft_flow *flow);
+
+/**
+ * Query flow throughput
+ *
+ * @param flow             (in)  flow
+ * @param bytes            (out) bytes sent so far
+ * @param bytes_per_second (out) current throughput
+ *
+ * @return @c FALSE if the flow hasn't sent anything yet
+ */
+gboolean sipe_ft_flow_progress(const struct sipe_ft_flow *flow,
+			       guint64 *bytes,
+			       guint64 *bytes_per_second);
+
+/**
+ * Free flow
+ *
+ * Safe to call from the send callback.
+ *
+ * @param flow flow (may be @c NULL)
+ */
+void sipe_ft_flow_free(struct sipe_ft_flow *flow);
+
+/**
+ * Free scheduler of a SIPE instance
+ *
+ * Remaining flows are detached and never called again.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_ft_scheduler_free(struct sipe_core_private *sipe_private);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
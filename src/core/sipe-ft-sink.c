@@ -0,0 +1,299 @@
+/**
+ * @file sipe-ft-sink.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-ft-sink.h"
+#include "sipe-job.h"
+
+/* write-behind: block size and limit of data waiting for the disk */
+#define SINK_BLOCK_SIZE  (256 * 1024)
+#define SINK_MAX_PENDING (4 * SINK_BLOCK_SIZE)
+
+struct sink_block {
+	guchar *data;
+	gsize length;
+};
+
+struct sink_write;
+
+struct sipe_ft_sink {
+	struct sipe_core_private *sipe_private;
+	FILE *fp;
+
+	struct sink_block *current;   /* being filled, NULL if none */
+	GQueue *queued;               /* full blocks, in file order */
+	GSList *free_blocks;
+	struct sink_write *write;     /* in flight, NULL if none */
+	struct sipe_job *job;
+	gsize pending;                /* bytes not yet written */
+	gboolean error;
+
+	sipe_ft_sink_written_cb *written_cb;
+	gpointer written_data;
+};
+
+/* job data */
+struct sink_write {
+	struct sipe_ft_sink *sink;    /* NULL: sink closed */
+	FILE *fp;
+	gboolean fp_owned;            /* TRUE: sink closed */
+	struct sink_block *block;     /* NULL: returned to sink */
+	gboolean error;
+};
+
+static void sink_block_free(struct sink_block *block)
+{
+	if (block) {
+		g_free(block->data);
+		g_free(block);
+	}
+}
+
+/* worker thread */
+static gpointer sink_write_execute(gpointer data)
+{
+	struct sink_write *write = data;
+	struct sink_block *block = write->block;
+
+	write->error = (fwrite(block->data, 1, block->length, write->fp) != block->length) ||
+		       (fflush(write->fp) != 0);
+
+	return(NULL);
+}
+
+/* main thread: always called, also for cancelled jobs */
+static void sink_write_free(gpointer data)
+{
+	struct sink_write *write = data;
+	struct sipe_ft_sink *sink = write->sink;
+
+	/* job was cancelled while sink still exists */
+	if (sink && (sink->write == write)) {
+		sink->write = NULL;
+		sink->job   = NULL;
+		sink->error = TRUE;
+	}
+
+	sink_block_free(write->block);
+	if (write->fp_owned)
+		fclose(write->fp);
+	g_free(write);
+}
+
+static void sink_write_done(struct sipe_core_private *sipe_private,
+			    gpointer result,
+			    gpointer data);
+
+static void sink_write_next(struct sipe_ft_sink *sink)
+{
+	struct sink_write *write;
+	struct sink_block *block;
+
+	if (sink->write || sink->error)
+		return;
+
+	block = g_queue_pop_head(sink->queued);
+	if (!block)
+		return;
+
+	write = g_new0(struct sink_write, 1);
+	write->sink  = sink;
+	write->fp    = sink->fp;
+	write->block = block;
+
+	sink->write = write;
+	sink->job   = sipe_job_submit(sink->sipe_private,
+				      sink_write_execute,
+				      sink_write_done,
+				      write,
+				      sink_write_free,
+				      NULL);
+}
+
+/* main thread */
+static void sink_write_done(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+			    SIPE_UNUSED_PARAMETER gpointer result,
+			    gpointer data)
+{
+	struct sink_write *write = data;
+	struct sipe_ft_sink *sink = write->sink;
+	struct sink_block *block = write->block;
+	gsize written;
+
+	if (!sink)
+		return;
+
+	sink->write = NULL;
+	sink->job   = NULL;
+	write->block = NULL;
+	written = block->length;
+	sink->pending -= written;
+
+	block->length = 0;
+	sink->free_blocks = g_slist_prepend(sink->free_blocks, block);
+
+	if (write->error) {
+		SIPE_DEBUG_ERROR_NOFORMAT("sink_write_done: write failed");
+		sink->error = TRUE;
+		written     = 0;
+	}
+
+	sink_write_next(sink);
+
+	/* might close the sink */
+	if (sink->written_cb)
+		(*sink->written_cb)(sink->written_data, written);
+}
+
+struct sipe_ft_sink *sipe_core_ft_sink_open(struct sipe_core_public *sipe_public,
+					    const gchar *filename)
+{
+	struct sipe_ft_sink *sink;
+	FILE *fp;
+
+	if (!filename)
+		return(NULL);
+
+	fp = g_fopen(filename, "wb");
+	if (!fp) {
+		SIPE_DEBUG_ERROR("sipe_core_ft_sink_open: can't open '%s'", filename);
+		return(NULL);
+	}
+
+	sink = g_new0(struct sipe_ft_sink, 1);
+	sink->sipe_private = SIPE_CORE_PRIVATE;
+	sink->fp     = fp;
+	sink->queued = g_queue_new();
+	SIPE_DEBUG_INFO("sipe_core_ft_sink_open: writing '%s' behind",
+			filename);
+
+	return(sink);
+}
+
+void sipe_ft_sink_set_written_cb(struct sipe_ft_sink *sink,
+				 sipe_ft_sink_written_cb *callback,
+				 gpointer data)
+{
+	sink->written_cb   = callback;
+	sink->written_data = data;
+}
+
+gboolean sipe_ft_sink_write(struct sipe_ft_sink *sink,
+			    const guchar *data,
+			    gsize length)
+{
+	if (sink->error)
+		return(FALSE);
+
+	while (length > 0) {
+		struct sink_block *block = sink->current;
+		gsize copy;
+
+		if (!block) {
+			GSList *entry = sink->free_blocks;
+
+			if (entry) {
+				block = entry->data;
+				sink->free_blocks = g_slist_delete_link(entry, entry);
+			} else {
+				block = g_new0(struct sink_block, 1);
+				block->data = g_malloc(SINK_BLOCK_SIZE);
+			}
+			sink->current = block;
+		}
+
+		copy = MIN(length, SINK_BLOCK_SIZE - block->length);
+		memcpy(block->data + block->length, data, copy);
+		block->length += copy;
+		sink->pending += copy;
+		data          += copy;
+		length        -= copy;
+
+		if (block->length == SINK_BLOCK_SIZE) {
+			g_queue_push_tail(sink->queued, block);
+			sink->current = NULL;
+		}
+	}
+
+	sink_write_next(sink);
+
+	return(TRUE);
+}
+
+void sipe_ft_sink_flush(struct sipe_ft_sink *sink)
+{
+	/* busy worker: keep aggregating */
+	if (sink->write || !sink->current)
+		return;
+
+	g_queue_push_tail(sink->queued, sink->current);
+	sink->current = NULL;
+	sink_write_next(sink);
+}
+
+gboolean sipe_ft_sink_full(const struct sipe_ft_sink *sink)
+{
+	return(sink->pending >= SINK_MAX_PENDING);
+}
+
+void sipe_ft_sink_close(struct sipe_ft_sink *sink)
+{
+	struct sink_block *block;
+
+	if (!sink)
+		return;
+
+	if (sink->write) {
+		/* running job still uses the file */
+		sink->write->sink     = NULL;
+		sink->write->fp_owned = TRUE;
+		sipe_job_cancel(sink->job);
+	} else {
+		fclose(sink->fp);
+	}
+
+	while ((block = g_queue_pop_head(sink->queued)) != NULL)
+		sink_block_free(block);
+	g_queue_free(sink->queued);
+	g_slist_free_full(sink->free_blocks,
+			  (GDestroyNotify) sink_block_free);
+	sink_block_free(sink->current);
+	g_free(sink);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
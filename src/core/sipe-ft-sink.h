@@ -0,0 +1,111 @@
+/**
+ * @file sipe-ft-sink.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * File sink for incoming file transfers
+ *
+ * Received data is collected in blocks which are written behind on a
+ * worker thread, i.e. the main loop never waits for the disk. While the
+ * worker is busy the data of several reads is aggregated into one write.
+ *
+ * Sinks are created by the backend with sipe_backend_ft_open_sink(),
+ * which calls sipe_core_ft_sink_open() for local files.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_ft_sink;
+
+/**
+ * Data written callback
+ *
+ * Called from the main loop after a block has been written to the file.
+ *
+ * @param data    callback data
+ * @param written number of bytes written, 0 on write error
+ */
+typedef void (sipe_ft_sink_written_cb)(gpointer data,
+				       gsize written);
+
+/**
+ * Set data written callback
+ *
+ * @param sink     file sink
+ * @param callback data written callback
+ * @param data     callback data
+ */
+void sipe_ft_sink_set_written_cb(struct sipe_ft_sink *sink,
+				 sipe_ft_sink_written_cb *callback,
+				 gpointer data);
+
+/**
+ * Append data to the file
+ *
+ * @param sink   file sink
+ * @param data   data to write
+ * @param length number of bytes
+ *
+ * @return @c FALSE if an earlier write has failed
+ */
+gboolean sipe_ft_sink_write(struct sipe_ft_sink *sink,
+			    const guchar *data,
+			    gsize length);
+
+/**
+ * Start writing partially filled block if the worker is idle
+ *
+ * @param sink file sink
+ */
+void sipe_ft_sink_flush(struct sipe_ft_sink *sink);
+
+/**
+ * Check write-behind limit
+ *
+ * The caller should stop receiving until the written callback reports
+ * progress.
+ *
+ * @param sink file sink
+ *
+ * @return @c TRUE if too much data is waiting to be written
+ */
+gboolean sipe_ft_sink_full(const struct sipe_ft_sink *sink);
+
+/**
+ * Close file sink
+ *
+ * Data that hasn't been written yet is discarded.
+ *
+ * @param sink file sink (may be @c NULL)
+ */
+void sipe_ft_sink_close(struct sipe_ft_sink *sink);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
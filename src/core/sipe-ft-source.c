@@ -0,0 +1,326 @@
+/**
+ * @file sipe-ft-source.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-ft-source.h"
+#include "sipe-job.h"
+
+/* read-ahead: number and size of alternating buffers */
+#define SOURCE_BLOCKS     2
+#define SOURCE_BLOCK_SIZE (256 * 1024)
+
+struct source_block {
+	guchar *data;
+	gsize length;
+	gsize offset;
+};
+
+struct source_read;
+
+struct sipe_ft_source {
+	struct sipe_core_private *sipe_private;
+
+	/* memory mapped file */
+	GMappedFile *mapped;
+	const guchar *data;
+	gsize length;
+	gsize offset;
+
+	/* read-ahead */
+	FILE *fp;
+	GSList *free_blocks;
+	struct source_block *current;
+	struct source_block *filled;
+	struct source_read *read;     /* in flight, NULL if none */
+	struct sipe_job *job;
+	gboolean eof;
+	gboolean error;
+	gboolean waiting;             /* peek returned 0 */
+
+	sipe_ft_source_ready_cb *ready_cb;
+	gpointer ready_data;
+};
+
+/* job data */
+struct source_read {
+	struct sipe_ft_source *source; /* NULL: source closed */
+	FILE *fp;
+	gboolean fp_owned;             /* TRUE: source closed */
+	struct source_block *block;    /* NULL: taken by source */
+	gsize length;
+	gboolean error;
+};
+
+static void source_block_free(struct source_block *block)
+{
+	if (block) {
+		g_free(block->data);
+		g_free(block);
+	}
+}
+
+/* worker thread */
+static gpointer source_read_execute(gpointer data)
+{
+	struct source_read *read = data;
+
+	read->length = fread(read->block->data, 1, SOURCE_BLOCK_SIZE, read->fp);
+	read->error  = ferror(read->fp) != 0;
+
+	return(NULL);
+}
+
+/* main thread: always called, also for cancelled jobs */
+static void source_read_free(gpointer data)
+{
+	struct source_read *read = data;
+	struct sipe_ft_source *source = read->source;
+
+	/* job was cancelled while source still exists */
+	if (source && (source->read == read)) {
+		source->read  = NULL;
+		source->job   = NULL;
+		source->error = TRUE;
+	}
+
+	source_block_free(read->block);
+	if (read->fp_owned)
+		fclose(read->fp);
+	g_free(read);
+}
+
+static void source_read_next(struct sipe_ft_source *source);
+
+/* main thread */
+static void source_read_done(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+			     SIPE_UNUSED_PARAMETER gpointer result,
+			     gpointer data)
+{
+	struct source_read *read = data;
+	struct sipe_ft_source *source = read->source;
+	struct source_block *block = read->block;
+
+	if (!source)
+		return;
+
+	source->read  = NULL;
+	source->job   = NULL;
+	read->block   = NULL;
+	block->length = read->length;
+	block->offset = 0;
+
+	if (read->error) {
+		source->error = TRUE;
+	} else if (read->length < SOURCE_BLOCK_SIZE) {
+		source->eof = TRUE;
+	}
+
+	if (block->length == 0) {
+		source->free_blocks = g_slist_prepend(source->free_blocks, block);
+	} else if (!source->current) {
+		source->current = block;
+	} else {
+		source->filled = block;
+	}
+
+	source_read_next(source);
+
+	if (source->waiting) {
+		source->waiting = FALSE;
+		if (source->ready_cb)
+			(*source->ready_cb)(source->ready_data);
+	}
+}
+
+static void source_read_next(struct sipe_ft_source *source)
+{
+	struct source_read *read;
+	GSList *entry = source->free_blocks;
+
+	if (source->read || source->eof || source->error || !entry)
+		return;
+
+	read = g_new0(struct source_read, 1);
+	read->source = source;
+	read->fp     = source->fp;
+	read->block  = entry->data;
+	source->free_blocks = g_slist_delete_link(entry, entry);
+
+	source->read = read;
+	source->job  = sipe_job_submit(source->sipe_private,
+				       source_read_execute,
+				       source_read_done,
+				       read,
+				       source_read_free,
+				       NULL);
+}
+
+struct sipe_ft_source *sipe_core_ft_source_open(struct sipe_core_public *sipe_public,
+						const gchar *filename)
+{
+	struct sipe_ft_source *source;
+	GMappedFile *mapped;
+	FILE *fp;
+
+	if (!filename)
+		return(NULL);
+
+	mapped = g_mapped_file_new(filename, FALSE, NULL);
+	if (mapped) {
+		source = g_new0(struct sipe_ft_source, 1);
+		source->sipe_private = SIPE_CORE_PRIVATE;
+		source->mapped = mapped;
+		source->data   = (const guchar *) g_mapped_file_get_contents(mapped);
+		source->length = g_mapped_file_get_length(mapped);
+		SIPE_DEBUG_INFO("sipe_core_ft_source_open: mapped '%s' (%" G_GSIZE_FORMAT " bytes)",
+				filename, source->length);
+		return(source);
+	}
+
+	/* e.g. file too large for address space or not a regular file */
+	fp = g_fopen(filename, "rb");
+	if (fp) {
+		guint i;
+
+		source = g_new0(struct sipe_ft_source, 1);
+		source->sipe_private = SIPE_CORE_PRIVATE;
+		source->fp = fp;
+		for (i = 0; i < SOURCE_BLOCKS; i++) {
+			struct source_block *block = g_new0(struct source_block, 1);
+			block->data = g_malloc(SOURCE_BLOCK_SIZE);
+			source->free_blocks = g_slist_prepend(source->free_blocks,
+							      block);
+		}
+		SIPE_DEBUG_INFO("sipe_core_ft_source_open: reading '%s' ahead",
+				filename);
+		source_read_next(source);
+		return(source);
+	}
+
+	SIPE_DEBUG_ERROR("sipe_core_ft_source_open: can't open '%s'", filename);
+	return(NULL);
+}
+
+void sipe_ft_source_set_ready_cb(struct sipe_ft_source *source,
+				 sipe_ft_source_ready_cb *callback,
+				 gpointer data)
+{
+	source->ready_cb   = callback;
+	source->ready_data = data;
+}
+
+gssize sipe_ft_source_peek(struct sipe_ft_source *source,
+			   const guchar **data,
+			   gsize size)
+{
+	struct source_block *block;
+
+	if (source->mapped) {
+		if (source->offset >= source->length)
+			return(-1);
+		*data = source->data + source->offset;
+		return(MIN(size, source->length - source->offset));
+	}
+
+	block = source->current;
+	if (block) {
+		*data = block->data + block->offset;
+		return(MIN(size, block->length - block->offset));
+	}
+
+	if (source->error || (source->eof && !source->read))
+		return(-1);
+
+	/* source_read_done() will call ready callback */
+	source->waiting = TRUE;
+	return(0);
+}
+
+void sipe_ft_source_consume(struct sipe_ft_source *source,
+			    gsize size)
+{
+	struct source_block *block;
+
+	if (source->mapped) {
+		source->offset += size;
+		return;
+	}
+
+	block = source->current;
+	if (!block)
+		return;
+
+	block->offset += size;
+	if (block->offset >= block->length) {
+		/* block done: switch buffers and refill */
+		source->free_blocks = g_slist_prepend(source->free_blocks, block);
+		source->current = source->filled;
+		source->filled  = NULL;
+		source_read_next(source);
+	}
+}
+
+void sipe_ft_source_close(struct sipe_ft_source *source)
+{
+	if (!source)
+		return;
+
+	if (source->mapped) {
+#if GLIB_CHECK_VERSION(2,22,0)
+		g_mapped_file_unref(source->mapped);
+#else
+		g_mapped_file_free(source->mapped);
+#endif
+	}
+
+	if (source->read) {
+		/* running job still uses the file */
+		source->read->source   = NULL;
+		source->read->fp_owned = TRUE;
+		sipe_job_cancel(source->job);
+	} else if (source->fp) {
+		fclose(source->fp);
+	}
+
+	g_slist_free_full(source->free_blocks,
+			  (GDestroyNotify) source_block_free);
+	source_block_free(source->current);
+	source_block_free(source->filled);
+	g_free(source);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,100 @@
+/**
+ * @file sipe-ft-source.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * File source for outgoing file transfers
+ *
+ * The file is mapped into memory where possible. Otherwise blocks are
+ * read ahead on a worker thread into two alternating buffers. In both
+ * cases the data can be sent directly from the source.
+ *
+ * Sources are created by the backend with sipe_backend_ft_open_source(),
+ * which calls sipe_core_ft_source_open() for local files.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_ft_source;
+
+/**
+ * Data available callback
+ *
+ * Called from the main loop when @c sipe_ft_source_peek() returned 0
+ * and data has been read since.
+ *
+ * @param data callback data
+ */
+typedef void (sipe_ft_source_ready_cb)(gpointer data);
+
+/**
+ * Set data available callback
+ *
+ * @param source   file source
+ * @param callback data available callback
+ * @param data     callback data
+ */
+void sipe_ft_source_set_ready_cb(struct sipe_ft_source *source,
+				 sipe_ft_source_ready_cb *callback,
+				 gpointer data);
+
+/**
+ * Access data at current position
+ *
+ * @param source file source
+ * @param data   (out) start of data. Valid until the next call of
+ *               @c sipe_ft_source_consume() or @c sipe_ft_source_close()
+ * @param size   maximum number of bytes
+ *
+ * @return number of bytes available at @c data, 0 if read-ahead hasn't
+ *         caught up yet or negative at end of file or on read errors
+ */
+gssize sipe_ft_source_peek(struct sipe_ft_source *source,
+			   const guchar **data,
+			   gsize size);
+
+/**
+ * Advance current position
+ *
+ * @param source file source
+ * @param size   number of bytes, must not exceed last peek
+ */
+void sipe_ft_source_consume(struct sipe_ft_source *source,
+			    gsize size);
+
+/**
+ * Close file source
+ *
+ * @param source file source (may be @c NULL)
+ */
+void sipe_ft_source_close(struct sipe_ft_source *source);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -41,10 +41,20 @@
 #include "sipe-ft-tftp.h"
 #include "sipe-nls.h"
 #include "sipe-utils.h"
+#include "sip-transport.h"
 
 #define BUFFER_SIZE 50
 #define SIPE_FT_CHUNK_HEADER_LENGTH  3
 
+/* chunk size field in chunk header is 16 bit */
+#define SIPE_FT_BLOCK_SIZE_MAX       0xFFFF
+/*
+ * When sending data via server with ForeFront installed, block bigger than
+ * this causes ending of transmission. Forefront Security for OCS only exists
+ * for OCS 2007 (R2), i.e. "RTC/3.x" servers.
+ */
+#define SIPE_FT_BLOCK_SIZE_FOREFRONT 2045
+
 static gboolean
 write_exact(struct sipe_file_transfer_private *ft_private, const guchar *data,
 	    gsize size)
@@ -132,7 +142,7 @@ sipe_cipher_context_init(const guchar *enc_key)
         sipe_digest_sha1(enc_key, SIPE_FT_KEY_LENGTH, k2);
 
 	/* 2.) RC4 decryption */
-	return sipe_crypt_ft_start(k2);
+	return sipe_crypt_cipher_start(SIPE_CRYPT_CIPHER_RC4, k2, 16, NULL);
 }
 
 static gpointer
@@ -405,6 +415,7 @@ sipe_ft_tftp_read(struct sipe_file_transfer *ft, guchar **buffer,
 	bytes_to_read = MIN(bytes_remaining, bytes_available);
 	bytes_to_read = MIN(bytes_to_read, ft_private->bytes_remaining_chunk);
 
+	/* the backend takes ownership of the buffer */
 	*buffer = g_malloc(bytes_to_read);
 	if (!*buffer) {
 		sipe_backend_ft_error(SIPE_FILE_TRANSFER_PUBLIC, _("Out of memory"));
@@ -422,23 +433,11 @@ sipe_ft_tftp_read(struct sipe_file_transfer *ft, guchar **buffer,
 	}
 
 	if (bytes_read > 0) {
-		guchar *decrypted = g_malloc(bytes_read);
-
-		if (!decrypted) {
-			sipe_backend_ft_error(SIPE_FILE_TRANSFER_PUBLIC, _("Out of memory"));
-			SIPE_DEBUG_ERROR("sipe_core_ft_read: can't allocate %" G_GSIZE_FORMAT " bytes for decryption buffer",
-					 (gsize)bytes_read);
-			g_free(*buffer);
-			*buffer = NULL;
-			return -1;
-		}
-		sipe_crypt_ft_stream(ft_private->cipher_context,
-				     *buffer, bytes_read, decrypted);
-		g_free(*buffer);
-		*buffer = decrypted;
-
+		/* decrypt in place */
+		sipe_crypt_cipher_stream(ft_private->cipher_context,
+					 *buffer, bytes_read, *buffer);
 		sipe_digest_ft_update(ft_private->hmac_context,
-				      decrypted, bytes_read);
+				      *buffer, bytes_read);
 
 		ft_private->bytes_remaining_chunk -= bytes_read;
 	}
@@ -446,6 +445,23 @@ sipe_ft_tftp_read(struct sipe_file_transfer *ft, guchar **buffer,
 	return(bytes_read);
 }
 
+static gsize
+sipe_ft_tftp_block_size(struct sipe_file_transfer_private *ft_private)
+{
+	const gchar *server = sip_transport_server_version(ft_private->sipe_private);
+	gsize block_size = SIPE_FT_BLOCK_SIZE_FOREFRONT;
+
+	/* unknown server: stay on the safe side */
+	if (server &&
+	    g_str_has_prefix(server, "RTC/") &&
+	    (g_ascii_strtoull(server + 4, NULL, 10) >= 4))
+		block_size = SIPE_FT_BLOCK_SIZE_MAX;
+
+	SIPE_DEBUG_INFO("sipe_ft_tftp_block_size: server '%s' -> block size %" G_GSIZE_FORMAT,
+			server ? server : "", block_size);
+	return(block_size);
+}
+
 gssize
 sipe_ft_tftp_write(struct sipe_file_transfer *ft, const guchar *buffer,
 		   gsize size)
@@ -453,12 +469,11 @@ sipe_ft_tftp_write(struct sipe_file_transfer *ft, const guchar *buffer,
 	struct sipe_file_transfer_private *ft_private = SIPE_FILE_TRANSFER_PRIVATE;
 	gssize bytes_written;
 
-	/* When sending data via server with ForeFront installed, block bigger than
-	 * this default causes ending of transmission. Hard limit block to this value
-	 * when libpurple sends us more data. */
-	const gsize DEFAULT_BLOCK_SIZE = 2045;
-	if (size > DEFAULT_BLOCK_SIZE)
-		size = DEFAULT_BLOCK_SIZE;
+	/* Hard limit block size when the backend sends us more data */
+	if (ft_private->block_size == 0)
+		ft_private->block_size = sipe_ft_tftp_block_size(ft_private);
+	if (size > ft_private->block_size)
+		size = ft_private->block_size;
 
 	if (ft_private->bytes_remaining_chunk == 0) {
 		gssize bytes_read;
@@ -497,9 +512,9 @@ sipe_ft_tftp_write(struct sipe_file_transfer *ft, const guchar *buffer,
 
 		ft_private->bytes_remaining_chunk = size;
 		ft_private->outbuf_ptr = ft_private->encrypted_outbuf;
-		sipe_crypt_ft_stream(ft_private->cipher_context,
-				     buffer, size,
-				     ft_private->encrypted_outbuf);
+		sipe_crypt_cipher_stream(ft_private->cipher_context,
+					 buffer, size,
+					 ft_private->encrypted_outbuf);
 		sipe_digest_ft_update(ft_private->hmac_context,
 				      buffer, size);
 
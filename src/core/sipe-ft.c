@@ -97,6 +97,15 @@ sipe_core_ft_create_outgoing(struct sipe_core_public *sipe_public)
 	return(SIPE_FILE_TRANSFER_PUBLIC);
 }
 
+gboolean
+sipe_core_ft_get_progress(struct sipe_file_transfer *ft,
+			  guint64 *bytes,
+			  guint64 *bytes_per_second)
+{
+	return(ft && ft->progress &&
+	       ft->progress(ft, bytes, bytes_per_second));
+}
+
 void
 sipe_ft_free(struct sipe_file_transfer *ft)
 {
@@ -114,7 +123,7 @@ sipe_ft_free(struct sipe_file_transfer *ft)
 		sipe_backend_network_listen_cancel(ft_private->listendata);
 
 	if (ft_private->cipher_context)
-		sipe_crypt_ft_destroy(ft_private->cipher_context);
+		sipe_crypt_cipher_destroy(ft_private->cipher_context);
 
 	if (ft_private->hmac_context)
 		sipe_digest_ft_destroy(ft_private->hmac_context);
@@ -49,6 +49,7 @@ struct sipe_file_transfer_private {
 	gpointer hmac_context;
 
 	gsize bytes_remaining_chunk;
+	gsize block_size;
 
 	guchar *encrypted_outbuf;
 	guchar *outbuf_ptr;
@@ -41,6 +41,9 @@
 
 struct sipe_groups {
 	GSList *list;
+	GHashTable *by_id;   /* GUINT_TO_POINTER(id) -> sipe_group */
+	GHashTable *by_name; /* name (case insensitive) -> sipe_group */
+	GPtrArray *slots;    /* slot -> sipe_group, NULL if unused */
 };
 
 struct group_user_context {
@@ -108,46 +111,109 @@ process_add_group_response(struct sipe_core_private *sipe_private,
 	return FALSE;
 }
 
+/* the first group with a given ID or name is indexed, like a list scan */
+static void group_index_add(struct sipe_groups *groups,
+			    struct sipe_group *group)
+{
+	gpointer id = GUINT_TO_POINTER(group->id);
+
+	if (!g_hash_table_lookup(groups->by_id, id))
+		g_hash_table_insert(groups->by_id, id, group);
+	if (group->name && !g_hash_table_lookup(groups->by_name, group->name))
+		g_hash_table_insert(groups->by_name, group->name, group);
+}
+
+/* must be called before ID or name of an indexed group are changed */
+static void group_index_remove(struct sipe_groups *groups,
+			       struct sipe_group *group)
+{
+	gpointer id            = GUINT_TO_POINTER(group->id);
+	gboolean id_indexed    = g_hash_table_lookup(groups->by_id, id) == group;
+	gboolean name_indexed  = group->name &&
+		(g_hash_table_lookup(groups->by_name, group->name) == group);
+	GSList *entry;
+
+	if (id_indexed)
+		g_hash_table_remove(groups->by_id, id);
+	if (name_indexed)
+		g_hash_table_remove(groups->by_name, group->name);
+	if (!(id_indexed || name_indexed))
+		return;
+
+	/* duplicates are rare: promote next group with same ID or name */
+	for (entry = groups->list; entry; entry = entry->next) {
+		struct sipe_group *other = entry->data;
+
+		if (other == group)
+			continue;
+		if (id_indexed && (other->id == group->id)) {
+			g_hash_table_insert(groups->by_id, id, other);
+			id_indexed = FALSE;
+		}
+		if (name_indexed && sipe_strcase_equal(other->name, group->name)) {
+			g_hash_table_insert(groups->by_name, other->name, other);
+			name_indexed = FALSE;
+		}
+	}
+}
+
+/* lowest free slot keeps the buddy membership bitmaps small */
+static void group_slot_allocate(struct sipe_groups *groups,
+				struct sipe_group *group)
+{
+	GPtrArray *slots = groups->slots;
+	guint slot;
+
+	for (slot = 0; slot < slots->len; slot++)
+		if (!g_ptr_array_index(slots, slot))
+			break;
+
+	if (slot == slots->len)
+		g_ptr_array_add(slots, group);
+	else
+		slots->pdata[slot] = group;
+	group->slot = slot;
+}
+
+static void group_rename(struct sipe_core_private *sipe_private,
+			 struct sipe_group *group,
+			 const gchar *name)
+{
+	struct sipe_groups *groups = sipe_private->groups;
+
+	group_index_remove(groups, group);
+	g_free(group->name);
+	group->name = g_strdup(name);
+	group_index_add(groups, group);
+}
+
 struct sipe_group*
 sipe_group_find_by_id(struct sipe_core_private *sipe_private,
 		      guint id)
 {
-	struct sipe_group *group;
-	GSList *entry;
-
 	if (!sipe_private)
 		return NULL;
 
-	entry = sipe_private->groups->list;
-	while (entry) {
-		group = entry->data;
-		if (group->id == id) {
-			return group;
-		}
-		entry = entry->next;
-	}
-	return NULL;
+	return(g_hash_table_lookup(sipe_private->groups->by_id,
+				   GUINT_TO_POINTER(id)));
 }
 
 struct sipe_group*
 sipe_group_find_by_name(struct sipe_core_private *sipe_private,
 			const gchar * name)
 {
-	struct sipe_group *group;
-	GSList *entry;
-
 	if (!sipe_private || !name)
 		return NULL;
 
-	entry = sipe_private->groups->list;
-	while (entry) {
-		group = entry->data;
-		if (sipe_strequal(group->name, name)) {
-			return group;
-		}
-		entry = entry->next;
-	}
-	return NULL;
+	return(g_hash_table_lookup(sipe_private->groups->by_name, name));
+}
+
+struct sipe_group *sipe_group_find_by_slot(struct sipe_core_private *sipe_private,
+					   guint slot)
+{
+	GPtrArray *slots = sipe_private->groups->slots;
+
+	return((slot < slots->len) ? g_ptr_array_index(slots, slot) : NULL);
 }
 
 void
@@ -193,8 +259,8 @@ gboolean sipe_group_rename(struct sipe_core_private *sipe_private,
 							   group->name,
 							   name);
 	if (renamed) {
-		g_free(group->name);
-		group->name = g_strdup(name);
+		group_rename(sipe_private, group, name);
+		group->roaming_hash = 0;
 	}
 	return(renamed);
 }
@@ -224,14 +290,32 @@ struct sipe_group *sipe_group_add(struct sipe_core_private *sipe_private,
 
 			sipe_private->groups->list = g_slist_append(sipe_private->groups->list,
 								    group);
+			group_index_add(sipe_private->groups, group);
+			group_slot_allocate(sipe_private->groups, group);
 
 			SIPE_DEBUG_INFO("sipe_group_add: created backend group '%s' with id %d",
 					group->name, group->id);
 		} else {
 			SIPE_DEBUG_INFO("sipe_group_add: backend group '%s' already exists",
 					name ? name : "");
-			if (group)
+			if (group) {
 				group->is_obsolete = FALSE;
+
+				/* server data replaces restored data */
+				if (group->id != id) {
+					group_index_remove(sipe_private->groups, group);
+					group->id = id;
+					group_index_add(sipe_private->groups, group);
+				}
+				if (exchange_key && !sipe_strequal(exchange_key, group->exchange_key)) {
+					g_free(group->exchange_key);
+					group->exchange_key = g_strdup(exchange_key);
+				}
+				if (change_key && !sipe_strequal(change_key, group->change_key)) {
+					g_free(group->change_key);
+					group->change_key = g_strdup(change_key);
+				}
+			}
 		}
 	}
 
@@ -241,8 +325,14 @@ struct sipe_group *sipe_group_add(struct sipe_core_private *sipe_private,
 static void group_free(struct sipe_core_private *sipe_private,
 		       struct sipe_group *group)
 {
-	sipe_private->groups->list = g_slist_remove(sipe_private->groups->list,
-						    group);
+	struct sipe_groups *groups = sipe_private->groups;
+
+	/* slot will be reused: drop memberships */
+	sipe_buddy_group_removed(sipe_private, group);
+
+	group_index_remove(groups, group);
+	groups->slots->pdata[group->slot] = NULL;
+	groups->list = g_slist_remove(groups->list, group);
 	g_free(group->name);
 	g_free(group->exchange_key);
 	g_free(group->change_key);
@@ -287,8 +377,7 @@ sipe_core_group_rename(struct sipe_core_public *sipe_public,
 			g_free(request);
 		}
 
-		g_free(s_group->name);
-		s_group->name = g_strdup(new_name);
+		group_rename(sipe_private, s_group, new_name);
 	} else {
 		SIPE_DEBUG_INFO("sipe_core_group_rename: cannot find group '%s'", old_name);
 	}
@@ -335,7 +424,7 @@ static void send_buddy_update(struct sipe_core_private *sipe_private,
 			      struct sipe_buddy *buddy,
 			      const gchar *alias)
 {
-	gchar *groups = sipe_buddy_groups_string(buddy);
+	gchar *groups = sipe_buddy_groups_string(sipe_private, buddy);
 
 	if (groups) {
 		gchar *request;
@@ -413,6 +502,16 @@ void sipe_group_update_start(struct sipe_core_private *sipe_private)
 	}
 }
 
+void sipe_group_update_cancel(struct sipe_core_private *sipe_private)
+{
+	GSList *entry = sipe_private->groups->list;
+
+	while (entry) {
+		((struct sipe_group *) entry->data)->is_obsolete = FALSE;
+		entry = entry->next;
+	}
+}
+
 void sipe_group_update_finish(struct sipe_core_private *sipe_private)
 {
 	GSList *entry = sipe_private->groups->list;
@@ -430,17 +529,51 @@ void sipe_group_update_finish(struct sipe_core_private *sipe_private)
 
 struct sipe_group *sipe_group_first(struct sipe_core_private *sipe_private)
 {
-	return(sipe_private->groups->list ? sipe_private->groups->list->data : NULL);
+	GSList *entry = sipe_private->groups->list;
+
+	/* skip groups that will be removed by sipe_group_update_finish() */
+	while (entry) {
+		struct sipe_group *group = entry->data;
+		if (!group->is_obsolete)
+			return(group);
+		entry = entry->next;
+	}
+
+	return(NULL);
 }
 
 guint sipe_group_count(struct sipe_core_private *sipe_private)
 {
-	return(g_slist_length(sipe_private->groups->list));
+	GSList *entry = sipe_private->groups->list;
+	guint count = 0;
+
+	while (entry) {
+		if (!((struct sipe_group *) entry->data)->is_obsolete)
+			count++;
+		entry = entry->next;
+	}
+
+	return(count);
+}
+
+void sipe_group_foreach(struct sipe_core_private *sipe_private,
+			GFunc callback,
+			gpointer callback_data)
+{
+	g_slist_foreach(sipe_private->groups->list,
+			callback,
+			callback_data);
 }
 
 void sipe_group_init(struct sipe_core_private *sipe_private)
 {
-	sipe_private->groups = g_new0(struct sipe_groups, 1);
+	struct sipe_groups *groups = g_new0(struct sipe_groups, 1);
+
+	groups->by_id        = g_hash_table_new(g_direct_hash, g_direct_equal);
+	groups->by_name      = g_hash_table_new(sipe_strcase_hash,
+						(GEqualFunc) sipe_strcase_equal);
+	groups->slots        = g_ptr_array_new();
+	sipe_private->groups = groups;
 }
 
 void sipe_group_free(struct sipe_core_private *sipe_private)
@@ -450,6 +583,9 @@ void sipe_group_free(struct sipe_core_private *sipe_private)
 	while ((entry = sipe_private->groups->list) != NULL)
 		group_free(sipe_private, entry->data);
 
+	g_hash_table_destroy(sipe_private->groups->by_name);
+	g_hash_table_destroy(sipe_private->groups->by_id);
+	g_ptr_array_free(sipe_private->groups->slots, TRUE);
 	g_free(sipe_private->groups);
 	sipe_private->groups = NULL;
 }
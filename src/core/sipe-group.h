@@ -30,15 +30,31 @@ struct sipe_group {
 	gchar *exchange_key;
 	gchar *change_key;
 	guint id;
+	guint slot;         /* registry slot, bit index for buddy memberships */
+	guint roaming_hash; /* last roaming contacts record, 0 = unknown */
 	gboolean is_obsolete;
 };
 
 struct sipe_group *sipe_group_find_by_id(struct sipe_core_private *sipe_private,
 					 guint id);
 
+/* group names are compared case insensitive, like the backends do */
 struct sipe_group *sipe_group_find_by_name(struct sipe_core_private *sipe_private,
 					   const gchar * name);
 
+/**
+ * Find group by registry slot
+ *
+ * Slots are small integers that are reused after a group has been freed.
+ *
+ * @param sipe_private SIPE core data
+ * @param slot         registry slot of group
+ *
+ * @return sipe_group structure or @c NULL if slot is unused
+ */
+struct sipe_group *sipe_group_find_by_slot(struct sipe_core_private *sipe_private,
+					   guint slot);
+
 void sipe_group_create(struct sipe_core_private *sipe_private,
 		       struct sipe_ucs_transaction *trans,
 		       const gchar *name,
@@ -92,9 +108,18 @@ void sipe_group_update_start(struct sipe_core_private *sipe_private);
  */
 void sipe_group_update_finish(struct sipe_core_private *sipe_private);
 
+/**
+ * Cancel group list update. This will keep all groups.
+ *
+ * @param sipe_private SIPE core data
+ */
+void sipe_group_update_cancel(struct sipe_core_private *sipe_private);
+
 /**
  * Return first group
  *
+ * Groups marked obsolete by sipe_group_update_start() are skipped.
+ *
  * @param sipe_private SIPE core data
  *
  * @return sipe_group structure or @c NULL if there are no groups
@@ -104,10 +129,23 @@ struct sipe_group *sipe_group_first(struct sipe_core_private *sipe_private);
 /**
  * Number of groups
  *
+ * Groups marked obsolete by sipe_group_update_start() are not counted.
+ *
  * @param sipe_private SIPE core data
  */
 guint sipe_group_count(struct sipe_core_private *sipe_private);
 
+/**
+ * Iterate group list
+ *
+ * @param sipe_private  SIPE core data
+ * @param callback      function to call on each group
+ * @param callback_data user data for the callback
+ */
+void sipe_group_foreach(struct sipe_core_private *sipe_private,
+			GFunc callback,
+			gpointer callback_data);
+
 /**
  * Initialize group data
  *
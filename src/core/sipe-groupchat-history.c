@@ -0,0 +1,377 @@
+/**
+ * @file sipe-groupchat-history.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * File format (numbers are little endian guint32):
+ *
+ *   "SIPEHIS1"
+ *   { record length, time stamp, message ID NUL, author NUL, HTML NUL }
+ *
+ * Records are only ever appended. The message ID is the SHA-1 digest of
+ * time stamp, author and text, as XCCOS doesn't provide a persistent one.
+ * The file name is the SHA-1 digest of the channel URI.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-digest.h"
+#include "sipe-groupchat-history.h"
+#include "sipe-utils.h"
+
+#define HISTORY_MAGIC        "SIPEHIS1"
+#define HISTORY_MAGIC_LENGTH 8
+#define HISTORY_KEEP         100               /* records kept in memory */
+#define HISTORY_COMPACT      (5 * HISTORY_KEEP) /* records before rewrite */
+#define HISTORY_REPLAY       25                /* same as server history */
+
+struct history_record {
+	gchar *id;
+	gchar *from;
+	gchar *html;
+	time_t when;
+};
+
+struct sipe_groupchat_history {
+	gchar *filename;
+	FILE *fp;           /* NULL: file can't be written */
+	GQueue *records;    /* tail: newest */
+	GHashTable *ids;    /* key: message ID, value: history_record */
+	time_t stored;      /* newest message from previous sessions */
+};
+
+static void history_record_free(struct history_record *record)
+{
+	g_free(record->id);
+	g_free(record->from);
+	g_free(record->html);
+	g_free(record);
+}
+
+static gchar *history_filename(struct sipe_core_private *sipe_private,
+			       const gchar *uri)
+{
+	gchar *name = g_strdup(sipe_private->username);
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+	gchar *digest_string;
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	sipe_digest_sha1((const guchar *) uri, strlen(uri), digest);
+	digest_string = buff_to_hex_str(digest, SIPE_DIGEST_SHA1_LENGTH);
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    "history",
+				    digest_string,
+				    NULL);
+	g_free(digest_string);
+	g_free(name);
+
+	return(filename);
+}
+
+static gchar *history_message_id(const gchar *from,
+				 time_t when,
+				 const gchar *html)
+{
+	gchar *key = g_strdup_printf("%" G_GINT64_FORMAT "\n%s\n%s",
+				     (gint64) when, from, html);
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+	gchar *id;
+
+	sipe_digest_sha1((const guchar *) key, strlen(key), digest);
+	id = buff_to_hex_str(digest, SIPE_DIGEST_SHA1_LENGTH);
+	g_free(key);
+
+	return(id);
+}
+
+static void history_append(struct sipe_groupchat_history *history,
+			   struct history_record *record)
+{
+	g_queue_push_tail(history->records, record);
+	g_hash_table_insert(history->ids, record->id, record);
+
+	if (g_queue_get_length(history->records) > HISTORY_KEEP) {
+		record = g_queue_pop_head(history->records);
+		g_hash_table_remove(history->ids, record->id);
+		history_record_free(record);
+	}
+}
+
+static void append_u32(GString *buffer, guint32 value)
+{
+	guint32 le = GUINT32_TO_LE(value);
+	g_string_append_len(buffer, (const gchar *) &le, sizeof(le));
+}
+
+static guint32 read_u32(const guchar *p)
+{
+	guint32 value;
+	memcpy(&value, p, sizeof(value));
+	return(GUINT32_FROM_LE(value));
+}
+
+static void history_record_encode(GString *buffer,
+				  const struct history_record *record)
+{
+	gsize id_length   = strlen(record->id) + 1;
+	gsize from_length = strlen(record->from) + 1;
+	gsize html_length = strlen(record->html) + 1;
+
+	append_u32(buffer, 4 + id_length + from_length + html_length);
+	append_u32(buffer, (guint32) record->when);
+	g_string_append_len(buffer, record->id,   id_length);
+	g_string_append_len(buffer, record->from, from_length);
+	g_string_append_len(buffer, record->html, html_length);
+}
+
+/* returns number of records in the file or G_MAXUINT for a damaged file */
+static guint history_read(struct sipe_groupchat_history *history,
+			  const guchar *data,
+			  gsize length)
+{
+	const guchar *p = data + HISTORY_MAGIC_LENGTH;
+	const guchar *end = data + length;
+	guint count = 0;
+
+	if ((length < HISTORY_MAGIC_LENGTH) ||
+	    memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LENGTH))
+		return(G_MAXUINT);
+
+	while (p < end) {
+		const gchar *strings[3];
+		const gchar *s;
+		struct history_record *record;
+		guint32 record_length;
+		guint i;
+
+		if (end - p < 8)
+			return(G_MAXUINT);
+		record_length = read_u32(p);
+		if ((record_length < 4 + 3) ||
+		    (record_length > (guint32) (end - p - 4)) ||
+		    (p[4 + record_length - 1] != '\0'))
+			return(G_MAXUINT);
+
+		/* three NUL terminated strings after the time stamp */
+		s = (const gchar *) p + 8;
+		for (i = 0; i < 3; i++) {
+			if (s >= (const gchar *) p + 4 + record_length)
+				return(G_MAXUINT);
+			strings[i] = s;
+			s += strlen(s) + 1;
+		}
+
+		record       = g_new(struct history_record, 1);
+		record->when = read_u32(p + 4);
+		record->id   = g_strdup(strings[0]);
+		record->from = g_strdup(strings[1]);
+		record->html = g_strdup(strings[2]);
+		if (record->when > history->stored)
+			history->stored = record->when;
+		if (g_hash_table_lookup(history->ids, record->id))
+			history_record_free(record);
+		else
+			history_append(history, record);
+
+		p += 4 + record_length;
+		count++;
+	}
+
+	return(count);
+}
+
+/* replace file with records kept in memory */
+static void history_rewrite(struct sipe_groupchat_history *history)
+{
+	GString *buffer = g_string_new(HISTORY_MAGIC);
+	gchar *dirname = g_path_get_dirname(history->filename);
+	GError *error = NULL;
+	GList *entry;
+
+	for (entry = history->records->head; entry; entry = entry->next)
+		history_record_encode(buffer, entry->data);
+
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(history->filename,
+				  buffer->str, buffer->len,
+				  &error))) {
+		SIPE_DEBUG_ERROR("history_rewrite: can't write '%s': %s",
+				 history->filename,
+				 error ? error->message : "can't create directory");
+		if (error)
+			g_error_free(error);
+	}
+
+	g_free(dirname);
+	g_string_free(buffer, TRUE);
+}
+
+struct sipe_groupchat_history *sipe_groupchat_history_open(struct sipe_core_private *sipe_private,
+							   const gchar *uri)
+{
+	struct sipe_groupchat_history *history = g_new0(struct sipe_groupchat_history, 1);
+	GMappedFile *file;
+	guint count = 0;
+
+	history->filename = history_filename(sipe_private, uri);
+	history->records  = g_queue_new();
+	history->ids      = g_hash_table_new(g_str_hash, g_str_equal);
+
+	file = g_mapped_file_new(history->filename, FALSE, NULL);
+	if (file) {
+		count = history_read(history,
+				     (const guchar *) g_mapped_file_get_contents(file),
+				     g_mapped_file_get_length(file));
+#if GLIB_CHECK_VERSION(2,22,0)
+		g_mapped_file_unref(file);
+#else
+		g_mapped_file_free(file);
+#endif
+	}
+
+	/*
+	 * Damaged files, e.g. after a crash while appending, can't be
+	 * appended to. They are rewritten with their valid records.
+	 */
+	if (!file || (count > HISTORY_COMPACT)) {
+		SIPE_DEBUG_INFO("sipe_groupchat_history_open: %s '%s' with %u messages",
+				file ? "compacting" : "creating",
+				history->filename,
+				g_queue_get_length(history->records));
+		history_rewrite(history);
+	} else {
+		SIPE_DEBUG_INFO("sipe_groupchat_history_open: %u messages for '%s' in '%s'",
+				g_queue_get_length(history->records),
+				uri, history->filename);
+	}
+
+	history->fp = g_fopen(history->filename, "ab");
+	if (!history->fp)
+		SIPE_DEBUG_ERROR("sipe_groupchat_history_open: can't append to '%s'",
+				 history->filename);
+
+	return(history);
+}
+
+guint sipe_groupchat_history_replay(struct sipe_core_private *sipe_private,
+				    struct sipe_groupchat_history *history,
+				    struct sipe_backend_chat_session *backend)
+{
+	guint count = MIN(g_queue_get_length(history->records), HISTORY_REPLAY);
+	GList *entry = history->records->tail;
+	guint i;
+
+	/* oldest of the last HISTORY_REPLAY messages first */
+	for (i = 1; i < count; i++)
+		entry = entry->prev;
+	for (; entry; entry = entry->next) {
+		const struct history_record *record = entry->data;
+		sipe_backend_chat_message(SIPE_CORE_PUBLIC,
+					  backend,
+					  record->from,
+					  record->when,
+					  record->html);
+	}
+
+	return(count);
+}
+
+gboolean sipe_groupchat_history_add(struct sipe_groupchat_history *history,
+				    const gchar *from,
+				    time_t when,
+				    const gchar *html)
+{
+	struct history_record *record;
+	gchar *id;
+
+	/* only messages after the newest stored one are new */
+	if (when < history->stored)
+		return(FALSE);
+
+	id = history_message_id(from, when, html);
+	if (g_hash_table_lookup(history->ids, id)) {
+		g_free(id);
+		return(FALSE);
+	}
+
+	record       = g_new(struct history_record, 1);
+	record->id   = id;
+	record->from = g_strdup(from);
+	record->html = g_strdup(html);
+	record->when = when;
+
+	if (history->fp) {
+		GString *buffer = g_string_new(NULL);
+
+		history_record_encode(buffer, record);
+		if ((fwrite(buffer->str, buffer->len, 1, history->fp) != 1) ||
+		    fflush(history->fp)) {
+			SIPE_DEBUG_ERROR("sipe_groupchat_history_add: can't append to '%s'",
+					 history->filename);
+			fclose(history->fp);
+			history->fp = NULL;
+		}
+		g_string_free(buffer, TRUE);
+	}
+
+	history_append(history, record);
+
+	return(TRUE);
+}
+
+void sipe_groupchat_history_close(struct sipe_groupchat_history *history)
+{
+	if (history) {
+		struct history_record *record;
+
+		if (history->fp)
+			fclose(history->fp);
+		g_hash_table_destroy(history->ids);
+		while ((record = g_queue_pop_head(history->records)) != NULL)
+			history_record_free(record);
+		g_queue_free(history->records);
+		g_free(history->filename);
+		g_free(history);
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
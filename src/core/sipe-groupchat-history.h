@@ -0,0 +1,97 @@
+/**
+ * @file sipe-groupchat-history.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Local message store for group chat channels
+ *
+ * Every channel message is appended to a per-channel file in the user
+ * cache directory. When a channel is joined again after a restart, the
+ * stored messages are shown at once and messages the server sends again
+ * with the channel history are recognized and dropped.
+ *
+ * Interface dependencies:
+ *
+ * <time.h>
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_backend_chat_session;
+struct sipe_core_private;
+struct sipe_groupchat_history;
+
+/**
+ * Open message store for a channel
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          channel URI
+ *
+ * @return message store. Must be freed with @c sipe_groupchat_history_close()
+ */
+struct sipe_groupchat_history *sipe_groupchat_history_open(struct sipe_core_private *sipe_private,
+							   const gchar *uri);
+
+/**
+ * Show stored messages in the backend chat session
+ *
+ * @param sipe_private SIPE core private data
+ * @param history      message store
+ * @param backend      backend chat session
+ *
+ * @return number of messages
+ */
+guint sipe_groupchat_history_replay(struct sipe_core_private *sipe_private,
+				    struct sipe_groupchat_history *history,
+				    struct sipe_backend_chat_session *backend);
+
+/**
+ * Store a channel message
+ *
+ * @param history message store
+ * @param from    author URI
+ * @param when    message time stamp
+ * @param html    message text (HTML)
+ *
+ * @return @c FALSE if the message is already known, i.e. it was already
+ *         shown and must not be passed to the backend again
+ */
+gboolean sipe_groupchat_history_add(struct sipe_groupchat_history *history,
+				    const gchar *from,
+				    time_t when,
+				    const gchar *html);
+
+/**
+ * Close message store
+ *
+ * @param history message store (may be @c NULL)
+ */
+void sipe_groupchat_history_close(struct sipe_groupchat_history *history);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
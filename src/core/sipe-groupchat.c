@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -124,8 +124,10 @@
 #include "sipe-core-private.h"
 #include "sipe-dialog.h"
 #include "sipe-groupchat.h"
+#include "sipe-groupchat-history.h"
 #include "sipe-im.h"
 #include "sipe-nls.h"
+#include "sipe-room-cache.h"
 #include "sipe-schedule.h"
 #include "sipe-session.h"
 #include "sipe-utils.h"
@@ -133,6 +135,15 @@
 
 #define GROUPCHAT_RETRY_TIMEOUT 5*60 /* seconds */
 
+/*
+ * Joins and history fetches are pipelined: queued channels are joined in
+ * batches and only a bounded number of commands is outstanding at a time,
+ * so that joining many channels doesn't flood the server.
+ */
+#define GROUPCHAT_JOIN_BATCH      10 /* channels per cmd:bjoin */
+#define GROUPCHAT_JOIN_WINDOW      2 /* outstanding cmd:bjoin */
+#define GROUPCHAT_HISTORY_WINDOW   4 /* outstanding cmd:bccontext */
+
 /**
  * aib node - magic numbers?
  *
@@ -153,11 +164,18 @@ struct sipe_groupchat {
 	struct sip_session *session;
 	gchar *domain;
 	GSList *join_queue;
+	GSList *pending_joins;
+	GSList *history_queue;
+	guint joins_in_flight;
+	guint history_in_flight;
 	GHashTable *uri_to_chat_session;
 	GHashTable *msgs;
+	GHashTable *histories;      /* key: channel URI */
 	guint envid;
 	guint expires;
 	gboolean connected;
+	struct sipe_room_cache *rooms;
+	gboolean rooms_listing;     /* backend room list is open */
 };
 
 struct sipe_groupchat_msg {
@@ -166,6 +184,9 @@ struct sipe_groupchat_msg {
 	gchar *content;
 	gchar *xccos;
 	guint envid;
+	/* pipelined commands, see groupchat_join_next() */
+	gboolean is_join;
+	gboolean is_history;
 };
 
 /* GDestroyNotify */
@@ -190,8 +211,12 @@ static void sipe_groupchat_allocate(struct sipe_core_private *sipe_private)
 	groupchat->msgs = g_hash_table_new_full(g_int_hash, g_int_equal,
 						NULL,
 						sipe_groupchat_msg_free);
+	groupchat->histories = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free,
+						     (GDestroyNotify) sipe_groupchat_history_close);
 	groupchat->envid = rand();
 	groupchat->connected = FALSE;
+	groupchat->rooms = sipe_room_cache_load(sipe_private);
 	sipe_private->groupchat = groupchat;
 }
 
@@ -199,6 +224,10 @@ static void sipe_groupchat_free_join_queue(struct sipe_groupchat *groupchat)
 {
 	sipe_utils_slist_free_full(groupchat->join_queue, g_free);
 	groupchat->join_queue = NULL;
+	sipe_utils_slist_free_full(groupchat->pending_joins, g_free);
+	groupchat->pending_joins = NULL;
+	sipe_utils_slist_free_full(groupchat->history_queue, g_free);
+	groupchat->history_queue = NULL;
 }
 
 void sipe_groupchat_free(struct sipe_core_private *sipe_private)
@@ -208,6 +237,8 @@ void sipe_groupchat_free(struct sipe_core_private *sipe_private)
 		sipe_groupchat_free_join_queue(groupchat);
 		g_hash_table_destroy(groupchat->msgs);
 		g_hash_table_destroy(groupchat->uri_to_chat_session);
+		g_hash_table_destroy(groupchat->histories);
+		sipe_room_cache_free(groupchat->rooms);
 		g_free(groupchat->domain);
 		g_free(groupchat);
 		sipe_private->groupchat = NULL;
@@ -420,6 +451,117 @@ static void groupchat_update_cb(struct sipe_core_private *sipe_private,
 static struct sipe_groupchat_msg *chatserver_command(struct sipe_core_private *sipe_private,
 						     const gchar *cmd);
 
+static void groupchat_join_next(struct sipe_core_private *sipe_private)
+{
+	struct sipe_groupchat *groupchat = sipe_private->groupchat;
+
+	while (groupchat->connected &&
+	       groupchat->pending_joins &&
+	       (groupchat->joins_in_flight < GROUPCHAT_JOIN_WINDOW)) {
+		GString *cmd = g_string_new("<cmd id=\"cmd:bjoin\" seqid=\"1\">"
+					    "<data>");
+		struct sipe_groupchat_msg *msg;
+		guint i = 0;
+
+		while (groupchat->pending_joins && (i < GROUPCHAT_JOIN_BATCH)) {
+			gchar *uri = groupchat->pending_joins->data;
+			gchar *chanid = generate_chanid_node(uri, i++);
+
+			if (chanid) {
+				g_string_append(cmd, chanid);
+				g_free(chanid);
+			}
+			g_free(uri);
+			groupchat->pending_joins = g_slist_delete_link(groupchat->pending_joins,
+								       groupchat->pending_joins);
+		}
+
+		g_string_append(cmd, "</data></cmd>");
+		msg = chatserver_command(sipe_private, cmd->str);
+		g_string_free(cmd, TRUE);
+
+		if (msg) {
+			msg->is_join = TRUE;
+			groupchat->joins_in_flight++;
+		}
+	}
+}
+
+static void groupchat_history_next(struct sipe_core_private *sipe_private)
+{
+	struct sipe_groupchat *groupchat = sipe_private->groupchat;
+
+	while (groupchat->connected &&
+	       groupchat->history_queue &&
+	       (groupchat->history_in_flight < GROUPCHAT_HISTORY_WINDOW)) {
+		gchar *uri = groupchat->history_queue->data;
+		/* Request last 25 entries from channel history */
+		gchar *cmd = g_strdup_printf("<cmd id=\"cmd:bccontext\" seqid=\"1\">"
+					     "<data>"
+					     "<chanib uri=\"%s\"/>"
+					     "<bcq><last cnt=\"25\"/></bcq>"
+					     "</data>"
+					     "</cmd>", uri);
+		struct sipe_groupchat_msg *msg = chatserver_command(sipe_private,
+								    cmd);
+		g_free(cmd);
+		g_free(uri);
+		groupchat->history_queue = g_slist_delete_link(groupchat->history_queue,
+							       groupchat->history_queue);
+
+		if (msg) {
+			msg->is_history = TRUE;
+			groupchat->history_in_flight++;
+		}
+	}
+}
+
+static void groupchat_history_queue(struct sipe_core_private *sipe_private,
+				    const gchar *uri)
+{
+	struct sipe_groupchat *groupchat = sipe_private->groupchat;
+
+	if (!g_slist_find_custom(groupchat->history_queue, uri,
+				 sipe_strcompare))
+		groupchat->history_queue = g_slist_append(groupchat->history_queue,
+							  g_strdup(uri));
+	groupchat_history_next(sipe_private);
+}
+
+/* pipelined command completed, successfully or not */
+static void groupchat_command_done(struct sipe_core_private *sipe_private,
+				   gboolean is_join)
+{
+	struct sipe_groupchat *groupchat = sipe_private->groupchat;
+
+	if (is_join) {
+		if (groupchat->joins_in_flight)
+			groupchat->joins_in_flight--;
+		groupchat_join_next(sipe_private);
+	} else {
+		if (groupchat->history_in_flight)
+			groupchat->history_in_flight--;
+		groupchat_history_next(sipe_private);
+	}
+}
+
+static void groupchat_search_rooms(struct sipe_core_private *sipe_private)
+{
+	/* XCCOS has no paging: the result always contains all rooms */
+	chatserver_command(sipe_private,
+			   "<cmd id=\"cmd:chansrch\" seqid=\"1\">"
+			   "<data>"
+			   "<qib qtype=\"BYNAME\" criteria=\"\" extended=\"false\"/>"
+			   "</data>"
+			   "</cmd>");
+}
+
+static void groupchat_rooms_terminate(struct sipe_core_private *sipe_private,
+				      SIPE_UNUSED_PARAMETER gpointer data)
+{
+	sipe_backend_groupchat_room_terminate(SIPE_CORE_PUBLIC);
+}
+
 void sipe_groupchat_invite_response(struct sipe_core_private *sipe_private,
 				    struct sip_dialog *dialog,
 				    struct sipmsg *response)
@@ -468,27 +610,20 @@ void sipe_groupchat_invite_response(struct sipe_core_private *sipe_private,
 
 		groupchat->connected = TRUE;
 
-		/* Any queued joins? */
-		if (groupchat->join_queue) {
-			GString *cmd = g_string_new("<cmd id=\"cmd:bjoin\" seqid=\"1\">"
-						    "<data>");
-			GSList *entry;
-			guint i = 0;
-
-			/* We used g_slist_prepend() to create the list */
-			groupchat->join_queue = entry = g_slist_reverse(groupchat->join_queue);
-			while (entry) {
-				gchar *chanid = generate_chanid_node(entry->data, i++);
-				g_string_append(cmd, chanid);
-				g_free(chanid);
-				entry = entry->next;
-			}
-			sipe_groupchat_free_join_queue(groupchat);
+		/* commands of the previous connection are gone */
+		groupchat->joins_in_flight   = 0;
+		groupchat->history_in_flight = 0;
 
-			g_string_append(cmd, "</data></cmd>");
-			chatserver_command(sipe_private, cmd->str);
-			g_string_free(cmd, TRUE);
-		}
+		/* Any queued joins? We used g_slist_prepend() to create the list */
+		groupchat->pending_joins = g_slist_concat(groupchat->pending_joins,
+							  g_slist_reverse(groupchat->join_queue));
+		groupchat->join_queue = NULL;
+		groupchat_join_next(sipe_private);
+		groupchat_history_next(sipe_private);
+
+		/* refresh room list in the background */
+		if (!sipe_room_cache_fresh(groupchat->rooms))
+			groupchat_search_rooms(sipe_private);
 
 		/* Request outstanding invites from server */
 		invcmd = g_strdup_printf("<cmd id=\"cmd:getinv\" seqid=\"1\">"
@@ -525,6 +660,8 @@ static gboolean chatserver_command_response(struct sipe_core_private *sipe_priva
 	if (msg->response != 200) {
 		struct sipe_groupchat_msg *gmsg = trans->payload->data;
 		struct sipe_chat_session *chat_session = gmsg->session;
+		gboolean is_join    = gmsg->is_join;
+		gboolean is_history = gmsg->is_history;
 
 		SIPE_DEBUG_INFO("chatserver_command_response: failure %d", msg->response);
 
@@ -534,6 +671,10 @@ static gboolean chatserver_command_response(struct sipe_core_private *sipe_priva
 							gmsg->content);
 
 		groupchat_expired_session_response(sipe_private, msg, trans);
+
+		/* no reply will arrive for a failed command */
+		if (is_join || is_history)
+			groupchat_command_done(sipe_private, is_join);
 	}
 	return TRUE;
 }
@@ -603,14 +744,21 @@ static void chatserver_response_channel_search(struct sipe_core_private *sipe_pr
 					       const sipe_xml *xml)
 {
 	struct sipe_core_public *sipe_public = SIPE_CORE_PUBLIC;
+	struct sipe_groupchat *groupchat = sipe_private->groupchat;
+	gboolean listing = groupchat->rooms_listing;
+
+	groupchat->rooms_listing = FALSE;
 
 	if (result != 200) {
-		sipe_backend_notify_error(sipe_public,
-					  _("Error retrieving room list"),
-					  message);
+		if (listing)
+			sipe_backend_notify_error(sipe_public,
+						  _("Error retrieving room list"),
+						  message);
 	} else {
 		const sipe_xml *chanib;
 
+		sipe_room_cache_update_start(groupchat->rooms);
+
 		for (chanib = sipe_xml_child(xml, "chanib");
 		     chanib;
 		     chanib = sipe_xml_twin(chanib)) {
@@ -673,13 +821,18 @@ static void chatserver_response_channel_search(struct sipe_core_private *sipe_pr
 
 			SIPE_DEBUG_INFO("group chat channel '%s': '%s' (%s) with %u users, flags 0x%x",
 					name, desc, uri, user_count, flags);
-			sipe_backend_groupchat_room_add(sipe_public,
-							uri, name, desc,
-							user_count, flags);
+			sipe_room_cache_update(sipe_private,
+					       groupchat->rooms,
+					       listing,
+					       uri, name, desc,
+					       user_count, flags);
 		}
+
+		sipe_room_cache_update_finish(sipe_private, groupchat->rooms);
 	}
 
-	sipe_backend_groupchat_room_terminate(sipe_public);
+	if (listing)
+		sipe_backend_groupchat_room_terminate(sipe_public);
 }
 
 static gboolean is_chanop(const sipe_xml *aib)
@@ -742,6 +895,12 @@ static void chatserver_response_join(struct sipe_core_private *sipe_private,
 				const gchar *attr = sipe_xml_attribute(node, "name");
 				gchar *self = sip_uri_self(sipe_private);
 				const sipe_xml *aib;
+				struct sipe_groupchat_history *history;
+				GHashTable *members = g_hash_table_new(g_str_hash,
+								       g_str_equal);
+				GSList *users     = NULL;
+				GSList *chanops   = NULL;
+				GSList *entry;
 
 				if (new) {
 					chat_session = sipe_chat_create_session(SIPE_CHAT_TYPE_GROUPCHAT,
@@ -790,11 +949,18 @@ static void chatserver_response_join(struct sipe_core_private *sipe_private,
 						while (*uid) {
 							const gchar *uri = g_hash_table_lookup(user_ids,
 											       *uid);
-							if (uri)
-								add_user(chat_session,
-									 uri,
-									 FALSE,
-									 chanop);
+							if (uri) {
+								if (!g_hash_table_lookup(members, uri)) {
+									g_hash_table_insert(members,
+											    (gpointer) uri,
+											    (gpointer) uri);
+									users = g_slist_prepend(users,
+												(gpointer) uri);
+								}
+								if (chanop)
+									chanops = g_slist_prepend(chanops,
+												  (gpointer) uri);
+							}
 							uid++;
 						}
 
@@ -802,15 +968,40 @@ static void chatserver_response_join(struct sipe_core_private *sipe_private,
 					}
 				}
 
-				/* Request last 25 entries from channel history */
-				self = g_strdup_printf("<cmd id=\"cmd:bccontext\" seqid=\"1\">"
-						       "<data>"
-						       "<chanib uri=\"%s\"/>"
-						       "<bcq><last cnt=\"25\"/></bcq>"
-						       "</data>"
-						       "</cmd>", chat_session->id);
-				chatserver_command(sipe_private, self);
-				g_free(self);
+				/* large rooms: hand over the roster in one go */
+				SIPE_DEBUG_INFO("room %s: %u users",
+						chat_session->id,
+						g_hash_table_size(members));
+				users = g_slist_reverse(users);
+				sipe_backend_chat_add_many(chat_session->backend,
+							   users,
+							   FALSE);
+				for (entry = chanops; entry; entry = entry->next)
+					sipe_backend_chat_operator(chat_session->backend,
+								   entry->data);
+				g_slist_free(chanops);
+				g_slist_free(users);
+				g_hash_table_destroy(members);
+
+				/* show stored messages before the server history */
+				history = g_hash_table_lookup(groupchat->histories,
+							      chat_session->id);
+				if (!history) {
+					history = sipe_groupchat_history_open(sipe_private,
+									      chat_session->id);
+					g_hash_table_insert(groupchat->histories,
+							    g_strdup(chat_session->id),
+							    history);
+				}
+				if (new)
+					SIPE_DEBUG_INFO("room %s: %u stored messages",
+							chat_session->id,
+							sipe_groupchat_history_replay(sipe_private,
+										      history,
+										      chat_session->backend));
+
+				groupchat_history_queue(sipe_private,
+							chat_session->id);
 			}
 		}
 
@@ -818,10 +1009,20 @@ static void chatserver_response_join(struct sipe_core_private *sipe_private,
 	}
 }
 
+static void chatserver_response_bjoin(struct sipe_core_private *sipe_private,
+				      struct sip_session *session,
+				      guint result,
+				      const gchar *message,
+				      const sipe_xml *xml)
+{
+	chatserver_response_join(sipe_private, session, result, message, xml);
+	groupchat_command_done(sipe_private, TRUE);
+}
+
 static void chatserver_grpchat_message(struct sipe_core_private *sipe_private,
 				       const sipe_xml *grpchat);
 
-static void chatserver_response_history(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+static void chatserver_response_history(struct sipe_core_private *sipe_private,
 					SIPE_UNUSED_PARAMETER struct sip_session *session,
 					SIPE_UNUSED_PARAMETER guint result,
 					SIPE_UNUSED_PARAMETER const gchar *message,
@@ -835,6 +1036,8 @@ static void chatserver_response_history(SIPE_UNUSED_PARAMETER struct sipe_core_p
 		if (sipe_strequal(sipe_xml_attribute(grpchat, "id"),
 				  "grpchat"))
 			chatserver_grpchat_message(sipe_private, grpchat);
+
+	groupchat_command_done(sipe_private, FALSE);
 }
 
 static void chatserver_response_part(struct sipe_core_private *sipe_private,
@@ -861,6 +1064,7 @@ static void chatserver_response_part(struct sipe_core_private *sipe_private,
 
 			g_hash_table_remove(groupchat->uri_to_chat_session,
 					    uri);
+			g_hash_table_remove(groupchat->histories, uri);
 			sipe_chat_remove_session(chat_session);
 
 		} else {
@@ -961,7 +1165,7 @@ static const struct response {
 	{ "rpl:requri",    chatserver_response_uri },
 	{ "rpl:chansrch",  chatserver_response_channel_search },
 	{ "rpl:join",      chatserver_response_join },
-	{ "rpl:bjoin",     chatserver_response_join },
+	{ "rpl:bjoin",     chatserver_response_bjoin },
 	{ "rpl:bccontext", chatserver_response_history },
 	{ "rpl:part",      chatserver_response_part },
 	{ "ntc:join",      chatserver_notice_join },
@@ -1024,6 +1228,7 @@ static void chatserver_grpchat_message(struct sipe_core_private *sipe_private,
 	time_t when = sipe_utils_str_to_time(sipe_xml_attribute(grpchat, "ts"));
 	gchar *text = sipe_xml_data(sipe_xml_child(grpchat, "chat"));
 	struct sipe_chat_session *chat_session;
+	struct sipe_groupchat_history *history;
 	gchar *escaped;
 
 	if (!uri || !from) {
@@ -1045,6 +1250,17 @@ static void chatserver_grpchat_message(struct sipe_core_private *sipe_private,
 	/* libxml2 decodes all entities, but the backend expects HTML */
 	escaped = g_markup_escape_text(text, -1);
 	g_free(text);
+
+	/* channel history after reconnect repeats messages already shown */
+	history = g_hash_table_lookup(groupchat->histories, uri);
+	if (history &&
+	    !sipe_groupchat_history_add(history, from, when, escaped)) {
+		SIPE_DEBUG_INFO("chatserver_grpchat_message: dropping known message from '%s' in '%s'",
+				from, uri);
+		g_free(escaped);
+		return;
+	}
+
 	sipe_backend_chat_message(SIPE_CORE_PUBLIC, chat_session->backend,
 				  from, when, escaped);
 	g_free(escaped);
@@ -1183,16 +1399,29 @@ gboolean sipe_core_groupchat_query_rooms(struct sipe_core_public *sipe_public)
 {
 	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
 	struct sipe_groupchat *groupchat = sipe_private->groupchat;
+	gboolean shown;
 
-	if (!groupchat || !groupchat->connected)
+	if (!groupchat)
 		return FALSE;
 
-	chatserver_command(sipe_private,
-			   "<cmd id=\"cmd:chansrch\" seqid=\"1\">"
-			   "<data>"
-			   "<qib qtype=\"BYNAME\" criteria=\"\" extended=\"false\"/>"
-			   "</data>"
-			   "</cmd>");
+	/* show last known list immediately */
+	shown = sipe_room_cache_show(sipe_private, groupchat->rooms) > 0;
+
+	if (groupchat->connected && !sipe_room_cache_fresh(groupchat->rooms)) {
+		/* rooms not shown yet are added when the result arrives */
+		groupchat->rooms_listing = TRUE;
+		groupchat_search_rooms(sipe_private);
+	} else if (shown || groupchat->connected) {
+		/* backend room list must be open before it can be terminated */
+		sipe_schedule_mseconds(sipe_private,
+				       "<+groupchat-rooms>",
+				       NULL,
+				       0,
+				       groupchat_rooms_terminate,
+				       NULL);
+	} else {
+		return FALSE;
+	}
 
 	return TRUE;
 }
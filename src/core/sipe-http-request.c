@@ -29,6 +29,7 @@
  *  - connection request queue handling
  *  - compile HTTP header contents and hand-off to transport layer
  *  - process HTTP response and hand-off to user callback
+ *  - pass on streamed response body
  */
 
 #ifdef HAVE_CONFIG_H
@@ -44,7 +45,10 @@
 #include "sipe-backend.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-debug.h"
 #include "sipe-http.h"
+#include "sipe-metrics.h"
+#include "sipe-utils.h"
 
 #define _SIPE_HTTP_PRIVATE_IF_REQUEST
 #include "sipe-http-request.h"
@@ -62,7 +66,7 @@ struct sipe_http_request {
 
 	gchar *path;
 	gchar *headers;
-	gchar *body;           /* NULL for GET */
+	GString *body;         /* NULL for GET */
 	gchar *content_type;   /* NULL if body == NULL */
 	gchar *authorization;
 
@@ -70,15 +74,29 @@ struct sipe_http_request {
 	const gchar *password; /* not copied */
 
 	sipe_http_response_callback *cb;
+	sipe_http_body_callback *body_cb; /* NULL unless streaming */
 	gpointer cb_data;
 
 	guint32 flags;
+	gint64 sent; /* sipe_utils_monotonic_msec() */
+	guint id;    /* correlation key for event trace */
 };
 
 #define SIPE_HTTP_REQUEST_FLAG_FIRST     0x00000001
 #define SIPE_HTTP_REQUEST_FLAG_REDIRECT  0x00000002
 #define SIPE_HTTP_REQUEST_FLAG_AUTHDATA  0x00000004
 #define SIPE_HTTP_REQUEST_FLAG_HANDSHAKE 0x00000008
+#define SIPE_HTTP_REQUEST_FLAG_PIPELINE  0x00000010
+#define SIPE_HTTP_REQUEST_FLAG_READY     0x00000020
+#define SIPE_HTTP_REQUEST_FLAG_SENT      0x00000040 /* waiting for response */
+#define SIPE_HTTP_REQUEST_FLAG_CANCELLED 0x00000080 /* discard response */
+#define SIPE_HTTP_REQUEST_FLAG_STREAMED  0x00000100 /* body partially delivered */
+
+/* last request number, see sipe_debug_event_id() */
+static guint request_id = 0;
+
+/* maximum number of pipelined requests on the wire per connection */
+#define SIPE_HTTP_PIPELINE_DEPTH 4
 
 static void sipe_http_request_free(struct sipe_core_private *sipe_private,
 				   struct sipe_http_request *req,
@@ -93,15 +111,16 @@ static void sipe_http_request_free(struct sipe_core_private *sipe_private,
 			   req->cb_data);
 	g_free(req->path);
 	g_free(req->headers);
-	g_free(req->body);
+	if (req->body)
+		g_string_free(req->body, TRUE);
 	g_free(req->content_type);
 	g_free(req->authorization);
 	g_free(req);
 }
 
-static void sipe_http_request_send(struct sipe_http_connection_public *conn_public)
+static void sipe_http_request_send(struct sipe_http_connection_public *conn_public,
+				   struct sipe_http_request *req)
 {
-	struct sipe_http_request *req = conn_public->pending_requests->data;
 	gchar *header;
 	gchar *content = NULL;
 	gchar *cookie  = NULL;
@@ -109,7 +128,7 @@ static void sipe_http_request_send(struct sipe_http_connection_public *conn_publ
 	if (req->body)
 		content = g_strdup_printf("Content-Length: %" G_GSIZE_FORMAT "\r\n"
 					  "Content-Type: %s\r\n",
-					  strlen(req->body),
+					  req->body->len,
 					  req->content_type);
 
 	if (req->session && req->session->cookie)
@@ -118,6 +137,7 @@ static void sipe_http_request_send(struct sipe_http_connection_public *conn_publ
 	header = g_strdup_printf("%s /%s HTTP/1.1\r\n"
 				 "Host: %s\r\n"
 				 "User-Agent: Sipe/" PACKAGE_VERSION "\r\n"
+				 "Accept-Encoding: gzip, deflate\r\n"
 				 "%s%s%s%s",
 				 content ? "POST" : "GET",
 				 req->path,
@@ -134,20 +154,135 @@ static void sipe_http_request_send(struct sipe_http_connection_public *conn_publ
 	g_free(req->authorization);
 	req->authorization = NULL;
 
+	req->flags |= SIPE_HTTP_REQUEST_FLAG_SENT;
+	conn_public->in_flight++;
+	req->sent = sipe_utils_monotonic_msec();
+	sipe_metrics_count(conn_public->sipe_private, SIPE_METRIC_HTTP_REQUESTS);
+	sipe_debug_event_id(SIPE_DEBUG_EVENT_HTTP_REQUEST,
+			    req->id,
+			    conn_public->host,
+			    0,
+			    req->body ? req->body->len : 0,
+			    0);
+
 	sipe_http_transport_send(conn_public,
 				 header,
-				 req->body);
+				 req->body ? req->body->str : NULL,
+				 req->body ? req->body->len : 0);
 	g_free(header);
 }
 
 gboolean sipe_http_request_pending(struct sipe_http_connection_public *conn_public)
 {
-	return(conn_public->pending_requests != NULL);
+	return(!g_queue_is_empty(conn_public->pending_requests));
+}
+
+void sipe_http_request_memory_usage(struct sipe_http_connection_public *conn_public,
+				    struct sipe_memory_usage *usage)
+{
+	const GList *entry;
+
+	sipe_metrics_memory_string(usage, conn_public->cached_authorization);
+	sipe_metrics_memory_list(usage,
+				 g_queue_get_length(conn_public->pending_requests));
+	for (entry = conn_public->pending_requests->head;
+	     entry;
+	     entry = entry->next) {
+		const struct sipe_http_request *req = entry->data;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_http_request));
+		sipe_metrics_memory_string(usage, req->path);
+		sipe_metrics_memory_string(usage, req->headers);
+		sipe_metrics_memory_string(usage, req->content_type);
+		sipe_metrics_memory_string(usage, req->authorization);
+		if (req->body)
+			SIPE_MEMORY_OBJECT(usage,
+					   sizeof(GString) + req->body->allocated_len);
+	}
+}
+
+/*
+ * Only idempotent requests without any per-request state can be put on
+ * the wire before the response to the previous request has been received.
+ */
+static gboolean sipe_http_request_pipelinable(const struct sipe_http_request *req)
+{
+	return(((req->flags & (SIPE_HTTP_REQUEST_FLAG_PIPELINE  |
+			       SIPE_HTTP_REQUEST_FLAG_READY     |
+			       SIPE_HTTP_REQUEST_FLAG_HANDSHAKE |
+			       SIPE_HTTP_REQUEST_FLAG_CANCELLED)) ==
+		(SIPE_HTTP_REQUEST_FLAG_PIPELINE | SIPE_HTTP_REQUEST_FLAG_READY)) &&
+	       !req->body          &&
+	       !req->session       &&
+	       !req->authorization);
 }
 
 void sipe_http_request_next(struct sipe_http_connection_public *conn_public)
 {
-	sipe_http_request_send(conn_public);
+	GList *entry = conn_public->pending_requests->head;
+	struct sipe_http_request *head = entry ? entry->data : NULL;
+
+	/* skip requests that are already on the wire */
+	while (entry &&
+	       (((struct sipe_http_request *) entry->data)->flags & SIPE_HTTP_REQUEST_FLAG_SENT))
+		entry = entry->next;
+	if (!entry)
+		return;
+
+	/* nothing on the wire: send next request */
+	if (conn_public->in_flight == 0) {
+		sipe_http_request_send(conn_public, entry->data);
+		entry = entry->next;
+	}
+
+	/* pipeline consecutive requests only behind a pipelinable head */
+	if (conn_public->no_pipelining ||
+	    (head->flags & SIPE_HTTP_REQUEST_FLAG_CANCELLED) ||
+	    !((head->flags & SIPE_HTTP_REQUEST_FLAG_PIPELINE) &&
+	      !(head->flags & SIPE_HTTP_REQUEST_FLAG_HANDSHAKE)))
+		return;
+
+	while (entry &&
+	       (conn_public->in_flight < SIPE_HTTP_PIPELINE_DEPTH) &&
+	       sipe_http_request_pipelinable(entry->data)) {
+		sipe_http_request_send(conn_public, entry->data);
+		entry = entry->next;
+	}
+}
+
+void sipe_http_request_disconnected(struct sipe_http_connection_public *conn_public)
+{
+	GList *entry = conn_public->pending_requests->head;
+
+	if (conn_public->in_flight) {
+		SIPE_DEBUG_INFO("sipe_http_request_disconnected: %u request(s) lost on '%s', disabling pipelining",
+				conn_public->in_flight,
+				conn_public->host);
+		conn_public->no_pipelining = TRUE;
+		conn_public->in_flight     = 0;
+	}
+
+	/* unanswered requests will be sent again after re-connect */
+	while (entry) {
+		struct sipe_http_request *req = entry->data;
+		GList *next = entry->next;
+
+		if (req->flags & SIPE_HTTP_REQUEST_FLAG_CANCELLED) {
+			g_queue_delete_link(conn_public->pending_requests, entry);
+			sipe_http_request_free(conn_public->sipe_private,
+					       req,
+					       SIPE_HTTP_STATUS_CANCELLED);
+		} else if (req->flags & SIPE_HTTP_REQUEST_FLAG_STREAMED) {
+			/* receiver can't handle the body a second time */
+			g_queue_delete_link(conn_public->pending_requests, entry);
+			sipe_http_request_free(conn_public->sipe_private,
+					       req,
+					       SIPE_HTTP_STATUS_FAILED);
+		} else
+			req->flags &= ~SIPE_HTTP_REQUEST_FLAG_SENT;
+
+		entry = next;
+	}
 }
 
 static void sipe_http_request_enqueue(struct sipe_core_private *sipe_private,
@@ -164,8 +299,7 @@ static void sipe_http_request_enqueue(struct sipe_core_private *sipe_private,
 	if (!sipe_http_request_pending(conn_public))
 		req->flags |= SIPE_HTTP_REQUEST_FLAG_FIRST;
 
-	conn_public->pending_requests = g_slist_append(conn_public->pending_requests,
-						       req);
+	g_queue_push_tail(conn_public->pending_requests, req);
 }
 
 static void sipe_http_request_drop_context(struct sipe_http_connection_public *conn_public)
@@ -236,8 +370,7 @@ static gboolean sipe_http_request_response_redirection(struct sipe_core_private
 		if (parsed_uri) {
 			/* remove request from old connection */
 			struct sipe_http_connection_public *conn_public = req->connection;
-			conn_public->pending_requests = g_slist_remove(conn_public->pending_requests,
-								       req);
+			g_queue_remove(conn_public->pending_requests, req);
 
 			/* free old request data */
 			g_free(req->path);
@@ -303,9 +436,13 @@ static gboolean sipe_http_request_response_unauthorized(struct sipe_core_private
 	} else {
 #if defined(HAVE_GSSAPI_GSSAPI_H) || defined(HAVE_SSPI)
 #define DEBUG_STRING ", NTLM and Negotiate"
-		/* Use "Negotiate" unless the user requested "NTLM" */
-		if (sipe_private->authentication_type != SIPE_AUTHENTICATION_TYPE_NTLM)
+		gchar *spn = g_strdup_printf("HTTP/%s", conn_public->host);
+
+		/* Use "Negotiate" unless the user requested "NTLM" or it failed for this host */
+		if ((sipe_private->authentication_type != SIPE_AUTHENTICATION_TYPE_NTLM) &&
+		    (sip_sec_mechanism_lookup(spn) != SIPE_AUTHENTICATION_TYPE_NTLM))
 			header = sipmsg_find_auth_header(msg, "Negotiate");
+		g_free(spn);
 		if (header) {
 			type   = SIPE_AUTHENTICATION_TYPE_NEGOTIATE;
 		} else
@@ -350,8 +487,31 @@ static gboolean sipe_http_request_response_unauthorized(struct sipe_core_private
 			 */
 			if ((req->flags & SIPE_HTTP_REQUEST_FLAG_HANDSHAKE) &&
 			    !token_in) {
+				gboolean negotiate = sipe_strequal(sip_sec_context_name(conn_public->context),
+								   "Negotiate");
+
 				SIPE_DEBUG_INFO_NOFORMAT("sipe_http_request_response_unauthorized: authentication failed, throwing away context");
 				sipe_http_request_drop_context(conn_public);
+				sipe_metrics_count(sipe_private, SIPE_METRIC_HTTP_AUTH_WASTED);
+
+				/*
+				 * Server rejected Negotiate: remember NTLM for
+				 * this host and retry this request with it.
+				 * NTLM is never retried, i.e. this recurses
+				 * at most once.
+				 */
+				if (negotiate &&
+				    (sipe_private->authentication_type != SIPE_AUTHENTICATION_TYPE_NTLM) &&
+				    sipmsg_find_auth_header(msg, "NTLM")) {
+					SIPE_DEBUG_INFO("sipe_http_request_response_unauthorized: Negotiate rejected by host '%s', retrying with NTLM",
+							conn_public->host);
+					sip_sec_mechanism_remember(spn,
+								   SIPE_AUTHENTICATION_TYPE_NTLM);
+					req->flags &= ~SIPE_HTTP_REQUEST_FLAG_HANDSHAKE;
+					failed = sipe_http_request_response_unauthorized(sipe_private,
+											 req,
+											 msg);
+				}
 
 			} else if (sip_sec_init_context_step(conn_public->context,
 						      spn,
@@ -361,6 +521,12 @@ static gboolean sipe_http_request_response_unauthorized(struct sipe_core_private
 
 				/* handshake has started */
 				req->flags |= SIPE_HTTP_REQUEST_FLAG_HANDSHAKE;
+				sipe_debug_event_id(SIPE_DEBUG_EVENT_HTTP_AUTH,
+						    req->id,
+						    sip_sec_context_name(conn_public->context),
+						    msg->response,
+						    0,
+						    sipe_utils_monotonic_msec() - req->sent);
 
 				/* generate authorization header */
 				req->authorization = g_strdup_printf("Authorization: %s %s\r\n",
@@ -450,13 +616,52 @@ static void sipe_http_request_response_callback(struct sipe_core_private *sipe_p
 	sipe_http_request_cancel(req);
 }
 
-void sipe_http_request_response(struct sipe_http_connection_public *conn_public,
-				struct sipmsg *msg)
+gboolean sipe_http_request_response(struct sipe_http_connection_public *conn_public,
+				    struct sipmsg *msg)
 {
 	struct sipe_core_private *sipe_private = conn_public->sipe_private;
-	struct sipe_http_request *req = conn_public->pending_requests->data;
+	struct sipe_http_request *req = g_queue_peek_head(conn_public->pending_requests);
+	gboolean reconnect = FALSE;
 	gboolean failed;
 
+	sipe_metrics_count(sipe_private, SIPE_METRIC_HTTP_RESPONSES);
+	sipe_metrics_latency(sipe_private, SIPE_METRIC_HTTP_LATENCY, req->sent);
+	sipe_debug_event_id(SIPE_DEBUG_EVENT_HTTP_RESPONSE,
+			    req->id,
+			    conn_public->host,
+			    msg->response,
+			    (msg->bodylen > 0) ? msg->bodylen : 0,
+			    sipe_utils_monotonic_msec() - req->sent);
+
+	/* responses arrive in request order: head is no longer on the wire */
+	if (req->flags & SIPE_HTTP_REQUEST_FLAG_SENT) {
+		req->flags &= ~SIPE_HTTP_REQUEST_FLAG_SENT;
+		conn_public->in_flight--;
+	}
+
+	if (req->flags & SIPE_HTTP_REQUEST_FLAG_CANCELLED) {
+		SIPE_DEBUG_INFO("sipe_http_request_response: discarding response %d for cancelled request",
+				msg->response);
+		g_queue_pop_head(conn_public->pending_requests);
+		sipe_http_request_free(sipe_private,
+				       req,
+				       SIPE_HTTP_STATUS_CANCELLED);
+		return(FALSE);
+	}
+
+	/*
+	 * Authentication is connection-based and needs a strict
+	 * request/response sequence. Throw away the responses for the
+	 * pipelined requests by re-connecting and stop pipelining.
+	 */
+	if ((msg->response == SIPE_HTTP_STATUS_CLIENT_UNAUTHORIZED) &&
+	    conn_public->in_flight) {
+		SIPE_DEBUG_INFO("sipe_http_request_response: authentication required for '%s', disabling pipelining",
+				conn_public->host);
+		conn_public->no_pipelining = TRUE;
+		reconnect                  = TRUE;
+	}
+
 	if ((req->flags & SIPE_HTTP_REQUEST_FLAG_REDIRECT)   &&
 	    (msg->response >= SIPE_HTTP_STATUS_REDIRECTION)  &&
 	    (msg->response <  SIPE_HTTP_STATUS_CLIENT_ERROR)) {
@@ -498,24 +703,50 @@ void sipe_http_request_response(struct sipe_http_connection_public *conn_public,
 		/* remove failed request */
 		sipe_http_request_cancel(req);
 	}
+
+	return(reconnect);
+}
+
+gboolean sipe_http_request_streaming(struct sipe_http_connection_public *conn_public,
+				     struct sipmsg *msg)
+{
+	struct sipe_http_request *req = g_queue_peek_head(conn_public->pending_requests);
+
+	return(req                                           &&
+	       req->body_cb                                  &&
+	       !(req->flags & SIPE_HTTP_REQUEST_FLAG_CANCELLED) &&
+	       (msg->response >= SIPE_HTTP_STATUS_OK)         &&
+	       (msg->response <  SIPE_HTTP_STATUS_REDIRECTION));
+}
+
+gsize sipe_http_request_body(struct sipe_http_connection_public *conn_public,
+			     const gchar *data,
+			     gsize length)
+{
+	struct sipe_http_request *req = g_queue_peek_head(conn_public->pending_requests);
+
+	/* cancelled while body is received: discard rest */
+	if (!req || !req->body_cb)
+		return(length);
+
+	req->flags |= SIPE_HTTP_REQUEST_FLAG_STREAMED;
+	return((*req->body_cb)(conn_public->sipe_private,
+			       data,
+			       length,
+			       req->cb_data));
 }
 
 void sipe_http_request_shutdown(struct sipe_http_connection_public *conn_public,
 				gboolean abort)
 {
-	if (conn_public->pending_requests) {
-		GSList *entry = conn_public->pending_requests;
-		while (entry) {
-			sipe_http_request_free(conn_public->sipe_private,
-					       entry->data,
-					       abort ?
-					       SIPE_HTTP_STATUS_ABORTED :
-					       SIPE_HTTP_STATUS_FAILED);
-			entry = entry->next;
-		}
-		g_slist_free(conn_public->pending_requests);
-		conn_public->pending_requests = NULL;
-	}
+	struct sipe_http_request *req;
+
+	while ((req = g_queue_pop_head(conn_public->pending_requests)) != NULL)
+		sipe_http_request_free(conn_public->sipe_private,
+				       req,
+				       abort ?
+				       SIPE_HTTP_STATUS_ABORTED :
+				       SIPE_HTTP_STATUS_FAILED);
 
 	if (conn_public->context) {
 		g_free(conn_public->cached_authorization);
@@ -528,14 +759,17 @@ void sipe_http_request_shutdown(struct sipe_http_connection_public *conn_public,
 struct sipe_http_request *sipe_http_request_new(struct sipe_core_private *sipe_private,
 						const struct sipe_http_parsed_uri *parsed_uri,
 						const gchar *headers,
-						const gchar *body,
+						GString *body,
 						const gchar *content_type,
 						sipe_http_response_callback *callback,
 						gpointer callback_data)
 {
 	struct sipe_http_request *req;
-	if (!parsed_uri)
+	if (!parsed_uri) {
+		if (body)
+			g_string_free(body, TRUE);
 		return(NULL);
+	}
 	if (sipe_http_shutting_down(sipe_private)) {
 		SIPE_DEBUG_ERROR("sipe_http_request_new: new HTTP request during shutdown: THIS SHOULD NOT HAPPEN! Debugging information:\n"
 				 "Host:    %s\n"
@@ -547,18 +781,21 @@ struct sipe_http_request *sipe_http_request_new(struct sipe_core_private *sipe_p
 				 parsed_uri->port,
 				 parsed_uri->path,
 				 headers ? headers : "<NONE>",
-				 body ? body : "<EMPTY>");
+				 body ? body->str : "<EMPTY>");
+		if (body)
+			g_string_free(body, TRUE);
 		return(NULL);
 	}
 
 	req          = g_new0(struct sipe_http_request, 1);
 	req->flags   = 0;
+	req->id      = ++request_id;
 	req->cb      = callback;
 	req->cb_data = callback_data;
 	if (headers)
 		req->headers      = g_strdup(headers);
 	if (body) {
-		req->body         = g_strdup(body);
+		req->body         = body;
 		req->content_type = g_strdup(content_type);
 	}
 
@@ -577,10 +814,16 @@ void sipe_http_request_ready(struct sipe_http_request *request)
 {
 	struct sipe_http_connection_public *conn_public = request->connection;
 
-	/* pass first request on already opened connection through directly */
-	if ((request->flags & SIPE_HTTP_REQUEST_FLAG_FIRST) &&
+	request->flags |= SIPE_HTTP_REQUEST_FLAG_READY;
+
+	/*
+	 * pass first request on already opened connection through directly,
+	 * pipelinable requests might be able to join those already in flight
+	 */
+	if ((request->flags & (SIPE_HTTP_REQUEST_FLAG_FIRST |
+			       SIPE_HTTP_REQUEST_FLAG_PIPELINE)) &&
 	    conn_public->connected)
-		sipe_http_request_send(conn_public);
+		sipe_http_request_next(conn_public);
 }
 
 struct sipe_http_session *sipe_http_session_start(void)
@@ -599,8 +842,17 @@ void sipe_http_session_close(struct sipe_http_session *session)
 void sipe_http_request_cancel(struct sipe_http_request *request)
 {
 	struct sipe_http_connection_public *conn_public = request->connection;
-	conn_public->pending_requests = g_slist_remove(conn_public->pending_requests,
-						       request);
+
+	/* request is on the wire: keep it to match the response */
+	if (request->flags & SIPE_HTTP_REQUEST_FLAG_SENT) {
+		request->flags  |= SIPE_HTTP_REQUEST_FLAG_CANCELLED;
+		request->cb      = NULL;
+		request->body_cb = NULL;
+		request->session = NULL;
+		return;
+	}
+
+	g_queue_remove(conn_public->pending_requests, request);
 
 	/* cancelled by requester, don't use callback */
 	request->cb = NULL;
@@ -621,6 +873,22 @@ void sipe_http_request_allow_redirect(struct sipe_http_request *request)
 	request->flags |= SIPE_HTTP_REQUEST_FLAG_REDIRECT;
 }
 
+void sipe_http_request_allow_pipelining(struct sipe_http_request *request)
+{
+	request->flags |= SIPE_HTTP_REQUEST_FLAG_PIPELINE;
+}
+
+void sipe_http_request_stream(struct sipe_http_request *request,
+			      sipe_http_body_callback *callback)
+{
+	request->body_cb = callback;
+}
+
+void sipe_http_request_resume(struct sipe_http_request *request)
+{
+	sipe_http_transport_resume(request->connection);
+}
+
 void sipe_http_request_authentication(struct sipe_http_request *request,
 				      const gchar *user,
 				      const gchar *password)
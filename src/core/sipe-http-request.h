@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2013-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -37,6 +37,7 @@ struct sipmsg;
 struct sipe_core_private;
 struct sipe_http_connection_public;
 struct sipe_http_request;
+struct sipe_memory_usage;
 
 struct sipe_http_parsed_uri {
 	gchar *host;
@@ -69,6 +70,15 @@ void sipe_http_parsed_uri_free(struct sipe_http_parsed_uri *parsed_uri);
  */
 gboolean sipe_http_request_pending(struct sipe_http_connection_public *conn_public);
 
+/**
+ * Estimate memory used by pending requests of HTTP connection
+ *
+ * @param conn_public HTTP connection public data
+ * @param usage       accumulated memory usage
+ */
+void sipe_http_request_memory_usage(struct sipe_http_connection_public *conn_public,
+				    struct sipe_memory_usage *usage);
+
 /**
  * HTTP connection is ready for next request
  *
@@ -76,14 +86,50 @@ gboolean sipe_http_request_pending(struct sipe_http_connection_public *conn_publ
  */
 void sipe_http_request_next(struct sipe_http_connection_public *conn_public);
 
+/**
+ * HTTP connection was closed: unanswered requests must be sent again
+ *
+ * @param conn_public HTTP connection public data
+ */
+void sipe_http_request_disconnected(struct sipe_http_connection_public *conn_public);
+
 /**
  * HTTP response received
  *
  * @param conn_public HTTP connection public data
  * @param msg         parsed message
+ *
+ * @return @c TRUE if the connection must be re-established before
+ *         sending the next request
+ */
+gboolean sipe_http_request_response(struct sipe_http_connection_public *conn_public,
+				    struct sipmsg *msg);
+
+/**
+ * HTTP response header received
+ *
+ * @param conn_public HTTP connection public data
+ * @param msg         parsed message header
+ *
+ * @return @c TRUE if the body must be passed on with
+ *         @c sipe_http_request_body() while it is received
+ */
+gboolean sipe_http_request_streaming(struct sipe_http_connection_public *conn_public,
+				     struct sipmsg *msg);
+
+/**
+ * Streamed HTTP response body fragment received
+ *
+ * @param conn_public HTTP connection public data
+ * @param data        decoded body data
+ * @param length      length of data
+ *
+ * @return number of bytes accepted. Delivery stops for less than
+ *         @c length until @c sipe_http_transport_resume() is called.
  */
-void sipe_http_request_response(struct sipe_http_connection_public *conn_public,
-				struct sipmsg *msg);
+gsize sipe_http_request_body(struct sipe_http_connection_public *conn_public,
+			     const gchar *data,
+			     gsize length);
 
 /**
  * HTTP connection shutdown
@@ -100,7 +146,7 @@ void sipe_http_request_shutdown(struct sipe_http_connection_public *conn_public,
  * @param sipe_private  SIPE core private data
  * @param parsed_uri    pointer to parsed URI
  * @param headers       additional headers to add (may be @c NULL)
- * @param body          body                      (may be @c NULL)
+ * @param body          body, will be owned by request (may be @c NULL)
  * @param content_type  MIME type for body (may be @c NULL if body is @c NULL)
  * @param callback      callback function
  * @param callback_data callback data
@@ -110,7 +156,7 @@ void sipe_http_request_shutdown(struct sipe_http_connection_public *conn_public,
 struct sipe_http_request *sipe_http_request_new(struct sipe_core_private *sipe_private,
 						const struct sipe_http_parsed_uri *parsed_uri,
 						const gchar *headers,
-						const gchar *body,
+						GString *body,
 						const gchar *content_type,
 						sipe_http_response_callback *callback,
 						gpointer callback_data);
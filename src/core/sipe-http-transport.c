@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2013-2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2013-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -26,19 +26,26 @@
  *  - connection handling: opening, closing, timeout
  *  - interface to backend: sending & receiving of raw messages
  *  - request queue pulling
+ *  - gzip/deflate content decoding
+ *  - streaming of response bodies
+ *  - pre-warming connections to the hosts of the previous session
  */
 
 #include <string.h>
-#include <time.h>
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #include "sipmsg.h"
 #include "sipe-backend.h"
 #include "sipe-common.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-debug.h"
 #include "sipe-http.h"
+#include "sipe-limits.h"
+#include "sipe-metrics.h"
+#include "sipe-roster-cache.h"
 #include "sipe-schedule.h"
 #include "sipe-utils.h"
 
@@ -53,30 +60,201 @@
 
 #define SIPE_HTTP_TIMEOUT_ACTION  "<+http-timeout>"
 #define SIPE_HTTP_DEFAULT_TIMEOUT 60 /* in seconds */
+#define SIPE_HTTP_STREAMING_TIMEOUT 300 /* in seconds, without any input */
+#define SIPE_HTTP_DEFAULT_CONNECTIONS 4 /* per host:port */
+#define SIPE_HTTP_ENVIRONMENT_CONNECTIONS "SIPE_HTTP_CONNECTIONS"
+#define SIPE_HTTP_DECODE_BUFFER 16384 /* bytes per decoder step */
+#define SIPE_HTTP_STREAM_FRAGMENT 16384 /* bytes per streamed fragment */
+#define SIPE_HTTP_PREWARM_TIMEOUT 30 /* in seconds, unused warm connection */
+#define SIPE_HTTP_PREWARM_HOSTS 8
+#define SIPE_HTTP_PREWARM_FILE "http.hosts"
+#define SIPE_HTTP_PREWARM_MAGIC "SIPE HTTP HOSTS 1\n"
+
+struct sipe_http_pool;
 
 struct sipe_http_connection {
 	struct sipe_http_connection_public public;
 
 	struct sipe_transport_connection *connection;
 
+	struct sipe_http_body *body; /* NULL unless receiving incomplete body */
+
+	struct sipe_http_pool *pool; /* NULL after connection has been dropped */
 	gchar *host_port;
-	time_t timeout;  /* in seconds from epoch */
+	gint64 timeout;  /* sipe_utils_monotonic_sec() */
+	gboolean use_tls;
+	gboolean warm;   /* pre-opened, no request sent yet */
+};
+
+/* all connections to one host:port */
+struct sipe_http_pool {
+	gchar *host_port;
+	GSList *connections;
+};
+
+/* host that has been used in this session */
+struct sipe_http_host {
+	gchar *host;
+	guint32 port;
 	gboolean use_tls;
+	guint requests;
 };
 
 struct sipe_http {
-	GHashTable *connections;
+	GHashTable *pools; /* key: host_port, value: struct sipe_http_pool */
+	GHashTable *hosts; /* key: host_port, value: struct sipe_http_host */
 	GQueue *timeouts;
-	time_t next_timeout; /* in seconds from epoch, 0 if timer isn't running */
+	gint64 next_timeout; /* sipe_utils_monotonic_sec(), 0 if timer isn't running */
+	guint max_connections; /* per pool */
 	gboolean shutting_down;
 };
 
+enum sipe_http_body_state {
+	SIPE_HTTP_BODY_LENGTH,      /* copying Content-Length data      */
+	SIPE_HTTP_CHUNKED_SIZE,     /* waiting for chunk size line     */
+	SIPE_HTTP_CHUNKED_DATA,     /* copying chunk data               */
+	SIPE_HTTP_CHUNKED_DATA_END, /* waiting for CRLF after chunk     */
+	SIPE_HTTP_CHUNKED_TRAILER,  /* waiting for end of trailer lines */
+	SIPE_HTTP_BODY_COMPLETE     /* waiting for receiver to catch up */
+};
+
+/*
+ * Body that didn't arrive together with its header, kept across input
+ * calls. Either HTTP/1.1 Transfer-Encoding: chunked or Content-Length.
+ */
+struct sipe_http_body {
+	struct sipmsg *msg;   /* parsed header */
+	gchar *header;        /* raw header for debug output */
+	GString *data;        /* decoded data, only undelivered part if streaming */
+	GConverter *decoder;  /* NULL unless Content-Encoding is used */
+	gsize remaining;      /* bytes left in current chunk or body */
+	enum sipe_http_body_state state;
+	gboolean streaming;   /* receiver gets body in fragments */
+	gboolean paused;      /* receiver didn't accept last fragment */
+	gboolean delivering;  /* receiver callback is active */
+};
+
+static void sipe_http_transport_body_free(struct sipe_http_connection *conn)
+{
+	struct sipe_http_body *body = conn->body;
+
+	if (body) {
+		sipmsg_free(body->msg);
+		g_free(body->header);
+		if (body->data)
+			g_string_free(body->data, TRUE);
+		if (body->decoder)
+			g_object_unref(body->decoder);
+		g_free(body);
+		conn->body = NULL;
+	}
+}
+
+/*
+ * Content decoding
+ *
+ * Every request offers gzip and deflate. Compressed data is decoded as
+ * it arrives, i.e. incomplete bodies are never stored in compressed form.
+ */
+static GConverter *sipe_http_transport_decoder(struct sipmsg *msg)
+{
+	const gchar *encoding = sipmsg_find_header(msg, "Content-Encoding");
+	GZlibCompressorFormat format;
+
+	if (!encoding || sipe_strcase_equal(encoding, "identity"))
+		return(NULL);
+
+	if (sipe_strcase_equal(encoding, "gzip") ||
+	    sipe_strcase_equal(encoding, "x-gzip")) {
+		format = G_ZLIB_COMPRESSOR_FORMAT_GZIP;
+	} else if (sipe_strcase_equal(encoding, "deflate")) {
+		format = G_ZLIB_COMPRESSOR_FORMAT_ZLIB;
+	} else {
+		SIPE_DEBUG_ERROR("sipe_http_transport_decoder: unsupported encoding '%s'",
+				 encoding);
+		return(NULL);
+	}
+
+	return(G_CONVERTER(g_zlib_decompressor_new(format)));
+}
+
+/* returns FALSE if data is corrupted */
+static gboolean sipe_http_transport_decode(GConverter *decoder,
+					   const gchar *data,
+					   gsize length,
+					   gboolean end,
+					   GString *body)
+{
+	gchar buffer[SIPE_HTTP_DECODE_BUFFER];
+	gsize written;
+
+	do {
+		GError *error = NULL;
+		gsize read;
+		GConverterResult result = g_converter_convert(decoder,
+							      data,
+							      length,
+							      buffer,
+							      sizeof(buffer),
+							      end ?
+							      G_CONVERTER_INPUT_AT_END :
+							      G_CONVERTER_NO_FLAGS,
+							      &read,
+							      &written,
+							      &error);
+
+		if (result == G_CONVERTER_ERROR) {
+			/* decoder needs more input: wait for next fragment */
+			gboolean partial = !end &&
+				g_error_matches(error,
+						G_IO_ERROR,
+						G_IO_ERROR_PARTIAL_INPUT);
+
+			if (!partial)
+				SIPE_DEBUG_ERROR("sipe_http_transport_decode: %s",
+						 error->message);
+			g_error_free(error);
+			return(partial);
+		}
+
+		g_string_append_len(body, buffer, written);
+		data   += read;
+		length -= read;
+
+		if (result == G_CONVERTER_FINISHED)
+			break;
+
+	/* full output buffer: decoder may have more data */
+	} while (length || end || (written == sizeof(buffer)));
+
+	return(TRUE);
+}
+
+/* decoded message looks like it was sent without encoding */
+static void sipe_http_transport_decoded(struct sipmsg *msg,
+					GString *body)
+{
+	gchar *length = g_strdup_printf("%" G_GSIZE_FORMAT, body->len);
+
+	SIPE_DEBUG_INFO("sipe_http_transport_decoded: %s body decoded to %" G_GSIZE_FORMAT " bytes",
+			sipmsg_find_header(msg, "Content-Encoding"),
+			body->len);
+
+	msg->bodylen = body->len;
+	msg->body    = g_string_free(body, FALSE);
+	sipmsg_remove_header_now(msg, "Content-Encoding");
+	sipmsg_remove_header_now(msg, "Content-Length");
+	sipmsg_add_header_now(msg, "Content-Length", length);
+	g_free(length);
+}
+
 static gint timeout_compare(gconstpointer a,
 			    gconstpointer b,
                             SIPE_UNUSED_PARAMETER gpointer user_data)
 {
-	return(((struct sipe_http_connection *) a)->timeout -
-	       ((struct sipe_http_connection *) b)->timeout);
+	gint64 timeout_a = ((struct sipe_http_connection *) a)->timeout;
+	gint64 timeout_b = ((struct sipe_http_connection *) b)->timeout;
+	return((timeout_a > timeout_b) - (timeout_a < timeout_b));
 }
 
 static void sipe_http_transport_update_timeout_queue(struct sipe_http_connection *conn,
@@ -91,52 +269,76 @@ static void sipe_http_transport_free(gpointer data)
 	if (conn->connection)
 		sipe_backend_transport_disconnect(conn->connection);
 	conn->connection = NULL;
+	sipe_http_transport_body_free(conn);
 
 	sipe_http_transport_update_timeout_queue(conn, TRUE);
 
 	sipe_http_request_shutdown(SIPE_HTTP_CONNECTION_PUBLIC,
 				   conn->public.sipe_private->http->shutting_down);
 
+	g_queue_free(conn->public.pending_requests);
 	g_free(conn->public.host);
 
 	g_free(conn->host_port);
 	g_free(conn);
 }
 
+static void sipe_http_pool_free(gpointer data)
+{
+	struct sipe_http_pool *pool = data;
+
+	while (pool->connections) {
+		struct sipe_http_connection *conn = pool->connections->data;
+		pool->connections = g_slist_delete_link(pool->connections,
+							pool->connections);
+		conn->pool = NULL;
+		sipe_http_transport_free(conn);
+	}
+
+	g_free(pool->host_port);
+	g_free(pool);
+}
+
 static void sipe_http_transport_drop(struct sipe_http *http,
 				     struct sipe_http_connection *conn,
 				     const gchar *message)
 {
+	struct sipe_http_pool *pool = conn->pool;
+
 	SIPE_DEBUG_INFO("sipe_http_transport_drop: dropping connection '%s': %s",
 			conn->host_port,
 			message ? message : "REASON UNKNOWN");
 
-#if GLIB_CHECK_VERSION(2,30,0)
-	/* this triggers sipe_http_transport_free() */
-	g_hash_table_remove(http->connections, conn->host_port);
-#else
-	/* GLIB < 2.30 calls destroy notifiers *before* removing the entry */
-	/* which can cause a race condition with sipe_http_transport_new() */
-	g_hash_table_steal(http->connections, conn->host_port);
+	/*
+	 * Detach connection from its pool *before* freeing it. Callbacks of
+	 * aborted requests may enqueue new requests for the same host:port
+	 * and those must not end up on this connection.
+	 */
+	pool->connections = g_slist_remove(pool->connections, conn);
+	conn->pool        = NULL;
+	if (!pool->connections)
+		/* pool is empty, no connections are freed by this */
+		g_hash_table_remove(http->pools, pool->host_port);
+
 	sipe_http_transport_free(conn);
-#endif
 	/* conn is no longer valid */
 }
 
 static void start_timer(struct sipe_core_private *sipe_private,
-			time_t current_time);
+			gint64 current_time);
 static void sipe_http_transport_timeout(struct sipe_core_private *sipe_private,
 					gpointer data)
 {
 	struct sipe_http *http = sipe_private->http;
 	struct sipe_http_connection *conn = data;
-	time_t current_time = time(NULL);
+	gint64 current_time = sipe_utils_monotonic_sec();
 
 	/* timer has expired */
 	http->next_timeout = 0;
 
 	while (1) {
-		sipe_http_transport_drop(http, conn, "timeout");
+		sipe_http_transport_drop(http, conn,
+					 conn->warm ? "unused warm connection" : "timeout");
 		/* conn is no longer valid */
 
 		/* is there another active connection? */
@@ -155,7 +357,7 @@ static void sipe_http_transport_timeout(struct sipe_core_private *sipe_private,
 }
 
 static void start_timer(struct sipe_core_private *sipe_private,
-			time_t current_time)
+			gint64 current_time)
 {
 	struct sipe_http *http = sipe_private->http;
 	struct sipe_http_connection *conn = g_queue_peek_head(http->timeouts);
@@ -175,7 +377,7 @@ static void sipe_http_transport_update_timeout_queue(struct sipe_http_connection
 	struct sipe_core_private *sipe_private = conn->public.sipe_private;
 	struct sipe_http *http = sipe_private->http;
 	GQueue *timeouts = http->timeouts;
-	time_t current_time = time(NULL);
+	gint64 current_time = sipe_utils_monotonic_sec();
 
 	/* is this connection at head of queue? */
 	gboolean update = (conn == g_queue_peek_head(timeouts));
@@ -184,10 +386,17 @@ static void sipe_http_transport_update_timeout_queue(struct sipe_http_connection
 	if (remove) {
 		g_queue_remove(timeouts, conn);
 	} else {
-		conn->timeout = current_time + SIPE_HTTP_DEFAULT_TIMEOUT;
-		g_queue_sort(timeouts,
-			     timeout_compare,
-			     NULL);
+		/* new timeout is always the latest, i.e. no full sort needed */
+		g_queue_remove(timeouts, conn);
+		conn->timeout = current_time +
+			((conn->body && conn->body->streaming) ?
+			 SIPE_HTTP_STREAMING_TIMEOUT :
+			 SIPE_HTTP_DEFAULT_TIMEOUT);
+		g_queue_insert_sorted(timeouts,
+				      conn,
+				      timeout_compare,
+				      NULL);
+		update = update || (conn == g_queue_peek_head(timeouts));
 	}
 
 	/* update timer if necessary */
@@ -210,6 +419,148 @@ gboolean sipe_http_shutting_down(struct sipe_core_private *sipe_private)
 	return(http->shutting_down);
 }
 
+void sipe_http_memory_usage(struct sipe_core_private *sipe_private,
+			    struct sipe_memory_usage *usage)
+{
+	struct sipe_http *http = sipe_private->http;
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!http)
+		return;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_http));
+	sipe_metrics_memory_hash(usage, http->pools);
+	sipe_metrics_memory_hash(usage, http->hosts);
+	sipe_metrics_memory_list(usage, g_queue_get_length(http->timeouts));
+
+	g_hash_table_iter_init(&iter, http->pools);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		const struct sipe_http_pool *pool = value;
+		const GSList *entry;
+
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_http_pool));
+		sipe_metrics_memory_string(usage, pool->host_port);
+		sipe_metrics_memory_list(usage, g_slist_length(pool->connections));
+
+		for (entry = pool->connections; entry; entry = entry->next) {
+			struct sipe_http_connection *conn = entry->data;
+			const struct sipe_http_body *body = conn->body;
+
+			SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_http_connection));
+			sipe_metrics_memory_string(usage, conn->host_port);
+			sipe_metrics_memory_string(usage, conn->public.host);
+			if (conn->connection && conn->connection->buffer)
+				SIPE_MEMORY_OBJECT(usage,
+						   conn->connection->buffer_length + 1);
+			if (body) {
+				SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_http_body));
+				sipmsg_memory_usage(body->msg, usage);
+				sipe_metrics_memory_string(usage, body->header);
+				if (body->data)
+					SIPE_MEMORY_OBJECT(usage,
+							   sizeof(GString) +
+							   body->data->allocated_len);
+			}
+			sipe_http_request_memory_usage(SIPE_HTTP_CONNECTION_PUBLIC,
+						       usage);
+		}
+	}
+}
+
+void sipe_http_queue_depth(struct sipe_core_private *sipe_private,
+			   guint *connections,
+			   guint *queued,
+			   guint *queued_max)
+{
+	struct sipe_http *http = sipe_private->http;
+
+	*connections = 0;
+	*queued      = 0;
+	*queued_max  = 0;
+
+	if (http) {
+		GHashTableIter iter;
+		gpointer value;
+
+		g_hash_table_iter_init(&iter, http->pools);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			const struct sipe_http_pool *pool = value;
+			const GSList *entry;
+
+			for (entry = pool->connections; entry; entry = entry->next) {
+				struct sipe_http_connection_public *conn_public = entry->data;
+				guint length = g_queue_get_length(conn_public->pending_requests);
+
+				(*connections)++;
+				*queued += length;
+				if (length > *queued_max)
+					*queued_max = length;
+			}
+		}
+	}
+}
+
+static gint host_compare(gconstpointer a,
+			 gconstpointer b)
+{
+	guint requests_a = ((const struct sipe_http_host *) a)->requests;
+	guint requests_b = ((const struct sipe_http_host *) b)->requests;
+	/* most used first */
+	return((requests_a < requests_b) - (requests_a > requests_b));
+}
+
+/*
+ * Host file format: magic line followed by one line per host
+ *
+ *   <1 = TLS, 0 = TCP> <port> <host>
+ */
+static void sipe_http_hosts_save(struct sipe_core_private *sipe_private)
+{
+	struct sipe_http *http = sipe_private->http;
+	GList *hosts;
+	GList *entry;
+	GString *buffer;
+	gchar *filename;
+	gchar *dirname;
+	guint count = 0;
+
+	/* keep hosts of previous session */
+	if (g_hash_table_size(http->hosts) == 0)
+		return;
+
+	buffer = g_string_new(SIPE_HTTP_PREWARM_MAGIC);
+	hosts  = g_list_sort(g_hash_table_get_values(http->hosts),
+			     host_compare);
+	for (entry = hosts;
+	     entry && (count < SIPE_HTTP_PREWARM_HOSTS);
+	     entry = entry->next, count++) {
+		const struct sipe_http_host *host = entry->data;
+		g_string_append_printf(buffer, "%d %" G_GUINT32_FORMAT " %s\n",
+				       host->use_tls ? 1 : 0,
+				       host->port,
+				       host->host);
+	}
+	g_list_free(hosts);
+
+	filename = sipe_roster_cache_filename(sipe_private, SIPE_HTTP_PREWARM_FILE);
+	dirname  = g_path_get_dirname(filename);
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(filename, buffer->str, buffer->len, NULL)))
+		SIPE_DEBUG_ERROR("sipe_http_hosts_save: can't write '%s'",
+				 filename);
+	g_free(dirname);
+	g_free(filename);
+	g_string_free(buffer, TRUE);
+}
+
+static void sipe_http_host_free(gpointer data)
+{
+	struct sipe_http_host *host = data;
+	g_free(host->host);
+	g_free(host);
+}
+
 void sipe_http_free(struct sipe_core_private *sipe_private)
 {
 	struct sipe_http *http = sipe_private->http;
@@ -219,8 +570,11 @@ void sipe_http_free(struct sipe_core_private *sipe_private)
 	/* HTTP stack is shutting down: reject all new requests */
 	http->shutting_down = TRUE;
 
+	sipe_http_hosts_save(sipe_private);
+
 	sipe_schedule_cancel(sipe_private, SIPE_HTTP_TIMEOUT_ACTION);
-	g_hash_table_destroy(http->connections);
+	g_hash_table_destroy(http->pools);
+	g_hash_table_destroy(http->hosts);
 	g_queue_free(http->timeouts);
 	g_free(http);
 	sipe_private->http = NULL;
@@ -229,14 +583,29 @@ void sipe_http_free(struct sipe_core_private *sipe_private)
 static void sipe_http_init(struct sipe_core_private *sipe_private)
 {
 	struct sipe_http *http;
+	const gchar *max;
 	if (sipe_private->http)
 		return;
 
 	sipe_private->http = http = g_new0(struct sipe_http, 1);
-	http->connections = g_hash_table_new_full(g_str_hash, g_str_equal,
-						  NULL,
-						  sipe_http_transport_free);
+	http->pools = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    NULL,
+					    sipe_http_pool_free);
+	http->hosts = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free,
+					    sipe_http_host_free);
 	http->timeouts = g_queue_new();
+
+	/* per-host connection limit can be overridden from the environment */
+	http->max_connections = SIPE_HTTP_DEFAULT_CONNECTIONS;
+	max = g_getenv(SIPE_HTTP_ENVIRONMENT_CONNECTIONS);
+	if (max) {
+		guint64 value = g_ascii_strtoull(max, NULL, 10);
+		if ((value > 0) && (value <= G_MAXUINT))
+			http->max_connections = value;
+	}
+	SIPE_DEBUG_INFO("sipe_http_init: up to %u connection(s) per host",
+			http->max_connections);
 }
 
 static void sipe_http_transport_connected(struct sipe_transport_connection *connection)
@@ -244,191 +613,387 @@ static void sipe_http_transport_connected(struct sipe_transport_connection *conn
 	struct sipe_http_connection *conn = SIPE_HTTP_CONNECTION;
 	struct sipe_core_private *sipe_private = conn->public.sipe_private;
 	struct sipe_http *http = sipe_private->http;
-	time_t current_time = time(NULL);
+	gint64 current_time = sipe_utils_monotonic_sec();
 
-	SIPE_DEBUG_INFO("sipe_http_transport_connected: %s", conn->host_port);
+	SIPE_DEBUG_INFO("sipe_http_transport_connected: %s%s", conn->host_port,
+			conn->warm ? " (warm)" : "");
 	conn->public.connected = TRUE;
 
 	/* add active connection to timeout queue */
-	conn->timeout = current_time + SIPE_HTTP_DEFAULT_TIMEOUT;
+	conn->timeout = current_time +
+		(conn->warm ? SIPE_HTTP_PREWARM_TIMEOUT : SIPE_HTTP_DEFAULT_TIMEOUT);
 	g_queue_insert_sorted(http->timeouts,
 			      conn,
 			      timeout_compare,
 			      NULL);
 
-	/* start timeout timer if necessary */
-	if (http->next_timeout == 0)
+	/* start timeout timer if necessary, warm timeouts are shorter */
+	if (http->next_timeout == 0) {
 		start_timer(sipe_private, current_time);
+	} else if (conn->timeout < http->next_timeout) {
+		sipe_schedule_cancel(sipe_private, SIPE_HTTP_TIMEOUT_ACTION);
+		start_timer(sipe_private, current_time);
+	}
 
 	sipe_http_request_next(SIPE_HTTP_CONNECTION_PUBLIC);
 }
 
-static void sipe_http_transport_input(struct sipe_transport_connection *connection)
+/* returns FALSE if data is corrupted */
+static gboolean sipe_http_transport_body_append(struct sipe_http_body *body,
+						const gchar *data,
+						gsize length,
+						gboolean end)
 {
-	struct sipe_http_connection *conn = SIPE_HTTP_CONNECTION;
-	char *current = connection->buffer;
+	if (body->decoder)
+		return(sipe_http_transport_decode(body->decoder,
+						  data,
+						  length,
+						  end,
+						  body->data));
+
+	g_string_append_len(body->data, data, length);
+	return(TRUE);
+}
 
-	/* according to the RFC remove CRLF at the beginning */
-	while (*current == '\r' || *current == '\n') {
-		current++;
+static void sipe_http_transport_body_error(struct sipe_http_body *body,
+					   const gchar *reason)
+{
+	SIPE_DEBUG_ERROR("sipe_http_transport_body: %s", reason);
+	body->msg->response = SIPMSG_RESPONSE_FATAL_ERROR;
+	body->state         = SIPE_HTTP_BODY_COMPLETE;
+}
+
+static void sipe_http_transport_body_end(struct sipe_http_body *body)
+{
+	if (sipe_http_transport_body_append(body, NULL, 0, TRUE))
+		body->state = SIPE_HTTP_BODY_COMPLETE;
+	else
+		sipe_http_transport_body_error(body, "truncated content encoding");
+}
+
+/* returns FALSE if receiver doesn't accept more data right now */
+static gboolean sipe_http_transport_body_deliver(struct sipe_http_connection *conn)
+{
+	struct sipe_http_body *body = conn->body;
+
+	if (body->streaming &&
+	    body->data->len &&
+	    (body->msg->response != SIPMSG_RESPONSE_FATAL_ERROR)) {
+		gsize consumed;
+
+		body->delivering = TRUE;
+		consumed = sipe_http_request_body(SIPE_HTTP_CONNECTION_PUBLIC,
+						  body->data->str,
+						  body->data->len);
+		body->delivering = FALSE;
+
+		g_string_erase(body->data, 0, MIN(consumed, body->data->len));
+		body->paused = (body->data->len != 0);
 	}
+
+	return(!body->paused);
+}
+
+/*
+ * Process as much body data as is in the buffer and remove it.
+ *
+ * While the receiver of a streamed body doesn't accept data the rest of
+ * the input stays in the buffer.
+ *
+ * Returns completed message (caller takes ownership) or NULL.
+ */
+static struct sipmsg *sipe_http_transport_body(struct sipe_transport_connection *connection,
+					       struct sipe_http_connection *conn)
+{
+	struct sipe_http_body *body = conn->body;
+	gchar *current = connection->buffer;
+	gchar *end     = connection->buffer + connection->buffer_used;
+	struct sipmsg *msg;
+
+	while ((body->state != SIPE_HTTP_BODY_COMPLETE) &&
+	       sipe_http_transport_body_deliver(conn)) {
+
+		if ((body->state == SIPE_HTTP_BODY_LENGTH) &&
+		    (body->remaining == 0)) {
+			sipe_http_transport_body_end(body);
+
+		} else if (current == end) {
+			break;
+
+		} else if ((body->state == SIPE_HTTP_BODY_LENGTH) ||
+			   (body->state == SIPE_HTTP_CHUNKED_DATA)) {
+			gsize length = MIN(body->remaining,
+					   (gsize) (end - current));
+
+			/* give receiver a chance to apply backpressure */
+			if (body->streaming)
+				length = MIN(length, SIPE_HTTP_STREAM_FRAGMENT);
+
+			if (!sipe_http_transport_body_append(body,
+							     current,
+							     length,
+							     FALSE))
+				sipe_http_transport_body_error(body,
+							       "corrupted content encoding");
+			/* e.g. endless chunked or compressed body */
+			else if (!body->streaming &&
+				 sipe_limit_exceeded(SIPE_LIMIT_HTTP_BODY,
+						     body->data->len))
+				sipe_http_transport_body_error(body,
+							       "body too large");
+			current         += length;
+			body->remaining -= length;
+			if ((body->remaining == 0) &&
+			    (body->state == SIPE_HTTP_CHUNKED_DATA))
+				body->state = SIPE_HTTP_CHUNKED_DATA_END;
+
+		} else {
+			/* all other states are line based */
+			gchar *eol = g_strstr_len(current, end - current, "\r\n");
+
+			/* line not finished yet */
+			if (!eol)
+				break;
+
+			switch (body->state) {
+			case SIPE_HTTP_CHUNKED_SIZE:
+				{
+					gchar *tmp;
+					guint64 length = g_ascii_strtoull(current, &tmp, 16);
+
+					if (tmp == current) {
+						sipe_http_transport_body_error(body,
+									       "illegal chunk size");
+					} else if (length == 0) {
+						body->state = SIPE_HTTP_CHUNKED_TRAILER;
+					} else {
+						body->remaining = length;
+						body->state     = SIPE_HTTP_CHUNKED_DATA;
+					}
+				}
+				break;
+
+			case SIPE_HTTP_CHUNKED_DATA_END:
+				if (eol != current)
+					sipe_http_transport_body_error(body,
+								       "chunk data too long");
+				else
+					body->state = SIPE_HTTP_CHUNKED_SIZE;
+				break;
+
+			case SIPE_HTTP_CHUNKED_TRAILER:
+				/* empty line terminates body, trailers are ignored */
+				if (eol == current)
+					sipe_http_transport_body_end(body);
+				break;
+
+			default:
+				break;
+			}
+
+			current = eol + 2;
+		}
+	}
+
 	if (current != connection->buffer)
 		sipe_utils_shrink_buffer(connection, current);
 
-	if (conn->connection &&
-	    (current = strstr(connection->buffer, "\r\n\r\n")) != NULL) {
-		struct sipmsg *msg;
-		gboolean drop = FALSE;
-		gboolean next;
-
-		current += 2;
-		current[0] = '\0';
-		msg = sipmsg_parse_header(connection->buffer);
-		if (!msg) {
-			/* restore header for next try */
-			current[0] = '\r';
-			return;
-		}
+	/* receiver must have accepted everything */
+	if ((body->state != SIPE_HTTP_BODY_COMPLETE) ||
+	    !sipe_http_transport_body_deliver(conn))
+		return(NULL);
+
+	msg = body->msg;
+	if (body->streaming) {
+		/* everything has been passed on already */
+		msg->bodylen = 0;
+		msg->body    = g_strdup("");
+		sipmsg_remove_header_now(msg, "Content-Encoding");
+	} else if (body->decoder) {
+		sipe_http_transport_decoded(msg, body->data);
+		body->data = NULL;
+	} else {
+		msg->bodylen = body->data->len;
+		msg->body    = g_string_free(body->data, FALSE);
+		body->data   = NULL;
+	}
+	body->msg = NULL;
 
-		/* HTTP/1.1 Transfer-Encoding: chunked */
-		if (msg->bodylen == SIPMSG_BODYLEN_CHUNKED) {
-			gchar *start        = current + 2;
-			GSList *chunks      = NULL;
-			gboolean incomplete = TRUE;
-
-			msg->bodylen = 0;
-			while (strlen(start) > 0) {
-				gchar *tmp;
-				guint length = g_ascii_strtoll(start, &tmp, 16);
-				guint remainder;
-				struct _chunk {
-					guint length;
-					const gchar *start;
-				} *chunk;
-
-				/* Illegal number */
-				if ((length == 0) && (start == tmp))
-					break;
-				msg->bodylen += length;
-
-				/* Chunk header not finished yet */
-				tmp = strstr(tmp, "\r\n");
-				if (tmp == NULL)
-					break;
-
-				/* Chunk not finished yet */
-				tmp += 2;
-				remainder = connection->buffer_used - (tmp - connection->buffer);
-				if (remainder < length + 2)
-					break;
-
-				/* Next chunk */
-				start = tmp + length + 2;
-
-				/* Body completed */
-				if (length == 0) {
-					gchar *dummy  = g_malloc(msg->bodylen + 1);
-					gchar *p      = dummy;
-					GSList *entry = chunks;
-
-					while (entry) {
-						chunk = entry->data;
-						memcpy(p, chunk->start, chunk->length);
-						p += chunk->length;
-						entry = entry->next;
-					}
-					p[0] = '\0';
+	sipe_debug_message(SIPE_DEBUG_SUBSYSTEM_HTTP,
+			   body->header,
+			   msg->body,
+			   FALSE);
 
-					msg->body = dummy;
-					sipe_utils_message_debug("HTTP",
-								 connection->buffer,
-								 msg->body,
-								 FALSE);
+	sipe_http_transport_body_free(conn);
+	return(msg);
+}
 
-					current = start;
-					sipe_utils_shrink_buffer(connection,
-								 current);
+static void sipe_http_transport_connect(struct sipe_http_connection *conn);
+/* returns TRUE if backend connection is still open */
+static gboolean sipe_http_transport_response(struct sipe_http_connection *conn,
+					     struct sipmsg *msg)
+{
+	gboolean drop = FALSE;
+	gboolean next;
+
+	if (msg->response == SIPMSG_RESPONSE_FATAL_ERROR) {
+		/* fatal header parse error */
+		msg->response = SIPE_HTTP_STATUS_SERVER_ERROR;
+		drop          = TRUE;
+	} else if (sipe_strcase_equal(sipmsg_find_header(msg, "Connection"), "close")) {
+		SIPE_DEBUG_INFO("sipe_http_transport_input: server requested close '%s'",
+				conn->host_port);
+		drop          = TRUE;
+	}
 
-					incomplete = FALSE;
-					break;
-				}
+	if (sipe_http_request_response(SIPE_HTTP_CONNECTION_PUBLIC, msg))
+		drop = TRUE;
+	next = sipe_http_request_pending(SIPE_HTTP_CONNECTION_PUBLIC);
 
-				/* Append completed chunk */
-				chunk = g_new0(struct _chunk, 1);
-				chunk->length = length;
-				chunk->start  = tmp;
-				chunks = g_slist_append(chunks, chunk);
-			}
+	if (drop) {
+		/* drop backend connection */
+		sipe_backend_transport_disconnect(conn->connection);
+		conn->connection       = NULL;
+		conn->public.connected = FALSE;
+		sipe_http_request_disconnected(SIPE_HTTP_CONNECTION_PUBLIC);
 
-			if (chunks)
-				sipe_utils_slist_free_full(chunks, g_free);
+		/* if we have pending requests we need to trigger re-connect */
+		if (next)
+			sipe_http_transport_connect(conn);
 
-			if (incomplete) {
-				/* restore header for next try */
-				sipmsg_free(msg);
-				current[0] = '\r';
-				return;
-			}
+	} else if (next) {
+		/* trigger sending of next pending request */
+		sipe_http_request_next(SIPE_HTTP_CONNECTION_PUBLIC);
+	}
+
+	sipmsg_free(msg);
+	return(!drop);
+}
+
+/* returns TRUE if a message was processed and the connection is still open */
+static gboolean sipe_http_transport_message(struct sipe_transport_connection *connection,
+					    struct sipe_http_connection *conn)
+{
+	char *start = connection->buffer;
+	char *current;
+	struct sipmsg *msg;
+	gboolean streaming;
+	gsize remainder;
+
+	/* continue with incomplete body */
+	if (conn->body) {
+		msg = sipe_http_transport_body(connection, conn);
+		return(msg ? sipe_http_transport_response(conn, msg) : FALSE);
+	}
+
+	/* according to the RFC remove CRLF at the beginning */
+	while (*start == '\r' || *start == '\n') {
+		start++;
+	}
+
+	if ((current = sipe_utils_find_header_end(connection, start)) == NULL)
+		return(FALSE);
+
+	current += 2;
+	current[0] = '\0';
+	msg = sipmsg_parse_header_len(start, current - start);
+	if (!msg) {
+		/* restore header for next try */
+		current[0] = '\r';
+		return(FALSE);
+	}
+
+	streaming = sipe_http_request_streaming(SIPE_HTTP_CONNECTION_PUBLIC,
+						msg);
+	remainder = connection->buffer_used - (current + 2 - connection->buffer);
+
+	/* reject oversized body before receiving it */
+	if (!streaming &&
+	    (msg->bodylen > 0) &&
+	    (msg->response != SIPMSG_RESPONSE_FATAL_ERROR) &&
+	    sipe_limit_exceeded(SIPE_LIMIT_HTTP_BODY, msg->bodylen)) {
+		SIPE_DEBUG_ERROR("sipe_http_transport_message: body of %d bytes too large",
+				 msg->bodylen);
+		msg->response = SIPMSG_RESPONSE_FATAL_ERROR;
+		return(sipe_http_transport_response(conn, msg));
+	}
 
+	/* HTTP/1.1 Transfer-Encoding: chunked or body not complete yet */
+	if ((msg->bodylen == SIPMSG_BODYLEN_CHUNKED) ||
+	    streaming                                ||
+	    (remainder < (gsize) msg->bodylen)) {
+		struct sipe_http_body *body = g_new0(struct sipe_http_body, 1);
+
+		body->msg       = msg;
+		body->header    = g_strdup(start);
+		body->decoder   = sipe_http_transport_decoder(msg);
+		body->streaming = streaming;
+		if (msg->bodylen == SIPMSG_BODYLEN_CHUNKED) {
+			body->data      = g_string_new("");
+			body->state     = SIPE_HTTP_CHUNKED_SIZE;
 		} else {
-			guint remainder = connection->buffer_used - (current + 2 - connection->buffer);
-
-			if (remainder >= (guint) msg->bodylen) {
-				char *dummy = g_malloc(msg->bodylen + 1);
-				current += 2;
-				memcpy(dummy, current, msg->bodylen);
-				dummy[msg->bodylen] = '\0';
-				msg->body = dummy;
-				current += msg->bodylen;
-				sipe_utils_message_debug("HTTP",
-							 connection->buffer,
-							 msg->body,
-							 FALSE);
-				sipe_utils_shrink_buffer(connection, current);
-			} else {
-				SIPE_DEBUG_INFO("sipe_http_transport_input: body too short (%d < %d, strlen %" G_GSIZE_FORMAT ") - ignoring message",
-						remainder, msg->bodylen, strlen(connection->buffer));
+			body->data      = g_string_sized_new(streaming ?
+							     SIPE_HTTP_STREAM_FRAGMENT :
+							     (gsize) msg->bodylen);
+			body->remaining = msg->bodylen;
+			body->state     = SIPE_HTTP_BODY_LENGTH;
+		}
+		conn->body = body;
+		if (streaming)
+			sipe_http_transport_update_timeout_queue(conn, FALSE);
+
+		/* header has been consumed */
+		sipe_utils_shrink_buffer(connection, current + 2);
 
-				/* restore header for next try */
-				sipmsg_free(msg);
-				current[0] = '\r';
-				return;
+		msg = sipe_http_transport_body(connection, conn);
+		if (!msg)
+			return(FALSE);
+
+	} else {
+		GConverter *decoder = sipe_http_transport_decoder(msg);
+		const gchar *body   = current + 2;
+		current = current + 2 + msg->bodylen;
+
+		if (decoder) {
+			GString *decoded = g_string_sized_new(msg->bodylen * 4);
+			if (sipe_http_transport_decode(decoder,
+						       body,
+						       msg->bodylen,
+						       TRUE,
+						       decoded)) {
+				sipe_http_transport_decoded(msg, decoded);
+			} else {
+				g_string_free(decoded, TRUE);
+				msg->response = SIPMSG_RESPONSE_FATAL_ERROR;
 			}
+			g_object_unref(decoder);
+		} else {
+			char *dummy = g_malloc(msg->bodylen + 1);
+			memcpy(dummy, body, msg->bodylen);
+			dummy[msg->bodylen] = '\0';
+			msg->body = dummy;
 		}
+		sipe_debug_message(SIPE_DEBUG_SUBSYSTEM_HTTP,
+				   start,
+				   msg->body,
+				   FALSE);
+		sipe_utils_shrink_buffer(connection, current);
+	}
 
-		if (msg->response == SIPMSG_RESPONSE_FATAL_ERROR) {
-			/* fatal header parse error */
-			msg->response = SIPE_HTTP_STATUS_SERVER_ERROR;
-			drop          = TRUE;
-		} else if (sipe_strcase_equal(sipmsg_find_header(msg, "Connection"), "close")) {
-			SIPE_DEBUG_INFO("sipe_http_transport_input: server requested close '%s'",
-					conn->host_port);
-			drop          = TRUE;
-		}
+	return(sipe_http_transport_response(conn, msg));
+}
 
-		sipe_http_request_response(SIPE_HTTP_CONNECTION_PUBLIC, msg);
-		next = sipe_http_request_pending(SIPE_HTTP_CONNECTION_PUBLIC);
-
-		if (drop) {
-			/* drop backend connection */
-			sipe_backend_transport_disconnect(conn->connection);
-			conn->connection       = NULL;
-			conn->public.connected = FALSE;
-
-			/* if we have pending requests we need to trigger re-connect */
-			if (next)
-				sipe_http_transport_new(conn->public.sipe_private,
-							conn->public.host,
-							conn->public.port,
-							conn->use_tls);
-
-		} else if (next) {
-			/* trigger sending of next pending request */
-			sipe_http_request_next(SIPE_HTTP_CONNECTION_PUBLIC);
-		}
+static void sipe_http_transport_input(struct sipe_transport_connection *connection)
+{
+	struct sipe_http_connection *conn = SIPE_HTTP_CONNECTION;
 
-		sipmsg_free(msg);
-	}
+	/* connection is alive, e.g. long-running streamed response */
+	sipe_http_transport_update_timeout_queue(conn, FALSE);
+
+	/* pipelined responses can arrive in one read */
+	while (conn->connection &&
+	       connection->buffer_used &&
+	       sipe_http_transport_message(connection, conn));
 }
 
 static void sipe_http_transport_error(struct sipe_transport_connection *connection,
@@ -441,6 +1006,71 @@ static void sipe_http_transport_error(struct sipe_transport_connection *connecti
 	/* conn is no longer valid */
 }
 
+static void sipe_http_transport_connect(struct sipe_http_connection *conn)
+{
+	struct sipe_core_private *sipe_private = conn->public.sipe_private;
+	sipe_connect_setup setup = {
+		conn->use_tls ? SIPE_TRANSPORT_TLS : SIPE_TRANSPORT_TCP,
+		conn->public.host,
+		conn->public.port,
+		conn,
+		sipe_http_transport_connected,
+		sipe_http_transport_input,
+		sipe_http_transport_error,
+		sipe_private->tls_sessions
+	};
+
+	SIPE_DEBUG_INFO("sipe_http_transport_connect: %s", conn->host_port);
+
+	/* will be re-inserted after connect */
+	sipe_http_transport_update_timeout_queue(conn, TRUE);
+
+	/* discard partial body from old connection */
+	sipe_http_transport_body_free(conn);
+
+	conn->public.connected = FALSE;
+	conn->connection = sipe_backend_transport_connect(SIPE_CORE_PUBLIC,
+							  &setup);
+}
+
+/* least-loaded connection in pool or NULL if a new one should be opened */
+static struct sipe_http_connection *sipe_http_pool_select(struct sipe_http *http,
+							  struct sipe_http_pool *pool)
+{
+	struct sipe_http_connection *selected = NULL;
+	guint selected_load = G_MAXUINT;
+	guint count = 0;
+	const GSList *entry;
+
+	for (entry = pool->connections; entry; entry = entry->next) {
+		struct sipe_http_connection *conn = entry->data;
+		guint load = g_queue_get_length(conn->public.pending_requests);
+
+		/* every connection counts toward the limit */
+		count++;
+
+		/* streamed response might not end for a long time */
+		if (conn->body && conn->body->streaming)
+			continue;
+
+		/* idle connection: can't get any better */
+		if (load == 0)
+			return(conn);
+
+		if (load < selected_load) {
+			selected      = conn;
+			selected_load = load;
+		}
+	}
+
+	/* all connections are busy: open another one if limit allows it */
+	if (count < http->max_connections)
+		return(NULL);
+
+	/* NULL: only streaming connections, another one is unavoidable */
+	return(selected);
+}
+
 struct sipe_http_connection_public *sipe_http_transport_new(struct sipe_core_private *sipe_private,
 							    const gchar *host_in,
 							    const guint32 port,
@@ -459,50 +1089,48 @@ struct sipe_http_connection_public *sipe_http_transport_new(struct sipe_core_pri
 		SIPE_DEBUG_ERROR("sipe_http_transport_new: new connection requested during shutdown: THIS SHOULD NOT HAPPEN! Debugging information:\n"
 				 "Host/Port: %s", host_port);
 	} else {
-		conn = g_hash_table_lookup(http->connections, host_port);
+		struct sipe_http_pool *pool = g_hash_table_lookup(http->pools,
+								  host_port);
+
+		if (pool) {
+			conn = sipe_http_pool_select(http, pool);
+		} else {
+			pool = g_new0(struct sipe_http_pool, 1);
+			pool->host_port = g_strdup(host_port);
+			g_hash_table_insert(http->pools,
+					    pool->host_port,
+					    pool);
+		}
 
 		if (conn) {
 			/* re-establishing connection */
 			if (!conn->connection) {
 				SIPE_DEBUG_INFO("sipe_http_transport_new: re-establishing %s", host_port);
-
-				/* will be re-inserted after connect */
-				sipe_http_transport_update_timeout_queue(conn, TRUE);
+				sipe_http_transport_connect(conn);
 			}
 
 		} else {
 			/* new connection */
-			SIPE_DEBUG_INFO("sipe_http_transport_new: new %s", host_port);
+			SIPE_DEBUG_INFO("sipe_http_transport_new: new %s (%u in pool)",
+					host_port,
+					g_slist_length(pool->connections) + 1);
 
 			conn = g_new0(struct sipe_http_connection, 1);
 
-			conn->public.sipe_private = sipe_private;
-			conn->public.host         = g_strdup(host);
-			conn->public.port         = port;
+			conn->public.sipe_private     = sipe_private;
+			conn->public.pending_requests = g_queue_new();
+			conn->public.host             = g_strdup(host);
+			conn->public.port             = port;
 
-			conn->host_port           = host_port;
-			conn->use_tls             = use_tls;
+			conn->pool                    = pool;
+			conn->host_port               = host_port;
+			conn->use_tls                 = use_tls;
+			host_port = NULL; /* conn_private takes ownership */
 
-			g_hash_table_insert(http->connections,
-					    host_port,
-					    conn);
-			host_port = NULL; /* conn_private takes ownership of the key */
-		}
+			pool->connections = g_slist_append(pool->connections,
+							   conn);
 
-		if (!conn->connection) {
-			sipe_connect_setup setup = {
-				use_tls ? SIPE_TRANSPORT_TLS : SIPE_TRANSPORT_TCP,
-				host,
-				port,
-				conn,
-				sipe_http_transport_connected,
-				sipe_http_transport_input,
-				sipe_http_transport_error
-			};
-
-			conn->public.connected = FALSE;
-			conn->connection = sipe_backend_transport_connect(SIPE_CORE_PUBLIC,
-									  &setup);
+			sipe_http_transport_connect(conn);
 		}
 	}
 
@@ -511,22 +1139,117 @@ struct sipe_http_connection_public *sipe_http_transport_new(struct sipe_core_pri
 	return(SIPE_HTTP_CONNECTION_PUBLIC);
 }
 
-void sipe_http_transport_send(struct sipe_http_connection_public *conn_public,
-			      const gchar *header,
-			      const gchar *body)
+void sipe_http_transport_resume(struct sipe_http_connection_public *conn_public)
 {
 	struct sipe_http_connection *conn = SIPE_HTTP_CONNECTION_PRIVATE;
-	GString *message = g_string_new(header);
+	struct sipe_http_body *body = conn->body;
 
-	g_string_append_printf(message, "\r\n%s", body ? body : "");
+	if (!conn->connection || !body || !body->paused)
+		return;
+	body->paused = FALSE;
 
-	sipe_utils_message_debug("HTTP", message->str, NULL, TRUE);
-	sipe_backend_transport_message(conn->connection, message->str);
-	g_string_free(message, TRUE);
+	/* called from receiver callback: delivery loop continues anyway */
+	if (body->delivering)
+		return;
+
+	if (sipe_http_transport_message(conn->connection, conn))
+		/* pipelined responses might be waiting in the buffer */
+		sipe_http_transport_input(conn->connection);
+}
+
+void sipe_http_transport_send(struct sipe_http_connection_public *conn_public,
+			      const gchar *header,
+			      const gchar *body,
+			      gsize body_length)
+{
+	struct sipe_http_connection *conn = SIPE_HTTP_CONNECTION_PRIVATE;
+	struct sipe_transport_segment segments[3];
+
+	segments[0].data   = header;
+	segments[0].length = strlen(header);
+	segments[1].data   = "\r\n";
+	segments[1].length = 2;
+	segments[2].data   = body;
+	segments[2].length = body_length;
+
+	sipe_debug_message(SIPE_DEBUG_SUBSYSTEM_HTTP, header, body, TRUE);
+	sipe_backend_transport_message_iov(conn->connection,
+					   segments,
+					   body ? 3 : 2);
+
+	/* remember host for next session */
+	conn->warm = FALSE;
+	{
+		struct sipe_http *http = conn->public.sipe_private->http;
+		struct sipe_http_host *host = g_hash_table_lookup(http->hosts,
+								  conn->host_port);
+
+		if (!host) {
+			host = g_new0(struct sipe_http_host, 1);
+			host->host    = g_strdup(conn->public.host);
+			host->port    = conn->public.port;
+			host->use_tls = conn->use_tls;
+			g_hash_table_insert(http->hosts,
+					    g_strdup(conn->host_port),
+					    host);
+		}
+		host->requests++;
+	}
 
 	sipe_http_transport_update_timeout_queue(conn, FALSE);
 }
 
+void sipe_http_prewarm(struct sipe_core_private *sipe_private)
+{
+	gchar *filename = sipe_roster_cache_filename(sipe_private,
+						     SIPE_HTTP_PREWARM_FILE);
+	gchar *contents;
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		if (g_str_has_prefix(contents, SIPE_HTTP_PREWARM_MAGIC)) {
+			gchar **lines = g_strsplit(contents + strlen(SIPE_HTTP_PREWARM_MAGIC),
+						   "\n",
+						   SIPE_HTTP_PREWARM_HOSTS + 1);
+			guint i;
+
+			sipe_http_init(sipe_private);
+
+			for (i = 0;
+			     lines[i] && (i < SIPE_HTTP_PREWARM_HOSTS);
+			     i++) {
+				gchar **fields = g_strsplit(lines[i], " ", 3);
+
+				if (g_strv_length(fields) == 3) {
+					struct sipe_http *http = sipe_private->http;
+					guint64 port = g_ascii_strtoull(fields[1], NULL, 10);
+					gchar *host_port = g_strdup_printf("%s:%" G_GUINT64_FORMAT,
+									   fields[2], port);
+
+					/* skip hosts that are already in use */
+					if (!http->shutting_down &&
+					    !is_empty(fields[2]) &&
+					    (port > 0) && (port <= G_MAXUINT16) &&
+					    !g_hash_table_lookup(http->pools, host_port)) {
+						struct sipe_http_connection_public *conn_public =
+							sipe_http_transport_new(sipe_private,
+										fields[2],
+										port,
+										sipe_strequal(fields[0], "1"));
+
+						SIPE_DEBUG_INFO("sipe_http_prewarm: %s", host_port);
+						SIPE_HTTP_CONNECTION_PRIVATE->warm = TRUE;
+					}
+					g_free(host_port);
+				}
+				g_strfreev(fields);
+			}
+			g_strfreev(lines);
+		}
+		g_free(contents);
+	}
+	g_free(filename);
+}
+
 /*
   Local Variables:
   mode: c
@@ -39,9 +39,11 @@ struct sip_sec_context;
 struct sipe_http_connection_public {
 	struct sipe_core_private *sipe_private;
 
-	GSList *pending_requests;        /* handled by sipe-http-request.c */
+	GQueue *pending_requests;        /* handled by sipe-http-request.c */
 	struct sip_sec_context *context; /* handled by sipe-http-request.c */
 	gchar *cached_authorization;     /* handled by sipe-http-request.c */
+	guint in_flight;                 /* handled by sipe-http-request.c */
+	gboolean no_pipelining;          /* handled by sipe-http-request.c */
 
 	gchar *host;
 	guint32 port;
@@ -60,7 +62,9 @@ gboolean sipe_http_shutting_down(struct sipe_core_private *sipe_private);
 /**
  * Initiate HTTP connection
  *
- * If a connection to this host/port already exists it will be reused.
+ * Connections to the same host/port are pooled. The least-loaded one is
+ * returned. A new one is opened if all are busy and the per-host limit
+ * (SIPE_HTTP_CONNECTIONS environment variable, default 4) allows it.
  *
  * @param sipe_private SIPE core private data
  * @param host         name of the host to connect to
@@ -80,7 +84,16 @@ struct sipe_http_connection_public *sipe_http_transport_new(struct sipe_core_pri
  * @param conn_public HTTP connection public data
  * @param header      HTTP header
  * @param body        HTTP body (may be @c NULL)
+ * @param body_length length of HTTP body
  */
 void sipe_http_transport_send(struct sipe_http_connection_public *conn_public,
 			      const gchar *header,
-			      const gchar *body);
+			      const gchar *body,
+			      gsize body_length);
+
+/**
+ * Continue delivery of streamed response body
+ *
+ * @param conn_public HTTP connection public data
+ */
+void sipe_http_transport_resume(struct sipe_http_connection_public *conn_public);
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2013-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -136,6 +136,29 @@ struct sipe_http_request *sipe_http_request_post(struct sipe_core_private *sipe_
 	struct sipe_http_request *req;
 	struct sipe_http_parsed_uri *parsed_uri = sipe_http_parse_uri(uri);
 
+	req = sipe_http_request_new(sipe_private,
+				    parsed_uri,
+				    headers,
+				    body ? g_string_new(body) : NULL,
+				    content_type,
+				    callback,
+				    callback_data);
+	sipe_http_parsed_uri_free(parsed_uri);
+
+	return(req);
+}
+
+struct sipe_http_request *sipe_http_request_post_buffer(struct sipe_core_private *sipe_private,
+							const gchar *uri,
+							const gchar *headers,
+							GString *body,
+							const gchar *content_type,
+							sipe_http_response_callback *callback,
+							gpointer callback_data)
+{
+	struct sipe_http_request *req;
+	struct sipe_http_parsed_uri *parsed_uri = sipe_http_parse_uri(uri);
+
 	req = sipe_http_request_new(sipe_private,
 				    parsed_uri,
 				    headers,
@@ -33,6 +33,7 @@
 /* Forward declarations */
 struct sipe_core_private;
 struct sipe_http_request;
+struct sipe_memory_usage;
 struct sipe_http_session;
 
 /**
@@ -50,10 +51,28 @@ typedef void (sipe_http_response_callback)(struct sipe_core_private *sipe_privat
 					   const gchar *body,
 					   gpointer callback_data);
 
+/**
+ * HTTP response body callback for streamed responses
+ *
+ * @param sipe_private  SIPE core private data
+ * @param data          next fragment of the response body
+ * @param length        length of fragment
+ * @param callback_data callback data
+ *
+ * @return number of bytes accepted. Returning less than @c length pauses
+ *         delivery: the rest is offered again after
+ *         @c sipe_http_request_resume() has been called.
+ */
+typedef gsize (sipe_http_body_callback)(struct sipe_core_private *sipe_private,
+					const gchar *data,
+					gsize length,
+					gpointer callback_data);
+
 /* HTTP response status codes */
 #define SIPE_HTTP_STATUS_FAILED                0 /* internal use */
 #define SIPE_HTTP_STATUS_OK                  200
 #define SIPE_HTTP_STATUS_REDIRECTION         300 /* - 399 */
+#define SIPE_HTTP_STATUS_NOT_MODIFIED        304
 #define SIPE_HTTP_STATUS_CLIENT_ERROR        400 /* - 499 */
 #define SIPE_HTTP_STATUS_CLIENT_UNAUTHORIZED 401
 #define SIPE_HTTP_STATUS_CLIENT_FORBIDDEN    403
@@ -62,6 +81,17 @@ typedef void (sipe_http_response_callback)(struct sipe_core_private *sipe_privat
 #define SIPE_HTTP_STATUS_CANCELLED            -2 /* internal use */
 #define SIPE_HTTP_STATUS_ABORTED              -1 /* internal use */
 
+/**
+ * Pre-warm HTTP connections
+ *
+ * Opens one connection to each host used most in the previous session,
+ * so that TCP & TLS handshakes overlap with SIP registration. Unused
+ * connections are dropped after a short idle timeout.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_http_prewarm(struct sipe_core_private *sipe_private);
+
 /**
  * Free HTTP data
  *
@@ -69,6 +99,28 @@ typedef void (sipe_http_response_callback)(struct sipe_core_private *sipe_privat
  */
 void sipe_http_free(struct sipe_core_private *sipe_private);
 
+/**
+ * Report HTTP request queue depth
+ *
+ * @param sipe_private SIPE core private data
+ * @param connections  number of open HTTP connections
+ * @param queued       number of queued requests over all connections
+ * @param queued_max   longest request queue of a single connection
+ */
+void sipe_http_queue_depth(struct sipe_core_private *sipe_private,
+			   guint *connections,
+			   guint *queued,
+			   guint *queued_max);
+
+/**
+ * Estimate memory used by the HTTP stack
+ *
+ * @param sipe_private SIPE core private data
+ * @param usage        accumulated memory usage
+ */
+void sipe_http_memory_usage(struct sipe_core_private *sipe_private,
+			    struct sipe_memory_usage *usage);
+
 /**
  * Start HTTP session
  *
@@ -121,6 +173,30 @@ struct sipe_http_request *sipe_http_request_post(struct sipe_core_private *sipe_
 						 sipe_http_response_callback *callback,
 						 gpointer callback_data);
 
+/**
+ * Create HTTP POST request from a prepared body buffer
+ *
+ * Same as @c sipe_http_request_post() but the buffer is handed over to
+ * the request as-is, e.g. one built with @c sipe_soap_new().
+ *
+ * @param sipe_private  SIPE core private data
+ * @param uri           URI
+ * @param headers       additional headers (may be @c NULL)
+ * @param body          body contents, will be owned by request
+ * @param content_type  body content type
+ * @param callback      callback function
+ * @param callback_data callback data
+ *
+ * @return pointer to opaque HTTP request data structure (@c NULL if failed)
+ */
+struct sipe_http_request *sipe_http_request_post_buffer(struct sipe_core_private *sipe_private,
+							const gchar *uri,
+							const gchar *headers,
+							GString *body,
+							const gchar *content_type,
+							sipe_http_response_callback *callback,
+							gpointer callback_data);
+
 /**
  * HTTP request is ready to be sent
  *
@@ -151,6 +227,42 @@ void sipe_http_request_session(struct sipe_http_request *request,
  */
 void sipe_http_request_allow_redirect(struct sipe_http_request *request);
 
+/**
+ * Allow pipelining of HTTP request
+ *
+ * The request can be sent on a keep-alive connection while responses to
+ * earlier requests are still outstanding. Only has an effect for GET
+ * requests without session. Pipelining is disabled on a connection when
+ * the server closes it or asks for authentication.
+ *
+ * @param request pointer to opaque HTTP request data structure
+ */
+void sipe_http_request_allow_pipelining(struct sipe_http_request *request);
+
+/**
+ * Stream HTTP response body
+ *
+ * The body of a successful (2xx) response is passed to @c callback in
+ * fragments as it is received instead of being buffered. The response
+ * callback is called afterwards with an empty body. Other responses are
+ * not affected. A request fails instead of being re-sent if its
+ * connection is lost after the first fragment has been delivered.
+ *
+ * @param request  pointer to opaque HTTP request data structure
+ * @param callback body callback function (uses callback data of request)
+ */
+void sipe_http_request_stream(struct sipe_http_request *request,
+			      sipe_http_body_callback *callback);
+
+/**
+ * Continue streaming of HTTP response body
+ *
+ * Must be called after the body callback didn't accept all data.
+ *
+ * @param request pointer to opaque HTTP request data structure
+ */
+void sipe_http_request_resume(struct sipe_http_request *request);
+
 /**
  * Provide authentication information for HTTP request
  *
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -49,57 +49,324 @@
 #include "sipe-xml.h"
 
 /*
- * Hash key template for unconfirmed messages
+ * Bulk send
  *
- *                                             Call-ID      Recipient URI (or empty)
- *                                               |               |
- *                                               |  SIP method   |    CSeq
- *                                               |     |         |     |             */
-#define UNCONFIRMED_KEY_TEMPLATE(method, cseq) "<%s><" method "><%s><" cseq
+ * Each destination of sipe_core_im_send_many() is a target. Queued copies
+ * of the message hold a reference to their target. The result is reported
+ * exactly once: delivered when a 2xx response arrives, undelivered when the
+ * last copy is dropped without one. Only IM_BULK_WINDOW targets are active,
+ * i.e. set up their conversation, at the same time.
+ */
+#define IM_BULK_WINDOW 16
+
+/* outstanding MESSAGE transactions per dialog */
+#define IM_MESSAGE_WINDOW 8
+
+struct sipe_im_bulk {
+	struct sipe_core_private *sipe_private;
+	gchar *what;
+	GQueue waiting;      /* gchar *: destinations not yet started */
+	guint active;        /* started destinations without result */
+	gboolean starting;
+	gboolean cancelled;
+	sipe_core_im_send_cb callback;
+	gpointer user_data;
+};
+
+struct sipe_im_target {
+	struct sipe_im_bulk *bulk; /* NULL after result was reported */
+	gchar *who;
+	guint references;
+};
+
+static void im_send(struct sipe_core_private *sipe_private,
+		    const gchar *uri,
+		    const gchar *what,
+		    struct sipe_im_target *target);
+
+static void im_bulk_free(struct sipe_im_bulk *bulk)
+{
+	struct sipe_core_private *sipe_private = bulk->sipe_private;
+	gchar *who;
+
+	sipe_private->im_bulk_jobs = g_slist_remove(sipe_private->im_bulk_jobs,
+						    bulk);
+	while ((who = g_queue_pop_head(&bulk->waiting)) != NULL) {
+		if (bulk->callback)
+			(*bulk->callback)(SIPE_CORE_PUBLIC, who, FALSE,
+					  bulk->user_data);
+		g_free(who);
+	}
+	g_free(bulk->what);
+	g_free(bulk);
+}
 
-/* key must be g_free()'d */
-static gchar *get_unconfirmed_message_key(const gchar *callid,
-					  unsigned int cseq,
-					  const gchar *with)
+static void im_bulk_next(struct sipe_im_bulk *bulk)
 {
-	return(g_strdup_printf(UNCONFIRMED_KEY_TEMPLATE("%s", "%d>"),
-			       callid,
-			       with ? "MESSAGE" : "INVITE",
-			       with ? with : "",
-			       cseq));
+	struct sipe_core_private *sipe_private = bulk->sipe_private;
+	gchar *who;
+
+	if (bulk->starting)
+		return;
+
+	bulk->starting = TRUE;
+	while (!bulk->cancelled &&
+	       (bulk->active < IM_BULK_WINDOW) &&
+	       ((who = g_queue_pop_head(&bulk->waiting)) != NULL)) {
+		struct sipe_im_target *target = g_new0(struct sipe_im_target, 1);
+
+		target->bulk       = bulk;
+		target->who        = who;
+		/* reference held during setup */
+		target->references = 1;
+		bulk->active++;
+
+		SIPE_DEBUG_INFO("im_bulk_next: starting %s (active %d, waiting %d)",
+				who, bulk->active,
+				g_queue_get_length(&bulk->waiting));
+		im_send(sipe_private, who, bulk->what, target);
+		sipe_im_target_unref(target);
+	}
+	bulk->starting = FALSE;
+
+	if (!bulk->active &&
+	    (bulk->cancelled || g_queue_is_empty(&bulk->waiting))) {
+		SIPE_DEBUG_INFO_NOFORMAT("im_bulk_next: job completed");
+		im_bulk_free(bulk);
+	}
+}
+
+static void im_target_report(struct sipe_im_target *target,
+			     gboolean delivered)
+{
+	struct sipe_im_bulk *bulk = target->bulk;
+	struct sipe_core_private *sipe_private;
+
+	if (!bulk)
+		return;
+	target->bulk = NULL;
+	sipe_private = bulk->sipe_private;
+
+	SIPE_DEBUG_INFO("im_target_report: %s %s",
+			target->who, delivered ? "delivered" : "undelivered");
+	if (bulk->callback)
+		(*bulk->callback)(SIPE_CORE_PUBLIC, target->who, delivered,
+				  bulk->user_data);
+
+	bulk->active--;
+	im_bulk_next(bulk);
+}
+
+static void queued_message_set_target(struct queued_message *message,
+				      struct sipe_im_target *target)
+{
+	if (target) {
+		message->target = target;
+		target->references++;
+	}
+}
+
+void sipe_im_target_unref(struct sipe_im_target *target)
+{
+	if (--target->references == 0) {
+		im_target_report(target, FALSE);
+		g_free(target->who);
+		g_free(target);
+	}
+}
+
+/*
+ * Unconfirmed messages
+ *
+ * session->unconfirmed_messages maps a dialog, i.e. (Call-ID, recipient URI),
+ * to the queue of messages sent to it that haven't been responded to yet.
+ * The recipient URI is NULL for the message sent with the INVITE. Messages
+ * are queued in ascending CSeq order and indexed by CSeq.
+ */
+struct unconfirmed_dialog {
+	gchar *callid;
+	gchar *with;
+	GQueue messages;     /* struct queued_message */
+	GHashTable *by_cseq; /* CSeq -> GList link in messages */
+};
+
+static guint unconfirmed_dialog_hash(gconstpointer key)
+{
+	const struct unconfirmed_dialog *ud = key;
+	return(g_str_hash(ud->callid) ^ (ud->with ? g_str_hash(ud->with) : 0));
+}
+
+static gboolean unconfirmed_dialog_equal(gconstpointer a, gconstpointer b)
+{
+	const struct unconfirmed_dialog *ud1 = a;
+	const struct unconfirmed_dialog *ud2 = b;
+	return(sipe_strequal(ud1->callid, ud2->callid) &&
+	       sipe_strequal(ud1->with,   ud2->with));
+}
+
+static void unconfirmed_dialog_free(gpointer data)
+{
+	struct unconfirmed_dialog *ud = data;
+	struct queued_message *message;
+
+	while ((message = g_queue_pop_head(&ud->messages)) != NULL)
+		sipe_session_free_queued_message(message);
+	g_hash_table_destroy(ud->by_cseq);
+	g_free(ud->with);
+	g_free(ud->callid);
+	g_free(ud);
+}
+
+static struct unconfirmed_dialog *find_unconfirmed_dialog(struct sip_session *session,
+							  const gchar *callid,
+							  const gchar *with)
+{
+	struct unconfirmed_dialog key;
+
+	if (!session->unconfirmed_messages || !callid)
+		return(NULL);
+
+	key.callid = (gchar *) callid;
+	key.with   = (gchar *) with;
+	return(g_hash_table_lookup(session->unconfirmed_messages, &key));
 }
 
 static void insert_unconfirmed_message(struct sip_session *session,
 				       struct sip_dialog *dialog,
 				       const gchar *with,
 				       const gchar *body,
-				       const gchar *content_type)
+				       const gchar *content_type,
+				       struct sipe_im_target *target)
 {
-	gchar *key = get_unconfirmed_message_key(dialog->callid, dialog->cseq + 1, with);
+	struct unconfirmed_dialog *ud = find_unconfirmed_dialog(session,
+								dialog->callid,
+								with);
 	struct queued_message *message = g_new0(struct queued_message, 1);
+	GList *link;
 
 	message->body = g_strdup(body);
 	if (content_type != NULL)
 		message->content_type = g_strdup(content_type);
 	message->cseq = dialog->cseq + 1;
+	queued_message_set_target(message, target);
+
+	if (!ud) {
+		if (!session->unconfirmed_messages)
+			session->unconfirmed_messages = g_hash_table_new_full(unconfirmed_dialog_hash,
+									      unconfirmed_dialog_equal,
+									      NULL,
+									      unconfirmed_dialog_free);
+		ud = g_new0(struct unconfirmed_dialog, 1);
+		ud->callid  = g_strdup(dialog->callid);
+		ud->with    = g_strdup(with);
+		ud->by_cseq = g_hash_table_new(g_direct_hash, g_direct_equal);
+		g_queue_init(&ud->messages);
+		g_hash_table_insert(session->unconfirmed_messages, ud, ud);
+	}
 
-	g_hash_table_insert(session->unconfirmed_messages, key, message);
-	SIPE_DEBUG_INFO("insert_unconfirmed_message: added %s to list (count=%d)",
-			key, g_hash_table_size(session->unconfirmed_messages));
+	/* replace stale entry with the same CSeq */
+	link = g_hash_table_lookup(ud->by_cseq, GUINT_TO_POINTER(message->cseq));
+	if (link) {
+		sipe_session_free_queued_message(link->data);
+		g_queue_delete_link(&ud->messages, link);
+	}
+
+	/* CSeq is increasing, i.e. normally this is an append */
+	link = ud->messages.tail;
+	while (link && (((struct queued_message *) link->data)->cseq > message->cseq))
+		link = link->prev;
+	if (link) {
+		g_queue_insert_after(&ud->messages, link, message);
+		link = link->next;
+	} else {
+		g_queue_push_head(&ud->messages, message);
+		link = ud->messages.head;
+	}
+	g_hash_table_insert(ud->by_cseq, GUINT_TO_POINTER(message->cseq), link);
+
+	SIPE_DEBUG_INFO("insert_unconfirmed_message: added %s CSeq %d to list (count=%d)",
+			with ? with : "INVITE", message->cseq,
+			g_queue_get_length(&ud->messages));
+}
+
+static guint count_unconfirmed_messages(struct sip_session *session,
+					const gchar *callid,
+					const gchar *with)
+{
+	struct unconfirmed_dialog *ud = find_unconfirmed_dialog(session,
+								callid,
+								with);
+	return(ud ? g_queue_get_length(&ud->messages) : 0);
+}
+
+gboolean sipe_im_dialog_busy(struct sip_session *session,
+			     struct sip_dialog *dialog)
+{
+	return(count_unconfirmed_messages(session,
+					  dialog->callid,
+					  dialog->with) > 0);
+}
+
+static struct queued_message *find_unconfirmed_message(struct sip_session *session,
+						       const gchar *callid,
+						       const gchar *with,
+						       guint cseq)
+{
+	struct unconfirmed_dialog *ud = find_unconfirmed_dialog(session,
+								callid,
+								with);
+	GList *link = ud ? g_hash_table_lookup(ud->by_cseq, GUINT_TO_POINTER(cseq)) : NULL;
+	return(link ? link->data : NULL);
 }
 
 static gboolean remove_unconfirmed_message(struct sip_session *session,
-					   const gchar *key)
+					   const gchar *callid,
+					   const gchar *with,
+					   guint cseq)
 {
-	gboolean found = g_hash_table_remove(session->unconfirmed_messages, key);
-	if (found) {
-		SIPE_DEBUG_INFO("remove_unconfirmed_message: removed %s from list (count=%d)",
-				key, g_hash_table_size(session->unconfirmed_messages));
-	} else {
-		SIPE_DEBUG_INFO("remove_unconfirmed_message: key %s not found",
-				key);
+	struct unconfirmed_dialog *ud = find_unconfirmed_dialog(session,
+								callid,
+								with);
+	GList *link = ud ? g_hash_table_lookup(ud->by_cseq, GUINT_TO_POINTER(cseq)) : NULL;
+
+	if (link) {
+		g_hash_table_remove(ud->by_cseq, GUINT_TO_POINTER(cseq));
+		sipe_session_free_queued_message(link->data);
+		g_queue_delete_link(&ud->messages, link);
+		SIPE_DEBUG_INFO("remove_unconfirmed_message: removed %s CSeq %d from list (count=%d)",
+				with ? with : "INVITE", cseq,
+				g_queue_get_length(&ud->messages));
+		if (g_queue_is_empty(&ud->messages))
+			g_hash_table_remove(session->unconfirmed_messages, ud);
+		return(TRUE);
 	}
-	return(found);
+
+	SIPE_DEBUG_INFO("remove_unconfirmed_message: %s CSeq %d not found",
+			with ? with : "INVITE", cseq);
+	return(FALSE);
+}
+
+/*
+ * The X-MMS-IM-Format for the user's font settings rarely changes,
+ * so the encoded "msgr" parameter is cached per account.
+ */
+static const gchar *im_msgr_parameter(struct sipe_core_private *sipe_private,
+				      const gchar *msgformat)
+{
+	if (!sipe_private->im_format_msgr ||
+	    !sipe_strequal(msgformat, sipe_private->im_format)) {
+		gchar *msgr_value = sipmsg_get_msgr_string(msgformat);
+
+		g_free(sipe_private->im_format);
+		g_free(sipe_private->im_format_msgr);
+		sipe_private->im_format      = g_strdup(msgformat);
+		sipe_private->im_format_msgr = msgr_value ?
+			g_strdup_printf(";msgr=%s", msgr_value) :
+			g_strdup("");
+		g_free(msgr_value);
+	}
+
+	return(sipe_private->im_format_msgr);
 }
 
 static void sipe_refer_notify(struct sipe_core_private *sipe_private,
@@ -142,7 +409,7 @@ static gboolean process_invite_response(struct sipe_core_private *sipe_private,
 	gchar *with = parse_from(sipmsg_find_header(msg, "To"));
 	struct sip_session *session;
 	struct sip_dialog *dialog;
-	gchar *key;
+	guint cseq;
 	struct queued_message *message;
 	struct sipmsg *request_msg = trans->msg;
 
@@ -165,8 +432,8 @@ static gboolean process_invite_response(struct sipe_core_private *sipe_private,
 
 	sipe_dialog_parse(dialog, msg, TRUE);
 
-	key = get_unconfirmed_message_key(dialog->callid, sipmsg_parse_cseq(msg), NULL);
-	message = g_hash_table_lookup(session->unconfirmed_messages, key);
+	cseq = sipmsg_parse_cseq(msg);
+	message = find_unconfirmed_message(session, dialog->callid, NULL, cseq);
 
 	if (msg->response != 200) {
 		gchar *alias = sipe_buddy_get_alias(sipe_private, with);
@@ -201,9 +468,8 @@ static gboolean process_invite_response(struct sipe_core_private *sipe_private,
 		}
 		g_free(alias);
 
-		remove_unconfirmed_message(session, key);
+		remove_unconfirmed_message(session, dialog->callid, NULL, cseq);
 		/* message is no longer valid */
-		g_free(key);
 
 		sipe_dialog_remove(session, with);
 		g_free(with);
@@ -240,15 +506,19 @@ static gboolean process_invite_response(struct sipe_core_private *sipe_private,
 	}
 
 	if(g_slist_find_custom(dialog->supported, "ms-text-format", (GCompareFunc)g_ascii_strcasecmp)) {
+		struct queued_message *first = session->outgoing_message_queue ?
+			session->outgoing_message_queue->data : NULL;
+
 		SIPE_DEBUG_INFO_NOFORMAT("process_invite_response: remote system accepted message in INVITE");
+		if (first && first->target)
+			im_target_report(first->target, TRUE);
 		sipe_session_dequeue_message(session);
 	}
 
 	sipe_im_process_queue(sipe_private, session);
 
-	remove_unconfirmed_message(session, key);
+	remove_unconfirmed_message(session, dialog->callid, NULL, cseq);
 
-	g_free(key);
 	g_free(with);
 	return TRUE;
 }
@@ -291,7 +561,7 @@ sipe_im_invite(struct sipe_core_private *sipe_private,
 {
 	gchar *hdr;
 	gchar *to;
-	gchar *contact;
+	const gchar *contact;
 	gchar *body;
 	gchar *self;
 	char  *ms_text_format = NULL;
@@ -325,21 +595,15 @@ sipe_im_invite(struct sipe_core_private *sipe_private,
 		char *msgtext = NULL;
 		char *base64_msg;
 		const gchar *msgr = "";
-		gchar *tmp = NULL;
 
 		if (!g_str_has_prefix(content_type, "text/x-msmsgsinvite")) {
 			char *msgformat;
-			gchar *msgr_value;
 
 			sipe_parse_html(msg_body, &msgformat, &msgtext);
 			SIPE_DEBUG_INFO("sipe_invite: msgformat=%s", msgformat);
 
-			msgr_value = sipmsg_get_msgr_string(msgformat);
+			msgr = im_msgr_parameter(sipe_private, msgformat);
 			g_free(msgformat);
-			if (msgr_value) {
-				msgr = tmp = g_strdup_printf(";msgr=%s", msgr_value);
-				g_free(msgr_value);
-			}
 
 			/* When Sipe reconnects after a crash, we are not able
 			 * to send messages to contacts with which we had open
@@ -361,11 +625,10 @@ sipe_im_invite(struct sipe_core_private *sipe_private,
 						 msgr,
 						 base64_msg);
 		g_free(msgtext);
-		g_free(tmp);
 		g_free(base64_msg);
 
 		insert_unconfirmed_message(session, dialog, NULL,
-					   msg_body, content_type);
+					   msg_body, content_type, NULL);
 	}
 
 	contact = get_contact(sipe_private);
@@ -429,7 +692,6 @@ sipe_im_invite(struct sipe_core_private *sipe_private,
 	g_free(referred_by_str);
 	g_free(body);
 	g_free(hdr);
-	g_free(contact);
 }
 
 static gboolean
@@ -442,7 +704,7 @@ process_message_response(struct sipe_core_private *sipe_private,
 	const gchar *callid = sipmsg_find_header(msg, "Call-ID");
 	struct sip_session *session = sipe_session_find_chat_or_im(sipe_private, callid, with);
 	struct sip_dialog *dialog;
-	gchar *key;
+	guint cseq = sipmsg_parse_cseq(msg);
 	struct queued_message *message;
 
 	if (!session) {
@@ -458,8 +720,7 @@ process_message_response(struct sipe_core_private *sipe_private,
 		return FALSE;
 	}
 
-	key = get_unconfirmed_message_key(sipmsg_find_header(msg, "Call-ID"), sipmsg_parse_cseq(msg), with);
-	message = g_hash_table_lookup(session->unconfirmed_messages, key);
+	message = find_unconfirmed_message(session, callid, with, cseq);
 
 	if (msg->response >= 400) {
 		int warning = sipmsg_parse_warning(msg, NULL);
@@ -489,9 +750,12 @@ process_message_response(struct sipe_core_private *sipe_private,
 							      msg->response, warning,
 							      alias ? alias : with,
 							      message ? message->body : NULL);
-			remove_unconfirmed_message(session, key);
+			remove_unconfirmed_message(session, callid, with, cseq);
 			/* message is no longer valid */
 			g_free(alias);
+
+			/* window might have been full */
+			sipe_im_process_queue(sipe_private, session);
 		}
 
 		ret = FALSE;
@@ -502,10 +766,11 @@ process_message_response(struct sipe_core_private *sipe_private,
 			SIPE_DEBUG_INFO("process_message_response: added message with id %s to conf_unconfirmed_messages(count=%d)",
 					message_id, g_hash_table_size(session->conf_unconfirmed_messages));
 		}
-		remove_unconfirmed_message(session, key);
+		if (message && message->target)
+			im_target_report(message->target, TRUE);
+		remove_unconfirmed_message(session, callid, with, cseq);
 	}
 
-	g_free(key);
 	g_free(with);
 
 	if (ret) sipe_im_process_queue(sipe_private, session);
@@ -536,7 +801,6 @@ process_message_timeout(struct sipe_core_private *sipe_private,
 	gchar *with = parse_from(sipmsg_find_header(msg, "To"));
 	const gchar *callid = sipmsg_find_header(msg, "Call-ID");
 	struct sip_session *session = sipe_session_find_chat_or_im(sipe_private, callid, with);
-	gchar *key;
 	gboolean found;
 
 	if (!session) {
@@ -546,9 +810,8 @@ process_message_timeout(struct sipe_core_private *sipe_private,
 	}
 
 	/* Remove timed-out message from unconfirmed list */
-	key = get_unconfirmed_message_key(sipmsg_find_header(msg, "Call-ID"), sipmsg_parse_cseq(msg), with);
-	found = remove_unconfirmed_message(session, key);
-	g_free(key);
+	found = remove_unconfirmed_message(session, callid, with,
+					   sipmsg_parse_cseq(msg));
 
 	if (found) {
 		gchar *alias = sipe_buddy_get_alias(sipe_private, with);
@@ -556,6 +819,9 @@ process_message_timeout(struct sipe_core_private *sipe_private,
 						      alias ? alias : with,
 						      msg->body);
 		g_free(alias);
+
+		/* window might have been full */
+		sipe_im_process_queue(sipe_private, session);
 	}
 
 	g_free(with);
@@ -569,27 +835,24 @@ static void sipe_im_send_message(struct sipe_core_private *sipe_private,
 				 const gchar *content_type)
 {
 	gchar *hdr;
-	gchar *tmp;
+	const gchar *tmp;
 	char *msgtext = NULL;
 	const gchar *msgr = "";
-	gchar *tmp2 = NULL;
 
 	if (content_type == NULL)
 		content_type = "text/plain";
 
+	/* receiving a message clears the typing indication on the other side */
+	dialog->typing_active = FALSE;
+
 	if (!g_str_has_prefix(content_type, "text/x-msmsgsinvite")) {
 		char *msgformat;
-		gchar *msgr_value;
 
 		sipe_parse_html(msg_body, &msgformat, &msgtext);
 		SIPE_DEBUG_INFO("sipe_send_message: msgformat=%s", msgformat);
 
-		msgr_value = sipmsg_get_msgr_string(msgformat);
+		msgr = im_msgr_parameter(sipe_private, msgformat);
 		g_free(msgformat);
-		if (msgr_value) {
-			msgr = tmp2 = g_strdup_printf(";msgr=%s", msgr_value);
-			g_free(msgr_value);
-		}
 	} else {
 		msgtext = g_strdup(msg_body);
 	}
@@ -600,8 +863,6 @@ static void sipe_im_send_message(struct sipe_core_private *sipe_private,
 	//hdr = g_strdup("Content-Type: text/plain; charset=UTF-8;msgr=WAAtAE0ATQBTAC....AoADQA\r\nSupported: timer\r\n");
 
 	hdr = g_strdup_printf("Contact: %s\r\nContent-Type: %s; charset=UTF-8%s\r\n", tmp, content_type, msgr);
-	g_free(tmp);
-	g_free(tmp2);
 
 #ifdef ENABLE_OCS2005_MESSAGE_HACK
 	sip_transport_request(
@@ -633,6 +894,18 @@ void sipe_im_process_queue(struct sipe_core_private *sipe_private,
 	while (entry2) {
 		struct queued_message *msg = entry2->data;
 
+		/* wait for responses when a dialog has too many in flight */
+		SIPE_DIALOG_FOREACH {
+			if (dialog->outgoing_invite) continue;
+			if (count_unconfirmed_messages(session,
+						       dialog->callid,
+						       dialog->with) >= IM_MESSAGE_WINDOW) {
+				SIPE_DEBUG_INFO("sipe_im_process_queue: window for %s is full",
+						dialog->with);
+				return;
+			}
+		} SIPE_DIALOG_FOREACH_END;
+
 		/* for multiparty chat or conference */
 		if (session->chat_session) {
 			gchar *who = sip_uri_self(sipe_private);
@@ -648,7 +921,8 @@ void sipe_im_process_queue(struct sipe_core_private *sipe_private,
 			if (dialog->outgoing_invite) continue; /* do not send messages as INVITE is not responded. */
 
 			insert_unconfirmed_message(session, dialog, dialog->with,
-						   msg->body, msg->content_type);
+						   msg->body, msg->content_type,
+						   msg->target);
 
 			sipe_im_send_message(sipe_private, dialog, msg->body, msg->content_type);
 		} SIPE_DIALOG_FOREACH_END;
@@ -657,85 +931,47 @@ void sipe_im_process_queue(struct sipe_core_private *sipe_private,
 	}
 }
 
-struct unconfirmed_callback_data {
-	const gchar *prefix;
-	GSList *list;
-};
-
-struct unconfirmed_message {
-	const gchar *key;
-	const struct queued_message *msg;
-};
-
-static gint compare_cseq(gconstpointer a,
-			 gconstpointer b)
-{
-	return(((struct unconfirmed_message *) a)->msg->cseq -
-	       ((struct unconfirmed_message *) b)->msg->cseq);
-}
-
-static void unconfirmed_message_callback(gpointer key,
-					 gpointer value,
-					 gpointer user_data)
-{
-	const gchar *message_key = key;
-	struct unconfirmed_callback_data *data = user_data;
-
-	SIPE_DEBUG_INFO("unconfirmed_message_callback: key %s", message_key);
-
-	/* Put messages with the same prefix on a list sorted by CSeq */
-	if (g_str_has_prefix(message_key, data->prefix)) {
-		struct unconfirmed_message *msg = g_malloc(sizeof(struct unconfirmed_message));
-		msg->key = message_key;
-		msg->msg = value;
-		data->list = g_slist_insert_sorted(data->list, msg,
-						   compare_cseq);
-	}
-}
+typedef void (*unconfirmed_message_callback)(struct sipe_core_private *sipe_private,
+					     struct sip_session *session,
+					     const struct queued_message *message,
+					     const gchar *callback_data);
 
 static void foreach_unconfirmed_message(struct sipe_core_private *sipe_private,
 					struct sip_session *session,
 					const gchar *callid,
 					const gchar *with,
-					unconfirmed_callback callback,
+					unconfirmed_message_callback callback,
 					const gchar *callback_data)
 {
-	gchar *prefix = g_strdup_printf(UNCONFIRMED_KEY_TEMPLATE("MESSAGE", ""),
-					callid, with);
-	struct unconfirmed_callback_data data = { prefix, NULL };
-
-	SIPE_DEBUG_INFO("foreach_unconfirmed_message: prefix %s", prefix);
-
-	/* Generate list of matching unconfirmed messages */
-	g_hash_table_foreach(session->unconfirmed_messages,
-			     unconfirmed_message_callback,
-			     &data);
-	g_free(prefix);
-
-	/* Process list unconfirmed messages */
-	if (data.list) {
-		GSList *entry;
+	struct unconfirmed_dialog *ud = find_unconfirmed_dialog(session,
+								callid,
+								with);
+	struct queued_message *message;
 
-		while ((entry = data.list) != NULL) {
-			struct unconfirmed_message *unconfirmed = entry->data;
-			data.list = g_slist_remove(data.list, unconfirmed);
+	SIPE_DEBUG_INFO("foreach_unconfirmed_message: with %s callid '%s' (count=%d)",
+			with, callid, ud ? g_queue_get_length(&ud->messages) : 0);
 
-			SIPE_DEBUG_INFO("foreach_unconfirmed_message: %s", unconfirmed->key);
-			(*callback)(sipe_private, session, unconfirmed->msg->body, callback_data);
+	if (!ud)
+		return;
 
-			g_hash_table_remove(session->unconfirmed_messages, unconfirmed->key);
-			g_free(unconfirmed);
-		}
+	/* Process unconfirmed messages in CSeq order */
+	g_hash_table_steal(session->unconfirmed_messages, ud);
+	while ((message = g_queue_pop_head(&ud->messages)) != NULL) {
+		g_hash_table_remove(ud->by_cseq, GUINT_TO_POINTER(message->cseq));
+		SIPE_DEBUG_INFO("foreach_unconfirmed_message: CSeq %d", message->cseq);
+		(*callback)(sipe_private, session, message, callback_data);
+		sipe_session_free_queued_message(message);
 	}
+	unconfirmed_dialog_free(ud);
 }
 
 static void cancel_callback(struct sipe_core_private *sipe_private,
 			    struct sip_session *session,
-			    const gchar *body,
+			    const struct queued_message *message,
 			    const gchar *with)
 {
 	sipe_user_present_message_undelivered(sipe_private, session,
-					      -1, -1, with, body);
+					      -1, -1, with, message->body);
 }
 
 void sipe_im_cancel_unconfirmed(struct sipe_core_private *sipe_private,
@@ -755,10 +991,13 @@ void sipe_im_cancel_unconfirmed(struct sipe_core_private *sipe_private,
 
 static void reenqueue_callback(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
 			       struct sip_session *session,
-			       const gchar *body,
+			       const struct queued_message *message,
 			       SIPE_UNUSED_PARAMETER const gchar *with)
 {
-	sipe_session_enqueue_message(session, body, NULL);
+	queued_message_set_target(sipe_session_enqueue_message(session,
+							       message->body,
+							       NULL),
+				  message->target);
 }
 
 void sipe_im_reenqueue_unconfirmed(struct sipe_core_private *sipe_private,
@@ -786,22 +1025,20 @@ void sipe_im_reenqueue_unconfirmed(struct sipe_core_private *sipe_private,
 	}
 }
 
-void sipe_core_im_send(struct sipe_core_public *sipe_public,
-		       const gchar *who,
-		       const gchar *what)
+static void im_send(struct sipe_core_private *sipe_private,
+		    const gchar *uri,
+		    const gchar *what,
+		    struct sipe_im_target *target)
 {
-	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
-	struct sip_session *session;
-	struct sip_dialog *dialog;
-	gchar *uri = sip_uri(who);
-
-	SIPE_DEBUG_INFO("sipe_core_im_send: '%s'", what);
-
-	session = sipe_session_find_or_add_im(sipe_private, uri);
-	dialog = sipe_dialog_find(session, uri);
+	struct sip_session *session = sipe_session_find_or_add_im(sipe_private,
+								  uri);
+	struct sip_dialog *dialog = sipe_dialog_find(session, uri);
 
 	/* Queue the message */
-	sipe_session_enqueue_message(session, what, NULL);
+	queued_message_set_target(sipe_session_enqueue_message(session,
+							       what,
+							       NULL),
+				  target);
 
 	if (dialog && !dialog->outgoing_invite) {
                 if (dialog->delayed_invite)
@@ -812,10 +1049,63 @@ void sipe_core_im_send(struct sipe_core_public *sipe_public,
 		/* Need to send the INVITE to get the outgoing dialog setup */
 		sipe_im_invite(sipe_private, session, uri, what, NULL, NULL, FALSE);
 	}
+}
+
+void sipe_core_im_send(struct sipe_core_public *sipe_public,
+		       const gchar *who,
+		       const gchar *what)
+{
+	gchar *uri = sip_uri(who);
 
+	SIPE_DEBUG_INFO("sipe_core_im_send: '%s'", what);
+
+	im_send(SIPE_CORE_PRIVATE, uri, what, NULL);
 	g_free(uri);
 }
 
+void sipe_core_im_send_many(struct sipe_core_public *sipe_public,
+			    const GSList *who,
+			    const gchar *what,
+			    sipe_core_im_send_cb callback,
+			    gpointer user_data)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	struct sipe_im_bulk *bulk;
+
+	if (!who)
+		return;
+
+	bulk = g_new0(struct sipe_im_bulk, 1);
+	bulk->sipe_private = sipe_private;
+	bulk->what         = g_strdup(what);
+	bulk->callback     = callback;
+	bulk->user_data    = user_data;
+	g_queue_init(&bulk->waiting);
+	for (; who; who = who->next)
+		g_queue_push_tail(&bulk->waiting, sip_uri(who->data));
+
+	SIPE_DEBUG_INFO("sipe_core_im_send_many: %d destinations, '%s'",
+			g_queue_get_length(&bulk->waiting), what);
+
+	sipe_private->im_bulk_jobs = g_slist_prepend(sipe_private->im_bulk_jobs,
+						     bulk);
+	im_bulk_next(bulk);
+}
+
+void sipe_im_bulk_cancel(struct sipe_core_private *sipe_private)
+{
+	GSList *jobs = g_slist_copy(sipe_private->im_bulk_jobs);
+	GSList *entry;
+
+	for (entry = jobs; entry; entry = entry->next) {
+		struct sipe_im_bulk *bulk = entry->data;
+		bulk->cancelled = TRUE;
+		if (!bulk->active)
+			im_bulk_free(bulk);
+	}
+	g_slist_free(jobs);
+}
+
 void sipe_core_im_close(struct sipe_core_public *sipe_public,
 			const gchar *who)
 {
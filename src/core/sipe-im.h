@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -24,6 +24,7 @@
 struct sip_dialog;
 struct sip_session;
 struct sipe_core_private;
+struct sipe_im_target;
 
 #ifdef HAVE_GMIME
 /* pls. don't add multipart/related - it's not used in IM modality */
@@ -62,6 +63,17 @@ void sipe_im_invite(struct sipe_core_private *sipe_private,
 void sipe_im_process_queue(struct sipe_core_private *sipe_private,
 			   struct sip_session *session);
 
+/**
+ * Check for outstanding MESSAGE transactions
+ *
+ * @param session      session for the IM conversation(s)
+ * @param dialog       dialog to check
+ *
+ * @return @c TRUE if a MESSAGE sent to the dialog hasn't been responded yet
+ */
+gboolean sipe_im_dialog_busy(struct sip_session *session,
+			     struct sip_dialog *dialog);
+
 /**
  * Cancel unconfirmed IM messages
  *
@@ -127,3 +139,23 @@ void sipe_im_topic(struct sipe_core_private *sipe_private,
  */
 void process_incoming_info_conversation(struct sipe_core_private *sipe_private,
 					struct sipmsg *msg);
+
+/**
+ * Drop reference to bulk send destination
+ *
+ * Called when a queued message is freed. Reports the destination as
+ * undelivered if this was the last reference and no result was reported yet.
+ *
+ * @param target (in) bulk send destination
+ */
+void sipe_im_target_unref(struct sipe_im_target *target);
+
+/**
+ * Cancel bulk send jobs
+ *
+ * Destinations that haven't been started are reported as undelivered.
+ * Started destinations report their result when their session is removed.
+ *
+ * @param sipe_private (in) SIPE core data
+ */
+void sipe_im_bulk_cancel(struct sipe_core_private *sipe_private);
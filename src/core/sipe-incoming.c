@@ -45,6 +45,7 @@
 #include "sipe-groupchat.h"
 #include "sipe-im.h"
 #include "sipe-incoming.h"
+#include "sipe-intern.h"
 #include "sipe-media.h"
 #include "sipe-mime.h"
 #include "sipe-nls.h"
@@ -462,12 +463,14 @@ void process_incoming_invite(struct sipe_core_private *sipe_private,
 				gchar *chat_title = sipe_chat_get_name();
 
 				/* Convert IM session to multiparty session */
-				g_free(session->with);
+				sipe_session_index_remove(sipe_private, session);
+				sipe_intern_unref(session->with);
 				session->with = NULL;
 				was_multiparty = FALSE;
 				session->chat_session = sipe_chat_create_session(SIPE_CHAT_TYPE_MULTIPARTY,
 										 roster_manager,
 										 chat_title);
+				sipe_session_index_add(sipe_private, session);
 
 				g_free(chat_title);
 			}
@@ -496,8 +499,10 @@ void process_incoming_invite(struct sipe_core_private *sipe_private,
 		session = sipe_session_find_or_add_im(sipe_private, from);
 
 	/* session is now initialized */
+	sipe_session_index_remove(sipe_private, session);
 	g_free(session->callid);
 	session->callid = g_strdup(callid);
+	sipe_session_index_add(sipe_private, session);
 
 	if (is_multiparty && end_points) {
 		gchar *to = parse_from(sipmsg_find_header(msg, "To"));
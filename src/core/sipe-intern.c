@@ -0,0 +1,139 @@
+/**
+ * @file sipe-intern.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-intern.h"
+#include "sipe-str.h"
+#include "sipe-utils.h"
+
+/* the interned string is stored directly behind the header */
+struct intern_entry {
+	guint refcount;
+	guint hash;
+	gchar uri[1];
+};
+
+#define INTERN_ENTRY(interned) \
+	((struct intern_entry *) ((interned) - G_STRUCT_OFFSET(struct intern_entry, uri)))
+
+/* key: entry->uri, value: entry */
+static GHashTable *pool = NULL;
+
+const gchar *sipe_intern_uri(const gchar *uri)
+{
+	struct intern_entry *entry;
+
+	if (!uri)
+		return(NULL);
+
+	if (!pool)
+		pool = g_hash_table_new(sipe_strcase_hash,
+					g_str_equal);
+
+	entry = g_hash_table_lookup(pool, uri);
+	if (entry) {
+		entry->refcount++;
+	} else {
+		gsize length = strlen(uri);
+
+		entry = g_malloc(G_STRUCT_OFFSET(struct intern_entry, uri) +
+				 length + 1);
+		entry->refcount = 1;
+		entry->hash     = sipe_strcase_hash(uri);
+		memcpy(entry->uri, uri, length + 1);
+		g_hash_table_insert(pool, entry->uri, entry);
+	}
+
+	return(entry->uri);
+}
+
+const gchar *sipe_intern_uri_lower(const gchar *uri)
+{
+	gchar *lower = sipe_str_ascii_strdown(uri);
+	const gchar *interned = sipe_intern_uri(lower);
+	g_free(lower);
+	return(interned);
+}
+
+const gchar *sipe_intern_ref(const gchar *interned)
+{
+	if (interned)
+		INTERN_ENTRY(interned)->refcount++;
+	return(interned);
+}
+
+void sipe_intern_unref(const gchar *interned)
+{
+	struct intern_entry *entry;
+
+	if (!interned)
+		return;
+
+	entry = INTERN_ENTRY(interned);
+	if (--entry->refcount == 0) {
+		g_hash_table_remove(pool, entry->uri);
+		g_free(entry);
+
+		if (g_hash_table_size(pool) == 0) {
+			g_hash_table_destroy(pool);
+			pool = NULL;
+		}
+	}
+}
+
+guint sipe_intern_hash(gconstpointer interned)
+{
+	return(INTERN_ENTRY((const gchar *) interned)->hash);
+}
+
+guint sipe_intern_count(void)
+{
+	return(pool ? g_hash_table_size(pool) : 0);
+}
+
+void sipe_intern_memory_usage(guint64 *bytes, guint64 *objects)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	if (!pool)
+		return;
+
+	g_hash_table_iter_init(&iter, pool);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		*bytes += G_STRUCT_OFFSET(struct intern_entry, uri) +
+			strlen(key) + 1;
+		(*objects)++;
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,102 @@
+/**
+ * @file sipe-intern.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Reference counted URI intern pool
+ *
+ * Every distinct URI is stored once. Two interned URIs are equal if and
+ * only if their pointers are equal. The pool is shared by all accounts
+ * and is freed when the last URI has been released.
+ *
+ * Interned URIs are read-only. The cached hash value is case-folded, i.e.
+ * sipe_intern_hash() can be used for tables with case-insensitive keys.
+ */
+
+/**
+ * Intern a URI
+ *
+ * @param uri URI (may be @c NULL)
+ *
+ * @return interned copy of URI with a new reference. Must be released
+ *         with sipe_intern_unref(). @c NULL if @c uri was @c NULL.
+ */
+const gchar *sipe_intern_uri(const gchar *uri);
+
+/**
+ * Intern lower case version of a URI
+ *
+ * @param uri URI (may be @c NULL)
+ *
+ * @return same as sipe_intern_uri()
+ */
+const gchar *sipe_intern_uri_lower(const gchar *uri);
+
+/**
+ * Add a reference to an interned URI
+ *
+ * @param interned interned URI (may be @c NULL)
+ *
+ * @return @c interned
+ */
+const gchar *sipe_intern_ref(const gchar *interned);
+
+/**
+ * Release a reference to an interned URI
+ *
+ * Can be used as GDestroyNotify.
+ *
+ * @param interned interned URI (may be @c NULL)
+ */
+void sipe_intern_unref(const gchar *interned);
+
+/**
+ * Hash value of an interned URI
+ *
+ * Returns the value cached in the pool, i.e. it is O(1).
+ *
+ * @param interned interned URI
+ *
+ * @return hash value
+ */
+guint sipe_intern_hash(gconstpointer interned);
+
+/**
+ * Number of distinct URIs in the pool
+ */
+guint sipe_intern_count(void);
+
+/**
+ * Estimate memory used by the pool
+ *
+ * @param bytes   incremented by number of bytes
+ * @param objects incremented by number of allocated objects
+ */
+void sipe_intern_memory_usage(guint64 *bytes, guint64 *objects);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,241 @@
+/**
+ * @file sipe-job.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * CPU intensive work is moved off the main loop to a thread pool that is
+ * shared by all SIPE instances. Results are returned to the main loop via
+ * an idle callback, where the job is matched against its SIPE instance.
+ * A job whose instance has gone away in the meantime is discarded.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-job.h"
+#include "sipe-utils.h"
+#include "sipe-xml.h"
+
+/* Worker threads require GLib threads without additional initialization */
+#if GLIB_CHECK_VERSION(2,32,0)
+#define SIPE_JOB_THREADS 4
+static GThreadPool *job_pool = NULL;
+#endif
+
+struct sipe_job {
+	struct sipe_core_private *sipe_private; /* NULL: cancelled */
+	sipe_job_func *func;
+	sipe_job_callback *callback;
+	gpointer data;
+	GDestroyNotify data_free;
+	gpointer result;
+	GDestroyNotify result_free;
+	GMainContext *context;                  /* of the SIPE instance */
+};
+
+/* main thread */
+static gboolean job_ready(gpointer data)
+{
+	struct sipe_job *job = data;
+	struct sipe_core_private *sipe_private = job->sipe_private;
+
+	if (sipe_private) {
+		sipe_private->jobs = g_slist_remove(sipe_private->jobs, job);
+		(*job->callback)(sipe_private, job->result, job->data);
+	} else if (job->result && job->result_free) {
+		(*job->result_free)(job->result);
+	}
+
+	if (job->data_free)
+		(*job->data_free)(job->data);
+	if (job->context)
+		g_main_context_unref(job->context);
+	g_free(job);
+
+	return(FALSE);
+}
+
+/* worker thread (or main thread without thread support) */
+static void job_execute(gpointer data,
+			SIPE_UNUSED_PARAMETER gpointer user_data)
+{
+	struct sipe_job *job = data;
+
+	job->result = (*job->func)(job->data);
+	sipe_utils_timeout_add(job->context, 0, job_ready, job);
+}
+
+struct sipe_job *sipe_job_submit(struct sipe_core_private *sipe_private,
+				 sipe_job_func *func,
+				 sipe_job_callback *callback,
+				 gpointer data,
+				 GDestroyNotify data_free,
+				 GDestroyNotify result_free)
+{
+	struct sipe_job *job = g_new0(struct sipe_job, 1);
+
+	job->sipe_private = sipe_private;
+	job->func         = func;
+	job->callback     = callback;
+	job->data         = data;
+	job->data_free    = data_free;
+	job->result_free  = result_free;
+	/* instance may be gone when the job has finished */
+	job->context      = SIPE_CORE_PUBLIC->context ?
+		g_main_context_ref(SIPE_CORE_PUBLIC->context) : NULL;
+	sipe_private->jobs = g_slist_prepend(sipe_private->jobs, job);
+
+#ifdef SIPE_JOB_THREADS
+	if (!job_pool) {
+		GError *error = NULL;
+
+		job_pool = g_thread_pool_new(job_execute,
+					     NULL,
+					     SIPE_JOB_THREADS,
+					     FALSE,
+					     &error);
+		if (!job_pool) {
+			SIPE_DEBUG_ERROR("sipe_job_submit: can't create thread pool: %s",
+					 error ? error->message : "UNKNOWN");
+			if (error)
+				g_error_free(error);
+		}
+	}
+
+	if (job_pool &&
+	    g_thread_pool_push(job_pool, job, NULL))
+		return(job);
+#endif
+
+	/* no threads: run job now, but deliver result asynchronously */
+	job_execute(job, NULL);
+	return(job);
+}
+
+void sipe_job_cancel(struct sipe_job *job)
+{
+	if (job && job->sipe_private) {
+		struct sipe_core_private *sipe_private = job->sipe_private;
+
+		sipe_private->jobs = g_slist_remove(sipe_private->jobs, job);
+		job->sipe_private  = NULL;
+	}
+}
+
+void sipe_job_cancel_all(struct sipe_core_private *sipe_private)
+{
+	GSList *entry;
+
+	for (entry = sipe_private->jobs; entry; entry = entry->next)
+		((struct sipe_job *) entry->data)->sipe_private = NULL;
+	g_slist_free(sipe_private->jobs);
+	sipe_private->jobs = NULL;
+}
+
+struct job_xml_parse {
+	gchar *document;
+	sipe_job_xml_callback *callback;
+	gpointer data;
+};
+
+static void job_xml_parse_free(gpointer data)
+{
+	struct job_xml_parse *jxp = data;
+	g_free(jxp->document);
+	g_free(jxp);
+}
+
+static void job_xml_free(gpointer data)
+{
+	sipe_xml_free(data);
+}
+
+/* worker thread */
+static gpointer job_xml_parse_execute(gpointer data)
+{
+	struct job_xml_parse *jxp = data;
+	return(sipe_xml_parse_silent(jxp->document, strlen(jxp->document)));
+}
+
+/* main thread */
+static void job_xml_parse_done(struct sipe_core_private *sipe_private,
+			       gpointer result,
+			       gpointer data)
+{
+	struct job_xml_parse *jxp = data;
+
+	if (!result)
+		SIPE_DEBUG_ERROR("job_xml_parse_done: failed to parse %" G_GSIZE_FORMAT " bytes of XML",
+				 strlen(jxp->document));
+
+	(*jxp->callback)(sipe_private, jxp->document, result, jxp->data);
+	sipe_xml_free(result);
+}
+
+struct sipe_job *sipe_job_xml_parse(struct sipe_core_private *sipe_private,
+				    const gchar *document,
+				    sipe_job_xml_callback *callback,
+				    gpointer data)
+{
+	struct job_xml_parse *jxp = g_new0(struct job_xml_parse, 1);
+
+	jxp->document = g_strdup(document);
+	jxp->callback = callback;
+	jxp->data     = data;
+
+	SIPE_DEBUG_INFO("sipe_job_xml_parse: %" G_GSIZE_FORMAT " bytes",
+			strlen(document));
+
+	return(sipe_job_submit(sipe_private,
+			       job_xml_parse_execute,
+			       job_xml_parse_done,
+			       jxp,
+			       job_xml_parse_free,
+			       job_xml_free));
+}
+
+void sipe_job_shutdown(void)
+{
+#ifdef SIPE_JOB_THREADS
+	if (job_pool) {
+		/* wait for running jobs */
+		g_thread_pool_free(job_pool, FALSE, TRUE);
+		job_pool = NULL;
+	}
+#endif
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
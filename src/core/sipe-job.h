@@ -0,0 +1,138 @@
+/**
+ * @file sipe-job.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_job;
+struct _sipe_xml;
+
+/**
+ * Job function
+ *
+ * Runs on a worker thread: it must not access SIPE data, call into the
+ * backend or generate debug output!
+ *
+ * @param data job data
+ *
+ * @return job result (may be @c NULL)
+ */
+typedef gpointer (sipe_job_func)(gpointer data);
+
+/**
+ * Job completion callback
+ *
+ * Called from the main loop. Not called when the job was cancelled.
+ *
+ * @param sipe_private SIPE core private data
+ * @param result       job result. Owned by the callback.
+ * @param data         job data
+ */
+typedef void (sipe_job_callback)(struct sipe_core_private *sipe_private,
+				 gpointer result,
+				 gpointer data);
+
+/**
+ * Run a function on a worker thread and return its result to the main loop
+ *
+ * Without thread support the function is executed immediately. The
+ * callback is always called asynchronously, i.e. after this function
+ * has returned.
+ *
+ * @param sipe_private SIPE core private data
+ * @param func         job function
+ * @param callback     completion callback
+ * @param data         job data
+ * @param data_free    destructor for job data (may be @c NULL). Called after
+ *                     the callback or when a cancelled job has finished.
+ * @param result_free  destructor for the result of a cancelled job (may be
+ *                     @c NULL)
+ *
+ * @return job handle for @c sipe_job_cancel()
+ */
+struct sipe_job *sipe_job_submit(struct sipe_core_private *sipe_private,
+				 sipe_job_func *func,
+				 sipe_job_callback *callback,
+				 gpointer data,
+				 GDestroyNotify data_free,
+				 GDestroyNotify result_free);
+
+/**
+ * Cancel a job
+ *
+ * A running job can't be stopped. Its result will be discarded.
+ *
+ * @param job job handle (may be @c NULL)
+ */
+void sipe_job_cancel(struct sipe_job *job);
+
+/**
+ * Cancel all jobs of a SIPE instance
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_job_cancel_all(struct sipe_core_private *sipe_private);
+
+/**
+ * XML document parse callback
+ *
+ * @param sipe_private SIPE core private data
+ * @param document     XML document text
+ * @param xml          parsed document or @c NULL on failure. Will be freed
+ *                     after the callback returns.
+ * @param data         callback data
+ */
+typedef void (sipe_job_xml_callback)(struct sipe_core_private *sipe_private,
+				     const gchar *document,
+				     struct _sipe_xml *xml,
+				     gpointer data);
+
+/**
+ * Minimum document length for parsing on a worker thread. Parsing
+ * smaller documents takes less time than the thread round trip.
+ */
+#define SIPE_JOB_XML_MIN_LENGTH (64 * 1024)
+
+/**
+ * Parse XML document on a worker thread
+ *
+ * @param sipe_private SIPE core private data
+ * @param document     XML document text (will be copied)
+ * @param callback     parse callback
+ * @param data         callback data
+ *
+ * @return job handle for @c sipe_job_cancel()
+ */
+struct sipe_job *sipe_job_xml_parse(struct sipe_core_private *sipe_private,
+				    const gchar *document,
+				    sipe_job_xml_callback *callback,
+				    gpointer data);
+
+/**
+ * Free job worker threads
+ */
+void sipe_job_shutdown(void);
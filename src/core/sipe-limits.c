@@ -0,0 +1,97 @@
+/**
+ * @file sipe-limits.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-limits.h"
+
+struct limit {
+	const gchar *name;
+	const gchar *environment;
+	gsize value;
+};
+
+/* must match the order of sipe_limit */
+static struct limit limits[SIPE_LIMITS] = {
+	{ "sip.header_lines",  "SIPE_LIMIT_SIP_HEADER_LINES",  512                },
+	{ "sip.header_length", "SIPE_LIMIT_SIP_HEADER_LENGTH", 64 * 1024          },
+	{ "sip.body",          "SIPE_LIMIT_SIP_BODY",          16 * 1024 * 1024   },
+	{ "http.body",         "SIPE_LIMIT_HTTP_BODY",         64 * 1024 * 1024   },
+	{ "xml.length",        "SIPE_LIMIT_XML_LENGTH",        16 * 1024 * 1024   },
+	{ "xml.depth",         "SIPE_LIMIT_XML_DEPTH",         256                },
+	{ "xml.nodes",         "SIPE_LIMIT_XML_NODES",         1000000            },
+	{ "mime.parts",        "SIPE_LIMIT_MIME_PARTS",        10000              },
+};
+
+/* updated from worker threads */
+static gint rejected[SIPE_LIMITS];
+
+void sipe_limits_init(void)
+{
+	guint i;
+
+	for (i = 0; i < SIPE_LIMITS; i++) {
+		const gchar *value = g_getenv(limits[i].environment);
+
+		if (value) {
+			limits[i].value = g_ascii_strtoull(value, NULL, 10);
+			SIPE_DEBUG_INFO("sipe_limits_init: %s = %" G_GSIZE_FORMAT,
+					limits[i].name, limits[i].value);
+		}
+	}
+}
+
+gsize sipe_limit_get(sipe_limit limit)
+{
+	return(limits[limit].value);
+}
+
+gboolean sipe_limit_exceeded(sipe_limit limit, gsize value)
+{
+	gsize maximum = limits[limit].value;
+
+	if (maximum && (value > maximum)) {
+		g_atomic_int_inc(&rejected[limit]);
+		return(TRUE);
+	}
+	return(FALSE);
+}
+
+guint sipe_limit_rejected(sipe_limit limit)
+{
+	return(g_atomic_int_get(&rejected[limit]));
+}
+
+const gchar *sipe_limit_name(sipe_limit limit)
+{
+	return(limits[limit].name);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
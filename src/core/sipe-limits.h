@@ -0,0 +1,106 @@
+/**
+ * @file sipe-limits.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Parser limits
+ *
+ * Bound the cost of parsing hostile or pathological input, e.g. from a
+ * misbehaving federated peer. Each limit is checked where the input is
+ * parsed, before the expensive work is done. Rejected input is counted
+ * per limit.
+ *
+ * The defaults can be changed with environment variables, e.g.
+ * SIPE_LIMIT_XML_DEPTH=64. A value of 0 disables the limit.
+ *
+ * Limits are process-wide and can be checked from worker threads.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+typedef enum {
+	SIPE_LIMIT_SIP_HEADER_LINES,  /* header lines incl. continuations */
+	SIPE_LIMIT_SIP_HEADER_LENGTH, /* bytes of one SIP header block */
+	SIPE_LIMIT_SIP_BODY,          /* bytes of one SIP body */
+	SIPE_LIMIT_HTTP_BODY,         /* bytes of one HTTP body, unless streamed */
+	SIPE_LIMIT_XML_LENGTH,        /* bytes of one XML document */
+	SIPE_LIMIT_XML_DEPTH,         /* element nesting */
+	SIPE_LIMIT_XML_NODES,         /* elements of one XML document */
+	SIPE_LIMIT_MIME_PARTS,        /* parts of one multipart body */
+	SIPE_LIMITS
+} sipe_limit;
+
+/**
+ * Read limits from the environment
+ *
+ * Called once by @c sipe_core_init(). Without it the defaults apply.
+ */
+void sipe_limits_init(void);
+
+/**
+ * Current value of a limit
+ *
+ * @param limit limit ID
+ *
+ * @return maximum allowed value, 0 if unlimited
+ */
+gsize sipe_limit_get(sipe_limit limit);
+
+/**
+ * Check a value against a limit
+ *
+ * Counts a rejection if the limit is exceeded.
+ *
+ * @param limit limit ID
+ * @param value value to check
+ *
+ * @return @c TRUE if the input must be rejected
+ */
+gboolean sipe_limit_exceeded(sipe_limit limit, gsize value);
+
+/**
+ * Number of rejections
+ *
+ * @param limit limit ID
+ *
+ * @return number of inputs rejected by this limit since process start
+ */
+guint sipe_limit_rejected(sipe_limit limit);
+
+/**
+ * Name of a limit
+ *
+ * @param limit limit ID
+ *
+ * @return name for debug output and metrics
+ */
+const gchar *sipe_limit_name(sipe_limit limit);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,294 @@
+/**
+ * @file sipe-media-rate.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-media-rate.h"
+#include "sipe-schedule.h"
+#include "sipe-utils.h"
+
+#define RATE_INTERVAL     5   /* seconds, about one RTCP report */
+#define RATE_LOSS_HIGH    10  /* percent */
+#define RATE_LOSS_LOW     2   /* percent */
+#define RATE_RTT_HIGH     400 /* milliseconds */
+#define RATE_CPU_HIGH     85  /* percent */
+#define RATE_CPU_LOW      60  /* percent */
+#define RATE_GOOD_SAMPLES 3   /* before stepping up again */
+
+/* 16:9 as used by Lync, highest quality first */
+static const struct sipe_media_video_params video_levels[] = {
+	{ 1280, 720, 30, 1500 },
+	{  960, 540, 30, 1000 },
+	{  640, 360, 30,  600 },
+	{  640, 360, 15,  400 },
+	{  424, 240, 15,  250 },
+	{  320, 180, 15,  150 },
+};
+#define RATE_LEVELS      G_N_ELEMENTS(video_levels)
+#define RATE_LEVEL_START 2 /* step up when the link allows */
+
+/* [MS-RTP] 2.2.12.2 Video Source Request */
+#define VSR_TYPE            0x0001
+#define VSR_HEADER_LENGTH   20
+#define VSR_ENTRY_LENGTH    68
+#define VSR_MSI_DOMINANT    0xFFFFFFFE /* active source */
+#define VSR_PT_H264UC       122
+#define VSR_FLAG_KEYFRAME   0x01
+#define VSR_ASPECT_16_9     0x02
+#define VSR_FPS_7_5         0x01
+#define VSR_FPS_15          0x04
+#define VSR_FPS_30          0x10
+
+struct rate_direction {
+	guint level;
+	guint good;              /* consecutive good samples */
+};
+
+struct sipe_media_rate {
+	struct sipe_core_private *sipe_private;
+	struct sipe_media_stream *stream;
+	gchar *timeout_key;
+
+	struct rate_direction send;
+	struct rate_direction receive;
+	guint16 vsr_id;
+
+	/* previous sample */
+	gboolean sampled;
+	guint64 packets_received;
+	guint64 packets_lost;
+	clock_t cpu;
+	gint64 wall;             /* sipe_utils_monotonic_msec() */
+};
+
+static guint8 *put16(guint8 *p, guint16 value)
+{
+	*p++ = value >> 8;
+	*p++ = value;
+	return(p);
+}
+
+static guint8 *put32(guint8 *p, guint32 value)
+{
+	p = put16(p, value >> 16);
+	return(put16(p, value));
+}
+
+static void send_video_source_request(struct sipe_media_rate *rate,
+				      gboolean keyframe)
+{
+	const struct sipe_media_video_params *params = video_levels + rate->receive.level;
+	guint8 fci[VSR_HEADER_LENGTH + VSR_ENTRY_LENGTH];
+	guint8 *p = fci;
+	guint8 fps = VSR_FPS_7_5 | VSR_FPS_15;
+
+	if (params->framerate >= 30)
+		fps |= VSR_FPS_30;
+
+	memset(fci, 0, sizeof(fci));
+
+	/* header */
+	p = put16(p, VSR_TYPE);
+	p = put16(p, sizeof(fci));
+	p = put32(p, VSR_MSI_DOMINANT);
+	p = put16(p, ++rate->vsr_id);
+	p += 2;                                /* reserved */
+	*p++ = 0;                              /* version */
+	*p++ = keyframe ? VSR_FLAG_KEYFRAME : 0;
+	*p++ = 1;                              /* number of entries */
+	*p++ = VSR_ENTRY_LENGTH;
+	p += 4;                                /* reserved */
+
+	/* entry */
+	*p++ = VSR_PT_H264UC;
+	*p++ = 0;                              /* UCConfig mode */
+	*p++ = 0;                              /* flags */
+	*p++ = VSR_ASPECT_16_9;
+	p = put16(p, params->width);
+	p = put16(p, params->height);
+	p = put32(p, video_levels[RATE_LEVELS - 1].bitrate * 1000);
+	p += 4;                                /* reserved */
+	p = put32(p, params->bitrate * 1000);  /* bitrate per level */
+	p = put16(p, 1);                       /* bitrate histogram */
+	p += 9 * 2;
+	p = put32(p, fps);
+	p = put16(p, 1);                       /* MUST instances */
+	p = put16(p, 0);                       /* MAY instances */
+	p = put16(p, 1);                       /* quality report histogram */
+	p += 7 * 2;
+	put32(p, params->width * params->height);
+
+	SIPE_DEBUG_INFO("send_video_source_request: stream '%s' request %u: %ux%u@%u %u kbit/s",
+			rate->stream->id, rate->vsr_id,
+			params->width, params->height,
+			params->framerate, params->bitrate);
+	sipe_backend_media_send_rtcp_feedback(rate->stream, fci, sizeof(fci));
+}
+
+static void set_video_params(struct sipe_media_rate *rate)
+{
+	const struct sipe_media_video_params *params = video_levels + rate->send.level;
+
+	SIPE_DEBUG_INFO("set_video_params: stream '%s': %ux%u@%u %u kbit/s",
+			rate->stream->id,
+			params->width, params->height,
+			params->framerate, params->bitrate);
+	sipe_backend_media_set_video_params(rate->stream, params);
+}
+
+/* returns TRUE if the level changed */
+static gboolean rate_adapt(struct rate_direction *direction,
+			   gboolean congested,
+			   gboolean idle)
+{
+	if (congested) {
+		direction->good = 0;
+		if (direction->level < RATE_LEVELS - 1) {
+			direction->level++;
+			return(TRUE);
+		}
+	} else if (idle) {
+		if (++direction->good >= RATE_GOOD_SAMPLES) {
+			direction->good = 0;
+			if (direction->level > 0) {
+				direction->level--;
+				return(TRUE);
+			}
+		}
+	} else {
+		direction->good = 0;
+	}
+	return(FALSE);
+}
+
+static void rate_schedule(struct sipe_media_rate *rate);
+
+static void rate_sample(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+			gpointer data)
+{
+	struct sipe_media_rate *rate = data;
+	struct sipe_media_stats stats;
+	clock_t cpu = clock();
+	gint64 wall = sipe_utils_monotonic_msec();
+
+	if (sipe_core_media_stream_get_stats(rate->stream, &stats) &&
+	    stats.have_rtp) {
+		if (rate->sampled && (wall > rate->wall) && (cpu != (clock_t) -1)) {
+			guint64 received = stats.packets_received - rate->packets_received;
+			guint64 lost     = stats.packets_lost - rate->packets_lost;
+			guint receive_loss = (received + lost) ?
+				(guint) (lost * 100 / (received + lost)) : 0;
+			guint load = (guint) (((gint64) (cpu - rate->cpu)) * 1000 * 100 /
+					      CLOCKS_PER_SEC / (wall - rate->wall));
+
+#if GLIB_CHECK_VERSION(2,36,0)
+			/* encoders use all cores */
+			load /= MAX(g_get_num_processors(), 1);
+#endif
+
+			SIPE_DEBUG_INFO("rate_sample: stream '%s': loss %u%%/%u%%, RTT %u ms, CPU %u%%",
+					rate->stream->id,
+					stats.remote_loss, receive_loss,
+					stats.rtt, load);
+
+			if (rate_adapt(&rate->send,
+				       (stats.remote_loss >= RATE_LOSS_HIGH) ||
+				       (stats.rtt >= RATE_RTT_HIGH) ||
+				       (load >= RATE_CPU_HIGH),
+				       (stats.remote_loss < RATE_LOSS_LOW) &&
+				       (stats.rtt < RATE_RTT_HIGH) &&
+				       (load < RATE_CPU_LOW)))
+				set_video_params(rate);
+
+			/* decoding high resolutions needs CPU too */
+			if (rate_adapt(&rate->receive,
+				       (receive_loss >= RATE_LOSS_HIGH) ||
+				       (load >= RATE_CPU_HIGH),
+				       (receive_loss < RATE_LOSS_LOW) &&
+				       (load < RATE_CPU_LOW)))
+				send_video_source_request(rate, FALSE);
+		}
+
+		rate->sampled          = TRUE;
+		rate->packets_received = stats.packets_received;
+		rate->packets_lost     = stats.packets_lost;
+	}
+
+	rate->cpu  = cpu;
+	rate->wall = wall;
+
+	rate_schedule(rate);
+}
+
+static void rate_schedule(struct sipe_media_rate *rate)
+{
+	sipe_schedule_seconds(rate->sipe_private,
+			      rate->timeout_key,
+			      rate,
+			      RATE_INTERVAL,
+			      rate_sample,
+			      NULL);
+}
+
+struct sipe_media_rate *sipe_media_rate_new(struct sipe_core_private *sipe_private,
+					    struct sipe_media_stream *stream)
+{
+	struct sipe_media_rate *rate = g_new0(struct sipe_media_rate, 1);
+
+	rate->sipe_private  = sipe_private;
+	rate->stream        = stream;
+	rate->timeout_key   = g_strdup_printf("<+video-rate-%p>", rate);
+	rate->send.level    = RATE_LEVEL_START;
+	rate->receive.level = RATE_LEVEL_START;
+	rate->cpu           = clock();
+	rate->wall          = sipe_utils_monotonic_msec();
+
+	set_video_params(rate);
+	send_video_source_request(rate, TRUE);
+	rate_schedule(rate);
+
+	return(rate);
+}
+
+void sipe_media_rate_free(struct sipe_media_rate *rate)
+{
+	if (rate) {
+		sipe_schedule_cancel(rate->sipe_private, rate->timeout_key);
+		g_free(rate->timeout_key);
+		g_free(rate);
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,73 @@
+/**
+ * @file sipe-media-rate.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Video rate control
+ *
+ * Samples the RTCP statistics of a video stream and the CPU load of the
+ * process at a fixed interval. Both directions step through the same
+ * ladder of resolution, frame rate and bitrate:
+ *
+ *  - sending: loss reported by the peer, round trip time and CPU load
+ *    select the encoder parameters, see sipe_backend_media_set_video_params()
+ *
+ *  - receiving: loss of the received stream and CPU load select the
+ *    parameters requested from the sender with a Video Source Request
+ *    [MS-RTP] 2.2.12.2
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_media_stream;
+struct sipe_media_rate;
+
+/**
+ * Start rate control for a video stream
+ *
+ * @param sipe_private SIPE core private data
+ * @param stream       initialized video stream
+ *
+ * @return rate controller. Must be freed with @c sipe_media_rate_free()
+ *         before the stream
+ */
+struct sipe_media_rate *sipe_media_rate_new(struct sipe_core_private *sipe_private,
+					    struct sipe_media_stream *stream);
+
+/**
+ * Stop rate control
+ *
+ * @param rate rate controller (may be @c NULL)
+ */
+void sipe_media_rate_free(struct sipe_media_rate *rate);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -42,7 +43,10 @@
 #include "sipe-core-private.h"
 #include "sipe-dialog.h"
 #include "sipe-media.h"
+#include "sipe-media-rate.h"
+#include "sipe-metrics.h"
 #include "sipe-ocs2007.h"
+#include "sipe-peer-caps.h"
 #include "sipe-session.h"
 #include "sipe-utils.h"
 #include "sipe-nls.h"
@@ -67,6 +71,9 @@ struct sipe_media_call_private {
 
 	struct sdpmsg			*smsg;
 	GSList				*failed_media;
+
+	gint64				 created; /* sipe_utils_monotonic_msec() */
+	gboolean			 media_flowing;
 };
 #define SIPE_MEDIA_CALL         ((struct sipe_media_call *) call_private)
 #define SIPE_MEDIA_CALL_PRIVATE ((struct sipe_media_call_private *) call)
@@ -74,19 +81,190 @@ struct sipe_media_call_private {
 struct sipe_media_stream_private {
 	struct sipe_media_stream public;
 
-	guchar *encryption_key;
+	guchar *encryption_key;      /* AES_CM_128_HMAC_SHA1_80 */
+	guchar *encryption_key_gcm;  /* AEAD_AES_128_GCM, NULL if unsupported */
 	int encryption_key_id;
+	SipeSrtpSuite encryption_suite;
 	gboolean remote_candidates_and_codecs_set;
 
 	GSList *extra_sdp;
 
+	/* video streams only */
+	struct sipe_media_rate *video_rate;
+
 	/* Arbitrary data associated with the stream. */
 	gpointer data;
 	GDestroyNotify data_free_func;
+
+	/* Port window taken from the account port pool, see below */
+	struct media_port_pool *port_pool;
+	guint port_window;
+	guint port_generation;
 };
 #define SIPE_MEDIA_STREAM         ((struct sipe_media_stream *) stream_private)
 #define SIPE_MEDIA_STREAM_PRIVATE ((struct sipe_media_stream_private *) stream)
 
+/*
+ * Setting SIPE_ICE_PACING to the connectivity check interval Ta in
+ * milliseconds requests aggressive nomination with that pacing for
+ * RFC 5245 streams. Default: backend settings.
+ */
+#define MEDIA_ENVIRONMENT_ICE_PACING "SIPE_ICE_PACING"
+
+/*
+ * Media port pool
+ *
+ * Without a pool every stream hands the complete configured port range
+ * to the backend, which then probes it from the start for free ports.
+ * With narrow firewall-approved ranges in conference-heavy deployments
+ * the probing gets slow and collides with the ports of the other streams.
+ *
+ * Instead the range of each media type is split into windows. A stream
+ * takes a free window and the backend only has to bind inside it. The
+ * windows are handed out round-robin, so ports just closed by the
+ * previous call aren't reused immediately. When all windows are taken
+ * the stream falls back to the complete range.
+ */
+#define MEDIA_PORT_WINDOW 8 /* RTP and RTCP for UDP and TCP candidates, with room for retries */
+
+typedef enum {
+	MEDIA_PORTS_DEFAULT,
+	MEDIA_PORTS_AUDIO,
+	MEDIA_PORTS_VIDEO,
+	MEDIA_PORTS_APPSHARING,
+	MEDIA_PORTS_FILETRANSFER,
+	MEDIA_PORTS_CLASSES
+} media_port_class;
+
+struct media_port_pool {
+	guint min_port;
+	guint max_port;
+	gboolean *in_use;   /* per window */
+	guint windows;
+	guint used;
+	guint cursor;       /* next window to try */
+	guint generation;   /* incremented when the range changes */
+};
+
+struct sipe_media_ports {
+	struct media_port_pool pools[MEDIA_PORTS_CLASSES];
+};
+
+static void media_port_pool_reset(struct media_port_pool *pool,
+				  guint min_port,
+				  guint max_port)
+{
+	g_free(pool->in_use);
+	pool->min_port = min_port;
+	pool->max_port = max_port;
+	pool->windows  = (max_port - min_port + 1) / MEDIA_PORT_WINDOW;
+	pool->in_use   = pool->windows ? g_new0(gboolean, pool->windows) : NULL;
+	pool->used     = 0;
+	pool->cursor   = 0;
+	pool->generation++;
+}
+
+static void media_ports_acquire(struct sipe_core_private *sipe_private,
+				struct sipe_media_stream_private *stream_private,
+				media_port_class class,
+				guint *min_port,
+				guint *max_port)
+{
+	struct media_port_pool *pool;
+	guint i;
+
+	/* any port or invalid range: nothing to split */
+	if (!*min_port || (*max_port < *min_port))
+		return;
+
+	if (!sipe_private->media_ports)
+		sipe_private->media_ports = g_new0(struct sipe_media_ports, 1);
+	pool = sipe_private->media_ports->pools + class;
+
+	/* range changed by in-band provisioning */
+	if ((pool->min_port != *min_port) || (pool->max_port != *max_port))
+		media_port_pool_reset(pool, *min_port, *max_port);
+
+	/* too narrow to be shared between streams */
+	if (pool->windows < 2)
+		return;
+
+	for (i = 0; i < pool->windows; i++) {
+		guint window = (pool->cursor + i) % pool->windows;
+
+		if (!pool->in_use[window]) {
+			pool->in_use[window] = TRUE;
+			pool->used++;
+			pool->cursor = (window + 1) % pool->windows;
+
+			stream_private->port_pool       = pool;
+			stream_private->port_window     = window;
+			stream_private->port_generation = pool->generation;
+
+			*min_port = pool->min_port + window * MEDIA_PORT_WINDOW;
+			/* last window gets the remainder of the range */
+			if (window < pool->windows - 1)
+				*max_port = *min_port + MEDIA_PORT_WINDOW - 1;
+
+			SIPE_DEBUG_INFO("media_ports_acquire: ports %u-%u (%u/%u windows in use)",
+					*min_port, *max_port,
+					pool->used, pool->windows);
+			return;
+		}
+	}
+
+	SIPE_DEBUG_INFO("media_ports_acquire: all %u windows of %u-%u in use, using complete range",
+			pool->windows, pool->min_port, pool->max_port);
+	sipe_metrics_count(sipe_private, SIPE_METRIC_MEDIA_PORTS_EXHAUSTED);
+}
+
+static void media_ports_release(struct sipe_media_stream_private *stream_private)
+{
+	struct media_port_pool *pool = stream_private->port_pool;
+
+	/* windows of a replaced range are simply forgotten */
+	if (pool &&
+	    (stream_private->port_generation == pool->generation) &&
+	    pool->in_use[stream_private->port_window]) {
+		pool->in_use[stream_private->port_window] = FALSE;
+		pool->used--;
+	}
+	stream_private->port_pool = NULL;
+}
+
+void sipe_media_ports_usage(struct sipe_core_private *sipe_private,
+			    guint *used,
+			    guint *windows)
+{
+	*used    = 0;
+	*windows = 0;
+
+	if (sipe_private->media_ports) {
+		guint i;
+
+		for (i = 0; i < MEDIA_PORTS_CLASSES; i++) {
+			const struct media_port_pool *pool =
+				sipe_private->media_ports->pools + i;
+
+			*used += pool->used;
+			if (pool->windows >= 2)
+				*windows += pool->windows;
+		}
+	}
+}
+
+void sipe_media_ports_free(struct sipe_core_private *sipe_private)
+{
+	if (sipe_private->media_ports) {
+		guint i;
+
+		for (i = 0; i < MEDIA_PORTS_CLASSES; i++)
+			g_free(sipe_private->media_ports->pools[i].in_use);
+		g_free(sipe_private->media_ports);
+		sipe_private->media_ports = NULL;
+	}
+}
+
 static void sipe_media_codec_list_free(GList *codecs)
 {
 	for (; codecs; codecs = g_list_delete_link(codecs, codecs))
@@ -99,23 +277,177 @@ static void sipe_media_candidate_list_free(GList *candidates)
 		sipe_backend_candidate_free(candidates->data);
 }
 
+static const gchar *
+candidate_type_to_string(SipeCandidateType type)
+{
+	switch (type) {
+		case SIPE_CANDIDATE_TYPE_HOST:
+			return("host");
+		case SIPE_CANDIDATE_TYPE_RELAY:
+			return("relay");
+		case SIPE_CANDIDATE_TYPE_SRFLX:
+			return("srflx");
+		case SIPE_CANDIDATE_TYPE_PRFLX:
+			return("prflx");
+		default:
+			return("unknown");
+	}
+}
+
+static void
+log_stream_stats(struct sipe_media_stream *stream)
+{
+	struct sipe_media_stats stats;
+
+	if (!sipe_core_media_stream_get_stats(stream, &stats))
+		return;
+
+	if (stats.have_candidates)
+		SIPE_DEBUG_INFO("stream '%s': candidate pair %s/%s over %s",
+				stream->id,
+				candidate_type_to_string(stats.local_candidate_type),
+				candidate_type_to_string(stats.remote_candidate_type),
+				stats.protocol == SIPE_NETWORK_PROTOCOL_UDP ?
+				"UDP" : "TCP");
+	if (stats.have_rtp)
+		SIPE_DEBUG_INFO("stream '%s': sent %" G_GUINT64_FORMAT
+				" received %" G_GUINT64_FORMAT
+				" lost %" G_GUINT64_FORMAT
+				" packets, jitter %u ms, RTT %u ms",
+				stream->id,
+				stats.packets_sent, stats.packets_received,
+				stats.packets_lost, stats.jitter, stats.rtt);
+	if (stats.have_frames)
+		SIPE_DEBUG_INFO("stream '%s': %" G_GUINT64_FORMAT
+				" frames at %u fps, %u bytes per frame",
+				stream->id,
+				stats.frames, stats.frame_rate,
+				stats.bytes_per_frame);
+}
+
 static void
 remove_stream(struct sipe_media_call* call,
 	      struct sipe_media_stream_private *stream_private)
 {
 	struct sipe_media_call_private *call_private = SIPE_MEDIA_CALL_PRIVATE;
 
+	if (SIPE_MEDIA_STREAM->backend_private)
+		log_stream_stats(SIPE_MEDIA_STREAM);
+
 	sipe_media_stream_set_data(SIPE_MEDIA_STREAM, NULL, NULL);
+	sipe_media_rate_free(stream_private->video_rate);
 
 	call_private->streams =
 			g_slist_remove(call_private->streams, stream_private);
 	sipe_backend_media_stream_free(SIPE_MEDIA_STREAM->backend_private);
+	media_ports_release(stream_private);
 	g_free(SIPE_MEDIA_STREAM->id);
 	g_free(stream_private->encryption_key);
+	g_free(stream_private->encryption_key_gcm);
 	sipe_utils_nameval_free(stream_private->extra_sdp);
 	g_free(stream_private);
 }
 
+/*
+ * Media relay allocation
+ *
+ * The relay list handed to the backend is kept across calls instead of
+ * being converted for every stream. Backends can therefore keep their
+ * TURN allocations for the same object alive between calls. The key
+ * covers credentials, relay addresses and ports, i.e. any rotation by a
+ * refresh or DNS update replaces the allocation. After the last call has
+ * ended the allocation is released after SIPE_MEDIA_RELAY_KEEP seconds.
+ */
+#define MEDIA_RELAY_KEEP              300 /* seconds */
+#define MEDIA_ENVIRONMENT_RELAY_KEEP  "SIPE_MEDIA_RELAY_KEEP"
+#define MEDIA_RELAY_RELEASE_ACTION    "<+media-relay-release>"
+
+static gchar *
+media_relay_allocation_key(struct sipe_core_private *sipe_private)
+{
+	GString *key = g_string_new(NULL);
+	GSList *entry;
+
+	g_string_append_printf(key, "%s:%s",
+			       sipe_private->media_relay_username ?
+			       sipe_private->media_relay_username : "",
+			       sipe_private->media_relay_password ?
+			       sipe_private->media_relay_password : "");
+	for (entry = sipe_private->media_relays; entry; entry = entry->next) {
+		struct sipe_media_relay *relay = entry->data;
+		g_string_append_printf(key, ";%s:%u:%u",
+				       relay->hostname ? relay->hostname : "",
+				       relay->udp_port,
+				       relay->tcp_port);
+	}
+
+	return(g_string_free(key, FALSE));
+}
+
+void
+sipe_media_relay_allocation_free(struct sipe_core_private *sipe_private)
+{
+	if (sipe_private->media_relay_allocation)
+		sipe_backend_media_relays_free(sipe_private->media_relay_allocation);
+	g_free(sipe_private->media_relay_allocation_key);
+	sipe_private->media_relay_allocation     = NULL;
+	sipe_private->media_relay_allocation_key = NULL;
+}
+
+static void
+media_relay_release_cb(struct sipe_core_private *sipe_private,
+		       SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	SIPE_DEBUG_INFO_NOFORMAT("media_relay_release_cb: no calls, releasing relay allocation");
+	sipe_media_relay_allocation_free(sipe_private);
+}
+
+static struct sipe_backend_media_relays *
+media_relay_allocation(struct sipe_core_private *sipe_private)
+{
+	gchar *key = media_relay_allocation_key(sipe_private);
+
+	sipe_schedule_cancel(sipe_private, MEDIA_RELAY_RELEASE_ACTION);
+
+	if (sipe_private->media_relay_allocation &&
+	    sipe_strequal(key, sipe_private->media_relay_allocation_key)) {
+		g_free(key);
+		return(sipe_private->media_relay_allocation);
+	}
+
+	/* first call or credentials have rotated */
+	if (sipe_private->media_relay_allocation)
+		SIPE_DEBUG_INFO_NOFORMAT("media_relay_allocation: relays or credentials changed, replacing allocation");
+	sipe_media_relay_allocation_free(sipe_private);
+	sipe_private->media_relay_allocation = sipe_backend_media_relays_convert(
+						sipe_private->media_relays,
+						sipe_private->media_relay_username,
+						sipe_private->media_relay_password);
+	sipe_private->media_relay_allocation_key = key;
+
+	return(sipe_private->media_relay_allocation);
+}
+
+static void
+media_relay_schedule_release(struct sipe_core_private *sipe_private)
+{
+	const gchar *value = g_getenv(MEDIA_ENVIRONMENT_RELAY_KEEP);
+	guint keep = value ? g_ascii_strtoull(value, NULL, 10) : MEDIA_RELAY_KEEP;
+
+	if (!sipe_private->media_relay_allocation)
+		return;
+
+	if (keep)
+		sipe_schedule_seconds(sipe_private,
+				      MEDIA_RELAY_RELEASE_ACTION,
+				      NULL,
+				      keep,
+				      media_relay_release_cb,
+				      NULL);
+	else
+		sipe_media_relay_allocation_free(sipe_private);
+}
+
 static gboolean
 call_private_equals(SIPE_UNUSED_PARAMETER const gchar *callid,
 		    struct sipe_media_call_private *call_private1,
@@ -136,6 +468,10 @@ sipe_media_call_free(struct sipe_media_call_private *call_private)
 				      call_private->streams->data);
 		}
 
+		/* keep relay allocation for back-to-back calls */
+		if (g_hash_table_size(call_private->sipe_private->media_calls) == 0)
+			media_relay_schedule_release(call_private->sipe_private);
+
 		sipe_backend_media_free(call_private->public.backend_private);
 
 		if (call_private->session) {
@@ -189,7 +525,7 @@ backend_candidates_to_sdpcandidate(GList *candidates)
 			continue;
 		}
 
-		c = g_new(struct sdpcandidate, 1);
+		c = sdpcandidate_new();
 		c->foundation = sipe_backend_candidate_get_foundation(candidate);
 		c->component = sipe_backend_candidate_get_component_type(candidate);
 		c->type = sipe_backend_candidate_get_type(candidate);
@@ -246,6 +582,84 @@ sdpcodec_compare(gconstpointer a, gconstpointer b)
 	       ((const struct sdpcodec *)b)->id;
 }
 
+static gchar *
+codec_preference_key(struct sipe_media_call_private *call_private,
+		     const gchar *media)
+{
+	return(g_strdup_printf("%s %s", SIPE_MEDIA_CALL->with, media));
+}
+
+static gchar *
+codec_preference_value(const struct sdpcodec *codec)
+{
+	return(g_strdup_printf("%s/%d", codec->name, codec->clock_rate));
+}
+
+/* Remember the codec the peer preferred in its session description */
+static void
+codec_preference_store(struct sipe_media_call_private *call_private,
+		       const struct sdpmedia *media)
+{
+	struct sipe_core_private *sipe_private = call_private->sipe_private;
+	GSList *i;
+
+	for (i = media->codecs; i; i = i->next) {
+		const struct sdpcodec *codec = i->data;
+
+		/* DTMF and comfort noise are never the negotiated codec */
+		if (sipe_strcase_equal(codec->name, "telephone-event") ||
+		    sipe_strcase_equal(codec->name, "CN"))
+			continue;
+
+		if (!sipe_private->media_codec_preferences)
+			sipe_private->media_codec_preferences =
+				g_hash_table_new_full(g_str_hash, g_str_equal,
+						      g_free, g_free);
+
+		g_hash_table_replace(sipe_private->media_codec_preferences,
+				     codec_preference_key(call_private,
+							  media->name),
+				     codec_preference_value(codec));
+		break;
+	}
+}
+
+/* Offer the codec the peer preferred last time first */
+static GSList *
+codec_preference_apply(struct sipe_media_call_private *call_private,
+		       const gchar *media, GSList *codecs)
+{
+	GHashTable *preferences = call_private->sipe_private->media_codec_preferences;
+	const gchar *preferred;
+	gchar *key;
+	GSList *i;
+
+	if (!preferences)
+		return(codecs);
+
+	key = codec_preference_key(call_private, media);
+	preferred = g_hash_table_lookup(preferences, key);
+	g_free(key);
+	if (!preferred)
+		return(codecs);
+
+	for (i = codecs; i; i = i->next) {
+		gchar *value = codec_preference_value(i->data);
+		gboolean match = sipe_strcase_equal(value, preferred);
+
+		g_free(value);
+		if (match) {
+			if (i != codecs) {
+				codecs = g_slist_remove_link(codecs, i);
+				codecs = g_slist_concat(i, codecs);
+			}
+			break;
+		}
+	}
+
+	return(codecs);
+}
+
 static GList *
 remove_wrong_farstream_0_1_tcp_candidates(GList *candidates)
 {
@@ -404,7 +818,7 @@ media_stream_to_sdpmedia(struct sipe_media_call_private *call_private,
 	// Process codecs
 	for (i = codecs; i; i = i->next) {
 		struct sipe_backend_codec *codec = i->data;
-		struct sdpcodec *c = g_new0(struct sdpcodec, 1);
+		struct sdpcodec *c = sdpcodec_new();
 		GList *params;
 
 		c->id = sipe_backend_codec_get_id(codec);
@@ -415,12 +829,10 @@ media_stream_to_sdpmedia(struct sipe_media_call_private *call_private,
 		params = sipe_backend_codec_get_optional_parameters(codec);
 		for (; params; params = params->next) {
 			struct sipnameval *param = params->data;
-			struct sipnameval *copy = g_new0(struct sipnameval, 1);
-
-			copy->name = g_strdup(param->name);
-			copy->value = g_strdup(param->value);
 
-			c->parameters = g_slist_append(c->parameters, copy);
+			c->parameters = sipe_utils_nameval_add(c->parameters,
+							       param->name,
+							       param->value);
 		}
 
 		/* Buggy(?) codecs may report non-unique id (a.k.a. payload
@@ -434,6 +846,10 @@ media_stream_to_sdpmedia(struct sipe_media_call_private *call_private,
 
 	sipe_media_codec_list_free(codecs);
 
+	sdpmedia->codecs = codec_preference_apply(call_private,
+						  sdpmedia->name,
+						  sdpmedia->codecs);
+
 	// Process local candidates
 	// If we have established candidate pairs, send them in SDP response.
 	// Otherwise send all available local candidates.
@@ -499,9 +915,26 @@ media_stream_to_sdpmedia(struct sipe_media_call_private *call_private,
 	// Set our key if encryption is enabled.
 	if (stream_private->encryption_key &&
 	    encryption_policy != SIPE_ENCRYPTION_POLICY_REJECTED) {
-		sdpmedia->encryption_key = g_memdup(stream_private->encryption_key,
-						    SIPE_SRTP_KEY_LEN);
-		sdpmedia->encryption_key_id = stream_private->encryption_key_id;
+		if (stream_private->encryption_key_gcm &&
+		    !stream_private->remote_candidates_and_codecs_set) {
+			/* offer GCM, the peer may still pick AES_CM */
+			sdpmedia->encryption_suite = SIPE_SRTP_AEAD_AES_128_GCM;
+			sdpmedia->encryption_key = g_memdup(stream_private->encryption_key_gcm,
+							    SIPE_SRTP_GCM_KEY_LEN);
+			sdpmedia->encryption_key_id = stream_private->encryption_key_id + 1;
+			sdpmedia->fallback_key = g_memdup(stream_private->encryption_key,
+							  SIPE_SRTP_KEY_LEN);
+			sdpmedia->fallback_key_id = stream_private->encryption_key_id;
+		} else {
+			SipeSrtpSuite suite = stream_private->encryption_suite;
+
+			sdpmedia->encryption_suite = suite;
+			sdpmedia->encryption_key = g_memdup((suite == SIPE_SRTP_AEAD_AES_128_GCM) ?
+							    stream_private->encryption_key_gcm :
+							    stream_private->encryption_key,
+							    SIPE_SRTP_SUITE_KEY_LEN(suite));
+			sdpmedia->encryption_key_id = stream_private->encryption_key_id;
+		}
 	}
 
 	// Append extra attributes assigned to the stream.
@@ -546,7 +979,7 @@ sipe_invite_call(struct sipe_media_call_private *call_private, TransCallback tc)
 {
 	struct sipe_core_private *sipe_private = call_private->sipe_private;
 	gchar *hdr;
-	gchar *contact;
+	const gchar *contact;
 	gchar *p_preferred_identity = NULL;
 	gchar *body;
 	struct sip_dialog *dialog = sipe_media_get_sip_dialog(SIPE_MEDIA_CALL);
@@ -574,7 +1007,6 @@ sipe_invite_call(struct sipe_media_call_private *call_private, TransCallback tc)
 		call_private->invite_content_type ?
 			";boundary=\"----=_NextPart_000_001E_01CB4397.0B5EB570\"" : "");
 
-	g_free(contact);
 	g_free(p_preferred_identity);
 
 	msg = sipe_media_to_sdpmsg(call_private);
@@ -715,10 +1147,32 @@ update_call_from_remote_sdp(struct sipe_media_call_private* call_private,
 	}
 
 	if (media->encryption_key && SIPE_MEDIA_STREAM_PRIVATE->encryption_key) {
-		sipe_backend_media_set_encryption_keys(SIPE_MEDIA_CALL, stream,
-				SIPE_MEDIA_STREAM_PRIVATE->encryption_key,
-				media->encryption_key);
-		SIPE_MEDIA_STREAM_PRIVATE->encryption_key_id = media->encryption_key_id;
+		const guchar *remote_key = media->encryption_key;
+		int remote_key_id = media->encryption_key_id;
+		SipeSrtpSuite suite = media->encryption_suite;
+
+		/* peer prefers GCM but we can't do it */
+		if ((suite == SIPE_SRTP_AEAD_AES_128_GCM) &&
+		    !SIPE_MEDIA_STREAM_PRIVATE->encryption_key_gcm) {
+			remote_key = media->fallback_key;
+			remote_key_id = media->fallback_key_id;
+			suite = SIPE_SRTP_AES_CM_128_HMAC_SHA1_80;
+		}
+
+		if (remote_key) {
+			SIPE_DEBUG_INFO("stream '%s': encryption %s",
+					stream->id,
+					(suite == SIPE_SRTP_AEAD_AES_128_GCM) ?
+					"AEAD_AES_128_GCM" : "AES_CM_128_HMAC_SHA1_80");
+			sipe_backend_media_set_encryption_keys(SIPE_MEDIA_CALL, stream,
+					suite,
+					(suite == SIPE_SRTP_AEAD_AES_128_GCM) ?
+					SIPE_MEDIA_STREAM_PRIVATE->encryption_key_gcm :
+					SIPE_MEDIA_STREAM_PRIVATE->encryption_key,
+					remote_key);
+			SIPE_MEDIA_STREAM_PRIVATE->encryption_suite = suite;
+			SIPE_MEDIA_STREAM_PRIVATE->encryption_key_id = remote_key_id;
+		}
 	}
 
 	result = sipe_backend_set_remote_codecs(SIPE_MEDIA_CALL, stream,
@@ -730,6 +1184,8 @@ update_call_from_remote_sdp(struct sipe_media_call_private* call_private,
 		return FALSE;
 	}
 
+	codec_preference_store(call_private, media);
+
 	for (i = media->candidates; i; i = i->next) {
 		struct sdpcandidate *c = i->data;
 		struct sipe_backend_candidate *candidate;
@@ -842,6 +1298,13 @@ static void
 stream_initialized_cb(struct sipe_media_call *call,
 		      struct sipe_media_stream *stream)
 {
+	if (sipe_strequal(stream->id, "video") &&
+	    !SIPE_MEDIA_STREAM_PRIVATE->video_rate) {
+		struct sipe_media_call_private *call_private = SIPE_MEDIA_CALL_PRIVATE;
+		SIPE_MEDIA_STREAM_PRIVATE->video_rate =
+			sipe_media_rate_new(call_private->sipe_private, stream);
+	}
+
 	if (call_initialized(call)) {
 		struct sipe_media_call_private *call_private = SIPE_MEDIA_CALL_PRIVATE;
 
@@ -986,6 +1449,7 @@ create_media(struct sipe_core_private *sipe_private, const gchar *callid,
 
 	call_private->ice_version = ice_version;
 	call_private->encryption_compatible = TRUE;
+	call_private->created = sipe_utils_monotonic_msec();
 
 	call_private->public.stream_initialized_cb  = stream_initialized_cb;
 	call_private->public.stream_end_cb          = stream_end_cb;
@@ -1071,46 +1535,77 @@ sipe_media_stream_add(struct sipe_media_call *call, const gchar *id,
 	struct sipe_backend_media_relays *backend_media_relays;
 	guint min_port = sipe_private->min_media_port;
 	guint max_port = sipe_private->max_media_port;
+	media_port_class port_class = MEDIA_PORTS_DEFAULT;
+	struct sipe_media_ice_params ice_params = { FALSE, 0 };
 
-	backend_media_relays = sipe_backend_media_relays_convert(
-						sipe_private->media_relays,
-						sipe_private->media_relay_username,
-						sipe_private->media_relay_password);
+	/*
+	 * The background refresh normally prevents this. Use what we have
+	 * for this stream; the next one will get the new credentials.
+	 */
+	if (sipe_private->media_relay_expires &&
+	    (sipe_private->media_relay_expires <= sipe_utils_monotonic_sec())) {
+		sipe_private->media_relay_expires = 0;
+		sipe_media_get_av_edge_credentials(sipe_private);
+	}
+
+	backend_media_relays = media_relay_allocation(sipe_private);
 
 	switch (type) {
 		case SIPE_MEDIA_AUDIO:
 			min_port = sipe_private->min_audio_port;
 			max_port = sipe_private->max_audio_port;
+			port_class = MEDIA_PORTS_AUDIO;
 			break;
 		case SIPE_MEDIA_VIDEO:
 			min_port = sipe_private->min_video_port;
-			max_port = sipe_private->max_audio_port;
+			max_port = sipe_private->max_video_port;
+			port_class = MEDIA_PORTS_VIDEO;
 			break;
 		case SIPE_MEDIA_APPLICATION:
 			if (sipe_strequal(id, "data")) {
 				min_port = sipe_private->min_filetransfer_port;
 				max_port = sipe_private->max_filetransfer_port;
+				port_class = MEDIA_PORTS_FILETRANSFER;
 			} else if (sipe_strequal(id, "applicationsharing")) {
 				min_port = sipe_private->min_appsharing_port;
 				max_port = sipe_private->max_appsharing_port;
+				port_class = MEDIA_PORTS_APPSHARING;
 			}
 			break;
 	}
 
-	backend_stream = sipe_backend_media_add_stream(SIPE_MEDIA_CALL,
-						       id, call->with, type,
+	/* backend needs the stream as handle for its callbacks */
+	stream_private = g_new0(struct sipe_media_stream_private, 1);
+	SIPE_MEDIA_STREAM->call = call;
+	SIPE_MEDIA_STREAM->id = g_strdup(id);
+
+	media_ports_acquire(sipe_private, stream_private, port_class,
+			    &min_port, &max_port);
+
+	/* Lync edges return many candidates: nominate the first working pair */
+	if (ice_version == SIPE_ICE_RFC_5245) {
+		const gchar *pacing = g_getenv(MEDIA_ENVIRONMENT_ICE_PACING);
+
+		if (pacing) {
+			ice_params.check_interval = g_ascii_strtoull(pacing, NULL, 10);
+			ice_params.aggressive_nomination = ice_params.check_interval != 0;
+		}
+	}
+
+	backend_stream = sipe_backend_media_add_stream(SIPE_MEDIA_STREAM,
+						       type,
 						       ice_version, initiator,
 						       backend_media_relays,
-						       min_port, max_port);
-
-	sipe_backend_media_relays_free(backend_media_relays);
+						       min_port, max_port,
+						       &ice_params);
 
 	if (!backend_stream) {
+		media_ports_release(stream_private);
+		g_free(SIPE_MEDIA_STREAM->id);
+		g_free(stream_private);
 		return NULL;
 	}
 
-	stream_private = g_new0(struct sipe_media_stream_private, 1);
-	SIPE_MEDIA_STREAM->id = g_strdup(id);
 	SIPE_MEDIA_STREAM->backend_private = backend_stream;
 
 #ifdef HAVE_SRTP
@@ -1121,6 +1616,13 @@ sipe_media_stream_add(struct sipe_media_call *call, const gchar *id,
 			stream_private->encryption_key[i] = rand() & 0xff;
 		}
 		stream_private->encryption_key_id = 1;
+
+		if (sipe_backend_media_srtp_suite_supported(SIPE_SRTP_AEAD_AES_128_GCM)) {
+			stream_private->encryption_key_gcm = g_new0(guchar, SIPE_SRTP_GCM_KEY_LEN);
+			for (i = 0; i != SIPE_SRTP_GCM_KEY_LEN; ++i) {
+				stream_private->encryption_key_gcm[i] = rand() & 0xff;
+			}
+		}
 	}
 #endif
 
@@ -1204,8 +1706,12 @@ sipe_core_media_initiate_call(struct sipe_core_public *sipe_public,
 			      const char *with,
 			      gboolean with_video)
 {
+	SipeIceVersion ice_version = SIPE_ICE_RFC_5245;
+
+	/* avoid the failed attempt of an earlier call */
+	sipe_peer_caps_get_ice_version(SIPE_CORE_PRIVATE, with, &ice_version);
 	sipe_media_initiate_call(SIPE_CORE_PRIVATE, with,
-				 SIPE_ICE_RFC_5245, with_video);
+				 ice_version, with_video);
 }
 
 void sipe_core_media_connect_conference(struct sipe_core_public *sipe_public,
@@ -1236,8 +1742,11 @@ void sipe_core_media_connect_conference(struct sipe_core_public *sipe_public,
 	av_uri = g_strjoinv("app:conf:audio-video:", parts);
 	g_strfreev(parts);
 
-	ice_version = SIPE_CORE_PRIVATE_FLAG_IS(LYNC2013) ? SIPE_ICE_RFC_5245 :
-							    SIPE_ICE_DRAFT_6;
+	if (!sipe_peer_caps_get_ice_version(sipe_private,
+					    sipe_private->focus_factory_uri,
+					    &ice_version))
+		ice_version = SIPE_CORE_PRIVATE_FLAG_IS(LYNC2013) ? SIPE_ICE_RFC_5245 :
+								    SIPE_ICE_DRAFT_6;
 
 	call_private = sipe_media_call_new_outgoing(sipe_private, av_uri, TRUE,
 						    ice_version);
@@ -1522,8 +2031,19 @@ void
 sipe_core_media_candidate_pair_established(struct sipe_media_call *call,
 					   struct sipe_media_stream *stream)
 {
+	struct sipe_media_call_private *call_private = SIPE_MEDIA_CALL_PRIVATE;
+
+	if (!call_private->media_flowing) {
+		call_private->media_flowing = TRUE;
+		SIPE_DEBUG_INFO("sipe_core_media_candidate_pair_established: first media after %" G_GINT64_FORMAT " ms",
+				sipe_utils_monotonic_msec() - call_private->created);
+		sipe_metrics_latency(call_private->sipe_private,
+				     SIPE_METRIC_MEDIA_SETUP,
+				     call_private->created);
+	}
+
 	if (sipe_backend_media_is_initiator(call, stream)) {
-		sipe_invite_call(SIPE_MEDIA_CALL_PRIVATE, sipe_media_send_final_ack);
+		sipe_invite_call(call_private, sipe_media_send_final_ack);
 	}
 
 	if (call->candidate_pair_established_cb) {
@@ -1531,6 +2051,42 @@ sipe_core_media_candidate_pair_established(struct sipe_media_call *call,
 	}
 }
 
+gboolean
+sipe_core_media_stream_get_stats(struct sipe_media_stream *stream,
+				 struct sipe_media_stats *stats)
+{
+	GList *candidates;
+
+	g_return_val_if_fail(stream && stats, FALSE);
+
+	memset(stats, 0, sizeof(struct sipe_media_stats));
+
+	/* selected pair tells whether relay or TCP fallback is in use */
+	candidates = sipe_backend_media_get_active_local_candidates(stream->call,
+								    stream);
+	if (candidates) {
+		stats->have_candidates      = TRUE;
+		stats->local_candidate_type = sipe_backend_candidate_get_type(candidates->data);
+		stats->protocol             = sipe_backend_candidate_get_protocol(candidates->data);
+		sipe_media_candidate_list_free(candidates);
+	}
+
+	candidates = sipe_backend_media_get_active_remote_candidates(stream->call,
+								     stream);
+	if (candidates) {
+		stats->remote_candidate_type = sipe_backend_candidate_get_type(candidates->data);
+		sipe_media_candidate_list_free(candidates);
+	}
+
+	sipe_backend_media_stream_get_rtp_stats(stream, stats);
+
+	/* statistics only known to the user of the stream */
+	if (stream->call->stats_cb)
+		stream->call->stats_cb(stream->call, stream, stats);
+
+	return(stats->have_rtp || stats->have_candidates || stats->have_frames);
+}
+
 static gboolean
 maybe_retry_call_with_ice_version(struct sipe_media_call_private *call_private,
 				  SipeIceVersion ice_version,
@@ -1538,13 +2094,20 @@ maybe_retry_call_with_ice_version(struct sipe_media_call_private *call_private,
 {
 	if (call_private->ice_version != ice_version &&
 	    sip_transaction_cseq(trans) == 1) {
+		struct sipe_core_private *sipe_private = call_private->sipe_private;
 		gchar *with = g_strdup(SIPE_MEDIA_CALL->with);
 		gboolean with_video = sipe_core_media_get_stream_by_id(SIPE_MEDIA_CALL, "video") != NULL;
 
+		/* next call to this peer starts with the right version */
+		sipe_peer_caps_set_ice_version(sipe_private,
+					       sipe_media_is_conference_call(call_private) ?
+					       sipe_private->focus_factory_uri : with,
+					       ice_version);
+
 		sipe_backend_media_hangup(SIPE_MEDIA_CALL->backend_private, FALSE);
 		SIPE_DEBUG_INFO("Retrying call with ICEv%d.",
 				ice_version == SIPE_ICE_DRAFT_6 ? 6 : 19);
-		sipe_media_initiate_call(call_private->sipe_private, with,
+		sipe_media_initiate_call(sipe_private, with,
 					 ice_version, with_video);
 
 		g_free(with);
@@ -1747,10 +2310,20 @@ sipe_media_get_sip_dialog(struct sipe_media_call *call)
 	return session->dialogs->data;
 }
 
+/*
+ * A/V Edge credentials are requested for MEDIA_RELAY_DURATION minutes and
+ * refreshed in the background before they expire. Relay IP addresses are
+ * kept across refreshes so that calls don't have to wait for DNS.
+ */
+#define MEDIA_RELAY_DURATION 480 /* minutes */
+#define MEDIA_RELAY_RETRY     60 /* seconds */
+#define MEDIA_RELAY_REFRESH_ACTION "<+media-relay-refresh>"
+
 static void
 sipe_media_relay_free(struct sipe_media_relay *relay)
 {
 	g_free(relay->hostname);
+	g_free(relay->name);
 	if (relay->dns_query)
 		sipe_backend_dns_query_cancel(relay->dns_query);
 	g_free(relay);
@@ -1767,24 +2340,52 @@ static void
 relay_ip_resolved_cb(struct sipe_media_relay* relay,
 		     const gchar *ip, SIPE_UNUSED_PARAMETER guint port)
 {
-	gchar *hostname = relay->hostname;
 	relay->dns_query = NULL;
 
 	if (ip && port) {
+		g_free(relay->hostname);
 		relay->hostname = g_strdup(ip);
-		SIPE_DEBUG_INFO("Media relay %s resolved to %s.", hostname, ip);
+		SIPE_DEBUG_INFO("Media relay %s resolved to %s.", relay->name, ip);
+	} else if (relay->hostname) {
+		SIPE_DEBUG_INFO("Unable to resolve media relay %s, keeping %s.",
+				relay->name, relay->hostname);
 	} else {
-		relay->hostname = NULL;
-		SIPE_DEBUG_INFO("Unable to resolve media relay %s.", hostname);
+		SIPE_DEBUG_INFO("Unable to resolve media relay %s.", relay->name);
 	}
+}
 
-	g_free(hostname);
+static const gchar *
+media_relay_cached_ip(GSList *relays, const gchar *name)
+{
+	for (; relays; relays = relays->next) {
+		struct sipe_media_relay *relay = relays->data;
+		if (sipe_strcase_equal(relay->name, name))
+			return(relay->hostname);
+	}
+	return(NULL);
 }
 
-static gboolean
-process_get_av_edge_credentials_response(struct sipe_core_private *sipe_private,
-					 struct sipmsg *msg,
-					 SIPE_UNUSED_PARAMETER struct transaction *trans)
+static void
+media_relay_refresh_cb(struct sipe_core_private *sipe_private,
+		       SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	sipe_media_get_av_edge_credentials(sipe_private);
+}
+
+static void
+media_relay_schedule_refresh(struct sipe_core_private *sipe_private,
+			     guint seconds)
+{
+	sipe_schedule_seconds(sipe_private,
+			      MEDIA_RELAY_REFRESH_ACTION,
+			      NULL,
+			      seconds,
+			      media_relay_refresh_cb,
+			      NULL);
+}
+
+static void
+media_relay_clear(struct sipe_core_private *sipe_private)
 {
 	g_free(sipe_private->media_relay_username);
 	g_free(sipe_private->media_relay_password);
@@ -1792,10 +2393,21 @@ process_get_av_edge_credentials_response(struct sipe_core_private *sipe_private,
 	sipe_private->media_relay_username = NULL;
 	sipe_private->media_relay_password = NULL;
 	sipe_private->media_relays = NULL;
+	sipe_private->media_relay_expires = 0;
+}
 
+static gboolean
+process_get_av_edge_credentials_response(struct sipe_core_private *sipe_private,
+					 struct sipmsg *msg,
+					 SIPE_UNUSED_PARAMETER struct transaction *trans)
+{
 	if (msg->response >= 400) {
 		SIPE_DEBUG_INFO_NOFORMAT("process_get_av_edge_credentials_response: SERVICE response is not 200. "
 					 "Failed to obtain A/V Edge credentials.");
+		/* credentials we already have are still good until they expire */
+		if (sipe_private->media_relay_expires <= sipe_utils_monotonic_sec())
+			media_relay_clear(sipe_private);
+		media_relay_schedule_refresh(sipe_private, MEDIA_RELAY_RETRY);
 		return FALSE;
 	}
 
@@ -1806,20 +2418,35 @@ process_get_av_edge_credentials_response(struct sipe_core_private *sipe_private,
 			const sipe_xml *xn_credentials = sipe_xml_child(xn_response, "credentialsResponse/credentials");
 			const sipe_xml *xn_relays = sipe_xml_child(xn_response, "credentialsResponse/mediaRelayList");
 			const sipe_xml *item;
+			GSList *old_relays = sipe_private->media_relays;
 			GSList *relays = NULL;
+			guint duration = MEDIA_RELAY_DURATION;
+			gchar *tmp;
+
+			sipe_private->media_relays = NULL;
+			media_relay_clear(sipe_private);
 
 			item = sipe_xml_child(xn_credentials, "username");
 			sipe_private->media_relay_username = sipe_xml_data(item);
 			item = sipe_xml_child(xn_credentials, "password");
 			sipe_private->media_relay_password = sipe_xml_data(item);
+			item = sipe_xml_child(xn_credentials, "duration");
+			if (item) {
+				guint value = atoi(tmp = sipe_xml_data(item));
+				g_free(tmp);
+				if (value)
+					duration = value;
+			}
 
 			for (item = sipe_xml_child(xn_relays, "mediaRelay"); item; item = sipe_xml_twin(item)) {
 				struct sipe_media_relay *relay = g_new0(struct sipe_media_relay, 1);
 				const sipe_xml *node;
-				gchar *tmp;
 
 				node = sipe_xml_child(item, "hostName");
-				relay->hostname = sipe_xml_data(node);
+				relay->name = sipe_xml_data(node);
+				/* use last known address until DNS has answered */
+				relay->hostname = g_strdup(media_relay_cached_ip(old_relays,
+										 relay->name));
 
 				node = sipe_xml_child(item, "udpPort");
 				if (node) {
@@ -1837,17 +2464,24 @@ process_get_av_edge_credentials_response(struct sipe_core_private *sipe_private,
 
 				relay->dns_query = sipe_backend_dns_query_a(
 							SIPE_CORE_PUBLIC,
-							relay->hostname,
+							relay->name,
 							relay->udp_port,
 							(sipe_dns_resolved_cb) relay_ip_resolved_cb,
 							relay);
 
 				SIPE_DEBUG_INFO("Media relay: %s TCP: %d UDP: %d",
-						relay->hostname,
+						relay->name,
 						relay->tcp_port, relay->udp_port);
 			}
 
+			sipe_media_relay_list_free(old_relays);
 			sipe_private->media_relays = relays;
+
+			/* refresh at 80% of the lifetime */
+			sipe_private->media_relay_expires = sipe_utils_monotonic_sec() + duration * 60;
+			media_relay_schedule_refresh(sipe_private, duration * 48);
+		} else {
+			media_relay_schedule_refresh(sipe_private, MEDIA_RELAY_RETRY);
 		}
 
 		sipe_xml_free(xn_response);
@@ -1859,7 +2493,6 @@ process_get_av_edge_credentials_response(struct sipe_core_private *sipe_private,
 void
 sipe_media_get_av_edge_credentials(struct sipe_core_private *sipe_private)
 {
-	// TODO: re-request credentials after duration expires?
 	static const char CRED_REQUEST_XML[] =
 		"<request requestID=\"%d\" "
 		         "from=\"%s\" "
@@ -1870,7 +2503,7 @@ sipe_media_get_av_edge_credentials(struct sipe_core_private *sipe_private)
 			"<credentialsRequest credentialsRequestID=\"%d\">"
 				"<identity>%s</identity>"
 				"<location>%s</location>"
-				"<duration>480</duration>"
+				"<duration>%d</duration>"
 			"</credentialsRequest>"
 		"</request>";
 
@@ -1881,6 +2514,9 @@ sipe_media_get_av_edge_credentials(struct sipe_core_private *sipe_private)
 	if (!sipe_private->mras_uri)
 		return;
 
+	/* a refresh triggered by other means replaces the scheduled one */
+	sipe_schedule_cancel(sipe_private, MEDIA_RELAY_REFRESH_ACTION);
+
 	self = sip_uri_self(sipe_private);
 
 	body = g_strdup_printf(
@@ -1890,7 +2526,8 @@ sipe_media_get_av_edge_credentials(struct sipe_core_private *sipe_private)
 		sipe_private->mras_uri,
 		request_id,
 		self,
-		SIPE_CORE_PRIVATE_FLAG_IS(REMOTE_USER) ? "internet" : "intranet");
+		SIPE_CORE_PRIVATE_FLAG_IS(REMOTE_USER) ? "internet" : "intranet",
+		MEDIA_RELAY_DURATION);
 	g_free(self);
 
 	sip_transport_service(sipe_private,
@@ -1948,6 +2585,49 @@ sipe_media_stream_get_data(struct sipe_media_stream *stream)
 	return SIPE_MEDIA_STREAM_PRIVATE->data;
 }
 
+void sipe_media_memory_usage(struct sipe_core_private *sipe_private,
+			     struct sipe_memory_usage *usage)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	sipe_metrics_memory_hash(usage, sipe_private->media_calls);
+	g_hash_table_iter_init(&iter, sipe_private->media_calls);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const struct sipe_media_call_private *call_private = value;
+		const GSList *entry;
+
+		sipe_metrics_memory_string(usage, key);
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_media_call_private));
+		sipe_metrics_memory_string(usage, call_private->extra_invite_section);
+		sipe_metrics_memory_string(usage, call_private->invite_content_type);
+		sipmsg_memory_usage(call_private->invitation, usage);
+		if (call_private->smsg)
+			SIPE_MEMORY_OBJECT(usage, sizeof(struct sdpmsg));
+
+		sipe_metrics_memory_list(usage, g_slist_length(call_private->streams));
+		for (entry = call_private->streams; entry; entry = entry->next) {
+			const struct sipe_media_stream_private *stream_private = entry->data;
+
+			SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_media_stream_private));
+			sipe_metrics_memory_string(usage, stream_private->public.id);
+			if (stream_private->encryption_key)
+				SIPE_MEMORY_OBJECT(usage, SIPE_SRTP_KEY_LEN);
+			if (stream_private->encryption_key_gcm)
+				SIPE_MEMORY_OBJECT(usage, SIPE_SRTP_GCM_KEY_LEN);
+		}
+	}
+
+	if (sipe_private->media_codec_preferences) {
+		sipe_metrics_memory_hash(usage, sipe_private->media_codec_preferences);
+		g_hash_table_iter_init(&iter, sipe_private->media_codec_preferences);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			sipe_metrics_memory_string(usage, key);
+			sipe_metrics_memory_string(usage, value);
+		}
+	}
+}
+
 /*
   Local Variables:
   mode: c
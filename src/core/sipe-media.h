@@ -3,6 +3,7 @@
  *
  * pidgin-sipe
  *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2010 Jakub Adam <jakub.adam@ktknet.cz>
  *
  * This program is free software; you can redistribute it and/or modify
@@ -24,6 +25,7 @@
 struct sipmsg;
 struct sipe_core_private;
 struct sipe_file_transfer_lync;
+struct sipe_memory_usage;
 struct sipe_media_call_private;
 
 struct sipe_media_call *
@@ -123,7 +125,8 @@ gboolean is_media_session_msg(struct sipe_media_call_private *call_private,
  * Sends a request to mras URI for the credentials to the A/V edge server.
  * Given @c sipe_core_private must have non-NULL mras_uri. When the valid
  * response is received, media_relay_username, media_relay_password and
- * media_relays attributes of the sipe core are filled.
+ * media_relays attributes of the sipe core are filled. The credentials
+ * are refreshed automatically before they expire.
  *
  * @param sipe_private (in) SIPE core data.
  */
@@ -151,3 +154,39 @@ sipe_media_stream_get_data(struct sipe_media_stream *stream);
  * @param list (in) GSList to free
  */
 void sipe_media_relay_list_free(GSList *list);
+
+/**
+ * Release media relay allocation kept for the next call
+ *
+ * @param sipe_private (in) SIPE core data.
+ */
+void sipe_media_relay_allocation_free(struct sipe_core_private *sipe_private);
+
+/**
+ * Query media port pool usage
+ *
+ * @param sipe_private (in)  SIPE core private data
+ * @param used         (out) port windows taken by streams
+ * @param windows      (out) port windows available in all pools
+ */
+void sipe_media_ports_usage(struct sipe_core_private *sipe_private,
+			    guint *used,
+			    guint *windows);
+
+/**
+ * Free media port pool
+ *
+ * @param sipe_private (in) SIPE core private data
+ */
+void sipe_media_ports_free(struct sipe_core_private *sipe_private);
+
+/**
+ * Estimate memory used by media calls in the core
+ *
+ * Streams handled by the backend media engine aren't included.
+ *
+ * @param sipe_private (in) SIPE core private data
+ * @param usage (in) accumulated memory usage
+ */
+void sipe_media_memory_usage(struct sipe_core_private *sipe_private,
+			     struct sipe_memory_usage *usage);
@@ -0,0 +1,436 @@
+/**
+ * @file sipe-metrics.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipmsg.h"
+#include "sip-transport.h"
+#include "sipe-backend.h"
+#include "sipe-buddy.h"
+#include "sipe-cache.h"
+#include "sipe-conf.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-directory-cache.h"
+#include "sipe-http.h"
+#include "sipe-intern.h"
+#include "sipe-limits.h"
+#include "sipe-media.h"
+#include "sipe-metrics.h"
+#include "sipe-schedule.h"
+#include "sipe-subscriptions.h"
+#include "sipe-tls-session.h"
+#include "sipe-token-store.h"
+#include "sipe-utils.h"
+#include "sipe-xml.h"
+
+/*
+ * HDR-style log-linear histogram: small values have their own bucket,
+ * every power of two above is split into 8 sub-buckets, i.e. the value
+ * of a bucket is accurate to 12.5%. This covers the full guint range in
+ * 240 buckets.
+ */
+#define HISTOGRAM_SUBBITS  3
+#define HISTOGRAM_SUB      (1 << HISTOGRAM_SUBBITS)
+#define HISTOGRAM_MIN_MSB  (HISTOGRAM_SUBBITS + 1)
+#define HISTOGRAM_LINEAR   (1 << HISTOGRAM_MIN_MSB)
+#define HISTOGRAM_BUCKETS  (HISTOGRAM_LINEAR + (32 - HISTOGRAM_MIN_MSB) * HISTOGRAM_SUB)
+
+struct sipe_metrics_histogram {
+	guint64 count;
+	guint64 sum;
+	guint min;
+	guint max;
+	guint32 buckets[HISTOGRAM_BUCKETS];
+};
+
+struct sipe_metrics {
+	guint64 counters[SIPE_METRIC_COUNTERS];
+	struct sipe_metrics_histogram histograms[SIPE_METRIC_HISTOGRAMS];
+};
+
+static const gchar * const counter_names[SIPE_METRIC_COUNTERS] = {
+	"sip.requests",
+	"sip.responses",
+	"sip.timeouts",
+	"sip.incoming",
+	"http.requests",
+	"http.responses",
+	"http.auth_wasted_roundtrips",
+	"webticket.cache_hits",
+	"webticket.cache_misses",
+	"schedule.added",
+	"schedule.executed",
+	"schedule.cancelled",
+	"appshare.bytes_to_socket",
+	"appshare.bytes_to_stream",
+	"appshare.stalls",
+	"im.typing_sent",
+	"im.typing_suppressed",
+	"media.ports_exhausted",
+	"tls.handshakes",
+	"tls.resumption_offered",
+	"tls.resumed",
+	"tls.messages",
+	"tls.records",
+};
+
+static const gchar * const histogram_names[SIPE_METRIC_HISTOGRAMS] = {
+	"sip.rtt",
+	"http.latency",
+	"schedule.lateness",
+	"appshare.stall",
+	"conf.join",
+	"media.first_media",
+};
+
+static const gchar * const cache_names[SIPE_CACHES][4] = {
+	{ "cache.directory.hits",    "cache.directory.misses",
+	  "cache.directory.evictions",    "cache.directory.bytes"    },
+	{ "cache.conf_focus.hits",   "cache.conf_focus.misses",
+	  "cache.conf_focus.evictions",   "cache.conf_focus.bytes"   },
+	{ "cache.buddy_search.hits", "cache.buddy_search.misses",
+	  "cache.buddy_search.evictions", "cache.buddy_search.bytes" },
+};
+
+/* must match sipe_limit */
+static const gchar * const limit_names[SIPE_LIMITS] = {
+	"limits.sip.header_lines",
+	"limits.sip.header_length",
+	"limits.sip.body",
+	"limits.http.body",
+	"limits.xml.length",
+	"limits.xml.depth",
+	"limits.xml.nodes",
+	"limits.mime.parts",
+};
+
+static guint histogram_index(guint value)
+{
+	guint msb;
+
+	if (value < HISTOGRAM_LINEAR)
+		return(value);
+
+	msb = g_bit_storage(value) - 1;
+	return(HISTOGRAM_LINEAR +
+	       (msb - HISTOGRAM_MIN_MSB) * HISTOGRAM_SUB +
+	       ((value >> (msb - HISTOGRAM_SUBBITS)) & (HISTOGRAM_SUB - 1)));
+}
+
+/* highest value that falls into a bucket */
+static guint histogram_upper(guint index)
+{
+	guint shift;
+	guint64 lower;
+
+	if (index < HISTOGRAM_LINEAR)
+		return(index);
+
+	index -= HISTOGRAM_LINEAR;
+	shift  = index / HISTOGRAM_SUB + HISTOGRAM_MIN_MSB - HISTOGRAM_SUBBITS;
+	lower  = ((guint64) (HISTOGRAM_SUB + index % HISTOGRAM_SUB)) << shift;
+	return((guint) (lower + (G_GUINT64_CONSTANT(1) << shift) - 1));
+}
+
+static guint histogram_percentile(const struct sipe_metrics_histogram *histogram,
+				  guint percent)
+{
+	guint64 rank = (histogram->count * percent + 99) / 100;
+	guint64 seen = 0;
+	guint i;
+
+	if (rank == 0)
+		return(0);
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+			return(MIN(histogram_upper(i), histogram->max));
+	}
+	return(histogram->max);
+}
+
+void sipe_metrics_count(struct sipe_core_private *sipe_private,
+			sipe_metric_counter counter)
+{
+	sipe_private->metrics->counters[counter]++;
+}
+
+void sipe_metrics_add(struct sipe_core_private *sipe_private,
+		      sipe_metric_counter counter,
+		      guint64 value)
+{
+	sipe_private->metrics->counters[counter] += value;
+}
+
+void sipe_metrics_latency(struct sipe_core_private *sipe_private,
+			  sipe_metric_histogram histogram,
+			  gint64 start)
+{
+	struct sipe_metrics_histogram *h = sipe_private->metrics->histograms + histogram;
+	gint64 elapsed = sipe_utils_monotonic_msec() - start;
+	guint value    = (elapsed < 0) ? 0 : (guint) MIN(elapsed, G_MAXUINT);
+
+	if ((h->count == 0) || (value < h->min))
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	h->sum += value;
+	h->buckets[histogram_index(value)]++;
+}
+
+void sipe_metrics_init(struct sipe_core_private *sipe_private)
+{
+	sipe_private->metrics = g_new0(struct sipe_metrics, 1);
+}
+
+void sipe_metrics_free(struct sipe_core_private *sipe_private)
+{
+	g_free(sipe_private->metrics);
+	sipe_private->metrics = NULL;
+}
+
+static void metrics_add(GArray *array,
+			const gchar *name,
+			sipe_core_metric_type type,
+			guint64 value)
+{
+	struct sipe_core_metric metric = { NULL, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	metric.name  = name;
+	metric.type  = type;
+	metric.value = value;
+	g_array_append_val(array, metric);
+}
+
+GArray *sipe_core_metrics_snapshot(struct sipe_core_public *sipe_public)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	struct sipe_metrics *metrics = sipe_private->metrics;
+	GArray *array = g_array_new(FALSE, FALSE, sizeof(struct sipe_core_metric));
+	struct sipe_resubscribe_stats resubscribe;
+	struct sipe_tls_session_stats tls_sessions;
+	guint connections, queued, queued_max;
+	guint i;
+
+	for (i = 0; i < SIPE_METRIC_COUNTERS; i++)
+		metrics_add(array,
+			    counter_names[i],
+			    SIPE_CORE_METRIC_COUNTER,
+			    metrics->counters[i]);
+
+	sipe_http_queue_depth(sipe_private,
+			      &connections,
+			      &queued,
+			      &queued_max);
+	sipe_subscriptions_resubscribe_stats(sipe_private, &resubscribe);
+	metrics_add(array, "sip.transactions", SIPE_CORE_METRIC_GAUGE,
+		    sip_transport_pending(sipe_private));
+	metrics_add(array, "http.connections", SIPE_CORE_METRIC_GAUGE,
+		    connections);
+	metrics_add(array, "http.queue", SIPE_CORE_METRIC_GAUGE,
+		    queued);
+	metrics_add(array, "http.queue_max", SIPE_CORE_METRIC_GAUGE,
+		    queued_max);
+	metrics_add(array, "subscriptions", SIPE_CORE_METRIC_GAUGE,
+		    g_hash_table_size(sipe_private->subscriptions));
+	metrics_add(array, "subscriptions.resubscribe_pending", SIPE_CORE_METRIC_GAUGE,
+		    resubscribe.pending + resubscribe.in_flight);
+	metrics_add(array, "schedule.pending", SIPE_CORE_METRIC_GAUGE,
+		    sipe_schedule_pending(sipe_private));
+	sipe_tls_session_stats(sipe_private, &tls_sessions);
+	metrics_add(array, "tls.sessions", SIPE_CORE_METRIC_GAUGE,
+		    tls_sessions.sessions);
+	metrics_add(array, "tls.resumption_ratio", SIPE_CORE_METRIC_GAUGE,
+		    tls_sessions.resumption);
+#ifdef HAVE_VV
+	{
+		guint used, windows;
+
+		sipe_media_ports_usage(sipe_private, &used, &windows);
+		metrics_add(array, "media.ports_used", SIPE_CORE_METRIC_GAUGE,
+			    used);
+		metrics_add(array, "media.ports_windows", SIPE_CORE_METRIC_GAUGE,
+			    windows);
+	}
+#endif
+
+	for (i = 0; i < SIPE_CACHES; i++) {
+		struct sipe_cache_stats stats;
+
+		sipe_cache_stats(sipe_private, i, &stats);
+		metrics_add(array, cache_names[i][0], SIPE_CORE_METRIC_COUNTER,
+			    stats.hits);
+		metrics_add(array, cache_names[i][1], SIPE_CORE_METRIC_COUNTER,
+			    stats.misses);
+		metrics_add(array, cache_names[i][2], SIPE_CORE_METRIC_COUNTER,
+			    stats.evictions);
+		metrics_add(array, cache_names[i][3], SIPE_CORE_METRIC_GAUGE,
+			    stats.bytes);
+	}
+
+	/* process-wide */
+	for (i = 0; i < SIPE_LIMITS; i++)
+		metrics_add(array, limit_names[i], SIPE_CORE_METRIC_COUNTER,
+			    sipe_limit_rejected(i));
+
+	for (i = 0; i < SIPE_METRIC_HISTOGRAMS; i++) {
+		const struct sipe_metrics_histogram *h = metrics->histograms + i;
+		struct sipe_core_metric *metric;
+
+		metrics_add(array,
+			    histogram_names[i],
+			    SIPE_CORE_METRIC_HISTOGRAM,
+			    h->count);
+		metric = &g_array_index(array, struct sipe_core_metric, array->len - 1);
+		metric->sum = h->sum;
+		metric->min = h->min;
+		metric->max = h->max;
+		metric->p50 = histogram_percentile(h, 50);
+		metric->p90 = histogram_percentile(h, 90);
+		metric->p99 = histogram_percentile(h, 99);
+	}
+
+	return(array);
+}
+
+/*
+ * Node sizes of the GLib containers. These aren't public, so they are
+ * approximated: a hash node stores key, value & hash plus a bucket
+ * pointer, a list node stores data & links.
+ */
+#define MEMORY_HASH_TABLE (8 * sizeof(gpointer))
+#define MEMORY_HASH_NODE  (3 * sizeof(gpointer) + sizeof(guint))
+#define MEMORY_LIST_NODE  sizeof(GList)
+
+void sipe_metrics_memory_string(struct sipe_memory_usage *usage,
+				const gchar *string)
+{
+	if (string)
+		SIPE_MEMORY_OBJECT(usage, strlen(string) + 1);
+}
+
+void sipe_metrics_memory_hash(struct sipe_memory_usage *usage,
+			      GHashTable *table)
+{
+	if (table) {
+		guint size = g_hash_table_size(table);
+
+		SIPE_MEMORY_OBJECT(usage, MEMORY_HASH_TABLE);
+		usage->bytes   += size * MEMORY_HASH_NODE;
+		usage->objects += size;
+	}
+}
+
+void sipe_metrics_memory_list(struct sipe_memory_usage *usage,
+			      guint length)
+{
+	usage->bytes   += length * MEMORY_LIST_NODE;
+	usage->objects += length;
+}
+
+static void memory_add(GArray *array,
+		       const gchar *name,
+		       const struct sipe_memory_usage *usage)
+{
+	struct sipe_core_memory memory;
+
+	memory.name    = name;
+	memory.bytes   = usage->bytes;
+	memory.objects = usage->objects;
+	g_array_append_val(array, memory);
+
+	SIPE_DEBUG_INFO("sipe_core_memory_report: %-13s %10" G_GUINT64_FORMAT " bytes %8" G_GUINT64_FORMAT " objects",
+			name, usage->bytes, usage->objects);
+}
+
+/* directory, Web Ticket, conference URL & buddy search caches */
+static void memory_caches(struct sipe_core_private *sipe_private,
+			  struct sipe_memory_usage *usage)
+{
+	sipe_directory_cache_memory_usage(sipe_private, usage);
+	sipe_token_store_memory_usage(sipe_private, usage);
+	sipe_conf_focus_cache_memory_usage(sipe_private, usage);
+	sipe_buddy_search_cache_memory_usage(sipe_private, usage);
+}
+
+GArray *sipe_core_memory_report(struct sipe_core_public *sipe_public)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+	GArray *array = g_array_new(FALSE, FALSE, sizeof(struct sipe_core_memory));
+	struct sipe_memory_usage usage;
+	struct sipe_memory_usage total = { 0, 0 };
+
+#define MEMORY_TAG(name, code)				\
+	do {							\
+		usage.bytes = usage.objects = 0;		\
+		code;						\
+		memory_add(array, name, &usage);		\
+		total.bytes   += usage.bytes;			\
+		total.objects += usage.objects;			\
+	} while (0)
+
+	MEMORY_TAG("buddies",
+		   sipe_buddy_memory_usage(sipe_private, &usage));
+	MEMORY_TAG("subscriptions",
+		   sipe_subscriptions_memory_usage(sipe_private, &usage));
+	MEMORY_TAG("transport",
+		   sip_transport_memory_usage(sipe_private, &usage));
+	MEMORY_TAG("http",
+		   sipe_http_memory_usage(sipe_private, &usage));
+#ifdef HAVE_VV
+	MEMORY_TAG("media",
+		   sipe_media_memory_usage(sipe_private, &usage));
+#endif
+
+	MEMORY_TAG("caches",
+		   memory_caches(sipe_private, &usage));
+
+	/* process wide, shared by all accounts */
+	MEMORY_TAG("xml",
+		   sipe_xml_memory_usage(&usage.bytes, &usage.objects));
+	MEMORY_TAG("uris",
+		   sipe_intern_memory_usage(&usage.bytes, &usage.objects));
+
+#undef MEMORY_TAG
+
+	memory_add(array, "total", &total);
+
+	return(array);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
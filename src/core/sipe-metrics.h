@@ -0,0 +1,155 @@
+/**
+ * @file sipe-metrics.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Runtime metrics
+ *
+ * Counters and latency histograms are updated where the event happens.
+ * Gauges are read from the owning module when a snapshot is taken, so
+ * they don't cost anything on the hot path.
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+
+typedef enum {
+	SIPE_METRIC_SIP_REQUESTS,
+	SIPE_METRIC_SIP_RESPONSES,
+	SIPE_METRIC_SIP_TIMEOUTS,
+	SIPE_METRIC_SIP_INCOMING,
+	SIPE_METRIC_HTTP_REQUESTS,
+	SIPE_METRIC_HTTP_RESPONSES,
+	SIPE_METRIC_HTTP_AUTH_WASTED,
+	SIPE_METRIC_WEBTICKET_CACHE_HITS,
+	SIPE_METRIC_WEBTICKET_CACHE_MISSES,
+	SIPE_METRIC_SCHEDULE_ADDED,
+	SIPE_METRIC_SCHEDULE_EXECUTED,
+	SIPE_METRIC_SCHEDULE_CANCELLED,
+	SIPE_METRIC_APPSHARE_BYTES_TO_SOCKET,
+	SIPE_METRIC_APPSHARE_BYTES_TO_STREAM,
+	SIPE_METRIC_APPSHARE_STALLS,
+	SIPE_METRIC_TYPING_SENT,
+	SIPE_METRIC_TYPING_SUPPRESSED,
+	SIPE_METRIC_MEDIA_PORTS_EXHAUSTED,
+	SIPE_METRIC_TLS_HANDSHAKES,
+	SIPE_METRIC_TLS_RESUMPTION_OFFERED,
+	SIPE_METRIC_TLS_RESUMED,
+	SIPE_METRIC_TLS_MESSAGES,
+	SIPE_METRIC_TLS_RECORDS,
+	SIPE_METRIC_COUNTERS
+} sipe_metric_counter;
+
+typedef enum {
+	SIPE_METRIC_SIP_RTT,
+	SIPE_METRIC_HTTP_LATENCY,
+	SIPE_METRIC_SCHEDULE_LATENESS,
+	SIPE_METRIC_APPSHARE_STALL,
+	SIPE_METRIC_CONF_JOIN,
+	SIPE_METRIC_MEDIA_SETUP,
+	SIPE_METRIC_HISTOGRAMS
+} sipe_metric_histogram;
+
+/**
+ * Increment a counter
+ *
+ * @param sipe_private SIPE core private data
+ * @param counter      counter ID
+ */
+void sipe_metrics_count(struct sipe_core_private *sipe_private,
+			sipe_metric_counter counter);
+
+/**
+ * Add a value to a counter
+ *
+ * @param sipe_private SIPE core private data
+ * @param counter      counter ID
+ * @param value        amount to add
+ */
+void sipe_metrics_add(struct sipe_core_private *sipe_private,
+		      sipe_metric_counter counter,
+		      guint64 value);
+
+/**
+ * Add a sample to a latency histogram
+ *
+ * @param sipe_private SIPE core private data
+ * @param histogram    histogram ID
+ * @param start        start of interval from sipe_utils_monotonic_msec()
+ */
+void sipe_metrics_latency(struct sipe_core_private *sipe_private,
+			  sipe_metric_histogram histogram,
+			  gint64 start);
+
+/*
+ * Memory accounting
+ *
+ * Modules walk their own data structures when a report is requested,
+ * i.e. the numbers are estimates: payload sizes plus the size of the
+ * structures, allocator overhead isn't included.
+ */
+struct sipe_memory_usage {
+	guint64 bytes;
+	guint64 objects;
+};
+
+/** one allocated object of @c size bytes */
+#define SIPE_MEMORY_OBJECT(usage, size) \
+	do { (usage)->bytes += (size); (usage)->objects++; } while (0)
+
+/**
+ * Add a string
+ *
+ * @param usage  accumulated memory usage
+ * @param string string (may be @c NULL)
+ */
+void sipe_metrics_memory_string(struct sipe_memory_usage *usage,
+				const gchar *string);
+
+/**
+ * Add the table & node overhead of a hash table, but not its contents
+ *
+ * @param usage accumulated memory usage
+ * @param table hash table (may be @c NULL)
+ */
+void sipe_metrics_memory_hash(struct sipe_memory_usage *usage,
+			      GHashTable *table);
+
+/**
+ * Add the node overhead of a list, but not its contents
+ *
+ * @param usage  accumulated memory usage
+ * @param length number of list entries
+ */
+void sipe_metrics_memory_list(struct sipe_memory_usage *usage,
+			      guint length);
+
+void sipe_metrics_init(struct sipe_core_private *sipe_private);
+void sipe_metrics_free(struct sipe_core_private *sipe_private);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
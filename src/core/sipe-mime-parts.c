@@ -0,0 +1,420 @@
+/**
+ * @file sipe-mime-parts.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Multipart splitter (RFC 2046 section 5.1)
+ *
+ * Parts are located directly in the original message body and handed
+ * to the callback as (pointer, length) views, i.e. the body is never
+ * copied. Only the part header fields are allocated.
+ *
+ * Documents that need decoding, i.e. a part with a Content-Transfer-Encoding
+ * other than 7bit, 8bit or binary, are handed to the MIME backend instead.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-limits.h"
+#include "sipe-mime.h"
+#include "sipe-utils.h"
+
+struct mime_part_view {
+	const gchar *headers;
+	gsize headers_length;
+	const gchar *body;
+	gsize body_length;
+};
+
+/* returns newly allocated boundary or NULL */
+static gchar *mime_boundary(const gchar *type)
+{
+	const gchar *param;
+
+	if (!type || (g_ascii_strncasecmp(type, "multipart/", 10) != 0))
+		return(NULL);
+
+	param = strchr(type, ';');
+	while (param) {
+		param++;
+		while (*param == ' ' || *param == '\t')
+			param++;
+
+		if (g_ascii_strncasecmp(param, "boundary=", 9) == 0) {
+			const gchar *start = param + 9;
+			const gchar *end;
+
+			if (*start == '"') {
+				end = strchr(++start, '"');
+			} else {
+				end = start + strcspn(start, "; \t\r\n");
+			}
+			if (end && (end > start))
+				return(g_strndup(start, end - start));
+			return(NULL);
+		}
+
+		param = strchr(param, ';');
+	}
+
+	return(NULL);
+}
+
+/*
+ * Find next delimiter line at or after "from". Returns pointer to the
+ * start of the delimiter or NULL. "next" points to the first character
+ * after the delimiter line, "last" signals the close delimiter.
+ */
+static const gchar *mime_find_delimiter(const gchar *from,
+					const gchar *end,
+					const gchar *delimiter,
+					gsize delimiter_length,
+					const gchar *body,
+					const gchar **next,
+					gboolean *last)
+{
+	while (from < end) {
+		const gchar *found = g_strstr_len(from, end - from, delimiter);
+		const gchar *tail;
+
+		if (!found)
+			break;
+		from = found + delimiter_length;
+
+		/* delimiter must be at the start of a line */
+		if ((found != body) && (found[-1] != '\n'))
+			continue;
+
+		tail = from;
+		if ((end - tail >= 2) && (tail[0] == '-') && (tail[1] == '-')) {
+			*last = TRUE;
+			tail += 2;
+		} else {
+			*last = FALSE;
+		}
+
+		/* transport padding */
+		while ((tail < end) && (*tail == ' ' || *tail == '\t'))
+			tail++;
+
+		if (tail == end) {
+			*next = tail;
+			return(found);
+		}
+		if (*tail == '\r')
+			tail++;
+		if ((tail < end) && (*tail == '\n')) {
+			*next = tail + 1;
+			return(found);
+		}
+
+		/* boundary is only a prefix of some other text: keep looking */
+	}
+
+	return(NULL);
+}
+
+static void mime_split_part(struct mime_part_view *part,
+			    const gchar *start,
+			    const gchar *end)
+{
+	const gchar *p = start;
+
+	/* part without header fields */
+	if (*p == '\r' && (p + 1 < end) && p[1] == '\n')
+		p += 2;
+	else if (*p == '\n')
+		p++;
+	if (p != start) {
+		part->headers        = start;
+		part->headers_length = 0;
+		part->body           = p;
+		part->body_length    = end - p;
+		return;
+	}
+
+	while (p < end) {
+		const gchar *eol = memchr(p, '\n', end - p);
+		const gchar *line;
+
+		if (!eol)
+			break;
+		line = eol + 1;
+		if ((line < end) && (*line == '\n')) {
+			part->body = line + 1;
+			break;
+		}
+		if ((end - line >= 2) && (line[0] == '\r') && (line[1] == '\n')) {
+			part->body = line + 2;
+			break;
+		}
+		p = line;
+	}
+
+	part->headers = start;
+	if (part->body) {
+		part->headers_length = part->body - start;
+		part->body_length    = end - part->body;
+	} else {
+		/* only header fields */
+		part->headers_length = end - start;
+		part->body           = end;
+		part->body_length    = 0;
+	}
+}
+
+/* returns list of sipnameval */
+static GSList *mime_parse_fields(const gchar *headers, gsize length)
+{
+	const gchar *p   = headers;
+	const gchar *end = headers + length;
+	GSList *fields = NULL;
+
+	while (p < end) {
+		const gchar *field_end = p;
+		const gchar *colon;
+		gboolean folded = FALSE;
+
+		/* logical field = line + continuation lines */
+		while (field_end < end) {
+			const gchar *eol = memchr(field_end, '\n', end - field_end);
+			if (!eol) {
+				field_end = end;
+				break;
+			}
+			field_end = eol + 1;
+			if ((field_end < end) &&
+			    (*field_end == ' ' || *field_end == '\t'))
+				folded = TRUE;
+			else
+				break;
+		}
+
+		colon = memchr(p, ':', field_end - p);
+		if (colon && (colon > p)) {
+			const gchar *value_end = field_end;
+
+			while ((value_end > colon + 1) &&
+			       g_ascii_isspace(value_end[-1]))
+				value_end--;
+
+			if (folded) {
+				gchar *value = g_strndup(colon + 1,
+							 value_end - colon - 1);
+				gchar *r, *w;
+
+				for (r = w = value; *r; r++)
+					if (*r != '\r' && *r != '\n')
+						*w++ = *r;
+				*w = '\0';
+				g_strstrip(value);
+
+				fields = g_slist_prepend(fields,
+							 sipe_utils_nameval_new(p,
+										colon - p,
+										value,
+										strlen(value)));
+				g_free(value);
+			} else {
+				const gchar *value = colon + 1;
+
+				while ((value < value_end) &&
+				       (*value == ' ' || *value == '\t'))
+					value++;
+
+				fields = g_slist_prepend(fields,
+							 sipe_utils_nameval_new(p,
+										colon - p,
+										value,
+										value_end - value));
+			}
+		}
+
+		p = field_end;
+	}
+
+	return(g_slist_reverse(fields));
+}
+
+static gboolean mime_needs_decoding(const struct mime_part_view *part)
+{
+	static const gchar name[] = "Content-Transfer-Encoding:";
+	const gchar *p   = part->headers;
+	const gchar *end = part->headers + part->headers_length;
+
+	while (p < end) {
+		const gchar *eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		if (((gsize) (eol - p) >= sizeof(name) - 1) &&
+		    (g_ascii_strncasecmp(p, name, sizeof(name) - 1) == 0)) {
+			gchar *value = g_strstrip(g_strndup(p + sizeof(name) - 1,
+							    eol - p - sizeof(name) + 1));
+			gboolean identity = (g_ascii_strcasecmp(value, "7bit")   == 0) ||
+					    (g_ascii_strcasecmp(value, "8bit")   == 0) ||
+					    (g_ascii_strcasecmp(value, "binary") == 0);
+			g_free(value);
+			if (!identity)
+				return(TRUE);
+		}
+
+		p = eol + 1;
+	}
+
+	return(FALSE);
+}
+
+/* MIME backend is only initialized when it is needed */
+static gboolean backend_initialized = FALSE;
+
+static void mime_parts_backend(const gchar *type,
+			       const gchar *body,
+			       sipe_mime_parts_cb callback,
+			       gpointer user_data)
+{
+	if (!backend_initialized) {
+		sipe_mime_init();
+		backend_initialized = TRUE;
+	}
+	sipe_mime_parts_foreach_fallback(type, body, callback, user_data);
+}
+
+void sipe_mime_parts_shutdown(void)
+{
+	if (backend_initialized) {
+		sipe_mime_shutdown();
+		backend_initialized = FALSE;
+	}
+}
+
+void sipe_mime_parts_foreach(const gchar *type,
+			     const gchar *body,
+			     sipe_mime_parts_cb callback,
+			     gpointer user_data)
+{
+	gchar *boundary = mime_boundary(type);
+	gchar *delimiter;
+	gsize delimiter_length;
+	const gchar *end;
+	const gchar *start;
+	const gchar *next;
+	gboolean last = FALSE;
+	GArray *parts;
+	guint i;
+
+	if (!body)
+		return;
+
+	if (!boundary) {
+		SIPE_DEBUG_INFO("sipe_mime_parts_foreach: no boundary in '%s'",
+				type ? type : "");
+		mime_parts_backend(type, body, callback, user_data);
+		return;
+	}
+
+	delimiter        = g_strconcat("--", boundary, NULL);
+	delimiter_length = strlen(delimiter);
+	g_free(boundary);
+	end              = body + strlen(body);
+	parts            = g_array_new(FALSE, TRUE,
+				       sizeof(struct mime_part_view));
+
+	/* pass 1: locate parts, skipping the preamble */
+	start = mime_find_delimiter(body, end,
+				    delimiter, delimiter_length,
+				    body, &next, &last);
+	while (start && !last) {
+		const gchar *part_start = next;
+		const gchar *part_end;
+		struct mime_part_view part = { NULL, 0, NULL, 0 };
+
+		start = mime_find_delimiter(part_start, end,
+					    delimiter, delimiter_length,
+					    body, &next, &last);
+		if (start) {
+			/* CRLF before delimiter belongs to the delimiter */
+			part_end = start;
+			if ((part_end > part_start) && (part_end[-1] == '\n'))
+				part_end--;
+			if ((part_end > part_start) && (part_end[-1] == '\r'))
+				part_end--;
+		} else {
+			SIPE_DEBUG_INFO_NOFORMAT("sipe_mime_parts_foreach: missing close delimiter");
+			part_end = end;
+		}
+
+		if (part_end > part_start) {
+			mime_split_part(&part, part_start, part_end);
+
+			if (mime_needs_decoding(&part)) {
+				SIPE_DEBUG_INFO_NOFORMAT("sipe_mime_parts_foreach: encoded part, using MIME backend");
+				g_array_free(parts, TRUE);
+				g_free(delimiter);
+				mime_parts_backend(type, body,
+						   callback, user_data);
+				return;
+			}
+
+			g_array_append_val(parts, part);
+
+			/* reject before any part has been processed */
+			if (sipe_limit_exceeded(SIPE_LIMIT_MIME_PARTS,
+						parts->len)) {
+				SIPE_DEBUG_ERROR("sipe_mime_parts_foreach: more than %" G_GSIZE_FORMAT " parts - ignoring document",
+						 sipe_limit_get(SIPE_LIMIT_MIME_PARTS));
+				g_array_free(parts, TRUE);
+				g_free(delimiter);
+				return;
+			}
+		}
+	}
+	g_free(delimiter);
+
+	SIPE_DEBUG_INFO("sipe_mime_parts_foreach: %d parts", parts->len);
+
+	/* pass 2: report parts with a Content-Type */
+	for (i = 0; i < parts->len; i++) {
+		struct mime_part_view *part = &g_array_index(parts,
+							     struct mime_part_view,
+							     i);
+		GSList *fields = mime_parse_fields(part->headers,
+						   part->headers_length);
+
+		if (sipe_utils_nameval_find(fields, "Content-Type"))
+			(*callback)(user_data, fields, part->body, part->body_length);
+
+		sipe_utils_nameval_free(fields);
+	}
+
+	g_array_free(parts, TRUE);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -110,10 +110,10 @@ static void gmime_callback(SIPE_UNUSED_PARAMETER GMimeObject *parent,
 	}
 }
 
-void sipe_mime_parts_foreach(const gchar *type,
-			     const gchar *body,
-			     sipe_mime_parts_cb callback,
-			     gpointer user_data)
+void sipe_mime_parts_foreach_fallback(const gchar *type,
+				      const gchar *body,
+				      sipe_mime_parts_cb callback,
+				      gpointer user_data)
 {
 	gchar *doc = g_strdup_printf("Content-Type: %s\r\n\r\n%s", type, body);
 	GMimeStream *stream = g_mime_stream_mem_new_with_buffer(doc, strlen(doc));
@@ -125,7 +125,7 @@ void sipe_mime_parts_foreach(const gchar *type,
 		if (multipart) {
 			struct gmime_callback_data cd = {callback, user_data};
 
-			SIPE_DEBUG_INFO("sipe_mime_parts_foreach: %d parts", g_mime_multipart_get_count(multipart));
+			SIPE_DEBUG_INFO("sipe_mime_parts_foreach_fallback: %d parts", g_mime_multipart_get_count(multipart));
 
 			g_mime_multipart_foreach(multipart, gmime_callback, &cd);
 			g_object_unref(multipart);
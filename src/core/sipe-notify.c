@@ -40,17 +40,21 @@
 #include "sipe-backend.h"
 #include "sipe-buddy.h"
 #include "sipe-cal.h"
+#include "sipe-common.h"
 #include "sipe-conf.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-group.h"
 #include "sipe-groupchat.h"
+#include "sipe-job.h"
 #include "sipe-media.h"
 #include "sipe-mime.h"
 #include "sipe-nls.h"
 #include "sipe-notify.h"
 #include "sipe-ocs2005.h"
 #include "sipe-ocs2007.h"
+#include "sipe-presence-batch.h"
+#include "sipe-roster-cache.h"
 #include "sipe-status.h"
 #include "sipe-subscriptions.h"
 #include "sipe-ucs.h"
@@ -78,13 +82,26 @@ static void sipe_process_provisioning(struct sipe_core_private *sipe_private,
 }
 
 /* OCS2007+ */
-static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
-					 struct sipmsg *msg)
+#define PROVISIONING_V2_FILE "provisioning.xml"
+
+/* subsystems are only (re-)started when their settings have changed */
+static gboolean provisioning_v2_apply(struct sipe_core_private *sipe_private,
+				      const gchar *body,
+				      gsize length)
 {
 	sipe_xml *xn_provision_group_list;
 	const sipe_xml *node;
+	gchar *old_focus_factory_uri = g_strdup(sipe_private->focus_factory_uri);
+	gchar *old_dlx_uri           = g_strdup(sipe_private->dlx_uri);
+	gchar *old_addressbook_uri   = g_strdup(sipe_private->addressbook_uri);
+	gchar *old_pool_uri          = g_strdup(sipe_private->persistentChatPool_uri);
+#ifdef HAVE_VV
+	gchar *old_mras_uri          = g_strdup(sipe_private->mras_uri);
+#endif
+	gboolean valid;
 
-	xn_provision_group_list = sipe_xml_parse(msg->body, msg->bodylen);
+	xn_provision_group_list = sipe_xml_parse(body, length);
+	valid = sipe_xml_child(xn_provision_group_list, "provisionGroup") != NULL;
 
 	/* provisionGroup */
 	for (node = sipe_xml_child(xn_provision_group_list, "provisionGroup");
@@ -99,7 +116,6 @@ static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
 			const gchar *addressbook_uri_str = SIPE_CORE_PRIVATE_FLAG_IS(REMOTE_USER) ?
 					"absExternalServerUrl" : "absInternalServerUrl";
 			gchar *ucPC2PCAVEncryption = NULL;
-			gchar *ucPortRangeEnabled = NULL;
 
 			g_free(sipe_private->focus_factory_uri);
 			sipe_private->focus_factory_uri = sipe_xml_data(sipe_xml_child(node, "focusFactoryUri"));
@@ -127,7 +143,8 @@ static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
 			SIPE_DEBUG_INFO("sipe_process_provisioning_v2: sipe_private->mras_uri=%s",
 					sipe_private->mras_uri ? sipe_private->mras_uri : "");
 
-			if (sipe_private->mras_uri)
+			if (sipe_private->mras_uri &&
+			    !sipe_strequal(sipe_private->mras_uri, old_mras_uri))
 					sipe_media_get_av_edge_credentials(sipe_private);
 #endif
 
@@ -142,49 +159,26 @@ static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
 			}
 			g_free(ucPC2PCAVEncryption);
 
-			ucPortRangeEnabled = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucPortRangeEnabled")));
-			if (sipe_strequal(ucPortRangeEnabled, "true")) {
-				gchar *port_str;
-
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMinMediaPort")));
-				sipe_private->min_media_port = atoi(port_str);
-				g_free(port_str);
+			if (sipe_xml_data_boolean(sipe_xml_child(node, "ucPortRangeEnabled"), FALSE)) {
+				sipe_private->min_media_port = sipe_xml_data_int(sipe_xml_child(node, "ucMinMediaPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMaxMediaPort")));
-				sipe_private->max_media_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->max_media_port = sipe_xml_data_int(sipe_xml_child(node, "ucMaxMediaPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMinAudioPort")));
-				sipe_private->min_audio_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->min_audio_port = sipe_xml_data_int(sipe_xml_child(node, "ucMinAudioPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMaxAudioPort")));
-				sipe_private->max_audio_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->max_audio_port = sipe_xml_data_int(sipe_xml_child(node, "ucMaxAudioPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMinVideoPort")));
-				sipe_private->min_video_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->min_video_port = sipe_xml_data_int(sipe_xml_child(node, "ucMinVideoPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMaxVideoPort")));
-				sipe_private->max_video_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->max_video_port = sipe_xml_data_int(sipe_xml_child(node, "ucMaxVideoPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMinAppSharingPort")));
-				sipe_private->min_appsharing_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->min_appsharing_port = sipe_xml_data_int(sipe_xml_child(node, "ucMinAppSharingPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMaxAppSharingPort")));
-				sipe_private->max_appsharing_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->max_appsharing_port = sipe_xml_data_int(sipe_xml_child(node, "ucMaxAppSharingPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMinFileTransferPort")));
-				sipe_private->min_filetransfer_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->min_filetransfer_port = sipe_xml_data_int(sipe_xml_child(node, "ucMinFileTransferPort"), 0);
 
-				port_str = g_strstrip(sipe_xml_data(sipe_xml_child(node, "ucMaxFileTransferPort")));
-				sipe_private->max_filetransfer_port = atoi(port_str);
-				g_free(port_str);
+				sipe_private->max_filetransfer_port = sipe_xml_data_int(sipe_xml_child(node, "ucMaxFileTransferPort"), 0);
 			} else {
 				sipe_private->min_media_port = 0;
 				sipe_private->max_media_port = 0;
@@ -197,7 +191,6 @@ static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
 				sipe_private->min_filetransfer_port = 0;
 				sipe_private->max_filetransfer_port = 0;
 			}
-			g_free(ucPortRangeEnabled);
 
 		/* persistentChatConfiguration */
 		} else if (sipe_strequal("persistentChatConfiguration", node_name)) {
@@ -209,17 +202,15 @@ static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
 			     property;
 			     property = sipe_xml_twin(property)) {
 				const gchar *name = sipe_xml_attribute(property, "name");
-				gchar *value = sipe_xml_data(property);
 
 				if (sipe_strequal(name, "EnablePersistentChat")) {
-					enabled = sipe_strequal(value, "true");
+					enabled = sipe_strequal(sipe_xml_data_view(property, NULL),
+								"true");
 
 				} else if (sipe_strequal(name, "DefaultPersistentChatPoolUri")) {
 					g_free(uri);
-					uri = value;
-					value = NULL;
+					uri = sipe_xml_data(property);
 				}
-				g_free(value);
 			}
 
 			if (enabled) {
@@ -234,34 +225,102 @@ static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
 	}
 	sipe_xml_free(xn_provision_group_list);
 
-	if (sipe_private->dlx_uri && sipe_private->addressbook_uri) {
+	if (sipe_private->dlx_uri && sipe_private->addressbook_uri &&
+	    (!sipe_strequal(sipe_private->dlx_uri, old_dlx_uri) ||
+	     !sipe_strequal(sipe_private->addressbook_uri, old_addressbook_uri))) {
 		/* Some buddies might have been added before we received this
 		 * provisioning notify with DLX and addressbook URIs. Now we can
 		 * trigger an update of their photos. */
 		sipe_buddy_refresh_photos(sipe_private);
 	}
 
-	if (sipe_private->focus_factory_uri) {
+	if (sipe_private->focus_factory_uri &&
+	    !sipe_strequal(sipe_private->focus_factory_uri, old_focus_factory_uri)) {
 		/* Fill the list of conferencing capabilities enabled on
 		 * the server. */
 		sipe_conf_get_capabilities(sipe_private);
 	}
 
-	if (SIPE_CORE_PRIVATE_FLAG_IS(OCS2007))
+	if (SIPE_CORE_PRIVATE_FLAG_IS(OCS2007) &&
+	    (!sipe_private->groupchat ||
+	     !sipe_strequal(sipe_private->persistentChatPool_uri, old_pool_uri)))
 		/* persistentChatPool_uri has been set at this point */
 		sipe_groupchat_init(sipe_private);
+
+	g_free(old_pool_uri);
+	g_free(old_addressbook_uri);
+	g_free(old_dlx_uri);
+	g_free(old_focus_factory_uri);
+#ifdef HAVE_VV
+	g_free(old_mras_uri);
+#endif
+
+	return(valid);
 }
 
-static void process_incoming_notify_rlmi_resub(struct sipe_core_private *sipe_private,
-					       const gchar *data, unsigned len)
+/*
+ * The last provisioning document is applied at login before the
+ * subscription is sent, i.e. subsystems can start right away. The fresh
+ * document then only changes what is different.
+ */
+void sipe_notify_provisioning_cached(struct sipe_core_private *sipe_private)
+{
+	gchar *filename;
+	gchar *contents;
+	gsize length;
+
+	/* fresh or cached document has already been applied */
+	if (sipe_private->provisioning_v2)
+		return;
+
+	filename = sipe_roster_cache_filename(sipe_private, PROVISIONING_V2_FILE);
+	if (g_file_get_contents(filename, &contents, &length, NULL)) {
+		SIPE_DEBUG_INFO("sipe_notify_provisioning_cached: applying '%s'",
+				filename);
+		if (provisioning_v2_apply(sipe_private, contents, length))
+			sipe_private->provisioning_v2 = contents;
+		else
+			g_free(contents);
+	}
+	g_free(filename);
+}
+
+static void sipe_process_provisioning_v2(struct sipe_core_private *sipe_private,
+					 struct sipmsg *msg)
+{
+	const gchar *cached = sipe_private->provisioning_v2;
+
+	if (cached &&
+	    (strlen(cached) == (gsize) msg->bodylen) &&
+	    (memcmp(cached, msg->body, msg->bodylen) == 0)) {
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_process_provisioning_v2: unchanged");
+		return;
+	}
+
+	if (provisioning_v2_apply(sipe_private, msg->body, msg->bodylen)) {
+		gchar *filename = sipe_roster_cache_filename(sipe_private,
+							     PROVISIONING_V2_FILE);
+		gchar *dirname  = g_path_get_dirname(filename);
+
+		g_free(sipe_private->provisioning_v2);
+		sipe_private->provisioning_v2 = g_strndup(msg->body, msg->bodylen);
+
+		if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+		      g_file_set_contents(filename, msg->body, msg->bodylen, NULL)))
+			SIPE_DEBUG_ERROR("sipe_process_provisioning_v2: can't write '%s'",
+					 filename);
+		g_free(dirname);
+		g_free(filename);
+	}
+}
+
+static void process_incoming_notify_rlmi_resub_xml(struct sipe_core_private *sipe_private,
+						   const sipe_xml *xn_list)
 {
-	sipe_xml *xn_list;
 	const sipe_xml *xn_resource;
 	GHashTable *servers = g_hash_table_new_full(g_str_hash, g_str_equal,
 						    g_free, NULL);
 
-	xn_list = sipe_xml_parse(data, len);
-
         for (xn_resource = sipe_xml_child(xn_list, "resource");
 	     xn_resource;
 	     xn_resource = sipe_xml_twin(xn_resource) )
@@ -279,6 +338,9 @@ static void process_incoming_notify_rlmi_resub(struct sipe_core_private *sipe_pr
                 if (strstr(state, "resubscribe")) {
 			const char *poolFqdn = sipe_xml_attribute(xn_instance, "poolFqdn");
 
+			/* remembered for the next batched subscription */
+			sipe_buddy_set_pool(sipe_private, uri, poolFqdn);
+
 			if (poolFqdn) { //[MS-PRES] Section 3.4.5.1.3 Processing Details
 				gchar *user    = g_strdup(uri);
 				gchar *host    = g_strdup(poolFqdn);
@@ -297,7 +359,13 @@ static void process_incoming_notify_rlmi_resub(struct sipe_core_private *sipe_pr
 	/* Send out any deferred poolFqdn subscriptions */
 	g_hash_table_foreach(servers, (GHFunc) sipe_subscribe_poolfqdn_resource_uri, sipe_private);
 	g_hash_table_destroy(servers);
+}
 
+static void process_incoming_notify_rlmi_resub(struct sipe_core_private *sipe_private,
+					       const gchar *data, unsigned len)
+{
+	sipe_xml *xn_list = sipe_xml_parse(data, len);
+	process_incoming_notify_rlmi_resub_xml(sipe_private, xn_list);
 	sipe_xml_free(xn_list);
 }
 
@@ -342,9 +410,30 @@ sipe_update_user_phone(struct sipe_core_private *sipe_private,
 	}
 }
 
-static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private,
-					  const gchar *data,
-					  unsigned len)
+/* thread safe */
+static sipe_xml *parse_msrtc(const gchar *data, gsize len, gboolean silent)
+{
+	sipe_xml *xn_presentity;
+
+	/* fix for Reuters environment on Linux */
+	if (data && strstr(data, "encoding=\"utf-16\"")) {
+		char *tmp_data;
+		tmp_data = sipe_utils_str_replace(data, "encoding=\"utf-16\"", "encoding=\"utf-8\"");
+		xn_presentity = silent ?
+			sipe_xml_parse_silent(tmp_data, strlen(tmp_data)) :
+			sipe_xml_parse(tmp_data, strlen(tmp_data));
+		g_free(tmp_data);
+	} else {
+		xn_presentity = silent ?
+			sipe_xml_parse_silent(data, len) :
+			sipe_xml_parse(data, len);
+	}
+
+	return(xn_presentity);
+}
+
+static void process_incoming_notify_msrtc_xml(struct sipe_core_private *sipe_private,
+					      const sipe_xml *xn_presentity)
 {
 	char *activity = NULL;
 	const char *epid;
@@ -360,7 +449,6 @@ static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private
 	char *cal_free_busy_base64 = NULL;
 	struct sipe_buddy *sbuddy;
 	const sipe_xml *node;
-	sipe_xml *xn_presentity;
 	const sipe_xml *xn_availability;
 	const sipe_xml *xn_activity;
 	const sipe_xml *xn_display_name;
@@ -378,16 +466,6 @@ static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private
 	time_t user_avail_since = 0;
 	time_t activity_since = 0;
 
-	/* fix for Reuters environment on Linux */
-	if (data && strstr(data, "encoding=\"utf-16\"")) {
-		char *tmp_data;
-		tmp_data = sipe_utils_str_replace(data, "encoding=\"utf-16\"", "encoding=\"utf-8\"");
-		xn_presentity = sipe_xml_parse(tmp_data, strlen(tmp_data));
-		g_free(tmp_data);
-	} else {
-		xn_presentity = sipe_xml_parse(data, len);
-	}
-
 	xn_availability = sipe_xml_child(xn_presentity, "availability");
 	xn_activity = sipe_xml_child(xn_presentity, "activity");
 	xn_display_name = sipe_xml_child(xn_presentity, "displayName");
@@ -544,14 +622,17 @@ static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private
 	sbuddy = sipe_buddy_find_by_uri(sipe_private, uri);
 	if (sbuddy)
 	{
+		/* 2005 systems always need the extended data */
+		struct sipe_buddy_extended *ext = sipe_buddy_extended(sbuddy);
+
 		g_free(sbuddy->activity);
 		sbuddy->activity = activity;
 		activity = NULL;
 
-		sbuddy->activity_since = activity_since;
+		ext->activity_since = activity_since;
 
-		sbuddy->user_avail = user_avail;
-		sbuddy->user_avail_since = user_avail_since;
+		ext->user_avail = user_avail;
+		ext->user_avail_since = user_avail_since;
 
 		g_free(sbuddy->note);
 		sbuddy->note = NULL;
@@ -559,27 +640,20 @@ static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private
 
 		sbuddy->is_oof_note = (xn_oof != NULL);
 
-		g_free(sbuddy->device_name);
-		sbuddy->device_name = NULL;
-		if (!is_empty(device_name)) { sbuddy->device_name = g_strdup(device_name); }
+		g_free(ext->device_name);
+		ext->device_name = NULL;
+		if (!is_empty(device_name)) { ext->device_name = g_strdup(device_name); }
 
 		if (!is_empty(cal_free_busy_base64)) {
-			g_free(sbuddy->cal_start_time);
-			sbuddy->cal_start_time = g_strdup(cal_start_time);
-
-			sbuddy->cal_granularity = sipe_strcase_equal(cal_granularity, "PT15M") ? 15 : 0;
-
-			g_free(sbuddy->cal_free_busy_base64);
-			sbuddy->cal_free_busy_base64 = cal_free_busy_base64;
-			cal_free_busy_base64 = NULL;
-
-			g_free(sbuddy->cal_free_busy);
-			sbuddy->cal_free_busy = NULL;
+			sipe_cal_set_free_busy(sbuddy,
+					       cal_start_time,
+					       cal_granularity,
+					       cal_free_busy_base64);
 		}
 
-		sbuddy->last_non_cal_status_id = status_id;
-		g_free(sbuddy->last_non_cal_activity);
-		sbuddy->last_non_cal_activity = g_strdup(sbuddy->activity);
+		ext->last_non_cal_status_id = status_id;
+		g_free(ext->last_non_cal_activity);
+		ext->last_non_cal_activity = g_strdup(sbuddy->activity);
 
 		if (sipe_strcase_equal(sbuddy->name, self_uri)) {
 			if (!sipe_strequal(sbuddy->note, sipe_private->note)) /* not same */
@@ -596,379 +670,542 @@ static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private
 			}
 
 			sipe_status_set_token(sipe_private,
-					      sbuddy->last_non_cal_status_id);
+					      ext->last_non_cal_status_id);
 		}
 	}
 	g_free(cal_free_busy_base64);
 	g_free(activity);
 
 	SIPE_DEBUG_INFO("process_incoming_notify_msrtc: status(%s)", status_id);
-	sipe_core_buddy_got_status(SIPE_CORE_PUBLIC, uri,
-				   sipe_status_token_to_activity(status_id));
+	sipe_buddy_got_status(sipe_private, uri,
+			      sipe_status_token_to_activity(status_id));
 
 	if (!SIPE_CORE_PRIVATE_FLAG_IS(OCS2007) && sipe_strcase_equal(self_uri, uri)) {
 		sipe_ocs2005_user_info_has_updated(sipe_private, xn_userinfo);
 	}
 
 	g_free(note);
-	sipe_xml_free(xn_presentity);
 	g_free(uri);
 	g_free(self_uri);
 }
 
-static void process_incoming_notify_rlmi(struct sipe_core_private *sipe_private,
-					 const gchar *data,
-					 unsigned len)
+static void process_incoming_notify_msrtc(struct sipe_core_private *sipe_private,
+					  const gchar *data,
+					  unsigned len)
 {
-	const char *uri;
-	struct sipe_buddy *sbuddy = NULL;
-	sipe_xml *xn_categories;
-	const sipe_xml *xn_category;
-	const char *status = NULL;
-	gboolean do_update_status = FALSE;
-	gboolean has_note_cleaned = FALSE;
-	gboolean has_free_busy_cleaned = FALSE;
+	sipe_xml *xn_presentity = parse_msrtc(data, len, FALSE);
+	process_incoming_notify_msrtc_xml(sipe_private, xn_presentity);
+	sipe_xml_free(xn_presentity);
+}
+
+/* state while streaming a categories document */
+struct rlmi_categories {
+	struct sipe_core_private *sipe_private;
+	struct sipe_buddy *sbuddy;
+	gchar *uri;
+	const char *status;
+	gboolean do_update_status;
+	gboolean has_note_cleaned;
+	gboolean has_free_busy_cleaned;
+	GSList *applied;  /* names of categories applied from this document */
+	gboolean skipped; /* unchanged categories were skipped */
+};
+
+static void process_incoming_notify_rlmi_categories(const sipe_xml *xn_categories,
+						    gpointer user_data)
+{
+	struct rlmi_categories *ctx = user_data;
+	const char *uri = sipe_xml_attribute(xn_categories, "uri"); /* with 'sip:' prefix */
 
-	xn_categories = sipe_xml_parse(data, len);
-	uri = sipe_xml_attribute(xn_categories, "uri"); /* with 'sip:' prefix */
 	if (uri) {
-		sbuddy = sipe_buddy_find_by_uri(sipe_private, uri);
+		ctx->uri    = g_strdup(uri);
+		ctx->sbuddy = sipe_buddy_find_by_uri(ctx->sipe_private, uri);
 	}
+}
 
-	if (!sbuddy) {
-		/* Got presence of a buddy not in our contact list, ignore. */
-		sipe_xml_free(xn_categories);
+/* state category paths: matched for every presence update */
+static sipe_xml_path rlmi_path_state            = SIPE_XML_PATH("state");
+static sipe_xml_path rlmi_path_availability     = SIPE_XML_PATH("availability");
+static sipe_xml_path rlmi_path_activity         = SIPE_XML_PATH("activity");
+static sipe_xml_path rlmi_path_custom           = SIPE_XML_PATH("custom");
+static sipe_xml_path rlmi_path_device           = SIPE_XML_PATH("device");
+static sipe_xml_path rlmi_path_meeting_subject  = SIPE_XML_PATH("meetingSubject");
+static sipe_xml_path rlmi_path_meeting_location = SIPE_XML_PATH("meetingLocation");
+
+static void process_incoming_notify_rlmi_category(const sipe_xml *xn_category,
+						  gpointer user_data)
+{
+	struct rlmi_categories *ctx = user_data;
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+	struct sipe_buddy *sbuddy = ctx->sbuddy;
+	const char *uri = ctx->uri;
+	const sipe_xml *xn_node;
+	const char *tmp;
+	const char *attrVar;
+	time_t publish_time;
+
+	/* Got presence of a buddy not in our contact list, ignore. */
+	if (!sbuddy)
 		return;
-	}
 
-	for (xn_category = sipe_xml_child(xn_categories, "category");
-		 xn_category ;
-		 xn_category = sipe_xml_twin(xn_category) )
+	attrVar = sipe_xml_attribute(xn_category, "name");
+	publish_time = (tmp = sipe_xml_attribute(xn_category, "publishTime")) ?
+		sipe_utils_str_to_time(tmp) : 0;
+
+	/* contactCard */
+	if (sipe_strequal(attrVar, "contactCard"))
 	{
-		const sipe_xml *xn_node;
-		const char *tmp;
-		const char *attrVar = sipe_xml_attribute(xn_category, "name");
-		time_t publish_time = (tmp = sipe_xml_attribute(xn_category, "publishTime")) ?
-			sipe_utils_str_to_time(tmp) : 0;
-
-		/* contactCard */
-		if (sipe_strequal(attrVar, "contactCard"))
-		{
-			const sipe_xml *card = sipe_xml_child(xn_category, "contactCard");
-
-			if (card) {
-				const sipe_xml *node;
-				/* identity - Display Name and email */
-				node = sipe_xml_child(card, "identity");
-				if (node) {
-					char* display_name = sipe_xml_data(
-						sipe_xml_child(node, "name/displayName"));
-					char* email = sipe_xml_data(
-						sipe_xml_child(node, "email"));
-
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_DISPLAY_NAME, display_name);
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_EMAIL, email);
-
-					g_free(display_name);
-					g_free(email);
-				}
-				/* company */
-				node = sipe_xml_child(card, "company");
-				if (node) {
-					char* company = sipe_xml_data(node);
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_COMPANY, company);
-					g_free(company);
-				}
-				/* department */
-				node = sipe_xml_child(card, "department");
-				if (node) {
-					char* department = sipe_xml_data(node);
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_DEPARTMENT, department);
-					g_free(department);
-				}
-				/* title */
-				node = sipe_xml_child(card, "title");
-				if (node) {
-					char* title = sipe_xml_data(node);
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_JOB_TITLE, title);
-					g_free(title);
-				}
-				/* office */
-				node = sipe_xml_child(card, "office");
-				if (node) {
-					char* office = sipe_xml_data(node);
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_OFFICE, office);
-					g_free(office);
-				}
-				/* site (url) */
-				node = sipe_xml_child(card, "url");
-				if (node) {
-					char* site = sipe_xml_data(node);
-					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_SITE, site);
-					g_free(site);
-				}
-				/* phone */
-				for (node = sipe_xml_child(card, "phone");
-				     node;
-				     node = sipe_xml_twin(node))
-				{
-					const char *phone_type = sipe_xml_attribute(node, "type");
-					char* phone = sipe_xml_data(sipe_xml_child(node, "uri"));
-					char* phone_display_string = sipe_xml_data(sipe_xml_child(node, "displayString"));
-
-					sipe_update_user_phone(sipe_private, uri, phone_type, phone, phone_display_string);
-
-					g_free(phone);
-					g_free(phone_display_string);
+		const sipe_xml *card = sipe_xml_child(xn_category, "contactCard");
+
+		if (card) {
+			const sipe_xml *node;
+			/* identity - Display Name and email */
+			node = sipe_xml_child(card, "identity");
+			if (node) {
+				char* display_name = sipe_xml_data(
+					sipe_xml_child(node, "name/displayName"));
+				char* email = sipe_xml_data(
+					sipe_xml_child(node, "email"));
+
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_DISPLAY_NAME, display_name);
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_EMAIL, email);
+
+				g_free(display_name);
+				g_free(email);
+			}
+			/* company */
+			node = sipe_xml_child(card, "company");
+			if (node) {
+				char* company = sipe_xml_data(node);
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_COMPANY, company);
+				g_free(company);
+			}
+			/* department */
+			node = sipe_xml_child(card, "department");
+			if (node) {
+				char* department = sipe_xml_data(node);
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_DEPARTMENT, department);
+				g_free(department);
+			}
+			/* title */
+			node = sipe_xml_child(card, "title");
+			if (node) {
+				char* title = sipe_xml_data(node);
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_JOB_TITLE, title);
+				g_free(title);
+			}
+			/* office */
+			node = sipe_xml_child(card, "office");
+			if (node) {
+				char* office = sipe_xml_data(node);
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_OFFICE, office);
+				g_free(office);
+			}
+			/* site (url) */
+			node = sipe_xml_child(card, "url");
+			if (node) {
+				char* site = sipe_xml_data(node);
+				sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_SITE, site);
+				g_free(site);
+			}
+			/* phone */
+			for (node = sipe_xml_child(card, "phone");
+			     node;
+			     node = sipe_xml_twin(node))
+			{
+				const char *phone_type = sipe_xml_attribute(node, "type");
+				char* phone = sipe_xml_data(sipe_xml_child(node, "uri"));
+				char* phone_display_string = sipe_xml_data(sipe_xml_child(node, "displayString"));
+
+				sipe_update_user_phone(sipe_private, uri, phone_type, phone, phone_display_string);
+
+				g_free(phone);
+				g_free(phone_display_string);
+			}
+			/* address */
+			for (node = sipe_xml_child(card, "address");
+			     node;
+			     node = sipe_xml_twin(node))
+			{
+				if (sipe_strequal(sipe_xml_attribute(node, "type"), "work")) {
+					char* street = sipe_xml_data(sipe_xml_child(node, "street"));
+					char* city = sipe_xml_data(sipe_xml_child(node, "city"));
+					char* state = sipe_xml_data(sipe_xml_child(node, "state"));
+					char* zipcode = sipe_xml_data(sipe_xml_child(node, "zipcode"));
+					char* country_code = sipe_xml_data(sipe_xml_child(node, "countryCode"));
+
+					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_STREET, street);
+					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_CITY, city);
+					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_STATE, state);
+					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_ZIPCODE, zipcode);
+					sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_COUNTRY, country_code);
+
+					g_free(street);
+					g_free(city);
+					g_free(state);
+					g_free(zipcode);
+					g_free(country_code);
+
+					break;
 				}
-				/* address */
-				for (node = sipe_xml_child(card, "address");
-				     node;
-				     node = sipe_xml_twin(node))
-				{
-					if (sipe_strequal(sipe_xml_attribute(node, "type"), "work")) {
-						char* street = sipe_xml_data(sipe_xml_child(node, "street"));
-						char* city = sipe_xml_data(sipe_xml_child(node, "city"));
-						char* state = sipe_xml_data(sipe_xml_child(node, "state"));
-						char* zipcode = sipe_xml_data(sipe_xml_child(node, "zipcode"));
-						char* country_code = sipe_xml_data(sipe_xml_child(node, "countryCode"));
-
-						sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_STREET, street);
-						sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_CITY, city);
-						sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_STATE, state);
-						sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_ZIPCODE, zipcode);
-						sipe_buddy_update_property(sipe_private, uri, SIPE_BUDDY_INFO_COUNTRY, country_code);
-
-						g_free(street);
-						g_free(city);
-						g_free(state);
-						g_free(zipcode);
-						g_free(country_code);
-
-						break;
-					}
+			}
+			/* photo */
+			for (node = sipe_xml_child(card, "photo");
+			     node;
+			     node = sipe_xml_twin(node)) {
+				gchar *photo_url = sipe_xml_data(sipe_xml_child(node, "uri"));
+				gchar *hash = sipe_xml_data(sipe_xml_child(node, "hash"));
+				gboolean found = FALSE;
+
+				if (!is_empty(uri) && !is_empty(hash)) {
+					sipe_buddy_update_photo(sipe_private,
+								uri,
+								hash,
+								photo_url,
+								NULL);
+					found = TRUE;
 				}
-				/* photo */
-				for (node = sipe_xml_child(card, "photo");
-				     node;
-				     node = sipe_xml_twin(node)) {
-					gchar *photo_url = sipe_xml_data(sipe_xml_child(node, "uri"));
-					gchar *hash = sipe_xml_data(sipe_xml_child(node, "hash"));
-					gboolean found = FALSE;
-
-					if (!is_empty(uri) && !is_empty(hash)) {
-						sipe_buddy_update_photo(sipe_private,
-									uri,
-									hash,
-									photo_url,
-									NULL);
-						found = TRUE;
-					}
 
-					g_free(hash);
-					g_free(photo_url);
+				g_free(hash);
+				g_free(photo_url);
 
-					if (found)
-						break;
-				}
+				if (found)
+					break;
 			}
 		}
-		/* note */
-		else if (sipe_strequal(attrVar, "note"))
-		{
-			if (!has_note_cleaned) {
-				has_note_cleaned = TRUE;
+	}
+	/* note */
+	else if (sipe_strequal(attrVar, "note"))
+	{
+		if (!ctx->has_note_cleaned) {
+			ctx->has_note_cleaned = TRUE;
 
-				g_free(sbuddy->note);
-				sbuddy->note = NULL;
-				sbuddy->is_oof_note = FALSE;
+			g_free(sbuddy->note);
+			sbuddy->note = NULL;
+			sbuddy->is_oof_note = FALSE;
+			sbuddy->note_since = publish_time;
+
+			ctx->do_update_status = TRUE;
+		}
+		if (publish_time >= sbuddy->note_since) {
+			/* clean up in case no 'note' element is supplied
+			 * which indicate note removal in client
+			 */
+			g_free(sbuddy->note);
+			sbuddy->note = NULL;
+			sbuddy->is_oof_note = FALSE;
+			sbuddy->note_since = publish_time;
+
+			xn_node = sipe_xml_child(xn_category, "note/body");
+			if (xn_node) {
+				char *tmp;
+				sbuddy->note = g_markup_escape_text((tmp = sipe_xml_data(xn_node)), -1);
+				g_free(tmp);
+				sbuddy->is_oof_note = sipe_strequal(sipe_xml_attribute(xn_node, "type"), "OOF");
 				sbuddy->note_since = publish_time;
 
-				do_update_status = TRUE;
+				SIPE_DEBUG_INFO("process_incoming_notify_rlmi: uri(%s), note(%s)",
+						uri, sbuddy->note ? sbuddy->note : "");
 			}
-			if (publish_time >= sbuddy->note_since) {
-				/* clean up in case no 'note' element is supplied
-				 * which indicate note removal in client
-				 */
-				g_free(sbuddy->note);
-				sbuddy->note = NULL;
-				sbuddy->is_oof_note = FALSE;
-				sbuddy->note_since = publish_time;
+			/* to trigger UI refresh in case no status info is supplied in this update */
+			ctx->do_update_status = TRUE;
+		}
+	}
+	/* state */
+	else if(sipe_strequal(attrVar, "state"))
+	{
+		int availability;
+		const sipe_xml *xn_availability;
+		const sipe_xml *xn_activity;
+		const sipe_xml *xn_device;
+		const sipe_xml *xn_meeting_subject;
+		const sipe_xml *xn_meeting_location;
+		const gchar *legacy_activity;
+
+		xn_node = sipe_xml_child_path(xn_category, &rlmi_path_state);
+		if (!xn_node) return;
+		xn_availability = sipe_xml_child_path(xn_node, &rlmi_path_availability);
+		if (!xn_availability) return;
+		xn_activity = sipe_xml_child_path(xn_node, &rlmi_path_activity);
+		xn_meeting_subject = sipe_xml_child_path(xn_node, &rlmi_path_meeting_subject);
+		xn_meeting_location = sipe_xml_child_path(xn_node, &rlmi_path_meeting_location);
+
+		availability = sipe_xml_data_int(xn_availability, 0);
+
+		sbuddy->is_mobile = FALSE;
+		xn_device = sipe_xml_child_path(xn_node, &rlmi_path_device);
+		if (xn_device) {
+			const gchar *device = sipe_xml_data_view(xn_device, NULL);
+			sbuddy->is_mobile = device && !g_ascii_strcasecmp(device, "Mobile");
+		}
 
-				xn_node = sipe_xml_child(xn_category, "note/body");
-				if (xn_node) {
-					char *tmp;
-					sbuddy->note = g_markup_escape_text((tmp = sipe_xml_data(xn_node)), -1);
-					g_free(tmp);
-					sbuddy->is_oof_note = sipe_strequal(sipe_xml_attribute(xn_node, "type"), "OOF");
-					sbuddy->note_since = publish_time;
+		/* activity */
+		g_free(sbuddy->activity);
+		sbuddy->activity = NULL;
+		if (xn_activity) {
+			const char *token = sipe_xml_attribute(xn_activity, "token");
+			const sipe_xml *xn_custom = sipe_xml_child_path(xn_activity, &rlmi_path_custom);
+
+			/* from token */
+			if (!is_empty(token)) {
+				sbuddy->activity = g_strdup(sipe_core_activity_description(sipe_status_token_to_activity(token)));
+			}
+			/* from custom element */
+			if (xn_custom) {
+				const gchar *custom = sipe_xml_data_view(xn_custom, NULL);
 
-					SIPE_DEBUG_INFO("process_incoming_notify_rlmi: uri(%s), note(%s)",
-							uri, sbuddy->note ? sbuddy->note : "");
+				if (!is_empty(custom)) {
+					g_free(sbuddy->activity);
+					sbuddy->activity = g_strdup(custom);
 				}
-				/* to trigger UI refresh in case no status info is supplied in this update */
-				do_update_status = TRUE;
 			}
 		}
-		/* state */
-		else if(sipe_strequal(attrVar, "state"))
-		{
-			char *tmp;
-			int availability;
-			const sipe_xml *xn_availability;
-			const sipe_xml *xn_activity;
-			const sipe_xml *xn_device;
-			const sipe_xml *xn_meeting_subject;
-			const sipe_xml *xn_meeting_location;
-			const gchar *legacy_activity;
-
-			xn_node = sipe_xml_child(xn_category, "state");
-			if (!xn_node) continue;
-			xn_availability = sipe_xml_child(xn_node, "availability");
-			if (!xn_availability) continue;
-			xn_activity = sipe_xml_child(xn_node, "activity");
-			xn_meeting_subject = sipe_xml_child(xn_node, "meetingSubject");
-			xn_meeting_location = sipe_xml_child(xn_node, "meetingLocation");
-
-			tmp = sipe_xml_data(xn_availability);
-			availability = atoi(tmp);
-			g_free(tmp);
-
-			sbuddy->is_mobile = FALSE;
-			xn_device = sipe_xml_child(xn_node, "device");
-			if (xn_device) {
-				tmp = sipe_xml_data(xn_device);
-				sbuddy->is_mobile = !g_ascii_strcasecmp(tmp, "Mobile");
-				g_free(tmp);
-			}
+		/* meeting_subject & meeting_location */
+		if (sbuddy->ext) {
+			g_free(sbuddy->ext->meeting_subject);
+			sbuddy->ext->meeting_subject = NULL;
+			g_free(sbuddy->ext->meeting_location);
+			sbuddy->ext->meeting_location = NULL;
+		}
+		if (xn_meeting_subject) {
+			const gchar *meeting_subject = sipe_xml_data_view(xn_meeting_subject, NULL);
 
-			/* activity */
-			g_free(sbuddy->activity);
-			sbuddy->activity = NULL;
-			if (xn_activity) {
-				const char *token = sipe_xml_attribute(xn_activity, "token");
-				const sipe_xml *xn_custom = sipe_xml_child(xn_activity, "custom");
+			if (!is_empty(meeting_subject))
+				sipe_buddy_extended(sbuddy)->meeting_subject = g_strdup(meeting_subject);
+		}
+		if (xn_meeting_location) {
+			const gchar *meeting_location = sipe_xml_data_view(xn_meeting_location, NULL);
 
-				/* from token */
-				if (!is_empty(token)) {
-					sbuddy->activity = g_strdup(sipe_core_activity_description(sipe_status_token_to_activity(token)));
-				}
-				/* from custom element */
-				if (xn_custom) {
-					char *custom = sipe_xml_data(xn_custom);
-
-					if (!is_empty(custom)) {
-						g_free(sbuddy->activity);
-						sbuddy->activity = custom;
-						custom = NULL;
-					}
-					g_free(custom);
-				}
-			}
-			/* meeting_subject */
-			g_free(sbuddy->meeting_subject);
-			sbuddy->meeting_subject = NULL;
-			if (xn_meeting_subject) {
-				char *meeting_subject = sipe_xml_data(xn_meeting_subject);
-
-				if (!is_empty(meeting_subject)) {
-					sbuddy->meeting_subject = meeting_subject;
-					meeting_subject = NULL;
-				}
-				g_free(meeting_subject);
-			}
-			/* meeting_location */
-			g_free(sbuddy->meeting_location);
-			sbuddy->meeting_location = NULL;
-			if (xn_meeting_location) {
-				char *meeting_location = sipe_xml_data(xn_meeting_location);
-
-				if (!is_empty(meeting_location)) {
-					sbuddy->meeting_location = meeting_location;
-					meeting_location = NULL;
-				}
-				g_free(meeting_location);
+			if (!is_empty(meeting_location))
+				sipe_buddy_extended(sbuddy)->meeting_location = g_strdup(meeting_location);
+		}
+
+		ctx->status = sipe_ocs2007_status_from_legacy_availability(availability, NULL);
+		legacy_activity = sipe_ocs2007_legacy_activity_description(availability);
+		if (sbuddy->activity && legacy_activity) {
+			gchar *tmp2 = sbuddy->activity;
+
+			sbuddy->activity = g_strdup_printf("%s, %s", sbuddy->activity, legacy_activity);
+			g_free(tmp2);
+		} else if (legacy_activity) {
+			sbuddy->activity = g_strdup(legacy_activity);
+		}
+
+		ctx->do_update_status = TRUE;
+	}
+	/* calendarData */
+	else if(sipe_strequal(attrVar, "calendarData"))
+	{
+		const sipe_xml *xn_free_busy = sipe_xml_child(xn_category, "calendarData/freeBusy");
+		const sipe_xml *xn_working_hours = sipe_xml_child(xn_category, "calendarData/WorkingHours");
+
+		if (xn_free_busy) {
+			struct sipe_buddy_extended *ext = sipe_buddy_extended(sbuddy);
+
+			if (!ctx->has_free_busy_cleaned) {
+				ctx->has_free_busy_cleaned = TRUE;
+
+				sipe_cal_set_free_busy(sbuddy, NULL, NULL, NULL);
+
+				ext->cal_free_busy_published = publish_time;
 			}
 
-			status = sipe_ocs2007_status_from_legacy_availability(availability, NULL);
-			legacy_activity = sipe_ocs2007_legacy_activity_description(availability);
-			if (sbuddy->activity && legacy_activity) {
-				gchar *tmp2 = sbuddy->activity;
+			if (publish_time >= ext->cal_free_busy_published) {
+				gchar *free_busy_base64 = sipe_xml_data(xn_free_busy);
+				const gchar *start_time = sipe_xml_attribute(xn_free_busy, "startTime");
+				const gchar *granularity = sipe_xml_attribute(xn_free_busy, "granularity");
+
+				sipe_cal_set_free_busy(sbuddy,
+						       start_time,
+						       granularity,
+						       free_busy_base64);
+
+				ext->cal_free_busy_published = publish_time;
 
-				sbuddy->activity = g_strdup_printf("%s, %s", sbuddy->activity, legacy_activity);
-				g_free(tmp2);
-			} else if (legacy_activity) {
-				sbuddy->activity = g_strdup(legacy_activity);
+				SIPE_DEBUG_INFO("process_incoming_notify_rlmi: startTime=%s granularity=%s cal_free_busy_base64=\n%s",
+						start_time ? start_time : "",
+						granularity ? granularity : "",
+						free_busy_base64 ? free_busy_base64 : "");
+				g_free(free_busy_base64);
 			}
+		}
 
-			do_update_status = TRUE;
+		if (xn_working_hours) {
+			sipe_cal_parse_working_hours(xn_working_hours, sbuddy);
 		}
-		/* calendarData */
-		else if(sipe_strequal(attrVar, "calendarData"))
-		{
-			const sipe_xml *xn_free_busy = sipe_xml_child(xn_category, "calendarData/freeBusy");
-			const sipe_xml *xn_working_hours = sipe_xml_child(xn_category, "calendarData/WorkingHours");
+	}
+}
 
-			if (xn_free_busy) {
-				if (!has_free_busy_cleaned) {
-					has_free_busy_cleaned = TRUE;
+static gboolean rlmi_category_applied(struct rlmi_categories *ctx,
+				      const gchar *name)
+{
+	GSList *entry;
 
-					g_free(sbuddy->cal_start_time);
-					sbuddy->cal_start_time = NULL;
+	for (entry = ctx->applied; entry; entry = entry->next)
+		if (sipe_strequal(entry->data, name))
+			return(TRUE);
+	return(FALSE);
+}
 
-					g_free(sbuddy->cal_free_busy_base64);
-					sbuddy->cal_free_busy_base64 = NULL;
+/*
+ * With MPOP each update of a buddy resends all category instances, also
+ * those that didn't change. Instances with the same raw XML as last time
+ * are skipped before their subtree is built.
+ *
+ * An instance is never skipped after another instance of the same category
+ * has been applied from this document: the instances are merged in order,
+ * e.g. the last "state" wins.
+ */
+static gboolean process_incoming_notify_rlmi_filter(const sipe_xml *xn_category,
+						    guint hash,
+						    gpointer user_data)
+{
+	struct rlmi_categories *ctx = user_data;
+	const gchar *name = sipe_xml_attribute(xn_category, "name");
+	const gchar *instance;
+	const gchar *container;
+	struct sipe_buddy_extended *ext;
+	gchar *key;
+
+	/* Got presence of a buddy not in our contact list, ignore. */
+	if (!ctx->sbuddy)
+		return(FALSE);
+
+	if (!name)
+		return(TRUE);
+
+	instance  = sipe_xml_attribute(xn_category, "instance");
+	container = sipe_xml_attribute(xn_category, "container");
+	key = g_strdup_printf("%s/%s/%s",
+			      name,
+			      instance ? instance : "",
+			      container ? container : "");
+	ext = sipe_buddy_extended(ctx->sbuddy);
+	if (!ext->category_hashes)
+		ext->category_hashes = g_hash_table_new_full(g_str_hash,
+							     g_str_equal,
+							     g_free,
+							     NULL);
+
+	if (hash &&
+	    (GPOINTER_TO_UINT(g_hash_table_lookup(ext->category_hashes, key)) == hash) &&
+	    !rlmi_category_applied(ctx, name)) {
+		ctx->skipped = TRUE;
+
+		/* a changed instance later on is merged by publish time */
+		if (sipe_strequal(name, "note"))
+			ctx->has_note_cleaned = TRUE;
+		else if (sipe_strequal(name, "calendarData"))
+			ctx->has_free_busy_cleaned = TRUE;
+
+		g_free(key);
+		return(FALSE);
+	}
+
+	if (hash) {
+		g_hash_table_insert(ext->category_hashes, key,
+				    GUINT_TO_POINTER(hash));
+	} else {
+		g_hash_table_remove(ext->category_hashes, key);
+		g_free(key);
+	}
+	if (!rlmi_category_applied(ctx, name))
+		ctx->applied = g_slist_prepend(ctx->applied, g_strdup(name));
 
-					g_free(sbuddy->cal_free_busy);
-					sbuddy->cal_free_busy = NULL;
+	return(TRUE);
+}
 
-					sbuddy->cal_free_busy_published = publish_time;
-				}
+static const struct sipe_xml_stream_handler rlmi_categories_handlers[] = {
+	{ "categories",          process_incoming_notify_rlmi_categories, NULL, NULL },
+	{ "categories/category", NULL, process_incoming_notify_rlmi_category,
+	  process_incoming_notify_rlmi_filter },
+	{ NULL,                  NULL, NULL, NULL }
+};
+
+static void process_incoming_notify_rlmi_done(struct rlmi_categories *ctx);
 
-				if (publish_time >= sbuddy->cal_free_busy_published) {
-					g_free(sbuddy->cal_start_time);
-					sbuddy->cal_start_time = g_strdup(sipe_xml_attribute(xn_free_busy, "startTime"));
+static void process_incoming_notify_rlmi(struct sipe_core_private *sipe_private,
+					 const gchar *data,
+					 unsigned len)
+{
+	struct rlmi_categories ctx;
 
-					sbuddy->cal_granularity = sipe_strcase_equal(sipe_xml_attribute(xn_free_busy, "granularity"), "PT15M") ?
-						15 : 0;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.sipe_private = sipe_private;
 
-					g_free(sbuddy->cal_free_busy_base64);
-					sbuddy->cal_free_busy_base64 = sipe_xml_data(xn_free_busy);
+	/* categories are processed while parsing */
+	sipe_xml_stream_parse(data, len, rlmi_categories_handlers, &ctx);
+	process_incoming_notify_rlmi_done(&ctx);
+}
 
-					g_free(sbuddy->cal_free_busy);
-					sbuddy->cal_free_busy = NULL;
+/* same as process_incoming_notify_rlmi() for a parsed document */
+static void process_incoming_notify_rlmi_xml(struct sipe_core_private *sipe_private,
+					     const sipe_xml *xn_categories)
+{
+	struct rlmi_categories ctx;
+	const sipe_xml *xn_category;
 
-					sbuddy->cal_free_busy_published = publish_time;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.sipe_private = sipe_private;
 
-					SIPE_DEBUG_INFO("process_incoming_notify_rlmi: startTime=%s granularity=%d cal_free_busy_base64=\n%s", sbuddy->cal_start_time, sbuddy->cal_granularity, sbuddy->cal_free_busy_base64);
-				}
-			}
+	if (sipe_strequal(sipe_xml_name(xn_categories), "categories")) {
+		process_incoming_notify_rlmi_categories(xn_categories, &ctx);
+		for (xn_category = sipe_xml_child(xn_categories, "category");
+		     xn_category;
+		     xn_category = sipe_xml_twin(xn_category))
+			process_incoming_notify_rlmi_category(xn_category, &ctx);
 
-			if (xn_working_hours) {
-				sipe_cal_parse_working_hours(xn_working_hours, sbuddy);
-			}
-		}
+		/* raw XML of the applied categories is unknown */
+		if (ctx.sbuddy && ctx.sbuddy->ext &&
+		    ctx.sbuddy->ext->category_hashes)
+			g_hash_table_remove_all(ctx.sbuddy->ext->category_hashes);
+	}
+	process_incoming_notify_rlmi_done(&ctx);
+}
+
+static void process_incoming_notify_rlmi_done(struct rlmi_categories *ctx)
+{
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+	const char *uri = ctx->uri;
+	gboolean unchanged = ctx->skipped && !ctx->applied;
+
+	sipe_utils_slist_free_full(ctx->applied, g_free);
+
+	if (!ctx->sbuddy) {
+		/* Got presence of a buddy not in our contact list, ignore. */
+		g_free(ctx->uri);
+		return;
+	}
+
+	/* nothing to tell the backend */
+	if (unchanged) {
+		SIPE_DEBUG_INFO("process_incoming_notify_rlmi: %s unchanged", uri);
+		g_free(ctx->uri);
+		return;
 	}
 
-	if (do_update_status) {
+	if (ctx->do_update_status) {
 		guint activity;
 
-		if (status) {
-			SIPE_DEBUG_INFO("process_incoming_notify_rlmi: %s", status);
-			activity = sipe_status_token_to_activity(status);
+		if (ctx->status) {
+			SIPE_DEBUG_INFO("process_incoming_notify_rlmi: %s", ctx->status);
+			activity = sipe_status_token_to_activity(ctx->status);
 		} else {
 			/* no status category in this update,
 			   using contact's current status */
-			activity = sipe_backend_buddy_get_status(SIPE_CORE_PUBLIC,
-								 uri);
+			activity = sipe_buddy_get_status(sipe_private, uri);
 		}
 
-		sipe_core_buddy_got_status(SIPE_CORE_PUBLIC, uri, activity);
+		sipe_buddy_got_status(sipe_private, uri, activity);
 	}
 
 	sipe_backend_buddy_refresh_properties(SIPE_CORE_PUBLIC, uri);
 
-	sipe_xml_free(xn_categories);
+	/* new free/busy data: refresh again at next calendar transition */
+	if (ctx->has_free_busy_cleaned)
+		sipe_cal_schedule_transition(sipe_private, ctx->sbuddy);
+
+	g_free(ctx->uri);
 }
 
 static void sipe_buddy_status_from_activity(struct sipe_core_private *sipe_private,
@@ -993,11 +1230,11 @@ static void sipe_buddy_status_from_activity(struct sipe_core_private *sipe_priva
 		}
 
 		SIPE_DEBUG_INFO("sipe_buddy_status_from_activity: status_id(%s)", status_id);
-		sipe_core_buddy_got_status(SIPE_CORE_PUBLIC, uri,
-					   sipe_status_token_to_activity(status_id));
+		sipe_buddy_got_status(sipe_private, uri,
+				      sipe_status_token_to_activity(status_id));
 	} else {
-		sipe_core_buddy_got_status(SIPE_CORE_PUBLIC, uri,
-					   SIPE_ACTIVITY_OFFLINE);
+		sipe_buddy_got_status(sipe_private, uri,
+				      SIPE_ACTIVITY_OFFLINE);
 	}
 }
 
@@ -1006,7 +1243,7 @@ static void process_incoming_notify_pidf(struct sipe_core_private *sipe_private,
 					 unsigned len)
 {
 	gchar *uri;
-	gchar *getbasic;
+	const gchar *getbasic;
 	gchar *activity = NULL;
 	sipe_xml *pidf;
 	const sipe_xml *basicstatus = NULL, *tuple, *status;
@@ -1032,7 +1269,7 @@ static void process_incoming_notify_pidf(struct sipe_core_private *sipe_private,
 		return;
 	}
 
-	getbasic = sipe_xml_data(basicstatus);
+	getbasic = sipe_xml_data_view(basicstatus, NULL);
 	if (!getbasic) {
 		SIPE_DEBUG_INFO_NOFORMAT("process_incoming_notify_pidf: no basic data found");
 		sipe_xml_free(pidf);
@@ -1043,7 +1280,6 @@ static void process_incoming_notify_pidf(struct sipe_core_private *sipe_private,
 	if (strstr(getbasic, "open")) {
 		isonline = TRUE;
 	}
-	g_free(getbasic);
 
 	uri = sip_uri(sipe_xml_attribute(pidf, "entity")); /* with 'sip:' prefix */ /* AOL comes without the prefix */
 
@@ -1078,26 +1314,65 @@ static void process_incoming_notify_pidf(struct sipe_core_private *sipe_private,
 	sipe_xml_free(pidf);
 }
 
+/* worker thread */
+sipe_xml *sipe_notify_presence_parse(enum sipe_presence_part_type type,
+				     const gchar *body,
+				     gsize length)
+{
+	return((type == SIPE_PRESENCE_PART_MSRTC) ?
+	       parse_msrtc(body, length, TRUE) :
+	       sipe_xml_parse_silent(body, length));
+}
+
+void sipe_notify_presence_apply(struct sipe_core_private *sipe_private,
+				enum sipe_presence_part_type type,
+				const gchar *body,
+				gsize length,
+				const sipe_xml *xml)
+{
+	switch (type) {
+	case SIPE_PRESENCE_PART_RESUB:
+		if (xml)
+			process_incoming_notify_rlmi_resub_xml(sipe_private, xml);
+		else
+			process_incoming_notify_rlmi_resub(sipe_private, body, length);
+		break;
+	case SIPE_PRESENCE_PART_MSRTC:
+		if (xml)
+			process_incoming_notify_msrtc_xml(sipe_private, xml);
+		else
+			process_incoming_notify_msrtc(sipe_private, body, length);
+		break;
+	case SIPE_PRESENCE_PART_CATEGORIES:
+		if (xml)
+			process_incoming_notify_rlmi_xml(sipe_private, xml);
+		else
+			process_incoming_notify_rlmi(sipe_private, body, length);
+		break;
+	case SIPE_PRESENCE_PART_PIDF:
+		process_incoming_notify_pidf(sipe_private, body, length);
+		break;
+	}
+}
+
 static void sipe_presence_mime_cb(gpointer user_data, /* sipe_core_private */
 				  const GSList *fields,
 				  const gchar *body,
 				  gsize length)
 {
-	const gchar *type = sipe_utils_nameval_find(fields, "Content-Type");
-
-	if (strstr(type,"application/rlmi+xml")) {
-		process_incoming_notify_rlmi_resub(user_data, body, length);
-	} else if (strstr(type, "text/xml+msrtc.pidf")) {
-		process_incoming_notify_msrtc(user_data, body, length);
-	} else {
-		process_incoming_notify_rlmi(user_data, body, length);
-	}
+	sipe_notify_presence_apply(user_data,
+				   sipe_presence_part_type(sipe_utils_nameval_find(fields,
+										   "Content-Type")),
+				   body,
+				   length,
+				   NULL);
 }
 
 static void sipe_process_presence(struct sipe_core_private *sipe_private,
 				  struct sipmsg *msg)
 {
 	const char *ctype = sipmsg_find_header(msg, "Content-Type");
+	enum sipe_presence_part_type type;
 
 	SIPE_DEBUG_INFO("sipe_process_presence: Content-Type: %s", ctype ? ctype : "");
 
@@ -1107,25 +1382,34 @@ static void sipe_process_presence(struct sipe_core_private *sipe_private,
 	{
 		if (strstr(ctype, "multipart"))
 		{
-			sipe_mime_parts_foreach(ctype, msg->body, sipe_presence_mime_cb, sipe_private);
+			/* keep order with batches that are still being parsed */
+			if ((msg->bodylen >= SIPE_JOB_XML_MIN_LENGTH) ||
+			    sipe_presence_batch_pending(sipe_private))
+				sipe_presence_batch_submit(sipe_private, ctype, msg->body);
+			else
+				sipe_mime_parts_foreach(ctype, msg->body, sipe_presence_mime_cb, sipe_private);
+			return;
 		}
 		else if(strstr(ctype, "application/msrtc-event-categories+xml") )
 		{
-			process_incoming_notify_rlmi(sipe_private, msg->body, msg->bodylen);
+			type = SIPE_PRESENCE_PART_CATEGORIES;
 		}
-		else if(strstr(ctype, "application/rlmi+xml"))
+		else
 		{
-			process_incoming_notify_rlmi_resub(sipe_private, msg->body, msg->bodylen);
+			type = SIPE_PRESENCE_PART_RESUB;
 		}
 	}
 	else if(ctype && strstr(ctype, "text/xml+msrtc.pidf"))
 	{
-		process_incoming_notify_msrtc(sipe_private, msg->body, msg->bodylen);
+		type = SIPE_PRESENCE_PART_MSRTC;
 	}
 	else
 	{
-		process_incoming_notify_pidf(sipe_private, msg->body, msg->bodylen);
+		type = SIPE_PRESENCE_PART_PIDF;
 	}
+
+	/* single part NOTIFYs must not overtake pending batches */
+	sipe_presence_batch_queue(sipe_private, type, msg->body, msg->bodylen);
 }
 
 /**
@@ -1189,14 +1473,14 @@ static const gchar *get_group_name(const sipe_xml *node)
 	return(g_str_has_prefix(name, "~") ? _("Other Contacts") : name);
 }
 
-static void add_new_group(struct sipe_core_private *sipe_private,
-			  const sipe_xml *node)
+static struct sipe_group *add_new_group(struct sipe_core_private *sipe_private,
+					 const sipe_xml *node)
 {
-	sipe_group_add(sipe_private,
-		       get_group_name(node),
-		       NULL,
-		       NULL,
-		       sipe_xml_int_attribute(node, "id", 0));
+	return(sipe_group_add(sipe_private,
+			      get_group_name(node),
+			      NULL,
+			      NULL,
+			      sipe_xml_int_attribute(node, "id", 0)));
 }
 
 static void add_new_buddy(struct sipe_core_private *sipe_private,
@@ -1252,235 +1536,432 @@ static void add_new_buddy(struct sipe_core_private *sipe_private,
 	g_strfreev(item_groups);
 }
 
-static gboolean sipe_process_roaming_contacts(struct sipe_core_private *sipe_private,
-					      struct sipmsg *msg)
+/* state while streaming a roaming contacts document */
+struct roaming_contacts {
+	struct sipe_core_private *sipe_private;
+	GSList *deleted_groups;  /* processed after all other updates */
+	guint changed;           /* full list: records applied */
+	guint unchanged;         /* full list: records only confirmed */
+	gboolean full_list;      /* contactList, not contactDelta */
+	gboolean process;        /* contact list not migrated to UCS */
+	gboolean groups_checked; /* at least one group exists */
+	gboolean groups_changed; /* full list: group added or renamed */
+};
+
+/* attributes that are applied from a full list record */
+static const gchar * const roaming_group_attributes[] = {
+	"id", "name", NULL
+};
+static const gchar * const roaming_contact_attributes[] = {
+	"uri", "name", "groups", NULL
+};
+
+/*
+ * Identifies the content of a full list record. Unchanged records only
+ * need to be confirmed, i.e. they don't cause any backend calls.
+ */
+static guint roaming_record_hash(const sipe_xml *node,
+				 const gchar * const *attributes)
 {
-	int len = msg->bodylen;
+	guint hash = 5381;
 
-	const gchar *tmp = sipmsg_find_header(msg, "Event");
-	const sipe_xml *item;
-	sipe_xml *isc;
-	guint delta;
-	const sipe_xml *group_node;
+	while (*attributes) {
+		const gchar *value = sipe_xml_attribute(node, *attributes++);
 
-	if (!g_str_has_prefix(tmp, "vnd-microsoft-roaming-contacts")) {
-		return FALSE;
+		/* separator also distinguishes NULL from "" */
+		if (value) {
+			while (*value)
+				hash = (hash << 5) + hash + (guchar) *value++;
+			hash = (hash << 5) + hash + 1;
+		}
+		hash = (hash << 5) + hash;
 	}
 
-	/* Convert the contact from XML to backend Buddies */
-	isc = sipe_xml_parse(msg->body, len);
-	if (!isc) {
-		return FALSE;
-	}
+	/* 0 is reserved for "unknown" */
+	return(hash ? hash : 1);
+}
 
+static void roaming_contacts_delta_num(struct sipe_core_private *sipe_private,
+				       const sipe_xml *isc)
+{
 	/* [MS-SIP]: deltaNum MUST be non-zero */
-	delta = sipe_xml_int_attribute(isc, "deltaNum", 0);
+	guint delta = sipe_xml_int_attribute(isc, "deltaNum", 0);
 	if (delta) {
 		sipe_private->deltanum_contacts = delta;
 	}
+}
 
-	/*
-	 * Process whole buddy list
-	 *
-	 *  - Only sent once
-	 *    * up to Lync 2010
-	 *    * Lync 2013 (and later) with buddy list not migrated
-	 *
-	 *  - Lync 2013 with buddy list migrated to Unified Contact Store (UCS)
-	 *    * Notify piggy-backed on SUBSCRIBE response with empty list
-	 *    * NOTIFY send by server with standard list (ignored by us)
-	 */
-	if (sipe_strequal(sipe_xml_name(isc), "contactList")) {
-		const gchar *ucsmode = sipe_xml_attribute(isc, "ucsmode");
-
-		SIPE_CORE_PRIVATE_FLAG_UNSET(LYNC2013);
-		if (ucsmode) {
-			gboolean migrated = sipe_strcase_equal(ucsmode,
-							       "migrated");
-			SIPE_CORE_PRIVATE_FLAG_SET(LYNC2013);
-			SIPE_DEBUG_INFO_NOFORMAT("contact list contains 'ucsmode' attribute (indicates Lync 2013+)");
-
-			if (migrated)
-				SIPE_DEBUG_INFO_NOFORMAT("contact list has been migrated to Unified Contact Store (UCS)");
-			sipe_ucs_init(sipe_private, migrated);
+static void roaming_contacts_check_groups(struct roaming_contacts *ctx)
+{
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+
+	/* Make sure we have at least one group */
+	if (!ctx->groups_checked) {
+		ctx->groups_checked = TRUE;
+		if (sipe_group_count(sipe_private) == 0) {
+			sipe_group_create(sipe_private,
+					  NULL,
+					  _("Other Contacts"),
+					  NULL);
 		}
+	}
+}
+
+/*
+ * Process whole buddy list
+ *
+ *  - Only sent once
+ *    * up to Lync 2010
+ *    * Lync 2013 (and later) with buddy list not migrated
+ *
+ *  - Lync 2013 with buddy list migrated to Unified Contact Store (UCS)
+ *    * Notify piggy-backed on SUBSCRIBE response with empty list
+ *    * NOTIFY send by server with standard list (ignored by us)
+ */
+static void roaming_contacts_list(const sipe_xml *isc, gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+	const gchar *ucsmode = sipe_xml_attribute(isc, "ucsmode");
+
+	roaming_contacts_delta_num(sipe_private, isc);
+
+	SIPE_CORE_PRIVATE_FLAG_UNSET(LYNC2013);
+	if (ucsmode) {
+		gboolean migrated = sipe_strcase_equal(ucsmode,
+						       "migrated");
+		SIPE_CORE_PRIVATE_FLAG_SET(LYNC2013);
+		SIPE_DEBUG_INFO_NOFORMAT("contact list contains 'ucsmode' attribute (indicates Lync 2013+)");
+
+		if (migrated)
+			SIPE_DEBUG_INFO_NOFORMAT("contact list has been migrated to Unified Contact Store (UCS)");
+		sipe_ucs_init(sipe_private, migrated);
+	}
 
-		if (!sipe_ucs_is_migrated(sipe_private)) {
-			/* Start processing contact list */
-			sipe_backend_buddy_list_processing_start(SIPE_CORE_PUBLIC);
+	ctx->full_list = TRUE;
+	ctx->process   = !sipe_ucs_is_migrated(sipe_private);
 
-			/* Parse groups */
-			for (group_node = sipe_xml_child(isc, "group"); group_node; group_node = sipe_xml_twin(group_node))
-				add_new_group(sipe_private, group_node);
+	/* Start processing contact list */
+	if (ctx->process) {
+		sipe_backend_buddy_list_processing_start(SIPE_CORE_PUBLIC);
 
-			/* Make sure we have at least one group */
-			if (sipe_group_count(sipe_private) == 0) {
-				sipe_group_create(sipe_private,
-						  NULL,
-						  _("Other Contacts"),
-						  NULL);
-			}
+		/* entries not confirmed by the server will be removed */
+		sipe_group_update_start(sipe_private);
+		sipe_buddy_update_start(sipe_private);
+	}
+}
 
-			/* Parse contacts */
-			for (item = sipe_xml_child(isc, "contact"); item; item = sipe_xml_twin(item)) {
-				const gchar *name = sipe_xml_attribute(item, "uri");
-				gchar *uri        = sip_uri_from_name(name);
-				add_new_buddy(sipe_private, item, uri);
-				g_free(uri);
-			}
+static void roaming_contacts_list_group(const sipe_xml *group_node,
+					gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
 
-			sipe_buddy_cleanup_local_list(sipe_private);
-
-			/* Add self-contact if not there yet. 2005 systems. */
-			/* This will resemble subscription to roaming_self in 2007 systems */
-			if (!SIPE_CORE_PRIVATE_FLAG_IS(OCS2007)) {
-				gchar *self_uri = sip_uri_self(sipe_private);
-				sipe_buddy_add(sipe_private,
-					       self_uri,
-					       NULL,
-					       NULL);
-				g_free(self_uri);
-			}
+	if (ctx->process) {
+		struct sipe_core_private *sipe_private = ctx->sipe_private;
+		guint hash = roaming_record_hash(group_node,
+						 roaming_group_attributes);
+		struct sipe_group *group = sipe_group_find_by_id(sipe_private,
+								 sipe_xml_int_attribute(group_node,
+											"id",
+											0));
 
-			/* Finished processing contact list */
-			sipe_backend_buddy_list_processing_finish(SIPE_CORE_PUBLIC);
+		if (group && (group->roaming_hash == hash)) {
+			group->is_obsolete = FALSE;
+			ctx->unchanged++;
+		} else {
+			group = add_new_group(sipe_private, group_node);
+			if (group)
+				group->roaming_hash = hash;
+			ctx->groups_changed = TRUE;
+			ctx->changed++;
 		}
+	}
+}
 
-	/* Process buddy list updates */
-	} else if (sipe_strequal(sipe_xml_name(isc), "contactDelta")) {
-
-		/* Process new groups */
-		for (group_node = sipe_xml_child(isc, "addedGroup"); group_node; group_node = sipe_xml_twin(group_node))
-			add_new_group(sipe_private, group_node);
-
-		/* Process modified groups */
-		for (group_node = sipe_xml_child(isc, "modifiedGroup"); group_node; group_node = sipe_xml_twin(group_node)) {
-			struct sipe_group *group = sipe_group_find_by_id(sipe_private,
-									 (int)g_ascii_strtod(sipe_xml_attribute(group_node, "id"),
-											     NULL));
-			if (group) {
-				const gchar *name = get_group_name(group_node);
-
-				if (!(is_empty(name) ||
-				      sipe_strequal(group->name, name)) &&
-				    sipe_group_rename(sipe_private,
-						      group,
-						      name))
-					SIPE_DEBUG_INFO("Replaced group %d name with %s", group->id, name);
-			}
+static void roaming_contacts_list_contact(const sipe_xml *item,
+					  gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+
+	if (ctx->process) {
+		struct sipe_core_private *sipe_private = ctx->sipe_private;
+		const gchar *name = sipe_xml_attribute(item, "uri");
+		gchar *uri        = sip_uri_from_name(name);
+		guint hash        = roaming_record_hash(item,
+							roaming_contact_attributes);
+		/* URI table is case insensitive */
+		struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
+								  uri);
+
+		/* groups precede contacts in the document */
+		roaming_contacts_check_groups(ctx);
+
+		/* group objects are unchanged, i.e. memberships are still valid */
+		if (!ctx->groups_changed              &&
+		    buddy                             &&
+		    (buddy->roaming_hash == hash)     &&
+		    sipe_buddy_update_confirm(sipe_private, buddy)) {
+			ctx->unchanged++;
+		} else {
+			add_new_buddy(sipe_private, item, uri);
+			buddy = sipe_buddy_find_by_uri(sipe_private, uri);
+			if (buddy)
+				buddy->roaming_hash = hash;
+			ctx->changed++;
 		}
 
-		/* Process new buddies */
-		for (item = sipe_xml_child(isc, "addedContact"); item; item = sipe_xml_twin(item)) {
-			add_new_buddy(sipe_private,
-				      item,
-				      sipe_xml_attribute(item, "uri"));
+		g_free(uri);
+	}
+}
+
+static void roaming_contacts_list_finish(struct roaming_contacts *ctx,
+					 gboolean complete)
+{
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+
+	if (!(ctx->full_list && ctx->process))
+		return;
+
+	SIPE_DEBUG_INFO("roaming_contacts_list_finish: %u records applied, %u unchanged",
+			ctx->changed, ctx->unchanged);
+
+	/* incomplete list must not remove buddies */
+	if (complete) {
+		roaming_contacts_check_groups(ctx);
+
+		sipe_buddy_update_finish(sipe_private);
+		sipe_group_update_finish(sipe_private);
+
+		sipe_buddy_cleanup_local_list(sipe_private);
+
+		/* Add self-contact if not there yet. 2005 systems. */
+		/* This will resemble subscription to roaming_self in 2007 systems */
+		if (!SIPE_CORE_PRIVATE_FLAG_IS(OCS2007)) {
+			gchar *self_uri = sip_uri_self(sipe_private);
+			sipe_buddy_add(sipe_private,
+				       self_uri,
+				       NULL,
+				       NULL);
+			g_free(self_uri);
 		}
+	} else {
+		sipe_buddy_update_cancel(sipe_private);
+		sipe_group_update_cancel(sipe_private);
+	}
+
+	/* Finished processing contact list */
+	sipe_buddy_status_flush(sipe_private);
+	sipe_backend_buddy_list_processing_finish(SIPE_CORE_PUBLIC);
+}
+
+/* Process buddy list updates */
+static void roaming_contacts_delta(const sipe_xml *isc, gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	roaming_contacts_delta_num(ctx->sipe_private, isc);
+}
+
+/* Process new groups */
+static void roaming_contacts_added_group(const sipe_xml *group_node,
+					 gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	add_new_group(ctx->sipe_private, group_node);
+}
+
+/* Process modified groups */
+static void roaming_contacts_modified_group(const sipe_xml *group_node,
+					    gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+	struct sipe_group *group = sipe_group_find_by_id(sipe_private,
+							 (int)g_ascii_strtod(sipe_xml_attribute(group_node, "id"),
+									     NULL));
+	if (group) {
+		const gchar *name = get_group_name(group_node);
+
+		group->roaming_hash = 0;
+		if (!(is_empty(name) ||
+		      sipe_strequal(group->name, name)) &&
+		    sipe_group_rename(sipe_private,
+				      group,
+				      name))
+			SIPE_DEBUG_INFO("Replaced group %d name with %s", group->id, name);
+	}
+}
+
+/* Process new buddies */
+static void roaming_contacts_added_contact(const sipe_xml *item,
+					   gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	add_new_buddy(ctx->sipe_private,
+		      item,
+		      sipe_xml_attribute(item, "uri"));
+}
 
-		/* Process modified buddies */
-		for (item = sipe_xml_child(isc, "modifiedContact"); item; item = sipe_xml_twin(item)) {
-			const gchar *uri = sipe_xml_attribute(item, "uri");
-			struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
-									  uri);
-
-			if (buddy) {
-				gchar **item_groups = g_strsplit(sipe_xml_attribute(item,
-										    "groups"),
-								 " ", 0);
-
-				/* this should be defined. Otherwise we would get "deletedContact" */
-				if (item_groups) {
-					const gchar *name = sipe_xml_attribute(item, "name");
-					gboolean empty_name = is_empty(name);
-					GSList *found = NULL;
-					int i = 0;
-
-					while (item_groups[i]) {
-						struct sipe_group *group = sipe_group_find_by_id(sipe_private,
-												 g_ascii_strtod(item_groups[i],
-														NULL));
-						/* ignore unkown groups */
-						if (group) {
-							sipe_backend_buddy b = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
-												       uri,
-												       group->name);
-
-							/* add group to found list */
-							found = g_slist_prepend(found, group);
-
-							if (b) {
-								/* new alias? */
-								gchar *b_alias = sipe_backend_buddy_get_alias(SIPE_CORE_PUBLIC,
-													      b);
-
-								if (!(empty_name ||
-								      sipe_strequal(b_alias, name))) {
-									sipe_backend_buddy_set_alias(SIPE_CORE_PUBLIC,
-												     b,
-												     name);
-									SIPE_DEBUG_INFO("Replaced for buddy %s in group '%s' old alias '%s' with '%s'",
-											uri, group->name, b_alias, name);
-								}
-								g_free(b_alias);
-
-							} else {
-								const gchar *alias = empty_name ? uri : name;
-								/* buddy was not in this group */
-								sipe_backend_buddy_add(SIPE_CORE_PUBLIC,
+/* Process modified buddies */
+static void roaming_contacts_modified_contact(const sipe_xml *item,
+					      gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+	const gchar *uri = sipe_xml_attribute(item, "uri");
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
+							  uri);
+
+	if (buddy) {
+		gchar **item_groups = g_strsplit(sipe_xml_attribute(item,
+								    "groups"),
+						 " ", 0);
+
+		buddy->roaming_hash = 0;
+
+		/* this should be defined. Otherwise we would get "deletedContact" */
+		if (item_groups) {
+			const gchar *name = sipe_xml_attribute(item, "name");
+			gboolean empty_name = is_empty(name);
+			GSList *found = NULL;
+			int i = 0;
+
+			while (item_groups[i]) {
+				struct sipe_group *group = sipe_group_find_by_id(sipe_private,
+										 g_ascii_strtod(item_groups[i],
+												NULL));
+				/* ignore unkown groups */
+				if (group) {
+					sipe_backend_buddy b = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
 										       uri,
-										       alias,
 										       group->name);
-								sipe_buddy_insert_group(buddy, group);
-								SIPE_DEBUG_INFO("Added buddy %s (alias '%s' to group '%s'",
-										uri, alias, group->name);
-							}
+
+					/* add group to found list */
+					found = g_slist_prepend(found, group);
+
+					if (b) {
+						/* new alias? */
+						gchar *b_alias = sipe_backend_buddy_get_alias(SIPE_CORE_PUBLIC,
+											      b);
+
+						if (!(empty_name ||
+						      sipe_strequal(b_alias, name))) {
+							sipe_backend_buddy_set_alias(SIPE_CORE_PUBLIC,
+										     b,
+										     name);
+							SIPE_DEBUG_INFO("Replaced for buddy %s in group '%s' old alias '%s' with '%s'",
+									uri, group->name, b_alias, name);
 						}
+						g_free(b_alias);
 
-						/* next group */
-						i++;
+					} else {
+						const gchar *alias = empty_name ? uri : name;
+						/* buddy was not in this group */
+						sipe_backend_buddy_add(SIPE_CORE_PUBLIC,
+								       uri,
+								       alias,
+								       group->name);
+						sipe_buddy_insert_group(buddy, group);
+						SIPE_DEBUG_INFO("Added buddy %s (alias '%s' to group '%s'",
+								uri, alias, group->name);
 					}
-					g_strfreev(item_groups);
-
- 					/* removed from groups? */
-					sipe_buddy_update_groups(sipe_private,
-								 buddy,
-								 found);
-					g_slist_free(found);
 				}
+
+				/* next group */
+				i++;
 			}
+			g_strfreev(item_groups);
+
+ 			/* removed from groups? */
+			sipe_buddy_update_groups(sipe_private,
+						 buddy,
+						 found);
+			g_slist_free(found);
 		}
+	}
+}
 
-		/* Process deleted buddies */
-		for (item = sipe_xml_child(isc, "deletedContact"); item; item = sipe_xml_twin(item)) {
-			const gchar *uri = sipe_xml_attribute(item, "uri");
-			struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
-									  uri);
+/* Process deleted buddies */
+static void roaming_contacts_deleted_contact(const sipe_xml *item,
+					     gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	struct sipe_core_private *sipe_private = ctx->sipe_private;
+	const gchar *uri = sipe_xml_attribute(item, "uri");
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
+							  uri);
+
+	if (buddy) {
+		SIPE_DEBUG_INFO("Removing buddy %s", uri);
+		sipe_buddy_remove(sipe_private, buddy);
+	}
+}
 
-			if (buddy) {
-				SIPE_DEBUG_INFO("Removing buddy %s", uri);
-				sipe_buddy_remove(sipe_private, buddy);
-			}
-		}
+static void roaming_contacts_deleted_group(const sipe_xml *group_node,
+					   gpointer user_data)
+{
+	struct roaming_contacts *ctx = user_data;
+	int id = (int)g_ascii_strtod(sipe_xml_attribute(group_node, "id"),
+				     NULL);
+
+	ctx->deleted_groups = g_slist_prepend(ctx->deleted_groups,
+					      GINT_TO_POINTER(id));
+}
+
+static const struct sipe_xml_stream_handler roaming_contacts_handlers[] = {
+	{ "contactList",                  roaming_contacts_list,  NULL,                              NULL },
+	{ "contactList/group",            NULL,                   roaming_contacts_list_group,       NULL },
+	{ "contactList/contact",          NULL,                   roaming_contacts_list_contact,     NULL },
+	{ "contactDelta",                 roaming_contacts_delta, NULL,                              NULL },
+	{ "contactDelta/addedGroup",      NULL,                   roaming_contacts_added_group,      NULL },
+	{ "contactDelta/modifiedGroup",   NULL,                   roaming_contacts_modified_group,   NULL },
+	{ "contactDelta/addedContact",    NULL,                   roaming_contacts_added_contact,    NULL },
+	{ "contactDelta/modifiedContact", NULL,                   roaming_contacts_modified_contact, NULL },
+	{ "contactDelta/deletedContact",  NULL,                   roaming_contacts_deleted_contact,  NULL },
+	{ "contactDelta/deletedGroup",    NULL,                   roaming_contacts_deleted_group,    NULL },
+	{ NULL,                           NULL,                   NULL,                              NULL }
+};
+
+static gboolean sipe_process_roaming_contacts(struct sipe_core_private *sipe_private,
+					      struct sipmsg *msg)
+{
+	const gchar *tmp = sipmsg_find_header(msg, "Event");
+	struct roaming_contacts ctx;
+	gboolean complete;
+	GSList *entry;
 
-		/* Process deleted groups
-		 *
-		 * NOTE: all buddies will already have been removed from the
-		 *       group prior to this. The log shows that OCS actually
-		 *       sends two separate updates when you delete a group:
-		 *
-		 *         - first one with "modifiedContact" removing buddies
-		 *           from the group, leaving it empty, and
-		 *
-		 *         - then one with "deletedGroup" removing the group
-		 */
-		for (group_node = sipe_xml_child(isc, "deletedGroup"); group_node; group_node = sipe_xml_twin(group_node))
-			sipe_group_remove(sipe_private,
-					  sipe_group_find_by_id(sipe_private,
-								(int)g_ascii_strtod(sipe_xml_attribute(group_node, "id"),
-										    NULL)));
-
-	}
-	sipe_xml_free(isc);
+	if (!g_str_has_prefix(tmp, "vnd-microsoft-roaming-contacts")) {
+		return FALSE;
+	}
+
+	/* Convert the contact from XML to backend Buddies while parsing */
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.sipe_private = sipe_private;
+	complete = sipe_xml_stream_parse(msg->body, msg->bodylen,
+					 roaming_contacts_handlers,
+					 &ctx);
+	roaming_contacts_list_finish(&ctx, complete);
+
+	/* Process deleted groups
+	 *
+	 * NOTE: all buddies will already have been removed from the
+	 *       group prior to this. The log shows that OCS actually
+	 *       sends two separate updates when you delete a group:
+	 *
+	 *         - first one with "modifiedContact" removing buddies
+	 *           from the group, leaving it empty, and
+	 *
+	 *         - then one with "deletedGroup" removing the group
+	 */
+	ctx.deleted_groups = g_slist_reverse(ctx.deleted_groups);
+	for (entry = ctx.deleted_groups; entry; entry = entry->next)
+		sipe_group_remove(sipe_private,
+				  sipe_group_find_by_id(sipe_private,
+							GPOINTER_TO_INT(entry->data)));
+	g_slist_free(ctx.deleted_groups);
+
+	if (!complete) {
+		return FALSE;
+	}
 
 	/* Subscribe to buddies, if contact list not migrated to UCS */
 	if (!sipe_ucs_is_migrated(sipe_private))
@@ -1496,23 +1977,124 @@ static gboolean sipe_process_roaming_contacts(struct sipe_core_private *sipe_pri
 	return 0;
 }
 
+/*
+ * Roaming ACL
+ *
+ * Every NOTIFY carries the complete ACL. The USER entries that have been
+ * applied last are kept, i.e. only added, removed or changed entries
+ * cause backend calls. A document with the same deltaNum as the last
+ * applied one isn't parsed at all.
+ */
+#define ROAMING_ACL_ALLOWED GINT_TO_POINTER(1)
+#define ROAMING_ACL_BLOCKED GINT_TO_POINTER(2)
+
+/* deltaNum of the root element without parsing the document */
+static guint roaming_acl_peek_delta(const struct sipmsg *msg)
+{
+	const gchar *end;
+	const gchar *attribute;
+
+	if (!msg->body)
+		return(0);
+
+	/* end of root element start tag, skips the XML declaration */
+	for (end = strchr(msg->body, '>');
+	     end && (end > msg->body) && (end[-1] == '?');
+	     end = strchr(end + 1, '>'));
+	if (!end)
+		return(0);
+
+	attribute = g_strstr_len(msg->body, end - msg->body, "deltaNum=\"");
+	return(attribute ? strtoul(attribute + 10, NULL, 10) : 0);
+}
+
+static void roaming_acl_apply(struct sipe_core_private *sipe_private,
+			      const gchar *uri,
+			      gboolean blocked)
+{
+	if (sipe_backend_buddy_is_blocked(SIPE_CORE_PUBLIC, uri) != blocked) {
+		SIPE_DEBUG_INFO("roaming_acl_apply: %s %s",
+				blocked ? "blocking" : "allowing", uri);
+		sipe_backend_buddy_set_blocked_status(SIPE_CORE_PUBLIC,
+						      uri,
+						      blocked);
+	}
+}
+
 static void sipe_process_roaming_acl(struct sipe_core_private *sipe_private,
 				     struct sipmsg *msg)
 {
-	guint delta;
+	GHashTable *old_acl = sipe_private->roaming_acl;
+	GHashTable *acl;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	guint delta = roaming_acl_peek_delta(msg);
+	guint changed = 0;
+	const sipe_xml *node;
 	sipe_xml *xml;
 
-	xml = sipe_xml_parse(msg->body, msg->bodylen);
+	/* [MS-SIP]: deltaNum MUST be non-zero */
+	if (delta && old_acl && (delta == sipe_private->roaming_acl_delta)) {
+		SIPE_DEBUG_INFO("sipe_process_roaming_acl: deltaNum %u already applied",
+				delta);
+		return;
+	}
+
+	xml = sipmsg_parse_xml_body(msg);
 	if (!xml)
 		return;
 
-	/* [MS-SIP]: deltaNum MUST be non-zero */
 	delta = sipe_xml_int_attribute(xml, "deltaNum", 0);
 	if (delta) {
 		sipe_private->deltanum_acl = delta;
 	}
 
+	acl = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (node = sipe_xml_child(xml, "ace"); node; node = sipe_xml_twin(node)) {
+		const gchar *mask   = sipe_xml_attribute(node, "mask");
+		const gchar *rights = sipe_xml_attribute(node, "rights");
+		gchar *uri;
+		gpointer blocked;
+
+		if (!sipe_strcase_equal(sipe_xml_attribute(node, "type"), "USER") ||
+		    is_empty(mask) || !rights)
+			continue;
+
+		/* see sip_soap_ocs2005_setacl() */
+		blocked = strchr(rights, 'B') ? ROAMING_ACL_BLOCKED : ROAMING_ACL_ALLOWED;
+		uri     = sip_uri(mask);
+		g_hash_table_insert(acl, g_ascii_strdown(uri, -1), blocked);
+		g_free(uri);
+	}
 	sipe_xml_free(xml);
+
+	/* added or changed entries */
+	g_hash_table_iter_init(&iter, acl);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (old_acl && (g_hash_table_lookup(old_acl, key) == value))
+			continue;
+		roaming_acl_apply(sipe_private, key, value == ROAMING_ACL_BLOCKED);
+		changed++;
+	}
+
+	/* removed entries: no longer blocked */
+	if (old_acl) {
+		g_hash_table_iter_init(&iter, old_acl);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			if (g_hash_table_lookup(acl, key))
+				continue;
+			if (value == ROAMING_ACL_BLOCKED)
+				roaming_acl_apply(sipe_private, key, FALSE);
+			changed++;
+		}
+		g_hash_table_destroy(old_acl);
+	}
+
+	SIPE_DEBUG_INFO("sipe_process_roaming_acl: deltaNum %u, %u entries, %u changed",
+			delta, g_hash_table_size(acl), changed);
+	sipe_private->roaming_acl       = acl;
+	sipe_private->roaming_acl_delta = delta;
 }
 
 struct sipe_auth_job {
@@ -1574,9 +2156,9 @@ static void sipe_process_presence_wpending (struct sipe_core_private *sipe_priva
 	// Ensure it's either not a response (eg it's a BENOTIFY) or that it's a 200 OK response
 	if (msg->response != 0 && msg->response != 200) return;
 
-	if (msg->bodylen == 0 || msg->body == NULL || sipe_strequal(sipmsg_find_header(msg, "Event"), "msrtc.wpending")) return;
+	if (msg->bodylen == 0 || msg->body == NULL || (sipmsg_event_id(sipmsg_find_known_header(msg, SIPMSG_HEADER_EVENT)) == SIPMSG_EVENT_MSRTC_WPENDING)) return;
 
-	watchers = sipe_xml_parse(msg->body, msg->bodylen);
+	watchers = sipmsg_parse_xml_body(msg);
 	if (!watchers) return;
 
 	for (watcher = sipe_xml_child(watchers, "watcher"); watcher; watcher = sipe_xml_twin(watcher)) {
@@ -1612,9 +2194,9 @@ static void sipe_process_presence_wpending (struct sipe_core_private *sipe_priva
 void process_incoming_notify(struct sipe_core_private *sipe_private,
 			     struct sipmsg *msg)
 {
-	const gchar *content_type = sipmsg_find_header(msg, "Content-Type");
-	const gchar *event = sipmsg_find_header(msg, "Event");
-	const gchar *subscription_state = sipmsg_find_header(msg, "subscription-state");
+	const gchar *content_type = sipmsg_find_known_header(msg, SIPMSG_HEADER_CONTENT_TYPE);
+	const gchar *event = sipmsg_find_known_header(msg, SIPMSG_HEADER_EVENT);
+	const gchar *subscription_state = sipmsg_find_known_header(msg, SIPMSG_HEADER_SUBSCRIPTION_STATE);
 
 	SIPE_DEBUG_INFO("process_incoming_notify: subscription_state: %s", subscription_state ? subscription_state : "");
 
@@ -1624,30 +2206,46 @@ void process_incoming_notify(struct sipe_core_private *sipe_private,
 
 	/* event subscriptions */
 	} else if (event) {
+		guint event_id = sipmsg_event_id(event);
 
+		switch (event_id) {
 		/* One-off subscriptions - sent with "Expires: 0" */
-		if (sipe_strcase_equal(event, "vnd-microsoft-provisioning-v2")) {
+		case SIPMSG_EVENT_PROVISIONING_V2:
 			sipe_process_provisioning_v2(sipe_private, msg);
-		} else if (sipe_strcase_equal(event, "vnd-microsoft-provisioning")) {
+			break;
+		case SIPMSG_EVENT_PROVISIONING:
 			sipe_process_provisioning(sipe_private, msg);
-		} else if (sipe_strcase_equal(event, "presence")) {
+			break;
+		case SIPMSG_EVENT_PRESENCE:
 			sipe_process_presence(sipe_private, msg);
-		} else if (sipe_strcase_equal(event, "registration-notify")) {
+			break;
+		case SIPMSG_EVENT_REGISTRATION_NOTIFY:
 			sipe_process_registration_notify(sipe_private, msg);
+			break;
 
 		/* Subscriptions with timeout */
-		} else if (!subscription_state || strstr(subscription_state, "active")) {
-			if (sipe_strcase_equal(event, "vnd-microsoft-roaming-contacts")) {
+		default:
+			if (subscription_state && !strstr(subscription_state, "active"))
+				break;
+
+			switch (event_id) {
+			case SIPMSG_EVENT_ROAMING_CONTACTS:
 				sipe_process_roaming_contacts(sipe_private, msg);
-			} else if (sipe_strcase_equal(event, "vnd-microsoft-roaming-self")) {
+				break;
+			case SIPMSG_EVENT_ROAMING_SELF:
 				sipe_ocs2007_process_roaming_self(sipe_private, msg);
-			} else if (sipe_strcase_equal(event, "vnd-microsoft-roaming-ACL")) {
+				break;
+			case SIPMSG_EVENT_ROAMING_ACL:
 				sipe_process_roaming_acl(sipe_private, msg);
-			} else if (sipe_strcase_equal(event, "presence.wpending")) {
+				break;
+			case SIPMSG_EVENT_PRESENCE_WPENDING:
 				sipe_process_presence_wpending(sipe_private, msg);
-			} else if (sipe_strcase_equal(event, "conference")) {
+				break;
+			case SIPMSG_EVENT_CONFERENCE:
 				sipe_process_conference(sipe_private, msg);
+				break;
 			}
+			break;
 		}
 	}
 }
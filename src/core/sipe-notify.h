@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -28,6 +28,15 @@ struct sipe_core_private;
 void process_incoming_notify(struct sipe_core_private *sipe_private,
 			     struct sipmsg *msg);
 
+/**
+ * Apply provisioning document of the previous session
+ *
+ * Does nothing if a provisioning document has already been applied.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_notify_provisioning_cached(struct sipe_core_private *sipe_private);
+
 /*
   Local Variables:
   mode: c
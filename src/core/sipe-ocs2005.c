@@ -289,7 +289,7 @@ static void send_presence_soap(struct sipe_core_private *sipe_private,
 	const gchar *note_pub = NULL;
 	gchar *states = NULL;
 	gchar *calendar_data = NULL;
-	gchar *epid = get_epid(sipe_private);
+	const gchar *epid = get_epid(sipe_private);
 	gchar *from = sip_uri_self(sipe_private);
 	time_t now = time(NULL);
 	gchar *since_time_str = sipe_utils_time_to_str(now);
@@ -397,24 +397,58 @@ static void send_presence_soap(struct sipe_core_private *sipe_private,
 	g_free(states);
 	g_free(calendar_data);
 	g_free(since_time_str);
-	g_free(epid);
 
 	sip_soap_raw_request_cb(sipe_private, from, body, NULL, NULL);
 
 	g_free(body);
 }
 
+#define PRESENCE_PUBLISH_ACTION "<+2005-presence>"
+#define PRESENCE_PUBLISH_DELAY  500 /* ms */
+
+static void presence_publish_cb(struct sipe_core_private *sipe_private,
+				SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	gboolean do_publish_calendar = sipe_private->ocs2005_publish_calendar;
+
+	sipe_private->ocs2005_publish_calendar = FALSE;
+	send_presence_soap(sipe_private, do_publish_calendar, FALSE);
+}
+
+/*
+ * Status, note & calendar changes often arrive in bursts. They are
+ * collected into one setPresence request sent shortly after the last
+ * change. The first publication after login isn't delayed.
+ */
 void sipe_ocs2005_presence_publish(struct sipe_core_private *sipe_private,
 				   gboolean do_publish_calendar)
 {
-	send_presence_soap(sipe_private, do_publish_calendar, FALSE);
+	if (!SIPE_CORE_PRIVATE_FLAG_IS(INITIAL_PUBLISH)) {
+		send_presence_soap(sipe_private, do_publish_calendar, FALSE);
+		return;
+	}
+
+	if (do_publish_calendar)
+		sipe_private->ocs2005_publish_calendar = TRUE;
+	sipe_schedule_mseconds(sipe_private,
+			       PRESENCE_PUBLISH_ACTION,
+			       NULL,
+			       PRESENCE_PUBLISH_DELAY,
+			       presence_publish_cb,
+			       NULL);
 }
 
 void sipe_ocs2005_reset_status(struct sipe_core_private *sipe_private)
 {
+	/* replaces pending publication */
+	sipe_schedule_cancel(sipe_private, PRESENCE_PUBLISH_ACTION);
+	sipe_private->ocs2005_publish_calendar = FALSE;
 	send_presence_soap(sipe_private, FALSE, TRUE);
 }
 
+static void schedule_calendar_status(struct sipe_core_private *sipe_private,
+				     struct sipe_buddy *sbuddy);
+
 void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 					struct sipe_buddy *sbuddy,
 					const char *status_id)
@@ -423,8 +457,10 @@ void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 	int cal_status = sipe_cal_get_status(sbuddy, time(NULL), &cal_avail_since);
 	int avail;
 	gchar *self_uri;
+	struct sipe_buddy_extended *ext;
 
 	if (!sbuddy) return;
+	ext = sipe_buddy_extended(sbuddy);
 
 	if (cal_status < SIPE_CAL_NO_DATA) {
 		SIPE_DEBUG_INFO("sipe_apply_calendar_status: cal_status      : %d for %s", cal_status, sbuddy->name);
@@ -433,9 +469,9 @@ void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 
 	/* scheduled Cal update call */
 	if (!status_id) {
-		status_id = sbuddy->last_non_cal_status_id;
+		status_id = ext->last_non_cal_status_id;
 		g_free(sbuddy->activity);
-		sbuddy->activity = g_strdup(sbuddy->last_non_cal_activity);
+		sbuddy->activity = g_strdup(ext->last_non_cal_activity);
 	}
 
 	if (!status_id) {
@@ -444,12 +480,15 @@ void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 		return;
 	}
 
+	/* re-apply when calendar status changes next time */
+	schedule_calendar_status(sipe_private, sbuddy);
+
 	/* adjust to calendar status */
 	if (cal_status != SIPE_CAL_NO_DATA) {
-		SIPE_DEBUG_INFO("sipe_apply_calendar_status: user_avail_since: %s", sipe_utils_time_to_debug_str(localtime(&sbuddy->user_avail_since)));
+		SIPE_DEBUG_INFO("sipe_apply_calendar_status: user_avail_since: %s", sipe_utils_time_to_debug_str(localtime(&ext->user_avail_since)));
 
 		if ((cal_status == SIPE_CAL_BUSY) &&
-		    (cal_avail_since > sbuddy->user_avail_since) &&
+		    (cal_avail_since > ext->user_avail_since) &&
 		    sipe_ocs2007_status_is_busy(status_id)) {
 			status_id = sipe_status_activity_to_token(SIPE_ACTIVITY_BUSY);
 			g_free(sbuddy->activity);
@@ -457,8 +496,8 @@ void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 		}
 		avail = sipe_ocs2007_availability_from_status(status_id, NULL);
 
-		SIPE_DEBUG_INFO("sipe_apply_calendar_status: activity_since  : %s", sipe_utils_time_to_debug_str(localtime(&sbuddy->activity_since)));
-		if (cal_avail_since > sbuddy->activity_since) {
+		SIPE_DEBUG_INFO("sipe_apply_calendar_status: activity_since  : %s", sipe_utils_time_to_debug_str(localtime(&ext->activity_since)));
+		if (cal_avail_since > ext->activity_since) {
 			if ((cal_status == SIPE_CAL_OOF) &&
 			    sipe_ocs2007_availability_is_away(avail)) {
 				g_free(sbuddy->activity);
@@ -469,8 +508,8 @@ void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 
 	/* then set status_id actually */
 	SIPE_DEBUG_INFO("sipe_apply_calendar_status: to %s for %s", status_id, sbuddy->name ? sbuddy->name : "" );
-	sipe_backend_buddy_set_status(SIPE_CORE_PUBLIC, sbuddy->name,
-				      sipe_status_token_to_activity(status_id));
+	sipe_buddy_set_status(sipe_private, sbuddy->name,
+			      sipe_status_token_to_activity(status_id));
 
 	/* set our account state to the one in roaming (including calendar info) */
 	self_uri = sip_uri_self(sipe_private);
@@ -486,56 +525,70 @@ void sipe_ocs2005_apply_calendar_status(struct sipe_core_private *sipe_private,
 	g_free(self_uri);
 }
 
-static void update_calendar_status_cb(SIPE_UNUSED_PARAMETER char *name,
-				      struct sipe_buddy *sbuddy,
-				      struct sipe_core_private *sipe_private)
+#define CALENDAR_STATUS_ACTION "<+2005-cal-status>"
+
+static void update_calendar_status(struct sipe_core_private *sipe_private,
+				   gpointer uri)
 {
-	sipe_ocs2005_apply_calendar_status(sipe_private, sbuddy, NULL);
+	struct sipe_buddy *sbuddy = sipe_buddy_find_by_uri(sipe_private, uri);
+
+	SIPE_DEBUG_INFO("update_calendar_status: %s", (gchar *) uri);
+	if (sbuddy)
+		sipe_ocs2005_apply_calendar_status(sipe_private, sbuddy, NULL);
 }
 
-/**
- * Updates contact's status
- * based on their calendar information.
+/*
+ * Each buddy with calendar information has one scheduled action at its
+ * next calendar status change, i.e. the scheduler queue orders all
+ * pending transitions and only buddies with a change due are updated.
  */
-static void update_calendar_status(struct sipe_core_private *sipe_private,
-				   SIPE_UNUSED_PARAMETER void *unused)
+static void schedule_calendar_status(struct sipe_core_private *sipe_private,
+				     struct sipe_buddy *sbuddy)
 {
-	SIPE_DEBUG_INFO_NOFORMAT("update_calendar_status() started.");
-	sipe_buddy_foreach(sipe_private,
-			   (GHFunc) update_calendar_status_cb,
-			   sipe_private);
+	time_t now = time(NULL);
+	time_t next = sipe_cal_get_transition(sbuddy, now);
+	gchar *action = g_strdup_printf(CALENDAR_STATUS_ACTION "<%s>",
+					sbuddy->name);
+
+	if (next) {
+		SIPE_DEBUG_INFO("schedule_calendar_status: %s at %s",
+				sbuddy->name,
+				sipe_utils_time_to_debug_str(localtime(&next)));
+		sipe_schedule_seconds(sipe_private,
+				      action,
+				      g_strdup(sbuddy->name),
+				      next - now,
+				      update_calendar_status,
+				      g_free);
+	} else {
+		sipe_schedule_cancel(sipe_private, action);
+	}
+	g_free(action);
+}
 
-	/* repeat scheduling */
-	sipe_ocs2005_schedule_status_update(sipe_private,
-					    time(NULL) + 3 * 60 /* 3 min */);
+static void schedule_calendar_status_cb(SIPE_UNUSED_PARAMETER char *name,
+					struct sipe_buddy *sbuddy,
+					struct sipe_core_private *sipe_private)
+{
+	if (sbuddy->ext && sbuddy->ext->last_non_cal_status_id)
+		schedule_calendar_status(sipe_private, sbuddy);
 }
 
 /**
  * Schedules process of contacts' status update
  * based on their calendar information.
- * Should be scheduled to the beginning of every
- * 15 min interval, like:
- * 13:00, 13:15, 13:30, 13:45, etc.
+ * Contacts are updated at their next calendar
+ * status change after calculate_from.
  */
 void sipe_ocs2005_schedule_status_update(struct sipe_core_private *sipe_private,
 					 time_t calculate_from)
 {
-#define SCHEDULE_INTERVAL 15 * 60 /* 15 min */
-
-	/* start of the beginning of closest 15 min interval. */
-	time_t next_start = (calculate_from / SCHEDULE_INTERVAL + 1) * SCHEDULE_INTERVAL;
-
 	SIPE_DEBUG_INFO("sipe_ocs2005_schedule_status_update: calculate_from time: %s",
 			sipe_utils_time_to_debug_str(localtime(&calculate_from)));
-	SIPE_DEBUG_INFO("sipe_ocs2005_schedule_status_update: next start time    : %s",
-			sipe_utils_time_to_debug_str(localtime(&next_start)));
-
-	sipe_schedule_seconds(sipe_private,
-			      "<+2005-cal-status>",
-			      NULL,
-			      next_start - time(NULL),
-			      update_calendar_status,
-			      NULL);
+
+	sipe_buddy_foreach(sipe_private,
+			   (GHFunc) schedule_calendar_status_cb,
+			   sipe_private);
 }
 
 /*
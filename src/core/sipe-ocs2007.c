@@ -49,12 +49,14 @@
 #include "sipe-nls.h"
 #include "sipe-ocs2007.h"
 #include "sipe-schedule.h"
+#include "sipe-soap.h"
 #include "sipe-status.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
 /** MS-PRES publication */
 struct sipe_publication {
+	guint64 key; /* see PUBLICATION_KEY(), used as hash table key */
 	gchar *category;
 	guint instance;
 	guint container;
@@ -216,33 +218,124 @@ static void free_publication(struct sipe_publication *publication)
 	g_free(publication);
 }
 
-struct hash_table_delete_payload {
-	GHashTable *hash_table;
+/** categories we publish ourselves */
+#define SIPE_PUB_CATEGORY_UNKNOWN       0
+#define SIPE_PUB_CATEGORY_DEVICE        1
+#define SIPE_PUB_CATEGORY_STATE         2
+#define SIPE_PUB_CATEGORY_NOTE          3
+#define SIPE_PUB_CATEGORY_CALENDAR_DATA 4
+
+/**
+ * Publication key <category><instance><container> packed into an integer
+ *
+ * MS-PRES container IDs are below 65536.
+ */
+#define PUBLICATION_KEY(category, instance, container) \
+	((((guint64) (category))            << 48) | \
+	 (((guint64) ((container) & 0xFFFF)) << 32) | \
+	 ((guint64) (instance)))
+#define PUBLICATION_KEY_CATEGORY(key)  ((guint) ((key) >> 48))
+#define PUBLICATION_KEY_CONTAINER(key) ((guint) (((key) >> 32) & 0xFFFF))
+
+static guint publication_category(const gchar *name)
+{
+	if (sipe_strequal(name, "state"))
+		return(SIPE_PUB_CATEGORY_STATE);
+	if (sipe_strequal(name, "note"))
+		return(SIPE_PUB_CATEGORY_NOTE);
+	if (sipe_strequal(name, "calendarData"))
+		return(SIPE_PUB_CATEGORY_CALENDAR_DATA);
+	if (sipe_strequal(name, "device"))
+		return(SIPE_PUB_CATEGORY_DEVICE);
+	return(SIPE_PUB_CATEGORY_UNKNOWN);
+}
+
+static guint publication_key_hash(gconstpointer key)
+{
+	guint64 value = *((const guint64 *) key);
+	return((guint) (value ^ (value >> 32)));
+}
+
+static gboolean publication_key_equal(gconstpointer a, gconstpointer b)
+{
+	return(*((const guint64 *) a) == *((const guint64 *) b));
+}
+
+GHashTable *sipe_ocs2007_publications_new(void)
+{
+	return(g_hash_table_new_full(publication_key_hash,
+				     publication_key_equal,
+				     NULL,
+				     (GDestroyNotify) free_publication));
+}
+
+static struct sipe_publication *publication_new(const gchar *name,
+						guint instance,
+						guint container,
+						guint version)
+{
+	struct sipe_publication *publication = g_new0(struct sipe_publication, 1);
+
+	publication->key       = PUBLICATION_KEY(publication_category(name),
+						 instance,
+						 container);
+	publication->category  = g_strdup(name);
+	publication->instance  = instance;
+	publication->container = container;
+	publication->version   = version;
+
+	return(publication);
+}
+
+/* key is owned by the publication: always replace the old entry */
+static void publication_insert(GHashTable *publications,
+			       struct sipe_publication *publication)
+{
+	g_hash_table_replace(publications, &publication->key, publication);
+}
+
+static struct sipe_publication *publication_find(struct sipe_core_private *sipe_private,
+						 guint category,
+						 guint instance,
+						 guint container)
+{
+	guint64 key = PUBLICATION_KEY(category, instance, container);
+	return(g_hash_table_lookup(sipe_private->our_publications, &key));
+}
+
+struct publication_delete_payload {
+	guint category;
 	guint container;
+	gboolean any_container;
 };
 
-static void sipe_remove_category_container_publications_cb(const gchar *name,
-							   struct sipe_publication *publication,
-							   struct hash_table_delete_payload *payload)
+static gboolean sipe_remove_category_container_publications_cb(gpointer key,
+							       SIPE_UNUSED_PARAMETER gpointer publication,
+							       gpointer user_data)
 {
-	if (publication->container == payload->container) {
-		g_hash_table_remove(payload->hash_table, name);
-	}
+	guint64 value = *((guint64 *) key);
+	struct publication_delete_payload *payload = user_data;
+
+	return((PUBLICATION_KEY_CATEGORY(value) == payload->category) &&
+	       (payload->any_container ||
+		(PUBLICATION_KEY_CONTAINER(value) == payload->container)));
 }
 
 static void sipe_remove_category_container_publications(GHashTable *our_publications,
 							const gchar *category,
-							guint container)
+							guint container,
+							gboolean any_container)
 {
-	struct hash_table_delete_payload payload;
-	payload.hash_table = g_hash_table_lookup(our_publications, category);
+	struct publication_delete_payload payload;
 
-	if (!payload.hash_table) return;
+	payload.category = publication_category(category);
+	if (payload.category == SIPE_PUB_CATEGORY_UNKNOWN) return;
 
-	payload.container = container;
-	g_hash_table_foreach(payload.hash_table,
-			     (GHFunc)sipe_remove_category_container_publications_cb,
-			     &payload);
+	payload.container     = container;
+	payload.any_container = any_container;
+	g_hash_table_foreach_remove(our_publications,
+				    sipe_remove_category_container_publications_cb,
+				    &payload);
 }
 
 /** MS-PRES container */
@@ -250,6 +343,15 @@ struct sipe_container {
 	guint id;
 	guint version;
 	GSList *members;
+	GHashTable *member_index; /* (type, value) -> member */
+};
+
+/** Locally stored MS-PRES containers */
+struct sipe_containers {
+	GHashTable *by_id;            /* id -> container */
+	GSList *access_domains;       /* values of "domain" members, sorted */
+	gboolean access_domains_valid;
+	guint version;                /* incremented by containers_changed() */
 };
 
 /** MS-PRES container member */
@@ -271,12 +373,68 @@ static void free_container_member(struct sipe_container_member *member)
 	g_free(member);
 }
 
+static guint container_member_hash(gconstpointer key)
+{
+	const struct sipe_container_member *member = key;
+	return((member->type  ? sipe_strcase_hash(member->type) * 31 : 0) +
+	       (member->value ? sipe_strcase_hash(member->value)     : 0));
+}
+
+static gboolean container_member_equal(gconstpointer a, gconstpointer b)
+{
+	const struct sipe_container_member *member_a = a;
+	const struct sipe_container_member *member_b = b;
+	return(sipe_strcase_equal(member_a->type,  member_b->type) &&
+	       sipe_strcase_equal(member_a->value, member_b->value));
+}
+
+static void container_add_member(struct sipe_container *container,
+				 const gchar *type,
+				 const gchar *value)
+{
+	struct sipe_container_member *member = g_new0(struct sipe_container_member, 1);
+
+	member->type  = g_strdup(type);
+	member->value = g_strdup(value);
+	container->members = g_slist_append(container->members, member);
+
+	if (!container->member_index)
+		container->member_index = g_hash_table_new(container_member_hash,
+							   container_member_equal);
+	/* first member wins, same as a list search */
+	if (!g_hash_table_lookup(container->member_index, member))
+		g_hash_table_insert(container->member_index, member, member);
+}
+
+static void container_remove_member(struct sipe_container *container,
+				    struct sipe_container_member *member)
+{
+	GSList *entry;
+
+	container->members = g_slist_remove(container->members, member);
+	g_hash_table_remove(container->member_index, member);
+
+	/* duplicate member takes over */
+	for (entry = container->members; entry; entry = entry->next) {
+		if (container_member_equal(entry->data, member)) {
+			g_hash_table_insert(container->member_index,
+					    entry->data,
+					    entry->data);
+			break;
+		}
+	}
+
+	free_container_member(member);
+}
+
 static void sipe_ocs2007_free_container(struct sipe_container *container)
 {
 	GSList *entry;
 
 	if (!container) return;
 
+	if (container->member_index)
+		g_hash_table_destroy(container->member_index);
 	entry = container->members;
 	while (entry) {
 		void *data = entry->data;
@@ -286,41 +444,114 @@ static void sipe_ocs2007_free_container(struct sipe_container *container)
 	g_free(container);
 }
 
-void sipe_core_buddy_menu_free(struct sipe_core_public *sipe_public)
+static void containers_changed(struct sipe_core_private *sipe_private)
 {
-	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
-	sipe_utils_slist_free_full(sipe_private->blist_menu_containers,
-				   (GDestroyNotify) sipe_ocs2007_free_container);
-	sipe_private->blist_menu_containers = NULL;
+	struct sipe_containers *containers = sipe_private->containers;
+
+	sipe_utils_slist_free_full(containers->access_domains, g_free);
+	containers->access_domains       = NULL;
+	containers->access_domains_valid = FALSE;
+	containers->version++;
 }
 
-static void blist_menu_remember_container(struct sipe_core_private *sipe_private,
-					  struct sipe_container *container)
+struct access_level_menu;
+
+/** Buddy menu entry for an access level change */
+struct access_level_action {
+	const struct access_level_menu *menu;
+	guint container_id;                  /* (guint) -1: unspecify */
+};
+
+/**
+ * Access levels menu data for one member
+ *
+ * Created once per member and kept until disconnect, because the backend
+ * menu entries point to the actions. The access level of the member is
+ * only recalculated after the containers have changed.
+ */
+struct access_level_menu {
+	struct sipe_container_member member; /* hash table key */
+	guint version;                       /* containers version */
+	int container_id;
+	gboolean is_group_access;
+	struct access_level_action actions[CONTAINERS_LEN + 1];
+};
+
+static void access_level_menu_free(gpointer data)
 {
-	sipe_private->blist_menu_containers = g_slist_prepend(sipe_private->blist_menu_containers,
-							      container);
+	struct access_level_menu *menu = data;
+
+	g_free(menu->member.type);
+	g_free(menu->member.value);
+	g_free(menu);
 }
 
-static struct sipe_container *create_container(guint index,
-					       const gchar *member_type,
-					       const gchar *member_value,
-					       gboolean is_group)
+void sipe_core_buddy_menu_free(struct sipe_core_public *sipe_public)
 {
-	struct sipe_container *container = g_new0(struct sipe_container, 1);
-	struct sipe_container_member *member = g_new0(struct sipe_container_member, 1);
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
 
-	container->id = is_group ? (guint) -1 : containers[index];
-	container->members = g_slist_append(container->members, member);
-	member->type = g_strdup(member_type);
-	member->value = g_strdup(member_value);
+	if (sipe_private->blist_menu_members) {
+		g_hash_table_destroy(sipe_private->blist_menu_members);
+		sipe_private->blist_menu_members = NULL;
+	}
+}
+
+static const struct access_level_menu *access_level_menu_get(struct sipe_core_private *sipe_private,
+							     const gchar *member_type,
+							     const gchar *member_value)
+{
+	guint version = sipe_private->containers ? sipe_private->containers->version : 0;
+	struct sipe_container_member key;
+	struct access_level_menu *menu;
+
+	if (!sipe_private->blist_menu_members)
+		sipe_private->blist_menu_members = g_hash_table_new_full(container_member_hash,
+									 container_member_equal,
+									 NULL,
+									 access_level_menu_free);
+
+	key.type  = (gchar *) member_type;
+	key.value = (gchar *) member_value;
+	menu = g_hash_table_lookup(sipe_private->blist_menu_members, &key);
+
+	if (!menu) {
+		guint i;
+
+		menu = g_new0(struct access_level_menu, 1);
+		menu->member.type  = g_strdup(member_type);
+		menu->member.value = g_strdup(member_value);
+		for (i = 0; i <= CONTAINERS_LEN; i++) {
+			menu->actions[i].menu         = menu;
+			menu->actions[i].container_id = (i < CONTAINERS_LEN) ?
+				containers[i] : (guint) -1;
+		}
+		g_hash_table_insert(sipe_private->blist_menu_members,
+				    &menu->member,
+				    menu);
+	} else if (menu->version == version) {
+		return(menu);
+	}
+
+	menu->version         = version;
+	menu->is_group_access = FALSE;
+	menu->container_id    = sipe_ocs2007_find_access_level(sipe_private,
+							       member_type,
+							       member_value,
+							       &menu->is_group_access);
 
-	return(container);
+	return(menu);
 }
 
 void sipe_ocs2007_free(struct sipe_core_private *sipe_private)
 {
-	sipe_utils_slist_free_full(sipe_private->containers,
-				   (GDestroyNotify) sipe_ocs2007_free_container);
+	struct sipe_containers *containers = sipe_private->containers;
+
+	if (!containers) return;
+
+	g_hash_table_destroy(containers->by_id);
+	sipe_utils_slist_free_full(containers->access_domains, g_free);
+	g_free(containers);
+	sipe_private->containers = NULL;
 }
 
 /**
@@ -331,24 +562,16 @@ sipe_find_container_member(struct sipe_container *container,
 			   const gchar *type,
 			   const gchar *value)
 {
-	struct sipe_container_member *member;
-	GSList *entry;
+	struct sipe_container_member key;
 
-	if (container == NULL || type == NULL) {
+	if (container == NULL || type == NULL || container->member_index == NULL) {
 		return NULL;
 	}
 
-	entry = container->members;
-	while (entry) {
-		member = entry->data;
-		if (sipe_strcase_equal(member->type, type) &&
-		    sipe_strcase_equal(member->value, value))
-		{
-			return member;
-		}
-		entry = entry->next;
-	}
-	return NULL;
+	/* lookup only, strings are not modified */
+	key.type  = (gchar *) type;
+	key.value = (gchar *) value;
+	return(g_hash_table_lookup(container->member_index, &key));
 }
 
 /**
@@ -357,15 +580,11 @@ sipe_find_container_member(struct sipe_container *container,
 static struct sipe_container *sipe_find_container(struct sipe_core_private *sipe_private,
 						  guint id)
 {
-	GSList *entry = sipe_private->containers;
-	while (entry) {
-		struct sipe_container *container = entry->data;
-		if (id == container->id) {
-			return container;
-		}
-		entry = entry->next;
-	}
-	return NULL;
+	struct sipe_containers *containers = sipe_private->containers;
+
+	if (!containers) return NULL;
+
+	return(g_hash_table_lookup(containers->by_id, GUINT_TO_POINTER(id)));
 }
 
 static int sipe_find_member_access_level(struct sipe_core_private *sipe_private,
@@ -517,98 +736,116 @@ int sipe_ocs2007_find_access_level(struct sipe_core_private *sipe_private,
 	return container_id;
 }
 
-static GSList *get_access_domains(struct sipe_core_private *sipe_private)
+static void get_access_domains_cb(SIPE_UNUSED_PARAMETER gpointer id,
+				  gpointer value,
+				  gpointer user_data)
 {
-	struct sipe_container *container;
-	struct sipe_container_member *member;
+	struct sipe_container *container = value;
+	struct sipe_utils_set *domains = user_data;
 	GSList *entry;
-	GSList *entry2;
-	GSList *res = NULL;
 
-	entry = sipe_private->containers;
-	while (entry) {
-		container = entry->data;
-
-		entry2 = container->members;
-		while (entry2) {
-			member = entry2->data;
-			if (sipe_strcase_equal(member->type, "domain"))
-			{
-				res = sipe_utils_slist_insert_unique_sorted(res,
-									    g_strdup(member->value),
-									    (GCompareFunc)g_ascii_strcasecmp,
-									    g_free);
-			}
-			entry2 = entry2->next;
-		}
-		entry = entry->next;
+	for (entry = container->members; entry; entry = entry->next) {
+		struct sipe_container_member *member = entry->data;
+		if (sipe_strcase_equal(member->type, "domain") && member->value &&
+		    !sipe_utils_set_contains(domains, member->value))
+			sipe_utils_set_add(domains, g_strdup(member->value));
 	}
-	return res;
 }
 
-static void sipe_send_container_members_prepare(const guint container_id,
-						const guint container_version,
-						const gchar *action,
-						const gchar *type,
-						const gchar *value,
-						char **container_xmls)
+/* calculated once after each container update. List is owned by cache */
+static const GSList *get_access_domains(struct sipe_core_private *sipe_private)
 {
-	gchar *value_str = value ? g_strdup_printf(" value=\"%s\"", value) : g_strdup("");
-	gchar *body;
+	struct sipe_containers *containers = sipe_private->containers;
 
-	if (!container_xmls) return;
+	if (!containers) return NULL;
 
-	body = g_strdup_printf(
-		"<container id=\"%d\" version=\"%d\"><member action=\"%s\" type=\"%s\"%s/></container>",
-		container_id,
-		container_version,
-		action,
-		type,
-		value_str);
-	g_free(value_str);
+	if (!containers->access_domains_valid) {
+		struct sipe_utils_set *domains = sipe_utils_set_new(sipe_strcase_hash,
+								    (GEqualFunc) sipe_strcase_equal,
+								    g_free);
 
-	if ((*container_xmls) == NULL) {
-		*container_xmls = body;
-	} else {
-		char *tmp = *container_xmls;
-
-		*container_xmls = g_strconcat(*container_xmls, body, NULL);
-		g_free(tmp);
-		g_free(body);
+		g_hash_table_foreach(containers->by_id,
+				     get_access_domains_cb,
+				     domains);
+		containers->access_domains = sipe_utils_set_free_to_list(domains,
+									 (GCompareFunc) g_ascii_strcasecmp);
+		containers->access_domains_valid = TRUE;
 	}
+	return(containers->access_domains);
 }
 
-static void sipe_send_set_container_members(struct sipe_core_private *sipe_private,
-					    char *container_xmls)
-{
-	gchar *self;
-	gchar *contact;
-	gchar *hdr;
-	gchar *body;
+/** Collects container member changes for one setContainerMembers request */
+struct sipe_ocs2007_access_batch {
+	struct sipe_core_private *sipe_private;
+	GString *members[CONTAINERS_LEN]; /* <member> elements per container */
+	GHashTable *users;                /* affected "user" member values */
+	GHashTable *domains;              /* affected "domain" member values */
+	gboolean everybody;               /* other member types affect all buddies */
+};
 
-	if (!container_xmls) return;
+static void sipe_refresh_blocked_status_cb(char *buddy_name,
+					   struct sipe_buddy *buddy,
+					   struct sipe_core_private *sipe_private);
+static void sipe_refresh_blocked_status(struct sipe_core_private *sipe_private);
 
-	self = sip_uri_self(sipe_private);
-	body = g_strdup_printf(
-		"<setContainerMembers xmlns=\"http://schemas.microsoft.com/2006/09/sip/container-management\">"
-		"%s"
-		"</setContainerMembers>",
-		container_xmls);
+struct sipe_ocs2007_access_batch *sipe_ocs2007_access_batch_start(struct sipe_core_private *sipe_private)
+{
+	struct sipe_ocs2007_access_batch *batch = g_new0(struct sipe_ocs2007_access_batch, 1);
+
+	batch->sipe_private = sipe_private;
+	batch->users        = g_hash_table_new_full(sipe_strcase_hash,
+						    (GEqualFunc) sipe_strcase_equal,
+						    g_free,
+						    NULL);
+	batch->domains      = g_hash_table_new_full(sipe_strcase_hash,
+						    (GEqualFunc) sipe_strcase_equal,
+						    g_free,
+						    NULL);
+
+	return(batch);
+}
 
-	contact = get_contact(sipe_private);
-	hdr = g_strdup_printf("Contact: %s\r\n"
-			      "Content-Type: application/msrtc-setcontainermembers+xml\r\n", contact);
-	g_free(contact);
+static void access_batch_member(struct sipe_ocs2007_access_batch *batch,
+				const guint container_id,
+				const gchar *action,
+				const gchar *type,
+				const gchar *value)
+{
+	GString *members;
+	guint i;
 
-	sip_transport_service(sipe_private,
-			      self,
-			      hdr,
-			      body,
-			      NULL);
+	for (i = 0; i < CONTAINERS_LEN; i++)
+		if (containers[i] == container_id)
+			break;
+	if (i == CONTAINERS_LEN)
+		return;
 
-	g_free(hdr);
-	g_free(body);
-	g_free(self);
+	members = batch->members[i];
+	if (!members)
+		members = batch->members[i] = g_string_new("");
+
+	g_string_append_printf(members,
+			       "<member action=\"%s\" type=\"%s\"",
+			       action,
+			       type);
+	if (value) {
+		g_string_append(members, " value=\"");
+		sipe_soap_append_escaped(members, value);
+		g_string_append_c(members, '"');
+	}
+	g_string_append(members, "/>");
+
+	/* remember whose blocked status might change */
+	if (sipe_strequal(type, "user"))
+		g_hash_table_insert(batch->users,
+				    g_strdup(sipe_get_no_sip_uri(value)),
+				    GINT_TO_POINTER(TRUE));
+	else if (sipe_strequal(type, "domain"))
+		g_hash_table_insert(batch->domains,
+				    g_strdup(value),
+				    GINT_TO_POINTER(TRUE));
+	else
+		batch->everybody = TRUE;
 }
 
 /**
@@ -617,14 +854,14 @@ static void sipe_send_set_container_members(struct sipe_core_private *sipe_priva
   * @param type		a type of member. E.g. "user", "sameEnterprise", etc.
   * @param value	a value for member. E.g. SIP URI for "user" member type.
   */
-void sipe_ocs2007_change_access_level(struct sipe_core_private *sipe_private,
+void sipe_ocs2007_access_batch_change(struct sipe_ocs2007_access_batch *batch,
 				      const int container_id,
 				      const gchar *type,
 				      const gchar *value)
 {
+	struct sipe_core_private *sipe_private = batch->sipe_private;
 	unsigned int i;
 	int current_container_id = -1;
-	char *container_xmls = NULL;
 
 	/* for each container: find/delete */
 	for (i = 0; i < CONTAINERS_LEN; i++) {
@@ -638,9 +875,10 @@ void sipe_ocs2007_change_access_level(struct sipe_core_private *sipe_private,
 			current_container_id = containers[i];
 			/* delete/publish current access level */
 			if (container_id < 0 || container_id != current_container_id) {
-				sipe_send_container_members_prepare(current_container_id, container->version, "remove", type, value, &container_xmls);
+				access_batch_member(batch, current_container_id, "remove", type, value);
 				/* remove member from our cache, to be able to recalculate AL below */
-				container->members = g_slist_remove(container->members, member);
+				container_remove_member(container, member);
+				containers_changed(sipe_private);
 				current_container_id = -1;
 			}
 		}
@@ -652,34 +890,132 @@ void sipe_ocs2007_change_access_level(struct sipe_core_private *sipe_private,
 	/* assign/publish new access level */
 	if (container_id != current_container_id && container_id >= 0) {
 		struct sipe_container *container = sipe_find_container(sipe_private, container_id);
-		guint version = container ? container->version : 0;
 
-		sipe_send_container_members_prepare(container_id, version, "add", type, value, &container_xmls);
+		access_batch_member(batch, container_id, "add", type, value);
+
+		/* server confirms with a roaming self NOTIFY */
+		if (container) {
+			container_add_member(container, type, value);
+			containers_changed(sipe_private);
+		}
+	}
+}
+
+static void access_batch_refresh_cb(char *buddy_name,
+				    struct sipe_buddy *buddy,
+				    struct sipe_ocs2007_access_batch *batch)
+{
+	const gchar *user   = sipe_get_no_sip_uri(buddy_name);
+	const gchar *domain = sipe_get_domain(user);
+
+	if (g_hash_table_lookup(batch->users, user) ||
+	    (domain && g_hash_table_lookup(batch->domains, domain)))
+		sipe_refresh_blocked_status_cb(buddy_name,
+					       buddy,
+					       batch->sipe_private);
+}
+
+static void access_batch_refresh_user_cb(gpointer key,
+					 SIPE_UNUSED_PARAMETER gpointer value,
+					 gpointer user_data)
+{
+	struct sipe_core_private *sipe_private = user_data;
+	gchar *uri = sip_uri(key);
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private, uri);
+
+	if (buddy)
+		sipe_refresh_blocked_status_cb((char *) buddy->name,
+					       buddy,
+					       sipe_private);
+	g_free(uri);
+}
+
+void sipe_ocs2007_access_batch_commit(struct sipe_ocs2007_access_batch *batch)
+{
+	struct sipe_core_private *sipe_private = batch->sipe_private;
+	GString *body = NULL;
+	unsigned int i;
+
+	for (i = 0; i < CONTAINERS_LEN; i++) {
+		GString *members = batch->members[i];
+
+		if (members) {
+			struct sipe_container *container = sipe_find_container(sipe_private,
+										containers[i]);
+
+			if (!body)
+				body = g_string_new("<setContainerMembers xmlns=\"http://schemas.microsoft.com/2006/09/sip/container-management\">");
+			g_string_append_printf(body,
+					       "<container id=\"%d\" version=\"%d\">%s</container>",
+					       containers[i],
+					       container ? container->version : 0,
+					       members->str);
+			g_string_free(members, TRUE);
+		}
 	}
 
-	if (container_xmls) {
-		sipe_send_set_container_members(sipe_private, container_xmls);
+	if (body) {
+		gchar *self = sip_uri_self(sipe_private);
+		gchar *hdr = g_strdup_printf("Contact: %s\r\n"
+					     "Content-Type: application/msrtc-setcontainermembers+xml\r\n",
+					     get_contact(sipe_private));
+
+		g_string_append(body, "</setContainerMembers>");
+		sip_transport_service(sipe_private,
+				      self,
+				      hdr,
+				      body->str,
+				      NULL);
+
+		g_free(hdr);
+		g_free(self);
+		g_string_free(body, TRUE);
+
+		/* local state has already been updated */
+		if (batch->everybody)
+			sipe_refresh_blocked_status(sipe_private);
+		else if (g_hash_table_size(batch->domains))
+			sipe_buddy_foreach(sipe_private,
+					   (GHFunc) access_batch_refresh_cb,
+					   batch);
+		else
+			g_hash_table_foreach(batch->users,
+					     access_batch_refresh_user_cb,
+					     sipe_private);
 	}
-	g_free(container_xmls);
+
+	g_hash_table_destroy(batch->domains);
+	g_hash_table_destroy(batch->users);
+	g_free(batch);
+}
+
+void sipe_ocs2007_change_access_level(struct sipe_core_private *sipe_private,
+				      const int container_id,
+				      const gchar *type,
+				      const gchar *value)
+{
+	struct sipe_ocs2007_access_batch *batch = sipe_ocs2007_access_batch_start(sipe_private);
+	sipe_ocs2007_access_batch_change(batch, container_id, type, value);
+	sipe_ocs2007_access_batch_commit(batch);
 }
 
 void sipe_core_change_access_level_from_container(struct sipe_core_public *sipe_public,
 						  gpointer parameter)
 {
-	struct sipe_container *container = parameter;
-	struct sipe_container_member *member;
+	const struct access_level_action *action = parameter;
+	const struct sipe_container_member *member;
 
-	if (!container || !container->members) return;
+	if (!action) return;
 
-	member = ((struct sipe_container_member *)container->members->data);
+	member = &action->menu->member;
 
 	if (!member->type) return;
 
 	SIPE_DEBUG_INFO("sipe_ocs2007_change_access_level_from_container: container->id=%d, member->type=%s, member->value=%s",
-			container->id, member->type, member->value ? member->value : "");
+			action->container_id, member->type, member->value ? member->value : "");
 
 	sipe_ocs2007_change_access_level(SIPE_CORE_PRIVATE,
-					 container->id,
+					 action->container_id,
 					 member->type,
 					 member->value);
 
@@ -710,6 +1046,13 @@ void sipe_core_change_access_level_for_domain(struct sipe_core_public *sipe_publ
  * 13:00, 13:15, 13:30, 13:45, etc.
  *
  */
+/* calendar transition: debounced with other status changes */
+static void publish_calendar_status_self(struct sipe_core_private *sipe_private,
+					 SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	sipe_status_publish(sipe_private, TRUE, FALSE);
+}
+
 static void schedule_publish_update(struct sipe_core_private *sipe_private,
 				    time_t calculate_from)
 {
@@ -726,7 +1069,7 @@ static void schedule_publish_update(struct sipe_core_private *sipe_private,
 			      "<+2007-cal-status>",
 			      NULL,
 			      next_start - time(NULL),
-			      sipe_ocs2007_presence_publish,
+			      publish_calendar_status_self,
 			      NULL);
 }
 
@@ -866,16 +1209,10 @@ static gchar *sipe_publish_get_category_state_calendar(struct sipe_core_private
 		sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_CALENDAR_OOF) :
 		sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_CALENDAR);
 
-	/* key is <category><instance><container> */
-	gchar *key_2 = g_strdup_printf("<%s><%u><%u>", "state", instance, 2);
-	gchar *key_3 = g_strdup_printf("<%s><%u><%u>", "state", instance, 3);
 	struct sipe_publication *publication_2 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "state"), key_2);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_STATE, instance, 2);
 	struct sipe_publication *publication_3 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "state"), key_3);
-
-	g_free(key_2);
-	g_free(key_3);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_STATE, instance, 3);
 
 	if (!publication_3 && !event) { /* was nothing, have nothing, exiting */
 		SIPE_DEBUG_INFO("sipe_publish_get_category_state_calendar: "
@@ -979,17 +1316,13 @@ static gchar *sipe_publish_get_category_note(struct sipe_core_private *sipe_priv
 					     gboolean force_publish)
 {
 	guint instance = sipe_strequal("OOF", note_type) ? sipe_get_pub_instance(sipe_private, SIPE_PUB_NOTE_OOF) : 0;
-	/* key is <category><instance><container> */
-	gchar *key_note_200 = g_strdup_printf("<%s><%u><%u>", "note", instance, 200);
-	gchar *key_note_300 = g_strdup_printf("<%s><%u><%u>", "note", instance, 300);
-	gchar *key_note_400 = g_strdup_printf("<%s><%u><%u>", "note", instance, 400);
 
 	struct sipe_publication *publication_note_200 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "note"), key_note_200);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_NOTE, instance, 200);
 	struct sipe_publication *publication_note_300 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "note"), key_note_300);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_NOTE, instance, 300);
 	struct sipe_publication *publication_note_400 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "note"), key_note_400);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_NOTE, instance, 400);
 
 	char *tmp = note ? sipe_backend_markup_strip_html(note) : NULL;
 	char *n1 = tmp ? g_markup_escape_text(tmp, -1) : NULL;
@@ -1000,9 +1333,6 @@ static gchar *sipe_publish_get_category_note(struct sipe_core_private *sipe_priv
 
 	g_free(tmp);
 	tmp = NULL;
-	g_free(key_note_200);
-	g_free(key_note_300);
-	g_free(key_note_400);
 
 	/* we even need to republish empty note */
 	if (!force_publish && sipe_strequal(n1, n2))
@@ -1132,37 +1462,22 @@ static gchar *sipe_publish_get_category_cal_working_hours(struct sipe_core_priva
 {
 	struct sipe_calendar* cal = sipe_private->calendar;
 
-	/* key is <category><instance><container> */
-	gchar *key_cal_1     = g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 1);
-	gchar *key_cal_100   = g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 100);
-	gchar *key_cal_200   = g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 200);
-	gchar *key_cal_300   = g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 300);
-	gchar *key_cal_400   = g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 400);
-	gchar *key_cal_32000 = g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 32000);
-
 	struct sipe_publication *publication_cal_1 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_1);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, 0, 1);
 	struct sipe_publication *publication_cal_100 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_100);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, 0, 100);
 	struct sipe_publication *publication_cal_200 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_200);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, 0, 200);
 	struct sipe_publication *publication_cal_300 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_300);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, 0, 300);
 	struct sipe_publication *publication_cal_400 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_400);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, 0, 400);
 	struct sipe_publication *publication_cal_32000 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_32000);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, 0, 32000);
 
 	const char *n1 = cal ? cal->working_hours_xml_str : NULL;
 	const char *n2 = publication_cal_300 ? publication_cal_300->working_hours_xml_str : NULL;
 
-	g_free(key_cal_1);
-	g_free(key_cal_100);
-	g_free(key_cal_200);
-	g_free(key_cal_300);
-	g_free(key_cal_400);
-	g_free(key_cal_32000);
-
 	if (!cal || is_empty(cal->email) || is_empty(cal->working_hours_xml_str)) {
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_publish_get_category_cal_working_hours: no data to publish, exiting");
 		return NULL;
@@ -1264,37 +1579,22 @@ static gchar *sipe_publish_get_category_cal_free_busy(struct sipe_core_private *
 	guint cal_data_instance = sipe_get_pub_instance(sipe_private, SIPE_PUB_CALENDAR_DATA);
 	char *fb_start_str;
 	char *free_busy_base64;
-	/* const char *st; */
-	/* const char *fb; */
+	const char *st;
+	const char *fb;
 	char *res;
 
-	/* key is <category><instance><container> */
-	gchar *key_cal_1     = g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 1);
-	gchar *key_cal_100   = g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 100);
-	gchar *key_cal_200   = g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 200);
-	gchar *key_cal_300   = g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 300);
-	gchar *key_cal_400   = g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 400);
-	gchar *key_cal_32000 = g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 32000);
-
 	struct sipe_publication *publication_cal_1 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_1);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, cal_data_instance, 1);
 	struct sipe_publication *publication_cal_100 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_100);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, cal_data_instance, 100);
 	struct sipe_publication *publication_cal_200 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_200);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, cal_data_instance, 200);
 	struct sipe_publication *publication_cal_300 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_300);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, cal_data_instance, 300);
 	struct sipe_publication *publication_cal_400 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_400);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, cal_data_instance, 400);
 	struct sipe_publication *publication_cal_32000 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "calendarData"), key_cal_32000);
-
-	g_free(key_cal_1);
-	g_free(key_cal_100);
-	g_free(key_cal_200);
-	g_free(key_cal_300);
-	g_free(key_cal_400);
-	g_free(key_cal_32000);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_CALENDAR_DATA, cal_data_instance, 32000);
 
 	if (!cal || is_empty(cal->email) || !cal->fb_start || is_empty(cal->free_busy)) {
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_publish_get_category_cal_free_busy: no data to publish, exiting");
@@ -1304,19 +1604,19 @@ static gchar *sipe_publish_get_category_cal_free_busy(struct sipe_core_private *
 	fb_start_str = sipe_utils_time_to_str(cal->fb_start);
 	free_busy_base64 = sipe_cal_get_freebusy_base64(cal->free_busy);
 
-	/* we will rebuplish the same data to refresh publication time,
-	 * so if data from multiple sources, most recent will be choosen
+	/* the server copy of our publication is the reference, i.e. if
+	 * another endpoint has published different data we'll overwrite it
 	 */
-	// st = publication_cal_300 ? publication_cal_300->fb_start_str : NULL;
-	// fb = publication_cal_300 ? publication_cal_300->free_busy_base64 : NULL;
-	//
-	//if (sipe_strequal(st, fb_start_str) && sipe_strequal(fb, free_busy_base64))
-	//{
-	//	SIPE_DEBUG_INFO_NOFORMAT("sipe_publish_get_category_cal_free_busy: FreeBusy has NOT changed. Exiting.");
-	//	g_free(fb_start_str);
-	//	g_free(free_busy_base64);
-	//	return NULL; /* nothing to update */
-	//}
+	st = publication_cal_300 ? publication_cal_300->fb_start_str : NULL;
+	fb = publication_cal_300 ? publication_cal_300->free_busy_base64 : NULL;
+
+	if (sipe_strequal(st, fb_start_str) && sipe_strequal(fb, free_busy_base64))
+	{
+		SIPE_DEBUG_INFO_NOFORMAT("sipe_publish_get_category_cal_free_busy: FreeBusy has NOT changed. Exiting.");
+		g_free(fb_start_str);
+		g_free(free_busy_base64);
+		return NULL; /* nothing to update */
+	}
 
 	res = g_strdup_printf(SIPE_PUB_XML_FREE_BUSY,
 				/* 1 */
@@ -1384,14 +1684,10 @@ static gchar *sipe_publish_get_category_device(struct sipe_core_private *sipe_pr
 {
 	gchar *uri;
 	gchar *doc;
-	gchar *uuid = get_uuid(sipe_private);
+	const gchar *uuid = get_uuid(sipe_private);
 	guint device_instance = sipe_get_pub_instance(sipe_private, SIPE_PUB_DEVICE);
-	/* key is <category><instance><container> */
-	gchar *key = g_strdup_printf("<%s><%u><%u>", "device", device_instance, 2);
 	struct sipe_publication *publication =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "device"), key);
-
-	g_free(key);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_DEVICE, device_instance, 2);
 
 	uri = sip_uri_self(sipe_private);
 	doc = g_strdup_printf(SIPE_PUB_XML_DEVICE,
@@ -1404,7 +1700,6 @@ static gchar *sipe_publish_get_category_device(struct sipe_core_private *sipe_pr
 	);
 
 	g_free(uri);
-	g_free(uuid);
 
 	return doc;
 }
@@ -1468,16 +1763,10 @@ static gchar *sipe_publish_get_category_state(struct sipe_core_private *sipe_pri
 	int availability = sipe_ocs2007_availability_from_status(sipe_private->status, NULL);
 	guint instance = is_user_state ? sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_USER) :
 					 sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_MACHINE);
-	/* key is <category><instance><container> */
-	gchar *key_2 = g_strdup_printf("<%s><%u><%u>", "state", instance, 2);
-	gchar *key_3 = g_strdup_printf("<%s><%u><%u>", "state", instance, 3);
 	struct sipe_publication *publication_2 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "state"), key_2);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_STATE, instance, 2);
 	struct sipe_publication *publication_3 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "state"), key_3);
-
-	g_free(key_2);
-	g_free(key_3);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_STATE, instance, 3);
 
 	if (!force_publish && publication_2 && (publication_2->availability == availability))
 	{
@@ -1534,6 +1823,85 @@ static void send_publish_category_initial(struct sipe_core_private *sipe_private
 	g_free(publications);
 }
 
+/**
+ * Extract the publications from our rejected request and replace the
+ * version of the conflicting ones with the current server version.
+ *
+ * [MS-PRES] publish requests are processed atomically, i.e. the other
+ * publications haven't been applied either and must be sent again.
+ * But they are sent unchanged instead of generating all categories
+ * from scratch.
+ *
+ * @param body   our rejected request
+ * @param faults key: index of publication (starts with 1), value: version
+ *
+ * @return publications XML or @c NULL. Must be g_free'd after use.
+ */
+static gchar *publications_with_versions(const gchar *body,
+					 GHashTable *faults)
+{
+	GString *publications;
+	const gchar *end;
+	const gchar *start;
+	guint index = 1;
+
+	if (!body)
+		return(NULL);
+	end = strstr(body, "</publications>");
+	if (!end)
+		return(NULL);
+
+	publications = g_string_new("");
+	start = strstr(body, "<publication ");
+	while (start && (start < end)) {
+		const gchar *next = strstr(start + 1, "<publication ");
+		const gchar *tag_end = strchr(start, '>');
+		const gchar *version = g_strstr_len(start,
+						    tag_end ? tag_end - start : 0,
+						    " version=\"");
+		gchar *idx = g_strdup_printf("%u", index++);
+		const gchar *cur_version = g_hash_table_lookup(faults, idx);
+		g_free(idx);
+
+		if (!next || (next > end))
+			next = end;
+
+		if (cur_version && version) {
+			const gchar *value = version + 10;
+			const gchar *value_end = strchr(value, '"');
+
+			if (value_end && (value_end < next)) {
+				g_string_append_len(publications,
+						    start,
+						    value - start);
+				g_string_append(publications, cur_version);
+				g_string_append_len(publications,
+						    value_end,
+						    next - value_end);
+			} else {
+				g_string_append_len(publications,
+						    start,
+						    next - start);
+			}
+		} else {
+			g_string_append_len(publications,
+					    start,
+					    next - start);
+		}
+
+		start = next;
+	}
+
+	if (publications->len == 0) {
+		g_string_free(publications, TRUE);
+		return(NULL);
+	}
+
+	SIPE_DEBUG_INFO("publications_with_versions: retrying %u publications, %u with new version",
+			index - 1, g_hash_table_size(faults));
+	return(g_string_free(publications, FALSE));
+}
+
 static gboolean process_send_presence_category_publish_response(struct sipe_core_private *sipe_private,
 								struct sipmsg *msg,
 								struct transaction *trans)
@@ -1548,7 +1916,7 @@ static gboolean process_send_presence_category_publish_response(struct sipe_core
 		gchar *fault_code;
 		GHashTable *faults;
 		int index_our;
-		gboolean has_device_publication = FALSE;
+		gchar *publications;
 
 		xml = sipe_xml_parse(msg->body, msg->bodylen);
 
@@ -1592,54 +1960,44 @@ static gboolean process_send_presence_category_publish_response(struct sipe_core
 			const gchar *categoryName = sipe_xml_attribute(node, "categoryName");
 			g_free(idx);
 
-			if (sipe_strequal("device", categoryName)) {
-				has_device_publication = TRUE;
-			}
-
 			if (curVersion) { /* fault exist on this index */
-				const gchar *container = sipe_xml_attribute(node, "container");
-				const gchar *instance = sipe_xml_attribute(node, "instance");
-				/* key is <category><instance><container> */
-				gchar *key = g_strdup_printf("<%s><%s><%s>", categoryName, instance, container);
-				GHashTable *category = g_hash_table_lookup(sipe_private->our_publications, categoryName);
-
-				if (category) {
-					struct sipe_publication *publication =
-						g_hash_table_lookup(category, key);
-
-					SIPE_DEBUG_INFO("key is %s", key);
-
-					if (publication) {
-						SIPE_DEBUG_INFO("Updating %s with version %s. Was %d before.",
-								key, curVersion, publication->version);
-						/* updating publication's version to the correct one */
-						publication->version = atoi(curVersion);
-					}
+				guint container = sipe_xml_int_attribute(node, "container", 0);
+				guint instance  = sipe_xml_int_attribute(node, "instance", 0);
+				struct sipe_publication *publication =
+					publication_find(sipe_private,
+							 publication_category(categoryName),
+							 instance,
+							 container);
+
+				if (publication) {
+					SIPE_DEBUG_INFO("Updating <%s><%u><%u> with version %s. Was %d before.",
+							categoryName, instance, container,
+							curVersion, publication->version);
+					/* updating publication's version to the correct one */
+					publication->version = atoi(curVersion);
 				} else {
-					/* We somehow lost this category from our publications... */
-					struct sipe_publication *publication = g_new0(struct sipe_publication, 1);
-					publication->category  = g_strdup(categoryName);
-					publication->instance  = atoi(instance);
-					publication->container = atoi(container);
-					publication->version   = atoi(curVersion);
-					category = g_hash_table_new_full(g_str_hash, g_str_equal,
-									 g_free, (GDestroyNotify)free_publication);
-					g_hash_table_insert(category, g_strdup(key), publication);
-					g_hash_table_insert(sipe_private->our_publications, g_strdup(categoryName), category);
-					SIPE_DEBUG_INFO("added lost category '%s' key '%s'", categoryName, key);
+					/* We somehow lost this publication... */
+					publication = publication_new(categoryName,
+								      instance,
+								      container,
+								      atoi(curVersion));
+					publication_insert(sipe_private->our_publications,
+							   publication);
+					SIPE_DEBUG_INFO("added lost publication <%s><%u><%u>",
+							categoryName, instance, container);
 				}
-				g_free(key);
 			}
 		}
 		sipe_xml_free(xml);
-		g_hash_table_destroy(faults);
 
 		/* rebublishing with right versions */
-		if (has_device_publication) {
-			send_publish_category_initial(sipe_private);
-		} else {
-			sipe_ocs2007_category_publish(sipe_private, TRUE);
+		publications = publications_with_versions(trans->msg->body,
+							  faults);
+		if (publications) {
+			send_presence_publish(sipe_private, publications);
+			g_free(publications);
 		}
+		g_hash_table_destroy(faults);
 	}
 	return TRUE;
 }
@@ -1661,7 +2019,7 @@ static void send_presence_publish(struct sipe_core_private *sipe_private,
 {
 	gchar *uri;
 	gchar *doc;
-	gchar *tmp;
+	const gchar *tmp;
 	gchar *hdr;
 
 	uri = sip_uri_self(sipe_private);
@@ -1679,7 +2037,6 @@ static void send_presence_publish(struct sipe_core_private *sipe_private,
 			      doc,
 			      process_send_presence_category_publish_response);
 
-	g_free(tmp);
 	g_free(hdr);
 	g_free(uri);
 	g_free(doc);
@@ -1818,15 +2175,10 @@ void sipe_ocs2007_phone_state_publish(struct sipe_core_private *sipe_private)
 	gchar *publications = NULL;
 	guint instance = sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_PHONE_VOIP);
 
-	/* key is <category><instance><container> */
-	gchar *key_2 = g_strdup_printf("<%s><%u><%u>", "state", instance, 2);
-	gchar *key_3 = g_strdup_printf("<%s><%u><%u>", "state", instance, 3);
 	struct sipe_publication *publication_2 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "state"), key_2);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_STATE, instance, 2);
 	struct sipe_publication *publication_3 =
-		g_hash_table_lookup(g_hash_table_lookup(sipe_private->our_publications, "state"), key_3);
-	g_free(key_2);
-	g_free(key_3);
+		publication_find(sipe_private, SIPE_PUB_CATEGORY_STATE, instance, 3);
 
 #ifdef HAVE_VV
 	if (g_hash_table_size(sipe_private->media_calls)) {
@@ -1880,7 +2232,7 @@ void sipe_ocs2007_phone_state_publish(struct sipe_core_private *sipe_private)
 	}
 }
 
-static void sipe_publish_get_cat_state_user_to_clear(SIPE_UNUSED_PARAMETER const char *name,
+static void sipe_publish_get_cat_state_user_to_clear(SIPE_UNUSED_PARAMETER gpointer key,
 						     gpointer value,
 						     GString* str)
 {
@@ -1913,14 +2265,23 @@ void sipe_ocs2007_reset_status(struct sipe_core_private *sipe_private)
 	g_free(publications);
 }
 
-/* key is <category><instance><container> */
-static gboolean sipe_is_our_publication(struct sipe_core_private *sipe_private,
-					const gchar *key)
+static void our_publication_key_add(GHashTable *keys,
+				    guint category,
+				    guint instance,
+				    guint container)
 {
-	GSList *entry;
+	guint64 *key = g_new(guint64, 1);
+	*key = PUBLICATION_KEY(category, instance, container);
+	g_hash_table_insert(keys, key, key);
+}
 
+/* key is packed <category><instance><container>, see PUBLICATION_KEY() */
+static gboolean sipe_is_our_publication(struct sipe_core_private *sipe_private,
+					guint64 key)
+{
 	/* filling keys for our publications if not yet cached */
 	if (!sipe_private->our_publication_keys) {
+		GHashTable *keys;
 		guint device_instance	  = sipe_get_pub_instance(sipe_private, SIPE_PUB_DEVICE);
 		guint machine_instance	  = sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_MACHINE);
 		guint user_instance	  = sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_USER);
@@ -1929,6 +2290,10 @@ static gboolean sipe_is_our_publication(struct sipe_core_private *sipe_private,
 		guint phone_voip_instance = sipe_get_pub_instance(sipe_private, SIPE_PUB_STATE_PHONE_VOIP);
 		guint cal_data_instance	  = sipe_get_pub_instance(sipe_private, SIPE_PUB_CALENDAR_DATA);
 		guint note_oof_instance	  = sipe_get_pub_instance(sipe_private, SIPE_PUB_NOTE_OOF);
+		static const guint calendar_data_containers[] = {
+			1, 100, 200, 300, 400, 32000
+		};
+		guint i;
 
 		SIPE_DEBUG_INFO_NOFORMAT("* Our Publication Instances *");
 		SIPE_DEBUG_INFO("\tDevice               : %u\t0x%08X", device_instance, device_instance);
@@ -1942,99 +2307,57 @@ static gboolean sipe_is_our_publication(struct sipe_core_private *sipe_private,
 		SIPE_DEBUG_INFO("\tNote                 : %u", 0);
 		SIPE_DEBUG_INFO("\tCalendar WorkingHours: %u", 0);
 
+		keys = g_hash_table_new_full(publication_key_hash,
+					     publication_key_equal,
+					     g_free,
+					     NULL);
+
 		/* device */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "device", device_instance, 2));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_DEVICE, device_instance, 2);
 
 		/* state:machineState */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", machine_instance, 2));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", machine_instance, 3));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, machine_instance, 2);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, machine_instance, 3);
 
 		/* state:userState */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", user_instance, 2));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", user_instance, 3));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, user_instance, 2);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, user_instance, 3);
 
 		/* state:calendarState */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", calendar_instance, 2));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", calendar_instance, 3));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, calendar_instance, 2);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, calendar_instance, 3);
 
 		/* state:calendarState OOF */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", cal_oof_instance, 2));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", cal_oof_instance, 3));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, cal_oof_instance, 2);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, cal_oof_instance, 3);
 
 		/* state:phoneState */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", phone_voip_instance, 2));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "state", phone_voip_instance, 3));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, phone_voip_instance, 2);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_STATE, phone_voip_instance, 3);
 
 		/* note */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "note", 0, 200));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "note", 0, 300));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "note", 0, 400));
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_NOTE, 0, 200);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_NOTE, 0, 300);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_NOTE, 0, 400);
 
 		/* note OOF */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "note", note_oof_instance, 200));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "note", note_oof_instance, 300));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "note", note_oof_instance, 400));
-
-		/* calendarData:WorkingHours */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 1));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 100));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 200));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 300));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 400));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", 0, 32000));
-
-		/* calendarData:FreeBusy */
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 1));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 100));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 200));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 300));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 400));
-		sipe_private->our_publication_keys = g_slist_append(sipe_private->our_publication_keys,
-			g_strdup_printf("<%s><%u><%u>", "calendarData", cal_data_instance, 32000));
-
-		//SIPE_DEBUG_INFO("sipe_is_our_publication: sipe_private->our_publication_keys length=%d",
-		//	  sipe_private->our_publication_keys ? (int) g_slist_length(sipe_private->our_publication_keys) : -1);
-	}
-
-	//SIPE_DEBUG_INFO("sipe_is_our_publication: key=%s", key);
-
-	entry = sipe_private->our_publication_keys;
-	while (entry) {
-		//SIPE_DEBUG_INFO("   sipe_is_our_publication: entry->data=%s", entry->data);
-		if (sipe_strequal(entry->data, key)) {
-			return TRUE;
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_NOTE, note_oof_instance, 200);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_NOTE, note_oof_instance, 300);
+		our_publication_key_add(keys, SIPE_PUB_CATEGORY_NOTE, note_oof_instance, 400);
+
+		for (i = 0; i < G_N_ELEMENTS(calendar_data_containers); i++) {
+			/* calendarData:WorkingHours */
+			our_publication_key_add(keys, SIPE_PUB_CATEGORY_CALENDAR_DATA,
+						0, calendar_data_containers[i]);
+			/* calendarData:FreeBusy */
+			our_publication_key_add(keys, SIPE_PUB_CATEGORY_CALENDAR_DATA,
+						cal_data_instance, calendar_data_containers[i]);
 		}
-		entry = entry->next;
+
+		sipe_private->our_publication_keys = keys;
 	}
-	return FALSE;
+
+	return(g_hash_table_lookup(sipe_private->our_publication_keys, &key) != NULL);
 }
 
 static void sipe_refresh_blocked_status_cb(char *buddy_name,
@@ -2068,14 +2391,15 @@ static void sipe_refresh_blocked_status(struct sipe_core_private *sipe_private)
 void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 				       struct sipmsg *msg)
 {
-	gchar *contact;
+	const gchar *contact;
 	gchar *to;
 	sipe_xml *xml;
 	const sipe_xml *node;
 	const sipe_xml *node2;
         char *display_name = NULL;
         char *uri;
-	GSList *category_names = NULL;
+	struct sipe_utils_set *categories;
+	GSList *category_names;
 	int aggreg_avail = 0;
 	gchar *activity_token = NULL;
 	gboolean do_update_status = FALSE;
@@ -2084,7 +2408,7 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 
 	SIPE_DEBUG_INFO_NOFORMAT("sipe_ocs2007_process_roaming_self");
 
-	xml = sipe_xml_parse(msg->body, msg->bodylen);
+	xml = sipmsg_parse_xml_body(msg);
 	if (!xml) return;
 
 	contact = get_contact(sipe_private);
@@ -2092,28 +2416,24 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 
 	/* categories */
 	/* set list of categories participating in this XML */
+	categories = sipe_utils_set_new(g_str_hash, g_str_equal, NULL);
 	for (node = sipe_xml_child(xml, "categories/category"); node; node = sipe_xml_twin(node)) {
 		const gchar *name = sipe_xml_attribute(node, "name");
-		category_names = sipe_utils_slist_insert_unique_sorted(category_names,
-								       (gchar *)name,
-								       (GCompareFunc)strcmp,
-								       NULL);
+		if (name)
+			sipe_utils_set_add(categories, (gchar *)name);
 	}
+	category_names = sipe_utils_set_free_to_list(categories, NULL);
 	SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: category_names length=%d",
 			category_names ? (int) g_slist_length(category_names) : -1);
 	/* drop category information */
 	if (category_names) {
 		GSList *entry = category_names;
 		while (entry) {
-			GHashTable *cat_publications;
 			const gchar *category = entry->data;
 			entry = entry->next;
 			SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: dropping category: %s", category);
-			cat_publications = g_hash_table_lookup(sipe_private->our_publications, category);
-			if (cat_publications) {
-				g_hash_table_remove(sipe_private->our_publications, category);
-				SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: dropped category: %s", category);
-			}
+			sipe_remove_category_container_publications(
+				sipe_private->our_publications, category, 0, TRUE);
 		}
 	}
 	g_slist_free(category_names);
@@ -2129,8 +2449,7 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 		guint version   = sipe_xml_int_attribute(node, "version", 0);
 		time_t publish_time = (tmp = sipe_xml_attribute(node, "publishTime")) ?
 			sipe_utils_str_to_time(tmp) : 0;
-		gchar *key;
-		GHashTable *cat_publications = g_hash_table_lookup(sipe_private->our_publications, name);
+		guint64 key;
 
 		/* Ex. clear note: <category name="note"/> */
 		if (container == (guint)-1) {
@@ -2149,33 +2468,30 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 			}
 			SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: removing publications for: %s/%u", name, container);
 			sipe_remove_category_container_publications(
-				sipe_private->our_publications, name, container);
+				sipe_private->our_publications, name, container, FALSE);
 			continue;
 		}
 
-		/* key is <category><instance><container> */
-		key = g_strdup_printf("<%s><%u><%u>", name, instance, container);
-		SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: key=%s version=%d", key, version);
+		key = PUBLICATION_KEY(publication_category(name), instance, container);
+		SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: key=<%s><%u><%u> version=%d",
+				name, instance, container, version);
 
 		/* capture all userState publication for later clean up if required */
 		if (sipe_strequal(name, "state") && (container == 2 || container == 3)) {
 			const sipe_xml *xn_state = sipe_xml_child(node, "state");
 
 			if (xn_state && sipe_strequal(sipe_xml_attribute(xn_state, "type"), "userState")) {
-				struct sipe_publication *publication = g_new0(struct sipe_publication, 1);
-				publication->category  = g_strdup(name);
-				publication->instance  = instance;
-				publication->container = container;
-				publication->version   = version;
+				struct sipe_publication *publication = publication_new(name,
+										       instance,
+										       container,
+										       version);
 
 				if (!sipe_private->user_state_publications) {
-					sipe_private->user_state_publications = g_hash_table_new_full(
-						g_str_hash, g_str_equal,
-						g_free,	(GDestroyNotify)free_publication);
+					sipe_private->user_state_publications = sipe_ocs2007_publications_new();
 				}
-				g_hash_table_insert(sipe_private->user_state_publications, g_strdup(key), publication);
-				SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added to user_state_publications key=%s version=%d",
-						key, version);
+				publication_insert(sipe_private->user_state_publications, publication);
+				SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added to user_state_publications key=<%s><%u><%u> version=%d",
+						name, instance, container, version);
 			}
 		}
 
@@ -2184,25 +2500,18 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 			g_hash_table_replace(devices, g_strdup_printf("%u", instance), NULL);
 
 		if (sipe_is_our_publication(sipe_private, key)) {
-			struct sipe_publication *publication = g_new0(struct sipe_publication, 1);
-
-			publication->category = g_strdup(name);
-			publication->instance  = instance;
-			publication->container = container;
-			publication->version   = version;
+			struct sipe_publication *publication = publication_new(name,
+									       instance,
+									       container,
+									       version);
 
 			/* filling publication->availability */
 			if (sipe_strequal(name, "state")) {
 				const sipe_xml *xn_state = sipe_xml_child(node, "state");
 				const sipe_xml *xn_avail = sipe_xml_child(xn_state, "availability");
 
-				if (xn_avail) {
-					gchar *avail_str = sipe_xml_data(xn_avail);
-					if (avail_str) {
-						publication->availability = atoi(avail_str);
-					}
-					g_free(avail_str);
-				}
+				if (xn_avail)
+					publication->availability = sipe_xml_data_int(xn_avail, publication->availability);
 				/* for calendarState */
 				if (xn_state && sipe_strequal(sipe_xml_attribute(xn_state, "type"), "calendarState")) {
 					const sipe_xml *xn_activity = sipe_xml_child(xn_state, "activity");
@@ -2273,17 +2582,10 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 				}
 			}
 
-			if (!cat_publications) {
-				cat_publications = g_hash_table_new_full(
-							g_str_hash, g_str_equal,
-							g_free,	(GDestroyNotify)free_publication);
-				g_hash_table_insert(sipe_private->our_publications, g_strdup(name), cat_publications);
-				SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added GHashTable cat=%s", name);
-			}
-			g_hash_table_insert(cat_publications, g_strdup(key), publication);
-			SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added key=%s version=%d", key, version);
+			publication_insert(sipe_private->our_publications, publication);
+			SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added key=<%s><%u><%u> version=%d",
+					name, instance, container, version);
 		}
-		g_free(key);
 
 		/* aggregateState (not an our publication) from 2-nd container */
 		if (sipe_strequal(name, "state") && container == 2) {
@@ -2293,13 +2595,8 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 			if (xn_state && sipe_strequal(sipe_xml_attribute(xn_state, "type"), "aggregateState")) {
 				const sipe_xml *xn_avail = sipe_xml_child(xn_state, "availability");
 
-				if (xn_avail) {
-					gchar *avail_str = sipe_xml_data(xn_avail);
-					if (avail_str) {
-						aggreg_avail = atoi(avail_str);
-					}
-					g_free(avail_str);
-				}
+				if (xn_avail)
+					aggreg_avail = sipe_xml_data_int(xn_avail, aggreg_avail);
 
 				do_update_status = TRUE;
 			}
@@ -2363,57 +2660,61 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 	g_hash_table_destroy(devices);
 
 	/* containers */
-	for (node = sipe_xml_child(xml, "containers/container"); node; node = sipe_xml_twin(node)) {
+	node = sipe_xml_child(xml, "containers/container");
+	if (node) {
+		if (!sipe_private->containers) {
+			sipe_private->containers = g_new0(struct sipe_containers, 1);
+			sipe_private->containers->by_id = g_hash_table_new_full(g_direct_hash,
+										g_direct_equal,
+										NULL,
+										(GDestroyNotify) sipe_ocs2007_free_container);
+		}
+		containers_changed(sipe_private);
+	}
+	for (; node; node = sipe_xml_twin(node)) {
 		guint id = sipe_xml_int_attribute(node, "id", 0);
 		struct sipe_container *container = sipe_find_container(sipe_private, id);
 
 		if (container) {
-			sipe_private->containers = g_slist_remove(sipe_private->containers, container);
 			SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: removed existing container id=%d v%d", container->id, container->version);
-			sipe_ocs2007_free_container(container);
+			/* frees the container */
+			g_hash_table_remove(sipe_private->containers->by_id,
+					    GUINT_TO_POINTER(id));
 		}
 		container = g_new0(struct sipe_container, 1);
 		container->id = id;
 		container->version = sipe_xml_int_attribute(node, "version", 0);
-		sipe_private->containers = g_slist_append(sipe_private->containers, container);
+		g_hash_table_insert(sipe_private->containers->by_id,
+				    GUINT_TO_POINTER(id),
+				    container);
 		SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added container id=%d v%d", container->id, container->version);
 
 		for (node2 = sipe_xml_child(node, "member"); node2; node2 = sipe_xml_twin(node2)) {
-			struct sipe_container_member *member = g_new0(struct sipe_container_member, 1);
-			member->type = g_strdup(sipe_xml_attribute(node2, "type"));
-			member->value = g_strdup(sipe_xml_attribute(node2, "value"));
-			container->members = g_slist_append(container->members, member);
+			const gchar *type  = sipe_xml_attribute(node2, "type");
+			const gchar *value = sipe_xml_attribute(node2, "value");
+			container_add_member(container, type, value);
 			SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: added container member type=%s value=%s",
-					member->type, member->value ? member->value : "");
+					type ? type : "", value ? value : "");
 		}
 	}
 
 	SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: access_level_set=%s",
 			SIPE_CORE_PRIVATE_FLAG_IS(ACCESS_LEVEL_SET) ? "TRUE" : "FALSE");
 	if (!SIPE_CORE_PRIVATE_FLAG_IS(ACCESS_LEVEL_SET) && sipe_xml_child(xml, "containers")) {
-		char *container_xmls = NULL;
+		struct sipe_ocs2007_access_batch *batch = sipe_ocs2007_access_batch_start(sipe_private);
 		int sameEnterpriseAL = sipe_ocs2007_find_access_level(sipe_private, "sameEnterprise", NULL, NULL);
 		int federatedAL      = sipe_ocs2007_find_access_level(sipe_private, "federated", NULL, NULL);
 
 		SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: sameEnterpriseAL=%d", sameEnterpriseAL);
 		SIPE_DEBUG_INFO("sipe_ocs2007_process_roaming_self: federatedAL=%d", federatedAL);
 		/* initial set-up to let counterparties see your status */
-		if (sameEnterpriseAL < 0) {
-			struct sipe_container *container = sipe_find_container(sipe_private, 200);
-			guint version = container ? container->version : 0;
-			sipe_send_container_members_prepare(200, version, "add", "sameEnterprise", NULL, &container_xmls);
-		}
-		if (federatedAL < 0) {
-			struct sipe_container *container = sipe_find_container(sipe_private, 100);
-			guint version = container ? container->version : 0;
-			sipe_send_container_members_prepare(100, version, "add", "federated", NULL, &container_xmls);
-		}
+		if (sameEnterpriseAL < 0)
+			sipe_ocs2007_access_batch_change(batch, 200, "sameEnterprise", NULL);
+		if (federatedAL < 0)
+			sipe_ocs2007_access_batch_change(batch, 100, "federated", NULL);
 		SIPE_CORE_PRIVATE_FLAG_SET(ACCESS_LEVEL_SET);
 
-		if (container_xmls) {
-			sipe_send_set_container_members(sipe_private, container_xmls);
-		}
-		g_free(container_xmls);
+		sipe_ocs2007_access_batch_commit(batch);
 	}
 
 	/* Refresh contacts' blocked status */
@@ -2463,7 +2764,6 @@ void sipe_ocs2007_process_roaming_self(struct sipe_core_private *sipe_private,
 		g_free(uri);
 	}
 
-	g_free(contact);
 	sipe_xml_free(xml);
 
 	/* Publish initial state if not yet.
@@ -2517,18 +2817,14 @@ static struct sipe_backend_buddy_menu *access_levels_menu(struct sipe_core_priva
 							  const gchar *member_value,
 							  const gboolean extra_menu)
 {
+	const struct access_level_menu *cached = access_level_menu_get(sipe_private,
+								       member_type,
+								       member_value);
 	unsigned int i;
-	gboolean is_group_access = FALSE;
-	int container_id;
 
 	if (!menu)
 		menu = sipe_backend_buddy_menu_start(SIPE_CORE_PUBLIC);
 
-	container_id = sipe_ocs2007_find_access_level(sipe_private,
-						      member_type,
-						      member_value,
-						      &is_group_access);
-
 	for (i = 1; i <= CONTAINERS_LEN; i++) {
 		/*
 		 * Blocked should remain in the first place
@@ -2537,18 +2833,11 @@ static struct sipe_backend_buddy_menu *access_levels_menu(struct sipe_core_priva
 		unsigned int j  = (i == CONTAINERS_LEN) ? 0 : i;
 		int container_j = containers[j];
 		const gchar *acc_level_name = sipe_ocs2007_access_level_name(container_j);
-		struct sipe_container *container = create_container(j,
-								    member_type,
-								    member_value,
-								    FALSE);
 		gchar *label;
 
-		/* libpurple memory leak workaround */
-		blist_menu_remember_container(sipe_private, container);
-
 		/* current container/access level */
-		if (container_j == container_id) {
-			label = is_group_access ?
+		if (container_j == cached->container_id) {
+			label = cached->is_group_access ?
 				g_strdup_printf(INDENT_MARKED_INHERITED_FMT, acc_level_name) :
 				g_strdup_printf(SIPE_OCS2007_INDENT_MARKED_FMT, acc_level_name);
 		} else {
@@ -2559,15 +2848,11 @@ static struct sipe_backend_buddy_menu *access_levels_menu(struct sipe_core_priva
 						   menu,
 						   label,
 						   SIPE_BUDDY_MENU_CHANGE_ACCESS_LEVEL,
-						   container);
+						   (gpointer) &cached->actions[j]);
 		g_free(label);
 	}
 
-	if (extra_menu && (container_id >= 0) && !is_group_access) {
-		struct sipe_container *container = create_container(0,
-									    member_type,
-									    member_value,
-									    TRUE);
+	if (extra_menu && (cached->container_id >= 0) && !cached->is_group_access) {
 		gchar *label;
 
 		/* separator */
@@ -2575,17 +2860,13 @@ static struct sipe_backend_buddy_menu *access_levels_menu(struct sipe_core_priva
 							 menu,
 							 "  --------------");
 
-
-		/* libpurple memory leak workaround */
-		blist_menu_remember_container(sipe_private, container);
-
 		/* Translators: remove (clear) previously assigned access level */
 		label = g_strdup_printf(INDENT_FMT, _("Unspecify"));
 		menu = sipe_backend_buddy_menu_add(SIPE_CORE_PUBLIC,
 						   menu,
 						   label,
 						   SIPE_BUDDY_MENU_CHANGE_ACCESS_LEVEL,
-						   container);
+						   (gpointer) &cached->actions[CONTAINERS_LEN]);
 		g_free(label);
 	}
 
@@ -2595,7 +2876,7 @@ static struct sipe_backend_buddy_menu *access_levels_menu(struct sipe_core_priva
 static struct sipe_backend_buddy_menu *access_groups_menu(struct sipe_core_private *sipe_private)
 {
 	struct sipe_backend_buddy_menu *menu = sipe_backend_buddy_menu_start(SIPE_CORE_PUBLIC);
-	GSList *access_domains, *entry;
+	const GSList *entry;
 
 	menu = sipe_backend_buddy_sub_menu_add(SIPE_CORE_PUBLIC,
 					       menu,
@@ -2625,12 +2906,11 @@ static struct sipe_backend_buddy_menu *access_groups_menu(struct sipe_core_priva
 								  NULL,
 								  TRUE));
 
-	entry = access_domains = get_access_domains(sipe_private);
+	entry = get_access_domains(sipe_private);
 	while (entry) {
-		gchar *domain    = entry->data;
-		gchar *menu_name = g_strdup_printf(_("People at %s"), domain);
+		const gchar *domain = entry->data;
+		gchar *menu_name    = g_strdup_printf(_("People at %s"), domain);
 
-		/* takes over ownership of entry->data (= domain) */
 		menu = sipe_backend_buddy_sub_menu_add(SIPE_CORE_PUBLIC,
 						       menu,
 						       menu_name,
@@ -2643,7 +2923,6 @@ static struct sipe_backend_buddy_menu *access_groups_menu(struct sipe_core_priva
 
 		entry = entry->next;
 	}
-	g_slist_free(access_domains);
 
 	/* separator */
 	/*			                  People in domains connected with my company */
@@ -2667,20 +2946,15 @@ struct sipe_backend_buddy_menu *sipe_ocs2007_access_control_menu(struct sipe_cor
 	gchar *label;
 
 	/*
-	 * Workaround for missing libpurple API to release resources allocated
-	 * during blist_node_menu() callback. See also:
+	 * libpurple has no API to release resources allocated during the
+	 * blist_node_menu() callback. See also:
 	 *
 	 *   <http://developer.pidgin.im/ticket/12597>
 	 *
-	 * We remember all memory blocks in a list and deallocate them when
-	 *
-	 *   - the next time we enter the callback, or
-	 *   - the account is disconnected
-	 *
-	 * That means that after the buddy menu has been closed we have unused
-	 * resources but at least we don't leak them anymore...
+	 * Therefore menu actions point to per-member data that is reused by
+	 * every menu for that member and released when the account is
+	 * disconnected. See access_level_menu_get().
 	 */
-	sipe_core_buddy_menu_free(SIPE_CORE_PUBLIC);
 
 	label = g_strdup_printf(INDENT_FMT, _("Online help..."));
 	menu = sipe_backend_buddy_menu_add(SIPE_CORE_PUBLIC,
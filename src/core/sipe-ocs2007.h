@@ -25,6 +25,7 @@
 struct sipmsg;
 struct sipe_container;
 struct sipe_core_private;
+struct sipe_ocs2007_access_batch;
 
 /**
  * Member is directly placed to access level container.
@@ -49,6 +50,13 @@ gboolean sipe_ocs2007_availability_is_away(guint availability);
 void sipe_ocs2007_presence_publish(struct sipe_core_private *sipe_private,
 				   gpointer unused);
 void sipe_ocs2007_free(struct sipe_core_private *sipe_private);
+
+/**
+ * Create table for MS-PRES publications (OCS2007+)
+ *
+ * @return hash table with packed <category><instance><container> keys
+ */
+GHashTable *sipe_ocs2007_publications_new(void);
 void sipe_ocs2007_category_publish(struct sipe_core_private *sipe_private,
 				   gboolean force_publish);
 void sipe_ocs2007_phone_state_publish(struct sipe_core_private *sipe_private);
@@ -69,6 +77,21 @@ void sipe_ocs2007_change_access_level(struct sipe_core_private *sipe_private,
 				      const gchar *type,
 				      const gchar *value);
 
+/**
+ * Batched access level changes
+ *
+ * All changes are sent in one setContainerMembers request by
+ * @c sipe_ocs2007_access_batch_commit(), which also frees the batch.
+ * The local containers are updated immediately and blocked status is
+ * only refreshed for the affected buddies.
+ */
+struct sipe_ocs2007_access_batch *sipe_ocs2007_access_batch_start(struct sipe_core_private *sipe_private);
+void sipe_ocs2007_access_batch_change(struct sipe_ocs2007_access_batch *batch,
+				      const int container_id,
+				      const gchar *type,
+				      const gchar *value);
+void sipe_ocs2007_access_batch_commit(struct sipe_ocs2007_access_batch *batch);
+
 /* buddy menu */
 struct sipe_backend_buddy_menu *sipe_ocs2007_access_control_menu(struct sipe_core_private *sipe_private,
 								 const gchar *buddy_name);
@@ -0,0 +1,325 @@
+/**
+ * @file sipe-peer-caps.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Cache file format: magic line followed by one line per peer
+ *
+ *   <expiration time> <ICE version> <MCU types> <peer URI>
+ *
+ * Unknown values are written as "-". MCU types are prefixed with "=" and
+ * separated by ",", i.e. a server without MCUs is written as "=".
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-peer-caps.h"
+#include "sipe-roster-cache.h"
+#include "sipe-utils.h"
+
+#define PEER_CAPS_FILE    "capabilities"
+#define PEER_CAPS_MAGIC   "SIPE CAPABILITIES 1\n"
+#define PEER_CAPS_TTL     (7 * 24 * 60 * 60) /* seconds */
+#define PEER_CAPS_MAX     256
+#define PEER_CAPS_UNKNOWN "-"
+
+struct peer_caps {
+	gint64 expires;             /* time(NULL) */
+	SipeIceVersion ice_version;
+	gboolean ice_known;
+	gchar *mcu_types;           /* NULL: unknown */
+};
+
+struct sipe_peer_caps {
+	GHashTable *peers; /* key: lower case URI, value: struct peer_caps */
+	gboolean dirty;
+};
+
+static void peer_caps_free(gpointer data)
+{
+	struct peer_caps *caps = data;
+	g_free(caps->mcu_types);
+	g_free(caps);
+}
+
+static void peer_caps_load(struct sipe_core_private *sipe_private,
+			   GHashTable *peers)
+{
+	gchar *filename = sipe_roster_cache_filename(sipe_private,
+						     PEER_CAPS_FILE);
+	gchar *contents;
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		if (g_str_has_prefix(contents, PEER_CAPS_MAGIC)) {
+			gchar **lines = g_strsplit(contents + strlen(PEER_CAPS_MAGIC),
+						   "\n",
+						   PEER_CAPS_MAX + 1);
+			gint64 now = time(NULL);
+			gchar **line;
+
+			for (line = lines; *line; line++) {
+				gchar **fields = g_strsplit(*line, " ", 4);
+
+				if ((g_strv_length(fields) == 4) &&
+				    !is_empty(fields[3]) &&
+				    (g_ascii_strtoll(fields[0], NULL, 10) > now)) {
+					struct peer_caps *caps = g_new0(struct peer_caps, 1);
+
+					caps->expires = g_ascii_strtoll(fields[0], NULL, 10);
+					if (!sipe_strequal(fields[1], PEER_CAPS_UNKNOWN)) {
+						guint64 ice_version = g_ascii_strtoull(fields[1], NULL, 10);
+						if (ice_version <= SIPE_ICE_RFC_5245) {
+							caps->ice_version = ice_version;
+							caps->ice_known   = TRUE;
+						}
+					}
+					if (fields[2][0] == '=')
+						caps->mcu_types = g_strdup(fields[2] + 1);
+
+					g_hash_table_insert(peers,
+							    g_ascii_strdown(fields[3], -1),
+							    caps);
+				}
+				g_strfreev(fields);
+			}
+			g_strfreev(lines);
+
+			SIPE_DEBUG_INFO("peer_caps_load: %u peer(s)",
+					g_hash_table_size(peers));
+		}
+		g_free(contents);
+	}
+	g_free(filename);
+}
+
+static void peer_caps_save(struct sipe_core_private *sipe_private,
+			   GHashTable *peers)
+{
+	GString *buffer = g_string_new(PEER_CAPS_MAGIC);
+	gint64 now = time(NULL);
+	GHashTableIter iter;
+	gpointer key, value;
+	gchar *filename;
+	gchar *dirname;
+
+	g_hash_table_iter_init(&iter, peers);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const struct peer_caps *caps = value;
+
+		if (caps->expires <= now)
+			continue;
+
+		g_string_append_printf(buffer, "%" G_GINT64_FORMAT " ",
+				       caps->expires);
+		if (caps->ice_known)
+			g_string_append_printf(buffer, "%u ",
+					       (guint) caps->ice_version);
+		else
+			g_string_append(buffer, PEER_CAPS_UNKNOWN " ");
+		if (caps->mcu_types)
+			g_string_append_printf(buffer, "=%s ", caps->mcu_types);
+		else
+			g_string_append(buffer, PEER_CAPS_UNKNOWN " ");
+		g_string_append_printf(buffer, "%s\n", (const gchar *) key);
+	}
+
+	filename = sipe_roster_cache_filename(sipe_private, PEER_CAPS_FILE);
+	dirname  = g_path_get_dirname(filename);
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(filename, buffer->str, buffer->len, NULL)))
+		SIPE_DEBUG_ERROR("peer_caps_save: can't write '%s'",
+				 filename);
+	g_free(dirname);
+	g_free(filename);
+	g_string_free(buffer, TRUE);
+}
+
+/* cache is loaded on first use */
+static struct sipe_peer_caps *peer_caps_init(struct sipe_core_private *sipe_private)
+{
+	struct sipe_peer_caps *peer_caps = sipe_private->peer_caps;
+
+	if (!peer_caps) {
+		sipe_private->peer_caps = peer_caps = g_new0(struct sipe_peer_caps, 1);
+		peer_caps->peers = g_hash_table_new_full(g_str_hash,
+							 g_str_equal,
+							 g_free,
+							 peer_caps_free);
+		peer_caps_load(sipe_private, peer_caps->peers);
+	}
+
+	return(peer_caps);
+}
+
+static struct peer_caps *peer_caps_lookup(struct sipe_core_private *sipe_private,
+					  const gchar *peer)
+{
+	struct sipe_peer_caps *peer_caps;
+	struct peer_caps *caps;
+	gchar *key;
+
+	if (!peer)
+		return(NULL);
+
+	peer_caps = peer_caps_init(sipe_private);
+	key       = g_ascii_strdown(peer, -1);
+	caps      = g_hash_table_lookup(peer_caps->peers, key);
+	if (caps && (caps->expires <= time(NULL))) {
+		g_hash_table_remove(peer_caps->peers, key);
+		caps = NULL;
+	}
+	g_free(key);
+
+	return(caps);
+}
+
+/* every update restarts the expiration time of the entry */
+static struct peer_caps *peer_caps_update(struct sipe_core_private *sipe_private,
+					  const gchar *peer)
+{
+	struct sipe_peer_caps *peer_caps;
+	struct peer_caps *caps;
+
+	if (!peer)
+		return(NULL);
+
+	peer_caps = peer_caps_init(sipe_private);
+	caps      = peer_caps_lookup(sipe_private, peer);
+	if (!caps) {
+		/* no usage order is kept for these entries: drop all of them */
+		if (g_hash_table_size(peer_caps->peers) >= PEER_CAPS_MAX)
+			g_hash_table_remove_all(peer_caps->peers);
+
+		caps = g_new0(struct peer_caps, 1);
+		g_hash_table_insert(peer_caps->peers,
+				    g_ascii_strdown(peer, -1),
+				    caps);
+	}
+	caps->expires    = time(NULL) + PEER_CAPS_TTL;
+	peer_caps->dirty = TRUE;
+
+	return(caps);
+}
+
+gboolean sipe_peer_caps_get_ice_version(struct sipe_core_private *sipe_private,
+					const gchar *peer,
+					SipeIceVersion *ice_version)
+{
+	const struct peer_caps *caps = peer_caps_lookup(sipe_private, peer);
+
+	if (caps && caps->ice_known) {
+		SIPE_DEBUG_INFO("sipe_peer_caps_get_ice_version: %s uses ICEv%d",
+				peer,
+				caps->ice_version == SIPE_ICE_DRAFT_6 ? 6 : 19);
+		*ice_version = caps->ice_version;
+		return(TRUE);
+	}
+
+	return(FALSE);
+}
+
+void sipe_peer_caps_set_ice_version(struct sipe_core_private *sipe_private,
+				    const gchar *peer,
+				    SipeIceVersion ice_version)
+{
+	struct peer_caps *caps = peer_caps_update(sipe_private, peer);
+
+	if (caps) {
+		caps->ice_version = ice_version;
+		caps->ice_known   = TRUE;
+	}
+}
+
+gboolean sipe_peer_caps_get_mcu_types(struct sipe_core_private *sipe_private,
+				      const gchar *server,
+				      GSList **types)
+{
+	const struct peer_caps *caps = peer_caps_lookup(sipe_private, server);
+
+	if (caps && caps->mcu_types) {
+		gchar **list = g_strsplit(caps->mcu_types, ",", 0);
+		gchar **type;
+
+		SIPE_DEBUG_INFO("sipe_peer_caps_get_mcu_types: %s offers '%s'",
+				server, caps->mcu_types);
+
+		for (type = list; *type; type++)
+			if (!is_empty(*type))
+				*types = g_slist_append(*types, g_strdup(*type));
+		g_strfreev(list);
+		return(TRUE);
+	}
+
+	return(FALSE);
+}
+
+void sipe_peer_caps_set_mcu_types(struct sipe_core_private *sipe_private,
+				  const gchar *server,
+				  const GSList *types)
+{
+	struct peer_caps *caps = peer_caps_update(sipe_private, server);
+
+	if (caps) {
+		GString *list = g_string_new(NULL);
+
+		for (; types; types = types->next) {
+			const gchar *type = types->data;
+
+			/* would break the file format */
+			if (strpbrk(type, " ,\n"))
+				continue;
+			if (list->len)
+				g_string_append_c(list, ',');
+			g_string_append(list, type);
+		}
+		g_free(caps->mcu_types);
+		caps->mcu_types = g_string_free(list, FALSE);
+	}
+}
+
+void sipe_peer_caps_free(struct sipe_core_private *sipe_private)
+{
+	struct sipe_peer_caps *peer_caps = sipe_private->peer_caps;
+
+	if (!peer_caps)
+		return;
+
+	if (peer_caps->dirty)
+		peer_caps_save(sipe_private, peer_caps->peers);
+	g_hash_table_destroy(peer_caps->peers);
+	g_free(peer_caps);
+	sipe_private->peer_caps = NULL;
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,101 @@
+/**
+ * @file sipe-peer-caps.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Peer capability cache
+ *
+ * Remembers capabilities that were learned from a peer or a server, e.g.
+ * the ICE version that a call had to be retried with. Entries are kept in
+ * the user cache directory across sessions and expire after a week.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ * "sipe-backend.h"
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+
+/**
+ * ICE version known to work with a peer
+ *
+ * @param sipe_private SIPE core private data
+ * @param peer         peer or server URI (may be @c NULL)
+ * @param ice_version  set to cached ICE version if known
+ *
+ * @return @c TRUE if the ICE version is known
+ */
+gboolean sipe_peer_caps_get_ice_version(struct sipe_core_private *sipe_private,
+					const gchar *peer,
+					SipeIceVersion *ice_version);
+
+/**
+ * Remember ICE version that works with a peer
+ *
+ * @param sipe_private SIPE core private data
+ * @param peer         peer or server URI (may be @c NULL)
+ * @param ice_version  ICE version
+ */
+void sipe_peer_caps_set_ice_version(struct sipe_core_private *sipe_private,
+				    const gchar *peer,
+				    SipeIceVersion ice_version);
+
+/**
+ * MCU types offered by a conferencing server
+ *
+ * @param sipe_private SIPE core private data
+ * @param server       focus factory URI (may be @c NULL)
+ * @param types        cached MCU types are appended to this list
+ *
+ * @return @c TRUE if the MCU types are known
+ */
+gboolean sipe_peer_caps_get_mcu_types(struct sipe_core_private *sipe_private,
+				      const gchar *server,
+				      GSList **types);
+
+/**
+ * Remember MCU types offered by a conferencing server
+ *
+ * @param sipe_private SIPE core private data
+ * @param server       focus factory URI (may be @c NULL)
+ * @param types        list of MCU type strings
+ */
+void sipe_peer_caps_set_mcu_types(struct sipe_core_private *sipe_private,
+				  const gchar *server,
+				  const GSList *types);
+
+/**
+ * Write cache to disk and free it
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_peer_caps_free(struct sipe_core_private *sipe_private);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
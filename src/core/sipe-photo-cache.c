@@ -0,0 +1,293 @@
+/**
+ * @file sipe-photo-cache.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * File format:
+ *
+ *   "SIPEPHOTO1" LF photo hash LF ETag LF photo data
+ *
+ * The file name is the SHA-1 digest of the buddy URI.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-digest.h"
+#include "sipe-job.h"
+#include "sipe-photo-cache.h"
+#include "sipe-utils.h"
+
+#define PHOTO_CACHE_MAGIC "SIPEPHOTO1\n"
+
+struct photo_cache_entry {
+	gchar *contents;     /* complete file */
+	const gchar *hash;   /* points into contents */
+	const gchar *etag;   /* points into contents, NULL if empty */
+	const gchar *photo;  /* points into contents */
+	gsize size;
+};
+
+static gchar *photo_cache_filename(struct sipe_core_private *sipe_private,
+				   const gchar *uri)
+{
+	gchar *name = g_strdup(sipe_private->username);
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+	gchar *digest_string;
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	sipe_digest_sha1((const guchar *) uri, strlen(uri), digest);
+	digest_string = buff_to_hex_str(digest, SIPE_DIGEST_SHA1_LENGTH);
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    "photos",
+				    digest_string,
+				    NULL);
+	g_free(digest_string);
+	g_free(name);
+
+	return(filename);
+}
+
+/* NUL terminate line and return start of next line */
+static gchar *photo_cache_line(gchar *start, const gchar *end)
+{
+	gchar *eol = memchr(start, '\n', end - start);
+	if (!eol)
+		return(NULL);
+	*eol = '\0';
+	return(eol + 1);
+}
+
+static gboolean photo_cache_read(struct sipe_core_private *sipe_private,
+				 const gchar *uri,
+				 struct photo_cache_entry *entry)
+{
+	gchar *filename = photo_cache_filename(sipe_private, uri);
+	gsize length;
+	gboolean valid = FALSE;
+
+	memset(entry, 0, sizeof(*entry));
+	if (g_file_get_contents(filename, &entry->contents, &length, NULL)) {
+		const gchar *end = entry->contents + length;
+		gchar *hash = entry->contents + strlen(PHOTO_CACHE_MAGIC);
+		gchar *etag;
+		gchar *photo;
+
+		if ((length > strlen(PHOTO_CACHE_MAGIC)) &&
+		    g_str_has_prefix(entry->contents, PHOTO_CACHE_MAGIC) &&
+		    ((etag  = photo_cache_line(hash, end)) != NULL) &&
+		    ((photo = photo_cache_line(etag, end)) != NULL) &&
+		    (photo < end)) {
+			entry->hash  = hash;
+			entry->etag  = *etag ? etag : NULL;
+			entry->photo = photo;
+			entry->size  = end - photo;
+			valid = TRUE;
+		} else {
+			SIPE_DEBUG_INFO("photo_cache_read: ignoring corrupted file '%s'",
+					filename);
+			g_free(entry->contents);
+			entry->contents = NULL;
+		}
+	}
+	g_free(filename);
+
+	return(valid);
+}
+
+static void photo_cache_set_photo(struct sipe_core_private *sipe_private,
+				  const gchar *uri,
+				  const gchar *photo_hash,
+				  const struct photo_cache_entry *entry)
+{
+	/* backend takes ownership of photo data */
+	sipe_backend_buddy_set_photo(SIPE_CORE_PUBLIC,
+				     uri,
+				     g_memdup(entry->photo, entry->size),
+				     entry->size,
+				     photo_hash);
+}
+
+gboolean sipe_photo_cache_load(struct sipe_core_private *sipe_private,
+			       const gchar *uri,
+			       const gchar *photo_hash)
+{
+	struct photo_cache_entry entry;
+	gboolean found = FALSE;
+
+	if (photo_cache_read(sipe_private, uri, &entry)) {
+		if (sipe_strequal(entry.hash, photo_hash)) {
+			SIPE_DEBUG_INFO("sipe_photo_cache_load: '%s' hash '%s'",
+					uri, photo_hash);
+			photo_cache_set_photo(sipe_private, uri, photo_hash, &entry);
+			found = TRUE;
+		}
+		g_free(entry.contents);
+	}
+
+	return(found);
+}
+
+gchar *sipe_photo_cache_etag(struct sipe_core_private *sipe_private,
+			     const gchar *uri)
+{
+	struct photo_cache_entry entry;
+	gchar *etag = NULL;
+
+	if (photo_cache_read(sipe_private, uri, &entry)) {
+		etag = g_strdup(entry.etag);
+		g_free(entry.contents);
+	}
+
+	return(etag);
+}
+
+gboolean sipe_photo_cache_revalidate(struct sipe_core_private *sipe_private,
+				     const gchar *uri,
+				     const gchar *photo_hash)
+{
+	struct photo_cache_entry entry;
+
+	if (!photo_cache_read(sipe_private, uri, &entry))
+		return(FALSE);
+
+	SIPE_DEBUG_INFO("sipe_photo_cache_revalidate: '%s' hash '%s' -> '%s'",
+			uri, entry.hash, photo_hash);
+	photo_cache_set_photo(sipe_private, uri, photo_hash, &entry);
+	sipe_photo_cache_store(sipe_private,
+			       uri,
+			       photo_hash,
+			       entry.etag,
+			       entry.photo,
+			       entry.size);
+	g_free(entry.contents);
+
+	return(TRUE);
+}
+
+struct photo_cache_write {
+	gchar *filename;
+	GString *contents;
+};
+
+static void photo_cache_write_free(gpointer data)
+{
+	struct photo_cache_write *job = data;
+	g_string_free(job->contents, TRUE);
+	g_free(job->filename);
+	g_free(job);
+}
+
+/* worker thread: returns error message or NULL */
+static gpointer photo_cache_write(gpointer data)
+{
+	struct photo_cache_write *job = data;
+	gchar *dirname = g_path_get_dirname(job->filename);
+	GError *error  = NULL;
+	gchar *message = NULL;
+
+	if (!((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	      g_file_set_contents(job->filename,
+				  job->contents->str,
+				  job->contents->len,
+				  &error))) {
+		message = g_strdup(error ? error->message : "can't create directory");
+		if (error)
+			g_error_free(error);
+	}
+	g_free(dirname);
+
+	return(message);
+}
+
+/* main thread */
+static void photo_cache_written(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+				gpointer result,
+				gpointer data)
+{
+	struct photo_cache_write *job = data;
+
+	if (result) {
+		SIPE_DEBUG_ERROR("sipe_photo_cache_store: can't write '%s': %s",
+				 job->filename, (const gchar *) result);
+		g_free(result);
+	}
+}
+
+void sipe_photo_cache_store(struct sipe_core_private *sipe_private,
+			    const gchar *uri,
+			    const gchar *photo_hash,
+			    const gchar *etag,
+			    gconstpointer photo,
+			    gsize size)
+{
+	struct photo_cache_write *job;
+	GString *buffer;
+
+	/* line based header */
+	if (is_empty(photo_hash) || strpbrk(photo_hash, "\r\n") ||
+	    (etag && strpbrk(etag, "\r\n")) ||
+	    (size == 0))
+		return;
+
+	buffer = g_string_sized_new(strlen(PHOTO_CACHE_MAGIC) +
+				    strlen(photo_hash) +
+				    (etag ? strlen(etag) : 0) +
+				    2 + size);
+	g_string_append(buffer, PHOTO_CACHE_MAGIC);
+	g_string_append(buffer, photo_hash);
+	g_string_append_c(buffer, '\n');
+	if (etag)
+		g_string_append(buffer, etag);
+	g_string_append_c(buffer, '\n');
+	g_string_append_len(buffer, photo, size);
+
+	/* file is written behind by a worker thread */
+	job = g_new0(struct photo_cache_write, 1);
+	job->filename = photo_cache_filename(sipe_private, uri);
+	job->contents = buffer;
+	sipe_job_submit(sipe_private,
+			photo_cache_write,
+			photo_cache_written,
+			job,
+			photo_cache_write_free,
+			g_free);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,98 @@
+/**
+ * @file sipe-photo-cache.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * On-disk buddy photo cache
+ *
+ * One file per buddy URI in the user cache directory. It contains the
+ * server photo hash, the HTTP ETag (if any) and the photo data. A photo
+ * is only taken from the cache if the server still reports the same hash.
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+
+/**
+ * Set buddy photo from cache
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ * @param photo_hash   photo hash reported by the server
+ *
+ * @return @c TRUE if a photo with this hash was found and set
+ */
+gboolean sipe_photo_cache_load(struct sipe_core_private *sipe_private,
+			       const gchar *uri,
+			       const gchar *photo_hash);
+
+/**
+ * ETag of cached photo
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ *
+ * @return ETag for If-None-Match header or @c NULL. Must be g_free()'d.
+ */
+gchar *sipe_photo_cache_etag(struct sipe_core_private *sipe_private,
+			     const gchar *uri);
+
+/**
+ * Server confirmed that cached photo is still valid (304 Not Modified)
+ *
+ * Sets the buddy photo from the cache and updates the cached hash.
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ * @param photo_hash   new photo hash reported by the server
+ *
+ * @return @c TRUE if the cached photo could be set
+ */
+gboolean sipe_photo_cache_revalidate(struct sipe_core_private *sipe_private,
+				     const gchar *uri,
+				     const gchar *photo_hash);
+
+/**
+ * Add photo to cache
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ * @param photo_hash   photo hash reported by the server
+ * @param etag         HTTP ETag (may be @c NULL)
+ * @param photo        photo data
+ * @param size         size of photo data
+ */
+void sipe_photo_cache_store(struct sipe_core_private *sipe_private,
+			    const gchar *uri,
+			    const gchar *photo_hash,
+			    const gchar *etag,
+			    gconstpointer photo,
+			    gsize size);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
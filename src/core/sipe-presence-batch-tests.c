@@ -0,0 +1,312 @@
+/**
+ * @file sipe-presence-batch-tests.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Presence updates must be applied in arrival order, even when a large
+ * batched NOTIFY is still being parsed on worker threads. Jobs are held
+ * back by the stubbed job API and completed in a chosen order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-digest.h"
+#include "sipe-job.h"
+#include "sipe-metrics.h"
+#include "sipe-mime.h"
+#include "sipe-presence-batch.h"
+#include "sipe-xml.h"
+
+/* stub functions for backend API */
+void sipe_backend_debug_literal(sipe_debug_level level,
+				const gchar *msg)
+{
+	printf("DEBUG %d: %s\n", level, msg);
+}
+void sipe_backend_debug(sipe_debug_level level,
+			const gchar *format,
+			...)
+{
+	va_list args;
+	gchar *msg;
+	va_start(args, format);
+	msg = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	sipe_backend_debug_literal(level, msg);
+	g_free(msg);
+}
+gboolean sipe_backend_debug_enabled(void)
+{
+	return TRUE;
+}
+
+void sipe_digest_sha1(SIPE_UNUSED_PARAMETER const guchar *data,
+		      SIPE_UNUSED_PARAMETER gsize length,
+		      SIPE_UNUSED_PARAMETER guchar *digest) {}
+const gchar *sipe_backend_network_ip_address(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public) { return(NULL); }
+gchar *sipe_backend_markup_css_property(SIPE_UNUSED_PARAMETER const gchar *style,
+					SIPE_UNUSED_PARAMETER const gchar *option) { return(NULL); }
+void sipe_mime_init(void) {}
+void sipe_mime_shutdown(void) {}
+void sipe_mime_parts_foreach_fallback(SIPE_UNUSED_PARAMETER const gchar *type,
+				      SIPE_UNUSED_PARAMETER const gchar *body,
+				      SIPE_UNUSED_PARAMETER sipe_mime_parts_cb callback,
+				      SIPE_UNUSED_PARAMETER gpointer user_data) {}
+void sipe_metrics_memory_string(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+				SIPE_UNUSED_PARAMETER const gchar *string) {}
+void sipe_metrics_memory_list(SIPE_UNUSED_PARAMETER struct sipe_memory_usage *usage,
+			      SIPE_UNUSED_PARAMETER guint length) {}
+
+/* stub job API: jobs wait until the test runs or cancels them */
+struct sipe_job {
+	struct sipe_core_private *sipe_private;
+	sipe_job_func *func;
+	sipe_job_callback *callback;
+	gpointer data;
+	GDestroyNotify data_free;
+};
+
+static GQueue *jobs = NULL;
+
+struct sipe_job *sipe_job_submit(struct sipe_core_private *sipe_private,
+				 sipe_job_func *func,
+				 sipe_job_callback *callback,
+				 gpointer data,
+				 GDestroyNotify data_free,
+				 SIPE_UNUSED_PARAMETER GDestroyNotify result_free)
+{
+	struct sipe_job *job = g_new0(struct sipe_job, 1);
+
+	job->sipe_private = sipe_private;
+	job->func         = func;
+	job->callback     = callback;
+	job->data         = data;
+	job->data_free    = data_free;
+	g_queue_push_tail(jobs, job);
+	return(job);
+}
+
+static void job_finish(struct sipe_job *job, gboolean run)
+{
+	if (run)
+		job->callback(job->sipe_private, job->func(job->data), job->data);
+	job->data_free(job->data);
+	g_free(job);
+}
+
+/* complete the pending jobs from the last to the first */
+static void jobs_run_reversed(void)
+{
+	struct sipe_job *job;
+
+	while ((job = g_queue_pop_tail(jobs)) != NULL)
+		job_finish(job, TRUE);
+}
+
+/* stub notify callbacks: record the order in which updates are applied */
+static GString *applied = NULL;
+
+sipe_xml *sipe_notify_presence_parse(SIPE_UNUSED_PARAMETER enum sipe_presence_part_type type,
+				     const gchar *body,
+				     gsize length)
+{
+	return(sipe_xml_parse(body, length));
+}
+
+void sipe_notify_presence_apply(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+				enum sipe_presence_part_type type,
+				const gchar *body,
+				gsize length,
+				const sipe_xml *xml)
+{
+	sipe_xml *parsed = xml ? NULL : sipe_xml_parse(body, length);
+	const gchar *uri = sipe_xml_attribute(xml ? xml : parsed, "uri");
+
+	g_string_append_printf(applied, "%s%d:%s",
+			       applied->len ? " " : "",
+			       type,
+			       uri ? uri : "?");
+	sipe_xml_free(parsed);
+}
+
+static const gchar *multipart_type =
+	"multipart/related;type=\"application/rlmi+xml\";start=resourceList;boundary=batch";
+
+static gchar *build_multipart(const gchar *prefix, guint count, GString *expected)
+{
+	GString *body = g_string_new("");
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		g_string_append_printf(body,
+				       "--batch\r\n"
+				       "Content-Type: text/xml+msrtc.pidf\r\n"
+				       "\r\n"
+				       "<presentity uri=\"sip:%s%03u@example.com\">"
+				       "<availability aggregate=\"3500\" description=\"\"/>"
+				       "</presentity>\r\n",
+				       prefix, i);
+		g_string_append_printf(expected, "%s%d:sip:%s%03u@example.com",
+				       expected->len ? " " : "",
+				       SIPE_PRESENCE_PART_MSRTC,
+				       prefix, i);
+	}
+	g_string_append(body, "--batch--\r\n");
+
+	return(g_string_free(body, FALSE));
+}
+
+static void queue_single(struct sipe_core_private *sipe_private,
+			 enum sipe_presence_part_type type,
+			 const gchar *uri,
+			 GString *expected)
+{
+	gchar *body = g_strdup_printf("<presentity uri=\"%s\"/>", uri);
+
+	sipe_presence_batch_queue(sipe_private, type, body, strlen(body));
+	g_free(body);
+	g_string_append_printf(expected, "%s%d:%s",
+			       expected->len ? " " : "",
+			       type,
+			       uri);
+}
+
+static int check(const gchar *label, const GString *expected)
+{
+	int failed = 0;
+
+	if (strcmp(applied->str, expected->str)) {
+		printf("FAILED: %s\n  expected: %s\n  applied:  %s\n",
+		       label, expected->str, applied->str);
+		failed = 1;
+	} else {
+		printf("OK: %s\n", label);
+	}
+
+	g_string_truncate(applied, 0);
+	return(failed);
+}
+
+int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char *argv[])
+{
+	struct sipe_core_private *sipe_private = g_new0(struct sipe_core_private, 1);
+	GString *expected = g_string_new("");
+	GString *none     = g_string_new("");
+	int failed        = 0;
+	gchar *large;
+	gchar *small;
+
+	sipe_xml_init();
+	jobs    = g_queue_new();
+	applied = g_string_new("");
+
+	/* nothing pending: applied immediately */
+	queue_single(sipe_private, SIPE_PRESENCE_PART_MSRTC,
+		     "sip:alice@example.com", expected);
+	failed += check("single part without pending batch", expected);
+	g_string_truncate(expected, 0);
+
+	/* large multipart NOTIFY followed by small single part NOTIFYs */
+	large = build_multipart("user", 200, expected);
+	sipe_presence_batch_submit(sipe_private, multipart_type, large);
+	g_free(large);
+	queue_single(sipe_private, SIPE_PRESENCE_PART_CATEGORIES,
+		     "sip:user000@example.com", expected);
+	queue_single(sipe_private, SIPE_PRESENCE_PART_PIDF,
+		     "sip:user199@example.com", expected);
+	failed += check("single parts wait for batch", none);
+	if (!sipe_presence_batch_pending(sipe_private)) {
+		printf("FAILED: no pending batch\n");
+		failed++;
+	}
+	jobs_run_reversed();
+	failed += check("single parts applied after batch", expected);
+	if (sipe_presence_batch_pending(sipe_private)) {
+		printf("FAILED: batch still pending\n");
+		failed++;
+	}
+	g_string_truncate(expected, 0);
+
+	/* second batch completes before the first one */
+	large = build_multipart("first", 8, expected);
+	sipe_presence_batch_submit(sipe_private, multipart_type, large);
+	g_free(large);
+	queue_single(sipe_private, SIPE_PRESENCE_PART_RESUB,
+		     "sip:between@example.com", expected);
+	small = build_multipart("second", 3, expected);
+	{
+		struct sipe_job *job;
+		guint first_jobs = g_queue_get_length(jobs);
+
+		sipe_presence_batch_submit(sipe_private, multipart_type, small);
+		while (g_queue_get_length(jobs) > first_jobs) {
+			job = g_queue_pop_tail(jobs);
+			job_finish(job, TRUE);
+		}
+		failed += check("later batch waits for earlier batch", none);
+	}
+	g_free(small);
+	jobs_run_reversed();
+	failed += check("batches applied in order", expected);
+	g_string_truncate(expected, 0);
+
+	/* teardown with pending jobs: nothing is applied */
+	large = build_multipart("dropped", 10, expected);
+	sipe_presence_batch_submit(sipe_private, multipart_type, large);
+	g_free(large);
+	queue_single(sipe_private, SIPE_PRESENCE_PART_MSRTC,
+		     "sip:dropped@example.com", expected);
+	sipe_presence_batch_free(sipe_private);
+	{
+		struct sipe_job *job;
+
+		while ((job = g_queue_pop_head(jobs)) != NULL)
+			job_finish(job, FALSE);
+	}
+	failed += check("teardown drops pending updates", none);
+
+	g_string_free(none, TRUE);
+	g_string_free(expected, TRUE);
+	g_string_free(applied, TRUE);
+	g_queue_free(jobs);
+	g_free(sipe_private);
+
+	printf("\nResult: %d test(s) failed\n", failed);
+	return(failed);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,298 @@
+/**
+ * @file sipe-presence-batch.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Presence NOTIFYs are applied strictly in arrival order. The parts of a
+ * large batched NOTIFY are parsed on worker threads. Every update that
+ * arrives while a batch is being parsed is appended to the same queue and
+ * applied on the main thread once all batches in front of it are done.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-job.h"
+#include "sipe-mime.h"
+#include "sipe-presence-batch.h"
+#include "sipe-utils.h"
+#include "sipe-xml.h"
+
+#define PRESENCE_JOBS_PER_BATCH 4
+
+struct presence_part {
+	enum sipe_presence_part_type type;
+	gchar *body;
+	gsize length;
+	sipe_xml *xml;    /* set by worker thread */
+	gboolean parsed;  /* FALSE: apply from body */
+};
+
+struct presence_batch {
+	struct sipe_core_private *sipe_private; /* NULL: detached */
+	struct presence_part *parts;
+	guint count;
+	guint pending;   /* jobs not completed yet */
+	guint refs;      /* jobs not freed yet */
+};
+
+struct presence_job {
+	struct presence_batch *batch;
+	guint first;
+	guint last;      /* exclusive */
+};
+
+enum sipe_presence_part_type sipe_presence_part_type(const gchar *content_type)
+{
+	if (content_type) {
+		if (strstr(content_type, "application/rlmi+xml"))
+			return(SIPE_PRESENCE_PART_RESUB);
+		if (strstr(content_type, "text/xml+msrtc.pidf"))
+			return(SIPE_PRESENCE_PART_MSRTC);
+	}
+	return(SIPE_PRESENCE_PART_CATEGORIES);
+}
+
+gboolean sipe_presence_batch_pending(struct sipe_core_private *sipe_private)
+{
+	return(sipe_private->presence_batches &&
+	       !g_queue_is_empty(sipe_private->presence_batches));
+}
+
+static void presence_part_apply(struct sipe_core_private *sipe_private,
+				const struct presence_part *part)
+{
+	if (part->parsed && !part->xml) {
+		SIPE_DEBUG_ERROR("presence_part_apply: failed to parse %" G_GSIZE_FORMAT " bytes of XML",
+				 part->length);
+		return;
+	}
+
+	sipe_notify_presence_apply(sipe_private,
+				   part->type,
+				   part->body,
+				   part->length,
+				   part->xml);
+}
+
+static void presence_batch_free(struct presence_batch *batch)
+{
+	guint i;
+
+	for (i = 0; i < batch->count; i++) {
+		g_free(batch->parts[i].body);
+		sipe_xml_free(batch->parts[i].xml);
+	}
+	g_free(batch->parts);
+	g_free(batch);
+}
+
+static void presence_batch_append(struct sipe_core_private *sipe_private,
+				  struct presence_batch *batch)
+{
+	if (!sipe_private->presence_batches)
+		sipe_private->presence_batches = g_queue_new();
+	g_queue_push_tail(sipe_private->presence_batches, batch);
+}
+
+/* apply all completed batches at the head of the queue */
+static void presence_batches_apply(struct sipe_core_private *sipe_private)
+{
+	GQueue *queue = sipe_private->presence_batches;
+	struct presence_batch *batch;
+
+	while ((batch = g_queue_peek_head(queue)) && (batch->pending == 0)) {
+		guint i;
+
+		g_queue_pop_head(queue);
+		batch->sipe_private = NULL;
+
+		SIPE_DEBUG_INFO("presence_batches_apply: %u parts", batch->count);
+		for (i = 0; i < batch->count; i++)
+			presence_part_apply(sipe_private, batch->parts + i);
+
+		/* all jobs have completed */
+		if (batch->refs == 0)
+			presence_batch_free(batch);
+	}
+}
+
+/* worker thread */
+static gpointer presence_job_execute(gpointer data)
+{
+	struct presence_job *job = data;
+	guint i;
+
+	for (i = job->first; i < job->last; i++) {
+		struct presence_part *part = job->batch->parts + i;
+
+		part->xml = sipe_notify_presence_parse(part->type,
+						       part->body,
+						       part->length);
+	}
+
+	return(NULL);
+}
+
+/* main thread: only called for jobs that haven't been cancelled */
+static void presence_job_done(struct sipe_core_private *sipe_private,
+			      SIPE_UNUSED_PARAMETER gpointer result,
+			      gpointer data)
+{
+	struct presence_job *job = data;
+
+	job->batch->pending--;
+	presence_batches_apply(sipe_private);
+}
+
+/* main thread: always called */
+static void presence_job_free(gpointer data)
+{
+	struct presence_job *job = data;
+	struct presence_batch *batch = job->batch;
+
+	/* batch is freed by the last job unless it is still queued */
+	if ((--batch->refs == 0) && !batch->sipe_private)
+		presence_batch_free(batch);
+	g_free(job);
+}
+
+static void presence_collect_cb(gpointer user_data, /* GArray */
+				const GSList *fields,
+				const gchar *body,
+				gsize length)
+{
+	struct presence_part part;
+
+	part.type   = sipe_presence_part_type(sipe_utils_nameval_find(fields,
+									  "Content-Type"));
+	part.body   = g_strndup(body, length);
+	part.length = length;
+	part.xml    = NULL;
+	part.parsed = TRUE;
+	g_array_append_val((GArray *) user_data, part);
+}
+
+void sipe_presence_batch_submit(struct sipe_core_private *sipe_private,
+				const gchar *content_type,
+				const gchar *body)
+{
+	GArray *parts = g_array_new(FALSE, FALSE, sizeof(struct presence_part));
+	struct presence_batch *batch;
+	guint jobs, per_job, first;
+
+	sipe_mime_parts_foreach(content_type, body, presence_collect_cb, parts);
+	if (parts->len == 0) {
+		g_array_free(parts, TRUE);
+		return;
+	}
+
+	batch = g_new0(struct presence_batch, 1);
+	batch->sipe_private = sipe_private;
+	batch->count        = parts->len;
+	batch->parts        = (struct presence_part *) g_array_free(parts, FALSE);
+	presence_batch_append(sipe_private, batch);
+
+	/* contiguous ranges of parts per job */
+	jobs    = MIN(batch->count, PRESENCE_JOBS_PER_BATCH);
+	per_job = (batch->count + jobs - 1) / jobs;
+	batch->pending = batch->refs = (batch->count + per_job - 1) / per_job;
+
+	SIPE_DEBUG_INFO("sipe_presence_batch_submit: %u parts in %u jobs",
+			batch->count, batch->pending);
+
+	for (first = 0; first < batch->count; first += per_job) {
+		struct presence_job *job = g_new0(struct presence_job, 1);
+
+		job->batch = batch;
+		job->first = first;
+		job->last  = MIN(first + per_job, batch->count);
+		sipe_job_submit(sipe_private,
+				presence_job_execute,
+				presence_job_done,
+				job,
+				presence_job_free,
+				NULL);
+	}
+}
+
+void sipe_presence_batch_queue(struct sipe_core_private *sipe_private,
+			       enum sipe_presence_part_type type,
+			       const gchar *body,
+			       gsize length)
+{
+	struct presence_batch *batch;
+
+	if (!sipe_presence_batch_pending(sipe_private)) {
+		sipe_notify_presence_apply(sipe_private, type, body, length, NULL);
+		return;
+	}
+
+	/* one part batch without jobs: applied from body when its turn comes */
+	batch = g_new0(struct presence_batch, 1);
+	batch->sipe_private = sipe_private;
+	batch->count        = 1;
+	batch->parts        = g_new0(struct presence_part, 1);
+	batch->parts->type   = type;
+	batch->parts->body   = g_strndup(body, length);
+	batch->parts->length = length;
+	presence_batch_append(sipe_private, batch);
+
+	SIPE_DEBUG_INFO("sipe_presence_batch_queue: %" G_GSIZE_FORMAT " bytes wait for %u batches",
+			length,
+			g_queue_get_length(sipe_private->presence_batches) - 1);
+}
+
+void sipe_presence_batch_free(struct sipe_core_private *sipe_private)
+{
+	GQueue *queue = sipe_private->presence_batches;
+
+	if (queue) {
+		struct presence_batch *batch;
+
+		/* jobs are cancelled: the last one frees its batch */
+		while ((batch = g_queue_pop_head(queue)) != NULL) {
+			if (batch->refs)
+				batch->sipe_private = NULL;
+			else
+				presence_batch_free(batch);
+		}
+		g_queue_free(queue);
+		sipe_private->presence_batches = NULL;
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
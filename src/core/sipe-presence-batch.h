@@ -0,0 +1,144 @@
+/**
+ * @file sipe-presence-batch.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Ordered application of presence updates
+ *
+ * Large batched presence NOTIFYs are parsed on worker threads. Every
+ * presence update that arrives while such a batch is still being parsed
+ * waits behind it, i.e. updates are always applied in arrival order.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct _sipe_xml;
+
+enum sipe_presence_part_type {
+	SIPE_PRESENCE_PART_RESUB,       /* application/rlmi+xml                   */
+	SIPE_PRESENCE_PART_MSRTC,       /* text/xml+msrtc.pidf                    */
+	SIPE_PRESENCE_PART_CATEGORIES,  /* application/msrtc-event-categories+xml */
+	SIPE_PRESENCE_PART_PIDF         /* PIDF, only as single part NOTIFY       */
+};
+
+/**
+ * Type of a part in a multipart presence NOTIFY
+ *
+ * @param content_type Content-Type of the part
+ *
+ * @return part type, never @c SIPE_PRESENCE_PART_PIDF
+ */
+enum sipe_presence_part_type sipe_presence_part_type(const gchar *content_type);
+
+/**
+ * Are presence updates waiting to be applied?
+ *
+ * @param sipe_private SIPE core private data
+ *
+ * @return @c TRUE if a later update must be queued
+ */
+gboolean sipe_presence_batch_pending(struct sipe_core_private *sipe_private);
+
+/**
+ * Parse the parts of a multipart presence NOTIFY on worker threads
+ *
+ * The parts are applied when they have all been parsed and all earlier
+ * updates have been applied.
+ *
+ * @param sipe_private SIPE core private data
+ * @param content_type Content-Type of the NOTIFY
+ * @param body         NOTIFY body (will be copied)
+ */
+void sipe_presence_batch_submit(struct sipe_core_private *sipe_private,
+				const gchar *content_type,
+				const gchar *body);
+
+/**
+ * Apply a single presence update in order
+ *
+ * The update is applied immediately if nothing is pending. Otherwise it
+ * is applied from the body after all earlier updates.
+ *
+ * @param sipe_private SIPE core private data
+ * @param type         update type
+ * @param body         update body (will be copied if queued)
+ * @param length       length of @c body
+ */
+void sipe_presence_batch_queue(struct sipe_core_private *sipe_private,
+			       enum sipe_presence_part_type type,
+			       const gchar *body,
+			       gsize length);
+
+/**
+ * Drop presence updates that are still waiting
+ *
+ * Must be called before the jobs of the SIPE instance are cancelled.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_presence_batch_free(struct sipe_core_private *sipe_private);
+
+/*
+ * Implemented in sipe-notify.c
+ */
+
+/**
+ * Parse a presence update
+ *
+ * Runs on a worker thread: see @c sipe_job_func for the restrictions.
+ *
+ * @param type   update type
+ * @param body   update body
+ * @param length length of @c body
+ *
+ * @return parsed update or @c NULL
+ */
+struct _sipe_xml *sipe_notify_presence_parse(enum sipe_presence_part_type type,
+					     const gchar *body,
+					     gsize length);
+
+/**
+ * Apply a presence update
+ *
+ * @param sipe_private SIPE core private data
+ * @param type         update type
+ * @param body         update body
+ * @param length       length of @c body
+ * @param xml          parsed update or @c NULL to process @c body
+ */
+void sipe_notify_presence_apply(struct sipe_core_private *sipe_private,
+				enum sipe_presence_part_type type,
+				const gchar *body,
+				gsize length,
+				const struct _sipe_xml *xml);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
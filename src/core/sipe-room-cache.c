@@ -0,0 +1,396 @@
+/**
+ * @file sipe-room-cache.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * File format (all numbers are little endian guint32):
+ *
+ *   header  magic "SIPEROOM", version, owner, time of last update,
+ *           #rooms, string table size
+ *   rooms   URI, name, description, #users, flags
+ *   strings NUL terminated strings
+ *
+ * Strings are stored as offsets into the string table, CACHE_NO_STRING
+ * is used for NULL. See also sipe-roster-cache.c.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-room-cache.h"
+#include "sipe-roster-cache.h"
+#include "sipe-utils.h"
+
+#define ROOM_CACHE_FILE     "rooms.cache"
+#define ROOM_CACHE_REFRESH  (60 * 60) /* seconds */
+
+#define CACHE_MAGIC       "SIPEROOM"
+#define CACHE_VERSION     1
+#define CACHE_NO_STRING   0xFFFFFFFF
+
+#define CACHE_HEADER_SIZE (8 + 5 * 4)
+#define CACHE_ROOM_SIZE   (5 * 4)
+
+struct sipe_room_cache {
+	GHashTable *rooms;  /* key: URI, value: room_entry */
+	time_t updated;     /* 0: never */
+	guint generation;   /* of current update */
+};
+
+struct room_entry {
+	gchar *uri;         /* owned by hash table key */
+	gchar *name;
+	gchar *description;
+	guint users;
+	guint32 flags;
+	guint generation;
+	gboolean shown;     /* in current backend room list */
+};
+
+static void room_entry_free(gpointer data)
+{
+	struct room_entry *room = data;
+	g_free(room->name);
+	g_free(room->description);
+	g_free(room);
+}
+
+static struct room_entry *room_cache_add(struct sipe_room_cache *cache,
+					 const gchar *uri)
+{
+	struct room_entry *room = g_hash_table_lookup(cache->rooms, uri);
+
+	if (!room) {
+		room      = g_new0(struct room_entry, 1);
+		room->uri = g_strdup(uri);
+		g_hash_table_insert(cache->rooms, room->uri, room);
+	}
+
+	return(room);
+}
+
+static void room_show(struct sipe_core_private *sipe_private,
+		      struct room_entry *room)
+{
+	room->shown = TRUE;
+	sipe_backend_groupchat_room_add(SIPE_CORE_PUBLIC,
+					room->uri,
+					room->name,
+					room->description,
+					room->users,
+					room->flags);
+}
+
+static void append_u32(GString *buffer, guint32 value)
+{
+	guint32 le = GUINT32_TO_LE(value);
+	g_string_append_len(buffer, (const gchar *) &le, sizeof(le));
+}
+
+static guint32 read_u32(const guchar *p)
+{
+	guint32 value;
+	memcpy(&value, p, sizeof(value));
+	return(GUINT32_FROM_LE(value));
+}
+
+static void append_string(GString *buffer,
+			  GString *strings,
+			  const gchar *string)
+{
+	if (string) {
+		append_u32(buffer, strings->len);
+		g_string_append_len(strings, string, strlen(string) + 1);
+	} else {
+		append_u32(buffer, CACHE_NO_STRING);
+	}
+}
+
+static const gchar *get_string(const gchar *strings,
+			       guint32 strings_size,
+			       const guchar *p,
+			       gboolean *valid)
+{
+	guint32 offset = read_u32(p);
+
+	if (offset == CACHE_NO_STRING)
+		return(NULL);
+	if (offset >= strings_size) {
+		*valid = FALSE;
+		return(NULL);
+	}
+	return(strings + offset);
+}
+
+static void room_cache_read(struct sipe_core_private *sipe_private,
+			    struct sipe_room_cache *cache,
+			    const guchar *data,
+			    gsize length)
+{
+	const gchar *strings;
+	const guchar *p;
+	guint32 count, strings_size, i;
+	gboolean valid = TRUE;
+
+	if ((length < CACHE_HEADER_SIZE) ||
+	    memcmp(data, CACHE_MAGIC, 8) ||
+	    (read_u32(data + 8) != CACHE_VERSION))
+		return;
+
+	count        = read_u32(data + 20);
+	strings_size = read_u32(data + 24);
+	/* 64-bit arithmetic: count can't overflow */
+	if ((CACHE_HEADER_SIZE + (guint64) count * CACHE_ROOM_SIZE + strings_size != length) ||
+	    (strings_size == 0))
+		return;
+	strings = (const gchar *) data + CACHE_HEADER_SIZE + count * CACHE_ROOM_SIZE;
+
+	/* every offset below strings_size is NUL terminated in the table */
+	if ((strings[strings_size - 1] != '\0') ||
+	    !sipe_strequal(get_string(strings, strings_size, data + 12, &valid),
+			   sipe_private->username))
+		return;
+
+	for (i = 0, p = data + CACHE_HEADER_SIZE; valid && (i < count); i++, p += CACHE_ROOM_SIZE) {
+		const gchar *uri = get_string(strings, strings_size, p, &valid);
+		const gchar *name = get_string(strings, strings_size, p + 4, &valid);
+		const gchar *description = get_string(strings, strings_size, p + 8, &valid);
+
+		if (valid && uri) {
+			struct room_entry *room = room_cache_add(cache, uri);
+
+			room->name        = g_strdup(name);
+			room->description = g_strdup(description);
+			room->users       = read_u32(p + 12);
+			room->flags       = read_u32(p + 16);
+		}
+	}
+
+	if (valid) {
+		cache->updated = read_u32(data + 16);
+	} else {
+		/* never show partial content */
+		g_hash_table_remove_all(cache->rooms);
+	}
+}
+
+struct sipe_room_cache *sipe_room_cache_load(struct sipe_core_private *sipe_private)
+{
+	struct sipe_room_cache *cache = g_new0(struct sipe_room_cache, 1);
+	GMappedFile *file;
+	gchar *filename;
+
+	cache->rooms = g_hash_table_new_full(g_str_hash, g_str_equal,
+					     g_free, room_entry_free);
+
+	if (!sipe_private->username)
+		return(cache);
+
+	filename = sipe_roster_cache_filename(sipe_private, ROOM_CACHE_FILE);
+	file     = g_mapped_file_new(filename, FALSE, NULL);
+	if (file) {
+		const guchar *data = (const guchar *) g_mapped_file_get_contents(file);
+
+		if (data)
+			room_cache_read(sipe_private,
+					cache,
+					data,
+					g_mapped_file_get_length(file));
+
+		if (cache->updated) {
+			SIPE_DEBUG_INFO("sipe_room_cache_load: %u rooms from '%s'",
+					g_hash_table_size(cache->rooms), filename);
+		} else {
+			SIPE_DEBUG_ERROR("sipe_room_cache_load: ignoring invalid file '%s'",
+					 filename);
+		}
+
+#if GLIB_CHECK_VERSION(2,22,0)
+		g_mapped_file_unref(file);
+#else
+		g_mapped_file_free(file);
+#endif
+	}
+	g_free(filename);
+
+	return(cache);
+}
+
+gboolean sipe_room_cache_fresh(const struct sipe_room_cache *cache)
+{
+	time_t now = time(NULL);
+
+	return(cache->updated &&
+	       (now >= cache->updated) &&
+	       (now - cache->updated < ROOM_CACHE_REFRESH));
+}
+
+guint sipe_room_cache_show(struct sipe_core_private *sipe_private,
+			   struct sipe_room_cache *cache)
+{
+	GHashTableIter iter;
+	gpointer room;
+
+	g_hash_table_iter_init(&iter, cache->rooms);
+	while (g_hash_table_iter_next(&iter, NULL, &room))
+		room_show(sipe_private, room);
+
+	return(g_hash_table_size(cache->rooms));
+}
+
+void sipe_room_cache_update_start(struct sipe_room_cache *cache)
+{
+	cache->generation++;
+}
+
+void sipe_room_cache_update(struct sipe_core_private *sipe_private,
+			    struct sipe_room_cache *cache,
+			    gboolean show,
+			    const gchar *uri,
+			    const gchar *name,
+			    const gchar *description,
+			    guint users,
+			    guint32 flags)
+{
+	struct room_entry *room;
+
+	if (!uri)
+		return;
+
+	room = room_cache_add(cache, uri);
+	if (!sipe_strequal(room->name, name)) {
+		g_free(room->name);
+		room->name = g_strdup(name);
+	}
+	if (!sipe_strequal(room->description, description)) {
+		g_free(room->description);
+		room->description = g_strdup(description);
+	}
+	room->users      = users;
+	room->flags      = flags;
+	room->generation = cache->generation;
+
+	/* the backend can't update rooms that are already in the list */
+	if (show && !room->shown)
+		room_show(sipe_private, room);
+}
+
+static gboolean room_cache_expired(SIPE_UNUSED_PARAMETER gpointer key,
+				   gpointer value,
+				   gpointer user_data)
+{
+	const struct room_entry *room = value;
+	const struct sipe_room_cache *cache = user_data;
+	return(room->generation != cache->generation);
+}
+
+static void room_cache_save(struct sipe_core_private *sipe_private,
+			    struct sipe_room_cache *cache)
+{
+	GString *buffer  = g_string_new(NULL);
+	GString *records = g_string_new(NULL);
+	GString *strings = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer value;
+	gchar *filename;
+	gchar *dirname;
+	GError *error = NULL;
+
+	g_string_append_len(buffer, CACHE_MAGIC, 8);
+	append_u32(buffer, CACHE_VERSION);
+	append_string(buffer, strings, sipe_private->username);
+	append_u32(buffer, (guint32) cache->updated);
+	append_u32(buffer, g_hash_table_size(cache->rooms));
+
+	g_hash_table_iter_init(&iter, cache->rooms);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		const struct room_entry *room = value;
+
+		append_string(records, strings, room->uri);
+		append_string(records, strings, room->name);
+		append_string(records, strings, room->description);
+		append_u32(records, room->users);
+		append_u32(records, room->flags);
+	}
+
+	append_u32(buffer, strings->len);
+	g_string_append_len(buffer, records->str, records->len);
+	g_string_append_len(buffer, strings->str, strings->len);
+
+	filename = sipe_roster_cache_filename(sipe_private, ROOM_CACHE_FILE);
+	dirname  = g_path_get_dirname(filename);
+	if ((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	    g_file_set_contents(filename, buffer->str, buffer->len, &error)) {
+		SIPE_DEBUG_INFO("room_cache_save: %u rooms written to '%s'",
+				g_hash_table_size(cache->rooms), filename);
+	} else {
+		SIPE_DEBUG_ERROR("room_cache_save: can't write '%s': %s",
+				 filename,
+				 error ? error->message : "can't create directory");
+		if (error)
+			g_error_free(error);
+	}
+	g_free(dirname);
+	g_free(filename);
+
+	g_string_free(strings, TRUE);
+	g_string_free(records, TRUE);
+	g_string_free(buffer, TRUE);
+}
+
+void sipe_room_cache_update_finish(struct sipe_core_private *sipe_private,
+				   struct sipe_room_cache *cache)
+{
+	guint removed = g_hash_table_foreach_remove(cache->rooms,
+						    room_cache_expired,
+						    cache);
+
+	SIPE_DEBUG_INFO("sipe_room_cache_update_finish: %u rooms, %u removed",
+			g_hash_table_size(cache->rooms), removed);
+
+	cache->updated = time(NULL);
+	if (sipe_private->username)
+		room_cache_save(sipe_private, cache);
+}
+
+void sipe_room_cache_free(struct sipe_room_cache *cache)
+{
+	if (cache) {
+		g_hash_table_destroy(cache->rooms);
+		g_free(cache);
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
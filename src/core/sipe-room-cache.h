@@ -0,0 +1,123 @@
+/**
+ * @file sipe-room-cache.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Group chat room list cache
+ *
+ * The result of the last channel search is kept per account and written
+ * next to the roster snapshot, so the room list can be shown immediately,
+ * even right after login. The list is refreshed from the server when it
+ * is older than ROOM_CACHE_REFRESH.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_room_cache;
+
+/**
+ * Load room list from disk
+ *
+ * @param sipe_private SIPE core private data
+ *
+ * @return room cache, empty if there is no valid file.
+ *         Must be freed with @c sipe_room_cache_free()
+ */
+struct sipe_room_cache *sipe_room_cache_load(struct sipe_core_private *sipe_private);
+
+/**
+ * Is the room list recent enough to skip the channel search?
+ *
+ * @param cache room cache
+ *
+ * @return @c TRUE if the list doesn't need to be refreshed
+ */
+gboolean sipe_room_cache_fresh(const struct sipe_room_cache *cache);
+
+/**
+ * Add all cached rooms to the backend room list
+ *
+ * Rooms shown here are not added again by @c sipe_room_cache_update().
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        room cache
+ *
+ * @return number of rooms
+ */
+guint sipe_room_cache_show(struct sipe_core_private *sipe_private,
+			   struct sipe_room_cache *cache);
+
+/**
+ * Start update from a channel search result
+ *
+ * @param cache room cache
+ */
+void sipe_room_cache_update_start(struct sipe_room_cache *cache);
+
+/**
+ * Add or update one room from the channel search result
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        room cache
+ * @param show         add room to backend room list if not shown yet
+ * @param uri          room URI
+ * @param name         room name
+ * @param description  room description
+ * @param users        number of users in the room
+ * @param flags        SIPE_GROUPCHAT_ROOM_* flags
+ */
+void sipe_room_cache_update(struct sipe_core_private *sipe_private,
+			    struct sipe_room_cache *cache,
+			    gboolean show,
+			    const gchar *uri,
+			    const gchar *name,
+			    const gchar *description,
+			    guint users,
+			    guint32 flags);
+
+/**
+ * Finish update: drop rooms not in the search result & write file
+ *
+ * @param sipe_private SIPE core private data
+ * @param cache        room cache
+ */
+void sipe_room_cache_update_finish(struct sipe_core_private *sipe_private,
+				   struct sipe_room_cache *cache);
+
+/**
+ * Free room cache
+ *
+ * @param cache room cache (may be @c NULL)
+ */
+void sipe_room_cache_free(struct sipe_room_cache *cache);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,451 @@
+/**
+ * @file sipe-roster-cache.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * File format (all numbers are little endian guint32):
+ *
+ *   header      magic "SIPEROST", version, owner, deltanum,
+ *               #groups, #buddies, #memberships, string table size
+ *   groups      id, name, exchange key, change key
+ *   buddies     URI, exchange key, change key,
+ *               index of first membership, #memberships, home pool
+ *   memberships group index, alias
+ *   strings     NUL terminated strings
+ *
+ * Strings are stored as offsets into the string table, CACHE_NO_STRING
+ * is used for NULL. The file is memory mapped and validated completely
+ * before anything is added to the buddy list.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipe-backend.h"
+#include "sipe-buddy.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-group.h"
+#include "sipe-roster-cache.h"
+
+#define CACHE_MAGIC       "SIPEROST"
+#define CACHE_VERSION     2
+#define CACHE_NO_STRING   0xFFFFFFFF
+
+#define CACHE_HEADER_SIZE (8 + 7 * 4)
+#define CACHE_GROUP_SIZE  (4 * 4)
+#define CACHE_BUDDY_SIZE  (6 * 4)
+#define CACHE_MEMBER_SIZE (2 * 4)
+
+struct roster_cache_writer {
+	struct sipe_core_private *sipe_private;
+	GString *records;
+	GString *members;
+	GString *strings;
+	GHashTable *group_index; /* sipe_group -> index + 1 */
+	guint groups;
+	guint buddies;
+	guint memberships;
+	/* current buddy */
+	const gchar *uri;
+	guint buddy_memberships;
+};
+
+struct roster_cache_reader {
+	const guchar *data;
+	const guchar *groups;
+	const guchar *buddies;
+	const guchar *memberships;
+	const gchar *strings;
+	guint32 group_count;
+	guint32 buddy_count;
+	guint32 membership_count;
+	guint32 strings_size;
+};
+
+gchar *sipe_roster_cache_filename(struct sipe_core_private *sipe_private,
+				  const gchar *file)
+{
+	gchar *name = g_strdup(sipe_private->username);
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    file,
+				    NULL);
+	g_free(name);
+
+	return(filename);
+}
+
+static void append_u32(GString *buffer, guint32 value)
+{
+	guint32 le = GUINT32_TO_LE(value);
+	g_string_append_len(buffer, (const gchar *) &le, sizeof(le));
+}
+
+static guint32 read_u32(const guchar *p)
+{
+	guint32 value;
+	memcpy(&value, p, sizeof(value));
+	return(GUINT32_FROM_LE(value));
+}
+
+static void append_string(struct roster_cache_writer *writer,
+			  GString *buffer,
+			  const gchar *string)
+{
+	if (string) {
+		append_u32(buffer, writer->strings->len);
+		g_string_append_len(writer->strings, string, strlen(string) + 1);
+	} else {
+		append_u32(buffer, CACHE_NO_STRING);
+	}
+}
+
+static void roster_cache_save_group(gpointer data, gpointer user_data)
+{
+	const struct sipe_group *group  = data;
+	struct roster_cache_writer *writer = user_data;
+
+	if (group->is_obsolete || !group->name)
+		return;
+
+	append_u32(writer->records, group->id);
+	append_string(writer, writer->records, group->name);
+	append_string(writer, writer->records, group->exchange_key);
+	append_string(writer, writer->records, group->change_key);
+	g_hash_table_insert(writer->group_index,
+			    (gpointer) group,
+			    GUINT_TO_POINTER(++writer->groups));
+}
+
+static void roster_cache_save_membership(gpointer data, gpointer user_data)
+{
+	const struct sipe_group *group  = data;
+	struct roster_cache_writer *writer = user_data;
+	struct sipe_core_private *sipe_private = writer->sipe_private;
+	guint index = GPOINTER_TO_UINT(g_hash_table_lookup(writer->group_index,
+							   group));
+	sipe_backend_buddy bb;
+	gchar *alias = NULL;
+
+	if (!index)
+		return;
+
+	bb = sipe_backend_buddy_find(SIPE_CORE_PUBLIC,
+				     writer->uri,
+				     group->name);
+	if (bb)
+		alias = sipe_backend_buddy_get_alias(SIPE_CORE_PUBLIC, bb);
+
+	append_u32(writer->members, index - 1);
+	append_string(writer, writer->members, alias);
+	g_free(alias);
+	writer->buddy_memberships++;
+}
+
+static void roster_cache_save_buddy(SIPE_UNUSED_PARAMETER gpointer key,
+				    gpointer value,
+				    gpointer user_data)
+{
+	struct sipe_buddy *buddy = value;
+	struct roster_cache_writer *writer = user_data;
+	guint first = writer->memberships;
+
+	if (buddy->is_obsolete)
+		return;
+
+	writer->uri               = buddy->name;
+	writer->buddy_memberships = 0;
+	sipe_buddy_foreach_group(writer->sipe_private,
+				 buddy,
+				 roster_cache_save_membership,
+				 writer);
+
+	/* buddies without groups are not on the buddy list */
+	if (writer->buddy_memberships == 0)
+		return;
+	writer->memberships += writer->buddy_memberships;
+
+	append_string(writer, writer->records, buddy->name);
+	append_string(writer, writer->records, buddy->exchange_key);
+	append_string(writer, writer->records, buddy->change_key);
+	append_u32(writer->records, first);
+	append_u32(writer->records, writer->buddy_memberships);
+	append_string(writer, writer->records, buddy->pool);
+	writer->buddies++;
+}
+
+void sipe_roster_cache_save(struct sipe_core_private *sipe_private)
+{
+	struct roster_cache_writer writer;
+	GString *buffer;
+	gchar *filename;
+	gchar *dirname;
+	GError *error = NULL;
+
+	if (!sipe_private->username ||
+	    !sipe_private->groups   ||
+	    !sipe_private->buddies  ||
+	    (sipe_group_count(sipe_private) == 0))
+		return;
+
+	memset(&writer, 0, sizeof(writer));
+	writer.sipe_private = sipe_private;
+	writer.records      = g_string_new(NULL);
+	writer.members      = g_string_new(NULL);
+	writer.strings      = g_string_new(NULL);
+	writer.group_index  = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	buffer = g_string_new(NULL);
+	g_string_append_len(buffer, CACHE_MAGIC, 8);
+	append_u32(buffer, CACHE_VERSION);
+	append_string(&writer, buffer, sipe_private->username);
+	append_u32(buffer, sipe_private->deltanum_contacts);
+
+	/* group records must precede buddy records */
+	sipe_group_foreach(sipe_private, roster_cache_save_group, &writer);
+	sipe_buddy_foreach(sipe_private, roster_cache_save_buddy, &writer);
+
+	append_u32(buffer, writer.groups);
+	append_u32(buffer, writer.buddies);
+	append_u32(buffer, writer.memberships);
+	append_u32(buffer, writer.strings->len);
+	g_string_append_len(buffer, writer.records->str, writer.records->len);
+	g_string_append_len(buffer, writer.members->str, writer.members->len);
+	g_string_append_len(buffer, writer.strings->str, writer.strings->len);
+
+	filename = sipe_roster_cache_filename(sipe_private, "roster.cache");
+	dirname  = g_path_get_dirname(filename);
+	if ((g_mkdir_with_parents(dirname, 0700) == 0) &&
+	    g_file_set_contents(filename, buffer->str, buffer->len, &error)) {
+		SIPE_DEBUG_INFO("sipe_roster_cache_save: %u groups, %u buddies written to '%s'",
+				writer.groups, writer.buddies, filename);
+	} else {
+		SIPE_DEBUG_ERROR("sipe_roster_cache_save: can't write '%s': %s",
+				 filename,
+				 error ? error->message : "can't create directory");
+		if (error)
+			g_error_free(error);
+	}
+	g_free(dirname);
+	g_free(filename);
+
+	g_hash_table_destroy(writer.group_index);
+	g_string_free(writer.strings, TRUE);
+	g_string_free(writer.members, TRUE);
+	g_string_free(writer.records, TRUE);
+	g_string_free(buffer, TRUE);
+}
+
+static gboolean valid_string(const struct roster_cache_reader *reader,
+			     guint32 offset,
+			     gboolean optional)
+{
+	return((offset == CACHE_NO_STRING) ? optional :
+	       (offset < reader->strings_size));
+}
+
+static const gchar *get_string(const struct roster_cache_reader *reader,
+			       const guchar *p)
+{
+	guint32 offset = read_u32(p);
+	return((offset == CACHE_NO_STRING) ? NULL : reader->strings + offset);
+}
+
+static gboolean roster_cache_validate(struct roster_cache_reader *reader,
+				      gsize length,
+				      const gchar *owner)
+{
+	const guchar *p;
+	guint64 expected;
+	guint32 i;
+
+	if ((length < CACHE_HEADER_SIZE) ||
+	    memcmp(reader->data, CACHE_MAGIC, 8) ||
+	    (read_u32(reader->data + 8) != CACHE_VERSION))
+		return(FALSE);
+
+	reader->group_count      = read_u32(reader->data + 20);
+	reader->buddy_count      = read_u32(reader->data + 24);
+	reader->membership_count = read_u32(reader->data + 28);
+	reader->strings_size     = read_u32(reader->data + 32);
+
+	/* 64-bit arithmetic: counts can't overflow */
+	expected = CACHE_HEADER_SIZE +
+		(guint64) reader->group_count      * CACHE_GROUP_SIZE +
+		(guint64) reader->buddy_count      * CACHE_BUDDY_SIZE +
+		(guint64) reader->membership_count * CACHE_MEMBER_SIZE +
+		reader->strings_size;
+	if ((expected != length) ||
+	    (reader->strings_size == 0))
+		return(FALSE);
+
+	reader->groups      = reader->data + CACHE_HEADER_SIZE;
+	reader->buddies     = reader->groups  + reader->group_count * CACHE_GROUP_SIZE;
+	reader->memberships = reader->buddies + reader->buddy_count * CACHE_BUDDY_SIZE;
+	reader->strings     = (const gchar *) reader->memberships +
+		reader->membership_count * CACHE_MEMBER_SIZE;
+
+	/* every offset below strings_size is NUL terminated in the table */
+	if (reader->strings[reader->strings_size - 1] != '\0')
+		return(FALSE);
+
+	if (!valid_string(reader, read_u32(reader->data + 12), FALSE) ||
+	    !sipe_strequal(get_string(reader, reader->data + 12), owner))
+		return(FALSE);
+
+	for (i = 0, p = reader->groups; i < reader->group_count; i++, p += CACHE_GROUP_SIZE)
+		if (!valid_string(reader, read_u32(p +  4), FALSE) ||
+		    !valid_string(reader, read_u32(p +  8), TRUE)  ||
+		    !valid_string(reader, read_u32(p + 12), TRUE))
+			return(FALSE);
+
+	for (i = 0, p = reader->buddies; i < reader->buddy_count; i++, p += CACHE_BUDDY_SIZE) {
+		guint32 first = read_u32(p + 12);
+		guint32 count = read_u32(p + 16);
+
+		if (!valid_string(reader, read_u32(p),     FALSE) ||
+		    !valid_string(reader, read_u32(p + 4), TRUE)  ||
+		    !valid_string(reader, read_u32(p + 8), TRUE)  ||
+		    (first > reader->membership_count)            ||
+		    (count > reader->membership_count - first)    ||
+		    !valid_string(reader, read_u32(p + 20), TRUE))
+			return(FALSE);
+	}
+
+	for (i = 0, p = reader->memberships; i < reader->membership_count; i++, p += CACHE_MEMBER_SIZE)
+		if ((read_u32(p) >= reader->group_count) ||
+		    !valid_string(reader, read_u32(p + 4), TRUE))
+			return(FALSE);
+
+	return(TRUE);
+}
+
+static void roster_cache_restore(struct sipe_core_private *sipe_private,
+				 const struct roster_cache_reader *reader)
+{
+	struct sipe_group **groups = g_new0(struct sipe_group *,
+					    reader->group_count);
+	const guchar *p;
+	guint32 i;
+
+	for (i = 0, p = reader->groups; i < reader->group_count; i++, p += CACHE_GROUP_SIZE)
+		groups[i] = sipe_group_add(sipe_private,
+					   get_string(reader, p +  4),
+					   get_string(reader, p +  8),
+					   get_string(reader, p + 12),
+					   read_u32(p));
+
+	for (i = 0, p = reader->buddies; i < reader->buddy_count; i++, p += CACHE_BUDDY_SIZE) {
+		const guchar *member = reader->memberships +
+			read_u32(p + 12) * CACHE_MEMBER_SIZE;
+		guint32 count = read_u32(p + 16);
+		struct sipe_buddy *buddy = NULL;
+
+		for (; count > 0; count--, member += CACHE_MEMBER_SIZE) {
+			struct sipe_group *group = groups[read_u32(member)];
+
+			if (!group)
+				continue;
+			if (!buddy) {
+				const gchar *pool = get_string(reader, p + 20);
+
+				buddy = sipe_buddy_add(sipe_private,
+						       get_string(reader, p),
+						       get_string(reader, p + 4),
+						       get_string(reader, p + 8));
+				if (pool && !buddy->pool)
+					buddy->pool = g_strdup(pool);
+			}
+			sipe_buddy_add_to_group(sipe_private,
+						buddy,
+						group,
+						get_string(reader, member + 4));
+		}
+	}
+
+	g_free(groups);
+}
+
+void sipe_roster_cache_load(struct sipe_core_private *sipe_private)
+{
+	struct roster_cache_reader reader;
+	GMappedFile *file;
+	gchar *filename;
+
+	if (!sipe_private->username ||
+	    (sipe_group_count(sipe_private) > 0))
+		return;
+
+	filename = sipe_roster_cache_filename(sipe_private, "roster.cache");
+	file     = g_mapped_file_new(filename, FALSE, NULL);
+	if (!file) {
+		SIPE_DEBUG_INFO("sipe_roster_cache_load: no snapshot '%s'",
+				filename);
+		g_free(filename);
+		return;
+	}
+
+	memset(&reader, 0, sizeof(reader));
+	reader.data = (const guchar *) g_mapped_file_get_contents(file);
+	if (reader.data &&
+	    roster_cache_validate(&reader,
+				  g_mapped_file_get_length(file),
+				  sipe_private->username)) {
+		SIPE_DEBUG_INFO("sipe_roster_cache_load: restoring %u groups, %u buddies from '%s'",
+				reader.group_count, reader.buddy_count, filename);
+
+		if (sipe_private->deltanum_contacts == 0)
+			sipe_private->deltanum_contacts = read_u32(reader.data + 16);
+
+		sipe_backend_buddy_list_processing_start(SIPE_CORE_PUBLIC);
+		roster_cache_restore(sipe_private, &reader);
+		sipe_buddy_status_flush(sipe_private);
+		sipe_backend_buddy_list_processing_finish(SIPE_CORE_PUBLIC);
+	} else {
+		SIPE_DEBUG_ERROR("sipe_roster_cache_load: ignoring invalid snapshot '%s'",
+				 filename);
+	}
+
+#if GLIB_CHECK_VERSION(2,22,0)
+	g_mapped_file_unref(file);
+#else
+	g_mapped_file_free(file);
+#endif
+	g_free(filename);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
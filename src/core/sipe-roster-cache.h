@@ -0,0 +1,75 @@
+/**
+ * @file sipe-roster-cache.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * On-disk roster snapshot
+ *
+ * The group and buddy lists are written to the user cache directory on
+ * logout and restored right after the first successful registration, i.e.
+ * the buddy list is usable before the server has sent the contact list.
+ *
+ * Restored entries are only provisional: the next full contact list from
+ * the server (roaming contacts or UCS) removes everything it doesn't
+ * confirm via sipe_{buddy,group}_update_{start,finish}().
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+
+/**
+ * Restore groups and buddies from the snapshot
+ *
+ * Does nothing if there is no valid snapshot for this account or if the
+ * group list is not empty.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_roster_cache_load(struct sipe_core_private *sipe_private);
+
+/**
+ * Write snapshot of current groups and buddies
+ *
+ * Must be called before buddy and group data are freed.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_roster_cache_save(struct sipe_core_private *sipe_private);
+
+/**
+ * Path of a file in the per-account snapshot directory
+ *
+ * @param sipe_private SIPE core private data
+ * @param file         file name
+ *
+ * @return path. Must be g_free()'d
+ */
+gchar *sipe_roster_cache_filename(struct sipe_core_private *sipe_private,
+				  const gchar *file);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -25,7 +25,10 @@
 #include "sipe-backend.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-debug.h"
+#include "sipe-metrics.h"
 #include "sipe-schedule.h"
+#include "sipe-utils.h"
 
 struct sipe_schedule {
 	/**
@@ -34,13 +37,134 @@ struct sipe_schedule {
 	 * Example:  <presence><sip:user@domain.com> or <registration>
 	 */
 	gchar *name;
-	struct sipe_core_private *sipe_private;
-	gpointer backend_private;
 	gpointer payload;
 	sipe_schedule_action action;
 	GDestroyNotify destroy;
+	gint64 due;       /* in milliseconds */
+	guint64 sequence; /* keeps insertion order for same due time */
+	guint index;      /* position in heap */
+};
+
+/*
+ * All actions are kept in a binary min-heap ordered by due time and a
+ * hash table indexed by name. Only the earliest action has a backend
+ * timer. Actions scheduled in seconds are aligned to full seconds, so
+ * that all actions that expire in the same second run from one timer.
+ */
+struct sipe_schedule_queue {
+	struct sipe_core_private *sipe_private;
+	GPtrArray *heap;
+	GHashTable *names;
+	gpointer backend_private; /* NULL if no backend timer is running */
+	gint64 backend_due;
+	guint64 sequence;
+	gboolean executing;
 };
 
+#define HEAP_ENTRY(i) ((struct sipe_schedule *) g_ptr_array_index(queue->heap, (i)))
+
+static gboolean sipe_schedule_before(const struct sipe_schedule *a,
+				     const struct sipe_schedule *b)
+{
+	return((a->due < b->due) ||
+	       ((a->due == b->due) && (a->sequence < b->sequence)));
+}
+
+static void sipe_schedule_heap_set(struct sipe_schedule_queue *queue,
+				   guint index,
+				   struct sipe_schedule *schedule)
+{
+	g_ptr_array_index(queue->heap, index) = schedule;
+	schedule->index = index;
+}
+
+static void sipe_schedule_heap_up(struct sipe_schedule_queue *queue,
+				  guint index)
+{
+	struct sipe_schedule *schedule = HEAP_ENTRY(index);
+
+	while (index > 0) {
+		guint parent = (index - 1) / 2;
+		if (!sipe_schedule_before(schedule, HEAP_ENTRY(parent)))
+			break;
+		sipe_schedule_heap_set(queue, index, HEAP_ENTRY(parent));
+		index = parent;
+	}
+	sipe_schedule_heap_set(queue, index, schedule);
+}
+
+static void sipe_schedule_heap_down(struct sipe_schedule_queue *queue,
+				    guint index)
+{
+	struct sipe_schedule *schedule = HEAP_ENTRY(index);
+	guint length = queue->heap->len;
+
+	while (TRUE) {
+		guint child = 2 * index + 1;
+		if (child >= length)
+			break;
+		if ((child + 1 < length) &&
+		    sipe_schedule_before(HEAP_ENTRY(child + 1), HEAP_ENTRY(child)))
+			child++;
+		if (!sipe_schedule_before(HEAP_ENTRY(child), schedule))
+			break;
+		sipe_schedule_heap_set(queue, index, HEAP_ENTRY(child));
+		index = child;
+	}
+	sipe_schedule_heap_set(queue, index, schedule);
+}
+
+/* remove action from heap & name index, doesn't free it */
+static void sipe_schedule_unlink(struct sipe_schedule_queue *queue,
+				 struct sipe_schedule *schedule)
+{
+	guint index = schedule->index;
+	struct sipe_schedule *last = g_ptr_array_remove_index(queue->heap,
+							      queue->heap->len - 1);
+
+	if (last != schedule) {
+		sipe_schedule_heap_set(queue, index, last);
+		sipe_schedule_heap_up(queue, index);
+		sipe_schedule_heap_down(queue, last->index);
+	}
+	if (schedule->name)
+		g_hash_table_remove(queue->names, schedule->name);
+}
+
+/* make sure backend timer expires no later than earliest action */
+static void sipe_schedule_arm(struct sipe_schedule_queue *queue)
+{
+	struct sipe_core_private *sipe_private = queue->sipe_private;
+	struct sipe_schedule *head;
+	gint64 delay;
+
+	if (queue->executing || (queue->heap->len == 0))
+		return;
+
+	head = HEAP_ENTRY(0);
+	if (queue->backend_private) {
+		if (queue->backend_due <= head->due)
+			return;
+		sipe_backend_schedule_cancel(SIPE_CORE_PUBLIC,
+					     queue->backend_private);
+	}
+
+	delay = head->due - sipe_utils_monotonic_msec();
+	if (delay < 0)
+		delay = 0;
+	queue->backend_due = head->due;
+
+	/* use the cheaper seconds timer for full seconds */
+	if ((delay >= 1000) && ((head->due % 1000) == 0))
+		queue->backend_private = sipe_backend_schedule_seconds(SIPE_CORE_PUBLIC,
+								       (delay + 999) / 1000,
+								       queue);
+	else
+		queue->backend_private = sipe_backend_schedule_mseconds(SIPE_CORE_PUBLIC,
+									delay,
+									queue);
+}
+
 static void sipe_schedule_deallocate(struct sipe_schedule *schedule)
 {
 	if (schedule->destroy) (*schedule->destroy)(schedule->payload);
@@ -50,39 +174,84 @@ static void sipe_schedule_deallocate(struct sipe_schedule *schedule)
 
 void sipe_core_schedule_execute(gpointer data)
 {
-	struct sipe_schedule *expired = data;
-	struct sipe_core_private *sipe_private = expired->sipe_private;
+	struct sipe_schedule_queue *queue = data;
+	struct sipe_core_private *sipe_private = queue->sipe_private;
+	gint64 now = sipe_utils_monotonic_msec();
+	guint64 sequence = queue->sequence;
+
+	/* backend timer has expired */
+	queue->backend_private = NULL;
+	queue->executing       = TRUE;
+
+	/* action can (re)schedule actions or even cancel all of them */
+	while (((queue = sipe_private->timeouts) != NULL) &&
+	       (queue->heap->len > 0)) {
+		struct sipe_schedule *expired = HEAP_ENTRY(0);
 
-	SIPE_DEBUG_INFO("sipe_core_schedule_execute: executing %s", expired->name);
-	sipe_private->timeouts = g_slist_remove(sipe_private->timeouts, expired);
-	SIPE_DEBUG_INFO("sipe_core_schedule_execute timeouts count %d after removal",
-			g_slist_length(sipe_private->timeouts));
+		if ((expired->due > now) || (expired->sequence >= sequence))
+			break;
 
-	(*expired->action)(sipe_private, expired->payload);
-	sipe_schedule_deallocate(expired);
+		SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+					  "sipe_core_schedule_execute: executing %s",
+					  expired->name);
+		sipe_schedule_unlink(queue, expired);
+		SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+					  "sipe_core_schedule_execute timeouts count %d after removal",
+					  queue->heap->len);
+		sipe_metrics_count(sipe_private, SIPE_METRIC_SCHEDULE_EXECUTED);
+		sipe_metrics_latency(sipe_private,
+				     SIPE_METRIC_SCHEDULE_LATENESS,
+				     expired->due);
+
+		(*expired->action)(sipe_private, expired->payload);
+		sipe_schedule_deallocate(expired);
+	}
+
+	if ((queue = sipe_private->timeouts) != NULL) {
+		queue->executing = FALSE;
+		sipe_schedule_arm(queue);
+	}
 }
 
-static struct sipe_schedule *sipe_schedule_allocate(struct sipe_core_private *sipe_private,
-						    const gchar *name,
-						    gpointer payload,
-						    sipe_schedule_action action,
-						    GDestroyNotify destroy)
+static void sipe_schedule_allocate(struct sipe_core_private *sipe_private,
+				   const gchar *name,
+				   gpointer payload,
+				   gint64 due,
+				   sipe_schedule_action action,
+				   GDestroyNotify destroy)
 {
+	struct sipe_schedule_queue *queue = sipe_private->timeouts;
 	struct sipe_schedule *new;
 
+	if (!queue) {
+		queue = g_new0(struct sipe_schedule_queue, 1);
+		queue->sipe_private = sipe_private;
+		queue->heap         = g_ptr_array_new();
+		queue->names        = g_hash_table_new(g_str_hash, g_str_equal);
+		sipe_private->timeouts = queue;
+	}
+
 	/* Make sure each action only exists once */
 	sipe_schedule_cancel(sipe_private, name);
 
 	new = g_new0(struct sipe_schedule, 1);
 	new->name = g_strdup(name);
-	new->sipe_private = sipe_private;
 	new->payload = payload;
 	new->action = action;
 	new->destroy = destroy;
-	sipe_private->timeouts = g_slist_append(sipe_private->timeouts, new);
-	SIPE_DEBUG_INFO("sipe_schedule_allocate timeouts count %d after addition",
-			g_slist_length(sipe_private->timeouts));
-	return(new);
+	new->due = due;
+	new->sequence = queue->sequence++;
+
+	if (new->name)
+		g_hash_table_insert(queue->names, new->name, new);
+	g_ptr_array_add(queue->heap, new);
+	sipe_schedule_heap_up(queue, queue->heap->len - 1);
+	SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+				  "sipe_schedule_allocate timeouts count %d after addition",
+				  queue->heap->len);
+	sipe_metrics_count(sipe_private, SIPE_METRIC_SCHEDULE_ADDED);
+
+	sipe_schedule_arm(queue);
 }
 
 void sipe_schedule_seconds(struct sipe_core_private *sipe_private,
@@ -92,16 +261,16 @@ void sipe_schedule_seconds(struct sipe_core_private *sipe_private,
 			   sipe_schedule_action action,
 			   GDestroyNotify destroy)
 {
-	struct sipe_schedule *new = sipe_schedule_allocate(sipe_private,
-							   name,
-							   payload,
-							   action,
-							   destroy);
-	SIPE_DEBUG_INFO("scheduling action %s timeout %d seconds",
-			name, seconds);
-	new->backend_private = sipe_backend_schedule_seconds(SIPE_CORE_PUBLIC,
-							     seconds,
-							     new);
+	SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+				  "scheduling action %s timeout %d seconds",
+				  name, seconds);
+	/* round up: a seconds timer must never fire early */
+	sipe_schedule_allocate(sipe_private,
+			       name,
+			       payload,
+			       ((sipe_utils_monotonic_msec() + 999) / 1000 + seconds) * 1000,
+			       action,
+			       destroy);
 }
 
 void sipe_schedule_mseconds(struct sipe_core_private *sipe_private,
@@ -111,61 +280,68 @@ void sipe_schedule_mseconds(struct sipe_core_private *sipe_private,
 			    sipe_schedule_action action,
 			    GDestroyNotify destroy)
 {
-	struct sipe_schedule *new = sipe_schedule_allocate(sipe_private,
-							   name,
-							   payload,
-							   action,
-							   destroy);
-	SIPE_DEBUG_INFO("scheduling action %s timeout %d milliseconds",
-			name, milliseconds);
-	new->backend_private = sipe_backend_schedule_mseconds(SIPE_CORE_PUBLIC,
-							      milliseconds,
-							      new);
-}
-
-static void sipe_schedule_remove(struct sipe_core_private *sipe_private,
-				 struct sipe_schedule *schedule)
-{
-	SIPE_DEBUG_INFO("sipe_schedule_remove: action name=%s",
-			schedule->name);
-	sipe_backend_schedule_cancel(SIPE_CORE_PUBLIC,
-				     schedule->backend_private);
-	sipe_schedule_deallocate(schedule);
+	SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+				  "scheduling action %s timeout %d milliseconds",
+				  name, milliseconds);
+	sipe_schedule_allocate(sipe_private,
+			       name,
+			       payload,
+			       sipe_utils_monotonic_msec() + milliseconds,
+			       action,
+			       destroy);
 }
 
 void sipe_schedule_cancel(struct sipe_core_private *sipe_private,
 			  const gchar *name)
 {
-	GSList *entry;
-
-	if (!sipe_private->timeouts || !name) return;
-
-	entry = sipe_private->timeouts;
-	while (entry) {
-		struct sipe_schedule *schedule = entry->data;
-		if (sipe_strequal(schedule->name, name)) {
-			GSList *to_delete = entry;
-			entry = entry->next;
-			sipe_private->timeouts = g_slist_delete_link(sipe_private->timeouts,
-								     to_delete);
-			sipe_schedule_remove(sipe_private, schedule);
-		} else {
-			entry = entry->next;
-		}
+	struct sipe_schedule_queue *queue = sipe_private->timeouts;
+	struct sipe_schedule *schedule;
+
+	if (!queue || !name) return;
+
+	schedule = g_hash_table_lookup(queue->names, name);
+	if (schedule) {
+		SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+					  "sipe_schedule_remove: action name=%s",
+					  schedule->name);
+		/* backend timer is left running, it re-arms when it expires */
+		sipe_schedule_unlink(queue, schedule);
+		sipe_schedule_deallocate(schedule);
+		sipe_metrics_count(sipe_private, SIPE_METRIC_SCHEDULE_CANCELLED);
 	}
 }
 
 void sipe_schedule_cancel_all(struct sipe_core_private *sipe_private)
 {
-	GSList *entry = sipe_private->timeouts;
+	struct sipe_schedule_queue *queue = sipe_private->timeouts;
+	guint i;
 
-	while (entry) {
-		sipe_schedule_remove(sipe_private, entry->data);
-		entry = entry->next;
-	}
+	if (!queue) return;
 
-	g_slist_free(sipe_private->timeouts);
+	/* detach first: destroy notifiers could schedule new actions */
 	sipe_private->timeouts = NULL;
+
+	if (queue->backend_private)
+		sipe_backend_schedule_cancel(SIPE_CORE_PUBLIC,
+					     queue->backend_private);
+
+	for (i = 0; i < queue->heap->len; i++) {
+		struct sipe_schedule *schedule = HEAP_ENTRY(i);
+		SIPE_DEBUG_SUBSYSTEM_INFO(SCHEDULE,
+					  "sipe_schedule_remove: action name=%s",
+					  schedule->name);
+		sipe_schedule_deallocate(schedule);
+	}
+
+	g_hash_table_destroy(queue->names);
+	g_ptr_array_free(queue->heap, TRUE);
+	g_free(queue);
+}
+
+guint sipe_schedule_pending(struct sipe_core_private *sipe_private)
+{
+	struct sipe_schedule_queue *queue = sipe_private->timeouts;
+	return(queue ? queue->heap->len : 0);
 }
 
 /*
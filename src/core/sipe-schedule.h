@@ -53,6 +53,13 @@ void sipe_schedule_cancel(struct sipe_core_private *sipe_private,
 			  const gchar *name);
 void sipe_schedule_cancel_all(struct sipe_core_private *sipe_private);
 
+/**
+ * Number of actions waiting for execution
+ *
+ * @param sipe_core_private
+ */
+guint sipe_schedule_pending(struct sipe_core_private *sipe_private);
+
 /*
   Local Variables:
   mode: c
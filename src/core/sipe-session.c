@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2009-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2009-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -37,17 +37,164 @@
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-dialog.h"
+#include "sipe-im.h"
+#include "sipe-intern.h"
 #include "sipe-session.h"
+#include "sipe-subscriptions.h"
 #include "sipe-utils.h"
 
-static void
-sipe_free_queued_message(struct queued_message *message)
+void
+sipe_session_free_queued_message(struct queued_message *message)
 {
+	if (message->target)
+		sipe_im_target_unref(message->target);
 	g_free(message->body);
 	g_free(message->content_type);
 	g_free(message);
 }
 
+/*
+ * Session lookup tables
+ *
+ * sipe_private->sessions stays the master list. Each table maps a key to
+ * a session with that key. Duplicate keys should not happen, if they do
+ * the oldest indexed session wins. The tables are created with the first
+ * session and destroyed with the last one.
+ */
+enum {
+	SESSION_INDEX_CALLID,
+	SESSION_INDEX_IM,
+	SESSION_INDEX_CONFERENCE,
+	SESSION_INDEX_CHAT,
+	SESSION_INDEXES
+};
+
+struct sipe_session_indexes {
+	GHashTable *tables[SESSION_INDEXES];
+};
+
+static gconstpointer session_key(const struct sip_session *session,
+				 guint index)
+{
+	switch (index) {
+	case SESSION_INDEX_CALLID:
+		return(session->callid);
+	case SESSION_INDEX_IM:
+		return(session->is_call ? NULL : session->with);
+	case SESSION_INDEX_CONFERENCE:
+		if (session->chat_session &&
+		    (session->chat_session->type == SIPE_CHAT_TYPE_CONFERENCE))
+			return(session->chat_session->id);
+		break;
+	case SESSION_INDEX_CHAT:
+		return(session->chat_session);
+	}
+	return(NULL);
+}
+
+static gboolean session_key_equal(guint index,
+				  gconstpointer key1,
+				  gconstpointer key2)
+{
+	if (index == SESSION_INDEX_CHAT)
+		return(key1 == key2);
+	return(sipe_strcase_equal(key1, key2));
+}
+
+static struct sip_session *session_lookup(struct sipe_core_private *sipe_private,
+					  guint index,
+					  gconstpointer key)
+{
+	struct sipe_session_indexes *indexes = sipe_private->session_indexes;
+	return(indexes ? g_hash_table_lookup(indexes->tables[index], key) : NULL);
+}
+
+void sipe_session_index_add(struct sipe_core_private *sipe_private,
+			    struct sip_session *session)
+{
+	struct sipe_session_indexes *indexes = sipe_private->session_indexes;
+	guint i;
+
+	if (!indexes) {
+		indexes = sipe_private->session_indexes = g_new0(struct sipe_session_indexes, 1);
+		for (i = 0; i < SESSION_INDEX_CHAT; i++)
+			indexes->tables[i] = g_hash_table_new_full(sipe_strcase_hash,
+								   (GEqualFunc) sipe_strcase_equal,
+								   g_free,
+								   NULL);
+		indexes->tables[SESSION_INDEX_CHAT] = g_hash_table_new(g_direct_hash,
+								       g_direct_equal);
+	}
+
+	for (i = 0; i < SESSION_INDEXES; i++) {
+		gconstpointer key = session_key(session, i);
+
+		if (key && !g_hash_table_lookup(indexes->tables[i], key))
+			g_hash_table_insert(indexes->tables[i],
+					    (i == SESSION_INDEX_CHAT) ?
+					    (gpointer) key : g_strdup(key),
+					    session);
+	}
+}
+
+void sipe_session_index_remove(struct sipe_core_private *sipe_private,
+			       struct sip_session *session)
+{
+	struct sipe_session_indexes *indexes = sipe_private->session_indexes;
+	guint i;
+
+	if (!indexes)
+		return;
+
+	for (i = 0; i < SESSION_INDEXES; i++) {
+		GHashTable *table = indexes->tables[i];
+		gconstpointer key = session_key(session, i);
+
+		if (key && (g_hash_table_lookup(table, key) == session)) {
+			GSList *entry;
+
+			g_hash_table_remove(table, key);
+
+			/* another session with the same key takes over */
+			for (entry = sipe_private->sessions; entry; entry = entry->next) {
+				struct sip_session *other = entry->data;
+				gconstpointer other_key = session_key(other, i);
+
+				if ((other != session) &&
+				    other_key &&
+				    session_key_equal(i, key, other_key)) {
+					g_hash_table_insert(table,
+							    (i == SESSION_INDEX_CHAT) ?
+							    (gpointer) other_key : g_strdup(other_key),
+							    other);
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void session_indexes_free(struct sipe_core_private *sipe_private)
+{
+	struct sipe_session_indexes *indexes = sipe_private->session_indexes;
+	guint i;
+
+	if (!indexes)
+		return;
+
+	for (i = 0; i < SESSION_INDEXES; i++)
+		g_hash_table_destroy(indexes->tables[i]);
+	g_free(indexes);
+	sipe_private->session_indexes = NULL;
+}
+
+static void session_append(struct sipe_core_private *sipe_private,
+			   struct sip_session *session)
+{
+	sipe_private->sessions = g_slist_append(sipe_private->sessions, session);
+	sipe_session_index_add(sipe_private, session);
+}
+
 struct sip_session *
 sipe_session_add_chat(struct sipe_core_private *sipe_private,
 		      struct sipe_chat_session *chat_session,
@@ -67,10 +214,8 @@ sipe_session_add_chat(struct sipe_core_private *sipe_private,
 								 chat_title);
 		g_free(chat_title);
 	}
-	session->unconfirmed_messages = g_hash_table_new_full(
-		g_str_hash, g_str_equal, g_free, (GDestroyNotify)sipe_free_queued_message);
 	session->conf_unconfirmed_messages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-	sipe_private->sessions = g_slist_append(sipe_private->sessions, session);
+	session_append(sipe_private, session);
 	return session;
 }
 
@@ -82,11 +227,9 @@ sipe_session_add_call(struct sipe_core_private *sipe_private,
 {
 	struct sip_session *session = g_new0(struct sip_session, 1);
 	SIPE_DEBUG_INFO("sipe_session_add_call: new session for %s", who);
-	session->with = g_strdup(who);
-	session->unconfirmed_messages = g_hash_table_new_full(
-		g_str_hash, g_str_equal, g_free, (GDestroyNotify)sipe_free_queued_message);
+	session->with = sipe_intern_uri(who);
 	session->is_call = TRUE;
-	sipe_private->sessions = g_slist_append(sipe_private->sessions, session);
+	session_append(sipe_private, session);
 	return session;
 }
 
@@ -100,13 +243,7 @@ sipe_session_find_chat(struct sipe_core_private *sipe_private,
 		return NULL;
 	}
 
-	SIPE_SESSION_FOREACH {
-		if (session->chat_session == chat_session) {
-			return session;
-		}
-	} SIPE_SESSION_FOREACH_END;
-	return NULL;
-
+	return(session_lookup(sipe_private, SESSION_INDEX_CHAT, chat_session));
 }
 
 struct sip_session *
@@ -117,13 +254,7 @@ sipe_session_find_chat_by_callid(struct sipe_core_private *sipe_private,
 		return NULL;
 	}
 
-	SIPE_SESSION_FOREACH {
-		if (session->callid &&
-		    sipe_strcase_equal(callid, session->callid)) {
-			return session;
-		}
-	} SIPE_SESSION_FOREACH_END;
-	return NULL;
+	return(session_lookup(sipe_private, SESSION_INDEX_CALLID, callid));
 }
 
 struct sip_session *
@@ -134,14 +265,7 @@ sipe_session_find_conference(struct sipe_core_private *sipe_private,
 		return NULL;
 	}
 
-	SIPE_SESSION_FOREACH {
-		if (session->chat_session &&
-		    (session->chat_session->type == SIPE_CHAT_TYPE_CONFERENCE) &&
-		    sipe_strcase_equal(focus_uri, session->chat_session->id)) {
-			return session;
-		}
-	} SIPE_SESSION_FOREACH_END;
-	return NULL;
+	return(session_lookup(sipe_private, SESSION_INDEX_CONFERENCE, focus_uri));
 }
 
 struct sip_session *
@@ -152,13 +276,7 @@ sipe_session_find_im(struct sipe_core_private *sipe_private,
 		return NULL;
 	}
 
-	SIPE_SESSION_FOREACH {
-		if (!session->is_call &&
-		    session->with && sipe_strcase_equal(who, session->with)) {
-			return session;
-		}
-	} SIPE_SESSION_FOREACH_END;
-	return NULL;
+	return(session_lookup(sipe_private, SESSION_INDEX_IM, who));
 }
 
 struct sip_session *
@@ -169,10 +287,11 @@ sipe_session_find_or_add_im(struct sipe_core_private *sipe_private,
 	if (!session) {
 		SIPE_DEBUG_INFO("sipe_session_find_or_add_im: new session for %s", who);
 		session = g_new0(struct sip_session, 1);
-		session->with = g_strdup(who);
-		session->unconfirmed_messages = g_hash_table_new_full(
-			g_str_hash, g_str_equal, g_free, (GDestroyNotify)sipe_free_queued_message);
-		sipe_private->sessions = g_slist_append(sipe_private->sessions, session);
+		session->with = sipe_intern_uri(who);
+		session_append(sipe_private, session);
+
+		/* conversation partner's presence is needed */
+		sipe_subscribe_presence_demand(sipe_private, who);
 	}
 	return session;
 }
@@ -194,7 +313,10 @@ void
 sipe_session_remove(struct sipe_core_private *sipe_private,
 		    struct sip_session *session)
 {
+	sipe_session_index_remove(sipe_private, session);
 	sipe_private->sessions = g_slist_remove(sipe_private->sessions, session);
+	if (!sipe_private->sessions)
+		session_indexes_free(sipe_private);
 
 	sipe_dialog_remove_all(session);
 	sipe_dialog_free(session->focus_dialog);
@@ -203,11 +325,16 @@ sipe_session_remove(struct sipe_core_private *sipe_private,
 
 	sipe_utils_slist_free_full(session->pending_invite_queue, g_free);
 
-	g_hash_table_destroy(session->unconfirmed_messages);
+	if (session->unconfirmed_messages)
+		g_hash_table_destroy(session->unconfirmed_messages);
 	if (session->conf_unconfirmed_messages)
 		g_hash_table_destroy(session->conf_unconfirmed_messages);
+	if (session->conf_imdn_pending)
+		g_hash_table_destroy(session->conf_imdn_pending);
+	if (session->conf_roster)
+		g_hash_table_destroy(session->conf_roster);
 
-	g_free(session->with);
+	sipe_intern_unref(session->with);
 	g_free(session->callid);
 	g_free(session->im_mcu_uri);
 	g_free(session->subject);
@@ -235,7 +362,7 @@ sipe_session_close(struct sipe_core_private *sipe_private,
 	}
 }
 
-void
+struct queued_message *
 sipe_session_enqueue_message(struct sip_session *session,
 			     const gchar *body, const gchar *content_type)
 {
@@ -245,6 +372,7 @@ sipe_session_enqueue_message(struct sip_session *session,
 		msg->content_type = g_strdup(content_type);
 
 	session->outgoing_message_queue = g_slist_append(session->outgoing_message_queue, msg);
+	return(msg);
 }
 
 GSList *
@@ -257,9 +385,7 @@ sipe_session_dequeue_message(struct sip_session *session)
 
 	msg = session->outgoing_message_queue->data;
 	session->outgoing_message_queue = g_slist_remove(session->outgoing_message_queue, msg);
-	g_free(msg->body);
-	g_free(msg->content_type);
-	g_free(msg);
+	sipe_session_free_queued_message(msg);
 
 	return session->outgoing_message_queue;
 }
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2009-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2009-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -29,6 +29,7 @@
 /* Forward declarations */
 struct sipe_core_private;
 struct sipe_chat_session;
+struct sipe_im_target;
 
 /* Helper macros to iterate over session list in a SIP account */
 #define SIPE_SESSION_FOREACH {                             \
@@ -43,10 +44,13 @@ struct sip_session {
 	/** chat session */
 	struct sipe_chat_session *chat_session;
 
-	gchar *with; /* For IM or call sessions only (not multi-party) . A URI.*/
+	const gchar *with; /* For IM or call sessions only (not multi-party) . An interned URI.*/
 	/** key is user (URI) */
 	GSList *dialogs;
-	/** Key is <Call-ID><CSeq><METHOD><To> */
+	/** lookup caches for dialogs, see sipe-dialog.c */
+	GHashTable *dialogs_by_with;
+	GHashTable *dialogs_by_tag;
+	/** Unconfirmed messages per dialog, ordered by CSeq, see sipe-im.c */
 	GHashTable *unconfirmed_messages;
 	GSList *outgoing_message_queue;
 
@@ -68,6 +72,12 @@ struct sip_session {
 	struct sip_dialog *focus_dialog;
 	/** Key is Message-Id */
 	GHashTable *conf_unconfirmed_messages;
+	/** Key is Message-Id, IMDNs waiting for flush, see sipe-conf.c */
+	GHashTable *conf_imdn_pending;
+	/** Key is user URI, see sipe-conf.c */
+	GHashTable *conf_roster;
+	/** join requested, sipe_utils_monotonic_msec(). 0 when joined */
+	gint64 conf_join_start;
 
 	/*
 	 * Media call related fields
@@ -96,6 +106,8 @@ struct queued_message {
 	 */
 	gchar *content_type;
 	guint cseq;
+	/** bulk send destination or NULL, see sipe-im.c */
+	struct sipe_im_target *target;
 };
 
 /**
@@ -210,6 +222,24 @@ sipe_session_find_chat_or_im(struct sipe_core_private *sipe_private,
  * @param sipe_private (in) SIPE core data
  * @param session (in) pointer to session
  */
+/**
+ * Update session lookup tables
+ *
+ * The Call-ID, IM peer URI and chat session of a session are used as
+ * lookup keys. Code that changes them for a session in the session list
+ * must call sipe_session_index_remove() before and sipe_session_index_add()
+ * after the change.
+ *
+ * @param sipe_private SIPE core private data
+ * @param session      session
+ */
+void
+sipe_session_index_add(struct sipe_core_private *sipe_private,
+		       struct sip_session *session);
+void
+sipe_session_index_remove(struct sipe_core_private *sipe_private,
+			  struct sip_session *session);
+
 void
 sipe_session_close(struct sipe_core_private *sipe_private,
 		   struct sip_session *session);
@@ -230,11 +260,21 @@ sipe_session_remove(struct sipe_core_private *sipe_private,
  * @param session (in) SIP session
  * @param body (in) message to send
  * @param content_type (in) content type of the message body
+ *
+ * @return new queue item
  */
-void
+struct queued_message *
 sipe_session_enqueue_message(struct sip_session *session,
 			     const gchar *body, const gchar *content_type);
 
+/**
+ * Deallocates a message queue item.
+ *
+ * @param message (in) message queue item
+ */
+void
+sipe_session_free_queued_message(struct queued_message *message);
+
 /**
  * Removes and deallocates the first item in outgoing message queue.
  *
@@ -171,6 +171,147 @@ sipmsg_breakdown_get_string(int version,
 	return msg;
 }
 
+/*
+ * Signature input string builder
+ */
+
+/* same matching as sipmsg_find_part_of_header(), but without copying */
+static const gchar *breakdown_part(const gchar *hdr,
+				   const gchar *before,
+				   const gchar *after,
+				   gsize *length)
+{
+	const gchar *start;
+	const gchar *end;
+
+	if (!hdr)
+		return(NULL);
+
+	start = before ? strstr(hdr, before) : hdr;
+	if (!start)
+		return(NULL);
+	if (before)
+		start += strlen(before);
+
+	end = after ? strstr(start, after) : NULL;
+	*length = end ? (gsize) (end - start) : strlen(start);
+	return(start);
+}
+
+static void breakdown_append(GString *buffer,
+			     const gchar *value,
+			     gsize length)
+{
+	g_string_append_c(buffer, '<');
+	if (value)
+		g_string_append_len(buffer, value, length);
+	g_string_append_c(buffer, '>');
+}
+
+static void breakdown_append_string(GString *buffer,
+				    const gchar *value)
+{
+	breakdown_append(buffer, value, value ? strlen(value) : 0);
+}
+
+static void breakdown_append_part(GString *buffer,
+				  const gchar *hdr,
+				  const gchar *before,
+				  const gchar *after)
+{
+	gsize length = 0;
+	const gchar *part = breakdown_part(hdr, before, after, &length);
+	breakdown_append(buffer, part, length);
+}
+
+gboolean sipmsg_breakdown_build(GString *buffer,
+				int version,
+				const struct sipmsg *msg,
+				const gchar *protocol,
+				const gchar *realm_target,
+				const gchar *rand,
+				const gchar *num)
+{
+	const gchar *auth;
+	const gchar *hdr;
+	const gchar *from;
+	const gchar *to;
+
+	g_string_truncate(buffer, 0);
+
+	if ((auth = sipmsg_find_header(msg, "Proxy-Authorization")) ||
+	    (auth = sipmsg_find_header(msg, "Proxy-Authentication-Info")) ||
+	    (auth = sipmsg_find_header(msg, "Authentication-Info"))) {
+		if (!strstr(auth, "realm=\"")) {
+			SIPE_DEBUG_INFO_NOFORMAT("realm NULL, so returning NULL signature string");
+			return(FALSE);
+		}
+
+		breakdown_append_part(buffer, auth, NULL, " ");
+		if (rand)
+			breakdown_append_string(buffer, rand);
+		else
+			breakdown_append_part(buffer, auth, "rand=\"", "\"");
+		if (num)
+			breakdown_append_string(buffer, num);
+		else
+			breakdown_append_part(buffer, auth, "num=\"", "\"");
+		breakdown_append_part(buffer, auth, "realm=\"", "\"");
+		breakdown_append_part(buffer, auth, "targetname=\"", "\"");
+
+	} else {
+		if (!realm_target) {
+			SIPE_DEBUG_INFO_NOFORMAT("realm NULL, so returning NULL signature string");
+			return(FALSE);
+		}
+
+		breakdown_append_string(buffer, protocol);
+		breakdown_append_string(buffer, rand);
+		breakdown_append_string(buffer, num);
+		/* constant per registration: "<realm><target>" */
+		g_string_append(buffer, realm_target);
+	}
+
+	breakdown_append_string(buffer,
+				sipmsg_find_known_header(msg, SIPMSG_HEADER_CALL_ID));
+	breakdown_append_part(buffer,
+			      sipmsg_find_known_header(msg, SIPMSG_HEADER_CSEQ),
+			      NULL, " ");
+	breakdown_append_string(buffer, msg->method);
+
+	from = sipmsg_find_known_header(msg, SIPMSG_HEADER_FROM);
+	breakdown_append_part(buffer, from, "<", ">");
+	breakdown_append_part(buffer, from, ";tag=", ";");
+
+	to = sipmsg_find_known_header(msg, SIPMSG_HEADER_TO);
+	if (version >= 3)
+		breakdown_append_part(buffer, to, "<", ">");
+	breakdown_append_part(buffer, to, ";tag=", ";");
+
+	if (version >= 3) {
+		gchar *sip_uri = NULL;
+		gchar *tel_uri = NULL;
+
+		hdr = sipmsg_find_header(msg, "P-Asserted-Identity");
+		if (!hdr)
+			hdr = sipmsg_find_header(msg, "P-Preferred-Identity");
+		if (hdr)
+			sipmsg_parse_p_asserted_identity(hdr, &sip_uri, &tel_uri);
+
+		breakdown_append_string(buffer, sip_uri);
+		breakdown_append_string(buffer, tel_uri);
+		g_free(tel_uri);
+		g_free(sip_uri);
+	}
+
+	breakdown_append_string(buffer, sipmsg_find_header(msg, "Expires"));
+
+	if (msg->response)
+		g_string_append_printf(buffer, "<%d>", msg->response);
+
+	return(TRUE);
+}
+
 /*
   Local Variables:
   mode: c
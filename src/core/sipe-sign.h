@@ -49,3 +49,28 @@ gchar*
 sipmsg_breakdown_get_string(int version,
 			    struct sipmsg_breakdown * msgbd);
 void sipmsg_breakdown_free(struct sipmsg_breakdown * msg);
+
+/**
+ * Build signature input string directly from the message headers
+ *
+ * Same result as sipmsg_breakdown_parse() & sipmsg_breakdown_get_string()
+ * but without copying each field: everything is appended straight into
+ * @c buffer. The buffer is truncated first, i.e. it can be reused.
+ *
+ * @param buffer       (out) signature input string
+ * @param version      authentication protocol version
+ * @param msg          SIP message
+ * @param protocol     authentication protocol of the registration
+ * @param realm_target "<realm><target>" of the registration or @c NULL
+ * @param rand         crand for outgoing messages or @c NULL
+ * @param num          cnum for outgoing messages or @c NULL
+ *
+ * @return @c FALSE if there is no realm, i.e. message can't be signed
+ */
+gboolean sipmsg_breakdown_build(GString *buffer,
+				int version,
+				const struct sipmsg *msg,
+				const gchar *protocol,
+				const gchar *realm_target,
+				const gchar *rand,
+				const gchar *num);
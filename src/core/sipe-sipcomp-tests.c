@@ -0,0 +1,182 @@
+/**
+ * @file sipe-sipcomp-tests.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipe-sipcomp.h"
+
+static const gchar *sip_message =
+	"SUBSCRIBE sip:alice@example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/TLS 192.168.0.1:49152\r\n"
+	"From: <sip:alice@example.com>;tag=5a3c0e2f7b;epid=01010101\r\n"
+	"To: <sip:alice@example.com>\r\n"
+	"Max-Forwards: 70\r\n"
+	"CSeq: 3 SUBSCRIBE\r\n"
+	"User-Agent: UCCAPI/15.0.4420.1017 OC/15.0.4420.1017 (Microsoft Lync)\r\n"
+	"Call-ID: 2a0f5e3b7c1d4e6f8a9b0c1d2e3f4a5b\r\n"
+	"Contact: <sip:alice@example.com;opaque=user:epid:AbCdEfGh;gruu>\r\n"
+	"Event: vnd-microsoft-roaming-contacts\r\n"
+	"Accept: application/vnd-microsoft-roaming-contacts+xml\r\n"
+	"Supported: com.microsoft.autoextend\r\n"
+	"Supported: ms-benotify\r\n"
+	"Proxy-Require: ms-benotify\r\n"
+	"Supported: ms-piggyback-first-notify\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+/* compress in one go, feed the receiver in small pieces */
+static int roundtrip(const gchar *label,
+		     struct sipe_sipcomp *tx,
+		     struct sipe_sipcomp *rx,
+		     const guchar *data,
+		     gsize length,
+		     gsize piece)
+{
+	GByteArray *wire = g_byte_array_new();
+	GString *result  = g_string_new("");
+	gsize received   = 0;
+	gsize consumed   = 0;
+	int failed       = 0;
+
+	sipe_sipcomp_compress(tx, data, length, wire);
+
+	while (consumed < wire->len) {
+		const guchar *plain;
+		gsize plain_length;
+		gssize used;
+
+		received = MIN(received + piece, wire->len);
+		used = sipe_sipcomp_decompress(rx,
+					       wire->data + consumed,
+					       received - consumed,
+					       &plain,
+					       &plain_length);
+		if (used < 0) {
+			printf("FAILED: %s - corrupted frame at %" G_GSIZE_FORMAT "\n",
+			       label, consumed);
+			failed = 1;
+			break;
+		} else if (used > 0) {
+			g_string_append_len(result, (const gchar *) plain, plain_length);
+			consumed += used;
+		} else if (received == wire->len) {
+			printf("FAILED: %s - truncated frame\n", label);
+			failed = 1;
+			break;
+		}
+	}
+
+	if (!failed) {
+		if ((result->len != length) ||
+		    memcmp(result->str, data, length)) {
+			printf("FAILED: %s - data mismatch\n", label);
+			failed = 1;
+		} else {
+			printf("OK: %s (%" G_GSIZE_FORMAT " -> %u bytes)\n",
+			       label, length, wire->len);
+		}
+	}
+
+	g_string_free(result, TRUE);
+	g_byte_array_free(wire, TRUE);
+	return(failed);
+}
+
+int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char *argv[])
+{
+	struct sipe_sipcomp *tx = sipe_sipcomp_new();
+	struct sipe_sipcomp *rx = sipe_sipcomp_new();
+	guchar *random          = g_malloc(20000);
+	GString *large          = g_string_new("");
+	int failed              = 0;
+	guint i;
+
+	/* history is shared between messages of one connection */
+	failed += roundtrip("first message", tx, rx,
+			    (const guchar *) sip_message, strlen(sip_message),
+			    G_MAXSIZE);
+	failed += roundtrip("second message", tx, rx,
+			    (const guchar *) sip_message, strlen(sip_message),
+			    7);
+	failed += roundtrip("keepalive", tx, rx,
+			    (const guchar *) "\r\n\r\n", 4, 1);
+
+	/* incompressible data: sent uncompressed, history restarts */
+	for (i = 0; i < 20000; i++)
+		random[i] = g_random_int() & 0xFF;
+	failed += roundtrip("random data", tx, rx, random, 20000, 1000);
+	failed += roundtrip("after random data", tx, rx,
+			    (const guchar *) sip_message, strlen(sip_message),
+			    G_MAXSIZE);
+
+	/* multiple frames, history wraps around */
+	for (i = 0; i < 300; i++)
+		g_string_append_printf(large, "<contact uri=\"sip:user%u@example.com\" name=\"User %u\" groups=\"%u\"/>\r\n",
+				       i, i, i % 7);
+	failed += roundtrip("large message", tx, rx,
+			    (const guchar *) large->str, large->len, 4096);
+	failed += roundtrip("large message again", tx, rx,
+			    (const guchar *) large->str, large->len, 333);
+
+	/* all byte values & long runs */
+	memset(random, 0xAA, 20000);
+	for (i = 0; i < 256; i++)
+		random[i * 8] = i;
+	failed += roundtrip("high literals & runs", tx, rx, random, 20000, 50);
+
+	/* corrupted data must be detected, not crash */
+	{
+		static const guchar bogus[] = { 0x20, 0x00, 0x02, 0xFF, 0xFF };
+		const guchar *plain;
+		gsize plain_length;
+		struct sipe_sipcomp *corrupt = sipe_sipcomp_new();
+
+		if (sipe_sipcomp_decompress(corrupt, bogus, sizeof(bogus),
+					    &plain, &plain_length) >= 0) {
+			printf("FAILED: corrupted frame not detected\n");
+			failed++;
+		}
+		sipe_sipcomp_free(corrupt);
+	}
+
+	g_string_free(large, TRUE);
+	g_free(random);
+	sipe_sipcomp_free(rx);
+	sipe_sipcomp_free(tx);
+
+	printf("\nResult: %d test(s) failed\n", failed);
+	return(failed);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
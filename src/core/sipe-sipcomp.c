@@ -0,0 +1,411 @@
+/**
+ * @file sipe-sipcomp.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * MS-SIPCOMP: SIP compression
+ *
+ * The bit stream uses the RFC 2118 (MPPC) encoding with an 8 KB history:
+ *
+ *   literal < 0x80         0     + 7 bits
+ *   literal >= 0x80        10    + 7 bits
+ *   offset < 64            1111  + 6 bits
+ *   offset < 320           1110  + 8 bits (offset - 64)
+ *   offset < 8192          110   + 13 bits (offset - 320)
+ *   length 3               0
+ *   length 2^k..2^(k+1)-1  (k-1) x 1, 0 + k bits (length - 2^k)
+ *
+ * Every frame starts with a flags byte which is followed by the length of
+ * the payload as 16-bit big endian value.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-sipcomp.h"
+
+#define HISTORY_SIZE  8192
+#define MATCH_MIN     3
+#define MATCH_MAX     (HISTORY_SIZE - 1)
+#define HASH_BITS     12
+#define HASH_SIZE     (1 << HASH_BITS)
+#define CHAIN_DEPTH   16
+
+#define FRAME_HEADER       3
+#define FRAME_TYPE_8K      0x00
+#define FRAME_TYPE_MASK    0x0F
+#define FRAME_COMPRESSED   0x20
+#define FRAME_AT_FRONT     0x40
+#define FRAME_FLUSHED      0x80
+
+struct sipe_sipcomp {
+	guchar history[HISTORY_SIZE];
+	guint position;
+	/* sender: next frame must tell the receiver to reset its history */
+	gboolean flushed;
+	/* sender: match finder */
+	gint16 head[HASH_SIZE];
+	gint16 chain[HISTORY_SIZE];
+};
+
+struct bit_writer {
+	GByteArray *out;
+	guint32 accumulator;
+	guint bits;
+};
+
+struct bit_reader {
+	const guchar *data;
+	gsize bits;
+	gsize position;
+};
+
+static void history_reset(struct sipe_sipcomp *comp)
+{
+	comp->position = 0;
+	/* all bits set == -1 == empty */
+	memset(comp->head, 0xFF, sizeof(comp->head));
+}
+
+struct sipe_sipcomp *sipe_sipcomp_new(void)
+{
+	struct sipe_sipcomp *comp = g_new0(struct sipe_sipcomp, 1);
+	history_reset(comp);
+	comp->flushed = TRUE;
+	return(comp);
+}
+
+void sipe_sipcomp_free(struct sipe_sipcomp *comp)
+{
+	g_free(comp);
+}
+
+gsize sipe_sipcomp_size(void)
+{
+	return(sizeof(struct sipe_sipcomp));
+}
+
+/* count <= 16 */
+static void put_bits(struct bit_writer *writer, guint32 value, guint count)
+{
+	writer->accumulator = (writer->accumulator << count) |
+		(value & ((1 << count) - 1));
+	writer->bits += count;
+
+	while (writer->bits >= 8) {
+		guint8 byte = writer->accumulator >> (writer->bits - 8);
+		g_byte_array_append(writer->out, &byte, 1);
+		writer->bits -= 8;
+	}
+	writer->accumulator &= (1 << writer->bits) - 1;
+}
+
+static void put_literal(struct bit_writer *writer, guint8 literal)
+{
+	if (literal < 0x80)
+		put_bits(writer, literal, 8);
+	else
+		put_bits(writer, 0x100 | (literal & 0x7F), 9);
+}
+
+static void put_copy(struct bit_writer *writer, guint offset, guint length)
+{
+	if (offset < 64)
+		put_bits(writer, 0x3C0 | offset, 10);
+	else if (offset < 320)
+		put_bits(writer, 0xE00 | (offset - 64), 12);
+	else
+		put_bits(writer, 0xC000 | (offset - 320), 16);
+
+	if (length == MATCH_MIN) {
+		put_bits(writer, 0, 1);
+	} else {
+		guint k = 0;
+		while ((length >> (k + 1)) != 0)
+			k++;
+		put_bits(writer, ((1 << (k - 1)) - 1) << 1, k);
+		put_bits(writer, length - (1 << k), k);
+	}
+}
+
+static guint hash3(const guchar *p)
+{
+	return(((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (HASH_SIZE - 1));
+}
+
+static void hash_insert(struct sipe_sipcomp *comp, guint position, guint end)
+{
+	if (position + MATCH_MIN <= end) {
+		guint hash = hash3(comp->history + position);
+		comp->chain[position] = comp->head[hash];
+		comp->head[hash]      = position;
+	}
+}
+
+static guint find_match(struct sipe_sipcomp *comp,
+			guint position,
+			guint end,
+			guint *offset)
+{
+	const guchar *history = comp->history;
+	guint max   = MIN(end - position, MATCH_MAX);
+	guint depth = CHAIN_DEPTH;
+	guint best  = 0;
+	gint candidate;
+
+	if (max < MATCH_MIN)
+		return(0);
+
+	candidate = comp->head[hash3(history + position)];
+	while ((candidate >= 0) && depth--) {
+		guint length = 0;
+
+		/* overlapping matches are OK: receiver copies byte by byte */
+		while ((length < max) &&
+		       (history[candidate + length] == history[position + length]))
+			length++;
+
+		if (length > best) {
+			best    = length;
+			*offset = position - candidate;
+			if (length == max)
+				break;
+		}
+
+		candidate = comp->chain[candidate];
+	}
+
+	return(best >= MATCH_MIN ? best : 0);
+}
+
+static void compress_frame(struct sipe_sipcomp *comp,
+			   const guchar *data,
+			   guint length,
+			   GByteArray *out)
+{
+	guint flags     = FRAME_TYPE_8K | FRAME_COMPRESSED;
+	guint header_at = out->len;
+	struct bit_writer writer = { out, 0, 0 };
+	guint position, end;
+	gsize payload;
+
+	if (comp->flushed) {
+		flags |= FRAME_FLUSHED;
+		comp->flushed = FALSE;
+	}
+	if (comp->position + length > HISTORY_SIZE) {
+		history_reset(comp);
+		flags |= FRAME_AT_FRONT;
+	}
+
+	position = comp->position;
+	end      = position + length;
+	memcpy(comp->history + position, data, length);
+
+	g_byte_array_set_size(out, header_at + FRAME_HEADER);
+	while (position < end) {
+		guint offset = 0;
+		guint match  = find_match(comp, position, end, &offset);
+
+		if (match) {
+			put_copy(&writer, offset, match);
+			while (match--)
+				hash_insert(comp, position++, end);
+		} else {
+			put_literal(&writer, comp->history[position]);
+			hash_insert(comp, position++, end);
+		}
+	}
+	if (writer.bits)
+		put_bits(&writer, 0, 8 - writer.bits);
+
+	payload = out->len - header_at - FRAME_HEADER;
+	if (payload >= length) {
+		/* no gain: send data as-is and restart with empty history */
+		g_byte_array_set_size(out, header_at + FRAME_HEADER);
+		g_byte_array_append(out, data, length);
+		flags   = FRAME_TYPE_8K | FRAME_FLUSHED;
+		payload = length;
+		history_reset(comp);
+	} else {
+		comp->position = end;
+	}
+
+	out->data[header_at]     = flags;
+	out->data[header_at + 1] = payload >> 8;
+	out->data[header_at + 2] = payload & 0xFF;
+}
+
+void sipe_sipcomp_compress(struct sipe_sipcomp *comp,
+			   const guchar *data,
+			   gsize length,
+			   GByteArray *out)
+{
+	while (length) {
+		guint chunk = MIN(length, HISTORY_SIZE);
+		compress_frame(comp, data, chunk, out);
+		data   += chunk;
+		length -= chunk;
+	}
+}
+
+static gboolean get_bits(struct bit_reader *reader,
+			 guint count,
+			 guint *value)
+{
+	guint result = 0;
+
+	if (reader->bits - reader->position < count)
+		return(FALSE);
+
+	while (count--) {
+		gsize position = reader->position++;
+		result = (result << 1) |
+			((reader->data[position >> 3] >> (7 - (position & 7))) & 1);
+	}
+	*value = result;
+	return(TRUE);
+}
+
+static gboolean decompress_frame(struct sipe_sipcomp *comp,
+				 const guchar *data,
+				 gsize length)
+{
+	struct bit_reader reader = { data, length * 8, 0 };
+	guchar *history = comp->history;
+
+	/* less than 8 bits left can only be padding */
+	while (reader.bits - reader.position >= 8) {
+		guint bit, value, offset, count;
+
+		get_bits(&reader, 1, &bit);
+		if (bit == 0) {
+			get_bits(&reader, 7, &value);
+			if (comp->position >= HISTORY_SIZE)
+				return(FALSE);
+			history[comp->position++] = value;
+			continue;
+		}
+
+		if (!get_bits(&reader, 1, &bit))
+			return(FALSE);
+		if (bit == 0) {
+			if (!get_bits(&reader, 7, &value) ||
+			    (comp->position >= HISTORY_SIZE))
+				return(FALSE);
+			history[comp->position++] = 0x80 | value;
+			continue;
+		}
+
+		/* copy tuple: offset */
+		if (!get_bits(&reader, 1, &bit))
+			return(FALSE);
+		if (bit == 0) {
+			if (!get_bits(&reader, 13, &offset))
+				return(FALSE);
+			offset += 320;
+		} else {
+			if (!get_bits(&reader, 1, &bit))
+				return(FALSE);
+			if (bit == 0) {
+				if (!get_bits(&reader, 8, &offset))
+					return(FALSE);
+				offset += 64;
+			} else if (!get_bits(&reader, 6, &offset)) {
+				return(FALSE);
+			}
+		}
+
+		/* copy tuple: length */
+		count = 0;
+		do {
+			if (!get_bits(&reader, 1, &bit) || (count > 11))
+				return(FALSE);
+			count += bit;
+		} while (bit);
+		if (count == 0) {
+			count = MATCH_MIN;
+		} else {
+			guint k = count + 1;
+			if (!get_bits(&reader, k, &value))
+				return(FALSE);
+			count = (1 << k) + value;
+		}
+
+		if ((offset == 0) ||
+		    (offset > comp->position) ||
+		    (comp->position + count > HISTORY_SIZE))
+			return(FALSE);
+		while (count--) {
+			history[comp->position] = history[comp->position - offset];
+			comp->position++;
+		}
+	}
+
+	return(TRUE);
+}
+
+gssize sipe_sipcomp_decompress(struct sipe_sipcomp *comp,
+			       const guchar *data,
+			       gsize length,
+			       const guchar **plain,
+			       gsize *plain_length)
+{
+	guint flags, payload, start;
+
+	if (length < FRAME_HEADER)
+		return(0);
+
+	flags   = data[0];
+	payload = (data[1] << 8) | data[2];
+	if (((flags & FRAME_TYPE_MASK) != FRAME_TYPE_8K) ||
+	    (payload > HISTORY_SIZE))
+		return(-1);
+	if (length < FRAME_HEADER + payload)
+		return(0);
+	data += FRAME_HEADER;
+
+	if (flags & (FRAME_FLUSHED | FRAME_AT_FRONT))
+		comp->position = 0;
+
+	if (!(flags & FRAME_COMPRESSED)) {
+		*plain        = data;
+		*plain_length = payload;
+		return(FRAME_HEADER + payload);
+	}
+
+	start = comp->position;
+	if (!decompress_frame(comp, data, payload))
+		return(-1);
+
+	*plain        = comp->history + start;
+	*plain_length = comp->position - start;
+	return(FRAME_HEADER + payload);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
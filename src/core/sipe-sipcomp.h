@@ -0,0 +1,96 @@
+/**
+ * @file sipe-sipcomp.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * SIP compression (MS-SIPCOMP)
+ *
+ * LZ77 with an 8 KB history buffer and the bit encoding of RFC 2118.
+ * Each direction of a connection has its own history, i.e. one context
+ * is needed for sending and one for receiving.
+ */
+
+/* Forward declarations */
+struct sipe_sipcomp;
+
+/* value for "Compression" header during NEGOTIATE */
+#define SIPE_SIPCOMP_LZ77_8K "LZ77-8K"
+
+/**
+ * Allocate compression context
+ *
+ * @return new context. Must be freed with @c sipe_sipcomp_free()
+ */
+struct sipe_sipcomp *sipe_sipcomp_new(void);
+
+/**
+ * Free compression context
+ *
+ * @param comp compression context (may be @c NULL)
+ */
+void sipe_sipcomp_free(struct sipe_sipcomp *comp);
+
+/**
+ * Size of a compression context
+ *
+ * @return number of bytes allocated by @c sipe_sipcomp_new()
+ */
+gsize sipe_sipcomp_size(void);
+
+/**
+ * Compress outgoing data
+ *
+ * @param comp   compression context for sending
+ * @param data   plain data
+ * @param length length of plain data
+ * @param out    compressed frames are appended to this array
+ */
+void sipe_sipcomp_compress(struct sipe_sipcomp *comp,
+			   const guchar *data,
+			   gsize length,
+			   GByteArray *out);
+
+/**
+ * Decompress one incoming frame
+ *
+ * @param comp         compression context for receiving
+ * @param data         received data, starting with a frame
+ * @param length       length of received data
+ * @param plain        (out) decompressed data, only valid until next call
+ * @param plain_length (out) length of decompressed data
+ *
+ * @return number of bytes consumed from @c data, 0 if the frame isn't
+ *         complete yet or -1 if the data is corrupted
+ */
+gssize sipe_sipcomp_decompress(struct sipe_sipcomp *comp,
+			       const guchar *data,
+			       gsize length,
+			       const guchar **plain,
+			       gsize *plain_length);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,70 @@
+/**
+ * @file sipe-soap.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-soap.h"
+
+/* most requests fit without reallocation */
+#define SIPE_SOAP_INITIAL_SIZE 2048
+
+GString *sipe_soap_new(const gchar *prefix)
+{
+	GString *soap = g_string_sized_new(SIPE_SOAP_INITIAL_SIZE);
+	if (prefix)
+		g_string_append(soap, prefix);
+	return(soap);
+}
+
+void sipe_soap_append_escaped(GString *soap, const gchar *text)
+{
+	if (!text)
+		return;
+
+	while (*text) {
+		gsize plain = strcspn(text, "&<>\"'");
+
+		g_string_append_len(soap, text, plain);
+		text += plain;
+
+		switch (*text) {
+		case '&':  g_string_append(soap, "&amp;");  break;
+		case '<':  g_string_append(soap, "&lt;");   break;
+		case '>':  g_string_append(soap, "&gt;");   break;
+		case '"':  g_string_append(soap, "&quot;"); break;
+		case '\'': g_string_append(soap, "&apos;"); break;
+		default:   /* end of string */              return;
+		}
+		text++;
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
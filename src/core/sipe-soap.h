@@ -0,0 +1,61 @@
+/**
+ * @file sipe-soap.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * SOAP/XML request body builder for HTTP based web services
+ *
+ * Callers keep the constant parts of their envelopes as static strings
+ * and append the variable parts one after the other. The result is one
+ * buffer that can be handed over to @c sipe_http_request_post_buffer()
+ * without further copying.
+ *
+ * NOTE: for SOAP requests over SIP see sip-soap.h
+ */
+
+/**
+ * Start new request body
+ *
+ * @param prefix constant start of the envelope (may be @c NULL)
+ *
+ * @return new buffer. Must be handed over or freed with @c g_string_free()
+ */
+GString *sipe_soap_new(const gchar *prefix);
+
+/**
+ * Append text with XML special characters replaced by entities
+ *
+ * Use this for character data and attribute values. XML fragments
+ * and constant envelope parts are appended with @c g_string_append().
+ *
+ * @param soap buffer
+ * @param text plain text (may be @c NULL)
+ */
+void sipe_soap_append_escaped(GString *soap, const gchar *text);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
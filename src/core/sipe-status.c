@@ -72,12 +72,15 @@ static struct
 /* SIPE_ACTIVITY_IN_PRES     */ { "in-presentation",           N_("Presenting")                },
 };
 
-static GHashTable *token_map;
+static GHashTable *token_map = NULL;
 
 void sipe_status_init(void)
 {
 	guint index;
 
+	if (token_map)
+		return;
+
 	token_map = g_hash_table_new(g_str_hash, g_str_equal);
 	for (index = SIPE_ACTIVITY_UNSET;
 	     index < SIPE_ACTIVITY_NUM_TYPES;
@@ -90,7 +93,10 @@ void sipe_status_init(void)
 
 void sipe_status_shutdown(void)
 {
-	g_hash_table_destroy(token_map);
+	if (token_map) {
+		g_hash_table_destroy(token_map);
+		token_map = NULL;
+	}
 }
 
 /* type == SIPE_ACTIVITY_xxx (see sipe-core.h) */
@@ -102,6 +108,8 @@ const gchar *sipe_status_activity_to_token(guint type)
 guint sipe_status_token_to_activity(const gchar *token)
 {
 	if (!token) return(SIPE_ACTIVITY_UNSET);
+	/* table is built on first use */
+	if (!token_map) sipe_status_init();
 	return(GPOINTER_TO_UINT(g_hash_table_lookup(token_map, token)));
 }
 
@@ -157,6 +165,64 @@ void sipe_status_and_note(struct sipe_core_private *sipe_private,
 	}
 }
 
+/*
+ * Idle detection and calendar transitions can flip our status several
+ * times within seconds, e.g. when locking and unlocking the screen.
+ */
+#define STATUS_PUBLISH_SETTLE     2000  /* milliseconds after last change */
+#define STATUS_PUBLISH_SETTLE_MAX 10000 /* milliseconds after first change */
+#define STATUS_PUBLISH_INTERVAL   15000 /* milliseconds between publications */
+#define STATUS_PUBLISH_ACTION     "<+status-publish>"
+
+static void status_publish(struct sipe_core_private *sipe_private,
+			   SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	gboolean do_publish_calendar = sipe_private->status_publish_calendar;
+
+	sipe_private->status_publish_calendar = FALSE;
+	sipe_private->status_publish_pending  = 0;
+	sipe_private->status_published        = sipe_utils_monotonic_msec();
+
+	sipe_cal_presence_publish(sipe_private, do_publish_calendar);
+}
+
+void sipe_status_publish(struct sipe_core_private *sipe_private,
+			 gboolean do_publish_calendar,
+			 gboolean immediate)
+{
+	gint64 now = sipe_utils_monotonic_msec();
+	gint64 due;
+
+	if (do_publish_calendar)
+		sipe_private->status_publish_calendar = TRUE;
+
+	if (immediate) {
+		sipe_schedule_cancel(sipe_private, STATUS_PUBLISH_ACTION);
+		status_publish(sipe_private, NULL);
+		return;
+	}
+
+	if (!sipe_private->status_publish_pending)
+		sipe_private->status_publish_pending = now;
+
+	/* every change restarts the settle window, but not forever */
+	due = MIN(now + STATUS_PUBLISH_SETTLE,
+		  sipe_private->status_publish_pending + STATUS_PUBLISH_SETTLE_MAX);
+	if (sipe_private->status_published)
+		due = MAX(due,
+			  sipe_private->status_published + STATUS_PUBLISH_INTERVAL);
+	due = MAX(due, now);
+
+	SIPE_DEBUG_INFO("sipe_status_publish: publishing in %" G_GINT64_FORMAT " ms",
+			due - now);
+	sipe_schedule_mseconds(sipe_private,
+			       STATUS_PUBLISH_ACTION,
+			       NULL,
+			       due - now,
+			       status_publish,
+			       NULL);
+}
+
 void sipe_core_status_set(struct sipe_core_public *sipe_public,
 			  gboolean set_by_user,
 			  guint activity,
@@ -186,7 +252,8 @@ void sipe_core_status_set(struct sipe_core_public *sipe_public,
 	}
 	g_free(tmp);
 
-	sipe_cal_presence_publish(sipe_private, FALSE);
+	/* machine changes, e.g. idle, are debounced */
+	sipe_status_publish(sipe_private, FALSE, set_by_user);
 }
 
 /*
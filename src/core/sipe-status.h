@@ -24,7 +24,7 @@
 /* Forward declarations */
 struct sipe_core_private;
 
-/* called by sipe-core.c during plugin initialization/destruction */
+/* table is built on first use, shutdown called by sipe-core.c */
 void sipe_status_init(void);
 void sipe_status_shutdown(void);
 
@@ -39,6 +39,21 @@ void sipe_status_set_activity(struct sipe_core_private *sipe_private,
 void sipe_status_and_note(struct sipe_core_private *sipe_private,
 			  const gchar *status_id);
 
+/**
+ * Publish own status
+ *
+ * Changes are collected until they have settled and publications are
+ * spaced by a minimum interval. The state at the time of publication is
+ * sent, i.e. intermediate states are dropped.
+ *
+ * @param sipe_private        SIPE core private data
+ * @param do_publish_calendar also publish calendar state
+ * @param immediate           explicit user action: publish right away
+ */
+void sipe_status_publish(struct sipe_core_private *sipe_private,
+			 gboolean do_publish_calendar,
+			 gboolean immediate);
+
 /*
   Local Variables:
   mode: c
@@ -0,0 +1,262 @@
+/**
+ * @file sipe-str.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <string.h>
+
+#include <glib.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SIPE_STR_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SIPE_STR_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "sipe-str.h"
+
+#define HEX_OFFSET_UPPER ('A' - '0' - 10)
+#define HEX_OFFSET_LOWER ('a' - '0' - 10)
+
+static void hex_encode_scalar(const guint8 *buff, gsize length,
+			      gchar *out, guint8 offset)
+{
+	while (length--) {
+		guint8 hi = *buff >> 4;
+		guint8 lo = *buff++ & 0x0F;
+		*out++ = '0' + hi + (hi > 9 ? offset : 0);
+		*out++ = '0' + lo + (lo > 9 ? offset : 0);
+	}
+	*out = '\0';
+}
+
+/* checks the candidate at "p" after a match of the first "\r" */
+#define IS_HEADER_END(p, end) \
+	(((end) - (p) >= 4) && ((p)[1] == '\n') && ((p)[2] == '\r') && ((p)[3] == '\n'))
+
+static const gchar *find_header_end_scalar(const gchar *p, const gchar *end)
+{
+	while (p < end) {
+		p = memchr(p, '\r', end - p);
+		if (!p)
+			return(NULL);
+		if (IS_HEADER_END(p, end))
+			return(p);
+		p++;
+	}
+	return(NULL);
+}
+
+static void ascii_down_scalar(gchar *dst, const gchar *src, gsize length)
+{
+	while (length--) {
+		gchar c = *src++;
+		*dst++ = ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+	}
+}
+
+#if defined(SIPE_STR_SSE2)
+
+void sipe_str_hex_encode(const guint8 *buff, gsize length,
+			 gchar *out, gboolean lower)
+{
+	guint8 offset        = lower ? HEX_OFFSET_LOWER : HEX_OFFSET_UPPER;
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	const __m128i nine   = _mm_set1_epi8(9);
+	const __m128i zero   = _mm_set1_epi8('0');
+	const __m128i alpha  = _mm_set1_epi8(offset);
+
+	for (; length >= 16; length -= 16, buff += 16, out += 32) {
+		__m128i in = _mm_loadu_si128((const __m128i *) buff);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), nibble);
+		__m128i lo = _mm_and_si128(in, nibble);
+
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+				  _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+				  _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+
+		_mm_storeu_si128((__m128i *) out,        _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+
+	hex_encode_scalar(buff, length, out, offset);
+}
+
+const gchar *sipe_str_find_header_end(const gchar *start, gsize length)
+{
+	const gchar *end = start + length;
+	const gchar *p   = start;
+	const __m128i cr = _mm_set1_epi8('\r');
+
+	for (; end - p >= 16; p += 16) {
+		guint mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p),
+							      cr));
+		while (mask) {
+			const gchar *candidate = p + g_bit_nth_lsf(mask, -1);
+			if (IS_HEADER_END(candidate, end))
+				return(candidate);
+			mask &= mask - 1;
+		}
+	}
+
+	return(find_header_end_scalar(p, end));
+}
+
+void sipe_str_ascii_down(gchar *dst, const gchar *src, gsize length)
+{
+	const __m128i before_a = _mm_set1_epi8('A' - 1);
+	const __m128i after_z  = _mm_set1_epi8('Z' + 1);
+	const __m128i fold     = _mm_set1_epi8('a' - 'A');
+
+	/* signed compare: bytes >= 0x80 are never in range */
+	for (; length >= 16; length -= 16, src += 16, dst += 16) {
+		__m128i in    = _mm_loadu_si128((const __m128i *) src);
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, before_a),
+					      _mm_cmplt_epi8(in, after_z));
+		_mm_storeu_si128((__m128i *) dst,
+				 _mm_add_epi8(in, _mm_and_si128(upper, fold)));
+	}
+
+	ascii_down_scalar(dst, src, length);
+}
+
+#elif defined(SIPE_STR_NEON)
+
+void sipe_str_hex_encode(const guint8 *buff, gsize length,
+			 gchar *out, gboolean lower)
+{
+	guint8 offset           = lower ? HEX_OFFSET_LOWER : HEX_OFFSET_UPPER;
+	const uint8x16_t nibble = vdupq_n_u8(0x0F);
+	const uint8x16_t nine   = vdupq_n_u8(9);
+	const uint8x16_t zero   = vdupq_n_u8('0');
+	const uint8x16_t alpha  = vdupq_n_u8(offset);
+
+	for (; length >= 16; length -= 16, buff += 16, out += 32) {
+		uint8x16_t in = vld1q_u8(buff);
+		uint8x16x2_t digits;
+
+		digits.val[0] = vshrq_n_u8(in, 4);
+		digits.val[1] = vandq_u8(in, nibble);
+		digits.val[0] = vaddq_u8(vaddq_u8(digits.val[0], zero),
+					 vandq_u8(vcgtq_u8(digits.val[0], nine), alpha));
+		digits.val[1] = vaddq_u8(vaddq_u8(digits.val[1], zero),
+					 vandq_u8(vcgtq_u8(digits.val[1], nine), alpha));
+
+		/* interleaving store: hi, lo, hi, lo, ... */
+		vst2q_u8((guint8 *) out, digits);
+	}
+
+	hex_encode_scalar(buff, length, out, offset);
+}
+
+const gchar *sipe_str_find_header_end(const gchar *start, gsize length)
+{
+	const gchar *end    = start + length;
+	const gchar *p      = start;
+	const uint8x16_t cr = vdupq_n_u8('\r');
+
+	for (; end - p >= 16; p += 16) {
+		uint8x16_t match = vceqq_u8(vld1q_u8((const guint8 *) p), cr);
+
+		/* check candidates in this block one by one */
+		if (vmaxvq_u8(match)) {
+			const gchar *candidate = memchr(p, '\r', 16);
+			while (candidate) {
+				if (IS_HEADER_END(candidate, end))
+					return(candidate);
+				candidate = memchr(candidate + 1, '\r',
+						   p + 16 - candidate - 1);
+			}
+		}
+	}
+
+	return(find_header_end_scalar(p, end));
+}
+
+void sipe_str_ascii_down(gchar *dst, const gchar *src, gsize length)
+{
+	const uint8x16_t a    = vdupq_n_u8('A');
+	const uint8x16_t z    = vdupq_n_u8('Z');
+	const uint8x16_t fold = vdupq_n_u8('a' - 'A');
+
+	for (; length >= 16; length -= 16, src += 16, dst += 16) {
+		uint8x16_t in    = vld1q_u8((const guint8 *) src);
+		uint8x16_t upper = vandq_u8(vcgeq_u8(in, a), vcleq_u8(in, z));
+		vst1q_u8((guint8 *) dst, vaddq_u8(in, vandq_u8(upper, fold)));
+	}
+
+	ascii_down_scalar(dst, src, length);
+}
+
+#else
+
+void sipe_str_hex_encode(const guint8 *buff, gsize length,
+			 gchar *out, gboolean lower)
+{
+	hex_encode_scalar(buff, length, out,
+			  lower ? HEX_OFFSET_LOWER : HEX_OFFSET_UPPER);
+}
+
+const gchar *sipe_str_find_header_end(const gchar *start, gsize length)
+{
+	return(find_header_end_scalar(start, start + length));
+}
+
+void sipe_str_ascii_down(gchar *dst, const gchar *src, gsize length)
+{
+	ascii_down_scalar(dst, src, length);
+}
+
+#endif
+
+void sipe_str_hex_decode(const gchar *hex, gsize length, guint8 *out)
+{
+	while (length--) {
+		gint hi = g_ascii_xdigit_value(*hex++);
+		gint lo = g_ascii_xdigit_value(*hex++);
+		*out++ = ((hi < 0) || (lo < 0)) ? 0 : (hi << 4) | lo;
+	}
+}
+
+gchar *sipe_str_ascii_strdown(const gchar *src)
+{
+	gchar *dst = NULL;
+
+	if (src) {
+		gsize length = strlen(src);
+		dst = g_malloc(length + 1);
+		sipe_str_ascii_down(dst, src, length + 1);
+	}
+
+	return(dst);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
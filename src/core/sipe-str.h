@@ -0,0 +1,102 @@
+/**
+ * @file sipe-str.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Vectorized string kernels
+ *
+ * Hot byte loops of the core, i.e. hex encoding, header terminator search
+ * and ASCII case folding. The implementation is selected at compile time:
+ * SSE2 on x86, NEON on ARM64 and a portable scalar version otherwise. All
+ * variants produce identical results.
+ */
+
+/*
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/**
+ * Encode buffer as hex string
+ *
+ * @param buff   (in)  data to encode
+ * @param length (in)  length of data
+ * @param out    (out) buffer for @c 2 * @c length + 1 characters. Result is
+ *                     NUL terminated.
+ * @param lower  (in)  @c TRUE for lower case, @c FALSE for upper case digits
+ */
+void sipe_str_hex_encode(const guint8 *buff, gsize length,
+			 gchar *out, gboolean lower);
+
+/**
+ * Decode hex string to buffer
+ *
+ * Invalid digits are decoded as 0.
+ *
+ * @param hex    (in)  hex digits, upper or lower case
+ * @param length (in)  number of bytes to decode, i.e. @c hex must contain
+ *                     at least @c 2 * @c length digits
+ * @param out    (out) buffer for @c length bytes
+ */
+void sipe_str_hex_decode(const gchar *hex, gsize length, guint8 *out);
+
+/**
+ * Find end of SIP/HTTP header block
+ *
+ * @param start  (in) start of data (need not be NUL terminated)
+ * @param length (in) length of data
+ *
+ * @return pointer to first "\r\n\r\n" or @c NULL
+ */
+const gchar *sipe_str_find_header_end(const gchar *start, gsize length);
+
+/**
+ * Convert ASCII upper case characters to lower case
+ *
+ * Non-ASCII bytes are copied unchanged, i.e. UTF-8 stays valid.
+ *
+ * @param dst    (out) result buffer for @c length bytes, may be @c src
+ * @param src    (in)  source string
+ * @param length (in)  number of bytes to convert
+ */
+void sipe_str_ascii_down(gchar *dst, const gchar *src, gsize length);
+
+/**
+ * Lower case copy of ASCII string
+ *
+ * Same as g_ascii_strdown(src, -1) but uses sipe_str_ascii_down().
+ *
+ * @param src (in) source string (may be @c NULL)
+ *
+ * @return lower case copy. Must be g_free()'d. @c NULL if @c src was @c NULL.
+ */
+gchar *sipe_str_ascii_strdown(const gchar *src);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -33,9 +33,13 @@
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-dialog.h"
+#include "sipe-group.h"
+#include "sipe-intern.h"
+#include "sipe-metrics.h"
 #include "sipe-mime.h"
 #include "sipe-notify.h"
 #include "sipe-schedule.h"
+#include "sipe-session.h"
 #include "sipe-subscriptions.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
@@ -44,7 +48,7 @@
 struct sip_subscription {
 	struct sip_dialog dialog;
 	gchar *event;
-	GSList *buddies; /* batched subscriptions */
+	GSList *buddies; /* batched subscriptions, interned URIs */
 };
 
 static void sipe_subscription_free(struct sip_subscription *subscription)
@@ -53,35 +57,76 @@ static void sipe_subscription_free(struct sip_subscription *subscription)
 	if (!subscription) return;
 
 	g_free(subscription->event);
-	sipe_utils_slist_free_full(subscription->buddies, g_free);
+	sipe_utils_slist_free_full(subscription->buddies,
+				   (GDestroyNotify) sipe_intern_unref);
 
 	/* NOTE: use cast to prevent BAD_FREE warning from Coverity */
 	sipe_dialog_free((struct sip_dialog *) subscription);
 }
 
+/*
+ * Single presence resubscriptions
+ *
+ * Renewals are queued and sent in batches. The batch size adapts to the
+ * observed server response latency: fast responses grow it by one, slow
+ * responses halve it. At most batch size requests are in flight.
+ */
+#define SIPE_RESUBSCRIBE_ACTION        "<+presence-resubscribe>"
+#define SIPE_RESUBSCRIBE_INTERVAL      1000 /* milliseconds */
+#define SIPE_RESUBSCRIBE_BATCH_INITIAL   10
+#define SIPE_RESUBSCRIBE_BATCH_MAX       50
+#define SIPE_RESUBSCRIBE_LATENCY_FAST  1000 /* milliseconds */
+#define SIPE_RESUBSCRIBE_LATENCY_SLOW  3000 /* milliseconds */
+
+struct sipe_resubscriptions {
+	GQueue *pending;     /* interned URIs, owns the references */
+	GHashTable *queued;  /* uri -> uri, entries in pending */
+	struct resubscribe_drain *drain; /* scheduled drain action */
+	guint batch_size;
+	guint in_flight;
+	guint sent;
+	guint latency;       /* smoothed, milliseconds */
+	/* on-demand presence subscriptions */
+	gboolean on_demand;
+	GSList *demand;      /* interned URIs, waiting to be subscribed */
+};
+
+/* SUBSCRIBE transaction payload */
+struct resubscribe_request {
+	struct sipe_resubscriptions *resub;
+	gint64 sent;         /* milliseconds */
+	gboolean answered;
+};
+
+/* scheduled drain action payload */
+struct resubscribe_drain {
+	struct sipe_resubscriptions *resub;
+};
+
 void sipe_subscriptions_init(struct sipe_core_private *sipe_private)
 {
+	struct sipe_resubscriptions *resub = g_new0(struct sipe_resubscriptions, 1);
+
 	sipe_private->subscriptions = g_hash_table_new_full(g_str_hash,
 							    g_str_equal,
 							    g_free,
 							    (GDestroyNotify)sipe_subscription_free);
+
+	resub->pending    = g_queue_new();
+	resub->queued     = g_hash_table_new(sipe_intern_hash, g_direct_equal);
+	resub->batch_size = SIPE_RESUBSCRIBE_BATCH_INITIAL;
+	sipe_private->resubscriptions = resub;
 }
 
-static void sipe_unsubscribe_cb(SIPE_UNUSED_PARAMETER gpointer key,
-				gpointer value, gpointer user_data)
+static void sipe_unsubscribe(struct sipe_core_private *sipe_private,
+			     struct sip_subscription *subscription)
 {
-	struct sip_subscription *subscription = value;
 	struct sip_dialog *dialog = &subscription->dialog;
-	struct sipe_core_private *sipe_private = user_data;
-	gchar *contact = get_contact(sipe_private);
+	const gchar *contact = get_contact(sipe_private);
 	gchar *hdr = g_strdup_printf(
 		"Event: %s\r\n"
 		"Expires: 0\r\n"
 		"Contact: %s\r\n", subscription->event, contact);
-	g_free(contact);
-
-	/* Rate limit to max. 25 requests per seconds */
-	g_usleep(1000000 / 25);
 
 	sip_transport_subscribe(sipe_private,
 				dialog->with,
@@ -93,6 +138,15 @@ static void sipe_unsubscribe_cb(SIPE_UNUSED_PARAMETER gpointer key,
 	g_free(hdr);
 }
 
+static void sipe_unsubscribe_cb(SIPE_UNUSED_PARAMETER gpointer key,
+				gpointer value, gpointer user_data)
+{
+	/* Rate limit to max. 25 requests per seconds */
+	g_usleep(1000000 / 25);
+
+	sipe_unsubscribe(user_data, value);
+}
+
 void sipe_subscriptions_unsubscribe(struct sipe_core_private *sipe_private)
 {
 	/* unsubscribe all */
@@ -104,7 +158,90 @@ void sipe_subscriptions_unsubscribe(struct sipe_core_private *sipe_private)
 
 void sipe_subscriptions_destroy(struct sipe_core_private *sipe_private)
 {
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+	const gchar *uri;
+
 	g_hash_table_destroy(sipe_private->subscriptions);
+
+	while ((uri = g_queue_pop_head(resub->pending)) != NULL)
+		sipe_intern_unref(uri);
+	g_queue_free(resub->pending);
+	g_hash_table_destroy(resub->queued);
+	sipe_utils_slist_free_full(resub->demand,
+				   (GDestroyNotify) sipe_intern_unref);
+	g_free(resub);
+	sipe_private->resubscriptions = NULL;
+}
+
+void sipe_subscriptions_resubscribe_stats(struct sipe_core_private *sipe_private,
+					  struct sipe_resubscribe_stats *stats)
+{
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+
+	stats->pending    = g_queue_get_length(resub->pending);
+	stats->in_flight  = resub->in_flight;
+	stats->batch_size = resub->batch_size;
+	stats->sent       = resub->sent;
+	stats->latency    = resub->latency;
+}
+
+void sipe_subscriptions_memory_usage(struct sipe_core_private *sipe_private,
+				     struct sipe_memory_usage *usage)
+{
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (resub) {
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sipe_resubscriptions));
+		sipe_metrics_memory_list(usage, g_queue_get_length(resub->pending));
+		sipe_metrics_memory_hash(usage, resub->queued);
+	}
+
+	if (!sipe_private->subscriptions)
+		return;
+
+	sipe_metrics_memory_hash(usage, sipe_private->subscriptions);
+	g_hash_table_iter_init(&iter, sipe_private->subscriptions);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const struct sip_subscription *subscription = value;
+		const struct sip_dialog *dialog = &subscription->dialog;
+		const GSList *entry;
+
+		sipe_metrics_memory_string(usage, key);
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct sip_subscription));
+		sipe_metrics_memory_string(usage, subscription->event);
+		sipe_metrics_memory_list(usage, g_slist_length(subscription->buddies));
+
+		sipe_metrics_memory_string(usage, dialog->with);
+		sipe_metrics_memory_string(usage, dialog->endpoint_GUID);
+		sipe_metrics_memory_string(usage, dialog->ourtag);
+		sipe_metrics_memory_string(usage, dialog->theirtag);
+		sipe_metrics_memory_string(usage, dialog->theirepid);
+		sipe_metrics_memory_string(usage, dialog->callid);
+		sipe_metrics_memory_string(usage, dialog->request);
+		for (entry = dialog->routes; entry; entry = entry->next)
+			sipe_metrics_memory_string(usage, entry->data);
+		for (entry = dialog->supported; entry; entry = entry->next)
+			sipe_metrics_memory_string(usage, entry->data);
+		sipe_metrics_memory_list(usage,
+					 g_slist_length(dialog->routes) +
+					 g_slist_length(dialog->supported));
+	}
+}
+
+/* on-demand mode: only renew presence subscriptions the user is using */
+static gboolean presence_wanted(struct sipe_core_private *sipe_private,
+				const gchar *uri)
+{
+	struct sipe_buddy *buddy;
+
+	if (!sipe_private->resubscriptions->on_demand)
+		return(TRUE);
+
+	/* not a buddy: subscription was requested explicitly */
+	buddy = sipe_buddy_find_by_uri(sipe_private, uri);
+	return(!buddy || buddy->presence_subscribed);
 }
 
 static void sipe_subscription_remove(struct sipe_core_private *sipe_private,
@@ -226,7 +363,7 @@ static void sipe_subscribe(struct sipe_core_private *sipe_private,
 			   const gchar *body,
 			   struct sip_dialog *dialog)
 {
-	gchar *contact = get_contact(sipe_private);
+	const gchar *contact = get_contact(sipe_private);
 	gchar *hdr = g_strdup_printf(
 		"Event: %s\r\n"
 		"Accept: %s\r\n"
@@ -240,7 +377,6 @@ static void sipe_subscribe(struct sipe_core_private *sipe_private,
 		accept,
 		addheaders ? addheaders : "",
 		contact);
-	g_free(contact);
 
 	sip_transport_subscribe(sipe_private,
 				uri,
@@ -334,6 +470,9 @@ static void sipe_subscribe_roaming_provisioning(struct sipe_core_private *sipe_p
 static void sipe_subscribe_roaming_provisioning_v2(struct sipe_core_private *sipe_private,
 						   SIPE_UNUSED_PARAMETER void *unused)
 {
+	/* don't wait for the NOTIFY */
+	sipe_notify_provisioning_cached(sipe_private);
+
 	sipe_subscribe_self(sipe_private,
 			    "vnd-microsoft-provisioning-v2",
 			    "application/vnd-microsoft-roaming-provisioning-v2+xml",
@@ -406,7 +545,10 @@ static void sipe_presence_timeout_mime_cb(gpointer user_data,
 		}
 
 		if (uri) {
-			*buddies = g_slist_append(*buddies, sip_uri(uri));
+			gchar *tmp = sip_uri(uri);
+			*buddies = g_slist_append(*buddies,
+						  (gpointer) sipe_intern_uri(tmp));
+			g_free(tmp);
 		}
 	}
 
@@ -446,10 +588,10 @@ static void sipe_process_presence_timeout(struct sipe_core_private *sipe_private
 	} else {
 		sipe_schedule_seconds(sipe_private,
 				      action_name,
-				      g_strdup(who),
+				      (gpointer) sipe_intern_uri(who),
 				      timeout,
 				      sipe_subscribe_presence_single_cb,
-				      g_free);
+				      (GDestroyNotify) sipe_intern_unref);
 		SIPE_DEBUG_INFO("Resubscription single contact with batched support(%s) in %d seconds", who, timeout);
 	}
 	g_free(action_name);
@@ -474,21 +616,22 @@ void sipe_subscribe_conference(struct sipe_core_private *sipe_private,
 /**
  * code for presence subscription
  */
-static void sipe_subscribe_presence_buddy(struct sipe_core_private *sipe_private,
-					  const gchar *uri,
-					  const gchar *request,
-					  const gchar *body)
+static struct transaction *sipe_subscribe_presence_buddy(struct sipe_core_private *sipe_private,
+							  const gchar *uri,
+							  const gchar *request,
+							  const gchar *body,
+							  TransCallback callback)
 {
 	gchar *key = sipe_utils_presence_key(uri);
-
-	sip_transport_subscribe(sipe_private,
-				uri,
-				request,
-				body,
-				sipe_subscribe_dialog(sipe_private, key),
-				process_subscribe_response);
+	struct transaction *trans = sip_transport_subscribe(sipe_private,
+							    uri,
+							    request,
+							    body,
+							    sipe_subscribe_dialog(sipe_private, key),
+							    callback);
 
 	g_free(key);
+	return(trans);
 }
 
 /**
@@ -502,12 +645,14 @@ static void sipe_subscribe_presence_buddy(struct sipe_core_private *sipe_private
  * The To-URI and the URI listed in the resource list MUST be the same for a single category SUBSCRIBE request.
  *
  */
-void sipe_subscribe_presence_single(struct sipe_core_private *sipe_private,
-				    const gchar *uri,
-				    const gchar *to)
+static struct transaction *sipe_subscribe_presence_single_send(struct sipe_core_private *sipe_private,
+								const gchar *uri,
+								const gchar *to,
+								TransCallback callback)
 {
+	struct transaction *trans;
 	gchar *self = NULL;
-	gchar *contact = get_contact(sipe_private);
+	const gchar *contact = get_contact(sipe_private);
 	gchar *request;
 	gchar *content = NULL;
 	const gchar *additional = "";
@@ -556,19 +701,166 @@ void sipe_subscribe_presence_single(struct sipe_core_private *sipe_private,
 				  additional,
 				  content_type,
 				  contact);
-	g_free(contact);
 
-	sipe_subscribe_presence_buddy(sipe_private, to, request, content);
+	trans = sipe_subscribe_presence_buddy(sipe_private, to, request, content,
+					      callback);
 
 	g_free(content);
 	g_free(self);
 	g_free(request);
+
+	return(trans);
+}
+
+void sipe_subscribe_presence_single(struct sipe_core_private *sipe_private,
+				    const gchar *uri,
+				    const gchar *to)
+{
+	if (!presence_wanted(sipe_private, uri))
+		return;
+
+	sipe_subscribe_presence_single_send(sipe_private, uri, to,
+					    process_subscribe_response);
+}
+
+static void sipe_resubscribe_request_free(gpointer data)
+{
+	struct resubscribe_request *request = data;
+	request->resub->in_flight--;
+	g_free(request);
+}
+
+static gboolean process_resubscribe_response(struct sipe_core_private *sipe_private,
+					     struct sipmsg *msg,
+					     struct transaction *trans)
+{
+	struct resubscribe_request *request = trans->payload->data;
+
+	if ((msg->response >= 200) && !request->answered) {
+		struct sipe_resubscriptions *resub = request->resub;
+		guint latency = sipe_utils_monotonic_msec() - request->sent;
+
+		request->answered = TRUE;
+		resub->latency = resub->latency ?
+			(3 * resub->latency + latency) / 4 :
+			latency;
+
+		if (latency < SIPE_RESUBSCRIBE_LATENCY_FAST) {
+			if (resub->batch_size < SIPE_RESUBSCRIBE_BATCH_MAX)
+				resub->batch_size++;
+		} else if (latency > SIPE_RESUBSCRIBE_LATENCY_SLOW) {
+			resub->batch_size = MAX(resub->batch_size / 2, 1);
+			SIPE_DEBUG_INFO("process_resubscribe_response: slow response (%u ms), batch size reduced to %u",
+					latency, resub->batch_size);
+		}
+	}
+
+	return(process_subscribe_response(sipe_private, msg, trans));
+}
+
+static void sipe_resubscribe_drain(struct sipe_core_private *sipe_private,
+				   gpointer data);
+
+static void sipe_resubscribe_drain_free(gpointer data)
+{
+	struct resubscribe_drain *drain = data;
+
+	/* only clear if not replaced by a newer drain action */
+	if (drain->resub->drain == drain)
+		drain->resub->drain = NULL;
+	g_free(drain);
+}
+
+static void sipe_resubscribe_schedule(struct sipe_core_private *sipe_private,
+				      struct sipe_resubscriptions *resub,
+				      guint timeout)
+{
+	if (!resub->drain && !g_queue_is_empty(resub->pending)) {
+		struct resubscribe_drain *drain = g_new0(struct resubscribe_drain, 1);
+		drain->resub = resub;
+		resub->drain = drain;
+		sipe_schedule_mseconds(sipe_private,
+				       SIPE_RESUBSCRIBE_ACTION,
+				       drain,
+				       timeout,
+				       sipe_resubscribe_drain,
+				       sipe_resubscribe_drain_free);
+	}
+}
+
+static void sipe_resubscribe_drain(struct sipe_core_private *sipe_private,
+				   SIPE_UNUSED_PARAMETER gpointer data)
+{
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+	guint sent = 0;
+
+	/* this drain action is being executed */
+	resub->drain = NULL;
+
+	while (resub->in_flight < resub->batch_size) {
+		const gchar *uri = g_queue_pop_head(resub->pending);
+		struct transaction *trans;
+
+		if (!uri)
+			break;
+		g_hash_table_remove(resub->queued, uri);
+
+		/* dropped while queued */
+		if (!presence_wanted(sipe_private, uri)) {
+			sipe_intern_unref(uri);
+			continue;
+		}
+
+		trans = sipe_subscribe_presence_single_send(sipe_private,
+							    uri,
+							    NULL,
+							    process_resubscribe_response);
+		if (trans) {
+			struct transaction_payload *payload = g_new0(struct transaction_payload, 1);
+			struct resubscribe_request *request = g_new0(struct resubscribe_request, 1);
+
+			request->resub   = resub;
+			request->sent    = sipe_utils_monotonic_msec();
+			payload->destroy = sipe_resubscribe_request_free;
+			payload->data    = request;
+			trans->payload   = payload;
+			resub->in_flight++;
+		}
+
+		sipe_intern_unref(uri);
+		sent++;
+	}
+
+	resub->sent += sent;
+	if (sent)
+		SIPE_DEBUG_INFO("sipe_resubscribe_drain: sent %u, pending %u, in flight %u, batch size %u",
+				sent, g_queue_get_length(resub->pending),
+				resub->in_flight, resub->batch_size);
+
+	sipe_resubscribe_schedule(sipe_private, resub, SIPE_RESUBSCRIBE_INTERVAL);
 }
 
 void sipe_subscribe_presence_single_cb(struct sipe_core_private *sipe_private,
 				       gpointer uri)
 {
-	sipe_subscribe_presence_single(sipe_private, uri, NULL);
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+	const gchar *interned;
+
+	if (!presence_wanted(sipe_private, uri))
+		return;
+
+	interned = sipe_intern_uri(uri);
+	if (g_hash_table_lookup(resub->queued, interned)) {
+		sipe_intern_unref(interned);
+	} else {
+		g_queue_push_tail(resub->pending, (gpointer) interned);
+		g_hash_table_insert(resub->queued,
+				    (gpointer) interned,
+				    (gpointer) interned);
+	}
+
+	/* as soon as possible, if the current batch has room */
+	sipe_resubscribe_schedule(sipe_private, resub, 0);
 }
 
 
@@ -579,46 +871,54 @@ void sipe_subscribe_presence_single_cb(struct sipe_core_private *sipe_private,
  *   A batch category SUBSCRIBE request MUST have the same To-URI and From-URI.
  *   This header will be send only if adhoclist there is a "Supported: adhoclist" in REGISTER answer else will be send a Single Category SUBSCRIBE
  */
-static void sipe_subscribe_presence_batched_to(struct sipe_core_private *sipe_private,
-					       gchar *resources_uri,
-					       const gchar *to)
+static struct transaction *sipe_subscribe_presence_batched_to(struct sipe_core_private *sipe_private,
+							      const gchar *resources_uri,
+							      gsize length,
+							      const gchar *to,
+							      TransCallback callback)
 {
-	gchar *contact = get_contact(sipe_private);
+	const gchar *contact = get_contact(sipe_private);
 	gchar *request;
-	gchar *content;
+	GString *content = g_string_sized_new(length + 512);
 	const gchar *require = "";
 	const gchar *accept = "";
 	const gchar *autoextend = "";
 	const gchar *content_type;
+	struct transaction *trans;
 
 	if (SIPE_CORE_PRIVATE_FLAG_IS(OCS2007)) {
 		require = ", categoryList";
 		accept = ", application/msrtc-event-categories+xml, application/xpidf+xml, application/pidf+xml";
-                content_type = "application/msrtc-adrl-categorylist+xml";
-                content = g_strdup_printf("<batchSub xmlns=\"http://schemas.microsoft.com/2006/01/sip/batch-subscribe\" uri=\"sip:%s\" name=\"\">\n"
-					  "<action name=\"subscribe\" id=\"63792024\">\n"
-					  "<adhocList>\n%s</adhocList>\n"
-					  "<categoryList xmlns=\"http://schemas.microsoft.com/2006/09/sip/categorylist\">\n"
-					  "<category name=\"calendarData\"/>\n"
-					  "<category name=\"contactCard\"/>\n"
-					  "<category name=\"note\"/>\n"
-					  "<category name=\"state\"/>\n"
-					  "</categoryList>\n"
-					  "</action>\n"
-					  "</batchSub>",
-					  sipe_private->username,
-					  resources_uri);
+		content_type = "application/msrtc-adrl-categorylist+xml";
+		g_string_append_printf(content,
+				       "<batchSub xmlns=\"http://schemas.microsoft.com/2006/01/sip/batch-subscribe\" uri=\"sip:%s\" name=\"\">\n"
+				       "<action name=\"subscribe\" id=\"63792024\">\n"
+				       "<adhocList>\n",
+				       sipe_private->username);
+		g_string_append_len(content, resources_uri, length);
+		g_string_append(content,
+				"</adhocList>\n"
+				"<categoryList xmlns=\"http://schemas.microsoft.com/2006/09/sip/categorylist\">\n"
+				"<category name=\"calendarData\"/>\n"
+				"<category name=\"contactCard\"/>\n"
+				"<category name=\"note\"/>\n"
+				"<category name=\"state\"/>\n"
+				"</categoryList>\n"
+				"</action>\n"
+				"</batchSub>");
 	} else {
-                autoextend =  "Supported: com.microsoft.autoextend\r\n";
+		autoextend = "Supported: com.microsoft.autoextend\r\n";
 		content_type = "application/adrl+xml";
-        	content = g_strdup_printf("<adhoclist xmlns=\"urn:ietf:params:xml:ns:adrl\" uri=\"sip:%s\" name=\"sip:%s\">\n"
-					  "<create xmlns=\"\">\n%s</create>\n"
-					  "</adhoclist>\n",
-					  sipe_private->username,
-					  sipe_private->username,
-					  resources_uri);
+		g_string_append_printf(content,
+				       "<adhoclist xmlns=\"urn:ietf:params:xml:ns:adrl\" uri=\"sip:%s\" name=\"sip:%s\">\n"
+				       "<create xmlns=\"\">\n",
+				       sipe_private->username,
+				       sipe_private->username);
+		g_string_append_len(content, resources_uri, length);
+		g_string_append(content,
+				"</create>\n"
+				"</adhoclist>\n");
 	}
-	g_free(resources_uri);
 
 	request = g_strdup_printf("Require: adhoclist%s\r\n"
 				  "Supported: eventlist\r\n"
@@ -634,12 +934,189 @@ static void sipe_subscribe_presence_batched_to(struct sipe_core_private *sipe_pr
 				  autoextend,
 				  content_type,
 				  contact);
-	g_free(contact);
 
-	sipe_subscribe_presence_buddy(sipe_private, to, request, content);
+	trans = sipe_subscribe_presence_buddy(sipe_private, to, request,
+					      content->str, callback);
 
-	g_free(content);
+	g_string_free(content, TRUE);
 	g_free(request);
+
+	return(trans);
+}
+
+/*
+ * Resource list for batched presence subscriptions
+ *
+ * All <resource> elements are collected in one string. It is sent in
+ * slices of at most SIPE_SUBSCRIBE_BATCH_SIZE resources. The next slice
+ * is sent when the server has answered the previous one, i.e. all
+ * further SUBSCRIBEs are sent inside the subscription dialog.
+ */
+#define SIPE_SUBSCRIBE_BATCH_SIZE 500
+
+struct presence_batch {
+	gchar *to;
+	GString *resources; /* <resource .../> elements */
+	GArray *ends;       /* end offset of each element in resources */
+	guint next;         /* first element of next slice */
+};
+
+static struct presence_batch *presence_batch_new(const gchar *to,
+						 guint count)
+{
+	struct presence_batch *batch = g_new0(struct presence_batch, 1);
+	batch->to        = g_strdup(to);
+	/* <resource uri="sip:..."/> */
+	batch->resources = g_string_sized_new(count * 64);
+	batch->ends      = g_array_sized_new(FALSE, FALSE, sizeof(gsize), count);
+	return(batch);
+}
+
+static void presence_batch_free(gpointer data)
+{
+	struct presence_batch *batch = data;
+
+	/* NULL if ownership was taken by process_subscribe_batch_response() */
+	if (!batch)
+		return;
+
+	g_array_free(batch->ends, TRUE);
+	g_string_free(batch->resources, TRUE);
+	g_free(batch->to);
+	g_free(batch);
+}
+
+static void presence_batch_add(struct presence_batch *batch,
+			       const gchar *uri,
+			       gboolean context)
+{
+	g_string_append(batch->resources, "<resource uri=\"");
+	g_string_append(batch->resources, uri);
+	g_string_append(batch->resources,
+			context ? "\"><context/></resource>\n" : "\"/>\n");
+	g_array_append_val(batch->ends, batch->resources->len);
+}
+
+static void presence_batch_send(struct sipe_core_private *sipe_private,
+				struct presence_batch *batch);
+
+static gboolean process_subscribe_batch_response(struct sipe_core_private *sipe_private,
+						 struct sipmsg *msg,
+						 struct transaction *trans)
+{
+	process_subscribe_response(sipe_private, msg, trans);
+
+	/* final response: send next slice */
+	if ((msg->response >= 200) && trans->payload && trans->payload->data) {
+		struct presence_batch *batch = trans->payload->data;
+		trans->payload->data = NULL; /* take ownership */
+		presence_batch_send(sipe_private, batch);
+	}
+
+	return(TRUE);
+}
+
+static void presence_batch_send(struct sipe_core_private *sipe_private,
+				struct presence_batch *batch)
+{
+	guint count = batch->ends->len;
+	guint last  = MIN(batch->next + SIPE_SUBSCRIBE_BATCH_SIZE, count);
+	gsize start = batch->next ? g_array_index(batch->ends, gsize, batch->next - 1) : 0;
+	gsize end   = last ? g_array_index(batch->ends, gsize, last - 1) : 0;
+	gboolean more = last < count;
+	struct transaction *trans;
+
+	SIPE_DEBUG_INFO("presence_batch_send: resources %u-%u of %u to %s",
+			batch->next, last, count, batch->to);
+	batch->next = last;
+
+	trans = sipe_subscribe_presence_batched_to(sipe_private,
+						   batch->resources->str + start,
+						   end - start,
+						   batch->to,
+						   more ?
+						   process_subscribe_batch_response :
+						   process_subscribe_response);
+
+	if (more && trans) {
+		struct transaction_payload *payload = g_new0(struct transaction_payload, 1);
+		payload->destroy = presence_batch_free;
+		payload->data    = batch;
+		trans->payload   = payload;
+	} else {
+		presence_batch_free(batch);
+	}
+}
+
+/*
+ * Batched subscriptions grouped by home server
+ *
+ * Buddies on another pool are redirected by our server with a
+ * "resubscribe" state and the pool FQDN [MS-PRES 3.4.5.1.3]. The pool is
+ * remembered per buddy (and in the roster snapshot), so that the next
+ * batch is sent directly to the pool without the extra round trip.
+ * Buddies with an unknown pool go to our own server as before.
+ */
+struct presence_pools {
+	struct presence_batch *self;
+	GHashTable *pools; /* pool FQDN (owned by batch) -> presence_batch */
+};
+
+static void presence_pools_init(struct sipe_core_private *sipe_private,
+				struct presence_pools *pools,
+				guint count)
+{
+	gchar *self = sip_uri_self(sipe_private);
+	pools->self  = presence_batch_new(self, count);
+	pools->pools = g_hash_table_new(g_str_hash, g_str_equal);
+	g_free(self);
+}
+
+static struct presence_batch *presence_pools_batch(struct presence_pools *pools,
+						   const struct sipe_buddy *buddy)
+{
+	struct presence_batch *batch;
+
+	if (!buddy || !buddy->pool)
+		return(pools->self);
+
+	batch = g_hash_table_lookup(pools->pools, buddy->pool);
+	if (!batch) {
+		batch = presence_batch_new(buddy->pool, 16);
+		g_hash_table_insert(pools->pools, batch->to, batch);
+	}
+	return(batch);
+}
+
+static void presence_pools_send_batch(struct sipe_core_private *sipe_private,
+				      struct presence_batch *batch)
+{
+	if (batch->ends->len)
+		presence_batch_send(sipe_private, batch);
+	else
+		presence_batch_free(batch);
+}
+
+static gboolean presence_pools_send_cb(SIPE_UNUSED_PARAMETER gpointer key,
+				       gpointer value,
+				       gpointer user_data)
+{
+	presence_pools_send_batch(user_data, value);
+	return(TRUE);
+}
+
+static void presence_pools_send(struct sipe_core_private *sipe_private,
+				struct presence_pools *pools)
+{
+	SIPE_DEBUG_INFO("presence_pools_send: %u buddies on own server, %u other pools",
+			pools->self->ends->len,
+			g_hash_table_size(pools->pools));
+
+	g_hash_table_foreach_steal(pools->pools,
+				   presence_pools_send_cb,
+				   sipe_private);
+	g_hash_table_destroy(pools->pools);
+	presence_pools_send_batch(sipe_private, pools->self);
 }
 
 struct presence_batched_routed {
@@ -659,16 +1136,18 @@ static void sipe_subscribe_presence_batched_routed(struct sipe_core_private *sip
 {
 	struct presence_batched_routed *data = payload;
 	const GSList *buddies = data->buddies;
-	gchar *resources_uri = g_strdup("");
+	struct presence_batch *batch = presence_batch_new(data->host,
+							  g_slist_length((GSList *) buddies));
 	while (buddies) {
-		gchar *tmp = resources_uri;
-		resources_uri = g_strdup_printf("%s<resource uri=\"%s\"/>\n", tmp, (char *) buddies->data);
-		g_free(tmp);
+		if (presence_wanted(sipe_private, buddies->data))
+			presence_batch_add(batch, buddies->data, FALSE);
 		buddies = buddies->next;
 	}
-	sipe_subscribe_presence_batched_to(sipe_private,
-					   resources_uri,
-					   data->host);
+
+	if (batch->ends->len)
+		presence_batch_send(sipe_private, batch);
+	else
+		presence_batch_free(batch);
 }
 
 static void sipe_subscribe_presence_batched_schedule(struct sipe_core_private *sipe_private,
@@ -683,15 +1162,21 @@ static void sipe_subscribe_presence_batched_schedule(struct sipe_core_private *s
 
 	if (subscription->buddies) {
 		/* merge old and new list */
-		GSList *entry = buddies;
-		while (entry) {
-			subscription->buddies = sipe_utils_slist_insert_unique_sorted(subscription->buddies,
-										      g_strdup(entry->data),
-										      (GCompareFunc) g_ascii_strcasecmp,
-										      g_free);
-			entry = entry->next;
-		}
-		sipe_utils_slist_free_full(buddies, g_free);
+		struct sipe_utils_set *set = sipe_utils_set_new(sipe_strcase_hash,
+								(GEqualFunc) sipe_strcase_equal,
+								(GDestroyNotify) sipe_intern_unref);
+		GSList *entry;
+
+		/* set takes the references */
+		for (entry = subscription->buddies; entry; entry = entry->next)
+			sipe_utils_set_add(set, entry->data);
+		for (entry = buddies; entry; entry = entry->next)
+			sipe_utils_set_add(set, entry->data);
+		g_slist_free(subscription->buddies);
+		g_slist_free(buddies);
+
+		subscription->buddies = sipe_utils_set_free_to_list(set,
+								    (GCompareFunc) g_ascii_strcasecmp);
 	} else {
 		/* no list yet, simply take ownership of whole list */
 		subscription->buddies = buddies;
@@ -710,38 +1195,46 @@ static void sipe_subscribe_presence_batched_schedule(struct sipe_core_private *s
 
 static void sipe_subscribe_resource_uri_with_context(const gchar *name,
 						     gpointer value,
-						     gchar **resources_uri)
+						     struct presence_pools *pools)
 {
 	struct sipe_buddy *sbuddy = (struct sipe_buddy *)value;
-	gchar *context = sbuddy && sbuddy->just_added ? "><context/></resource>" : "/>";
-	gchar *tmp = *resources_uri;
+
+	if (sbuddy && !sbuddy->presence_subscribed)
+		return;
+
+	presence_batch_add(presence_pools_batch(pools, sbuddy),
+			   name,
+			   sbuddy && sbuddy->just_added);
 
 	/* should be enough to include context one time */
 	if (sbuddy)
 		sbuddy->just_added = FALSE;
-
-	*resources_uri = g_strdup_printf("%s<resource uri=\"%s\"%s\n", tmp, name, context);
-	g_free(tmp);
 }
 
 static void sipe_subscribe_resource_uri(const char *name,
-					SIPE_UNUSED_PARAMETER gpointer value,
-					gchar **resources_uri)
+					gpointer value,
+					struct presence_pools *pools)
 {
-	gchar *tmp = *resources_uri;
-        *resources_uri = g_strdup_printf("%s<resource uri=\"%s\"/>\n", tmp, name);
-	g_free(tmp);
+	struct sipe_buddy *sbuddy = (struct sipe_buddy *)value;
+
+	if (sbuddy && !sbuddy->presence_subscribed)
+		return;
+
+	presence_batch_add(presence_pools_batch(pools, sbuddy), name, FALSE);
 }
 
 /**
   * A callback for g_hash_table_foreach
   */
-static void schedule_buddy_resubscription_cb(char *buddy_name,
-					     SIPE_UNUSED_PARAMETER struct sipe_buddy *buddy,
+static void schedule_buddy_resubscription_cb(const gchar *buddy_name,
+					     struct sipe_buddy *buddy,
 					     struct sipe_core_private *sipe_private)
 {
 	guint time_range = (sipe_buddy_count(sipe_private) * 1000) / 25; /* time interval for 25 requests per sec. In msec. */
 
+	if (!buddy->presence_subscribed)
+		return;
+
 	/*
 	 * g_hash_table_size() can never return 0, otherwise this function
 	 * wouldn't be called :-) But to keep Coverity happy...
@@ -752,14 +1245,232 @@ static void schedule_buddy_resubscription_cb(char *buddy_name,
 
 		sipe_schedule_mseconds(sipe_private,
 				       action_name,
-				       g_strdup(buddy_name),
+				       (gpointer) sipe_intern_ref(buddy_name),
 				       timeout,
 				       sipe_subscribe_presence_single_cb,
-				       g_free);
+				       (GDestroyNotify) sipe_intern_unref);
 		g_free(action_name);
 	}
 }
 
+/*
+ * On-demand presence subscriptions
+ *
+ * Most buddies of a large contact list are in collapsed groups and never
+ * looked at. Above SIPE_PRESENCE_ON_DEMAND_MIN buddies only those in
+ * visible groups or with an open conversation are subscribed at login.
+ * The others are subscribed when the backend hints that their presence
+ * is needed, e.g. because they are displayed, or when they show up in a
+ * conversation or in search results. Subscriptions that haven't been
+ * used for SIPE_PRESENCE_IDLE seconds are dropped again.
+ *
+ * The threshold can be changed with the environment variable
+ * SIPE_PRESENCE_ON_DEMAND (number of buddies, 0 disables on-demand mode).
+ */
+#define SIPE_PRESENCE_ON_DEMAND_MIN         1000 /* buddies */
+#define SIPE_PRESENCE_ENVIRONMENT_ON_DEMAND "SIPE_PRESENCE_ON_DEMAND"
+#define SIPE_PRESENCE_DEMAND_ACTION         "<+presence-demand>"
+#define SIPE_PRESENCE_DEMAND_DELAY          500           /* milliseconds */
+#define SIPE_PRESENCE_IDLE_ACTION           "<+presence-idle>"
+#define SIPE_PRESENCE_IDLE_CHECK            (30 * 60)     /* seconds */
+#define SIPE_PRESENCE_IDLE                  (4 * 60 * 60) /* seconds */
+
+static gboolean presence_on_demand(struct sipe_core_private *sipe_private)
+{
+	const gchar *threshold = g_getenv(SIPE_PRESENCE_ENVIRONMENT_ON_DEMAND);
+	guint64 value = SIPE_PRESENCE_ON_DEMAND_MIN;
+
+	if (threshold)
+		value = g_ascii_strtoull(threshold, NULL, 10);
+
+	return(value && (sipe_buddy_count(sipe_private) > value));
+}
+
+struct presence_visible {
+	struct sipe_core_private *sipe_private;
+	gboolean visible;
+};
+
+static void presence_group_visible_cb(gpointer data,
+				      gpointer user_data)
+{
+	const struct sipe_group *group = data;
+	struct presence_visible *context = user_data;
+	struct sipe_core_private *sipe_private = context->sipe_private;
+
+	if (!context->visible)
+		context->visible = sipe_backend_buddy_group_visible(SIPE_CORE_PUBLIC,
+								    group->name);
+}
+
+/* buddy is displayed or in a conversation */
+static gboolean presence_buddy_in_use(struct sipe_core_private *sipe_private,
+				      struct sipe_buddy *buddy)
+{
+	struct presence_visible context = { sipe_private, FALSE };
+
+	if (sipe_session_find_im(sipe_private, buddy->name))
+		return(TRUE);
+
+	sipe_buddy_foreach_group(sipe_private,
+				 buddy,
+				 presence_group_visible_cb,
+				 &context);
+	return(context.visible);
+}
+
+static void presence_eager_cb(SIPE_UNUSED_PARAMETER gpointer key,
+			      gpointer value,
+			      gpointer user_data)
+{
+	struct sipe_core_private *sipe_private = user_data;
+	struct sipe_buddy *buddy = value;
+
+	/* flag survives a reconnect, i.e. subscriptions stay the same */
+	if (!sipe_private->resubscriptions->on_demand)
+		buddy->presence_subscribed = TRUE;
+	else if (!buddy->presence_subscribed)
+		buddy->presence_subscribed = presence_buddy_in_use(sipe_private,
+								   buddy);
+
+	if (buddy->presence_subscribed && !buddy->presence_used)
+		buddy->presence_used = sipe_utils_monotonic_sec();
+}
+
+static void presence_demand_cb(struct sipe_core_private *sipe_private,
+			       SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+	GSList *demand = g_slist_reverse(resub->demand);
+	GSList *entry;
+
+	resub->demand = NULL;
+	SIPE_DEBUG_INFO("presence_demand_cb: subscribing to %u buddies",
+			g_slist_length(demand));
+
+	if (SIPE_CORE_PRIVATE_FLAG_IS(BATCHED_SUPPORT)) {
+		struct presence_pools pools;
+
+		presence_pools_init(sipe_private,
+				    &pools,
+				    g_slist_length(demand));
+		for (entry = demand; entry; entry = entry->next) {
+			struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
+									  entry->data);
+
+			/* buddy might have been removed in the meantime */
+			if (buddy) {
+				presence_batch_add(presence_pools_batch(&pools, buddy),
+						   buddy->name,
+						   SIPE_CORE_PRIVATE_FLAG_IS(OCS2007) &&
+						   buddy->just_added);
+				buddy->just_added = FALSE;
+			}
+		}
+		presence_pools_send(sipe_private, &pools);
+
+	} else {
+		for (entry = demand; entry; entry = entry->next)
+			sipe_subscribe_presence_single_cb(sipe_private,
+							  entry->data);
+	}
+
+	sipe_utils_slist_free_full(demand, (GDestroyNotify) sipe_intern_unref);
+}
+
+void sipe_subscribe_presence_demand(struct sipe_core_private *sipe_private,
+				    const gchar *uri)
+{
+	struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+	struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private, uri);
+
+	if (!buddy)
+		return;
+
+	buddy->presence_used = sipe_utils_monotonic_sec();
+	if (buddy->presence_subscribed)
+		return;
+	buddy->presence_subscribed = TRUE;
+
+	/* picked up by the initial subscription */
+	if (!SIPE_CORE_PRIVATE_FLAG_IS(SUBSCRIBED_BUDDIES))
+		return;
+
+	/* collect the buddies that become visible together, e.g. by scrolling */
+	if (!resub->demand)
+		sipe_schedule_mseconds(sipe_private,
+				       SIPE_PRESENCE_DEMAND_ACTION,
+				       NULL,
+				       SIPE_PRESENCE_DEMAND_DELAY,
+				       presence_demand_cb,
+				       NULL);
+	resub->demand = g_slist_prepend(resub->demand,
+					(gpointer) sipe_intern_ref(buddy->name));
+}
+
+static void presence_drop(struct sipe_core_private *sipe_private,
+			  const gchar *uri)
+{
+	gchar *key = sipe_utils_presence_key(uri);
+	struct sip_subscription *subscription = g_hash_table_lookup(sipe_private->subscriptions,
+								    key);
+
+	/* pending renewal, batched subscriptions simply expire */
+	sipe_schedule_cancel(sipe_private, key);
+
+	if (subscription) {
+		sipe_unsubscribe(sipe_private, subscription);
+		sipe_subscription_remove(sipe_private, key);
+	}
+	g_free(key);
+
+	/* same as a buddy that was never subscribed */
+	sipe_buddy_set_status(sipe_private, uri, SIPE_ACTIVITY_OFFLINE);
+}
+
+struct presence_idle {
+	struct sipe_core_private *sipe_private;
+	gint64 now;
+	guint dropped;
+};
+
+static void presence_idle_cb(SIPE_UNUSED_PARAMETER gpointer key,
+			     gpointer value,
+			     gpointer user_data)
+{
+	struct presence_idle *idle = user_data;
+	struct sipe_buddy *buddy = value;
+
+	if (!buddy->presence_subscribed)
+		return;
+
+	if (presence_buddy_in_use(idle->sipe_private, buddy)) {
+		buddy->presence_used = idle->now;
+	} else if ((idle->now - buddy->presence_used) >= SIPE_PRESENCE_IDLE) {
+		buddy->presence_subscribed = FALSE;
+		presence_drop(idle->sipe_private, buddy->name);
+		idle->dropped++;
+	}
+}
+
+static void presence_idle_check(struct sipe_core_private *sipe_private,
+				SIPE_UNUSED_PARAMETER gpointer unused)
+{
+	struct presence_idle idle = { sipe_private, sipe_utils_monotonic_sec(), 0 };
+
+	sipe_buddy_foreach(sipe_private, presence_idle_cb, &idle);
+	if (idle.dropped)
+		SIPE_DEBUG_INFO("presence_idle_check: dropped %u unused subscriptions",
+				idle.dropped);
+
+	sipe_schedule_seconds(sipe_private,
+			      SIPE_PRESENCE_IDLE_ACTION,
+			      NULL,
+			      SIPE_PRESENCE_IDLE_CHECK,
+			      presence_idle_check,
+			      NULL);
+}
+
 void sipe_subscribe_presence_initial(struct sipe_core_private *sipe_private)
 {
 	/*
@@ -767,21 +1478,45 @@ void sipe_subscribe_presence_initial(struct sipe_core_private *sipe_private)
 	 * We'll resubsribe to them based on the Expire field values.
 	 */
 	if (!SIPE_CORE_PRIVATE_FLAG_IS(SUBSCRIBED_BUDDIES)) {
+		struct sipe_resubscriptions *resub = sipe_private->resubscriptions;
+
+		/* this subscription includes all pending demands */
+		sipe_schedule_cancel(sipe_private, SIPE_PRESENCE_DEMAND_ACTION);
+		sipe_utils_slist_free_full(resub->demand,
+					   (GDestroyNotify) sipe_intern_unref);
+		resub->demand = NULL;
+
+		resub->on_demand = presence_on_demand(sipe_private);
+		sipe_buddy_foreach(sipe_private,
+				   presence_eager_cb,
+				   sipe_private);
+		if (resub->on_demand) {
+			SIPE_DEBUG_INFO("sipe_subscribe_presence_initial: on-demand mode for %u buddies",
+					sipe_buddy_count(sipe_private));
+			sipe_schedule_seconds(sipe_private,
+					      SIPE_PRESENCE_IDLE_ACTION,
+					      NULL,
+					      SIPE_PRESENCE_IDLE_CHECK,
+					      presence_idle_check,
+					      NULL);
+		}
 
 		if (SIPE_CORE_PRIVATE_FLAG_IS(BATCHED_SUPPORT)) {
-			gchar *to = sip_uri_self(sipe_private);
-			gchar *resources_uri = g_strdup("");
+			struct presence_pools pools;
+
+			presence_pools_init(sipe_private,
+					    &pools,
+					    sipe_buddy_count(sipe_private));
 			if (SIPE_CORE_PRIVATE_FLAG_IS(OCS2007)) {
 				sipe_buddy_foreach(sipe_private,
 						   (GHFunc) sipe_subscribe_resource_uri_with_context,
-						   &resources_uri);
+						   &pools);
 			} else {
 				sipe_buddy_foreach(sipe_private,
 						   (GHFunc) sipe_subscribe_resource_uri,
-						   &resources_uri);
+						   &pools);
 			}
-			sipe_subscribe_presence_batched_to(sipe_private, resources_uri, to);
-			g_free(to);
+			presence_pools_send(sipe_private, &pools);
 
 		} else {
 			sipe_buddy_foreach(sipe_private,
@@ -856,6 +1591,21 @@ static const struct event_subscription_data events_table[] =
 	{ NULL, NULL, 0 }
 };
 
+/*
+ * Spread presence renewals over the last quarter of the refresh window,
+ * so that subscriptions created together don't come due together.
+ */
+#define SIPE_RESUBSCRIBE_JITTER_MAX 300 /* seconds */
+
+static guint sipe_subscription_jitter(guint timeout)
+{
+	guint window = MIN(timeout / 4, SIPE_RESUBSCRIBE_JITTER_MAX);
+
+	if (window)
+		timeout -= ((guint) rand()) % (window + 1);
+	return(timeout);
+}
+
 static void sipe_subscription_expiration(struct sipe_core_private *sipe_private,
 					 struct sipmsg *msg,
 					 const gchar *event)
@@ -870,16 +1620,18 @@ static void sipe_subscription_expiration(struct sipe_core_private *sipe_private,
 		if (sipe_strcase_equal(event, "presence")) {
 			gchar *who = parse_from(sipmsg_find_header(msg, "To"));
 
+			timeout = sipe_subscription_jitter(timeout);
+
 			if (SIPE_CORE_PRIVATE_FLAG_IS(BATCHED_SUPPORT)) {
 				sipe_process_presence_timeout(sipe_private, msg, who, timeout);
 			} else {
 				gchar *action_name = sipe_utils_presence_key(who);
 				sipe_schedule_seconds(sipe_private,
 						      action_name,
-						      g_strdup(who),
+						      (gpointer) sipe_intern_uri(who),
 						      timeout,
 						      sipe_subscribe_presence_single_cb,
-						      g_free);
+						      (GDestroyNotify) sipe_intern_unref);
 				g_free(action_name);
 				SIPE_DEBUG_INFO("Resubscription single contact '%s' in %d seconds", who, timeout);
 			}
@@ -924,6 +1676,21 @@ void sipe_subscription_self_events(struct sipe_core_private *sipe_private)
 			(*esd->callback)(sipe_private, NULL);
 }
 
+/*
+ * Refresh after connection resume
+ */
+void sipe_subscriptions_resume(struct sipe_core_private *sipe_private)
+{
+	/* existing dialogs turn these into in-dialog refreshes */
+	sipe_subscription_self_events(sipe_private);
+
+	/* buddies are only subscribed after the contact list arrived */
+	if (SIPE_CORE_PRIVATE_FLAG_IS(SUBSCRIBED_BUDDIES)) {
+		SIPE_CORE_PRIVATE_FLAG_UNSET(SUBSCRIBED_BUDDIES);
+		sipe_subscribe_presence_initial(sipe_private);
+	}
+}
+
 /*
   Local Variables:
   mode: c
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -23,6 +23,7 @@
 /* Forward declarations */
 struct sipe_core_private;
 struct sip_dialog;
+struct sipe_memory_usage;
 
 /**
  * Subscriptions subsystem
@@ -31,6 +32,35 @@ void sipe_subscriptions_init(struct sipe_core_private *sipe_private);
 void sipe_subscriptions_unsubscribe(struct sipe_core_private *sipe_private);
 void sipe_subscriptions_destroy(struct sipe_core_private *sipe_private);
 
+/**
+ * Presence resubscription queue statistics
+ */
+struct sipe_resubscribe_stats {
+	guint pending;    /* renewals waiting to be sent           */
+	guint in_flight;  /* SUBSCRIBEs waiting for a response     */
+	guint batch_size; /* current adaptive batch size           */
+	guint sent;       /* renewals sent since login             */
+	guint latency;    /* smoothed response latency [ms]        */
+};
+
+/**
+ * Fill in presence resubscription queue statistics
+ *
+ * @param sipe_private SIPE core private data
+ * @param stats        statistics to fill in
+ */
+void sipe_subscriptions_resubscribe_stats(struct sipe_core_private *sipe_private,
+					  struct sipe_resubscribe_stats *stats);
+
+/**
+ * Estimate memory used by subscriptions
+ *
+ * @param sipe_private SIPE core private data
+ * @param usage        accumulated memory usage
+ */
+void sipe_subscriptions_memory_usage(struct sipe_core_private *sipe_private,
+				     struct sipe_memory_usage *usage);
+
 /**
  * Subscriptions
  */
@@ -44,6 +74,18 @@ void sipe_subscribe_presence_single(struct sipe_core_private *sipe_private,
 void sipe_subscribe_presence_single_cb(struct sipe_core_private *sipe_private,
 				       gpointer uri);
 void sipe_subscribe_presence_initial(struct sipe_core_private *sipe_private);
+
+/**
+ * The presence of a buddy is needed, e.g. it is displayed
+ *
+ * In on-demand mode this subscribes to the buddy if necessary and keeps
+ * the subscription from being dropped as unused.
+ *
+ * @param sipe_private SIPE core private data
+ * @param uri          buddy URI
+ */
+void sipe_subscribe_presence_demand(struct sipe_core_private *sipe_private,
+				    const gchar *uri);
 void sipe_subscribe_poolfqdn_resource_uri(const gchar *host,
 					  GSList *server,
 					  struct sipe_core_private *sipe_private);
@@ -54,3 +96,10 @@ void sipe_subscribe_poolfqdn_resource_uri(const gchar *host,
  * @param sipe_private SIPE core private data
  */
 void sipe_subscription_self_events(struct sipe_core_private *sipe_private);
+
+/**
+ * Refresh all subscriptions after the SIP connection was replaced
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_subscriptions_resume(struct sipe_core_private *sipe_private);
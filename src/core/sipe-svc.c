@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -39,12 +39,17 @@
 #include "sipe-core.h"
 #include "sipe-core-private.h"
 #include "sipe-http.h"
+#include "sipe-job.h"
+#include "sipe-soap.h"
 #include "sipe-svc.h"
 #include "sipe-tls.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 #include "uuid.h"
 
+/* failed requests are not repeated for this long */
+#define SVC_FAILURE_CACHE_MSEC 10000
+
 /* forward declaration */
 struct svc_request;
 typedef void (svc_callback)(struct sipe_core_private *sipe_private,
@@ -52,16 +57,26 @@ typedef void (svc_callback)(struct sipe_core_private *sipe_private,
 			    const gchar *raw,
 			    sipe_xml *xml);
 
+struct svc_waiter {
+	sipe_svc_callback *cb;
+	gpointer cb_data;
+};
+
 struct svc_request {
 	svc_callback *internal_cb;
 	sipe_svc_callback *cb;
 	gpointer *cb_data;
 	struct sipe_http_request *request;
+	struct sipe_job *job; /* parsing large response */
 	gchar *uri;
+	gchar *key;       /* URI + body */
+	GSList *waiters;  /* identical requests sharing this one */
 };
 
 struct sipe_svc {
 	GSList *pending_requests;
+	GHashTable *inflight;  /* key: request key, value: svc_request */
+	GHashTable *failures;  /* key: request key, value: gint64 expiry */
 	gboolean shutting_down;
 };
 
@@ -72,11 +87,22 @@ struct sipe_svc_session {
 static void sipe_svc_request_free(struct sipe_core_private *sipe_private,
 				  struct svc_request *data)
 {
+	GSList *entry;
+
 	if (data->request)
 		sipe_http_request_cancel(data->request);
+	sipe_job_cancel(data->job);
 	if (data->cb)
 		/* Callback: aborted */
 		(*data->cb)(sipe_private, NULL, NULL, NULL, data->cb_data);
+	for (entry = data->waiters; entry; entry = entry->next) {
+		struct svc_waiter *waiter = entry->data;
+		/* Callback: aborted */
+		(*waiter->cb)(sipe_private, NULL, NULL, NULL, waiter->cb_data);
+		g_free(waiter);
+	}
+	g_slist_free(data->waiters);
+	g_free(data->key);
 	g_free(data->uri);
 	g_free(data);
 }
@@ -98,6 +124,8 @@ void sipe_svc_free(struct sipe_core_private *sipe_private)
 		}
 		g_slist_free(svc->pending_requests);
 	}
+	g_hash_table_destroy(svc->inflight);
+	g_hash_table_destroy(svc->failures);
 
 	g_free(svc);
 	sipe_private->svc = NULL;
@@ -105,10 +133,40 @@ void sipe_svc_free(struct sipe_core_private *sipe_private)
 
 static void sipe_svc_init(struct sipe_core_private *sipe_private)
 {
+	struct sipe_svc *svc;
+
 	if (sipe_private->svc)
 		return;
 
-	sipe_private->svc = g_new0(struct sipe_svc, 1);
+	sipe_private->svc = svc = g_new0(struct sipe_svc, 1);
+	svc->inflight = g_hash_table_new(g_str_hash, g_str_equal);
+	svc->failures = g_hash_table_new_full(g_str_hash,
+					      g_str_equal,
+					      g_free,
+					      g_free);
+}
+
+static gboolean svc_failure_expired(SIPE_UNUSED_PARAMETER gpointer key,
+				    gpointer value,
+				    gpointer user_data)
+{
+	return(*(gint64 *) value <= *(gint64 *) user_data);
+}
+
+static gboolean svc_recently_failed(struct sipe_svc *svc,
+				    const gchar *key)
+{
+	gint64 now = sipe_utils_monotonic_msec();
+	g_hash_table_foreach_remove(svc->failures, svc_failure_expired, &now);
+	return(g_hash_table_lookup(svc->failures, key) != NULL);
+}
+
+static void svc_failed(struct sipe_svc *svc,
+		       const gchar *key)
+{
+	gint64 *expires = g_new(gint64, 1);
+	*expires = sipe_utils_monotonic_msec() + SVC_FAILURE_CACHE_MSEC;
+	g_hash_table_replace(svc->failures, g_strdup(key), expires);
 }
 
 struct sipe_svc_session *sipe_svc_session_start(void)
@@ -126,6 +184,37 @@ void sipe_svc_session_close(struct sipe_svc_session *session)
 	}
 }
 
+static void sipe_svc_response_parsed(struct sipe_core_private *sipe_private,
+				     const gchar *body,
+				     sipe_xml *xml,
+				     gpointer callback_data)
+{
+	struct svc_request *data = callback_data;
+	struct sipe_svc *svc = sipe_private->svc;
+	GSList *entry;
+
+	data->job = NULL;
+
+	/* Internal callback: success (xml != NULL) or failed */
+	(*data->internal_cb)(sipe_private, data, xml ? body : NULL, xml);
+	for (entry = data->waiters; entry; entry = entry->next) {
+		struct svc_waiter *waiter = entry->data;
+		data->cb      = waiter->cb;
+		data->cb_data = waiter->cb_data;
+		(*data->internal_cb)(sipe_private, data, xml ? body : NULL, xml);
+		g_free(waiter);
+	}
+	g_slist_free(data->waiters);
+	data->waiters = NULL;
+
+	/* Internal callback has already called this */
+	data->cb = NULL;
+
+	svc->pending_requests = g_slist_remove(svc->pending_requests,
+					       data);
+	sipe_svc_request_free(sipe_private, data);
+}
+
 static void sipe_svc_https_response(struct sipe_core_private *sipe_private,
 				    guint status,
 				    SIPE_UNUSED_PARAMETER GSList *headers,
@@ -134,26 +223,29 @@ static void sipe_svc_https_response(struct sipe_core_private *sipe_private,
 {
 	struct svc_request *data = callback_data;
 	struct sipe_svc *svc = sipe_private->svc;
+	sipe_xml *xml = NULL;
 
 	SIPE_DEBUG_INFO("sipe_svc_https_response: code %d", status);
 	data->request = NULL;
 
-	if ((status == SIPE_HTTP_STATUS_OK) && body) {
-		sipe_xml *xml = sipe_xml_parse(body, strlen(body));
-		/* Internal callback: success */
-		(*data->internal_cb)(sipe_private, data, body, xml);
-		sipe_xml_free(xml);
-	} else {
-		/* Internal callback: failed */
-		(*data->internal_cb)(sipe_private, data, NULL, NULL);
-	}
+	/* new identical requests must not join this one any longer */
+	g_hash_table_remove(svc->inflight, data->key);
 
-	/* Internal callback has already called this */
-	data->cb = NULL;
+	if ((status == SIPE_HTTP_STATUS_OK) && body) {
+		/* don't block the main loop with large responses */
+		if (strlen(body) >= SIPE_JOB_XML_MIN_LENGTH) {
+			data->job = sipe_job_xml_parse(sipe_private,
+						       body,
+						       sipe_svc_response_parsed,
+						       data);
+			return;
+		}
+		xml = sipe_xml_parse(body, strlen(body));
+	} else if (status != (guint) SIPE_HTTP_STATUS_ABORTED)
+		svc_failed(svc, data->key);
 
-	svc->pending_requests = g_slist_remove(svc->pending_requests,
-					       data);
-	sipe_svc_request_free(sipe_private, data);
+	sipe_svc_response_parsed(sipe_private, body, xml, data);
+	sipe_xml_free(xml);
 }
 
 /**
@@ -161,25 +253,52 @@ static void sipe_svc_https_response(struct sipe_core_private *sipe_private,
  *
  * @param content_type MIME type for body content (ignored when body is @c NULL)
  * @param soap_action  SOAP action header value   (ignored when body is @c NULL)
- * @param body         body contents              (may be @c NULL)
+ * @param body         body contents, will be freed (may be @c NULL)
  */
 static gboolean sipe_svc_https_request(struct sipe_core_private *sipe_private,
 				       struct sipe_svc_session *session,
 				       const gchar *uri,
 				       const gchar *content_type,
 				       const gchar *soap_action,
-				       const gchar *body,
+				       GString *body,
 				       svc_callback *internal_callback,
 				       sipe_svc_callback *callback,
 				       gpointer callback_data)
 {
-	struct svc_request *data = g_new0(struct svc_request, 1);
+	struct svc_request *data;
 	struct sipe_http_request *request = NULL;
 	struct sipe_svc *svc;
+	gchar *key;
 
 	sipe_svc_init(sipe_private);
 	svc = sipe_private->svc;
 
+	/* identical requests share one network operation */
+	key  = g_strconcat(uri, "\n", body ? body->str : "", NULL);
+	data = g_hash_table_lookup(svc->inflight, key);
+	if (data && (data->internal_cb == internal_callback)) {
+		struct svc_waiter *waiter = g_new0(struct svc_waiter, 1);
+
+		SIPE_DEBUG_INFO("sipe_svc_https_request: joining pending request for %s",
+				uri);
+		waiter->cb      = callback;
+		waiter->cb_data = callback_data;
+		data->waiters   = g_slist_append(data->waiters, waiter);
+		g_free(key);
+		if (body)
+			g_string_free(body, TRUE);
+		return(TRUE);
+	}
+	if (svc_recently_failed(svc, key)) {
+		SIPE_DEBUG_INFO("sipe_svc_https_request: request for %s failed recently - not retrying yet",
+				uri);
+		g_free(key);
+		if (body)
+			g_string_free(body, TRUE);
+		return(FALSE);
+	}
+	data = g_new0(struct svc_request, 1);
+
 	if (svc->shutting_down) {
 		SIPE_DEBUG_ERROR("sipe_svc_https_request: new Web Service request during shutdown: THIS SHOULD NOT HAPPEN! Debugging information:\n"
 				 "URI:    %s\n"
@@ -187,19 +306,21 @@ static gboolean sipe_svc_https_request(struct sipe_core_private *sipe_private,
 				 "Body:   %s\n",
 				 uri,
 				 soap_action ? soap_action : "<NONE>",
-				 body ? body : "<EMPTY>");
+				 body ? body->str : "<EMPTY>");
+		if (body)
+			g_string_free(body, TRUE);
 	} else {
 		if (body) {
 			gchar *headers = g_strdup_printf("SOAPAction: \"%s\"\r\n",
 							 soap_action);
 
-			request = sipe_http_request_post(sipe_private,
-							 uri,
-							 headers,
-							 body,
-							 content_type,
-							 sipe_svc_https_response,
-							 data);
+			request = sipe_http_request_post_buffer(sipe_private,
+								uri,
+								headers,
+								body,
+								content_type,
+								sipe_svc_https_response,
+								data);
 			g_free(headers);
 
 		} else {
@@ -217,9 +338,11 @@ static gboolean sipe_svc_https_request(struct sipe_core_private *sipe_private,
 		data->cb_data     = callback_data;
 		data->request     = request;
 		data->uri         = g_strdup(uri);
+		data->key         = key;
 
 		svc->pending_requests = g_slist_prepend(svc->pending_requests,
 							data);
+		g_hash_table_insert(svc->inflight, key, data);
 
 		sipe_http_request_session(request, session->session);
 		sipe_http_request_ready(request);
@@ -227,6 +350,7 @@ static gboolean sipe_svc_https_request(struct sipe_core_private *sipe_private,
 	} else {
 		SIPE_DEBUG_ERROR("failed to create HTTP connection to %s", uri);
 		g_free(data);
+		g_free(key);
 	}
 
 	return(request != NULL);
@@ -244,48 +368,55 @@ static gboolean sipe_svc_wsdl_request(struct sipe_core_private *sipe_private,
 				      sipe_svc_callback *callback,
 				      gpointer callback_data)
 {
+	GString *body = sipe_soap_new("<?xml version=\"1.0\"?>\r\n"
+				      "<soap:Envelope ");
+
+	g_string_append(body, additional_ns);
+	g_string_append(body,
+			" xmlns:auth=\"http://schemas.xmlsoap.org/ws/2006/12/authorization\""
+			" xmlns:wsa=\"http://www.w3.org/2005/08/addressing\""
+			" xmlns:wsp=\"http://schemas.xmlsoap.org/ws/2004/09/policy\""
+			" xmlns:wsse=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-secext-1.0.xsd\""
+			" xmlns:wsu=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-utility-1.0.xsd\""
+			" >");
+
 	/* Only generate SOAP header if we have a security token */
-	gchar *soap_header = wsse_security ?
-		g_strdup_printf("<soap:Header>"
-				" <wsa:To>%s</wsa:To>"
+	if (wsse_security) {
+		g_string_append(body,
+				"<soap:Header>"
+				" <wsa:To>");
+		sipe_soap_append_escaped(body, uri);
+		g_string_append(body,
+				"</wsa:To>"
 				" <wsa:ReplyTo>"
 				"  <wsa:Address>http://www.w3.org/2005/08/addressing/anonymous</wsa:Address>"
 				" </wsa:ReplyTo>"
-				" <wsa:Action>%s</wsa:Action>"
-				" <wsse:Security>%s</wsse:Security>"
-				"</soap:Header>",
-				uri,
-				soap_action,
-				wsse_security) :
-		g_strdup("");
-	gchar *body = g_strdup_printf("<?xml version=\"1.0\"?>\r\n"
-				      "<soap:Envelope %s"
-				      " xmlns:auth=\"http://schemas.xmlsoap.org/ws/2006/12/authorization\""
-				      " xmlns:wsa=\"http://www.w3.org/2005/08/addressing\""
-				      " xmlns:wsp=\"http://schemas.xmlsoap.org/ws/2004/09/policy\""
-				      " xmlns:wsse=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-secext-1.0.xsd\""
-				      " xmlns:wsu=\"http://docs.oasis-open.org/wss/2004/01/oasis-200401-wss-wssecurity-utility-1.0.xsd\""
-				      " >"
-				      "%s"
-				      " <soap:Body>%s</soap:Body>"
-				      "</soap:Envelope>",
-				      additional_ns,
-				      soap_header,
-				      soap_body);
-
-	gboolean ret = sipe_svc_https_request(sipe_private,
-					      session,
-					      uri,
-					      content_type ? content_type : "text/xml",
-					      soap_action,
-					      body,
-					      internal_callback,
-					      callback,
-					      callback_data);
-	g_free(soap_header);
-	g_free(body);
+				" <wsa:Action>");
+		sipe_soap_append_escaped(body, soap_action);
+		g_string_append(body,
+				"</wsa:Action>"
+				" <wsse:Security>");
+		g_string_append(body, wsse_security);
+		g_string_append(body,
+				"</wsse:Security>"
+				"</soap:Header>");
+	}
 
-	return(ret);
+	g_string_append(body, " <soap:Body>");
+	g_string_append(body, soap_body);
+	g_string_append(body,
+			"</soap:Body>"
+			"</soap:Envelope>");
+
+	return(sipe_svc_https_request(sipe_private,
+				      session,
+				      uri,
+				      content_type ? content_type : "text/xml",
+				      soap_action,
+				      body,
+				      internal_callback,
+				      callback,
+				      callback_data));
 }
 
 static gboolean new_soap_req(struct sipe_core_private *sipe_private,
@@ -338,7 +469,7 @@ gboolean sipe_svc_get_and_publish_cert(struct sipe_core_private *sipe_private,
 	struct sipe_tls_random id;
 	gchar *id_base64;
 	gchar *id_uuid;
-	gchar *uuid = get_uuid(sipe_private);
+	const gchar *uuid = get_uuid(sipe_private);
 	gchar *soap_body;
 	gboolean ret;
 
@@ -371,7 +502,6 @@ gboolean sipe_svc_get_and_publish_cert(struct sipe_core_private *sipe_private,
 				    certreq,
 				    id_uuid);
 	g_free(id_uuid);
-	g_free(uuid);
 
 	ret = new_soap_req(sipe_private,
 			   session,
@@ -387,6 +517,27 @@ gboolean sipe_svc_get_and_publish_cert(struct sipe_core_private *sipe_private,
 	return(ret);
 }
 
+static gchar *ab_entry_soap_body(const gchar *search,
+				 guint max_returns)
+{
+	return(g_strdup_printf("<SearchAbEntry"
+			       " xmlns=\"DistributionListExpander\""
+			       " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
+			       " xmlns:soapenc=\"http://schemas.xmlsoap.org/soap/encoding/\""
+			       ">"
+			       " <AbEntryRequest>"
+			       "  %s"
+			       "  <Metadata>"
+			       "   <FromDialPad>false</FromDialPad>"
+			       "   <MaxResultNum>%d</MaxResultNum>"
+			       "   <ReturnList>displayName,msRTCSIP-PrimaryUserAddress,title,telephoneNumber,homePhone,mobile,otherTelephone,mail,company,country,photoRelPath,photoSize,photoHash</ReturnList>"
+			       "  </Metadata>"
+			       " </AbEntryRequest>"
+			       "</SearchAbEntry>",
+			       search,
+			       max_returns));
+}
+
 gboolean sipe_svc_ab_entry_request(struct sipe_core_private *sipe_private,
 				   struct sipe_svc_session *session,
 				   const gchar *uri,
@@ -397,22 +548,7 @@ gboolean sipe_svc_ab_entry_request(struct sipe_core_private *sipe_private,
 				   gpointer callback_data)
 {
 	gboolean ret;
-	gchar *soap_body = g_strdup_printf("<SearchAbEntry"
-					   " xmlns=\"DistributionListExpander\""
-					   " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
-					   " xmlns:soapenc=\"http://schemas.xmlsoap.org/soap/encoding/\""
-					   ">"
-					   " <AbEntryRequest>"
-					   "  %s"
-					   "  <Metadata>"
-					   "   <FromDialPad>false</FromDialPad>"
-					   "   <MaxResultNum>%d</MaxResultNum>"
-					   "   <ReturnList>displayName,msRTCSIP-PrimaryUserAddress,title,telephoneNumber,homePhone,mobile,otherTelephone,mail,company,country,photoRelPath,photoSize,photoHash</ReturnList>"
-					   "  </Metadata>"
-					   " </AbEntryRequest>"
-					   "</SearchAbEntry>",
-					   search,
-					   max_returns);
+	gchar *soap_body = ab_entry_soap_body(search, max_returns);
 
 	ret = new_soap_req(sipe_private,
 			   session,
@@ -428,6 +564,48 @@ gboolean sipe_svc_ab_entry_request(struct sipe_core_private *sipe_private,
 	return(ret);
 }
 
+guint sipe_svc_ab_entry_request_multi(struct sipe_core_private *sipe_private,
+				      struct sipe_svc_session *session,
+				      const gchar *uri,
+				      const gchar *wsse_security,
+				      const gchar * const *searches,
+				      guint count,
+				      guint max_returns,
+				      sipe_svc_callback *callback,
+				      gpointer *callback_data)
+{
+	GSList *failed = NULL;
+	GSList *entry;
+	guint triggered = 0;
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		if (sipe_svc_ab_entry_request(sipe_private,
+					      session,
+					      uri,
+					      wsse_security,
+					      searches[i],
+					      max_returns,
+					      callback,
+					      callback_data[i]))
+			triggered++;
+		else
+			failed = g_slist_prepend(failed, callback_data[i]);
+	}
+
+	SIPE_DEBUG_INFO("sipe_svc_ab_entry_request_multi: %u of %u searches triggered for %s",
+			triggered, count, uri);
+
+	/* fail the rest only after all searches have been queued */
+	failed = g_slist_reverse(failed);
+	for (entry = failed; entry; entry = entry->next)
+		/* Callback: failed */
+		(*callback)(sipe_private, uri, NULL, NULL, entry->data);
+	g_slist_free(failed);
+
+	return(triggered);
+}
+
 /* Requests to login.microsoftonline.com & ADFS */
 static gboolean request_passport(struct sipe_core_private *sipe_private,
 				 struct sipe_svc_session *session,
@@ -561,7 +739,7 @@ gboolean sipe_svc_webticket(struct sipe_core_private *sipe_private,
 			    sipe_svc_callback *callback,
 			    gpointer callback_data)
 {
-	gchar *uuid = get_uuid(sipe_private);
+	const gchar *uuid = get_uuid(sipe_private);
 	gchar *secret = g_base64_encode(entropy->buffer, entropy->length);
 	gchar *soap_body = g_strdup_printf("<wst:RequestSecurityToken Context=\"%s\">"
 					   " <wst:TokenType>http://docs.oasis-open.org/wss/oasis-wss-saml-token-profile-1.1#SAMLV1.1</wst:TokenType>"
@@ -597,7 +775,6 @@ gboolean sipe_svc_webticket(struct sipe_core_private *sipe_private,
 				    callback_data);
 	g_free(soap_body);
 	g_free(secret);
-	g_free(uuid);
 
 	return(ret);
 }
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -104,6 +104,36 @@ gboolean sipe_svc_ab_entry_request(struct sipe_core_private *sipe_private,
 				   sipe_svc_callback *callback,
 				   gpointer callback_data);
 
+/**
+ * Trigger several [MS-DLX] address book entry searches
+ *
+ * [MS-DLX] combines all conditions of one search with AND, i.e. every
+ * search needs its own SearchAbEntry request. The requests share the
+ * session and the authentication token. @c callback is called once for
+ * every search with its entry from @c callback_data. Searches that can't
+ * be triggered fail after all others have been queued.
+ *
+ * @param sipe_private  SIPE core private data
+ * @param session       opaque session pointer
+ * @param uri           service URI
+ * @param wsse_security predefined authentication token
+ * @param searches      array of searches, see @c sipe_svc_ab_entry_request()
+ * @param count         number of searches
+ * @param max_returns   how many entries to return per search
+ * @param callback      callback function
+ * @param callback_data array of callback data, one per search
+ * @return              number of searches that were triggered
+ */
+guint sipe_svc_ab_entry_request_multi(struct sipe_core_private *sipe_private,
+				      struct sipe_svc_session *session,
+				      const gchar *uri,
+				      const gchar *wsse_security,
+				      const gchar * const *searches,
+				      guint count,
+				      guint max_returns,
+				      sipe_svc_callback *callback,
+				      gpointer *callback_data);
+
 /**
  * Trigger fetch of WebTicket security token
  *
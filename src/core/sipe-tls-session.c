@@ -0,0 +1,196 @@
+/**
+ * @file sipe-tls-session.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-metrics.h"
+#include "sipe-tls-session.h"
+#include "sipe-utils.h"
+
+/* Lync Server keeps sessions for 10 hours (SChannel ServerCacheTime) */
+#define SIPE_TLS_SESSION_TIMEOUT (10 * 60 * 60 * 1000) /* milliseconds */
+
+struct sipe_tls_session_cache {
+	struct sipe_core_private *sipe_private;
+	GHashTable *sessions; /* key: "host:port", value: tls_session */
+	guint64 handshakes;
+	guint64 resumed;
+};
+
+struct tls_session {
+	gpointer data;
+	GDestroyNotify destroy;
+	gint64 expires;       /* sipe_utils_monotonic_msec() */
+};
+
+static void tls_session_free(gpointer data)
+{
+	struct tls_session *session = data;
+
+	if (session->destroy)
+		(*session->destroy)(session->data);
+	g_free(session);
+}
+
+static gchar *tls_session_key(const gchar *host, guint port)
+{
+	/* host names are case-insensitive */
+	gchar *lower = g_ascii_strdown(host, -1);
+	gchar *key   = g_strdup_printf("%s:%u", lower, port);
+	g_free(lower);
+	return(key);
+}
+
+gpointer sipe_core_tls_session_lookup(struct sipe_tls_session_cache *cache,
+				      const gchar *host,
+				      guint port)
+{
+	struct tls_session *session;
+	gchar *key;
+
+	if (!cache || !host)
+		return(NULL);
+
+	key     = tls_session_key(host, port);
+	session = g_hash_table_lookup(cache->sessions, key);
+	if (session && (session->expires < sipe_utils_monotonic_msec())) {
+		SIPE_DEBUG_INFO("sipe_core_tls_session_lookup: %s expired", key);
+		g_hash_table_remove(cache->sessions, key);
+		session = NULL;
+	}
+	g_free(key);
+
+	if (!session)
+		return(NULL);
+
+	sipe_metrics_count(cache->sipe_private,
+			   SIPE_METRIC_TLS_RESUMPTION_OFFERED);
+	return(session->data);
+}
+
+void sipe_core_tls_session_store(struct sipe_tls_session_cache *cache,
+				 const gchar *host,
+				 guint port,
+				 gpointer data,
+				 GDestroyNotify destroy)
+{
+	struct tls_session *session;
+
+	if (!cache || !host) {
+		if (destroy)
+			(*destroy)(data);
+		return;
+	}
+
+	sipe_metrics_count(cache->sipe_private, SIPE_METRIC_TLS_HANDSHAKES);
+	cache->handshakes++;
+
+	session          = g_new0(struct tls_session, 1);
+	session->data    = data;
+	session->destroy = destroy;
+	session->expires = sipe_utils_monotonic_msec() + SIPE_TLS_SESSION_TIMEOUT;
+
+	/* replaces the session of the previous connection */
+	g_hash_table_insert(cache->sessions,
+			    tls_session_key(host, port),
+			    session);
+}
+
+void sipe_core_tls_session_resumed(struct sipe_tls_session_cache *cache)
+{
+	if (cache) {
+		sipe_metrics_count(cache->sipe_private,
+				   SIPE_METRIC_TLS_RESUMED);
+		cache->resumed++;
+	}
+}
+
+void sipe_core_tls_session_invalidate(struct sipe_tls_session_cache *cache,
+				      const gchar *host,
+				      guint port)
+{
+	if (cache && host) {
+		gchar *key = tls_session_key(host, port);
+		g_hash_table_remove(cache->sessions, key);
+		g_free(key);
+	}
+}
+
+void sipe_core_tls_records(struct sipe_core_public *sipe_public,
+			   guint messages,
+			   gsize length)
+{
+	struct sipe_core_private *sipe_private = SIPE_CORE_PRIVATE;
+
+	sipe_metrics_add(sipe_private, SIPE_METRIC_TLS_MESSAGES, messages);
+	sipe_metrics_add(sipe_private,
+			 SIPE_METRIC_TLS_RECORDS,
+			 (length + SIPE_TLS_RECORD_LENGTH - 1) / SIPE_TLS_RECORD_LENGTH);
+}
+
+void sipe_tls_session_stats(struct sipe_core_private *sipe_private,
+			    struct sipe_tls_session_stats *stats)
+{
+	struct sipe_tls_session_cache *cache = sipe_private->tls_sessions;
+
+	stats->sessions   = 0;
+	stats->resumption = 0;
+	if (cache) {
+		stats->sessions = g_hash_table_size(cache->sessions);
+		if (cache->handshakes)
+			stats->resumption = (guint) (cache->resumed * 100 /
+						     cache->handshakes);
+	}
+}
+
+void sipe_tls_session_init(struct sipe_core_private *sipe_private)
+{
+	struct sipe_tls_session_cache *cache = g_new0(struct sipe_tls_session_cache, 1);
+
+	cache->sipe_private = sipe_private;
+	cache->sessions     = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    g_free, tls_session_free);
+	sipe_private->tls_sessions = cache;
+}
+
+void sipe_tls_session_free(struct sipe_core_private *sipe_private)
+{
+	struct sipe_tls_session_cache *cache = sipe_private->tls_sessions;
+
+	if (cache) {
+		g_hash_table_destroy(cache->sessions);
+		g_free(cache);
+		sipe_private->tls_sessions = NULL;
+	}
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
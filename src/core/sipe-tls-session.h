@@ -0,0 +1,65 @@
+/**
+ * @file sipe-tls-session.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * TLS session cache & record accounting
+ *
+ * Backends can store the session state of a TLS connection after the
+ * handshake and offer it again for the next connection to the same
+ * host:port. SIP reconnects and new HTTP connections then resume the
+ * session instead of running a full handshake. The public interface for
+ * the backends is in sipe-core.h.
+ *
+ * Interface dependencies:
+ *
+ * <glib.h>
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+
+struct sipe_tls_session_stats {
+	guint sessions;       /* cached sessions */
+	guint resumption;     /* resumed handshakes in percent */
+};
+
+/**
+ * Query TLS session cache statistics
+ *
+ * @param sipe_private SIPE core private data
+ * @param stats        (out) statistics
+ */
+void sipe_tls_session_stats(struct sipe_core_private *sipe_private,
+			    struct sipe_tls_session_stats *stats);
+
+void sipe_tls_session_init(struct sipe_core_private *sipe_private);
+void sipe_tls_session_free(struct sipe_core_private *sipe_private);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
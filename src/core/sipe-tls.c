@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -58,13 +59,49 @@ enum tls_handshake_state {
 	TLS_HANDSHAKE_STATE_FAILED
 };
 
+/* cached TLS session, see tls_session_lookup() */
+#define TLS_SESSION_ID_MAX_LENGTH 32
+struct tls_session {
+	guchar certificate_digest[SIPE_DIGEST_SHA1_LENGTH];
+	guchar session_id[TLS_SESSION_ID_MAX_LENGTH];
+	gsize session_id_length;
+	guint cipher_suite;
+	guchar master_secret[48]; /* TLS_ARRAY_MASTER_SECRET_LENGTH */
+	time_t expires;
+};
+
+/*
+ * Parsed data of incoming messages
+ *
+ * Values are views into the incoming buffer, i.e. they are only valid
+ * during the sipe_tls_next() call that parsed them.
+ */
+struct tls_parsed_value {
+	const guchar *data; /* NULL if not present */
+	gsize length;       /* bytes */
+	guint value;        /* INTEGER only */
+};
+
+struct tls_parsed_data {
+	struct tls_parsed_value random;
+	struct tls_parsed_value session_id;
+	struct tls_parsed_value cipher_suite;
+	struct tls_parsed_value certificate;
+};
+
 struct tls_internal_state {
 	struct sipe_tls_state common;
 	gpointer certificate;
+	gchar *target;
+	struct tls_session *session;
+	const guchar *encrypted_record;
+	gsize encrypted_length;
 	enum tls_handshake_state state;
 	guchar *msg_current;
 	gsize msg_remainder;
-	GHashTable *data;
+	struct tls_parsed_data *data; /* != NULL while parsing incoming */
+	struct tls_parsed_data parsed;
+	gsize out_size;
 	GString *debug;
 	gpointer md5_context;
 	gpointer sha1_context;
@@ -81,11 +118,11 @@ struct tls_internal_state {
 	const guchar *server_write_mac_secret;
 	const guchar *client_write_secret;
 	const guchar *server_write_secret;
-	void (*mac_func)(const guchar *key, gsize key_length,
-			 const guchar *data, gsize data_length,
-			 guchar *digest);
+	gpointer (*mac_start)(const guchar *key, gsize key_length);
+	gpointer mac_context;
 	gpointer cipher_context;
 	guint64 sequence_number;
+	guint cipher_suite;
 	gboolean encrypted;
 };
 
@@ -150,9 +187,10 @@ struct layout_descriptor {
 	gsize min; /* 0 for fixed/array */
 	gsize max;
 	gsize offset;
+	gsize parsed; /* offset in struct tls_parsed_data */
 };
 
-#define TLS_LAYOUT_DESCRIPTOR_END { NULL, NULL, NULL, 0, 0, 0 }
+#define TLS_LAYOUT_DESCRIPTOR_END { NULL, NULL, NULL, 0, 0, 0, 0 }
 #define TLS_LAYOUT_IS_VALID(desc) (desc->label)
 
 struct msg_descriptor  {
@@ -162,15 +200,8 @@ struct msg_descriptor  {
 	guint type;
 };
 
-/* parsed data */
-struct tls_parsed_integer {
-	guint value;
-};
-
-struct tls_parsed_array {
-	gsize length; /* bytes */
-	const guchar data[0];
-};
+#define PARSED_OFFSET(a) G_STRUCT_OFFSET(struct tls_parsed_data, a)
+#define PARSED_NONE      ((gsize) -1)
 
 /* compile data */
 struct tls_compile_integer {
@@ -199,6 +230,7 @@ struct tls_compile_vector {
 
 struct tls_compile_sessionid {
 	gsize elements; /* VECTOR */
+	guchar placeholder[TLS_SESSION_ID_MAX_LENGTH];
 };
 
 struct tls_compile_cipher {
@@ -211,12 +243,6 @@ struct tls_compile_compression {
 	guint methods[1];
 };
 
-/* compiled message */
-struct tls_compiled_message {
-	gsize size;
-	guchar data[];
-};
-
 /*
  * Random byte buffers
  */
@@ -294,6 +320,47 @@ static void debug_secrets(struct tls_internal_state *state,
 /*
  * TLS Pseudorandom Function (PRF) - RFC2246, Section 5
  */
+static guchar *sipe_tls_p_hash(gpointer hmac,
+			       gsize hmac_length,
+			       const guchar *seed,
+			       gsize seed_length,
+			       gsize output_length)
+{
+	/*
+	 * output_length ==  0                   -> illegal
+	 * output_length ==  1..hmac_length      -> iterations = 1
+	 * output_length == hmac_length + 1..2x  -> iterations = 2
+	 */
+	guint iterations = (output_length + hmac_length - 1) / hmac_length;
+	guchar A[SIPE_DIGEST_HMAC_SHA1_LENGTH];
+	guchar *output;
+	guchar *p;
+
+	SIPE_DEBUG_INFO("p_hash: output %" G_GSIZE_FORMAT " bytes -> %d iterations",
+			output_length, iterations);
+
+	/* A(1) = HMAC_hash(secret, A(0)), A(0) = seed */
+	sipe_digest_hmac_update(hmac, seed, seed_length);
+	sipe_digest_hmac_end(hmac, A);
+
+	/* Each iteration adds hmac_length bytes */
+	p = output = g_malloc(iterations * hmac_length);
+
+	while (iterations-- > 0) {
+		/* P_hash(i) = HMAC_hash(secret, A(i) + seed), i = 1, 2, ... */
+		sipe_digest_hmac_update(hmac, A, hmac_length);
+		sipe_digest_hmac_update(hmac, seed, seed_length);
+		sipe_digest_hmac_end(hmac, p);
+		p += hmac_length;
+
+		/* A(i+1) = HMAC_hash(secret, A(i)) */
+		sipe_digest_hmac_update(hmac, A, hmac_length);
+		sipe_digest_hmac_end(hmac, A);
+	}
+
+	return(output);
+}
+
 static guchar *sipe_tls_p_md5(const guchar *secret,
 			      gsize secret_length,
 			      const guchar *seed,
@@ -302,47 +369,18 @@ static guchar *sipe_tls_p_md5(const guchar *secret,
 {
 	guchar *output = NULL;
 
-	/*
-	 * output_length ==  0     -> illegal
-	 * output_length ==  1..16 -> iterations = 1
-	 * output_length == 17..32 -> iterations = 2
-	 */
 	if (secret && seed && (output_length > 0)) {
-		guint iterations = (output_length + SIPE_DIGEST_HMAC_MD5_LENGTH - 1) / SIPE_DIGEST_HMAC_MD5_LENGTH;
-		guchar *concat   = g_malloc(SIPE_DIGEST_HMAC_MD5_LENGTH + seed_length);
-		guchar A[SIPE_DIGEST_HMAC_MD5_LENGTH];
-		guchar *p;
+		gpointer hmac = sipe_digest_hmac_md5_start(secret, secret_length);
 
 		SIPE_DEBUG_INFO("p_md5: secret %" G_GSIZE_FORMAT " bytes, seed %" G_GSIZE_FORMAT " bytes",
 				secret_length, seed_length);
-		SIPE_DEBUG_INFO("p_md5: output %" G_GSIZE_FORMAT " bytes -> %d iterations",
-				output_length, iterations);
-
-		/* A(1) = HMAC_MD5(secret, A(0)), A(0) = seed */
-		sipe_digest_hmac_md5(secret, secret_length,
-				      seed, seed_length,
-				      A);
-
-		/* Each iteration adds SIPE_DIGEST_HMAC_MD5_LENGTH bytes */
-		p = output = g_malloc(iterations * SIPE_DIGEST_HMAC_MD5_LENGTH);
-
-		while (iterations-- > 0) {
-			/* P_MD5(i) = HMAC_MD5(secret, A(i) + seed), i = 1, 2, ... */
-			guchar P[SIPE_DIGEST_HMAC_MD5_LENGTH];
-			memcpy(concat, A, SIPE_DIGEST_HMAC_MD5_LENGTH);
-			memcpy(concat + SIPE_DIGEST_HMAC_MD5_LENGTH, seed, seed_length);
-			sipe_digest_hmac_md5(secret, secret_length,
-					      concat, SIPE_DIGEST_HMAC_MD5_LENGTH + seed_length,
-					      P);
-			memcpy(p, P, SIPE_DIGEST_HMAC_MD5_LENGTH);
-			p += SIPE_DIGEST_HMAC_MD5_LENGTH;
-
-			/* A(i+1) = HMAC_MD5(secret, A(i)) */
-			sipe_digest_hmac_md5(secret, secret_length,
-					      A, SIPE_DIGEST_HMAC_MD5_LENGTH,
-					      A);
-		}
-		g_free(concat);
+
+		output = sipe_tls_p_hash(hmac,
+					 SIPE_DIGEST_HMAC_MD5_LENGTH,
+					 seed,
+					 seed_length,
+					 output_length);
+		sipe_digest_hmac_destroy(hmac);
 	}
 
 	return(output);
@@ -356,47 +394,18 @@ guchar *sipe_tls_p_sha1(const guchar *secret,
 {
 	guchar *output = NULL;
 
-	/*
-	 * output_length ==  0     -> illegal
-	 * output_length ==  1..20 -> iterations = 1
-	 * output_length == 21..40 -> iterations = 2
-	 */
 	if (secret && seed && (output_length > 0)) {
-		guint iterations = (output_length + SIPE_DIGEST_HMAC_SHA1_LENGTH - 1) / SIPE_DIGEST_HMAC_SHA1_LENGTH;
-		guchar *concat   = g_malloc(SIPE_DIGEST_HMAC_SHA1_LENGTH + seed_length);
-		guchar A[SIPE_DIGEST_HMAC_SHA1_LENGTH];
-		guchar *p;
+		gpointer hmac = sipe_digest_hmac_sha1_start(secret, secret_length);
 
 		SIPE_DEBUG_INFO("p_sha1: secret %" G_GSIZE_FORMAT " bytes, seed %" G_GSIZE_FORMAT " bytes",
 				secret_length, seed_length);
-		SIPE_DEBUG_INFO("p_sha1: output %" G_GSIZE_FORMAT " bytes -> %d iterations",
-				output_length, iterations);
-
-		/* A(1) = HMAC_SHA1(secret, A(0)), A(0) = seed */
-		sipe_digest_hmac_sha1(secret, secret_length,
-				      seed, seed_length,
-				      A);
-
-		/* Each iteration adds SIPE_DIGEST_HMAC_SHA1_LENGTH bytes */
-		p = output = g_malloc(iterations * SIPE_DIGEST_HMAC_SHA1_LENGTH);
-
-		while (iterations-- > 0) {
-			/* P_SHA1(i) = HMAC_SHA1(secret, A(i) + seed), i = 1, 2, ... */
-			guchar P[SIPE_DIGEST_HMAC_SHA1_LENGTH];
-			memcpy(concat, A, SIPE_DIGEST_HMAC_SHA1_LENGTH);
-			memcpy(concat + SIPE_DIGEST_HMAC_SHA1_LENGTH, seed, seed_length);
-			sipe_digest_hmac_sha1(secret, secret_length,
-					      concat, SIPE_DIGEST_HMAC_SHA1_LENGTH + seed_length,
-					      P);
-			memcpy(p, P, SIPE_DIGEST_HMAC_SHA1_LENGTH);
-			p += SIPE_DIGEST_HMAC_SHA1_LENGTH;
-
-			/* A(i+1) = HMAC_SHA1(secret, A(i)) */
-			sipe_digest_hmac_sha1(secret, secret_length,
-					      A, SIPE_DIGEST_HMAC_SHA1_LENGTH,
-					      A);
-		}
-		g_free(concat);
+
+		output = sipe_tls_p_hash(hmac,
+					 SIPE_DIGEST_HMAC_SHA1_LENGTH,
+					 seed,
+					 seed_length,
+					 output_length);
+		sipe_digest_hmac_destroy(hmac);
 	}
 
 	return(output);
@@ -516,19 +525,32 @@ static gboolean parse_integer_quiet(struct tls_internal_state *state,
 	return(TRUE);
 }
 
+static void parse_save(struct tls_internal_state *state,
+		       const struct layout_descriptor *desc,
+		       const guchar *data,
+		       gsize length,
+		       guint value)
+{
+	if (state->data && (desc->parsed != PARSED_NONE)) {
+		/* (void *): offset points to correctly aligned data */
+		struct tls_parsed_value *save =
+			(void *) ((guchar *) state->data + desc->parsed);
+		save->data   = data;
+		save->length = length;
+		save->value  = value;
+	}
+}
+
 static gboolean parse_integer(struct tls_internal_state *state,
 			      const struct layout_descriptor *desc)
 {
+	const guchar *data = state->msg_current;
 	guint value;
 	if (!parse_integer_quiet(state, desc->label, desc->max, &value))
 		return(FALSE);
 	debug_printf(state, "%s/INTEGER%" G_GSIZE_FORMAT " = %d\n",
 		     desc->label, desc->max, value);
-	if (state->data) {
-		struct tls_parsed_integer *save = g_new0(struct tls_parsed_integer, 1);
-		save->value = value;
-		g_hash_table_insert(state->data, (gpointer) desc->label, save);
-	}
+	parse_save(state, desc, data, desc->max, value);
 	return(TRUE);
 }
 
@@ -539,14 +561,7 @@ static gboolean parse_array(struct tls_internal_state *state,
 		return(FALSE);
 	debug_printf(state, "%s/ARRAY[%" G_GSIZE_FORMAT "]\n",
 		     desc->label, desc->max);
-	if (state->data) {
-		struct tls_parsed_array *save = g_malloc0(sizeof(struct tls_parsed_array) +
-							  desc->max);
-		save->length = desc->max;
-		memcpy((guchar *)save->data, state->msg_current, desc->max);
-		g_hash_table_insert(state->data, (gpointer) desc->label, save);
-
-	}
+	parse_save(state, desc, state->msg_current, desc->max, 0);
 	state->msg_current   += desc->max;
 	state->msg_remainder -= desc->max;
 	return(TRUE);
@@ -566,14 +581,10 @@ static gboolean parse_vector(struct tls_internal_state *state,
 				 desc->label, length, desc->min);
 		return(FALSE);
 	}
+	if (!msg_remainder_check(state, desc->label, length))
+		return(FALSE);
 	debug_printf(state, "%s/VECTOR<%d>\n", desc->label, length);
-	if (state->data) {
-		struct tls_parsed_array *save = g_malloc0(sizeof(struct tls_parsed_array) +
-							  length);
-		save->length = length;
-		memcpy((guchar *)save->data, state->msg_current, length);
-		g_hash_table_insert(state->data, (gpointer) desc->label, save);
-	}
+	parse_save(state, desc, state->msg_current, length, 0);
 	state->msg_current   += length;
 	state->msg_remainder -= length;
 	return(TRUE);
@@ -677,11 +688,11 @@ struct ClientHello_host {
 #define CLIENTHELLO_OFFSET(a) offsetof(struct ClientHello_host, a)
 
 static const struct layout_descriptor ClientHello_l[] = {
-	{ "Client Protocol Version", parse_integer, compile_integer,     0,  2,                      CLIENTHELLO_OFFSET(protocol_version) },
-	{ "Random",                  parse_array,   compile_array,       0, TLS_ARRAY_RANDOM_LENGTH, CLIENTHELLO_OFFSET(random) },
-	{ "SessionID",               parse_vector,  compile_vector,      0, 32,                      CLIENTHELLO_OFFSET(sessionid) },
-	{ "CipherSuite",             parse_vector,  compile_vector_int2, 2, TLS_VECTOR_MAX16,        CLIENTHELLO_OFFSET(cipher)},
-	{ "CompressionMethod",       parse_vector,  compile_vector,      1, TLS_VECTOR_MAX8,         CLIENTHELLO_OFFSET(compression) },
+	{ "Client Protocol Version", parse_integer, compile_integer,     0,  2,                      CLIENTHELLO_OFFSET(protocol_version), PARSED_NONE },
+	{ "Random",                  parse_array,   compile_array,       0, TLS_ARRAY_RANDOM_LENGTH, CLIENTHELLO_OFFSET(random),           PARSED_NONE },
+	{ "SessionID",               parse_vector,  compile_vector,      0, 32,                      CLIENTHELLO_OFFSET(sessionid),        PARSED_NONE },
+	{ "CipherSuite",             parse_vector,  compile_vector_int2, 2, TLS_VECTOR_MAX16,        CLIENTHELLO_OFFSET(cipher),           PARSED_NONE },
+	{ "CompressionMethod",       parse_vector,  compile_vector,      1, TLS_VECTOR_MAX8,         CLIENTHELLO_OFFSET(compression),      PARSED_NONE },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor ClientHello_m = {
@@ -689,11 +700,11 @@ static const struct msg_descriptor ClientHello_m = {
 };
 
 static const struct layout_descriptor ServerHello_l[] = {
-	{ "Server Protocol Version", parse_integer, NULL, 0,  2,                      0 },
-	{ "Random",                  parse_array,   NULL, 0, TLS_ARRAY_RANDOM_LENGTH, 0 },
-	{ "SessionID",               parse_vector,  NULL, 0, 32,                      0 },
-	{ "CipherSuite",             parse_integer, NULL, 0,  2,                      0 },
-	{ "CompressionMethod",       parse_integer, NULL, 0,  1,                      0 },
+	{ "Server Protocol Version", parse_integer, NULL, 0,  2,                      0, PARSED_NONE },
+	{ "Random",                  parse_array,   NULL, 0, TLS_ARRAY_RANDOM_LENGTH, 0, PARSED_OFFSET(random) },
+	{ "SessionID",               parse_vector,  NULL, 0, 32,                      0, PARSED_OFFSET(session_id) },
+	{ "CipherSuite",             parse_integer, NULL, 0,  2,                      0, PARSED_OFFSET(cipher_suite) },
+	{ "CompressionMethod",       parse_integer, NULL, 0,  1,                      0, PARSED_NONE },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor ServerHello_m = {
@@ -706,7 +717,7 @@ struct Certificate_host {
 #define CERTIFICATE_OFFSET(a) offsetof(struct Certificate_host, a)
 
 static const struct layout_descriptor Certificate_l[] = {
-	{ "Certificate",             parse_vector, compile_vector, 0, TLS_VECTOR_MAX24, CERTIFICATE_OFFSET(certificate) },
+	{ "Certificate",             parse_vector, compile_vector, 0, TLS_VECTOR_MAX24, CERTIFICATE_OFFSET(certificate), PARSED_OFFSET(certificate) },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor Certificate_m = {
@@ -714,8 +725,8 @@ static const struct msg_descriptor Certificate_m = {
 };
 
 static const struct layout_descriptor CertificateRequest_l[] = {
-	{ "CertificateType",         parse_vector, NULL, 1, TLS_VECTOR_MAX8,  0 },
-	{ "DistinguishedName",       parse_vector, NULL, 0, TLS_VECTOR_MAX16, 0 },
+	{ "CertificateType",         parse_vector, NULL, 1, TLS_VECTOR_MAX8,  0, PARSED_NONE },
+	{ "DistinguishedName",       parse_vector, NULL, 0, TLS_VECTOR_MAX16, 0, PARSED_NONE },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor CertificateRequest_m = {
@@ -735,7 +746,7 @@ struct ClientKeyExchange_host {
 #define CLIENTKEYEXCHANGE_OFFSET(a) offsetof(struct ClientKeyExchange_host, a)
 
 static const struct layout_descriptor ClientKeyExchange_l[] = {
-	{ "Exchange Keys",           parse_vector, compile_vector, 0, TLS_VECTOR_MAX16, CLIENTKEYEXCHANGE_OFFSET(secret) },
+	{ "Exchange Keys",           parse_vector, compile_vector, 0, TLS_VECTOR_MAX16, CLIENTKEYEXCHANGE_OFFSET(secret), PARSED_NONE },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor ClientKeyExchange_m = {
@@ -748,7 +759,7 @@ struct CertificateVerify_host {
 #define CERTIFICATEVERIFY_OFFSET(a) offsetof(struct CertificateVerify_host, a)
 
 static const struct layout_descriptor CertificateVerify_l[] = {
-	{ "Signature",               parse_vector, compile_vector, 0, TLS_VECTOR_MAX16, CERTIFICATEVERIFY_OFFSET(signature) },
+	{ "Signature",               parse_vector, compile_vector, 0, TLS_VECTOR_MAX16, CERTIFICATEVERIFY_OFFSET(signature), PARSED_NONE },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor CertificateVerify_m = {
@@ -761,7 +772,7 @@ struct Finished_host {
 #define FINISHED_OFFSET(a) offsetof(struct Finished_host, a)
 
 static const struct layout_descriptor Finished_l[] = {
-	{ "Verify Data",             parse_array, compile_array, 0, TLS_ARRAY_VERIFY_LENGTH, FINISHED_OFFSET(verify) },
+	{ "Verify Data",             parse_array, compile_array, 0, TLS_ARRAY_VERIFY_LENGTH, FINISHED_OFFSET(verify), PARSED_NONE },
 	TLS_LAYOUT_DESCRIPTOR_END
 };
 static const struct msg_descriptor Finished_m = {
@@ -845,7 +856,7 @@ static gboolean handshake_parse(struct tls_internal_state *state)
 static void free_parse_data(struct tls_internal_state *state)
 {
 	if (state->data) {
-		g_hash_table_destroy(state->data);
+		memset(state->data, 0, sizeof(struct tls_parsed_data));
 		state->data = NULL;
 	}
 }
@@ -855,6 +866,7 @@ static gboolean tls_record_parse(struct tls_internal_state *state,
 {
 	const guchar *bytes  = incoming ? state->common.in_buffer : state->common.out_buffer;
 	gsize length         = incoming ? state->common.in_length : state->common.out_length;
+	struct tls_parsed_data *data = state->data;
 	guint version;
 	const gchar *version_str;
 	gsize record_length;
@@ -863,9 +875,13 @@ static gboolean tls_record_parse(struct tls_internal_state *state,
 	debug_printf(state, "TLS MESSAGE %s\n", incoming ? "INCOMING" : "OUTGOING");
 
 	/* Collect parser data for incoming messages */
-	if (incoming)
-		state->data = g_hash_table_new_full(g_str_hash, g_str_equal,
-						    NULL, g_free);
+	if (incoming) {
+		memset(&state->parsed, 0, sizeof(struct tls_parsed_data));
+		state->data = &state->parsed;
+	} else {
+		/* don't overwrite incoming data with our own messages */
+		state->data = NULL;
+	}
 
 	while (success && (length > 0)) {
 
@@ -911,16 +927,6 @@ static gboolean tls_record_parse(struct tls_internal_state *state,
 		state->msg_current   = (guchar *) bytes + TLS_RECORD_HEADER_LENGTH;
 		state->msg_remainder = record_length - TLS_RECORD_HEADER_LENGTH;
 
-		/* Add incoming message contents to digest contexts */
-		if (incoming) {
-			sipe_digest_md5_update(state->md5_context,
-					       state->msg_current,
-					       state->msg_remainder);
-			sipe_digest_sha1_update(state->sha1_context,
-						state->msg_current,
-						state->msg_remainder);
-		}
-
 		switch (bytes[TLS_RECORD_OFFSET_TYPE]) {
 		case TLS_RECORD_TYPE_CHANGE_CIPHER_SPEC:
 			debug_print(state, "Change Cipher Spec\n");
@@ -931,7 +937,19 @@ static gboolean tls_record_parse(struct tls_internal_state *state,
 			if (incoming && state->encrypted) {
 				debug_print(state, "Encrypted handshake message\n");
 				debug_hex(state, 0);
+				/* only needed for an abbreviated handshake */
+				state->encrypted_record = bytes;
+				state->encrypted_length = record_length;
 			} else {
+				/* Add incoming message contents to digest contexts */
+				if (incoming) {
+					sipe_digest_md5_update(state->md5_context,
+							       state->msg_current,
+							       state->msg_remainder);
+					sipe_digest_sha1_update(state->sha1_context,
+								state->msg_current,
+								state->msg_remainder);
+				}
 				success = handshake_parse(state);
 			}
 			break;
@@ -947,7 +965,9 @@ static gboolean tls_record_parse(struct tls_internal_state *state,
 		length -= record_length;
 	}
 
-	if (!success)
+	if (!incoming)
+		state->data = data;
+	else if (!success)
 		free_parse_data(state);
 
 	if (state->debug) {
@@ -960,75 +980,69 @@ static gboolean tls_record_parse(struct tls_internal_state *state,
 
 /*
  * TLS message compiler
+ *
+ * Records are compiled in place into the output buffer. It is allocated
+ * once per handshake step and only grows if the initial estimate is too
+ * small, i.e. there are no intermediate copies of the messages.
  */
-static void compile_tls_record(struct tls_internal_state *state,
-			       ...)
+#define TLS_OUT_BUFFER_INITIAL_SIZE 4096
+
+static guchar *out_reserve(struct tls_internal_state *state,
+			   gsize size)
 {
-	gsize total_size = 0;
-	guchar *current;
-	va_list ap;
-
-	/* calculate message size */
-	va_start(ap, state);
-	while (1) {
-		const struct tls_compiled_message *msg = va_arg(ap, struct tls_compiled_message *);
-		if (!msg) break;
-		total_size += msg->size;
+	gsize needed = state->common.out_length + size;
+
+	if (!state->common.out_buffer)
+		state->out_size = 0;
+
+	if (needed > state->out_size) {
+		state->out_size = MAX(needed,
+				      MAX(2 * state->out_size,
+					  TLS_OUT_BUFFER_INITIAL_SIZE));
+		state->common.out_buffer = g_realloc(state->common.out_buffer,
+						     state->out_size);
 	}
-	va_end(ap);
 
-	SIPE_DEBUG_INFO("compile_tls_record: total size %" G_GSIZE_FORMAT,
-			total_size);
+	return(state->common.out_buffer + state->common.out_length);
+}
 
-	state->common.out_buffer = current = g_malloc(total_size + TLS_RECORD_HEADER_LENGTH);
-	state->common.out_length = total_size + TLS_RECORD_HEADER_LENGTH;
+static gsize tls_record_start(struct tls_internal_state *state,
+			      guint type)
+{
+	gsize start     = state->common.out_length;
+	guchar *current = out_reserve(state, TLS_RECORD_HEADER_LENGTH);
 
-	/* add TLS record header */
-	current[TLS_RECORD_OFFSET_TYPE] = TLS_RECORD_TYPE_HANDSHAKE;
+	/* add TLS record header, length is filled in by tls_record_end() */
+	current[TLS_RECORD_OFFSET_TYPE] = type;
 	lowlevel_integer_to_tls(current + TLS_RECORD_OFFSET_VERSION, 2,
 				TLS_PROTOCOL_VERSION_1_0);
-	lowlevel_integer_to_tls(current + TLS_RECORD_OFFSET_LENGTH, 2,
-				total_size);
-	current += TLS_RECORD_HEADER_LENGTH;
-
-	/* copy messages */
-	va_start(ap, state);
-	while (1) {
-		const struct tls_compiled_message *msg = va_arg(ap, struct tls_compiled_message *);
-		if (!msg) break;
-
-		memcpy(current, msg->data, msg->size);
-		current += msg->size;
-	}
-	va_end(ap);
+	state->common.out_length += TLS_RECORD_HEADER_LENGTH;
+
+	return(start);
 }
 
-static void compile_encrypted_tls_record(struct tls_internal_state *state,
-					 const struct tls_compiled_message *msg)
+static void tls_record_end(struct tls_internal_state *state,
+			   gsize start)
 {
-	guchar *plaintext;
-	gsize plaintext_length;
-	guchar *mac;
-	gsize mac_length;
-	guchar *message;
-	guchar *encrypted;
-	gsize encrypted_length;
+	gsize length = state->common.out_length - start - TLS_RECORD_HEADER_LENGTH;
 
-	/* Create plaintext TLS record */
-	compile_tls_record(state, msg, NULL);
-	plaintext        = state->common.out_buffer;
-	plaintext_length = state->common.out_length;
-	if (plaintext_length == 0) /* make Coverity happy */
-		return;
+	SIPE_DEBUG_INFO("tls_record_end: total size %" G_GSIZE_FORMAT,
+			length);
+
+	lowlevel_integer_to_tls(state->common.out_buffer + start + TLS_RECORD_OFFSET_LENGTH,
+				2, length);
+}
+
+static void tls_record_encrypt(struct tls_internal_state *state,
+			       gsize start)
+{
+	gsize plaintext_length = state->common.out_length - start;
+	guchar sequence_number[sizeof(guint64)];
+	guchar *record;
 
-	/* Prepare encryption buffer */
-	encrypted_length = plaintext_length + state->mac_length;
-	SIPE_DEBUG_INFO("compile_encrypted_tls_record: total size %" G_GSIZE_FORMAT,
-			encrypted_length - TLS_RECORD_HEADER_LENGTH);
-	message          = g_malloc(encrypted_length);
-	memcpy(message, plaintext, plaintext_length);
-	lowlevel_integer_to_tls(message + TLS_RECORD_OFFSET_LENGTH, 2,
-				encrypted_length - TLS_RECORD_HEADER_LENGTH);
+	/* space for MAC */
+	out_reserve(state, state->mac_length);
+	record = state->common.out_buffer + start;
 
 	/*
 	 * Calculate MAC
@@ -1037,38 +1051,35 @@ static void compile_encrypted_tls_record(struct tls_internal_state *state,
 	 *           sequence_number + type + version + length + fragment)
 	 *                             \---  == original TLS record  ---/
 	 */
-	mac_length = sizeof(guint64) + plaintext_length;
-	mac        = g_malloc(mac_length);
-	lowlevel_integer_to_tls(mac,
-				sizeof(guint64),
+	lowlevel_integer_to_tls(sequence_number,
+				sizeof(sequence_number),
 				state->sequence_number++);
-	memcpy(mac + sizeof(guint64), plaintext, plaintext_length);
-	g_free(plaintext);
-	state->mac_func(state->client_write_mac_secret,
-			state->mac_length,
-			mac,
-			mac_length,
-			message + plaintext_length);
-	g_free(mac);
-
-	/* Encrypt message + MAC */
-	encrypted = g_malloc(encrypted_length);
-	memcpy(encrypted, message, TLS_RECORD_HEADER_LENGTH);
-	sipe_crypt_tls_stream(state->cipher_context,
-			      message + TLS_RECORD_HEADER_LENGTH,
-			      encrypted_length - TLS_RECORD_HEADER_LENGTH,
-			      encrypted + TLS_RECORD_HEADER_LENGTH);
-	g_free(message);
-
-	/* swap buffers */
-	state->common.out_buffer = encrypted;
-	state->common.out_length = encrypted_length;
+	sipe_digest_hmac_update(state->mac_context,
+				sequence_number,
+				sizeof(sequence_number));
+	sipe_digest_hmac_update(state->mac_context,
+				record,
+				plaintext_length);
+	sipe_digest_hmac_end(state->mac_context,
+			     record + plaintext_length);
+	state->common.out_length += state->mac_length;
+
+	SIPE_DEBUG_INFO("tls_record_encrypt: total size %" G_GSIZE_FORMAT,
+			plaintext_length - TLS_RECORD_HEADER_LENGTH + state->mac_length);
+	lowlevel_integer_to_tls(record + TLS_RECORD_OFFSET_LENGTH, 2,
+				plaintext_length - TLS_RECORD_HEADER_LENGTH + state->mac_length);
+
+	/* Encrypt message + MAC in place */
+	sipe_crypt_cipher_stream(state->cipher_context,
+				 record + TLS_RECORD_HEADER_LENGTH,
+				 plaintext_length - TLS_RECORD_HEADER_LENGTH + state->mac_length,
+				 record + TLS_RECORD_HEADER_LENGTH);
 }
 
-static struct tls_compiled_message *compile_handshake_msg(struct tls_internal_state *state,
-							  const struct msg_descriptor *desc,
-							  gpointer data,
-							  gsize size)
+static void compile_handshake_msg(struct tls_internal_state *state,
+				  const struct msg_descriptor *desc,
+				  gpointer data,
+				  gsize size)
 {
 	/*
 	 * Estimate the size of the compiled message
@@ -1081,16 +1092,11 @@ static struct tls_compiled_message *compile_handshake_msg(struct tls_internal_st
 	 *
 	 * Therefore we don't need space checks in the compiler functions
 	 */
-	gsize total_size = sizeof(struct tls_compiled_message) +
-		size + TLS_HANDSHAKE_HEADER_LENGTH;
-	struct tls_compiled_message *msg = g_malloc(total_size);
-	guchar *handshake = msg->data;
+	guchar *handshake = out_reserve(state,
+					size + TLS_HANDSHAKE_HEADER_LENGTH);
 	const struct layout_descriptor *ldesc = desc->layouts;
 	gsize length;
 
-	SIPE_DEBUG_INFO("compile_handshake_msg: buffer size %" G_GSIZE_FORMAT,
-			total_size);
-
 	/* add TLS handshake header */
 	handshake[TLS_HANDSHAKE_OFFSET_TYPE] = desc->type;
 	state->msg_current = handshake  + TLS_HANDSHAKE_HEADER_LENGTH;
@@ -1114,23 +1120,38 @@ static struct tls_compiled_message *compile_handshake_msg(struct tls_internal_st
 	SIPE_DEBUG_INFO("compile_handshake_msg: (%d)%s, size %" G_GSIZE_FORMAT,
 			desc->type, desc->description, length);
 
-	msg->size = length + TLS_HANDSHAKE_HEADER_LENGTH;
+	length += TLS_HANDSHAKE_HEADER_LENGTH;
+	state->common.out_length += length;
 
 	/* update digest contexts */
-	sipe_digest_md5_update(state->md5_context, handshake, msg->size);
-	sipe_digest_sha1_update(state->sha1_context, handshake, msg->size);
+	sipe_digest_md5_update(state->md5_context, handshake, length);
+	sipe_digest_sha1_update(state->sha1_context, handshake, length);
+}
+
+/* ChangeCipherSpec is always the same */
+static void tls_change_cipher_spec(struct tls_internal_state *state)
+{
+	static const guchar change_cipher_spec[] = {
+		TLS_RECORD_TYPE_CHANGE_CIPHER_SPEC,
+		(TLS_PROTOCOL_VERSION_1_0 >> 8) & 0xFF,
+		TLS_PROTOCOL_VERSION_1_0 & 0xFF,
+		0x00, 0x01, /* length: 1 byte        */
+		0x01        /* change_cipher_spec(1) */
+	};
 
-	return(msg);
+	memcpy(out_reserve(state, sizeof(change_cipher_spec)),
+	       change_cipher_spec,
+	       sizeof(change_cipher_spec));
+	state->common.out_length += sizeof(change_cipher_spec);
 }
 
 /*
  * Specific TLS data verficiation & message compilers
  */
-static struct tls_compiled_message *tls_client_certificate(struct tls_internal_state *state)
+static gboolean tls_client_certificate(struct tls_internal_state *state)
 {
 	struct Certificate_host *certificate;
 	gsize certificate_length = sipe_cert_crypto_raw_length(state->certificate);
-	struct tls_compiled_message *msg;
 
 	/* setup our response */
 	/* Client Certificate is VECTOR_MAX24 of VECTOR_MAX24s */
@@ -1143,29 +1164,29 @@ static struct tls_compiled_message *tls_client_certificate(struct tls_internal_s
 	       sipe_cert_crypto_raw(state->certificate),
 	       certificate_length);
 
-	msg = compile_handshake_msg(state, &Certificate_m, certificate,
-				    sizeof(struct Certificate_host) + certificate_length + 3);
+	compile_handshake_msg(state, &Certificate_m, certificate,
+			      sizeof(struct Certificate_host) + certificate_length + 3);
 	g_free(certificate);
 
-	return(msg);
+	return(TRUE);
 }
 
 static gboolean check_cipher_suite(struct tls_internal_state *state)
 {
-	struct tls_parsed_integer *cipher_suite = g_hash_table_lookup(state->data,
-								      "CipherSuite");
+	const struct tls_parsed_value *cipher_suite = &state->data->cipher_suite;
 	const gchar *label = NULL;
 
-	if (!cipher_suite) {
+	if (!cipher_suite->data) {
 		SIPE_DEBUG_ERROR_NOFORMAT("check_cipher_suite: server didn't specify the cipher suite");
 		return(FALSE);
 	}
 
+	state->cipher_suite = cipher_suite->value;
 	switch (cipher_suite->value) {
 	case TLS_RSA_EXPORT_WITH_RC4_40_MD5:
 		state->mac_length = SIPE_DIGEST_HMAC_MD5_LENGTH;
 		state->key_length = 40 / 8;
-		state->mac_func   = sipe_digest_hmac_md5;
+		state->mac_start  = sipe_digest_hmac_md5_start;
 		label             = "MD5";
 		state->common.algorithm = SIPE_TLS_DIGEST_ALGORITHM_MD5;
 		break;
@@ -1173,7 +1194,7 @@ static gboolean check_cipher_suite(struct tls_internal_state *state)
 	case TLS_RSA_WITH_RC4_128_MD5:
 		state->mac_length = SIPE_DIGEST_HMAC_MD5_LENGTH;
 		state->key_length = 128 / 8;
-		state->mac_func   = sipe_digest_hmac_md5;
+		state->mac_start  = sipe_digest_hmac_md5_start;
 		label             = "MD5";
 		state->common.algorithm = SIPE_TLS_DIGEST_ALGORITHM_MD5;
 		break;
@@ -1181,7 +1202,7 @@ static gboolean check_cipher_suite(struct tls_internal_state *state)
 	case TLS_RSA_WITH_RC4_128_SHA:
 		state->mac_length = SIPE_DIGEST_HMAC_SHA1_LENGTH;
 		state->key_length = 128 / 8;
-		state->mac_func   = sipe_digest_hmac_sha1;
+		state->mac_start  = sipe_digest_hmac_sha1_start;
 		label             = "SHA-1";
 		state->common.algorithm = SIPE_TLS_DIGEST_ALGORITHM_SHA1;
 		break;
@@ -1201,7 +1222,6 @@ static gboolean check_cipher_suite(struct tls_internal_state *state)
 
 static void tls_calculate_secrets(struct tls_internal_state *state)
 {
-	gsize length = 2 * (state->mac_length + state->key_length);
 	guchar *random;
 
 	/* Generate pre-master secret */
@@ -1235,9 +1255,16 @@ static void tls_calculate_secrets(struct tls_internal_state *state)
 					    random,
 					    TLS_ARRAY_RANDOM_LENGTH * 2,
 					    TLS_ARRAY_MASTER_SECRET_LENGTH);
+	g_free(random);
 	debug_secrets(state, "tls_calculate_secrets: master secret    ",
 		      state->master_secret,
 		      TLS_ARRAY_MASTER_SECRET_LENGTH);
+}
+
+static void tls_calculate_keys(struct tls_internal_state *state)
+{
+	gsize length = 2 * (state->mac_length + state->key_length);
+	guchar *random = g_malloc(TLS_ARRAY_RANDOM_LENGTH * 2);
 
 	/*
 	 * Calculate session key material
@@ -1246,7 +1273,7 @@ static void tls_calculate_secrets(struct tls_internal_state *state)
 	 *                 "key expansion",
 	 *                 ServerHello.random + ClientHello.random)
 	 */
-	SIPE_DEBUG_INFO("tls_calculate_secrets: key_block length %" G_GSIZE_FORMAT,
+	SIPE_DEBUG_INFO("tls_calculate_keys: key_block length %" G_GSIZE_FORMAT,
 			length);
 	memcpy(random,
 	       state->server_random.buffer,
@@ -1263,7 +1290,7 @@ static void tls_calculate_secrets(struct tls_internal_state *state)
 					TLS_ARRAY_RANDOM_LENGTH * 2,
 					length);
 	g_free(random);
-	debug_secrets(state, "tls_calculate_secrets: key block        ",
+	debug_secrets(state, "tls_calculate_keys: key block           ",
 		      state->key_block, length);
 
 	/* partition key block */
@@ -1272,9 +1299,13 @@ static void tls_calculate_secrets(struct tls_internal_state *state)
 	state->client_write_secret     = state->key_block + 2 * state->mac_length;
 	state->server_write_secret     = state->key_block + 2 * state->mac_length + state->key_length;
 
-	/* initialize cipher context */
-	state->cipher_context = sipe_crypt_tls_start(state->client_write_secret,
-						     state->key_length);
+	/* initialize MAC & cipher context */
+	state->mac_context    = state->mac_start(state->client_write_mac_secret,
+						 state->mac_length);
+	state->cipher_context = sipe_crypt_cipher_start(SIPE_CRYPT_CIPHER_RC4,
+							state->client_write_secret,
+							state->key_length,
+							NULL);
 }
 
 #if 0 /* NOT NEEDED? */
@@ -1348,26 +1379,23 @@ static guchar *tls_pkcs1_public_padding(SIPE_UNUSED_PARAMETER struct tls_interna
 	return(pad_buffer);
 }
 
-static struct tls_compiled_message *tls_client_key_exchange(struct tls_internal_state *state)
+static gboolean tls_client_key_exchange(struct tls_internal_state *state)
 {
-	struct tls_parsed_array *server_random;
-	struct tls_parsed_array *server_certificate;
+	const struct tls_parsed_value *server_random      = &state->data->random;
+	const struct tls_parsed_value *server_certificate = &state->data->certificate;
 	struct ClientKeyExchange_host *exchange;
 	gsize server_certificate_length;
 	guchar *padded;
-	struct tls_compiled_message *msg;
 
 	/* check for required data fields */
 	if (!check_cipher_suite(state))
-		return(NULL);
-	server_random = g_hash_table_lookup(state->data, "Random");
-	if (!server_random) {
+		return(FALSE);
+	if (!server_random->data) {
 		SIPE_DEBUG_ERROR_NOFORMAT("tls_client_key_exchange: no server random");
-		return(NULL);
+		return(FALSE);
 	}
-	server_certificate = g_hash_table_lookup(state->data, "Certificate");
 	/* Server Certificate is VECTOR_MAX24 of VECTOR_MAX24s */
-	if (!server_certificate || (server_certificate->length < 3)) {
+	if (!server_certificate->data || (server_certificate->length < 3)) {
 		SIPE_DEBUG_ERROR_NOFORMAT("tls_client_key_exchange: no server certificate");
 		return(FALSE);
 	}
@@ -1380,6 +1408,7 @@ static struct tls_compiled_message *tls_client_key_exchange(struct tls_internal_
 			server_certificate_length);
 	if ((server_certificate_length + 3) > server_certificate->length) {
 		SIPE_DEBUG_ERROR_NOFORMAT("tls_client_key_exchange: truncated server certificate");
+		return(FALSE);
 	}
 	state->server_certificate = sipe_cert_crypto_import(server_certificate->data + 3,
 							    server_certificate_length);
@@ -1402,6 +1431,7 @@ static struct tls_compiled_message *tls_client_key_exchange(struct tls_internal_
 	state->server_random.buffer = g_memdup(server_random->data,
 					       server_random->length);
 	tls_calculate_secrets(state);
+	tls_calculate_keys(state);
 
 	/* ClientKeyExchange */
 	padded = tls_pkcs1_public_padding(state,
@@ -1410,7 +1440,7 @@ static struct tls_compiled_message *tls_client_key_exchange(struct tls_internal_
 					  server_certificate_length);
 	if (!padded) {
 		SIPE_DEBUG_ERROR_NOFORMAT("tls_client_key_exchange: padding of pre-master secret failed");
-		return(NULL);
+		return(FALSE);
 	}
 	exchange = g_malloc0(sizeof(struct ClientKeyExchange_host) +
 			     server_certificate_length);
@@ -1422,7 +1452,7 @@ static struct tls_compiled_message *tls_client_key_exchange(struct tls_internal_
 		SIPE_DEBUG_ERROR_NOFORMAT("tls_client_key_exchange: encryption of pre-master secret failed");
 		g_free(exchange);
 		g_free(padded);
-		return(NULL);
+		return(FALSE);
 	}
 	g_free(padded);
 
@@ -1432,17 +1462,16 @@ static struct tls_compiled_message *tls_client_key_exchange(struct tls_internal_
 		      server_certificate_length);
 #endif
 
-	msg = compile_handshake_msg(state, &ClientKeyExchange_m, exchange,
-				    sizeof(struct ClientKeyExchange_host) + server_certificate_length);
+	compile_handshake_msg(state, &ClientKeyExchange_m, exchange,
+			      sizeof(struct ClientKeyExchange_host) + server_certificate_length);
 	g_free(exchange);
 
-	return(msg);
+	return(TRUE);
 }
 
-static struct tls_compiled_message *tls_certificate_verify(struct tls_internal_state *state)
+static gboolean tls_certificate_verify(struct tls_internal_state *state)
 {
 	struct CertificateVerify_host *verify;
-	struct tls_compiled_message *msg;
 	guchar *digests = g_malloc(SIPE_DIGEST_MD5_LENGTH + SIPE_DIGEST_SHA1_LENGTH);
 	guchar *signature;
 	gsize length;
@@ -1459,7 +1488,7 @@ static struct tls_compiled_message *tls_certificate_verify(struct tls_internal_s
 	g_free(digests);
 	if (!signature) {
 		SIPE_DEBUG_ERROR_NOFORMAT("tls_certificate_verify: signing of handshake digests failed");
-		return(NULL);
+		return(FALSE);
 	}
 
 	/* CertificateVerify */
@@ -1469,19 +1498,20 @@ static struct tls_compiled_message *tls_certificate_verify(struct tls_internal_s
 	memcpy(verify->signature.placeholder, signature, length);
 	g_free(signature);
 
-	msg = compile_handshake_msg(state, &CertificateVerify_m, verify,
-				    sizeof(struct CertificateVerify_host) + length);
+	compile_handshake_msg(state, &CertificateVerify_m, verify,
+			      sizeof(struct CertificateVerify_host) + length);
 	g_free(verify);
 
-	return(msg);
+	return(TRUE);
 }
 
-static struct tls_compiled_message *tls_client_finished(struct tls_internal_state *state)
+/* Finished is always the first and only encrypted record */
+static void tls_client_finished(struct tls_internal_state *state)
 {
 	guchar *digests = g_malloc(SIPE_DIGEST_MD5_LENGTH + SIPE_DIGEST_SHA1_LENGTH);
 	guchar *verify;
-	struct tls_compiled_message *cmsg;
 	struct Finished_host msg;
+	gsize start;
 
 	/* calculate digests */
 	sipe_digest_md5_end(state->md5_context, digests);
@@ -1504,9 +1534,99 @@ static struct tls_compiled_message *tls_client_finished(struct tls_internal_stat
 	memcpy(msg.verify.verify, verify, TLS_ARRAY_VERIFY_LENGTH);
 	g_free(verify);
 
-	cmsg = compile_handshake_msg(state, &Finished_m, &msg, sizeof(msg));
+	tls_change_cipher_spec(state);
+	start = tls_record_start(state, TLS_RECORD_TYPE_HANDSHAKE);
+	compile_handshake_msg(state, &Finished_m, &msg, sizeof(msg));
+	tls_record_end(state, start);
+	tls_record_encrypt(state, start);
+}
+
+/* constant-time comparison for MACs */
+static gboolean tls_memequal(const guchar *a, const guchar *b, gsize length)
+{
+	guchar diff = 0;
+	while (length--) diff |= *a++ ^ *b++;
+	return(diff == 0);
+}
+
+/*
+ * TLS session cache
+ *
+ * Sessions are kept per target in memory only and are shared by all
+ * connections of the process. A cached session allows the abbreviated
+ * handshake (RFC2246 section 7.3), i.e. it avoids the RSA operations for
+ * ClientKeyExchange and CertificateVerify.
+ */
+static GHashTable *tls_sessions = NULL;
+
+static void tls_session_free(gpointer data)
+{
+	struct tls_session *session = data;
+	/* don't leave the master secret lying around */
+	memset(session, 0, sizeof(struct tls_session));
+	g_free(session);
+}
+
+static void tls_certificate_digest(struct tls_internal_state *state,
+				   guchar *digest)
+{
+	sipe_digest_sha1(sipe_cert_crypto_raw(state->certificate),
+			 sipe_cert_crypto_raw_length(state->certificate),
+			 digest);
+}
+
+static struct tls_session *tls_session_lookup(struct tls_internal_state *state)
+{
+	struct tls_session *session;
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+
+	if (!tls_sessions || !state->target)
+		return(NULL);
+
+	session = g_hash_table_lookup(tls_sessions, state->target);
+	if (!session)
+		return(NULL);
+
+	/* session must belong to the same, still valid certificate */
+	tls_certificate_digest(state, digest);
+	if ((session->expires <= time(NULL)) ||
+	    memcmp(digest, session->certificate_digest, sizeof(digest))) {
+		g_hash_table_remove(tls_sessions, state->target);
+		return(NULL);
+	}
+
+	return(g_memdup(session, sizeof(struct tls_session)));
+}
+
+static void tls_session_store(struct tls_internal_state *state)
+{
+	struct tls_session *session = state->session;
+
+	if (!state->target || !session || !session->session_id_length)
+		return;
 
-	return(cmsg);
+	tls_certificate_digest(state, session->certificate_digest);
+	session->cipher_suite = state->cipher_suite;
+	memcpy(session->master_secret, state->master_secret,
+	       TLS_ARRAY_MASTER_SECRET_LENGTH);
+	session->expires = time(NULL) +
+		sipe_cert_crypto_expires(state->certificate);
+
+	if (!tls_sessions)
+		tls_sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, tls_session_free);
+	g_hash_table_replace(tls_sessions,
+			     g_strdup(state->target),
+			     g_memdup(session, sizeof(struct tls_session)));
+
+	SIPE_DEBUG_INFO("tls_session_store: cached session for '%s'",
+			state->target);
+}
+
+static void tls_session_drop(struct tls_internal_state *state)
+{
+	if (tls_sessions && state->target)
+		g_hash_table_remove(tls_sessions, state->target);
 }
 
 /*
@@ -1534,7 +1654,18 @@ static gboolean tls_client_hello(struct tls_internal_state *state)
 		  }
 		}
 	};
-	struct tls_compiled_message *cmsg;
+	gsize start;
+
+	/* offer cached session for resumption */
+	state->session = tls_session_lookup(state);
+	if (state->session) {
+		msg.sessionid.elements = state->session->session_id_length;
+		memcpy(msg.sessionid.placeholder,
+		       state->session->session_id,
+		       state->session->session_id_length);
+		SIPE_DEBUG_INFO("tls_client_hello: trying to resume session for '%s'",
+				state->target);
+	}
 
 	/* First 4 bytes of client_random is the current timestamp */
 	sipe_tls_fill_random(&state->client_random,
@@ -1543,9 +1674,9 @@ static gboolean tls_client_hello(struct tls_internal_state *state)
 	memcpy(msg.random.random, state->client_random.buffer,
 	       TLS_ARRAY_RANDOM_LENGTH);
 
-	cmsg = compile_handshake_msg(state, &ClientHello_m, &msg, sizeof(msg));
-        compile_tls_record(state, cmsg, NULL);
-	g_free(cmsg);
+	start = tls_record_start(state, TLS_RECORD_TYPE_HANDSHAKE);
+	compile_handshake_msg(state, &ClientHello_m, &msg, sizeof(msg));
+	tls_record_end(state, start);
 
 	if (sipe_backend_debug_enabled())
 		state->debug = g_string_new("");
@@ -1554,86 +1685,10 @@ static gboolean tls_client_hello(struct tls_internal_state *state)
 	return(tls_record_parse(state, FALSE));
 }
 
-static gboolean tls_server_hello(struct tls_internal_state *state)
-{
-	struct tls_compiled_message *certificate = NULL;
-	struct tls_compiled_message *exchange    = NULL;
-	struct tls_compiled_message *verify      = NULL;
-	struct tls_compiled_message *finished    = NULL;
-	gboolean success = FALSE;
-
-	if (!tls_record_parse(state, TRUE))
-		return(FALSE);
-
-	if (((certificate = tls_client_certificate(state))  != NULL) &&
-	    ((exchange    = tls_client_key_exchange(state)) != NULL) &&
-	    ((verify      = tls_certificate_verify(state))  != NULL) &&
-	    ((finished    = tls_client_finished(state))     != NULL)) {
-
-		/* Part 1 */
-		compile_tls_record(state, certificate, exchange, verify, NULL);
-
-		success = tls_record_parse(state, FALSE);
-		if (success) {
-			guchar *part1      = state->common.out_buffer;
-			gsize part1_length = state->common.out_length;
-			guchar *part3;
-			gsize part3_length;
-			guchar *merged;
-			gsize length;
-			/* ChangeCipherSpec is always the same */
-			static const guchar part2[] = {
-				TLS_RECORD_TYPE_CHANGE_CIPHER_SPEC,
-				(TLS_PROTOCOL_VERSION_1_0 >> 8) & 0xFF,
-				TLS_PROTOCOL_VERSION_1_0 & 0xFF,
-				0x00, 0x01, /* length: 1 byte        */
-				0x01        /* change_cipher_spec(1) */
-			};
-
-			state->common.out_buffer = NULL;
-
-			/* Part 3 - this is the first encrypted record */
-			compile_encrypted_tls_record(state, finished);
-			part3        = state->common.out_buffer;
-			part3_length = state->common.out_length;
-
-				/* merge TLS records */
-			length = part1_length + sizeof(part2) + part3_length;
-			merged = g_malloc(length);
-
-			memcpy(merged,                                part1, part1_length);
-			memcpy(merged + part1_length,                 part2, sizeof(part2));
-			memcpy(merged + part1_length + sizeof(part2), part3, part3_length);
-			g_free(part3);
-			g_free(part1);
-
-			/* replace output buffer with merged message */
-			state->common.out_buffer = merged;
-			state->common.out_length = length;
-
-			state->state = TLS_HANDSHAKE_STATE_FINISHED;
-		}
-	}
-
-	g_free(finished);
-	g_free(verify);
-	g_free(exchange);
-	g_free(certificate);
-	free_parse_data(state);
-
-	return(success);
-}
-
-static gboolean tls_finished(struct tls_internal_state *state)
+static void tls_calculate_dsk_keys(struct tls_internal_state *state)
 {
 	guchar *random;
 
-	if (!tls_record_parse(state, TRUE))
-		return(FALSE);
-
-	/* we don't need the data */
-	free_parse_data(state);
-
 	/*
 	 * Calculate session keys [MS-SIPAE section 3.2.5.1]
 	 *
@@ -1663,7 +1718,7 @@ static gboolean tls_finished(struct tls_internal_state *state)
 	g_free(random);
 
 #ifdef __SIPE_TLS_CRYPTO_DEBUG
-	debug_secrets(state, "tls_finished: TLS-DSK key block         ",
+	debug_secrets(state, "tls_calculate_dsk_keys: TLS-DSK key block",
 		      state->tls_dsk_key_block, 4 * 32);
 #endif
 
@@ -1671,12 +1726,166 @@ static gboolean tls_finished(struct tls_internal_state *state)
 	state->common.server_key = state->tls_dsk_key_block + 3 * 32;
 	state->common.key_length = 32;
 
-	debug_secrets(state, "tls_finished: TLS-DSK client key        ",
+	debug_secrets(state, "tls_calculate_dsk_keys: TLS-DSK client key",
 		      state->common.client_key,
 		      state->common.key_length);
-	debug_secrets(state, "tls_finished: TLS-DSK server key        ",
+	debug_secrets(state, "tls_calculate_dsk_keys: TLS-DSK server key",
 		      state->common.server_key,
 		      state->common.key_length);
+}
+
+/*
+ * Abbreviated handshake
+ *
+ * Server has sent ServerHello, ChangeCipherSpec and an encrypted Finished.
+ * We reply with ChangeCipherSpec and Finished and are done.
+ */
+static gboolean tls_server_finished_resumed(struct tls_internal_state *state)
+{
+	const struct tls_parsed_value *server_random = &state->data->random;
+	const gsize length = TLS_HANDSHAKE_HEADER_LENGTH + TLS_ARRAY_VERIFY_LENGTH;
+	guchar plaintext[TLS_HANDSHAKE_HEADER_LENGTH + TLS_ARRAY_VERIFY_LENGTH + SIPE_DIGEST_HMAC_SHA1_LENGTH];
+	guchar mac[SIPE_DIGEST_HMAC_SHA1_LENGTH];
+	guchar sequence_number[sizeof(guint64)];
+	guchar header[TLS_RECORD_HEADER_LENGTH];
+	gpointer context;
+
+	if (!check_cipher_suite(state) ||
+	    (state->cipher_suite != state->session->cipher_suite)) {
+		SIPE_DEBUG_ERROR_NOFORMAT("tls_server_finished_resumed: cipher suite mismatch");
+		return(FALSE);
+	}
+	if (!server_random->data) {
+		SIPE_DEBUG_ERROR_NOFORMAT("tls_server_finished_resumed: no server random");
+		return(FALSE);
+	}
+	if (!state->encrypted_record ||
+	    (state->encrypted_length != TLS_RECORD_HEADER_LENGTH + length + state->mac_length)) {
+		SIPE_DEBUG_ERROR_NOFORMAT("tls_server_finished_resumed: no server Finished");
+		return(FALSE);
+	}
+
+	state->server_random.length = server_random->length;
+	state->server_random.buffer = g_memdup(server_random->data,
+					       server_random->length);
+	state->master_secret = g_memdup(state->session->master_secret,
+					TLS_ARRAY_MASTER_SECRET_LENGTH);
+	tls_calculate_keys(state);
+
+	/* decrypt server Finished + MAC */
+	context = sipe_crypt_cipher_start(SIPE_CRYPT_CIPHER_RC4,
+					  state->server_write_secret,
+					  state->key_length,
+					  NULL);
+	if (!context)
+		return(FALSE);
+	sipe_crypt_cipher_stream(context,
+				 state->encrypted_record + TLS_RECORD_HEADER_LENGTH,
+				 length + state->mac_length,
+				 plaintext);
+	sipe_crypt_cipher_destroy(context);
+
+	/* MAC is calculated over the plaintext TLS record, sequence number 0 */
+	memcpy(header, state->encrypted_record, TLS_RECORD_HEADER_LENGTH);
+	lowlevel_integer_to_tls(header + TLS_RECORD_OFFSET_LENGTH, 2, length);
+	lowlevel_integer_to_tls(sequence_number, sizeof(sequence_number), 0);
+	context = state->mac_start(state->server_write_mac_secret,
+				   state->mac_length);
+	sipe_digest_hmac_update(context, sequence_number, sizeof(sequence_number));
+	sipe_digest_hmac_update(context, header, sizeof(header));
+	sipe_digest_hmac_update(context, plaintext, length);
+	sipe_digest_hmac_end(context, mac);
+	sipe_digest_hmac_destroy(context);
+	if (!tls_memequal(mac, plaintext + length, state->mac_length) ||
+	    (plaintext[TLS_HANDSHAKE_OFFSET_TYPE] != TLS_HANDSHAKE_TYPE_FINISHED)) {
+		SIPE_DEBUG_ERROR_NOFORMAT("tls_server_finished_resumed: server Finished corrupted");
+		return(FALSE);
+	}
+
+	/* client Finished covers the server Finished too */
+	sipe_digest_md5_update(state->md5_context, plaintext, length);
+	sipe_digest_sha1_update(state->sha1_context, plaintext, length);
+
+	tls_client_finished(state);
+	tls_calculate_dsk_keys(state);
+	state->state = TLS_HANDSHAKE_STATE_COMPLETED;
+
+	SIPE_DEBUG_INFO("tls_server_finished_resumed: session for '%s' resumed",
+			state->target);
+
+	return(TRUE);
+}
+
+static gboolean tls_server_hello(struct tls_internal_state *state)
+{
+	const struct tls_parsed_value *session_id;
+	gboolean success = FALSE;
+	gsize start;
+
+	if (!tls_record_parse(state, TRUE))
+		return(FALSE);
+
+	session_id = &state->data->session_id;
+	if (state->session) {
+		/* server accepted our session? */
+		if (session_id->length &&
+		    (session_id->length == state->session->session_id_length) &&
+		    (memcmp(session_id->data,
+			    state->session->session_id,
+			    session_id->length) == 0)) {
+			success = tls_server_finished_resumed(state);
+			free_parse_data(state);
+			if (!success)
+				tls_session_drop(state);
+			return(success);
+		}
+
+		SIPE_DEBUG_INFO_NOFORMAT("tls_server_hello: server requested full handshake");
+		tls_session_drop(state);
+		tls_session_free(state->session);
+		state->session = NULL;
+	}
+
+	/* remember session ID for tls_session_store() */
+	if (session_id->length &&
+	    (session_id->length <= TLS_SESSION_ID_MAX_LENGTH)) {
+		state->session = g_new0(struct tls_session, 1);
+		state->session->session_id_length = session_id->length;
+		memcpy(state->session->session_id, session_id->data,
+		       session_id->length);
+	}
+
+	/* Part 1 */
+	start = tls_record_start(state, TLS_RECORD_TYPE_HANDSHAKE);
+	if (tls_client_certificate(state)  &&
+	    tls_client_key_exchange(state) &&
+	    tls_certificate_verify(state)) {
+		tls_record_end(state, start);
+
+		success = tls_record_parse(state, FALSE);
+		if (success) {
+			/* Part 2 & 3 - ChangeCipherSpec & encrypted Finished */
+			tls_client_finished(state);
+
+			state->state = TLS_HANDSHAKE_STATE_FINISHED;
+		}
+	}
+
+	free_parse_data(state);
+
+	return(success);
+}
+
+static gboolean tls_finished(struct tls_internal_state *state)
+{
+	if (!tls_record_parse(state, TRUE))
+		return(FALSE);
+
+	/* we don't need the data */
+	free_parse_data(state);
+
+	tls_calculate_dsk_keys(state);
+	tls_session_store(state);
 
 	state->common.out_buffer = NULL;
 	state->common.out_length = 0;
@@ -1716,6 +1925,7 @@ gboolean sipe_tls_next(struct sipe_tls_state *state)
 		return(FALSE);
 
 	state->out_buffer = NULL;
+	state->out_length = 0;
 
 	switch (internal->state) {
 	case TLS_HANDSHAKE_STATE_START:
@@ -1744,6 +1954,16 @@ gboolean sipe_tls_next(struct sipe_tls_state *state)
 	return(success);
 }
 
+void sipe_tls_set_target(struct sipe_tls_state *state,
+			 const gchar *target)
+{
+	/* Avoid "cast increases required alignment" errors */
+	struct tls_internal_state *internal = (void *) state;
+
+	if (state && target && !internal->target)
+		internal->target = g_strdup(target);
+}
+
 guint sipe_tls_expires(struct sipe_tls_state *state)
 {
 	/* Avoid "cast increases required alignment" errors */
@@ -1762,6 +1982,9 @@ void sipe_tls_free(struct sipe_tls_state *state)
 		struct tls_internal_state *internal = (void *) state;
 
 		free_parse_data(internal);
+		if (internal->session)
+			tls_session_free(internal->session);
+		g_free(internal->target);
 		if (internal->debug)
 			g_string_free(internal->debug, TRUE);
 		g_free(internal->tls_dsk_key_block);
@@ -1771,7 +1994,9 @@ void sipe_tls_free(struct sipe_tls_state *state)
 		sipe_tls_free_random(&internal->client_random);
 		sipe_tls_free_random(&internal->server_random);
 		if (internal->cipher_context)
-			sipe_crypt_tls_destroy(internal->cipher_context);
+			sipe_crypt_cipher_destroy(internal->cipher_context);
+		if (internal->mac_context)
+			sipe_digest_hmac_destroy(internal->mac_context);
 		if (internal->md5_context)
 			sipe_digest_md5_destroy(internal->md5_context);
 		if (internal->sha1_context)
@@ -110,6 +110,19 @@ struct sipe_tls_state *sipe_tls_start(gpointer certificate);
  */
 gboolean sipe_tls_next(struct sipe_tls_state *state);
 
+/**
+ * Set target for TLS session resumption
+ *
+ * Sessions are cached per target. If a valid session for the same target
+ * and certificate exists then the next handshake tries to resume it.
+ * Must be called before the first sipe_tls_next().
+ *
+ * @param state  pointer to TLS state structure
+ * @param target target name, e.g. server FQDN
+ */
+void sipe_tls_set_target(struct sipe_tls_state *state,
+			 const gchar *target);
+
 /**
  * Extract expiration time from TLS certificate
  *
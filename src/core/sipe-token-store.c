@@ -0,0 +1,684 @@
+/**
+ * @file sipe-token-store.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015-2016 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "sipe-common.h"
+#include "sipe-backend.h"
+#include "sipe-core.h"
+#include "sipe-core-private.h"
+#include "sipe-crypt.h"
+#include "sipe-digest.h"
+#include "sipe-metrics.h"
+#include "sipe-tls.h"
+#include "sipe-token-store.h"
+#include "sipe-utils.h"
+
+/*
+ * File layout:
+ *
+ *   magic | nonce | HMAC-SHA1(mac key, nonce | ciphertext) | ciphertext
+ *
+ * The ciphertext is AES-128-CTR with the nonce as initial counter block.
+ * Files with an older magic (RC4) are ignored and rewritten on update.
+ *
+ * The plaintext is a sequence of records, each consisting of 5 netstrings:
+ *
+ *   expires, service URI, port name, auth URI, token
+ */
+#define TOKEN_STORE_WEBTICKETS   "webtickets"
+#define TOKEN_STORE_MAGIC        "SIPETOK2"
+#define TOKEN_STORE_MAGIC_LENGTH (sizeof(TOKEN_STORE_MAGIC) - 1)
+#define TOKEN_STORE_NONCE_LENGTH 16
+#define TOKEN_STORE_KEY_LENGTH   SIPE_DIGEST_HMAC_SHA1_LENGTH
+#define TOKEN_STORE_AES_LENGTH   16
+#define TOKEN_STORE_HEADER_LENGTH (TOKEN_STORE_MAGIC_LENGTH + \
+				   TOKEN_STORE_NONCE_LENGTH + \
+				   SIPE_DIGEST_HMAC_SHA1_LENGTH)
+
+struct token_store_entry {
+	gchar *user;
+	gchar *service_uri;
+	const gchar *port_name; /* interned */
+	gchar *auth_uri;
+	gchar *token;
+	time_t expires;
+};
+
+/*
+ * Shared by all SIPE instances of the process. Every access to the tables
+ * must hold the lock. It is never held across a callback or file I/O.
+ */
+G_LOCK_DEFINE_STATIC(token_store);
+/* key: "<user>\n<service URI>", value: entry */
+static GHashTable *store = NULL;
+/* key: user name, value: same */
+static GHashTable *loaded = NULL;
+
+static void token_store_entry_free(gpointer data)
+{
+	struct token_store_entry *entry = data;
+	g_free(entry->token);
+	g_free(entry->auth_uri);
+	g_free(entry->service_uri);
+	g_free(entry->user);
+	g_free(entry);
+}
+
+/* caller must hold the lock */
+static void token_store_init(void)
+{
+	if (!store) {
+		store  = g_hash_table_new_full(g_str_hash,
+					       g_str_equal,
+					       g_free,
+					       token_store_entry_free);
+		loaded = g_hash_table_new_full(g_str_hash,
+					       g_str_equal,
+					       g_free,
+					       NULL);
+	}
+}
+
+static gchar *token_store_key(const gchar *user,
+			      const gchar *service_uri)
+{
+	return(g_strdup_printf("%s\n%s", user, service_uri));
+}
+
+static gchar *token_store_filename(struct sipe_core_private *sipe_private,
+				   const gchar *file)
+{
+	gchar *name = g_strdup(sipe_private->username);
+	gchar *filename;
+
+	g_strcanon(name,
+		   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@.-_",
+		   '_');
+	filename = g_build_filename(g_get_user_cache_dir(),
+				    "sipe",
+				    name,
+				    file,
+				    NULL);
+	g_free(name);
+
+	return(filename);
+}
+
+static gboolean token_store_write_file(const gchar *filename,
+				       const gchar *contents,
+				       gsize length)
+{
+	gchar *dirname = g_path_get_dirname(filename);
+	GError *error  = NULL;
+	gboolean ok    = (g_mkdir_with_parents(dirname, 0700) == 0) &&
+		g_file_set_contents(filename, contents, length, &error);
+
+	if (!ok) {
+		SIPE_DEBUG_ERROR("token_store_write_file: can't write '%s': %s",
+				 filename,
+				 error ? error->message : "can't create directory");
+		if (error)
+			g_error_free(error);
+	}
+	g_free(dirname);
+
+	return(ok);
+}
+
+/* per-installation secret, created on first use */
+static gboolean token_store_secret(guchar *secret)
+{
+	gchar *filename = g_build_filename(g_get_user_config_dir(),
+					   "sipe",
+					   "token.key",
+					   NULL);
+	gchar *contents;
+	gsize length;
+	gboolean ok;
+
+	if (g_file_get_contents(filename, &contents, &length, NULL)) {
+		ok = (length == TOKEN_STORE_KEY_LENGTH);
+		if (ok)
+			memcpy(secret, contents, TOKEN_STORE_KEY_LENGTH);
+		g_free(contents);
+	} else {
+		struct sipe_tls_random random;
+
+		sipe_tls_fill_random(&random, TOKEN_STORE_KEY_LENGTH * 8);
+		memcpy(secret, random.buffer, TOKEN_STORE_KEY_LENGTH);
+		sipe_tls_free_random(&random);
+		ok = token_store_write_file(filename,
+					    (const gchar *) secret,
+					    TOKEN_STORE_KEY_LENGTH);
+	}
+	g_free(filename);
+
+	return(ok);
+}
+
+/* key = HMAC-SHA1(secret, user | 0 | password) */
+static gboolean token_store_account_key(struct sipe_core_private *sipe_private,
+					guchar *key)
+{
+	guchar secret[TOKEN_STORE_KEY_LENGTH];
+	const gchar *password = sipe_private->password ? sipe_private->password : "";
+	gsize user_length     = strlen(sipe_private->username);
+	gsize length          = user_length + 1 + strlen(password);
+	guchar *data;
+
+	if (!token_store_secret(secret))
+		return(FALSE);
+
+	data = g_malloc(length);
+	memcpy(data, sipe_private->username, user_length + 1);
+	memcpy(data + user_length + 1, password, length - user_length - 1);
+	sipe_digest_hmac_sha1(secret, sizeof(secret), data, length, key);
+	memset(data, 0, length);
+	g_free(data);
+	memset(secret, 0, sizeof(secret));
+
+	return(TRUE);
+}
+
+/* digest = HMAC-SHA1(key, label | nonce | data) */
+static void token_store_derive(const guchar *key,
+			       const gchar *label,
+			       const guchar *nonce,
+			       const guchar *data,
+			       gsize data_length,
+			       guchar *digest)
+{
+	gsize label_length = strlen(label);
+	gsize length       = label_length + TOKEN_STORE_NONCE_LENGTH + data_length;
+	guchar *buffer     = g_malloc(length);
+
+	memcpy(buffer, label, label_length);
+	memcpy(buffer + label_length, nonce, TOKEN_STORE_NONCE_LENGTH);
+	if (data_length)
+		memcpy(buffer + label_length + TOKEN_STORE_NONCE_LENGTH,
+		       data, data_length);
+	sipe_digest_hmac_sha1(key, TOKEN_STORE_KEY_LENGTH,
+			      buffer, length,
+			      digest);
+	g_free(buffer);
+}
+
+/* AES-128-CTR: encryption & decryption are the same operation */
+static gboolean token_store_crypt(const guchar *key,
+				  const guchar *nonce,
+				  const guchar *in,
+				  gsize length,
+				  guchar *out)
+{
+	guchar digest[SIPE_DIGEST_HMAC_SHA1_LENGTH];
+	gpointer cipher;
+
+	token_store_derive(key, "enc", nonce, NULL, 0, digest);
+	cipher = sipe_crypt_cipher_start(SIPE_CRYPT_CIPHER_AES_128_CTR,
+					 digest, TOKEN_STORE_AES_LENGTH,
+					 nonce);
+	memset(digest, 0, sizeof(digest));
+	if (!cipher)
+		return(FALSE);
+
+	sipe_crypt_cipher_stream(cipher, in, length, out);
+	sipe_crypt_cipher_destroy(cipher);
+
+	return(TRUE);
+}
+
+static void token_store_netstring(GString *buffer,
+				  const gchar *string)
+{
+	gsize length = strlen(string);
+	g_string_append_printf(buffer, "%" G_GSIZE_FORMAT ":", length);
+	g_string_append_len(buffer, string, length);
+	g_string_append_c(buffer, ',');
+}
+
+/* returns newly allocated string and advances *start, NULL on error */
+static gchar *token_store_field(const gchar **start,
+				const gchar *end)
+{
+	const gchar *p = *start;
+	gchar *colon;
+	guint64 length = g_ascii_strtoull(p, &colon, 10);
+
+	if ((colon == p) || (colon >= end) || (*colon != ':') ||
+	    (length >= (guint64) (end - colon - 1)) ||
+	    (colon[length + 1] != ','))
+		return(NULL);
+
+	*start = colon + length + 2;
+	return(g_strndup(colon + 1, length));
+}
+
+/* encrypt & authenticate plaintext and write it to the user cache file */
+static gboolean token_store_encrypt(struct sipe_core_private *sipe_private,
+				    const gchar *file,
+				    const gchar *plain,
+				    gsize length)
+{
+	guchar key[TOKEN_STORE_KEY_LENGTH];
+	guchar digest[SIPE_DIGEST_HMAC_SHA1_LENGTH];
+	struct sipe_tls_random nonce;
+	GString *buffer;
+	gchar *filename;
+	gboolean ok;
+
+	if (!token_store_account_key(sipe_private, key))
+		return(FALSE);
+
+	sipe_tls_fill_random(&nonce, TOKEN_STORE_NONCE_LENGTH * 8);
+	buffer = g_string_sized_new(TOKEN_STORE_HEADER_LENGTH + length);
+	g_string_append(buffer, TOKEN_STORE_MAGIC);
+	g_string_append_len(buffer, (gchar *) nonce.buffer, TOKEN_STORE_NONCE_LENGTH);
+	/* placeholder for MAC */
+	g_string_set_size(buffer, TOKEN_STORE_HEADER_LENGTH + length);
+
+	ok = token_store_crypt(key, nonce.buffer,
+			       (const guchar *) plain, length,
+			       (guchar *) buffer->str + TOKEN_STORE_HEADER_LENGTH);
+	if (ok) {
+		token_store_derive(key, "mac", nonce.buffer,
+				   (guchar *) buffer->str + TOKEN_STORE_HEADER_LENGTH,
+				   length,
+				   digest);
+		memcpy(buffer->str + TOKEN_STORE_MAGIC_LENGTH + TOKEN_STORE_NONCE_LENGTH,
+		       digest, sizeof(digest));
+
+		filename = token_store_filename(sipe_private, file);
+		ok = token_store_write_file(filename, buffer->str, buffer->len);
+		g_free(filename);
+	}
+
+	sipe_tls_free_random(&nonce);
+	g_string_free(buffer, TRUE);
+	memset(key, 0, sizeof(key));
+
+	return(ok);
+}
+
+/* read user cache file, check authentication and decrypt it */
+static gchar *token_store_decrypt(struct sipe_core_private *sipe_private,
+				  const gchar *file,
+				  gsize *plain_length)
+{
+	guchar key[TOKEN_STORE_KEY_LENGTH];
+	gchar *filename = token_store_filename(sipe_private, file);
+	gchar *plain    = NULL;
+	gchar *contents;
+	gsize length;
+
+	if (g_file_get_contents(filename, &contents, &length, NULL)) {
+		if ((length >= TOKEN_STORE_HEADER_LENGTH) &&
+		    (memcmp(contents,
+			    TOKEN_STORE_MAGIC,
+			    TOKEN_STORE_MAGIC_LENGTH) == 0) &&
+		    token_store_account_key(sipe_private, key)) {
+			const guchar *nonce   = (guchar *) contents + TOKEN_STORE_MAGIC_LENGTH;
+			const guchar *mac     = nonce + TOKEN_STORE_NONCE_LENGTH;
+			const guchar *cipher  = mac + SIPE_DIGEST_HMAC_SHA1_LENGTH;
+			gsize cipher_length   = length - TOKEN_STORE_HEADER_LENGTH;
+			guchar digest[SIPE_DIGEST_HMAC_SHA1_LENGTH];
+
+			token_store_derive(key, "mac", nonce,
+					   cipher, cipher_length,
+					   digest);
+			if (memcmp(digest, mac, sizeof(digest)) == 0) {
+				plain = g_malloc(cipher_length + 1);
+
+				if (token_store_crypt(key, nonce,
+						      cipher, cipher_length,
+						      (guchar *) plain)) {
+					plain[cipher_length] = '\0';
+					*plain_length        = cipher_length;
+				} else {
+					g_free(plain);
+					plain = NULL;
+				}
+			} else {
+				SIPE_DEBUG_INFO("token_store_decrypt: authentication of '%s' failed - ignoring",
+						filename);
+			}
+			memset(key, 0, sizeof(key));
+		} else {
+			SIPE_DEBUG_INFO("token_store_decrypt: ignoring invalid file '%s'",
+					filename);
+		}
+		g_free(contents);
+	}
+	g_free(filename);
+
+	return(plain);
+}
+
+/* caller must hold the lock */
+static GString *token_store_serialize(struct sipe_core_private *sipe_private)
+{
+	GString *plain = g_string_new("");
+	time_t now = time(NULL);
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, store);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct token_store_entry *entry = value;
+
+		if (sipe_strequal(entry->user, sipe_private->username) &&
+		    (entry->expires > now)) {
+			gchar *expires = g_strdup_printf("%" G_GINT64_FORMAT,
+							 (gint64) entry->expires);
+			token_store_netstring(plain, expires);
+			token_store_netstring(plain, entry->service_uri);
+			token_store_netstring(plain, entry->port_name);
+			token_store_netstring(plain, entry->auth_uri);
+			token_store_netstring(plain, entry->token);
+			g_free(expires);
+		}
+	}
+
+	return(plain);
+}
+
+static void token_store_save(struct sipe_core_private *sipe_private,
+			     GString *plain)
+{
+	token_store_encrypt(sipe_private,
+			    TOKEN_STORE_WEBTICKETS,
+			    plain->str,
+			    plain->len);
+
+	memset(plain->str, 0, plain->len);
+	g_string_free(plain, TRUE);
+}
+
+/* caller must hold the lock */
+static void token_store_insert(const gchar *user,
+			       const gchar *service_uri,
+			       const gchar *port_name,
+			       const gchar *auth_uri,
+			       const gchar *token,
+			       time_t expires)
+{
+	struct token_store_entry *entry = g_new0(struct token_store_entry, 1);
+
+	entry->user        = g_strdup(user);
+	entry->service_uri = g_strdup(service_uri);
+	entry->port_name   = g_intern_string(port_name);
+	entry->auth_uri    = g_strdup(auth_uri);
+	entry->token       = g_strdup(token);
+	entry->expires     = expires;
+	g_hash_table_replace(store,
+			     token_store_key(user, service_uri),
+			     entry);
+}
+
+/* caller must hold the lock */
+static void token_store_parse(struct sipe_core_private *sipe_private,
+			      const gchar *p,
+			      const gchar *end)
+{
+	time_t now = time(NULL);
+
+	while (p < end) {
+		gchar *expires_string = token_store_field(&p, end);
+		gchar *service_uri    = expires_string ? token_store_field(&p, end) : NULL;
+		gchar *port_name      = service_uri    ? token_store_field(&p, end) : NULL;
+		gchar *auth_uri       = port_name      ? token_store_field(&p, end) : NULL;
+		gchar *token          = auth_uri       ? token_store_field(&p, end) : NULL;
+		gboolean valid        = (token != NULL);
+
+		if (valid) {
+			time_t expires = g_ascii_strtoll(expires_string, NULL, 10);
+			gchar *key     = token_store_key(sipe_private->username,
+							 service_uri);
+			struct token_store_entry *entry = g_hash_table_lookup(store,
+									      key);
+			g_free(key);
+
+			/* never replace a newer token from memory */
+			if ((expires > now) &&
+			    !(entry && (entry->expires >= expires))) {
+				SIPE_DEBUG_INFO("token_store_parse: restored token for URI %s",
+						service_uri);
+				token_store_insert(sipe_private->username,
+						   service_uri,
+						   port_name,
+						   auth_uri,
+						   token,
+						   expires);
+			}
+		} else {
+			SIPE_DEBUG_INFO_NOFORMAT("token_store_parse: ignoring corrupted record");
+		}
+
+		g_free(token);
+		g_free(auth_uri);
+		g_free(port_name);
+		g_free(service_uri);
+		g_free(expires_string);
+
+		if (!valid)
+			break;
+	}
+}
+
+void sipe_token_store_load(struct sipe_core_private *sipe_private)
+{
+	gchar *plain;
+	gsize length;
+
+	G_LOCK(token_store);
+	token_store_init();
+	if (g_hash_table_lookup(loaded, sipe_private->username)) {
+		G_UNLOCK(token_store);
+		return;
+	}
+	g_hash_table_insert(loaded,
+			    g_strdup(sipe_private->username),
+			    GINT_TO_POINTER(TRUE));
+	G_UNLOCK(token_store);
+
+	plain = token_store_decrypt(sipe_private,
+				    TOKEN_STORE_WEBTICKETS,
+				    &length);
+	if (plain) {
+		G_LOCK(token_store);
+		token_store_parse(sipe_private,
+				  plain,
+				  plain + length);
+		G_UNLOCK(token_store);
+		memset(plain, 0, length);
+		g_free(plain);
+	}
+}
+
+gboolean sipe_token_store_lookup(struct sipe_core_private *sipe_private,
+				 const gchar *service_uri,
+				 guint validity,
+				 gchar **auth_uri,
+				 gchar **token)
+{
+	struct token_store_entry *entry = NULL;
+
+	G_LOCK(token_store);
+	if (store) {
+		gchar *key = token_store_key(sipe_private->username,
+					     service_uri);
+		entry = g_hash_table_lookup(store, key);
+		g_free(key);
+	}
+
+	if (entry && (entry->expires < time(NULL) + (time_t) validity)) {
+		SIPE_DEBUG_INFO("sipe_token_store_lookup: cached token for URI %s has expired",
+				service_uri);
+		entry = NULL;
+	}
+
+	if (entry) {
+		*auth_uri = g_strdup(entry->auth_uri);
+		*token    = g_strdup(entry->token);
+	}
+	G_UNLOCK(token_store);
+
+	return(entry != NULL);
+}
+
+static gboolean token_store_expired(SIPE_UNUSED_PARAMETER gpointer key,
+				    gpointer value,
+				    gpointer data)
+{
+	return(((struct token_store_entry *) value)->expires <= *(time_t *) data);
+}
+
+void sipe_token_store_add(struct sipe_core_private *sipe_private,
+			  const gchar *service_uri,
+			  const gchar *port_name,
+			  const gchar *auth_uri,
+			  const gchar *token,
+			  time_t expires)
+{
+	time_t now = time(NULL);
+	GString *plain;
+
+	G_LOCK(token_store);
+	token_store_init();
+	g_hash_table_foreach_remove(store, token_store_expired, &now);
+	token_store_insert(sipe_private->username,
+			   service_uri,
+			   port_name,
+			   auth_uri,
+			   token,
+			   expires);
+	plain = token_store_serialize(sipe_private);
+	G_UNLOCK(token_store);
+
+	token_store_save(sipe_private, plain);
+}
+
+struct token_store_copy {
+	gchar *service_uri;
+	const gchar *port_name; /* interned */
+	time_t expires;
+};
+
+void sipe_token_store_foreach(struct sipe_core_private *sipe_private,
+			      sipe_token_store_callback *callback,
+			      gpointer data)
+{
+	time_t now = time(NULL);
+	GSList *entries = NULL;
+	GSList *entry;
+	GHashTableIter iter;
+	gpointer value;
+
+	/* callback may modify the store, i.e. it is called without lock */
+	G_LOCK(token_store);
+	if (store) {
+		g_hash_table_iter_init(&iter, store);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct token_store_entry *e = value;
+			if (sipe_strequal(e->user, sipe_private->username) &&
+			    (e->expires > now)) {
+				struct token_store_copy *copy = g_new(struct token_store_copy, 1);
+
+				copy->service_uri = g_strdup(e->service_uri);
+				copy->port_name   = e->port_name;
+				copy->expires     = e->expires;
+				entries = g_slist_prepend(entries, copy);
+			}
+		}
+	}
+	G_UNLOCK(token_store);
+
+	for (entry = entries; entry; entry = entry->next) {
+		struct token_store_copy *copy = entry->data;
+
+		callback(sipe_private,
+			 copy->service_uri,
+			 copy->port_name,
+			 copy->expires,
+			 data);
+		g_free(copy->service_uri);
+		g_free(copy);
+	}
+	g_slist_free(entries);
+}
+
+void sipe_token_store_memory_usage(struct sipe_core_private *sipe_private,
+				   struct sipe_memory_usage *usage)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	G_LOCK(token_store);
+	if (!store) {
+		G_UNLOCK(token_store);
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, store);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const struct token_store_entry *e = value;
+
+		if (!sipe_strequal(e->user, sipe_private->username))
+			continue;
+
+		sipe_metrics_memory_string(usage, key);
+		SIPE_MEMORY_OBJECT(usage, sizeof(struct token_store_entry));
+		sipe_metrics_memory_string(usage, e->user);
+		sipe_metrics_memory_string(usage, e->service_uri);
+		sipe_metrics_memory_string(usage, e->auth_uri);
+		sipe_metrics_memory_string(usage, e->token);
+		sipe_metrics_memory_list(usage, 1);
+	}
+	G_UNLOCK(token_store);
+}
+
+gboolean sipe_token_store_write_secure(struct sipe_core_private *sipe_private,
+				       const gchar *file,
+				       const gchar *data,
+				       gsize length)
+{
+	return(token_store_encrypt(sipe_private, file, data, length));
+}
+
+gchar *sipe_token_store_read_secure(struct sipe_core_private *sipe_private,
+				    const gchar *file,
+				    gsize *length)
+{
+	return(token_store_decrypt(sipe_private, file, length));
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,166 @@
+/**
+ * @file sipe-token-store.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015-2016 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Persistent Web Ticket store
+ *
+ * Tokens are kept in a process wide table keyed by user name and Web
+ * Service URI, i.e. they survive a disconnect and are shared by all
+ * accounts for the same user. The table is protected by a lock. Each
+ * update is written encrypted to the user cache directory, so that a
+ * restart doesn't require a new WS-Trust exchange either.
+ *
+ * The file is encrypted with AES-128-CTR and authenticated with
+ * HMAC-SHA1. The key is derived from a random secret in the user
+ * configuration directory and, when available, the account password.
+ * A file that fails the authentication check is ignored.
+ *
+ * Threat model: the encryption protects a copy of the cache directory
+ * on its own, e.g. in a backup or a synchronized profile. It does not
+ * protect against anybody who can read the configuration directory of
+ * the user as well, unless the password is not saved, because then the
+ * password is part of the key. Tokens are bearer credentials, i.e. the
+ * files must be treated like the saved password itself.
+ *
+ * The same file format is available for other per-account secrets, e.g.
+ * the TLS-DSK certificate cache.
+ */
+
+/* Forward declarations */
+struct sipe_core_private;
+struct sipe_memory_usage;
+
+/**
+ * Token store enumeration callback
+ *
+ * @param sipe_private SIPE core private data
+ * @param service_uri  Web Service base URI
+ * @param port_name    Web Service authentication port name
+ * @param expires      token expiration time
+ * @param data         user data
+ */
+typedef void (sipe_token_store_callback)(struct sipe_core_private *sipe_private,
+					 const gchar *service_uri,
+					 const gchar *port_name,
+					 time_t expires,
+					 gpointer data);
+
+/**
+ * Load tokens for this account from disk
+ *
+ * Does nothing if the tokens for this user have already been loaded.
+ *
+ * @param sipe_private SIPE core private data
+ */
+void sipe_token_store_load(struct sipe_core_private *sipe_private);
+
+/**
+ * Look up a token
+ *
+ * @param sipe_private SIPE core private data
+ * @param service_uri  Web Service base URI
+ * @param validity     token must still be valid for this many seconds
+ * @param auth_uri     returns Web Service auth. URI (must be g_free()'d)
+ * @param token        returns Web Ticket XML fragment (must be g_free()'d)
+ *
+ * @return @c TRUE if a valid token was found
+ */
+gboolean sipe_token_store_lookup(struct sipe_core_private *sipe_private,
+				 const gchar *service_uri,
+				 guint validity,
+				 gchar **auth_uri,
+				 gchar **token);
+
+/**
+ * Add or replace a token and update the file on disk
+ *
+ * @param sipe_private SIPE core private data
+ * @param service_uri  Web Service base URI
+ * @param port_name    Web Service authentication port name
+ * @param auth_uri     Web Service auth. URI
+ * @param token        Web Ticket XML fragment
+ * @param expires      token expiration time
+ */
+void sipe_token_store_add(struct sipe_core_private *sipe_private,
+			  const gchar *service_uri,
+			  const gchar *port_name,
+			  const gchar *auth_uri,
+			  const gchar *token,
+			  time_t expires);
+
+/**
+ * Enumerate all valid tokens for this account
+ *
+ * @param sipe_private SIPE core private data
+ * @param callback     called for each token
+ * @param data         user data for callback
+ */
+void sipe_token_store_foreach(struct sipe_core_private *sipe_private,
+			      sipe_token_store_callback *callback,
+			      gpointer data);
+
+/**
+ * Estimate memory used by the tokens for this account
+ *
+ * @param sipe_private SIPE core private data
+ * @param usage        accumulated memory usage
+ */
+void sipe_token_store_memory_usage(struct sipe_core_private *sipe_private,
+				   struct sipe_memory_usage *usage);
+
+/**
+ * Write data encrypted and authenticated to a file in the user cache directory
+ *
+ * @param sipe_private SIPE core private data
+ * @param file         file name, must not be "webtickets"
+ * @param data         plaintext
+ * @param length       length of plaintext
+ *
+ * @return @c TRUE if the file was written
+ */
+gboolean sipe_token_store_write_secure(struct sipe_core_private *sipe_private,
+				       const gchar *file,
+				       const gchar *data,
+				       gsize length);
+
+/**
+ * Read a file written with sipe_token_store_write_secure()
+ *
+ * @param sipe_private SIPE core private data
+ * @param file         file name
+ * @param length       returns length of plaintext
+ *
+ * @return NUL-terminated plaintext or @c NULL if the file is missing or
+ *         fails the authentication check. Should be wiped and @c g_free()'d
+ */
+gchar *sipe_token_store_read_secure(struct sipe_core_private *sipe_private,
+				    const gchar *file,
+				    gsize *length);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -31,12 +31,13 @@
  *  <http://msdn.microsoft.com/en-us/library/office/jj900502.aspx>
  * FindPeople operation
  *  <http://msdn.microsoft.com/en-us/library/office/jj191039.aspx>
+ * Streaming notifications
+ *  <http://msdn.microsoft.com/en-us/library/office/dn458792.aspx>
  */
 
 #include <string.h>
 
 #include <glib.h>
-#include <time.h>
 
 #include "sipe-backend.h"
 #include "sipe-buddy.h"
@@ -45,16 +46,50 @@
 #include "sipe-core-private.h"
 #include "sipe-digest.h"
 #include "sipe-ews-autodiscover.h"
+#include "sipe-ews-notify.h"
 #include "sipe-group.h"
 #include "sipe-http.h"
+#include "sipe-job.h"
 #include "sipe-nls.h"
+#include "sipe-schedule.h"
+#include "sipe-soap.h"
 #include "sipe-subscriptions.h"
 #include "sipe-ucs.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
+/* number of concurrent UCS requests, can be overridden from the environment */
+#define SIPE_UCS_DEFAULT_WINDOW 4
+#define SIPE_UCS_ENVIRONMENT_WINDOW "SIPE_UCS_CONCURRENCY"
+
+/* contacts & IM groups of the Lync contact list */
+#define UCS_NOTIFY_FOLDER_IDS \
+	"<t:DistinguishedFolderId Id=\"quickcontacts\"/>" \
+	"<t:DistinguishedFolderId Id=\"imcontactlist\"/>"
+#define UCS_REFRESH_ACTION "<+ucs-refresh>"
+#define UCS_REFRESH_DELAY  5 /* seconds, collects related changes */
+
+/* request body goes between these */
+#define UCS_ENVELOPE_PREFIX \
+	"<?xml version=\"1.0\"?>\r\n" \
+	"<soap:Envelope" \
+	" xmlns:m=\"http://schemas.microsoft.com/exchange/services/2006/messages\"" \
+	" xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\"" \
+	" xmlns:t=\"http://schemas.microsoft.com/exchange/services/2006/types\"" \
+	" >" \
+	" <soap:Header>" \
+	"  <t:RequestServerVersion Version=\"Exchange2013\" />" \
+	" </soap:Header>" \
+	" <soap:Body>" \
+	"  "
+#define UCS_ENVELOPE_SUFFIX \
+	" </soap:Body>" \
+	"</soap:Envelope>"
+
+/* requests of one transaction are sent one after the other */
 struct sipe_ucs_transaction {
 	GSList *pending_requests;
+	struct ucs_request *active_request; /* NULL if none is in flight */
 };
 
 typedef void (ucs_callback)(struct sipe_core_private *sipe_private,
@@ -68,16 +103,20 @@ struct ucs_request {
 	gpointer cb_data;
 	struct sipe_ucs_transaction *transaction;
 	struct sipe_http_request *request;
+	struct sipe_xml_push *push; /* parsing response while it arrives */
 };
 
 struct sipe_ucs {
-	struct ucs_request *active_request;
-	GSList *transactions;
-	GSList *default_transaction;
+	GQueue *transactions;       /* in order of priority */
+	GList *default_transaction; /* link in transactions */
+	guint active_requests;      /* over all transactions */
+	guint window;               /* maximum of active_requests */
 	gchar *ews_url;
-	time_t last_response;
+	struct sipe_ews_notify *notify; /* contact list changes */
+	gint64 last_response; /* sipe_utils_monotonic_sec() */
 	guint group_id;
 	gboolean migrated;
+	gboolean scheduling;
 	gboolean shutting_down;
 };
 
@@ -90,18 +129,21 @@ static void sipe_ucs_request_free(struct sipe_core_private *sipe_private,
 	/* remove request from transaction */
 	trans->pending_requests = g_slist_remove(trans->pending_requests,
 						 data);
-	sipe_private->ucs->active_request = NULL;
+	if (trans->active_request == data) {
+		trans->active_request = NULL;
+		ucs->active_requests--;
+	}
 
 	/* remove completed transactions (except default transaction) */
 	if (!trans->pending_requests &&
 	    (trans != ucs->default_transaction->data)) {
-		ucs->transactions = g_slist_remove(ucs->transactions,
-						   trans);
+		g_queue_remove(ucs->transactions, trans);
 		g_free(trans);
 	}
 
 	if (data->request)
 		sipe_http_request_cancel(data->request);
+	sipe_xml_push_free(data->push);
 	if (data->cb)
 		/* Callback: aborted */
 		(*data->cb)(sipe_private, NULL, NULL, data->cb_data);
@@ -110,6 +152,40 @@ static void sipe_ucs_request_free(struct sipe_core_private *sipe_private,
 }
 
 static void sipe_ucs_next_request(struct sipe_core_private *sipe_private);
+static void ucs_notify_start(struct sipe_core_private *sipe_private);
+static void sipe_ucs_response_parsed(struct sipe_core_private *sipe_private,
+				     const sipe_xml *xml,
+				     struct ucs_request *data)
+{
+	const sipe_xml *soap_body = sipe_xml_child(xml, "Body");
+
+	/* Callback: success */
+	(*data->cb)(sipe_private,
+		    data->transaction,
+		    soap_body,
+		    data->cb_data);
+
+	/* already been called */
+	data->cb = NULL;
+
+	sipe_ucs_request_free(sipe_private, data);
+	sipe_ucs_next_request(sipe_private);
+}
+
+static gsize sipe_ucs_http_body(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+				const gchar *body,
+				gsize length,
+				gpointer callback_data)
+{
+	struct ucs_request *data = callback_data;
+
+	if (!data->push)
+		data->push = sipe_xml_push_new();
+	sipe_xml_push_feed(data->push, body, length);
+
+	return(length);
+}
+
 static void sipe_ucs_http_response(struct sipe_core_private *sipe_private,
 				   guint status,
 				   SIPE_UNUSED_PARAMETER GSList *headers,
@@ -121,20 +197,18 @@ static void sipe_ucs_http_response(struct sipe_core_private *sipe_private,
 	SIPE_DEBUG_INFO("sipe_ucs_http_response: code %d", status);
 	data->request = NULL;
 
-	if ((status == SIPE_HTTP_STATUS_OK) && body) {
-		sipe_xml *xml = sipe_xml_parse(body, strlen(body));
-		const sipe_xml *soap_body = sipe_xml_child(xml, "Body");
-		/* Callback: success */
-		(*data->cb)(sipe_private,
-			    data->transaction,
-			    soap_body,
-			    data->cb_data);
+	if (status == SIPE_HTTP_STATUS_OK) {
+		/* response has been parsed while it was received */
+		sipe_xml *xml = sipe_xml_push_finish(data->push);
+		data->push = NULL;
+		sipe_ucs_response_parsed(sipe_private, xml, data);
 		sipe_xml_free(xml);
-	} else {
-		/* Callback: failed */
-		(*data->cb)(sipe_private, NULL, NULL, data->cb_data);
+		return;
 	}
 
+	/* Callback: failed */
+	(*data->cb)(sipe_private, NULL, NULL, data->cb_data);
+
 	/* already been called */
 	data->cb = NULL;
 
@@ -142,58 +216,80 @@ static void sipe_ucs_http_response(struct sipe_core_private *sipe_private,
 	sipe_ucs_next_request(sipe_private);
 }
 
+static gboolean sipe_ucs_send_request(struct sipe_core_private *sipe_private,
+				      struct ucs_request *data)
+{
+	struct sipe_ucs *ucs = sipe_private->ucs;
+	GString *soap = sipe_soap_new(UCS_ENVELOPE_PREFIX);
+	struct sipe_http_request *request;
+
+	g_string_append(soap, data->body);
+	g_string_append(soap, UCS_ENVELOPE_SUFFIX);
+	request = sipe_http_request_post_buffer(sipe_private,
+						ucs->ews_url,
+						NULL,
+						soap,
+						"text/xml; charset=UTF-8",
+						sipe_ucs_http_response,
+						data);
+
+	if (!request) {
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_ucs_send_request: failed to create HTTP connection");
+		return(FALSE);
+	}
+
+	g_free(data->body);
+	data->body    = NULL;
+	data->request = request;
+
+	data->transaction->active_request = data;
+	ucs->active_requests++;
+
+	sipe_core_email_authentication(sipe_private,
+				       request);
+	sipe_http_request_allow_redirect(request);
+	sipe_http_request_stream(request, sipe_ucs_http_body);
+	sipe_http_request_ready(request);
+
+	return(TRUE);
+}
+
 static void sipe_ucs_next_request(struct sipe_core_private *sipe_private)
 {
 	struct sipe_ucs *ucs = sipe_private->ucs;
-	struct sipe_ucs_transaction *trans;
+	GList *entry;
 
-	if (ucs->active_request || ucs->shutting_down || !ucs->ews_url)
+	/* called from a callback below: the loop will pick up new requests */
+	if (ucs->scheduling || ucs->shutting_down || !ucs->ews_url)
 		return;
+	ucs->scheduling = TRUE;
 
-	trans = ucs->transactions->data;
-	while (trans->pending_requests) {
-		struct ucs_request *data = trans->pending_requests->data;
-		gchar *soap = g_strdup_printf("<?xml version=\"1.0\"?>\r\n"
-					      "<soap:Envelope"
-					      " xmlns:m=\"http://schemas.microsoft.com/exchange/services/2006/messages\""
-					      " xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\""
-					      " xmlns:t=\"http://schemas.microsoft.com/exchange/services/2006/types\""
-					      " >"
-					      " <soap:Header>"
-					      "  <t:RequestServerVersion Version=\"Exchange2013\" />"
-					      " </soap:Header>"
-					      " <soap:Body>"
-					      "  %s"
-					      " </soap:Body>"
-					      "</soap:Envelope>",
-					      data->body);
-		struct sipe_http_request *request = sipe_http_request_post(sipe_private,
-									   ucs->ews_url,
-									   NULL,
-									   soap,
-									   "text/xml; charset=UTF-8",
-									   sipe_ucs_http_response,
-									   data);
-		g_free(soap);
-
-		if (request) {
-			g_free(data->body);
-			data->body    = NULL;
-			data->request = request;
-
-			ucs->active_request = data;
-
-			sipe_core_email_authentication(sipe_private,
-						       request);
-			sipe_http_request_allow_redirect(request);
-			sipe_http_request_ready(request);
+	/*
+	 * Start the first request of every idle transaction, in order of
+	 * priority, until the window is full.
+	 */
+	entry = ucs->transactions->head;
+	while (entry && (ucs->active_requests < ucs->window)) {
+		struct sipe_ucs_transaction *trans = entry->data;
+
+		/* request failure may remove the transaction */
+		entry = entry->next;
+
+		while (trans->pending_requests && !trans->active_request) {
+			struct ucs_request *data = trans->pending_requests->data;
+			gboolean last = (trans->pending_requests->next == NULL);
+
+			if (sipe_ucs_send_request(sipe_private, data))
+				break;
 
-			break;
-		} else {
-			SIPE_DEBUG_ERROR_NOFORMAT("sipe_ucs_next_request: failed to create HTTP connection");
 			sipe_ucs_request_free(sipe_private, data);
+			if (last)
+				/* trans is no longer valid */
+				break;
 		}
 	}
+
+	ucs->scheduling = FALSE;
 }
 
 static gboolean sipe_ucs_http_request(struct sipe_core_private *sipe_private,
@@ -229,21 +325,91 @@ static gboolean sipe_ucs_http_request(struct sipe_core_private *sipe_private,
 	}
 }
 
+static struct sipe_ucs_transaction *ucs_transaction_new(struct sipe_ucs *ucs,
+							gboolean background)
+{
+	struct sipe_ucs_transaction *trans = g_new0(struct sipe_ucs_transaction, 1);
+
+	/*
+	 * insert new transactions before default transaction,
+	 * background transactions go behind all others
+	 */
+	if (background || !ucs->default_transaction)
+		g_queue_push_tail(ucs->transactions, trans);
+	else
+		g_queue_insert_before(ucs->transactions,
+				      ucs->default_transaction,
+				      trans);
+
+	return(trans);
+}
+
 struct sipe_ucs_transaction *sipe_ucs_transaction(struct sipe_core_private *sipe_private)
 {
 	struct sipe_ucs *ucs = sipe_private->ucs;
-	struct sipe_ucs_transaction *trans;
 
 	if (!ucs)
 		return(NULL);
 
-	/* always insert new transactions before default transaction */
-	trans = g_new0(struct sipe_ucs_transaction, 1);
-	ucs->transactions = g_slist_insert_before(ucs->transactions,
-						  ucs->default_transaction,
-						  trans);
+	return(ucs_transaction_new(ucs, FALSE));
+}
 
-	return(trans);
+struct ucs_photo {
+	gchar *uri;
+	gchar *base64;
+	/* result, filled by worker thread */
+	guchar *photo;
+	gsize photo_size;
+	gchar *hash;
+};
+
+static void ucs_photo_free(gpointer data)
+{
+	struct ucs_photo *job = data;
+	g_free(job->hash);
+	g_free(job->photo);
+	g_free(job->base64);
+	g_free(job->uri);
+	g_free(job);
+}
+
+/* worker thread */
+static gpointer ucs_photo_decode(gpointer data)
+{
+	struct ucs_photo *job = data;
+	guchar digest[SIPE_DIGEST_SHA1_LENGTH];
+
+	/* decode photo data */
+	job->photo = g_base64_decode(job->base64, &job->photo_size);
+
+	/* EWS doesn't provide a hash -> calculate SHA-1 digest */
+	sipe_digest_sha1(job->photo, job->photo_size, digest);
+	job->hash = buff_to_hex_str(digest, SIPE_DIGEST_SHA1_LENGTH);
+
+	return(NULL);
+}
+
+/* main thread */
+static void ucs_photo_decoded(struct sipe_core_private *sipe_private,
+			      SIPE_UNUSED_PARAMETER gpointer result,
+			      gpointer data)
+{
+	struct ucs_photo *job = data;
+
+	/* unchanged photo: skip backend update, i.e. icon file write */
+	if (!sipe_strequal(job->hash,
+			   sipe_backend_buddy_get_photo_hash(SIPE_CORE_PUBLIC,
+							     job->uri))) {
+		/* backend frees "photo" */
+		sipe_backend_buddy_set_photo(SIPE_CORE_PUBLIC,
+					     job->uri,
+					     job->photo,
+					     job->photo_size,
+					     job->hash);
+		job->photo = NULL;
+	}
+
+	sipe_buddy_photo_done(sipe_private, job->uri);
 }
 
 static void sipe_ucs_get_user_photo_response(struct sipe_core_private *sipe_private,
@@ -256,31 +422,22 @@ static void sipe_ucs_get_user_photo_response(struct sipe_core_private *sipe_priv
 					      "GetUserPhotoResponse/PictureData");
 
 	if (node) {
-		gchar *base64;
-		gsize photo_size;
-		guchar *photo;
-		guchar digest[SIPE_DIGEST_SHA1_LENGTH];
-		gchar *digest_string;
-
-		/* decode photo data */
-		base64 = sipe_xml_data(node);
-		photo = g_base64_decode(base64, &photo_size);
-		g_free(base64);
-
-		/* EWS doesn't provide a hash -> calculate SHA-1 digest */
-		sipe_digest_sha1(photo, photo_size, digest);
-		digest_string = buff_to_hex_str(digest,
-						SIPE_DIGEST_SHA1_LENGTH);
-
-		/* backend frees "photo" */
-		sipe_backend_buddy_set_photo(SIPE_CORE_PUBLIC,
-					     uri,
-					     photo,
-					     photo_size,
-					     digest_string);
-		g_free(digest_string);
+		const gchar *base64 = sipe_xml_data_view(node, NULL);
+		struct ucs_photo *job = g_new0(struct ucs_photo, 1);
+
+		/* decode & hash off the main loop, job takes over "uri" */
+		job->uri    = uri;
+		job->base64 = g_strdup(base64 ? base64 : "");
+		sipe_job_submit(sipe_private,
+				ucs_photo_decode,
+				ucs_photo_decoded,
+				job,
+				ucs_photo_free,
+				NULL);
+		return;
 	}
 
+	sipe_buddy_photo_done(sipe_private, uri);
 	g_free(uri);
 }
 
@@ -294,12 +451,17 @@ void sipe_ucs_get_photo(struct sipe_core_private *sipe_private,
 				      "</m:GetUserPhoto>",
 				      sipe_get_no_sip_uri(uri));
 
+	/* independent of all other requests, low priority */
 	if (!sipe_ucs_http_request(sipe_private,
+				   sipe_private->ucs ?
+				   ucs_transaction_new(sipe_private->ucs, TRUE) :
 				   NULL,
 				   body,
 				   sipe_ucs_get_user_photo_response,
-				   payload))
+				   payload)) {
+		sipe_buddy_photo_done(sipe_private, uri);
 		g_free(payload);
+	}
 }
 
 static void sipe_ucs_search_response(struct sipe_core_private *sipe_private,
@@ -307,9 +469,8 @@ static void sipe_ucs_search_response(struct sipe_core_private *sipe_private,
 				     const sipe_xml *body,
 				     gpointer callback_data)
 {
+	guint search_id = GPOINTER_TO_UINT(callback_data);
 	const sipe_xml *persona_node;
-	struct sipe_backend_search_results *results = NULL;
-	guint match_count = 0;
 
 	for (persona_node = sipe_xml_child(body,
 					   "FindPeopleResponse/People/Persona");
@@ -325,20 +486,6 @@ static void sipe_ucs_search_response(struct sipe_core_private *sipe_private,
 			gchar *company;
 			gchar *email;
 
-			/* OK, we found something - show the results to the user */
-			match_count++;
-			if (!results) {
-				results = sipe_backend_search_results_start(SIPE_CORE_PUBLIC,
-									    callback_data);
-				if (!results) {
-					SIPE_DEBUG_ERROR_NOFORMAT("sipe_ucs_search_response: Unable to display the search results.");
-					sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-								   callback_data,
-								   _("Unable to display the search results"));
-					return;
-				}
-			}
-
 			uri         = sipe_xml_data(address);
 			displayname = sipe_xml_data(sipe_xml_child(persona_node,
 								   "DisplayName"));
@@ -347,13 +494,13 @@ static void sipe_ucs_search_response(struct sipe_core_private *sipe_private,
 			email       = sipe_xml_data(sipe_xml_child(persona_node,
 								   "EmailAddress/EmailAddress"));
 
-			sipe_backend_search_results_add(SIPE_CORE_PUBLIC,
-							results,
-							sipe_get_no_sip_uri(uri),
-							displayname,
-							company,
-							NULL,
-							email);
+			sipe_buddy_search_add(sipe_private,
+					      search_id,
+					      sipe_get_no_sip_uri(uri),
+					      displayname,
+					      company,
+					      NULL,
+					      email);
 
 			g_free(email);
 			g_free(company);
@@ -362,19 +509,12 @@ static void sipe_ucs_search_response(struct sipe_core_private *sipe_private,
 		}
 	}
 
-	if (match_count > 0)
-		sipe_buddy_search_contacts_finalize(sipe_private,
-						    results,
-						    match_count,
-						    FALSE);
-	else
-		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-					   callback_data,
-					   _("No contacts found"));
+	/* shows "No contacts found" if nothing was added */
+	sipe_buddy_search_finish(sipe_private, search_id, FALSE);
 }
 
 void sipe_ucs_search(struct sipe_core_private *sipe_private,
-		     struct sipe_backend_search_token *token,
+		     guint search_id,
 		     const gchar *given_name,
 		     const gchar *surname,
 		     const gchar *email,
@@ -440,18 +580,19 @@ void sipe_ucs_search(struct sipe_core_private *sipe_private,
 						      "</m:FindPeople>",
 						      query->str);
 
+		/* independent of all other requests */
 		if (!sipe_ucs_http_request(sipe_private,
-					   NULL,
+					   sipe_ucs_transaction(sipe_private),
 					   body,
 					   sipe_ucs_search_response,
-					   token))
-			sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-						   token,
-						   _("Contact search failed"));
+					   GUINT_TO_POINTER(search_id)))
+			sipe_buddy_search_failed(sipe_private,
+						 search_id,
+						 _("Contact search failed"));
 	} else
-		sipe_backend_search_failed(SIPE_CORE_PUBLIC,
-					   token,
-					   _("Invalid contact search query"));
+		sipe_buddy_search_failed(sipe_private,
+					 search_id,
+					 _("Invalid contact search query"));
 
 	g_string_free(query, TRUE);
 }
@@ -462,7 +603,7 @@ static void sipe_ucs_ignore_response(struct sipe_core_private *sipe_private,
 				     SIPE_UNUSED_PARAMETER gpointer callback_data)
 {
 	SIPE_DEBUG_INFO_NOFORMAT("sipe_ucs_ignore_response: done");
-	sipe_private->ucs->last_response = time(NULL);
+	sipe_private->ucs->last_response = sipe_utils_monotonic_sec();
 }
 
 static void ucs_extract_keys(const sipe_xml *persona_node,
@@ -485,21 +626,17 @@ static void ucs_extract_keys(const sipe_xml *persona_node,
 	     attr_node = sipe_xml_twin(attr_node)) {
 		const sipe_xml *id_node = sipe_xml_child(attr_node,
 							 "SourceId");
-		gchar *hidden = sipe_xml_data(sipe_xml_child(attr_node,
-							     "IsHidden"));
-		gchar *quick = sipe_xml_data(sipe_xml_child(attr_node,
-							    "IsQuickContact"));
-		if (id_node &&
-		    sipe_strcase_equal(hidden, "false") &&
-		    sipe_strcase_equal(quick,  "true")) {
+		gboolean hidden = sipe_xml_data_boolean(sipe_xml_child(attr_node,
+								       "IsHidden"),
+							TRUE);
+		gboolean quick = sipe_xml_data_boolean(sipe_xml_child(attr_node,
+								      "IsQuickContact"),
+						       FALSE);
+		if (id_node && !hidden && quick) {
 			*key = sipe_xml_attribute(id_node, "Id");
 			*change = sipe_xml_attribute(id_node, "ChangeKey");
-			g_free(quick);
-			g_free(hidden);
 			break;
 		}
-		g_free(quick);
-		g_free(hidden);
 	}
 }
 
@@ -513,7 +650,7 @@ static void sipe_ucs_add_new_im_contact_to_group_response(struct sipe_core_priva
 	const sipe_xml *persona_node = sipe_xml_child(body,
 						      "AddNewImContactToGroupResponse/Persona");
 
-	sipe_private->ucs->last_response = time(NULL);
+	sipe_private->ucs->last_response = sipe_utils_monotonic_sec();
 
 	if (persona_node                  &&
 	    buddy                         &&
@@ -621,12 +758,18 @@ static struct sipe_group *ucs_create_group(struct sipe_core_private *sipe_privat
 	if (!(is_empty(key) || is_empty(change))) {
 		gchar *name = sipe_xml_data(sipe_xml_child(group_node,
 							   "DisplayName"));
+		guint id;
+
+		/* sipe_group must have unique ID, also against restored groups */
+		do {
+			id = ++sipe_private->ucs->group_id;
+		} while (sipe_group_find_by_id(sipe_private, id));
+
 		group = sipe_group_add(sipe_private,
 				       name,
 				       key,
 				       change,
-				       /* sipe_group must have unique ID */
-				       ++sipe_private->ucs->group_id);
+				       id);
 		g_free(name);
 	}
 
@@ -643,7 +786,7 @@ static void sipe_ucs_add_im_group_response(struct sipe_core_private *sipe_privat
 						    "AddImGroupResponse/ImGroup");
 	struct sipe_group *group = ucs_create_group(sipe_private, group_node);
 
-	sipe_private->ucs->last_response = time(NULL);
+	sipe_private->ucs->last_response = sipe_utils_monotonic_sec();
 
 	if (group) {
 		struct sipe_buddy *buddy = sipe_buddy_find_by_uri(sipe_private,
@@ -762,8 +905,9 @@ static void sipe_ucs_get_im_item_list_response(struct sipe_core_private *sipe_pr
 		for (persona_node = sipe_xml_child(node, "Personas/Persona");
 		     persona_node;
 		     persona_node = sipe_xml_twin(persona_node)) {
-			gchar *address = sipe_xml_data(sipe_xml_child(persona_node,
-								      "ImAddress"));
+			const gchar *address = sipe_xml_data_view(sipe_xml_child(persona_node,
+										 "ImAddress"),
+								  NULL);
 			const gchar *key = NULL;
 			const gchar *change = NULL;
 
@@ -785,13 +929,12 @@ static void sipe_ucs_get_im_item_list_response(struct sipe_core_private *sipe_pr
 
 				/* hash table takes ownership of alias */
 				g_hash_table_insert(uri_to_alias,
-						    buddy->name,
+						    (gpointer) buddy->name,
 						    alias);
 
 				SIPE_DEBUG_INFO("sipe_ucs_get_im_item_list_response: persona URI '%s' key '%s' change '%s'",
 						buddy->name, key, change);
 			}
-			g_free(address);
 		}
 
 		for (group_node = sipe_xml_child(node, "Groups/ImGroup");
@@ -828,9 +971,13 @@ static void sipe_ucs_get_im_item_list_response(struct sipe_core_private *sipe_pr
 			sipe_group_update_finish(sipe_private);
 		} else {
 			sipe_buddy_cleanup_local_list(sipe_private);
+			sipe_buddy_status_flush(sipe_private);
 			sipe_backend_buddy_list_processing_finish(SIPE_CORE_PUBLIC);
 			sipe_subscribe_presence_initial(sipe_private);
 		}
+
+		/* wait for changes instead of fetching the whole list again */
+		ucs_notify_start(sipe_private);
 	} else if (sipe_private->ucs) {
 		SIPE_DEBUG_ERROR_NOFORMAT("sipe_ucs_get_im_item_list_response: query failed, contact list operations will not work!");
 		ucs_init_failure(sipe_private);
@@ -848,6 +995,122 @@ static void ucs_get_im_item_list(struct sipe_core_private *sipe_private)
 				      NULL);
 }
 
+static void ucs_refresh_cb(struct sipe_core_private *sipe_private,
+			   SIPE_UNUSED_PARAMETER gpointer data)
+{
+	SIPE_DEBUG_INFO_NOFORMAT("ucs_refresh_cb: contact list changed");
+	ucs_get_im_item_list(sipe_private);
+}
+
+/* returns FALSE if the change can't be applied to the local list */
+static gboolean ucs_notify_apply(struct sipe_core_private *sipe_private,
+				 const gchar *type,
+				 const sipe_xml *event_node)
+{
+	const sipe_xml *item_node = sipe_xml_child(event_node, "ItemId");
+	struct sipe_buddy *buddy;
+
+	/* folder changes, new contacts & IM groups */
+	if (!item_node                          ||
+	    sipe_strequal(type, "CreatedEvent") ||
+	    sipe_strequal(type, "MovedEvent"))
+		return(FALSE);
+
+	/* unknown item, e.g. IM group membership changed */
+	buddy = sipe_buddy_find_by_exchange_key(sipe_private,
+						sipe_xml_attribute(item_node,
+								   "Id"));
+	if (!buddy)
+		return(FALSE);
+
+	if (sipe_strequal(type, "DeletedEvent")) {
+		SIPE_DEBUG_INFO("ucs_notify_apply: persona URI '%s' deleted",
+				buddy->name);
+		sipe_buddy_remove(sipe_private, buddy);
+	} else {
+		const gchar *change = sipe_xml_attribute(item_node,
+							 "ChangeKey");
+
+		if (is_empty(change))
+			return(FALSE);
+
+		/* next request for this contact must use the new key */
+		SIPE_DEBUG_INFO("ucs_notify_apply: persona URI '%s' change '%s'",
+				buddy->name, change);
+		sipe_buddy_add_keys(sipe_private, buddy, NULL, change);
+	}
+
+	return(TRUE);
+}
+
+static void ucs_notify_cb(struct sipe_core_private *sipe_private,
+			  enum sipe_ews_notify_state state,
+			  const sipe_xml *notification,
+			  SIPE_UNUSED_PARAMETER gpointer callback_data)
+{
+	static const gchar * const types[] = {
+		"CreatedEvent",
+		"DeletedEvent",
+		"ModifiedEvent",
+		"MovedEvent",
+		NULL
+	};
+	gboolean refresh = FALSE;
+	guint i;
+
+	switch (state) {
+	case SIPE_EWS_NOTIFY_EVENTS:
+		for (i = 0; types[i]; i++) {
+			const sipe_xml *event_node;
+
+			for (event_node = sipe_xml_child(notification, types[i]);
+			     event_node;
+			     event_node = sipe_xml_twin(event_node))
+				if (!ucs_notify_apply(sipe_private,
+						      types[i],
+						      event_node))
+					refresh = TRUE;
+		}
+
+		/* see sipe_ucs_init() */
+		if (refresh &&
+		    ((sipe_utils_monotonic_sec() - sipe_private->ucs->last_response) < 10)) {
+			SIPE_DEBUG_INFO_NOFORMAT("ucs_notify_cb: ignoring this contact list change - triggered by our last change");
+			refresh = FALSE;
+		}
+		break;
+	case SIPE_EWS_NOTIFY_RESYNC:
+		/* changes might have been missed */
+		refresh = TRUE;
+		break;
+	case SIPE_EWS_NOTIFY_LOST:
+		/* contact list update triggers are used until it comes back */
+		break;
+	}
+
+	if (refresh)
+		sipe_schedule_seconds(sipe_private,
+				      UCS_REFRESH_ACTION,
+				      NULL,
+				      UCS_REFRESH_DELAY,
+				      ucs_refresh_cb,
+				      NULL);
+}
+
+static void ucs_notify_start(struct sipe_core_private *sipe_private)
+{
+	struct sipe_ucs *ucs = sipe_private->ucs;
+
+	if (!ucs->notify)
+		ucs->notify = sipe_ews_notify_start(sipe_private,
+						    "ucs",
+						    ucs->ews_url,
+						    "Exchange2013",
+						    UCS_NOTIFY_FOLDER_IDS,
+						    ucs_notify_cb,
+						    NULL);
+}
+
 static void ucs_set_ews_url(struct sipe_core_private *sipe_private,
 		      const gchar *ews_url)
 {
@@ -890,6 +1153,7 @@ void sipe_ucs_init(struct sipe_core_private *sipe_private,
 		   gboolean migrated)
 {
 	struct sipe_ucs *ucs;
+	const gchar *window;
 
 	if (sipe_private->ucs) {
 		struct sipe_ucs *ucs = sipe_private->ucs;
@@ -902,7 +1166,9 @@ void sipe_ucs_init(struct sipe_core_private *sipe_private,
 		 * by our own changes to the contact list.
 		 */
 		if (SIPE_CORE_PRIVATE_FLAG_IS(SUBSCRIBED_BUDDIES)) {
-			if ((time(NULL) - ucs->last_response) >= 10)
+			if (sipe_ews_notify_active(ucs->notify))
+				SIPE_DEBUG_INFO_NOFORMAT("sipe_ucs_init: ignoring this contact list update - changes are pushed by EWS");
+			else if ((sipe_utils_monotonic_sec() - ucs->last_response) >= 10)
 				ucs_get_im_item_list(sipe_private);
 			else
 				SIPE_DEBUG_INFO_NOFORMAT("sipe_ucs_init: ignoring this contact list update - triggered by our last change");
@@ -914,10 +1180,19 @@ void sipe_ucs_init(struct sipe_core_private *sipe_private,
 
 	sipe_private->ucs = ucs = g_new0(struct sipe_ucs, 1);
 	ucs->migrated           = migrated;
+	ucs->transactions       = g_queue_new();
+	ucs->window             = SIPE_UCS_DEFAULT_WINDOW;
+
+	window = g_getenv(SIPE_UCS_ENVIRONMENT_WINDOW);
+	if (window) {
+		guint64 value = g_ascii_strtoull(window, NULL, 10);
+		if ((value > 0) && (value <= G_MAXUINT))
+			ucs->window = value;
+	}
 
 	/* create default transaction */
-	sipe_ucs_transaction(sipe_private);
-	ucs->default_transaction = ucs->transactions;
+	ucs_transaction_new(ucs, FALSE);
+	ucs->default_transaction = ucs->transactions->head;
 
 	if (migrated) {
 		/* user specified a service URL? */
@@ -935,7 +1210,7 @@ void sipe_ucs_init(struct sipe_core_private *sipe_private,
 void sipe_ucs_free(struct sipe_core_private *sipe_private)
 {
 	struct sipe_ucs *ucs = sipe_private->ucs;
-	GSList *entry;
+	GList *entry;
 
 	if (!ucs)
 		return;
@@ -943,7 +1218,10 @@ void sipe_ucs_free(struct sipe_core_private *sipe_private)
 	/* UCS stack is shutting down: reject all new requests */
 	ucs->shutting_down = TRUE;
 
-	entry = ucs->transactions;
+	sipe_schedule_cancel(sipe_private, UCS_REFRESH_ACTION);
+	sipe_ews_notify_free(ucs->notify);
+
+	entry = ucs->transactions->head;
 	while (entry) {
 		struct sipe_ucs_transaction *trans = entry->data;
 		GSList *entry2 = trans->pending_requests;
@@ -962,7 +1240,9 @@ void sipe_ucs_free(struct sipe_core_private *sipe_private)
 
 	}
 	/* only default transaction is left... */
-	sipe_utils_slist_free_full(ucs->transactions, g_free);
+	while (!g_queue_is_empty(ucs->transactions))
+		g_free(g_queue_pop_head(ucs->transactions));
+	g_queue_free(ucs->transactions);
 
 	g_free(ucs->ews_url);
 	g_free(ucs);
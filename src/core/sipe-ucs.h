@@ -45,7 +45,7 @@ void sipe_ucs_get_photo(struct sipe_core_private *sipe_private,
  * This is not directly related to UCS, but we can reuse the code.
  *
  * @param sipe_private SIPE core private data
- * @param token        opaque search token provided by backend
+ * @param search_id    contact search ID, see sipe-buddy.h
  * @param given_name   search parameters provided by the user...
  * @param surname
  * @param email
@@ -54,7 +54,7 @@ void sipe_ucs_get_photo(struct sipe_core_private *sipe_private,
  * @param country
  */
 void sipe_ucs_search(struct sipe_core_private *sipe_private,
-		     struct sipe_backend_search_token *token,
+		     guint search_id,
 		     const gchar *given_name,
 		     const gchar *surname,
 		     const gchar *email,
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-13 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -35,6 +35,7 @@
 #include "sipe-core-private.h"
 #include "sipe-dialog.h"
 #include "sipe-im.h"
+#include "sipe-metrics.h"
 #include "sipe-nls.h"
 #include "sipe-session.h"
 #include "sipe-user.h"
@@ -98,22 +99,83 @@ void sipe_user_present_message_undelivered(struct sipe_core_private *sipe_privat
 	g_free(msg);
 }
 
+/*
+ * Typing notifications
+ *
+ * The backend reports typing repeatedly, e.g. libpurple every 4 seconds.
+ * Each report would be an INFO on the dialog, so only state changes and
+ * refreshes after the minimum interval are sent. Nothing is sent while a
+ * MESSAGE or the previous INFO is outstanding on the dialog, because two
+ * requests in short succession can be rejected with
+ *
+ *    SIP/2.0 500 Stale CSeq Value
+ *
+ * The interval can be changed with the environment variable
+ * SIPE_TYPING_INTERVAL (in seconds). It should stay below the timeout of
+ * the receiving side, e.g. 6 seconds for SIPE.
+ */
+#define SIPE_TYPING_INTERVAL             4000  /* milliseconds */
+#define SIPE_TYPING_ENVIRONMENT_INTERVAL "SIPE_TYPING_INTERVAL"
+/* give up waiting for an INFO response (64*T1) */
+#define SIPE_TYPING_IN_FLIGHT_TIMEOUT    32000 /* milliseconds */
+
+static guint typing_interval(struct sipe_core_private *sipe_private)
+{
+	if (!sipe_private->typing_interval) {
+		const gchar *interval = g_getenv(SIPE_TYPING_ENVIRONMENT_INTERVAL);
+
+		sipe_private->typing_interval = SIPE_TYPING_INTERVAL;
+		if (interval) {
+			guint64 value = g_ascii_strtoull(interval, NULL, 10);
+			if ((value > 0) && (value <= G_MAXUINT / 1000))
+				sipe_private->typing_interval = value * 1000;
+		}
+	}
+	return(sipe_private->typing_interval);
+}
+
+static gboolean typing_suppressed(struct sipe_core_private *sipe_private,
+				  struct sip_session *session,
+				  struct sip_dialog *dialog,
+				  gboolean typing,
+				  gint64 now)
+{
+	gint64 elapsed = now - dialog->typing_sent;
+
+	/* other side already has this state: only "type" needs a refresh */
+	if ((typing == dialog->typing_active) &&
+	    (!typing || (elapsed < typing_interval(sipe_private))))
+		return(TRUE);
+
+	if (dialog->typing_in_flight &&
+	    (elapsed < SIPE_TYPING_IN_FLIGHT_TIMEOUT))
+		return(TRUE);
+
+	return(sipe_im_dialog_busy(session, dialog));
+}
+
 static gboolean process_info_typing_response(struct sipe_core_private *sipe_private,
 					     struct sipmsg *msg,
 					     SIPE_UNUSED_PARAMETER struct transaction *trans)
 {
-	/* Indicates dangling IM session which needs to be dropped */
-	if (msg->response == 408 || /* Request timeout */
-	    msg->response == 480 || /* Temporarily Unavailable */
-	    msg->response == 481) { /* Call/Transaction Does Not Exist */
-		gchar *with = parse_from(sipmsg_find_header(msg, "To"));
-		struct sip_session *session = sipe_session_find_im(sipe_private, with);
-		struct sip_dialog *dialog = sipe_dialog_find(session, with);
-		if (dialog)
+	gchar *with = parse_from(sipmsg_find_header(msg, "To"));
+	struct sip_session *session = sipe_session_find_im(sipe_private, with);
+	struct sip_dialog *dialog = sipe_dialog_find(session, with);
+
+	if (dialog) {
+		if (dialog->typing_in_flight)
+			sipe_dialog_rtt_sample(dialog, dialog->typing_sent);
+		dialog->typing_in_flight = FALSE;
+
+		/* Indicates dangling IM session which needs to be dropped */
+		if (msg->response == 408 || /* Request timeout */
+		    msg->response == 480 || /* Temporarily Unavailable */
+		    msg->response == 481)   /* Call/Transaction Does Not Exist */
 			sipe_im_cancel_dangling(sipe_private, session, dialog, with,
 						sipe_im_cancel_unconfirmed);
-		g_free(with);
-	}	
+	}
+	g_free(with);
+
 	return(TRUE);
 }
 
@@ -132,17 +194,31 @@ void sipe_core_user_feedback_typing(struct sipe_core_public *sipe_public,
 			(dialog && dialog->is_established) ? "YES" : "NO"); */
 
 	if (session && dialog && dialog->is_established) {
-		gchar *body = g_strdup_printf("<?xml version=\"1.0\"?>"
-					      "<KeyboardActivity>"
-					      " <status status=\"%s\" />"
-					      "</KeyboardActivity>",
-					      typing ? "type" : "idle");
+		gint64 now = sipe_utils_monotonic_msec();
+		gchar *body;
+
+		if (typing_suppressed(sipe_private, session, dialog, typing, now)) {
+			sipe_metrics_count(sipe_private,
+					   SIPE_METRIC_TYPING_SUPPRESSED);
+			return;
+		}
+
+		body = g_strdup_printf("<?xml version=\"1.0\"?>"
+				       "<KeyboardActivity>"
+				       " <status status=\"%s\" />"
+				       "</KeyboardActivity>",
+				       typing ? "type" : "idle");
 		sip_transport_info(sipe_private,
 				   "Content-Type: application/xml\r\n",
 				   body,
 				   dialog,
 				   process_info_typing_response);
 		g_free(body);
+
+		dialog->typing_sent      = now;
+		dialog->typing_active    = typing;
+		dialog->typing_in_flight = TRUE;
+		sipe_metrics_count(sipe_private, SIPE_METRIC_TYPING_SENT);
 	}
 }
 
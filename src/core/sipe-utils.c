@@ -31,6 +31,7 @@
 #include "sipe-backend.h"
 #include "sipe-core.h"    /* to ensure same API for backends */
 #include "sipe-core-private.h"
+#include "sipe-str.h"
 #include "sipe-utils.h"
 #include "uuid.h"
 
@@ -58,9 +59,9 @@ gchar *genconfid(void)
 			       RANDOM16BITS, RANDOM16BITS);
 }
 
-gchar *get_contact(const struct sipe_core_private *sipe_private)
+const gchar *get_contact(const struct sipe_core_private *sipe_private)
 {
-	return g_strdup(sipe_private->contact);
+	return(sipe_private->contact);
 }
 
 gchar *parse_from(const gchar *hdr)
@@ -192,7 +193,7 @@ const gchar *sipe_get_no_sip_uri(const gchar *sip_uri)
 	}
 }
 
-gchar *
+const gchar *
 get_epid(struct sipe_core_private *sipe_private)
 {
 	if (!sipe_private->epid) {
@@ -202,15 +203,15 @@ get_epid(struct sipe_core_private *sipe_private)
 						   sipe_backend_network_ip_address(SIPE_CORE_PUBLIC));
 		g_free(self_sip_uri);
 	}
-	return g_strdup(sipe_private->epid);
+	return(sipe_private->epid);
 }
 
-gchar *get_uuid(struct sipe_core_private *sipe_private)
+const gchar *get_uuid(struct sipe_core_private *sipe_private)
 {
-	gchar *epid = get_epid(sipe_private);
-	gchar *uuid = generateUUIDfromEPID(epid);
-	g_free(epid);
-	return(uuid);
+	/* derived from epid, i.e. same lifetime */
+	if (!sipe_private->uuid)
+		sipe_private->uuid = generateUUIDfromEPID(get_epid(sipe_private));
+	return(sipe_private->uuid);
 }
 
 
@@ -219,10 +220,9 @@ sipe_get_pub_instance(struct sipe_core_private *sipe_private,
 		      int publication_key)
 {
 	unsigned res = 0;
-	gchar *epid = get_epid(sipe_private);
+	const gchar *epid = get_epid(sipe_private);
 
 	sscanf(epid, "%08x", &res);
-	g_free(epid);
 
 	if (publication_key == SIPE_PUB_DEVICE) {
 		/* as is */
@@ -238,10 +238,11 @@ sipe_get_pub_instance(struct sipe_core_private *sipe_private,
 		   publication_key == SIPE_PUB_NOTE_OOF)
 	{ /* First hexadecimal digit is 0x4 */
 		unsigned calendar_id = 0;
-		char *mail_hash = sipe_get_epid(sipe_private->email, "", "");
 
-		sscanf(mail_hash, "%08x", &calendar_id);
-		g_free(mail_hash);
+		if (!sipe_private->email_epid)
+			sipe_private->email_epid = sipe_get_epid(sipe_private->email,
+								 "", "");
+		sscanf(sipe_private->email_epid, "%08x", &calendar_id);
 		res = (calendar_id >> 4) | 0x40000000;
 	} else if (publication_key == SIPE_PUB_STATE_PHONE_VOIP) {	/* First hexadecimal digit is 0x8 */
 		res = (res >> 4) | 0x80000000;
@@ -294,38 +295,6 @@ is_empty(const char *st)
 	return FALSE;
 }
 
-void sipe_utils_message_debug(const gchar *type,
-			      const gchar *header,
-			      const gchar *body,
-			      gboolean sending)
-{
-	if (sipe_backend_debug_enabled()) {
-		GString *str         = g_string_new("");
-		GTimeVal currtime;
-		gchar *time_str;
-		const char *marker   = sending ?
-			">>>>>>>>>>" :
-			"<<<<<<<<<<";
-		gchar *tmp;
-
-		g_get_current_time(&currtime);
-		time_str = g_time_val_to_iso8601(&currtime);
-		g_string_append_printf(str, "\nMESSAGE START %s %s - %s\n", marker, type, time_str);
-		g_string_append(str, tmp = sipe_utils_str_replace(header, "\r\n", "\n"));
-		g_free(tmp);
-		g_string_append(str, "\n");
-		if (body) {
-			g_string_append(str, tmp = sipe_utils_str_replace(body, "\r\n", "\n"));
-			g_free(tmp);
-			g_string_append(str, "\n");
-		}
-		g_string_append_printf(str, "MESSAGE END %s %s - %s", marker, type, time_str);
-		g_free(time_str);
-		SIPE_DEBUG_INFO_NOFORMAT(str->str);
-		g_string_free(str, TRUE);
-	}
-}
-
 gboolean
 sipe_strequal(const gchar *left, const gchar *right)
 {
@@ -340,10 +309,22 @@ sipe_strequal(const gchar *left, const gchar *right)
 gboolean
 sipe_strcase_equal(const gchar *left, const gchar *right)
 {
-	return ((left == NULL && right == NULL) ||
+	/* interned strings are often compared with themselves */
+	return ((left == right) ||
 	        (left != NULL && right != NULL && g_ascii_strcasecmp(left, right) == 0));
 }
 
+guint sipe_strcase_hash(gconstpointer key)
+{
+	const guchar *p = key;
+	guint hash = 5381;
+
+	while (*p)
+		hash = (hash << 5) + hash + g_ascii_tolower(*p++);
+
+	return(hash);
+}
+
 gint sipe_strcompare(gconstpointer a, gconstpointer b)
 {
 #if GLIB_CHECK_VERSION(2,16,0)
@@ -357,11 +338,116 @@ gint sipe_strcompare(gconstpointer a, gconstpointer b)
 #endif
 }
 
+/* parse exactly count digits */
+static gboolean parse_digits(const gchar **p, guint count, guint *value)
+{
+	const gchar *s = *p;
+	guint result = 0;
+
+	while (count--) {
+		if ((*s < '0') || (*s > '9'))
+			return(FALSE);
+		result = result * 10 + (*s++ - '0');
+	}
+
+	*p     = s;
+	*value = result;
+	return(TRUE);
+}
+
+/* days since 1970-01-01 in the proleptic Gregorian calendar */
+static gint64 days_from_civil(gint year, guint month, guint day)
+{
+	gint era;
+	guint yoe, doy, doe;
+
+	/* year starts in March, i.e. leap day is the last day of the year */
+	if (month <= 2)
+		year--;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = (guint) (year - era * 400);
+	doy = (153 * ((month > 2) ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return((gint64) era * 146097 + doe - 719468);
+}
+
+/*
+ * Fast path for the format used by all servers:
+ *
+ *    YYYY-MM-DDThh:mm:ss[.fff...][Z|+hh:mm|-hh:mm|+hhmm|-hhmm]
+ *
+ * Parses directly from the input without allocation. Returns FALSE for
+ * anything else, which is then left to GLib.
+ */
+static gboolean str_to_time_fast(const gchar *p, time_t *result)
+{
+	guint year, month, day, hour, minute, second;
+	gint offset = 0;
+	gint64 seconds;
+
+	if (!parse_digits(&p, 4, &year)   || (*p++ != '-') ||
+	    !parse_digits(&p, 2, &month)  || (*p++ != '-') ||
+	    !parse_digits(&p, 2, &day)    || (*p++ != 'T') ||
+	    !parse_digits(&p, 2, &hour)   || (*p++ != ':') ||
+	    !parse_digits(&p, 2, &minute) || (*p++ != ':') ||
+	    !parse_digits(&p, 2, &second))
+		return(FALSE);
+
+	if ((month < 1) || (month > 12) ||
+	    (day   < 1) || (day   > 31) ||
+	    (hour   > 23) ||
+	    (minute > 59) ||
+	    (second > 60)) /* leap second */
+		return(FALSE);
+
+	/* fractions are truncated, same as GLib does for tv_sec */
+	if (*p == '.') {
+		p++;
+		if ((*p < '0') || (*p > '9'))
+			return(FALSE);
+		while ((*p >= '0') && (*p <= '9'))
+			p++;
+	}
+
+	/* no time zone means UTC */
+	if (*p == 'Z') {
+		p++;
+	} else if ((*p == '+') || (*p == '-')) {
+		gint sign = (*p++ == '-') ? -1 : 1;
+		guint offset_hour, offset_minute;
+
+		if (!parse_digits(&p, 2, &offset_hour))
+			return(FALSE);
+		/* colon is optional in the offset */
+		if (*p == ':')
+			p++;
+		if (!parse_digits(&p, 2, &offset_minute) ||
+		    (offset_hour > 23) || (offset_minute > 59))
+			return(FALSE);
+		offset = sign * (gint) (offset_hour * 3600 + offset_minute * 60);
+	}
+
+	if (*p != '\0')
+		return(FALSE);
+
+	seconds = days_from_civil(year, month, day) * 86400 +
+		hour * 3600 + minute * 60 + second - offset;
+	*result = (time_t) seconds;
+
+	/* doesn't fit into time_t on this platform */
+	return(*result == seconds);
+}
+
 time_t
 sipe_utils_str_to_time(const gchar *timestamp)
 {
 	GTimeVal time;
 	gboolean success = FALSE;
+	time_t result;
+
+	if (timestamp && str_to_time_fast(timestamp, &result))
+		return(result);
 
 	/* g_time_val_from_iso8601() warns about NULL pointer */
 	if (timestamp) {
@@ -412,24 +498,48 @@ const gchar *sipe_utils_time_to_debug_str(const struct tm *tm)
 	return(buffer);
 }
 
+gint64 sipe_utils_monotonic_msec(void)
+{
+#if GLIB_CHECK_VERSION(2,28,0)
+	return(g_get_monotonic_time() / 1000);
+#else
+	GTimeVal now;
+	g_get_current_time(&now);
+	return(((gint64) now.tv_sec) * 1000 + now.tv_usec / 1000);
+#endif
+}
+
+GSource *sipe_utils_timeout_add(GMainContext *context,
+				guint msec,
+				GSourceFunc func,
+				gpointer data)
+{
+	GSource *source = msec ? g_timeout_source_new(msec) : g_idle_source_new();
+
+	g_source_set_callback(source, func, data, NULL);
+	g_source_attach(source, context);
+	/* context keeps the source alive */
+	g_source_unref(source);
+
+	return(source);
+}
+
+gint64 sipe_utils_monotonic_sec(void)
+{
+	return(sipe_utils_monotonic_msec() / 1000);
+}
+
 size_t
 hex_str_to_buff(const char *hex_str, guint8 **buff)
 {
-	char two_digits[3];
 	size_t length;
-	size_t i;
 
 	if (!buff) return 0;
 	if (!hex_str) return 0;
 
 	length = strlen(hex_str)/2;
 	*buff = (unsigned char *)g_malloc(length);
-	for (i = 0; i < length; i++) {
-		two_digits[0] = hex_str[i * 2];
-		two_digits[1] = hex_str[i * 2 + 1];
-		two_digits[2] = '\0';
-		(*buff)[i] = (unsigned char)strtoul(two_digits, NULL, 16);
-	}
+	sipe_str_hex_decode(hex_str, length, *buff);
 
 	return length;
 }
@@ -438,15 +548,11 @@ char *
 buff_to_hex_str(const guint8 *buff, const size_t buff_len)
 {
 	char *res;
-	size_t i, j;
 
 	if (!buff) return NULL;
 
 	res = g_malloc(buff_len * 2 + 1);
-	for (i = 0, j = 0; i < buff_len; i++, j+=2) {
-		sprintf(&res[j], "%02X", buff[i]);
-	}
-	res[j] = '\0';
+	sipe_str_hex_encode(buff, buff_len, res, FALSE);
 	return res;
 }
 
@@ -485,11 +591,42 @@ sipe_utils_parse_lines(GSList **list, gchar **lines, gchar *delimiter)
 	return TRUE;
 }
 
+struct sipnameval *
+sipe_utils_nameval_new(const gchar *name, gssize name_length,
+		       const gchar *value, gsize value_length)
+{
+	/* element, value and (optionally) name share one memory block */
+	struct sipnameval *element = g_malloc(sizeof(struct sipnameval) +
+					      value_length + 1 +
+					      (name_length >= 0 ? name_length + 1 : 0));
+	gchar *p = (gchar *) (element + 1);
+
+	element->value = p;
+	memcpy(p, value, value_length);
+	p += value_length;
+	*p++ = '\0';
+
+	if (name_length >= 0) {
+		element->name = p;
+		memcpy(p, name, name_length);
+		p[name_length] = '\0';
+	} else {
+		/* caller guarantees that name outlives the element */
+		element->name = (gchar *) name;
+	}
+
+	return(element);
+}
+
+void
+sipe_utils_nameval_free_element(struct sipnameval *element)
+{
+	g_free(element);
+}
+
 GSList*
 sipe_utils_nameval_add(GSList* list, const gchar *name, const gchar *value)
 {
-	struct sipnameval *element = g_new0(struct sipnameval,1);
-
 	/* SANITY CHECK: the calling code must be fixed if this happens! */
 	if (!value) {
 		SIPE_DEBUG_ERROR("sipe_utils_nameval_add: NULL value for %s",
@@ -497,21 +634,15 @@ sipe_utils_nameval_add(GSList* list, const gchar *name, const gchar *value)
 		value = "";
 	}
 
-	element->name = g_strdup(name);
-	element->value = g_strdup(value);
-	return g_slist_append(list, element);
+	return g_slist_append(list,
+			      sipe_utils_nameval_new(name, strlen(name),
+						     value, strlen(value)));
 }
 
 void
 sipe_utils_nameval_free(GSList *list) {
-	struct sipnameval *elem;
-	while(list) {
-		elem = list->data;
-		list = g_slist_remove(list,elem);
-		g_free(elem->name);
-		g_free(elem->value);
-		g_free(elem);
-	}
+	g_slist_free_full(list,
+			  (GDestroyNotify) sipe_utils_nameval_free_element);
 }
 
 const gchar *
@@ -545,26 +676,100 @@ gchar *sipe_utils_str_replace(const gchar *string,
 			      const gchar *delimiter,
 			      const gchar *replacement)
 {
-	gchar **split;
-	gchar *result;
+	GString *result;
+	gsize delimiter_length;
+	const gchar *found;
 
 	if (!string || !delimiter || !replacement) return NULL;
 
-	split = g_strsplit(string, delimiter, 0);
-	result = g_strjoinv(replacement, split);
-	g_strfreev(split);
+	/* same as g_strsplit(): empty delimiter doesn't match */
+	delimiter_length = strlen(delimiter);
+	if (!delimiter_length) return g_strdup(string);
 
-	return result;
+	result = g_string_sized_new(strlen(string));
+	while ((found = strstr(string, delimiter)) != NULL) {
+		g_string_append_len(result, string, found - string);
+		g_string_append(result, replacement);
+		string = found + delimiter_length;
+	}
+	g_string_append(result, string);
+
+	return g_string_free(result, FALSE);
 }
 
 void sipe_utils_shrink_buffer(struct sipe_transport_connection *conn,
 			      const gchar *unread)
 {
-	conn->buffer_used -= unread - conn->buffer;
+	gsize consumed = unread - conn->buffer;
+
+	conn->buffer_used -= consumed;
+	conn->buffer_scanned = (conn->buffer_scanned > consumed) ?
+		conn->buffer_scanned - consumed : 0;
 	/* string terminator is not included in buffer_used */
 	memmove(conn->buffer, unread, conn->buffer_used + 1);
 }
 
+/* free space that guarantees progress for one read */
+#define TRANSPORT_BUFFER_MINIMUM 4096
+/* buffers beyond this size are released when empty */
+#define TRANSPORT_BUFFER_KEEP    (64 * 1024)
+#ifndef SIPE_TRANSPORT_BUFFER_MAXIMUM
+#define SIPE_TRANSPORT_BUFFER_MAXIMUM (32 * 1024 * 1024)
+#endif
+
+gsize sipe_core_transport_buffer_reserve(struct sipe_transport_connection *conn)
+{
+	gsize length = conn->buffer_length;
+
+	/* everything has been processed, release memory of large message */
+	if ((conn->buffer_used == 0) && (length > TRANSPORT_BUFFER_KEEP))
+		length = TRANSPORT_BUFFER_MINIMUM;
+
+	if (length < conn->buffer_used + TRANSPORT_BUFFER_MINIMUM) {
+		if (length < TRANSPORT_BUFFER_MINIMUM)
+			length = TRANSPORT_BUFFER_MINIMUM;
+		while (length < conn->buffer_used + TRANSPORT_BUFFER_MINIMUM)
+			length *= 2;
+		if (length > SIPE_TRANSPORT_BUFFER_MAXIMUM)
+			length = MAX(SIPE_TRANSPORT_BUFFER_MAXIMUM,
+				     conn->buffer_length);
+	}
+
+	if (length != conn->buffer_length) {
+		conn->buffer        = g_realloc(conn->buffer, length);
+		conn->buffer_length = length;
+		SIPE_DEBUG_INFO("sipe_core_transport_buffer_reserve: new buffer length %" G_GSIZE_FORMAT,
+				length);
+	}
+
+	return((length > conn->buffer_used + 1) ?
+	       length - conn->buffer_used - 1 :
+	       0);
+}
+
+gchar *sipe_utils_find_header_end(struct sipe_transport_connection *conn,
+				  gchar *start)
+{
+	gchar *scan = conn->buffer + conn->buffer_scanned;
+	gchar *end  = conn->buffer + conn->buffer_used;
+	gchar *found;
+
+	if (scan < start)
+		scan = start;
+
+	found = (gchar *) sipe_str_find_header_end(scan, end - scan);
+	if (found) {
+		conn->buffer_scanned = found - conn->buffer;
+	} else {
+		/* terminator could be split across reads */
+		if (end - scan > 3)
+			scan = end - 3;
+		conn->buffer_scanned = scan - conn->buffer;
+	}
+
+	return(found);
+}
+
 gboolean sipe_utils_ip_is_private(const char *ip)
 {
 	return g_str_has_prefix(ip, "10.")      ||
@@ -651,6 +856,76 @@ void sipe_utils_slist_free_full(GSList *list,
 #endif
 }
 
+struct sipe_utils_set {
+	GHashTable *table;
+	GSList *items;  /* reverse insertion order */
+	GDestroyNotify destroy;
+};
+
+struct sipe_utils_set *sipe_utils_set_new(GHashFunc hash,
+					  GEqualFunc equal,
+					  GDestroyNotify destroy)
+{
+	struct sipe_utils_set *set = g_new0(struct sipe_utils_set, 1);
+
+	set->table   = g_hash_table_new(hash, equal);
+	set->destroy = destroy;
+
+	return(set);
+}
+
+gboolean sipe_utils_set_add(struct sipe_utils_set *set,
+			    gpointer data)
+{
+	if (g_hash_table_lookup(set->table, data)) {
+		/* duplicate */
+		if (set->destroy)
+			(*set->destroy)(data);
+		return(FALSE);
+	}
+
+	/* unique: set takes ownership of "data" */
+	g_hash_table_insert(set->table, data, data);
+	set->items = g_slist_prepend(set->items, data);
+	return(TRUE);
+}
+
+gboolean sipe_utils_set_contains(struct sipe_utils_set *set,
+				 gconstpointer data)
+{
+	return(g_hash_table_lookup(set->table, data) != NULL);
+}
+
+GSList *sipe_utils_set_free_to_list(struct sipe_utils_set *set,
+				    GCompareFunc sort)
+{
+	GSList *list = g_slist_reverse(set->items);
+
+	g_hash_table_destroy(set->table);
+	g_free(set);
+
+	/* sort is stable: equal items keep insertion order */
+	if (sort)
+		list = g_slist_sort(list, sort);
+	return(list);
+}
+
+void sipe_utils_set_free(struct sipe_utils_set *set)
+{
+	GDestroyNotify destroy;
+	GSList *list;
+
+	if (!set)
+		return;
+
+	destroy = set->destroy;
+	list    = sipe_utils_set_free_to_list(set, NULL);
+	if (destroy)
+		sipe_utils_slist_free_full(list, destroy);
+	else
+		g_slist_free(list);
+}
+
 /*
   Local Variables:
   mode: c
@@ -113,9 +113,9 @@ struct sipe_transport_connection;
  *
  * @param sipe_private (in) SIPE core private data
  *
- * @return epid. Must be g_free()'d.
+ * @return epid. Cached until the connection is closed.
  */
-gchar *
+const gchar *
 get_epid(struct sipe_core_private *sipe_private);
 
 /**
@@ -123,9 +123,9 @@ get_epid(struct sipe_core_private *sipe_private);
  *
  * @param sipe_private (in) SIPE core private data
  *
- * @return uuid. Must be g_free()'d.
+ * @return uuid. Cached until the connection is closed.
  */
-gchar *
+const gchar *
 get_uuid(struct sipe_core_private *sipe_private);
 
 /**
@@ -168,9 +168,9 @@ sipe_get_pub_instance(struct sipe_core_private *sipe_private,
  *
  * @param sipe_private (in) SIPE core private data
  *
- * @return Contact. Must be g_free()'d.
+ * @return Contact. Only valid until the next REGISTER response.
  */
-gchar *get_contact(const struct sipe_core_private *sipe_private);
+const gchar *get_contact(const struct sipe_core_private *sipe_private);
 
 /**
  * Parses URI from SIP header
@@ -245,19 +245,6 @@ sipe_is_bad_alias(const char *uri,
 gboolean
 is_empty(const char *st);
 
-/**
- * Message debugging
- *
- * @param type    message type description (SIP or HTTP).
- * @param header  message header
- * @param body    message body or NULL
- * @param sending TRUE if outgoing message
- */
-void sipe_utils_message_debug(const gchar *type,
-			      const gchar *header,
-			      const gchar *body,
-			      gboolean sending);
-
 /**
  * Tests two strings for equality.
  *
@@ -289,6 +276,18 @@ gboolean sipe_strequal(const gchar *left, const gchar *right);
  */
 gboolean sipe_strcase_equal(const gchar *left, const gchar *right);
 
+/**
+ * Hash function for ASCII strings, ignoring the case
+ *
+ * Same value as g_str_hash() of the lower case string. Use together
+ * with sipe_strcase_equal() for hash tables with case-insensitive keys.
+ *
+ * @param key A string (must not be @c NULL)
+ *
+ * @return hash value
+ */
+guint sipe_strcase_hash(gconstpointer key);
+
 /**
  * Compares two strings
  *
@@ -311,6 +310,9 @@ gint sipe_strcompare(gconstpointer a, gconstpointer b);
  * Parses a timestamp in ISO8601 format and returns a time_t.
  * Assumes UTC if no timezone specified
  *
+ * YYYY-MM-DDThh:mm:ss[.fff][Z|+hh:mm|-hh:mm] is parsed without allocation,
+ * other formats are handed to GLib.
+ *
  * @param timestamp The timestamp (may be @c NULL)
  *
  * @return time_t or 0 if timestamp parsing failed
@@ -338,6 +340,43 @@ sipe_utils_time_to_str(time_t timestamp);
  */
 const gchar *sipe_utils_time_to_debug_str(const struct tm *tm);
 
+/**
+ * Monotonic clock for measuring intervals
+ *
+ * Falls back to wall clock time for GLib < 2.28
+ *
+ * @return time in milliseconds from an unspecified starting point
+ */
+gint64 sipe_utils_monotonic_msec(void);
+
+/**
+ * Add a timeout to a main context
+ *
+ * Same as g_timeout_add() or g_idle_add() for the given context.
+ *
+ * @param context main context (@c NULL for the default context)
+ * @param msec    timeout in milliseconds, 0 for an idle callback
+ * @param func    callback, return @c FALSE to remove the timeout
+ * @param data    callback data
+ *
+ * @return source for g_source_destroy(). Only valid until the callback
+ *         has returned @c FALSE.
+ */
+GSource *sipe_utils_timeout_add(GMainContext *context,
+				guint msec,
+				GSourceFunc func,
+				gpointer data);
+
+/**
+ * Monotonic clock for deadlines in seconds
+ *
+ * Use this instead of time(NULL) for timeouts that never leave the
+ * process, so that they are not affected by system clock changes.
+ *
+ * @return time in seconds from an unspecified starting point
+ */
+gint64 sipe_utils_monotonic_sec(void);
+
 struct sipnameval {
 	gchar *name;
 	gchar *value;
@@ -381,6 +420,32 @@ buff_to_hex_str(const guint8 *buff, const size_t buff_len);
 gboolean
 sipe_utils_parse_lines(GSList **list, gchar **lines, gchar *delimiter);
 
+/**
+ * Allocates a name-value pair
+ *
+ * Element, value and name are allocated as one memory block. If
+ * @c name_length is negative then @c name is not copied, i.e. it must
+ * be an interned string that outlives the element.
+ *
+ * @param name         attribute's name
+ * @param name_length  length of @c name or -1
+ * @param value        value of attribute @c name (need not be NUL terminated)
+ * @param value_length length of @c value
+ *
+ * @return new element. Must be freed with @c sipe_utils_nameval_free_element()
+ */
+struct sipnameval *
+sipe_utils_nameval_new(const gchar *name, gssize name_length,
+		       const gchar *value, gsize value_length);
+
+/**
+ * Frees a single name-value pair
+ *
+ * @param element a @c sipnameval structure
+ */
+void
+sipe_utils_nameval_free_element(struct sipnameval *element);
+
 /**
  * Adds a name-value pair to @c list
  *
@@ -448,6 +513,21 @@ gchar *sipe_utils_str_replace(const gchar *string,
  */
 void sipe_utils_shrink_buffer(struct sipe_transport_connection *conn,
 			      const gchar *unread);
+
+/**
+ * Find end of message header in transport buffer
+ *
+ * The search resumes where the last unsuccessful search stopped, i.e.
+ * data received earlier is not scanned again when more data arrives.
+ *
+ * @param conn  the transport connection
+ * @param start pointer to the first unread character in the buffer
+ *
+ * @return pointer to "\r\n\r\n" at end of header or @c NULL
+ */
+gchar *sipe_utils_find_header_end(struct sipe_transport_connection *conn,
+				  gchar *start);
+
 /**
  * Checks whether given IP address belongs to private block as defined in RFC1918
  *
@@ -497,3 +577,66 @@ GSList *sipe_utils_slist_insert_unique_sorted(GSList *list,
  */
 void sipe_utils_slist_free_full(GSList *list,
 				GDestroyNotify free);
+
+/**
+ * Insertion-ordered hash set
+ *
+ * Replaces @c sipe_utils_slist_insert_unique_sorted() when building large
+ * collections: membership is checked in O(1) and the result is sorted at
+ * most once when it is converted to a list.
+ */
+struct sipe_utils_set;
+
+/**
+ * Create hash set
+ *
+ * @param hash    hash function for items
+ * @param equal   equality function for items
+ * @param destroy called for items that are dropped (may be @c NULL)
+ *
+ * @return new set
+ */
+struct sipe_utils_set *sipe_utils_set_new(GHashFunc hash,
+					  GEqualFunc equal,
+					  GDestroyNotify destroy);
+
+/**
+ * Add item to hash set
+ *
+ * @param set  hash set
+ * @param data the item to add (must not be @c NULL). The set takes
+ *             ownership, i.e. a duplicate is destroyed immediately.
+ *
+ * @return @c TRUE if the item was added
+ */
+gboolean sipe_utils_set_add(struct sipe_utils_set *set,
+			    gpointer data);
+
+/**
+ * Check hash set membership
+ *
+ * @param set  hash set
+ * @param data the item to look for
+ *
+ * @return @c TRUE if an equal item is in the set
+ */
+gboolean sipe_utils_set_contains(struct sipe_utils_set *set,
+				 gconstpointer data);
+
+/**
+ * Free hash set and return its items
+ *
+ * @param set  hash set
+ * @param sort function to sort the items. @c NULL keeps insertion order.
+ *
+ * @return list of items. Caller takes ownership of the items.
+ */
+GSList *sipe_utils_set_free_to_list(struct sipe_utils_set *set,
+				    GCompareFunc sort);
+
+/**
+ * Free hash set and its items
+ *
+ * @param set hash set (may be @c NULL)
+ */
+void sipe_utils_set_free(struct sipe_utils_set *set);
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2011-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2011-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -37,13 +37,22 @@
 #include "sipe-backend.h"
 #include "sipe-core.h"
 #include "sipe-core-private.h"
+#include "sipe-debug.h"
 #include "sipe-digest.h"
+#include "sipe-metrics.h"
+#include "sipe-schedule.h"
 #include "sipe-svc.h"
 #include "sipe-tls.h"
+#include "sipe-token-store.h"
 #include "sipe-webticket.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
+/* renew cached tokens this many seconds before they expire */
+#define WEBTICKET_REFRESH_AHEAD 300
+#define WEBTICKET_REFRESH_MIN    30
+#define WEBTICKET_REFRESH_ACTION "<+webticket-refresh>"
+
 struct webticket_queued_data {
 	sipe_webticket_callback *callback;
 	gpointer callback_data;
@@ -74,16 +83,40 @@ struct webticket_callback_data {
 	struct sipe_svc_session *session;
 
 	GSList *queued;
+	gint64 started; /* sipe_utils_monotonic_msec() */
 };
 
-struct webticket_token {
-	gchar *auth_uri;
-	gchar *token;
-	time_t expires;
+/* event trace: see token_state in webticket_callback_data */
+static const gchar * const token_state_names[] = {
+	"none",
+	"service",
+	"federation",
+	"fedbearer",
+};
+
+static void webticket_event(struct webticket_callback_data *wcd,
+			    const gchar *step)
+{
+	sipe_debug_event(SIPE_DEBUG_EVENT_WEBTICKET,
+			 wcd->service_uri,
+			 step,
+			 0,
+			 0,
+			 sipe_utils_monotonic_msec() - wcd->started);
+}
+
+#define WEBTICKET_TOKEN_STATE(wcd, state)				\
+	do {								\
+		(wcd)->token_state = (state);				\
+		webticket_event((wcd), token_state_names[(state)]);	\
+	} while (0)
+
+struct webticket_refresh {
+	gchar *service_uri;
+	const gchar *port_name; /* interned */
 };
 
 struct sipe_webticket {
-	GHashTable *cache;
 	GHashTable *pending;
 
 	gchar *webticket_adfs_uri;
@@ -107,18 +140,21 @@ void sipe_webticket_free(struct sipe_core_private *sipe_private)
 	g_free(webticket->adfs_token);
 	if (webticket->pending)
 		g_hash_table_destroy(webticket->pending);
-	if (webticket->cache)
-		g_hash_table_destroy(webticket->cache);
 	g_free(webticket);
 	sipe_private->webticket = NULL;
 }
 
-static void free_token(gpointer data)
+static void schedule_refresh(struct sipe_core_private *sipe_private,
+			     const gchar *service_uri,
+			     const gchar *port_name,
+			     time_t expires);
+static void restored_token(struct sipe_core_private *sipe_private,
+			   const gchar *service_uri,
+			   const gchar *port_name,
+			   time_t expires,
+			   SIPE_UNUSED_PARAMETER gpointer data)
 {
-	struct webticket_token *wt = data;
-	g_free(wt->auth_uri);
-	g_free(wt->token);
-	g_free(wt);
+	schedule_refresh(sipe_private, service_uri, port_name, expires);
 }
 
 static void sipe_webticket_init(struct sipe_core_private *sipe_private)
@@ -130,45 +166,52 @@ static void sipe_webticket_init(struct sipe_core_private *sipe_private)
 
 	sipe_private->webticket = webticket = g_new0(struct sipe_webticket, 1);
 
-	webticket->cache   = g_hash_table_new_full(g_str_hash,
-						   g_str_equal,
-						   g_free,
-						   free_token);
 	webticket->pending = g_hash_table_new(g_str_hash,
 					      g_str_equal);
+
+	/* tokens from previous sessions or other accounts */
+	sipe_token_store_load(sipe_private);
+	sipe_token_store_foreach(sipe_private, restored_token, NULL);
 }
 
-/* takes ownership of "token" */
 static void cache_token(struct sipe_core_private *sipe_private,
 			const gchar *service_uri,
+			const gchar *port_name,
 			const gchar *auth_uri,
-			gchar *token,
+			const gchar *token,
 			time_t expires)
 {
-	struct webticket_token *wt = g_new0(struct webticket_token, 1);
-	wt->auth_uri = g_strdup(auth_uri);
-	wt->token    = token;
-	wt->expires  = expires;
-	g_hash_table_insert(sipe_private->webticket->cache,
-			    g_strdup(service_uri),
-			    wt);
+	sipe_token_store_add(sipe_private,
+			     service_uri,
+			     port_name,
+			     auth_uri,
+			     token,
+			     expires);
+	schedule_refresh(sipe_private, service_uri, port_name, expires);
 }
 
-static const struct webticket_token *cache_hit(struct sipe_core_private *sipe_private,
-					       const gchar *service_uri)
+static gboolean cache_hit(struct sipe_core_private *sipe_private,
+			  const gchar *service_uri,
+			  gchar **auth_uri,
+			  gchar **token)
 {
-	const struct webticket_token *wt;
-
 	/* make sure a cached Web Ticket is still valid for 60 seconds */
-	wt = g_hash_table_lookup(sipe_private->webticket->cache,
-				 service_uri);
-	if (wt && (wt->expires < time(NULL) + 60)) {
-		SIPE_DEBUG_INFO("cache_hit: cached token for URI %s has expired",
-				service_uri);
-		wt = NULL;
-	}
-
-	return(wt);
+	gboolean hit = sipe_token_store_lookup(sipe_private,
+					       service_uri,
+					       60,
+					       auth_uri,
+					       token);
+
+	sipe_metrics_count(sipe_private,
+			   hit ?
+			   SIPE_METRIC_WEBTICKET_CACHE_HITS :
+			   SIPE_METRIC_WEBTICKET_CACHE_MISSES);
+	sipe_debug_event(SIPE_DEBUG_EVENT_WEBTICKET,
+			 service_uri,
+			 hit ? "cache hit" : "cache miss",
+			 0, 0, 0);
+
+	return(hit);
 }
 
 /* frees just the main request data, when this is called "queued" is cleared */
@@ -204,6 +247,8 @@ static void callback_execute(struct sipe_core_private *sipe_private,
 {
 	GSList *entry = wcd->queued;
 
+	webticket_event(wcd, wsse_security ? "done" : "failed");
+
 	/* complete main request */
 	wcd->callback(sipe_private,
 		      wcd->service_uri,
@@ -321,6 +366,71 @@ static void generate_federation_wsse(struct sipe_webticket *webticket,
 	g_free(timestamp);
 }
 
+/* XML-Sig: SignedInfo for reference element in canonical form */
+struct signed_info_output {
+	gpointer hmac;
+	GString *canon;
+};
+
+static void signed_info_output(gpointer data,
+			       const gchar *text,
+			       gsize length)
+{
+	struct signed_info_output *out = data;
+
+	sipe_digest_hmac_update(out->hmac, (const guchar *) text, length);
+	g_string_append_len(out->canon, text, length);
+}
+
+static const gchar *const signed_info_c14n_method[] = {
+	"Algorithm", "http://www.w3.org/2001/10/xml-exc-c14n#", NULL
+};
+static const gchar *const signed_info_signature_method[] = {
+	"Algorithm", "http://www.w3.org/2000/09/xmldsig#hmac-sha1", NULL
+};
+static const gchar *const signed_info_reference[] = {
+	"URI", "#timestamp", NULL
+};
+static const gchar *const signed_info_digest_method[] = {
+	"Algorithm", "http://www.w3.org/2000/09/xmldsig#sha1", NULL
+};
+
+static gchar *signed_info_sign(const guchar *key,
+			       gsize key_length,
+			       const gchar *digest_value,
+			       guchar *signature)
+{
+	struct signed_info_output out;
+	struct sipe_xml_c14n c14n = { signed_info_output, &out };
+
+	out.hmac  = sipe_digest_hmac_sha1_start(key, key_length);
+	if (!out.hmac)
+		return(NULL);
+	out.canon = g_string_sized_new(512);
+
+	sipe_xml_c14n_start(&c14n, "SignedInfo",
+			    "http://www.w3.org/2000/09/xmldsig#", NULL);
+	sipe_xml_c14n_element(&c14n, "CanonicalizationMethod",
+			      signed_info_c14n_method, NULL);
+	sipe_xml_c14n_element(&c14n, "SignatureMethod",
+			      signed_info_signature_method, NULL);
+	sipe_xml_c14n_start(&c14n, "Reference", NULL, signed_info_reference);
+	sipe_xml_c14n_start(&c14n, "Transforms", NULL, NULL);
+	sipe_xml_c14n_element(&c14n, "Transform",
+			      signed_info_c14n_method, NULL);
+	sipe_xml_c14n_end(&c14n, "Transforms");
+	sipe_xml_c14n_element(&c14n, "DigestMethod",
+			      signed_info_digest_method, NULL);
+	sipe_xml_c14n_element(&c14n, "DigestValue", NULL, digest_value);
+	sipe_xml_c14n_end(&c14n, "Reference");
+	sipe_xml_c14n_end(&c14n, "SignedInfo");
+
+	sipe_digest_hmac_end(out.hmac, signature);
+	sipe_digest_hmac_destroy(out.hmac);
+
+	return(g_string_free(out.canon, FALSE));
+}
+
 static gchar *generate_sha1_proof_wsse(const gchar *raw,
 				       struct sipe_tls_random *entropy,
 				       time_t *expires)
@@ -366,7 +476,6 @@ static gchar *generate_sha1_proof_wsse(const gchar *raw,
 				/* same as SIPE_DIGEST_HMAC_SHA1_LENGTH */
 				guchar digest[SIPE_DIGEST_SHA1_LENGTH];
 				gchar *base64;
-				gchar *signed_info;
 				gchar *canon;
 
 				SIPE_DEBUG_INFO_NOFORMAT("generate_sha1_proof_wsse: found assertionID and successfully computed the key");
@@ -378,33 +487,14 @@ static gchar *generate_sha1_proof_wsse(const gchar *raw,
 				base64 = g_base64_encode(digest,
 							 SIPE_DIGEST_SHA1_LENGTH);
 
-				/* XML-Sig: SignedInfo for reference element */
-				signed_info = g_strdup_printf("<SignedInfo xmlns=\"http://www.w3.org/2000/09/xmldsig#\">"
-							      "<CanonicalizationMethod Algorithm=\"http://www.w3.org/2001/10/xml-exc-c14n#\"/>"
-							      "<SignatureMethod Algorithm=\"http://www.w3.org/2000/09/xmldsig#hmac-sha1\"/>"
-							      "<Reference URI=\"#timestamp\">"
-							      "<Transforms>"
-							      "<Transform Algorithm=\"http://www.w3.org/2001/10/xml-exc-c14n#\"/>"
-							      "</Transforms>"
-							      "<DigestMethod Algorithm=\"http://www.w3.org/2000/09/xmldsig#sha1\"/>"
-							      "<DigestValue>%s</DigestValue>"
-							      "</Reference>"
-							      "</SignedInfo>",
-							      base64);
+				/* XML-Sig: sign SignedInfo in canonical form */
+				canon = signed_info_sign(key, entropy->length,
+							 base64, digest);
 				g_free(base64);
 
-				/* XML-Sig: SignedInfo in canonical form */
-				canon = sipe_xml_exc_c14n(signed_info);
-				g_free(signed_info);
-
 				if (canon) {
 					gchar *signature;
 
-					/* calculate signature */
-					sipe_digest_hmac_sha1(key, entropy->length,
-							      (guchar *)canon,
-							      strlen(canon),
-							      digest);
 					base64 = g_base64_encode(digest,
 								 SIPE_DIGEST_HMAC_SHA1_LENGTH);
 
@@ -482,9 +572,9 @@ static void webticket_token(struct sipe_core_private *sipe_private,
 									&expires);
 
 			if (wsse_security) {
-				/* cache takes ownership of wsse_security */
 				cache_token(sipe_private,
 					    wcd->service_uri,
+					    wcd->service_port,
 					    wcd->service_auth_uri,
 					    wsse_security,
 					    expires);
@@ -493,6 +583,7 @@ static void webticket_token(struct sipe_core_private *sipe_private,
 						 wcd->service_auth_uri,
 						 wsse_security,
 						 NULL);
+				g_free(wsse_security);
 				failed = FALSE;
 			}
 			break;
@@ -533,7 +624,7 @@ static void webticket_token(struct sipe_core_private *sipe_private,
 						       &wcd->entropy,
 						       webticket_token,
 						       wcd)) {
-					wcd->token_state = TOKEN_STATE_SERVICE;
+					WEBTICKET_TOKEN_STATE(wcd, TOKEN_STATE_SERVICE);
 
 					/* callback data passed down the line */
 					wcd = NULL;
@@ -606,7 +697,7 @@ static gboolean federated_authentication(struct sipe_core_private *sipe_private,
 							wcd->webticket_fedbearer_uri,
 							webticket_token,
 							wcd)))
-		wcd->token_state = TOKEN_STATE_FED_BEARER;
+		WEBTICKET_TOKEN_STATE(wcd, TOKEN_STATE_FED_BEARER);
 
 	/* If TRUE then callback data has been passed down the line */
 	return(success);
@@ -631,14 +722,14 @@ static gboolean fedbearer_authentication(struct sipe_core_private *sipe_private,
 						       webticket->webticket_adfs_uri,
 						       webticket_token,
 						       wcd)))
-			wcd->token_state = TOKEN_STATE_FEDERATION;
+			WEBTICKET_TOKEN_STATE(wcd, TOKEN_STATE_FEDERATION);
 	} else {
 		if ((success = sipe_svc_webticket_lmc(sipe_private,
 						      wcd->session,
 						      wcd->webticket_fedbearer_uri,
 						      webticket_token,
 						      wcd)))
-			wcd->token_state = TOKEN_STATE_FED_BEARER;
+			WEBTICKET_TOKEN_STATE(wcd, TOKEN_STATE_FED_BEARER);
 	}
 
 	/* If TRUE then callback data has been passed down the line */
@@ -773,7 +864,7 @@ static void webticket_metadata(struct sipe_core_private *sipe_private,
 							     &wcd->entropy,
 							     webticket_token,
 							     wcd);
-				wcd->token_state = TOKEN_STATE_SERVICE;
+				WEBTICKET_TOKEN_STATE(wcd, TOKEN_STATE_SERVICE);
 			} else {
 				success = initiate_fedbearer(sipe_private,
 							     wcd);
@@ -886,6 +977,131 @@ static void service_metadata(struct sipe_core_private *sipe_private,
 	}
 }
 
+/* always fetches a new token, but shares a pending request */
+static gboolean webticket_fetch(struct sipe_core_private *sipe_private,
+				struct sipe_svc_session *session,
+				const gchar *base_uri,
+				const gchar *port_name,
+				sipe_webticket_callback *callback,
+				gpointer callback_data)
+{
+	GHashTable *pending = sipe_private->webticket->pending;
+	struct webticket_callback_data *wcd = g_hash_table_lookup(pending,
+								  base_uri);
+	gboolean ret;
+
+	/* is there already a pending request for this URI? */
+	if (wcd) {
+		SIPE_DEBUG_INFO("webticket_fetch: pending request found for URI %s - queueing",
+				base_uri);
+		queue_request(wcd, callback, callback_data);
+		ret = TRUE;
+	} else {
+		wcd = g_new0(struct webticket_callback_data, 1);
+
+		ret = sipe_svc_metadata(sipe_private,
+					session,
+					base_uri,
+					service_metadata,
+					wcd);
+
+		if (ret) {
+			wcd->service_uri   = g_strdup(base_uri);
+			wcd->service_port  = port_name;
+			wcd->callback      = callback;
+			wcd->callback_data = callback_data;
+			wcd->session       = session;
+			wcd->token_state   = TOKEN_STATE_NONE;
+			wcd->started       = sipe_utils_monotonic_msec();
+			webticket_event(wcd, "metadata");
+			g_hash_table_insert(pending,
+					    wcd->service_uri, /* borrowed */
+					    wcd);             /* borrowed */
+		} else {
+			g_free(wcd);
+		}
+	}
+
+	return(ret);
+}
+
+static void refresh_done(SIPE_UNUSED_PARAMETER struct sipe_core_private *sipe_private,
+			 const gchar *base_uri,
+			 SIPE_UNUSED_PARAMETER const gchar *auth_uri,
+			 const gchar *wsse_security,
+			 SIPE_UNUSED_PARAMETER const gchar *failure_msg,
+			 gpointer callback_data)
+{
+	SIPE_DEBUG_INFO("refresh_done: token refresh for URI %s %s",
+			base_uri, wsse_security ? "succeeded" : "failed");
+	sipe_svc_session_close(callback_data);
+}
+
+static void refresh_free(gpointer data)
+{
+	struct webticket_refresh *refresh = data;
+	g_free(refresh->service_uri);
+	g_free(refresh);
+}
+
+static void refresh_token(struct sipe_core_private *sipe_private,
+			  gpointer data)
+{
+	struct webticket_refresh *refresh = data;
+	struct sipe_webticket *webticket  = sipe_private->webticket;
+	struct sipe_svc_session *session;
+
+	/* a request for this URI is already on its way */
+	if (!webticket ||
+	    webticket->shutting_down ||
+	    g_hash_table_lookup(webticket->pending, refresh->service_uri))
+		return;
+
+	SIPE_DEBUG_INFO("refresh_token: renewing token for URI %s",
+			refresh->service_uri);
+	session = sipe_svc_session_start();
+	if (!webticket_fetch(sipe_private,
+			     session,
+			     refresh->service_uri,
+			     refresh->port_name,
+			     refresh_done,
+			     session))
+		sipe_svc_session_close(session);
+}
+
+static void schedule_refresh(struct sipe_core_private *sipe_private,
+			     const gchar *service_uri,
+			     const gchar *port_name,
+			     time_t expires)
+{
+	struct webticket_refresh *refresh;
+	time_t lifetime = expires - time(NULL);
+	time_t delay;
+	gchar *action;
+
+	/* renew shortly before expiry, but not before half of the lifetime */
+	if (lifetime > 2 * WEBTICKET_REFRESH_AHEAD)
+		delay = lifetime - WEBTICKET_REFRESH_AHEAD;
+	else
+		delay = lifetime / 2;
+	if (delay < WEBTICKET_REFRESH_MIN)
+		return;
+
+	refresh = g_new0(struct webticket_refresh, 1);
+	refresh->service_uri = g_strdup(service_uri);
+	refresh->port_name   = g_intern_string(port_name);
+
+	/* replaces any older refresh for the same URI */
+	action = g_strconcat(WEBTICKET_REFRESH_ACTION, service_uri, NULL);
+	sipe_schedule_seconds(sipe_private,
+			      action,
+			      refresh,
+			      delay,
+			      refresh_token,
+			      refresh_free);
+	g_free(action);
+}
+
 gboolean sipe_webticket_request(struct sipe_core_private *sipe_private,
 				struct sipe_svc_session *session,
 				const gchar *base_uri,
@@ -907,53 +1123,29 @@ gboolean sipe_webticket_request(struct sipe_core_private *sipe_private,
 				 port_name);
 
 	} else {
-		const struct webticket_token *wt = cache_hit(sipe_private, base_uri);
+		gchar *auth_uri;
+		gchar *token;
 
 		/* cache hit for this URI? */
-		if (wt) {
+		if (cache_hit(sipe_private, base_uri, &auth_uri, &token)) {
 			SIPE_DEBUG_INFO("sipe_webticket_request: using cached token for URI %s (Auth URI %s)",
-					base_uri, wt->auth_uri);
+					base_uri, auth_uri);
 			callback(sipe_private,
 				 base_uri,
-				 wt->auth_uri,
-				 wt->token,
+				 auth_uri,
+				 token,
 				 NULL,
 				 callback_data);
+			g_free(token);
+			g_free(auth_uri);
 			ret = TRUE;
 		} else {
-			GHashTable *pending = webticket->pending;
-			struct webticket_callback_data *wcd = g_hash_table_lookup(pending,
-										  base_uri);
-
-			/* is there already a pending request for this URI? */
-			if (wcd) {
-				SIPE_DEBUG_INFO("sipe_webticket_request: pending request found for URI %s - queueing",
-						base_uri);
-				queue_request(wcd, callback, callback_data);
-				ret = TRUE;
-			} else {
-				wcd = g_new0(struct webticket_callback_data, 1);
-
-				ret = sipe_svc_metadata(sipe_private,
-							session,
-							base_uri,
-							service_metadata,
-							wcd);
-
-				if (ret) {
-					wcd->service_uri   = g_strdup(base_uri);
-					wcd->service_port  = port_name;
-					wcd->callback      = callback;
-					wcd->callback_data = callback_data;
-					wcd->session       = session;
-					wcd->token_state   = TOKEN_STATE_NONE;
-					g_hash_table_insert(pending,
-							    wcd->service_uri, /* borrowed */
-							    wcd);             /* borrowed */
-				} else {
-					g_free(wcd);
-				}
-			}
+			ret = webticket_fetch(sipe_private,
+					      session,
+					      base_uri,
+					      port_name,
+					      callback,
+					      callback_data);
 		}
 	}
 
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-12 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -20,7 +20,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-/* Tests for sipe-xml.c */
+/* Tests for sipe-xml.c and the timestamp parser in sipe-utils.c */
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -187,6 +187,129 @@ static void assert_stringify(const sipe_xml *xml,
 }
 
 
+/* streaming parser */
+static void stream_record(const sipe_xml *node, gpointer user_data)
+{
+	gchar *data = sipe_xml_data(node);
+	g_string_append_printf(user_data, "%s(%s,%s)",
+			       sipe_xml_name(node),
+			       sipe_xml_attribute(node, "n"),
+			       data ? data : "");
+	g_free(data);
+}
+
+/* skips an element with the same raw text as the previous one */
+static guint stream_last_hash;
+static gboolean stream_filter(SIPE_UNUSED_PARAMETER const sipe_xml *node,
+			      guint hash, gpointer user_data)
+{
+	gboolean changed = (hash == 0) || (hash != stream_last_hash);
+	stream_last_hash = hash;
+	if (!changed)
+		g_string_append(user_data, "-");
+	return(changed);
+}
+
+static const struct sipe_xml_stream_handler stream_handlers[] = {
+	{ "r",   stream_record, NULL,          NULL },
+	{ "r/c", NULL,          stream_record, NULL },
+	{ NULL,  NULL,          NULL,          NULL }
+};
+
+static const struct sipe_xml_stream_handler stream_filter_handlers[] = {
+	{ "r",   stream_record, NULL,          NULL          },
+	{ "r/c", NULL,          stream_record, stream_filter },
+	{ NULL,  NULL,          NULL,          NULL          }
+};
+
+static void assert_stream_handlers(const struct sipe_xml_stream_handler *handlers,
+				   const gchar *s, gboolean ok,
+				   const gchar *expected)
+{
+	GString *record = g_string_new("");
+	gboolean result;
+
+	teststring = s ? s : "(nil)";
+	stream_last_hash = 0;
+	result = sipe_xml_stream_parse(s, s ? strlen(s) : 0,
+				       handlers, record);
+	if ((result == ok) && sipe_strequal(record->str, expected)) {
+		succeeded++;
+	} else {
+		printf("[%s]\nXML stream FAILED: %s '%s' expected '%s'\n",
+		       teststring, result ? "TRUE" : "FALSE",
+		       record->str, expected);
+		failed++;
+	}
+	g_string_free(record, TRUE);
+}
+
+static void assert_stream(const gchar *s, gboolean ok, const gchar *expected)
+{
+	assert_stream_handlers(stream_handlers, s, ok, expected);
+}
+
+static void c14n_record(gpointer data, const gchar *text, gsize length)
+{
+	g_string_append_len(data, text, length);
+}
+
+static const gchar *const c14n_attributes[] = {
+	"a", "1\"&<\t", "b", "2", NULL
+};
+
+static void assert_c14n(const gchar *expected)
+{
+	GString *record = g_string_new("");
+	struct sipe_xml_c14n c14n = { c14n_record, record };
+
+	teststring = "c14n writer";
+	sipe_xml_c14n_start(&c14n, "r", "urn:x", NULL);
+	sipe_xml_c14n_element(&c14n, "e", c14n_attributes, NULL);
+	sipe_xml_c14n_element(&c14n, "t", NULL, "a<b>&c\r");
+	sipe_xml_c14n_end(&c14n, "r");
+	if (sipe_strequal(record->str, expected)) {
+		succeeded++;
+	} else {
+		printf("[%s]\nXML c14n FAILED: '%s' expected '%s'\n",
+		       teststring, record->str, expected);
+		failed++;
+	}
+	g_string_free(record, TRUE);
+}
+
+static void assert_raw(const gchar *xml, const gchar *tag,
+		       gboolean include_tag, const gchar *expected)
+{
+	gchar *raw = sipe_xml_extract_raw(xml, tag, include_tag);
+
+	teststring = xml;
+	if (sipe_strequal(raw, expected)) {
+		succeeded++;
+	} else {
+		printf("[%s]\nXML raw FAILED: '%s' expected '%s'\n",
+		       teststring, raw ? raw : "(nil)",
+		       expected ? expected : "(nil)");
+		failed++;
+	}
+	g_free(raw);
+}
+
+/* ISO8601 timestamps */
+static void assert_time(const gchar *timestamp, time_t expected)
+{
+	time_t result = sipe_utils_str_to_time(timestamp);
+
+	if (result == expected) {
+		succeeded++;
+	} else {
+		printf("[%s]\nISO8601 FAILED: %ld expected %ld\n",
+		       timestamp ? timestamp : "(nil)",
+		       (long) result, (long) expected);
+		failed++;
+	}
+}
+
 /* memory leak check */
 static gsize allocated = 0;
 
@@ -401,6 +524,50 @@ int main(SIPE_UNUSED_PARAMETER int argc, SIPE_UNUSED_PARAMETER char **argv)
 	xml = assert_parse("<a a=\"1\" a=\"2\"></a>", FALSE);
 	sipe_xml_free(xml);
 
+	/* streaming */
+	assert_stream(NULL, FALSE, "");
+	assert_stream("<r n=\"0\"/>", TRUE, "r(0,)");
+	assert_stream("<r n=\"0\"><skip><c n=\"x\"/></skip><c n=\"1\">a<d>b</d></c><c n=\"2\"/></r>",
+		      TRUE, "r(0,)c(1,a)c(2,)");
+	assert_stream("<x:r n=\"0\"><x:c x:n=\"1\"/></x:r>", TRUE, "r(0,)c(1,)");
+	assert_stream("<q><c n=\"1\"/></q>", TRUE, "");
+	assert_stream("<r n=\"0\"><c n=\"1\"/><c n=\"2\">", FALSE, "r(0,)c(1,)");
+	assert_stream_handlers(stream_filter_handlers,
+			       "<r n=\"0\"><c n=\"1\">a</c><c n=\"1\">a</c><c n=\"1\">b</c><c n=\"2\">b</c><c n=\"2\"/><c n=\"2\"/></r>",
+			       TRUE, "r(0,)c(1,a)-c(1,b)c(2,b)c(2,)-");
+	assert_stream_handlers(stream_filter_handlers,
+			       "<x:r n=\"0\"><x:c n=\"1\">a<d/></x:c><x:c n=\"1\">a<d/></x:c></x:r>",
+			       TRUE, "r(0,)c(1,a)-");
+	/* nested element of the same name: raw text can't be hashed */
+	assert_stream_handlers(stream_filter_handlers,
+			       "<r n=\"0\"><c n=\"1\">a<c/></c><c n=\"1\">a<c/></c></r>",
+			       TRUE, "r(0,)c(1,a)c(1,a)");
+
+	/* canonicalization & raw extraction */
+	assert_c14n("<r xmlns=\"urn:x\"><e a=\"1&quot;&amp;&lt;&#x9;\" b=\"2\"></e><t>a&lt;b&gt;&amp;c&#xD;</t></r>");
+	assert_raw("<a><b x=\"1\">c</b></a>", "b", FALSE, "c");
+	assert_raw("<a><b x=\"1\">c</b></a>", "b", TRUE, "<b x=\"1\">c</b>");
+	assert_raw("<a><bb>d</bb><b>c</b></a>", "b", FALSE, "d</bb><b>c");
+	assert_raw("<a><b>c</bb></a>", "b", FALSE, NULL);
+	assert_raw("<a></a>", "b", FALSE, NULL);
+
+	/* ISO8601 timestamps: fast path */
+	assert_time("1970-01-01T00:00:00Z",              0);
+	assert_time("2009-11-13T10:00:00Z",              1258106400);
+	assert_time("2009-11-13T10:00:00",               1258106400);
+	assert_time("2015-03-04T10:00:00.1234567+01:00", 1425459600);
+	assert_time("2000-02-29T23:59:59-05:30",         951888599);
+	assert_time("2016-12-31T23:59:60Z",              1483228800);
+	assert_time("2009-11-13T10:00:00+0100",          1258102800);
+	/* ISO8601 timestamps: GLib fallback */
+	assert_time("20091113T100000Z",                  1258106400);
+	/* ISO8601 timestamps: invalid */
+	assert_time(NULL,                                0);
+	assert_time("",                                  0);
+	assert_time("2015-03-04",                        0);
+
+	sipe_xml_shutdown();
+
 	if (allocated) {
 		printf("MEMORY LEAK: %" G_GSIZE_FORMAT " still allocated\n", allocated);
 		failed++;
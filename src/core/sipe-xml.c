@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -35,55 +35,171 @@
 #include "glib.h"
 
 #include "sipe-backend.h"
+#include "sipe-limits.h"
 #include "sipe-utils.h"
 #include "sipe-xml.h"
 
+/*
+ * All nodes, attribute arrays, values and data of a document are carved
+ * out of a few large memory blocks, attribute names are interned. Freeing
+ * the document releases the blocks.
+ *
+ * Element names are interned globally, i.e. they can be matched against
+ * the components of a compiled path by pointer comparison. The number of
+ * element names used by the protocols is small.
+ */
+#define SIPE_XML_ARENA_BLOCK 4096
+#define SIPE_XML_ARENA_ALIGN(n) (((n) + 7) & ~((gsize) 7))
+
+struct _sipe_xml_block {
+	struct _sipe_xml_block *next;
+};
+
+struct _sipe_xml_arena {
+	struct _sipe_xml_block *blocks;
+	gchar *next;  /* free space in current block */
+	gchar *end;
+	gchar *last;  /* last allocation, can be extended in place */
+	GStringChunk *names;
+};
+
+struct _sipe_xml_attribute {
+	const gchar *name;
+	const gchar *value;
+};
+
 struct _sipe_xml {
-	gchar *name;
+	const gchar *name;
 	sipe_xml *parent;
 	sipe_xml *sibling;
 	sipe_xml *first;
 	sipe_xml *last;
-	GString *data;
-	GHashTable *attributes;
+	gchar *data;
+	gsize data_length;
+	struct _sipe_xml_attribute *attributes;
+	guint attribute_count;
+};
+
+/* a document root is a node with the arena attached */
+struct _sipe_xml_document {
+	sipe_xml root;
+	struct _sipe_xml_arena arena;
 };
 
 struct _parser_data {
-	sipe_xml *root;
+	struct _sipe_xml_document *document;
 	sipe_xml *current;
+	xmlParserCtxtPtr ctxt;
+	gsize length;    /* bytes fed so far */
+	guint depth;     /* of current element */
+	guint nodes;     /* materialized elements */
 	gboolean error;
+	gboolean silent; /* no debug output, i.e. worker thread */
 };
 
-/* our string equal function is case insensitive -> hash must be too! */
-static guint sipe_ascii_strdown_hash(gconstpointer key)
+static gpointer sipe_xml_arena_alloc(struct _sipe_xml_arena *arena,
+				     gsize size)
 {
-	gchar *lc = g_ascii_strdown((const gchar *) key, -1);
-	guint bucket = g_str_hash(lc);
-	g_free(lc);
+	gsize aligned = SIPE_XML_ARENA_ALIGN(size);
+	gchar *mem;
+
+	if ((gsize) (arena->end - arena->next) < aligned) {
+		/* leave room for growth of large data */
+		gsize length = SIPE_XML_ARENA_ALIGN(sizeof(struct _sipe_xml_block)) +
+			MAX(SIPE_XML_ARENA_BLOCK, 2 * aligned);
+		struct _sipe_xml_block *block = g_malloc(length);
+
+		block->next   = arena->blocks;
+		arena->blocks = block;
+		arena->next   = (gchar *) block +
+			SIPE_XML_ARENA_ALIGN(sizeof(struct _sipe_xml_block));
+		arena->end    = (gchar *) block + length;
+	}
 
-	return(bucket);
+	mem          = arena->next;
+	arena->next += aligned;
+	arena->last  = mem;
+	return(memset(mem, 0, size));
 }
 
-static void callback_start_element(void *user_data, const xmlChar *name, const xmlChar **attrs)
+/* append to zero-terminated string allocated from arena */
+static gchar *sipe_xml_arena_append(struct _sipe_xml_arena *arena,
+				    gchar *string,
+				    gsize length,
+				    const gchar *text,
+				    gsize text_length)
 {
-	struct _parser_data *pd = user_data;
-	const char *tmp;
-	sipe_xml *node;
+	gsize needed = length + text_length + 1;
+
+	if (!string ||
+	    (string != arena->last) ||
+	    ((gsize) (arena->end - string) < needed)) {
+		gchar *copy = sipe_xml_arena_alloc(arena, needed);
+		if (string)
+			memcpy(copy, string, length);
+		string = copy;
+	} else {
+		arena->next = string + SIPE_XML_ARENA_ALIGN(needed);
+	}
 
-	if (!name || pd->error) return;
+	memcpy(string + length, text, text_length);
+	string[length + text_length] = '\0';
+	return(string);
+}
 
-	node = g_new0(sipe_xml, 1);
+static void sipe_xml_arena_free(struct _sipe_xml_arena *arena)
+{
+	struct _sipe_xml_block *block = arena->blocks;
 
-	if ((tmp = strchr((char *)name, ':')) != NULL) {
-		name = (xmlChar *)tmp + 1;
+	while (block) {
+		struct _sipe_xml_block *next = block->next;
+		g_free(block);
+		block = next;
 	}
-	node->name = g_strdup((gchar *)name);
+	if (arena->names)
+		g_string_chunk_free(arena->names);
+}
+
+static const gchar *sipe_xml_arena_intern(struct _sipe_xml_arena *arena,
+					  const gchar *name)
+{
+	if (!arena->names)
+		arena->names = g_string_chunk_new(256);
+	return(g_string_chunk_insert_const(arena->names, name));
+}
+
+/* returns TRUE if the document has been rejected */
+static gboolean parser_limit(struct _parser_data *pd,
+			     sipe_limit limit,
+			     gsize value)
+{
+	if (!sipe_limit_exceeded(limit, value))
+		return(FALSE);
 
-	if (!pd->root) {
-		pd->root = node;
+	/* skip the rest of the document */
+	pd->error = TRUE;
+	if (pd->ctxt)
+		xmlStopParser(pd->ctxt);
+
+	if (!pd->silent)
+		SIPE_DEBUG_ERROR("XML parser: %s limit of %" G_GSIZE_FORMAT " exceeded",
+				 sipe_limit_name(limit), sipe_limit_get(limit));
+	return(TRUE);
+}
+
+static void dom_start_element(struct _parser_data *pd, const xmlChar *name, const xmlChar **attrs)
+{
+	struct _sipe_xml_arena *arena;
+	const char *tmp;
+	sipe_xml *node;
+
+	if (!pd->document) {
+		pd->document = g_new0(struct _sipe_xml_document, 1);
+		node         = &pd->document->root;
 	} else {
 		sipe_xml *current = pd->current;
 
+		node = sipe_xml_arena_alloc(&pd->document->arena, sizeof(sipe_xml));
 		node->parent = current;
 		if (current->last) {
 			current->last->sibling = node;
@@ -92,36 +208,80 @@ static void callback_start_element(void *user_data, const xmlChar *name, const x
 		}
 		current->last = node;
 	}
+	arena = &pd->document->arena;
+
+	if ((tmp = strchr((char *)name, ':')) != NULL) {
+		name = (xmlChar *)tmp + 1;
+	}
+	node->name = g_intern_string((gchar *)name);
 
 	if (attrs) {
-		const xmlChar *key;
-
-		node->attributes = g_hash_table_new_full(sipe_ascii_strdown_hash,
-							 (GEqualFunc) sipe_strcase_equal,
-							 g_free, g_free);
-		while ((key = *attrs++) != NULL) {
-			if ((tmp = strchr((char *)key, ':')) != NULL) {
-				key = (xmlChar *)tmp + 1;
+		const xmlChar **count = attrs;
+		struct _sipe_xml_attribute *attribute;
+
+		while (*count)
+			count += 2;
+		node->attribute_count = (count - attrs) / 2;
+		node->attributes = attribute =
+			sipe_xml_arena_alloc(arena,
+					     node->attribute_count * sizeof(struct _sipe_xml_attribute));
+
+		while (*attrs) {
+			const gchar *key   = (const gchar *) *attrs++;
+			const gchar *value = (const gchar *) *attrs++;
+			gsize length       = value ? strlen(value) : 0;
+			gchar *copy;
+			gchar *amp;
+
+			if ((tmp = strchr(key, ':')) != NULL) {
+				key = tmp + 1;
 			}
+			attribute->name = sipe_xml_arena_intern(arena, key);
+
 			/* libxml2 decodes all entities except &amp;.
 			   &amp; is replaced by the equivalent &#38; */
-			g_hash_table_insert(node->attributes,
-					    g_strdup((gchar *) key),
-					    sipe_utils_str_replace((gchar *) *attrs++, "&#38;", "&"));
+			copy = sipe_xml_arena_append(arena, NULL, 0,
+						     value ? value : "", length);
+			amp  = copy;
+			while ((amp = strstr(amp, "&#38;")) != NULL) {
+				amp++;
+				memmove(amp, amp + 4, strlen(amp + 4) + 1);
+			}
+			attribute->value = copy;
+			attribute++;
 		}
 	}
 
 	pd->current = node;
 }
 
+static void dom_end_element(struct _parser_data *pd)
+{
+	if (pd->current && pd->current->parent)
+		pd->current = pd->current->parent;
+}
+
+static void callback_start_element(void *user_data, const xmlChar *name, const xmlChar **attrs)
+{
+	struct _parser_data *pd = user_data;
+
+	if (!name || pd->error) return;
+
+	if (parser_limit(pd, SIPE_LIMIT_XML_DEPTH, ++pd->depth) ||
+	    parser_limit(pd, SIPE_LIMIT_XML_NODES, ++pd->nodes))
+		return;
+
+	dom_start_element(pd, name, attrs);
+}
+
 static void callback_end_element(void *user_data, const xmlChar *name)
 {
 	struct _parser_data *pd = user_data;
 
-	if (!name || !pd->current || pd->error) return;
+	if (!name || pd->error) return;
 
-	if (pd->current->parent)
-		pd->current = pd->current->parent;
+	pd->depth--;
+	dom_end_element(pd);
 }
 
 static void callback_characters(void *user_data, const xmlChar *text, int text_len)
@@ -132,10 +292,12 @@ static void callback_characters(void *user_data, const xmlChar *text, int text_l
 	if (!pd->current || pd->error || !text || !text_len) return;
 
 	node = pd->current;
-	if (node->data)
-		node->data = g_string_append_len(node->data, (gchar *)text, text_len);
-	else
-		node->data = g_string_new_len((gchar *)text, text_len);
+	node->data = sipe_xml_arena_append(&pd->document->arena,
+					   node->data,
+					   node->data_length,
+					   (const gchar *) text,
+					   text_len);
+	node->data_length += text_len;
 }
 
 static void callback_error(void *user_data, const char *msg, ...)
@@ -145,6 +307,8 @@ static void callback_error(void *user_data, const char *msg, ...)
 	va_list args;
 
 	pd->error = TRUE;
+	if (pd->silent)
+		return;
 
 	va_start(args, msg);
 	errmsg = g_strdup_vprintf(msg, args);
@@ -157,10 +321,15 @@ static void callback_error(void *user_data, const char *msg, ...)
 static void callback_serror(void *user_data, xmlErrorPtr error)
 {
 	struct _parser_data *pd = user_data;
+	gboolean fatal = error && (error->level == XML_ERR_ERROR ||
+				   error->level == XML_ERR_FATAL);
 
-	if (error && (error->level == XML_ERR_ERROR ||
-	              error->level == XML_ERR_FATAL)) {
+	if (fatal)
 		pd->error = TRUE;
+	if (pd->silent)
+		return;
+
+	if (fatal) {
 		SIPE_DEBUG_ERROR("XML parser error: Domain %i, code %i, level %i: %s",
 				 error->domain, error->code, error->level,
 				 error->message ? error->message : "(null)");
@@ -210,20 +379,212 @@ static xmlSAXHandler parser = {
 	callback_serror,        /* serror */
 };
 
-sipe_xml *sipe_xml_parse(const gchar *string, gsize length)
+void sipe_xml_init(void)
 {
-	sipe_xml *result = NULL;
+	/* must be called from the main thread before any parser is used */
+	xmlInitParser();
+}
 
-	if (string && length) {
-		struct _parser_data *pd = g_new0(struct _parser_data, 1);
+/*
+ * Parser contexts
+ *
+ * Each thread keeps an idle push parser context and a dictionary for the
+ * element & attribute names seen by libxml2. The context is reset between
+ * documents instead of being set up from scratch for each of them. All
+ * contexts of a thread share the dictionary. It is dropped when it grows
+ * too large, e.g. after parsing documents with generated names.
+ */
+#define SIPE_XML_DICT_MAX 4096
 
-		if (xmlSAXUserParseMemory(&parser, pd, string, length))
+struct _parser_thread {
+	xmlDictPtr dict;
+	xmlParserCtxtPtr push; /* idle push parser context */
+	xmlParserCtxtPtr tree; /* idle context for sipe_xml_exc_c14n() */
+};
+
+static void parser_thread_free(gpointer data)
+{
+	struct _parser_thread *thread = data;
+
+	if (thread->tree)
+		xmlFreeParserCtxt(thread->tree);
+	if (thread->push)
+		xmlFreeParserCtxt(thread->push);
+	if (thread->dict)
+		xmlDictFree(thread->dict);
+	g_free(thread);
+}
+
+/* Worker threads require GLib threads without additional initialization */
+#if GLIB_CHECK_VERSION(2,32,0)
+static GPrivate parser_thread_key = G_PRIVATE_INIT(parser_thread_free);
+
+static struct _parser_thread *parser_thread(void)
+{
+	struct _parser_thread *thread = g_private_get(&parser_thread_key);
+
+	if (!thread) {
+		thread = g_new0(struct _parser_thread, 1);
+		g_private_set(&parser_thread_key, thread);
+	}
+	return(thread);
+}
+
+static void parser_thread_shutdown(void)
+{
+	g_private_replace(&parser_thread_key, NULL);
+}
+#else
+/* no worker threads: all documents are parsed in the main thread */
+static struct _parser_thread *parser_thread_data = NULL;
+
+static struct _parser_thread *parser_thread(void)
+{
+	if (!parser_thread_data)
+		parser_thread_data = g_new0(struct _parser_thread, 1);
+	return(parser_thread_data);
+}
+
+static void parser_thread_shutdown(void)
+{
+	if (parser_thread_data) {
+		parser_thread_free(parser_thread_data);
+		parser_thread_data = NULL;
+	}
+}
+#endif
+
+static void parser_context_share_dict(struct _parser_thread *thread,
+				      xmlParserCtxtPtr ctxt)
+{
+	if (thread->dict) {
+		xmlDictFree(ctxt->dict);
+		ctxt->dict = thread->dict;
+
+		/* names cached by the context must come from its dictionary */
+		ctxt->str_xml    = xmlDictLookup(ctxt->dict, BAD_CAST "xml", 3);
+		ctxt->str_xmlns  = xmlDictLookup(ctxt->dict, BAD_CAST "xmlns", 5);
+		ctxt->str_xml_ns = xmlDictLookup(ctxt->dict, XML_XML_NAMESPACE, 36);
+	} else {
+		thread->dict = ctxt->dict;
+	}
+	xmlDictReference(thread->dict);
+}
+
+static gboolean parser_context_keep(struct _parser_thread *thread,
+				    xmlParserCtxtPtr *slot,
+				    xmlParserCtxtPtr ctxt)
+{
+	if (!*slot &&
+	    (ctxt->dict == thread->dict) &&
+	    (xmlDictSize(thread->dict) < SIPE_XML_DICT_MAX)) {
+		*slot = ctxt;
+		return(TRUE);
+	}
+
+	xmlFreeParserCtxt(ctxt);
+
+	/* start over with a new dictionary */
+	if (thread->dict &&
+	    (xmlDictSize(thread->dict) >= SIPE_XML_DICT_MAX)) {
+		xmlDictFree(thread->dict);
+		thread->dict = NULL;
+	}
+	return(FALSE);
+}
+
+static xmlParserCtxtPtr parser_context_get(xmlSAXHandler *sax,
+					   struct _parser_data *pd)
+{
+	struct _parser_thread *thread = parser_thread();
+	xmlParserCtxtPtr ctxt         = thread->push;
+
+	if (ctxt) {
+		thread->push = NULL;
+		xmlCtxtResetPush(ctxt, NULL, 0, NULL, NULL);
+	} else {
+		ctxt = xmlCreatePushParserCtxt(sax, pd, NULL, 0, NULL);
+		if (!ctxt)
+			return(NULL);
+		parser_context_share_dict(thread, ctxt);
+	}
+
+	/* the same context is used with different SAX handlers */
+	memcpy(ctxt->sax, sax, sizeof(xmlSAXHandler));
+	ctxt->userData = pd;
+	pd->ctxt       = ctxt;
+
+	return(ctxt);
+}
+
+static void parser_context_release(xmlParserCtxtPtr ctxt)
+{
+	struct _parser_thread *thread = parser_thread();
+
+	ctxt->userData = NULL;
+	parser_context_keep(thread, &thread->push, ctxt);
+}
+
+/* xmlParseChunk() only accepts int sizes */
+#define SIPE_XML_CHUNK_MAX (1 << 30)
+
+static void parser_context_feed(xmlParserCtxtPtr ctxt,
+				struct _parser_data *pd,
+				const gchar *data,
+				gsize length,
+				gboolean terminate)
+{
+	do {
+		gsize chunk = MIN(length, SIPE_XML_CHUNK_MAX);
+
+		length -= chunk;
+		xmlParseChunk(ctxt, data, chunk, terminate && !length);
+		if (!ctxt->wellFormed)
 			pd->error = TRUE;
+		data += chunk;
+	} while (length && !pd->error);
+}
+
+static sipe_xml *parser_result(struct _parser_data *pd)
+{
+	sipe_xml *result = NULL;
 
+	if (pd->document) {
 		if (pd->error) {
-			sipe_xml_free(pd->root);
+			sipe_xml_free(&pd->document->root);
 		} else {
-			result = pd->root;
+			result = &pd->document->root;
+		}
+		pd->document = NULL;
+	}
+
+	return(result);
+}
+
+static sipe_xml *xml_parse(const gchar *string, gsize length,
+			   gboolean silent)
+{
+	sipe_xml *result = NULL;
+
+	if (string && length) {
+		struct _parser_data *pd;
+		xmlParserCtxtPtr ctxt;
+
+		if (sipe_limit_exceeded(SIPE_LIMIT_XML_LENGTH, length)) {
+			if (!silent)
+				SIPE_DEBUG_ERROR("xml_parse: rejecting document of %" G_GSIZE_FORMAT " bytes",
+						 length);
+			return(NULL);
+		}
+
+		pd         = g_new0(struct _parser_data, 1);
+		ctxt       = parser_context_get(&parser, pd);
+		pd->silent = silent;
+
+		if (ctxt) {
+			parser_context_feed(ctxt, pd, string, length, TRUE);
+			parser_context_release(ctxt);
+			result = parser_result(pd);
 		}
 
 		g_free(pd);
@@ -232,55 +593,392 @@ sipe_xml *sipe_xml_parse(const gchar *string, gsize length)
 	return result;
 }
 
-void sipe_xml_free(sipe_xml *node)
+sipe_xml *sipe_xml_parse(const gchar *string, gsize length)
 {
-	sipe_xml *child;
+	return(xml_parse(string, length, FALSE));
+}
 
-	if (!node) return;
+sipe_xml *sipe_xml_parse_silent(const gchar *string, gsize length)
+{
+	return(xml_parse(string, length, TRUE));
+}
 
-	/* we don't support partial tree deletion */
-	if (node->parent != NULL) {
-		SIPE_DEBUG_ERROR_NOFORMAT("sipe_xml_free: partial delete attempt! Expect crash or memory leaks...");
+struct sipe_xml_push {
+	struct _parser_data pd;
+	xmlParserCtxtPtr ctxt;
+};
+
+struct sipe_xml_push *sipe_xml_push_new(void)
+{
+	struct sipe_xml_push *push = g_new0(struct sipe_xml_push, 1);
+
+	push->ctxt = parser_context_get(&parser, &push->pd);
+	if (!push->ctxt) {
+		g_free(push);
+		return(NULL);
+	}
+
+	return(push);
+}
+
+void sipe_xml_push_feed(struct sipe_xml_push *push,
+			const gchar *data,
+			gsize length)
+{
+	if (push && data && length && !push->pd.error) {
+		push->pd.length += length;
+		if (!parser_limit(&push->pd, SIPE_LIMIT_XML_LENGTH, push->pd.length))
+			parser_context_feed(push->ctxt, &push->pd, data, length, FALSE);
+	}
+}
+
+sipe_xml *sipe_xml_push_finish(struct sipe_xml_push *push)
+{
+	sipe_xml *result;
+
+	if (!push) return(NULL);
+
+	if (!push->pd.error)
+		parser_context_feed(push->ctxt, &push->pd, NULL, 0, TRUE);
+	parser_context_release(push->ctxt);
+	result = parser_result(&push->pd);
+	g_free(push);
+
+	return(result);
+}
+
+void sipe_xml_push_free(struct sipe_xml_push *push)
+{
+	if (push) {
+		push->pd.error = TRUE;
+		sipe_xml_push_finish(push);
+	}
+}
+
+/*
+ * Streaming parser
+ *
+ * Only elements inside a subtree matched by a handler with an "end"
+ * callback are materialized. Each such subtree gets its own document
+ * which is released right after the callback returns.
+ */
+struct _stream_data {
+	struct _parser_data pd; /* must be first: DOM callbacks use it */
+	const struct sipe_xml_stream_handler *handlers;
+	const struct sipe_xml_stream_handler *active; /* building subtree */
+	gpointer user_data;
+	GString *path;        /* "a/b/c" of current element */
+	GArray *path_lengths; /* path->len before each element */
+	guint skip;           /* depth inside ignored element */
+};
+
+static const struct sipe_xml_stream_handler *stream_find_handler(struct _stream_data *sd,
+								 gboolean *ancestor)
+{
+	const struct sipe_xml_stream_handler *handler;
+	const gchar *path = sd->path->str;
+	gsize length      = sd->path->len;
+
+	*ancestor = FALSE;
+	for (handler = sd->handlers; handler->path; handler++) {
+		if (strncmp(handler->path, path, length) == 0) {
+			if (handler->path[length] == '\0')
+				return(handler);
+			if (handler->path[length] == '/')
+				*ancestor = TRUE;
+		}
+	}
+	return(NULL);
+}
+
+#define STREAM_HASH(hash, c) ((hash) = ((hash) << 5) + (hash) + (guchar) (c))
+
+/*
+ * Hash of the raw text of an element whose start tag has just been parsed.
+ * The start tag callback is called before the closing '>' of the tag has
+ * been consumed, i.e. the content starts right after the current position.
+ */
+static guint stream_raw_hash(struct _parser_data *pd,
+			     const xmlChar *name,
+			     const xmlChar **attrs)
+{
+	xmlParserInputPtr input = pd->ctxt ? pd->ctxt->input : NULL;
+	const gchar *cur, *end;
+	guint hash = 5381;
+
+	if (!(input && input->cur && input->end))
+		return(0);
+	cur = (const gchar *) input->cur;
+	end = (const gchar *) input->end;
+
+	/* separators also distinguish attribute names from values */
+	if (attrs)
+		while (*attrs) {
+			const xmlChar *value = *attrs++;
+			while (*value)
+				STREAM_HASH(hash, *value++);
+			STREAM_HASH(hash, 1);
+		}
+
+	if ((cur < end) && (*cur == '>')) {
+		gchar *tag = g_strdup_printf("</%s>", name);
+		const gchar *close = g_strstr_len(cur, end - cur, tag);
+		const gchar *nested;
+
+		g_free(tag);
+		/* end tag not buffered yet */
+		if (!close)
+			return(0);
+
+		/* end tag might belong to a nested element */
+		tag    = g_strdup_printf("<%s", name);
+		nested = g_strstr_len(cur, close - cur, tag);
+		if (nested && strchr(" \t\r\n/>", nested[strlen(tag)])) {
+			g_free(tag);
+			return(0);
+		}
+		g_free(tag);
+
+		for (cur++; cur < close; cur++)
+			STREAM_HASH(hash, *cur);
+	} else if (!(((end - cur) >= 2) && (cur[0] == '/') && (cur[1] == '>'))) {
+		return(0);
+	}
+
+	/* 0 is reserved for "unknown" */
+	return(hash ? hash : 1);
+}
+
+static void stream_start_element(void *user_data, const xmlChar *name, const xmlChar **attrs)
+{
+	struct _stream_data *sd = user_data;
+	struct _parser_data *pd = user_data;
+	const struct sipe_xml_stream_handler *handler;
+	const gchar *tmp;
+	gboolean ancestor;
+	gsize length;
+
+	if (!name || pd->error) return;
+
+	/* ignored elements count too */
+	if (parser_limit(pd, SIPE_LIMIT_XML_DEPTH, ++pd->depth))
+		return;
+
+	/* inside matched subtree */
+	if (sd->active) {
+		if (!parser_limit(pd, SIPE_LIMIT_XML_NODES, ++pd->nodes))
+			dom_start_element(pd, name, attrs);
+		return;
+	}
+
+	/* inside ignored element */
+	if (sd->skip) {
+		sd->skip++;
+		return;
+	}
+
+	length = sd->path->len;
+	if ((tmp = strchr((char *)name, ':')) == NULL)
+		tmp = (const gchar *) name;
+	else
+		tmp++;
+	if (length)
+		g_string_append_c(sd->path, '/');
+	g_string_append(sd->path, tmp);
+
+	handler = stream_find_handler(sd, &ancestor);
+	if (!(handler || ancestor)) {
+		g_string_truncate(sd->path, length);
+		sd->skip = 1;
+		return;
+	}
+	g_array_append_val(sd->path_lengths, length);
+
+	if (handler) {
+		if (parser_limit(pd, SIPE_LIMIT_XML_NODES, ++pd->nodes))
+			return;
+		dom_start_element(pd, name, attrs);
+
+		/* rejected elements are skipped without building the subtree */
+		if (handler->filter &&
+		    !(*handler->filter)(&pd->document->root,
+					stream_raw_hash(pd, name, attrs),
+					sd->user_data)) {
+			sipe_xml_free(&pd->document->root);
+			pd->document = NULL;
+			pd->current  = NULL;
+			pd->nodes    = 0;
+			g_array_set_size(sd->path_lengths,
+					 sd->path_lengths->len - 1);
+			g_string_truncate(sd->path, length);
+			sd->skip = 1;
+			return;
+		}
+
+		if (handler->start)
+			(*handler->start)(&pd->document->root, sd->user_data);
+
+		if (handler->end) {
+			sd->active = handler;
+		} else {
+			/* only attributes were requested */
+			sipe_xml_free(&pd->document->root);
+			pd->document = NULL;
+			pd->current  = NULL;
+			pd->nodes    = 0;
+		}
 	}
+}
+
+static void stream_end_element(void *user_data, const xmlChar *name)
+{
+	struct _stream_data *sd = user_data;
+	struct _parser_data *pd = user_data;
+
+	if (!name || pd->error) return;
+
+	pd->depth--;
+
+	if (sd->active) {
+		/* end of matched subtree? */
+		if (pd->current == &pd->document->root) {
+			(*sd->active->end)(&pd->document->root, sd->user_data);
+			sipe_xml_free(&pd->document->root);
+			pd->document = NULL;
+			pd->current  = NULL;
+			pd->nodes    = 0;
+			sd->active   = NULL;
+		} else {
+			dom_end_element(pd);
+			return;
+		}
+	} else if (sd->skip) {
+		sd->skip--;
+		return;
+	}
+
+	if (sd->path_lengths->len) {
+		guint last = sd->path_lengths->len - 1;
+		g_string_truncate(sd->path,
+				  g_array_index(sd->path_lengths, gsize, last));
+		g_array_set_size(sd->path_lengths, last);
+	}
+}
+
+static void stream_characters(void *user_data, const xmlChar *text, int text_len)
+{
+	struct _stream_data *sd = user_data;
+
+	if (sd->active)
+		callback_characters(user_data, text, text_len);
+}
+
+/* API doesn't accept const data structure */
+static xmlSAXHandler stream_parser = {
+	NULL,                   /* internalSubset */
+	NULL,                   /* isStandalone */
+	NULL,                   /* hasInternalSubset */
+	NULL,                   /* hasExternalSubset */
+	NULL,                   /* resolveEntity */
+	NULL,                   /* getEntity */
+	NULL,                   /* entityDecl */
+	NULL,                   /* notationDecl */
+	NULL,                   /* attributeDecl */
+	NULL,                   /* elementDecl */
+	NULL,                   /* unparsedEntityDecl */
+	NULL,                   /* setDocumentLocator */
+	NULL,                   /* startDocument */
+	NULL,                   /* endDocument */
+	stream_start_element,   /* startElement */
+	stream_end_element,     /* endElement   */
+	NULL,                   /* reference */
+	stream_characters,      /* characters */
+	NULL,                   /* ignorableWhitespace */
+	NULL,                   /* processingInstruction */
+	NULL,                   /* comment */
+	NULL,                   /* warning */
+	callback_error,         /* error */
+	NULL,                   /* fatalError */
+	NULL,                   /* getParameterEntity */
+	NULL,                   /* cdataBlock */
+	NULL,                   /* externalSubset */
+	XML_SAX2_MAGIC,         /* initialized */
+	NULL,                   /* _private */
+	NULL,                   /* startElementNs */
+	NULL,                   /* endElementNs   */
+	callback_serror,        /* serror */
+};
 
-	/* free children */
-	child = node->first;
-	while (child) {
-		sipe_xml *tmp = child->sibling;
-		child->parent = NULL; /* detach from tree, see above */
-		sipe_xml_free(child);
-		child = tmp;
+gboolean sipe_xml_stream_parse(const gchar *string, gsize length,
+			       const struct sipe_xml_stream_handler *handlers,
+			       gpointer user_data)
+{
+	struct _stream_data *sd;
+	xmlParserCtxtPtr ctxt;
+	gboolean result;
+
+	if (!string || !length || !handlers) return FALSE;
+
+	sd = g_new0(struct _stream_data, 1);
+	sd->handlers     = handlers;
+	sd->user_data    = user_data;
+	sd->path         = g_string_new("");
+	sd->path_lengths = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+	ctxt = parser_context_get(&stream_parser, &sd->pd);
+	if (ctxt) {
+		parser_context_feed(ctxt, &sd->pd, string, length, TRUE);
+		parser_context_release(ctxt);
+	} else {
+		sd->pd.error = TRUE;
 	}
 
-	/* free node */
-	g_free(node->name);
-	if (node->data)       g_string_free(node->data, TRUE);
-	if (node->attributes) g_hash_table_destroy(node->attributes);
-	g_free(node);
+	/* unfinished subtree after error */
+	if (sd->pd.document)
+		sipe_xml_free(&sd->pd.document->root);
+
+	result = !sd->pd.error;
+	g_array_free(sd->path_lengths, TRUE);
+	g_string_free(sd->path, TRUE);
+	g_free(sd);
+
+	return(result);
 }
 
-static void sipe_xml_stringify_attribute(gpointer key, gpointer value,
-					 gpointer user_data)
+void sipe_xml_free(sipe_xml *node)
 {
-	g_string_append_printf(user_data, " %s=\"%s\"",
-			       (const gchar *) key, (const gchar *) value);
+	struct _sipe_xml_document *document;
+
+	if (!node) return;
+
+	/* we don't support partial tree deletion */
+	if (node->parent != NULL) {
+		SIPE_DEBUG_ERROR_NOFORMAT("sipe_xml_free: partial delete attempt! Ignoring...");
+		return;
+	}
+
+	/* all nodes are allocated from the arena of the root node */
+	document = (struct _sipe_xml_document *) node;
+	sipe_xml_arena_free(&document->arena);
+	g_free(document);
 }
 
 static void sipe_xml_stringify_node(GString *s, const sipe_xml *node)
 {
+	guint i;
+
 	g_string_append_printf(s, "<%s", node->name);
 
-	if (node->attributes) {
-		g_hash_table_foreach(node->attributes,
-				     (GHFunc) sipe_xml_stringify_attribute,
-				     s);
-	}
+	for (i = 0; i < node->attribute_count; i++)
+		g_string_append_printf(s, " %s=\"%s\"",
+				       node->attributes[i].name,
+				       node->attributes[i].value);
 
 	if (node->data || node->first) {
 		const sipe_xml *child;
 
 		g_string_append_printf(s, ">%s",
-				       node->data ? node->data->str : "");
+				       node->data ? node->data : "");
 
 		for (child = node->first; child; child = child->sibling)
 			sipe_xml_stringify_node(s, child);
@@ -302,38 +1000,167 @@ gchar *sipe_xml_stringify(const sipe_xml *node)
 	return g_string_free(s, FALSE);
 }
 
-const sipe_xml *sipe_xml_child(const sipe_xml *parent, const gchar *name)
+struct _sipe_xml_path_compiled {
+	const gchar *names[1]; /* interned, NULL terminated */
+};
+
+static struct _sipe_xml_path_compiled *sipe_xml_path_split(const gchar *path)
+{
+	gchar **components = g_strsplit(path, "/", 0);
+	guint count        = g_strv_length(components);
+	struct _sipe_xml_path_compiled *compiled =
+		g_malloc(sizeof(struct _sipe_xml_path_compiled) +
+			 count * sizeof(const gchar *));
+	guint i;
+
+	for (i = 0; i < count; i++)
+		compiled->names[i] = g_intern_string(components[i]);
+	compiled->names[count] = NULL;
+	g_strfreev(components);
+
+	return(compiled);
+}
+
+sipe_xml_path *sipe_xml_path_compile(const gchar *path)
+{
+	sipe_xml_path *compiled = g_new0(sipe_xml_path, 1);
+	compiled->compiled = sipe_xml_path_split(path);
+	return(compiled);
+}
+
+void sipe_xml_path_free(sipe_xml_path *path)
+{
+	if (path) {
+		g_free(path->compiled);
+		g_free(path);
+	}
+}
+
+const sipe_xml *sipe_xml_child_path(const sipe_xml *parent,
+				    sipe_xml_path *path)
+{
+	const gchar * const *name;
+
+	if (!parent || !path) return NULL;
+
+	/* static paths are compiled on first use */
+	if (!path->compiled)
+		path->compiled = sipe_xml_path_split(path->path);
+
+	name = path->compiled->names;
+	if (!*name) return NULL;
+
+	for (; *name; name++) {
+		const sipe_xml *child;
+
+		for (child = parent->first; child; child = child->sibling)
+			if (child->name == *name)
+				break;
+
+		if (!child)
+			return NULL;
+		parent = child;
+	}
+
+	return parent;
+}
+
+/* compiled string paths of sipe_xml_child(): main thread only */
+#define SIPE_XML_PATH_CACHE_MAX 1024
+static GHashTable *path_cache = NULL;
+
+void sipe_xml_shutdown(void)
+{
+	if (path_cache) {
+		g_hash_table_destroy(path_cache);
+		path_cache = NULL;
+	}
+	parser_thread_shutdown();
+}
+
+void sipe_xml_memory_usage(guint64 *bytes, guint64 *objects)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (!path_cache)
+		return;
+
+	g_hash_table_iter_init(&iter, path_cache);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const sipe_xml_path *path = value;
+		const gchar * const *name;
+
+		*bytes   += strlen(key) + 1 + sizeof(sipe_xml_path);
+		*objects += 2;
+		if (path->compiled) {
+			*bytes += sizeof(struct _sipe_xml_path_compiled);
+			for (name = path->compiled->names; *name; name++)
+				*bytes += sizeof(const gchar *);
+			(*objects)++;
+		}
+	}
+}
+
+static const sipe_xml *sipe_xml_child_walk(const sipe_xml *parent,
+					   const gchar *name)
 {
-	gchar **names;
 	const sipe_xml *child = NULL;
 
-	if (!parent || !name) return NULL;
+	/* walk path a/b/c one component at a time */
+	while (parent) {
+		const gchar *slash = strchr(name, '/');
+		gsize length       = slash ? (gsize) (slash - name) : strlen(name);
 
-	/* 0: child name */
-	/* 1: trailing path (optional) */
-	names = g_strsplit(name, "/", 2);
+		for (child = parent->first; child; child = child->sibling) {
+			if ((strncmp(name, child->name, length) == 0) &&
+			    (child->name[length] == '\0'))
+				break;
+		}
 
-	for (child = parent->first; child; child = child->sibling) {
-		if (sipe_strequal(names[0], child->name))
+		if (!child || !slash)
 			break;
-	}
 
-	/* recurse into path */
-	if (child && names[1])
-		child = sipe_xml_child(child, names[1]);
+		parent = child;
+		name   = slash + 1;
+	}
 
-	g_strfreev(names);
 	return child;
 }
 
+const sipe_xml *sipe_xml_child(const sipe_xml *parent, const gchar *name)
+{
+	sipe_xml_path *path;
+
+	if (!parent || !name) return NULL;
+
+	if (!path_cache)
+		path_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+						   g_free,
+						   (GDestroyNotify) sipe_xml_path_free);
+
+	path = g_hash_table_lookup(path_cache, name);
+	if (!path) {
+		/* callers with generated paths must not fill the cache */
+		if (g_hash_table_size(path_cache) >= SIPE_XML_PATH_CACHE_MAX)
+			return(sipe_xml_child_walk(parent, name));
+
+		path = sipe_xml_path_compile(name);
+		g_hash_table_insert(path_cache, g_strdup(name), path);
+	}
+
+	return(sipe_xml_child_path(parent, path));
+}
+
 const sipe_xml *sipe_xml_twin(const sipe_xml *node)
 {
 	sipe_xml *sibling;
 
 	if (!node) return NULL;
 
+	/* element names are interned */
 	for (sibling = node->sibling; sibling; sibling = sibling->sibling) {
-		if (sipe_strequal(node->name, sibling->name))
+		if (node->name == sibling->name)
 			return sibling;
 	}
 	return NULL;
@@ -346,8 +1173,17 @@ const gchar *sipe_xml_name(const sipe_xml *node)
 
 const gchar *sipe_xml_attribute(const sipe_xml *node, const gchar *attr)
 {
-	if (!node || !attr || !node->attributes) return NULL;
-	return(g_hash_table_lookup(node->attributes, attr));
+	guint i;
+
+	if (!node || !attr) return NULL;
+
+	/* attribute names are case insensitive, last one wins */
+	for (i = node->attribute_count; i > 0; i--) {
+		const struct _sipe_xml_attribute *attribute = node->attributes + i - 1;
+		if (g_ascii_strcasecmp(attribute->name, attr) == 0)
+			return(attribute->value);
+	}
+	return NULL;
 }
 
 guint sipe_xml_int_attribute(const sipe_xml *node, const gchar *attr,
@@ -359,8 +1195,64 @@ guint sipe_xml_int_attribute(const sipe_xml *node, const gchar *attr,
 
 gchar *sipe_xml_data(const sipe_xml *node)
 {
-	if (!node || !node->data || !node->data->str) return NULL;
-	return g_strdup(node->data->str);
+	if (!node || !node->data) return NULL;
+	return g_strndup(node->data, node->data_length);
+}
+
+const gchar *sipe_xml_data_view(const sipe_xml *node, gsize *length)
+{
+	if (!node || !node->data) {
+		if (length) *length = 0;
+		return NULL;
+	}
+	if (length) *length = node->data_length;
+	return(node->data);
+}
+
+/* data view without leading & trailing whitespace */
+static const gchar *sipe_xml_data_trimmed(const sipe_xml *node, gsize *length)
+{
+	const gchar *data = sipe_xml_data_view(node, length);
+	gsize len         = *length;
+
+	if (!data) return NULL;
+	while (len && g_ascii_isspace(*data)) {
+		data++;
+		len--;
+	}
+	while (len && g_ascii_isspace(data[len - 1]))
+		len--;
+
+	*length = len;
+	return(len ? data : NULL);
+}
+
+guint sipe_xml_data_int(const sipe_xml *node, guint fallback)
+{
+	gsize length;
+	const gchar *data = sipe_xml_data_trimmed(node, &length);
+	gchar *end;
+	guint64 value;
+
+	if (!data) return(fallback);
+	/* data is NUL terminated, trailing whitespace stops the conversion */
+	value = g_ascii_strtoull(data, &end, 10);
+	return((end == data) ? fallback : (guint) value);
+}
+
+gboolean sipe_xml_data_boolean(const sipe_xml *node, gboolean fallback)
+{
+	gsize length;
+	const gchar *data = sipe_xml_data_trimmed(node, &length);
+
+	if (!data) return(fallback);
+	if (((length == 4) && (g_ascii_strncasecmp(data, "true", 4) == 0)) ||
+	    ((length == 1) && (*data == '1')))
+		return(TRUE);
+	if (((length == 5) && (g_ascii_strncasecmp(data, "false", 5) == 0)) ||
+	    ((length == 1) && (*data == '0')))
+		return(FALSE);
+	return(fallback);
 }
 
 /**
@@ -375,17 +1267,13 @@ void sipe_xml_dump(const sipe_xml *node, const gchar *path)
 	gchar *new_path;
 	if (!node) return;
 	new_path = g_strdup_printf("%s/%s", path ? path : "", node->name);
-	if (node->attributes) {
-		GList *attrs = g_hash_table_get_keys(node->attributes);
+	if (node->attribute_count) {
 		GString *buf = g_string_new("");
-		GList *entry = attrs;
-		while (entry) {
-			g_string_append_printf(buf, "%s ", (gchar *)entry->data);
-			entry = entry->next;
-		}
+		guint i;
+		for (i = 0; i < node->attribute_count; i++)
+			g_string_append_printf(buf, "%s ", node->attributes[i].name);
 		SIPE_DEBUG_INFO("%s [%s]", new_path, buf->str);
 		g_string_free(buf, TRUE);
-		g_list_free(attrs);
 	} else {
 		SIPE_DEBUG_INFO_NOFORMAT(new_path);
 	}
@@ -401,10 +1289,20 @@ void sipe_xml_dump(const sipe_xml *node, const gchar *path)
 
 gchar *sipe_xml_exc_c14n(const gchar *string)
 {
-	/* Parse string to XML document */
-	xmlDocPtr doc = xmlReadMemory(string, strlen(string), "", NULL, 0);
+	struct _parser_thread *thread = parser_thread();
+	xmlParserCtxtPtr ctxt         = thread->tree;
+	xmlDocPtr doc                 = NULL;
 	gchar *canon = NULL;
 
+	/* Parse string to XML document */
+	thread->tree = NULL;
+	if (!ctxt && ((ctxt = xmlNewParserCtxt()) != NULL))
+		parser_context_share_dict(thread, ctxt);
+	if (ctxt) {
+		doc = xmlCtxtReadMemory(ctxt, string, strlen(string), "", NULL, 0);
+		parser_context_keep(thread, &thread->tree, ctxt);
+	}
+
 	if (doc) {
 		xmlChar *buffer;
 		int size;
@@ -441,28 +1339,142 @@ gchar *sipe_xml_exc_c14n(const gchar *string)
 	return(canon);
 }
 
+/* C14N escaping rules for text and attribute values */
+static void c14n_escaped(const struct sipe_xml_c14n *c14n,
+			 const gchar *text,
+			 gboolean attribute)
+{
+	const gchar *special = attribute ? "&<\"\t\n\r" : "&<>\r";
+
+	while (*text) {
+		gsize safe = strcspn(text, special);
+		const gchar *entity;
+
+		if (safe)
+			(*c14n->output)(c14n->data, text, safe);
+		text += safe;
+
+		switch (*text) {
+		case '&':  entity = "&amp;";  break;
+		case '<':  entity = "&lt;";   break;
+		case '>':  entity = "&gt;";   break;
+		case '"':  entity = "&quot;"; break;
+		case '\t': entity = "&#x9;";  break;
+		case '\n': entity = "&#xA;";  break;
+		case '\r': entity = "&#xD;";  break;
+		default:
+			/* end of text */
+			return;
+		}
+		(*c14n->output)(c14n->data, entity, strlen(entity));
+		text++;
+	}
+}
+
+#define C14N_LITERAL(c14n, s) (*(c14n)->output)((c14n)->data, s, sizeof(s) - 1)
+
+static void c14n_string(const struct sipe_xml_c14n *c14n,
+			const gchar *string)
+{
+	(*c14n->output)(c14n->data, string, strlen(string));
+}
+
+void sipe_xml_c14n_start(const struct sipe_xml_c14n *c14n,
+			 const gchar *name,
+			 const gchar *namespace_uri,
+			 const gchar *const *attributes)
+{
+	C14N_LITERAL(c14n, "<");
+	c14n_string(c14n, name);
+
+	/* namespace declarations precede the attributes */
+	if (namespace_uri) {
+		C14N_LITERAL(c14n, " xmlns=\"");
+		c14n_escaped(c14n, namespace_uri, TRUE);
+		C14N_LITERAL(c14n, "\"");
+	}
+
+	if (attributes) {
+		while (*attributes) {
+			C14N_LITERAL(c14n, " ");
+			c14n_string(c14n, *attributes++);
+			C14N_LITERAL(c14n, "=\"");
+			c14n_escaped(c14n, *attributes++, TRUE);
+			C14N_LITERAL(c14n, "\"");
+		}
+	}
+
+	C14N_LITERAL(c14n, ">");
+}
+
+void sipe_xml_c14n_text(const struct sipe_xml_c14n *c14n,
+			const gchar *text)
+{
+	if (text)
+		c14n_escaped(c14n, text, FALSE);
+}
+
+void sipe_xml_c14n_end(const struct sipe_xml_c14n *c14n,
+		       const gchar *name)
+{
+	C14N_LITERAL(c14n, "</");
+	c14n_string(c14n, name);
+	C14N_LITERAL(c14n, ">");
+}
+
+void sipe_xml_c14n_element(const struct sipe_xml_c14n *c14n,
+			   const gchar *name,
+			   const gchar *const *attributes,
+			   const gchar *text)
+{
+	/* canonical form has no empty-element tags */
+	sipe_xml_c14n_start(c14n, name, NULL, attributes);
+	sipe_xml_c14n_text(c14n, text);
+	sipe_xml_c14n_end(c14n, name);
+}
+
+/* find "<tag" or "</tag>" without building the search strings */
+static const gchar *extract_raw_find(const gchar *xml,
+				     const gchar *tag,
+				     gsize tag_length,
+				     gboolean end)
+{
+	const gchar *marker = end ? "</" : "<";
+	gsize marker_length = end ? 2 : 1;
+
+	while ((xml = strstr(xml, marker)) != NULL) {
+		const gchar *name = xml + marker_length;
+
+		if ((strncmp(name, tag, tag_length) == 0) &&
+		    (!end || (name[tag_length] == '>')))
+			return(xml);
+		xml = name;
+	}
+
+	return(NULL);
+}
+
 gchar *sipe_xml_extract_raw(const gchar *xml, const gchar *tag,
 			    gboolean include_tag)
 {
-	gchar *tag_start = g_strdup_printf("<%s", tag);
-	gchar *tag_end = g_strdup_printf("</%s>", tag);
-	gchar *data = NULL;
-	const gchar *start = strstr(xml, tag_start);
+	gsize tag_length   = strlen(tag);
+	gchar *data        = NULL;
+	const gchar *start = extract_raw_find(xml, tag, tag_length, FALSE);
 
 	if (start) {
-		const gchar *end = strstr(start + strlen(tag_start), tag_end);
+		const gchar *end = extract_raw_find(start + 1 + tag_length,
+						    tag, tag_length, TRUE);
 		if (end) {
 			if (include_tag) {
-				data = g_strndup(start, end + strlen(tag_end) - start);
+				/* include "</tag>" */
+				data = g_strndup(start, end + 3 + tag_length - start);
 			} else {
-				const gchar *tmp = strchr(start + strlen(tag_start), '>') + 1;
+				const gchar *tmp = strchr(start + 1 + tag_length, '>') + 1;
 				data = g_strndup(tmp, end - tmp);
 			}
 		}
 	}
 
-	g_free(tag_end);
-	g_free(tag_start);
 	return data;
 }
 
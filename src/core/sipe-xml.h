@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-15 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,6 +22,25 @@
 
 typedef struct _sipe_xml sipe_xml;
 
+/**
+ * Compiled path for @c sipe_xml_child_path()
+ *
+ * Use @c SIPE_XML_PATH() for a static path or @c sipe_xml_path_compile().
+ */
+typedef struct {
+	const gchar *path;
+	struct _sipe_xml_path_compiled *compiled;
+} sipe_xml_path;
+
+/**
+ * Static initializer for a compiled path
+ *
+ *   static sipe_xml_path path = SIPE_XML_PATH("a/b/c");
+ *
+ * The path is compiled on first use and stays valid until program exit.
+ */
+#define SIPE_XML_PATH(p) { (p), NULL }
+
 /**
  * Parse XML from a string.
  *
@@ -32,6 +51,79 @@ typedef struct _sipe_xml sipe_xml;
  */
 sipe_xml *sipe_xml_parse(const gchar *string, gsize length);
 
+/**
+ * Parse XML from a string without generating debug output.
+ *
+ * Can be called from a worker thread after @c sipe_xml_init().
+ *
+ * @param string String with the XML to be parsed.
+ * @param length Length of the string.
+ *
+ * @return Parsed XML information. Must be @c sipe_xml_free()'d.
+ */
+sipe_xml *sipe_xml_parse_silent(const gchar *string, gsize length);
+
+/**
+ * Incremental parser, e.g. for a message body that is still being received
+ */
+struct sipe_xml_push;
+
+/**
+ * Start parsing a new XML document incrementally
+ *
+ * @return push parser or @c NULL. Must be finished or freed.
+ */
+struct sipe_xml_push *sipe_xml_push_new(void);
+
+/**
+ * Feed the next part of the XML document to the push parser
+ *
+ * @param push   push parser
+ * @param data   next bytes of the XML document
+ * @param length number of bytes
+ */
+void sipe_xml_push_feed(struct sipe_xml_push *push,
+			const gchar *data,
+			gsize length);
+
+/**
+ * Finish parsing and free the push parser
+ *
+ * @param push push parser
+ *
+ * @return Parsed XML information or @c NULL on error. Must be @c sipe_xml_free()'d.
+ */
+sipe_xml *sipe_xml_push_finish(struct sipe_xml_push *push);
+
+/**
+ * Abort parsing and free the push parser
+ *
+ * @param push push parser (may be @c NULL)
+ */
+void sipe_xml_push_free(struct sipe_xml_push *push);
+
+/**
+ * Initialize XML parser
+ *
+ * Must be called from the main thread before XML is parsed anywhere else.
+ */
+void sipe_xml_init(void);
+
+/**
+ * Free internal data of XML module
+ */
+void sipe_xml_shutdown(void);
+
+/**
+ * Estimate memory used by internal data of XML module
+ *
+ * Parsed documents are owned by their callers and aren't included.
+ *
+ * @param bytes   incremented by number of bytes
+ * @param objects incremented by number of allocated objects
+ */
+void sipe_xml_memory_usage(guint64 *bytes, guint64 *objects);
+
 /**
  * Free XML information.
  *
@@ -39,6 +131,69 @@ sipe_xml *sipe_xml_parse(const gchar *string, gsize length);
  */
 void sipe_xml_free(sipe_xml *xml);
 
+/**
+ * Callback for streaming XML parser
+ *
+ * @param node      matched element. Never try to @c sipe_xml_free() it!
+ * @param user_data user data given to @c sipe_xml_stream_parse()
+ */
+typedef void (*sipe_xml_stream_callback)(const sipe_xml *node,
+					 gpointer user_data);
+
+/**
+ * Filter for streaming XML parser
+ *
+ * The hash covers the raw text of the element, i.e. attributes and
+ * content, without building its subtree. It is 0 if the raw text isn't
+ * available, e.g. when the element contains an element of the same name.
+ *
+ * @param node      matched element. Node has attributes only.
+ * @param hash      hash of the raw element text, 0 if unknown.
+ * @param user_data user data given to @c sipe_xml_stream_parse()
+ *
+ * @return @c FALSE to skip the element without calling its callbacks
+ */
+typedef gboolean (*sipe_xml_stream_filter)(const sipe_xml *node,
+					   guint hash,
+					   gpointer user_data);
+
+/**
+ * Element handler for streaming XML parser
+ *
+ * The list of handlers is terminated by an entry with @c path == @c NULL.
+ */
+struct sipe_xml_stream_handler {
+	/** absolute path of the element without root slash (a, a/b, ...) */
+	const gchar *path;
+	/** called after start tag. Node has attributes only. Can be NULL. */
+	sipe_xml_stream_callback start;
+	/** called after end tag with full subtree. Can be NULL. */
+	sipe_xml_stream_callback end;
+	/** called before the other callbacks. Can be NULL. */
+	sipe_xml_stream_filter filter;
+};
+
+/**
+ * Parse XML from a string and pass matching elements to callbacks.
+ *
+ * Only the subtrees of elements with an "end" handler are kept in
+ * memory. Each subtree is freed after its callback has returned.
+ * Elements that don't match any handler path are skipped.
+ *
+ * NOTE: callbacks for the elements before a parser error have
+ *       already been called when this function returns @c FALSE.
+ *
+ * @param string    String with the XML to be parsed.
+ * @param length    Length of the string.
+ * @param handlers  Array of element handlers.
+ * @param user_data Passed to the callbacks.
+ *
+ * @return @c TRUE if the whole document was parsed successfully.
+ */
+gboolean sipe_xml_stream_parse(const gchar *string, gsize length,
+			       const struct sipe_xml_stream_handler *handlers,
+			       gpointer user_data);
+
 /**
  * Convert XML information to string.
  *
@@ -51,6 +206,9 @@ gchar *sipe_xml_stringify(const sipe_xml *xml);
 /**
  * Gets a child node named name.
  *
+ * The compiled form of the path is cached, i.e. this function must only
+ * be called from the main thread.
+ *
  * @param parent The parent node.
  * @param name   relative XPATH of the child (a, a/b, a/b/c, etc.).
  *
@@ -58,6 +216,36 @@ gchar *sipe_xml_stringify(const sipe_xml *xml);
  */
 const sipe_xml *sipe_xml_child(const sipe_xml *parent, const gchar *name);
 
+/**
+ * Compile relative XPATH for @c sipe_xml_child_path()
+ *
+ * @param path relative XPATH (a, a/b, a/b/c, etc.).
+ *
+ * @return compiled path. Must be @c sipe_xml_path_free()'d.
+ */
+sipe_xml_path *sipe_xml_path_compile(const gchar *path);
+
+/**
+ * Free compiled path
+ *
+ * @param path compiled path (may be @c NULL). Never use it on a static path!
+ */
+void sipe_xml_path_free(sipe_xml_path *path);
+
+/**
+ * Gets a child node using a compiled path.
+ *
+ * Same as @c sipe_xml_child(), but the path components are matched
+ * with pointer comparisons instead of string comparisons.
+ *
+ * @param parent The parent node.
+ * @param path   compiled path.
+ *
+ * @return The child or @c NULL. Never try to @c sipe_xml_free() it!
+ */
+const sipe_xml *sipe_xml_child_path(const sipe_xml *parent,
+				    sipe_xml_path *path);
+
 /**
  * Gets the next node with the same name as node.
  *
@@ -108,6 +296,40 @@ guint sipe_xml_int_attribute(const sipe_xml *node, const gchar *attr,
  */
 gchar *sipe_xml_data(const sipe_xml *node);
 
+/**
+ * Gets escaped data from the current XML node without copying it.
+ *
+ * @param node   The node to get data from.
+ * @param length Returns the length of the data (can be @c NULL).
+ *
+ * @return The NUL terminated data from the node or @c NULL. It is owned
+ *         by the document and only valid until @c sipe_xml_free().
+ */
+const gchar *sipe_xml_data_view(const sipe_xml *node, gsize *length);
+
+/**
+ * Gets data from the current XML node and convert it to an unsigned
+ * integer. Surrounding whitespace is ignored.
+ *
+ * @param node     The node to get data from.
+ * @param fallback Default value if the node has no numeric data.
+ *
+ * @return Data converted to an integer or the fallback value.
+ */
+guint sipe_xml_data_int(const sipe_xml *node, guint fallback);
+
+/**
+ * Gets data from the current XML node and convert it to a boolean.
+ * Accepts "true"/"false" (case insensitive) and "1"/"0". Surrounding
+ * whitespace is ignored.
+ *
+ * @param node     The node to get data from.
+ * @param fallback Default value if the node has no boolean data.
+ *
+ * @return Data converted to a boolean or the fallback value.
+ */
+gboolean sipe_xml_data_boolean(const sipe_xml *node, gboolean fallback);
+
 /**
  * For debugging while writing XML processing code.
  * NOTE: the code for this function is flagged out by default!
@@ -129,6 +351,67 @@ void sipe_xml_dump(const sipe_xml *node, const gchar *path);
  */
 gchar *sipe_xml_exc_c14n(const gchar *string);
 
+/**
+ * Streaming writer for "Exclusive XML Canonicalization"
+ *
+ * Writes elements directly in canonical form without building a document,
+ * e.g. into a digest context. Only covers the shapes that SIPE signs:
+ * a default namespace declaration on the outermost element, attributes
+ * without prefix supplied in canonical (sorted) order and text content.
+ */
+typedef void sipe_xml_c14n_output(gpointer data,
+				  const gchar *text,
+				  gsize length);
+
+struct sipe_xml_c14n {
+	sipe_xml_c14n_output *output;
+	gpointer data;
+};
+
+/**
+ * Write start tag
+ *
+ * @param c14n          canonicalization writer
+ * @param name          element name
+ * @param namespace_uri default namespace to declare (can be @c NULL)
+ * @param attributes    @c NULL terminated name/value pairs (can be @c NULL)
+ */
+void sipe_xml_c14n_start(const struct sipe_xml_c14n *c14n,
+			 const gchar *name,
+			 const gchar *namespace_uri,
+			 const gchar *const *attributes);
+
+/**
+ * Write escaped text content
+ *
+ * @param c14n canonicalization writer
+ * @param text text (can be @c NULL)
+ */
+void sipe_xml_c14n_text(const struct sipe_xml_c14n *c14n,
+			const gchar *text);
+
+/**
+ * Write end tag
+ *
+ * @param c14n canonicalization writer
+ * @param name element name
+ */
+void sipe_xml_c14n_end(const struct sipe_xml_c14n *c14n,
+		       const gchar *name);
+
+/**
+ * Write element with optional text content and no children
+ *
+ * @param c14n       canonicalization writer
+ * @param name       element name
+ * @param attributes @c NULL terminated name/value pairs (can be @c NULL)
+ * @param text       text (can be @c NULL)
+ */
+void sipe_xml_c14n_element(const struct sipe_xml_c14n *c14n,
+			   const gchar *name,
+			   const gchar *const *attributes,
+			   const gchar *text);
+
 /**
  * Extracts raw data between a pair of XML tags.
  *
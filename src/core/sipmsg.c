@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2008 Novell, Inc.
  * Copyright (C) 2005 Thomas Butter <butter@uni-mannheim.de>
  *
@@ -30,12 +30,17 @@
 #include <glib.h>
 
 #include "sipmsg.h"
+#include "sipe-arena.h"
 #include "sipe-backend.h"
+#include "sipe-limits.h"
+#include "sipe-metrics.h"
 #include "sipe-mime.h"
+#include "sipe-str.h"
 #include "sipe-utils.h"
+#include "sipe-xml.h"
 
 struct sipmsg *sipmsg_parse_msg(const gchar *msg) {
-	const char *tmp = strstr(msg, "\r\n\r\n");
+	const char *tmp = sipe_str_find_header_end(msg, strlen(msg));
 	char *line;
 	struct sipmsg *smsg;
 
@@ -50,47 +55,464 @@ struct sipmsg *sipmsg_parse_msg(const gchar *msg) {
 	return smsg;
 }
 
+/*
+ * Well-known header names, methods and event packages
+ *
+ * Each list is indexed by its ID, i.e. the order must match the enums in
+ * sipmsg.h. Lookup is a single probe into a perfect hash slot table. The
+ * slot tables are generated by contrib/perfect-hash/sipmsg-tokens.pl and
+ * must be regenerated whenever a list changes.
+ */
+struct sipmsg_token {
+	const gchar *name;
+	guint length;
+};
+#define TOKEN(n) { n, sizeof(n) - 1 }
+
+static const struct sipmsg_token sipmsg_header_names[SIPMSG_HEADER_KNOWN_MAX] = {
+	TOKEN("Call-ID"),
+	TOKEN("CSeq"),
+	TOKEN("Content-Length"),
+	TOKEN("Content-Type"),
+	TOKEN("From"),
+	TOKEN("To"),
+	TOKEN("Transfer-Encoding"),
+	TOKEN("Allow"),
+	TOKEN("Allow-Events"),
+	TOKEN("Authentication-Info"),
+	TOKEN("Authorization"),
+	TOKEN("Connection"),
+	TOKEN("Contact"),
+	TOKEN("Date"),
+	TOKEN("EndPoints"),
+	TOKEN("Event"),
+	TOKEN("Expires"),
+	TOKEN("Location"),
+	TOKEN("Max-Forwards"),
+	TOKEN("Message-Id"),
+	TOKEN("ms-client-diagnostics"),
+	TOKEN("ms-diagnostics"),
+	TOKEN("ms-keep-alive"),
+	TOKEN("ms-piggyback-cseq"),
+	TOKEN("ms-text-format"),
+	TOKEN("Ms-Sender"),
+	TOKEN("P-Asserted-Identity"),
+	TOKEN("P-Preferred-Identity"),
+	TOKEN("Proxy-Authenticate"),
+	TOKEN("Proxy-Authentication-Info"),
+	TOKEN("Proxy-Authorization"),
+	TOKEN("Record-Route"),
+	TOKEN("Refer-To"),
+	TOKEN("Referred-By"),
+	TOKEN("Require"),
+	TOKEN("Roster-Manager"),
+	TOKEN("Server"),
+	TOKEN("Session-Expires"),
+	TOKEN("Set-Cookie"),
+	TOKEN("Subject"),
+	TOKEN("Subscription-State"),
+	TOKEN("Supported"),
+	TOKEN("TriggeredInvite"),
+	TOKEN("User-Agent"),
+	TOKEN("Via"),
+	TOKEN("Warning"),
+	TOKEN("WWW-Authenticate"),
+};
+
+/* SIPMSG_METHOD_UNKNOWN & SIPMSG_EVENT_UNKNOWN are not in the lists */
+static const struct sipmsg_token sipmsg_method_names[SIPMSG_METHOD_MAX - 1] = {
+	TOKEN("ACK"),
+	TOKEN("BENOTIFY"),
+	TOKEN("BYE"),
+	TOKEN("CANCEL"),
+	TOKEN("INFO"),
+	TOKEN("INVITE"),
+	TOKEN("MESSAGE"),
+	TOKEN("NOTIFY"),
+	TOKEN("OPTIONS"),
+	TOKEN("PRACK"),
+	TOKEN("PUBLISH"),
+	TOKEN("REFER"),
+	TOKEN("REGISTER"),
+	TOKEN("SERVICE"),
+	TOKEN("SUBSCRIBE"),
+};
+
+static const struct sipmsg_token sipmsg_event_names[SIPMSG_EVENT_MAX - 1] = {
+	TOKEN("conference"),
+	TOKEN("msrtc.wpending"),
+	TOKEN("presence"),
+	TOKEN("presence.wpending"),
+	TOKEN("registration-notify"),
+	TOKEN("vnd-microsoft-provisioning"),
+	TOKEN("vnd-microsoft-provisioning-v2"),
+	TOKEN("vnd-microsoft-roaming-ACL"),
+	TOKEN("vnd-microsoft-roaming-contacts"),
+	TOKEN("vnd-microsoft-roaming-self"),
+};
+#undef TOKEN
+
+/* BEGIN generated by contrib/perfect-hash/sipmsg-tokens.pl */
+#define SIPMSG_EVENT_SEED 9
+#define SIPMSG_EVENT_BITS 5
+static const guint8 sipmsg_event_slots[1 << SIPMSG_EVENT_BITS] = {
+	 0,  5,  0,  1,  0,  0,  0,  0,  0,  8,  0,  0,  0, 10,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  7,  0,  4,  3,  2,  9,  0,  6,  0
+};
+#define SIPMSG_HEADER_SEED 15690
+#define SIPMSG_HEADER_BITS 7
+static const guint8 sipmsg_header_slots[1 << SIPMSG_HEADER_BITS] = {
+	 0, 42, 34,  5,  0, 40,  0,  2,  0, 32,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0, 15, 33,  0,  0, 17,  0,  0,  0,  0,  0,  0,  0,  0,
+	35,  8, 46,  0,  0,  0,  0,  0, 24, 12,  0,  0,  0,  0,  0, 44,
+	 0, 36,  0, 18,  0,  9,  0,  0, 26, 41, 43,  0,  0, 37,  0,  0,
+	 0, 45,  0,  0,  0,  0, 31, 20, 11,  0,  0, 21,  0,  0,  0,  4,
+	 0,  0,  0,  0, 19,  7,  0,  1,  0, 47,  0,  0, 30,  0, 14,  0,
+	 0,  0,  0,  0,  0, 28,  0, 23,  0, 13,  6,  0,  0,  0,  0, 38,
+	25, 39, 22,  0, 27, 10, 29, 16,  0,  0,  0,  0,  0,  0,  0,  3
+};
+#define SIPMSG_METHOD_SEED 95
+#define SIPMSG_METHOD_BITS 5
+static const guint8 sipmsg_method_slots[1 << SIPMSG_METHOD_BITS] = {
+	 0,  0,  0,  7, 14, 11,  0,  0, 12, 15,  6,  0,  0,  0,  0,  5,
+	 2,  0,  3,  8,  0, 13,  0,  0,  0,  4,  1,  0,  0,  9,  0, 10
+};
+/* END generated by contrib/perfect-hash/sipmsg-tokens.pl */
+
+/* must match token_hash() in contrib/perfect-hash/sipmsg-tokens.pl */
+static guint sipmsg_token_hash(const gchar *name,
+			       gsize length,
+			       guint32 seed,
+			       guint bits)
+{
+	guint32 hash = seed;
+	while (length--)
+		hash = (hash ^ (guchar) g_ascii_tolower(*name++)) * 16777619;
+	return(((hash >> 16) ^ hash) & ((1 << bits) - 1));
+}
+
+#define SIPMSG_TOKEN_LOOKUP(table, TABLE, name, length) \
+	sipmsg_ ## table ## _slots[sipmsg_token_hash(name, \
+						   length, \
+						   SIPMSG_ ## TABLE ## _SEED, \
+						   SIPMSG_ ## TABLE ## _BITS)]
+
+/*
+ * Returns index + 1 into sipmsg_header_names, 0 if not found.
+ *
+ * Exact (case sensitive) match is required for interning so that the
+ * header list content is identical to the received message. The ID is
+ * looked up case insensitive for the fixed header fields.
+ */
+static guint sipmsg_header_slot(const gchar *name,
+				gsize length,
+				gboolean exact)
+{
+	guint slot = SIPMSG_TOKEN_LOOKUP(header, HEADER, name, length);
+	if (slot) {
+		const struct sipmsg_token *token = sipmsg_header_names + slot - 1;
+		if ((token->length != length) ||
+		    (exact ?
+		     memcmp(token->name, name, length) :
+		     g_ascii_strncasecmp(token->name, name, length)))
+			slot = 0;
+	}
+	return(slot);
+}
+
+/* returns SIPMSG_HEADER_KNOWN_MAX for unknown headers */
+static guint sipmsg_header_id(const gchar *name, gsize length)
+{
+	guint slot = sipmsg_header_slot(name, length, FALSE);
+	return(slot ? slot - 1 : SIPMSG_HEADER_KNOWN_MAX);
+}
+
+static const gchar *sipmsg_header_intern(const gchar *name, gsize length)
+{
+	guint slot = sipmsg_header_slot(name, length, TRUE);
+	return(slot ? sipmsg_header_names[slot - 1].name : NULL);
+}
+
+guint sipmsg_method_id(const gchar *method)
+{
+	if (method) {
+		gsize length = strlen(method);
+		guint slot   = SIPMSG_TOKEN_LOOKUP(method, METHOD, method, length);
+		if (slot &&
+		    (sipmsg_method_names[slot - 1].length == length) &&
+		    (memcmp(sipmsg_method_names[slot - 1].name,
+			    method,
+			    length) == 0))
+			return(slot);
+	}
+	return(SIPMSG_METHOD_UNKNOWN);
+}
+
+guint sipmsg_event_id(const gchar *event)
+{
+	if (event) {
+		gsize length = strlen(event);
+		guint slot   = SIPMSG_TOKEN_LOOKUP(event, EVENT, event, length);
+		if (slot &&
+		    (sipmsg_event_names[slot - 1].length == length) &&
+		    (g_ascii_strncasecmp(sipmsg_event_names[slot - 1].name,
+					 event,
+					 length) == 0))
+			return(slot);
+	}
+	return(SIPMSG_EVENT_UNKNOWN);
+}
+
+/* must be called for every new element in msg->headers */
+static void sipmsg_known_header_added(struct sipmsg *msg,
+				      struct sipnameval *element)
+{
+	guint id = sipmsg_header_id(element->name, strlen(element->name));
+	if ((id < SIPMSG_HEADER_KNOWN_MAX) && !msg->known_headers[id])
+		msg->known_headers[id] = element;
+}
+
+/* must be called for every element removed from msg->headers */
+static void sipmsg_known_header_removed(struct sipmsg *msg,
+					struct sipnameval *element)
+{
+	guint id = sipmsg_header_id(element->name, strlen(element->name));
+	if ((id < SIPMSG_HEADER_KNOWN_MAX) &&
+	    (msg->known_headers[id] == element)) {
+		GSList *entry;
+
+		msg->known_headers[id] = NULL;
+		/* next instance becomes the first one */
+		for (entry = msg->headers; entry; entry = entry->next) {
+			struct sipnameval *elem = entry->data;
+			if ((elem != element) &&
+			    (sipmsg_header_id(elem->name,
+					      strlen(elem->name)) == id)) {
+				msg->known_headers[id] = elem;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Single pass header tokenizer
+ *
+ * "name: value" lines may be continued by lines starting with SP or HT.
+ * Continuation lines are joined with a single space and stripped of
+ * leading whitespace.
+ */
+/*
+ * Everything derived from the message header lives in the message arena:
+ * header elements, start line parts and borrowed strings. Removing a
+ * header only unlinks the element, the memory is released together with
+ * the message.
+ */
+static struct sipe_arena *sipmsg_arena(struct sipmsg *msg)
+{
+	if (!msg->arena)
+		msg->arena = sipe_arena_new();
+	return(msg->arena);
+}
+
+/* same layout as sipe_utils_nameval_new(), but allocated from the arena */
+static struct sipnameval *sipmsg_nameval_new(struct sipmsg *msg,
+					     const gchar *name,
+					     gssize name_length,
+					     const gchar *value,
+					     gsize value_length)
+{
+	struct sipnameval *element = sipe_arena_alloc(sipmsg_arena(msg),
+						      sizeof(struct sipnameval) +
+						      value_length + 1 +
+						      (name_length >= 0 ? name_length + 1 : 0));
+	gchar *p = (gchar *) (element + 1);
+
+	element->value = p;
+	memcpy(p, value, value_length);
+	p += value_length;
+	*p++ = '\0';
+
+	if (name_length >= 0) {
+		element->name = p;
+		memcpy(p, name, name_length);
+		p[name_length] = '\0';
+	} else {
+		/* interned name outlives the element */
+		element->name = (gchar *) name;
+	}
+
+	return(element);
+}
+
+static gboolean sipmsg_parse_header_lines(struct sipmsg *msg,
+					  const gchar *p,
+					  const gchar *end)
+{
+	GSList *headers   = NULL;
+	gsize lines       = 0;
+	gboolean overflow = FALSE;
+
+	while (p < end) {
+		const gchar *eol = g_strstr_len(p, end - p, "\r\n");
+		const gchar *colon;
+		const gchar *value;
+		const gchar *next;
+		const gchar *name;
+		struct sipnameval *element;
+		gsize value_length;
+		gchar *dst;
+
+		if (!eol) eol = end;
+
+		/* empty line terminates header (legacy: any line <= 2 chars) */
+		if (eol - p <= 2)
+			break;
+
+		colon = memchr(p, ':', eol - p);
+		if (!colon) {
+			g_slist_free(headers);
+			return(FALSE);
+		}
+
+		value = colon + 1;
+		while ((value < eol) && (*value == ' ' || *value == '\t'))
+			value++;
+		value_length = eol - value;
+
+		/* look ahead for continuation lines */
+		next     = eol;
+		overflow = sipe_limit_exceeded(SIPE_LIMIT_SIP_HEADER_LINES,
+					       ++lines);
+		while (!overflow &&
+		       (next + 2 < end) &&
+		       (next[2] == ' ' || next[2] == '\t')) {
+			const gchar *cont = next + 2;
+			const gchar *cont_eol = g_strstr_len(cont, end - cont, "\r\n");
+			if (!cont_eol) cont_eol = end;
+			overflow = sipe_limit_exceeded(SIPE_LIMIT_SIP_HEADER_LINES,
+						       ++lines);
+			while ((cont < cont_eol) && (*cont == ' ' || *cont == '\t'))
+				cont++;
+			value_length += 1 + (cont_eol - cont);
+			next = cont_eol;
+		}
+		if (overflow)
+			break;
+
+		/*
+		 * value_length never exceeds (next - value), i.e. the copy
+		 * stays inside the header block. The continuation lines are
+		 * then compacted over the copied raw data.
+		 */
+		name = sipmsg_header_intern(p, colon - p);
+		element = sipmsg_nameval_new(msg,
+					     name ? name : p,
+					     name ? -1 : colon - p,
+					     value,
+					     value_length);
+		dst = element->value + (eol - value);
+		while (eol != next) {
+			const gchar *cont = eol + 2;
+			const gchar *cont_eol = g_strstr_len(cont, end - cont, "\r\n");
+			if (!cont_eol) cont_eol = end;
+			while ((cont < cont_eol) && (*cont == ' ' || *cont == '\t'))
+				cont++;
+			*dst++ = ' ';
+			memcpy(dst, cont, cont_eol - cont);
+			dst += cont_eol - cont;
+			eol = cont_eol;
+		}
+
+		headers = g_slist_prepend(headers, element);
+		p = next + 2;
+	}
+
+	/* prepend + reverse is O(n) */
+	msg->headers = g_slist_reverse(headers);
+	for (headers = msg->headers; headers; headers = headers->next)
+		sipmsg_known_header_added(msg, headers->data);
+
+	if (overflow) {
+		SIPE_DEBUG_ERROR("sipmsg_parse_header: more than %" G_GSIZE_FORMAT " header lines. Aborting!",
+				 sipe_limit_get(SIPE_LIMIT_SIP_HEADER_LINES));
+		msg->response = SIPMSG_RESPONSE_FATAL_ERROR;
+	}
+
+	return(TRUE);
+}
+
 struct sipmsg *sipmsg_parse_header(const gchar *header) {
-	struct sipmsg *msg = g_new0(struct sipmsg,1);
-	gchar **lines = g_strsplit(header,"\r\n",0);
-	gchar **parts;
+	return(sipmsg_parse_header_len(header, strlen(header)));
+}
+
+struct sipmsg *sipmsg_parse_header_len(const gchar *header, gsize length) {
+	struct sipe_arena *arena = sipe_arena_new();
+	struct sipmsg *msg = sipmsg_parse_header_arena(header, length, arena);
+	if (!msg)
+		sipe_arena_free(arena);
+	return(msg);
+}
+
+struct sipmsg *sipmsg_parse_header_arena(const gchar *header,
+					 gsize length,
+					 struct sipe_arena *arena) {
+	struct sipmsg *msg;
+	const gchar *end = header + length;
+	const gchar *eol;
+	const gchar *part1;
+	const gchar *part2;
 	const gchar *contentlength;
-	if(!lines[0]) {
-		g_strfreev(lines);
-		g_free(msg);
+
+	/* start line: "<part0> <part1> <part2...>" */
+	eol = g_strstr_len(header, length, "\r\n");
+	if (!eol) eol = end;
+	if (eol == header)
 		return NULL;
-	}
-	parts = g_strsplit(lines[0], " ", 3);
-	if(!parts[0] || !parts[1] || !parts[2]) {
-		g_strfreev(parts);
-		g_strfreev(lines);
-		g_free(msg);
+	part1 = memchr(header, ' ', eol - header);
+	if (!part1)
 		return NULL;
-	}
-	if(strstr(parts[0],"SIP") || strstr(parts[0],"HTTP")) { /* numeric response */
-		msg->responsestr = g_strdup(parts[2]);
-		msg->response = strtol(parts[1],NULL,10);
+	part1++;
+	part2 = memchr(part1, ' ', eol - part1);
+	if (!part2)
+		return NULL;
+	part2++;
+
+	msg = g_new0(struct sipmsg, 1);
+	msg->arena = arena;
+	if (g_strstr_len(header, part1 - header, "SIP") ||
+	    g_strstr_len(header, part1 - header, "HTTP")) { /* numeric response */
+		msg->responsestr = sipe_arena_strndup(arena, part2, eol - part2);
+		msg->response = strtol(part1, NULL, 10);
 	} else { /* request */
-		msg->method = g_strdup(parts[0]);
-		msg->target = g_strdup(parts[1]);
+		msg->method = sipe_arena_strndup(arena, header, part1 - header - 1);
+		msg->method_id = sipmsg_method_id(msg->method);
+		msg->target = sipe_arena_strndup(arena, part1, part2 - part1 - 1);
 		msg->response = 0;
 	}
-	g_strfreev(parts);
-	if (sipe_utils_parse_lines(&msg->headers, lines + 1, ":") == FALSE) {
-		g_strfreev(lines);
+
+	if ((eol < end) &&
+	    !sipmsg_parse_header_lines(msg, eol + 2, end)) {
+		/* arena stays with the caller */
+		msg->arena = NULL;
 		sipmsg_free(msg);
+		sipe_arena_reset(arena);
 		return NULL;
 	}
-	g_strfreev(lines);
-	contentlength = sipmsg_find_header(msg, "Content-Length");
+
+	/* header lines limit exceeded: caller must drop the message */
+	if (msg->response == SIPMSG_RESPONSE_FATAL_ERROR)
+		return(msg);
+
+	contentlength = sipmsg_find_known_header(msg, SIPMSG_HEADER_CONTENT_LENGTH);
 	if (contentlength) {
 		msg->bodylen = strtol(contentlength,NULL,10);
 	} else {
-		const gchar *tmp = sipmsg_find_header(msg, "Transfer-Encoding");
+		const gchar *tmp = sipmsg_find_known_header(msg, SIPMSG_HEADER_TRANSFER_ENCODING);
 		if (tmp && sipe_strcase_equal(tmp, "chunked")) {
 			msg->bodylen = SIPMSG_BODYLEN_CHUNKED;
 		} else {
-			tmp = sipmsg_find_header(msg, "Content-Type");
+			tmp = sipmsg_find_known_header(msg, SIPMSG_HEADER_CONTENT_TYPE);
 			if (tmp) {
 				/*
 				 * This is a fatal error situation: the message
@@ -108,14 +530,14 @@ struct sipmsg *sipmsg_parse_header(const gchar *header) {
 	}
 	if(msg->response) {
 		const gchar *tmp;
-		tmp = sipmsg_find_header(msg, "CSeq");
+		tmp = sipmsg_find_known_header(msg, SIPMSG_HEADER_CSEQ);
 		if(!tmp) {
 			/* SHOULD NOT HAPPEN */
 			msg->method = 0;
 		} else {
-			parts = g_strsplit(tmp, " ", 2);
-			msg->method = g_strdup(parts[1]);
-			g_strfreev(parts);
+			const gchar *method = strchr(tmp, ' ');
+			msg->method = method ? sipe_arena_strdup(arena, method + 1) : NULL;
+			msg->method_id = sipmsg_method_id(msg->method);
 		}
 	}
 	return msg;
@@ -123,12 +545,14 @@ struct sipmsg *sipmsg_parse_header(const gchar *header) {
 
 struct sipmsg *sipmsg_copy(const struct sipmsg *other) {
 	struct sipmsg *msg = g_new0(struct sipmsg, 1);
+	struct sipe_arena *arena = sipmsg_arena(msg);
 	GSList *list;
 
 	msg->response		= other->response;
-	msg->responsestr	= g_strdup(other->responsestr);
-	msg->method		= g_strdup(other->method);
-	msg->target		= g_strdup(other->target);
+	msg->responsestr	= sipe_arena_strdup(arena, other->responsestr);
+	msg->method		= sipe_arena_strdup(arena, other->method);
+	msg->method_id		= other->method_id;
+	msg->target		= sipe_arena_strdup(arena, other->target);
 
 	list = other->headers;
 	while(list) {
@@ -153,9 +577,10 @@ struct sipmsg *sipmsg_copy(const struct sipmsg *other) {
 	return msg;
 }
 
-char *sipmsg_to_string(const struct sipmsg *msg) {
+static GString *sipmsg_header_to_gstring(const struct sipmsg *msg,
+					 gsize reserve) {
 	GSList *cur;
-	GString *outstr = g_string_new("");
+	GString *outstr = g_string_sized_new(256 + reserve);
 	struct sipnameval *elem;
 
 	if(msg->response)
@@ -168,17 +593,27 @@ char *sipmsg_to_string(const struct sipmsg *msg) {
 	cur = msg->headers;
 	while(cur) {
 		elem = cur->data;
-                /*Todo: remove the LFCR in a good way*/
-                /*if(sipe_strequal(elem->name,"Proxy-Authorization"))
-                  g_string_append_printf(outstr, "%s: %s", elem->name,
-			elem->value);
-                else     */
-		   g_string_append_printf(outstr, "%s: %s\r\n", elem->name,
-			elem->value);
+		g_string_append(outstr, elem->name);
+		g_string_append(outstr, ": ");
+		g_string_append(outstr, elem->value);
+		g_string_append(outstr, "\r\n");
 		cur = g_slist_next(cur);
 	}
 
-	g_string_append_printf(outstr, "\r\n%s", msg->bodylen ? msg->body : "");
+	g_string_append(outstr, "\r\n");
+
+	return outstr;
+}
+
+gchar *sipmsg_header_to_string(const struct sipmsg *msg) {
+	return g_string_free(sipmsg_header_to_gstring(msg, 0), FALSE);
+}
+
+char *sipmsg_to_string(const struct sipmsg *msg) {
+	GString *outstr = sipmsg_header_to_gstring(msg, msg->bodylen);
+
+	if (msg->bodylen && msg->body)
+		g_string_append(outstr, msg->body);
 
 	return g_string_free(outstr, FALSE);
 }
@@ -187,7 +622,7 @@ char *sipmsg_to_string(const struct sipmsg *msg) {
  * Adds header to current message headers
  */
 void sipmsg_add_header_now(struct sipmsg *msg, const gchar *name, const gchar *value) {
-	struct sipnameval *element = g_new0(struct sipnameval,1);
+	struct sipnameval *element;
 
 	/* SANITY CHECK: the calling code must be fixed if this happens! */
 	if (!value) {
@@ -196,16 +631,17 @@ void sipmsg_add_header_now(struct sipmsg *msg, const gchar *name, const gchar *v
 		value = "";
 	}
 
-	element->name = g_strdup(name);
-	element->value = g_strdup(value);
+	element = sipmsg_nameval_new(msg, name, strlen(name),
+				     value, strlen(value));
 	msg->headers = g_slist_append(msg->headers, element);
+	sipmsg_known_header_added(msg, element);
 }
 
 /**
  * Adds header to separate storage for future merge
  */
 void sipmsg_add_header(struct sipmsg *msg, const gchar *name, const gchar *value) {
-	struct sipnameval *element = g_new0(struct sipnameval,1);
+	struct sipnameval *element;
 
 	/* SANITY CHECK: the calling code must be fixed if this happens! */
 	if (!value) {
@@ -213,8 +649,8 @@ void sipmsg_add_header(struct sipmsg *msg, const gchar *name, const gchar *value
 		value = "";
 	}
 
-	element->name = g_strdup(name);
-	element->value = g_strdup(value);
+	element = sipmsg_nameval_new(msg, name, strlen(name),
+				     value, strlen(value));
 	msg->new_headers = g_slist_append(msg->new_headers, element);
 }
 
@@ -244,9 +680,7 @@ void sipmsg_strip_headers(struct sipmsg *msg, const gchar *keepers[]) {
 			SIPE_DEBUG_INFO("sipmsg_strip_headers: removing %s", elem->name);
 			entry = g_slist_next(entry);
 			msg->headers = g_slist_delete_link(msg->headers, to_delete);
-			g_free(elem->name);
-			g_free(elem->value);
-			g_free(elem);
+			sipmsg_known_header_removed(msg, elem);
 		} else {
 			entry = g_slist_next(entry);
 		}
@@ -259,23 +693,66 @@ void sipmsg_strip_headers(struct sipmsg *msg, const gchar *keepers[]) {
 void sipmsg_merge_new_headers(struct sipmsg *msg) {
 	while(msg->new_headers) {
 		msg->headers = g_slist_append(msg->headers, msg->new_headers->data);
+		sipmsg_known_header_added(msg, msg->new_headers->data);
 		msg->new_headers = g_slist_remove(msg->new_headers, msg->new_headers->data);
 	}
 }
 
-void sipmsg_free(struct sipmsg *msg) {
+struct sipe_arena *sipmsg_free_keep_arena(struct sipmsg *msg) {
+	struct sipe_arena *arena = NULL;
+
 	if (msg) {
-		sipe_utils_nameval_free(msg->headers);
-		sipe_utils_nameval_free(msg->new_headers);
+		arena = msg->arena;
+		g_slist_free(msg->headers);
+		g_slist_free(msg->new_headers);
 		g_free(msg->signature);
 		g_free(msg->rand);
 		g_free(msg->num);
-		g_free(msg->responsestr);
-		g_free(msg->method);
-		g_free(msg->target);
 		g_free(msg->body);
+		sipe_xml_free(msg->xml);
 		g_free(msg);
+
+		if (arena)
+			sipe_arena_reset(arena);
 	}
+
+	return(arena);
+}
+
+void sipmsg_free(struct sipmsg *msg) {
+	sipe_arena_free(sipmsg_free_keep_arena(msg));
+}
+
+void sipmsg_memory_usage(const struct sipmsg *msg,
+			 struct sipe_memory_usage *usage)
+{
+	if (!msg)
+		return;
+
+	SIPE_MEMORY_OBJECT(usage, sizeof(struct sipmsg));
+	/* headers and start line live in the arena */
+	if (msg->arena)
+		SIPE_MEMORY_OBJECT(usage, sipe_arena_size(msg->arena));
+	sipe_metrics_memory_list(usage,
+				 g_slist_length(msg->headers) +
+				 g_slist_length(msg->new_headers));
+	sipe_metrics_memory_string(usage, msg->signature);
+	sipe_metrics_memory_string(usage, msg->rand);
+	sipe_metrics_memory_string(usage, msg->num);
+	if (msg->body)
+		SIPE_MEMORY_OBJECT(usage, MAX(msg->bodylen, 0) + 1);
+}
+
+sipe_xml *sipmsg_parse_xml_body(struct sipmsg *msg)
+{
+	sipe_xml *xml = msg->xml;
+
+	if (xml)
+		msg->xml = NULL;
+	else
+		xml = sipe_xml_parse(msg->body, msg->bodylen);
+
+	return(xml);
 }
 
 void sipmsg_remove_header_now(struct sipmsg *msg, const gchar *name) {
@@ -286,9 +763,7 @@ void sipmsg_remove_header_now(struct sipmsg *msg, const gchar *name) {
 		// OCS2005 can send the same header in either all caps or mixed case
 		if (sipe_strcase_equal(elem->name, name)) {
 			msg->headers = g_slist_remove(msg->headers, elem);
-			g_free(elem->name);
-			g_free(elem->value);
-			g_free(elem);
+			sipmsg_known_header_removed(msg, elem);
 			return;
 		}
 		tmp = g_slist_next(tmp);
@@ -297,42 +772,79 @@ void sipmsg_remove_header_now(struct sipmsg *msg, const gchar *name) {
 }
 
 const gchar *sipmsg_find_header(const struct sipmsg *msg, const gchar *name) {
+	guint id = sipmsg_header_id(name, strlen(name));
+	/* well-known headers don't need a list scan */
+	if (id < SIPMSG_HEADER_KNOWN_MAX)
+		return(sipmsg_find_known_header(msg, id));
 	return sipe_utils_nameval_find_instance (msg->headers, name, 0);
 }
 
+const gchar *sipmsg_find_known_header(const struct sipmsg *msg, guint id) {
+	const struct sipnameval *elem = (id < SIPMSG_HEADER_KNOWN_MAX) ?
+		msg->known_headers[id] : NULL;
+	return(elem ? elem->value : NULL);
+}
+
 const gchar *sipmsg_find_header_instance(const struct sipmsg *msg, const gchar *name, int which) {
 	return sipe_utils_nameval_find_instance(msg->headers, name, which);
 }
 
+/* returns start of part or NULL, length of part in *length */
+static const gchar *sipmsg_part_of_header(const gchar *hdr,
+					  const gchar *before,
+					  const gchar *after,
+					  gsize *length)
+{
+	const gchar *tmp;
+	const gchar *tmp2;
+
+	tmp = before == NULL ? hdr : strstr(hdr, before);
+	if (!tmp)
+		return(NULL);
+
+	if (before != NULL)
+		tmp += strlen(before);
+
+	if (after != NULL && (tmp2 = strstr(tmp, after)))
+		*length = tmp2 - tmp;
+	else
+		*length = strlen(tmp);
+
+	return(tmp);
+}
+
 gchar *sipmsg_find_part_of_header(const char *hdr, const char * before, const char * after, const char * def) {
-	const char *tmp;
-	const char *tmp2;
-	gchar *res2;
+	const gchar *part;
+	gsize length;
+
 	if (!hdr) {
 		return NULL;
 	}
 
-	//printf("partof %s w/ %s before and %s after\n", hdr, before, after);
-
-	tmp = before == NULL ? hdr : strstr(hdr, before);
-	if (!tmp) {
-		//printf ("not found, returning null\n");
+	part = sipmsg_part_of_header(hdr, before, after, &length);
+	if (!part)
 		return (gchar *)def;
-	}
 
-	if (before != NULL) {
-		tmp += strlen(before);
-		//printf ("tmp now %s\n", tmp);
-	}
+	return(g_strndup(part, length));
+}
 
-	if (after != NULL && (tmp2 = strstr(tmp, after))) {
-		gchar * res = g_strndup(tmp, tmp2 - tmp);
-		//printf("returning %s\n", res);
-		return res;
-	}
-	res2 = g_strdup(tmp);
-	//printf("returning %s\n", res2);
-	return res2;
+const gchar *sipmsg_borrow_part_of_header(struct sipmsg *msg,
+					  const gchar *hdr,
+					  const gchar *before,
+					  const gchar *after,
+					  const gchar *def)
+{
+	const gchar *part;
+	gsize length;
+
+	if (!hdr)
+		return(NULL);
+
+	part = sipmsg_part_of_header(hdr, before, after, &length);
+	if (!part)
+		return(def);
+
+	return(sipe_arena_strndup(sipmsg_arena(msg), part, length));
 }
 
 int sipmsg_parse_cseq(struct sipmsg *msg)
@@ -471,86 +983,177 @@ const gchar *sipmsg_find_auth_header(struct sipmsg *msg, const gchar *name) {
  * 'msgr' typically looks like:
  * X-MMS-IM-Format: FN=Microsoft%20Sans%20Serif; EF=BI; CO=800000; CS=0; PF=22
  */
-static gchar *sipmsg_get_x_mms_im_format(gchar *msgr) {
-	gchar *msgr2;
-	gsize msgr_dec64_len;
+static gchar *sipmsg_get_x_mms_im_format(const gchar *msgr) {
+	gsize length;
+	gchar *padded;
 	guchar *msgr_dec64;
 	gchar *msgr_utf8;
-	gchar **lines;
-	gchar **parts;
-	gchar *x_mms_im_format;
-	gchar *tmp;
+	gchar *x_mms_im_format = NULL;
 
 	if (!msgr) return NULL;
-	msgr2 = g_strdup(msgr);
-	while (strlen(msgr2) % 4 != 0) {
-		gchar *tmp_msgr2 = msgr2;
-		msgr2 = g_strdup_printf("%s=", msgr2);
-		g_free(tmp_msgr2);
-	}
-	msgr_dec64 = g_base64_decode(msgr2, &msgr_dec64_len);
-	msgr_utf8 = g_convert((gchar *) msgr_dec64, msgr_dec64_len, "UTF-8", "UTF-16LE", NULL, NULL, NULL);
+
+	/* base64 padding has been stripped */
+	length = strlen(msgr);
+	padded = g_malloc(length + 4);
+	memcpy(padded, msgr, length);
+	while (length % 4 != 0)
+		padded[length++] = '=';
+	padded[length] = '\0';
+	msgr_dec64 = g_base64_decode(padded, &length);
+	g_free(padded);
+
+	msgr_utf8 = g_convert((gchar *) msgr_dec64, length, "UTF-8", "UTF-16LE", NULL, NULL, NULL);
 	g_free(msgr_dec64);
-	g_free(msgr2);
-	lines = g_strsplit(msgr_utf8,"\r\n\r\n",0);
-	g_free(msgr_utf8);
-	//@TODO: make extraction like parsing of message headers.
-	parts = g_strsplit(lines[0],"X-MMS-IM-Format:",0);
-	x_mms_im_format = g_strdup(parts[1]);
-	g_strfreev(parts);
-	g_strfreev(lines);
-	tmp = x_mms_im_format;
-	if (x_mms_im_format) {
-		while(*x_mms_im_format==' ' || *x_mms_im_format=='\t') x_mms_im_format++;
+
+	if (msgr_utf8) {
+		/* only header block counts */
+		gchar *end = strstr(msgr_utf8, "\r\n\r\n");
+		gchar *value;
+
+		if (end)
+			*end = '\0';
+		//@TODO: make extraction like parsing of message headers.
+		value = strstr(msgr_utf8, "X-MMS-IM-Format:");
+		if (value) {
+			value += sizeof("X-MMS-IM-Format:") - 1;
+			while (*value == ' ' || *value == '\t') value++;
+			x_mms_im_format = g_strdup(value);
+		}
+		g_free(msgr_utf8);
 	}
-	x_mms_im_format = g_strdup(x_mms_im_format);
-	g_free(tmp);
+
 	return x_mms_im_format;
 }
 
-gchar *sipmsg_get_msgr_string(gchar *x_mms_im_format) {
-	gchar *msgr_orig;
-	gsize msgr_utf16_len;
-	gchar *msgr_utf16;
+gchar *sipmsg_get_msgr_string(const gchar *x_mms_im_format) {
+	static const gchar header[]  = "X-MMS-IM-Format: ";
+	static const gchar trailer[] = "\r\n\r\n";
+	gunichar2 *utf16;
+	glong utf16_len;
+	guchar *msgr_utf16;
 	gchar *msgr_enc;
-	gchar *res;
+	glong i;
+	gsize j;
 	int len;
 
 	if (!x_mms_im_format) return NULL;
-	msgr_orig = g_strdup_printf("X-MMS-IM-Format: %s\r\n\r\n", x_mms_im_format);
-	msgr_utf16 = g_convert(msgr_orig, -1, "UTF-16LE", "UTF-8", NULL, &msgr_utf16_len, NULL);
-	g_free(msgr_orig);
-	msgr_enc = g_base64_encode((guchar *) msgr_utf16, msgr_utf16_len);
+
+	/* X-MMS-IM-Format: <format>\r\n\r\n in UTF-16LE */
+	utf16 = g_utf8_to_utf16(x_mms_im_format, -1, NULL, &utf16_len, NULL);
+	if (!utf16) return NULL;
+	msgr_utf16 = g_malloc(2 * (sizeof(header) - 1 + utf16_len + sizeof(trailer) - 1));
+	for (j = 0, i = 0; i < (glong) sizeof(header) - 1; i++) {
+		msgr_utf16[j++] = header[i];
+		msgr_utf16[j++] = 0;
+	}
+	for (i = 0; i < utf16_len; i++) {
+		msgr_utf16[j++] = utf16[i] & 0xFF;
+		msgr_utf16[j++] = utf16[i] >> 8;
+	}
+	for (i = 0; i < (glong) sizeof(trailer) - 1; i++) {
+		msgr_utf16[j++] = trailer[i];
+		msgr_utf16[j++] = 0;
+	}
+	g_free(utf16);
+
+	msgr_enc = g_base64_encode(msgr_utf16, j);
 	g_free(msgr_utf16);
+
+	/* strip padding */
 	len = strlen(msgr_enc);
-	while (msgr_enc[len - 1] == '=') len--;
-	res = g_strndup(msgr_enc, len);
-	g_free(msgr_enc);
-	return res;
+	while (len && (msgr_enc[len - 1] == '=')) len--;
+	msgr_enc[len] = '\0';
+	return msgr_enc;
 }
 
-static void msn_parse_format(const char *mime, char **pre_ret, char **post_ret);
-
 /**
- * Translates X-MMS-IM format to HTML presentation.
+ * HTML tags for X-MMS-IM format, see msn_format_open()
  */
-static gchar *sipmsg_apply_x_mms_im_format(const char *x_mms_im_format, gchar *body) {
-	char *pre, *post;
-	gchar *res;
+struct msn_format {
+	gchar effects[8];
+	gboolean font;
+	gboolean color;
+	gboolean rtl;
+};
+
+static void msn_format_open(GString *html, const gchar *mime, struct msn_format *format);
+static void msn_format_close(GString *html, const struct msn_format *format);
 
-	if (!x_mms_im_format) {
-		return body ? g_strdup(body) : NULL;
+/* same as g_markup_escape_text(), but appends to string */
+static void append_escaped_text(GString *html, const gchar *text, gsize length)
+{
+	const gchar *end = text + length;
+	const gchar *run = text;
+	const gchar *p   = text;
+
+	while (p < end) {
+		const guchar c = *p;
+		const gchar *entity = NULL;
+		gunichar control = 0;
+		gsize skip = 1;
+
+		switch (c) {
+		case '&':  entity = "&amp;";  break;
+		case '<':  entity = "&lt;";   break;
+		case '>':  entity = "&gt;";   break;
+		case '\'': entity = "&apos;"; break;
+		case '"':  entity = "&quot;"; break;
+		default:
+			if (((c >= 0x01) && (c <= 0x08)) ||
+			    (c == 0x0b) || (c == 0x0c) ||
+			    ((c >= 0x0e) && (c <= 0x1f)) ||
+			    (c == 0x7f)) {
+				control = c;
+			} else if ((c == 0xc2) && (p + 1 < end)) {
+				/* C1 control characters U+0080 - U+009F */
+				const guchar c2 = p[1];
+				if ((c2 < 0x84) || ((c2 > 0x85) && (c2 < 0xa0))) {
+					control = c2;
+					skip = 2;
+				}
+			}
+			break;
+		}
+
+		if (entity || control) {
+			g_string_append_len(html, run, p - run);
+			if (entity)
+				g_string_append(html, entity);
+			else
+				g_string_append_printf(html, "&#x%x;", control);
+			p  += skip;
+			run = p;
+		} else {
+			p++;
+		}
+	}
+	g_string_append_len(html, run, end - run);
+}
+
+/*
+ * HTML uses tags for formatting, not line breaks. But clients still
+ * might render them, so we need to remove them to avoid incorrect
+ * text rendering.
+ */
+static void append_html_without_breaks(GString *html, const gchar *text, gsize length)
+{
+	const gchar *end = text + length;
+
+	while (text < end) {
+		const gchar *run = text;
+
+		while ((text < end) && (*text != '\r') && (*text != '\n'))
+			text++;
+		g_string_append_len(html, run, text - run);
+		while ((text < end) && ((*text == '\r') || (*text == '\n')))
+			text++;
 	}
-	msn_parse_format(x_mms_im_format, &pre, &post);
-	res = g_strdup_printf("%s%s%s", pre ? pre :  "", body ? body : "", post ? post : "");
-	g_free(pre);
-	g_free(post);
-	return res;
 }
 
 struct html_message_data {
 	gchar *ms_text_format;
 	gchar *body;
+	gsize length;
 	gboolean preferred;
 };
 
@@ -579,7 +1182,8 @@ static void get_html_message_mime_cb(gpointer user_data,
 			g_free(data->ms_text_format);
 			g_free(data->body);
 			data->ms_text_format = g_strdup(type);
-			data->body = g_strndup(body, length);
+			data->body   = g_strndup(body, length);
+			data->length = length;
 		}
 	}
 }
@@ -587,78 +1191,72 @@ static void get_html_message_mime_cb(gpointer user_data,
 /* ms-text-format: text/plain; charset=UTF-8;msgr=WAAtAE0...DIADQAKAA0ACgA;ms-body=SGk= */
 gchar *get_html_message(const gchar *ms_text_format_in, const gchar *body_in)
 {
+	struct html_message_data data = { NULL, NULL, 0, FALSE };
+	const gchar *ms_text_format = ms_text_format_in;
+	const gchar *body = body_in;
+	gsize length = 0;
+	guchar *decoded = NULL;
 	gchar *msgr;
-	gchar *res;
-	gchar *ms_text_format = NULL;
-	gchar *body = NULL;
+	gchar *x_mms_im_format = NULL;
+	struct msn_format format;
+	GString *html;
 
 	if (g_str_has_prefix(ms_text_format_in, "multipart/related") ||
 	    g_str_has_prefix(ms_text_format_in, "multipart/alternative")) {
-		struct html_message_data data = { NULL, NULL, FALSE };
 
 		sipe_mime_parts_foreach(ms_text_format_in, body_in,
 					get_html_message_mime_cb, &data);
 
+		if (!data.ms_text_format)
+			return NULL;
 		ms_text_format = data.ms_text_format;
-		body = data.body;
-
-	} else {
-		ms_text_format = g_strdup(ms_text_format_in);
-		body = g_strdup(body_in);
-	}
+		body   = data.body;
+		length = data.length;
 
-	if (body) {
-		res = body;
+	} else if (body) {
+		length = strlen(body);
 	} else {
 		gchar *tmp = sipmsg_find_part_of_header(ms_text_format, "ms-body=", NULL, NULL);
-		gsize len;
-		if (!tmp) {
-			g_free(ms_text_format);
+		if (!tmp)
 			return NULL;
-		}
-		res = (gchar *) g_base64_decode(tmp, &len);
+		decoded = g_base64_decode(tmp, &length);
 		g_free(tmp);
-		if (!res) {
-			g_free(ms_text_format);
+		if (!decoded)
 			return NULL;
+		body = (const gchar *) decoded;
+		/* decoded text is not NUL terminated */
+		{
+			const gchar *nul = memchr(body, '\0', length);
+			if (nul)
+				length = nul - body;
 		}
 	}
 
-	if (g_str_has_prefix(ms_text_format, "text/html")) {
-		/*
-		 * HTML uses tags for formatting, not line breaks. But
-		 * clients still might render them, so we need to remove
-		 * them to avoid incorrect text rendering.
-		 */
-		gchar *d = res;
-		const gchar *s = res;
-		gchar c;
-
-		/* No ANSI C nor glib function seems to exist for this :-( */
-		while ((c = *s++))
-			if ((c != '\n') && (c != '\r'))
-				*d++ = c;
-		*d = c;
-
-	} else {
-		char *tmp = res;
-		res = g_markup_escape_text(res, -1); // as this is not html
-		g_free(tmp);
-	}
+	html = g_string_sized_new(length + 128);
 
 	msgr = sipmsg_find_part_of_header(ms_text_format, "msgr=", ";", NULL);
 	if (msgr) {
-		gchar *x_mms_im_format = sipmsg_get_x_mms_im_format(msgr);
-		gchar *tmp = res;
+		x_mms_im_format = sipmsg_get_x_mms_im_format(msgr);
 		g_free(msgr);
-		res = sipmsg_apply_x_mms_im_format(x_mms_im_format, res);
-		g_free(tmp);
+	}
+	if (x_mms_im_format)
+		msn_format_open(html, x_mms_im_format, &format);
+
+	if (g_str_has_prefix(ms_text_format, "text/html"))
+		append_html_without_breaks(html, body, length);
+	else
+		append_escaped_text(html, body, length); // as this is not html
+
+	if (x_mms_im_format) {
+		msn_format_close(html, &format);
 		g_free(x_mms_im_format);
 	}
 
-	g_free(ms_text_format);
+	g_free(decoded);
+	g_free(data.body);
+	g_free(data.ms_text_format);
 
-	return res;
+	return g_string_free(html, FALSE);
 }
 
 static gchar *
@@ -721,51 +1319,55 @@ sipmsg_parse_warning(struct sipmsg *msg, gchar **reason)
 //TEMP solution to include it here (copy from purple's msn protocol
 //How to reuse msn's util methods from sipe?
 
-/* from internal.h */
-#define MSG_LEN 2048
-#define BUF_LEN MSG_LEN
-
-void
-msn_parse_format(const char *mime, char **pre_ret, char **post_ret)
+/**
+ * Appends HTML opening tags for X-MMS-IM format @c mime and remembers
+ * which closing tags msn_format_close() needs to append.
+ */
+static void
+msn_format_open(GString *html, const char *mime, struct msn_format *format)
 {
-	char *cur;
-	GString *pre  = g_string_new(NULL);
-	GString *post = g_string_new(NULL);
+	const char *cur;
 	unsigned int colors[3];
 
-	if (pre_ret  != NULL) *pre_ret  = NULL;
-	if (post_ret != NULL) *post_ret = NULL;
+	memset(format, 0, sizeof(struct msn_format));
 
 	cur = strstr(mime, "FN=");
 
 	if (cur && (*(cur = cur + 3) != ';'))
 	{
-		pre = g_string_append(pre, "<FONT FACE=\"");
+		const char *end = cur;
+		gchar *escaped;
+		gchar *face;
+
+		while (*end && *end != ';')
+			end++;
 
-		while (*cur && *cur != ';')
+		escaped = g_strndup(cur, end - cur);
+		face = sipe_utils_uri_unescape(escaped);
+		g_free(escaped);
+
+		if (face)
 		{
-			pre = g_string_append_c(pre, *cur);
-			cur++;
+			g_string_append(html, "<FONT FACE=\"");
+			g_string_append(html, face);
+			g_string_append(html, "\">");
+			format->font = TRUE;
+			g_free(face);
 		}
-
-		pre = g_string_append(pre, "\">");
-		post = g_string_prepend(post, "</FONT>");
 	}
 
 	cur = strstr(mime, "EF=");
 
 	if (cur && (*(cur = cur + 3) != ';'))
 	{
-		while (*cur && *cur != ';')
+		guint i = 0;
+
+		while (*cur && *cur != ';' && (i < sizeof(format->effects) - 1))
 		{
-			pre = g_string_append_c(pre, '<');
-			pre = g_string_append_c(pre, *cur);
-			pre = g_string_append_c(pre, '>');
-			post = g_string_prepend_c(post, '>');
-			post = g_string_prepend_c(post, *cur);
-			post = g_string_prepend_c(post, '/');
-			post = g_string_prepend_c(post, '<');
-			cur++;
+			g_string_append_c(html, '<');
+			g_string_append_c(html, *cur);
+			g_string_append_c(html, '>');
+			format->effects[i++] = *cur++;
 		}
 	}
 
@@ -779,8 +1381,6 @@ msn_parse_format(const char *mime, char **pre_ret, char **post_ret)
 
 		if (i > 0)
 		{
-			char tag[64];
-
 			if (i == 1)
 			{
 				colors[1] = 0;
@@ -805,12 +1405,10 @@ msn_parse_format(const char *mime, char **pre_ret, char **post_ret)
 			/* hh is undefined in mingw's gcc 4.4
 			 *  https://sourceforge.net/tracker/index.php?func=detail&aid=2818436&group_id=2435&atid=102435
 			 */
-			g_snprintf(tag, sizeof(tag),
-					   "<FONT COLOR=\"#%02x%02x%02x\">",
-					   (unsigned char)colors[0], (unsigned char)colors[1], (unsigned char)colors[2]);
-
-			pre = g_string_append(pre, tag);
-			post = g_string_prepend(post, "</FONT>");
+			g_string_append_printf(html,
+					       "<FONT COLOR=\"#%02x%02x%02x\">",
+					       (unsigned char)colors[0], (unsigned char)colors[1], (unsigned char)colors[2]);
+			format->color = TRUE;
 		}
 	}
 
@@ -821,51 +1419,29 @@ msn_parse_format(const char *mime, char **pre_ret, char **post_ret)
 		if (*cur == '1')
 		{
 			/* RTL text was received */
-			pre = g_string_append(pre, "<SPAN style=\"direction:rtl;text-align:right;\">");
-			post = g_string_prepend(post, "</SPAN>");
+			g_string_append(html, "<SPAN style=\"direction:rtl;text-align:right;\">");
+			format->rtl = TRUE;
 		}
 	}
-
-	cur = sipe_utils_uri_unescape(pre->str);
-	g_string_free(pre, TRUE);
-
-	if (pre_ret != NULL)
-		*pre_ret = cur;
-	else
-		g_free(cur);
-
-	cur = sipe_utils_uri_unescape(post->str);
-	g_string_free(post, TRUE);
-
-	if (post_ret != NULL)
-		*post_ret = cur;
-	else
-		g_free(cur);
 }
 
-static const char *
-encode_spaces(const char *str)
+static void
+msn_format_close(GString *html, const struct msn_format *format)
 {
-	static char buf[BUF_LEN];
-	const char *c;
-	char *d;
-
-	g_return_val_if_fail(str != NULL, NULL);
+	guint i = strlen(format->effects);
 
-	for (c = str, d = buf; *c != '\0'; c++)
+	if (format->rtl)
+		g_string_append(html, "</SPAN>");
+	if (format->color)
+		g_string_append(html, "</FONT>");
+	while (i-- > 0)
 	{
-		if (*c == ' ')
-		{
-			*d++ = '%';
-			*d++ = '2';
-			*d++ = '0';
-		}
-		else
-			*d++ = *c;
+		g_string_append(html, "</");
+		g_string_append_c(html, format->effects[i]);
+		g_string_append_c(html, '>');
 	}
-	*d = '\0';
-
-	return buf;
+	if (format->font)
+		g_string_append(html, "</FONT>");
 }
 
 void
@@ -1094,12 +1670,20 @@ sipe_parse_html(const char *html, char **attributes, char **message)
 			msg[retcount++] = *c++;
 	}
 
-	if (fontface == NULL)
-		fontface = g_strdup("MS Sans Serif");
+	{
+		GString *format = g_string_sized_new(64);
+		const char *face = fontface ? fontface : "MS Sans Serif";
 
-	*attributes = g_strdup_printf("FN=%s; EF=%s; CO=%s; PF=0; RL=%c",
-								  encode_spaces(fontface),
-								  fonteffect, fontcolor, direction);
+		g_string_append(format, "FN=");
+		for (; *face; face++)
+			if (*face == ' ')
+				g_string_append(format, "%20");
+			else
+				g_string_append_c(format, *face);
+		g_string_append_printf(format, "; EF=%s; CO=%s; PF=0; RL=%c",
+				       fonteffect, fontcolor, direction);
+		*attributes = g_string_free(format, FALSE);
+	}
 	*message = msg;
 
 	g_free(fontface);
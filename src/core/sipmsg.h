@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2014 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2008 Novell, Inc.
  * Copyright (C) 2005, Thomas Butter <butter@uni-mannheim.de>
  *
@@ -31,10 +31,103 @@
 #define SIPMSG_RESPONSE_FATAL_ERROR -1
 #define SIPMSG_BODYLEN_CHUNKED      -1
 
+/*
+ * Well-known headers, methods and events, see sipmsg_find_known_header(),
+ * sipmsg_method_id() and sipmsg_event_id().
+ *
+ * The order must match the lists in contrib/perfect-hash/sipmsg-tokens.pl
+ */
+enum sipmsg_header_id {
+	SIPMSG_HEADER_CALL_ID = 0,
+	SIPMSG_HEADER_CSEQ,
+	SIPMSG_HEADER_CONTENT_LENGTH,
+	SIPMSG_HEADER_CONTENT_TYPE,
+	SIPMSG_HEADER_FROM,
+	SIPMSG_HEADER_TO,
+	SIPMSG_HEADER_TRANSFER_ENCODING,
+	SIPMSG_HEADER_ALLOW,
+	SIPMSG_HEADER_ALLOW_EVENTS,
+	SIPMSG_HEADER_AUTHENTICATION_INFO,
+	SIPMSG_HEADER_AUTHORIZATION,
+	SIPMSG_HEADER_CONNECTION,
+	SIPMSG_HEADER_CONTACT,
+	SIPMSG_HEADER_DATE,
+	SIPMSG_HEADER_ENDPOINTS,
+	SIPMSG_HEADER_EVENT,
+	SIPMSG_HEADER_EXPIRES,
+	SIPMSG_HEADER_LOCATION,
+	SIPMSG_HEADER_MAX_FORWARDS,
+	SIPMSG_HEADER_MESSAGE_ID,
+	SIPMSG_HEADER_MS_CLIENT_DIAGNOSTICS,
+	SIPMSG_HEADER_MS_DIAGNOSTICS,
+	SIPMSG_HEADER_MS_KEEP_ALIVE,
+	SIPMSG_HEADER_MS_PIGGYBACK_CSEQ,
+	SIPMSG_HEADER_MS_TEXT_FORMAT,
+	SIPMSG_HEADER_MS_SENDER,
+	SIPMSG_HEADER_P_ASSERTED_IDENTITY,
+	SIPMSG_HEADER_P_PREFERRED_IDENTITY,
+	SIPMSG_HEADER_PROXY_AUTHENTICATE,
+	SIPMSG_HEADER_PROXY_AUTHENTICATION_INFO,
+	SIPMSG_HEADER_PROXY_AUTHORIZATION,
+	SIPMSG_HEADER_RECORD_ROUTE,
+	SIPMSG_HEADER_REFER_TO,
+	SIPMSG_HEADER_REFERRED_BY,
+	SIPMSG_HEADER_REQUIRE,
+	SIPMSG_HEADER_ROSTER_MANAGER,
+	SIPMSG_HEADER_SERVER,
+	SIPMSG_HEADER_SESSION_EXPIRES,
+	SIPMSG_HEADER_SET_COOKIE,
+	SIPMSG_HEADER_SUBJECT,
+	SIPMSG_HEADER_SUBSCRIPTION_STATE,
+	SIPMSG_HEADER_SUPPORTED,
+	SIPMSG_HEADER_TRIGGEREDINVITE,
+	SIPMSG_HEADER_USER_AGENT,
+	SIPMSG_HEADER_VIA,
+	SIPMSG_HEADER_WARNING,
+	SIPMSG_HEADER_WWW_AUTHENTICATE,
+	SIPMSG_HEADER_KNOWN_MAX
+};
+
+enum sipmsg_method_id {
+	SIPMSG_METHOD_UNKNOWN = 0,
+	SIPMSG_METHOD_ACK,
+	SIPMSG_METHOD_BENOTIFY,
+	SIPMSG_METHOD_BYE,
+	SIPMSG_METHOD_CANCEL,
+	SIPMSG_METHOD_INFO,
+	SIPMSG_METHOD_INVITE,
+	SIPMSG_METHOD_MESSAGE,
+	SIPMSG_METHOD_NOTIFY,
+	SIPMSG_METHOD_OPTIONS,
+	SIPMSG_METHOD_PRACK,
+	SIPMSG_METHOD_PUBLISH,
+	SIPMSG_METHOD_REFER,
+	SIPMSG_METHOD_REGISTER,
+	SIPMSG_METHOD_SERVICE,
+	SIPMSG_METHOD_SUBSCRIBE,
+	SIPMSG_METHOD_MAX
+};
+
+enum sipmsg_event_id {
+	SIPMSG_EVENT_UNKNOWN = 0,
+	SIPMSG_EVENT_CONFERENCE,		/* conference */
+	SIPMSG_EVENT_MSRTC_WPENDING,		/* msrtc.wpending */
+	SIPMSG_EVENT_PRESENCE,			/* presence */
+	SIPMSG_EVENT_PRESENCE_WPENDING,		/* presence.wpending */
+	SIPMSG_EVENT_REGISTRATION_NOTIFY,	/* registration-notify */
+	SIPMSG_EVENT_PROVISIONING,		/* vnd-microsoft-provisioning */
+	SIPMSG_EVENT_PROVISIONING_V2,		/* vnd-microsoft-provisioning-v2 */
+	SIPMSG_EVENT_ROAMING_ACL,		/* vnd-microsoft-roaming-ACL */
+	SIPMSG_EVENT_ROAMING_CONTACTS,		/* vnd-microsoft-roaming-contacts */
+	SIPMSG_EVENT_ROAMING_SELF,		/* vnd-microsoft-roaming-self */
+	SIPMSG_EVENT_MAX
+};
+
 struct sipmsg {
 	int response; /* 0 means request, otherwise response code */
 	gchar *responsestr;
 	gchar *method;
+	guint method_id; /* SIPMSG_METHOD_xxx for method */
 	gchar *target;
 	GSList *headers;
 	GSList *new_headers;
@@ -43,6 +136,11 @@ struct sipmsg {
 	gchar *signature;
 	gchar *rand;
 	gchar *num;
+	struct _sipe_xml *xml; /* body parsed while receiving, can be NULL */
+	/* first instance of well-known headers, pointers into headers list */
+	struct sipnameval *known_headers[SIPMSG_HEADER_KNOWN_MAX];
+	/* owns start line and header elements, released with the message */
+	struct sipe_arena *arena;
 };
 
 struct sipendpoint {
@@ -53,12 +151,66 @@ struct sipendpoint {
 
 struct sipmsg *sipmsg_parse_msg(const gchar *msg);
 struct sipmsg *sipmsg_parse_header(const gchar *header);
+/**
+ * Parses SIP/HTTP header block in a single pass
+ *
+ * @param header (in) start of header block (need not be NUL terminated)
+ * @param length (in) length of header block, excluding final empty line
+ *
+ * @return parsed message or @c NULL
+ */
+struct sipmsg *sipmsg_parse_header_len(const gchar *header, gsize length);
+/**
+ * Same as @c sipmsg_parse_header_len() but allocates from a given arena
+ *
+ * @param header (in) start of header block (need not be NUL terminated)
+ * @param length (in) length of header block, excluding final empty line
+ * @param arena  (in) empty arena, owned by the message on success. On
+ *                    failure it is reset and stays with the caller.
+ *
+ * @return parsed message or @c NULL
+ */
+struct sipe_arena;
+struct sipmsg *sipmsg_parse_header_arena(const gchar *header,
+					 gsize length,
+					 struct sipe_arena *arena);
 struct sipmsg *sipmsg_copy(const struct sipmsg *other);
 void sipmsg_add_header_now(struct sipmsg *msg, const gchar *name, const gchar *value);
 void sipmsg_add_header(struct sipmsg *msg, const gchar *name, const gchar *value);
 void sipmsg_strip_headers(struct sipmsg *msg, const gchar *keepers[]);
 void sipmsg_merge_new_headers(struct sipmsg *msg);
 void sipmsg_free(struct sipmsg *msg);
+/**
+ * Free SIP message but keep its arena for the next message
+ *
+ * @param msg SIP message (may be @c NULL)
+ *
+ * @return reset arena or @c NULL. Must be passed to
+ *         @c sipmsg_parse_header_arena() or @c sipe_arena_free()'d.
+ */
+struct sipe_arena *sipmsg_free_keep_arena(struct sipmsg *msg);
+
+/**
+ * Estimate memory used by a SIP message
+ *
+ * @param msg   SIP message (may be @c NULL)
+ * @param usage accumulated memory usage
+ */
+struct sipe_memory_usage;
+void sipmsg_memory_usage(const struct sipmsg *msg,
+			 struct sipe_memory_usage *usage);
+
+/**
+ * Parse XML message body
+ *
+ * Takes over the document if the transport already parsed the body while
+ * it was received, otherwise the body is parsed now.
+ *
+ * @param msg SIP message
+ *
+ * @return Parsed XML body or @c NULL. Must be @c sipe_xml_free()'d.
+ */
+struct _sipe_xml *sipmsg_parse_xml_body(struct sipmsg *msg);
 
 /**
  * Parses CSeq from SIP message
@@ -86,12 +238,63 @@ GSList *sipmsg_parse_endpoints_header(const gchar *header);
 void sipmsg_parse_p_asserted_identity(const gchar *header, gchar **sip_uri,
 				      gchar **tel_uri);
 const gchar *sipmsg_find_header(const struct sipmsg *msg, const gchar *name);
+/**
+ * Fast lookup of first instance of a well-known header
+ *
+ * @param msg (in) SIP message
+ * @param id  (in) one of @c SIPMSG_HEADER_xxx
+ *
+ * @return header value or @c NULL
+ */
+const gchar *sipmsg_find_known_header(const struct sipmsg *msg, guint id);
+/**
+ * Perfect hash lookup of a SIP method name (case sensitive)
+ *
+ * @param method (in) method name, can be @c NULL
+ *
+ * @return one of @c SIPMSG_METHOD_xxx
+ */
+guint sipmsg_method_id(const gchar *method);
+/**
+ * Perfect hash lookup of an Event header value (case insensitive)
+ *
+ * @param event (in) event package name, can be @c NULL
+ *
+ * @return one of @c SIPMSG_EVENT_xxx
+ */
+guint sipmsg_event_id(const gchar *event);
 const gchar *sipmsg_find_header_instance(const struct sipmsg *msg, const gchar *name, int which);
 gchar *sipmsg_find_part_of_header(const char *hdr, const char * before, const char * after, const char * def);
+/**
+ * Same as @c sipmsg_find_part_of_header() but the result is borrowed
+ *
+ * @param msg    (in) SIP message that provides the storage
+ * @param hdr    (in) header value (may be @c NULL)
+ * @param before (in) text preceding the part (may be @c NULL)
+ * @param after  (in) text following the part (may be @c NULL)
+ * @param def    (in) returned if @c before is not found
+ *
+ * @return part of header, @c def or @c NULL. Valid until @c msg is freed.
+ */
+const gchar *sipmsg_borrow_part_of_header(struct sipmsg *msg,
+					  const gchar *hdr,
+					  const gchar *before,
+					  const gchar *after,
+					  const gchar *def);
 const gchar *sipmsg_find_auth_header(struct sipmsg *msg, const gchar *name);
 void sipmsg_remove_header_now(struct sipmsg *msg, const gchar *name);
 char *sipmsg_to_string(const struct sipmsg *msg);
 
+/**
+ * Start line and headers of a message, including the empty line that
+ * separates them from the body. Send the body as a separate segment.
+ *
+ * @param msg SIP message
+ *
+ * @return header string. Must be g_free()'d after use.
+ */
+gchar *sipmsg_header_to_string(const struct sipmsg *msg);
+
 /**
  * Formats message to html if not yet.
  * Either - keep as is if text/html, or escape text, or escape text and apply format string if any
@@ -107,7 +310,7 @@ gchar *get_html_message(const gchar *ms_text_format, const gchar *body);
  * Returns UTF-16LE/'modified base64' encoded X-MMS-IM-Format
  * based on input x_mms_im_format.
  */
-gchar *sipmsg_get_msgr_string(gchar *x_mms_im_format);
+gchar *sipmsg_get_msgr_string(const gchar *x_mms_im_format);
 
 /**
  * Parses the Purple message formatting (html) into the MSN format.
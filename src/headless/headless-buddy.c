@@ -0,0 +1,425 @@
+/**
+ * @file headless-buddy.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * The buddy list only exists to give the core what it expects from a
+ * backend. Nothing is displayed, so buddy information is only allocated
+ * when the core actually stores some and photos are never downloaded.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+
+#include "headless-private.h"
+
+#define SIPE_INFO_FIELD_MAX (SIPE_BUDDY_INFO_CUSTOM1_PHONE_DISPLAY + 1)
+
+struct headless_buddy {
+	const gchar *uri;   /* borrowed from headless_private->buddies key */
+	GSList *entries;    /* headless_buddy_entry */
+	gchar **info;       /* SIPE_INFO_FIELD_MAX entries, allocated on demand */
+	guint activity;
+};
+
+struct headless_buddy_entry {
+	struct headless_buddy *buddy; /* pointer to parent */
+	const gchar *group;           /* borrowed from headless_private->groups key */
+};
+
+static void buddy_free(gpointer data)
+{
+	struct headless_buddy *buddy = data;
+
+	g_slist_free_full(buddy->entries, g_free);
+	if (buddy->info) {
+		guint i;
+		for (i = 0; i < SIPE_INFO_FIELD_MAX; i++)
+			g_free(buddy->info[i]);
+		g_free(buddy->info);
+	}
+	g_free(buddy);
+}
+
+void sipe_headless_buddy_init(struct sipe_backend_private *headless_private)
+{
+	headless_private->buddies = g_hash_table_new_full(g_str_hash, g_str_equal,
+							  g_free, buddy_free);
+	headless_private->groups  = g_hash_table_new_full(g_str_hash, g_str_equal,
+							  g_free, NULL);
+}
+
+void sipe_headless_buddy_free(struct sipe_backend_private *headless_private)
+{
+	/* NOTE: the order is important due to borrowing of keys! */
+	if (headless_private->buddies) {
+		g_hash_table_destroy(headless_private->buddies);
+		headless_private->buddies = NULL;
+	}
+	if (headless_private->groups) {
+		g_hash_table_destroy(headless_private->groups);
+		headless_private->groups = NULL;
+	}
+}
+
+static struct headless_buddy_entry *buddy_entry_find(struct headless_buddy *buddy,
+						     const gchar *group_name)
+{
+	GSList *entry;
+
+	for (entry = buddy->entries; entry; entry = entry->next) {
+		struct headless_buddy_entry *buddy_entry = entry->data;
+		if (sipe_strequal(buddy_entry->group, group_name))
+			return(buddy_entry);
+	}
+
+	return(NULL);
+}
+
+/*
+ * Backend adaptor functions
+ */
+sipe_backend_buddy sipe_backend_buddy_find(struct sipe_core_public *sipe_public,
+					   const gchar *buddy_name,
+					   const gchar *group_name)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	struct headless_buddy *buddy                  = g_hash_table_lookup(headless_private->buddies,
+									    buddy_name);
+	if (!buddy)
+		return(NULL);
+
+	if (group_name)
+		return(buddy_entry_find(buddy, group_name));
+
+	/* just return the first entry */
+	return(buddy->entries ? buddy->entries->data : NULL);
+}
+
+static GSList *buddy_add_all(struct headless_buddy *buddy, GSList *list)
+{
+	GSList *entry;
+
+	if (!buddy)
+		return(list);
+
+	for (entry = buddy->entries; entry; entry = entry->next)
+		list = g_slist_prepend(list, entry->data);
+
+	return(list);
+}
+
+GSList *sipe_backend_buddy_find_all(struct sipe_core_public *sipe_public,
+				    const gchar *buddy_name,
+				    const gchar *group_name)
+{
+	GSList *result = NULL;
+
+	/* NOTE: group_name != NULL not implemented in purple either */
+	if (!group_name) {
+		struct sipe_backend_private *headless_private = sipe_public->backend_private;
+
+		if (buddy_name) {
+			result = buddy_add_all(g_hash_table_lookup(headless_private->buddies,
+								   buddy_name),
+					       result);
+		} else {
+			GHashTableIter iter;
+			struct headless_buddy *buddy;
+
+			g_hash_table_iter_init(&iter, headless_private->buddies);
+			while (g_hash_table_iter_next(&iter, NULL, (gpointer) &buddy))
+				result = buddy_add_all(buddy, result);
+		}
+	}
+
+	return(result);
+}
+
+gchar *sipe_backend_buddy_get_name(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+				   const sipe_backend_buddy who)
+{
+	return(g_strdup(((struct headless_buddy_entry *) who)->buddy->uri));
+}
+
+gchar *sipe_backend_buddy_get_string(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+				     sipe_backend_buddy who,
+				     const sipe_buddy_info_fields key)
+{
+	struct headless_buddy *buddy = ((struct headless_buddy_entry *) who)->buddy;
+
+	if ((key >= SIPE_INFO_FIELD_MAX) || !buddy->info)
+		return(NULL);
+	return(g_strdup(buddy->info[key]));
+}
+
+void sipe_backend_buddy_set_string(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+				   sipe_backend_buddy who,
+				   const sipe_buddy_info_fields key,
+				   const gchar *val)
+{
+	struct headless_buddy *buddy = ((struct headless_buddy_entry *) who)->buddy;
+
+	if (key >= SIPE_INFO_FIELD_MAX)
+		return;
+
+	if (!buddy->info) {
+		if (!val)
+			return;
+		buddy->info = g_new0(gchar *, SIPE_INFO_FIELD_MAX);
+	}
+
+	g_free(buddy->info[key]);
+	buddy->info[key] = g_strdup(val);
+}
+
+gchar *sipe_backend_buddy_get_alias(struct sipe_core_public *sipe_public,
+				    const sipe_backend_buddy who)
+{
+	return(sipe_backend_buddy_get_string(sipe_public,
+					     who,
+					     SIPE_BUDDY_INFO_DISPLAY_NAME));
+}
+
+gchar *sipe_backend_buddy_get_server_alias(struct sipe_core_public *sipe_public,
+					   const sipe_backend_buddy who)
+{
+	/* server alias is the same as alias */
+	return(sipe_backend_buddy_get_alias(sipe_public, who));
+}
+
+gchar *sipe_backend_buddy_get_local_alias(struct sipe_core_public *sipe_public,
+					  const sipe_backend_buddy who)
+{
+	/* local alias is the same as alias */
+	return(sipe_backend_buddy_get_alias(sipe_public, who));
+}
+
+gchar *sipe_backend_buddy_get_group_name(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					 const sipe_backend_buddy who)
+{
+	return(g_strdup(((struct headless_buddy_entry *) who)->group));
+}
+
+void sipe_backend_buddy_set_alias(struct sipe_core_public *sipe_public,
+				  const sipe_backend_buddy who,
+				  const gchar *alias)
+{
+	sipe_backend_buddy_set_string(sipe_public,
+				      who,
+				      SIPE_BUDDY_INFO_DISPLAY_NAME,
+				      alias);
+}
+
+void sipe_backend_buddy_set_server_alias(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					 SIPE_UNUSED_PARAMETER const sipe_backend_buddy who,
+					 SIPE_UNUSED_PARAMETER const gchar *alias)
+{
+	/* server alias is the same as alias. Ignore this */
+}
+
+void sipe_backend_buddy_refresh_properties(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					   SIPE_UNUSED_PARAMETER const gchar *uri)
+{
+}
+
+guint sipe_backend_buddy_get_status(struct sipe_core_public *sipe_public,
+				    const gchar *uri)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	struct headless_buddy *buddy                  = g_hash_table_lookup(headless_private->buddies,
+									    uri);
+
+	if (!buddy)
+		return(SIPE_ACTIVITY_UNSET);
+	return(buddy->activity);
+}
+
+void sipe_backend_buddy_set_status(struct sipe_core_public *sipe_public,
+				   const gchar *uri,
+				   guint activity)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	struct headless_buddy *buddy                  = g_hash_table_lookup(headless_private->buddies,
+									    uri);
+
+	if (buddy)
+		buddy->activity = activity;
+}
+
+void sipe_backend_buddy_list_processing_start(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public)
+{
+}
+
+void sipe_backend_buddy_list_processing_finish(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public)
+{
+}
+
+sipe_backend_buddy sipe_backend_buddy_add(struct sipe_core_public *sipe_public,
+					  const gchar *name,
+					  const gchar *alias,
+					  const gchar *group_name)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	const gchar *group                            = g_hash_table_lookup(headless_private->groups,
+									    group_name);
+	struct headless_buddy *buddy                  = g_hash_table_lookup(headless_private->buddies,
+									    name);
+	struct headless_buddy_entry *buddy_entry;
+
+	if (!group)
+		return(NULL);
+
+	if (!buddy) {
+		buddy           = g_new0(struct headless_buddy, 1);
+		buddy->uri      = g_strdup(name); /* reused as key */
+		buddy->activity = SIPE_ACTIVITY_OFFLINE;
+		g_hash_table_insert(headless_private->buddies,
+				    (gchar *) buddy->uri, /* owned by hash table */
+				    buddy);
+	}
+
+	buddy_entry = buddy_entry_find(buddy, group);
+	if (!buddy_entry) {
+		buddy_entry        = g_new0(struct headless_buddy_entry, 1);
+		buddy_entry->buddy = buddy;
+		buddy_entry->group = group;
+		buddy->entries     = g_slist_prepend(buddy->entries, buddy_entry);
+	}
+
+	if (alias && !(buddy->info && buddy->info[SIPE_BUDDY_INFO_DISPLAY_NAME]))
+		sipe_backend_buddy_set_alias(sipe_public, buddy_entry, alias);
+
+	return(buddy_entry);
+}
+
+void sipe_backend_buddy_remove(struct sipe_core_public *sipe_public,
+			       const sipe_backend_buddy who)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	struct headless_buddy_entry *remove_entry     = who;
+	struct headless_buddy *buddy                  = remove_entry->buddy;
+
+	buddy->entries = g_slist_remove(buddy->entries, remove_entry);
+	g_free(remove_entry);
+
+	/* removed from last group -> drop this buddy */
+	if (!buddy->entries)
+		g_hash_table_remove(headless_private->buddies, buddy->uri);
+}
+
+gboolean sipe_backend_uses_photo(void)
+{
+	return(FALSE);
+}
+
+void sipe_backend_buddy_set_photo(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+				  SIPE_UNUSED_PARAMETER const gchar *who,
+				  gpointer image_data,
+				  SIPE_UNUSED_PARAMETER gsize image_len,
+				  SIPE_UNUSED_PARAMETER const gchar *photo_hash)
+{
+	g_free(image_data);
+}
+
+const gchar *sipe_backend_buddy_get_photo_hash(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					       SIPE_UNUSED_PARAMETER const gchar *who)
+{
+	return(NULL);
+}
+
+gboolean sipe_backend_buddy_group_add(struct sipe_core_public *sipe_public,
+				      const gchar *group_name)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+
+	if (!g_hash_table_lookup(headless_private->groups, group_name)) {
+		gchar *group = g_strdup(group_name);
+		g_hash_table_insert(headless_private->groups, group, group);
+	}
+
+	return(TRUE);
+}
+
+/* no collapsed groups: subscribe to all buddies */
+gboolean sipe_backend_buddy_group_visible(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					  SIPE_UNUSED_PARAMETER const gchar *group_name)
+{
+	return(TRUE);
+}
+
+gboolean sipe_backend_buddy_group_rename(struct sipe_core_public *sipe_public,
+					 const gchar *old_name,
+					 const gchar *new_name)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	const gchar *old_group                        = g_hash_table_lookup(headless_private->groups,
+									    old_name);
+	gchar *new_group;
+	GHashTableIter iter;
+	struct headless_buddy *buddy;
+
+	if (!old_group)
+		return(FALSE);
+	if (sipe_strequal(old_name, new_name))
+		return(TRUE);
+
+	new_group = g_hash_table_lookup(headless_private->groups, new_name);
+	if (!new_group) {
+		new_group = g_strdup(new_name);
+		g_hash_table_insert(headless_private->groups, new_group, new_group);
+	}
+
+	/* update borrowed group names before old one is released */
+	g_hash_table_iter_init(&iter, headless_private->buddies);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer) &buddy)) {
+		struct headless_buddy_entry *buddy_entry = buddy_entry_find(buddy,
+									    old_group);
+		if (buddy_entry)
+			buddy_entry->group = new_group;
+	}
+
+	g_hash_table_remove(headless_private->groups, old_name);
+
+	return(TRUE);
+}
+
+void sipe_backend_buddy_group_remove(struct sipe_core_public *sipe_public,
+				     const gchar *group_name)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+
+	/* NOTE: this will only be called on empty groups */
+	g_hash_table_remove(headless_private->groups, group_name);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
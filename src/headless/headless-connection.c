@@ -0,0 +1,437 @@
+/**
+ * @file headless-connection.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Account configuration
+ *
+ * Each group of the key file describes one account:
+ *
+ *   [name]
+ *   signin-name    = user@company.com          (mandatory)
+ *   login          = DOMAIN\user               (optional)
+ *   password       = secret                    (optional with SSO)
+ *   server         = sip.company.com           (optional, default: DNS)
+ *   port           = 5061                      (optional)
+ *   transport      = auto | tls | tcp          (optional, default: auto)
+ *   authentication = auto | ntlm | krb5 | tls-dsk
+ *   sso            = true | false              (optional, default: false)
+ *   dont-publish   = true | false              (optional, default: false)
+ *   standby        = true | false              (optional, default: false)
+ *   compression    = true | false              (optional, default: false)
+ *   user-agent, email, email-url, email-login, email-password,
+ *   groupchat-user                             (optional)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+
+#include "headless-private.h"
+
+#define RECONNECT_DELAY_MIN  30 /* seconds */
+#define RECONNECT_DELAY_MAX 900 /* seconds */
+
+struct headless_account {
+	gchar *name;
+	gchar *signin_name;
+	gchar *login;
+	gchar *password;
+	gchar *server;
+	gchar *port;
+	gchar *email;
+	gchar *settings[SIPE_SETTING_LAST];
+	guint transport;
+	guint authentication;
+	gboolean sso;
+	gboolean dont_publish;
+	gboolean standby;
+	gboolean compression;
+
+	guint reconnect_delay;
+	guint reconnect_timer;
+	guint disconnect_idle;
+	gulong network_changed;
+
+	struct sipe_backend_private private;
+};
+
+#define SIPE_PUBLIC_TO_ACCOUNT sipe_public->backend_private->account
+
+static gchar *config_string(GKeyFile *config,
+			    const gchar *name,
+			    const gchar *key)
+{
+	gchar *value = g_key_file_get_string(config, name, key, NULL);
+
+	/* treat empty strings like missing keys */
+	if (value && !strlen(g_strstrip(value))) {
+		g_free(value);
+		value = NULL;
+	}
+
+	return(value);
+}
+
+struct headless_account *sipe_headless_account_new(GKeyFile *config,
+						   const gchar *name)
+{
+	struct headless_account *account;
+	gchar *signin_name = config_string(config, name, "signin-name");
+	gchar *value;
+
+	if (!signin_name) {
+		g_warning("account '%s': signin-name is missing", name);
+		return(NULL);
+	}
+
+	account              = g_new0(struct headless_account, 1);
+	account->name        = g_strdup(name);
+	account->signin_name = signin_name;
+	account->login       = config_string(config, name, "login");
+	account->password    = config_string(config, name, "password");
+	account->server      = config_string(config, name, "server");
+	account->port        = config_string(config, name, "port");
+	account->email       = config_string(config, name, "email");
+	account->sso         = g_key_file_get_boolean(config, name, "sso", NULL);
+	account->dont_publish = g_key_file_get_boolean(config, name, "dont-publish", NULL);
+	account->standby     = g_key_file_get_boolean(config, name, "standby", NULL);
+	account->compression = g_key_file_get_boolean(config, name, "compression", NULL);
+
+	account->settings[SIPE_SETTING_EMAIL_URL]      = config_string(config, name, "email-url");
+	account->settings[SIPE_SETTING_EMAIL_LOGIN]    = config_string(config, name, "email-login");
+	account->settings[SIPE_SETTING_EMAIL_PASSWORD] = config_string(config, name, "email-password");
+	account->settings[SIPE_SETTING_GROUPCHAT_USER] = config_string(config, name, "groupchat-user");
+	account->settings[SIPE_SETTING_USER_AGENT]     = config_string(config, name, "user-agent");
+
+	/* map option list to flags - default is automatic */
+	account->transport = SIPE_TRANSPORT_AUTO;
+	value = config_string(config, name, "transport");
+	if (sipe_strequal(value, "tls"))
+		account->transport = SIPE_TRANSPORT_TLS;
+	else if (sipe_strequal(value, "tcp"))
+		account->transport = SIPE_TRANSPORT_TCP;
+	g_free(value);
+
+	account->authentication = SIPE_AUTHENTICATION_TYPE_AUTOMATIC;
+	value = config_string(config, name, "authentication");
+	if (sipe_strequal(value, "ntlm"))
+		account->authentication = SIPE_AUTHENTICATION_TYPE_NTLM;
+#ifdef HAVE_GSSAPI_GSSAPI_H
+	else if (sipe_strequal(value, "krb5"))
+		account->authentication = SIPE_AUTHENTICATION_TYPE_KERBEROS;
+#endif
+	else if (sipe_strequal(value, "tls-dsk"))
+		account->authentication = SIPE_AUTHENTICATION_TYPE_TLS_DSK;
+	g_free(value);
+
+	if (sipe_core_transport_sip_requires_password(account->authentication,
+						      account->sso) &&
+	    !account->password) {
+		g_warning("account '%s': password is missing", name);
+		sipe_headless_account_free(account);
+		return(NULL);
+	}
+
+	account->reconnect_delay = RECONNECT_DELAY_MIN;
+	account->private.account = account;
+
+	return(account);
+}
+
+static void account_disconnect(struct headless_account *account)
+{
+	struct sipe_backend_private *headless_private = &account->private;
+	struct sipe_core_public *sipe_public          = headless_private->public;
+
+	if (account->disconnect_idle) {
+		g_source_remove(account->disconnect_idle);
+		account->disconnect_idle = 0;
+	}
+
+	if (sipe_public) {
+		SIPE_DEBUG_INFO("account_disconnect: %s", account->name);
+
+		headless_private->is_disconnecting = TRUE;
+		sipe_core_deallocate(sipe_public);
+		headless_private->public    = NULL;
+		headless_private->transport = NULL;
+
+		/* core has released all buddies */
+		sipe_headless_buddy_free(headless_private);
+
+		g_free(headless_private->ipaddress);
+		headless_private->ipaddress = NULL;
+		g_free(headless_private->message);
+		headless_private->message   = NULL;
+	}
+}
+
+void sipe_headless_account_disconnect(struct headless_account *account)
+{
+	if (account->reconnect_timer) {
+		g_source_remove(account->reconnect_timer);
+		account->reconnect_timer = 0;
+	}
+	account_disconnect(account);
+}
+
+void sipe_headless_account_free(struct headless_account *account)
+{
+	guint i;
+
+	if (!account)
+		return;
+
+	sipe_headless_account_disconnect(account);
+
+	if (account->network_changed)
+		g_signal_handler_disconnect(g_network_monitor_get_default(),
+					    account->network_changed);
+
+	for (i = 0; i < SIPE_SETTING_LAST; i++)
+		g_free(account->settings[i]);
+	g_free(account->email);
+	g_free(account->port);
+	g_free(account->server);
+	g_free(account->password);
+	g_free(account->login);
+	g_free(account->signin_name);
+	g_free(account->name);
+	g_free(account);
+}
+
+struct sipe_backend_private *sipe_headless_account_private(struct headless_account *account)
+{
+	return(&account->private);
+}
+
+static void network_changed_cb(SIPE_UNUSED_PARAMETER GNetworkMonitor *monitor,
+			       gboolean available,
+			       gpointer data)
+{
+	struct headless_account *account = data;
+	struct sipe_core_public *sipe_public = account->private.public;
+
+	if (sipe_public) {
+		sipe_core_transport_sip_network_changed(sipe_public, available);
+
+	/* waiting for reconnect: network is back, don't wait any longer */
+	} else if (available && account->reconnect_timer) {
+		g_source_remove(account->reconnect_timer);
+		account->reconnect_timer = 0;
+		account->reconnect_delay = RECONNECT_DELAY_MIN;
+		g_message("account '%s': network changed - reconnecting",
+			  account->name);
+		sipe_headless_account_connect(account);
+	}
+}
+
+void sipe_headless_account_connect(struct headless_account *account)
+{
+	struct sipe_backend_private *headless_private = &account->private;
+	struct sipe_core_public *sipe_public;
+	const gchar *errmsg;
+
+	if (headless_private->public)
+		return;
+
+	/* stays connected while the account exists */
+	if (!account->network_changed)
+		account->network_changed = g_signal_connect(g_network_monitor_get_default(),
+							    "network-changed",
+							    G_CALLBACK(network_changed_cb),
+							    account);
+
+	sipe_public = sipe_core_allocate(account->signin_name,
+					 account->sso,
+					 account->login,
+					 account->password,
+					 account->email,
+					 account->settings[SIPE_SETTING_EMAIL_URL],
+					 NULL, /* default main context */
+					 &errmsg);
+	if (!sipe_public) {
+		g_warning("account '%s': %s", account->name, errmsg);
+		return;
+	}
+
+	SIPE_DEBUG_INFO("sipe_headless_account_connect: %s created %p",
+			account->name, sipe_public);
+
+	/* initialize backend private data */
+	sipe_public->backend_private       = headless_private;
+	headless_private->public           = sipe_public;
+	headless_private->activity         = SIPE_ACTIVITY_AVAILABLE;
+	headless_private->message          = NULL;
+	headless_private->transport        = NULL;
+	headless_private->ipaddress        = NULL;
+	headless_private->is_disconnecting = FALSE;
+	sipe_headless_buddy_init(headless_private);
+
+	SIPE_CORE_FLAG_UNSET(DONT_PUBLISH);
+	if (account->dont_publish)
+		SIPE_CORE_FLAG_SET(DONT_PUBLISH);
+	SIPE_CORE_FLAG_UNSET(STANDBY);
+	if (account->standby)
+		SIPE_CORE_FLAG_SET(STANDBY);
+	SIPE_CORE_FLAG_UNSET(SIP_COMPRESSION);
+	if (account->compression)
+		SIPE_CORE_FLAG_SET(SIP_COMPRESSION);
+
+	sipe_core_transport_sip_connect(sipe_public,
+					account->transport,
+					account->authentication,
+					account->server,
+					account->port);
+}
+
+static gboolean reconnect_timeout(gpointer data)
+{
+	struct headless_account *account = data;
+
+	account->reconnect_timer = 0;
+	g_message("account '%s': reconnecting", account->name);
+	sipe_headless_account_connect(account);
+
+	return(FALSE);
+}
+
+/* core must not be deallocated from inside a core callback */
+static gboolean disconnect_idle(gpointer data)
+{
+	struct headless_account *account = data;
+
+	account->disconnect_idle = 0;
+	account_disconnect(account);
+
+	return(FALSE);
+}
+
+/*
+ * Backend adaptor functions
+ */
+void sipe_backend_connection_completed(struct sipe_core_public *sipe_public)
+{
+	struct headless_account *account = SIPE_PUBLIC_TO_ACCOUNT;
+
+	g_message("account '%s': connected", account->name);
+	account->reconnect_delay = RECONNECT_DELAY_MIN;
+}
+
+void sipe_backend_connection_error(struct sipe_core_public *sipe_public,
+				   sipe_connection_error error,
+				   const gchar *msg)
+{
+	struct headless_account *account = SIPE_PUBLIC_TO_ACCOUNT;
+
+	if (sipe_public->backend_private->is_disconnecting)
+		return;
+	sipe_public->backend_private->is_disconnecting = TRUE;
+
+	if (!account->disconnect_idle)
+		account->disconnect_idle = g_idle_add(disconnect_idle, account);
+
+	/* only network errors can go away by themselves */
+	if (error == SIPE_CONNECTION_ERROR_NETWORK) {
+		g_warning("account '%s': %s - reconnecting in %u seconds",
+			  account->name, msg, account->reconnect_delay);
+		account->reconnect_timer = g_timeout_add_seconds(account->reconnect_delay,
+								 reconnect_timeout,
+								 account);
+		account->reconnect_delay = MIN(2 * account->reconnect_delay,
+					       RECONNECT_DELAY_MAX);
+	} else {
+		g_warning("account '%s': %s - account disabled",
+			  account->name, msg);
+	}
+}
+
+gboolean sipe_backend_connection_is_disconnecting(struct sipe_core_public *sipe_public)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+
+	/* disconnect was requested or transport was already disconnected */
+	return(headless_private->is_disconnecting ||
+	       headless_private->transport == NULL);
+}
+
+gboolean sipe_backend_connection_is_valid(struct sipe_core_public *sipe_public)
+{
+	return(!sipe_backend_connection_is_disconnecting(sipe_public));
+}
+
+const gchar *sipe_backend_setting(struct sipe_core_public *sipe_public,
+				  sipe_setting type)
+{
+	if (type >= SIPE_SETTING_LAST)
+		return(NULL);
+	return(SIPE_PUBLIC_TO_ACCOUNT->settings[type]);
+}
+
+/*
+ * Status
+ *
+ * There is no user to change the status, i.e. the account stays at the
+ * status it had at login or the one the server told us about.
+ */
+guint sipe_backend_status(struct sipe_core_public *sipe_public)
+{
+	return(sipe_public->backend_private->activity);
+}
+
+gboolean sipe_backend_status_changed(struct sipe_core_public *sipe_public,
+				     guint activity,
+				     const gchar *message)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+
+	return((activity != headless_private->activity) ||
+	       !sipe_strequal(message, headless_private->message));
+}
+
+void sipe_backend_status_and_note(struct sipe_core_public *sipe_public,
+				  guint activity,
+				  const gchar *message)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+
+	headless_private->activity = activity;
+	g_free(headless_private->message);
+	headless_private->message  = g_strdup(message);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,101 @@
+/**
+ * @file headless-debug.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ ******************************************************************************
+ *
+ * How to collect debugging information
+ *
+ *    $ G_MESSAGES_DEBUG="sipe" sipe-headless --debug accounts.conf
+ *
+ * --debug            : enable SIPE debug output, i.e. like pidgin's --debug
+ *
+ * G_MESSAGES_DEBUG   : make informational messages visible
+ *
+ * Warnings and errors are always printed by the default GLib log handler.
+ *
+ * SIPE_DEBUG_LOGFILE : write SIPE debug output to this file instead,
+ *                      [also enables SIPE debug output]
+ *
+ ******************************************************************************
+ */
+
+#include <stdarg.h>
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+
+#include "headless-private.h"
+
+static gboolean debug_enabled = FALSE;
+
+void sipe_headless_debug_init(gboolean enabled)
+{
+	debug_enabled = enabled;
+}
+
+static const GLogLevelFlags debug_level_mapping[] = {
+	G_LOG_LEVEL_DEBUG,    /* SIPE_DEBUG_LEVEL_INFO    */
+	G_LOG_LEVEL_WARNING,  /* SIPE_DEBUG_LEVEL_WARNING */
+	G_LOG_LEVEL_CRITICAL, /* SIPE_DEBUG_LEVEL_ERROR   */
+};
+
+void sipe_backend_debug_literal(sipe_debug_level level,
+				const gchar *msg)
+{
+	/* debug log file replaces synchronous g_log() output */
+	if (sipe_core_debug_log(level, msg))
+		return;
+
+	if (debug_enabled)
+		g_log(SIPE_HEADLESS_DOMAIN, debug_level_mapping[level],
+		      "%s", msg);
+}
+
+void sipe_backend_debug(sipe_debug_level level,
+			const gchar *format,
+			...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	if (sipe_backend_debug_enabled()) {
+		gchar *msg = g_strdup_vprintf(format, ap);
+		sipe_backend_debug_literal(level, msg);
+		g_free(msg);
+	}
+	va_end(ap);
+}
+
+gboolean sipe_backend_debug_enabled(void)
+{
+	return(debug_enabled || sipe_core_debug_log_active());
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,326 @@
+/**
+ * @file headless-dnsquery.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * All accounts of the process share one DNS cache. Accounts of the same
+ * domain usually ask the same questions at the same time, e.g. during
+ * startup, so concurrent queries for the same name are merged into one
+ * lookup and successful results are kept for DNS_CACHE_TTL seconds.
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+
+#include "headless-private.h"
+
+#define DNS_CACHE_TTL 300 /* seconds */
+
+struct dns_cache_entry {
+	gchar *key;
+	gchar *hostname; /* NULL while lookup is in progress */
+	guint port;
+	gint64 expires;  /* g_get_monotonic_time() */
+	GSList *waiting; /* sipe_dns_query */
+	GCancellable *cancel;
+};
+
+struct sipe_dns_query {
+	sipe_dns_resolved_cb  callback;
+	gpointer	      extradata;
+	guint                 port;
+	struct dns_cache_entry *entry; /* NULL if answered from cache */
+	gchar                *hostname;
+	guint                 idle;
+};
+
+static GHashTable *dns_cache = NULL;
+
+static void dns_cache_entry_free(gpointer data)
+{
+	struct dns_cache_entry *entry = data;
+	if (entry->cancel) {
+		g_cancellable_cancel(entry->cancel);
+		g_object_unref(entry->cancel);
+	}
+	g_slist_free_full(entry->waiting, g_free);
+	g_free(entry->hostname);
+	g_free(entry->key);
+	g_free(entry);
+}
+
+void sipe_headless_dns_shutdown(void)
+{
+	if (dns_cache) {
+		g_hash_table_destroy(dns_cache);
+		dns_cache = NULL;
+	}
+}
+
+/* returns entry with lookup in progress or valid result */
+static struct dns_cache_entry *dns_cache_lookup(const gchar *key,
+						gboolean *start)
+{
+	struct dns_cache_entry *entry;
+
+	if (!dns_cache)
+		dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+						  NULL, dns_cache_entry_free);
+
+	entry = g_hash_table_lookup(dns_cache, key);
+	if (entry &&
+	    entry->hostname &&
+	    (entry->expires <= g_get_monotonic_time())) {
+		g_hash_table_remove(dns_cache, key);
+		entry = NULL;
+	}
+
+	*start = !entry;
+	if (!entry) {
+		entry      = g_new0(struct dns_cache_entry, 1);
+		entry->key = g_strdup(key);
+		g_hash_table_insert(dns_cache, entry->key, entry);
+	}
+
+	return(entry);
+}
+
+static void dns_query_deliver(struct sipe_dns_query *query,
+			      const gchar *hostname,
+			      guint port)
+{
+	if (query->callback)
+		query->callback(query->extradata, hostname, port);
+	g_free(query->hostname);
+	g_free(query);
+}
+
+static gboolean dns_query_cached(gpointer data)
+{
+	struct sipe_dns_query *query = data;
+
+	query->idle = 0;
+	dns_query_deliver(query, query->hostname, query->port);
+	return(FALSE);
+}
+
+static struct sipe_dns_query *dns_query_new(struct dns_cache_entry *entry,
+					    guint port,
+					    sipe_dns_resolved_cb callback,
+					    gpointer data)
+{
+	struct sipe_dns_query *query = g_new0(struct sipe_dns_query, 1);
+
+	query->callback  = callback;
+	query->extradata = data;
+	query->port      = port;
+
+	if (entry->hostname) {
+		/* callback must not be called before we have returned */
+		SIPE_DEBUG_INFO("dns_query_new: %s answered from cache",
+				entry->key);
+		query->hostname = g_strdup(entry->hostname);
+		/* A queries return the port requested by the caller */
+		if (!port)
+			query->port = entry->port;
+		query->idle = g_idle_add(dns_query_cached, query);
+	} else {
+		query->entry   = entry;
+		entry->waiting = g_slist_append(entry->waiting, query);
+	}
+
+	return(query);
+}
+
+static void dns_lookup_completed(struct dns_cache_entry *entry,
+				 const gchar *hostname,
+				 guint port)
+{
+	GSList *waiting = entry->waiting;
+	GSList *tmp;
+
+	entry->waiting  = NULL;
+	g_object_unref(entry->cancel);
+	entry->cancel   = NULL;
+
+	/* query callbacks can start new queries with the same key */
+	if (hostname) {
+		entry->hostname = g_strdup(hostname);
+		entry->port     = port;
+		entry->expires  = g_get_monotonic_time() +
+			(gint64) DNS_CACHE_TTL * G_USEC_PER_SEC;
+	} else {
+		/* failures are not cached */
+		g_hash_table_remove(dns_cache, entry->key);
+	}
+
+	for (tmp = waiting; tmp; tmp = tmp->next) {
+		struct sipe_dns_query *query = tmp->data;
+		dns_query_deliver(query,
+				  hostname,
+				  (hostname && query->port) ? query->port : port);
+	}
+	g_slist_free(waiting);
+}
+
+static void dns_srv_response(GObject *resolver,
+			     GAsyncResult *result,
+			     gpointer data)
+{
+	GError *error  = NULL;
+	GList *targets = g_resolver_lookup_service_finish(G_RESOLVER(resolver),
+							  result,
+							  &error);
+	struct dns_cache_entry *entry = data;
+
+	if (targets) {
+		GSrvTarget *target = targets->data;
+		dns_lookup_completed(entry,
+				     g_srv_target_get_hostname(target),
+				     g_srv_target_get_port(target));
+		g_resolver_free_targets(targets);
+	} else {
+		SIPE_DEBUG_INFO("dns_srv_response: failed: %s",
+				error ? error->message : "UNKNOWN");
+		if (error)
+			g_error_free(error);
+		dns_lookup_completed(entry, NULL, 0);
+	}
+}
+
+struct sipe_dns_query *sipe_backend_dns_query_srv(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+						  const gchar *protocol,
+						  const gchar *transport,
+						  const gchar *domain,
+						  sipe_dns_resolved_cb callback,
+						  gpointer data)
+{
+	gchar *key = g_strdup_printf("SRV:_%s._%s.%s",
+				     protocol, transport, domain);
+	gboolean start;
+	struct dns_cache_entry *entry = dns_cache_lookup(key, &start);
+
+	g_free(key);
+
+	if (start) {
+		GResolver *resolver = g_resolver_get_default();
+
+		SIPE_DEBUG_INFO("sipe_backend_dns_query_srv: %s", entry->key);
+
+		entry->cancel = g_cancellable_new();
+		g_resolver_lookup_service_async(resolver,
+						protocol, transport, domain,
+						entry->cancel,
+						dns_srv_response,
+						entry);
+		g_object_unref(resolver);
+	}
+
+	return(dns_query_new(entry, 0, callback, data));
+}
+
+static void dns_a_response(GObject *resolver,
+			   GAsyncResult *result,
+			   gpointer data)
+{
+	GError *error    = NULL;
+	GList *addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(resolver),
+							    result,
+							    &error);
+	struct dns_cache_entry *entry = data;
+
+	if (addresses) {
+		GInetAddress *address  = addresses->data;
+		gchar        *ipstr    = g_inet_address_to_string(address);
+		dns_lookup_completed(entry, ipstr, 0);
+		g_free(ipstr);
+		g_resolver_free_addresses(addresses);
+	} else {
+		SIPE_DEBUG_INFO("dns_a_response: failed: %s",
+				error ? error->message : "UNKNOWN");
+		if (error)
+			g_error_free(error);
+		dns_lookup_completed(entry, NULL, 0);
+	}
+}
+
+struct sipe_dns_query *sipe_backend_dns_query_a(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+						const gchar *hostname,
+						guint port,
+						sipe_dns_resolved_cb callback,
+						gpointer data)
+{
+	gchar *key = g_strdup_printf("A:%s", hostname);
+	gboolean start;
+	struct dns_cache_entry *entry = dns_cache_lookup(key, &start);
+
+	g_free(key);
+
+	if (start) {
+		GResolver *resolver = g_resolver_get_default();
+
+		SIPE_DEBUG_INFO("sipe_backend_dns_query_a: %s", hostname);
+
+		entry->cancel = g_cancellable_new();
+		g_resolver_lookup_by_name_async(resolver,
+						hostname,
+						entry->cancel,
+						dns_a_response,
+						entry);
+		g_object_unref(resolver);
+	}
+
+	return(dns_query_new(entry, port, callback, data));
+}
+
+void sipe_backend_dns_query_cancel(struct sipe_dns_query *query)
+{
+	struct dns_cache_entry *entry = query->entry;
+	GSList *tmp;
+
+	if (!entry) {
+		/* answered from cache, but not delivered yet */
+		g_source_remove(query->idle);
+		g_free(query->hostname);
+		g_free(query);
+		return;
+	}
+
+	/* callback is invalid now, do no longer call! */
+	query->callback = NULL;
+
+	/* other queries still waiting for this lookup? */
+	for (tmp = entry->waiting; tmp; tmp = tmp->next)
+		if (((struct sipe_dns_query *) tmp->data)->callback)
+			return;
+	g_cancellable_cancel(entry->cancel);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,698 @@
+/**
+ * @file headless-loadtest.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * Please use "make loadtest" to build & run it!
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Login load test
+ *
+ *    $ sipe-loadtest [--debug] [--contacts N]
+ *
+ * Runs one account of the headless backend against a scripted OCS 2007
+ * server inside the same process. The socket transport is replaced by an
+ * in-memory transport, i.e. the real core code for SIP input, roaming
+ * contacts and presence processing is exercised without any network:
+ *
+ *   - REGISTER is accepted with the first request
+ *   - the contact list subscription returns N contacts in 32 groups
+ *   - batched presence subscriptions are answered with rlmi NOTIFYs
+ *   - all other SIP requests are accepted, HTTP requests are rejected
+ *
+ * Login is complete when the client has acknowledged the presence
+ * NOTIFYs for all contacts. The results are printed as one line:
+ *
+ *   contacts=N register=<s> roster=<s> presence=<s> cpu=<s> rss=<KB>
+ *
+ * Peak RSS is a process-wide value, so use one process per roster size.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipmsg.h"
+
+#include "headless-private.h"
+
+#define LOADTEST_DOMAIN        "load.test"
+#define LOADTEST_TAG           "loadtest"
+#define LOADTEST_BOUNDARY      "loadtest-boundary"
+#define LOADTEST_GROUPS        32
+#define LOADTEST_NOTIFY_BATCH 100   /* resources per presence NOTIFY */
+#define LOADTEST_READ_CHUNK   16384 /* simulated size of a network read */
+#define LOADTEST_TIMEOUT      600   /* seconds */
+
+static gboolean debug  = FALSE;
+static gint contacts   = 1000;
+
+static const GOptionEntry options[] = {
+	{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug,
+	  "Enable SIPE debug output", NULL },
+	{ "contacts", 'c', 0, G_OPTION_ARG_INT, &contacts,
+	  "Number of contacts on the roster (default: 1000)", "N" },
+	{ NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static struct {
+	GMainLoop *loop;
+	struct sipe_backend_private *private;
+	gint64 start;      /* g_get_monotonic_time() */
+	gint64 registered;
+	gint64 roster;
+	gint64 presence;
+	guint resources;   /* presence resources subscribed by the client */
+	guint notify_sent;
+	guint notify_acked;
+	gboolean failed;
+} loadtest;
+
+struct sipe_transport_headless {
+	/* public part shared with core */
+	struct sipe_transport_connection public;
+
+	/* headless private part */
+	transport_connected_cb *connected;
+	transport_input_cb *input;
+	transport_error_cb *error;
+	struct sipe_backend_private *private;
+	GByteArray *to_server;
+	GByteArray *to_client;
+	gsize to_client_offset;
+	guint connect_idle;
+	guint server_idle;
+	guint client_idle;
+	guint cseq;        /* server side NOTIFY sequence */
+	gboolean is_disconnected;
+};
+
+#define HEADLESS_TRANSPORT ((struct sipe_transport_headless *) conn)
+#define SIPE_TRANSPORT_CONNECTION ((struct sipe_transport_connection *) transport)
+
+static gdouble loadtest_seconds(gint64 timestamp)
+{
+	return(timestamp ?
+	       (gdouble) (timestamp - loadtest.start) / G_USEC_PER_SEC :
+	       -1.0);
+}
+
+static void loadtest_check_completed(void)
+{
+	struct sipe_backend_private *headless_private = loadtest.private;
+
+	if (!loadtest.roster &&
+	    headless_private->buddies &&
+	    (g_hash_table_size(headless_private->buddies) >= (guint) contacts))
+		loadtest.roster = g_get_monotonic_time();
+
+	if (loadtest.roster &&
+	    !loadtest.presence &&
+	    (loadtest.resources >= (guint) contacts) &&
+	    (loadtest.notify_acked == loadtest.notify_sent)) {
+		loadtest.presence = g_get_monotonic_time();
+		g_main_loop_quit(loadtest.loop);
+	}
+}
+
+/*
+ * Client side: data written by the server is delivered in chunks
+ */
+static gboolean client_input(gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+	struct sipe_transport_connection *conn = SIPE_TRANSPORT_CONNECTION;
+	gsize available = transport->to_client->len - transport->to_client_offset;
+	gsize readlen   = sipe_core_transport_buffer_reserve(conn);
+	gboolean more;
+
+	if (readlen == 0) {
+		transport->client_idle = 0;
+		transport->error(conn, "message exceeds maximum buffer size");
+		return(FALSE);
+	}
+
+	readlen = MIN(MIN(readlen, available), LOADTEST_READ_CHUNK);
+	memcpy(conn->buffer + conn->buffer_used,
+	       transport->to_client->data + transport->to_client_offset,
+	       readlen);
+	conn->buffer_used               += readlen;
+	conn->buffer[conn->buffer_used]  = '\0';
+	transport->to_client_offset     += readlen;
+
+	more = transport->to_client_offset < transport->to_client->len;
+	if (!more) {
+		g_byte_array_set_size(transport->to_client, 0);
+		transport->to_client_offset = 0;
+		transport->client_idle      = 0;
+	}
+
+	/* a disconnected transport is freed from an idle callback */
+	transport->input(conn);
+
+	loadtest_check_completed();
+	return(more);
+}
+
+static void server_write(struct sipe_transport_headless *transport,
+			 const gchar *data,
+			 gsize length)
+{
+	g_byte_array_append(transport->to_client,
+			    (const guint8 *) data,
+			    length);
+	if (!transport->client_idle)
+		transport->client_idle = g_idle_add(client_input, transport);
+}
+
+/*
+ * Server side
+ */
+static void server_response(struct sipe_transport_headless *transport,
+			    struct sipmsg *msg,
+			    const gchar *extra,
+			    const gchar *body)
+{
+	const gchar *to = sipmsg_find_header(msg, "To");
+	gsize length    = body ? strlen(body) : 0;
+	gchar *response = g_strdup_printf("SIP/2.0 200 OK\r\n"
+					  "Via: %s\r\n"
+					  "From: %s\r\n"
+					  "To: %s%s\r\n"
+					  "Call-ID: %s\r\n"
+					  "CSeq: %s\r\n"
+					  "%s"
+					  "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+					  "\r\n",
+					  sipmsg_find_header(msg, "Via"),
+					  sipmsg_find_header(msg, "From"),
+					  to,
+					  strstr(to, "tag=") ? "" : ";tag=" LOADTEST_TAG,
+					  sipmsg_find_header(msg, "Call-ID"),
+					  sipmsg_find_header(msg, "CSeq"),
+					  extra ? extra : "",
+					  length);
+	server_write(transport, response, strlen(response));
+	if (body)
+		server_write(transport, body, length);
+	g_free(response);
+}
+
+static void server_register(struct sipe_transport_headless *transport,
+			    struct sipmsg *msg)
+{
+	gchar *extra = g_strdup_printf("Contact: %s;expires=900\r\n"
+				       "Expires: 900\r\n"
+				       "Allow-Events: vnd-microsoft-roaming-contacts,vnd-microsoft-roaming-self,presence\r\n"
+				       "Supported: msrtc-event-categories\r\n"
+				       "Supported: adhoclist\r\n"
+				       "Server: RTC/3.5\r\n",
+				       sipmsg_find_header(msg, "Contact"));
+
+	server_response(transport, msg, extra, NULL);
+	g_free(extra);
+
+	if (!loadtest.registered)
+		loadtest.registered = g_get_monotonic_time();
+}
+
+static void server_roaming_contacts(struct sipe_transport_headless *transport,
+				    struct sipmsg *msg)
+{
+	GString *body = g_string_sized_new(100 * contacts);
+	guint i;
+
+	g_string_append(body,
+			"<contactList deltaNum=\"1\" xmlns=\"http://schemas.microsoft.com/2006/09/sip/contactlist\">");
+	for (i = 1; i <= LOADTEST_GROUPS; i++)
+		g_string_append_printf(body,
+				       "<group id=\"%u\" name=\"%s%u\" externalURI=\"\"/>",
+				       i, (i == 1) ? "~" : "Group ", i);
+	for (i = 0; i < (guint) contacts; i++)
+		g_string_append_printf(body,
+				       "<contact uri=\"user%u@" LOADTEST_DOMAIN "\" name=\"User %u\" groups=\"%u \" subscribed=\"true\" externalURI=\"\"/>",
+				       i, i, (i % LOADTEST_GROUPS) + 1);
+	g_string_append(body, "</contactList>");
+
+	server_response(transport, msg,
+			"Event: vnd-microsoft-roaming-contacts\r\n"
+			"Expires: 3600\r\n"
+			"ms-piggyback-cseq: 1\r\n"
+			"Content-Type: application/vnd-microsoft-roaming-contacts+xml\r\n",
+			body->str);
+	g_string_free(body, TRUE);
+}
+
+static void server_presence_notify(struct sipe_transport_headless *transport,
+				   struct sipmsg *msg,
+				   GSList *resources)
+{
+	const gchar *to = sipmsg_find_header(msg, "To");
+	GString *body   = g_string_new(NULL);
+	GSList *entry;
+	gchar *request;
+
+	g_string_append(body,
+			"--" LOADTEST_BOUNDARY "\r\n"
+			"Content-Type: application/rlmi+xml\r\n"
+			"\r\n"
+			"<list xmlns=\"urn:ietf:params:xml:ns:rlmi\" uri=\"sip:loadtest@" LOADTEST_DOMAIN "\" version=\"1\" fullState=\"false\">");
+	for (entry = resources; entry; entry = entry->next)
+		g_string_append_printf(body,
+				       "<resource uri=\"%s\"><instance id=\"1\" state=\"active\" cid=\"%s\"/></resource>",
+				       (gchar *) entry->data,
+				       (gchar *) entry->data);
+	g_string_append(body, "</list>\r\n");
+
+	for (entry = resources; entry; entry = entry->next)
+		g_string_append_printf(body,
+				       "--" LOADTEST_BOUNDARY "\r\n"
+				       "Content-Type: application/msrtc-event-categories+xml\r\n"
+				       "\r\n"
+				       "<categories xmlns=\"http://schemas.microsoft.com/2006/09/sip/categories\" uri=\"%s\">"
+				       "<category name=\"state\" instance=\"1\" publishTime=\"2015-01-01T00:00:00Z\" container=\"2\" version=\"1\" expireType=\"static\">"
+				       "<state xmlns=\"http://schemas.microsoft.com/2006/09/sip/state\" manual=\"false\"><availability>3500</availability></state>"
+				       "</category>"
+				       "<category name=\"note\" instance=\"0\" publishTime=\"2015-01-01T00:00:00Z\" container=\"2\" version=\"1\" expireType=\"static\">"
+				       "<note xmlns=\"http://schemas.microsoft.com/2006/09/sip/note\"><body type=\"personal\" uri=\"\">Load test</body></note>"
+				       "</category>"
+				       "</categories>\r\n",
+				       (gchar *) entry->data);
+	g_string_append(body, "--" LOADTEST_BOUNDARY "--\r\n");
+
+	/* NOTIFY in the dialog created by the SUBSCRIBE */
+	transport->cseq++;
+	request = g_strdup_printf("NOTIFY sip:loadtest@" LOADTEST_DOMAIN " SIP/2.0\r\n"
+				  "Via: SIP/2.0/TLS 127.0.0.1:5061;branch=z9hG4bK" LOADTEST_TAG "%u\r\n"
+				  "From: %s%s\r\n"
+				  "To: %s\r\n"
+				  "Call-ID: %s\r\n"
+				  "CSeq: %u NOTIFY\r\n"
+				  "Event: presence\r\n"
+				  "subscription-state: active;expires=3600\r\n"
+				  "Content-Type: multipart/related; type=\"application/rlmi+xml\"; boundary=" LOADTEST_BOUNDARY "\r\n"
+				  "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+				  "\r\n",
+				  transport->cseq,
+				  to,
+				  strstr(to, "tag=") ? "" : ";tag=" LOADTEST_TAG,
+				  sipmsg_find_header(msg, "From"),
+				  sipmsg_find_header(msg, "Call-ID"),
+				  transport->cseq,
+				  body->len);
+	server_write(transport, request, strlen(request));
+	server_write(transport, body->str, body->len);
+	g_free(request);
+	g_string_free(body, TRUE);
+
+	loadtest.notify_sent++;
+}
+
+static void server_presence(struct sipe_transport_headless *transport,
+			    struct sipmsg *msg)
+{
+	const gchar *cursor = msg->body;
+	GSList *resources   = NULL;
+	guint count         = 0;
+
+	server_response(transport, msg,
+			"Event: presence\r\n"
+			"Expires: 3600\r\n",
+			NULL);
+
+	while (cursor && (cursor = strstr(cursor, "<resource uri=\"")) != NULL) {
+		const gchar *end;
+
+		cursor += 15;
+		end = strchr(cursor, '"');
+		if (!end)
+			break;
+
+		resources = g_slist_prepend(resources,
+					    g_strndup(cursor, end - cursor));
+		cursor = end;
+		loadtest.resources++;
+
+		if (++count == LOADTEST_NOTIFY_BATCH) {
+			resources = g_slist_reverse(resources);
+			server_presence_notify(transport, msg, resources);
+			g_slist_free_full(resources, g_free);
+			resources = NULL;
+			count     = 0;
+		}
+	}
+
+	if (resources) {
+		resources = g_slist_reverse(resources);
+		server_presence_notify(transport, msg, resources);
+		g_slist_free_full(resources, g_free);
+	}
+}
+
+static void server_request(struct sipe_transport_headless *transport,
+			   struct sipmsg *msg)
+{
+	const gchar *method = msg->method;
+
+	if (msg->response) {
+		/* client acknowledges our NOTIFY */
+		const gchar *cseq = sipmsg_find_header(msg, "CSeq");
+		if (cseq && strstr(cseq, "NOTIFY"))
+			loadtest.notify_acked++;
+
+	} else if (sipe_strequal(method, "REGISTER")) {
+		server_register(transport, msg);
+
+	} else if (sipe_strequal(method, "SUBSCRIBE")) {
+		const gchar *event = sipmsg_find_header(msg, "Event");
+
+		if (event &&
+		    !g_ascii_strcasecmp(event, "vnd-microsoft-roaming-contacts")) {
+			server_roaming_contacts(transport, msg);
+		} else if (event &&
+			   !g_ascii_strcasecmp(event, "presence") &&
+			   msg->body &&
+			   strstr(msg->body, "<resource ")) {
+			server_presence(transport, msg);
+		} else {
+			gchar *extra = g_strdup_printf("Event: %s\r\n"
+						       "Expires: 3600\r\n",
+						       event ? event : "");
+			server_response(transport, msg, extra, NULL);
+			g_free(extra);
+		}
+
+	} else if (!sipe_strequal(method, "ACK")) {
+		/* SERVICE, OPTIONS, BYE, ... */
+		server_response(transport, msg, NULL, NULL);
+	}
+}
+
+static gboolean server_input(gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+	GByteArray *input = transport->to_server;
+	gsize offset      = 0;
+
+	transport->server_idle = 0;
+
+	while (offset < input->len) {
+		gchar *start = (gchar *) input->data + offset;
+		gchar *end   = g_strstr_len(start, input->len - offset, "\r\n\r\n");
+		struct sipmsg *msg;
+		gsize header;
+
+		if (!end)
+			break;
+		header = end - start + 2;
+
+		/* no HTTP services: fail these requests immediately */
+		if (g_str_has_prefix(start, "GET ") ||
+		    g_str_has_prefix(start, "POST ")) {
+			static const gchar response[] =
+				"HTTP/1.1 503 Service Unavailable\r\n"
+				"Content-Length: 0\r\n"
+				"\r\n";
+			msg = sipmsg_parse_header_len(start, header);
+			if (msg && (msg->bodylen >= 0) &&
+			    (header + 2 + msg->bodylen <= input->len - offset)) {
+				offset += header + 2 + msg->bodylen;
+				server_write(transport, response, sizeof(response) - 1);
+				sipmsg_free(msg);
+				continue;
+			}
+			sipmsg_free(msg);
+			break;
+		}
+
+		msg = sipmsg_parse_header_len(start, header);
+		if (!msg) {
+			SIPE_DEBUG_ERROR_NOFORMAT("server_input: corrupted message from client");
+			loadtest.failed = TRUE;
+			g_main_loop_quit(loadtest.loop);
+			return(FALSE);
+		}
+		if (header + 2 + msg->bodylen > input->len - offset) {
+			sipmsg_free(msg);
+			break;
+		}
+
+		msg->body = g_strndup(start + header + 2, msg->bodylen);
+		offset += header + 2 + msg->bodylen;
+		server_request(transport, msg);
+		sipmsg_free(msg);
+	}
+
+	g_byte_array_remove_range(input, 0, offset);
+	loadtest_check_completed();
+
+	return(FALSE);
+}
+
+/*
+ * In-memory transport
+ */
+static gboolean transport_connected(gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+
+	transport->connect_idle = 0;
+
+	/* the first connection is always to the server */
+	if (transport->private->transport == NULL)
+		transport->private->transport = transport;
+
+	transport->connected(SIPE_TRANSPORT_CONNECTION);
+
+	return(FALSE);
+}
+
+struct sipe_transport_connection *sipe_backend_transport_connect(struct sipe_core_public *sipe_public,
+								 const sipe_connect_setup *setup)
+{
+	struct sipe_transport_headless *transport = g_new0(struct sipe_transport_headless, 1);
+
+	SIPE_DEBUG_INFO("sipe_backend_transport_connect: %s:%u",
+			setup->server_name, setup->server_port);
+
+	transport->public.type        = setup->type;
+	transport->public.user_data   = setup->user_data;
+	transport->public.client_port = 50000;
+	transport->connected          = setup->connected;
+	transport->input              = setup->input;
+	transport->error              = setup->error;
+	transport->private            = sipe_public->backend_private;
+	transport->to_server          = g_byte_array_new();
+	transport->to_client          = g_byte_array_new();
+	transport->connect_idle       = g_idle_add(transport_connected, transport);
+
+	return(SIPE_TRANSPORT_CONNECTION);
+}
+
+static gboolean free_transport(gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+
+	g_byte_array_free(transport->to_server, TRUE);
+	g_byte_array_free(transport->to_client, TRUE);
+	g_free(transport->public.buffer);
+	g_free(transport);
+
+	return(FALSE);
+}
+
+void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_headless *transport = HEADLESS_TRANSPORT;
+
+	if (!transport || transport->is_disconnected)
+		return;
+
+	SIPE_DEBUG_INFO("sipe_backend_transport_disconnect: %p", transport);
+
+	transport->is_disconnected = TRUE;
+	if (transport->private->transport == transport)
+		transport->private->transport = NULL;
+
+	if (transport->connect_idle)
+		g_source_remove(transport->connect_idle);
+	if (transport->server_idle)
+		g_source_remove(transport->server_idle);
+	if (transport->client_idle)
+		g_source_remove(transport->client_idle);
+	transport->connect_idle = 0;
+	transport->server_idle  = 0;
+	transport->client_idle  = 0;
+
+	/* we might have been called from client_input() */
+	g_idle_add(free_transport, transport);
+}
+
+void sipe_backend_transport_message(struct sipe_transport_connection *conn,
+				    const gchar *buffer)
+{
+	struct sipe_transport_segment segment;
+
+	segment.data   = buffer;
+	segment.length = strlen(buffer);
+	sipe_backend_transport_message_iov(conn, &segment, 1);
+}
+
+void sipe_backend_transport_message_iov(struct sipe_transport_connection *conn,
+					const struct sipe_transport_segment *segments,
+					guint count)
+{
+	struct sipe_transport_headless *transport = HEADLESS_TRANSPORT;
+	guint i;
+
+	if (transport->is_disconnected)
+		return;
+
+	for (i = 0; i < count; i++)
+		g_byte_array_append(transport->to_server,
+				    (const guint8 *) segments[i].data,
+				    segments[i].length);
+
+	if (!transport->server_idle)
+		transport->server_idle = g_idle_add(server_input, transport);
+}
+
+void sipe_backend_transport_flush(SIPE_UNUSED_PARAMETER struct sipe_transport_connection *conn)
+{
+	/* N/A: everything has been delivered already */
+}
+
+gsize sipe_backend_transport_pending(SIPE_UNUSED_PARAMETER struct sipe_transport_connection *conn)
+{
+	/* N/A: server reads everything in the next idle callback */
+	return(0);
+}
+
+const gchar *sipe_backend_network_ip_address(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public)
+{
+	return("127.0.0.1");
+}
+
+gchar *sipe_backend_version(void)
+{
+	return(g_strdup_printf("Loadtest/%s", PACKAGE_VERSION));
+}
+
+/*
+ * Runner
+ */
+static gboolean loadtest_timeout(SIPE_UNUSED_PARAMETER gpointer data)
+{
+	g_printerr("login didn't complete in %d seconds\n", LOADTEST_TIMEOUT);
+	loadtest.failed = TRUE;
+	g_main_loop_quit(loadtest.loop);
+	return(FALSE);
+}
+
+static gdouble timeval_seconds(const struct timeval *tv)
+{
+	return((gdouble) tv->tv_sec + (gdouble) tv->tv_usec / 1000000);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context = g_option_context_new(NULL);
+	GError *error           = NULL;
+	GKeyFile *config;
+	struct headless_account *account;
+	struct rusage usage;
+
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error) ||
+	    (contacts <= 0)) {
+		g_printerr("%s\n", error ? error->message : "invalid number of contacts");
+		if (error)
+			g_error_free(error);
+		g_option_context_free(context);
+		return(1);
+	}
+	g_option_context_free(context);
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+	g_type_init();
+#endif
+	sipe_headless_debug_init(debug);
+	sipe_core_init(LOCALEDIR);
+
+	config = g_key_file_new();
+	g_key_file_set_string(config, "loadtest", "signin-name",    "loadtest@" LOADTEST_DOMAIN);
+	g_key_file_set_string(config, "loadtest", "password",       "loadtest");
+	g_key_file_set_string(config, "loadtest", "server",         "sip." LOADTEST_DOMAIN);
+	g_key_file_set_string(config, "loadtest", "port",           "5061");
+	g_key_file_set_string(config, "loadtest", "transport",      "tls");
+	g_key_file_set_string(config, "loadtest", "authentication", "ntlm");
+	account = sipe_headless_account_new(config, "loadtest");
+	g_key_file_free(config);
+	if (!account) {
+		sipe_core_destroy();
+		return(1);
+	}
+
+	loadtest.loop  = g_main_loop_new(NULL, FALSE);
+	loadtest.start = g_get_monotonic_time();
+	g_timeout_add_seconds(LOADTEST_TIMEOUT, loadtest_timeout, NULL);
+
+	sipe_headless_account_connect(account);
+	loadtest.private = sipe_headless_account_private(account);
+	if (loadtest.private->public)
+		g_main_loop_run(loadtest.loop);
+	else
+		loadtest.failed = TRUE;
+
+	getrusage(RUSAGE_SELF, &usage);
+	printf("contacts=%d register=%.3f roster=%.3f presence=%.3f cpu=%.3f rss=%ld\n",
+	       contacts,
+	       loadtest_seconds(loadtest.registered),
+	       loadtest_seconds(loadtest.roster),
+	       loadtest_seconds(loadtest.presence),
+	       timeval_seconds(&usage.ru_utime) + timeval_seconds(&usage.ru_stime),
+	       usage.ru_maxrss);
+
+	sipe_headless_account_free(account);
+	g_main_loop_unref(loadtest.loop);
+	sipe_headless_dns_shutdown();
+	sipe_core_destroy();
+
+	return(loadtest.failed ? 1 : 0);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
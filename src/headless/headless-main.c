@@ -0,0 +1,154 @@
+/**
+ * @file headless-main.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Runs many accounts in one process without any user interface:
+ *
+ *    $ sipe-headless [--debug] accounts.conf
+ *
+ * See headless-connection.c for the format of the accounts file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <glib-unix.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+
+#include "headless-private.h"
+
+static gboolean debug = FALSE;
+
+static const GOptionEntry options[] = {
+	{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug,
+	  "Enable SIPE debug output", NULL },
+	{ NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static gboolean quit_signal(gpointer data)
+{
+	g_message("terminating");
+	g_main_loop_quit(data);
+	return(TRUE);
+}
+
+static GSList *accounts_load(const gchar *file)
+{
+	GKeyFile *config = g_key_file_new();
+	GError *error    = NULL;
+	GSList *accounts = NULL;
+
+	if (g_key_file_load_from_file(config, file, G_KEY_FILE_NONE, &error)) {
+		gchar **names = g_key_file_get_groups(config, NULL);
+		gchar **name;
+
+		for (name = names; *name; name++) {
+			struct headless_account *account = sipe_headless_account_new(config,
+										     *name);
+			if (account)
+				accounts = g_slist_prepend(accounts, account);
+		}
+		g_strfreev(names);
+
+	} else {
+		g_warning("can't load '%s': %s", file, error->message);
+		g_error_free(error);
+	}
+
+	g_key_file_free(config);
+	return(g_slist_reverse(accounts));
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context = g_option_context_new("ACCOUNTS-FILE");
+	GError *error           = NULL;
+	GSList *accounts;
+	GSList *entry;
+	GMainLoop *loop;
+
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error) ||
+	    (argc != 2)) {
+		g_printerr("%s\n", error ? error->message : "accounts file missing");
+		if (error)
+			g_error_free(error);
+		g_option_context_free(context);
+		return(1);
+	}
+	g_option_context_free(context);
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+	g_type_init();
+#endif
+	sipe_headless_debug_init(debug);
+	sipe_core_init(LOCALEDIR);
+
+	SIPE_DEBUG_INFO("main: initializing - version %s", PACKAGE_VERSION);
+
+	accounts = accounts_load(argv[1]);
+	if (!accounts) {
+		sipe_core_destroy();
+		g_printerr("no valid accounts in '%s'\n", argv[1]);
+		return(1);
+	}
+
+	loop = g_main_loop_new(NULL, FALSE);
+	g_unix_signal_add(SIGINT,  quit_signal, loop);
+	g_unix_signal_add(SIGTERM, quit_signal, loop);
+
+	for (entry = accounts; entry; entry = entry->next)
+		sipe_headless_account_connect(entry->data);
+
+	g_main_loop_run(loop);
+
+	g_slist_free_full(accounts,
+			  (GDestroyNotify) sipe_headless_account_free);
+	g_main_loop_unref(loop);
+
+	sipe_headless_dns_shutdown();
+	sipe_headless_transport_shutdown();
+	sipe_core_destroy();
+
+	return(0);
+}
+
+gchar *sipe_backend_version(void)
+{
+	return(g_strdup_printf("Headless/%s", PACKAGE_VERSION));
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
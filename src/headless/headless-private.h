@@ -0,0 +1,77 @@
+/**
+ * @file headless-private.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Forward declarations */
+struct _GKeyFile;
+struct headless_account;
+struct sipe_transport_headless;
+
+/* constants */
+#define SIPE_HEADLESS_DOMAIN "sipe"
+
+struct sipe_backend_private {
+	struct sipe_core_public *public;
+	struct headless_account *account;
+
+	/* buddies */
+	GHashTable *buddies; /* key: SIP URI,    value: headless_buddy */
+	GHashTable *groups;  /* key: group name, value: group name */
+
+	/* status */
+	guint activity;
+	gchar *message;
+
+	/* transport */
+	struct sipe_transport_headless *transport;
+	gchar *ipaddress;
+	gboolean is_disconnecting;
+};
+
+/* account */
+struct headless_account *sipe_headless_account_new(struct _GKeyFile *config,
+						   const gchar *name);
+void sipe_headless_account_free(struct headless_account *account);
+void sipe_headless_account_connect(struct headless_account *account);
+void sipe_headless_account_disconnect(struct headless_account *account);
+struct sipe_backend_private *sipe_headless_account_private(struct headless_account *account);
+
+/* buddy */
+void sipe_headless_buddy_init(struct sipe_backend_private *headless_private);
+void sipe_headless_buddy_free(struct sipe_backend_private *headless_private);
+
+/* debugging */
+void sipe_headless_debug_init(gboolean enabled);
+
+/* DNS query */
+void sipe_headless_dns_shutdown(void);
+
+/* transport */
+void sipe_headless_transport_shutdown(void);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,81 @@
+/**
+ * @file headless-schedule.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <glib.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+
+static gboolean timeout_execute(gpointer data)
+{
+	sipe_core_schedule_execute(data);
+	return(FALSE);
+}
+
+static gpointer timeout_attach(struct sipe_core_public *sipe_public,
+			       GSource *source,
+			       gpointer data)
+{
+	guint id;
+
+	g_source_set_callback(source, timeout_execute, data, NULL);
+	id = g_source_attach(source, sipe_public->context);
+	g_source_unref(source);
+
+	return(GUINT_TO_POINTER(id));
+}
+
+gpointer sipe_backend_schedule_seconds(struct sipe_core_public *sipe_public,
+				       guint timeout,
+				       gpointer data)
+{
+	return(timeout_attach(sipe_public,
+			      g_timeout_source_new_seconds(timeout),
+			      data));
+}
+
+gpointer sipe_backend_schedule_mseconds(struct sipe_core_public *sipe_public,
+					guint timeout,
+					gpointer data)
+{
+	return(timeout_attach(sipe_public,
+			      g_timeout_source_new(timeout),
+			      data));
+}
+
+void sipe_backend_schedule_cancel(struct sipe_core_public *sipe_public,
+				  gpointer data)
+{
+	GSource *source = g_main_context_find_source_by_id(sipe_public->context,
+							   GPOINTER_TO_UINT(data));
+	if (source)
+		g_source_destroy(source);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
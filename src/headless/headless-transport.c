@@ -0,0 +1,510 @@
+/**
+ * @file headless-transport.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2012-2013 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "sipe-backend.h"
+#include "sipe-common.h"
+#include "sipe-core.h"
+#include "sipe-nls.h"
+
+#include "headless-private.h"
+
+struct sipe_transport_headless {
+	/* public part shared with core */
+	struct sipe_transport_connection public;
+
+	/* headless private part */
+	transport_connected_cb *connected;
+	transport_input_cb *input;
+	transport_error_cb *error;
+	gchar *hostname;
+	struct sipe_backend_private *private;
+	GCancellable *cancel;
+	GSocketConnection *socket;
+	GInputStream *istream;
+	GOutputStream *ostream;
+	GByteArray *queued;  /* collects messages while a write is in flight */
+	GByteArray *writing; /* data of the write in flight */
+	gsize write_offset;
+	guint port;
+	gboolean is_writing;
+	gboolean do_flush;
+};
+
+#define HEADLESS_TRANSPORT ((struct sipe_transport_headless *) conn)
+#define SIPE_TRANSPORT_CONNECTION ((struct sipe_transport_connection *) transport)
+
+static void read_completed(GObject *stream,
+			   GAsyncResult *result,
+			   gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+	struct sipe_transport_connection *conn = SIPE_TRANSPORT_CONNECTION;
+	gsize readlen;
+
+	/* callback result is valid */
+	if (result) {
+		GError *error = NULL;
+		gssize len    = g_input_stream_read_finish(G_INPUT_STREAM(stream),
+							   result,
+							   &error);
+
+		if (len < 0) {
+			const gchar *msg = error ? error->message : "UNKNOWN";
+			SIPE_DEBUG_ERROR("read_completed: error: %s", msg);
+			if (transport->error)
+				transport->error(conn, msg);
+			g_error_free(error);
+			return;
+		} else if (len == 0) {
+			SIPE_DEBUG_ERROR_NOFORMAT("read_completed: server has disconnected");
+			transport->error(conn, _("Server has disconnected"));
+			return;
+		} else if (transport->do_flush) {
+			/* read completed while disconnected transport is flushing */
+			SIPE_DEBUG_INFO_NOFORMAT("read_completed: ignored during flushing");
+			return;
+		} else if (g_cancellable_is_cancelled(transport->cancel)) {
+			/* read completed when transport was disconnected */
+			SIPE_DEBUG_INFO_NOFORMAT("read_completed: cancelled");
+			return;
+		}
+
+		/* Forward data to core */
+		conn->buffer_used               += len;
+		conn->buffer[conn->buffer_used]  = '\0';
+		transport->input(conn);
+	}
+
+	/* Increase input buffer size as needed */
+	readlen = sipe_core_transport_buffer_reserve(conn);
+	if (readlen == 0) {
+		SIPE_DEBUG_ERROR_NOFORMAT("read_completed: message exceeds maximum buffer size");
+		if (transport->error)
+			transport->error(conn, _("Read error"));
+		return;
+	}
+
+	/* setup next read */
+	g_input_stream_read_async(G_INPUT_STREAM(stream),
+				  conn->buffer + conn->buffer_used,
+				  readlen,
+				  G_PRIORITY_DEFAULT,
+				  transport->cancel,
+				  read_completed,
+				  transport);
+}
+
+static void socket_connected(GObject *client,
+			     GAsyncResult *result,
+			     gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+	GError *error = NULL;
+
+	transport->socket = g_socket_client_connect_finish(G_SOCKET_CLIENT(client),
+							   result,
+							   &error);
+
+	if (transport->socket == NULL) {
+		/* there is no user to ask: invalid certificates are fatal */
+		const gchar *msg = error ? error->message : "UNKNOWN";
+		SIPE_DEBUG_ERROR("socket_connected: failed: %s", msg);
+		if (transport->error)
+			transport->error(SIPE_TRANSPORT_CONNECTION, msg);
+		if (error)
+			g_error_free(error);
+	} else if (g_cancellable_is_cancelled(transport->cancel)) {
+		/* connect already succeeded when transport was disconnected */
+		g_object_unref(transport->socket);
+		transport->socket = NULL;
+		SIPE_DEBUG_INFO_NOFORMAT("socket_connected: succeeded, but cancelled");
+	} else {
+		GSocketAddress *saddr = g_socket_connection_get_local_address(transport->socket,
+									      &error);
+
+		if (saddr) {
+			SIPE_DEBUG_INFO_NOFORMAT("socket_connected: success");
+
+			transport->public.client_port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(saddr));
+			g_object_unref(saddr);
+
+			transport->istream = g_io_stream_get_input_stream(G_IO_STREAM(transport->socket));
+			transport->ostream = g_io_stream_get_output_stream(G_IO_STREAM(transport->socket));
+
+			/* the first connection is always to the server */
+			if (transport->private->transport == NULL)
+				transport->private->transport = transport;
+
+			/* this sets up the async read handler */
+			read_completed(G_OBJECT(transport->istream), NULL, transport);
+			transport->connected(SIPE_TRANSPORT_CONNECTION);
+
+		} else {
+			g_object_unref(transport->socket);
+			transport->socket = NULL;
+			SIPE_DEBUG_ERROR("socket_connected: failed: %s", error->message);
+			transport->error(SIPE_TRANSPORT_CONNECTION, error->message);
+			g_error_free(error);
+		}
+	}
+}
+
+/*
+ * All accounts share one socket client per transport type. A client has no
+ * per-connection state, i.e. it can run any number of connects in parallel.
+ */
+static GSocketClient *socket_client_tcp = NULL;
+static GSocketClient *socket_client_tls = NULL;
+
+void sipe_headless_transport_shutdown(void)
+{
+	if (socket_client_tcp)
+		g_object_unref(socket_client_tcp);
+	if (socket_client_tls)
+		g_object_unref(socket_client_tls);
+	socket_client_tcp = NULL;
+	socket_client_tls = NULL;
+}
+
+static GSocketClient *socket_client(guint type)
+{
+	GSocketClient **client = (type == SIPE_TRANSPORT_TLS) ?
+		&socket_client_tls : &socket_client_tcp;
+
+	if (!*client) {
+		*client = g_socket_client_new();
+		/* request TLS connection */
+		if (type == SIPE_TRANSPORT_TLS)
+			g_socket_client_set_tls(*client, TRUE);
+	}
+
+	return(*client);
+}
+
+static void internal_connect(struct sipe_transport_headless *transport)
+{
+	GSocketConnectable *address = g_network_address_new(transport->hostname,
+							     transport->port);
+
+	SIPE_DEBUG_INFO("internal_connect - hostname: %s port: %d (%s)",
+			transport->hostname, transport->port,
+			(transport->public.type == SIPE_TRANSPORT_TLS) ? "TLS" : "TCP");
+
+	g_socket_client_connect_async(socket_client(transport->public.type),
+				      address,
+				      transport->cancel,
+				      socket_connected,
+				      transport);
+	g_object_unref(address);
+}
+
+struct sipe_transport_connection *sipe_backend_transport_connect(struct sipe_core_public *sipe_public,
+								 const sipe_connect_setup *setup)
+{
+	struct sipe_transport_headless *transport = g_new0(struct sipe_transport_headless, 1);
+
+	transport->public.type      = setup->type;
+	transport->public.user_data = setup->user_data;
+	transport->connected        = setup->connected;
+	transport->input            = setup->input;
+	transport->error            = setup->error;
+	transport->hostname         = g_strdup(setup->server_name);
+	transport->private          = sipe_public->backend_private;
+	transport->cancel           = g_cancellable_new();
+	transport->queued           = g_byte_array_new();
+	transport->writing          = g_byte_array_new();
+	transport->port             = setup->server_port;
+	transport->is_writing       = FALSE;
+	transport->do_flush         = FALSE;
+
+	if ((setup->type == SIPE_TRANSPORT_TLS) ||
+	    (setup->type == SIPE_TRANSPORT_TCP)) {
+
+		internal_connect(transport);
+		return(SIPE_TRANSPORT_CONNECTION);
+
+	} else {
+		setup->error(SIPE_TRANSPORT_CONNECTION,
+			     "This should not happen...");
+		sipe_backend_transport_disconnect(SIPE_TRANSPORT_CONNECTION);
+		return(NULL);
+	}
+}
+
+static gboolean free_transport(gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+
+	SIPE_DEBUG_INFO("free_transport %p", transport);
+
+	g_free(transport->hostname);
+
+	/* free unflushed data */
+	g_byte_array_free(transport->queued,  TRUE);
+	g_byte_array_free(transport->writing, TRUE);
+
+	if (transport->cancel)
+		g_object_unref(transport->cancel);
+
+	g_free(transport);
+
+	return(FALSE);
+}
+
+static void close_completed(GObject *stream,
+			    GAsyncResult *result,
+			    gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+	SIPE_DEBUG_INFO("close_completed: transport %p", data);
+	g_io_stream_close_finish(G_IO_STREAM(stream), result, NULL);
+	g_idle_add(free_transport, transport);
+}
+
+static void do_close(struct sipe_transport_headless *transport)
+{
+	SIPE_DEBUG_INFO("do_close: %p", transport);
+
+	/* cancel outstanding asynchronous operations */
+	transport->do_flush = FALSE;
+	g_cancellable_cancel(transport->cancel);
+	g_io_stream_close_async(G_IO_STREAM(transport->socket),
+				G_PRIORITY_DEFAULT,
+				NULL,
+				close_completed,
+				transport);
+}
+
+void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_headless *transport = HEADLESS_TRANSPORT;
+
+	if (!transport) return;
+
+	SIPE_DEBUG_INFO("sipe_backend_transport_disconnect: %p", transport);
+
+	/* error callback is invalid now, do no longer call! */
+	transport->error = NULL;
+
+	/* dropping connection to the server? */
+	if (transport->private->transport == transport)
+		transport->private->transport = NULL;
+
+	/* already connected? */
+	if (transport->socket) {
+
+		/* flush required? */
+		if (transport->do_flush && transport->is_writing)
+			SIPE_DEBUG_INFO("sipe_backend_transport_disconnect: %p needs flushing",
+					transport);
+		else
+			do_close(transport);
+
+	} else {
+		/* cancel outstanding connect operation */
+		if (transport->cancel)
+			g_cancellable_cancel(transport->cancel);
+
+		/* queue transport to be deleted */
+		g_idle_add(free_transport, transport);
+	}
+}
+
+static void do_write(struct sipe_transport_headless *transport);
+static void write_next(struct sipe_transport_headless *transport);
+static void write_completed(GObject *stream,
+			    GAsyncResult *result,
+			    gpointer data)
+{
+	struct sipe_transport_headless *transport = data;
+	GError                          *error     = NULL;
+	gssize written = g_output_stream_write_finish(G_OUTPUT_STREAM(stream),
+						      result,
+						      &error);
+
+	if ((written < 0) || error) {
+		const gchar *msg = error ? error->message : "UNKNOWN";
+		SIPE_DEBUG_ERROR("write_completed: error: %s", msg);
+		if (transport->error)
+			transport->error(SIPE_TRANSPORT_CONNECTION, msg);
+		g_error_free(error);
+
+		/* error during flush: give up and close transport */
+		if (transport->do_flush)
+			do_close(transport);
+
+	} else if (g_cancellable_is_cancelled(transport->cancel)) {
+		/* write completed when transport was disconnected */
+		SIPE_DEBUG_INFO_NOFORMAT("write_completed: cancelled");
+		transport->is_writing = FALSE;
+	} else {
+		/* partial write: continue at offset */
+		transport->write_offset += written;
+		write_next(transport);
+	}
+}
+
+static void write_next(struct sipe_transport_headless *transport)
+{
+	/* rest of current data */
+	if (transport->write_offset < transport->writing->len) {
+		g_output_stream_write_async(transport->ostream,
+					    transport->writing->data + transport->write_offset,
+					    transport->writing->len - transport->write_offset,
+					    G_PRIORITY_DEFAULT,
+					    transport->cancel,
+					    write_completed,
+					    transport);
+		return;
+	}
+
+	/* more to write? */
+	if (transport->queued->len) {
+		/* yes, everything queued in the meantime goes out in one write */
+		do_write(transport);
+	} else {
+		/* no, we're done for now... */
+		transport->is_writing = FALSE;
+
+		/* flush completed */
+		if (transport->do_flush)
+			do_close(transport);
+	}
+}
+
+/* start writing all queued data */
+static void do_write(struct sipe_transport_headless *transport)
+{
+	/* swap buffers: data must stay valid until write has completed */
+	GByteArray *writing = transport->queued;
+
+	g_byte_array_set_size(transport->writing, 0);
+	transport->queued       = transport->writing;
+	transport->writing      = writing;
+	transport->write_offset = 0;
+	transport->is_writing   = TRUE;
+	write_next(transport);
+}
+
+static void queue_write(struct sipe_transport_headless *transport,
+			const gchar *buffer,
+			gsize length)
+{
+	g_byte_array_append(transport->queued,
+			    (const guint8 *) buffer,
+			    length);
+
+	/* not writing? Then write directly to stream */
+	if (!transport->is_writing)
+		do_write(transport);
+}
+
+void sipe_backend_transport_message(struct sipe_transport_connection *conn,
+				    const gchar *buffer)
+{
+	queue_write(HEADLESS_TRANSPORT, buffer, strlen(buffer));
+}
+
+void sipe_backend_transport_message_iov(struct sipe_transport_connection *conn,
+					const struct sipe_transport_segment *segments,
+					guint count)
+{
+	struct sipe_transport_headless *transport = HEADLESS_TRANSPORT;
+	guint i;
+
+	/* collect the segments directly into the output queue */
+	for (i = 0; i < count; i++)
+		g_byte_array_append(transport->queued,
+				    (const guint8 *) segments[i].data,
+				    segments[i].length);
+
+	if (!transport->is_writing)
+		do_write(transport);
+}
+
+void sipe_backend_transport_flush(struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_headless *transport = HEADLESS_TRANSPORT;
+	transport->do_flush = TRUE;
+}
+
+gsize sipe_backend_transport_pending(struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_headless *transport = HEADLESS_TRANSPORT;
+	gsize pending = transport->queued->len;
+
+	if (transport->is_writing)
+		pending += transport->writing->len - transport->write_offset;
+	return(pending);
+}
+
+const gchar *sipe_backend_network_ip_address(struct sipe_core_public *sipe_public)
+{
+	struct sipe_backend_private *headless_private = sipe_public->backend_private;
+	const gchar *ipstr = headless_private->ipaddress;
+
+	/* address cached? */
+	if (!ipstr) {
+		struct sipe_transport_headless *transport = headless_private->transport;
+
+		/* default if everything should fail */
+		ipstr = "127.0.0.1";
+
+		/* connection to server established - get local IP from socket */
+		if (transport && transport->socket) {
+			GSocketAddress *saddr = g_socket_connection_get_local_address(transport->socket,
+										      NULL);
+
+			if (saddr) {
+				GInetAddress *iaddr = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(saddr));
+
+				if (iaddr) {
+					/* cache address string */
+					ipstr = headless_private->ipaddress = g_inet_address_to_string(iaddr);
+					SIPE_DEBUG_INFO("sipe_backend_network_ip_address: %s", ipstr);
+				}
+				g_object_unref(saddr);
+			}
+		}
+	}
+
+	return(ipstr);
+}
+
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-12 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -120,12 +120,438 @@ sipe_info_to_miranda_property(sipe_buddy_info_fields info)
 	return (const char *)g_hash_table_lookup(info_to_property_table, (gconstpointer)info);
 }
 
+/*
+ * Contact settings cache
+ *
+ * The SIPE-owned settings of all contacts are loaded in one pass at login.
+ * Reads are served from the cache. Writes only mark the contact as dirty
+ * and are written back to the database in batches from a timer. Miranda
+ * itself reads the settings from the database, so the delay is short.
+ *
+ * Without a cache, i.e. before login or after logout, all accesses go to
+ * the database directly.
+ */
+#define CONTACT_FLUSH_MSECONDS 1000
+#define CONTACT_FLUSH_BATCH    256
+
+struct contact_value {
+	gchar *value;         /* NULL: setting doesn't exist */
+	gboolean utf8;        /* write with DBWriteContactSettingStringUtf() */
+	gboolean dirty;
+};
+
+struct contact_settings {
+	HANDLE hContact;
+	gchar *name;          /* SIP_UNIQUEID */
+	GHashTable *strings;  /* setting name -> struct contact_value */
+	WORD status;
+	gboolean has_status;
+	gboolean status_dirty;
+	gboolean chat_room;
+	gboolean dirty;       /* on flush list */
+};
+
+struct sipe_miranda_contact_cache {
+	GHashTable *by_handle; /* HANDLE -> struct contact_settings */
+	GHashTable *by_name;   /* lower-case name -> GSList of contacts */
+	GSList *dirty;         /* contacts waiting for flush */
+	gpointer flush_timer;
+};
+
+static gchar *contact_db_string(SIPPROTO *pr,
+				HANDLE hContact,
+				const gchar *module,
+				const gchar *setting)
+{
+	DBVARIANT dbv;
+	gchar *value = NULL;
+
+	if (!DBGetContactSettingStringUtf(hContact,
+					  module ? module : pr->proto.m_szModuleName,
+					  setting,
+					  &dbv)) {
+		value = g_strdup(dbv.pszVal);
+		DBFreeVariant(&dbv);
+	}
+	return(value);
+}
+
+static void contact_value_free(gpointer data)
+{
+	struct contact_value *value = data;
+	g_free(value->value);
+	g_free(value);
+}
+
+static void contact_settings_free(gpointer data)
+{
+	struct contact_settings *contact = data;
+	g_hash_table_destroy(contact->strings);
+	g_free(contact->name);
+	g_free(contact);
+}
+
+static struct contact_value *contact_value_get(SIPPROTO *pr,
+						struct contact_settings *contact,
+						const gchar *setting)
+{
+	struct contact_value *value = g_hash_table_lookup(contact->strings,
+							  setting);
+
+	/* read through: absent settings are cached too */
+	if (!value) {
+		value = g_new0(struct contact_value, 1);
+		value->value = contact_db_string(pr, contact->hContact,
+						 NULL, setting);
+		g_hash_table_insert(contact->strings, g_strdup(setting), value);
+	}
+	return(value);
+}
+
+static void contact_index_add(struct sipe_miranda_contact_cache *cache,
+			      struct contact_settings *contact)
+{
+	gchar *key = g_ascii_strdown(contact->name, -1);
+	GSList *list = g_hash_table_lookup(cache->by_name, key);
+
+	/* keep database order for contacts with the same name */
+	list = g_slist_append(list, contact);
+	g_hash_table_insert(cache->by_name, key, list);
+}
+
+static void contact_index_remove(struct sipe_miranda_contact_cache *cache,
+				 struct contact_settings *contact)
+{
+	gchar *key = g_ascii_strdown(contact->name, -1);
+	GSList *list = g_hash_table_lookup(cache->by_name, key);
+
+	list = g_slist_remove(list, contact);
+	if (list)
+		g_hash_table_insert(cache->by_name, g_strdup(key), list);
+	else
+		g_hash_table_remove(cache->by_name, key);
+	g_free(key);
+}
+
+static struct contact_settings *contact_load(SIPPROTO *pr,
+					     HANDLE hContact)
+{
+	struct sipe_miranda_contact_cache *cache = pr->contact_cache;
+	struct contact_settings *contact = g_new0(struct contact_settings, 1);
+	WORD status;
+
+	contact->hContact   = hContact;
+	contact->strings    = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    g_free, contact_value_free);
+	contact->name       = contact_db_string(pr, hContact, NULL, SIP_UNIQUEID);
+	contact->chat_room  = DBGetContactSettingByte(hContact,
+						      pr->proto.m_szModuleName,
+						      "ChatRoom", 0) != 0;
+	contact->has_status = sipe_miranda_getWord(pr, hContact, "Status", &status) != 0;
+	if (contact->has_status)
+		contact->status = status;
+
+	/* read by every alias lookup */
+	contact_value_get(pr, contact, "Nick");
+	contact_value_get(pr, contact, "Alias");
+
+	g_hash_table_insert(cache->by_handle, hContact, contact);
+	if (contact->name)
+		contact_index_add(cache, contact);
+
+	return(contact);
+}
+
+static struct contact_settings *contact_find(SIPPROTO *pr,
+					     HANDLE hContact)
+{
+	struct sipe_miranda_contact_cache *cache = pr->contact_cache;
+	struct contact_settings *contact;
+	const gchar *proto;
+
+	if (!cache || !hContact)
+		return(NULL);
+
+	contact = g_hash_table_lookup(cache->by_handle, hContact);
+	if (contact)
+		return(contact);
+
+	/* created outside of SIPE since login */
+	proto = (const gchar *) CallService(MS_PROTO_GETCONTACTBASEPROTO,
+					    (WPARAM) hContact, 0);
+	if (!proto || lstrcmpA(proto, pr->proto.m_szModuleName))
+		return(NULL);
+
+	return(contact_load(pr, hContact));
+}
+
+static void contact_flush(SIPPROTO *pr,
+			  struct contact_settings *contact)
+{
+	GHashTableIter iter;
+	const gchar *setting;
+	struct contact_value *value;
+
+	if (contact->status_dirty) {
+		sipe_miranda_setWord(pr, contact->hContact, "Status", contact->status);
+		contact->status_dirty = FALSE;
+	}
+
+	g_hash_table_iter_init(&iter, contact->strings);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &setting, (gpointer *) &value)) {
+		if (value->dirty) {
+			if (value->utf8)
+				sipe_miranda_setContactStringUtf(pr, contact->hContact,
+								 setting, value->value);
+			else
+				sipe_miranda_setContactString(pr, contact->hContact,
+							      setting, value->value);
+			value->dirty = FALSE;
+		}
+	}
+
+	contact->dirty = FALSE;
+}
+
+static void contact_flush_cb(gpointer data)
+{
+	SIPPROTO *pr = data;
+	struct sipe_miranda_contact_cache *cache = pr->contact_cache;
+	guint count = 0;
+
+	/* cancelled in the nick of time */
+	if (!cache)
+		return;
+
+	/* timer entry is freed after callback */
+	cache->flush_timer = NULL;
+
+	while (cache->dirty && (count++ < CONTACT_FLUSH_BATCH)) {
+		struct contact_settings *contact = cache->dirty->data;
+		cache->dirty = g_slist_delete_link(cache->dirty, cache->dirty);
+		contact_flush(pr, contact);
+	}
+
+	if (cache->dirty)
+		cache->flush_timer = sipe_miranda_schedule_mseconds(contact_flush_cb,
+								    CONTACT_FLUSH_MSECONDS,
+								    pr);
+	else
+		SIPE_DEBUG_INFO("contact_flush_cb: flushed %u contacts", count);
+}
+
+static void contact_dirty(SIPPROTO *pr,
+			  struct contact_settings *contact)
+{
+	struct sipe_miranda_contact_cache *cache = pr->contact_cache;
+
+	if (!contact->dirty) {
+		contact->dirty = TRUE;
+		cache->dirty   = g_slist_prepend(cache->dirty, contact);
+	}
+	if (!cache->flush_timer)
+		cache->flush_timer = sipe_miranda_schedule_mseconds(contact_flush_cb,
+								    CONTACT_FLUSH_MSECONDS,
+								    pr);
+}
+
+/* returns new string, free with g_free() */
+static gchar *contact_get_string(SIPPROTO *pr,
+				 HANDLE hContact,
+				 const gchar *setting)
+{
+	struct contact_settings *contact = contact_find(pr, hContact);
+
+	if (contact)
+		return(g_strdup(contact_value_get(pr, contact, setting)->value));
+	return(contact_db_string(pr, hContact, NULL, setting));
+}
+
+static void contact_set_string(SIPPROTO *pr,
+			       HANDLE hContact,
+			       const gchar *setting,
+			       const gchar *string,
+			       gboolean utf8)
+{
+	struct contact_settings *contact = contact_find(pr, hContact);
+	struct contact_value *value;
+
+	if (!contact) {
+		if (utf8)
+			sipe_miranda_setContactStringUtf(pr, hContact, setting, string);
+		else
+			sipe_miranda_setContactString(pr, hContact, setting, string);
+		return;
+	}
+
+	/* updates often repeat the current value */
+	value = contact_value_get(pr, contact, setting);
+	if (string && sipe_strequal(value->value, string))
+		return;
+
+	g_free(value->value);
+	value->value = g_strdup(string);
+	value->utf8  = utf8;
+	value->dirty = TRUE;
+	contact_dirty(pr, contact);
+}
+
+static gboolean contact_get_status(SIPPROTO *pr,
+				   HANDLE hContact,
+				   WORD *status)
+{
+	struct contact_settings *contact = contact_find(pr, hContact);
+
+	if (!contact)
+		return(sipe_miranda_getWord(pr, hContact, "Status", status) != 0);
+
+	if (contact->has_status)
+		*status = contact->status;
+	return(contact->has_status);
+}
+
+static void contact_set_status(SIPPROTO *pr,
+			       HANDLE hContact,
+			       WORD status)
+{
+	struct contact_settings *contact = contact_find(pr, hContact);
+
+	if (!contact) {
+		sipe_miranda_setWord(pr, hContact, "Status", status);
+		return;
+	}
+
+	if (contact->has_status && (contact->status == status))
+		return;
+
+	contact->status       = status;
+	contact->has_status   = TRUE;
+	contact->status_dirty = TRUE;
+	contact_dirty(pr, contact);
+}
+
+void sipe_miranda_buddy_cache_load(SIPPROTO *pr)
+{
+	struct sipe_miranda_contact_cache *cache;
+	HANDLE hContact;
+
+	if (pr->contact_cache)
+		return;
+
+	cache = pr->contact_cache = g_new0(struct sipe_miranda_contact_cache, 1);
+	cache->by_handle = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						 NULL, contact_settings_free);
+	cache->by_name   = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, (GDestroyNotify) g_slist_free);
+
+	hContact = (HANDLE)CallService(MS_DB_CONTACT_FINDFIRST, 0, 0);
+	while (hContact) {
+		gchar* szProto = (char*)CallService(MS_PROTO_GETCONTACTBASEPROTO, (WPARAM)hContact, 0);
+		if (szProto != NULL && !lstrcmpA(szProto, pr->proto.m_szModuleName))
+			contact_load(pr, hContact);
+		hContact = (HANDLE)CallService(MS_DB_CONTACT_FINDNEXT, (WPARAM)hContact, 0);
+	}
+
+	SIPE_DEBUG_INFO("sipe_miranda_buddy_cache_load: %u contacts",
+			g_hash_table_size(cache->by_handle));
+}
+
+void sipe_miranda_buddy_cache_add(SIPPROTO *pr, HANDLE hContact)
+{
+	sipe_miranda_buddy_cache_remove(pr, hContact);
+	if (pr->contact_cache)
+		contact_load(pr, hContact);
+}
+
+void sipe_miranda_buddy_cache_remove(SIPPROTO *pr, HANDLE hContact)
+{
+	struct sipe_miranda_contact_cache *cache = pr->contact_cache;
+	struct contact_settings *contact;
+
+	if (!cache)
+		return;
+
+	contact = g_hash_table_lookup(cache->by_handle, hContact);
+	if (contact) {
+		/* pending writes are obsolete */
+		if (contact->dirty)
+			cache->dirty = g_slist_remove(cache->dirty, contact);
+		if (contact->name)
+			contact_index_remove(cache, contact);
+		g_hash_table_remove(cache->by_handle, hContact);
+	}
+}
+
+void sipe_miranda_buddy_cache_free(SIPPROTO *pr)
+{
+	struct sipe_miranda_contact_cache *cache = pr->contact_cache;
+	GSList *entry;
+
+	if (!cache)
+		return;
+
+	if (cache->flush_timer)
+		sipe_backend_schedule_cancel(pr->sip, cache->flush_timer);
+
+	for (entry = cache->dirty; entry; entry = entry->next)
+		contact_flush(pr, entry->data);
+	SIPE_DEBUG_INFO("sipe_miranda_buddy_cache_free: flushed %u contacts",
+			g_slist_length(cache->dirty));
+	g_slist_free(cache->dirty);
+
+	g_hash_table_destroy(cache->by_name);
+	g_hash_table_destroy(cache->by_handle);
+	g_free(cache);
+	pr->contact_cache = NULL;
+}
+
+static sipe_backend_buddy buddy_find_cached(SIPPROTO *pr,
+					    const gchar *name,
+					    const gchar *group)
+{
+	gchar *key = g_ascii_strdown(name, -1);
+	GSList *entry = g_hash_table_lookup(pr->contact_cache->by_name, key);
+
+	g_free(key);
+	for (; entry; entry = entry->next) {
+		struct contact_settings *contact = entry->data;
+		gchar *contact_group;
+		int tCompareResult;
+
+		if (!group)
+		{
+			SIPE_DEBUG_INFO("buddy_name <%s> group <%s> found <%08x>", name, group, contact->hContact);
+			return contact->hContact;
+		}
+
+		/* group is owned by Miranda */
+		contact_group = contact_db_string(pr, contact->hContact, "CList", "Group");
+		if (!contact_group) {
+			SIPE_DEBUG_INFO("buddy_name <%s> group <%s> ERROR getting contact group", name, group);
+			return NULL;
+		}
+		tCompareResult = lstrcmpiA(contact_group, group);
+		g_free(contact_group);
+		if ( !tCompareResult )
+		{
+			SIPE_DEBUG_INFO("buddy_name <%s> group <%s> found <%08x> in group", name, group, contact->hContact);
+			return contact->hContact;
+		}
+	}
+
+	SIPE_DEBUG_INFO("buddy_name <%s> group <%s> NOT FOUND", name, group);
+	return NULL;
+}
+
 sipe_backend_buddy sipe_miranda_buddy_find(SIPPROTO *pr,
 					   const gchar *name,
 					   const gchar *group)
 {
 	HANDLE hContact;
 
+	if (pr->contact_cache)
+		return buddy_find_cached(pr, name, group);
+
 	hContact = (HANDLE)CallService(MS_DB_CONTACT_FINDFIRST, 0, 0);
 	while (hContact) {
 		gchar* szProto = (char*)CallService(MS_PROTO_GETCONTACTBASEPROTO, (WPARAM)hContact, 0);
@@ -176,6 +602,46 @@ GSList* sipe_miranda_buddy_find_all(SIPPROTO *pr,
 	GSList *res = NULL;
 	HANDLE hContact;
 
+	if (pr->contact_cache) {
+		GSList *entry = NULL;
+		GList *all = NULL;
+
+		if (buddy_name) {
+			gchar *key = g_ascii_strdown(buddy_name, -1);
+			entry = g_hash_table_lookup(pr->contact_cache->by_name, key);
+			g_free(key);
+		} else {
+			all = g_hash_table_get_values(pr->contact_cache->by_handle);
+		}
+
+		while (entry || all) {
+			struct contact_settings *contact;
+
+			if (all) {
+				contact = all->data;
+				all = g_list_delete_link(all, all);
+			} else {
+				contact = entry->data;
+				entry = entry->next;
+			}
+			if (contact->chat_room)
+				continue;
+
+			if (!group_name) {
+				res = g_slist_prepend(res, contact->hContact);
+			} else {
+				gchar *group = contact_db_string(pr, contact->hContact, "CList", "Group");
+				if (group && !lstrcmpiA(group, group_name))
+					res = g_slist_prepend(res, contact->hContact);
+				g_free(group);
+			}
+		}
+
+		res = g_slist_reverse(res);
+		SIPE_DEBUG_INFO("name <%s> group <%s> found <%d> buddies", buddy_name, group_name, g_slist_length(res));
+		return res;
+	}
+
 	hContact = (HANDLE)CallService(MS_DB_CONTACT_FINDFIRST, 0, 0);
 	while (hContact) {
 		gchar* szProto = (char*)CallService(MS_PROTO_GETCONTACTBASEPROTO, (WPARAM)hContact, 0);
@@ -217,76 +683,50 @@ GSList* sipe_backend_buddy_find_all(struct sipe_core_public *sipe_public,
 	return sipe_miranda_buddy_find_all(sipe_public->backend_private, buddy_name, group_name);
 }
 
-gchar* sipe_backend_buddy_get_name(struct sipe_core_public *sipe_public,
-				   const sipe_backend_buddy who)
+static gchar *buddy_get_name(SIPPROTO *pr,
+			     HANDLE hContact)
 {
-	DBVARIANT dbv;
-	HANDLE hContact = (HANDLE)who;
-	gchar *alias;
-	SIPPROTO *pr = sipe_public->backend_private;
-	const gchar *module = pr->proto.m_szModuleName;
+	struct contact_settings *contact = contact_find(pr, hContact);
 
-	if ( !DBGetContactSettingString( hContact, module, SIP_UNIQUEID, &dbv )) {
-		alias = g_strdup(dbv.pszVal);
-		DBFreeVariant( &dbv );
-		return alias;
-	}
+	if (contact)
+		return g_strdup(contact->name);
+	return contact_db_string(pr, hContact, NULL, SIP_UNIQUEID);
+}
 
-	return NULL;
+gchar* sipe_backend_buddy_get_name(struct sipe_core_public *sipe_public,
+				   const sipe_backend_buddy who)
+{
+	return buddy_get_name(sipe_public->backend_private, (HANDLE)who);
 }
 
 gchar* sipe_backend_buddy_get_alias(struct sipe_core_public *sipe_public,
 				    const sipe_backend_buddy who)
 {
-	DBVARIANT dbv;
 	HANDLE hContact = (HANDLE)who;
-	gchar *alias;
 	SIPPROTO *pr = sipe_public->backend_private;
-	const gchar *module = pr->proto.m_szModuleName;
-
-	if ( DBGetContactSettingString( hContact, module, "Nick", &dbv )
-	  && DBGetContactSettingString( hContact, module, "Alias", &dbv )
-	  && DBGetContactSettingString( hContact, module, SIP_UNIQUEID, &dbv ))
-			return NULL;
+	gchar *alias;
 
-	alias = g_strdup(dbv.pszVal);
-	DBFreeVariant( &dbv );
+	if ((alias = contact_get_string(pr, hContact, "Nick")) == NULL &&
+	    (alias = contact_get_string(pr, hContact, "Alias")) == NULL)
+		alias = buddy_get_name(pr, hContact);
 	return alias;
 }
 
 gchar* sipe_backend_buddy_get_server_alias(struct sipe_core_public *sipe_public,
 					   const sipe_backend_buddy who)
 {
-	DBVARIANT dbv;
-	HANDLE hContact = (HANDLE)who;
-	char *alias;
-	SIPPROTO *pr = sipe_public->backend_private;
-	const gchar *module = pr->proto.m_szModuleName;
-
-	if ( !DBGetContactSettingString( hContact, module, "Alias", &dbv )) {
-		alias = g_strdup(dbv.pszVal);
-		DBFreeVariant( &dbv );
-		return alias;
-	}
-
-	return NULL;
+	return contact_get_string(sipe_public->backend_private, (HANDLE)who, "Alias");
 }
 
 gchar* sipe_backend_buddy_get_local_alias(struct sipe_core_public *sipe_public,
 					   const sipe_backend_buddy who)
 {
-	DBVARIANT dbv;
 	HANDLE hContact = (HANDLE)who;
-	char *alias;
 	SIPPROTO *pr = sipe_public->backend_private;
-	const gchar *module = pr->proto.m_szModuleName;
-
-	if ( DBGetContactSettingString( hContact, module, "Nick", &dbv )
-	  && DBGetContactSettingString( hContact, module, SIP_UNIQUEID, &dbv ))
-			return NULL;
+	gchar *alias = contact_get_string(pr, hContact, "Nick");
 
-	alias = g_strdup(dbv.pszVal);
-	DBFreeVariant( &dbv );
+	if (!alias)
+		alias = buddy_get_name(pr, hContact);
 	return alias;
 }
 
@@ -315,7 +755,7 @@ guint sipe_backend_buddy_get_status(struct sipe_core_public *sipe_public,
 	sipe_backend_buddy buddy = sipe_backend_buddy_find(sipe_public, uri, NULL);
 	WORD rv = SIPE_ACTIVITY_UNSET;
 
-	sipe_miranda_getWord(pr, buddy, "Status", &rv);
+	contact_get_status(pr, buddy, &rv);
 	return MirandaStatusToSipe(rv);
 }
 
@@ -327,7 +767,7 @@ void sipe_backend_buddy_set_alias(struct sipe_core_public *sipe_public,
 	HANDLE hContact = (HANDLE)who;
 
 	SIPE_DEBUG_INFO("Set alias of contact <%08x> to <%s>", who, alias);
-	sipe_miranda_setContactStringUtf( pr, hContact, "Nick", alias );
+	contact_set_string(pr, hContact, "Nick", alias, TRUE);
 }
 
 void sipe_backend_buddy_set_server_alias(struct sipe_core_public *sipe_public,
@@ -338,7 +778,7 @@ void sipe_backend_buddy_set_server_alias(struct sipe_core_public *sipe_public,
 	SIPPROTO *pr = sipe_public->backend_private;
 
 	SIPE_DEBUG_INFO("Set alias of contact <%08x> to <%s>", who, alias);
-	sipe_miranda_setContactStringUtf( pr, hContact, "Alias", alias );
+	contact_set_string(pr, hContact, "Alias", alias, TRUE);
 }
 
 gchar* sipe_backend_buddy_get_string(struct sipe_core_public *sipe_public,
@@ -346,19 +786,12 @@ gchar* sipe_backend_buddy_get_string(struct sipe_core_public *sipe_public,
 				     const sipe_buddy_info_fields key)
 {
 	SIPPROTO *pr = sipe_public->backend_private;
-	const gchar *module = pr->proto.m_szModuleName;
 	const gchar *prop_name = sipe_info_to_miranda_property(key);
-	char *tmp;
-	char *prop_str;
 
 	if (!prop_name)
 		return NULL;
 
-	tmp = sipe_miranda_getContactString(pr, buddy, prop_name);
-	prop_str = g_strdup(tmp);
-	mir_free(tmp);
-
-	return prop_str;
+	return contact_get_string(pr, buddy, prop_name);
 }
 
 void sipe_backend_buddy_set_string(struct sipe_core_public *sipe_public,
@@ -367,14 +800,13 @@ void sipe_backend_buddy_set_string(struct sipe_core_public *sipe_public,
 				   const gchar *val)
 {
 	SIPPROTO *pr = sipe_public->backend_private;
-	const gchar *module = pr->proto.m_szModuleName;
 	const gchar *prop_name = sipe_info_to_miranda_property(key);
 
 	SIPE_DEBUG_INFO("buddy <%08x> key <%d = %s> val <%s>", buddy, key, prop_name, val);
 	if (!prop_name)
 		return;
 
-	sipe_miranda_setContactString(pr, buddy, prop_name, val);
+	contact_set_string(pr, buddy, prop_name, val, FALSE);
 }
 
 void sipe_backend_buddy_refresh_properties(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
@@ -403,15 +835,17 @@ sipe_backend_buddy sipe_backend_buddy_add(struct sipe_core_public *sipe_public,
 	hContact = ( HANDLE )CallService( MS_DB_CONTACT_ADD, 0, 0 );
 	CallService( MS_PROTO_ADDTOCONTACT, ( WPARAM )hContact,( LPARAM )pr->proto.m_szModuleName );
 	sipe_miranda_setContactString( pr, hContact, SIP_UNIQUEID, name ); // name
-	if (alias) sipe_miranda_setContactStringUtf( pr, hContact, "Nick", alias );
 	DBWriteContactSettingString( hContact, "CList", "Group", groupname );
-	sipe_miranda_setContactString( pr, hContact, "Group", groupname );
+	sipe_miranda_buddy_cache_add(pr, hContact);
+	if (alias) contact_set_string(pr, hContact, "Nick", alias, TRUE);
+	contact_set_string(pr, hContact, "Group", groupname, FALSE);
 	return (sipe_backend_buddy)hContact;
 }
 
 void sipe_backend_buddy_remove(struct sipe_core_public *sipe_public,
 			       const sipe_backend_buddy who)
 {
+	sipe_miranda_buddy_cache_remove(sipe_public->backend_private, (HANDLE)who);
 	CallService( MS_DB_CONTACT_DELETE, (WPARAM)who, 0 );
 }
 
@@ -437,6 +871,7 @@ void sipe_backend_buddy_request_authorization(struct sipe_core_public *sipe_publ
 		CallService( MS_PROTO_ADDTOCONTACT, ( WPARAM )hContact,( LPARAM )pr->proto.m_szModuleName );
 		DBWriteContactSettingByte( hContact, "CList", "NotOnList", 1 );
 		sipe_miranda_setContactString( pr, hContact, SIP_UNIQUEID, who ); // name
+		sipe_miranda_buddy_cache_add(pr, hContact);
 	}
 
 	ccs.szProtoService	= PSR_AUTH;
@@ -507,7 +942,7 @@ void sipe_backend_buddy_set_status(struct sipe_core_public *sipe_public,
 	GSList *contacts = sipe_backend_buddy_find_all(sipe_public, who, NULL);
 
 	CONTACTS_FOREACH(contacts)
-		sipe_miranda_setWord(pr, hContact, "Status", SipeStatusToMiranda(activity));
+		contact_set_status(pr, hContact, SipeStatusToMiranda(activity));
 	CONTACTS_FOREACH_END;
 
 }
@@ -521,6 +956,13 @@ gboolean sipe_backend_buddy_group_add(struct sipe_core_public *sipe_public,
 	return (hGroup?TRUE:FALSE);
 }
 
+/* no collapsed groups: subscribe to all buddies */
+gboolean sipe_backend_buddy_group_visible(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					  SIPE_UNUSED_PARAMETER const gchar *group_name)
+{
+	return(TRUE);
+}
+
 gboolean sipe_backend_buddy_group_rename(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
 					 SIPE_UNUSED_PARAMETER const gchar *old_name,
 					 SIPE_UNUSED_PARAMETER const gchar *new_name)
@@ -558,7 +1000,7 @@ static void set_if_defined(SIPPROTO *pr, GHashTable *store, HANDLE hContact, sip
 {
 	char *value = (char *)g_hash_table_lookup(store, (gpointer)field);
 	if (value)
-		sipe_miranda_setContactStringUtf(pr, hContact, label, value);
+		contact_set_string(pr, hContact, label, value, TRUE);
 }
 
 void sipe_backend_buddy_info_finalize(struct sipe_core_public *sipe_public,
@@ -567,8 +1009,8 @@ void sipe_backend_buddy_info_finalize(struct sipe_core_public *sipe_public,
 {
 	SIPPROTO *pr = sipe_public->backend_private;
 	HANDLE hContact = sipe_miranda_buddy_find(pr, uri, NULL); /* (HANDLE) data; */
-	DBVARIANT dbv;
 	GHashTable *results = (GHashTable*)info;
+	gchar *name;
 
 	GHashTableIter iter;
 	const char *id, *value;
@@ -588,19 +1030,20 @@ void sipe_backend_buddy_info_finalize(struct sipe_core_public *sipe_public,
 	set_if_defined(pr, results, hContact, SIPE_BUDDY_INFO_ZIPCODE, "CompanyZIP");
 	set_if_defined(pr, results, hContact, SIPE_BUDDY_INFO_DEPARTMENT, "CompanyDepartment");
 
-	if ( !DBGetContactSettingString( hContact, pr->proto.m_szModuleName, SIP_UNIQUEID, &dbv )) {
+	name = buddy_get_name(pr, hContact);
+	if (name) {
 		GString *content = g_string_new(NULL);
 		WORD wstatus;
 		gchar *status;
 /*		GSList *info; */
 		gboolean is_online;
 
-		sipe_miranda_getWord(pr, hContact, "Status", &wstatus);
+		contact_get_status(pr, hContact, &wstatus);
 		status = (gchar*)CallService(MS_CLIST_GETSTATUSMODEDESCRIPTION, (WPARAM)wstatus, (LPARAM)GSMDF_PREFIXONLINE);
 		is_online = g_str_has_prefix(status, "Online: ") || !g_ascii_strcasecmp(status, "Online");
 /*
 		info = sipe_core_buddy_info(sipe_public,
-					    dbv.pszVal,
+					    name,
 					    g_str_has_prefix(status, "Online: ") ? status+8 : status,
 					    is_online);
 
@@ -614,6 +1057,7 @@ void sipe_backend_buddy_info_finalize(struct sipe_core_public *sipe_public,
 		sipe_miranda_setContactStringUtf(pr, hContact, "About", content->str);
 */
 		g_string_free(content, TRUE);
+		g_free(name);
 	}
 
 	sipe_miranda_SendBroadcast(pr, hContact, ACKTYPE_GETINFO, ACKRESULT_SUCCESS, (HANDLE) 1, (LPARAM) 0);
@@ -684,6 +1128,7 @@ int sipe_miranda_buddy_delete(SIPPROTO *pr, WPARAM wParam, LPARAM lParam)
 	DBFreeVariant( &dbv );
 
 	LOCK;
+	sipe_miranda_buddy_cache_remove(pr, hContact);
 	sipe_core_buddy_remove(pr->sip, name, groupname);
 	UNLOCK;
 
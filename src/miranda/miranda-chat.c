@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2009 pier11 <pier11@operamail.com>
  *
  *
@@ -80,6 +80,17 @@ void sipe_backend_chat_add(struct sipe_backend_chat_session *backend_session,
 	mir_free(nick);
 }
 
+/* Miranda chat module has no bulk join event */
+void sipe_backend_chat_add_many(struct sipe_backend_chat_session *backend_session,
+				const GSList *uris,
+				gboolean is_new)
+{
+	const GSList *entry;
+
+	for (entry = uris; entry; entry = entry->next)
+		sipe_backend_chat_add(backend_session, entry->data, is_new);
+}
+
 void sipe_backend_chat_close(struct sipe_backend_chat_session *backend_session)
 {
 	SIPPROTO *pr;
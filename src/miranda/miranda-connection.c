@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -39,6 +39,7 @@ void sipe_miranda_connection_destroy(SIPPROTO *pr)
 	SIPE_DEBUG_INFO("valid <%d> state <%d>", pr->valid, pr->state);
 	if (!pr->valid) return;
 
+	sipe_miranda_buddy_cache_free(pr);
 	set_buddies_offline(pr);
 	sipe_miranda_close(pr);
 	pr->state = SIPE_MIRANDA_DISCONNECTED;
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  * Copyright (C) 2010 Jakub Adam <jakub.adam@ktknet.cz>
  * Copyright (C) 2010 Tomáš Hrabčík <tomas.hrabcik@tieto.com>
  *
@@ -355,6 +355,7 @@ void sipe_backend_ft_incoming(struct sipe_core_public *sipe_public,
 		CallService( MS_PROTO_ADDTOCONTACT, ( WPARAM )hContact,( LPARAM )pr->proto.m_szModuleName );
 		DBWriteContactSettingByte( hContact, "CList", "NotOnList", 1 );
 		sipe_miranda_setContactString( pr, hContact, SIP_UNIQUEID, who ); // name
+		sipe_miranda_buddy_cache_add(pr, hContact);
 	}
 
 	ft->backend_private = new_xfer(pr, ft, hContact);
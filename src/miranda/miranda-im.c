@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2010-11 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2010-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -55,6 +55,7 @@ void sipe_backend_im_message(struct sipe_core_public *sipe_public,
 		CallService( MS_PROTO_ADDTOCONTACT, ( WPARAM )hContact,( LPARAM )pr->proto.m_szModuleName );
 		DBWriteContactSettingByte( hContact, "CList", "NotOnList", 1 );
 		sipe_miranda_setContactString( pr, hContact, SIP_UNIQUEID, from ); // name
+		sipe_miranda_buddy_cache_add(pr, hContact);
 	}
 
 	msg = sipe_miranda_eliminate_html(html, strlen(html));
@@ -76,14 +76,13 @@ sipe_backend_media_relays_free(struct sipe_backend_media_relays *media_relays)
 }
 
 struct sipe_backend_media_stream *
-sipe_backend_media_add_stream(struct sipe_media_call *media,
-			      const gchar *id,
-			      const gchar *participant,
+sipe_backend_media_add_stream(struct sipe_media_stream *stream,
 			      SipeMediaType type,
 			      SipeIceVersion ice_version,
 			      gboolean initiator,
 			      struct sipe_backend_media_relays *media_relays,
-			      guint min_port, guint max_port)
+			      guint min_port, guint max_port,
+			      const struct sipe_media_ice_params *ice_params)
 {
 	_NIF();
 	return NULL;
@@ -134,8 +133,16 @@ sipe_backend_media_get_active_remote_candidates(struct sipe_media_call *media,
 	return NULL;
 }
 
+gboolean
+sipe_backend_media_srtp_suite_supported(SipeSrtpSuite suite)
+{
+	return(suite == SIPE_SRTP_AES_CM_128_HMAC_SHA1_80);
+}
+
+void
 sipe_backend_media_set_encryption_keys(struct sipe_media_call *media,
 				       struct sipe_media_stream *stream,
+				       SipeSrtpSuite suite,
 				       const guchar *encryption_key,
 				       const guchar *decryption_key)
 {
@@ -384,6 +391,37 @@ sipe_backend_media_read(struct sipe_backend_media *media,
 	_NIF();
 }
 
+gboolean
+sipe_backend_media_stream_get_rtp_stats(struct sipe_media_stream *stream,
+					struct sipe_media_stats *stats)
+{
+	_NIF();
+}
+
+void
+sipe_backend_media_set_video_params(struct sipe_media_stream *stream,
+				    const struct sipe_media_video_params *params)
+{
+	_NIF();
+}
+
+void
+sipe_backend_media_send_rtcp_feedback(struct sipe_media_stream *stream,
+				      const guint8 *fci,
+				      gsize length)
+{
+	_NIF();
+}
+
+gint
+sipe_backend_media_read_iov(struct sipe_media_call *call,
+			    struct sipe_media_stream *stream,
+			    const struct sipe_media_segment *segments,
+			    guint count)
+{
+	_NIF();
+}
+
 gint
 sipe_backend_media_write(struct sipe_backend_media *media,
 			 struct sipe_backend_stream *stream,
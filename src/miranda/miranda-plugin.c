@@ -649,6 +649,9 @@ void sipe_miranda_login(SIPPROTO *pr) {
 	password = g_strdup(tmp);
 	mir_free(tmp);
 
+	/* before the core looks up any contacts */
+	sipe_miranda_buddy_cache_load(pr);
+
 	LOCK;
 	pr->sip = sipe_core_allocate(username,
 //	/* @TODO: is this correct?
@@ -658,6 +661,7 @@ void sipe_miranda_login(SIPPROTO *pr) {
 				     password,
 				     email,
 				     email_url,
+				     NULL,
 				     &errmsg);
 	if (pr->sip) pr->sip->backend_private = pr;
 	sipe_public = pr->sip;
@@ -1139,6 +1143,10 @@ static HANDLE AddToList( SIPPROTO *pr, int flags, PROTOSEARCHRESULT* psr )
 		mir_free(tmp);
 	}
 
+	LOCK;
+	sipe_miranda_buddy_cache_add(pr, hContact);
+	UNLOCK;
+
 	g_free(id);
 	return hContact;
 }
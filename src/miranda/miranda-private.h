@@ -25,6 +25,7 @@ typedef enum
 } sipe_miranda_ConnectionState;
 
 struct sipe_miranda_connection_info;
+struct sipe_miranda_contact_cache;
 
 typedef struct sipe_backend_private
 {
@@ -38,6 +39,7 @@ typedef struct sipe_backend_private
 	HANDLE disconnect_timeout;
 	GSList *contactMenuChatItems;
 	DWORD main_thread_id;
+	struct sipe_miranda_contact_cache *contact_cache;
 	char _SIGNATURE[16];
 } SIPPROTO;
 
@@ -134,6 +136,12 @@ gpointer sipe_miranda_schedule_mseconds(void (*callback)(gpointer), guint timeou
 sipe_backend_buddy sipe_miranda_buddy_find(SIPPROTO *pr, const gchar *name, const gchar *group);
 GSList* sipe_miranda_buddy_find_all(SIPPROTO *pr, const gchar *buddy_name, const gchar *group_name);
 
+/* Contact settings cache, see miranda-buddy.c */
+void sipe_miranda_buddy_cache_load(SIPPROTO *pr);
+void sipe_miranda_buddy_cache_add(SIPPROTO *pr, HANDLE hContact);
+void sipe_miranda_buddy_cache_remove(SIPPROTO *pr, HANDLE hContact);
+void sipe_miranda_buddy_cache_free(SIPPROTO *pr);
+
 /* Plugin interface functions */
 int sipe_miranda_SetStatus( SIPPROTO *pr, int iNewStatus );
 int sipe_miranda_SendMsg(SIPPROTO *pr, HANDLE hContact, int flags, const char* msg);
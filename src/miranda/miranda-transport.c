@@ -42,8 +42,6 @@
 #define MIRANDA_TRANSPORT ((struct sipe_transport_miranda *) conn)
 #define SIPE_TRANSPORT_CONNECTION ((struct sipe_transport_connection *) transport)
 
-#define BUFFER_SIZE_INCREMENT 4096
-
 struct sipe_transport_miranda {
 	/* public part shared with core */
 	struct sipe_transport_connection public;
@@ -57,10 +55,19 @@ struct sipe_transport_miranda {
 
 	SIPPROTO *pr;
 
-	/* Private. For locking only */
-	HANDLE hDoneEvent;
+	/* gather buffer for sipe_backend_transport_message_iov() */
+	GString *send_buffer;
 };
 
+/* keep send buffers of normal sized messages between writes */
+#define SEND_BUFFER_KEEP 65536
+
+/*
+ * All transports are read from the select loop thread in miranda-input.c.
+ * Its event for waiting on the main thread is therefore created only once.
+ */
+static HANDLE input_done_event = NULL;
+
 static void __stdcall
 transport_input_cb_async(void *data)
 {
@@ -70,7 +77,8 @@ transport_input_cb_async(void *data)
 	LOCK;
         transport->input(conn);
 	UNLOCK;
-	SetEvent(transport->hDoneEvent);
+	/* transport may have been freed by the input callback */
+	SetEvent(input_done_event);
 }
 
 static void
@@ -101,17 +109,15 @@ miranda_sipe_input_cb(gpointer data,
 
 	do {
 		/* Increase input buffer size as needed */
-		if (conn->buffer_length < conn->buffer_used + BUFFER_SIZE_INCREMENT) {
-			conn->buffer_length += BUFFER_SIZE_INCREMENT;
-			conn->buffer = g_realloc(conn->buffer, conn->buffer_length);
-			SIPE_DEBUG_INFO("miranda_sipe_input_cb: new buffer length %" G_GSIZE_FORMAT,
-					conn->buffer_length);
+		readlen = sipe_core_transport_buffer_reserve(conn);
+		if (readlen == 0) {
+			SIPE_DEBUG_ERROR_NOFORMAT("miranda_sipe_input_cb: message exceeds maximum buffer size");
+			transport->error(SIPE_TRANSPORT_CONNECTION, "Read error");
+			UNLOCK;
+			return;
 		}
 
 		/* Try to read as much as there is space left in the buffer */
-		/* minus 1 for the string terminator */
-		readlen = conn->buffer_length - conn->buffer_used - 1;
-
 		len = Netlib_Recv(transport->fd, conn->buffer + conn->buffer_used, readlen, MSG_NODUMP);
 
 		if (len == SOCKET_ERROR) {
@@ -137,10 +143,10 @@ miranda_sipe_input_cb(gpointer data,
 	conn->buffer[conn->buffer_used] = '\0';
 	UNLOCK;
 
-	transport->hDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!input_done_event)
+		input_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
 	CallFunctionAsync(transport_input_cb_async, transport);
-	WaitForSingleObject(transport->hDoneEvent, INFINITE);
-	CloseHandle(transport->hDoneEvent);
+	WaitForSingleObject(input_done_event, INFINITE);
 }
 
 static void
@@ -199,28 +205,75 @@ void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
 	if (transport->inputhandler)
 		sipe_miranda_input_remove(transport->inputhandler);
 
+	if (transport->send_buffer)
+		g_string_free(transport->send_buffer, TRUE);
 	g_free(transport->public.buffer);
 	g_free(transport);
 }
 
-void sipe_backend_transport_message(struct sipe_transport_connection *conn,
-				    const gchar *buffer)
+static gboolean transport_send(struct sipe_transport_miranda *transport,
+			       const gchar *buffer,
+			       gsize length)
 {
-	struct sipe_transport_miranda *transport = MIRANDA_TRANSPORT;
-	guint written = 0;
+	gsize written = 0;
 
-	do {
-		int len = Netlib_Send(transport->fd, buffer + written, strlen(buffer + written), MSG_NODUMP);
+	while (written < length) {
+		int len = Netlib_Send(transport->fd, buffer + written, length - written, MSG_NODUMP);
 
 		if (len == SOCKET_ERROR) {
 			SIPE_DEBUG_INFO_NOFORMAT("sipe_backend_transport_message: error, exiting");
 			transport->error(SIPE_TRANSPORT_CONNECTION,
 					 "Write error");
-			return;
+			return(FALSE);
 		}
 
 		written += len;
-	} while (written < strlen(buffer));
+	}
+
+	return(TRUE);
+}
+
+void sipe_backend_transport_message(struct sipe_transport_connection *conn,
+				    const gchar *buffer)
+{
+	transport_send(MIRANDA_TRANSPORT, buffer, strlen(buffer));
+}
+
+void sipe_backend_transport_message_iov(struct sipe_transport_connection *conn,
+					const struct sipe_transport_segment *segments,
+					guint count)
+{
+	struct sipe_transport_miranda *transport = MIRANDA_TRANSPORT;
+	GString *buffer;
+	guint i;
+
+	if (count == 1) {
+		transport_send(transport, segments[0].data, segments[0].length);
+		return;
+	}
+
+	/*
+	 * Netlib has no gather write. Sending segment by segment would
+	 * create one TLS record and one system call per segment, so the
+	 * segments are collected into a buffer that is kept between writes.
+	 */
+	if (!transport->send_buffer)
+		transport->send_buffer = g_string_sized_new(SEND_BUFFER_KEEP);
+	buffer = transport->send_buffer;
+	for (i = 0; i < count; i++)
+		g_string_append_len(buffer,
+				    segments[i].data,
+				    segments[i].length);
+
+	/* transport might be gone after an error */
+	if (transport_send(transport, buffer->str, buffer->len)) {
+		if (buffer->allocated_len > SEND_BUFFER_KEEP) {
+			g_string_free(buffer, TRUE);
+			transport->send_buffer = NULL;
+		} else {
+			g_string_truncate(buffer, 0);
+		}
+	}
 }
 
 void sipe_backend_transport_flush(struct sipe_transport_connection *conn)
@@ -228,6 +281,12 @@ void sipe_backend_transport_flush(struct sipe_transport_connection *conn)
 	/* N/A */
 }
 
+gsize sipe_backend_transport_pending(struct sipe_transport_connection *conn)
+{
+	/* N/A: Netlib sends synchronously */
+	return(0);
+}
+
 /*
   Local Variables:
   mode: c
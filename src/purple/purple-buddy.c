@@ -28,6 +28,7 @@
 
 #include "notify.h"
 #include "request.h"
+#include "signals.h"
 
 #include "version.h"
 #if PURPLE_VERSION_CHECK(3,0,0)
@@ -94,12 +95,175 @@ static const struct {
 #define buddy_info_property(i)    buddy_info_map[i].property
 #define buddy_info_description(i) gettext(buddy_info_map[i].description)
 
+/*
+ * Buddy list transaction
+ *
+ * Between sipe_backend_buddy_list_processing_start() and _finish() alias
+ * and status changes are only recorded. They are applied in one pass at
+ * the end, i.e. a buddy that is updated several times during roster
+ * processing causes only one UI update per property.
+ */
+struct purple_buddy_pending {
+	gchar *alias;
+	gchar *server_alias;
+	gboolean set_alias;
+	gboolean set_server_alias;
+};
+
+static void buddy_pending_free(gpointer data)
+{
+	struct purple_buddy_pending *pending = data;
+
+	g_free(pending->alias);
+	g_free(pending->server_alias);
+	g_free(pending);
+}
+
+static struct purple_buddy_pending *buddy_pending(struct sipe_core_public *sipe_public,
+						  const sipe_backend_buddy who,
+						  gboolean create)
+{
+	struct sipe_backend_private *purple_private = sipe_public->backend_private;
+	struct purple_buddy_pending *pending;
+
+	if (!purple_private->blist_pending)
+		return(NULL);
+
+	pending = g_hash_table_lookup(purple_private->blist_pending, who);
+	if (!pending && create) {
+		pending = g_new0(struct purple_buddy_pending, 1);
+		g_hash_table_insert(purple_private->blist_pending, who, pending);
+	}
+
+	return(pending);
+}
+
+void sipe_purple_buddy_pending_free(struct sipe_backend_private *purple_private)
+{
+	if (purple_private->blist_pending) {
+		g_hash_table_destroy(purple_private->blist_pending);
+		purple_private->blist_pending = NULL;
+	}
+	if (purple_private->blist_pending_status) {
+		g_hash_table_destroy(purple_private->blist_pending_status);
+		purple_private->blist_pending_status = NULL;
+	}
+	purple_private->blist_processing = 0;
+}
+
+static const gchar *buddy_local_alias(struct sipe_core_public *sipe_public,
+				      const sipe_backend_buddy who)
+{
+	struct purple_buddy_pending *pending = buddy_pending(sipe_public,
+							    who,
+							    FALSE);
+
+	if (pending && pending->set_alias)
+		return(pending->alias);
+
+	return(
+#if PURPLE_VERSION_CHECK(2,6,0)
+		purple_buddy_get_local_buddy_alias(who)
+#else
+		purple_buddy_get_local_alias(who)
+#endif
+		);
+}
+
+static const gchar *buddy_server_alias(struct sipe_core_public *sipe_public,
+				       const sipe_backend_buddy who)
+{
+	struct purple_buddy_pending *pending = buddy_pending(sipe_public,
+							    who,
+							    FALSE);
+
+	if (pending && pending->set_server_alias)
+		return(pending->server_alias);
+
+	return(purple_buddy_get_server_alias(who));
+}
+
+/*
+ * Buddy lookup cache
+ *
+ * The core looks up the same URI several times while processing one
+ * message. Lookup results are cached until a buddy of this account is
+ * added to or removed from the buddy list.
+ */
+struct purple_buddy_cache_entry {
+	PurpleBuddy *buddy;  /* purple_blist_find_buddy() result */
+	GSList *buddies;     /* purple_blist_find_buddies() result */
+	gboolean has_buddy;
+	gboolean has_buddies;
+};
+
+static void buddy_cache_entry_free(gpointer data)
+{
+	struct purple_buddy_cache_entry *entry = data;
+
+	g_slist_free(entry->buddies);
+	g_free(entry);
+}
+
+static void buddy_cache_invalidate(PurpleBuddy *buddy,
+				   gpointer data)
+{
+	struct sipe_backend_private *purple_private = data;
+
+	if (purple_private->buddy_cache &&
+	    (purple_buddy_get_account(buddy) == purple_private->account))
+		g_hash_table_remove_all(purple_private->buddy_cache);
+}
+
+static struct purple_buddy_cache_entry *buddy_cache_entry(struct sipe_backend_private *purple_private,
+							  const gchar *buddy_name)
+{
+	struct purple_buddy_cache_entry *entry;
+
+	if (!purple_private->buddy_cache) {
+		purple_private->buddy_cache = g_hash_table_new_full(g_str_hash,
+								    g_str_equal,
+								    g_free,
+								    buddy_cache_entry_free);
+		purple_signal_connect(purple_blist_get_handle(),
+				      "buddy-added",
+				      purple_private,
+				      PURPLE_CALLBACK(buddy_cache_invalidate),
+				      purple_private);
+		purple_signal_connect(purple_blist_get_handle(),
+				      "buddy-removed",
+				      purple_private,
+				      PURPLE_CALLBACK(buddy_cache_invalidate),
+				      purple_private);
+	}
+
+	entry = g_hash_table_lookup(purple_private->buddy_cache, buddy_name);
+	if (!entry) {
+		entry = g_new0(struct purple_buddy_cache_entry, 1);
+		g_hash_table_insert(purple_private->buddy_cache,
+				    g_strdup(buddy_name),
+				    entry);
+	}
+
+	return(entry);
+}
+
+void sipe_purple_buddy_cache_free(struct sipe_backend_private *purple_private)
+{
+	if (purple_private->buddy_cache) {
+		purple_signals_disconnect_by_handle(purple_private);
+		g_hash_table_destroy(purple_private->buddy_cache);
+		purple_private->buddy_cache = NULL;
+	}
+}
+
 sipe_backend_buddy sipe_backend_buddy_find(struct sipe_core_public *sipe_public,
 					   const gchar *buddy_name,
 					   const gchar *group_name)
 {
 	struct sipe_backend_private *purple_private = sipe_public->backend_private;
 	PurpleGroup *purple_group;
+	struct purple_buddy_cache_entry *entry;
 
 	if (group_name)
 	{
@@ -110,10 +274,15 @@ sipe_backend_buddy sipe_backend_buddy_find(struct sipe_core_public *sipe_public,
 		return purple_blist_find_buddy_in_group(purple_private->account,
 							buddy_name,
 							purple_group);
-	} else {
-		return purple_blist_find_buddy(purple_private->account,
-					       buddy_name);
 	}
+
+	entry = buddy_cache_entry(purple_private, buddy_name);
+	if (!entry->has_buddy) {
+		entry->buddy     = purple_blist_find_buddy(purple_private->account,
+							   buddy_name);
+		entry->has_buddy = TRUE;
+	}
+	return entry->buddy;
 }
 
 GSList* sipe_backend_buddy_find_all(struct sipe_core_public *sipe_public,
@@ -121,6 +290,7 @@ GSList* sipe_backend_buddy_find_all(struct sipe_core_public *sipe_public,
 				    const gchar *group_name)
 {
 	struct sipe_backend_private *purple_private = sipe_public->backend_private;
+	struct purple_buddy_cache_entry *entry;
 
 	if (group_name)
 	{
@@ -128,7 +298,14 @@ GSList* sipe_backend_buddy_find_all(struct sipe_core_public *sipe_public,
 		return NULL;
 	}
 
-	return purple_blist_find_buddies(purple_private->account, buddy_name);
+	entry = buddy_cache_entry(purple_private, buddy_name);
+	if (!entry->has_buddies) {
+		entry->buddies     = purple_blist_find_buddies(purple_private->account,
+							       buddy_name);
+		entry->has_buddies = TRUE;
+	}
+	/* caller frees the list */
+	return g_slist_copy(entry->buddies);
 }
 
 gchar* sipe_backend_buddy_get_name(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
@@ -137,28 +314,33 @@ gchar* sipe_backend_buddy_get_name(SIPE_UNUSED_PARAMETER struct sipe_core_public
 	return g_strdup(purple_buddy_get_name((PurpleBuddy *) who));
 }
 
-gchar* sipe_backend_buddy_get_alias(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+gchar* sipe_backend_buddy_get_alias(struct sipe_core_public *sipe_public,
 				    const sipe_backend_buddy who)
 {
-	return g_strdup(purple_buddy_get_alias(who));
+	const gchar *alias;
+
+	if (!buddy_pending(sipe_public, who, FALSE))
+		return g_strdup(purple_buddy_get_alias(who));
+
+	/* same precedence as purple_buddy_get_alias() */
+	alias = buddy_local_alias(sipe_public, who);
+	if (!alias || !*alias)
+		alias = buddy_server_alias(sipe_public, who);
+	if (!alias || !*alias)
+		alias = purple_buddy_get_name(who);
+	return g_strdup(alias);
 }
 
-gchar* sipe_backend_buddy_get_server_alias(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+gchar* sipe_backend_buddy_get_server_alias(struct sipe_core_public *sipe_public,
 					   const sipe_backend_buddy who)
 {
-	return g_strdup(purple_buddy_get_server_alias(who));
+	return g_strdup(buddy_server_alias(sipe_public, who));
 }
 
-gchar *sipe_backend_buddy_get_local_alias(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+gchar *sipe_backend_buddy_get_local_alias(struct sipe_core_public *sipe_public,
 					  const sipe_backend_buddy who)
 {
-	return g_strdup(
-#if PURPLE_VERSION_CHECK(2,6,0)
-		purple_buddy_get_local_buddy_alias(who)
-#else
-		purple_buddy_get_local_alias(who)
-#endif
-		);
+	return g_strdup(buddy_local_alias(sipe_public, who));
 }
 
 gchar* sipe_backend_buddy_get_group_name(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
@@ -171,24 +353,54 @@ guint sipe_backend_buddy_get_status(struct sipe_core_public *sipe_public,
 				    const gchar *uri)
 {
 	struct sipe_backend_private *purple_private = sipe_public->backend_private;
-	PurpleBuddy *pbuddy = purple_blist_find_buddy(purple_private->account, uri);
-	const PurplePresence *presence = purple_buddy_get_presence(pbuddy);
-	const PurpleStatus *pstatus = purple_presence_get_active_status(presence);
+	PurpleBuddy *pbuddy;
+	const PurplePresence *presence;
+	const PurpleStatus *pstatus;
+	gpointer activity;
+
+	if (purple_private->blist_pending_status &&
+	    g_hash_table_lookup_extended(purple_private->blist_pending_status,
+					 uri,
+					 NULL,
+					 &activity))
+		return(GPOINTER_TO_UINT(activity));
+
+	pbuddy   = sipe_backend_buddy_find(sipe_public, uri, NULL);
+	presence = purple_buddy_get_presence(pbuddy);
+	pstatus  = purple_presence_get_active_status(presence);
 	return(sipe_purple_token_to_activity(purple_status_get_id(pstatus)));
 }
 
-void sipe_backend_buddy_set_alias(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+void sipe_backend_buddy_set_alias(struct sipe_core_public *sipe_public,
 				  const sipe_backend_buddy who,
 				  const gchar *alias)
 {
-	purple_buddy_set_local_alias(who, alias);
+	struct purple_buddy_pending *pending = buddy_pending(sipe_public,
+							    who,
+							    TRUE);
+
+	if (pending) {
+		g_free(pending->alias);
+		pending->alias     = g_strdup(alias);
+		pending->set_alias = TRUE;
+	} else
+		purple_buddy_set_local_alias(who, alias);
 }
 
-void sipe_backend_buddy_set_server_alias(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+void sipe_backend_buddy_set_server_alias(struct sipe_core_public *sipe_public,
 					 const sipe_backend_buddy who,
 					 const gchar *alias)
 {
-	purple_buddy_set_server_alias(who, alias);
+	struct purple_buddy_pending *pending = buddy_pending(sipe_public,
+							    who,
+							    TRUE);
+
+	if (pending) {
+		g_free(pending->server_alias);
+		pending->server_alias     = g_strdup(alias);
+		pending->set_server_alias = TRUE;
+	} else
+		purple_buddy_set_server_alias(who, alias);
 }
 
 gchar* sipe_backend_buddy_get_string(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
@@ -214,12 +426,63 @@ void sipe_backend_buddy_refresh_properties(SIPE_UNUSED_PARAMETER struct sipe_cor
 	/* nothing to do here: already taken care of by libpurple */
 }
 
-void sipe_backend_buddy_list_processing_start(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public)
+void sipe_backend_buddy_list_processing_start(struct sipe_core_public *sipe_public)
 {
+	struct sipe_backend_private *purple_private = sipe_public->backend_private;
+
+	if (purple_private->blist_processing++ == 0) {
+		purple_private->blist_pending        = g_hash_table_new_full(g_direct_hash,
+									     g_direct_equal,
+									     NULL,
+									     buddy_pending_free);
+		purple_private->blist_pending_status = g_hash_table_new_full(g_str_hash,
+									     g_str_equal,
+									     g_free,
+									     NULL);
+	}
 }
 
-void sipe_backend_buddy_list_processing_finish(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public)
+void sipe_backend_buddy_list_processing_finish(struct sipe_core_public *sipe_public)
 {
+	struct sipe_backend_private *purple_private = sipe_public->backend_private;
+	GHashTable *pending;
+	GHashTable *pending_status;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	/* finish without start or nested transaction */
+	if ((purple_private->blist_processing == 0) ||
+	    (--purple_private->blist_processing > 0))
+		return;
+
+	/* disable recording while changes are applied */
+	pending                              = purple_private->blist_pending;
+	pending_status                       = purple_private->blist_pending_status;
+	purple_private->blist_pending        = NULL;
+	purple_private->blist_pending_status = NULL;
+
+	SIPE_DEBUG_INFO("sipe_backend_buddy_list_processing_finish: %d alias and %d status updates",
+			g_hash_table_size(pending),
+			g_hash_table_size(pending_status));
+
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		PurpleBuddy *buddy                   = key;
+		struct purple_buddy_pending *changes = value;
+
+		if (changes->set_alias)
+			purple_buddy_set_local_alias(buddy, changes->alias);
+		if (changes->set_server_alias)
+			purple_buddy_set_server_alias(buddy, changes->server_alias);
+	}
+	g_hash_table_destroy(pending);
+
+	g_hash_table_iter_init(&iter, pending_status);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		sipe_backend_buddy_set_status(sipe_public,
+					      key,
+					      GPOINTER_TO_UINT(value));
+	g_hash_table_destroy(pending_status);
 }
 
 sipe_backend_buddy sipe_backend_buddy_add(struct sipe_core_public *sipe_public,
@@ -239,9 +502,15 @@ sipe_backend_buddy sipe_backend_buddy_add(struct sipe_core_public *sipe_public,
 	return b;
 }
 
-void sipe_backend_buddy_remove(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+void sipe_backend_buddy_remove(struct sipe_core_public *sipe_public,
 			       const sipe_backend_buddy who)
 {
+	struct sipe_backend_private *purple_private = sipe_public->backend_private;
+
+	/* drop recorded changes for this buddy */
+	if (purple_private->blist_pending)
+		g_hash_table_remove(purple_private->blist_pending, who);
+
 	purple_blist_remove_buddy(who);
 }
 
@@ -319,7 +588,15 @@ void sipe_backend_buddy_set_status(struct sipe_core_public *sipe_public,
 	PurpleStatus *status = NULL;
 	gchar *tmp = NULL;
 
-	buddy = purple_blist_find_buddy(purple_private->account, who);
+	/* buddy list transaction: only the last status is applied */
+	if (purple_private->blist_pending_status) {
+		g_hash_table_replace(purple_private->blist_pending_status,
+				     g_strdup(who),
+				     GUINT_TO_POINTER(activity));
+		return;
+	}
+
+	buddy = sipe_backend_buddy_find(sipe_public, who, NULL);
 	if (buddy)
 		status = purple_presence_get_active_status(purple_buddy_get_presence(buddy));
 
@@ -385,6 +662,17 @@ gboolean sipe_backend_buddy_group_add(SIPE_UNUSED_PARAMETER struct sipe_core_pub
 	return (purple_group != NULL);
 }
 
+gboolean sipe_backend_buddy_group_visible(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					  const gchar *group_name)
+{
+	PurpleGroup *purple_group = purple_blist_find_group(group_name);
+
+	/* Pidgin remembers collapsed groups in the buddy list */
+	return(purple_group &&
+	       !purple_blist_node_get_bool((PurpleBlistNode *) purple_group,
+					   "collapsed"));
+}
+
 gboolean sipe_backend_buddy_group_rename(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
 					 const gchar *old_name,
 					 const gchar *new_name)
@@ -49,6 +49,7 @@
 #else
 #include "blist.h"
 #define purple_chat_conversation_add_user(c, n, m, f, b) purple_conv_chat_add_user(c, n, m, f, b)
+#define purple_chat_conversation_add_users(c, u, m, f, b) purple_conv_chat_add_users(c, u, m, f, b)
 #define purple_chat_conversation_clear_users(c)          purple_conv_chat_clear_users(c)
 #define purple_chat_conversation_get_id(c)               purple_conv_chat_get_id(c)
 #define purple_chat_conversation_remove_user(c, n, s)    purple_conv_chat_remove_user(c, n, s)
@@ -330,6 +331,35 @@ void sipe_backend_chat_add(struct sipe_backend_chat_session *backend_session,
 					  is_new);
 }
 
+void sipe_backend_chat_add_many(struct sipe_backend_chat_session *backend_session,
+				const GSList *uris,
+				gboolean is_new)
+{
+	GList *users = NULL;
+	GList *flags = NULL;
+	const GSList *entry;
+
+	if (!uris)
+		return;
+
+	for (entry = uris; entry; entry = entry->next) {
+		users = g_list_prepend(users, entry->data);
+		flags = g_list_prepend(flags,
+				       GINT_TO_POINTER(PURPLE_CHAT_USER_NONE));
+	}
+	users = g_list_reverse(users);
+
+	/* user list is sorted & redrawn only once */
+	purple_chat_conversation_add_users(BACKEND_SESSION_TO_PURPLE_CONV_CHAT(backend_session),
+					   users,
+					   NULL,
+					   flags,
+					   is_new);
+
+	g_list_free(flags);
+	g_list_free(users);
+}
+
 void sipe_backend_chat_close(struct sipe_backend_chat_session *backend_session)
 {
 	purple_chat_conversation_clear_users(BACKEND_SESSION_TO_PURPLE_CONV_CHAT(backend_session));
@@ -26,6 +26,7 @@
 #include "debug.h"
 
 #include "sipe-backend.h"
+#include "sipe-core.h"
 
 #ifdef ADIUM
 /*
@@ -43,6 +44,10 @@ gboolean AIDebugLoggingIsEnabled(void);
 void sipe_backend_debug_literal(sipe_debug_level level,
 				const gchar *msg)
 {
+	/* debug log file replaces synchronous libpurple output */
+	if (sipe_core_debug_log(level, msg))
+		return;
+
 	if (SIPE_PURPLE_DEBUG_IS_ENABLED) {
 
 		/* purple_debug doesn't have a vprintf-like API call :-( */
@@ -68,7 +73,7 @@ void sipe_backend_debug(sipe_debug_level level,
 
 	va_start(ap, format);
 
-	if (SIPE_PURPLE_DEBUG_IS_ENABLED) {
+	if (sipe_backend_debug_enabled()) {
 
 		/* purple_debug doesn't have a vprintf-like API call :-( */
 		gchar *msg = g_strdup_vprintf(format, ap);
@@ -81,7 +86,7 @@ void sipe_backend_debug(sipe_debug_level level,
 
 gboolean sipe_backend_debug_enabled(void)
 {
-	return SIPE_PURPLE_DEBUG_IS_ENABLED;
+	return SIPE_PURPLE_DEBUG_IS_ENABLED || sipe_core_debug_log_active();
 }
 
 /*
@@ -157,6 +157,70 @@ gssize sipe_backend_ft_read_file(struct sipe_file_transfer *ft, guchar *data,
 	return bytes_read;
 }
 
+struct sipe_ft_source *sipe_backend_ft_open_source(struct sipe_core_public *sipe_public,
+						   struct sipe_file_transfer *ft)
+{
+	PurpleXfer *xfer = FT_TO_PURPLE_XFER;
+#if PURPLE_VERSION_CHECK(3,0,0) || PURPLE_VERSION_CHECK(2,6,0)
+	PurpleXferUiOps *ui_ops = purple_xfer_get_ui_ops(xfer);
+
+	/* UI supplies the data itself */
+	if (ui_ops && ui_ops->ui_read)
+		return(NULL);
+#endif
+
+	return(sipe_core_ft_source_open(sipe_public,
+					purple_xfer_get_local_filename(xfer)));
+}
+
+void sipe_backend_ft_source_sent(struct sipe_file_transfer *ft,
+				 gsize size)
+{
+	PurpleXfer *xfer = FT_TO_PURPLE_XFER;
+
+	purple_xfer_set_bytes_sent(xfer,
+				   purple_xfer_get_bytes_sent(xfer) + size);
+	purple_xfer_update_progress(xfer);
+
+	if (purple_xfer_get_bytes_remaining(xfer) == 0 &&
+	    !purple_xfer_is_completed(xfer)) {
+		purple_xfer_set_completed(xfer, TRUE);
+		g_timeout_add_seconds(0, end_transfer_cb, (gpointer)xfer);
+	}
+}
+
+struct sipe_ft_sink *sipe_backend_ft_open_sink(struct sipe_core_public *sipe_public,
+					       struct sipe_file_transfer *ft)
+{
+	PurpleXfer *xfer = FT_TO_PURPLE_XFER;
+#if PURPLE_VERSION_CHECK(3,0,0) || PURPLE_VERSION_CHECK(2,6,0)
+	PurpleXferUiOps *ui_ops = purple_xfer_get_ui_ops(xfer);
+
+	/* UI consumes the data itself */
+	if (ui_ops && ui_ops->ui_write)
+		return(NULL);
+#endif
+
+	return(sipe_core_ft_sink_open(sipe_public,
+				      purple_xfer_get_local_filename(xfer)));
+}
+
+void sipe_backend_ft_sink_written(struct sipe_file_transfer *ft,
+				  gsize size)
+{
+	PurpleXfer *xfer = FT_TO_PURPLE_XFER;
+
+	purple_xfer_set_bytes_sent(xfer,
+				   purple_xfer_get_bytes_sent(xfer) + size);
+	purple_xfer_update_progress(xfer);
+
+	if (purple_xfer_get_bytes_remaining(xfer) == 0 &&
+	    !purple_xfer_is_completed(xfer)) {
+		purple_xfer_set_completed(xfer, TRUE);
+		g_timeout_add_seconds(0, end_transfer_cb, (gpointer)xfer);
+	}
+}
+
 gssize sipe_backend_ft_write_file(struct sipe_file_transfer *ft,
 				  const guchar *data,
 				  gsize size)
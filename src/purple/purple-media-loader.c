@@ -0,0 +1,667 @@
+/**
+ * @file purple-media-loader.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Voice & video backend: on demand loading
+ *
+ * Implements the media backend API of sipe-backend.h by forwarding
+ * into the voice & video backend module. The module is loaded by the
+ * first call that needs it. Releasing objects never triggers a load,
+ * because they can only have been created by a loaded module.
+ *
+ * If the module can't be loaded the functions return failure, i.e. the
+ * core fails the call setup. The failure is remembered and logged once.
+ *
+ * See purple-media-module.h.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+#include <gmodule.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+
+#include "purple-private.h"
+#include "purple-media-module.h"
+
+static const struct sipe_purple_media_core media_core = {
+	SIPE_PURPLE_MEDIA_MODULE_API,
+	sipe_backend_debug_literal,
+	sipe_backend_debug_enabled,
+	sipe_strequal,
+	sipe_core_media_get_stream_by_id,
+	sipe_core_media_candidate_pair_established,
+#ifdef HAVE_FREERDP
+	sipe_core_applicationsharing_stop_presenting,
+#endif
+};
+
+static const struct sipe_purple_media_module *media_module_loaded = NULL;
+static gboolean media_module_failed = FALSE;
+
+static const struct sipe_purple_media_module *media_module_load(void)
+{
+	gchar *path = g_module_build_path(SIPE_PURPLE_VV_MODULE_DIR,
+					  SIPE_PURPLE_MEDIA_MODULE_NAME);
+	GModule *handle = g_module_open(path,
+					G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+	gpointer init = NULL;
+	const struct sipe_purple_media_module *module = NULL;
+
+	if (!handle) {
+		SIPE_DEBUG_ERROR("media_module_load: can't load '%s': %s",
+				 path, g_module_error());
+	} else if (!g_module_symbol(handle,
+				    SIPE_PURPLE_MEDIA_MODULE_INIT,
+				    &init) ||
+		   ((module = (*(sipe_purple_media_module_init_func) init)(&media_core)) == NULL)) {
+		SIPE_DEBUG_ERROR("media_module_load: '%s' is not a compatible voice & video module",
+				 path);
+		g_module_close(handle);
+	} else {
+		/* GStreamer & GObject keep references to module code */
+		g_module_make_resident(handle);
+		SIPE_DEBUG_INFO("media_module_load: loaded '%s'", path);
+	}
+
+	g_free(path);
+	return(module);
+}
+
+static const struct sipe_purple_media_module *media_module(gboolean load)
+{
+	if (!media_module_loaded && load && !media_module_failed) {
+		media_module_loaded = media_module_load();
+		media_module_failed = (media_module_loaded == NULL);
+	}
+	return(media_module_loaded);
+}
+
+void
+capture_pipeline(const gchar *label)
+{
+	/* debugging aid: no pipeline exists before the module is loaded */
+	const struct sipe_purple_media_module *module = media_module(FALSE);
+	if (module)
+		(*module->capture_pipeline)(label);
+}
+
+struct sipe_backend_media *
+sipe_backend_media_new(struct sipe_core_public *sipe_public,
+		       struct sipe_media_call *call,
+		       const gchar *participant,
+		       gboolean initiator,
+		       gboolean hidden_from_ui)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->media_new)(sipe_public, call, participant, initiator,
+				    hidden_from_ui));
+}
+
+void
+sipe_backend_media_free(struct sipe_backend_media *media)
+{
+	const struct sipe_purple_media_module *module = media_module(FALSE);
+	if (module)
+		(*module->media_free)(media);
+}
+
+void
+sipe_backend_media_set_cname(struct sipe_backend_media *media,
+			     gchar *cname)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_set_cname)(media, cname);
+}
+
+struct sipe_backend_media_stream *
+sipe_backend_media_add_stream(struct sipe_media_stream *stream,
+			      SipeMediaType type,
+			      SipeIceVersion ice_version,
+			      gboolean initiator,
+			      struct sipe_backend_media_relays *media_relays,
+			      guint min_port,
+			      guint max_port,
+			      const struct sipe_media_ice_params *ice_params)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->media_add_stream)(stream, type, ice_version, initiator,
+					   media_relays, min_port, max_port,
+					   ice_params));
+}
+
+struct sipe_backend_media_relays *
+sipe_backend_media_relays_convert(GSList *media_relays,
+				  gchar *username,
+				  gchar *password)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->media_relays_convert)(media_relays, username,
+					       password));
+}
+
+void
+sipe_backend_media_relays_free(struct sipe_backend_media_relays *media_relays)
+{
+	const struct sipe_purple_media_module *module = media_module(FALSE);
+	if (module)
+		(*module->media_relays_free)(media_relays);
+}
+
+void
+sipe_backend_media_add_remote_candidates(struct sipe_media_call *media,
+					 struct sipe_media_stream *stream,
+					 GList *candidates)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_add_remote_candidates)(media, stream,
+						       candidates);
+}
+
+gboolean
+sipe_backend_media_is_initiator(struct sipe_media_call *media,
+				struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->media_is_initiator)(media, stream));
+}
+
+gboolean
+sipe_backend_media_accepted(struct sipe_backend_media *media)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->media_accepted)(media));
+}
+
+gboolean
+sipe_backend_stream_initialized(struct sipe_media_call *media,
+				struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->stream_initialized)(media, stream));
+}
+
+GList *
+sipe_backend_media_get_active_local_candidates(struct sipe_media_call *media,
+					       struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->media_get_active_local_candidates)(media, stream));
+}
+
+GList *
+sipe_backend_media_get_active_remote_candidates(struct sipe_media_call *media,
+						struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->media_get_active_remote_candidates)(media, stream));
+}
+
+gboolean
+sipe_backend_media_srtp_suite_supported(SipeSrtpSuite suite)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->media_srtp_suite_supported)(suite));
+}
+
+void
+sipe_backend_media_set_encryption_keys(struct sipe_media_call *media,
+				       struct sipe_media_stream *stream,
+				       SipeSrtpSuite suite,
+				       const guchar *encryption_key,
+				       const guchar *decryption_key)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_set_encryption_keys)(media, stream, suite,
+						     encryption_key,
+						     decryption_key);
+}
+
+void
+sipe_backend_stream_hold(struct sipe_media_call *media,
+			 struct sipe_media_stream *stream,
+			 gboolean local)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->stream_hold)(media, stream, local);
+}
+
+void
+sipe_backend_stream_unhold(struct sipe_media_call *media,
+			   struct sipe_media_stream *stream,
+			   gboolean local)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->stream_unhold)(media, stream, local);
+}
+
+gboolean
+sipe_backend_stream_is_held(struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->stream_is_held)(stream));
+}
+
+void
+sipe_backend_media_stream_end(struct sipe_media_call *media,
+			      struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_stream_end)(media, stream);
+}
+
+void
+sipe_backend_media_stream_free(struct sipe_backend_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(FALSE);
+	if (module)
+		(*module->media_stream_free)(stream);
+}
+
+struct sipe_backend_codec *
+sipe_backend_codec_new(int id,
+		       const char *name,
+		       SipeMediaType type,
+		       guint clock_rate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->codec_new)(id, name, type, clock_rate));
+}
+
+void
+sipe_backend_codec_free(struct sipe_backend_codec *codec)
+{
+	const struct sipe_purple_media_module *module = media_module(FALSE);
+	if (module)
+		(*module->codec_free)(codec);
+}
+
+int
+sipe_backend_codec_get_id(struct sipe_backend_codec *codec)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->codec_get_id)(codec));
+}
+
+gchar *
+sipe_backend_codec_get_name(struct sipe_backend_codec *codec)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->codec_get_name)(codec));
+}
+
+guint
+sipe_backend_codec_get_clock_rate(struct sipe_backend_codec *codec)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->codec_get_clock_rate)(codec));
+}
+
+void
+sipe_backend_codec_add_optional_parameter(struct sipe_backend_codec *codec,
+					  const gchar *name,
+					  const gchar *value)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->codec_add_optional_parameter)(codec, name, value);
+}
+
+GList *
+sipe_backend_codec_get_optional_parameters(struct sipe_backend_codec *codec)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->codec_get_optional_parameters)(codec));
+}
+
+gboolean
+sipe_backend_set_remote_codecs(struct sipe_media_call *media,
+			       struct sipe_media_stream *stream,
+			       GList *codecs)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->set_remote_codecs)(media, stream, codecs));
+}
+
+GList *
+sipe_backend_get_local_codecs(struct sipe_media_call *media,
+			      struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->get_local_codecs)(media, stream));
+}
+
+struct sipe_backend_candidate *
+sipe_backend_candidate_new(const gchar *foundation,
+			   SipeComponentType component,
+			   SipeCandidateType type,
+			   SipeNetworkProtocol proto,
+			   const gchar *ip,
+			   guint port,
+			   const gchar *username,
+			   const gchar *password)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->candidate_new)(foundation, component, type, proto, ip,
+					port, username, password));
+}
+
+void
+sipe_backend_candidate_free(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(FALSE);
+	if (module)
+		(*module->candidate_free)(candidate);
+}
+
+gchar *
+sipe_backend_candidate_get_username(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->candidate_get_username)(candidate));
+}
+
+gchar *
+sipe_backend_candidate_get_password(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->candidate_get_password)(candidate));
+}
+
+gchar *
+sipe_backend_candidate_get_foundation(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->candidate_get_foundation)(candidate));
+}
+
+gchar *
+sipe_backend_candidate_get_ip(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->candidate_get_ip)(candidate));
+}
+
+guint
+sipe_backend_candidate_get_port(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->candidate_get_port)(candidate));
+}
+
+gchar *
+sipe_backend_candidate_get_base_ip(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->candidate_get_base_ip)(candidate));
+}
+
+guint
+sipe_backend_candidate_get_base_port(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->candidate_get_base_port)(candidate));
+}
+
+guint32
+sipe_backend_candidate_get_priority(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->candidate_get_priority)(candidate));
+}
+
+void
+sipe_backend_candidate_set_priority(struct sipe_backend_candidate *candidate,
+				    guint32 priority)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->candidate_set_priority)(candidate, priority);
+}
+
+SipeComponentType
+sipe_backend_candidate_get_component_type(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(SIPE_COMPONENT_NONE);
+	return((*module->candidate_get_component_type)(candidate));
+}
+
+SipeCandidateType
+sipe_backend_candidate_get_type(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(SIPE_CANDIDATE_TYPE_ANY);
+	return((*module->candidate_get_type)(candidate));
+}
+
+SipeNetworkProtocol
+sipe_backend_candidate_get_protocol(struct sipe_backend_candidate *candidate)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(SIPE_NETWORK_PROTOCOL_UDP);
+	return((*module->candidate_get_protocol)(candidate));
+}
+
+GList *
+sipe_backend_get_local_candidates(struct sipe_media_call *media,
+				  struct sipe_media_stream *stream)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->get_local_candidates)(media, stream));
+}
+
+void
+sipe_backend_media_accept(struct sipe_backend_media *media,
+			  gboolean local)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_accept)(media, local);
+}
+
+void
+sipe_backend_media_hangup(struct sipe_backend_media *media,
+			  gboolean local)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_hangup)(media, local);
+}
+
+void
+sipe_backend_media_reject(struct sipe_backend_media *media,
+			  gboolean local)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_reject)(media, local);
+}
+
+gint
+sipe_backend_media_read(struct sipe_media_call *call,
+			struct sipe_media_stream *stream,
+			guint8 *buffer,
+			guint buffer_len,
+			gboolean blocking)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->media_read)(call, stream, buffer, buffer_len,
+				     blocking));
+}
+
+gint
+sipe_backend_media_write(struct sipe_media_call *call,
+			 struct sipe_media_stream *stream,
+			 guint8 *buffer,
+			 guint buffer_len,
+			 gboolean blocking)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->media_write)(call, stream, buffer, buffer_len,
+				      blocking));
+}
+
+gboolean
+sipe_backend_media_stream_get_rtp_stats(struct sipe_media_stream *stream,
+					struct sipe_media_stats *stats)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(FALSE);
+	return((*module->media_stream_get_rtp_stats)(stream, stats));
+}
+
+void
+sipe_backend_media_set_video_params(struct sipe_media_stream *stream,
+				    const struct sipe_media_video_params *params)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_set_video_params)(stream, params);
+}
+
+void
+sipe_backend_media_send_rtcp_feedback(struct sipe_media_stream *stream,
+				      const guint8 *fci,
+				      gsize length)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (module)
+		(*module->media_send_rtcp_feedback)(stream, fci, length);
+}
+
+gint
+sipe_backend_media_read_iov(struct sipe_media_call *call,
+			    struct sipe_media_stream *stream,
+			    const struct sipe_media_segment *segments,
+			    guint count)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(0);
+	return((*module->media_read_iov)(call, stream, segments, count));
+}
+
+#ifdef HAVE_FREERDP
+struct sipe_user_ask_ctx *
+sipe_backend_applicationsharing_show_presenter_actions(struct sipe_core_public *sipe_public,
+						       const gchar *message,
+						       struct sipe_appshare *appshare)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(NULL);
+	return((*module->applicationsharing_show_presenter_actions)(sipe_public,
+								    message,
+								    appshare));
+}
+#endif
+
+SipeEncryptionPolicy
+sipe_backend_media_get_encryption_policy(struct sipe_core_public *sipe_public)
+{
+	const struct sipe_purple_media_module *module = media_module(TRUE);
+	if (!module)
+		return(SIPE_ENCRYPTION_POLICY_REJECTED);
+	return((*module->media_get_encryption_policy)(sipe_public));
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,178 @@
+/**
+ * @file purple-media-module.c
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Voice & video backend module: entry point
+ *
+ * Provides the plugin functions that purple-media.c and
+ * purple-applicationsharing.c call, forwarded through the table handed
+ * over by the plugin. See purple-media-module.h.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+
+#include <glib.h>
+#include <gmodule.h>
+
+#include "sipe-backend.h"
+#include "sipe-core.h"
+
+#include "purple-private.h"
+#include "purple-media-module.h"
+
+static const struct sipe_purple_media_core *core = NULL;
+
+/* plugin functions */
+void sipe_backend_debug_literal(sipe_debug_level level,
+				const gchar *msg)
+{
+	(*core->debug_literal)(level, msg);
+}
+
+void sipe_backend_debug(sipe_debug_level level,
+			const gchar *format,
+			...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	if ((*core->debug_enabled)()) {
+		gchar *msg = g_strdup_vprintf(format, ap);
+		(*core->debug_literal)(level, msg);
+		g_free(msg);
+	}
+	va_end(ap);
+}
+
+gboolean sipe_backend_debug_enabled(void)
+{
+	return((*core->debug_enabled)());
+}
+
+gboolean sipe_strequal(const gchar *left, const gchar *right)
+{
+	return((*core->strequal)(left, right));
+}
+
+struct sipe_media_stream *
+sipe_core_media_get_stream_by_id(struct sipe_media_call *call,
+				 const gchar *id)
+{
+	return((*core->media_get_stream_by_id)(call, id));
+}
+
+void sipe_core_media_candidate_pair_established(struct sipe_media_call *call,
+						struct sipe_media_stream *stream)
+{
+	(*core->media_candidate_pair_established)(call, stream);
+}
+
+#ifdef HAVE_FREERDP
+void sipe_core_applicationsharing_stop_presenting(struct sipe_appshare *appshare)
+{
+	(*core->applicationsharing_stop_presenting)(appshare);
+}
+#endif
+
+static const struct sipe_purple_media_module module = {
+	SIPE_PURPLE_MEDIA_MODULE_API,
+	capture_pipeline,
+	sipe_backend_media_new,
+	sipe_backend_media_free,
+	sipe_backend_media_set_cname,
+	sipe_backend_media_add_stream,
+	sipe_backend_media_relays_convert,
+	sipe_backend_media_relays_free,
+	sipe_backend_media_add_remote_candidates,
+	sipe_backend_media_is_initiator,
+	sipe_backend_media_accepted,
+	sipe_backend_stream_initialized,
+	sipe_backend_media_get_active_local_candidates,
+	sipe_backend_media_get_active_remote_candidates,
+	sipe_backend_media_srtp_suite_supported,
+	sipe_backend_media_set_encryption_keys,
+	sipe_backend_stream_hold,
+	sipe_backend_stream_unhold,
+	sipe_backend_stream_is_held,
+	sipe_backend_media_stream_end,
+	sipe_backend_media_stream_free,
+	sipe_backend_codec_new,
+	sipe_backend_codec_free,
+	sipe_backend_codec_get_id,
+	sipe_backend_codec_get_name,
+	sipe_backend_codec_get_clock_rate,
+	sipe_backend_codec_add_optional_parameter,
+	sipe_backend_codec_get_optional_parameters,
+	sipe_backend_set_remote_codecs,
+	sipe_backend_get_local_codecs,
+	sipe_backend_candidate_new,
+	sipe_backend_candidate_free,
+	sipe_backend_candidate_get_username,
+	sipe_backend_candidate_get_password,
+	sipe_backend_candidate_get_foundation,
+	sipe_backend_candidate_get_ip,
+	sipe_backend_candidate_get_port,
+	sipe_backend_candidate_get_base_ip,
+	sipe_backend_candidate_get_base_port,
+	sipe_backend_candidate_get_priority,
+	sipe_backend_candidate_set_priority,
+	sipe_backend_candidate_get_component_type,
+	sipe_backend_candidate_get_type,
+	sipe_backend_candidate_get_protocol,
+	sipe_backend_get_local_candidates,
+	sipe_backend_media_accept,
+	sipe_backend_media_hangup,
+	sipe_backend_media_reject,
+	sipe_backend_media_read,
+	sipe_backend_media_write,
+	sipe_backend_media_stream_get_rtp_stats,
+	sipe_backend_media_set_video_params,
+	sipe_backend_media_send_rtcp_feedback,
+	sipe_backend_media_read_iov,
+#ifdef HAVE_FREERDP
+	sipe_backend_applicationsharing_show_presenter_actions,
+#endif
+	sipe_backend_media_get_encryption_policy,
+};
+
+G_MODULE_EXPORT const struct sipe_purple_media_module *
+sipe_purple_media_module_init(const struct sipe_purple_media_core *plugin)
+{
+	if (plugin->api != SIPE_PURPLE_MEDIA_MODULE_API)
+		return(NULL);
+
+	core = plugin;
+	return(&module);
+}
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -0,0 +1,214 @@
+/**
+ * @file purple-media-module.h
+ *
+ * pidgin-sipe
+ *
+ * Copyright (C) 2015 SIPE Project <http://sipe.sourceforge.net/>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Interface between the plugin and the voice & video backend module
+ *
+ * Unless configured with --disable-vv-module, the code in purple-media.c
+ * and purple-applicationsharing.c is built into a separate module. It is
+ * loaded by purple-media-loader.c when the core first needs the media
+ * backend, i.e. when a call is set up or offered. IM-only accounts never
+ * map GStreamer, Farstream and libnice through the plugin.
+ *
+ * libpurple opens the plugin with local symbol binding. Therefore the
+ * module can't resolve any symbol of the plugin. All calls in both
+ * directions go through the function tables below.
+ *
+ * Both sides are always built from the same tree. The API version only
+ * protects against a stale module left over from an older installation.
+ *
+ * Needs to include in this order:
+ *
+ * #include <glib.h>
+ * #include "sipe-backend.h"
+ * #include "sipe-core.h"
+ */
+
+#define SIPE_PURPLE_MEDIA_MODULE_API 1
+
+/* name of the module (without prefix & suffix) and its entry point */
+#define SIPE_PURPLE_MEDIA_MODULE_NAME "sipe_vv"
+#define SIPE_PURPLE_MEDIA_MODULE_INIT "sipe_purple_media_module_init"
+
+/* plugin functions used by the module */
+struct sipe_purple_media_core {
+	guint api;
+	void (*debug_literal)(sipe_debug_level level,
+			      const gchar *msg);
+	gboolean (*debug_enabled)(void);
+	gboolean (*strequal)(const gchar *left,
+			     const gchar *right);
+	struct sipe_media_stream *(*media_get_stream_by_id)(struct sipe_media_call *call,
+							    const gchar *id);
+	void (*media_candidate_pair_established)(struct sipe_media_call *call,
+						 struct sipe_media_stream *stream);
+#ifdef HAVE_FREERDP
+	void (*applicationsharing_stop_presenting)(struct sipe_appshare *appshare);
+#endif
+};
+
+/* module functions used by the plugin: see sipe-backend.h */
+struct sipe_purple_media_module {
+	guint api;
+	void (*capture_pipeline)(const gchar *label);
+	struct sipe_backend_media *(*media_new)(struct sipe_core_public *sipe_public,
+						struct sipe_media_call *call,
+						const gchar *participant,
+						gboolean initiator,
+						gboolean hidden_from_ui);
+	void (*media_free)(struct sipe_backend_media *media);
+	void (*media_set_cname)(struct sipe_backend_media *media,
+				gchar *cname);
+	struct sipe_backend_media_stream *(*media_add_stream)(struct sipe_media_stream *stream,
+							      SipeMediaType type,
+							      SipeIceVersion ice_version,
+							      gboolean initiator,
+							      struct sipe_backend_media_relays *media_relays,
+							      guint min_port,
+							      guint max_port,
+							      const struct sipe_media_ice_params *ice_params);
+	struct sipe_backend_media_relays *(*media_relays_convert)(GSList *media_relays,
+								  gchar *username,
+								  gchar *password);
+	void (*media_relays_free)(struct sipe_backend_media_relays *media_relays);
+	void (*media_add_remote_candidates)(struct sipe_media_call *media,
+					    struct sipe_media_stream *stream,
+					    GList *candidates);
+	gboolean (*media_is_initiator)(struct sipe_media_call *media,
+				       struct sipe_media_stream *stream);
+	gboolean (*media_accepted)(struct sipe_backend_media *media);
+	gboolean (*stream_initialized)(struct sipe_media_call *media,
+				       struct sipe_media_stream *stream);
+	GList *(*media_get_active_local_candidates)(struct sipe_media_call *media,
+						    struct sipe_media_stream *stream);
+	GList *(*media_get_active_remote_candidates)(struct sipe_media_call *media,
+						     struct sipe_media_stream *stream);
+	gboolean (*media_srtp_suite_supported)(SipeSrtpSuite suite);
+	void (*media_set_encryption_keys)(struct sipe_media_call *media,
+					  struct sipe_media_stream *stream,
+					  SipeSrtpSuite suite,
+					  const guchar *encryption_key,
+					  const guchar *decryption_key);
+	void (*stream_hold)(struct sipe_media_call *media,
+			    struct sipe_media_stream *stream,
+			    gboolean local);
+	void (*stream_unhold)(struct sipe_media_call *media,
+			      struct sipe_media_stream *stream,
+			      gboolean local);
+	gboolean (*stream_is_held)(struct sipe_media_stream *stream);
+	void (*media_stream_end)(struct sipe_media_call *media,
+				 struct sipe_media_stream *stream);
+	void (*media_stream_free)(struct sipe_backend_media_stream *stream);
+	struct sipe_backend_codec *(*codec_new)(int id,
+						const char *name,
+						SipeMediaType type,
+						guint clock_rate);
+	void (*codec_free)(struct sipe_backend_codec *codec);
+	int (*codec_get_id)(struct sipe_backend_codec *codec);
+	gchar *(*codec_get_name)(struct sipe_backend_codec *codec);
+	guint (*codec_get_clock_rate)(struct sipe_backend_codec *codec);
+	void (*codec_add_optional_parameter)(struct sipe_backend_codec *codec,
+					     const gchar *name,
+					     const gchar *value);
+	GList *(*codec_get_optional_parameters)(struct sipe_backend_codec *codec);
+	gboolean (*set_remote_codecs)(struct sipe_media_call *media,
+				      struct sipe_media_stream *stream,
+				      GList *codecs);
+	GList *(*get_local_codecs)(struct sipe_media_call *media,
+				   struct sipe_media_stream *stream);
+	struct sipe_backend_candidate *(*candidate_new)(const gchar *foundation,
+							SipeComponentType component,
+							SipeCandidateType type,
+							SipeNetworkProtocol proto,
+							const gchar *ip,
+							guint port,
+							const gchar *username,
+							const gchar *password);
+	void (*candidate_free)(struct sipe_backend_candidate *candidate);
+	gchar *(*candidate_get_username)(struct sipe_backend_candidate *candidate);
+	gchar *(*candidate_get_password)(struct sipe_backend_candidate *candidate);
+	gchar *(*candidate_get_foundation)(struct sipe_backend_candidate *candidate);
+	gchar *(*candidate_get_ip)(struct sipe_backend_candidate *candidate);
+	guint (*candidate_get_port)(struct sipe_backend_candidate *candidate);
+	gchar *(*candidate_get_base_ip)(struct sipe_backend_candidate *candidate);
+	guint (*candidate_get_base_port)(struct sipe_backend_candidate *candidate);
+	guint32 (*candidate_get_priority)(struct sipe_backend_candidate *candidate);
+	void (*candidate_set_priority)(struct sipe_backend_candidate *candidate,
+				       guint32 priority);
+	SipeComponentType (*candidate_get_component_type)(struct sipe_backend_candidate *candidate);
+	SipeCandidateType (*candidate_get_type)(struct sipe_backend_candidate *candidate);
+	SipeNetworkProtocol (*candidate_get_protocol)(struct sipe_backend_candidate *candidate);
+	GList *(*get_local_candidates)(struct sipe_media_call *media,
+				       struct sipe_media_stream *stream);
+	void (*media_accept)(struct sipe_backend_media *media,
+			     gboolean local);
+	void (*media_hangup)(struct sipe_backend_media *media,
+			     gboolean local);
+	void (*media_reject)(struct sipe_backend_media *media,
+			     gboolean local);
+	gint (*media_read)(struct sipe_media_call *call,
+			   struct sipe_media_stream *stream,
+			   guint8 *buffer,
+			   guint buffer_len,
+			   gboolean blocking);
+	gint (*media_write)(struct sipe_media_call *call,
+			    struct sipe_media_stream *stream,
+			    guint8 *buffer,
+			    guint buffer_len,
+			    gboolean blocking);
+	gboolean (*media_stream_get_rtp_stats)(struct sipe_media_stream *stream,
+					       struct sipe_media_stats *stats);
+	void (*media_set_video_params)(struct sipe_media_stream *stream,
+				       const struct sipe_media_video_params *params);
+	void (*media_send_rtcp_feedback)(struct sipe_media_stream *stream,
+					 const guint8 *fci,
+					 gsize length);
+	gint (*media_read_iov)(struct sipe_media_call *call,
+			       struct sipe_media_stream *stream,
+			       const struct sipe_media_segment *segments,
+			       guint count);
+#ifdef HAVE_FREERDP
+	struct sipe_user_ask_ctx *(*applicationsharing_show_presenter_actions)(struct sipe_core_public *sipe_public,
+									       const gchar *message,
+									       struct sipe_appshare *appshare);
+#endif
+	SipeEncryptionPolicy (*media_get_encryption_policy)(struct sipe_core_public *sipe_public);
+};
+
+/**
+ * Module entry point
+ *
+ * @param core plugin functions, must stay valid while the process runs
+ *
+ * @return module functions or @c NULL if @c core->api doesn't match
+ */
+const struct sipe_purple_media_module *sipe_purple_media_module_init(const struct sipe_purple_media_core *core);
+typedef const struct sipe_purple_media_module *(*sipe_purple_media_module_init_func)(const struct sipe_purple_media_core *core);
+
+/*
+  Local Variables:
+  mode: c
+  c-file-style: "bsd"
+  indent-tabs-mode: t
+  tab-width: 8
+  End:
+*/
@@ -71,6 +71,9 @@ struct sipe_backend_media {
 
 	gboolean has_rtp_candidate_pair;
 	gboolean has_rtcp_candidate_pair;
+
+	/* Farstream numbers sessions in the order they are added */
+	guint rtp_sessions;
 };
 
 struct sipe_backend_media_stream {
@@ -78,6 +81,19 @@ struct sipe_backend_media_stream {
 	gboolean remote_on_hold;
 	gboolean accepted;
 	gboolean initialized_cb_was_fired;
+
+	/* id of the rtpbin session carrying this stream */
+	guint rtp_session_id;
+
+	/* application data callbacks registered for this stream */
+	PurpleMedia *app_data_media;
+	gchar *app_data_session_id;
+	gchar *app_data_participant;
+
+	/* RTCP feedback waiting for the next report, see rtcp_feedback lock */
+	GObject *rtcp_session;
+	gulong rtcp_handler_id;
+	GByteArray *rtcp_feedback;
 };
 
 #if PURPLE_VERSION_CHECK(3,0,0)
@@ -86,9 +102,33 @@ struct sipe_backend_media_stream {
 #define SIPE_RELAYS_G_TYPE G_TYPE_VALUE_ARRAY
 #endif
 
+/* RTCP is generated on a streaming thread */
+G_LOCK_DEFINE_STATIC(rtcp_feedback);
+
 void
 sipe_backend_media_stream_free(struct sipe_backend_media_stream *stream)
 {
+	if (stream->app_data_media) {
+		/* callbacks must not see the freed stream */
+		purple_media_manager_set_application_data_callbacks(
+				purple_media_manager_get(),
+				stream->app_data_media,
+				stream->app_data_session_id,
+				stream->app_data_participant,
+				NULL, NULL, NULL);
+		g_object_unref(stream->app_data_media);
+		g_free(stream->app_data_session_id);
+		g_free(stream->app_data_participant);
+	}
+	if (stream->rtcp_session) {
+		g_signal_handler_disconnect(stream->rtcp_session,
+					    stream->rtcp_handler_id);
+		g_object_unref(stream->rtcp_session);
+	}
+	G_LOCK(rtcp_feedback);
+	if (stream->rtcp_feedback)
+		g_byte_array_free(stream->rtcp_feedback, TRUE);
+	G_UNLOCK(rtcp_feedback);
 	g_free(stream);
 }
 
@@ -359,19 +399,75 @@ sipe_backend_media_set_cname(struct sipe_backend_media *media, gchar *cname)
 	"[audio/PCMU]\n" \
 	"farsight-send-profile=audioconvert ! audioresample ! audioconvert ! mulawenc ! rtppcmupay min-ptime=20000000 max-ptime=20000000\n";
 
+#if GST_CHECK_VERSION(1,0,0)
+/* hardware accelerated video codecs, preferred when available */
+static const struct {
+	const gchar *encoder;
+	const gchar *decoder;
+	const gchar *conf;
+} hardware_codecs[] = {
+	{ "vaapih264enc", "vaapih264dec",
+	  "[video/H264]\n"
+	  "farsight-send-profile=videoconvert ! vaapih264enc ! rtph264pay\n"
+	  "farsight-recv-profile=rtph264depay ! vaapih264dec ! videoconvert\n" },
+	{ "vah264enc", "vah264dec",
+	  "[video/H264]\n"
+	  "farsight-send-profile=videoconvert ! vah264enc ! rtph264pay\n"
+	  "farsight-recv-profile=rtph264depay ! vah264dec ! videoconvert\n" },
+};
+
+static gboolean
+element_available(const gchar *name)
+{
+	GstElementFactory *factory = gst_element_factory_find(name);
+
+	if (factory) {
+		gst_object_unref(factory);
+		return(TRUE);
+	}
+	return(FALSE);
+}
+#endif
+
+/* codec capabilities don't change while we are running */
 static void
 ensure_codecs_conf()
 {
+	static gboolean checked = FALSE;
 	gchar *filename;
+
+	if (checked)
+		return;
+	checked = TRUE;
+
 	filename = g_build_filename(purple_user_dir(), "fs-codec.conf", NULL);
 
 	if (!g_file_test(filename, G_FILE_TEST_EXISTS)) {
 		int fd = g_open(filename, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
-		gchar *fs_codecs_conf = FS_CODECS_CONF;
-		if ((fd < 0) || write(fd, fs_codecs_conf, strlen(fs_codecs_conf)) == -1)
+		GString *fs_codecs_conf = g_string_new(FS_CODECS_CONF);
+#if GST_CHECK_VERSION(1,0,0)
+		guint i;
+
+		for (i = 0; i < G_N_ELEMENTS(hardware_codecs); i++) {
+			if (element_available(hardware_codecs[i].encoder) &&
+			    element_available(hardware_codecs[i].decoder)) {
+				SIPE_DEBUG_INFO("ensure_codecs_conf: using hardware codec %s/%s",
+						hardware_codecs[i].encoder,
+						hardware_codecs[i].decoder);
+				g_string_append(fs_codecs_conf, "\n");
+				g_string_append(fs_codecs_conf,
+						hardware_codecs[i].conf);
+				break;
+			}
+		}
+#endif
+
+		if ((fd < 0) ||
+		    write(fd, fs_codecs_conf->str, fs_codecs_conf->len) == -1)
 			SIPE_DEBUG_ERROR_NOFORMAT("Can not create fs-codec.conf!");
 		if (fd >= 0)
 			close(fd);
+		g_string_free(fs_codecs_conf, TRUE);
 	}
 
 	g_free(filename);
@@ -456,18 +552,14 @@ sipe_backend_media_relays_free(struct sipe_backend_media_relays *media_relays)
 static void
 stream_readable_cb(SIPE_UNUSED_PARAMETER PurpleMediaManager *manager,
 		 SIPE_UNUSED_PARAMETER PurpleMedia *media,
-		 const gchar *sessionid,
+		 SIPE_UNUSED_PARAMETER const gchar *sessionid,
 		 SIPE_UNUSED_PARAMETER const gchar *participant,
 		 gpointer user_data)
 {
-	struct sipe_media_call *call = (struct sipe_media_call *)user_data;
-	struct sipe_media_stream *stream;
-
-	SIPE_DEBUG_INFO_NOFORMAT("Stream readable");
+	struct sipe_media_stream *stream = user_data;
+	struct sipe_media_call *call = stream->call;
 
-	stream = sipe_core_media_get_stream_by_id(call, sessionid);
-
-	if (stream && call->read_cb) {
+	if (call->read_cb) {
 		call->read_cb(call, stream);
 	}
 }
@@ -482,22 +574,52 @@ sipe_backend_media_read(struct sipe_media_call *call,
 			stream->id, call->with, buffer, buffer_len, blocking);
 }
 
+gint
+sipe_backend_media_read_iov(struct sipe_media_call *call,
+			    struct sipe_media_stream *stream,
+			    const struct sipe_media_segment *segments,
+			    guint count)
+{
+	PurpleMediaManager *manager = purple_media_manager_get();
+	gint total = 0;
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		guint offset = 0;
+
+		while (offset < segments[i].length) {
+			gint len = purple_media_manager_receive_application_data(
+					manager, call->backend_private->m,
+					stream->id, call->with,
+					segments[i].data + offset,
+					segments[i].length - offset,
+					FALSE);
+			if (len <= 0)
+				/* report data already read before an error */
+				return(total ? total : len);
+
+			offset += len;
+			total  += len;
+		}
+	}
+
+	return(total);
+}
+
 static void
 stream_writable_cb(SIPE_UNUSED_PARAMETER PurpleMediaManager *manager,
 		   SIPE_UNUSED_PARAMETER PurpleMedia *media,
-		   const gchar *session_id,
+		   SIPE_UNUSED_PARAMETER const gchar *session_id,
 		   SIPE_UNUSED_PARAMETER const gchar *participant,
 		   gboolean writable,
 		   gpointer user_data)
 {
-	struct sipe_media_call *call = (struct sipe_media_call *)user_data;
-	struct sipe_media_stream *stream;
+	struct sipe_media_stream *stream = user_data;
+	struct sipe_media_call *call = stream->call;
 
 	SIPE_DEBUG_INFO("Stream %swritable", writable ? "" : "not ");
 
-	stream = sipe_core_media_get_stream_by_id(call, session_id);
-
-	if (stream && call->writable_cb) {
+	if (call->writable_cb) {
 		call->writable_cb(call, stream, writable);
 	}
 }
@@ -513,16 +635,18 @@ sipe_backend_media_write(struct sipe_media_call *call,
 }
 
 struct sipe_backend_media_stream *
-sipe_backend_media_add_stream(struct sipe_media_call *call,
-			      const gchar *id,
-			      const gchar *participant,
+sipe_backend_media_add_stream(struct sipe_media_stream *sipe_stream,
 			      SipeMediaType type,
 			      SipeIceVersion ice_version,
 			      gboolean initiator,
 			      struct sipe_backend_media_relays *media_relays,
-			      guint min_port, guint max_port)
+			      guint min_port, guint max_port,
+			      const struct sipe_media_ice_params *ice_params)
 {
+	struct sipe_media_call *call = sipe_stream->call;
 	struct sipe_backend_media *media = call->backend_private;
+	const gchar *id = sipe_stream->id;
+	const gchar *participant = call->with;
 	struct sipe_backend_media_stream *stream = NULL;
 	PurpleMediaSessionType prpl_type = sipe_media_to_purple(type);
 	PurpleMediaAppDataCallbacks callbacks = {
@@ -559,6 +683,15 @@ sipe_backend_media_add_stream(struct sipe_media_call *call,
 			++params_cnt;
 		}
 
+		/*
+		 * Farstream's nice transmitter doesn't expose nomination mode
+		 * or check pacing of its libnice agent.
+		 */
+		if (ice_params && (ice_params->aggressive_nomination ||
+				   ice_params->check_interval))
+			SIPE_DEBUG_INFO("sipe_backend_media_add_stream: stream '%s': ICE tuning not supported by transmitter",
+					id);
+
 		if (media_relays) {
 			params[params_cnt].name = "relay-info";
 			g_value_init(&params[params_cnt].value, SIPE_RELAYS_G_TYPE);
@@ -590,7 +723,7 @@ sipe_backend_media_add_stream(struct sipe_media_call *call,
 		purple_media_manager_set_application_data_callbacks(
 				purple_media_manager_get(),
 				media->m, id, participant, &callbacks,
-				call, NULL);
+				sipe_stream, NULL);
 	}
 
 	if (purple_media_add_stream(media->m, id, participant, prpl_type,
@@ -598,9 +731,21 @@ sipe_backend_media_add_stream(struct sipe_media_call *call,
 				    params)) {
 		stream = g_new0(struct sipe_backend_media_stream, 1);
 		stream->initialized_cb_was_fired = FALSE;
+		stream->rtp_session_id = ++media->rtp_sessions;
+
+		if (type == SIPE_MEDIA_APPLICATION) {
+			stream->app_data_media       = g_object_ref(media->m);
+			stream->app_data_session_id  = g_strdup(id);
+			stream->app_data_participant = g_strdup(participant);
+		}
 
 		if (!initiator)
 			++media->unconfirmed_streams;
+	} else if (type == SIPE_MEDIA_APPLICATION) {
+		purple_media_manager_set_application_data_callbacks(
+				purple_media_manager_get(),
+				media->m, id, participant, NULL,
+				NULL, NULL);
 	}
 
 	if (relay_info) {
@@ -612,6 +757,282 @@ sipe_backend_media_add_stream(struct sipe_media_call *call,
 	return stream;
 }
 
+#if GST_CHECK_VERSION(1,4,0)
+static GstBin *
+find_conference_bin(struct sipe_media_stream *stream)
+{
+	GstElement *tee;
+	GstObject *conference_bin;
+
+	/*
+	 * The session tee lives in the bin of this call's conference, which
+	 * also contains the rtpbin sessions and codec bins created by Farstream.
+	 */
+	tee = purple_media_get_tee(stream->call->backend_private->m,
+				   stream->id, NULL);
+	if (!tee)
+		return(NULL);
+
+	conference_bin = gst_object_get_parent(GST_OBJECT(tee));
+	if (conference_bin && !GST_IS_BIN(conference_bin)) {
+		gst_object_unref(conference_bin);
+		conference_bin = NULL;
+	}
+
+	return((GstBin *) conference_bin);
+}
+
+static GstElement *
+find_rtp_session(struct sipe_media_stream *stream)
+{
+	GstBin *conference_bin = find_conference_bin(stream);
+	GstElement *session = NULL;
+
+	if (conference_bin) {
+		gchar *name = g_strdup_printf("rtpsession%u",
+					      stream->backend_private->rtp_session_id);
+		session = gst_bin_get_by_name(conference_bin, name);
+		g_free(name);
+		gst_object_unref(conference_bin);
+	}
+
+	return(session);
+}
+
+static void
+add_source_stats(const GstStructure *source, struct sipe_media_stats *stats)
+{
+	gboolean internal = FALSE;
+	guint64 packets;
+
+	gst_structure_get_boolean(source, "internal", &internal);
+
+	if (internal) {
+		gboolean have_rb = FALSE;
+		guint rtt;
+		guint fraction;
+
+		if (gst_structure_get_uint64(source, "packets-sent", &packets))
+			stats->packets_sent += packets;
+
+		/* round trip time is in NTP short format, i.e. 1/65536 s */
+		if (gst_structure_get_boolean(source, "have-rb", &have_rb) &&
+		    have_rb &&
+		    gst_structure_get_uint(source, "rb-round-trip", &rtt))
+			stats->rtt = MAX(stats->rtt,
+					 (guint) (((guint64) rtt * 1000) >> 16));
+
+		/* fraction lost is in 1/256 */
+		if (have_rb &&
+		    gst_structure_get_uint(source, "rb-fractionlost", &fraction))
+			stats->remote_loss = MAX(stats->remote_loss,
+						 fraction * 100 / 256);
+	} else {
+		gint lost;
+		guint jitter;
+		gint clock_rate;
+
+		if (gst_structure_get_uint64(source, "packets-received", &packets))
+			stats->packets_received += packets;
+
+		if (gst_structure_get_int(source, "packets-lost", &lost) &&
+		    (lost > 0))
+			stats->packets_lost += lost;
+
+		/* jitter is in RTP timestamp units */
+		if (gst_structure_get_uint(source, "jitter", &jitter) &&
+		    gst_structure_get_int(source, "clock-rate", &clock_rate) &&
+		    (clock_rate > 0))
+			stats->jitter = MAX(stats->jitter,
+					    (guint) (((guint64) jitter * 1000) / clock_rate));
+	}
+}
+#endif
+
+gboolean
+sipe_backend_media_stream_get_rtp_stats(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+					SIPE_UNUSED_PARAMETER struct sipe_media_stats *stats)
+{
+#if GST_CHECK_VERSION(1,4,0)
+	GstElement *session;
+	GstStructure *session_stats = NULL;
+	const GValue *sources;
+
+	if (!stream->backend_private)
+		return(FALSE);
+
+	session = find_rtp_session(stream);
+	if (!session)
+		return(FALSE);
+
+	g_object_get(session, "stats", &session_stats, NULL);
+	gst_object_unref(session);
+	if (!session_stats)
+		return(FALSE);
+
+	sources = gst_structure_get_value(session_stats, "source-stats");
+	if (sources && G_VALUE_HOLDS(sources, G_TYPE_VALUE_ARRAY)) {
+		GValueArray *array = g_value_get_boxed(sources);
+		guint i;
+
+		for (i = 0; array && (i < array->n_values); i++) {
+			const GstStructure *source =
+				gst_value_get_structure(&array->values[i]);
+			if (source)
+				add_source_stats(source, stats);
+		}
+		stats->have_rtp = TRUE;
+	}
+
+	gst_structure_free(session_stats);
+
+	return(stats->have_rtp);
+#else
+	/* rtpsession "stats" property requires GStreamer 1.4 */
+	return(FALSE);
+#endif
+}
+
+void
+sipe_backend_media_set_video_params(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+				    SIPE_UNUSED_PARAMETER const struct sipe_media_video_params *params)
+{
+#if GST_CHECK_VERSION(1,4,0)
+	GstBin *conference_bin;
+	GstIterator *it;
+	GValue item = G_VALUE_INIT;
+
+	if (!stream->backend_private)
+		return;
+
+	conference_bin = find_conference_bin(stream);
+	if (!conference_bin)
+		return;
+
+	/*
+	 * Resolution and frame rate are fixed by the PurpleMedia video source,
+	 * only the encoder bitrate can be changed while the stream is running.
+	 * x264enc and the VA-API encoders all take kbit/s.
+	 */
+	it = gst_bin_iterate_recurse(conference_bin);
+	while (gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+		GstElement *element = g_value_get_object(&item);
+		GstElementFactory *factory = gst_element_get_factory(element);
+		const gchar *klass = factory ?
+			gst_element_factory_get_metadata(factory,
+							 GST_ELEMENT_METADATA_KLASS) :
+			NULL;
+
+		if (klass &&
+		    strstr(klass, "Encoder") &&
+		    strstr(klass, "Video") &&
+		    g_object_class_find_property(G_OBJECT_GET_CLASS(element),
+						 "bitrate")) {
+			SIPE_DEBUG_INFO("sipe_backend_media_set_video_params: %s bitrate %u kbit/s",
+					GST_ELEMENT_NAME(element),
+					params->bitrate);
+			g_object_set(element, "bitrate", params->bitrate, NULL);
+		}
+		g_value_reset(&item);
+	}
+	g_value_unset(&item);
+	gst_iterator_free(it);
+	gst_object_unref(conference_bin);
+#endif
+}
+
+#if GST_CHECK_VERSION(1,4,0)
+#define RTCP_PT_PSFB    206
+#define RTCP_FMT_AFB    15
+#define RTCP_FB_HEADER  12
+
+static gboolean
+on_sending_rtcp_cb(GObject *session,
+		   GstBuffer *buffer,
+		   SIPE_UNUSED_PARAMETER gboolean early,
+		   struct sipe_backend_media_stream *stream)
+{
+	GByteArray *fci;
+	guint ssrc = 0;
+	guint8 *packet;
+	gsize length;
+
+	G_LOCK(rtcp_feedback);
+	fci = stream->rtcp_feedback;
+	stream->rtcp_feedback = NULL;
+	G_UNLOCK(rtcp_feedback);
+	if (!fci)
+		return(FALSE);
+
+	g_object_get(session, "internal-ssrc", &ssrc, NULL);
+
+	/* payload-specific feedback, media source SSRC 0 */
+	length = RTCP_FB_HEADER + fci->len;
+	packet = g_malloc0(length);
+	packet[0] = 0x80 | RTCP_FMT_AFB;
+	packet[1] = RTCP_PT_PSFB;
+	packet[2] = (length / 4 - 1) >> 8;
+	packet[3] = (length / 4 - 1);
+	packet[4] = ssrc >> 24;
+	packet[5] = ssrc >> 16;
+	packet[6] = ssrc >> 8;
+	packet[7] = ssrc;
+	memcpy(packet + RTCP_FB_HEADER, fci->data, fci->len);
+	g_byte_array_free(fci, TRUE);
+
+	/* a compound RTCP packet is just the concatenation of its packets */
+	gst_buffer_append_memory(buffer,
+				 gst_memory_new_wrapped(0, packet, length,
+							0, length,
+							packet, g_free));
+
+	return(TRUE);
+}
+#endif
+
+void
+sipe_backend_media_send_rtcp_feedback(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+				      SIPE_UNUSED_PARAMETER const guint8 *fci,
+				      SIPE_UNUSED_PARAMETER gsize length)
+{
+#if GST_CHECK_VERSION(1,4,0)
+	struct sipe_backend_media_stream *backend_stream = stream->backend_private;
+
+	if (!backend_stream)
+		return;
+
+	if (!backend_stream->rtcp_session) {
+		GstElement *session = find_rtp_session(stream);
+
+		if (!session)
+			return;
+		g_object_get(session, "internal-session",
+			     &backend_stream->rtcp_session, NULL);
+		gst_object_unref(session);
+		if (!backend_stream->rtcp_session)
+			return;
+
+		backend_stream->rtcp_handler_id =
+			g_signal_connect(backend_stream->rtcp_session,
+					 "on-sending-rtcp",
+					 G_CALLBACK(on_sending_rtcp_cb),
+					 backend_stream);
+	}
+
+	/* a newer request replaces one that hasn't been sent yet */
+	G_LOCK(rtcp_feedback);
+	if (backend_stream->rtcp_feedback)
+		g_byte_array_free(backend_stream->rtcp_feedback, TRUE);
+	backend_stream->rtcp_feedback = g_byte_array_sized_new(length);
+	g_byte_array_append(backend_stream->rtcp_feedback, fci, length);
+	G_UNLOCK(rtcp_feedback);
+
+	/* don't wait for the regular report */
+	g_signal_emit_by_name(backend_stream->rtcp_session, "send-rtcp",
+			      (guint64) 0);
+#endif
+}
+
 void
 sipe_backend_media_stream_end(struct sipe_media_call *media,
 			      struct sipe_media_stream *stream)
@@ -737,27 +1158,67 @@ sipe_backend_media_get_active_remote_candidates(struct sipe_media_call *media,
 }
 
 #ifdef HAVE_SRTP
+gboolean
+sipe_backend_media_srtp_suite_supported(SipeSrtpSuite suite)
+{
+	static gint gcm_supported = -1;
+
+	if (suite != SIPE_SRTP_AEAD_AES_128_GCM)
+		return(TRUE);
+
+	/* GStreamer SRTP elements support GCM since 1.16 */
+	if (gcm_supported < 0) {
+		GstElementFactory *factory = gst_element_factory_find("srtpenc");
+
+		gcm_supported = 0;
+		if (factory) {
+			gcm_supported = gst_plugin_feature_check_version(GST_PLUGIN_FEATURE(factory),
+									 1, 16, 0);
+			gst_object_unref(factory);
+		}
+		SIPE_DEBUG_INFO("sipe_backend_media_srtp_suite_supported: AEAD_AES_128_GCM %ssupported",
+				gcm_supported ? "" : "not ");
+	}
+
+	return(gcm_supported);
+}
+
 void
 sipe_backend_media_set_encryption_keys(struct sipe_media_call *media,
 				       struct sipe_media_stream *stream,
+				       SipeSrtpSuite suite,
 				       const guchar *encryption_key,
 				       const guchar *decryption_key)
 {
+	/* GCM provides authentication itself */
+	const gchar *cipher = (suite == SIPE_SRTP_AEAD_AES_128_GCM) ?
+		"aes-128-gcm" : "aes-128-icm";
+	const gchar *auth = (suite == SIPE_SRTP_AEAD_AES_128_GCM) ?
+		"null" : "hmac-sha1-80";
+	guint key_len = SIPE_SRTP_SUITE_KEY_LEN(suite);
+
 	purple_media_set_encryption_parameters(media->backend_private->m,
 			stream->id,
-			"aes-128-icm",
-			"hmac-sha1-80",
-			(gchar *)encryption_key, SIPE_SRTP_KEY_LEN);
+			cipher,
+			auth,
+			(gchar *)encryption_key, key_len);
 	purple_media_set_decryption_parameters(media->backend_private->m,
 			stream->id, media->with,
-			"aes-128-icm",
-			"hmac-sha1-80",
-			(gchar *)decryption_key, SIPE_SRTP_KEY_LEN);
+			cipher,
+			auth,
+			(gchar *)decryption_key, key_len);
 }
 #else
+gboolean
+sipe_backend_media_srtp_suite_supported(SIPE_UNUSED_PARAMETER SipeSrtpSuite suite)
+{
+	return(FALSE);
+}
+
 void
 sipe_backend_media_set_encryption_keys(SIPE_UNUSED_PARAMETER struct sipe_media_call *media,
 				       SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+				       SIPE_UNUSED_PARAMETER SipeSrtpSuite suite,
 				       SIPE_UNUSED_PARAMETER const guchar *encryption_key,
 				       SIPE_UNUSED_PARAMETER const guchar *decryption_key)
 {}
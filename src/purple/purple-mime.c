@@ -55,10 +55,10 @@ GSList * mime_fields_to_nameval(PurpleMimePart* part)
 	return fields;
 }
 
-void sipe_mime_parts_foreach(const gchar *type,
-			     const gchar *body,
-			     sipe_mime_parts_cb callback,
-			     gpointer user_data)
+void sipe_mime_parts_foreach_fallback(const gchar *type,
+				      const gchar *body,
+				      sipe_mime_parts_cb callback,
+				      gpointer user_data)
 {
 	gchar *doc = g_strdup_printf("Content-Type: %s\r\n\r\n%s", type, body);
 	PurpleMimeDocument *mime = purple_mime_document_parse(doc);
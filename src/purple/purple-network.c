@@ -29,6 +29,7 @@
 #include "glib.h"
 #include "network.h"
 #include "eventloop.h"
+#include "signals.h"
 
 #ifdef _WIN32
 /* wrappers for write() & friends for socket handling */
@@ -52,6 +53,7 @@
 
 #include "sipe-common.h"
 #include "sipe-backend.h"
+#include "sipe-core.h"
 #include "purple-private.h"
 
 #if 0
@@ -247,6 +249,29 @@ void sipe_backend_network_listen_cancel(struct sipe_backend_listendata *ldata)
 	g_free(ldata);
 }
 
+static void network_configuration_changed(struct sipe_backend_private *purple_private)
+{
+	sipe_core_transport_sip_network_changed(purple_private->public,
+						purple_network_is_available());
+}
+
+void sipe_purple_network_monitor_start(struct sipe_backend_private *purple_private)
+{
+	purple_signal_connect(purple_network_get_handle(),
+			      "network-configuration-changed",
+			      purple_private,
+			      PURPLE_CALLBACK(network_configuration_changed),
+			      purple_private);
+}
+
+void sipe_purple_network_monitor_stop(struct sipe_backend_private *purple_private)
+{
+	purple_signal_disconnect(purple_network_get_handle(),
+				 "network-configuration-changed",
+				 purple_private,
+				 PURPLE_CALLBACK(network_configuration_changed));
+}
+
 gboolean
 sipe_backend_fd_is_valid(struct sipe_backend_fd *fd)
 {
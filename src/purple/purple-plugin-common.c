@@ -25,6 +25,10 @@
 #endif
 
 #include <string.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 #include <glib.h>
 
@@ -63,7 +67,6 @@
 #define PURPLE_IS_BUDDY(n)                            PURPLE_BLIST_NODE_IS_BUDDY(n)
 #define PURPLE_IS_CHAT(n)                             PURPLE_BLIST_NODE_IS_CHAT(n)
 #define PURPLE_IM_TYPING                              PURPLE_TYPING
-#define PURPLE_IM_NOT_TYPING                          PURPLE_NOT_TYPING
 #define purple_account_option_string_set_masked(o, f) purple_account_option_set_masked(o, f)
 #define purple_connection_error(g, e, m)              purple_connection_error_reason(g, e, m)
 #define purple_connection_get_flags(gc)               0
@@ -164,6 +167,11 @@ const char *sipe_purple_list_icon(SIPE_UNUSED_PARAMETER PurpleAccount *a,
 gchar *sipe_purple_status_text(PurpleBuddy *buddy)
 {
 	const PurpleStatus *status = purple_presence_get_active_status(purple_buddy_get_presence(buddy));
+
+	/* only called for buddies that are displayed */
+	sipe_core_buddy_presence_hint(PURPLE_BUDDY_TO_SIPE_CORE_PUBLIC,
+				      purple_buddy_get_name(buddy));
+
 	return sipe_core_buddy_status(PURPLE_BUDDY_TO_SIPE_CORE_PUBLIC,
 				      purple_buddy_get_name(buddy),
 				      sipe_purple_token_to_activity(purple_status_get_id(status)),
@@ -175,6 +183,8 @@ void sipe_purple_tooltip_text(PurpleBuddy *buddy,
 			      SIPE_UNUSED_PARAMETER gboolean full)
 {
 	const PurplePresence *presence = purple_buddy_get_presence(buddy);
+	sipe_core_buddy_presence_hint(PURPLE_BUDDY_TO_SIPE_CORE_PUBLIC,
+				      purple_buddy_get_name(buddy));
 	sipe_core_buddy_tooltip_info(PURPLE_BUDDY_TO_SIPE_CORE_PUBLIC,
 				     purple_buddy_get_name(buddy),
 				     purple_status_get_name(purple_presence_get_active_status(presence)),
@@ -401,6 +411,7 @@ static void connect_to_core(PurpleConnection *gc,
 					 password,
 					 email,
 					 email_url,
+					 NULL, /* default main context */
 					 &errmsg);
 	g_strfreev(username_split);
 
@@ -449,6 +460,9 @@ static void connect_to_core(PurpleConnection *gc,
 					username_split[0],
 					username_split[0] ? username_split[1] : NULL);
 	g_strfreev(username_split);
+
+	/* detect dead connections early, e.g. after Wi-Fi <-> VPN */
+	sipe_purple_network_monitor_start(purple_private);
 }
 
 static void password_required_cb(PurpleConnection *gc,
@@ -524,6 +538,7 @@ void sipe_purple_close(PurpleConnection *gc)
 	if (sipe_public) {
 		struct sipe_backend_private *purple_private = sipe_public->backend_private;
 
+		sipe_purple_network_monitor_stop(purple_private);
 		sipe_core_deallocate(sipe_public);
 
 		/* anything left after that must be in pending state... */
@@ -533,6 +548,8 @@ void sipe_purple_close(PurpleConnection *gc)
 		if (purple_private->roomlist_map)
 			g_hash_table_destroy(purple_private->roomlist_map);
 		sipe_purple_chat_destroy_rejoin(purple_private);
+		sipe_purple_buddy_pending_free(purple_private);
+		sipe_purple_buddy_cache_free(purple_private);
 
 		if (purple_private->deferred_status_timeout)
 			purple_timeout_remove(purple_private->deferred_status_timeout);
@@ -554,21 +571,13 @@ unsigned int sipe_purple_send_typing(PurpleConnection *gc,
 
 	/*
 	 * libpurple calls this function with PURPLE_NOT_TYPING *after*
-	 * calling sipe_purple_send_im() with the message. This causes
-	 * SIPE core to send out two SIP messages to the same dialog in
-	 * short succession without waiting for the response to the first
-	 * one. Some servers then reject the first one with
-	 *
-	 *    SIP/2.0 500 Stale CSeq Value
-	 *
-	 * which triggers a "message not delivered" error for the user.
-	 *
-	 * Work around this by filtering out PURPLE_NOT_TYPING events.
+	 * calling sipe_purple_send_im() with the message. SIPE core
+	 * suppresses notifications while a MESSAGE is outstanding, so
+	 * this no longer causes "500 Stale CSeq Value" errors.
 	 */
-	if (state != PURPLE_IM_NOT_TYPING)
-		sipe_core_user_feedback_typing(PURPLE_GC_TO_SIPE_CORE_PUBLIC,
-					       who,
-					       typing);
+	sipe_core_user_feedback_typing(PURPLE_GC_TO_SIPE_CORE_PUBLIC,
+				       who,
+				       typing);
 
 	/* tell libpurple to send typing indications every 4 seconds */
 	return(typing ? 4 : 0);
@@ -628,12 +637,6 @@ sipe_purple_get_account_text_table(SIPE_UNUSED_PARAMETER PurpleAccount *account)
 
 #ifdef HAVE_VV
 
-static void
-sipe_purple_sigusr1_handler(SIPE_UNUSED_PARAMETER int signum)
-{
-	capture_pipeline("PURPLE_SIPE_PIPELINE");
-}
-
 gboolean sipe_purple_initiate_media(PurpleAccount *account, const char *who,
 				    SIPE_UNUSED_PARAMETER PurpleMediaSessionType type)
 {
@@ -653,10 +656,35 @@ PurpleMediaCaps sipe_purple_get_media_caps(SIPE_UNUSED_PARAMETER PurpleAccount *
 #endif
 #endif
 
+#ifndef _WIN32
+static void sipe_purple_trace_writer(const gchar *data,
+				     gsize length,
+				     SIPE_UNUSED_PARAMETER gpointer user_data)
+{
+	while (length > 0) {
+		ssize_t written = write(STDERR_FILENO, data, length);
+		if (written <= 0)
+			break;
+		data   += written;
+		length -= written;
+	}
+}
+
+static void
+sipe_purple_sigusr1_handler(SIPE_UNUSED_PARAMETER int signum)
+{
+	sipe_core_debug_trace_dump(sipe_purple_trace_writer, NULL);
+	sipe_core_debug_events_dump(sipe_purple_trace_writer, NULL);
+#ifdef HAVE_VV
+	capture_pipeline("PURPLE_SIPE_PIPELINE");
+#endif
+}
+#endif
+
 /* PurplePluginInfo function calls & data structure */
 gboolean sipe_purple_plugin_load(SIPE_UNUSED_PARAMETER PurplePlugin *plugin)
 {
-#ifdef HAVE_VV
+#ifndef _WIN32
 	struct sigaction action;
 	memset(&action, 0, sizeof (action));
 	action.sa_handler = sipe_purple_sigusr1_handler;
@@ -670,7 +698,7 @@ gboolean sipe_purple_plugin_load(SIPE_UNUSED_PARAMETER PurplePlugin *plugin)
 
 gboolean sipe_purple_plugin_unload(SIPE_UNUSED_PARAMETER PurplePlugin *plugin)
 {
-#ifdef HAVE_VV
+#ifndef _WIN32
 	struct sigaction action;
 	memset(&action, 0, sizeof (action));
 	action.sa_handler = SIG_DFL;
@@ -825,6 +853,33 @@ static void sipe_purple_reset_status(PurpleProtocolAction *action)
 	}
 }
 
+static void sipe_purple_show_memory_usage(PurpleProtocolAction *action)
+{
+	PurpleConnection *gc = SIPE_PURPLE_ACTION_TO_CONNECTION;
+	GArray *report = sipe_core_memory_report(PURPLE_GC_TO_SIPE_CORE_PUBLIC);
+	GString *html = g_string_new("<table>");
+	guint i;
+
+	for (i = 0; i < report->len; i++) {
+		const struct sipe_core_memory *memory =
+			&g_array_index(report, struct sipe_core_memory, i);
+		g_string_append_printf(html,
+				       "<tr><td>%s</td><td align=\"right\">%" G_GUINT64_FORMAT " KiB</td><td align=\"right\">%" G_GUINT64_FORMAT "</td></tr>",
+				       memory->name,
+				       (memory->bytes + 1023) / 1024,
+				       memory->objects);
+	}
+	g_string_append(html, "</table>");
+	g_array_free(report, TRUE);
+
+	purple_notify_formatted(gc,
+				_("Memory usage"),
+				_("Memory usage"),
+				_("Estimated memory used per subsystem (size, objects)"),
+				html->str, NULL, NULL);
+	g_string_free(html, TRUE);
+}
+
 GList *sipe_purple_actions()
 {
 	GList *menu = NULL;
@@ -853,6 +908,9 @@ GList *sipe_purple_actions()
 	act = purple_protocol_action_new(_("Reset status"), sipe_purple_reset_status);
 	menu = g_list_prepend(menu, act);
 
+	act = purple_protocol_action_new(_("Memory usage"), sipe_purple_show_memory_usage);
+	menu = g_list_prepend(menu, act);
+
 	return g_list_reverse(menu);
 }
 
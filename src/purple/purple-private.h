@@ -77,6 +77,14 @@ struct sipe_backend_private {
 	GSList *transports;
 	GSList *dns_queries;
 
+	/* buddy list transaction, see purple-buddy.c */
+	GHashTable *blist_pending;        /* PurpleBuddy -> pending aliases */
+	GHashTable *blist_pending_status; /* URI -> activity */
+	guint blist_processing;           /* nesting level */
+
+	/* URI -> buddy lookup results, see purple-buddy.c */
+	GHashTable *buddy_cache;
+
 	/* work around broken libpurple idle notification */
 	gchar *deferred_status_note;
 	guint  deferred_status_activity;
@@ -97,6 +105,16 @@ struct sipe_backend_fd {
 const gchar *sipe_purple_activity_to_token(guint type);
 guint sipe_purple_token_to_activity(const gchar *token);
 
+/* Buddy list transaction */
+void sipe_purple_buddy_pending_free(struct sipe_backend_private *purple_private);
+
+/* Buddy lookup cache */
+void sipe_purple_buddy_cache_free(struct sipe_backend_private *purple_private);
+
+/* Network change notification */
+void sipe_purple_network_monitor_start(struct sipe_backend_private *purple_private);
+void sipe_purple_network_monitor_stop(struct sipe_backend_private *purple_private);
+
 /* DNS queries */
 void sipe_purple_dns_query_cancel_all(struct sipe_backend_private *purple_private);
 
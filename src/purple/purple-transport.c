@@ -50,6 +50,7 @@
 #define purple_circular_buffer_append(b, s, n) purple_circ_buffer_append(b, s, n)
 #define purple_circular_buffer_get_max_read(b) purple_circ_buffer_get_max_read(b)
 #define purple_circular_buffer_get_output(b)   b->outptr
+#define purple_circular_buffer_get_used(b)     b->bufused
 #define purple_circular_buffer_mark_read(b, s) purple_circ_buffer_mark_read(b, s)
 #define purple_circular_buffer_new(s)          purple_circ_buffer_new(s)
 #endif
@@ -57,6 +58,8 @@
 #ifdef _WIN32
 /* wrappers for write() & friends for socket handling */
 #include "win32/win32dep.h"
+#else
+#include <sys/uio.h>
 #endif
 
 #include "purple-private.h"
@@ -77,7 +80,10 @@ struct sipe_transport_purple {
 	PurpleSslConnection *gsc;
 	PurpleProxyConnectData *proxy;
 	PurpleCircularBuffer *transmit_buffer;
+	GByteArray *record;       /* TLS: next record, taken from buffer */
 	guint transmit_handler;
+	guint cork_handler;
+	guint corked_messages;    /* TLS: messages queued since last write */
 	guint receive_handler;
 	int socket;
 
@@ -87,7 +93,8 @@ struct sipe_transport_purple {
 #define PURPLE_TRANSPORT ((struct sipe_transport_purple *) conn)
 #define SIPE_TRANSPORT_CONNECTION ((struct sipe_transport_connection *) transport)
 
-#define BUFFER_SIZE_INCREMENT 4096
+/* TLS: wait for more messages before writing a partial record */
+#define TRANSPORT_CORK_DELAY 2 /* milliseconds */
 
 
 
@@ -105,16 +112,14 @@ static void transport_common_input(struct sipe_transport_purple *transport)
 	/* Read all available data from the connection */
 	do {
 		/* Increase input buffer size as needed */
-		if (conn->buffer_length < conn->buffer_used + BUFFER_SIZE_INCREMENT) {
-			conn->buffer_length += BUFFER_SIZE_INCREMENT;
-			conn->buffer = g_realloc(conn->buffer, conn->buffer_length);
-			SIPE_DEBUG_INFO("transport_input_common: new buffer length %" G_GSIZE_FORMAT,
-					conn->buffer_length);
+		readlen = sipe_core_transport_buffer_reserve(conn);
+		if (readlen == 0) {
+			SIPE_DEBUG_ERROR_NOFORMAT("transport_input_common: message exceeds maximum buffer size");
+			transport->error(SIPE_TRANSPORT_CONNECTION, _("Read error"));
+			return;
 		}
 
 		/* Try to read as much as there is space left in the buffer */
-		/* minus 1 for the string terminator */
-		readlen = conn->buffer_length - conn->buffer_used - 1;
 		len = transport->gsc ?
 			(gssize) purple_ssl_read(transport->gsc,
 						 conn->buffer + conn->buffer_used,
@@ -257,6 +262,12 @@ sipe_backend_transport_connect(struct sipe_core_public *sipe_public,
 		/* SSL case */
 		SIPE_DEBUG_INFO_NOFORMAT("using SSL");
 
+		/*
+		 * setup->session_cache can't be used: the SSL plugin hides
+		 * the session state. NSS resumes sessions on its own.
+		 */
+		transport->record = g_byte_array_sized_new(SIPE_TLS_RECORD_LENGTH);
+
 		if ((transport->gsc = purple_ssl_connect(account,
 							 setup->server_name,
 							 setup->server_port,
@@ -333,6 +344,8 @@ void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
 
 	if (transport->transmit_handler)
 		purple_input_remove(transport->transmit_handler);
+	if (transport->cork_handler)
+		purple_timeout_remove(transport->cork_handler);
 	if (transport->receive_handler)
 		purple_input_remove(transport->receive_handler);
 
@@ -342,6 +355,8 @@ void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
 #else
 		purple_circ_buffer_destroy(transport->transmit_buffer);
 #endif
+	if (transport->record)
+		g_byte_array_unref(transport->record);
 	g_free(transport->public.buffer);
 
 	/* defer deletion of transport data structure to idle callback */
@@ -357,16 +372,54 @@ void sipe_purple_transport_close_all(struct sipe_backend_private *purple_private
 		sipe_backend_transport_disconnect(entry->data);
 }
 
+static gsize transport_queued(struct sipe_transport_purple *transport)
+{
+	gsize queued = purple_circular_buffer_get_used(transport->transmit_buffer);
+
+	if (transport->record)
+		queued += transport->record->len;
+	return(queued);
+}
+
+/*
+ * TLS: every write is encrypted into its own record(s). Collect queued
+ * messages into full records, also across the wrap-around of the
+ * circular buffer. Data stays in the record until it has been written.
+ */
+static void transport_fill_record(struct sipe_transport_purple *transport)
+{
+	GByteArray *record = transport->record;
+	gsize max_read;
+
+	while ((record->len < SIPE_TLS_RECORD_LENGTH) &&
+	       ((max_read = purple_circular_buffer_get_max_read(transport->transmit_buffer)) > 0)) {
+		gsize length = MIN(max_read,
+				   SIPE_TLS_RECORD_LENGTH - record->len);
+
+		g_byte_array_append(record,
+				    (const guint8 *) purple_circular_buffer_get_output(transport->transmit_buffer),
+				    length);
+		purple_circular_buffer_mark_read(transport->transmit_buffer,
+						 length);
+	}
+}
+
 /* returns FALSE on write error */
 static gboolean transport_write(struct sipe_transport_purple *transport)
 {
 	gsize max_write;
 
-	max_write = purple_circular_buffer_get_max_read(transport->transmit_buffer);
+	if (transport->gsc) {
+		transport_fill_record(transport);
+		max_write = transport->record->len;
+	} else {
+		max_write = purple_circular_buffer_get_max_read(transport->transmit_buffer);
+	}
+
 	if (max_write > 0) {
 		gssize written = transport->gsc ?
 			(gssize) purple_ssl_write(transport->gsc,
-						  purple_circular_buffer_get_output(transport->transmit_buffer),
+						  transport->record->data,
 						  max_write) :
 			write(transport->socket,
 			      purple_circular_buffer_get_output(transport->transmit_buffer),
@@ -381,8 +434,16 @@ static gboolean transport_write(struct sipe_transport_purple *transport)
 			return FALSE;
 		}
 
-		purple_circular_buffer_mark_read(transport->transmit_buffer,
-						 written);
+		if (transport->gsc) {
+			sipe_core_tls_records(transport->purple_private->public,
+					      transport->corked_messages,
+					      written);
+			transport->corked_messages = 0;
+			g_byte_array_remove_range(transport->record, 0, written);
+		} else {
+			purple_circular_buffer_mark_read(transport->transmit_buffer,
+							 written);
+		}
 
 	} else {
 		/* buffer is empty -> stop sending */
@@ -404,16 +465,13 @@ static void transport_canwrite_cb(gpointer data,
 		transport_write(data);
 }
 
-void sipe_backend_transport_message(struct sipe_transport_connection *conn,
-				    const gchar *buffer)
+static void transport_start_write(struct sipe_transport_purple *transport)
 {
-	struct sipe_transport_purple *transport = PURPLE_TRANSPORT;
-
-	/* add packet to circular buffer */
-	purple_circular_buffer_append(transport->transmit_buffer,
-				      buffer, strlen(buffer));
+	if (transport->cork_handler) {
+		purple_timeout_remove(transport->cork_handler);
+		transport->cork_handler = 0;
+	}
 
-	/* initiate transmission */
 	if (!transport->transmit_handler) {
 		transport->transmit_handler = purple_input_add(transport->socket,
 							       PURPLE_INPUT_WRITE,
@@ -422,12 +480,105 @@ void sipe_backend_transport_message(struct sipe_transport_connection *conn,
 	}
 }
 
+static gboolean transport_uncork_cb(gpointer data)
+{
+	struct sipe_transport_purple *transport = data;
+
+	transport->cork_handler = 0;
+	transport_start_write(transport);
+
+	return(FALSE);
+}
+
+void sipe_backend_transport_message(struct sipe_transport_connection *conn,
+				    const gchar *buffer)
+{
+	struct sipe_transport_segment segment;
+
+	segment.data   = buffer;
+	segment.length = strlen(buffer);
+	sipe_backend_transport_message_iov(conn, &segment, 1);
+}
+
+void sipe_backend_transport_message_iov(struct sipe_transport_connection *conn,
+					const struct sipe_transport_segment *segments,
+					guint count)
+{
+	struct sipe_transport_purple *transport = PURPLE_TRANSPORT;
+	gsize offset = 0;
+	guint i = 0;
+
+	if (transport->gsc)
+		transport->corked_messages++;
+
+#ifndef _WIN32
+	/* plain socket & nothing queued: try to send segments directly */
+	if (!transport->gsc &&
+	    !purple_circular_buffer_get_max_read(transport->transmit_buffer)) {
+		struct iovec *iov = g_newa(struct iovec, count);
+		gssize written;
+
+		for (i = 0; i < count; i++) {
+			iov[i].iov_base = (gpointer) segments[i].data;
+			iov[i].iov_len  = segments[i].length;
+		}
+
+		/*
+		 * Errors are reported by transport_write(), i.e. not while
+		 * the core is still in the middle of sending the message.
+		 */
+		written = writev(transport->socket, iov, count);
+		if (written < 0)
+			written = 0;
+
+		/* skip segments that have been sent completely */
+		for (i = 0;
+		     (i < count) && ((gsize) written >= segments[i].length);
+		     i++)
+			written -= segments[i].length;
+		offset = written;
+	}
+#endif
+
+	/* add unsent part of packet to circular buffer */
+	if (i < count) {
+		for (; i < count; i++, offset = 0)
+			purple_circular_buffer_append(transport->transmit_buffer,
+						      segments[i].data + offset,
+						      segments[i].length - offset);
+
+		/* initiate transmission */
+		if (transport->transmit_handler) {
+			/* already waiting for the socket */
+		} else if (transport->gsc &&
+			   (transport_queued(transport) < SIPE_TLS_RECORD_LENGTH)) {
+			/* TLS: wait for more messages to fill the record */
+			if (!transport->cork_handler)
+				transport->cork_handler = purple_timeout_add(TRANSPORT_CORK_DELAY,
+									     transport_uncork_cb,
+									     transport);
+		} else {
+			transport_start_write(transport);
+		}
+	}
+}
+
 void sipe_backend_transport_flush(struct sipe_transport_connection *conn)
 {
 	struct sipe_transport_purple *transport = PURPLE_TRANSPORT;
 
-	while (	purple_circular_buffer_get_max_read(transport->transmit_buffer)
-		&& transport_write(transport));
+	if (transport->cork_handler) {
+		purple_timeout_remove(transport->cork_handler);
+		transport->cork_handler = 0;
+	}
+
+	while (transport_queued(transport) && transport_write(transport));
+}
+
+gsize sipe_backend_transport_pending(struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_purple *transport = PURPLE_TRANSPORT;
+	return(transport_queued(transport));
 }
 
 /*
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2012 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2012-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -36,6 +36,10 @@
 
 #define SIPE_INFO_FIELD_MAX (SIPE_BUDDY_INFO_CUSTOM1_PHONE_DISPLAY + 1)
 
+/* presence, alias & avatar updates are signalled in batches */
+#define CONTACT_UPDATES_DELAY 100 /* milliseconds */
+#define CONTACT_UPDATES_MAX   250 /* pending contacts before forced flush */
+
 struct telepathy_buddy {
 	const gchar *uri;   /* borrowed from contact_list->buddies key */
 	GHashTable *groups; /* key: group name, value: buddy_entry */
@@ -70,6 +74,21 @@ typedef struct _SipeContactList {
 	GHashTable *buddies;       /* key: SIP URI,    value: buddy */
 	GHashTable *buddy_handles; /* key: TpHandle,   value: buddy */
 	GHashTable *groups;        /* key: group name, value: buddy */
+	GHashTable *group_members; /* key: group name, value: TpHandleSet */
+	                           /* keys are borrowed from groups */
+
+	/* changes not yet signalled, see contact_list_flush() */
+	TpHandleSet *changed;
+	TpHandleSet *removed;
+	GHashTable *group_added;   /* key: group name, value: TpHandleSet */
+	GHashTable *group_removed; /* key: group name, value: TpHandleSet */
+	guint processing;
+
+	/* updates not yet signalled, see contact_updates_emit() */
+	GHashTable *pending_presences; /* key: TpHandle, value: activity */
+	GHashTable *pending_aliases;   /* key: TpHandle, value: alias */
+	GHashTable *pending_avatars;   /* key: TpHandle, value: GArray */
+	guint pending_source;
 
 	gboolean initial_received;
 } SipeContactList;
@@ -135,6 +154,8 @@ static void sipe_contact_list_constructed(GObject *object)
 	self->contact_repo = tp_base_connection_get_handles(self->connection,
 							    TP_HANDLE_TYPE_CONTACT);
 	self->contacts     = tp_handle_set_new(self->contact_repo);
+	self->changed      = tp_handle_set_new(self->contact_repo);
+	self->removed      = tp_handle_set_new(self->contact_repo);
 }
 
 static void sipe_contact_list_dispose(GObject *object)
@@ -144,9 +165,21 @@ static void sipe_contact_list_dispose(GObject *object)
 
 	SIPE_DEBUG_INFO_NOFORMAT("SipeContactList::dispose");
 
+	if (self->pending_source) {
+		g_source_remove(self->pending_source);
+		self->pending_source = 0;
+	}
+	tp_clear_pointer(&self->pending_presences, g_hash_table_unref);
+	tp_clear_pointer(&self->pending_aliases, g_hash_table_unref);
+	tp_clear_pointer(&self->pending_avatars, g_hash_table_unref);
 	tp_clear_pointer(&self->contacts, tp_handle_set_destroy);
+	tp_clear_pointer(&self->changed, tp_handle_set_destroy);
+	tp_clear_pointer(&self->removed, tp_handle_set_destroy);
 	tp_clear_object(&self->connection);
 	/* NOTE: the order is important due to borrowing of keys! */
+	tp_clear_pointer(&self->group_added, g_hash_table_unref);
+	tp_clear_pointer(&self->group_removed, g_hash_table_unref);
+	tp_clear_pointer(&self->group_members, g_hash_table_unref);
 	tp_clear_pointer(&self->buddy_handles, g_hash_table_unref);
 	tp_clear_pointer(&self->buddies, g_hash_table_unref);
 	tp_clear_pointer(&self->groups, g_hash_table_unref);
@@ -182,6 +215,24 @@ static void sipe_contact_list_init(SIPE_UNUSED_PARAMETER SipeContactList *self)
 	self->buddy_handles = g_hash_table_new(g_direct_hash, g_direct_equal);
 	self->groups        = g_hash_table_new_full(g_str_hash, g_str_equal,
 						    g_free, NULL);
+	self->group_members = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    NULL,
+						    (GDestroyNotify) tp_handle_set_destroy);
+	self->group_added   = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    NULL,
+						    (GDestroyNotify) tp_handle_set_destroy);
+	self->group_removed = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    NULL,
+						    (GDestroyNotify) tp_handle_set_destroy);
+	self->processing    = 0;
+
+	self->pending_presences = g_hash_table_new(g_direct_hash, g_direct_equal);
+	self->pending_aliases   = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, g_free);
+	self->pending_avatars   = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL,
+							(GDestroyNotify) g_array_unref);
+	self->pending_source    = 0;
 
 	self->initial_received = FALSE;
 }
@@ -213,18 +264,14 @@ static TpHandleSet *dup_group_members(TpBaseContactList *contact_list,
 				      const gchar *group_name)
 {
 	SipeContactList *self = SIPE_CONTACT_LIST(contact_list);
-	TpHandleSet *members  = tp_handle_set_new(self->contact_repo);
-	GHashTableIter iter;
-	struct telepathy_buddy *buddy;
+	TpHandleSet *members  = g_hash_table_lookup(self->group_members,
+						    group_name);
 
 	SIPE_DEBUG_INFO_NOFORMAT("SipeContactList::dup_group_members called");
 
-	g_hash_table_iter_init(&iter, self->buddies);
-	while (g_hash_table_iter_next(&iter, NULL, (gpointer) &buddy))
-		if (g_hash_table_lookup(buddy->groups, group_name))
-			tp_handle_set_add(members, buddy->handle);
-
-	return(members);
+	if (members)
+		return(tp_handle_set_copy(members));
+	return(tp_handle_set_new(self->contact_repo));
 }
 
 static GStrv dup_contact_groups(TpBaseContactList *contact_list,
@@ -572,6 +619,224 @@ gpointer sipe_telepathy_contact_info_props(void)
 	return(props);
 }
 
+/*
+ * Contact list change tracking
+ *
+ * Changes are collected while the core is processing the contact list and
+ * signalled as one delta per contact list/group when processing finishes.
+ * Before the initial list has been received only the caches are updated,
+ * tp_base_contact_list_set_list_received() announces the complete list.
+ */
+static TpHandleSet *group_pending(SipeContactList *contact_list,
+				  GHashTable *table,
+				  const gchar *group)
+{
+	TpHandleSet *set = g_hash_table_lookup(table, group);
+	if (!set) {
+		set = tp_handle_set_new(contact_list->contact_repo);
+		g_hash_table_insert(table, (gchar *) group, set);
+	}
+	return(set);
+}
+
+static void group_member_add(SipeContactList *contact_list,
+			     const gchar *group,
+			     TpHandle handle)
+{
+	tp_handle_set_add(group_pending(contact_list,
+					contact_list->group_members,
+					group),
+			  handle);
+
+	if (contact_list->initial_received) {
+		TpHandleSet *removed = g_hash_table_lookup(contact_list->group_removed,
+							   group);
+		if (removed)
+			tp_handle_set_remove(removed, handle);
+		tp_handle_set_add(group_pending(contact_list,
+						contact_list->group_added,
+						group),
+				  handle);
+	}
+}
+
+static void group_member_remove(SipeContactList *contact_list,
+				const gchar *group,
+				TpHandle handle)
+{
+	TpHandleSet *members = g_hash_table_lookup(contact_list->group_members,
+						   group);
+	if (members)
+		tp_handle_set_remove(members, handle);
+
+	if (contact_list->initial_received) {
+		TpHandleSet *added = g_hash_table_lookup(contact_list->group_added,
+							 group);
+		if (added)
+			tp_handle_set_remove(added, handle);
+		tp_handle_set_add(group_pending(contact_list,
+						contact_list->group_removed,
+						group),
+				  handle);
+	}
+}
+
+static void contact_list_emit_changes(SipeContactList *contact_list)
+{
+	TpBaseContactList *base = TP_BASE_CONTACT_LIST(contact_list);
+	GHashTableIter iter;
+	const gchar *group;
+	TpHandleSet *set;
+
+	if (!tp_handle_set_is_empty(contact_list->changed) ||
+	    !tp_handle_set_is_empty(contact_list->removed)) {
+		SIPE_DEBUG_INFO("contact_list_emit_changes: %d changed, %d removed",
+				tp_handle_set_size(contact_list->changed),
+				tp_handle_set_size(contact_list->removed));
+		tp_base_contact_list_contacts_changed(base,
+						      contact_list->changed,
+						      contact_list->removed);
+		tp_handle_set_clear(contact_list->changed);
+		tp_handle_set_clear(contact_list->removed);
+	}
+
+	g_hash_table_iter_init(&iter, contact_list->group_added);
+	while (g_hash_table_iter_next(&iter, (gpointer) &group, (gpointer) &set))
+		if (!tp_handle_set_is_empty(set))
+			tp_base_contact_list_groups_changed(base, set,
+							    &group, 1,
+							    NULL, 0);
+	g_hash_table_remove_all(contact_list->group_added);
+
+	g_hash_table_iter_init(&iter, contact_list->group_removed);
+	while (g_hash_table_iter_next(&iter, (gpointer) &group, (gpointer) &set))
+		if (!tp_handle_set_is_empty(set))
+			tp_base_contact_list_groups_changed(base, set,
+							    NULL, 0,
+							    &group, 1);
+	g_hash_table_remove_all(contact_list->group_removed);
+}
+
+/* signal changes unless we are inside a processing block */
+static void contact_list_flush(SipeContactList *contact_list)
+{
+	if (contact_list->initial_received && (contact_list->processing == 0))
+		contact_list_emit_changes(contact_list);
+}
+
+/*
+ * Presence, alias & avatar updates
+ *
+ * Status changes arrive in bursts, e.g. one NOTIFY with the state of all
+ * buddies after login. Emitting one D-Bus signal per contact floods the
+ * clients, so updates are collected and signalled together when the main
+ * loop gets back to us. Later updates for the same contact replace earlier
+ * ones. The batch is flushed at the latest after CONTACT_UPDATES_DELAY or
+ * when CONTACT_UPDATES_MAX contacts are pending.
+ */
+static void contact_updates_emit_presences(SipeContactList *contact_list)
+{
+	GHashTable *presences;
+	GHashTableIter iter;
+	gpointer handle, activity;
+
+	if (g_hash_table_size(contact_list->pending_presences) == 0)
+		return;
+
+	presences = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					  NULL,
+					  (GDestroyNotify) tp_presence_status_free);
+	g_hash_table_iter_init(&iter, contact_list->pending_presences);
+	while (g_hash_table_iter_next(&iter, &handle, &activity))
+		/* skip buddies that have been removed in the meantime */
+		if (g_hash_table_lookup(contact_list->buddy_handles, handle))
+			g_hash_table_insert(presences,
+					    handle,
+					    tp_presence_status_new(GPOINTER_TO_UINT(activity),
+								   NULL));
+	g_hash_table_remove_all(contact_list->pending_presences);
+
+	if (g_hash_table_size(presences))
+		tp_presence_mixin_emit_presence_update(G_OBJECT(contact_list->connection),
+						       presences);
+	g_hash_table_unref(presences);
+}
+
+static void contact_updates_emit_avatars(SipeContactList *contact_list)
+{
+	GHashTableIter iter;
+	gpointer handle;
+	GArray *array;
+
+	g_hash_table_iter_init(&iter, contact_list->pending_avatars);
+	while (g_hash_table_iter_next(&iter, &handle, (gpointer) &array)) {
+		struct telepathy_buddy *buddy = g_hash_table_lookup(contact_list->buddy_handles,
+								    handle);
+
+		/* avatar signals carry one contact each */
+		if (buddy && buddy->hash) {
+			tp_svc_connection_interface_avatars_emit_avatar_updated(contact_list->connection,
+										buddy->handle,
+										buddy->hash);
+			tp_svc_connection_interface_avatars_emit_avatar_retrieved(contact_list->connection,
+										  buddy->handle,
+										  buddy->hash,
+										  array,
+										  /* @TODO: is this correct? */
+										  "image/jpeg");
+		}
+	}
+	g_hash_table_remove_all(contact_list->pending_avatars);
+}
+
+static void contact_updates_emit(SipeContactList *contact_list)
+{
+	if (contact_list->pending_source) {
+		g_source_remove(contact_list->pending_source);
+		contact_list->pending_source = 0;
+	}
+
+	SIPE_DEBUG_INFO("contact_updates_emit: %u presences, %u aliases, %u avatars",
+			g_hash_table_size(contact_list->pending_presences),
+			g_hash_table_size(contact_list->pending_aliases),
+			g_hash_table_size(contact_list->pending_avatars));
+
+	contact_updates_emit_presences(contact_list);
+
+	if (g_hash_table_size(contact_list->pending_aliases)) {
+		sipe_telepathy_connection_aliases_updated(contact_list->connection,
+							  contact_list->pending_aliases);
+		g_hash_table_remove_all(contact_list->pending_aliases);
+	}
+
+	contact_updates_emit_avatars(contact_list);
+}
+
+static gboolean contact_updates_timeout(gpointer data)
+{
+	SipeContactList *contact_list = data;
+
+	/* source is removed when we return FALSE */
+	contact_list->pending_source = 0;
+	contact_updates_emit(contact_list);
+
+	return(FALSE);
+}
+
+static void contact_updates_queued(SipeContactList *contact_list)
+{
+	guint pending = g_hash_table_size(contact_list->pending_presences) +
+		g_hash_table_size(contact_list->pending_aliases) +
+		g_hash_table_size(contact_list->pending_avatars);
+
+	if (pending >= CONTACT_UPDATES_MAX)
+		contact_updates_emit(contact_list);
+	else if (!contact_list->pending_source)
+		contact_list->pending_source = g_timeout_add(CONTACT_UPDATES_DELAY,
+							     contact_updates_timeout,
+							     contact_list);
+}
+
 /*
  * Backend adaptor functions
  */
@@ -753,9 +1018,10 @@ void sipe_backend_buddy_set_alias(struct sipe_core_public *sipe_public,
 	if (contact_list->initial_received) {
 		SIPE_DEBUG_INFO("sipe_backend_buddy_set_alias: %s changed to '%s'",
 				buddy->uri, alias);
-		sipe_telepathy_connection_alias_updated(contact_list->connection,
-						        buddy->handle,
-							alias);
+		g_hash_table_insert(contact_list->pending_aliases,
+				    GUINT_TO_POINTER(buddy->handle),
+				    g_strdup(alias ? alias : ""));
+		contact_updates_queued(contact_list);
 	}
 }
 
@@ -766,16 +1032,29 @@ void sipe_backend_buddy_set_server_alias(SIPE_UNUSED_PARAMETER struct sipe_core_
 	/* server alias is the same as alias. Ignore this */
 }
 
+void sipe_backend_buddy_list_processing_start(struct sipe_core_public *sipe_public)
+{
+	struct sipe_backend_private *telepathy_private = sipe_public->backend_private;
+
+	telepathy_private->contact_list->processing++;
+}
+
 void sipe_backend_buddy_list_processing_finish(struct sipe_core_public *sipe_public)
 {
 	struct sipe_backend_private *telepathy_private = sipe_public->backend_private;
 	SipeContactList *contact_list                  = telepathy_private->contact_list;
 
+	/* finish is also called without matching start */
+	if (contact_list->processing > 0)
+		contact_list->processing--;
+
 	if (!contact_list->initial_received) {
 		/* we can only call this once */
 		contact_list->initial_received = TRUE;
 		SIPE_DEBUG_INFO_NOFORMAT("sipe_backend_buddy_list_processing_finish called");
 		tp_base_contact_list_set_list_received(TP_BASE_CONTACT_LIST(contact_list));
+	} else {
+		contact_list_flush(contact_list);
 	}
 }
 
@@ -817,6 +1096,10 @@ sipe_backend_buddy sipe_backend_buddy_add(struct sipe_core_public *sipe_public,
 		buddy->handle   = tp_handle_ensure(contact_list->contact_repo,
 						   buddy->uri, NULL, NULL);
 		tp_handle_set_add(contact_list->contacts, buddy->handle);
+		if (contact_list->initial_received) {
+			tp_handle_set_remove(contact_list->removed, buddy->handle);
+			tp_handle_set_add(contact_list->changed, buddy->handle);
+		}
 		g_hash_table_insert(contact_list->buddies,
 				    (gchar *) buddy->uri, /* owned by hash table */
 				    buddy);
@@ -833,11 +1116,10 @@ sipe_backend_buddy sipe_backend_buddy_add(struct sipe_core_public *sipe_public,
 		g_hash_table_insert(buddy->groups,
 				    (gchar *) group, /* key is borrowed */
 				    buddy_entry);
+		group_member_add(contact_list, group, buddy->handle);
 	}
 
-	if (contact_list->initial_received) {
-		/* @TODO: emit signal? */
-	}
+	contact_list_flush(contact_list);
 
 	return(buddy_entry);
 }
@@ -849,7 +1131,9 @@ void sipe_backend_buddy_remove(struct sipe_core_public *sipe_public,
 	SipeContactList *contact_list                  = telepathy_private->contact_list;
 	struct telepathy_buddy_entry *remove_entry     = who;
 	struct telepathy_buddy       *buddy            = remove_entry->buddy;
+	TpHandle handle                                = buddy->handle;
 
+	group_member_remove(contact_list, remove_entry->group, handle);
 	g_hash_table_remove(buddy->groups,
 			    remove_entry->group);
 	/* remove_entry is invalid */
@@ -857,17 +1141,20 @@ void sipe_backend_buddy_remove(struct sipe_core_public *sipe_public,
 	if (g_hash_table_size(buddy->groups) == 0) {
 		/* removed from last group -> drop this buddy */
 		tp_handle_set_remove(contact_list->contacts,
-				     buddy->handle);
+				     handle);
 		g_hash_table_remove(contact_list->buddy_handles,
-				    GUINT_TO_POINTER(buddy->handle));
+				    GUINT_TO_POINTER(handle));
 		g_hash_table_remove(contact_list->buddies,
 				    buddy->uri);
+		/* buddy is invalid */
 
+		if (contact_list->initial_received) {
+			tp_handle_set_remove(contact_list->changed, handle);
+			tp_handle_set_add(contact_list->removed, handle);
+		}
 	}
 
-	if (contact_list->initial_received) {
-		/* @TODO: emit signal? */
-	}
+	contact_list_flush(contact_list);
 }
 
 void sipe_backend_buddy_set_status(struct sipe_core_public *sipe_public,
@@ -878,7 +1165,6 @@ void sipe_backend_buddy_set_status(struct sipe_core_public *sipe_public,
 	SipeContactList *contact_list                  = telepathy_private->contact_list;
 	struct telepathy_buddy *buddy                  = g_hash_table_lookup(contact_list->buddies,
 									     uri);
-	TpPresenceStatus *status;
 
 	if (!buddy)
 		return;
@@ -886,11 +1172,11 @@ void sipe_backend_buddy_set_status(struct sipe_core_public *sipe_public,
 
 	SIPE_DEBUG_INFO("sipe_backend_buddy_set_status: %s to %d", uri, activity);
 
-	/* emit status update signal */
-	status = tp_presence_status_new(activity, NULL);
-	tp_presence_mixin_emit_one_presence_update(G_OBJECT(telepathy_private->connection),
-						   buddy->handle, status);
-	tp_presence_status_free(status);
+	/* status update signal is emitted by contact_updates_emit() */
+	g_hash_table_insert(contact_list->pending_presences,
+			    GUINT_TO_POINTER(buddy->handle),
+			    GUINT_TO_POINTER(activity));
+	contact_updates_queued(contact_list);
 }
 
 gboolean sipe_backend_uses_photo(void)
@@ -903,6 +1189,7 @@ static void buddy_photo_updated(struct sipe_backend_private *telepathy_private,
 				const gchar *photo,
 				gsize photo_len)
 {
+	SipeContactList *contact_list = telepathy_private->contact_list;
 	GArray *array = g_array_new(FALSE, FALSE, sizeof(gchar));
 
 	SIPE_DEBUG_INFO("buddy_photo_updated: %s (%" G_GSIZE_FORMAT ")",
@@ -910,16 +1197,11 @@ static void buddy_photo_updated(struct sipe_backend_private *telepathy_private,
 
 	g_array_append_vals(array, photo, photo_len);
 
-	tp_svc_connection_interface_avatars_emit_avatar_updated(telepathy_private->connection,
-								buddy->handle,
-								buddy->hash);
-	tp_svc_connection_interface_avatars_emit_avatar_retrieved(telepathy_private->connection,
-								  buddy->handle,
-								  buddy->hash,
-								  array,
-								  /* @TODO: is this correct? */
-								  "image/jpeg");
-	g_array_unref(array);
+	/* signals are emitted by contact_updates_emit() */
+	g_hash_table_insert(contact_list->pending_avatars,
+			    GUINT_TO_POINTER(buddy->handle),
+			    array);
+	contact_updates_queued(contact_list);
 }
 
 void sipe_backend_buddy_set_photo(struct sipe_core_public *sipe_public,
@@ -1034,17 +1316,33 @@ gboolean sipe_backend_buddy_group_add(struct sipe_core_public *sipe_public,
 	return(group != NULL);
 }
 
+/* no collapsed groups: subscribe to all buddies */
+gboolean sipe_backend_buddy_group_visible(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
+					  SIPE_UNUSED_PARAMETER const gchar *group_name)
+{
+	return(TRUE);
+}
+
 void sipe_backend_buddy_group_remove(struct sipe_core_public *sipe_public,
 				     const gchar *group_name)
 {
 	struct sipe_backend_private *telepathy_private = sipe_public->backend_private;
 	SipeContactList *contact_list                  = telepathy_private->contact_list;
 
-	g_hash_table_remove(contact_list->groups, group_name);
+	if (!g_hash_table_lookup(contact_list->groups, group_name))
+		return;
 
 	if (contact_list->initial_received) {
-		/* @TODO: emit signal? */
+		/* pending deltas may refer to this group */
+		contact_list_emit_changes(contact_list);
+		tp_base_contact_list_groups_removed(TP_BASE_CONTACT_LIST(contact_list),
+						    &group_name,
+						    1);
 	}
+
+	/* NOTE: the order is important due to borrowing of keys! */
+	g_hash_table_remove(contact_list->group_members, group_name);
+	g_hash_table_remove(contact_list->groups, group_name);
 }
 
 /*
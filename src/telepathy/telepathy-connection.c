@@ -29,6 +29,7 @@
 
 #include <glib-object.h>
 #include <glib/gstdio.h>
+#include <gio/gio.h>
 #include <telepathy-glib/base-connection.h>
 #include <telepathy-glib/base-protocol.h>
 #include <telepathy-glib/contacts-mixin.h>
@@ -141,6 +142,17 @@ static void create_handle_repos(SIPE_UNUSED_PARAMETER TpBaseConnection *conn,
 								   NULL);
 }
 
+static void network_changed_cb(SIPE_UNUSED_PARAMETER GNetworkMonitor *monitor,
+			       gboolean available,
+			       gpointer data)
+{
+	struct sipe_backend_private *telepathy_private = data;
+
+	if (telepathy_private->public)
+		sipe_core_transport_sip_network_changed(telepathy_private->public,
+							available);
+}
+
 static gboolean connect_to_core(SipeConnection *self,
 				GError **error)
 {
@@ -153,6 +165,7 @@ static gboolean connect_to_core(SipeConnection *self,
 					 self->password,
 					 NULL, /* @TODO: email     */
 					 NULL, /* @TODO: email_url */
+					 NULL, /* default main context */
 					 &errmsg);
 
 	SIPE_DEBUG_INFO("connect_to_core: created %p", sipe_public);
@@ -196,6 +209,12 @@ static gboolean connect_to_core(SipeConnection *self,
 						self->server,
 						self->port);
 
+		/* detect dead connections early, e.g. after Wi-Fi <-> VPN */
+		telepathy_private->network_changed = g_signal_connect(g_network_monitor_get_default(),
+								      "network-changed",
+								      G_CALLBACK(network_changed_cb),
+								      telepathy_private);
+
 		return(TRUE);
 	} else {
 		g_set_error_literal(error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
@@ -318,6 +337,12 @@ static gboolean disconnect_from_core(gpointer data)
 
 	SIPE_DEBUG_INFO("disconnect_from_core: %p", sipe_public);
 
+	if (telepathy_private->network_changed) {
+		g_signal_handler_disconnect(g_network_monitor_get_default(),
+					    telepathy_private->network_changed);
+		telepathy_private->network_changed = 0;
+	}
+
 	if (sipe_public)
 		sipe_core_deallocate(sipe_public);
 	telepathy_private->public    = NULL;
@@ -778,26 +803,32 @@ TpBaseConnection *sipe_telepathy_connection_new(TpBaseProtocol *protocol,
 	return(TP_BASE_CONNECTION(conn));
 }
 
-void sipe_telepathy_connection_alias_updated(TpBaseConnection *connection,
-					     guint contact,
-					     const gchar *alias)
+/* aliases: key TpHandle, value alias */
+void sipe_telepathy_connection_aliases_updated(TpBaseConnection *connection,
+					       GHashTable *aliases)
 {
-	GPtrArray *aliases = g_ptr_array_sized_new(1);
-	GValueArray *pair  = g_value_array_new(2);
-
-	g_value_array_append(pair, NULL);
-	g_value_array_append(pair, NULL);
-	g_value_init(pair->values + 0, G_TYPE_UINT);
-	g_value_init(pair->values + 1, G_TYPE_STRING);
-	g_value_set_uint(pair->values + 0, contact);
-	g_value_set_string(pair->values + 1, alias);
-	g_ptr_array_add(aliases, pair);
-
-	tp_svc_connection_interface_aliasing_emit_aliases_changed(SIPE_CONNECTION(connection),
-								  aliases);
-
-	g_ptr_array_unref(aliases);
-	g_value_array_free(pair);
+	GPtrArray *changed = g_ptr_array_new_with_free_func((GDestroyNotify) g_value_array_free);
+	GHashTableIter iter;
+	gpointer contact, alias;
+
+	g_hash_table_iter_init(&iter, aliases);
+	while (g_hash_table_iter_next(&iter, &contact, &alias)) {
+		GValueArray *pair = g_value_array_new(2);
+
+		g_value_array_append(pair, NULL);
+		g_value_array_append(pair, NULL);
+		g_value_init(pair->values + 0, G_TYPE_UINT);
+		g_value_init(pair->values + 1, G_TYPE_STRING);
+		g_value_set_uint(pair->values + 0, GPOINTER_TO_UINT(contact));
+		g_value_set_string(pair->values + 1, alias);
+		g_ptr_array_add(changed, pair);
+	}
+
+	if (changed->len)
+		tp_svc_connection_interface_aliasing_emit_aliases_changed(SIPE_CONNECTION(connection),
+									  changed);
+
+	g_ptr_array_unref(changed);
 }
 
 struct sipe_backend_private *sipe_telepathy_connection_private(GObject *object)
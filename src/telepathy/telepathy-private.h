@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2012-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2012-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -58,6 +58,7 @@ struct sipe_backend_private {
 	/* transport */
 	struct sipe_transport_telepathy *transport;
 	gchar *ipaddress;
+	gulong network_changed; /* GNetworkMonitor signal handler */
 };
 
 /* buddy */
@@ -83,9 +84,8 @@ gpointer sipe_telepathy_contact_info_props(void);
 struct _TpBaseConnection *sipe_telepathy_connection_new(struct _TpBaseProtocol *protocol,
 							GHashTable *params,
 							GError **error);
-void sipe_telepathy_connection_alias_updated(struct _TpBaseConnection *connection,
-					     guint contact,
-					     const gchar *alias);
+void sipe_telepathy_connection_aliases_updated(struct _TpBaseConnection *connection,
+					       GHashTable *aliases);
 struct sipe_backend_private *sipe_telepathy_connection_private(GObject *object);
 
 /* debugging */
@@ -112,6 +112,9 @@ struct _SipeTLSManager *sipe_telepathy_tls_new(struct _TpBaseConnection *connect
 struct sipe_tls_info *sipe_telepathy_tls_info_new(const gchar *hostname,
 						  struct _GTlsCertificate *certificate);
 void sipe_telepathy_tls_info_free(struct sipe_tls_info *tls_info);
+gboolean sipe_telepathy_tls_verdict_cached(const gchar *hostname,
+					   struct _GTlsCertificate *certificate);
+void sipe_telepathy_tls_verdict_invalidate(const gchar *hostname);
 void sipe_telepathy_tls_verify_async(struct _GObject *connection,
 				     struct sipe_tls_info *tls_info,
 				     GAsyncReadyCallback callback,
@@ -41,7 +41,6 @@
 
 /** BUDDIES ******************************************************************/
 
-void sipe_backend_buddy_list_processing_start(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public) {}
 void sipe_backend_buddy_request_add(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
 				    SIPE_UNUSED_PARAMETER const gchar *who,
 				    SIPE_UNUSED_PARAMETER const gchar *alias) {}
@@ -94,6 +93,9 @@ void sipe_backend_chat_session_destroy(SIPE_UNUSED_PARAMETER struct sipe_backend
 void sipe_backend_chat_add(SIPE_UNUSED_PARAMETER struct sipe_backend_chat_session *backend_session,
 			   SIPE_UNUSED_PARAMETER const gchar *uri,
 			   SIPE_UNUSED_PARAMETER gboolean is_new) {}
+void sipe_backend_chat_add_many(SIPE_UNUSED_PARAMETER struct sipe_backend_chat_session *backend_session,
+				SIPE_UNUSED_PARAMETER const GSList *uris,
+				SIPE_UNUSED_PARAMETER gboolean is_new) {}
 void sipe_backend_chat_close(SIPE_UNUSED_PARAMETER struct sipe_backend_chat_session *backend_session) {}
 struct sipe_backend_chat_session *sipe_backend_chat_create(SIPE_UNUSED_PARAMETER struct sipe_core_public *sipe_public,
 							   SIPE_UNUSED_PARAMETER struct sipe_chat_session *session,
@@ -182,15 +184,14 @@ struct sipe_backend_media_relays * sipe_backend_media_relays_convert(SIPE_UNUSED
 								     SIPE_UNUSED_PARAMETER gchar *username,
 								     SIPE_UNUSED_PARAMETER gchar *password) { return(NULL); }
 void sipe_backend_media_relays_free(SIPE_UNUSED_PARAMETER struct sipe_backend_media_relays *media_relays) {}
-struct sipe_backend_media_stream *sipe_backend_media_add_stream(SIPE_UNUSED_PARAMETER struct sipe_media_call *media,
-								SIPE_UNUSED_PARAMETER const gchar *id,
-								SIPE_UNUSED_PARAMETER const gchar *participant,
+struct sipe_backend_media_stream *sipe_backend_media_add_stream(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
 								SIPE_UNUSED_PARAMETER SipeMediaType type,
 								SIPE_UNUSED_PARAMETER SipeIceVersion ice_version,
 								SIPE_UNUSED_PARAMETER gboolean initiator,
 								SIPE_UNUSED_PARAMETER struct sipe_backend_media_relays *media_relays,
 								SIPE_UNUSED_PARAMETER guint min_port,
-								SIPE_UNUSED_PARAMETER guint max_port) { return(NULL); }
+								SIPE_UNUSED_PARAMETER guint max_port,
+								SIPE_UNUSED_PARAMETER const struct sipe_media_ice_params *ice_params) { return(NULL); }
 void sipe_backend_media_add_remote_candidates(SIPE_UNUSED_PARAMETER struct sipe_media_call *media,
 					      SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
 					      SIPE_UNUSED_PARAMETER GList *candidates) {}
@@ -203,8 +204,10 @@ GList *sipe_backend_media_get_active_local_candidates(SIPE_UNUSED_PARAMETER stru
 						      SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream) { return(NULL); }
 GList *sipe_backend_media_get_active_remote_candidates(SIPE_UNUSED_PARAMETER struct sipe_media_call *media,
 						       SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream) { return(NULL); }
+gboolean sipe_backend_media_srtp_suite_supported(SIPE_UNUSED_PARAMETER SipeSrtpSuite suite) { return(FALSE); }
 void sipe_backend_media_set_encryption_keys(SIPE_UNUSED_PARAMETER struct sipe_media_call *media,
 					    SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+					    SIPE_UNUSED_PARAMETER SipeSrtpSuite suite,
 					    SIPE_UNUSED_PARAMETER const guchar *encryption_key,
 					    SIPE_UNUSED_PARAMETER const guchar *decryption_key) {}
 void sipe_backend_stream_hold(SIPE_UNUSED_PARAMETER struct sipe_media_call *media,
@@ -275,6 +278,17 @@ gint sipe_backend_media_write(SIPE_UNUSED_PARAMETER struct sipe_backend_media *m
 			      SIPE_UNUSED_PARAMETER guint8 *buffer,
 			      SIPE_UNUSED_PARAMETER guint buffer_len,
 			      SIPE_UNUSED_PARAMETER gboolean blocking) {}
+gboolean sipe_backend_media_stream_get_rtp_stats(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+						 SIPE_UNUSED_PARAMETER struct sipe_media_stats *stats) { return(FALSE); }
+void sipe_backend_media_set_video_params(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+					 SIPE_UNUSED_PARAMETER const struct sipe_media_video_params *params) {}
+void sipe_backend_media_send_rtcp_feedback(SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+					   SIPE_UNUSED_PARAMETER const guint8 *fci,
+					   SIPE_UNUSED_PARAMETER gsize length) {}
+gint sipe_backend_media_read_iov(SIPE_UNUSED_PARAMETER struct sipe_media_call *call,
+				 SIPE_UNUSED_PARAMETER struct sipe_media_stream *stream,
+				 SIPE_UNUSED_PARAMETER const struct sipe_media_segment *segments,
+				 SIPE_UNUSED_PARAMETER guint count) { return(-1); }
 #endif
 
 /** NETWORK ******************************************************************/
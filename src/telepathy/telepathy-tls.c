@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2013-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -39,6 +39,7 @@
 struct _SipeTLSCertificate;
 struct sipe_tls_info {
 	gchar *hostname;
+	gchar *fingerprint; /* SHA-256 of server public key */
 	gchar *cert_path;
 	GPtrArray *cert_data;
 	GStrv reference_identities;
@@ -50,6 +51,26 @@ struct sipe_tls_info {
 #define SIPE_TLS_CERTIFICATE_REJECTED 1
 #define SIPE_TLS_CERTIFICATE_ACCEPTED 2
 
+/*
+ * Accepted certificates
+ *
+ * Every transport (SIP, EWS, UCS, webticket, ...) verifies the server
+ * certificate on its own. Remember which server keys the user accepted, so
+ * that reconnects and further connections to the same host don't require
+ * another round-trip to the client. The cache is per process, because the
+ * connection object is recreated on reconnect.
+ *
+ * key: hostname, value: struct tls_verdict
+ */
+#define SIPE_TLS_VERDICT_TTL (8 * 60 * 60) /* seconds */
+
+struct tls_verdict {
+	gchar *fingerprint;
+	gint64 expires;     /* g_get_monotonic_time() */
+};
+
+static GHashTable *tls_verdicts = NULL;
+
 G_BEGIN_DECLS
 /*
  * TLS Manager class - data structures
@@ -458,6 +479,8 @@ static void sipe_tls_channel_init(SIPE_UNUSED_PARAMETER SipeTLSChannel *self)
 static void certificate_accepted_cb(SIPE_UNUSED_PARAMETER SipeTLSCertificate *certificate,
 				    SipeTLSChannel *self)
 {
+	tls_verdict_accepted(self->tls_info);
+
 	g_simple_async_result_complete(self->result);
 	g_clear_object(&self->result);
 	tp_base_channel_close(TP_BASE_CHANNEL(self));
@@ -472,6 +495,8 @@ static void certificate_rejected_cb(SIPE_UNUSED_PARAMETER SipeTLSCertificate *ce
 	if (!quark)
 		quark = g_quark_from_static_string("server-tls-error");
 
+	sipe_telepathy_tls_verdict_invalidate(self->tls_info->hostname);
+
 	g_simple_async_result_set_error(self->result,
 					quark,
 					0,
@@ -726,6 +751,167 @@ static void tls_certificate_iface_init(gpointer g_iface,
 #undef IMPLEMENT
 }
 
+/* read one DER element, advances *p past it */
+static gboolean der_element(const guchar **p,
+			    const guchar *end,
+			    guchar *tag,
+			    const guchar **content,
+			    gsize *length)
+{
+	const guchar *q = *p;
+	gsize len;
+
+	if (end - q < 2)
+		return(FALSE);
+	*tag = *q++;
+	len  = *q++;
+
+	if (len & 0x80) {
+		guint octets = len & 0x7F;
+
+		/* certificates are much smaller than 16MB */
+		if ((octets == 0) || (octets > 3) ||
+		    ((gsize) (end - q) < octets))
+			return(FALSE);
+		for (len = 0; octets--; )
+			len = (len << 8) | *q++;
+	}
+
+	if ((gsize) (end - q) < len)
+		return(FALSE);
+
+	*content = q;
+	*length  = len;
+	*p       = q + len;
+	return(TRUE);
+}
+
+/*
+ * RFC 5280 4.1: hash the SubjectPublicKeyInfo, i.e. the same server key
+ * is still recognized after the certificate has been renewed. Fall back to
+ * the whole certificate if it can't be parsed.
+ */
+static gchar *certificate_fingerprint(const guchar *der,
+				      gsize der_length)
+{
+	const guchar *p   = der;
+	const guchar *end = der + der_length;
+	const guchar *content;
+	gsize length;
+	guchar tag;
+
+	/* Certificate ::= SEQUENCE { tbsCertificate SEQUENCE { ... } } */
+	if (der_element(&p, end, &tag, &content, &length) && (tag == 0x30)) {
+		p   = content;
+		end = content + length;
+		if (der_element(&p, end, &tag, &content, &length) && (tag == 0x30)) {
+			const guchar *start;
+			guint skip = 5; /* serial, signature, issuer, validity, subject */
+
+			p   = content;
+			end = content + length;
+
+			/* optional version [0] */
+			if (der_element(&p, end, &tag, &content, &length) &&
+			    (tag != 0xA0))
+				skip--;
+
+			while (skip && der_element(&p, end, &tag, &content, &length))
+				skip--;
+
+			start = p;
+			if ((skip == 0) &&
+			    der_element(&p, end, &tag, &content, &length) &&
+			    (tag == 0x30))
+				return(g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+								   start,
+								   p - start));
+		}
+	}
+
+	SIPE_DEBUG_INFO_NOFORMAT("certificate_fingerprint: can't find public key, using whole certificate");
+	return(g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+					   der,
+					   der_length));
+}
+
+static void tls_verdict_free(gpointer data)
+{
+	struct tls_verdict *verdict = data;
+	g_free(verdict->fingerprint);
+	g_free(verdict);
+}
+
+static void tls_verdict_accepted(const struct sipe_tls_info *tls_info)
+{
+	struct tls_verdict *verdict = g_new0(struct tls_verdict, 1);
+
+	if (!tls_verdicts)
+		tls_verdicts = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, tls_verdict_free);
+
+	verdict->fingerprint = g_strdup(tls_info->fingerprint);
+	verdict->expires     = g_get_monotonic_time() +
+		(gint64) SIPE_TLS_VERDICT_TTL * G_USEC_PER_SEC;
+
+	SIPE_DEBUG_INFO("tls_verdict_accepted: %s %s",
+			tls_info->hostname, verdict->fingerprint);
+	/* replaces verdict for the previous certificate */
+	g_hash_table_insert(tls_verdicts,
+			    g_strdup(tls_info->hostname),
+			    verdict);
+}
+
+void sipe_telepathy_tls_verdict_invalidate(const gchar *hostname)
+{
+	if (tls_verdicts && hostname &&
+	    g_hash_table_remove(tls_verdicts, hostname))
+		SIPE_DEBUG_INFO("sipe_telepathy_tls_verdict_invalidate: %s",
+				hostname);
+}
+
+gboolean sipe_telepathy_tls_verdict_cached(const gchar *hostname,
+					   GTlsCertificate *certificate)
+{
+	struct tls_verdict *verdict;
+	GByteArray *der = NULL;
+	gchar *fingerprint;
+	gboolean accepted;
+
+	if (!tls_verdicts || !hostname)
+		return(FALSE);
+	verdict = g_hash_table_lookup(tls_verdicts, hostname);
+	if (!verdict)
+		return(FALSE);
+
+	if (verdict->expires < g_get_monotonic_time()) {
+		SIPE_DEBUG_INFO("sipe_telepathy_tls_verdict_cached: %s expired",
+				hostname);
+		sipe_telepathy_tls_verdict_invalidate(hostname);
+		return(FALSE);
+	}
+
+	g_object_get(certificate, "certificate", &der, NULL);
+	if (!der)
+		return(FALSE);
+	fingerprint = certificate_fingerprint(der->data, der->len);
+	g_byte_array_unref(der);
+
+	accepted = (g_strcmp0(fingerprint, verdict->fingerprint) == 0);
+	if (accepted) {
+		SIPE_DEBUG_INFO("sipe_telepathy_tls_verdict_cached: %s accepted",
+				hostname);
+	} else {
+		/* server key has changed: user has to decide again */
+		SIPE_DEBUG_INFO("sipe_telepathy_tls_verdict_cached: %s changed to %s",
+				hostname, fingerprint);
+		sipe_telepathy_tls_verdict_invalidate(hostname);
+	}
+	g_free(fingerprint);
+
+	return(accepted);
+}
+
 static void append_certificate_der(GPtrArray *certificates,
 				   GByteArray *der)
 {
@@ -758,6 +944,9 @@ struct sipe_tls_info *sipe_telepathy_tls_info_new(const gchar *hostname,
 		tls_info->reference_identities = (GStrv) g_ptr_array_free(identities,
 									  FALSE);
 
+		tls_info->fingerprint = certificate_fingerprint(der->data,
+							       der->len);
+
 		tls_info->cert_data = g_ptr_array_new_full(1,
 							   (GDestroyNotify) g_array_unref);
 		/* unrefs "der" */
@@ -791,6 +980,7 @@ void sipe_telepathy_tls_info_free(struct sipe_tls_info *tls_info)
 {
 	g_object_unref(tls_info->certificate);
 	g_free(tls_info->hostname);
+	g_free(tls_info->fingerprint);
 	g_free(tls_info->cert_path);
 	g_ptr_array_unref(tls_info->cert_data);
 	g_strfreev(tls_info->reference_identities);
@@ -3,7 +3,7 @@
  *
  * pidgin-sipe
  *
- * Copyright (C) 2012-2013 SIPE Project <http://sipe.sourceforge.net/>
+ * Copyright (C) 2012-2015 SIPE Project <http://sipe.sourceforge.net/>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -46,12 +46,18 @@ struct sipe_transport_telepathy {
 	transport_error_cb *error;
 	gchar *hostname;
 	struct sipe_tls_info *tls_info;
+	struct sipe_tls_session_cache *session_cache;
 	struct sipe_backend_private *private;
 	GCancellable *cancel;
 	GSocketConnection *socket;
 	GInputStream *istream;
 	GOutputStream *ostream;
-	GSList *buffers;
+	GByteArray *queued;  /* collects messages while a write is in flight */
+	GByteArray *writing; /* data of the write in flight */
+	gsize write_offset;
+	guint cork_source;
+	guint queued_messages;
+	guint writing_messages;
 	guint port;
 	gboolean is_writing;
 	gboolean do_flush;
@@ -60,7 +66,8 @@ struct sipe_transport_telepathy {
 #define TELEPATHY_TRANSPORT ((struct sipe_transport_telepathy *) conn)
 #define SIPE_TRANSPORT_CONNECTION ((struct sipe_transport_connection *) transport)
 
-#define BUFFER_SIZE_INCREMENT 4096
+/* TLS: wait for more messages before writing a partial record */
+#define TRANSPORT_CORK_DELAY 2 /* milliseconds */
 
 static void read_completed(GObject *stream,
 			   GAsyncResult *result,
@@ -68,59 +75,55 @@ static void read_completed(GObject *stream,
 {
 	struct sipe_transport_telepathy *transport = data;
 	struct sipe_transport_connection *conn = SIPE_TRANSPORT_CONNECTION;
+	gsize readlen;
 
-	do {
-		if (conn->buffer_length < conn->buffer_used + BUFFER_SIZE_INCREMENT) {
-			conn->buffer_length += BUFFER_SIZE_INCREMENT;
-			conn->buffer = g_realloc(conn->buffer, conn->buffer_length);
-			SIPE_DEBUG_INFO("read_completed: new buffer length %" G_GSIZE_FORMAT,
-					conn->buffer_length);
-		}
-
-		/* callback result is valid */
-		if (result) {
-			GError *error = NULL;
-			gssize len    = g_input_stream_read_finish(G_INPUT_STREAM(stream),
-								   result,
-								   &error);
-
-			if (len < 0) {
-				const gchar *msg = error ? error->message : "UNKNOWN";
-				SIPE_DEBUG_ERROR("read_completed: error: %s", msg);
-				if (transport->error)
-					transport->error(conn, msg);
-				g_error_free(error);
-				return;
-			} else if (len == 0) {
-				SIPE_DEBUG_ERROR_NOFORMAT("read_completed: server has disconnected");
-				transport->error(conn, _("Server has disconnected"));
-				return;
-			} else if (transport->do_flush) {
-				/* read completed while disconnected transport is flushing */
-				SIPE_DEBUG_INFO_NOFORMAT("read_completed: ignored during flushing");
-				return;
-			} else if (g_cancellable_is_cancelled(transport->cancel)) {
-				/* read completed when transport was disconnected */
-				SIPE_DEBUG_INFO_NOFORMAT("read_completed: cancelled");
-				return;
-			}
-
-			/* Forward data to core */
-			conn->buffer_used               += len;
-			conn->buffer[conn->buffer_used]  = '\0';
-			transport->input(conn);
+	/* callback result is valid */
+	if (result) {
+		GError *error = NULL;
+		gssize len    = g_input_stream_read_finish(G_INPUT_STREAM(stream),
+							   result,
+							   &error);
 
-			/* we processed the result */
-			result = NULL;
+		if (len < 0) {
+			const gchar *msg = error ? error->message : "UNKNOWN";
+			SIPE_DEBUG_ERROR("read_completed: error: %s", msg);
+			if (transport->error)
+				transport->error(conn, msg);
+			g_error_free(error);
+			return;
+		} else if (len == 0) {
+			SIPE_DEBUG_ERROR_NOFORMAT("read_completed: server has disconnected");
+			transport->error(conn, _("Server has disconnected"));
+			return;
+		} else if (transport->do_flush) {
+			/* read completed while disconnected transport is flushing */
+			SIPE_DEBUG_INFO_NOFORMAT("read_completed: ignored during flushing");
+			return;
+		} else if (g_cancellable_is_cancelled(transport->cancel)) {
+			/* read completed when transport was disconnected */
+			SIPE_DEBUG_INFO_NOFORMAT("read_completed: cancelled");
+			return;
 		}
 
-		/* buffer too short? */
-	} while (conn->buffer_length - conn->buffer_used - 1 == 0);
+		/* Forward data to core */
+		conn->buffer_used               += len;
+		conn->buffer[conn->buffer_used]  = '\0';
+		transport->input(conn);
+	}
+
+	/* Increase input buffer size as needed */
+	readlen = sipe_core_transport_buffer_reserve(conn);
+	if (readlen == 0) {
+		SIPE_DEBUG_ERROR_NOFORMAT("read_completed: message exceeds maximum buffer size");
+		if (transport->error)
+			transport->error(conn, _("Read error"));
+		return;
+	}
 
 	/* setup next read */
 	g_input_stream_read_async(G_INPUT_STREAM(stream),
 				  conn->buffer + conn->buffer_used,
-				  conn->buffer_length - conn->buffer_used - 1,
+				  readlen,
 				  G_PRIORITY_DEFAULT,
 				  transport->cancel,
 				  read_completed,
@@ -170,6 +173,10 @@ static void socket_connected(GObject *client,
 		} else {
 			const gchar *msg = error ? error->message : "UNKNOWN";
 			SIPE_DEBUG_ERROR("socket_connected: failed: %s", msg);
+			/* don't offer a session the server may have rejected */
+			sipe_core_tls_session_invalidate(transport->session_cache,
+							 transport->hostname,
+							 transport->port);
 			if (transport->error)
 				transport->error(SIPE_TRANSPORT_CONNECTION, msg);
 			g_error_free(error);
@@ -225,6 +232,10 @@ static gboolean accept_certificate_signal(SIPE_UNUSED_PARAMETER GTlsConnection *
 		sipe_telepathy_tls_info_free(transport->tls_info);
 		transport->tls_info = NULL;
 		return(TRUE);
+	} else if (sipe_telepathy_tls_verdict_cached(transport->hostname,
+						     peer_cert)) {
+		/* user accepted this server key before */
+		return(TRUE);
 	} else {
 		/* retry after user accepted certificate */
 		transport->tls_info = sipe_telepathy_tls_info_new(transport->hostname,
@@ -239,12 +250,46 @@ static void tls_handshake_starts(SIPE_UNUSED_PARAMETER GSocketClient *client,
 				 GIOStream *connection,
 				 gpointer user_data)
 {
+	struct sipe_transport_telepathy *transport = user_data;
+
 	if (event == G_SOCKET_CLIENT_TLS_HANDSHAKING) {
-		SIPE_DEBUG_INFO("tls_handshake_starts: %p", connection);
+#if GLIB_CHECK_VERSION(2,46,0)
+		GTlsClientConnection *previous = sipe_core_tls_session_lookup(transport->session_cache,
+									      transport->hostname,
+									      transport->port);
+
+		/* offer session of the last connection for resumption */
+		if (previous) {
+			SIPE_DEBUG_INFO("tls_handshake_starts: %p resuming session of %p",
+					connection, previous);
+			g_tls_client_connection_copy_session_state(G_TLS_CLIENT_CONNECTION(connection),
+								   previous);
+		} else
+#endif
+			SIPE_DEBUG_INFO("tls_handshake_starts: %p", connection);
+
 		g_signal_connect(connection, /* is a GTlsConnection */
 				 "accept-certificate",
 				 G_CALLBACK(accept_certificate_signal),
 				 user_data);
+
+#if GLIB_CHECK_VERSION(2,46,0)
+	} else if ((event == G_SOCKET_CLIENT_TLS_HANDSHAKED) &&
+		   !g_cancellable_is_cancelled(transport->cancel)) {
+		/*
+		 * The connection object carries the session state. It is
+		 * closed together with the socket, but stays alive until the
+		 * next connection to the same server has copied the state.
+		 *
+		 * GIO doesn't tell whether the server accepted the session,
+		 * i.e. sipe_core_tls_session_resumed() can't be called here.
+		 */
+		sipe_core_tls_session_store(transport->session_cache,
+					    transport->hostname,
+					    transport->port,
+					    g_object_ref(connection),
+					    g_object_unref);
+#endif
 	}
 }
 
@@ -290,9 +335,11 @@ struct sipe_transport_connection *sipe_backend_transport_connect(struct sipe_cor
 	transport->error            = setup->error;
 	transport->hostname         = g_strdup(setup->server_name);
 	transport->tls_info         = NULL;
+	transport->session_cache    = setup->session_cache;
 	transport->private          = sipe_public->backend_private;
 	transport->cancel           = g_cancellable_new();
-	transport->buffers          = NULL;
+	transport->queued           = g_byte_array_new();
+	transport->writing          = g_byte_array_new();
 	transport->port             = setup->server_port;
 	transport->is_writing       = FALSE;
 	transport->do_flush         = FALSE;
@@ -314,7 +361,6 @@ struct sipe_transport_connection *sipe_backend_transport_connect(struct sipe_cor
 static gboolean free_transport(gpointer data)
 {
 	struct sipe_transport_telepathy *transport = data;
-	GSList *entry;
 
 	SIPE_DEBUG_INFO("free_transport %p", transport);
 
@@ -322,10 +368,9 @@ static gboolean free_transport(gpointer data)
 		sipe_telepathy_tls_info_free(transport->tls_info);
 	g_free(transport->hostname);
 
-	/* free unflushed buffers */
-	for (entry = transport->buffers; entry; entry = entry->next)
-		g_free(entry->data);
-	g_slist_free(transport->buffers);
+	/* free unflushed data */
+	g_byte_array_free(transport->queued,  TRUE);
+	g_byte_array_free(transport->writing, TRUE);
 
 	if (transport->cancel)
 		g_object_unref(transport->cancel);
@@ -367,6 +412,12 @@ void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
 
 	SIPE_DEBUG_INFO("sipe_backend_transport_disconnect: %p", transport);
 
+	/* corked data is only sent when flushing was requested */
+	if (transport->cork_source) {
+		g_source_remove(transport->cork_source);
+		transport->cork_source = 0;
+	}
+
 	/* error callback is invalid now, do no longer call! */
 	transport->error = NULL;
 
@@ -394,8 +445,8 @@ void sipe_backend_transport_disconnect(struct sipe_transport_connection *conn)
 	}
 }
 
-static void do_write(struct sipe_transport_telepathy *transport,
-		     const gchar *buffer);
+static void do_write(struct sipe_transport_telepathy *transport);
+static void write_next(struct sipe_transport_telepathy *transport);
 static void write_completed(GObject *stream,
 			    GAsyncResult *result,
 			    gpointer data)
@@ -422,36 +473,101 @@ static void write_completed(GObject *stream,
 		SIPE_DEBUG_INFO_NOFORMAT("write_completed: cancelled");
 		transport->is_writing = FALSE;
 	} else {
-		/* more to write? */
-		if (transport->buffers) {
-			/* yes */
-			gchar *buffer = transport->buffers->data;
-			transport->buffers = g_slist_remove(transport->buffers,
-							    buffer);
-			do_write(transport, buffer);
-			g_free(buffer);
-		} else {
-			/* no, we're done for now... */
-			transport->is_writing = FALSE;
-
-			/* flush completed */
-			if (transport->do_flush)
-				do_close(transport);
+		if (transport->public.type == SIPE_TRANSPORT_TLS) {
+			sipe_core_tls_records(transport->private->public,
+					      transport->writing_messages,
+					      written);
+			transport->writing_messages = 0;
 		}
+
+		/* partial write: continue at offset */
+		transport->write_offset += written;
+		write_next(transport);
 	}
 }
 
-static void do_write(struct sipe_transport_telepathy *transport,
-		     const gchar *buffer)
+static void write_next(struct sipe_transport_telepathy *transport)
 {
-	transport->is_writing = TRUE;
-	g_output_stream_write_async(transport->ostream,
-				    buffer,
-				    strlen(buffer),
-				    G_PRIORITY_DEFAULT,
-				    transport->cancel,
-				    write_completed,
-				    transport);
+	/* rest of current data */
+	if (transport->write_offset < transport->writing->len) {
+		g_output_stream_write_async(transport->ostream,
+					    transport->writing->data + transport->write_offset,
+					    transport->writing->len - transport->write_offset,
+					    G_PRIORITY_DEFAULT,
+					    transport->cancel,
+					    write_completed,
+					    transport);
+		return;
+	}
+
+	/* more to write? */
+	if (transport->queued->len) {
+		/* yes, everything queued in the meantime goes out in one write */
+		do_write(transport);
+	} else {
+		/* no, we're done for now... */
+		transport->is_writing = FALSE;
+
+		/* flush completed */
+		if (transport->do_flush)
+			do_close(transport);
+	}
+}
+
+/* start writing all queued data */
+static void do_write(struct sipe_transport_telepathy *transport)
+{
+	/* swap buffers: data must stay valid until write has completed */
+	GByteArray *writing = transport->queued;
+
+	if (transport->cork_source) {
+		g_source_remove(transport->cork_source);
+		transport->cork_source = 0;
+	}
+	transport->writing_messages = transport->queued_messages;
+	transport->queued_messages  = 0;
+
+	g_byte_array_set_size(transport->writing, 0);
+	transport->queued       = transport->writing;
+	transport->writing      = writing;
+	transport->write_offset = 0;
+	transport->is_writing   = TRUE;
+	write_next(transport);
+}
+
+static gboolean uncork_write(gpointer data)
+{
+	struct sipe_transport_telepathy *transport = data;
+
+	transport->cork_source = 0;
+	if (!transport->is_writing)
+		do_write(transport);
+
+	return(FALSE);
+}
+
+/* message has been added to queue */
+static void queue_write(struct sipe_transport_telepathy *transport)
+{
+	transport->queued_messages++;
+
+	/* writing? Then queue is written when write has completed */
+	if (transport->is_writing)
+		return;
+
+	/*
+	 * TLS: each write is encrypted into its own record(s). Wait a
+	 * little for more messages unless a full record is queued.
+	 */
+	if ((transport->public.type == SIPE_TRANSPORT_TLS) &&
+	    (transport->queued->len < SIPE_TLS_RECORD_LENGTH)) {
+		if (!transport->cork_source)
+			transport->cork_source = g_timeout_add(TRANSPORT_CORK_DELAY,
+							       uncork_write,
+							       transport);
+	} else {
+		do_write(transport);
+	}
 }
 
 void sipe_backend_transport_message(struct sipe_transport_connection *conn,
@@ -459,20 +575,46 @@ void sipe_backend_transport_message(struct sipe_transport_connection *conn,
 {
 	struct sipe_transport_telepathy *transport = TELEPATHY_TRANSPORT;
 
-	/* currently writing? */
-	if (transport->is_writing) {
-		/* yes, append copy of buffer to list */
-		transport->buffers = g_slist_append(transport->buffers,
-						    g_strdup(buffer));
-	} else
-		/* no, write directly to stream */
-		do_write(transport, buffer);
+	g_byte_array_append(transport->queued,
+			    (const guint8 *) buffer,
+			    strlen(buffer));
+	queue_write(transport);
+}
+
+void sipe_backend_transport_message_iov(struct sipe_transport_connection *conn,
+					const struct sipe_transport_segment *segments,
+					guint count)
+{
+	struct sipe_transport_telepathy *transport = TELEPATHY_TRANSPORT;
+	guint i;
+
+	/* collect the segments directly into the output queue */
+	for (i = 0; i < count; i++)
+		g_byte_array_append(transport->queued,
+				    (const guint8 *) segments[i].data,
+				    segments[i].length);
+
+	queue_write(transport);
 }
 
 void sipe_backend_transport_flush(struct sipe_transport_connection *conn)
 {
 	struct sipe_transport_telepathy *transport = TELEPATHY_TRANSPORT;
 	transport->do_flush = TRUE;
+
+	/* uncork: disconnect waits until the write has completed */
+	if (!transport->is_writing && transport->queued->len)
+		do_write(transport);
+}
+
+gsize sipe_backend_transport_pending(struct sipe_transport_connection *conn)
+{
+	struct sipe_transport_telepathy *transport = TELEPATHY_TRANSPORT;
+	gsize pending = transport->queued->len;
+
+	if (transport->is_writing)
+		pending += transport->writing->len - transport->write_offset;
+	return(pending);
 }
 
 const gchar *sipe_backend_network_ip_address(struct sipe_core_public *sipe_public)